@@ -0,0 +1,339 @@
+#include "android_tx.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+#include "metrics.h"
+#include "serial_tx.h"
+#include "timeline.h"
+
+// A message this many places behind the highest one acked is taken as lost and
+// sent again without waiting for its timeout (once)
+#define ANDROID_TX_FAST_RESEND_GAP 3
+// Bytes packed into one write(); many queued messages, never a partial one
+#define ANDROID_TX_BATCH_BYTES 4096
+// {"cat":"seq","seq":4294967295,"value":...}\n around a message
+#define ANDROID_TX_FRAME_OVERHEAD 48
+#define ANDROID_TX_MAX_FRAME (ANDROID_TX_MAX_MESSAGE + ANDROID_TX_FRAME_OVERHEAD)
+#define ANDROID_TX_ACK_RING_SIZE 16 // A power of two
+
+// Bounded MPSC queue (Vyukov): a slot is free for the producer that claims
+// position pos when seq == pos, and holds that producer's message once seq ==
+// pos + 1. The writer hands it back by setting seq to pos + ANDROID_TX_QUEUE_SIZE.
+typedef struct {
+    atomic_size_t seq;
+    size_t len;
+    char data[ANDROID_TX_MAX_MESSAGE];
+} TxSlot;
+
+static TxSlot g_slots[ANDROID_TX_QUEUE_SIZE];
+static _Alignas(64) atomic_size_t g_head; // Next position to claim, shared by producers
+static _Alignas(64) size_t g_tail;        // Next position to write, writer only
+
+// A sent message awaiting its ack. Writer only; slot seq % ANDROID_TX_WINDOW.
+typedef struct {
+    bool acked;
+    bool fast_resent; // Already sent again because later messages were acked
+    uint64_t sent_ns;
+    uint32_t rto_ms;
+    size_t len;
+    char frame[ANDROID_TX_MAX_FRAME];
+} TxPending;
+
+typedef struct {
+    uint32_t cum;
+    uint32_t sack;
+} TxAck;
+
+static TxPending g_window[ANDROID_TX_WINDOW];
+static uint32_t g_base_seq = 1; // Oldest unacknowledged
+static uint32_t g_next_seq = 1; // Given to the next message
+
+// Acks from the reactor (single producer) to the writer. A full ring drops the
+// ack; the next one covers it, since acks are cumulative.
+static TxAck g_acks[ANDROID_TX_ACK_RING_SIZE];
+static _Alignas(64) atomic_uint g_ack_head;
+static _Alignas(64) atomic_uint g_ack_tail;
+static atomic_bool g_reliable = false; // Android has acked at least once
+
+static int g_fd = -1;
+static atomic_bool g_running = false;
+static atomic_bool g_writer_idle = false; // Set before the writer sleeps; the next producer posts
+static pthread_t g_writer;
+static sem_t g_wakeup;
+
+// Writes all of data through the link's writer (serial_tx.h), which waits out
+// a full RFCOMM buffer for up to ANDROID_TX_STALL_MS. Returns 0, or -1 if the
+// link took too long or failed.
+static int tx_write(int fd, const char* data, size_t len) {
+    uint64_t start_ns = latency_now_ns();
+    int result = serial_tx_send(fd, data, len);
+    metric_observe_since(METRIC_HIST_ANDROID_WRITE_US, start_ns);
+    if (result == 0) {
+        metric_inc(METRIC_ANDROID_WRITES);
+        return 0;
+    }
+    metric_inc(METRIC_ANDROID_WRITE_FAILURES);
+    LOG_ERROR("[AndroidTx] Dropping %zu bytes: %s\n", len, strerror(errno));
+    return -1;
+}
+
+// Claims a slot and copies message into it. Returns -1 if the queue is full.
+static int tx_push(const char* message, size_t len) {
+    size_t pos = atomic_load_explicit(&g_head, memory_order_relaxed);
+    TxSlot* slot;
+    for (;;) {
+        slot = &g_slots[pos & (ANDROID_TX_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&g_head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return -1; // The writer has not freed this slot yet
+        } else {
+            pos = atomic_load_explicit(&g_head, memory_order_relaxed);
+        }
+    }
+    memcpy(slot->data, message, len);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static bool tx_queue_ready(void) {
+    TxSlot* slot = &g_slots[g_tail & (ANDROID_TX_QUEUE_SIZE - 1)];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == g_tail + 1;
+}
+
+static bool tx_acks_ready(void) {
+    return atomic_load_explicit(&g_ack_head, memory_order_acquire) != atomic_load_explicit(&g_ack_tail, memory_order_relaxed);
+}
+
+// Wraps message as {"cat":"seq","seq":seq,"value":message} into out. Returns the length.
+static size_t tx_frame(char* out, uint32_t seq, const char* message, size_t len) {
+    while (len > 0 && (message[len - 1] == '\n' || message[len - 1] == '\r')) len--;
+    int head = snprintf(out, ANDROID_TX_FRAME_OVERHEAD, "{\"cat\":\"seq\",\"seq\":%u,\"value\":", seq);
+    memcpy(out + head, message, len);
+    memcpy(out + head + len, "}\n", 2);
+    return (size_t)head + len + 2;
+}
+
+// Marks what the queued acks cover and slides the window past it.
+static void tx_apply_acks(void) {
+    unsigned tail = atomic_load_explicit(&g_ack_tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&g_ack_head, memory_order_acquire);
+    for (; tail != head; tail++) {
+        TxAck ack = g_acks[tail & (ANDROID_TX_ACK_RING_SIZE - 1)];
+        // Sequence numbers are compared by difference, so they may wrap
+        for (uint32_t seq = g_base_seq; seq != g_next_seq; seq++) {
+            int32_t past_cum = (int32_t)(seq - ack.cum);
+            bool covered = past_cum <= 0 || (past_cum <= 32 && (ack.sack >> (past_cum - 1)) & 1);
+            if (covered) g_window[seq % ANDROID_TX_WINDOW].acked = true;
+        }
+    }
+    atomic_store_explicit(&g_ack_tail, tail, memory_order_release);
+    while (g_base_seq != g_next_seq && g_window[g_base_seq % ANDROID_TX_WINDOW].acked) g_base_seq++;
+
+    // Holes well behind what Android has already acked are losses, not delays
+    uint32_t highest = g_base_seq;
+    for (uint32_t seq = g_base_seq; seq != g_next_seq; seq++) {
+        if (g_window[seq % ANDROID_TX_WINDOW].acked) highest = seq;
+    }
+    for (uint32_t seq = g_base_seq; (int32_t)(highest - seq) >= ANDROID_TX_FAST_RESEND_GAP; seq++) {
+        TxPending* p = &g_window[seq % ANDROID_TX_WINDOW];
+        if (!p->acked && !p->fast_resent) {
+            p->fast_resent = true;
+            p->sent_ns = 0; // Due now
+        }
+    }
+    metric_gauge_set(METRIC_GAUGE_ANDROID_UNACKED, (int64_t)(g_next_seq - g_base_seq));
+}
+
+// Appends frames that have waited out their timeout to batch, doubling it.
+static size_t tx_take_retransmits(char* batch, size_t used, uint64_t now_ns) {
+    for (uint32_t seq = g_base_seq; seq != g_next_seq; seq++) {
+        TxPending* p = &g_window[seq % ANDROID_TX_WINDOW];
+        if (p->acked || now_ns - p->sent_ns < (uint64_t)p->rto_ms * 1000000ull) continue;
+        if (used + p->len > ANDROID_TX_BATCH_BYTES) break;
+        memcpy(batch + used, p->frame, p->len);
+        used += p->len;
+        p->sent_ns = now_ns;
+        p->rto_ms = p->rto_ms * 2 < ANDROID_TX_RTO_MAX_MS ? p->rto_ms * 2 : ANDROID_TX_RTO_MAX_MS;
+        metric_inc(METRIC_ANDROID_RETRANSMITS);
+    }
+    return used;
+}
+
+// Moves the published messages at the front of the queue into batch, stopping
+// before one that would not fit or, in reliable mode, when the window is full.
+// Returns the number of bytes in batch.
+static size_t tx_take(char* batch, size_t used, uint64_t now_ns) {
+    bool reliable = atomic_load_explicit(&g_reliable, memory_order_relaxed);
+    while (tx_queue_ready()) {
+        TxSlot* slot = &g_slots[g_tail & (ANDROID_TX_QUEUE_SIZE - 1)];
+        if (!reliable) {
+            if (used + slot->len > ANDROID_TX_BATCH_BYTES) break;
+            memcpy(batch + used, slot->data, slot->len);
+            used += slot->len;
+        } else {
+            if (g_next_seq - g_base_seq >= ANDROID_TX_WINDOW || used + slot->len + ANDROID_TX_FRAME_OVERHEAD > ANDROID_TX_BATCH_BYTES) break;
+            TxPending* p = &g_window[g_next_seq % ANDROID_TX_WINDOW];
+            p->len = tx_frame(p->frame, g_next_seq, slot->data, slot->len);
+            p->acked = false;
+            p->fast_resent = false;
+            p->sent_ns = now_ns;
+            p->rto_ms = ANDROID_TX_RTO_MS;
+            g_next_seq++;
+            memcpy(batch + used, p->frame, p->len);
+            used += p->len;
+        }
+        atomic_store_explicit(&slot->seq, g_tail + ANDROID_TX_QUEUE_SIZE, memory_order_release);
+        g_tail++;
+    }
+    return used;
+}
+
+// Sends whatever is due: retransmits first, then new messages. Returns true if
+// anything was written.
+static bool tx_flush(void) {
+    static char batch[ANDROID_TX_BATCH_BYTES];
+    bool wrote = false;
+    for (;;) {
+        tx_apply_acks();
+        uint64_t now_ns = latency_now_ns();
+        size_t len = tx_take_retransmits(batch, 0, now_ns);
+        len = tx_take(batch, len, now_ns);
+        if (len == 0) return wrote;
+        tx_write(g_fd, batch, len);
+        timeline_span(now_ns, latency_now_ns(), "write %zu bytes", len);
+        wrote = true;
+    }
+}
+
+// Earliest retransmit deadline in the window, or 0 if nothing is outstanding.
+static uint64_t tx_next_deadline_ns(void) {
+    uint64_t next = 0;
+    for (uint32_t seq = g_base_seq; seq != g_next_seq; seq++) {
+        const TxPending* p = &g_window[seq % ANDROID_TX_WINDOW];
+        if (p->acked) continue;
+        uint64_t due = p->sent_ns + (uint64_t)p->rto_ms * 1000000ull;
+        if (next == 0 || due < next) next = due;
+    }
+    return next;
+}
+
+// Sleeps until posted, or until due_ns (CLOCK_MONOTONIC) when it is non-zero.
+static void tx_sleep(uint64_t due_ns) {
+    if (due_ns == 0) {
+        while (sem_wait(&g_wakeup) == -1 && errno == EINTR) {}
+        return;
+    }
+    uint64_t now_ns = latency_now_ns();
+    if (due_ns <= now_ns) return;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline); // sem_timedwait() takes CLOCK_REALTIME
+    uint64_t wait_ns = due_ns - now_ns;
+    deadline.tv_sec += (time_t)(wait_ns / 1000000000ull);
+    deadline.tv_nsec += (long)(wait_ns % 1000000000ull);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (sem_timedwait(&g_wakeup, &deadline) == -1 && errno == EINTR) {}
+}
+
+static void* android_tx_thread(void* args) {
+    (void)args;
+    timeline_thread("android tx");
+    while (atomic_load(&g_running)) {
+        tx_flush();
+        // Announce the sleep, then look again: a message or ack published in
+        // between either is seen here or finds g_writer_idle set and posts.
+        atomic_store(&g_writer_idle, true);
+        bool window_full = g_next_seq - g_base_seq >= ANDROID_TX_WINDOW;
+        if ((tx_queue_ready() && !window_full) || tx_acks_ready() || !atomic_load(&g_running)) {
+            atomic_store(&g_writer_idle, false);
+            continue;
+        }
+        tx_sleep(tx_next_deadline_ns());
+        atomic_store(&g_writer_idle, false);
+    }
+    return NULL;
+}
+
+int android_tx_start(int fd) {
+    if (atomic_load(&g_running)) return 0;
+    for (size_t i = 0; i < ANDROID_TX_QUEUE_SIZE; i++) atomic_init(&g_slots[i].seq, i);
+    atomic_init(&g_head, 0);
+    g_tail = 0;
+    g_base_seq = g_next_seq = 1;
+    atomic_init(&g_ack_head, 0);
+    atomic_init(&g_ack_tail, 0);
+    atomic_init(&g_reliable, false);
+    g_fd = fd;
+    if (sem_init(&g_wakeup, 0, 0) != 0) {
+        perror("[AndroidTx] sem_init failed, writing synchronously");
+        return -1;
+    }
+    atomic_store(&g_writer_idle, false);
+    atomic_store(&g_running, true);
+    if (pthread_create(&g_writer, NULL, android_tx_thread, NULL) != 0) {
+        atomic_store(&g_running, false);
+        sem_destroy(&g_wakeup);
+        LOG_ERROR("[AndroidTx] Could not start the writer, writing synchronously.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void android_tx_stop(void) {
+    if (!atomic_exchange(&g_running, false)) return;
+    sem_post(&g_wakeup);
+    pthread_join(g_writer, NULL);
+    tx_flush(); // Sent once more; nothing waits for the acks
+    sem_destroy(&g_wakeup);
+}
+
+static void tx_wake_writer(void) {
+    // Pairs with the writer's store-then-check: either it sees the new entry or we see it idle
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&g_writer_idle, false)) sem_post(&g_wakeup);
+}
+
+int android_tx_send(int fd, const char* message, size_t len) {
+    if (!atomic_load_explicit(&g_running, memory_order_acquire) || fd != g_fd) return tx_write(fd, message, len);
+    if (len > ANDROID_TX_MAX_MESSAGE) {
+        LOG_ERROR("[AndroidTx] %zu byte message too long, not sent.\n", len);
+        return -1;
+    }
+    if (tx_push(message, len) != 0) {
+        metric_inc(METRIC_ANDROID_TX_DROPPED);
+        return -1;
+    }
+    metric_inc(METRIC_ANDROID_MSGS_TX);
+    tx_wake_writer();
+    return 0;
+}
+
+void android_tx_ack(uint32_t cum, uint32_t sack) {
+    if (!atomic_load_explicit(&g_running, memory_order_acquire)) return;
+    unsigned head = atomic_load_explicit(&g_ack_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&g_ack_tail, memory_order_acquire);
+    if (head - tail < ANDROID_TX_ACK_RING_SIZE) {
+        g_acks[head & (ANDROID_TX_ACK_RING_SIZE - 1)] = (TxAck){ cum, sack };
+        atomic_store_explicit(&g_ack_head, head + 1, memory_order_release);
+    }
+    if (!atomic_exchange(&g_reliable, true)) LOG_INFO("[AndroidTx] Android acks messages; sequencing from now on.\n");
+    tx_wake_writer();
+}
@@ -0,0 +1,67 @@
+#ifndef ANDROID_TX_H
+#define ANDROID_TX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file android_tx.h
+ * @brief Single writer for the Bluetooth link to Android.
+ *
+ * Every message for Android (ROBOT, TARGET, status and ACK replies) goes through
+ * android_tx_send(). The caller copies it into a slot of a bounded lock-free MPSC
+ * queue and returns at once, so the nav thread, image workers and reactor never
+ * wait on RFCOMM. A writer thread started by android_tx_start() takes everything
+ * that has queued up, packs it into one buffer and sends it with a single
+ * write(), so a burst of messages costs one RFCOMM write instead of one each.
+ * Only the writer ever waits for RFCOMM to drain (serial_tx.h), for up to
+ * ANDROID_TX_STALL_MS.
+ *
+ * Producers never block: a message that finds the queue full is dropped and
+ * counted. Messages keep the order in which their producers queued them. Before
+ * android_tx_start(), after android_tx_stop() and for any other fd, the caller
+ * writes directly, as before.
+ *
+ * Reliable delivery. Android opts in by sending an ack; until the first one
+ * arrives messages go out bare, as older apps expect. From then on the writer
+ * wraps every message with a sequence number, counting from 1:
+ *
+ *   {"cat":"seq","seq":17,"value":"TARGET,1,11"}        value is the message it replaces
+ *   {"cat":"ack","value":{"cum":16,"sack":[18,19]}}    from Android: all up to cum, plus sack
+ *
+ * A connecting app sends {"cat":"ack","value":{"cum":0}}. Up to
+ * ANDROID_TX_WINDOW messages can be unacknowledged at once, all of them on the
+ * wire together. One that is not acked within its timeout (ANDROID_TX_RTO_MS,
+ * doubled on every resend up to ANDROID_TX_RTO_MAX_MS) is sent again, so a lost
+ * TARGET is recovered without any producer waiting. Android should act on each
+ * seq once and ack duplicates again. While the window is full, new messages
+ * wait in the queue.
+ */
+
+// Queued messages; a power of two
+#define ANDROID_TX_QUEUE_SIZE 64
+// Longest message; every one the controller sends is well under this
+#define ANDROID_TX_MAX_MESSAGE 512
+// Unacknowledged messages in flight; at most 32 (the width of a sack mask)
+#define ANDROID_TX_WINDOW 16
+#define ANDROID_TX_RTO_MS 300
+#define ANDROID_TX_RTO_MAX_MS 2400
+// How long a write waits for a full RFCOMM buffer before its batch is dropped
+#define ANDROID_TX_STALL_MS 900
+
+// Starts the writer for fd. Returns 0, or -1 if the thread could not be created
+// (messages are then written directly).
+int android_tx_start(int fd);
+
+// Writes out everything still queued and stops the writer.
+void android_tx_stop(void);
+
+// Queues len bytes of message for fd. Returns 0 if queued (or written, when
+// there is no writer), -1 if it was dropped or the direct write failed.
+int android_tx_send(int fd, const char* message, size_t len);
+
+// Records an ack from Android (called by the reactor): every seq up to cum, and
+// cum + 1 + i for each bit i of sack. The first call turns on reliable delivery.
+void android_tx_ack(uint32_t cum, uint32_t sack);
+
+#endif // ANDROID_TX_H
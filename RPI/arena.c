@@ -0,0 +1,182 @@
+#include "arena.h"
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size; // Usable bytes in data[]
+    size_t used;
+    size_t last; // Offset of the most recent allocation, which may grow in place
+    _Alignas(max_align_t) unsigned char data[];
+};
+
+static size_t align_up(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static ArenaBlock* arena_new_block(Arena* arena, size_t min_size) {
+    size_t size = arena->block_size > min_size ? arena->block_size : min_size;
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+    if (!block) {
+        fprintf(stderr, "[Arena] Out of memory allocating a %zu byte block.\n", size);
+        return NULL;
+    }
+    block->next = arena->head;
+    block->size = size;
+    block->used = 0;
+    block->last = 0;
+    arena->head = block;
+    return block;
+}
+
+void arena_init(Arena* arena, size_t block_size) {
+    arena->head = NULL;
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+}
+
+void arena_reset(Arena* arena) {
+    ArenaBlock* keep = arena->head;
+    if (!keep) return;
+    ArenaBlock* block = keep->next;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    keep->next = NULL;
+    keep->used = 0;
+    keep->last = 0;
+}
+
+void arena_destroy(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    if (size > SIZE_MAX - ARENA_ALIGN - sizeof(ArenaBlock)) return NULL;
+    size_t rounded = align_up(size ? size : 1);
+    ArenaBlock* block = arena->head;
+    if (!block || block->size - block->used < rounded) {
+        block = arena_new_block(arena, rounded);
+        if (!block) return NULL;
+    }
+    block->last = block->used;
+    block->used += rounded;
+    return block->data + block->last;
+}
+
+void* arena_realloc(Arena* arena, void* ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return arena_alloc(arena, new_size);
+    if (new_size <= old_size) return ptr;
+
+    ArenaBlock* block = arena->head;
+    if (block && (unsigned char*)ptr == block->data + block->last &&
+        new_size <= block->size - block->last) {
+        block->used = block->last + align_up(new_size);
+        return ptr;
+    }
+    void* fresh = arena_alloc(arena, new_size);
+    if (fresh) memcpy(fresh, ptr, old_size);
+    return fresh;
+}
+
+char* arena_strdup(Arena* arena, const char* s) {
+    size_t len = strlen(s);
+    char* copy = arena_alloc(arena, len + 1);
+    if (copy) memcpy(copy, s, len + 1);
+    return copy;
+}
+
+void* arena_array_grow(Arena* arena, void* items, int count, int* capacity, int needed, size_t elem_size) {
+    if (needed <= *capacity) return items;
+    int new_cap = *capacity > 0 ? *capacity : 16;
+    while (new_cap < needed) {
+        if (new_cap > INT_MAX / 2) return NULL;
+        new_cap *= 2;
+    }
+    if ((size_t)new_cap > SIZE_MAX / elem_size) return NULL;
+    void* grown = arena_realloc(arena, items, (size_t)count * elem_size, (size_t)new_cap * elem_size);
+    if (grown) *capacity = new_cap;
+    return grown;
+}
+
+// --- String builder ---
+
+static bool sb_reserve(StrBuilder* sb, size_t extra) {
+    if (sb->failed) return false;
+    if (extra < sb->cap && sb->len < sb->cap - extra) return true; // Room for extra + NUL
+    if (extra > SIZE_MAX / 4 - sb->len) {
+        sb->failed = true;
+        return false;
+    }
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (cap <= sb->len + extra) cap *= 2;
+    char* data = arena_realloc(sb->arena, sb->data, sb->len + 1, cap);
+    if (!data) {
+        sb->failed = true;
+        return false;
+    }
+    sb->data = data;
+    sb->cap = cap;
+    return true;
+}
+
+void sb_init(StrBuilder* sb, Arena* arena, size_t initial_cap) {
+    sb->arena = arena;
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    sb->failed = false;
+    if (sb_reserve(sb, initial_cap)) sb->data[0] = '\0';
+}
+
+void sb_append_n(StrBuilder* sb, const char* s, size_t n) {
+    if (!sb_reserve(sb, n)) return;
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+void sb_append(StrBuilder* sb, const char* s) {
+    sb_append_n(sb, s, strlen(s));
+}
+
+void sb_appendf(StrBuilder* sb, const char* fmt, ...) {
+    if (!sb_reserve(sb, 0)) return;
+
+    va_list args, retry;
+    va_start(args, fmt);
+    va_copy(retry, args);
+    int n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, args);
+    va_end(args);
+
+    if (n < 0) {
+        sb->failed = true;
+    } else if ((size_t)n >= sb->cap - sb->len) {
+        // Didn't fit: grow once to the exact size and format again
+        if (sb_reserve(sb, (size_t)n)) {
+            vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, retry);
+            sb->len += (size_t)n;
+        }
+    } else {
+        sb->len += (size_t)n;
+    }
+    va_end(retry);
+}
+
+const char* sb_str(const StrBuilder* sb) {
+    if (sb->failed) return NULL;
+    return sb->data ? sb->data : "";
+}
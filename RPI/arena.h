@@ -0,0 +1,61 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @file arena.h
+ * @brief Per-mission bump allocator and the buffers built on it.
+ *
+ * Everything a mission allocates (request payload, server response, route
+ * arrays) comes from one arena and is released in one go by arena_reset() when
+ * the next mission starts. Single allocations are never freed, so an array that
+ * grows leaves its old copy readable until the reset. An arena is not
+ * thread-safe: only one thread may allocate from it at a time.
+ */
+
+#define ARENA_DEFAULT_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;  // Block currently allocated from; older blocks follow via next
+    size_t block_size; // Minimum size of each new block
+} Arena;
+
+void arena_init(Arena* arena, size_t block_size);
+// Releases every allocation. The most recent block is kept for reuse.
+void arena_reset(Arena* arena);
+void arena_destroy(Arena* arena);
+
+// Returns size bytes aligned for any type, or NULL if out of memory.
+void* arena_alloc(Arena* arena, size_t size);
+// Resizes ptr (old_size bytes, NULL for a new allocation). The most recent
+// allocation grows in place when its block has room; anything else is copied.
+void* arena_realloc(Arena* arena, void* ptr, size_t old_size, size_t new_size);
+char* arena_strdup(Arena* arena, const char* s);
+
+// Returns storage for at least needed elements of elem_size, keeping the first
+// count elements of items. *capacity is updated. Growth doubles, so pushing n
+// elements costs O(n) overall. Returns NULL if out of memory.
+void* arena_array_grow(Arena* arena, void* items, int count, int* capacity, int needed, size_t elem_size);
+
+// --- String builder ---
+// Tracks its length so every append is amortised O(1); data is always NUL-terminated.
+typedef struct {
+    Arena* arena;
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed; // An append ran out of memory; the string is incomplete
+} StrBuilder;
+
+void sb_init(StrBuilder* sb, Arena* arena, size_t initial_cap);
+void sb_append_n(StrBuilder* sb, const char* s, size_t n);
+void sb_append(StrBuilder* sb, const char* s);
+void sb_appendf(StrBuilder* sb, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+// Returns the built string, or NULL if any append failed.
+const char* sb_str(const StrBuilder* sb);
+
+#endif // ARENA_H
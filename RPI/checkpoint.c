@@ -0,0 +1,327 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+#include "rt_profile.h"
+
+// File layout: records of a header then len bytes of int32 fields, so a
+// record means the same on every run of the same build.
+enum {
+    CHECKPOINT_MISSION = 1, // count, start x, y, dir, then (id, x, y, d) per obstacle
+    CHECKPOINT_ROUTE,       // command count, snap count, (type, value, speed)..., (x, y, d)...
+    CHECKPOINT_SENT,        // cmd_id, route index
+    CHECKPOINT_DONE,        // cmd_id
+    CHECKPOINT_REPORTED,    // obstacle id
+    CHECKPOINT_END
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;
+    uint32_t check; // FNV-1a 32 over the payload
+} CheckpointHeader;
+
+static struct {
+    int fd;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // CLOCK_MONOTONIC
+    bool dirty;          // Written since the last fdatasync()
+    bool urgent;         // ...and it should not wait for CHECKPOINT_SYNC_MS
+    bool stop;
+    bool syncing;        // The syncer thread runs
+    pthread_t syncer;
+} g_cp = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t checkpoint_check(const void* data, size_t len) {
+    uint32_t hash = 0x811c9dc5u; // FNV-1a 32
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x01000193u;
+    }
+    return hash;
+}
+
+// Batches fdatasync(): a record waits at most CHECKPOINT_SYNC_MS to reach the
+// card, an urgent one not at all, and the nav thread never waits for either.
+static void* checkpoint_syncer(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_cp.lock);
+    while (!g_cp.stop || g_cp.dirty) {
+        if (!g_cp.dirty) {
+            pthread_cond_wait(&g_cp.wake, &g_cp.lock);
+            continue;
+        }
+        if (!g_cp.urgent && !g_cp.stop) {
+            struct timespec due;
+            clock_gettime(CLOCK_MONOTONIC, &due);
+            due.tv_nsec += CHECKPOINT_SYNC_MS * 1000000L;
+            due.tv_sec += due.tv_nsec / 1000000000L;
+            due.tv_nsec %= 1000000000L;
+            while (!g_cp.urgent && !g_cp.stop && pthread_cond_timedwait(&g_cp.wake, &g_cp.lock, &due) == 0) {
+            }
+        }
+        g_cp.dirty = g_cp.urgent = false;
+        int fd = g_cp.fd;
+        pthread_mutex_unlock(&g_cp.lock);
+        if (fd != -1 && fdatasync(fd) != 0) LOG_WARN("[Checkpoint] fdatasync failed: %s\n", strerror(errno));
+        pthread_mutex_lock(&g_cp.lock);
+    }
+    pthread_mutex_unlock(&g_cp.lock);
+    return NULL;
+}
+
+// g_cp.lock held. Appends one record; a failed write turns the log off rather
+// than leave a gap a later record would paper over.
+static void checkpoint_append(uint32_t type, const int32_t* fields, size_t count, bool urgent) {
+    if (g_cp.fd == -1) return;
+    CheckpointHeader header = { type, (uint32_t)(count * sizeof(int32_t)), checkpoint_check(fields, count * sizeof(int32_t)) };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void*)fields, header.len } };
+    if (writev(g_cp.fd, iov, 2) != (ssize_t)(sizeof(header) + header.len)) {
+        LOG_ERROR("[Checkpoint] Write failed (%s); missions are no longer checkpointed.\n", strerror(errno));
+        close(g_cp.fd);
+        g_cp.fd = -1;
+        return;
+    }
+    g_cp.dirty = true;
+    g_cp.urgent |= urgent;
+    pthread_cond_signal(&g_cp.wake);
+}
+
+static void checkpoint_record(uint32_t type, const int32_t* fields, size_t count, bool urgent) {
+    pthread_mutex_lock(&g_cp.lock);
+    checkpoint_append(type, fields, count, urgent);
+    pthread_mutex_unlock(&g_cp.lock);
+}
+
+int checkpoint_route_index(const CheckpointMission* m, uint32_t cmd_id) {
+    if (cmd_id == 0 || !m->sent_ids) return -1;
+    for (int k = m->commands.count - 1; k >= 0; k--) {
+        if (m->sent_ids[k] == cmd_id) return k;
+    }
+    return -1;
+}
+
+bool checkpoint_was_reported(const CheckpointMission* m, int obstacle_id) {
+    for (int i = 0; i < m->reported_count; i++) {
+        if (m->reported_ids[i] == obstacle_id) return true;
+    }
+    return false;
+}
+
+// Reads the ROUTE record fields into m. Returns 0, or -1 if they do not add up.
+static int checkpoint_read_route(const int32_t* f, size_t count, Arena* arena, CheckpointMission* m) {
+    if (count < 2 || f[0] < 0 || f[1] < 0 || count != 2 + 3 * (size_t)f[0] + 3 * (size_t)f[1]) return -1;
+    int commands = f[0], snaps = f[1];
+    Command* items = arena_alloc(arena, (size_t)(commands ? commands : 1) * sizeof(Command));
+    SnapPosition* snap_items = arena_alloc(arena, (size_t)(snaps ? snaps : 1) * sizeof(SnapPosition));
+    uint32_t* sent_ids = arena_alloc(arena, (size_t)(commands ? commands : 1) * sizeof(uint32_t));
+    if (!items || !snap_items || !sent_ids) return -1;
+    f += 2;
+    for (int i = 0; i < commands; i++, f += 3) {
+        items[i] = (Command){ .type = (CommandType)f[0], .value = f[1], .speed = (SpeedClass)f[2] };
+    }
+    for (int i = 0; i < snaps; i++, f += 3) snap_items[i] = (SnapPosition){ f[0], f[1], f[2] };
+    memset(sent_ids, 0, (size_t)(commands ? commands : 1) * sizeof(uint32_t));
+    m->commands = (CommandList){ items, commands, commands };
+    m->snap_positions = (SnapList){ snap_items, snaps, snaps };
+    m->sent_ids = sent_ids;
+    m->done = 0;
+    return 0;
+}
+
+// Replays the log's records into out. Returns 1 on an unfinished mission, else 0.
+static int checkpoint_replay(const unsigned char* data, size_t size, Arena* arena, CheckpointMission* out) {
+    bool mission = false, ended = false;
+    size_t at = 0;
+    while (size - at >= sizeof(CheckpointHeader)) {
+        CheckpointHeader header;
+        memcpy(&header, data + at, sizeof(header));
+        if (header.len % sizeof(int32_t) || header.len > size - at - sizeof(header)) break;
+        const unsigned char* payload = data + at + sizeof(header);
+        if (checkpoint_check(payload, header.len) != header.check) break;
+        at += sizeof(header) + header.len;
+
+        int32_t local[8];
+        const int32_t* f = local;
+        size_t count = header.len / sizeof(int32_t);
+        int32_t* copy = NULL;
+        if (count <= 8) {
+            memcpy(local, payload, header.len);
+        } else {
+            copy = malloc(header.len); // Records follow each other unaligned
+            if (!copy) break;
+            memcpy(copy, payload, header.len);
+            f = copy;
+        }
+        bool bad = false;
+        switch (header.type) {
+        case CHECKPOINT_MISSION:
+            bad = count < 4 || f[0] < 0 || f[0] > MAX_OBSTACLES || count != 4 + 4 * (size_t)f[0];
+            if (bad) break;
+            memset(out, 0, sizeof(*out));
+            out->obstacle_count = f[0];
+            out->start_x = f[1];
+            out->start_y = f[2];
+            out->start_dir = f[3];
+            for (int i = 0; i < out->obstacle_count; i++) {
+                out->obstacles[i] = (Obstacle){ f[4 + 4 * i], f[5 + 4 * i], f[6 + 4 * i], f[7 + 4 * i] };
+            }
+            mission = true;
+            ended = false;
+            break;
+        case CHECKPOINT_ROUTE:
+            bad = !mission || checkpoint_read_route(f, count, arena, out) != 0;
+            break;
+        case CHECKPOINT_SENT:
+            bad = count != 2;
+            if (!bad && out->sent_ids && f[1] >= 0 && f[1] < out->commands.count) out->sent_ids[f[1]] = (uint32_t)f[0];
+            break;
+        case CHECKPOINT_DONE: {
+            bad = count != 1;
+            int k = bad ? -1 : checkpoint_route_index(out, (uint32_t)f[0]);
+            if (k + 1 > out->done) out->done = k + 1;
+            break;
+        }
+        case CHECKPOINT_REPORTED:
+            bad = count != 1;
+            if (!bad && !checkpoint_was_reported(out, f[0]) && out->reported_count < MAX_OBSTACLES) {
+                out->reported_ids[out->reported_count++] = f[0];
+            }
+            break;
+        case CHECKPOINT_END:
+            ended = true;
+            break;
+        default:
+            bad = true;
+        }
+        free(copy);
+        if (bad) break;
+    }
+    if (at < size) LOG_WARN("[Checkpoint] Ignoring %zu unreadable byte(s) at the end of the log.\n", size - at);
+    return mission && !ended && out->commands.count > 0 ? 1 : 0;
+}
+
+int checkpoint_open(const char* path, Arena* arena, CheckpointMission* out) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        LOG_ERROR("[Checkpoint] Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    unsigned char* data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = malloc((size_t)st.st_size);
+        if (!data || pread(fd, data, (size_t)st.st_size, 0) != st.st_size) {
+            LOG_ERROR("[Checkpoint] Cannot read %s.\n", path);
+            free(data);
+            close(fd);
+            return -1;
+        }
+    }
+    int found = data ? checkpoint_replay(data, (size_t)st.st_size, arena, out) : 0;
+    free(data);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_cp.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    g_cp.fd = fd;
+    g_cp.stop = false;
+    if (rt_thread_create(&g_cp.syncer, RT_ROLE_BACKGROUND, false, checkpoint_syncer, NULL) != 0) {
+        LOG_WARN("[Checkpoint] No syncer thread; records reach the card when the kernel writes them back.\n");
+    } else {
+        g_cp.syncing = true;
+    }
+    return found;
+}
+
+void checkpoint_begin(const Obstacle* obstacles, int obstacle_count, int start_x, int start_y, int start_dir) {
+    int32_t fields[4 + 4 * MAX_OBSTACLES];
+    if (obstacle_count > MAX_OBSTACLES) obstacle_count = MAX_OBSTACLES;
+    fields[0] = obstacle_count;
+    fields[1] = start_x;
+    fields[2] = start_y;
+    fields[3] = start_dir;
+    for (int i = 0; i < obstacle_count; i++) {
+        fields[4 + 4 * i] = obstacles[i].id;
+        fields[5 + 4 * i] = obstacles[i].x;
+        fields[6 + 4 * i] = obstacles[i].y;
+        fields[7 + 4 * i] = obstacles[i].d;
+    }
+    pthread_mutex_lock(&g_cp.lock);
+    if (g_cp.fd != -1 && ftruncate(g_cp.fd, 0) != 0) {
+        LOG_WARN("[Checkpoint] Cannot truncate the log: %s\n", strerror(errno));
+    }
+    checkpoint_append(CHECKPOINT_MISSION, fields, 4 + 4 * (size_t)obstacle_count, true);
+    pthread_mutex_unlock(&g_cp.lock);
+}
+
+void checkpoint_route(const Command* commands, int command_count, const SnapPosition* snaps, int snap_count) {
+    if (g_cp.fd == -1) return;
+    size_t count = 2 + 3 * (size_t)command_count + 3 * (size_t)snap_count;
+    int32_t* fields = malloc(count * sizeof(int32_t));
+    if (!fields) return;
+    int32_t* f = fields;
+    *f++ = command_count;
+    *f++ = snap_count;
+    for (int i = 0; i < command_count; i++) {
+        *f++ = commands[i].type;
+        *f++ = commands[i].value;
+        *f++ = commands[i].speed;
+    }
+    for (int i = 0; i < snap_count; i++) {
+        *f++ = snaps[i].x;
+        *f++ = snaps[i].y;
+        *f++ = snaps[i].d;
+    }
+    checkpoint_record(CHECKPOINT_ROUTE, fields, count, true);
+    free(fields);
+}
+
+void checkpoint_sent(uint32_t cmd_id, int index) {
+    int32_t fields[2] = { (int32_t)cmd_id, index };
+    checkpoint_record(CHECKPOINT_SENT, fields, 2, false);
+}
+
+void checkpoint_done(uint32_t cmd_id) {
+    int32_t field = (int32_t)cmd_id;
+    checkpoint_record(CHECKPOINT_DONE, &field, 1, false);
+}
+
+void checkpoint_reported(int obstacle_id) {
+    int32_t field = obstacle_id;
+    checkpoint_record(CHECKPOINT_REPORTED, &field, 1, false);
+}
+
+void checkpoint_end(void) {
+    checkpoint_record(CHECKPOINT_END, NULL, 0, true);
+}
+
+void checkpoint_close(void) {
+    pthread_mutex_lock(&g_cp.lock);
+    g_cp.stop = true;
+    pthread_cond_signal(&g_cp.wake);
+    pthread_mutex_unlock(&g_cp.lock);
+    bool synced = g_cp.syncing; // The syncer flushes what is left before it exits
+    if (synced) pthread_join(g_cp.syncer, NULL);
+    g_cp.syncing = false;
+    pthread_mutex_lock(&g_cp.lock);
+    if (g_cp.fd != -1) {
+        if (!synced) fdatasync(g_cp.fd);
+        close(g_cp.fd);
+        g_cp.fd = -1;
+    }
+    pthread_mutex_unlock(&g_cp.lock);
+}
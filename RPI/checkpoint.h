@@ -0,0 +1,74 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "shared_types.h" // For Obstacle, Command, SnapPosition, Arena
+
+/**
+ * @file checkpoint.h
+ * @brief Mission log for picking a mission up again after the controller restarts.
+ *
+ * One append-only file of small binary records: the mission (obstacles and
+ * start pose), each route driven (again after every swap), the STM32 ID each
+ * route command went out under, each DONE and each obstacle whose image was
+ * reported. Records are written as they happen and flushed to the card by a
+ * background thread every CHECKPOINT_SYNC_MS, or straight away for the mission,
+ * a route and the end. A new mission truncates the file; a mission that ended
+ * leaves an END record and is not resumed.
+ *
+ * Every record carries an FNV-1a check, so a power cut mid-write loses that
+ * record and whatever followed it, never more.
+ */
+
+#ifndef CHECKPOINT_SYNC_MS
+#define CHECKPOINT_SYNC_MS 100
+#endif
+
+// The unfinished mission a log held, in memory from checkpoint_open()'s arena.
+typedef struct {
+    Obstacle obstacles[MAX_OBSTACLES];
+    int obstacle_count;
+    int start_x, start_y, start_dir;
+    CommandList commands; // The route under way
+    SnapList snap_positions;
+    uint32_t* sent_ids;   // sent_ids[k]: the ID route command k went out under, 0 if never
+    int done;             // Route commands before index done have finished as far as the log knows
+    int reported_ids[MAX_OBSTACLES]; // Obstacles whose image reached Android
+    int reported_count;
+} CheckpointMission;
+
+// Opens (creating) the log at path and reads what it holds. Returns 1 with out
+// filled if it ends in an unfinished mission, 0 if not, -1 on error (the log
+// is then off).
+int checkpoint_open(const char* path, Arena* arena, CheckpointMission* out);
+
+// Starts a new mission's log.
+void checkpoint_begin(const Obstacle* obstacles, int obstacle_count, int start_x, int start_y, int start_dir);
+
+// The route the mission drives from here, with IDs from the next checkpoint_sent().
+void checkpoint_route(const Command* commands, int command_count, const SnapPosition* snaps, int snap_count);
+
+// Route command index went to the STM32 as cmd_id.
+void checkpoint_sent(uint32_t cmd_id, int index);
+
+// The STM32 finished cmd_id.
+void checkpoint_done(uint32_t cmd_id);
+
+// Android has the image of obstacle_id. Any thread.
+void checkpoint_reported(int obstacle_id);
+
+// The mission is over, whichever way.
+void checkpoint_end(void);
+
+// Flushes what is queued and stops the syncer.
+void checkpoint_close(void);
+
+// The route index cmd_id went out as, -1 if none in m.
+int checkpoint_route_index(const CheckpointMission* m, uint32_t cmd_id);
+
+// True if m's log says Android has the image of obstacle_id.
+bool checkpoint_was_reported(const CheckpointMission* m, int obstacle_id);
+
+#endif // CHECKPOINT_H
@@ -0,0 +1,163 @@
+#include "clock_sync.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+typedef struct {
+    int64_t board_ns;     // Midpoint of the board's rx .. tx, unwrapped
+    int64_t local_ns;     // Midpoint of the Pi's send .. receive, wire time taken out
+    int64_t rtt_ns;
+    int64_t tick_lead_ns; // tx - tick: how far into its ms tick the reply was formatted
+} SyncSample;
+
+static struct {
+    pthread_mutex_t lock;
+    SyncSample samples[CLOCK_SYNC_SAMPLES]; // Ring; next is the oldest once full
+    int count;
+    int next;
+    int64_t board_us; // Newest rx and tick, unwrapped
+    int64_t tick_ms;
+    // local = ref_local_ns + intercept_ns + (1 + slope) * (board - ref_board_ns)
+    int64_t ref_board_ns;
+    int64_t ref_local_ns;
+    double intercept_ns;
+    double slope;
+    int64_t tick_lead_ns; // Smallest kept
+    int64_t best_rtt_ns;
+    int fitted;
+} g_sync = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// value, a 32-bit reading that wraps, as the 64-bit one nearest to near
+static int64_t unwrap32(int64_t near, uint32_t value) {
+    return near + (int32_t)(value - (uint32_t)near);
+}
+
+static double map_locked(int64_t board_ns) {
+    return (double)g_sync.ref_local_ns + g_sync.intercept_ns + (1.0 + g_sync.slope) * (double)(board_ns - g_sync.ref_board_ns);
+}
+
+static void refit_locked(void) {
+    const SyncSample* newest = &g_sync.samples[(g_sync.next + CLOCK_SYNC_SAMPLES - 1) % CLOCK_SYNC_SAMPLES];
+    int64_t best = INT64_MAX;
+    int64_t lead = INT64_MAX;
+    for (int i = 0; i < g_sync.count; i++) {
+        if (g_sync.samples[i].rtt_ns < best) best = g_sync.samples[i].rtt_ns;
+        if (g_sync.samples[i].tick_lead_ns < lead) lead = g_sync.samples[i].tick_lead_ns;
+    }
+    int64_t limit = best + (best / 2 > CLOCK_SYNC_RTT_SLACK_NS ? best / 2 : CLOCK_SYNC_RTT_SLACK_NS);
+
+    // x: board time from the newest sample; y: how far the Pi's clock is off a rate of 1
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, min_x = 0, max_x = 0;
+    int n = 0;
+    for (int i = 0; i < g_sync.count; i++) {
+        const SyncSample* s = &g_sync.samples[i];
+        if (s->rtt_ns > limit) continue;
+        double x = (double)(s->board_ns - newest->board_ns);
+        double y = (double)(s->local_ns - newest->local_ns) - x;
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        if (n == 0 || x < min_x) min_x = x;
+        if (n == 0 || x > max_x) max_x = x;
+        n++;
+    }
+    g_sync.ref_board_ns = newest->board_ns;
+    g_sync.ref_local_ns = newest->local_ns;
+    double var = sxx - sx * sx / n;
+    if (n >= 3 && max_x - min_x >= (double)CLOCK_SYNC_MIN_SPAN_NS && var > 0) {
+        g_sync.slope = (sxy - sx * sy / n) / var;
+        g_sync.intercept_ns = (sy - g_sync.slope * sx) / n;
+    } else {
+        g_sync.slope = 0;
+        g_sync.intercept_ns = sy / n;
+    }
+    g_sync.tick_lead_ns = lead;
+    g_sync.best_rtt_ns = best;
+    g_sync.fitted = n;
+}
+
+void clock_sync_reset(void) {
+    pthread_mutex_lock(&g_sync.lock);
+    g_sync.count = 0;
+    g_sync.next = 0;
+    pthread_mutex_unlock(&g_sync.lock);
+}
+
+void clock_sync_add(uint64_t sent_ns, uint64_t received_ns, uint64_t request_wire_ns, uint64_t reply_wire_ns,
+                    const Stm32SyncReply* reply) {
+    int64_t local_start = (int64_t)(sent_ns + request_wire_ns);
+    int64_t local_end = (int64_t)(received_ns - reply_wire_ns);
+    int64_t board_span_ns = (int64_t)(uint32_t)(reply->tx_us - reply->rx_us) * 1000;
+
+    pthread_mutex_lock(&g_sync.lock);
+    bool first = g_sync.count == 0;
+    int64_t rx_us = first ? reply->rx_us : unwrap32(g_sync.board_us, reply->rx_us);
+    int64_t tick_ms = first ? reply->tick_ms : unwrap32(g_sync.tick_ms, reply->tick_ms);
+    SyncSample s = {
+        .board_ns = rx_us * 1000 + board_span_ns / 2,
+        .local_ns = local_start + (local_end - local_start) / 2,
+        .rtt_ns = local_end - local_start - board_span_ns,
+    };
+    if (s.rtt_ns < 0) s.rtt_ns = 0;
+    if (!first && fabs((double)s.local_ns - map_locked(s.board_ns)) > (double)(CLOCK_SYNC_STEP_NS + s.rtt_ns)) {
+        LOG_INFO("[ClockSync] STM32 clock jumped by %.3f s; starting over.\n",
+                 ((double)s.local_ns - map_locked(s.board_ns)) / 1e9);
+        g_sync.count = 0;
+        g_sync.next = 0;
+        rx_us = reply->rx_us;
+        tick_ms = reply->tick_ms;
+        s.board_ns = rx_us * 1000 + board_span_ns / 2;
+    }
+    s.tick_lead_ns = (rx_us * 1000 + board_span_ns) - tick_ms * 1000000;
+    g_sync.board_us = rx_us;
+    g_sync.tick_ms = tick_ms;
+    g_sync.samples[g_sync.next] = s;
+    g_sync.next = (g_sync.next + 1) % CLOCK_SYNC_SAMPLES;
+    if (g_sync.count < CLOCK_SYNC_SAMPLES) g_sync.count++;
+    refit_locked();
+    int64_t rtt_ns = g_sync.best_rtt_ns;
+    double slope = g_sync.slope;
+    pthread_mutex_unlock(&g_sync.lock);
+
+    if (first) LOG_INFO("[ClockSync] STM32 clock mapped, round trip %.1f us.\n", rtt_ns / 1e3);
+    LOG_DEBUG("[ClockSync] Round trip %.1f us (best %.1f), drift %.2f ppm.\n", s.rtt_ns / 1e3, rtt_ns / 1e3, slope * 1e6);
+    metric_gauge_set(METRIC_GAUGE_STM32_CLOCK_RTT_US, rtt_ns / 1000);
+    metric_gauge_set(METRIC_GAUGE_STM32_CLOCK_DRIFT_PPB, (int64_t)llround(slope * 1e9));
+}
+
+bool clock_sync_board_to_local(uint32_t board_us, uint64_t* local_ns) {
+    pthread_mutex_lock(&g_sync.lock);
+    bool synced = g_sync.count > 0;
+    if (synced) *local_ns = (uint64_t)llround(map_locked(unwrap32(g_sync.board_us, board_us) * 1000));
+    pthread_mutex_unlock(&g_sync.lock);
+    return synced;
+}
+
+bool clock_sync_tick_to_local(uint32_t tick_ms, uint64_t* local_ns) {
+    pthread_mutex_lock(&g_sync.lock);
+    bool synced = g_sync.count > 0;
+    if (synced) {
+        int64_t board_ns = unwrap32(g_sync.tick_ms, tick_ms) * 1000000 + g_sync.tick_lead_ns + 500000;
+        *local_ns = (uint64_t)llround(map_locked(board_ns));
+    }
+    pthread_mutex_unlock(&g_sync.lock);
+    return synced;
+}
+
+bool clock_sync_status(ClockSyncStatus* out) {
+    pthread_mutex_lock(&g_sync.lock);
+    bool synced = g_sync.count > 0;
+    if (synced) {
+        out->samples = g_sync.count;
+        out->fitted = g_sync.fitted;
+        out->offset_ns = g_sync.ref_local_ns + llround(g_sync.intercept_ns) - g_sync.ref_board_ns;
+        out->drift_ppm = g_sync.slope * 1e6;
+        out->rtt_ns = (uint64_t)g_sync.best_rtt_ns;
+    }
+    pthread_mutex_unlock(&g_sync.lock);
+    return synced;
+}
@@ -0,0 +1,68 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stm32_protocol.h" // For Stm32SyncReply
+
+/**
+ * @file clock_sync.h
+ * @brief Maps the STM32's clock onto the Pi's CLOCK_MONOTONIC.
+ *
+ * To firmware that advertises SYNC (stm32_protocol.h), the reactor sends one
+ * every CLOCK_SYNC_PERIOD_MS. Each exchange gives four readings, NTP-style:
+ * the Pi's send and receive times and the board's rx and tx. The round trip
+ * is the Pi's interval less the board's. With each frame's own time on the
+ * wire taken out (its bytes at the link's rate), what is left is assumed to
+ * be the same both ways, so the midpoints of the two intervals are the same
+ * moment on both clocks.
+ *
+ * The last CLOCK_SYNC_SAMPLES exchanges are kept. Waiting behind other
+ * replies or a busy receive task only ever adds delay, so only those within
+ * half the best round trip of it (at least CLOCK_SYNC_RTT_SLACK_NS) are
+ * fitted: local = offset + (1 + drift) * board, by least squares once they
+ * span CLOCK_SYNC_MIN_SPAN_NS, a plain offset before. The offset is then good
+ * to about half the best round trip. A sample more than CLOCK_SYNC_STEP_NS
+ * off the fit means the board's clock jumped (it rebooted), and the fit
+ * starts over.
+ *
+ * HAL_GetTick() timestamps (telemetry) go through the same fit. Each reply
+ * also ties the ms tick to the us clock. The smallest tx - tick seen is where
+ * a tick begins, so a tick maps to its middle, within 0.5 ms.
+ *
+ * Thread-safe.
+ */
+
+#define CLOCK_SYNC_PERIOD_MS 1000
+#define CLOCK_SYNC_SAMPLES 32
+#define CLOCK_SYNC_RTT_SLACK_NS 20000ll
+#define CLOCK_SYNC_MIN_SPAN_NS 10000000000ll // 10 s: drift below that is noise
+#define CLOCK_SYNC_STEP_NS 50000000ll
+
+typedef struct {
+    int samples;       // Kept
+    int fitted;        // Of those, close enough to the best round trip
+    int64_t offset_ns; // Pi time - board time, at the newest sample
+    double drift_ppm;  // How much faster the Pi's clock runs than the board's
+    uint64_t rtt_ns;   // Best round trip kept
+} ClockSyncStatus;
+
+// Forgets every sample, as after the link was reopened.
+void clock_sync_reset(void);
+
+// One exchange: sent_ns just before the request was written and received_ns
+// when the reply was read (latency_now_ns()), and request_wire_ns and
+// reply_wire_ns the time each frame's bytes take at the link's rate.
+void clock_sync_add(uint64_t sent_ns, uint64_t received_ns, uint64_t request_wire_ns, uint64_t reply_wire_ns,
+                    const Stm32SyncReply* reply);
+
+// Pi time of a board us reading (low 32 bits, within 35 minutes of the newest
+// sample) or HAL_GetTick() reading. Return false until the first sample.
+bool clock_sync_board_to_local(uint32_t board_us, uint64_t* local_ns);
+bool clock_sync_tick_to_local(uint32_t tick_ms, uint64_t* local_ns);
+
+// Returns false until the first sample.
+bool clock_sync_status(ClockSyncStatus* out);
+
+#endif // CLOCK_SYNC_H
@@ -0,0 +1,100 @@
+"""
+Server end of the controller's persistent channel (server_channel.h), for the
+fake servers. Each frame is
+
+    u32 length | u8 type | u8 op | u16 meta_len | u32 id | meta (JSON) | blob
+
+little-endian, where length counts everything after itself. serve_channel()
+answers HELLO and runs handler(conn, op, request_id, meta, blob) on its own
+thread for every request. The handler returns the reply's meta as a dict, or
+raises to send an error. It may also call conn.push() later, for example with
+a revised route.
+"""
+import json
+import socket
+import struct
+import threading
+
+CHANNEL_VERSION = 1
+MSG_HELLO, MSG_REQUEST, MSG_REPLY, MSG_ERROR, MSG_CANCEL, MSG_PUSH = range(1, 7)
+OP_NONE, OP_PATH, OP_DETECT, OP_ROUTE = range(4)
+HEADER = struct.Struct("<IBBHI")
+
+
+def read_exact(sock, n):
+    buf = b""
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise ConnectionError("channel closed")
+        buf += chunk
+    return buf
+
+
+class ChannelConnection:
+    def __init__(self, sock):
+        self.sock = sock
+        self.lock = threading.Lock()
+        self.cancelled = set()
+
+    def send(self, msg_type, op, request_id, meta=b"", blob=b""):
+        header = HEADER.pack(HEADER.size - 4 + len(meta) + len(blob), msg_type, op, len(meta), request_id)
+        with self.lock:
+            self.sock.sendall(header + meta + blob)
+
+    def push(self, op, request_id, meta):
+        self.send(MSG_PUSH, op, request_id, json.dumps(meta, separators=(",", ":")).encode("utf-8"))
+
+    def read(self):
+        length, msg_type, op, meta_len, request_id = HEADER.unpack(read_exact(self.sock, HEADER.size))
+        body = read_exact(self.sock, length - (HEADER.size - 4))
+        return msg_type, op, request_id, body[:meta_len], body[meta_len:]
+
+
+def _answer(conn, handler, op, request_id, meta, blob):
+    try:
+        reply_type, reply = MSG_REPLY, handler(conn, op, request_id, json.loads(meta or b"{}"), blob)
+    except Exception as e:  # Reported to the controller, not fatal to the connection
+        reply_type, reply = MSG_ERROR, {"error": str(e)}
+    if request_id in conn.cancelled:
+        conn.cancelled.discard(request_id)
+        return
+    try:
+        conn.send(reply_type, op, request_id, json.dumps(reply, separators=(",", ":")).encode("utf-8"))
+    except OSError:
+        pass  # Controller went away; it retries over HTTP
+
+
+def _serve_connection(sock, handler, label):
+    conn = ChannelConnection(sock)
+    try:
+        while True:
+            msg_type, op, request_id, meta, blob = conn.read()
+            if msg_type == MSG_HELLO:
+                conn.send(MSG_HELLO, OP_NONE, 0, json.dumps({"version": CHANNEL_VERSION}).encode("ascii"))
+                print(f"[{label}] Channel client connected.")
+            elif msg_type == MSG_CANCEL:
+                conn.cancelled.add(request_id)
+            elif msg_type == MSG_REQUEST:
+                threading.Thread(target=_answer, args=(conn, handler, op, request_id, meta, blob), daemon=True).start()
+    except (ConnectionError, OSError):
+        pass
+    finally:
+        sock.close()
+
+
+def serve_channel(port, handler, label):
+    """Accepts channel connections on port in a background thread."""
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(("0.0.0.0", port))
+    listener.listen()
+
+    def accept_loop():
+        while True:
+            sock, _ = listener.accept()
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=_serve_connection, args=(sock, handler, label), daemon=True).start()
+
+    threading.Thread(target=accept_loop, daemon=True).start()
+    print(f"[{label}] Channel listening on port {port} ...")
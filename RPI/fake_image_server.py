@@ -1,15 +1,80 @@
-from http.server import BaseHTTPRequestHandler, HTTPServer
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 import time
 import re
 import json
+import sys
+
+from fake_channel import OP_DETECT, serve_channel
+
+CHANNEL_PORT = 4001
+
+# Snapshots per request advertised to the controller (X-Detect-Batch on HEAD).
+# Run with --no-batch to behave like a server that takes one image per request.
+BATCH_MAX = 0 if "--no-batch" in sys.argv else 3
+
+# --bullseye 1,3 answers the first snapshot of those obstacles with the
+# bullseye, as if the robot had been sent to a blank face, to exercise the
+# controller's retry from another face.
+BULLSEYE_IDS = set(sys.argv[sys.argv.index("--bullseye") + 1].split(",")) if "--bullseye" in sys.argv else set()
+
+
+def detection_reply(obstacle_id_str):
+    if obstacle_id_str in BULLSEYE_IDS:
+        BULLSEYE_IDS.discard(obstacle_id_str)
+        return {
+            "success": True,
+            "count": 1,
+            "objects": [{"class_label": "Bullseye", "img_id": 10, "confidence": 0.95, "bbox": [10, 20, 30, 40]}]
+        }
+    try:
+        img_id = int(obstacle_id_str) + 10 # Create a unique img_id based on obstacle_id
+    except ValueError:
+        img_id = -1
+    return {
+        "success": True,
+        "count": 1,
+        "objects": [
+            {
+                "class_label": f"test_object_{obstacle_id_str}",
+                "img_id": img_id,
+                "confidence": 0.95,
+                "bbox": [10, 20, 30, 40]
+            }
+        ]
+    }
+
 
 class FakeImageServer(BaseHTTPRequestHandler):
+    def do_HEAD(self):
+        # The controller's warm-up request
+        self.send_response(200)
+        if BATCH_MAX > 1:
+            self.send_header('X-Detect-Batch', str(BATCH_MAX))
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
     def do_POST(self):
         if self.path == '/detect':
             content_length = int(self.headers['Content-Length'])
             body = self.rfile.read(content_length)
             body_str = body.decode('utf-8', errors='ignore')
-            
+
+            # One object_id per image; several when the controller batches snapshots
+            object_ids = re.findall(r'name="object_id"\r\n\r\n(\S+)', body_str)
+            if len(object_ids) > 1:
+                print(f"[Fake Img Server] Received batch of {len(object_ids)} images for obstacles: {object_ids}")
+                print("[Fake Img Server] Simulating 5-second image recognition...")
+                time.sleep(5)
+                response_json = json.dumps({
+                    "success": True,
+                    "results": [dict(detection_reply(i), object_id=int(i)) for i in object_ids if i.isdigit()],
+                })
+                self.send_response(200)
+                self.send_header('Content-type', 'application/json')
+                self.end_headers()
+                self.wfile.write(response_json.encode('utf-8'))
+                print(f"[Fake Img Server] Sent response: {response_json}")
+                return
             match = re.search(r'name="object_id"\r\n\r\n(\S+)', body_str)
 
             obstacle_id_str = "0"
@@ -26,26 +91,9 @@ class FakeImageServer(BaseHTTPRequestHandler):
             self.send_header('Content-type', 'application/json')
             self.end_headers()
             
-            try:
-                obstacle_id = int(obstacle_id_str)
-                img_id = obstacle_id + 10 # Create a unique img_id based on obstacle_id
-            except ValueError:
-                img_id = -1
-
             # Return the FULL detection response, as requested for testing the C parser.
             # Note: The C parser is expected to fail on this, but this is for validation.
-            response_data = {
-                "success": True,
-                "count": 1,
-                "objects": [
-                    {
-                        "class_label": f"test_object_{obstacle_id_str}",
-                        "img_id": img_id,
-                        "confidence": 0.95,
-                        "bbox": [10, 20, 30, 40]
-                    }
-                ]
-            }
+            response_data = detection_reply(obstacle_id_str)
             
             # Create a compact JSON string without indentation.
             response_json = json.dumps(response_data)
@@ -57,10 +105,22 @@ class FakeImageServer(BaseHTTPRequestHandler):
             self.end_headers()
 
 
+def handle_channel_request(conn, op, request_id, meta, blob):
+    # One frame per request; a burst's frames arrive as concurrent requests
+    if op != OP_DETECT:
+        raise ValueError(f"unsupported op {op}")
+    obstacle_id_str = str(meta.get("object_id", 0))
+    print(f"[Fake Img Server] Received {len(blob)}-byte channel image for obstacle ID: {obstacle_id_str}")
+    time.sleep(5)
+    return detection_reply(obstacle_id_str)
+
+
 def run_image_server():
+    serve_channel(CHANNEL_PORT, handle_channel_request, "Fake Img Server")
     # Set to run on port 4000 as per user request.
     server_address = ('0.0.0.0', 4000)
-    httpd = HTTPServer(server_address, FakeImageServer)
+    # Threaded so a snapshot burst's concurrent uploads are served side by side
+    httpd = ThreadingHTTPServer(server_address, FakeImageServer)
     print('Fake Image Recognition Server running on http://localhost:4000 ...')
     httpd.serve_forever()
 
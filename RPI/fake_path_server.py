@@ -1,30 +1,19 @@
+import json
+import sys
+import threading
+import time
 from http.server import BaseHTTPRequestHandler, HTTPServer
 
-class FakePathServer(BaseHTTPRequestHandler):
-    def do_POST(self):
-        if self.path == '/path':
-            content_length = int(self.headers['Content-Length'])
-            body = self.rfile.read(content_length)
-            print(f"[Fake Path Server] Received path request with payload: {body.decode('utf-8')}")
+from fake_channel import OP_PATH, OP_ROUTE, serve_channel
 
-            self.send_response(200)
-            self.send_header('Content-type', 'application/json')
-            self.end_headers()
-            # The 'data' wrapper is re-added as the C parser expects it.
-            response = """
-{
+CHANNEL_PORT = 5001
+# With --reroute, every route requested over the channel is pushed again this
+# long after the reply, as a server that found a better one would.
+REROUTE_DELAY_SECONDS = 1.0 if "--reroute" in sys.argv else None
+
+ROUTE_REPLY = {
     "data": {
-        "commands": [
-            "FW10",
-            "FR90",
-            "SP1",
-            "FW15",
-            "FL90",
-            "SP2",
-            "FW20",
-            "SP3",
-            "FW5"
-        ],
+        "commands": ["FW10", "FR90", "SP1", "FW15", "FL90", "SP2", "FW20", "SP3", "FW5"],
         "path": [
             {"x": 0, "y": 0, "d": 0, "s": -1},
             {"x": 0, "y": 1, "d": 0, "s": -1},
@@ -34,24 +23,85 @@ class FakePathServer(BaseHTTPRequestHandler):
             {"x": 2, "y": 3, "d": 0, "s": 2},
             {"x": 3, "y": 3, "d": 2, "s": -1},
             {"x": 3, "y": 4, "d": 2, "s": 3},
-            {"x": 4, "y": 4, "d": 0, "s": -1}
+            {"x": 4, "y": 4, "d": 0, "s": -1},
         ],
         "distance": 100.0,
         "snap_positions": [
             {"x": 1, "y": 2, "d": 2},
             {"x": 2, "y": 3, "d": 0},
-            {"x": 3, "y": 4, "d": 2}
-        ]
+            {"x": 3, "y": 4, "d": 2},
+        ],
     }
 }
-            """
-            self.wfile.write(response.encode('utf-8'))
+
+# Same route as /path, one NDJSON line per command as /path/stream sends it.
+STREAM_ROUTE = [
+    {"cmd": "FW10"},
+    {"cmd": "FR90"},
+    {"cmd": "SP1", "x": 1, "y": 2, "d": 2},
+    {"cmd": "FW15"},
+    {"cmd": "FL90"},
+    {"cmd": "SP2", "x": 2, "y": 3, "d": 0},
+    {"cmd": "FW20"},
+    {"cmd": "SP3", "x": 3, "y": 4, "d": 2},
+    {"cmd": "FW5"},
+    {"done": True, "distance": 100.0},
+]
+STREAM_LINE_DELAY_SECONDS = 0.5  # Simulates the planner still working on later legs
+
+class FakePathServer(BaseHTTPRequestHandler):
+    # Chunked transfer encoding needs HTTP/1.1
+    protocol_version = 'HTTP/1.1'
+
+    def do_POST(self):
+        if self.path == '/path/stream':
+            content_length = int(self.headers['Content-Length'])
+            body = self.rfile.read(content_length)
+            print(f"[Fake Path Server] Received stream request with payload: {body.decode('utf-8')}")
+
+            self.send_response(200)
+            self.send_header('Content-type', 'application/x-ndjson')
+            self.send_header('Transfer-Encoding', 'chunked')
+            self.end_headers()
+            for entry in STREAM_ROUTE:
+                line = (json.dumps(entry, separators=(",", ":")) + "\n").encode('utf-8')
+                self.wfile.write(f"{len(line):x}\r\n".encode('ascii') + line + b"\r\n")
+                self.wfile.flush()
+                time.sleep(STREAM_LINE_DELAY_SECONDS)
+            self.wfile.write(b"0\r\n\r\n")
+            print("[Fake Path Server] Streamed hardcoded route.")
+        elif self.path == '/path':
+            content_length = int(self.headers['Content-Length'])
+            body = self.rfile.read(content_length)
+            print(f"[Fake Path Server] Received path request with payload: {body.decode('utf-8')}")
+
+            self.send_response(200)
+            self.send_header('Content-type', 'application/json')
+            self.send_header('Connection', 'close')
+            self.end_headers()
+            # The 'data' wrapper is re-added as the C parser expects it.
+            self.wfile.write(json.dumps(ROUTE_REPLY, indent=4).encode('utf-8'))
             print("[Fake Path Server] Sent hardcoded route with 'data' wrapper.")
         else:
             self.send_response(404)
+            self.send_header('Content-Length', '0')
             self.end_headers()
 
+def handle_channel_request(conn, op, request_id, payload, blob):
+    if op != OP_PATH:
+        raise ValueError(f"unsupported op {op}")
+    print(f"[Fake Path Server] Received channel path request {request_id} with payload: {json.dumps(payload)}")
+    if REROUTE_DELAY_SECONDS is not None:
+        def reroute():
+            time.sleep(REROUTE_DELAY_SECONDS)
+            conn.push(OP_ROUTE, request_id, ROUTE_REPLY)
+            print(f"[Fake Path Server] Pushed revised route for request {request_id}.")
+        threading.Thread(target=reroute, daemon=True).start()
+    return ROUTE_REPLY
+
+
 def run_path_server():
+    serve_channel(CHANNEL_PORT, handle_channel_request, "Fake Path Server")
     server_address = ('0.0.0.0', 5000) # Changed to port 5000
     httpd = HTTPServer(server_address, FakePathServer)
     print('Fake Pathfinding Server running on http://localhost:5000 ...') # Changed port in print
@@ -1,10 +1,138 @@
 import os
+import struct
+import sys
+import threading
 import time
 import re
 
 RPI_TO_STM_PIPE = "rpi_to_stm"  # RPi -> FakeSTM
 STM_TO_RPI_PIPE = "stm_to_rpi"  # FakeSTM -> RPi
 ACK_DELAY_SECONDS = 1
+SETTLE_DELAY_SECONDS = 0.2  # Time for the chassis to stop rocking after DONE
+
+# Binary command frames, see stm32_protocol.h
+FRAME_SYNC = 0xA5
+FRAME_LEN = 11
+BINARY_PROBE = ":0/GENERAL/BINARY/1/0"
+HELLO_PREFIX = ":0/GENERAL/HELLO/"
+OP_STOP = 0x12
+OP_ROUTE = 0x20
+OP_RESUME = 0x21
+ROUTE_SNAP = 0x30
+ROUTE_HEADER_LEN = 7
+
+# Telemetry frames as the MDP firmware sends them after "TELEM <hz>";
+# run with --telemetry HZ to interleave them with the replies.
+TELEM_TYPE = 0x80
+TELEM_FIELDS = "<IiihhhhihH"  # tick, enc A/D, rps A/D, pwm A/D, yaw, yaw rate, IR
+TELEM_IR_MM = 800  # Nothing in range, or the occupancy map would find things that are not there
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+def parse_binary_frame(frame):
+    """Returns the command ID of a valid frame, or None if the length or CRC is wrong."""
+    if frame[1] != FRAME_LEN - 4 or crc16_ccitt(frame[1:9]) != int.from_bytes(frame[9:11], "little"):
+        print(f"Fake STM32: Rejected binary frame {frame.hex()}")
+        return None
+    opcode = frame[2]
+    cmd_id, speed, dist = (int.from_bytes(frame[i:i + 2], "little") for i in (3, 5, 7))
+    print(f"Fake STM32: Received binary command: id={cmd_id} op=0x{opcode:02x} speed={speed} dist={dist}")
+    return cmd_id
+
+class RouteExecutor:
+    """Runs an uploaded route the way the stm32-motor firmware does."""
+
+    def __init__(self, write_fd):
+        self.write_fd = write_fd
+        self.steps = []
+        self.resumed = threading.Event()
+        self.cancelled = threading.Event()
+
+    def load(self, frame):
+        """Stores one ROUTE frame; returns its command ID, or None if it is corrupt."""
+        length = frame[1]
+        if crc16_ccitt(frame[1:2 + length]) != int.from_bytes(frame[2 + length:4 + length], "little"):
+            print(f"Fake STM32: Rejected route frame {frame.hex()}")
+            return None
+        cmd_id, base_id = (int.from_bytes(frame[i:i + 2], "little") for i in (3, 5))
+        first, total = frame[7], frame[8]
+        if first == 0:
+            self.steps = []
+        for i in range(9, 2 + length, 4):
+            self.steps.append((frame[i], frame[i + 1], int.from_bytes(frame[i + 2:i + 4], "little")))
+        print(f"Fake STM32: Route frame {cmd_id}: {len(self.steps)}/{total} steps (IDs from {base_id})")
+        write_reply(self.write_fd, f"!{cmd_id}/DONE;\n".encode('utf-8'))
+        if len(self.steps) == total:
+            self.cancelled.clear()
+            threading.Thread(target=self.run, args=(base_id,), daemon=True).start()
+        return cmd_id
+
+    def run(self, base_id):
+        for k, (opcode, speed, value) in enumerate(self.steps):
+            if self.cancelled.is_set():
+                print("Fake STM32: Route abandoned.")
+                return
+            cmd_id = base_id + k
+            if opcode == ROUTE_SNAP:
+                self.resumed.clear()
+                write_reply(self.write_fd, f"!{cmd_id}/SNAP;\n".encode('utf-8'))
+                print(f"Fake STM32: Waiting at snapshot step {cmd_id} (obstacle {value})")
+                while not self.resumed.wait(0.1):
+                    if self.cancelled.is_set():
+                        print("Fake STM32: Route abandoned.")
+                        return
+                continue
+            print(f"Fake STM32: Route step {cmd_id}: op=0x{opcode:02x} speed={speed} dist={value}")
+            time.sleep(ACK_DELAY_SECONDS)
+            write_reply(self.write_fd, f"!{cmd_id}/DONE;\n".encode('utf-8'))
+            time.sleep(SETTLE_DELAY_SECONDS)
+            write_reply(self.write_fd, f"!{cmd_id}/SETTLED;\n".encode('utf-8'))
+        print("Fake STM32: Route complete.")
+
+def telemetry_frame(tick_ms):
+    enc = tick_ms // 10
+    body = bytes([struct.calcsize(TELEM_FIELDS) + 1, TELEM_TYPE]) + struct.pack(
+        TELEM_FIELDS, tick_ms, enc, enc, 1500, 1500, 3000, 3000, tick_ms % 36000, 0, TELEM_IR_MM)
+    return bytes([FRAME_SYNC]) + body + crc16_ccitt(body).to_bytes(2, "little")
+
+def send_telemetry(write_fd, hz):
+    start = time.monotonic()
+    while True:
+        tick_ms = int((time.monotonic() - start) * 1000)
+        try:
+            write_reply(write_fd, telemetry_frame(tick_ms))
+        except OSError:
+            return
+        time.sleep(1.0 / hz)
+
+write_lock = threading.Lock()
+
+def write_reply(write_fd, data):
+    """Writes data whole, so replies and telemetry frames never interleave."""
+    with write_lock:
+        os.write(write_fd, data)
+
+def execute_command(write_fd, cmd_id):
+    # Real firmware accepts the command into its queue before executing it
+    write_reply(write_fd, f"!{cmd_id}/OK/MOTOR_CONTROL_SUCCESS;\n".encode('utf-8'))
+    print(f"Fake STM32: Simulating processing for command ID {cmd_id}...")
+    time.sleep(ACK_DELAY_SECONDS)
+
+    ack_message = f"!{cmd_id}/DONE;\n".encode('utf-8')
+
+    # Write the ACK to the dedicated ACK pipe
+    write_reply(write_fd, ack_message)
+    print(f"Fake STM32: Sent ACK: '{ack_message.decode('utf-8').strip()}'")
+
+    time.sleep(SETTLE_DELAY_SECONDS)
+    write_reply(write_fd, f"!{cmd_id}/SETTLED;\n".encode('utf-8'))
 
 def run_fake_stm():
     """
@@ -35,8 +163,14 @@ def run_fake_stm():
         print("Ensure the main C program is started and attempts to open both pipes.")
         return
 
+    if "--telemetry" in sys.argv:
+        hz = float(sys.argv[sys.argv.index("--telemetry") + 1])
+        threading.Thread(target=send_telemetry, args=(write_fd, hz), daemon=True).start()
+        print(f"Fake STM32: Sending telemetry at {hz:g} Hz.")
+
     cmd_pattern = re.compile(rb":(\d+)/")
     read_buffer = b""
+    route = RouteExecutor(write_fd)
 
     try:
         while True:
@@ -49,9 +183,43 @@ def run_fake_stm():
             
             read_buffer += chunk
 
-            # Process all complete messages (ending in ';') in the buffer.
-            while b';' in read_buffer:
-                message, read_buffer = read_buffer.split(b';', 1)
+            # Process every complete binary frame or ASCII message (ending in ';').
+            while read_buffer:
+                if read_buffer[0] == FRAME_SYNC:
+                    if len(read_buffer) < 3:
+                        break
+                    if read_buffer[1] > FRAME_LEN - 4 and read_buffer[2] == OP_ROUTE:
+                        # ROUTE upload: 2 + LEN + 2 bytes
+                        route_len = 2 + read_buffer[1] + 2
+                        if len(read_buffer) < route_len:
+                            break
+                        frame, read_buffer = read_buffer[:route_len], read_buffer[route_len:]
+                        if route.load(frame) is None:
+                            write_reply(write_fd, b"!0/ERROR/BAD_FRAME_CRC;\n")
+                        continue
+                    if len(read_buffer) < FRAME_LEN:
+                        break
+                    frame, read_buffer = read_buffer[:FRAME_LEN], read_buffer[FRAME_LEN:]
+                    cmd_id = parse_binary_frame(frame)
+                    if cmd_id is None:
+                        write_reply(write_fd, b"!0/ERROR/BAD_FRAME_CRC;\n")
+                    elif frame[2] == OP_RESUME:
+                        route.resumed.set()
+                    else:
+                        if frame[2] == OP_STOP:
+                            route.cancelled.set()
+                        execute_command(write_fd, cmd_id)
+                    continue
+
+                end = read_buffer.find(b';')
+                sync = read_buffer.find(bytes([FRAME_SYNC]))
+                if sync != -1 and (end == -1 or sync < end):
+                    # Unterminated ASCII before a binary frame: drop it, as the firmware would
+                    read_buffer = read_buffer[sync:]
+                    continue
+                if end == -1:
+                    break
+                message, read_buffer = read_buffer[:end], read_buffer[end + 1:]
                 
                 message_str = message.decode('utf-8', errors='ignore').strip()
                 if not message_str:
@@ -59,18 +227,16 @@ def run_fake_stm():
 
                 print(f"Fake STM32: Received command: '{message_str};'")
 
-                if message.startswith(b':'):
+                if message_str.startswith(HELLO_PREFIX):
+                    write_reply(write_fd, b"!0/OK/HELLO/0/1/ASCII+BINARY/ROUTE/1000000;\n")
+                    print("Fake STM32: Answered HELLO.")
+                elif message_str == BINARY_PROBE:
+                    write_reply(write_fd, b"!0/OK/BINARY_V1/ROUTE;\n")
+                    print("Fake STM32: Binary frames enabled.")
+                elif message.startswith(b':'):
                     match = cmd_pattern.match(message)
                     if match:
-                        cmd_id = int(match.group(1))
-                        print(f"Fake STM32: Simulating processing for command ID {cmd_id}...")
-                        time.sleep(ACK_DELAY_SECONDS)
-
-                        ack_message = f"!{cmd_id}/DONE;\n".encode('utf-8')
-                        
-                        # Write the ACK to the dedicated ACK pipe
-                        os.write(write_fd, ack_message)
-                        print(f"Fake STM32: Sent ACK: '{ack_message.decode('utf-8').strip()}'")
+                        execute_command(write_fd, int(match.group(1)))
                     else:
                         print(f"Fake STM32: Unrecognized command format: '{message_str};'")
                 else:
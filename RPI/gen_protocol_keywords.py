@@ -0,0 +1,164 @@
+"""
+Generates protocol_keywords.h: perfect-hash lookup tables for the keywords the
+Pi and the STM32 firmware dispatch on (image class labels, Android message
+categories and the ASCII protocol's component / command fields).
+
+Each table is a power-of-two array indexed by a seeded FNV-1a hash of the
+keyword. The seed is searched for here so that no two keywords share a slot,
+which leaves one hash and one memcmp per lookup whatever the table size.
+
+The header is written to RPI/ and to the firmware's Core/Inc/ so both builds
+pick up the same tables. Edit the lists below and re-run:
+
+    python3 gen_protocol_keywords.py
+"""
+import os
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+OUTPUTS = [
+    os.path.join(HERE, "protocol_keywords.h"),
+    os.path.join(HERE, "..", "STM", "stm32-motor", "Core", "Inc", "protocol_keywords.h"),
+]
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+
+# (function name, enum prefix, doc, value if not found, [(keyword, enum suffix, value)])
+TABLES = [
+    ("kw_image_class", None,
+     "Image recognition class label -> image ID (11..40) sent to Android.", -1,
+     [(f"Number {n}", None, 10 + n) for n in range(1, 10)] +
+     [(f"Alphabet {c}", None, 20 + i) for i, c in enumerate("ABCDEFGH")] +
+     [(f"Alphabet {c}", None, 28 + i) for i, c in enumerate("STUVWXYZ")] +
+     [("Up Arrow", None, 36), ("Down Arrow", None, 37), ("Right Arrow", None, 38),
+      ("Left Arrow", None, 39), ("Stop sign", None, 40)]),
+    ("kw_android_category", "KW_CAT_",
+     "\"cat\" field of an Android JSON message.", 0,
+     [("sendArena", "SEND_ARENA", 1), ("stop", "STOP", 2), ("stats", "STATS", 3), ("stm", "STM", 4),
+      ("ack", "ACK", 5), ("config", "CONFIG", 6)]),
+    ("kw_stm_component", "KW_COMPONENT_",
+     "Component field of an ASCII command (\":id/COMPONENT/COMMAND/...;\").", 0,
+     [("MOTOR", "MOTOR", 1), ("GENERAL", "GENERAL", 2), ("SENSOR", "SENSOR", 3)]),
+    # Values are the firmware's enum cmdList, so the result can be cast straight to it
+    ("kw_motor_command", "KW_MOTOR_",
+     "MOTOR command field; values match enum cmdList in the firmware.", -1,
+     [("FWD", "FWD", 0), ("REV", "REV", 1), ("STOP", "STOP", 2), ("TURNL", "TURNL", 3),
+      ("TURNR", "TURNR", 4), ("TURN90L", "TURN90L", 5), ("TURN90R", "TURN90R", 6),
+      ("TASK2", "TASK2", 7), ("PWMTURNL", "PWMTURNL", 8), ("PWMTURNR", "PWMTURNR", 9)]),
+    ("kw_general_command", "KW_GENERAL_",
+     "GENERAL command field, plus the CAPTURE1/CAPTURE2 tuning commands.", 0,
+     [("CAPTURE", "CAPTURE", 1), ("DONE", "DONE", 2), ("BINARY", "BINARY", 3),
+      ("CAPTURE1", "CAPTURE1", 4), ("CAPTURE2", "CAPTURE2", 5), ("HELLO", "HELLO", 6), ("BAUD", "BAUD", 7),
+      ("PING", "PING", 8), ("SCHED", "SCHED", 9), ("SYNC", "SYNC", 10), ("PROGRESS", "PROGRESS", 11), ("PROF", "PROF", 12),
+      ("WHERE", "WHERE", 13), ("CREDIT", "CREDIT", 14)]),
+]
+
+
+def fnv1a(data, seed):
+    h = (FNV_OFFSET ^ seed) & 0xFFFFFFFF
+    for byte in data:
+        h ^= byte
+        h = (h * FNV_PRIME) & 0xFFFFFFFF
+    return h
+
+
+def find_seed(keywords):
+    """Smallest table (at least 2x the keyword count) and seed with no collisions."""
+    size = 1
+    while size < 2 * len(keywords):
+        size *= 2
+    while True:
+        for seed in range(1 << 16):
+            slots = {fnv1a(k.encode(), seed) & (size - 1) for k in keywords}
+            if len(slots) == len(keywords):
+                return size, seed
+        size *= 2
+
+
+def c_string(s):
+    return '"' + s.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+def emit_table(name, prefix, doc, missing, entries):
+    keywords = [k for k, _, _ in entries]
+    size, seed = find_seed(keywords)
+    out = []
+    if prefix:
+        out.append("enum {")
+        out.extend(f"    {prefix}{suffix} = {value}," for _, suffix, value in entries)
+        out.append("};")
+        out.append("")
+    slots = {}
+    for keyword, suffix, value in entries:
+        slots[fnv1a(keyword.encode(), seed) & (size - 1)] = (keyword, f"{prefix}{suffix}" if prefix else str(value))
+    out.append(f"// {doc} Returns {missing} if not found.")
+    out.append(f"static inline int {name}(const char* s, size_t len) {{")
+    out.append(f"    static const KeywordEntry table[{size}] = {{")
+    for slot in sorted(slots):
+        keyword, value = slots[slot]
+        out.append(f"        [{slot}] = {{{c_string(keyword)}, {len(keyword)}, {value}}},")
+    out.append("    };")
+    out.append(f"    return keyword_lookup(table, {size - 1}u, 0x{seed:04x}u, s, len, {missing});")
+    out.append("}")
+    out.append("")
+    return out
+
+
+def generate():
+    out = [
+        "/* Generated by RPI/gen_protocol_keywords.py -- do not edit, re-run the script. */",
+        "#ifndef PROTOCOL_KEYWORDS_H",
+        "#define PROTOCOL_KEYWORDS_H",
+        "",
+        "#include <stddef.h>",
+        "#include <stdint.h>",
+        "#include <string.h>",
+        "",
+        "/**",
+        " * @file protocol_keywords.h",
+        " * @brief Perfect-hash keyword lookups shared by the Pi and the STM32 firmware.",
+        " *",
+        " * Every table slot holds at most one keyword, so a lookup is one FNV-1a hash",
+        " * of the input and one memcmp against the slot it lands in. Inputs are",
+        " * (pointer, length) pairs and need not be NUL-terminated.",
+        " */",
+        "",
+        "typedef struct {",
+        "    const char* name;",
+        "    uint8_t len;",
+        "    int16_t value;",
+        "} KeywordEntry;",
+        "",
+        "static inline uint32_t keyword_hash(const char* s, size_t len, uint32_t seed) {",
+        f"    uint32_t h = {FNV_OFFSET}u ^ seed;",
+        "    for (size_t i = 0; i < len; i++) {",
+        "        h ^= (uint8_t)s[i];",
+        f"        h *= {FNV_PRIME}u;",
+        "    }",
+        "    return h;",
+        "}",
+        "",
+        "static inline int keyword_lookup(const KeywordEntry* table, uint32_t mask, uint32_t seed,",
+        "                                 const char* s, size_t len, int missing) {",
+        "    const KeywordEntry* e = &table[keyword_hash(s, len, seed) & mask];",
+        "    if (e->name && e->len == len && memcmp(e->name, s, len) == 0) return e->value;",
+        "    return missing;",
+        "}",
+        "",
+    ]
+    for table in TABLES:
+        out.extend(emit_table(*table))
+    out.append("#endif // PROTOCOL_KEYWORDS_H")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    header = generate()
+    for path in OUTPUTS:
+        with open(path, "w") as f:
+            f.write(header)
+        print(f"Wrote {os.path.normpath(path)}")
+
+
+if __name__ == "__main__":
+    main()
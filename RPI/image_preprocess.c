@@ -0,0 +1,502 @@
+#include "image_preprocess.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h> // Must precede jpeglib.h
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define IMAGE_USE_NEON 1
+#endif
+
+// --- Snapshot geometry ---
+// Grid cells are 10 cm. The snap pose is the robot's cell; the camera sits
+// towards the front of the chassis and the image face is half a cell in front
+// of the obstacle's centre.
+#define CELL_CM 10.0
+#define CAMERA_FORWARD_OFFSET_CM 5.0
+#define OBSTACLE_FACE_CM 10.0
+#define CAMERA_HFOV_DEG 62.2 // Pi Camera v2
+// Pose drift and image placement on the face make the prediction loose, so the
+// crop is several symbol widths wide and never narrower than MIN_ROI_FRACTION.
+#define ROI_SYMBOL_MARGIN 2.0
+#define MIN_ROI_FRACTION 0.4
+
+int image_roi_for_snapshot(const SnapPosition* snap, const Obstacle* obstacle,
+                           int frame_width, int frame_height, ImageRoi* roi) {
+    // Forward and right unit vectors for N, E, S, W (diagonal poses are not used at snapshots)
+    static const int forward[4][2] = { {0, 1}, {1, 0}, {0, -1}, {-1, 0} };
+    static const int right[4][2] = { {1, 0}, {0, -1}, {-1, 0}, {0, 1} };
+    if (snap->d < 0 || snap->d > 6 || snap->d % 2 != 0) return -1;
+    int dir = snap->d / 2;
+
+    int dx = obstacle->x - snap->x;
+    int dy = obstacle->y - snap->y;
+    double ahead_cm = (dx * forward[dir][0] + dy * forward[dir][1]) * CELL_CM
+                      - CELL_CM / 2.0 - CAMERA_FORWARD_OFFSET_CM;
+    double lateral_cm = (dx * right[dir][0] + dy * right[dir][1]) * CELL_CM;
+    if (ahead_cm <= 0.0) return -1;
+
+    double focal_px = (frame_width / 2.0) / tan(CAMERA_HFOV_DEG * M_PI / 360.0);
+    double centre_x = frame_width / 2.0 + lateral_cm * focal_px / ahead_cm;
+    double centre_y = frame_height / 2.0; // Camera is level with the image face
+    double side = ROI_SYMBOL_MARGIN * OBSTACLE_FACE_CM * focal_px / ahead_cm;
+
+    int width = (int)fmax(side, frame_width * MIN_ROI_FRACTION);
+    int height = (int)fmax(side, frame_height * MIN_ROI_FRACTION);
+    if (width > frame_width) width = frame_width;
+    if (height > frame_height) height = frame_height;
+    width &= ~1; // Even sizes keep every 2x2 block whole
+    height &= ~1;
+
+    int x = (int)(centre_x - width / 2.0);
+    int y = (int)(centre_y - height / 2.0);
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x + width > frame_width) x = frame_width - width;
+    if (y + height > frame_height) y = frame_height - height;
+
+    *roi = (ImageRoi){ x, y, width, height };
+    return 0;
+}
+
+// --- 2x2 box downscale ---
+
+static void downscale_row_pair(const uint8_t* row0, const uint8_t* row1, uint8_t* out, int out_width) {
+    int i = 0;
+#ifdef IMAGE_USE_NEON
+    // 16 source pixels -> 8 output pixels per iteration, channels de-interleaved by vld3
+    for (; i + 8 <= out_width; i += 8) {
+        uint8x16x3_t a = vld3q_u8(row0 + i * 6);
+        uint8x16x3_t b = vld3q_u8(row1 + i * 6);
+        uint8x8x3_t o;
+        o.val[0] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[0]), vpaddlq_u8(b.val[0])), 2);
+        o.val[1] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])), 2);
+        o.val[2] = vrshrn_n_u16(vaddq_u16(vpaddlq_u8(a.val[2]), vpaddlq_u8(b.val[2])), 2);
+        vst3_u8(out + i * 3, o);
+    }
+#endif
+    for (; i < out_width; i++) {
+        const uint8_t* p0 = row0 + i * 6;
+        const uint8_t* p1 = row1 + i * 6;
+        for (int c = 0; c < 3; c++) {
+            out[i * 3 + c] = (uint8_t)((p0[c] + p0[c + 3] + p1[c] + p1[c + 3] + 2) >> 2);
+        }
+    }
+}
+
+void image_downscale_2x_rgb(const uint8_t* src, int width, int height, size_t src_stride,
+                            uint8_t* dst, size_t dst_stride) {
+    int out_width = width / 2;
+    for (int y = 0; y + 1 < height; y += 2) {
+        downscale_row_pair(src + (size_t)y * src_stride, src + (size_t)(y + 1) * src_stride,
+                           dst + (size_t)(y / 2) * dst_stride, out_width);
+    }
+}
+
+// --- libjpeg glue ---
+// libjpeg's default error handler calls exit(). Errors (e.g. a truncated frame)
+// longjmp back to image_preprocess instead.
+
+typedef struct {
+    struct jpeg_error_mgr pub;
+    jmp_buf escape;
+} JpegErrorManager;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    JpegErrorManager* err = (JpegErrorManager*)cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    fprintf(stderr, "[ImagePrep] libjpeg: %s\n", message);
+    longjmp(err->escape, 1);
+}
+
+// Destination manager appending into a MemoryStruct, so the output buffer is
+// reused across frames like the capture buffer.
+#define JPEG_OUT_CHUNK 4096
+
+typedef struct {
+    struct jpeg_destination_mgr pub;
+    struct MemoryStruct* out;
+    JOCTET chunk[JPEG_OUT_CHUNK];
+    bool failed;
+} MemoryDestination;
+
+static void dest_init(j_compress_ptr cinfo) {
+    MemoryDestination* dest = (MemoryDestination*)cinfo->dest;
+    dest->pub.next_output_byte = dest->chunk;
+    dest->pub.free_in_buffer = JPEG_OUT_CHUNK;
+}
+
+static boolean dest_empty(j_compress_ptr cinfo) {
+    MemoryDestination* dest = (MemoryDestination*)cinfo->dest;
+    if (WriteMemoryCallback(dest->chunk, 1, JPEG_OUT_CHUNK, dest->out) != JPEG_OUT_CHUNK) dest->failed = true;
+    dest->pub.next_output_byte = dest->chunk;
+    dest->pub.free_in_buffer = JPEG_OUT_CHUNK;
+    return TRUE;
+}
+
+static void dest_term(j_compress_ptr cinfo) {
+    MemoryDestination* dest = (MemoryDestination*)cinfo->dest;
+    size_t n = JPEG_OUT_CHUNK - dest->pub.free_in_buffer;
+    if (n > 0 && WriteMemoryCallback(dest->chunk, 1, n, dest->out) != n) dest->failed = true;
+}
+
+static bool ensure_capacity(ImagePreprocessor* pre, size_t needed) {
+    if (needed <= pre->capacity) return true;
+    uint8_t* grown = realloc(pre->pixels, needed);
+    if (!grown) return false;
+    pre->pixels = grown;
+    pre->capacity = needed;
+    return true;
+}
+
+// Decodes frame and keeps only the roi columns/rows. On success *out_roi is the
+// crop actually applied (clamped to the decoded size).
+static int decode_cropped(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                          const ImageRoi* roi, ImageRoi* out_roi) {
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager err;
+    uint8_t* volatile row = NULL; // Freed after a longjmp, so must not live in a register
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_error_exit;
+    if (setjmp(err.escape)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(row);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)frame->memory, (unsigned long)frame->size);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    int width = (int)cinfo.output_width, height = (int)cinfo.output_height;
+    ImageRoi crop = roi ? *roi : (ImageRoi){ 0, 0, width, height };
+    if (crop.x < 0 || crop.y < 0 || crop.width < 2 || crop.height < 2 ||
+        crop.x + crop.width > width || crop.y + crop.height > height) {
+        crop = (ImageRoi){ 0, 0, width & ~1, height & ~1 };
+    }
+
+    // Room for the crop plus every halved copy (at most a third more)
+    size_t crop_bytes = (size_t)crop.width * crop.height * 3;
+    row = malloc((size_t)width * 3);
+    if (!row || !ensure_capacity(pre, crop_bytes + crop_bytes / 3 + 64)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(row);
+        return -1;
+    }
+
+    JSAMPROW rows[1] = { row };
+    while (cinfo.output_scanline < cinfo.output_height) {
+        int y = (int)cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        if (y >= crop.y && y < crop.y + crop.height) {
+            memcpy(pre->pixels + (size_t)(y - crop.y) * crop.width * 3, row + (size_t)crop.x * 3,
+                   (size_t)crop.width * 3);
+        }
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    *out_roi = crop;
+    return 0;
+}
+
+static int encode_rgb(ImagePreprocessor* pre, const uint8_t* pixels, int width, int height, int quality) {
+    struct jpeg_compress_struct cinfo;
+    JpegErrorManager err;
+    MemoryDestination dest;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_error_exit;
+    if (setjmp(err.escape)) {
+        jpeg_destroy_compress(&cinfo);
+        return -1;
+    }
+    jpeg_create_compress(&cinfo);
+
+    pre->jpeg.size = 0;
+    dest.pub.init_destination = dest_init;
+    dest.pub.empty_output_buffer = dest_empty;
+    dest.pub.term_destination = dest_term;
+    dest.out = &pre->jpeg;
+    dest.failed = false;
+    cinfo.dest = &dest.pub;
+
+    cinfo.image_width = (JDIMENSION)width;
+    cinfo.image_height = (JDIMENSION)height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW row = (JSAMPROW)(pixels + (size_t)cinfo.next_scanline * width * 3);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return dest.failed ? -1 : 0;
+}
+
+int image_decode_rgb(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                     const ImageRoi* roi, int max_width, ImageRgb* out) {
+    ImageRoi crop;
+    if (frame->size == 0 || decode_cropped(pre, frame, roi, &crop) != 0) return -1;
+
+    // Halve until the width fits. Each copy goes right after the previous one.
+    uint8_t* pixels = pre->pixels;
+    int width = crop.width, height = crop.height;
+    while (width > max_width && width >= 4 && height >= 4) {
+        uint8_t* half = pixels + (size_t)width * height * 3;
+        image_downscale_2x_rgb(pixels, width, height, (size_t)width * 3, half, (size_t)(width / 2) * 3);
+        pixels = half;
+        width /= 2;
+        height /= 2;
+    }
+    *out = (ImageRgb){ pixels, width, height, crop };
+    return 0;
+}
+
+static void upload_observe_encode(size_t bytes, int pixels, int quality);
+
+int image_preprocess(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                     const ImageRoi* roi, int max_width, int quality) {
+    ImageRgb image;
+    if (image_decode_rgb(pre, frame, roi, max_width, &image) != 0) return -1;
+    pre->width = image.width;
+    pre->height = image.height;
+    pre->crop = image.crop;
+    if (encode_rgb(pre, image.pixels, image.width, image.height, quality) != 0) return -1;
+    upload_observe_encode(pre->jpeg.size, image.width * image.height, quality);
+    return 0;
+}
+
+void image_preprocessor_free(ImagePreprocessor* pre) {
+    free(pre->pixels);
+    free(pre->jpeg.memory);
+    pre->pixels = NULL;
+    pre->capacity = 0;
+    pre->jpeg = (struct MemoryStruct){0};
+}
+
+// --- Quality gate ---
+
+typedef struct {
+    int64_t lap_sum;
+    uint64_t lap_squares;
+    uint64_t dark, bright;
+} LumaSums;
+
+// Laplacian over the interior pixels of row, whose neighbours are up and down
+static void laplacian_row(const uint8_t* up, const uint8_t* row, const uint8_t* down, int width, LumaSums* sums) {
+    int x = 1;
+#ifdef IMAGE_USE_NEON
+    // 8 pixels per iteration in 16 bits: |lap| <= 1020, so its square fits 32 bits
+    int32x4_t sum = vdupq_n_s32(0);
+    uint32x4_t squares = vdupq_n_u32(0);
+    for (; x + 9 <= width; x += 8) {
+        uint16x8_t centre = vshll_n_u8(vld1_u8(row + x), 2);
+        uint16x8_t around = vaddq_u16(vaddl_u8(vld1_u8(row + x - 1), vld1_u8(row + x + 1)),
+                                      vaddl_u8(vld1_u8(up + x), vld1_u8(down + x)));
+        int16x8_t lap = vreinterpretq_s16_u16(vsubq_u16(centre, around));
+        sum = vpadalq_s16(sum, lap);
+        squares = vaddq_u32(squares, vreinterpretq_u32_s32(vmull_s16(vget_low_s16(lap), vget_low_s16(lap))));
+        squares = vaddq_u32(squares, vreinterpretq_u32_s32(vmull_s16(vget_high_s16(lap), vget_high_s16(lap))));
+    }
+    int64x2_t sum2 = vpaddlq_s32(sum);
+    uint64x2_t squares2 = vpaddlq_u32(squares);
+    sums->lap_sum += vgetq_lane_s64(sum2, 0) + vgetq_lane_s64(sum2, 1);
+    sums->lap_squares += vgetq_lane_u64(squares2, 0) + vgetq_lane_u64(squares2, 1);
+#endif
+    for (; x + 1 < width; x++) {
+        int lap = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+        sums->lap_sum += lap;
+        sums->lap_squares += (uint64_t)(lap * lap);
+    }
+}
+
+// Pixels of row at either end of the histogram
+static void clipped_row(const uint8_t* row, int width, LumaSums* sums) {
+    int x = 0;
+#ifdef IMAGE_USE_NEON
+    // Compare masks are 0xFF per hit; shifted down to 1 and pairwise added they count them
+    uint16x8_t dark = vdupq_n_u16(0), bright = vdupq_n_u16(0);
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t p = vld1q_u8(row + x);
+        dark = vpadalq_u8(dark, vshrq_n_u8(vcleq_u8(p, vdupq_n_u8(IMAGE_QUALITY_DARK_LEVEL)), 7));
+        bright = vpadalq_u8(bright, vshrq_n_u8(vcgeq_u8(p, vdupq_n_u8(IMAGE_QUALITY_BRIGHT_LEVEL)), 7));
+    }
+    uint64x2_t dark2 = vpaddlq_u32(vpaddlq_u16(dark));
+    uint64x2_t bright2 = vpaddlq_u32(vpaddlq_u16(bright));
+    sums->dark += vgetq_lane_u64(dark2, 0) + vgetq_lane_u64(dark2, 1);
+    sums->bright += vgetq_lane_u64(bright2, 0) + vgetq_lane_u64(bright2, 1);
+#endif
+    for (; x < width; x++) {
+        sums->dark += row[x] <= IMAGE_QUALITY_DARK_LEVEL;
+        sums->bright += row[x] >= IMAGE_QUALITY_BRIGHT_LEVEL;
+    }
+}
+
+void image_luma_quality(const uint8_t* luma, int width, int height, size_t stride, ImageQuality* out) {
+    LumaSums sums = {0};
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = luma + (size_t)y * stride;
+        clipped_row(row, width, &sums);
+        if (y > 0 && y + 1 < height) laplacian_row(row - stride, row, row + stride, width, &sums);
+    }
+    double pixels = (double)width * height;
+    double interior = (double)(width - 2) * (height - 2);
+    double mean = sums.lap_sum / interior;
+    *out = (ImageQuality){
+        .sharpness = sums.lap_squares / interior - mean * mean,
+        .dark = sums.dark / pixels,
+        .bright = sums.bright / pixels,
+        .width = width,
+        .height = height,
+    };
+}
+
+int image_quality_measure(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                          const ImageRoi* roi, ImageQuality* out) {
+    if (frame->size == 0) return -1;
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = jpeg_error_exit;
+    if (setjmp(err.escape)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)frame->memory, (unsigned long)frame->size);
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = IMAGE_QUALITY_SCALE;
+    cinfo.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&cinfo);
+
+    // The crop in decoded pixels; the whole frame if it does not fit
+    int width = (int)cinfo.output_width, height = (int)cinfo.output_height;
+    ImageRoi crop = { 0, 0, width, height };
+    if (roi && roi->x >= 0 && roi->y >= 0 && roi->x + roi->width <= (int)cinfo.image_width &&
+        roi->y + roi->height <= (int)cinfo.image_height) {
+        crop.x = (int)((int64_t)roi->x * width / cinfo.image_width);
+        crop.y = (int)((int64_t)roi->y * height / cinfo.image_height);
+        crop.width = (int)((int64_t)roi->width * width / cinfo.image_width);
+        crop.height = (int)((int64_t)roi->height * height / cinfo.image_height);
+    }
+    if (crop.width < 3 || crop.height < 3 || !ensure_capacity(pre, (size_t)width * height)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    // Whole rows straight into the scratch; the crop is a window onto them, and
+    // rows below it are never decoded
+    while ((int)cinfo.output_scanline < crop.y + crop.height) {
+        JSAMPROW row = pre->pixels + (size_t)cinfo.output_scanline * width;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    image_luma_quality(pre->pixels + (size_t)crop.y * width + crop.x, crop.width, crop.height, (size_t)width, out);
+    return 0;
+}
+
+const char* image_quality_problem(const ImageQuality* quality) {
+    if (quality->dark > IMAGE_QUALITY_MAX_CLIPPED) return "under-exposed";
+    if (quality->bright > IMAGE_QUALITY_MAX_CLIPPED) return "over-exposed";
+    if (quality->sharpness < IMAGE_QUALITY_MIN_SHARPNESS) return "blurred";
+    return NULL;
+}
+
+// --- Upload sizing ---
+// Each new sample outweighs the ones before by 1 / UPLOAD_FIT_DECAY, so the fit
+// follows the link over the last ten or so uploads.
+#define UPLOAD_FIT_DECAY 0.9
+#define UPLOAD_FIT_MIN_WEIGHT 3.0
+#define UPLOAD_FIT_MIN_SPREAD 1024.0 // Bytes, standard deviation of the sizes fitted
+#define UPLOAD_RTT_GAIN 0.2
+#define UPLOAD_BPP_GAIN 0.2
+#define UPLOAD_QUALITY_STEP 10
+#define UPLOAD_BYTES_PER_PIXEL 0.25 // At IMAGE_UPLOAD_QUALITY, until encodes say otherwise
+
+static struct {
+    pthread_mutex_t lock;
+    double w, sx, sy, sxx, sxy; // Decayed sums over (bytes, seconds)
+    double seconds_per_byte;    // Last good slope; 0 until there is one
+    double rtt_s;
+    double bytes_per_pixel;     // At IMAGE_UPLOAD_QUALITY
+} g_upload = { .lock = PTHREAD_MUTEX_INITIALIZER, .bytes_per_pixel = UPLOAD_BYTES_PER_PIXEL };
+
+// Size of a libjpeg baseline encode at quality relative to IMAGE_UPLOAD_QUALITY
+// (85), from photos of the arena's symbols. Indexed by (quality - 35) / 10.
+static double upload_quality_factor(int quality) {
+    static const double factor[] = { 0.37, 0.43, 0.50, 0.58, 0.72, 1.0, 1.35 };
+    int i = (quality - 35) / 10;
+    if (i < 0) i = 0;
+    if (i > 6) i = 6;
+    return factor[i];
+}
+
+ImageUploadSettings image_upload_pick(int crop_width, int crop_height) {
+    ImageUploadSettings fallback = { IMAGE_UPLOAD_MAX_WIDTH, IMAGE_UPLOAD_QUALITY };
+    pthread_mutex_lock(&g_upload.lock);
+    double spb = g_upload.seconds_per_byte, rtt = g_upload.rtt_s, bpp = g_upload.bytes_per_pixel;
+    pthread_mutex_unlock(&g_upload.lock);
+    if (spb <= 0.0 || crop_width < 2 || crop_height < 2) return fallback;
+
+    // Widths image_decode_rgb() can produce: the crop, halved. Largest first;
+    // at each width, highest quality first.
+    double budget_s = IMAGE_UPLOAD_TARGET_MS / 1000.0 - rtt;
+    ImageUploadSettings last = fallback;
+    for (int width = crop_width, height = crop_height; width >= 2; width /= 2, height /= 2) {
+        if (width < IMAGE_UPLOAD_MIN_WIDTH) break;
+        for (int q = IMAGE_UPLOAD_QUALITY; q >= IMAGE_UPLOAD_MIN_QUALITY; q -= UPLOAD_QUALITY_STEP) {
+            double bytes = bpp * width * height * upload_quality_factor(q) / upload_quality_factor(IMAGE_UPLOAD_QUALITY);
+            last = (ImageUploadSettings){ width, q };
+            if (bytes * spb <= budget_s) return last;
+        }
+    }
+    return last; // Nothing fits: the smallest the detector still handles
+}
+
+// Keeps bytes_per_pixel in step with what the encoder actually produces.
+static void upload_observe_encode(size_t bytes, int pixels, int quality) {
+    if (pixels <= 0 || bytes == 0) return;
+    double bpp = (double)bytes / pixels * upload_quality_factor(IMAGE_UPLOAD_QUALITY) / upload_quality_factor(quality);
+    pthread_mutex_lock(&g_upload.lock);
+    g_upload.bytes_per_pixel += UPLOAD_BPP_GAIN * (bpp - g_upload.bytes_per_pixel);
+    pthread_mutex_unlock(&g_upload.lock);
+}
+
+void image_upload_observe(size_t bytes, double seconds, double rtt_s) {
+    double x = (double)bytes;
+    pthread_mutex_lock(&g_upload.lock);
+    g_upload.w = g_upload.w * UPLOAD_FIT_DECAY + 1.0;
+    g_upload.sx = g_upload.sx * UPLOAD_FIT_DECAY + x;
+    g_upload.sy = g_upload.sy * UPLOAD_FIT_DECAY + seconds;
+    g_upload.sxx = g_upload.sxx * UPLOAD_FIT_DECAY + x * x;
+    g_upload.sxy = g_upload.sxy * UPLOAD_FIT_DECAY + x * seconds;
+    double var = g_upload.sxx / g_upload.w - (g_upload.sx / g_upload.w) * (g_upload.sx / g_upload.w);
+    if (g_upload.w >= UPLOAD_FIT_MIN_WEIGHT && var >= UPLOAD_FIT_MIN_SPREAD * UPLOAD_FIT_MIN_SPREAD) {
+        double slope = (g_upload.w * g_upload.sxy - g_upload.sx * g_upload.sy) /
+                       (g_upload.w * g_upload.sxx - g_upload.sx * g_upload.sx);
+        if (slope > 0.0) g_upload.seconds_per_byte = slope; // Noise can tip it over; keep the last one then
+    }
+    if (rtt_s >= 0.0) {
+        g_upload.rtt_s = g_upload.rtt_s > 0.0 ? g_upload.rtt_s + UPLOAD_RTT_GAIN * (rtt_s - g_upload.rtt_s) : rtt_s;
+    }
+    pthread_mutex_unlock(&g_upload.lock);
+}
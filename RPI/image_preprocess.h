@@ -0,0 +1,136 @@
+#ifndef IMAGE_PREPROCESS_H
+#define IMAGE_PREPROCESS_H
+
+#include <stdint.h>
+
+#include "rpi_hal.h"      // For struct MemoryStruct
+#include "shared_types.h" // For Obstacle, SnapPosition
+
+/**
+ * @file image_preprocess.h
+ * @brief Shrinks a snapshot before it is uploaded to the image server.
+ *
+ * The camera delivers 640x480 JPEGs but the symbol only fills part of the frame,
+ * and where it sits follows from the snap pose and the obstacle's cell. Each frame
+ * is decoded, cropped to that region, halved (2x2 box filter, NEON on the Pi)
+ * until it fits a maximum width, and re-encoded.
+ *
+ * The width and JPEG quality follow the Wi-Fi (image_upload_pick()). Finished
+ * uploads report their size and their time from request to the first reply
+ * byte. A decayed least-squares fit of time against size gives the link's
+ * seconds per byte, so time spent in the server does not count against the link.
+ * New connections also report their TCP handshake as an RTT sample, and encodes
+ * report bytes per pixel. Each frame then gets the largest width, at the
+ * highest quality, predicted to upload within IMAGE_UPLOAD_TARGET_MS. It never
+ * drops below IMAGE_UPLOAD_MIN_WIDTH and IMAGE_UPLOAD_MIN_QUALITY, the smallest
+ * the detector still reads reliably. Until the fit has enough varied samples,
+ * frames go out at IMAGE_UPLOAD_MAX_WIDTH and IMAGE_UPLOAD_QUALITY.
+ *
+ * Before any of that, image_quality_measure() tells a blurred or badly exposed
+ * frame from a usable one cheaply enough to recapture it while the robot is
+ * still stopped.
+ */
+
+#define IMAGE_UPLOAD_MAX_WIDTH 320 // Without a link estimate
+#define IMAGE_UPLOAD_QUALITY 85    // Also the highest quality picked
+#define IMAGE_UPLOAD_MIN_WIDTH 160
+#define IMAGE_UPLOAD_MIN_QUALITY 55
+#define IMAGE_UPLOAD_TARGET_MS 250 // Per frame; a burst's frames upload side by side
+
+typedef struct {
+    int x, y;
+    int width, height;
+} ImageRoi;
+
+// Per-worker scratch, reused between frames.
+typedef struct {
+    uint8_t* pixels; // Cropped RGB rows, then their downscaled copies
+    size_t capacity;
+    struct MemoryStruct jpeg; // Re-encoded output
+    int width, height;        // Of jpeg
+    ImageRoi crop;            // Part of the frame jpeg covers, in frame pixels
+} ImagePreprocessor;
+
+// Predicts where obstacle's image face appears in a frame_width x frame_height
+// capture taken from snap. Returns -1 if the pose does not face the obstacle
+// (or is unknown), in which case the whole frame should be kept.
+int image_roi_for_snapshot(const SnapPosition* snap, const Obstacle* obstacle,
+                           int frame_width, int frame_height, ImageRoi* roi);
+
+// Decoded pixels of a frame (see image_decode_rgb()).
+typedef struct {
+    const uint8_t* pixels; // RGB24, width * 3 bytes per row; inside the preprocessor's scratch
+    int width, height;
+    ImageRoi crop; // Part of the frame they cover, in frame pixels
+} ImageRgb;
+
+// Decodes frame, crops it to roi (the whole frame when roi is NULL) and halves it
+// until it is at most max_width wide, without re-encoding. out stays valid until
+// the next call on pre. Returns 0 on success, -1 as image_preprocess() does.
+int image_decode_rgb(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                     const ImageRoi* roi, int max_width, ImageRgb* out);
+
+// Crops frame to roi (the whole frame when roi is NULL), downscales to at most
+// max_width and re-encodes into pre->jpeg. Returns 0 on success, -1 if the
+// frame could not be decoded or memory ran out; frame is left untouched.
+int image_preprocess(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                     const ImageRoi* roi, int max_width, int quality);
+
+void image_preprocessor_free(ImagePreprocessor* pre);
+
+// --- Upload sizing (thread-safe) ---
+
+typedef struct {
+    int max_width;
+    int quality;
+} ImageUploadSettings;
+
+// Settings for a frame whose crop is crop_width x crop_height pixels.
+ImageUploadSettings image_upload_pick(int crop_width, int crop_height);
+
+// An upload of bytes that got its first reply byte seconds after the request
+// went out. rtt_s is the TCP handshake when the upload opened a new
+// connection, else negative.
+void image_upload_observe(size_t bytes, double seconds, double rtt_s);
+
+// --- Quality gate ---
+// Whether a frame is worth sending to the detector, judged on its luma decoded
+// at 1 / IMAGE_QUALITY_SCALE (libjpeg's DCT scaling, so most of the IDCT is
+// skipped) and cropped to the symbol's region: motion blur leaves little
+// variance in the Laplacian, and a bad exposure piles the histogram up at one
+// end. Thresholds are for that scale; a few ms per 640x480 frame on the Pi.
+#define IMAGE_QUALITY_SCALE 4
+#ifndef IMAGE_QUALITY_MIN_SHARPNESS
+#define IMAGE_QUALITY_MIN_SHARPNESS 100.0
+#endif
+#ifndef IMAGE_QUALITY_MAX_CLIPPED
+#define IMAGE_QUALITY_MAX_CLIPPED 0.6 // Of the pixels, at either end
+#endif
+#define IMAGE_QUALITY_DARK_LEVEL 8    // Luma at or below counts as clipped black
+#define IMAGE_QUALITY_BRIGHT_LEVEL 247
+
+typedef struct {
+    double sharpness;    // Variance of the 4-neighbour Laplacian
+    double dark, bright; // Fractions of pixels clipped at either end
+    int width, height;   // Of the luma measured
+} ImageQuality;
+
+// Measures frame's crop to roi (the whole frame when roi is NULL). Returns 0, or
+// -1 if the frame could not be decoded or memory ran out. Uses pre's scratch,
+// like image_decode_rgb().
+int image_quality_measure(ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                          const ImageRoi* roi, ImageQuality* out);
+
+// What is wrong with a measured frame ("blurred", "under-exposed",
+// "over-exposed"), or NULL if it passes.
+const char* image_quality_problem(const ImageQuality* quality);
+
+// The measurement itself, on an 8-bit luma plane at least 3x3 (NEON on the Pi).
+void image_luma_quality(const uint8_t* luma, int width, int height, size_t stride, ImageQuality* out);
+
+// Halves an RGB24 image with a rounded 2x2 box filter. dst receives
+// (width / 2) x (height / 2) pixels.
+void image_downscale_2x_rgb(const uint8_t* src, int width, int height, size_t src_stride,
+                            uint8_t* dst, size_t dst_stride);
+
+#endif // IMAGE_PREPROCESS_H
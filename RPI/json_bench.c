@@ -0,0 +1,167 @@
+/*
+ * Throughput benchmark for json_parser.c over the payload corpus in json_corpus/.
+ *
+ *   gcc -O2 -Wall json_bench.c json_parser.c arena.c -o json_bench
+ *   ./json_bench json_corpus/[a-z]*          (-n ITERATIONS, default 20000)
+ *
+ * The file name prefix picks the parse the controller does for that payload:
+ *   sendarena_  Android message: tokenize, "cat" lookup, parse_android_map_doc
+ *   route_      parse_route_json (mission arena reset between runs)
+ *   routeline_  parse_route_ndjson_line
+ *   detect_     parse_detection_json
+ *   detectbatch_  parse_detection_batch_json, then parse_detection_json per result
+ * Every file is also timed through get_json_string on its first key, the
+ * one-off lookup path. Each result is the best of BENCH_ROUNDS rounds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "json_parser.h"
+#include "json_schema.h"
+
+#define BENCH_ROUNDS 5
+
+typedef struct {
+    const char* name;
+    char* json;
+    size_t len;
+} Payload;
+
+static SharedAppContext g_context;
+static Arena g_arena;
+
+static int bench_sendarena(const Payload* p) {
+    JsonToken tokens[MAX_OBSTACLES * 9 + 32];
+    JsonDoc doc;
+    if (json_parse(&doc, p->json, p->len, tokens, (int)(sizeof(tokens) / sizeof(tokens[0]))) != 0) return -1;
+    AndroidMessage msg = { .value = -1 };
+    if (json_decode_android_message(&doc, 0, &msg, NULL) != 0 || strcmp(msg.cat, "sendArena") != 0) return -1;
+    return parse_android_map_doc(&doc, msg.value, &g_context);
+}
+
+static int bench_route(const Payload* p) {
+    CommandList commands;
+    SnapList snaps;
+    arena_reset(&g_arena);
+    return parse_route_json(p->json, &g_arena, &commands, &snaps);
+}
+
+static int bench_routeline(const Payload* p) {
+    Command command;
+    SnapPosition snap;
+    bool has_snap, done;
+    return parse_route_ndjson_line(p->json, &command, &snap, &has_snap, &done);
+}
+
+static int bench_detect(const Payload* p) {
+    Detection objects[DETECTION_MAX_OBJECTS];
+    return parse_detection_json(p->json, p->len, objects, DETECTION_MAX_OBJECTS) < 0 ? -1 : 0;
+}
+
+static int bench_detect_batch(const Payload* p) {
+    DetectionResultSpan results[DETECTION_BATCH_MAX_RESULTS];
+    Detection objects[DETECTION_MAX_OBJECTS];
+    int count = parse_detection_batch_json(p->json, p->len, results, DETECTION_BATCH_MAX_RESULTS);
+    for (int i = 0; i < count; i++) {
+        if (parse_detection_json(results[i].reply.ptr, (size_t)results[i].reply.len, objects, DETECTION_MAX_OBJECTS) < 0) {
+            return -1;
+        }
+    }
+    return count < 0 ? -1 : 0;
+}
+
+// Key used for the get_json_string timing: the first key in the document
+static char g_first_key[64];
+
+static int bench_lookup(const Payload* p) {
+    char value[256];
+    get_json_string(p->json, g_first_key, value, sizeof(value));
+    return 0; // A non-string first value is still a full lookup
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void run(const char* label, int (*parse)(const Payload*), const Payload* p, long iterations) {
+    if (parse(p) != 0) {
+        printf("  %-14s FAILED to parse\n", label);
+        return;
+    }
+    double best = 1e30;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        double start = now_seconds();
+        for (long i = 0; i < iterations; i++) parse(p);
+        double per_message = (now_seconds() - start) / (double)iterations;
+        if (per_message < best) best = per_message;
+    }
+    printf("  %-14s %10.0f ns/msg %9.1f MB/s\n", label, best * 1e9, (double)p->len / best / 1e6);
+}
+
+static int load(const char* path, Payload* p) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    p->json = malloc((size_t)size + 1);
+    if (!p->json || fread(p->json, 1, (size_t)size, f) != (size_t)size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(f);
+        free(p->json);
+        return -1;
+    }
+    fclose(f);
+    p->json[size] = '\0';
+    // Payloads arrive without their line terminator
+    while (size > 0 && (p->json[size - 1] == '\n' || p->json[size - 1] == '\r')) p->json[--size] = '\0';
+    p->len = (size_t)size;
+    const char* slash = strrchr(path, '/');
+    p->name = slash ? slash + 1 : path;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    long iterations = 20000;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atol(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || iterations <= 0) {
+        fprintf(stderr, "Usage: %s [-n ITERATIONS] PAYLOAD...\n", argv[0]);
+        return 1;
+    }
+    arena_init(&g_arena, 0);
+
+    for (int i = first; i < argc; i++) {
+        Payload p;
+        if (load(argv[i], &p) != 0) continue;
+        printf("%s (%zu bytes)\n", p.name, p.len);
+        if (strncmp(p.name, "sendarena_", 10) == 0) run("sendArena", bench_sendarena, &p, iterations);
+        else if (strncmp(p.name, "routeline_", 10) == 0) run("route line", bench_routeline, &p, iterations);
+        else if (strncmp(p.name, "route_", 6) == 0) run("route", bench_route, &p, iterations);
+        else if (strncmp(p.name, "detect_", 7) == 0) run("detection", bench_detect, &p, iterations);
+        else if (strncmp(p.name, "detectbatch_", 12) == 0) run("batch detect", bench_detect_batch, &p, iterations);
+
+        // In every corpus payload the first quoted string is the first key
+        g_first_key[0] = '\0';
+        const char* key = strchr(p.json, '"');
+        const char* end = key ? strchr(key + 1, '"') : NULL;
+        if (end && (size_t)(end - key - 1) < sizeof(g_first_key)) {
+            memcpy(g_first_key, key + 1, (size_t)(end - key - 1));
+            g_first_key[end - key - 1] = '\0';
+        }
+        if (g_first_key[0]) run("get_json_*", bench_lookup, &p, iterations);
+        free(p.json);
+    }
+    arena_destroy(&g_arena);
+    return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * libFuzzer harness for json_parser.c. Every input goes through each entry point
+ * that sees Bluetooth or server bytes, and the token array is checked for
+ * consistency whenever the tokenizer accepts the input.
+ *
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined json_fuzz.c json_parser.c arena.c -o json_fuzz
+ *   ./json_fuzz -max_len=8192 -close_fd_mask=2 json_corpus/
+ *
+ * Without clang, -DJSON_FUZZ_STANDALONE builds a driver that replays files and
+ * every truncation of them (what a dropped Bluetooth packet looks like):
+ *
+ *   gcc -g -fsanitize=address,undefined -DJSON_FUZZ_STANDALONE json_fuzz.c json_parser.c arena.c -o json_fuzz
+ *   ./json_fuzz json_corpus/[a-z]* 2>/dev/null
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_parser.h"
+#include "json_schema.h"
+
+#define FUZZ_MAX_TOKENS 256
+
+static void check_tokens(const JsonDoc* doc, size_t len) {
+    for (int i = 0; i < doc->count; i++) {
+        const JsonToken* t = &doc->tokens[i];
+        int ok = t->start >= 0 && t->start <= t->end && (size_t)t->end <= len &&
+                 t->next > i && t->next <= doc->count && t->size >= 0;
+        if (!ok) {
+            fprintf(stderr, "Inconsistent token %d: start %d end %d next %d size %d\n", i, t->start, t->end, t->next, t->size);
+            abort();
+        }
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    // The parsers take NUL-terminated strings, as the line readers deliver them
+    char* json = malloc(size + 1);
+    if (!json) return 0;
+    memcpy(json, data, size);
+    json[size] = '\0';
+    size_t len = strlen(json);
+
+    JsonToken tokens[FUZZ_MAX_TOKENS];
+    JsonDoc doc;
+    if (json_parse(&doc, json, len, tokens, FUZZ_MAX_TOKENS) == 0) {
+        check_tokens(&doc, len);
+        AndroidMessage msg = { .value = -1 };
+        json_decode_android_message(&doc, 0, &msg, NULL);
+        static SharedAppContext context;
+        parse_android_map_doc(&doc, msg.value, &context);
+    }
+
+    Arena arena;
+    arena_init(&arena, 0);
+    if (json_parse_arena(&doc, json, len, &arena) == 0) check_tokens(&doc, len);
+    CommandList commands;
+    SnapList snaps;
+    parse_route_json(json, &arena, &commands, &snaps);
+    arena_destroy(&arena);
+
+    static SharedAppContext map_context;
+    parse_android_map_json(json, &map_context);
+
+    Command command;
+    SnapPosition snap;
+    bool has_snap, done;
+    parse_route_ndjson_line(json, &command, &snap, &has_snap, &done);
+
+    Detection objects[DETECTION_MAX_OBJECTS];
+    int count = parse_detection_json(json, len, objects, DETECTION_MAX_OBJECTS);
+    for (int i = 1; i < count; i++) {
+        if (objects[i - 1].confidence < objects[i].confidence) abort();
+    }
+    for (int i = 0; i < count; i++) {
+        const JsonSpan* label = &objects[i].class_label;
+        if (label->len > 0 && (label->ptr < json || label->ptr + label->len > json + len)) abort();
+    }
+
+    DetectionResultSpan results[DETECTION_BATCH_MAX_RESULTS];
+    int result_count = parse_detection_batch_json(json, len, results, DETECTION_BATCH_MAX_RESULTS);
+    for (int i = 0; i < result_count; i++) {
+        const JsonSpan* reply = &results[i].reply;
+        if (reply->ptr < json || reply->len < 0 || reply->ptr + reply->len > json + len) abort();
+        parse_detection_json(reply->ptr, (size_t)reply->len, objects, DETECTION_MAX_OBJECTS);
+    }
+
+    char value[64];
+    int number;
+    double real;
+    get_json_string(json, "cat", value, sizeof(value));
+    get_json_int(json, "count", &number);
+    get_json_double(json, "confidence", &real);
+
+    free(json);
+    return 0;
+}
+
+#ifdef JSON_FUZZ_STANDALONE
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE* f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            continue;
+        }
+        static uint8_t buffer[1 << 16];
+        size_t size = fread(buffer, 1, sizeof(buffer), f);
+        fclose(f);
+        for (size_t cut = 0; cut <= size; cut++) LLVMFuzzerTestOneInput(buffer, cut);
+        printf("%s: %zu inputs\n", argv[i], size + 1);
+    }
+    return 0;
+}
+#endif
@@ -1,128 +1,651 @@
 #include "json_parser.h"
+#include "json_schema.h"
+#include "protocol_keywords.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
 
 #define JSON_MAX_FIELD_LEN 128
 #define JSON_MAX_ARRAY_ELEMS 20
 
-// Helper function to find a key and return a pointer to its value start
-static const char* find_json_value(const char* json, const char* key) {
-    char search_key[JSON_MAX_FIELD_LEN];
-    snprintf(search_key, sizeof(search_key), "\"%s\":", key);
-    const char* key_pos = strstr(json, search_key);
-    if (!key_pos) return NULL;
-    return key_pos + strlen(search_key);
+// --- Structural scan ---
+// Stage one classifies the document 16 bytes at a time (NEON on the Pi, SSE2 on
+// x86, table lookups elsewhere) into two bitmaps, bit i of word i / 64 for byte
+// i: structural bytes ('"', '{', '}', '[', ']', ',', ':') and every byte that is
+// not whitespace. The tokenizer then hops from one structural byte to the next;
+// what lies between two of them is string contents or, outside strings,
+// whitespace around at most one number or literal, which the second bitmap
+// finds without looking at the whitespace bytes.
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define JSON_USE_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_USE_SSE2 1
+#endif
+
+enum { JSON_CLASS_STRUCTURAL = 1, JSON_CLASS_SPACE = 2 };
+
+static const uint8_t json_class_table[256] = {
+    ['"'] = JSON_CLASS_STRUCTURAL, [','] = JSON_CLASS_STRUCTURAL, [':'] = JSON_CLASS_STRUCTURAL,
+    ['['] = JSON_CLASS_STRUCTURAL, [']'] = JSON_CLASS_STRUCTURAL,
+    ['{'] = JSON_CLASS_STRUCTURAL, ['}'] = JSON_CLASS_STRUCTURAL,
+    [' '] = JSON_CLASS_SPACE, ['\n'] = JSON_CLASS_SPACE, ['\r'] = JSON_CLASS_SPACE, ['\t'] = JSON_CLASS_SPACE,
+};
+
+#ifdef JSON_USE_NEON
+// Collapses a 0x00/0xFF byte mask to 16 bits, byte i -> bit i. vaddv is
+// AArch64-only and the Pi runs armhf, so this uses pairwise adds.
+static uint16_t json_movemask(uint8x16_t mask) {
+    static const uint8_t bit_weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t weighted = vandq_u8(mask, vld1q_u8(bit_weights));
+    uint8x8_t sum = vpadd_u8(vget_low_u8(weighted), vget_high_u8(weighted));
+    sum = vpadd_u8(sum, sum);
+    sum = vpadd_u8(sum, sum);
+    return (uint16_t)(vget_lane_u8(sum, 0) | (vget_lane_u8(sum, 1) << 8));
 }
 
-// Function to extract an integer value from a JSON string for a given key
-int get_json_int(const char *json_string, const char *key, int *value) {
-    const char* val_start = find_json_value(json_string, key);
-    if (!val_start) return -1;
+static void json_classify16(const uint8_t* p, uint16_t* structural, uint16_t* ink) {
+    uint8x16_t v = vld1q_u8(p);
+    uint8x16_t folded = vorrq_u8(v, vdupq_n_u8(0x20)); // '[' -> '{', ']' -> '}'
+    uint8x16_t hit = vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')), vceqq_u8(folded, vdupq_n_u8('}')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(',')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8(':')));
+    hit = vorrq_u8(hit, vceqq_u8(v, vdupq_n_u8('"')));
+    uint8x16_t space = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\n')));
+    space = vorrq_u8(space, vceqq_u8(v, vdupq_n_u8('\r')));
+    space = vorrq_u8(space, vceqq_u8(v, vdupq_n_u8('\t')));
+    *structural = json_movemask(hit);
+    *ink = (uint16_t)~json_movemask(space);
+}
+#elif defined(JSON_USE_SSE2)
+static void json_classify16(const uint8_t* p, uint16_t* structural, uint16_t* ink) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(':')));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    space = _mm_or_si128(space, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    space = _mm_or_si128(space, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    *structural = (uint16_t)_mm_movemask_epi8(hit);
+    *ink = (uint16_t)~_mm_movemask_epi8(space);
+}
+#endif
+
+// Fills structural[] and ink[], (len + 63) / 64 words each. Bits past len are clear.
+static void json_classify(const char* json, size_t len, uint64_t* structural, uint64_t* ink) {
+    const uint8_t* p = (const uint8_t*)json;
+    size_t words = (len + 63) / 64;
+    for (size_t w = 0; w < words; w++) {
+        size_t base = w * 64;
+        uint64_t s_word = 0, i_word = 0;
+        size_t i = 0;
+#if defined(JSON_USE_NEON) || defined(JSON_USE_SSE2)
+        for (; i + 16 <= 64 && base + i + 16 <= len; i += 16) {
+            uint16_t s16, i16;
+            json_classify16(p + base + i, &s16, &i16);
+            s_word |= (uint64_t)s16 << i;
+            i_word |= (uint64_t)i16 << i;
+        }
+#endif
+        for (; i < 64 && base + i < len; i++) {
+            uint8_t cls = json_class_table[p[base + i]];
+            s_word |= (uint64_t)(cls & JSON_CLASS_STRUCTURAL) << i;
+            i_word |= (uint64_t)!(cls & JSON_CLASS_SPACE) << i;
+        }
+        structural[w] = s_word;
+        ink[w] = i_word;
+    }
+}
 
-    // Skip whitespace
-    while (*val_start && isspace((unsigned char)*val_start)) {
-        val_start++;
+// First offset in [from, to) whose bit equals set, or to.
+static size_t json_bit_find(const uint64_t* bits, size_t from, size_t to, bool set) {
+    while (from < to) {
+        uint64_t word = bits[from / 64];
+        if (!set) word = ~word;
+        word &= ~0ULL << (from % 64);
+        if (word) {
+            size_t at = from / 64 * 64 + (size_t)__builtin_ctzll(word);
+            return at < to ? at : to;
+        }
+        from = (from / 64 + 1) * 64;
     }
+    return to;
+}
 
-    if (sscanf(val_start, "%d", value) == 1) {
-        return 0; // Success
+// Walks the set bits of the structural bitmap in order.
+typedef struct {
+    const uint64_t* bits;
+    size_t words;
+    size_t word_index;
+    uint64_t word; // Bits of bits[word_index] not yet returned
+} JsonCursor;
+
+static void json_cursor_init(JsonCursor* c, const uint64_t* bits, size_t len) {
+    c->bits = bits;
+    c->words = (len + 63) / 64;
+    c->word_index = 0;
+    c->word = c->words > 0 ? bits[0] : 0;
+}
+
+// Offset of the next structural byte, or len if there are no more.
+static inline size_t json_cursor_next(JsonCursor* c, size_t len) {
+    while (c->word == 0) {
+        if (++c->word_index >= c->words) return len;
+        c->word = c->bits[c->word_index];
     }
-    return -1; // Failure
+    size_t at = c->word_index * 64 + (size_t)__builtin_ctzll(c->word);
+    c->word &= c->word - 1;
+    return at;
 }
 
-// Function to extract a string value from a JSON string for a given key
-int get_json_string(const char *json_string, const char *key, char *value_buffer, size_t buffer_size) {
-    const char* val_start = find_json_value(json_string, key);
-    if (!val_start) return -1;
+// --- Tokenizer ---
+
+typedef struct {
+    const char* json;
+    size_t len;
+    JsonCursor cursor;
+    const uint64_t* ink; // Non-whitespace bytes
+    JsonToken* tokens;
+    int count;
+    int capacity;
+    Arena* arena; // NULL when tokens is a fixed caller array
+} JsonTokenizer;
+
+static int json_new_token(JsonTokenizer* t, JsonType type, size_t start, size_t end) {
+    if (t->count == t->capacity) {
+        if (!t->arena) return -1;
+        JsonToken* grown = arena_array_grow(t->arena, t->tokens, t->count, &t->capacity, t->count + 1, sizeof(JsonToken));
+        if (!grown) return -1;
+        t->tokens = grown;
+    }
+    JsonToken* tok = &t->tokens[t->count];
+    tok->type = type;
+    tok->start = (int)start;
+    tok->end = (int)end;
+    tok->size = 0;
+    tok->next = t->count + 1;
+    return t->count++;
+}
 
-    // Skip whitespace before the value
-    while (*val_start && isspace((unsigned char)*val_start)) {
-        val_start++;
+// True if json[start..end) is a number or literal.
+static bool json_is_primitive(const char* json, size_t start, size_t end) {
+    size_t n = end - start;
+    const char* p = json + start;
+    if ((n == 4 && memcmp(p, "true", 4) == 0) || (n == 5 && memcmp(p, "false", 5) == 0) ||
+        (n == 4 && memcmp(p, "null", 4) == 0)) {
+        return true;
     }
+    if (*p != '-' && (unsigned)(*p - '0') > 9) return false;
+    for (size_t i = 1; i < n; i++) {
+        char c = p[i];
+        if ((unsigned)(c - '0') > 9 && c != '.' && c != 'e' && c != 'E' && c != '+' && c != '-') return false;
+    }
+    return true;
+}
 
-    if (*val_start != '"') return -1; // Check for opening quote
+// Where the tokenizer is within the innermost container
+enum { JSON_WANT_VALUE, JSON_WANT_KEY, JSON_WANT_COLON, JSON_WANT_COMMA };
+
+typedef struct {
+    int stack[JSON_MAX_DEPTH]; // Open containers
+    int depth;
+    int want;
+    bool just_opened; // A ']' or '}' may close an empty container
+    bool done;        // The root value is complete
+} JsonState;
+
+static void json_value_done(JsonTokenizer* t, JsonState* st) {
+    if (st->depth == 0) {
+        st->done = true;
+        return;
+    }
+    JsonToken* parent = &t->tokens[st->stack[st->depth - 1]];
+    if (parent->type == JSON_ARRAY) parent->size++;
+    st->want = JSON_WANT_COMMA;
+    st->just_opened = false;
+}
 
-    val_start++; // Move past the opening quote
-    const char* val_end = strchr(val_start, '"');
-    if (!val_end) return -1;
+// Handles the bytes between two structural characters: whitespace around at
+// most one number or literal.
+static int json_gap(JsonTokenizer* t, JsonState* st, size_t start, size_t end) {
+    start = json_bit_find(t->ink, start, end, true);
+    if (start == end) return 0;
+    size_t last = json_bit_find(t->ink, start, end, false);
+    if (json_bit_find(t->ink, last, end, true) != end) return -1; // Two values in one gap
+    end = last;
+    if (st->done || st->want != JSON_WANT_VALUE || !json_is_primitive(t->json, start, end)) return -1;
+    if (json_new_token(t, JSON_PRIMITIVE, start, end) < 0) return -1;
+    json_value_done(t, st);
+    return 0;
+}
+
+static int json_tokenize(JsonTokenizer* t) {
+    JsonState st = { .want = JSON_WANT_VALUE };
+    size_t pos = 0;
+
+    for (;;) {
+        size_t at = json_cursor_next(&t->cursor, t->len);
+        if (at > pos && json_gap(t, &st, pos, at) != 0) return -1;
+        if (at == t->len) break;
+        if (st.done) return -1; // Trailing data after the root value
+
+        char c = t->json[at];
+        pos = at + 1;
+        switch (c) {
+        case '{':
+        case '[': {
+            if (st.want != JSON_WANT_VALUE || st.depth == JSON_MAX_DEPTH) return -1;
+            int idx = json_new_token(t, c == '{' ? JSON_OBJECT : JSON_ARRAY, at, at + 1);
+            if (idx < 0) return -1;
+            st.stack[st.depth++] = idx;
+            st.want = c == '{' ? JSON_WANT_KEY : JSON_WANT_VALUE;
+            st.just_opened = true;
+            break;
+        }
+        case '}':
+        case ']': {
+            if (st.depth == 0 || (st.want != JSON_WANT_COMMA && !st.just_opened)) return -1;
+            JsonToken* container = &t->tokens[st.stack[st.depth - 1]];
+            if (container->type != (c == '}' ? JSON_OBJECT : JSON_ARRAY)) return -1;
+            container->end = (int)(at + 1);
+            container->next = t->count;
+            st.depth--;
+            json_value_done(t, &st);
+            break;
+        }
+        case ',':
+            if (st.want != JSON_WANT_COMMA) return -1;
+            st.want = t->tokens[st.stack[st.depth - 1]].type == JSON_OBJECT ? JSON_WANT_KEY : JSON_WANT_VALUE;
+            st.just_opened = false;
+            break;
+        case ':':
+            if (st.want != JSON_WANT_COLON) return -1;
+            st.want = JSON_WANT_VALUE;
+            break;
+        default: { // '"'
+            if (st.want != JSON_WANT_VALUE && st.want != JSON_WANT_KEY) return -1;
+            // The closing quote is the next marked '"' not preceded by an odd run of backslashes
+            size_t close = at;
+            for (;;) {
+                close = json_cursor_next(&t->cursor, t->len);
+                if (close == t->len) return -1; // Unterminated
+                if (t->json[close] != '"') continue;
+                size_t backslashes = 0;
+                while (close - backslashes > at + 1 && t->json[close - backslashes - 1] == '\\') backslashes++;
+                if (backslashes % 2 == 0) break;
+            }
+            if (json_new_token(t, JSON_STRING, at + 1, close) < 0) return -1;
+            pos = close + 1;
+            if (st.want == JSON_WANT_KEY) {
+                t->tokens[st.stack[st.depth - 1]].size++;
+                st.want = JSON_WANT_COLON;
+                st.just_opened = false;
+            } else {
+                json_value_done(t, &st);
+            }
+            break;
+        }
+        }
+    }
+    return st.done && st.depth == 0 ? 0 : -1;
+}
 
-    size_t len = val_end - val_start;
-    if (len >= buffer_size) return -1; // Buffer too small
+// Documents up to this size keep their bitmaps on the stack
+#define JSON_STACK_SCAN_BYTES 4096
 
-    strncpy(value_buffer, val_start, len);
-    value_buffer[len] = '\0';
-    return 0; // Success
+// Every token but a bare top-level primitive owns a distinct structural byte
+// (its opening bracket or quote, or the ',' / closer after a primitive), so
+// this bounds the token count without tokenizing.
+static int json_token_bound(const uint64_t* structural, size_t words) {
+    size_t bound = 1;
+    for (size_t i = 0; i < words; i++) bound += (size_t)__builtin_popcountll(structural[i]);
+    return bound > INT_MAX ? INT_MAX : (int)bound;
 }
 
-// Helper for parsing a single obstacle object
-static int parse_single_obstacle(const char* obs_str, Obstacle* obstacle) {
-    if (get_json_int(obs_str, "id", &obstacle->id) == 0 &&
-        get_json_int(obs_str, "x", &obstacle->x) == 0 &&
-        get_json_int(obs_str, "y", &obstacle->y) == 0 &&
-        get_json_int(obs_str, "d", &obstacle->d) == 0) { // Expect 'd' as integer
+static int json_run(JsonDoc* doc, JsonTokenizer* t) {
+    size_t words = (t->len + 63) / 64;
+    uint64_t small[2 * (JSON_STACK_SCAN_BYTES / 64)];
+    uint64_t* bits = small;
+    if (t->len > JSON_STACK_SCAN_BYTES) {
+        // Arena parses (the route) take their scratch from the arena so the
+        // mission-start path never reaches malloc
+        bits = t->arena ? arena_alloc(t->arena, 2 * words * sizeof(uint64_t)) : malloc(2 * words * sizeof(uint64_t));
+        if (!bits) return -1;
+    }
+    json_classify(t->json, t->len, bits, bits + words);
+    if (t->arena) {
+        // Size the token array once instead of doubling it while tokenizing
+        t->capacity = json_token_bound(bits, words);
+        t->tokens = arena_alloc(t->arena, (size_t)t->capacity * sizeof(JsonToken));
+        if (!t->tokens) return -1;
+    }
+    json_cursor_init(&t->cursor, bits, t->len);
+    t->ink = bits + words;
+    int result = json_tokenize(t);
+    if (bits != small && !t->arena) free(bits);
+    *doc = (JsonDoc){ t->json, t->tokens, result == 0 ? t->count : 0 };
+    return result;
+}
+
+int json_parse(JsonDoc* doc, const char* json, size_t len, JsonToken* tokens, int max_tokens) {
+    JsonTokenizer t = { .json = json, .len = len, .tokens = tokens, .capacity = max_tokens };
+    return json_run(doc, &t);
+}
+
+int json_parse_arena(JsonDoc* doc, const char* json, size_t len, Arena* arena) {
+    JsonTokenizer t = { .json = json, .len = len, .arena = arena };
+    return json_run(doc, &t);
+}
+
+int json_object_get(const JsonDoc* doc, int object, const char* key) {
+    if (object < 0 || object >= doc->count || doc->tokens[object].type != JSON_OBJECT) return -1;
+    size_t key_len = strlen(key);
+    int tok = object + 1;
+    for (int i = 0; i < doc->tokens[object].size; i++) {
+        const JsonToken* k = &doc->tokens[tok];
+        if ((size_t)(k->end - k->start) == key_len && memcmp(doc->json + k->start, key, key_len) == 0) {
+            return tok + 1;
+        }
+        tok = doc->tokens[tok + 1].next; // Skip the value's subtree to the next key
+    }
+    return -1;
+}
+
+static const JsonToken* json_token_of_type(const JsonDoc* doc, int tok, JsonType type) {
+    if (tok < 0 || tok >= doc->count || doc->tokens[tok].type != type) return NULL;
+    return &doc->tokens[tok];
+}
+
+int json_token_double(const JsonDoc* doc, int tok, double* value) {
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_PRIMITIVE);
+    if (!t) return -1;
+    char number[64];
+    size_t len = (size_t)(t->end - t->start);
+    if (len >= sizeof(number)) return -1;
+    memcpy(number, doc->json + t->start, len);
+    number[len] = '\0';
+    char* end;
+    double parsed = strtod(number, &end);
+    if (end == number || *end != '\0') return -1; // Not a number (true/false/null)
+    *value = parsed;
+    return 0;
+}
+
+int json_token_int(const JsonDoc* doc, int tok, int* value) {
+    // Plain integers (every coordinate and ID we read) are converted in place;
+    // anything with a fraction or exponent goes through strtod
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_PRIMITIVE);
+    if (!t) return -1;
+    const char* p = doc->json + t->start;
+    int len = t->end - t->start;
+    int negative = len > 0 && *p == '-';
+    int digits = len - negative;
+    if (digits > 0 && digits <= 9) {
+        int parsed = 0;
+        int i = negative;
+        for (; i < len && p[i] >= '0' && p[i] <= '9'; i++) parsed = parsed * 10 + (p[i] - '0');
+        if (i == len) {
+            *value = negative ? -parsed : parsed;
+            return 0;
+        }
+    }
+    double parsed;
+    if (json_token_double(doc, tok, &parsed) != 0 || parsed < INT_MIN || parsed > INT_MAX) return -1;
+    *value = (int)parsed; // Truncates like the old "%d" scan did
+    return 0;
+}
+
+int json_token_bool(const JsonDoc* doc, int tok, bool* value) {
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_PRIMITIVE);
+    if (!t) return -1;
+    if (doc->json[t->start] == 't') *value = true;
+    else if (doc->json[t->start] == 'f') *value = false;
+    else return -1;
+    return 0;
+}
+
+int json_token_string(const JsonDoc* doc, int tok, char* buffer, size_t buffer_size) {
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_STRING);
+    if (!t || buffer_size == 0) return -1;
+    size_t out = 0;
+    for (int i = t->start; i < t->end; i++) {
+        char c = doc->json[i];
+        if (c == '\\') {
+            c = doc->json[++i];
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': // No field we read needs non-ASCII
+                    if (i + 4 >= t->end) return -1;
+                    c = '?';
+                    i += 4;
+                    break;
+                default: break;                  // \" \\ \/
+            }
+        }
+        if (out + 1 >= buffer_size) return -1;
+        buffer[out++] = c;
+    }
+    buffer[out] = '\0';
+    return 0;
+}
+
+int json_token_span(const JsonDoc* doc, int tok, JsonSpan* span) {
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_STRING);
+    if (!t) return -1;
+    span->ptr = doc->json + t->start;
+    span->len = t->end - t->start;
+    return 0;
+}
+
+bool json_token_equals(const JsonDoc* doc, int tok, const char* s) {
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_STRING);
+    if (!t) return false;
+    size_t len = strlen(s);
+    return (size_t)(t->end - t->start) == len && memcmp(doc->json + t->start, s, len) == 0;
+}
+
+// --- Schema decoders ---
+// One decoder per entry of JSON_MESSAGES (json_schema.h). Each is a single walk
+// over the object's members with a switch on the schema slot of every key.
+
+static int json_decode_INT(const JsonDoc* doc, int tok, void* out, size_t size) {
+    (void)size;
+    return json_token_int(doc, tok, out);
+}
+
+static int json_decode_DOUBLE(const JsonDoc* doc, int tok, void* out, size_t size) {
+    (void)size;
+    return json_token_double(doc, tok, out);
+}
+
+static int json_decode_BOOL(const JsonDoc* doc, int tok, void* out, size_t size) {
+    (void)size;
+    return json_token_bool(doc, tok, out);
+}
+
+static int json_decode_STRING(const JsonDoc* doc, int tok, void* out, size_t size) {
+    return json_token_string(doc, tok, out, size);
+}
+
+static int json_decode_SPAN(const JsonDoc* doc, int tok, void* out, size_t size) {
+    (void)size;
+    return json_token_span(doc, tok, out);
+}
+
+static int json_decode_TOKEN(const JsonDoc* doc, int tok, void* out, size_t size) {
+    (void)doc;
+    (void)size;
+    *(int*)out = tok;
+    return 0;
+}
+
+typedef struct {
+    const char* key;
+    int len;
+} JsonSchemaKey;
+
+// Returns the schema slot of the key token, or -1 for a key the schema does not
+// list. The slot at the member's position is tried first, since senders write
+// members in schema order.
+static int json_schema_slot(const JsonDoc* doc, int key, const JsonSchemaKey* keys, int count, int expected) {
+    const JsonToken* k = &doc->tokens[key];
+    const char* s = doc->json + k->start;
+    int len = k->end - k->start;
+    if (expected < count && keys[expected].len == len && memcmp(keys[expected].key, s, (size_t)len) == 0) return expected;
+    for (int i = 0; i < count; i++) {
+        if (keys[i].len == len && memcmp(keys[i].key, s, (size_t)len) == 0) return i;
+    }
+    return -1;
+}
 
-        // Adjust coordinates from Android's 1-indexed to RPi's 0-indexed
-        obstacle->x -= 1;
-        obstacle->y -= 1;
+#define JSON_SCHEMA_KEY_(P, slot, field, key, kind, required) { key, (int)sizeof(key) - 1 },
+#define JSON_SCHEMA_COUNT_(P, slot, field, key, kind, required) + 1
+#define JSON_SCHEMA_REQUIRED_(P, slot, field, key, kind, required) | ((uint32_t)(required) << P##slot)
+#define JSON_SCHEMA_CASE_(P, slot, field, key, kind, required) \
+    case P##slot: \
+        if (json_decode_##kind(doc, key_tok + 1, &out->field, sizeof(out->field)) == 0) found |= JSON_BIT(P##slot); \
+        break;
+
+#define JSON_DEFINE_DECODER_(name, msg_type, schema, prefix) \
+int name(const JsonDoc* doc, int object, msg_type* out, uint32_t* present) { \
+    static const JsonSchemaKey keys[] = { schema(JSON_SCHEMA_KEY_, prefix) }; \
+    const int count = 0 schema(JSON_SCHEMA_COUNT_, prefix); \
+    const uint32_t required = 0 schema(JSON_SCHEMA_REQUIRED_, prefix); \
+    uint32_t found = 0; \
+    if (present) *present = 0; \
+    if (object < 0 || object >= doc->count || doc->tokens[object].type != JSON_OBJECT) return -1; \
+    int key_tok = object + 1; \
+    for (int m = 0; m < doc->tokens[object].size; m++, key_tok = json_next(doc, key_tok + 1)) { \
+        switch (json_schema_slot(doc, key_tok, keys, count, m)) { \
+            schema(JSON_SCHEMA_CASE_, prefix) \
+            default: break; \
+        } \
+    } \
+    if (present) *present = found; \
+    return (found & required) == required ? 0 : -1; \
+}
 
-        return 0; // Success
+JSON_MESSAGES(JSON_DEFINE_DECODER_)
+
+// --- One-off lookups ---
+
+#define JSON_LOOKUP_TOKENS 128
+
+// Tokenizes json for a single top-level lookup. Documents too big for the
+// on-stack array get a heap array sized for the worst case (a token per two bytes).
+typedef struct {
+    JsonDoc doc;
+    JsonToken small[JSON_LOOKUP_TOKENS];
+    JsonToken* heap;
+} JsonLookup;
+
+static int json_lookup(JsonLookup* lookup, const char* json, const char* key) {
+    size_t len = strlen(json);
+    lookup->heap = NULL;
+    if (json_parse(&lookup->doc, json, len, lookup->small, JSON_LOOKUP_TOKENS) != 0) {
+        if (len / 2 + 1 <= JSON_LOOKUP_TOKENS || len / 2 + 1 > INT_MAX) return -1; // Malformed, not just big
+        lookup->heap = malloc((len / 2 + 1) * sizeof(JsonToken));
+        if (!lookup->heap || json_parse(&lookup->doc, json, len, lookup->heap, (int)(len / 2 + 1)) != 0) return -1;
     }
-    return -1; // Failure
+    return json_object_get(&lookup->doc, 0, key);
 }
 
+// Function to extract an integer value from a JSON string for a given key
+int get_json_int(const char *json_string, const char *key, int *value) {
+    JsonLookup lookup;
+    int tok = json_lookup(&lookup, json_string, key);
+    int result = json_token_int(&lookup.doc, tok, value);
+    free(lookup.heap);
+    return result;
+}
+
+// Function to extract a floating-point value from a JSON string for a given key
+int get_json_double(const char *json_string, const char *key, double *value) {
+    JsonLookup lookup;
+    int tok = json_lookup(&lookup, json_string, key);
+    int result = json_token_double(&lookup.doc, tok, value);
+    free(lookup.heap);
+    return result;
+}
+
+// Function to extract a string value from a JSON string for a given key
+int get_json_string(const char *json_string, const char *key, char *value_buffer, size_t buffer_size) {
+    JsonLookup lookup;
+    int tok = json_lookup(&lookup, json_string, key);
+    int result = json_token_string(&lookup.doc, tok, value_buffer, buffer_size);
+    free(lookup.heap);
+    return result;
+}
+
+// Helper for parsing a single obstacle object
+static int parse_single_obstacle(const JsonDoc* doc, int obs, Obstacle* obstacle) {
+    if (json_decode_obstacle(doc, obs, obstacle, NULL) != 0) return -1; // Expect 'd' as integer
+
+    // Adjust coordinates from Android's 1-indexed to RPi's 0-indexed
+    obstacle->x -= 1;
+    obstacle->y -= 1;
+    return 0; // Success
+}
+
+// A sendArena map: obstacles plus the robot's start pose
+#define JSON_MAP_MAX_TOKENS (MAX_OBSTACLES * 9 + 16)
+
 // Function to parse the Android map JSON into the SharedAppContext
 int parse_android_map_json(const char* json_string, SharedAppContext* context) {
-    const char* obstacles_array_start = strstr(json_string, "\"obstacles\":[");
-    if (!obstacles_array_start) return -1;
-
-    obstacles_array_start += strlen("\"obstacles\":[");
-    const char* obstacles_array_end = strstr(obstacles_array_start, "]");
-    if (!obstacles_array_end) return -1;
-
-    char temp_obstacles_str[strlen(json_string) + 1];
-    strncpy(temp_obstacles_str, obstacles_array_start, obstacles_array_end - obstacles_array_start);
-    temp_obstacles_str[obstacles_array_end - obstacles_array_start] = '\0';
-
-    context->obstacle_count = 0;
-    const char* current_obs_str = temp_obstacles_str;
-    while (current_obs_str && *current_obs_str != '\0' && context->obstacle_count < MAX_OBSTACLES) {
-        const char* obj_start = strchr(current_obs_str, '{');
-        if (!obj_start) break;
-        const char* obj_end = strchr(obj_start, '}');
-        if (!obj_end) break;
-
-        char single_obs_json[JSON_MAX_FIELD_LEN];
-        strncpy(single_obs_json, obj_start, obj_end - obj_start + 1);
-        single_obs_json[obj_end - obj_start + 1] = '\0';
-
-        if (parse_single_obstacle(single_obs_json, &context->obstacles[context->obstacle_count]) == 0) {
-            context->obstacle_count++;
+    JsonToken tokens[JSON_MAP_MAX_TOKENS];
+    JsonDoc doc;
+    if (json_parse(&doc, json_string, strlen(json_string), tokens, JSON_MAP_MAX_TOKENS) != 0) return -1;
+    return parse_android_map_doc(&doc, 0, context);
+}
+
+int parse_android_map_doc(const JsonDoc* doc, int map, SharedAppContext* context) {
+    ArenaMap parsed;
+    if (parse_android_map_into(doc, map, &parsed) != 0) return -1;
+    memcpy(context->obstacles, parsed.obstacles, sizeof(parsed.obstacles[0]) * (size_t)parsed.obstacle_count);
+    context->obstacle_count = parsed.obstacle_count;
+    context->robot_start_x = parsed.robot_x;
+    context->robot_start_y = parsed.robot_y;
+    context->robot_start_dir = parsed.robot_dir;
+    return 0;
+}
+
+int parse_android_map_into(const JsonDoc* doc, int map, ArenaMap* out) {
+    // Defaults for a missing robot pose: (1, 1) in Android's 1-indexed cells, facing North
+    ArenaMapMessage msg = { .obstacles = -1, .robot_x = 1, .robot_y = 1, .robot_dir = 0 };
+    uint32_t present;
+    if (json_decode_arena_map(doc, map, &msg, &present) != 0 || doc->tokens[msg.obstacles].type != JSON_ARRAY) return -1;
+
+    out->obstacle_count = 0;
+    int obs = msg.obstacles + 1;
+    for (int i = 0; i < doc->tokens[msg.obstacles].size && out->obstacle_count < MAX_OBSTACLES; i++, obs = json_next(doc, obs)) {
+        if (parse_single_obstacle(doc, obs, &out->obstacles[out->obstacle_count]) == 0) {
+            out->obstacle_count++;
         } else {
-            fprintf(stderr, "Error parsing single obstacle JSON: %s\n", single_obs_json);
+            const JsonToken* t = &doc->tokens[obs];
+            fprintf(stderr, "Error parsing single obstacle JSON: %.*s\n", t->end - t->start, doc->json + t->start);
         }
-        current_obs_str = obj_end + 1;
-        if (*current_obs_str == ',') current_obs_str++; // Skip comma if present
     }
 
     // Parse robot_x, robot_y, robot_direction
-    int robot_x_val = 1; // Default to 1 (0-indexed)
-    int robot_y_val = 1; // Default to 1 (0-indexed)
-    int robot_dir_val = 0; // Default to 0 (North)
-
-    if (get_json_int(json_string, "robot_x", &robot_x_val) != 0) {
-        fprintf(stderr, "Could not parse robot_x, using default.\n");
-    }
-    if (get_json_int(json_string, "robot_y", &robot_y_val) != 0) {
-        fprintf(stderr, "Could not parse robot_y, using default.\n");
-    }
+    if (!(present & JSON_BIT(JSON_ARENA_MAP_ROBOT_X))) fprintf(stderr, "Could not parse robot_x, using default.\n");
+    if (!(present & JSON_BIT(JSON_ARENA_MAP_ROBOT_Y))) fprintf(stderr, "Could not parse robot_y, using default.\n");
 
-    int android_dir = 0;
-    if (get_json_int(json_string, "robot_dir", &android_dir) == 0) {
+    int robot_dir_val = 0; // Default to 0 (North)
+    if (present & JSON_BIT(JSON_ARENA_MAP_ROBOT_DIR)) {
         // Map Android's 1=N, 2=E, 3=S, 4=W to RPi's 0,2,4,6
-        switch (android_dir) {
+        switch (msg.robot_dir) {
             case 1: robot_dir_val = 0; break; // North
             case 2: robot_dir_val = 2; break; // East
             case 3: robot_dir_val = 4; break; // South
@@ -134,167 +657,234 @@ int parse_android_map_json(const char* json_string, SharedAppContext* context) {
     }
 
     // Adjust coordinates from Android's 1-indexed to RPi's 0-indexed
-    context->robot_start_x = robot_x_val - 1;
-    context->robot_start_y = robot_y_val - 1;
-    context->robot_start_dir = robot_dir_val;
+    out->robot_x = msg.robot_x - 1;
+    out->robot_y = msg.robot_y - 1;
+    out->robot_dir = robot_dir_val;
 
     return 0; // Success
 }
 
 // Helper for parsing a single command string (e.g., "FW5000", "SP1")
-static int parse_single_command_string(const char* cmd_str, Command* command) {
-    if (strncmp(cmd_str, "FW", 2) == 0) {
-        command->type = CMD_MOVE_FORWARD;
-        command->value = atoi(cmd_str + 2);
-    } else if (strncmp(cmd_str, "BW", 2) == 0) {
-        command->type = CMD_MOVE_BACKWARD;
-        command->value = atoi(cmd_str + 2);
-    } else if (strncmp(cmd_str, "FL", 2) == 0) {
-        command->type = CMD_TURN_LEFT;
-        command->value = atoi(cmd_str + 2); // Assuming angle like 90
-    } else if (strncmp(cmd_str, "FR", 2) == 0) {
-        command->type = CMD_TURN_RIGHT;
-        command->value = atoi(cmd_str + 2); // Assuming angle like 90
-    } else if (strncmp(cmd_str, "SP", 2) == 0) {
-        command->type = CMD_SNAPSHOT;
-        command->value = atoi(cmd_str + 2); // Obstacle ID
-    } else {
-        fprintf(stderr, "Unknown command type: %s\n", cmd_str);
-        return -1; // Unknown command
+// Route commands are a two-letter opcode followed by the value, so the opcode
+// pair is switched on as one 16-bit key.
+#define ROUTE_OP(a, b) (((unsigned)(unsigned char)(a) << 8) | (unsigned char)(b))
+
+// Parses a route command such as "FW50" or "FW90F" from cmd[0..len), which need
+// not be NUL-terminated. The value is read like atoi would.
+static int parse_command_span(const char* cmd, size_t len, Command* command) {
+    unsigned op = len >= 2 ? ROUTE_OP(cmd[0], cmd[1]) : 0;
+    switch (op) {
+        case ROUTE_OP('F', 'W'): command->type = CMD_MOVE_FORWARD; break;
+        case ROUTE_OP('B', 'W'): command->type = CMD_MOVE_BACKWARD; break;
+        case ROUTE_OP('F', 'L'): command->type = CMD_TURN_LEFT; break;  // Value is the angle, like 90
+        case ROUTE_OP('F', 'R'): command->type = CMD_TURN_RIGHT; break; // Value is the angle, like 90
+        case ROUTE_OP('S', 'P'): command->type = CMD_SNAPSHOT; break;   // Value is the obstacle ID
+        default:
+            fprintf(stderr, "Unknown command type: %.*s\n", (int)len, cmd);
+            return -1; // Unknown command
     }
+    size_t i = 2;
+    while (i < len && isspace((unsigned char)cmd[i])) i++;
+    bool negative = i < len && cmd[i] == '-';
+    if (i < len && (cmd[i] == '-' || cmd[i] == '+')) i++;
+    int value = 0;
+    for (; i < len && cmd[i] >= '0' && cmd[i] <= '9'; i++) value = value * 10 + (cmd[i] - '0');
+    command->value = negative ? -value : value;
+    // Speed class letter; anything else after the value is ignored as before
+    command->speed = i < len && command->type != CMD_SNAPSHOT
+                     ? (cmd[i] == 'S' ? SPEED_SLOW : cmd[i] == 'F' ? SPEED_FAST : SPEED_NORMAL)
+                     : SPEED_NORMAL;
     return 0;
 }
 
+static int parse_command_token(const JsonDoc* doc, int tok, Command* command) {
+    const JsonToken* t = json_token_of_type(doc, tok, JSON_STRING);
+    return t ? parse_command_span(doc->json + t->start, (size_t)(t->end - t->start), command) : -1;
+}
+
 // Function to parse the pathfinding server's route JSON
-int parse_route_json(const char* json_string, Command commands[], int* command_count, SnapPosition snap_positions[], int* snap_position_count) {
-    *command_count = 0;
-    *snap_position_count = 0;
-    int ret_val = -1; // Default to failure
-    char* commands_substr = NULL;
-    char* snaps_substr = NULL;
+int parse_route_json(const char* json_string, Arena* arena, CommandList* commands, SnapList* snap_positions) {
+    *commands = (CommandList){0};
+    *snap_positions = (SnapList){0};
 
-    // --- Find the "data" object ---
-    const char* data_key_start = strstr(json_string, "\"data\""); // Find "data" key
-    if (!data_key_start) {
-        fprintf(stderr, "[Parser] 'data' key not found in server response.\n");
+    JsonDoc doc;
+    if (json_parse_arena(&doc, json_string, strlen(json_string), arena) != 0) {
+        fprintf(stderr, "[Parser] Malformed JSON in server response.\n");
         return -1;
     }
-    const char* data_obj_start = data_key_start + strlen("\"data\""); // Move past "data"
-    while (*data_obj_start && isspace((unsigned char)*data_obj_start)) data_obj_start++; // Skip whitespace
-    if (*data_obj_start != ':') { // Check for colon
-        fprintf(stderr, "[Parser] Malformed JSON: missing ':' after 'data' key.\n");
-        return -1;
-    }
-    data_obj_start++; // Move past ':'
-    while (*data_obj_start && isspace((unsigned char)*data_obj_start)) data_obj_start++; // Skip whitespace
-    if (*data_obj_start != '{') { // Check for opening brace
-        fprintf(stderr, "[Parser] Malformed JSON: 'data' is not an object.\n");
+
+    // --- Find the "data" object ---
+    RouteReply reply = { .data = -1 };
+    if (json_decode_route_reply(&doc, 0, &reply, NULL) != 0 || doc.tokens[reply.data].type != JSON_OBJECT) {
+        fprintf(stderr, "[Parser] 'data' object not found in server response.\n");
         return -1;
     }
-    data_obj_start++; // Move past '{' to inside the data object
 
     // --- Parse commands array ---
-    const char* commands_key_start = strstr(data_obj_start, "\"commands\"");
-    if (!commands_key_start) {
+    // The lists are sized from the array tokens and filled straight from the
+    // response buffer: no copies, and one arena allocation per list.
+    RouteData route = { .commands = -1, .snap_positions = -1 };
+    if (json_decode_route_data(&doc, reply.data, &route, NULL) != 0 || doc.tokens[route.commands].type != JSON_ARRAY) {
         fprintf(stderr, "[Parser] 'commands' array not found in server response.\n");
         return -1;
     }
-    const char* commands_array_start = commands_key_start + strlen("\"commands\""); // Move past "commands"
-    while (*commands_array_start && isspace((unsigned char)*commands_array_start)) commands_array_start++; // Skip whitespace
-    if (*commands_array_start != ':') { // Check for colon
-         fprintf(stderr, "[Parser] Malformed JSON: missing ':' after 'commands' key.\n");
-         return -1;
-    }
-    commands_array_start++; // Move past ':'
-    while (*commands_array_start && isspace((unsigned char)*commands_array_start)) commands_array_start++; // Skip whitespace
-    if (*commands_array_start != '[') { // Check for opening bracket
-        fprintf(stderr, "[Parser] Malformed JSON: 'commands' is not an array.\n");
+    int cmds = route.commands;
+    int count = doc.tokens[cmds].size;
+    if (count > 0 && !(commands->items = arena_alloc(arena, (size_t)count * sizeof(Command)))) {
+        fprintf(stderr, "[Parser] Out of memory storing route commands.\n");
         return -1;
     }
-    commands_array_start++; // Move past '['
+    commands->capacity = count;
+    int tok = cmds + 1;
+    for (int i = 0; i < count; i++, tok = json_next(&doc, tok)) {
+        if (parse_command_token(&doc, tok, &commands->items[commands->count]) != 0) {
+            const JsonToken* t = &doc.tokens[tok];
+            fprintf(stderr, "[Parser] Error: Failed to parse command token: '%.*s'\n", t->end - t->start, json_string + t->start);
+            return -1;
+        }
+        commands->count++;
+    }
 
-    const char* commands_array_end = strstr(commands_array_start, "]");
-    if (!commands_array_end) {
-        fprintf(stderr, "[Parser] Malformed 'commands' array: closing bracket not found.\n");
-        return -1;
+    // --- Parse snap_positions array ---
+    int snaps = route.snap_positions;
+    if (snaps >= 0 && doc.tokens[snaps].type == JSON_ARRAY && doc.tokens[snaps].size > 0) {
+        count = doc.tokens[snaps].size;
+        if (!(snap_positions->items = arena_alloc(arena, (size_t)count * sizeof(SnapPosition)))) {
+            fprintf(stderr, "[Parser] Out of memory storing snap positions.\n");
+            return -1;
+        }
+        snap_positions->capacity = count;
+        tok = snaps + 1;
+        for (int i = 0; i < count; i++, tok = json_next(&doc, tok)) {
+            // Entries missing x, y or d are skipped
+            if (json_decode_snap_position(&doc, tok, &snap_positions->items[snap_positions->count], NULL) == 0) {
+                snap_positions->count++;
+            }
+        }
     }
 
-    size_t commands_len = commands_array_end - commands_array_start;
-    commands_substr = (char*)malloc(commands_len + 1);
-    if (!commands_substr) {
-        fprintf(stderr, "[Parser] Failed to allocate memory for commands parsing.\n");
+    return 0; // Success
+}
+
+// A route line is one small object
+#define JSON_LINE_MAX_TOKENS 32
+
+// Function to parse one line of the streamed route (see parse_route_ndjson_line in json_parser.h)
+int parse_route_ndjson_line(const char* line, Command* command, SnapPosition* snap, bool* has_snap, bool* done) {
+    *has_snap = false;
+    *done = false;
+
+    JsonToken tokens[JSON_LINE_MAX_TOKENS];
+    JsonDoc doc;
+    RouteLine msg = { .error = "", .done = false, .cmd = -1 };
+    uint32_t present;
+    if (json_parse(&doc, line, strlen(line), tokens, JSON_LINE_MAX_TOKENS) != 0 ||
+        json_decode_route_line(&doc, 0, &msg, &present) != 0) {
+        fprintf(stderr, "[Parser] Malformed route line: '%s'\n", line);
         return -1;
     }
+    if (present & JSON_BIT(JSON_ROUTE_LINE_ERROR)) {
+        fprintf(stderr, "[Parser] Server reported route error: %s\n", msg.error);
+        return -1;
+    }
+    if (msg.done) {
+        *done = true;
+        return 0;
+    }
+    if (parse_command_token(&doc, msg.cmd, command) != 0) {
+        fprintf(stderr, "[Parser] Malformed route line: '%s'\n", line);
+        return -1;
+    }
+    if (command->type == CMD_SNAPSHOT) {
+        const uint32_t pose = JSON_BIT(JSON_ROUTE_LINE_X) | JSON_BIT(JSON_ROUTE_LINE_Y) | JSON_BIT(JSON_ROUTE_LINE_D);
+        if ((present & pose) != pose) {
+            fprintf(stderr, "[Parser] Snapshot line without a position: '%s'\n", line);
+            return -1;
+        }
+        *snap = msg.snap;
+        *has_snap = true;
+    }
+    return 0;
+}
 
-    strncpy(commands_substr, commands_array_start, commands_len);
-    commands_substr[commands_len] = '\0';
-
-    char* saveptr;
-    char* token = strtok_r(commands_substr, ",", &saveptr);
-    while (token != NULL && *command_count < MAX_COMMANDS) {
-        // Trim leading/trailing whitespace
-        while (isspace((unsigned char)*token)) token++;
-        char* end = token + strlen(token) - 1;
-        while (end > token && isspace((unsigned char)*end)) end--;
-        *(end + 1) = '\0';
+// --- Image server replies ---
 
-        // Remove quotes
-        if (*token == '"') token++;
-        if (strlen(token) > 0 && *(token + strlen(token) - 1) == '"') {
-            *(token + strlen(token) - 1) = '\0';
-        }
+// Each detected object is a handful of fields plus a 4-number bbox
+#define DETECTION_MAX_TOKENS (DETECTION_MAX_OBJECTS * 16 + 16)
 
-        if (strlen(token) > 0) {
-            if (parse_single_command_string(token, &commands[*command_count]) == 0) {
-                (*command_count)++;
-            } else {
-                fprintf(stderr, "[Parser] Error: Failed to parse command token: '%s'\n", token);
-                ret_val = -1;
-                goto cleanup; // Go to cleanup on failure
-            }
-        }
-        token = strtok_r(NULL, ",", &saveptr);
+// Reads a [x1, y1, x2, y2] array; anything else leaves has_bbox false.
+static void parse_detection_bbox(const JsonDoc* doc, int bbox, Detection* out) {
+    if (bbox < 0 || doc->tokens[bbox].type != JSON_ARRAY || doc->tokens[bbox].size != 4) return;
+    for (int i = 0; i < 4; i++) {
+        if (json_token_double(doc, bbox + 1 + i, &out->bbox[i]) != 0) return;
     }
+    out->has_bbox = true;
+}
 
-    // --- Parse snap_positions array ---
-    const char* snaps_key_start = strstr(data_obj_start, "\"snap_positions\"");
-    if (snaps_key_start) {
-        const char* snaps_array_start_ptr = snaps_key_start + strlen("\"snap_positions\"");
-        while (*snaps_array_start_ptr && isspace((unsigned char)*snaps_array_start_ptr)) snaps_array_start_ptr++;
-        if (*snaps_array_start_ptr == ':') {
-            snaps_array_start_ptr++;
-            while (*snaps_array_start_ptr && isspace((unsigned char)*snaps_array_start_ptr)) snaps_array_start_ptr++;
-            if (*snaps_array_start_ptr == '[') {
-                 snaps_array_start_ptr++;
-                const char* snaps_array_end = strstr(snaps_array_start_ptr, "]");
-                if (snaps_array_end) {
-                    size_t snaps_len = snaps_array_end - snaps_array_start_ptr;
-                    snaps_substr = (char*)malloc(snaps_len + 1);
-                    if (snaps_substr) {
-                        strncpy(snaps_substr, snaps_array_start_ptr, snaps_len);
-                        snaps_substr[snaps_len] = '\0';
-
-                        char* snap_token = strtok_r(snaps_substr, "{", &saveptr);
-                        while(snap_token != NULL && *snap_position_count < MAX_SNAP_POSITIONS) {
-                            if (strchr(snap_token, '}')) {
-                                if (get_json_int(snap_token, "x", &snap_positions[*snap_position_count].x) == 0 &&
-                                    get_json_int(snap_token, "y", &snap_positions[*snap_position_count].y) == 0 &&
-                                    get_json_int(snap_token, "d", &snap_positions[*snap_position_count].d) == 0) {
-                                    (*snap_position_count)++;
-                                }
-                            }
-                            snap_token = strtok_r(NULL, "{", &saveptr);
-                        }
-                    }
-                }
+// Function to parse an image server reply (see parse_detection_json in json_parser.h)
+int parse_detection_json(const char* json, size_t len, Detection* objects, int max_objects) {
+    JsonToken tokens[DETECTION_MAX_TOKENS];
+    JsonDoc doc;
+    DetectionReply reply = { .count = 0, .objects = -1 };
+    if (json_parse(&doc, json, len, tokens, DETECTION_MAX_TOKENS) != 0 ||
+        json_decode_detection_reply(&doc, 0, &reply, NULL) != 0) {
+        return -1;
+    }
+    if (reply.count <= 0) return 0;
+    if (reply.objects < 0 || doc.tokens[reply.objects].type != JSON_ARRAY) return -1;
+
+    int n = 0;
+    int obj = reply.objects + 1;
+    for (int i = 0; i < doc.tokens[reply.objects].size && n < max_objects; i++, obj = json_next(&doc, obj)) {
+        // A server that reports no confidence is trusted, as before bursts
+        DetectionObject object = { .img_id = -1, .confidence = 1.0, .bbox = -1 };
+        if (json_decode_detection_object(&doc, obj, &object, NULL) != 0) continue;
+
+        Detection d = { .img_id = object.img_id, .confidence = object.confidence };
+        d.class_label = object.class_label.len > 0 ? object.class_label : object.class_name;
+        // Trim a " - ..." suffix (server may send "Number 4 - 4")
+        for (int c = 0; c + 3 <= d.class_label.len; c++) {
+            if (memcmp(d.class_label.ptr + c, " - ", 3) == 0) {
+                d.class_label.len = c;
+                break;
             }
         }
+        if (d.img_id < 0 && d.class_label.len > 0) d.img_id = kw_image_class(d.class_label.ptr, (size_t)d.class_label.len);
+        parse_detection_bbox(&doc, object.bbox, &d);
+
+        // Insertion sort, most confident first; ties keep the server's order
+        int at = n++;
+        while (at > 0 && objects[at - 1].confidence < d.confidence) {
+            objects[at] = objects[at - 1];
+            at--;
+        }
+        objects[at] = d;
     }
+    return n;
+}
 
-    ret_val = 0; // Success
+// A batch carries a few bursts' worth of single replies
+#define DETECTION_BATCH_MAX_TOKENS (DETECTION_MAX_TOKENS * 4)
 
-cleanup:
-    free(commands_substr);
-    free(snaps_substr);
-    return ret_val;
-}
\ No newline at end of file
+// Function to parse a batched image server reply (see parse_detection_batch_json in json_parser.h)
+int parse_detection_batch_json(const char* json, size_t len, DetectionResultSpan* results, int max_results) {
+    JsonToken tokens[DETECTION_BATCH_MAX_TOKENS];
+    JsonDoc doc;
+    DetectionBatchReply reply = { .results = -1 };
+    if (json_parse(&doc, json, len, tokens, DETECTION_BATCH_MAX_TOKENS) != 0 ||
+        json_decode_detection_batch_reply(&doc, 0, &reply, NULL) != 0 || doc.tokens[reply.results].type != JSON_ARRAY) {
+        return -1;
+    }
+
+    int n = 0;
+    int result = reply.results + 1;
+    for (int i = 0; i < doc.tokens[reply.results].size && n < max_results; i++, result = json_next(&doc, result)) {
+        DetectionBatchResult item;
+        if (json_decode_detection_batch_result(&doc, result, &item, NULL) != 0) continue;
+        const JsonToken* t = &doc.tokens[result];
+        results[n].object_id = item.object_id;
+        results[n].reply = (JsonSpan){ json + t->start, t->end - t->start };
+        n++;
+    }
+    return n;
+}
@@ -1,18 +1,140 @@
 #ifndef JSON_PARSER_H
 #define JSON_PARSER_H
 
+#include <stdbool.h>
+
 #include "shared_types.h" // For Obstacle, Command, SnapPosition, SharedAppContext
 
+// --- Tokenizer ---
+// A document is scanned once into a flat array of tokens in document order; the
+// root is token 0 and every container is followed by its children. Lookups then
+// walk tokens instead of re-searching the text, and a key only matches in the
+// object it belongs to.
+
+typedef enum {
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_PRIMITIVE // Number, true, false or null
+} JsonType;
+
+typedef struct {
+    JsonType type;
+    int start; // Offset of the first byte; for strings, just past the opening quote
+    int end;   // Offset one past the last byte; for strings, the closing quote
+    int size;  // Objects: number of keys. Arrays: number of elements
+    int next;  // Index of the first token after this one and its children
+} JsonToken;
+
+typedef struct {
+    const char* json;
+    JsonToken* tokens;
+    int count;
+} JsonDoc;
+
+#define JSON_MAX_DEPTH 32
+
+// Tokenizes json[0..len) into tokens[max_tokens]. Returns 0, or -1 if the text
+// is not a single well-formed JSON value or needs more than max_tokens tokens.
+int json_parse(JsonDoc* doc, const char* json, size_t len, JsonToken* tokens, int max_tokens);
+
+// Same, with the token array (sized once) and any scan scratch taken from arena.
+int json_parse_arena(JsonDoc* doc, const char* json, size_t len, Arena* arena);
+
+// Returns the value token for key in object, or -1 if object is not an object
+// or has no such key.
+int json_object_get(const JsonDoc* doc, int object, const char* key);
+
+// Index of the token after tok's subtree: the next element of an array, or the
+// next key of an object when tok is a value. The first child of a non-empty
+// container is container + 1.
+static inline int json_next(const JsonDoc* doc, int tok) {
+    return doc->tokens[tok].next;
+}
+
+// Typed accessors. Each returns 0 on success, or -1 if tok is negative or not of
+// the expected type.
+int json_token_int(const JsonDoc* doc, int tok, int* value);
+int json_token_double(const JsonDoc* doc, int tok, double* value);
+int json_token_bool(const JsonDoc* doc, int tok, bool* value);
+// Copies a string token with its escapes decoded; -1 if it does not fit.
+int json_token_string(const JsonDoc* doc, int tok, char* buffer, size_t buffer_size);
+// True if tok is a string equal to s (compared without decoding escapes).
+bool json_token_equals(const JsonDoc* doc, int tok, const char* s);
+
+// A run of the source text, not NUL-terminated. String spans are the raw bytes
+// between the quotes, escapes left as sent.
+typedef struct {
+    const char* ptr;
+    int len;
+} JsonSpan;
+
+// Points span at the string token's text; -1 if tok is not a string.
+int json_token_span(const JsonDoc* doc, int tok, JsonSpan* span);
+
+// --- One-off lookups ---
+// These tokenize json on every call and only see top-level keys. Parse the
+// document once with json_parse() when reading several values.
+
 // Function to extract an integer value from a JSON string for a given key
 int get_json_int(const char *json_string, const char *key, int *value);
 
+// Function to extract a floating-point value from a JSON string for a given key
+int get_json_double(const char *json_string, const char *key, double *value);
+
 // Function to extract a string value from a JSON string for a given key
 int get_json_string(const char *json_string, const char *key, char *value_buffer, size_t buffer_size);
 
 // Function to parse the Android map JSON into the SharedAppContext
 int parse_android_map_json(const char* json_string, SharedAppContext* context);
 
-// Function to parse the pathfinding server's route response
-int parse_route_json(const char* json_string, Command commands[], int* command_count, SnapPosition snap_positions[], int* snap_position_count);
+// Same, for a map object inside an already tokenized message.
+int parse_android_map_doc(const JsonDoc* doc, int map, SharedAppContext* context);
+// Same, into map rather than the context's mission fields.
+int parse_android_map_into(const JsonDoc* doc, int map, ArenaMap* out);
+
+// Function to parse the pathfinding server's route response. The lists are
+// reset and filled in place from json_string, with their storage in arena.
+int parse_route_json(const char* json_string, Arena* arena, CommandList* commands, SnapList* snap_positions);
+
+// Function to parse one line of the server's streamed (NDJSON) route. Each line is
+// {"cmd":"FW10"}, {"cmd":"SP1","x":..,"y":..,"d":..} (sets has_snap), {"done":true}
+// (sets done) or {"error":"..."}. Returns 0 on success, -1 on an error or malformed line.
+int parse_route_ndjson_line(const char* line, Command* command, SnapPosition* snap, bool* has_snap, bool* done);
+
+// --- Image server replies ---
+
+// Objects beyond this in one reply are ignored
+#define DETECTION_MAX_OBJECTS 16
+
+// One object from the image server. class_label points into the reply text, so
+// it stays valid only as long as that buffer does.
+typedef struct {
+    int img_id;           // From the reply, else from the class label; -1 if neither maps
+    double confidence;    // 1.0 when the server reports none
+    JsonSpan class_label; // " - ..." suffix trimmed; empty if the server sent no label
+    bool has_bbox;
+    double bbox[4];       // As sent by the server: x1, y1, x2, y2 in frame pixels
+} Detection;
+
+// Function to parse an image server reply ({"count":N,"objects":[...]}) into
+// objects[max_objects], most confident first. Returns the number of objects
+// (0 when the server detected nothing), or -1 if the reply is malformed.
+int parse_detection_json(const char* json, size_t len, Detection* objects, int max_objects);
+
+// Results beyond this in one batched reply are ignored
+#define DETECTION_BATCH_MAX_RESULTS 16
+
+// One image's answer within a batched reply.
+typedef struct {
+    int object_id;  // The obstacle the image was sent for
+    JsonSpan reply; // Its {"count":N,"objects":[...]} object, for parse_detection_json
+} DetectionResultSpan;
+
+// Splits the reply to an upload of several images ({"results":[{"object_id":N,
+// "count":...,"objects":[...]},...]}) into results[max_results], in the
+// server's order. Results without an object_id are skipped. Returns the number
+// of results, or -1 if the reply is malformed.
+int parse_detection_batch_json(const char* json, size_t len, DetectionResultSpan* results, int max_results);
 
 #endif // JSON_PARSER_H
@@ -0,0 +1,161 @@
+#ifndef JSON_SCHEMA_H
+#define JSON_SCHEMA_H
+
+#include <stdint.h>
+
+#include "json_parser.h"
+
+/**
+ * @file json_schema.h
+ * @brief Every JSON message shape the controller reads, declared once.
+ *
+ * Each JSON_SCHEMA_* list names the members of one object as
+ * F(P, SLOT, field, "key", KIND, required), where P is the message's slot
+ * prefix. JSON_MESSAGES pairs every schema with its C struct; this header
+ * expands it into a JSON_<MESSAGE>_<SLOT> index per member and a decoder
+ * declaration, and json_parser.c expands it into the decoders themselves.
+ *
+ * A decoder walks the object's members once. It checks each key against the
+ * member the schema expects at that position (the order the senders use),
+ * falls back to the schema's other keys, and writes the value straight into
+ * the struct field. Unknown keys are skipped. Fields that are absent keep
+ * whatever the caller put there, so callers preset their defaults.
+ *
+ * Kinds: INT, DOUBLE, BOOL, STRING (into a char array), SPAN (a JsonSpan onto
+ * the string in the source text, nothing copied) and TOKEN, which stores the
+ * value's token index (for arrays and nested objects the caller walks).
+ *
+ * Decoders return 0 when every required member was decoded. *present (may be
+ * NULL) gets bit JSON_<MESSAGE>_<SLOT> for each member that was.
+ */
+
+// --- Message structs (fields not in shared_types.h) ---
+
+typedef struct {
+    char cat[50];
+    int value; // Token
+} AndroidMessage;
+
+typedef struct {
+    int obstacles; // Token
+    int robot_x;
+    int robot_y;
+    int robot_dir; // Android's 1=N, 2=E, 3=S, 4=W
+} ArenaMapMessage;
+
+typedef struct {
+    int data; // Token
+} RouteReply;
+
+typedef struct {
+    int commands;       // Token
+    int snap_positions; // Token
+} RouteData;
+
+typedef struct {
+    char error[128];
+    bool done;
+    int cmd; // Token
+    SnapPosition snap;
+} RouteLine;
+
+typedef struct {
+    int count;
+    int objects; // Token
+} DetectionReply;
+
+typedef struct {
+    int results; // Token
+} DetectionBatchReply;
+
+typedef struct {
+    int object_id;
+} DetectionBatchResult;
+
+typedef struct {
+    JsonSpan class_label;
+    JsonSpan class_name; // Older servers send "class" instead of "class_label"
+    int img_id;
+    double confidence;
+    int bbox; // Token
+} DetectionObject;
+
+// --- Schemas ---
+
+#define JSON_SCHEMA_ANDROID_MESSAGE(F, P) \
+    F(P, CAT,   cat,   "cat",   STRING, 1) \
+    F(P, VALUE, value, "value", TOKEN,  0)
+
+#define JSON_SCHEMA_ARENA_MAP(F, P) \
+    F(P, OBSTACLES, obstacles, "obstacles", TOKEN, 1) \
+    F(P, ROBOT_X,   robot_x,   "robot_x",   INT,   0) \
+    F(P, ROBOT_Y,   robot_y,   "robot_y",   INT,   0) \
+    F(P, ROBOT_DIR, robot_dir, "robot_dir", INT,   0)
+
+#define JSON_SCHEMA_OBSTACLE(F, P) \
+    F(P, ID, id, "id", INT, 1) \
+    F(P, X,  x,  "x",  INT, 1) \
+    F(P, Y,  y,  "y",  INT, 1) \
+    F(P, D,  d,  "d",  INT, 1)
+
+#define JSON_SCHEMA_ROUTE_REPLY(F, P) \
+    F(P, DATA, data, "data", TOKEN, 1)
+
+#define JSON_SCHEMA_ROUTE_DATA(F, P) \
+    F(P, COMMANDS,       commands,       "commands",       TOKEN, 1) \
+    F(P, SNAP_POSITIONS, snap_positions, "snap_positions", TOKEN, 0)
+
+#define JSON_SCHEMA_SNAP_POSITION(F, P) \
+    F(P, X, x, "x", INT, 1) \
+    F(P, Y, y, "y", INT, 1) \
+    F(P, D, d, "d", INT, 1)
+
+#define JSON_SCHEMA_ROUTE_LINE(F, P) \
+    F(P, CMD,   cmd,    "cmd",   TOKEN,  0) \
+    F(P, X,     snap.x, "x",     INT,    0) \
+    F(P, Y,     snap.y, "y",     INT,    0) \
+    F(P, D,     snap.d, "d",     INT,    0) \
+    F(P, DONE,  done,   "done",  BOOL,   0) \
+    F(P, ERROR, error,  "error", STRING, 0)
+
+#define JSON_SCHEMA_DETECTION_REPLY(F, P) \
+    F(P, COUNT,   count,   "count",   INT,   1) \
+    F(P, OBJECTS, objects, "objects", TOKEN, 0)
+
+#define JSON_SCHEMA_DETECTION_BATCH_REPLY(F, P) \
+    F(P, RESULTS, results, "results", TOKEN, 1)
+
+// Only the key a batch adds; the rest of a result is a DETECTION_REPLY
+#define JSON_SCHEMA_DETECTION_BATCH_RESULT(F, P) \
+    F(P, OBJECT_ID, object_id, "object_id", INT, 1)
+
+#define JSON_SCHEMA_DETECTION_OBJECT(F, P) \
+    F(P, CLASS_LABEL, class_label, "class_label", SPAN,   0) \
+    F(P, IMG_ID,      img_id,      "img_id",      INT,    0) \
+    F(P, CONFIDENCE,  confidence,  "confidence",  DOUBLE, 0) \
+    F(P, BBOX,        bbox,        "bbox",        TOKEN,  0) \
+    F(P, CLASS_NAME,  class_name,  "class",       SPAN,   0)
+
+// X(decoder, struct, schema, slot prefix)
+#define JSON_MESSAGES(X) \
+    X(json_decode_android_message, AndroidMessage, JSON_SCHEMA_ANDROID_MESSAGE, JSON_ANDROID_MESSAGE_) \
+    X(json_decode_arena_map, ArenaMapMessage, JSON_SCHEMA_ARENA_MAP, JSON_ARENA_MAP_) \
+    X(json_decode_obstacle, Obstacle, JSON_SCHEMA_OBSTACLE, JSON_OBSTACLE_) \
+    X(json_decode_route_reply, RouteReply, JSON_SCHEMA_ROUTE_REPLY, JSON_ROUTE_REPLY_) \
+    X(json_decode_route_data, RouteData, JSON_SCHEMA_ROUTE_DATA, JSON_ROUTE_DATA_) \
+    X(json_decode_snap_position, SnapPosition, JSON_SCHEMA_SNAP_POSITION, JSON_SNAP_POSITION_) \
+    X(json_decode_route_line, RouteLine, JSON_SCHEMA_ROUTE_LINE, JSON_ROUTE_LINE_) \
+    X(json_decode_detection_reply, DetectionReply, JSON_SCHEMA_DETECTION_REPLY, JSON_DETECTION_REPLY_) \
+    X(json_decode_detection_batch_reply, DetectionBatchReply, JSON_SCHEMA_DETECTION_BATCH_REPLY, JSON_DETECTION_BATCH_REPLY_) \
+    X(json_decode_detection_batch_result, DetectionBatchResult, JSON_SCHEMA_DETECTION_BATCH_RESULT, JSON_DETECTION_BATCH_RESULT_) \
+    X(json_decode_detection_object, DetectionObject, JSON_SCHEMA_DETECTION_OBJECT, JSON_DETECTION_OBJECT_)
+
+#define JSON_BIT(slot) (1u << (slot))
+
+#define JSON_SLOT_ENUM_(P, slot, field, key, kind, required) P##slot,
+#define JSON_DECLARE_DECODER_(name, msg_type, schema, prefix) \
+    enum { schema(JSON_SLOT_ENUM_, prefix) }; \
+    int name(const JsonDoc* doc, int object, msg_type* out, uint32_t* present);
+JSON_MESSAGES(JSON_DECLARE_DECODER_)
+
+#endif // JSON_SCHEMA_H
@@ -0,0 +1,179 @@
+#include "json_writer.h"
+
+#include <string.h>
+
+// Longest decimal 64-bit value plus sign
+#define JW_INT_CHARS 21
+
+void jw_init(JsonWriter* w, char* buffer, size_t size) {
+    *w = (JsonWriter){ .data = buffer, .cap = size };
+    if (size == 0) w->failed = true;
+    else buffer[0] = '\0';
+}
+
+void jw_init_arena(JsonWriter* w, Arena* arena, size_t initial_cap) {
+    *w = (JsonWriter){ .arena = arena };
+    if (initial_cap == 0) initial_cap = 64;
+    w->data = arena_alloc(arena, initial_cap);
+    if (!w->data) {
+        w->failed = true;
+        return;
+    }
+    w->cap = initial_cap;
+    w->data[0] = '\0';
+}
+
+// Makes room for n more bytes plus the terminator. Fixed buffers never grow.
+static bool jw_reserve(JsonWriter* w, size_t n) {
+    if (w->failed) return false;
+    if (w->len + n < w->cap) return true;
+    if (!w->arena || n > SIZE_MAX / 4 - w->len) {
+        w->failed = true;
+        return false;
+    }
+    size_t cap = w->cap;
+    while (cap <= w->len + n) cap *= 2;
+    char* data = arena_realloc(w->arena, w->data, w->len + 1, cap);
+    if (!data) {
+        w->failed = true;
+        return false;
+    }
+    w->data = data;
+    w->cap = cap;
+    return true;
+}
+
+void jw_raw(JsonWriter* w, const char* s, size_t n) {
+    if (!jw_reserve(w, n)) return;
+    memcpy(w->data + w->len, s, n);
+    w->len += n;
+    w->data[w->len] = '\0';
+}
+
+void jw_raw_str(JsonWriter* w, const char* s) {
+    jw_raw(w, s, strlen(s));
+}
+
+static void jw_raw_digits(JsonWriter* w, unsigned long long magnitude, bool negative) {
+    char digits[JW_INT_CHARS];
+    char* p = digits + sizeof(digits);
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (negative) *--p = '-';
+    jw_raw(w, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+void jw_raw_int(JsonWriter* w, long value) {
+    // Work in unsigned so LONG_MIN negates cleanly
+    unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    jw_raw_digits(w, magnitude, value < 0);
+}
+
+// Emits the comma that separates this value from the previous member.
+static void jw_before_value(JsonWriter* w) {
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+    if (w->depth == 0) return;
+    uint32_t bit = 1u << (w->depth - 1);
+    if (w->has_items & bit) jw_raw(w, ",", 1);
+    w->has_items |= bit;
+}
+
+static void jw_open(JsonWriter* w, char c) {
+    jw_before_value(w);
+    if (w->depth >= JW_MAX_DEPTH) {
+        w->failed = true;
+        return;
+    }
+    jw_raw(w, &c, 1);
+    w->depth++;
+    w->has_items &= ~(1u << (w->depth - 1));
+}
+
+static void jw_close(JsonWriter* w, char c) {
+    if (w->depth == 0) {
+        w->failed = true;
+        return;
+    }
+    w->depth--;
+    jw_raw(w, &c, 1);
+}
+
+void jw_begin_object(JsonWriter* w) { jw_open(w, '{'); }
+void jw_end_object(JsonWriter* w) { jw_close(w, '}'); }
+void jw_begin_array(JsonWriter* w) { jw_open(w, '['); }
+void jw_end_array(JsonWriter* w) { jw_close(w, ']'); }
+
+static const char jw_hex[] = "0123456789abcdef";
+
+// Appends s as a quoted JSON string. The escaped length is counted first so the
+// output is reserved once and written in a single pass.
+static void jw_quoted(JsonWriter* w, const char* s) {
+    size_t n = 2;
+    for (const unsigned char* p = (const unsigned char*)s; *p; p++) {
+        if (*p == '"' || *p == '\\' || *p == '\n' || *p == '\r' || *p == '\t') n += 2;
+        else if (*p < 0x20) n += 6;
+        else n += 1;
+    }
+    if (!jw_reserve(w, n)) return;
+    char* out = w->data + w->len;
+    *out++ = '"';
+    for (const unsigned char* p = (const unsigned char*)s; *p; p++) {
+        switch (*p) {
+            case '"': *out++ = '\\'; *out++ = '"'; break;
+            case '\\': *out++ = '\\'; *out++ = '\\'; break;
+            case '\n': *out++ = '\\'; *out++ = 'n'; break;
+            case '\r': *out++ = '\\'; *out++ = 'r'; break;
+            case '\t': *out++ = '\\'; *out++ = 't'; break;
+            default:
+                if (*p < 0x20) {
+                    memcpy(out, "\\u00", 4);
+                    out[4] = jw_hex[*p >> 4];
+                    out[5] = jw_hex[*p & 0xF];
+                    out += 6;
+                } else {
+                    *out++ = (char)*p;
+                }
+        }
+    }
+    *out++ = '"';
+    w->len += n;
+    w->data[w->len] = '\0';
+}
+
+void jw_key(JsonWriter* w, const char* key) {
+    jw_before_value(w);
+    jw_quoted(w, key);
+    jw_raw(w, ":", 1);
+    w->after_key = true;
+}
+
+void jw_int(JsonWriter* w, long value) {
+    jw_before_value(w);
+    jw_raw_int(w, value);
+}
+
+void jw_uint(JsonWriter* w, unsigned long long value) {
+    jw_before_value(w);
+    jw_raw_digits(w, value, false);
+}
+
+void jw_bool(JsonWriter* w, bool value) {
+    jw_before_value(w);
+    if (value) jw_raw(w, "true", 4);
+    else jw_raw(w, "false", 5);
+}
+
+void jw_string(JsonWriter* w, const char* s) {
+    jw_before_value(w);
+    jw_quoted(w, s);
+}
+
+const char* jw_str(const JsonWriter* w) {
+    if (w->failed) return NULL;
+    return w->data ? w->data : "";
+}
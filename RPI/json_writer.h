@@ -0,0 +1,68 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ * @file json_writer.h
+ * @brief Single-pass builder for outbound JSON and line messages.
+ *
+ * Writes into a caller-owned buffer (status lines, ACKs) or grows in an arena
+ * (server payloads). Commas between members are inserted automatically, strings
+ * are escaped, and integers are formatted without printf, so every message is
+ * produced in one pass with its length known at the end. jw_raw*() append text
+ * verbatim for the quoted line messages Android expects ("ROBOT,x,y,d").
+ *
+ *   JsonWriter w;
+ *   char buf[128];
+ *   jw_init(&w, buf, sizeof(buf));
+ *   jw_begin_object(&w);
+ *   jw_key(&w, "cat"); jw_string(&w, "stop");
+ *   jw_end_object(&w);
+ *   jw_raw(&w, "\n", 1);
+ *   if (jw_str(&w)) write(fd, buf, jw_len(&w));
+ */
+
+#define JW_MAX_DEPTH 32
+
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    Arena* arena;       // Grows data in this arena; NULL for a fixed caller buffer
+    bool failed;        // Out of room or nesting too deep; the output is incomplete
+    bool after_key;     // The next value completes a "key": pair
+    int depth;
+    uint32_t has_items; // Bit d: the container at depth d already has a member
+} JsonWriter;
+
+// Writes into buffer[size]. The output is always NUL-terminated.
+void jw_init(JsonWriter* w, char* buffer, size_t size);
+// Writes into storage grown in arena, starting at initial_cap bytes.
+void jw_init_arena(JsonWriter* w, Arena* arena, size_t initial_cap);
+
+// --- Verbatim text ---
+void jw_raw(JsonWriter* w, const char* s, size_t n);
+void jw_raw_str(JsonWriter* w, const char* s);
+void jw_raw_int(JsonWriter* w, long value);
+
+// --- JSON values ---
+void jw_begin_object(JsonWriter* w);
+void jw_end_object(JsonWriter* w);
+void jw_begin_array(JsonWriter* w);
+void jw_end_array(JsonWriter* w);
+void jw_key(JsonWriter* w, const char* key);
+void jw_int(JsonWriter* w, long value);
+void jw_uint(JsonWriter* w, unsigned long long value); // Counters that outgrow a 32-bit long
+void jw_bool(JsonWriter* w, bool value);
+void jw_string(JsonWriter* w, const char* s);
+
+// Returns the output, or NULL if anything was dropped.
+const char* jw_str(const JsonWriter* w);
+static inline size_t jw_len(const JsonWriter* w) { return w->len; }
+
+#endif // JSON_WRITER_H
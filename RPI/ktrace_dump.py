@@ -0,0 +1,200 @@
+"""
+Fetches the MDP firmware's kernel trace and writes it as a Perfetto timeline.
+
+The firmware's FreeRTOS hooks record every context switch, the entry and exit
+of the traced ISRs (IMU_INT, IR_ADC, ENC_LATCH, UART_RX) and every queue send
+and receive in a 1024-event RAM ring, stamped with the DWT cycle counter.
+"KTRACE <n>" sends back the newest n events as binary frames (see the Kernel
+trace section of STM/MDP/Core/Src/main.c).
+
+    python3 ktrace_dump.py /dev/ttyUSB0 -o kernel.json
+    python3 ktrace_dump.py /dev/ttyUSB0 --merge mission.json
+
+The output is Chrome Trace Event JSON, for ui.perfetto.dev or chrome://tracing:
+one track per task with a slice for each time it ran (ended "preempted" or
+"blocked"), one per ISR, and one per queue with an instant for each send and
+receive. --merge adds the tracks to a timeline written by the controller's
+--timeline, as an "MDP kernel" process on the same time axis, which works once
+that timeline has seen telemetry (TELEM) and so knows the board's tick.
+"""
+import argparse
+import json
+import struct
+import sys
+import time
+
+import serial
+
+from fake_stm import FRAME_SYNC, crc16_ccitt
+
+MDP_BAUD = 1000000
+TYPE_HEAD = 0x83
+TYPE_DATA = 0x84
+HEAD_FIELDS = struct.Struct("<HIIIH")        # events, lost, tick ms, cycles, cycles per us
+DATA_HEADER = struct.Struct("<H")            # first event
+EVENT = struct.Struct("<IBBH")               # cycles, kind, id, arg
+MAX_EVENTS = 1024
+REPLY_TIMEOUT_SECONDS = 5.0
+
+TASK_IN, TASK_OUT, ISR_ENTER, ISR_EXIT, QUEUE_SEND, QUEUE_RECV = range(6)  # ktrace_kind_t order
+UNTAGGED = 0xFF
+FROM_ISR = 0x8000
+TASKS = ["defaultTask", "ShowTask", "MotorTask", "EncoderTask", "DistanceTask", "IMUTask",
+         "ServoMotorTask", "IRTask", "CmdTask", "UartRxTask"]  # wcet_id_t order
+ISRS = ["IMU_INT", "IR_ADC", "ENC_LATCH", "UART_RX"]          # isr_trace_id_t order
+QUEUES = ["kernel queues", "DisplayQueue"]                  # ktrace_queue_t order
+PID = 3  # After the controller's Raspberry Pi (1) and STM32 (2)
+ISR_TID = 100
+QUEUE_TID = 200
+
+
+def read_dump(port, events):
+    """Sends KTRACE and returns (header, [event]) once ACK arrives."""
+    port.reset_input_buffer()
+    port.write(f"KTRACE {events}\n".encode("ascii"))
+    header, got, buf = None, {}, b""
+    deadline = time.monotonic() + REPLY_TIMEOUT_SECONDS
+    while time.monotonic() < deadline:
+        buf += port.read(port.in_waiting or 1)
+        while buf:
+            if buf[0] == FRAME_SYNC:
+                if len(buf) < 2 or len(buf) < buf[1] + 4:
+                    break  # Rest of the frame still on the wire
+                end = buf[1] + 2
+                body = buf[2:end]
+                if crc16_ccitt(buf[1:end]) != int.from_bytes(buf[end:end + 2], "little"):
+                    raise ValueError("KTRACE frame with a bad CRC")
+                buf = buf[end + 2:]
+                if body[0] == TYPE_HEAD:
+                    header = HEAD_FIELDS.unpack(body[1:])
+                elif body[0] == TYPE_DATA:
+                    (first,) = DATA_HEADER.unpack_from(body, 1)
+                    data = body[1 + DATA_HEADER.size:]
+                    for i in range(len(data) // EVENT.size):
+                        got[first + i] = EVENT.unpack_from(data, i * EVENT.size)
+                continue
+            line, sep, rest = buf.partition(b"\n")
+            if not sep:
+                break
+            buf = rest
+            text = line.decode("ascii", errors="replace").strip()
+            if text.startswith("ACK KTRACE"):
+                if header is None:
+                    raise ValueError("ACK KTRACE without a header frame")
+                return header, [got[i] for i in sorted(got)]
+            if text.startswith("ERR KTRACE"):
+                raise RuntimeError(f"firmware refused the dump: {text}")
+    raise TimeoutError("no ACK KTRACE from the firmware")
+
+
+def event_ticks(header, events):
+    """Board tick (ms, fractional) of each event.
+
+    The cycle counter wraps every 2^32 cycles (25 s at 168 MHz), so the events
+    are unwrapped from the newest back, each against the one after it.
+    """
+    _, _, tick_ms, ref_cyc, cyc_per_us = header
+    cyc_per_ms = cyc_per_us * 1000.0
+    ticks = [0.0] * len(events)
+    prev_raw, prev = ref_cyc, 0
+    for i in range(len(events) - 1, -1, -1):
+        raw = events[i][0]
+        delta = (prev_raw - raw) & 0xFFFFFFFF
+        if delta >= 1 << 31:
+            delta -= 1 << 32  # An ISR's entry, recorded after a later event
+        prev -= delta
+        prev_raw = raw
+        ticks[i] = tick_ms + prev / cyc_per_ms
+    return ticks
+
+
+def name(names, i, fallback):
+    return names[i] if i < len(names) else f"{fallback} {i}"
+
+
+def task_name(i):
+    return "idle / timers" if i == UNTAGGED else name(TASKS, i, "task")
+
+
+def trace_events(header, events, tick0_us):
+    """Chrome trace events for one dump, ts in us from tick0_us (where tick 0 falls)."""
+    ticks = event_ticks(header, events)
+    order = sorted(range(len(events)), key=lambda i: ticks[i])
+    us = lambda i: tick0_us + ticks[i] * 1000.0
+    out = [{"ph": "M", "name": "process_name", "pid": PID, "args": {"name": "MDP kernel"}}]
+    tracks = {}
+
+    def track(tid, label):
+        if tid not in tracks:
+            tracks[tid] = label
+            out.append({"ph": "M", "name": "thread_name", "pid": PID, "tid": tid, "args": {"name": label}})
+            out.append({"ph": "M", "name": "thread_sort_index", "pid": PID, "tid": tid, "args": {"sort_index": tid}})
+        return tid
+
+    running = None  # (task, index of its TASK_IN)
+    isr_open = {}
+    for i in order:
+        _, kind, ident, arg = events[i]
+        if kind in (TASK_IN, TASK_OUT) and running is not None and (kind == TASK_IN or running[0] == ident):
+            task, start = running
+            slice_args = {"ended": "preempted" if arg else "blocked"} if kind == TASK_OUT else {}
+            out.append({"ph": "X", "pid": PID, "tid": track(task if task != UNTAGGED else len(TASKS), task_name(task)),
+                        "ts": round(us(start), 3), "dur": round(us(i) - us(start), 3),
+                        "name": task_name(task), "args": slice_args})
+            running = None
+        if kind == TASK_IN:
+            running = (ident, i)
+        elif kind == ISR_ENTER:
+            isr_open[ident] = i
+        elif kind == ISR_EXIT and ident in isr_open:
+            start = isr_open.pop(ident)
+            out.append({"ph": "X", "pid": PID, "tid": track(ISR_TID + ident, name(ISRS, ident, "ISR")),
+                        "ts": round(us(start), 3), "dur": round(us(i) - us(start), 3),
+                        "name": name(ISRS, ident, "ISR")})
+        elif kind in (QUEUE_SEND, QUEUE_RECV):
+            label = ("send" if kind == QUEUE_SEND else "receive") + (" from ISR" if arg & FROM_ISR else "")
+            out.append({"ph": "i", "s": "t", "pid": PID, "tid": track(QUEUE_TID + ident, name(QUEUES, ident, "queue")),
+                        "ts": round(us(i), 3), "name": label, "args": {"waiting": arg & ~FROM_ISR}})
+    return out
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("device", help="MDP USART3 serial device")
+    parser.add_argument("--events", type=int, default=MAX_EVENTS, help=f"events to fetch, newest last (1-{MAX_EVENTS})")
+    parser.add_argument("--baud", type=int, default=MDP_BAUD)
+    parser.add_argument("--merge", metavar="TIMELINE", help="add the tracks to this --timeline file, in place")
+    parser.add_argument("-o", "--output", help="JSON file (default: stdout; with --merge, the timeline itself)")
+    args = parser.parse_args()
+
+    timeline = None
+    if args.merge:
+        with open(args.merge) as f:
+            timeline = json.load(f)
+        if "stm32_tick0_us" not in timeline.get("otherData", {}):
+            sys.exit(f"{args.merge} has no board clock (otherData.stm32_tick0_us): it saw no telemetry")
+
+    with serial.Serial(args.device, args.baud, timeout=0.1) as port:
+        header, events = read_dump(port, args.events)
+    count, lost = header[0], header[1]
+    print(f"{len(events)} of {count} events, {lost} overwritten before the dump", file=sys.stderr)
+    if not events:
+        sys.exit("the kernel trace is empty")
+
+    if timeline is not None:
+        tick0_us = timeline["otherData"]["stm32_tick0_us"]
+        timeline["traceEvents"] = [e for e in timeline["traceEvents"] if e.get("pid") != PID]  # A previous merge
+        timeline["traceEvents"] += trace_events(header, events, tick0_us)
+        doc, path = timeline, args.output or args.merge
+    else:
+        doc = {"displayTimeUnit": "ms", "traceEvents": trace_events(header, events, -min(event_ticks(header, events)) * 1000.0)}
+        path = args.output
+    if path:
+        with open(path, "w") as out:
+            json.dump(doc, out)
+    else:
+        json.dump(doc, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
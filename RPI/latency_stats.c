@@ -0,0 +1,279 @@
+#include "latency_stats.h"
+#include "logger.h"
+#include "metrics.h"
+#include "timeline.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* LATENCY_CMD_NAMES[LATENCY_CMD_TYPES] = {"FW", "BW", "TL", "TR"};
+static const char* LATENCY_PHASE_NAMES[LATENCY_PHASES] = {"send->accept", "accept->done", "send->done"};
+
+uint64_t latency_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int latency_bucket(uint64_t us) {
+    if (us > UINT32_MAX) us = UINT32_MAX;
+    if (us < LATENCY_SUB_BUCKETS) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - 4;
+    return LATENCY_SUB_BUCKETS + shift * LATENCY_SUB_BUCKETS + (int)((us >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls into bucket idx
+static uint64_t latency_bucket_upper(int idx) {
+    if (idx < LATENCY_SUB_BUCKETS) return (uint64_t)idx;
+    int shift = (idx - LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS;
+    uint64_t sub = (uint64_t)((idx - LATENCY_SUB_BUCKETS) % LATENCY_SUB_BUCKETS);
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+// Only the nav thread records, so plain load/store pairs are enough; the
+// atomics just keep concurrent dumps well-defined.
+static void latency_record(LatencyHistogram* hist, uint64_t start_ns, uint64_t end_ns) {
+    if (end_ns < start_ns) return;
+    uint64_t us = (end_ns - start_ns) / 1000;
+    atomic_uint* count = &hist->counts[latency_bucket(us)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    if (us > atomic_load_explicit(&hist->max_us, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max_us, us, memory_order_relaxed);
+    }
+}
+
+void latency_reset(LatencyStats* stats) {
+    for (int t = 0; t < LATENCY_CMD_TYPES; t++) {
+        for (int p = 0; p < LATENCY_PHASES; p++) {
+            LatencyHistogram* hist = &stats->hist[t][p];
+            for (int b = 0; b < LATENCY_BUCKETS; b++) atomic_store_explicit(&hist->counts[b], 0, memory_order_relaxed);
+            atomic_store_explicit(&hist->max_us, 0, memory_order_relaxed);
+        }
+    }
+    memset(stats->inflight, 0, sizeof(stats->inflight));
+    stats->last_done_ns = 0;
+    stats->last_done_id = 0;
+    stats->first_sent_ns = 0;
+    stats->busy_ns = 0;
+    stats->settle_ns = 0;
+}
+
+static void latency_add(atomic_ullong* sum, unsigned long long value) {
+    atomic_store_explicit(sum, atomic_load_explicit(sum, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static void latency_fit_record(LatencyFit* fit, int value, uint64_t start_ns, uint64_t end_ns) {
+    if (end_ns < start_ns) return;
+    unsigned long long v = (unsigned long long)abs(value);
+    unsigned long long us = (end_ns - start_ns) / 1000;
+    latency_add(&fit->n, 1);
+    latency_add(&fit->sum_v, v);
+    latency_add(&fit->sum_vv, v * v);
+    latency_add(&fit->sum_t_us, us);
+    latency_add(&fit->sum_vt, v * us);
+}
+
+static void latency_fit_line(const LatencyFit* fit, unsigned long long* n_out, double* per_cmd_s, double* per_unit_s);
+
+uint64_t latency_predict_us(const LatencyStats* stats, CommandType type, int value) {
+    if ((int)type < 0 || (int)type >= LATENCY_CMD_TYPES) return 0;
+    double v = abs(value);
+    if (stats && atomic_load_explicit(&stats->fit[type].n, memory_order_relaxed) >= LATENCY_FIT_MIN_SAMPLES) {
+        unsigned long long n;
+        double per_cmd_s, per_unit_s;
+        latency_fit_line(&stats->fit[type], &n, &per_cmd_s, &per_unit_s);
+        return (uint64_t)((per_cmd_s + per_unit_s * v) * 1e6);
+    }
+    bool turn = type == CMD_TURN_LEFT || type == CMD_TURN_RIGHT;
+    double speed = turn ? LATENCY_PRIOR_TURN_DEG_PER_S : LATENCY_PRIOR_MOVE_CM_PER_S;
+    return (uint64_t)((LATENCY_PRIOR_PER_CMD_S + v / speed) * 1e6);
+}
+
+int latency_motion_timeout_ms(const LatencyStats* stats, CommandType type, int value) {
+    uint64_t predicted_us = latency_predict_us(stats, type, value);
+    bool fitted = stats && (int)type >= 0 && (int)type < LATENCY_CMD_TYPES &&
+                  atomic_load_explicit(&stats->fit[type].n, memory_order_relaxed) >= LATENCY_FIT_MIN_SAMPLES;
+    double ms = predicted_us * LATENCY_PRIOR_SLACK / 1000.0;
+    if (fitted) {
+        // No error seen yet against the fit: assume a quarter of the prediction, as TCP seeds RTTVAR
+        uint64_t dev_us = stats->dev_us[type] ? stats->dev_us[type] : predicted_us / 4;
+        ms = (predicted_us + LATENCY_DEADLINE_DEV_GAIN * dev_us) / 1000.0;
+    }
+    ms += LATENCY_DEADLINE_MARGIN_MS;
+    if (ms < LATENCY_DEADLINE_MIN_MS) ms = LATENCY_DEADLINE_MIN_MS;
+    if (ms > LATENCY_DEADLINE_MAX_MS) ms = LATENCY_DEADLINE_MAX_MS;
+    return (int)ms;
+}
+
+int latency_cmd_timeout_ms(const LatencyStats* stats, uint32_t cmd_id, uint64_t now_ns) {
+    const LatencyInflight* rec = &stats->inflight[cmd_id % STM32_ACK_TABLE_SIZE];
+    if (rec->cmd_id != cmd_id || rec->sent_ns == 0) return -1;
+    // Commands complete in order, so one queued behind others starts at the last DONE
+    uint64_t start_ns = rec->sent_ns > stats->last_done_ns ? rec->sent_ns : stats->last_done_ns;
+    uint64_t deadline_ns = start_ns + (uint64_t)latency_motion_timeout_ms(stats, rec->type, rec->value) * 1000000ull;
+    if (deadline_ns <= now_ns + 1000000ull) return 1;
+    return (int)((deadline_ns - now_ns) / 1000000ull);
+}
+
+void latency_cmd_sent(LatencyStats* stats, uint32_t cmd_id, CommandType type, int value, uint64_t sent_ns) {
+    if ((int)type < 0 || (int)type >= LATENCY_CMD_TYPES) return;
+    LatencyInflight* rec = &stats->inflight[cmd_id % STM32_ACK_TABLE_SIZE];
+    rec->cmd_id = cmd_id;
+    rec->type = type;
+    rec->value = value;
+    rec->sent_ns = sent_ns;
+    rec->accepted_ns = 0;
+    if (stats->first_sent_ns == 0) stats->first_sent_ns = sent_ns;
+}
+
+void latency_cmd_event(LatencyStats* stats, uint32_t cmd_id, int8_t status, uint64_t rx_ns) {
+    if (status == STM32_ACK_SETTLED) {
+        if (cmd_id == stats->last_done_id && rx_ns >= stats->last_done_ns) stats->settle_ns += rx_ns - stats->last_done_ns;
+        return;
+    }
+    LatencyInflight* rec = &stats->inflight[cmd_id % STM32_ACK_TABLE_SIZE];
+    if (rec->cmd_id != cmd_id || rec->sent_ns == 0) return; // Not sent by the nav thread this run
+
+    LatencyHistogram* hist = stats->hist[rec->type];
+    if (status == STM32_ACK_ACCEPTED) {
+        rec->accepted_ns = rx_ns;
+        latency_record(&hist[LATENCY_SEND_TO_ACCEPT], rec->sent_ns, rx_ns);
+        return;
+    }
+    if (status == STM32_ACK_DONE) {
+        if (rec->accepted_ns != 0) latency_record(&hist[LATENCY_ACCEPT_TO_DONE], rec->accepted_ns, rx_ns);
+        latency_record(&hist[LATENCY_SEND_TO_DONE], rec->sent_ns, rx_ns);
+        if (rx_ns >= rec->sent_ns) metric_observe_us(METRIC_HIST_STM32_ACK_US, (rx_ns - rec->sent_ns) / 1000);
+        // Queued commands start executing when the one ahead of them finishes
+        uint64_t start_ns = rec->sent_ns > stats->last_done_ns ? rec->sent_ns : stats->last_done_ns;
+        if (rx_ns >= start_ns &&
+            atomic_load_explicit(&stats->fit[rec->type].n, memory_order_relaxed) >= LATENCY_FIT_MIN_SAMPLES) {
+            // Against the fitted prediction the deadline was set from, before this sample joins the fit
+            uint64_t took_us = (rx_ns - start_ns) / 1000;
+            uint64_t predicted_us = latency_predict_us(stats, rec->type, rec->value);
+            uint64_t error_us = took_us > predicted_us ? took_us - predicted_us : predicted_us - took_us;
+            uint64_t* dev = &stats->dev_us[rec->type];
+            *dev = *dev == 0 ? error_us : (3 * *dev + error_us) / 4;
+        }
+        latency_fit_record(&stats->fit[rec->type], rec->value, start_ns, rx_ns);
+        if (rx_ns >= start_ns) stats->busy_ns += rx_ns - start_ns;
+        timeline_stm32_span(TIMELINE_STM32_COMMANDS, start_ns, rx_ns, "%s%d #%u", LATENCY_CMD_NAMES[rec->type],
+                            rec->value, cmd_id);
+        stats->last_done_ns = rx_ns;
+        stats->last_done_id = cmd_id;
+    }
+    rec->sent_ns = 0; // Completed or failed; ignore any duplicate reply
+}
+
+// Value at quantile q (0..1), reported as the upper edge of its bucket.
+static double latency_percentile_ms(const unsigned* counts, unsigned samples, uint64_t max_us, double q) {
+    unsigned rank = (unsigned)(q * samples);
+    if (rank >= samples) rank = samples - 1;
+    unsigned seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) {
+            uint64_t us = latency_bucket_upper(b);
+            return (us > max_us ? max_us : us) / 1000.0;
+        }
+    }
+    return max_us / 1000.0;
+}
+
+void latency_dump(const LatencyStats* stats, const char* title) {
+    LOG_INFO("[Latency] --- %s ---\n", title);
+    LOG_INFO("[Latency] %-4s %-13s %7s %9s %9s %9s %9s\n", "cmd", "phase", "n", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    int printed = 0;
+    for (int t = 0; t < LATENCY_CMD_TYPES; t++) {
+        for (int p = 0; p < LATENCY_PHASES; p++) {
+            const LatencyHistogram* hist = &stats->hist[t][p];
+            // Snapshot the counters so the percentiles are computed over one consistent set
+            unsigned counts[LATENCY_BUCKETS];
+            unsigned samples = 0;
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                counts[b] = atomic_load_explicit(&hist->counts[b], memory_order_relaxed);
+                samples += counts[b];
+            }
+            if (samples == 0) continue;
+            uint64_t max_us = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+            LOG_INFO("[Latency] %-4s %-13s %7u %9.1f %9.1f %9.1f %9.1f\n",
+                   LATENCY_CMD_NAMES[t], LATENCY_PHASE_NAMES[p], samples,
+                   latency_percentile_ms(counts, samples, max_us, 0.50),
+                   latency_percentile_ms(counts, samples, max_us, 0.95),
+                   latency_percentile_ms(counts, samples, max_us, 0.99),
+                   max_us / 1000.0);
+            printed++;
+        }
+    }
+    if (printed == 0) LOG_INFO("[Latency] No STM32 commands timed yet.\n");
+}
+
+// Least-squares seconds = per_cmd_s + per_unit_s * value. When every sample has
+// the same value (turns are always 90 degrees) the time goes into per_cmd_s.
+// Negative coefficients are clamped so the planner never sees a free move.
+static void latency_fit_line(const LatencyFit* fit, unsigned long long* n_out, double* per_cmd_s, double* per_unit_s) {
+    double n = (double)atomic_load_explicit(&fit->n, memory_order_relaxed);
+    double sv = (double)atomic_load_explicit(&fit->sum_v, memory_order_relaxed);
+    double svv = (double)atomic_load_explicit(&fit->sum_vv, memory_order_relaxed);
+    double st = (double)atomic_load_explicit(&fit->sum_t_us, memory_order_relaxed) / 1e6;
+    double svt = (double)atomic_load_explicit(&fit->sum_vt, memory_order_relaxed) / 1e6;
+    *n_out = (unsigned long long)n;
+
+    double det = n * svv - sv * sv;
+    double a = st / n, b = 0.0;
+    if (det > 1e-9 * n * svv) {
+        b = (n * svt - sv * st) / det;
+        a = (st - b * sv) / n;
+    }
+    if (b < 0.0) {
+        a = st / n;
+        b = 0.0;
+    } else if (a < 0.0) {
+        a = 0.0;
+        b = svt / svv; // Through the origin
+    }
+    *per_cmd_s = a;
+    *per_unit_s = b;
+}
+
+int latency_write_cost_model(const LatencyStats* stats, const char* path) {
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    bool any = false;
+    for (int t = 0; t < LATENCY_CMD_TYPES; t++) {
+        if (atomic_load_explicit(&stats->fit[t].n, memory_order_relaxed) > 0) any = true;
+    }
+    if (!any) return 0;
+
+    FILE* f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        LOG_ERROR("[Latency] Cannot create %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "{\"version\":1,\"commands\":{");
+    bool first = true;
+    for (int t = 0; t < LATENCY_CMD_TYPES; t++) {
+        if (atomic_load_explicit(&stats->fit[t].n, memory_order_relaxed) == 0) continue;
+        unsigned long long n;
+        double per_cmd_s, per_unit_s;
+        latency_fit_line(&stats->fit[t], &n, &per_cmd_s, &per_unit_s);
+        fprintf(f, "%s\"%s\":{\"n\":%llu,\"per_cmd_s\":%.6f,\"per_unit_s\":%.6f}",
+                first ? "" : ",", LATENCY_CMD_NAMES[t], n, per_cmd_s, per_unit_s);
+        LOG_INFO("[Latency] Cost model %s: %.3f s + %.5f s/unit (n=%llu)\n", LATENCY_CMD_NAMES[t], per_cmd_s, per_unit_s, n);
+        first = false;
+    }
+    fprintf(f, "}}\n");
+
+    if (fclose(f) != 0 || rename(tmp_path, path) != 0) {
+        LOG_ERROR("[Latency] Failed to write %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "shared_types.h" // For CommandType, STM32_ACK_TABLE_SIZE
+
+/**
+ * @file latency_stats.h
+ * @brief STM32 command round-trip instrumentation.
+ *
+ * Every command sent during navigation is stamped with CLOCK_MONOTONIC at send,
+ * when the STM32 accepts it (!id/OK) and when it completes (!id/DONE). The
+ * intervals feed per-command-type histograms that are dumped at mission end or
+ * on demand. Recording is done by the nav thread only; dumping may happen from
+ * any thread.
+ *
+ * Alongside the histograms, each type keeps least-squares sums for fitting
+ * seconds = a + b * value, which latency_write_cost_model() saves for the
+ * pathfinding server so it can plan in estimated seconds rather than cells.
+ *
+ * The same fit sets each command's ACK deadline. latency_cmd_timeout_ms()
+ * predicts when a command should finish: from its start (its send, or the
+ * previous DONE) plus a + b * value, plus LATENCY_DEADLINE_DEV_GAIN times an
+ * EWMA of how far DONEs have landed from the prediction, plus
+ * LATENCY_DEADLINE_MARGIN_MS. A stalled 10 cm move is then caught within a
+ * fraction of a second of when it should have finished, not after a fixed
+ * timeout. Until a type has LATENCY_FIT_MIN_SAMPLES samples, a motion model
+ * (distance or angle over the profile speed) stands in, with
+ * LATENCY_PRIOR_SLACK to spare.
+ */
+
+// Commands that are timed. Snapshots never reach the STM32.
+#define LATENCY_CMD_TYPES 4 // CMD_MOVE_FORWARD .. CMD_TURN_RIGHT
+
+typedef enum {
+    LATENCY_SEND_TO_ACCEPT, // send -> !id/OK
+    LATENCY_ACCEPT_TO_DONE, // !id/OK -> !id/DONE (execution on the robot)
+    LATENCY_SEND_TO_DONE,   // send -> !id/DONE (full round trip)
+    LATENCY_PHASES
+} LatencyPhase;
+
+// Log-linear buckets over microseconds: 16 sub-buckets per power of two,
+// so every bucket is within ~6% of its lower bound, up to ~71 minutes.
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS + 28 * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    atomic_uint counts[LATENCY_BUCKETS];
+    atomic_ullong max_us;
+} LatencyHistogram;
+
+// Send/accept times for one command still in flight, indexed like the ACK table
+typedef struct {
+    uint32_t cmd_id;
+    CommandType type;
+    int value; // Command.value: cm for moves, degrees for turns
+    uint64_t sent_ns;
+    uint64_t accepted_ns; // 0 until !id/OK arrives
+} LatencyInflight;
+
+// Sums over every completed command of one type. A sample is the time the
+// command added to the mission: from its send, or from the previous DONE when
+// it was queued behind other commands, to its own DONE.
+typedef struct {
+    atomic_ullong n;
+    atomic_ullong sum_v;    // value
+    atomic_ullong sum_vv;   // value^2
+    atomic_ullong sum_t_us; // time
+    atomic_ullong sum_vt;   // value * time
+} LatencyFit;
+
+// Motion model used before a type is fitted: a fixed cost per command
+// (acceleration, braking, the link) plus distance or angle at profile speed.
+#define LATENCY_PRIOR_PER_CMD_S 0.5
+#define LATENCY_PRIOR_MOVE_CM_PER_S 15.0
+#define LATENCY_PRIOR_TURN_DEG_PER_S 30.0
+#define LATENCY_PRIOR_SLACK 2.0 // The model is a guess; its deadline is this many times longer
+#define LATENCY_FIT_MIN_SAMPLES 3
+#define LATENCY_DEADLINE_DEV_GAIN 4
+#define LATENCY_DEADLINE_MARGIN_MS 300
+#define LATENCY_DEADLINE_MIN_MS 500
+#define LATENCY_DEADLINE_MAX_MS 60000
+
+typedef struct {
+    LatencyHistogram hist[LATENCY_CMD_TYPES][LATENCY_PHASES];
+    LatencyInflight inflight[STM32_ACK_TABLE_SIZE];
+    LatencyFit fit[LATENCY_CMD_TYPES];
+    uint64_t dev_us[LATENCY_CMD_TYPES]; // EWMA of |DONE - fitted prediction|; kept across missions like fit
+    uint64_t last_done_ns; // DONE time of the previous command this mission
+    uint32_t last_done_id;
+    // Mission totals for the KPI report (mission_report.h)
+    uint64_t first_sent_ns; // First timed command's send, 0 before it
+    uint64_t busy_ns;       // Sum of the fit's samples: each command's start to its DONE
+    uint64_t settle_ns;     // Sum of DONE -> SETTLED of the last command done
+} LatencyStats;
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+uint64_t latency_now_ns(void);
+
+// Clears all histograms and in-flight records, e.g. at the start of a mission.
+// The cost-model sums are kept, so the fit covers every run since start-up.
+void latency_reset(LatencyStats* stats);
+
+// Records that cmd_id of the given type and value was sent at sent_ns.
+void latency_cmd_sent(LatencyStats* stats, uint32_t cmd_id, CommandType type, int value, uint64_t sent_ns);
+
+// Records an STM32 reply for cmd_id received at rx_ns. status is one of the
+// STM32_ACK_* values; ACCEPTED and DONE produce samples, ERROR drops the record,
+// SETTLED after the latest DONE adds to settle_ns.
+void latency_cmd_event(LatencyStats* stats, uint32_t cmd_id, int8_t status, uint64_t rx_ns);
+
+// Predicted time for a command of type and value to execute, in microseconds:
+// the fit once it has enough samples, else the motion model. stats may be NULL
+// for the motion model alone.
+uint64_t latency_predict_us(const LatencyStats* stats, CommandType type, int value);
+
+// Deadline for a command of type and value that starts now, in ms (see above).
+// stats may be NULL, as for latency_predict_us().
+int latency_motion_timeout_ms(const LatencyStats* stats, CommandType type, int value);
+
+// Milliseconds from now_ns until cmd_id, sent and still in flight, is overdue;
+// at least 1. Returns -1 if cmd_id is not a timed command in flight (the caller
+// then uses its fixed timeout).
+int latency_cmd_timeout_ms(const LatencyStats* stats, uint32_t cmd_id, uint64_t now_ns);
+
+// Prints p50/p95/p99/max per command type and phase to stdout.
+void latency_dump(const LatencyStats* stats, const char* title);
+
+// Writes the fitted per-type times to path as JSON (atomically, via a temporary
+// file); the pathfinding server reloads it when it changes. Types without
+// samples are left out. Returns 0 on success (or when nothing is timed yet), -1 on error.
+int latency_write_cost_model(const LatencyStats* stats, const char* path);
+
+#endif // LATENCY_STATS_H
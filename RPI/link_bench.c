@@ -0,0 +1,394 @@
+/*
+ * Hardware-in-the-loop latency benchmark of the RPi -> STM32 command link.
+ * Sends a burst of PINGs (stm32_protocol.h) and splits each round trip into
+ * the stages the firmware timed on its cycle counter and the Pi's own:
+ *
+ *   gcc -O2 -Wall link_bench.c stm32_protocol.c stm32_sim.c latency_stats.c logger.c metrics.c timeline.c clock_sync.c json_writer.c arena.c \
+ *       -o link_bench -lpthread -lm
+ *   ./link_bench [-n COUNT] [-w WINDOW] [-b BAUD] [-s RATE] [--binary] [-o SAMPLES.csv] DEVICE
+ *   ./link_bench [...] --stm32-sim SPEC
+ *
+ * Stages of one PING:
+ *   write     the Pi's write() of the frame
+ *   rx        its first byte to its last at the STM32's UART
+ *   wake      last byte to the receive task (RX ISR, notify, context switch)
+ *   dispatch  parse, command table and queueing the reply
+ *   tx        reply queued to its last bit sent (reported in the next reply)
+ *   host      the rest: USB-serial adapter, kernel and tty both ways
+ *   total     before write() to the reply read
+ *
+ * DEVICE is opened at BAUD (default 1000000, the firmware's boot rate); -s
+ * asks the firmware to move to RATE first, as the controller's BAUD handshake
+ * does. --binary sends STM32_OP_PING frames instead of ASCII. WINDOW PINGs are
+ * kept in flight (default 1). With more, frames queue in the firmware, and an
+ * ASCII frame arriving while both of its buffers are busy is dropped; those
+ * count as lost after BENCH_TIMEOUT_MS. For each stage, the histogram has
+ * power-of-two microsecond buckets. -o writes every sample as CSV.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+
+#include "latency_stats.h" // For latency_now_ns()
+#include "stm32_protocol.h"
+#include "stm32_sim.h"
+
+#define BENCH_DEFAULT_BAUD 1000000
+#define BENCH_MAX_WINDOW 64
+#define BENCH_TIMEOUT_MS 1000
+#define BENCH_REPLY_MAX 128
+#define BENCH_HIST_BUCKETS 24 // Up to 2^23 us, ~8 s
+#define BENCH_HIST_WIDTH 50
+
+typedef enum {
+    STAGE_WRITE,
+    STAGE_RX,
+    STAGE_WAKE,
+    STAGE_DISPATCH,
+    STAGE_TX,
+    STAGE_HOST,
+    STAGE_TOTAL,
+    STAGES
+} BenchStage;
+
+static const char* const STAGE_NAMES[STAGES] = {"write", "rx", "wake", "dispatch", "tx", "host", "total"};
+
+// One PING. ns[] holds -1 for a stage that is not known (yet).
+typedef struct {
+    uint64_t sent_ns;
+    int replied;
+    int lost; // Given up on; a late reply is ignored
+    int64_t ns[STAGES];
+} BenchSample;
+
+typedef struct {
+    int fd;
+    char line[BENCH_REPLY_MAX];
+    size_t len;
+    int in_reply; // Between a '!' and its ';'
+} BenchLink;
+
+static speed_t bench_speed(int baud) {
+    switch (baud) {
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 3000000: return B3000000;
+        case 4000000: return B4000000;
+        default:      return B0;
+    }
+}
+
+// Raw 8N1 at baud, with the adapter's receive batching off (as init_serial_port()).
+static int bench_set_baud(int fd, int baud) {
+    speed_t speed = bench_speed(baud);
+    struct termios options;
+    if (speed == B0 || tcgetattr(fd, &options) != 0) return -1;
+    cfmakeraw(&options);
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    options.c_cflag |= (CLOCAL | CREAD);
+    options.c_cflag &= ~(CSTOPB | CRTSCTS);
+    options.c_cc[VMIN] = 1;
+    options.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &options);
+}
+
+static int bench_open(const char* device, int baud) {
+    int fd = open(device, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(device);
+        return -1;
+    }
+    if (bench_set_baud(fd, baud) != 0) {
+        fprintf(stderr, "%s: cannot set %d baud\n", device, baud);
+        close(fd);
+        return -1;
+    }
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+static int bench_write(int fd, const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Reads the next "!...;" reply into link->line (without the ';'). Returns 1,
+// 0 on timeout, or -1 if the link failed.
+static int bench_read_reply(BenchLink* link, int timeout_ms) {
+    uint64_t deadline = latency_now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    for (;;) {
+        uint8_t byte;
+        ssize_t n = read(link->fd, &byte, 1);
+        if (n == 1) {
+            if (byte == '!') {
+                link->in_reply = 1;
+                link->len = 0;
+            }
+            if (!link->in_reply) continue; // Between replies
+            if (byte == ';') {
+                link->line[link->len] = '\0';
+                link->in_reply = 0;
+                return 1;
+            }
+            if (link->len < sizeof(link->line) - 1) link->line[link->len++] = (char)byte;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) return -1;
+        if (n == 0 && errno != EAGAIN) return -1;
+        uint64_t now = latency_now_ns();
+        if (now >= deadline) return 0;
+        struct pollfd pfd = {.fd = link->fd, .events = POLLIN};
+        if (poll(&pfd, 1, (int)((deadline - now) / 1000000ull) + 1) < 0 && errno != EINTR) return -1;
+    }
+}
+
+// Sends message and waits for a reply starting with prefix.
+static int bench_request(BenchLink* link, const char* message, const char* prefix) {
+    if (bench_write(link->fd, message, strlen(message)) != 0) return -1;
+    for (;;) {
+        int r = bench_read_reply(link, BENCH_TIMEOUT_MS);
+        if (r <= 0) return -1;
+        if (strncmp(link->line, prefix, strlen(prefix)) == 0) return 0;
+    }
+}
+
+static int bench_hello(BenchLink* link, int max_baud, Stm32LinkCaps* caps) {
+    char hello[64];
+    snprintf(hello, sizeof(hello), STM32_HELLO_FMT, STM32_LINK_VERSION, max_baud);
+    if (bench_request(link, hello, STM32_HELLO_REPLY) != 0) return -1;
+    return stm32_parse_hello(link->line, caps);
+}
+
+// Moves both ends to rate, as the controller's BAUD handshake
+static int bench_switch_baud(BenchLink* link, int rate, Stm32LinkCaps* caps) {
+    char baud[48];
+    snprintf(baud, sizeof(baud), STM32_BAUD_FMT, rate);
+    if (bench_request(link, baud, STM32_BAUD_REPLY) != 0) return -1;
+    if (isatty(link->fd) && bench_set_baud(link->fd, rate) != 0) return -1;
+    return bench_hello(link, rate, caps);
+}
+
+static int bench_send_ping(BenchLink* link, uint32_t id, int binary) {
+    if (binary) {
+        uint8_t frame[STM32_FRAME_LEN];
+        if (stm32_encode_frame(STM32_OP_PING, id, 0, 0, frame) != 0) return -1;
+        return bench_write(link->fd, frame, sizeof(frame));
+    }
+    char message[32];
+    int len = snprintf(message, sizeof(message), STM32_PING_FMT, id);
+    return bench_write(link->fd, message, (size_t)len);
+}
+
+static int cmp_i64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_stage(const BenchSample* samples, int count, BenchStage stage, int64_t* scratch) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i].replied && samples[i].ns[stage] >= 0) scratch[n++] = samples[i].ns[stage];
+    }
+    if (n == 0) {
+        printf("%-9s no samples\n", STAGE_NAMES[stage]);
+        return;
+    }
+    qsort(scratch, (size_t)n, sizeof(scratch[0]), cmp_i64);
+    printf("%-9s n=%-6d p50 %9.1f us  p90 %9.1f  p99 %9.1f  max %9.1f\n", STAGE_NAMES[stage], n,
+           scratch[n / 2] / 1e3, scratch[n * 9 / 10] / 1e3, scratch[n * 99 / 100] / 1e3, scratch[n - 1] / 1e3);
+    int buckets[BENCH_HIST_BUCKETS] = {0}, peak = 0, first = BENCH_HIST_BUCKETS, last = 0;
+    for (int i = 0; i < n; i++) {
+        int b = 0;
+        for (int64_t us = scratch[i] / 1000; us > 0 && b < BENCH_HIST_BUCKETS - 1; us >>= 1) b++;
+        if (++buckets[b] > peak) peak = buckets[b];
+        if (b < first) first = b;
+        if (b > last) last = b;
+    }
+    for (int b = first; b <= last; b++) {
+        long lo = b ? 1L << (b - 1) : 0, hi = 1L << b;
+        int bar = (buckets[b] * BENCH_HIST_WIDTH + peak - 1) / peak;
+        printf("  [%7ld, %7ld) us %6d %.*s\n", lo, hi, buckets[b], bar,
+               "##################################################");
+    }
+}
+
+static int write_samples(const char* path, const BenchSample* samples, int count) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "id");
+    for (int s = 0; s < STAGES; s++) fprintf(f, ",%s_ns", STAGE_NAMES[s]);
+    fprintf(f, "\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(f, "%d", i + 1);
+        for (int s = 0; s < STAGES; s++) {
+            if (samples[i].replied && samples[i].ns[s] >= 0) fprintf(f, ",%lld", (long long)samples[i].ns[s]);
+            else fprintf(f, ",");
+        }
+        fprintf(f, "\n");
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [-n COUNT] [-w WINDOW] [-b BAUD] [-s RATE] [--binary] [-o SAMPLES.csv]"
+            " DEVICE | --stm32-sim SPEC\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    int count = 1000, window = 1, baud = BENCH_DEFAULT_BAUD, rate = 0, binary = 0;
+    const char *device = NULL, *sim_spec = NULL, *out_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        const char* opt = argv[i];
+        if (strcmp(opt, "--binary") == 0) {
+            binary = 1;
+        } else if (i + 1 < argc && strcmp(opt, "-n") == 0) {
+            count = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-w") == 0) {
+            window = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-b") == 0) {
+            baud = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-s") == 0) {
+            rate = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-o") == 0) {
+            out_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(opt, "--stm32-sim") == 0) {
+            sim_spec = argv[++i];
+        } else if (opt[0] != '-' && !device) {
+            device = opt;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // PING IDs go out in 16-bit binary fields
+    if ((device != NULL) == (sim_spec != NULL) || count < 1 || count > 65535 || window < 1
+        || window > BENCH_MAX_WINDOW) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    BenchLink link = {.fd = -1};
+    if (sim_spec) {
+        Stm32SimConfig config;
+        if (stm32_sim_parse(sim_spec, &config) != 0 || stm32_sim_start(&config, &link.fd) != 0) {
+            fprintf(stderr, "Cannot start the STM32 sim with '%s'\n", sim_spec);
+            return 1;
+        }
+    } else {
+        link.fd = bench_open(device, baud);
+        if (link.fd < 0) return 1;
+    }
+    int fl = fcntl(link.fd, F_GETFL);
+    fcntl(link.fd, F_SETFL, fl | O_NONBLOCK);
+
+    Stm32LinkCaps caps;
+    int status = 1;
+    BenchSample* samples = calloc((size_t)count, sizeof(BenchSample));
+    int64_t* scratch = calloc((size_t)count, sizeof(int64_t));
+    if (!samples || !scratch) goto out;
+    if (bench_hello(&link, rate > baud ? rate : baud, &caps) != 0) {
+        fprintf(stderr, "No HELLO reply; the firmware predates the handshake or is not at %d baud\n", baud);
+        goto out;
+    }
+    if (rate && rate != baud && bench_switch_baud(&link, rate, &caps) != 0) {
+        fprintf(stderr, "The firmware did not confirm %d baud\n", rate);
+        goto out;
+    }
+    if (!caps.ping || (binary && !caps.binary)) {
+        fprintf(stderr, "Firmware %d does not advertise %s\n", caps.firmware_version, caps.ping ? "BINARY" : "PING");
+        goto out;
+    }
+    printf("Firmware %d, %d PINGs (%s), window %d, %d baud\n", caps.firmware_version, count,
+           binary ? "binary" : "ASCII", window, rate ? rate : baud);
+
+    int next = 0, done = 0, in_flight = 0, lost = 0;
+    while (done < count) {
+        while (next < count && in_flight < window) {
+            BenchSample* s = &samples[next];
+            for (int st = 0; st < STAGES; st++) s->ns[st] = -1;
+            s->sent_ns = latency_now_ns();
+            if (bench_send_ping(&link, (uint32_t)(next + 1), binary) != 0) {
+                perror("write");
+                goto out;
+            }
+            s->ns[STAGE_WRITE] = (int64_t)(latency_now_ns() - s->sent_ns);
+            next++;
+            in_flight++;
+        }
+        int r = bench_read_reply(&link, BENCH_TIMEOUT_MS);
+        if (r < 0) {
+            fprintf(stderr, "Link closed\n");
+            goto out;
+        }
+        if (r == 0) {
+            // Nothing for a whole timeout: whatever is outstanding is lost
+            for (int i = 0; i < next; i++) {
+                if (!samples[i].replied && !samples[i].lost) samples[i].lost = 1;
+            }
+            lost += in_flight;
+            done += in_flight;
+            in_flight = 0;
+            continue;
+        }
+        uint64_t rx_ns = latency_now_ns();
+        uint32_t id;
+        Stm32PingStages stages;
+        if (stm32_parse_ping(link.line, &id, &stages) != 0 || id < 1 || id > (uint32_t)next) continue;
+        BenchSample* s = &samples[id - 1];
+        if (s->replied || s->lost) continue;
+        s->replied = 1;
+        s->ns[STAGE_RX] = stages.rx_ns;
+        s->ns[STAGE_WAKE] = stages.wake_ns;
+        s->ns[STAGE_DISPATCH] = stages.dispatch_ns;
+        s->ns[STAGE_TOTAL] = (int64_t)(rx_ns - s->sent_ns);
+        // The firmware reports the previous reply's transmit time, once it has gone
+        if (id > 1 && stages.prev_tx_ns > 0 && samples[id - 2].replied) {
+            BenchSample* prev = &samples[id - 2];
+            prev->ns[STAGE_TX] = stages.prev_tx_ns;
+            prev->ns[STAGE_HOST] = prev->ns[STAGE_TOTAL] - prev->ns[STAGE_RX] - prev->ns[STAGE_WAKE]
+                                   - prev->ns[STAGE_DISPATCH] - prev->ns[STAGE_TX];
+        }
+        done++;
+        in_flight--;
+    }
+
+    printf("%d replied, %d lost\n", count - lost, lost);
+    for (int st = 0; st < STAGES; st++) print_stage(samples, count, (BenchStage)st, scratch);
+    status = out_path && write_samples(out_path, samples, count) != 0;
+out:
+    free(samples);
+    free(scratch);
+    if (sim_spec) stm32_sim_stop();
+    else if (link.fd >= 0) close(link.fd);
+    return status;
+}
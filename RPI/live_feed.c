@@ -0,0 +1,511 @@
+#define _GNU_SOURCE // accept4
+#include "live_feed.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "json_parser.h"
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+#include "metrics.h"
+#include "rt_profile.h"
+#include "timeline.h"
+
+// Backlog lines handed to one sendmsg()
+#define LIVE_FEED_WRITE_LINES 16
+// Longest subscribe line; a longer one disconnects the subscriber
+#define LIVE_FEED_MAX_REQUEST 256
+#define LIVE_FEED_REQUEST_TOKENS 32
+
+static const char* const LIVE_TOPIC_NAMES[LIVE_TOPICS] = {
+    [LIVE_TOPIC_STATE] = "state",
+    [LIVE_TOPIC_COMMAND] = "command",
+    [LIVE_TOPIC_ROBOT] = "robot",
+    [LIVE_TOPIC_DETECTION] = "detection",
+    [LIVE_TOPIC_REPORT] = "report",
+    [LIVE_TOPIC_POSE] = "pose",
+    [LIVE_TOPIC_TELEMETRY] = "telemetry",
+    [LIVE_TOPIC_QUEUE] = "queue",
+};
+
+// Bounded MPSC queue (Vyukov), as android_tx.c: a slot is free for the producer
+// that claims position pos when seq == pos, and holds its message once seq ==
+// pos + 1. The feed thread hands it back by setting seq to pos + LIVE_FEED_QUEUE_SIZE.
+typedef struct {
+    atomic_size_t seq;
+    LiveTopic topic;
+    size_t len;
+    char data[LIVE_FEED_MAX_MESSAGE];
+} FeedSlot;
+
+static FeedSlot g_slots[LIVE_FEED_QUEUE_SIZE];
+static _Alignas(64) atomic_size_t g_head; // Next position to claim, shared by producers
+static _Alignas(64) size_t g_tail;        // Next position to take, feed thread only
+
+typedef struct {
+    size_t len;
+    char data[LIVE_FEED_MAX_MESSAGE];
+} FeedLine;
+
+// The newest message of a sampled topic. version counts from 1, so a
+// subscriber's sent_version of 0 means it has not had one yet.
+typedef struct {
+    uint64_t version;
+    FeedLine line;
+} FeedSample;
+
+// Feed thread only
+typedef struct {
+    int fd; // -1: slot free
+    uint32_t topics; // Bit per LiveTopic
+    uint64_t period_ns; // Sampled topics: at most one line per period
+    uint64_t next_due_ns[LIVE_TOPICS];
+    uint64_t sent_version[LIVE_TOPICS];
+    FeedLine backlog[LIVE_FEED_BACKLOG]; // Whole lines not yet written
+    unsigned backlog_head;
+    unsigned backlog_count;
+    FeedLine partial; // The rest of a line the socket took only part of
+    size_t partial_off;
+    char request[LIVE_FEED_MAX_REQUEST];
+    size_t request_len;
+} Subscriber;
+
+static Subscriber g_subs[LIVE_FEED_MAX_SUBSCRIBERS];
+static FeedSample g_samples[LIVE_TOPICS];
+static atomic_int g_subscriber_count;
+
+static int g_listen_fd = -1;
+static int g_wakeup_fd = -1;
+static atomic_bool g_running = false;
+static atomic_bool g_feed_idle = false; // Set before the feed thread polls; the next producer posts
+static pthread_t g_feed_thread;
+static uint64_t g_start_ns;
+
+static bool topic_sampled(LiveTopic topic) {
+    return topic >= LIVE_TOPIC_FIRST_SAMPLED;
+}
+
+// --- Producers ---
+
+bool live_feed_active(void) {
+    return atomic_load_explicit(&g_subscriber_count, memory_order_relaxed) > 0;
+}
+
+JsonWriter* live_feed_begin(LiveFeedMessage* msg, LiveTopic topic) {
+    msg->topic = topic;
+    jw_init(&msg->w, msg->buf, sizeof(msg->buf) - 1); // Room for the newline
+    jw_begin_object(&msg->w);
+    jw_key(&msg->w, "topic");
+    jw_string(&msg->w, LIVE_TOPIC_NAMES[topic]);
+    jw_key(&msg->w, "t_ms");
+    jw_uint(&msg->w, (latency_now_ns() - g_start_ns) / 1000000ull);
+    return &msg->w;
+}
+
+// Claims a slot and copies the line into it. Returns -1 if the queue is full.
+static int feed_push(LiveTopic topic, const char* line, size_t len) {
+    size_t pos = atomic_load_explicit(&g_head, memory_order_relaxed);
+    FeedSlot* slot;
+    for (;;) {
+        slot = &g_slots[pos & (LIVE_FEED_QUEUE_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&g_head, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return -1; // The feed thread has not freed this slot yet
+        } else {
+            pos = atomic_load_explicit(&g_head, memory_order_relaxed);
+        }
+    }
+    memcpy(slot->data, line, len);
+    slot->topic = topic;
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+void live_feed_publish(LiveFeedMessage* msg) {
+    if (!atomic_load_explicit(&g_running, memory_order_acquire)) return;
+    jw_end_object(&msg->w);
+    if (!jw_str(&msg->w)) {
+        LOG_DEBUG("[LiveFeed] %s message longer than %d bytes, not sent.\n", LIVE_TOPIC_NAMES[msg->topic],
+                  LIVE_FEED_MAX_MESSAGE);
+        return;
+    }
+    size_t len = jw_len(&msg->w);
+    msg->buf[len++] = '\n';
+    if (feed_push(msg->topic, msg->buf, len) != 0) {
+        metric_inc(METRIC_LIVE_FEED_DROPPED);
+        return;
+    }
+    // Pairs with the feed thread's store-then-check: either it sees the message or we see it idle
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&g_feed_idle, false)) {
+        uint64_t one = 1;
+        if (write(g_wakeup_fd, &one, sizeof(one)) != sizeof(one)) perror("[LiveFeed] eventfd write failed");
+    }
+}
+
+// --- Subscribers (feed thread) ---
+
+static void subscriber_close(Subscriber* sub, const char* why) {
+    LOG_INFO("[LiveFeed] Subscriber %d disconnected (%s).\n", (int)(sub - g_subs), why);
+    close(sub->fd);
+    sub->fd = -1;
+    atomic_fetch_sub(&g_subscriber_count, 1);
+    metric_gauge_add(METRIC_GAUGE_LIVE_FEED_SUBSCRIBERS, -1);
+}
+
+// Appends a line to sub's backlog, dropping the oldest one if it is full.
+static void subscriber_queue(Subscriber* sub, const char* data, size_t len) {
+    if (sub->backlog_count == LIVE_FEED_BACKLOG) {
+        sub->backlog_head = (sub->backlog_head + 1) & (LIVE_FEED_BACKLOG - 1);
+        sub->backlog_count--;
+        metric_inc(METRIC_LIVE_FEED_LINES_DROPPED);
+    }
+    FeedLine* line = &sub->backlog[(sub->backlog_head + sub->backlog_count) & (LIVE_FEED_BACKLOG - 1)];
+    memcpy(line->data, data, len);
+    line->len = len;
+    sub->backlog_count++;
+}
+
+// Queues every sampled topic whose newest value sub has not had and is due for.
+static void subscriber_take_samples(Subscriber* sub, uint64_t now_ns) {
+    for (int t = LIVE_TOPIC_FIRST_SAMPLED; t < LIVE_TOPICS; t++) {
+        const FeedSample* sample = &g_samples[t];
+        if (!(sub->topics & (1u << t)) || sample->version == sub->sent_version[t] || now_ns < sub->next_due_ns[t]) continue;
+        subscriber_queue(sub, sample->line.data, sample->line.len);
+        sub->sent_version[t] = sample->version;
+        sub->next_due_ns[t] = now_ns + sub->period_ns;
+    }
+}
+
+// Writes as much of sub's backlog as its socket takes without blocking.
+// Returns -1 if the subscriber went away (it is then closed).
+static int subscriber_write(Subscriber* sub) {
+    while (sub->partial.len > 0 || sub->backlog_count > 0) {
+        struct iovec iov[LIVE_FEED_WRITE_LINES + 1];
+        int n_iov = 0;
+        if (sub->partial.len > 0) {
+            iov[n_iov++] = (struct iovec){ sub->partial.data + sub->partial_off, sub->partial.len - sub->partial_off };
+        }
+        for (unsigned i = 0; i < sub->backlog_count && n_iov < LIVE_FEED_WRITE_LINES + 1; i++) {
+            FeedLine* line = &sub->backlog[(sub->backlog_head + i) & (LIVE_FEED_BACKLOG - 1)];
+            iov[n_iov++] = (struct iovec){ line->data, line->len };
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)n_iov };
+        ssize_t n = sendmsg(sub->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            subscriber_close(sub, strerror(errno));
+            return -1;
+        }
+        size_t done = (size_t)n;
+        if (sub->partial.len > 0) {
+            size_t rest = sub->partial.len - sub->partial_off;
+            if (done < rest) {
+                sub->partial_off += done;
+                return 0;
+            }
+            done -= rest;
+            sub->partial.len = 0;
+            sub->partial_off = 0;
+        }
+        // Whole lines leave the backlog; one the socket took part of moves to partial,
+        // so dropping the oldest line never cuts one in half
+        while (done > 0) {
+            FeedLine* line = &sub->backlog[sub->backlog_head];
+            size_t take = done < line->len ? done : line->len;
+            if (take < line->len) {
+                memcpy(sub->partial.data, line->data, line->len);
+                sub->partial.len = line->len;
+                sub->partial_off = take;
+            }
+            done -= take;
+            sub->backlog_head = (sub->backlog_head + 1) & (LIVE_FEED_BACKLOG - 1);
+            sub->backlog_count--;
+        }
+    }
+    return 0;
+}
+
+// Applies a subscribe line such as {"topics":["pose"],"max_hz":5}.
+static void subscriber_configure(Subscriber* sub, const char* line, size_t len) {
+    JsonToken tokens[LIVE_FEED_REQUEST_TOKENS];
+    JsonDoc doc;
+    if (json_parse(&doc, line, len, tokens, LIVE_FEED_REQUEST_TOKENS) != 0 || tokens[0].type != JSON_OBJECT) {
+        LOG_WARN("[LiveFeed] Ignoring malformed subscribe line: %.*s\n", (int)len, line);
+        return;
+    }
+    int topics = json_object_get(&doc, 0, "topics");
+    if (topics >= 0 && tokens[topics].type == JSON_ARRAY) {
+        uint32_t mask = 0;
+        for (int i = 0, tok = topics + 1; i < tokens[topics].size; i++, tok = json_next(&doc, tok)) {
+            for (int t = 0; t < LIVE_TOPICS; t++) {
+                if (json_token_equals(&doc, tok, LIVE_TOPIC_NAMES[t])) mask |= 1u << t;
+            }
+        }
+        sub->topics = mask;
+    }
+    int hz;
+    if (json_token_int(&doc, json_object_get(&doc, 0, "max_hz"), &hz) == 0) {
+        if (hz < 1) hz = 1;
+        if (hz > LIVE_FEED_MAX_HZ) hz = LIVE_FEED_MAX_HZ;
+        sub->period_ns = 1000000000ull / (uint64_t)hz;
+        memset(sub->next_due_ns, 0, sizeof(sub->next_due_ns));
+    }
+    LOG_INFO("[LiveFeed] Subscriber %d: topics 0x%02x, sampled at %llu Hz.\n", (int)(sub - g_subs), sub->topics,
+             (unsigned long long)(1000000000ull / sub->period_ns));
+}
+
+// Reads subscribe lines. Returns -1 if the subscriber went away (it is then closed).
+static int subscriber_read(Subscriber* sub) {
+    for (;;) {
+        ssize_t n = recv(sub->fd, sub->request + sub->request_len, sizeof(sub->request) - sub->request_len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) {
+            subscriber_close(sub, n == 0 ? "closed" : strerror(errno));
+            return -1;
+        }
+        sub->request_len += (size_t)n;
+        char* newline;
+        while ((newline = memchr(sub->request, '\n', sub->request_len)) != NULL) {
+            size_t line_len = (size_t)(newline - sub->request);
+            subscriber_configure(sub, sub->request, line_len);
+            sub->request_len -= line_len + 1;
+            memmove(sub->request, newline + 1, sub->request_len);
+        }
+        if (sub->request_len == sizeof(sub->request)) {
+            subscriber_close(sub, "subscribe line too long");
+            return -1;
+        }
+    }
+}
+
+static void feed_accept(void) {
+    for (;;) {
+        int fd = accept4(g_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("[LiveFeed] accept failed");
+            return;
+        }
+        Subscriber* sub = NULL;
+        for (int i = 0; i < LIVE_FEED_MAX_SUBSCRIBERS && !sub; i++) {
+            if (g_subs[i].fd == -1) sub = &g_subs[i];
+        }
+        if (!sub) {
+            LOG_WARN("[LiveFeed] Already %d subscribers, refusing another.\n", LIVE_FEED_MAX_SUBSCRIBERS);
+            close(fd);
+            continue;
+        }
+        memset(sub, 0, sizeof(*sub));
+        sub->fd = fd;
+        sub->topics = (1u << LIVE_TOPICS) - 1;
+        sub->period_ns = 1000000000ull / LIVE_FEED_DEFAULT_HZ;
+        atomic_fetch_add(&g_subscriber_count, 1);
+        metric_gauge_add(METRIC_GAUGE_LIVE_FEED_SUBSCRIBERS, 1);
+        LOG_INFO("[LiveFeed] Subscriber %d connected.\n", (int)(sub - g_subs));
+    }
+}
+
+// --- Feed thread ---
+
+// Hands one message to every subscriber of its topic: straight into the backlog
+// for an event, as the topic's newest value for a sampled one.
+static void feed_dispatch(LiveTopic topic, const char* data, size_t len) {
+    if (topic_sampled(topic)) {
+        FeedSample* sample = &g_samples[topic];
+        memcpy(sample->line.data, data, len);
+        sample->line.len = len;
+        sample->version++;
+        return;
+    }
+    for (int i = 0; i < LIVE_FEED_MAX_SUBSCRIBERS; i++) {
+        if (g_subs[i].fd != -1 && (g_subs[i].topics & (1u << topic))) subscriber_queue(&g_subs[i], data, len);
+    }
+}
+
+static bool feed_queue_ready(void) {
+    const FeedSlot* slot = &g_slots[g_tail & (LIVE_FEED_QUEUE_SIZE - 1)];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == g_tail + 1;
+}
+
+static void feed_drain(void) {
+    while (feed_queue_ready()) {
+        FeedSlot* slot = &g_slots[g_tail & (LIVE_FEED_QUEUE_SIZE - 1)];
+        feed_dispatch(slot->topic, slot->data, slot->len);
+        atomic_store_explicit(&slot->seq, g_tail + LIVE_FEED_QUEUE_SIZE, memory_order_release);
+        g_tail++;
+    }
+}
+
+// Samples the queue gauges as LIVE_TOPIC_QUEUE when any of them changed.
+static void feed_sample_queues(void) {
+    static const MetricGauge gauges[] = { METRIC_GAUGE_IMAGE_QUEUE_DEPTH, METRIC_GAUGE_IMAGE_WORKERS_BUSY,
+                                          METRIC_GAUGE_STM32_IN_FLIGHT, METRIC_GAUGE_ANDROID_UNACKED };
+    static const char* const keys[] = { "image_queue", "images_busy", "stm32_in_flight", "android_unacked" };
+    static int64_t last[sizeof(gauges) / sizeof(gauges[0])];
+    bool changed = g_samples[LIVE_TOPIC_QUEUE].version == 0;
+    int64_t values[sizeof(gauges) / sizeof(gauges[0])];
+    for (size_t i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++) {
+        values[i] = metric_gauge_get(gauges[i]);
+        if (values[i] != last[i]) changed = true;
+        last[i] = values[i];
+    }
+    if (!changed) return;
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_QUEUE);
+    for (size_t i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++) {
+        jw_key(w, keys[i]);
+        jw_int(w, (long)values[i]);
+    }
+    jw_end_object(w);
+    jw_raw(w, "\n", 1);
+    if (jw_str(w)) feed_dispatch(LIVE_TOPIC_QUEUE, msg.buf, jw_len(w));
+}
+
+// Milliseconds until the next sampled line is due for anyone, or -1 if none is waiting.
+static int feed_poll_timeout_ms(uint64_t now_ns, uint64_t next_queue_sample_ns) {
+    uint64_t due = live_feed_active() ? next_queue_sample_ns : 0;
+    for (int i = 0; i < LIVE_FEED_MAX_SUBSCRIBERS; i++) {
+        const Subscriber* sub = &g_subs[i];
+        if (sub->fd == -1) continue;
+        for (int t = LIVE_TOPIC_FIRST_SAMPLED; t < LIVE_TOPICS; t++) {
+            if (!(sub->topics & (1u << t)) || g_samples[t].version == sub->sent_version[t]) continue;
+            if (due == 0 || sub->next_due_ns[t] < due) due = sub->next_due_ns[t];
+        }
+    }
+    if (due == 0) return -1;
+    return due <= now_ns ? 0 : (int)((due - now_ns + 999999) / 1000000);
+}
+
+static void* live_feed_thread(void* args) {
+    (void)args;
+    timeline_thread("live feed");
+    uint64_t next_queue_sample_ns = 0;
+    while (atomic_load(&g_running)) {
+        feed_drain();
+        uint64_t now_ns = latency_now_ns();
+        if (live_feed_active() && now_ns >= next_queue_sample_ns) {
+            feed_sample_queues();
+            next_queue_sample_ns = now_ns + LIVE_FEED_QUEUE_PERIOD_MS * 1000000ull;
+        }
+
+        struct pollfd fds[2 + LIVE_FEED_MAX_SUBSCRIBERS];
+        Subscriber* polled[LIVE_FEED_MAX_SUBSCRIBERS];
+        int n_fds = 2;
+        fds[0] = (struct pollfd){ .fd = g_listen_fd, .events = POLLIN };
+        fds[1] = (struct pollfd){ .fd = g_wakeup_fd, .events = POLLIN };
+        for (int i = 0; i < LIVE_FEED_MAX_SUBSCRIBERS; i++) {
+            Subscriber* sub = &g_subs[i];
+            if (sub->fd == -1) continue;
+            subscriber_take_samples(sub, now_ns);
+            if (subscriber_write(sub) != 0) continue;
+            bool pending = sub->partial.len > 0 || sub->backlog_count > 0;
+            polled[n_fds - 2] = sub;
+            fds[n_fds++] = (struct pollfd){ .fd = sub->fd, .events = POLLIN | (pending ? POLLOUT : 0) };
+        }
+
+        // Announce the wait, then look again: a message published in between
+        // either is seen here or finds g_feed_idle set and writes the eventfd.
+        atomic_store(&g_feed_idle, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (feed_queue_ready() || !atomic_load(&g_running)) {
+            atomic_store(&g_feed_idle, false);
+            continue;
+        }
+        int ready = poll(fds, (nfds_t)n_fds, feed_poll_timeout_ms(now_ns, next_queue_sample_ns));
+        atomic_store(&g_feed_idle, false);
+        if (ready < 0) {
+            if (errno != EINTR) perror("[LiveFeed] poll failed");
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(g_wakeup_fd, &count, sizeof(count)) != sizeof(count)) perror("[LiveFeed] eventfd read failed");
+        }
+        for (int i = 2; i < n_fds; i++) {
+            Subscriber* sub = polled[i - 2];
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (subscriber_read(sub) != 0) continue;
+            }
+            // POLLOUT is served by the subscriber_write() at the top of the loop
+        }
+        if (fds[0].revents & POLLIN) feed_accept();
+    }
+    return NULL;
+}
+
+int live_feed_start(int port) {
+    if (atomic_load(&g_running)) return 0;
+    g_start_ns = latency_now_ns();
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("[LiveFeed] socket failed");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, LIVE_FEED_MAX_SUBSCRIBERS) == -1) {
+        perror("[LiveFeed] bind/listen failed");
+        close(fd);
+        return -1;
+    }
+    g_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_wakeup_fd == -1) {
+        perror("[LiveFeed] eventfd failed");
+        close(fd);
+        return -1;
+    }
+    g_listen_fd = fd;
+    for (size_t i = 0; i < LIVE_FEED_QUEUE_SIZE; i++) atomic_init(&g_slots[i].seq, i);
+    atomic_init(&g_head, 0);
+    g_tail = 0;
+    for (int i = 0; i < LIVE_FEED_MAX_SUBSCRIBERS; i++) g_subs[i].fd = -1;
+    memset(g_samples, 0, sizeof(g_samples));
+    atomic_store(&g_subscriber_count, 0);
+    atomic_store(&g_feed_idle, false);
+    atomic_store(&g_running, true);
+    if (rt_thread_create(&g_feed_thread, RT_ROLE_BACKGROUND, false, live_feed_thread, NULL) != 0) {
+        atomic_store(&g_running, false);
+        LOG_ERROR("[LiveFeed] Could not start the feed thread.\n");
+        close(g_wakeup_fd);
+        close(g_listen_fd);
+        g_wakeup_fd = g_listen_fd = -1;
+        return -1;
+    }
+    LOG_INFO("[LiveFeed] Publishing on TCP port %d.\n", port);
+    return 0;
+}
+
+void live_feed_stop(void) {
+    if (!atomic_exchange(&g_running, false)) return;
+    uint64_t one = 1;
+    if (write(g_wakeup_fd, &one, sizeof(one)) != sizeof(one)) perror("[LiveFeed] eventfd write failed");
+    pthread_join(g_feed_thread, NULL);
+    for (int i = 0; i < LIVE_FEED_MAX_SUBSCRIBERS; i++) {
+        if (g_subs[i].fd != -1) subscriber_close(&g_subs[i], "shutting down");
+    }
+    close(g_wakeup_fd);
+    close(g_listen_fd);
+    g_wakeup_fd = g_listen_fd = -1;
+}
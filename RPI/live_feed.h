@@ -0,0 +1,91 @@
+#ifndef LIVE_FEED_H
+#define LIVE_FEED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "json_writer.h"
+
+/**
+ * @file live_feed.h
+ * @brief Live publish/subscribe feed of the controller's state, for dashboards.
+ *
+ * live_feed_start() listens on a TCP port. Each subscriber that connects gets
+ * one JSON object per line:
+ *
+ *   {"topic":"pose","t_ms":5123,"x_mm":812,"y_mm":-40,"theta_ddeg":900}
+ *
+ * t_ms counts from live_feed_start(). The topics are listed in LiveTopic.
+ * Event topics carry every message. Sampled topics (LIVE_TOPIC_FIRST_SAMPLED
+ * onwards) change faster than anyone can watch them. Each subscriber gets the
+ * latest of those at most max_hz times a second, and a value that changes in
+ * between replaces the one still waiting. A subscriber may send one line at
+ * any time to change what it receives:
+ *
+ *   {"topics":["pose","command"],"max_hz":5}
+ *
+ * Both keys are optional. The defaults are every topic at LIVE_FEED_DEFAULT_HZ.
+ *
+ * Producers never block and never touch a socket. A message is copied into a
+ * bounded lock-free MPSC queue and the feed thread fans it out. A message that
+ * finds the queue full is dropped and counted. Each subscriber has its own
+ * backlog of LIVE_FEED_BACKLOG lines. When a slow reader lets it fill up, the
+ * oldest line is dropped, so what it reads is always recent. Nobody else waits
+ * for it.
+ *
+ *   if (live_feed_active()) {
+ *       LiveFeedMessage msg;
+ *       JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_STATE);
+ *       jw_key(w, "phase"); jw_string(w, "idle");
+ *       live_feed_publish(&msg);
+ *   }
+ */
+
+#define LIVE_FEED_MAX_SUBSCRIBERS 4
+// Longest line, newline included; a message that outgrows it is not sent
+#define LIVE_FEED_MAX_MESSAGE 640
+// Messages between producers and the feed thread; a power of two
+#define LIVE_FEED_QUEUE_SIZE 256
+// Lines waiting for one subscriber's socket; a power of two
+#define LIVE_FEED_BACKLOG 64
+#define LIVE_FEED_DEFAULT_HZ 10
+#define LIVE_FEED_MAX_HZ 200
+// The feed thread itself samples the metrics gauges as LIVE_TOPIC_QUEUE this often
+#define LIVE_FEED_QUEUE_PERIOD_MS 100
+
+typedef enum {
+    LIVE_TOPIC_STATE,     // Mission phase: pathfinding, navigating, idle
+    LIVE_TOPIC_COMMAND,   // A command sent to the STM32, and its outcome
+    LIVE_TOPIC_ROBOT,     // Grid position at each snapshot, as Android gets it
+    LIVE_TOPIC_DETECTION, // Each snapshot's answer
+    LIVE_TOPIC_REPORT,    // Each mission's KPI report (mission_report.h)
+    LIVE_TOPIC_POSE,      // STM32 odometry pose from its replies
+    LIVE_TOPIC_TELEMETRY, // STM32 telemetry frames
+    LIVE_TOPIC_QUEUE,     // Image queue, busy workers, commands in flight
+    LIVE_TOPICS
+} LiveTopic;
+
+#define LIVE_TOPIC_FIRST_SAMPLED LIVE_TOPIC_POSE
+
+typedef struct {
+    JsonWriter w;
+    LiveTopic topic;
+    char buf[LIVE_FEED_MAX_MESSAGE];
+} LiveFeedMessage;
+
+// Starts listening on port and the feed thread. Returns 0, or -1 if the port
+// or thread is unavailable (the feed then stays off).
+int live_feed_start(int port);
+// Disconnects every subscriber and stops the feed thread.
+void live_feed_stop(void);
+
+// Whether anyone is subscribed; publishers skip building messages otherwise.
+bool live_feed_active(void);
+
+// Starts a message on topic: the writer already holds {"topic":..,"t_ms":..
+// and takes the rest of its members.
+JsonWriter* live_feed_begin(LiveFeedMessage* msg, LiveTopic topic);
+// Closes the message and queues it for the subscribers.
+void live_feed_publish(LiveFeedMessage* msg);
+
+#endif // LIVE_FEED_H
@@ -0,0 +1,245 @@
+#include "local_detector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "protocol_keywords.h" // For kw_image_class()
+
+#ifdef HAVE_TFLITE
+#include <tensorflow/lite/c/c_api.h>
+#include <tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h>
+
+struct LocalDetector {
+    TfLiteInterpreter* interpreter;
+    TfLiteDelegate* xnnpack;
+};
+
+static TfLiteModel* g_model;
+static char* g_label_text; // The labels file, one NUL-terminated label per line
+static JsonSpan g_labels[LOCAL_DETECTOR_MAX_LABELS];
+static int g_label_count;
+
+static int load_labels(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    g_label_text = malloc((size_t)size + 1);
+    if (!g_label_text || fread(g_label_text, 1, (size_t)size, f) != (size_t)size) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    g_label_text[size] = '\0';
+
+    g_label_count = 0;
+    char* line = g_label_text;
+    while (*line && g_label_count < LOCAL_DETECTOR_MAX_LABELS) {
+        char* end = strchr(line, '\n');
+        if (end) *end = '\0';
+        int len = (int)strlen(line);
+        if (len > 0 && line[len - 1] == '\r') line[--len] = '\0';
+        g_labels[g_label_count++] = (JsonSpan){ line, len };
+        if (!end) break;
+        line = end + 1;
+    }
+    return g_label_count > 0 ? 0 : -1;
+}
+
+int local_detector_load(const char* model_path, const char* labels_path) {
+    if (access(model_path, R_OK) != 0) {
+        LOG_INFO("[LocalDetector] No model at %s; snapshots go to the server.\n", model_path);
+        return -1;
+    }
+    if (load_labels(labels_path) != 0) {
+        LOG_ERROR("[LocalDetector] Could not read labels from %s.\n", labels_path);
+        local_detector_unload();
+        return -1;
+    }
+    g_model = TfLiteModelCreateFromFile(model_path);
+    if (!g_model) {
+        LOG_ERROR("[LocalDetector] Could not load model %s.\n", model_path);
+        local_detector_unload();
+        return -1;
+    }
+    LOG_INFO("[LocalDetector] Loaded %s with %d labels.\n", model_path, g_label_count);
+    return 0;
+}
+
+void local_detector_unload(void) {
+    if (g_model) TfLiteModelDelete(g_model);
+    g_model = NULL;
+    free(g_label_text);
+    g_label_text = NULL;
+    g_label_count = 0;
+}
+
+bool local_detector_available(void) {
+    return g_model != NULL;
+}
+
+LocalDetector* local_detector_create(void) {
+    if (!g_model) return NULL;
+    LocalDetector* detector = calloc(1, sizeof(*detector));
+    if (!detector) return NULL;
+    TfLiteXNNPackDelegateOptions xnnpack_options = TfLiteXNNPackDelegateOptionsDefault();
+    xnnpack_options.num_threads = LOCAL_DETECTOR_THREADS;
+    detector->xnnpack = TfLiteXNNPackDelegateCreate(&xnnpack_options);
+
+    TfLiteInterpreterOptions* options = TfLiteInterpreterOptionsCreate();
+    TfLiteInterpreterOptionsSetNumThreads(options, LOCAL_DETECTOR_THREADS);
+    if (detector->xnnpack) TfLiteInterpreterOptionsAddDelegate(options, detector->xnnpack);
+    detector->interpreter = TfLiteInterpreterCreate(g_model, options);
+    TfLiteInterpreterOptionsDelete(options);
+
+    if (!detector->interpreter || TfLiteInterpreterAllocateTensors(detector->interpreter) != kTfLiteOk) {
+        LOG_ERROR("[LocalDetector] Could not build an interpreter for the model.\n");
+        local_detector_destroy(detector);
+        return NULL;
+    }
+    const TfLiteTensor* input = TfLiteInterpreterGetInputTensor(detector->interpreter, 0);
+    if (TfLiteTensorNumDims(input) != 4 || TfLiteTensorDim(input, 3) != 3) {
+        LOG_ERROR("[LocalDetector] Model input is not [1, height, width, 3].\n");
+        local_detector_destroy(detector);
+        return NULL;
+    }
+    return detector;
+}
+
+void local_detector_destroy(LocalDetector* detector) {
+    if (!detector) return;
+    if (detector->interpreter) TfLiteInterpreterDelete(detector->interpreter);
+    if (detector->xnnpack) TfLiteXNNPackDelegateDelete(detector->xnnpack);
+    free(detector);
+}
+
+// Resizes image into the input tensor (nearest neighbour; the decode has already
+// box-filtered it to about the model's width) in the tensor's own number format.
+static void fill_input(TfLiteTensor* input, const ImageRgb* image) {
+    int height = TfLiteTensorDim(input, 1), width = TfLiteTensorDim(input, 2);
+    TfLiteType type = TfLiteTensorType(input);
+    TfLiteQuantizationParams q = TfLiteTensorQuantizationParams(input);
+    uint8_t* data = (uint8_t*)TfLiteTensorData(input);
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = image->pixels + (size_t)(y * image->height / height) * image->width * 3;
+        for (int x = 0; x < width; x++) {
+            const uint8_t* px = row + (size_t)(x * image->width / width) * 3;
+            size_t at = ((size_t)y * width + x) * 3;
+            for (int c = 0; c < 3; c++) {
+                if (type == kTfLiteFloat32) {
+                    ((float*)data)[at + c] = (px[c] - LOCAL_DETECTOR_INPUT_MEAN) / LOCAL_DETECTOR_INPUT_STD;
+                } else if (type == kTfLiteInt8) {
+                    // Quantised from [0, 1]; scale 1/255 and zero point -128 for the usual models
+                    int v = q.scale > 0 ? (int)(px[c] / 255.0f / q.scale + q.zero_point + 0.5f) : px[c] - 128;
+                    ((int8_t*)data)[at + c] = (int8_t)(v < -128 ? -128 : v > 127 ? 127 : v);
+                } else {
+                    data[at + c] = px[c];
+                }
+            }
+        }
+    }
+}
+
+static float output_value(const TfLiteTensor* tensor, int index) {
+    const void* data = TfLiteTensorData(tensor);
+    TfLiteQuantizationParams q = TfLiteTensorQuantizationParams(tensor);
+    switch (TfLiteTensorType(tensor)) {
+    case kTfLiteFloat32: return ((const float*)data)[index];
+    case kTfLiteUInt8: return (((const uint8_t*)data)[index] - q.zero_point) * q.scale;
+    case kTfLiteInt8: return (((const int8_t*)data)[index] - q.zero_point) * q.scale;
+    default: return 0.0f;
+    }
+}
+
+// Keeps class if it has a label that maps to an image ID and beats *out.
+static bool consider(int class_index, float score, bool found, Detection* out) {
+    if (class_index < 0 || class_index >= g_label_count) return false;
+    if (found && score <= out->confidence) return false;
+    JsonSpan label = g_labels[class_index];
+    int img_id = kw_image_class(label.ptr, (size_t)label.len);
+    if (img_id < 0) return false;
+    out->img_id = img_id;
+    out->confidence = score;
+    out->class_label = label;
+    out->has_bbox = false;
+    return true;
+}
+
+int local_detect(LocalDetector* detector, ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                 Detection* out) {
+    TfLiteInterpreter* interpreter = detector->interpreter;
+    TfLiteTensor* input = TfLiteInterpreterGetInputTensor(interpreter, 0);
+    ImageRgb image;
+    // Decode no smaller than the model wants; fill_input() does the rest
+    if (image_decode_rgb(pre, frame, NULL, TfLiteTensorDim(input, 2) * 2 - 1, &image) != 0) return -1;
+    fill_input(input, &image);
+    if (TfLiteInterpreterInvoke(interpreter) != kTfLiteOk) {
+        LOG_ERROR("[LocalDetector] Inference failed.\n");
+        return -1;
+    }
+
+    bool found = false;
+    if (TfLiteInterpreterGetOutputTensorCount(interpreter) >= 4) {
+        // TFLite_Detection_PostProcess: boxes [1, N, 4] (ymin, xmin, ymax, xmax in 0..1), classes, scores, count
+        const TfLiteTensor* boxes = TfLiteInterpreterGetOutputTensor(interpreter, 0);
+        const TfLiteTensor* classes = TfLiteInterpreterGetOutputTensor(interpreter, 1);
+        const TfLiteTensor* scores = TfLiteInterpreterGetOutputTensor(interpreter, 2);
+        int count = (int)output_value(TfLiteInterpreterGetOutputTensor(interpreter, 3), 0);
+        if (count > TfLiteTensorDim(scores, 1)) count = TfLiteTensorDim(scores, 1);
+        for (int i = 0; i < count; i++) {
+            if (!consider((int)output_value(classes, i), output_value(scores, i), found, out)) continue;
+            found = true;
+            // Back to frame pixels, as the server reports them
+            out->has_bbox = true;
+            out->bbox[0] = image.crop.x + output_value(boxes, i * 4 + 1) * image.crop.width;
+            out->bbox[1] = image.crop.y + output_value(boxes, i * 4 + 0) * image.crop.height;
+            out->bbox[2] = image.crop.x + output_value(boxes, i * 4 + 3) * image.crop.width;
+            out->bbox[3] = image.crop.y + output_value(boxes, i * 4 + 2) * image.crop.height;
+        }
+    } else {
+        const TfLiteTensor* scores = TfLiteInterpreterGetOutputTensor(interpreter, 0);
+        int classes = TfLiteTensorDim(scores, TfLiteTensorNumDims(scores) - 1);
+        for (int c = 0; c < classes; c++) {
+            if (consider(c, output_value(scores, c), found, out)) found = true;
+        }
+    }
+    return found ? 0 : -1;
+}
+
+#else // !HAVE_TFLITE
+
+struct LocalDetector {
+    int unused;
+};
+
+int local_detector_load(const char* model_path, const char* labels_path) {
+    (void)labels_path;
+    LOG_WARN("[LocalDetector] Built without TFLite (-DHAVE_TFLITE); ignoring %s.\n", model_path);
+    return -1;
+}
+
+void local_detector_unload(void) {}
+
+bool local_detector_available(void) {
+    return false;
+}
+
+LocalDetector* local_detector_create(void) {
+    return NULL;
+}
+
+void local_detector_destroy(LocalDetector* detector) {
+    (void)detector;
+}
+
+int local_detect(LocalDetector* detector, ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                 Detection* out) {
+    (void)detector; (void)pre; (void)frame; (void)out;
+    return -1;
+}
+
+#endif // HAVE_TFLITE
@@ -0,0 +1,61 @@
+#ifndef LOCAL_DETECTOR_H
+#define LOCAL_DETECTOR_H
+
+#include <stdbool.h>
+
+#include "image_preprocess.h" // For ImagePreprocessor
+#include "json_parser.h"      // For Detection
+#include "rpi_hal.h"          // For struct MemoryStruct
+
+/**
+ * @file local_detector.h
+ * @brief On-Pi image recognition, so a snapshot survives a Wi-Fi dropout.
+ *
+ * Runs a TensorFlow Lite model with the XNNPACK delegate (NEON kernels on the
+ * Pi) on each frame and returns the same Detection the image server's reply
+ * parses into. Build with -DHAVE_TFLITE and link -ltensorflowlite_c; without it
+ * local_detector_load() fails and every snapshot goes to the server.
+ *
+ * Two model shapes are accepted:
+ * - Detection models ending in TFLite_Detection_PostProcess (four outputs:
+ *   boxes, classes, scores, count). These report a bbox.
+ * - Classifiers with a single [1, classes] score output.
+ * Inputs are [1, height, width, 3], as uint8, int8 or float32 (normalised with
+ * LOCAL_DETECTOR_INPUT_MEAN and LOCAL_DETECTOR_INPUT_STD). Line i of the labels
+ * file names class i. img_id comes from the label through kw_image_class(), as
+ * for server replies, so labels use the server's names ("Number 3", "Up Arrow",
+ * ...).
+ *
+ * The model is loaded once and shared. Each image worker gets its own
+ * interpreter, since an interpreter must not be used from two threads at once.
+ */
+
+#ifndef LOCAL_DETECTOR_INPUT_MEAN
+#define LOCAL_DETECTOR_INPUT_MEAN 127.5f
+#endif
+#ifndef LOCAL_DETECTOR_INPUT_STD
+#define LOCAL_DETECTOR_INPUT_STD 127.5f
+#endif
+// Threads per interpreter; each worker is pinned to its own core
+#define LOCAL_DETECTOR_THREADS 1
+#define LOCAL_DETECTOR_MAX_LABELS 64
+
+typedef struct LocalDetector LocalDetector;
+
+// Loads the model and its labels for every worker. Returns 0, or -1 if either
+// cannot be read or the build has no TFLite.
+int local_detector_load(const char* model_path, const char* labels_path);
+void local_detector_unload(void);
+bool local_detector_available(void);
+
+// One interpreter for the calling worker. Returns NULL if none could be built.
+LocalDetector* local_detector_create(void);
+void local_detector_destroy(LocalDetector* detector);
+
+// Recognises the most confident object in frame (a JPEG), decoding it into pre.
+// Returns 0 with *out filled (its class_label points at the loaded labels), or
+// -1 if nothing with a known label was found or the frame could not be decoded.
+int local_detect(LocalDetector* detector, ImagePreprocessor* pre, const struct MemoryStruct* frame,
+                 Detection* out);
+
+#endif // LOCAL_DETECTOR_H
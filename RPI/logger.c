@@ -0,0 +1,504 @@
+#include "logger.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Per-thread ring capacity; a power of two
+#define LOG_RING_SIZE (64 * 1024)
+// Largest single record. Longer string arguments are cut to fit and end in "..."
+#define LOG_MAX_RECORD (16 * 1024)
+// Kept free for the arguments after a long string
+#define LOG_ARG_RESERVE 256
+#define LOG_FLUSH_INTERVAL_MS 10
+#define LOG_SPEC_MAX 48
+
+// Filler from a record that would wrap to the end of the ring; the record itself
+// follows at offset 0.
+#define LOG_RECORD_PAD 0xFF
+
+// Records are 8-byte aligned: this header, then one 8-byte slot per argument in
+// format order ('*' widths and precisions included). A string is a length slot
+// followed by its bytes, padded to 8.
+typedef struct {
+    uint32_t size;  // Whole record, a multiple of 8
+    uint8_t level;  // LogLevel or LOG_RECORD_PAD
+    uint8_t reserved[3];
+    uint64_t t_ns;  // CLOCK_MONOTONIC, orders records across rings
+    const char* format;
+} LogRecord;
+
+#define LOG_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define LOG_HEADER_SIZE LOG_ALIGN(sizeof(LogRecord))
+
+// Single producer (the owning thread), single consumer (the flusher).
+typedef struct {
+    _Alignas(64) atomic_size_t head; // Advanced by the owner
+    _Alignas(64) atomic_size_t tail; // Advanced by the flusher
+    atomic_uint dropped;
+    atomic_bool in_use;
+    _Alignas(8) unsigned char data[LOG_RING_SIZE];
+    _Alignas(8) unsigned char scratch[LOG_MAX_RECORD]; // Owner only: records are built here
+} LogRing;
+
+static LogRing g_rings[LOG_MAX_THREADS];
+static _Thread_local LogRing* t_ring;
+static pthread_key_t g_ring_key;
+static pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_int g_level = LOG_LEVEL_INFO;
+static atomic_bool g_running = false;
+static pthread_t g_flusher;
+// Posted when a ring passes half full, so a burst is drained before the next tick
+static sem_t g_flush_wakeup;
+
+void log_set_level(LogLevel level) {
+    atomic_store(&g_level, (int)level);
+}
+
+bool log_enabled(LogLevel level) {
+    return (int)level >= atomic_load_explicit(&g_level, memory_order_relaxed);
+}
+
+int log_parse_level(const char* name, LogLevel* level) {
+    static const char* const names[] = { "debug", "info", "warn", "error" };
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (LogLevel)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// --- Format walking ---
+// The writer and the flusher walk the format the same way, so both agree on
+// which slot belongs to which conversion.
+
+typedef struct {
+    const char* flags;
+    int flags_len;
+    const char* width; // Digits or "*"
+    int width_len;
+    const char* precision; // Digits or "*" after the '.'
+    int precision_len;     // -1 if there is no '.'
+    char length;           // 0, 'H' (hh), 'h', 'l', 'L' (ll), 'z', 'j', 't' or 'D' (long double)
+    char conversion;       // 0 if unsupported
+} LogSpec;
+
+// Scans the conversion starting just after a '%'. Returns the byte after it.
+static const char* log_scan_spec(const char* p, LogSpec* s) {
+    memset(s, 0, sizeof(*s));
+    s->precision_len = -1;
+    s->flags = p;
+    while (*p && strchr("-+ #0", *p)) p++;
+    s->flags_len = (int)(p - s->flags);
+    s->width = p;
+    if (*p == '*') p++;
+    else while (*p >= '0' && *p <= '9') p++;
+    s->width_len = (int)(p - s->width);
+    if (*p == '.') {
+        s->precision = ++p;
+        if (*p == '*') p++;
+        else while (*p >= '0' && *p <= '9') p++;
+        s->precision_len = (int)(p - s->precision);
+    }
+    switch (*p) {
+        case 'h': s->length = p[1] == 'h' ? 'H' : 'h'; p += p[1] == 'h' ? 2 : 1; break;
+        case 'l': s->length = p[1] == 'l' ? 'L' : 'l'; p += p[1] == 'l' ? 2 : 1; break;
+        case 'z': case 'j': case 't': s->length = *p++; break;
+        case 'L': s->length = 'D'; p++; break;
+        default: break;
+    }
+    if (*p && strchr("diuoxXcsfFeEgGaApn%", *p)) s->conversion = *p++;
+    return p;
+}
+
+// --- Writer side ---
+
+static void log_put_slot(unsigned char* buf, size_t* pos, const void* value) {
+    if (*pos + 8 > LOG_MAX_RECORD) return;
+    memcpy(buf + *pos, value, 8);
+    *pos += 8;
+}
+
+static int64_t log_arg_signed(va_list* ap, char length) {
+    switch (length) {
+        case 'H': return (signed char)va_arg(*ap, int);
+        case 'h': return (short)va_arg(*ap, int);
+        case 'l': return va_arg(*ap, long);
+        case 'L': return va_arg(*ap, long long);
+        case 'z': return va_arg(*ap, ssize_t);
+        case 'j': return va_arg(*ap, intmax_t);
+        case 't': return va_arg(*ap, ptrdiff_t);
+        default: return va_arg(*ap, int);
+    }
+}
+
+static uint64_t log_arg_unsigned(va_list* ap, char length) {
+    switch (length) {
+        case 'H': return (unsigned char)va_arg(*ap, unsigned int);
+        case 'h': return (unsigned short)va_arg(*ap, unsigned int);
+        case 'l': return va_arg(*ap, unsigned long);
+        case 'L': return va_arg(*ap, unsigned long long);
+        case 'z': return va_arg(*ap, size_t);
+        case 'j': return va_arg(*ap, uintmax_t);
+        case 't': return (uint64_t)va_arg(*ap, ptrdiff_t);
+        default: return va_arg(*ap, unsigned int);
+    }
+}
+
+// Copies a string argument, cut to what is left of the record.
+static void log_put_string(unsigned char* buf, size_t* pos, const char* s, int precision) {
+    if (!s) s = "(null)";
+    size_t n = precision >= 0 ? strnlen(s, (size_t)precision) : strlen(s);
+    size_t room = LOG_MAX_RECORD - LOG_ARG_RESERVE > *pos + 8 ? LOG_MAX_RECORD - LOG_ARG_RESERVE - *pos - 8 : 0;
+    bool cut = n > room;
+    if (cut) n = room;
+    uint64_t len = n;
+    log_put_slot(buf, pos, &len);
+    if (*pos + LOG_ALIGN(n) > LOG_MAX_RECORD) return;
+    memcpy(buf + *pos, s, n);
+    if (cut && n >= 3) memcpy(buf + *pos + n - 3, "...", 3);
+    *pos += LOG_ALIGN(n);
+}
+
+// Builds the record for format and its arguments in buf. Returns its size.
+static size_t log_encode(unsigned char* buf, LogLevel level, const char* format, va_list ap_in) {
+    va_list ap;
+    va_copy(ap, ap_in);
+    size_t pos = LOG_HEADER_SIZE;
+    for (const char* p = format; *p;) {
+        if (*p++ != '%') continue;
+        LogSpec spec;
+        p = log_scan_spec(p, &spec);
+        if (spec.conversion == 0) break; // Rest is printed as text
+        if (spec.conversion == '%') continue;
+
+        if (spec.width_len == 1 && spec.width[0] == '*') {
+            int64_t width = va_arg(ap, int);
+            log_put_slot(buf, &pos, &width);
+        }
+        int precision = -1;
+        if (spec.precision_len == 1 && spec.precision[0] == '*') {
+            precision = va_arg(ap, int);
+            int64_t slot = precision;
+            log_put_slot(buf, &pos, &slot);
+        } else if (spec.precision_len >= 0) {
+            precision = atoi(spec.precision); // "." alone is 0
+        }
+
+        switch (spec.conversion) {
+            case 'd': case 'i': {
+                int64_t v = log_arg_signed(&ap, spec.length);
+                log_put_slot(buf, &pos, &v);
+                break;
+            }
+            case 'u': case 'o': case 'x': case 'X': {
+                uint64_t v = log_arg_unsigned(&ap, spec.length);
+                log_put_slot(buf, &pos, &v);
+                break;
+            }
+            case 'c': {
+                int64_t v = va_arg(ap, int);
+                log_put_slot(buf, &pos, &v);
+                break;
+            }
+            case 's':
+                log_put_string(buf, &pos, va_arg(ap, const char*), precision);
+                break;
+            case 'p': {
+                uint64_t v = (uintptr_t)va_arg(ap, void*);
+                log_put_slot(buf, &pos, &v);
+                break;
+            }
+            case 'n':
+                (void)va_arg(ap, void*); // Nothing to count into after the fact
+                break;
+            default: { // Floating point
+                double v = spec.length == 'D' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                log_put_slot(buf, &pos, &v);
+                break;
+            }
+        }
+    }
+    va_end(ap);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    LogRecord header = {
+        .size = (uint32_t)pos,
+        .level = (uint8_t)level,
+        .t_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec,
+        .format = format,
+    };
+    memcpy(buf, &header, sizeof(header));
+    return pos;
+}
+
+static void log_release_ring(void* ring) {
+    atomic_store(&((LogRing*)ring)->in_use, false);
+}
+
+static void log_make_key(void) {
+    pthread_key_create(&g_ring_key, log_release_ring);
+}
+
+// Returns the calling thread's ring, claiming a free one on first use, or NULL
+// if all are taken.
+static LogRing* log_thread_ring(void) {
+    if (t_ring) return t_ring;
+    pthread_once(&g_ring_key_once, log_make_key);
+    for (int i = 0; i < LOG_MAX_THREADS; i++) {
+        bool expected = false;
+        if (!atomic_load_explicit(&g_rings[i].in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&g_rings[i].in_use, &expected, true)) {
+            t_ring = &g_rings[i];
+            pthread_setspecific(g_ring_key, t_ring);
+            return t_ring;
+        }
+    }
+    return NULL;
+}
+
+// Appends a record built in the ring's scratch buffer, or counts it as dropped.
+static void log_push(LogRing* ring, size_t size) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t offset = head & (LOG_RING_SIZE - 1);
+    size_t to_end = LOG_RING_SIZE - offset;
+    size_t total = size <= to_end ? size : to_end + size;
+    if (LOG_RING_SIZE - (head - tail) < total) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (size > to_end) {
+        // Only the size and level of a filler are read, and both fit in 8 bytes
+        uint32_t pad_size = (uint32_t)to_end;
+        memcpy(ring->data + offset, &pad_size, sizeof(pad_size));
+        ring->data[offset + offsetof(LogRecord, level)] = LOG_RECORD_PAD;
+        offset = 0;
+    }
+    memcpy(ring->data + offset, ring->scratch, size);
+    atomic_store_explicit(&ring->head, head + total, memory_order_release);
+    if (head - tail < LOG_RING_SIZE / 2 && head + total - tail >= LOG_RING_SIZE / 2) sem_post(&g_flush_wakeup);
+}
+
+void log_write(LogLevel level, const char* format, ...) {
+    if (!log_enabled(level)) return;
+    va_list ap;
+    va_start(ap, format);
+    LogRing* ring = atomic_load_explicit(&g_running, memory_order_acquire) ? log_thread_ring() : NULL;
+    if (!ring) {
+        vfprintf(level >= LOG_LEVEL_WARN ? stderr : stdout, format, ap);
+        va_end(ap);
+        return;
+    }
+    size_t size = log_encode(ring->scratch, level, format, ap);
+    va_end(ap);
+    log_push(ring, size);
+}
+
+// --- Flusher side ---
+
+static bool log_take_slot(const unsigned char* args, size_t len, size_t* pos, void* value) {
+    if (*pos + 8 > len) return false;
+    memcpy(value, args + *pos, 8);
+    *pos += 8;
+    return true;
+}
+
+static int log_append(char* spec, int at, const char* s, int n) {
+    if (n < 0 || at + n >= LOG_SPEC_MAX) return LOG_SPEC_MAX;
+    memcpy(spec + at, s, (size_t)n);
+    return at + n;
+}
+
+// Formats one record. Stops at the first argument the record does not hold.
+static void log_print_record(FILE* out, const LogRecord* record) {
+    const unsigned char* args = (const unsigned char*)record;
+    size_t len = record->size;
+    size_t pos = LOG_HEADER_SIZE;
+    const char* p = record->format;
+    while (*p) {
+        const char* pct = strchr(p, '%');
+        if (!pct) {
+            fputs(p, out);
+            return;
+        }
+        fwrite(p, 1, (size_t)(pct - p), out);
+        LogSpec s;
+        p = log_scan_spec(pct + 1, &s);
+        if (s.conversion == 0) {
+            fputs(pct, out);
+            return;
+        }
+        if (s.conversion == '%') {
+            fputc('%', out);
+            continue;
+        }
+        if (s.conversion == 'n') continue;
+
+        // Rebuild the conversion with '*' values filled in and integers widened
+        char spec[LOG_SPEC_MAX];
+        char number[24];
+        int at = log_append(spec, 0, "%", 1);
+        at = log_append(spec, at, s.flags, s.flags_len);
+        int64_t star;
+        if (s.width_len == 1 && s.width[0] == '*') {
+            if (!log_take_slot(args, len, &pos, &star)) return;
+            at = log_append(spec, at, number, snprintf(number, sizeof(number), "%d", (int)star));
+        } else {
+            at = log_append(spec, at, s.width, s.width_len);
+        }
+        if (s.precision_len >= 0) {
+            if (s.precision_len == 1 && s.precision[0] == '*') {
+                if (!log_take_slot(args, len, &pos, &star)) return;
+                if (star >= 0 && s.conversion != 's') {
+                    at = log_append(spec, at, number, snprintf(number, sizeof(number), ".%d", (int)star));
+                }
+            } else if (s.conversion != 's') {
+                at = log_append(spec, at, ".", 1);
+                at = log_append(spec, at, s.precision, s.precision_len);
+            }
+        }
+        if (s.conversion == 's') at = log_append(spec, at, ".*", 2); // Strings are stored cut to length
+        if (strchr("diuoxX", s.conversion)) at = log_append(spec, at, "ll", 2);
+        at = log_append(spec, at, &s.conversion, 1);
+        if (at >= LOG_SPEC_MAX) {
+            fputs(pct, out);
+            return;
+        }
+        spec[at] = '\0';
+
+        uint64_t slot;
+        if (!log_take_slot(args, len, &pos, &slot)) return;
+        switch (s.conversion) {
+            case 'd': case 'i': case 'c': {
+                int64_t v;
+                memcpy(&v, &slot, sizeof(v));
+                if (s.conversion == 'c') fprintf(out, spec, (int)v);
+                else fprintf(out, spec, (long long)v);
+                break;
+            }
+            case 'u': case 'o': case 'x': case 'X':
+                fprintf(out, spec, (unsigned long long)slot);
+                break;
+            case 's':
+                if (pos + LOG_ALIGN(slot) > len) return;
+                fprintf(out, spec, (int)slot, (const char*)args + pos);
+                pos += LOG_ALIGN(slot);
+                break;
+            case 'p':
+                fprintf(out, spec, (void*)(uintptr_t)slot);
+                break;
+            default: {
+                double v;
+                memcpy(&v, &slot, sizeof(v));
+                fprintf(out, spec, v);
+                break;
+            }
+        }
+    }
+}
+
+// Returns the ring's oldest record below head, skipping fillers, or NULL.
+static const LogRecord* log_peek(LogRing* ring, size_t head) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail != head) {
+        const unsigned char* at = ring->data + (tail & (LOG_RING_SIZE - 1));
+        uint32_t size;
+        memcpy(&size, at, sizeof(size));
+        if (at[offsetof(LogRecord, level)] != LOG_RECORD_PAD) return (const LogRecord*)at;
+        tail += size;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return NULL;
+}
+
+// Writes out every record queued so far, oldest first across all rings.
+// Returns the number written. Only the flusher (or log_stop() after it) calls this.
+static int log_drain(void) {
+    size_t heads[LOG_MAX_THREADS];
+    for (int i = 0; i < LOG_MAX_THREADS; i++) {
+        heads[i] = atomic_load_explicit(&g_rings[i].head, memory_order_acquire);
+    }
+    int written = 0;
+    for (;;) {
+        int oldest = -1;
+        const LogRecord* record = NULL;
+        for (int i = 0; i < LOG_MAX_THREADS; i++) {
+            const LogRecord* r = log_peek(&g_rings[i], heads[i]);
+            if (r && (!record || r->t_ns < record->t_ns)) {
+                record = r;
+                oldest = i;
+            }
+        }
+        if (!record) break;
+        log_print_record(record->level >= LOG_LEVEL_WARN ? stderr : stdout, record);
+        atomic_fetch_add_explicit(&g_rings[oldest].tail, record->size, memory_order_release);
+        written++;
+    }
+    for (int i = 0; i < LOG_MAX_THREADS; i++) {
+        unsigned int dropped = atomic_exchange_explicit(&g_rings[i].dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            fprintf(stderr, "[Log] Ring %d full, dropped %u messages.\n", i, dropped);
+            written++;
+        }
+    }
+    if (written > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+static void* log_flusher_thread(void* args) {
+    (void)args;
+    while (atomic_load(&g_running)) {
+        if (log_drain() > 0) continue;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (sem_timedwait(&g_flush_wakeup, &deadline) == -1 && errno == EINTR) {}
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    if (atomic_load(&g_running)) return 0;
+    pthread_once(&g_ring_key_once, log_make_key);
+    if (sem_init(&g_flush_wakeup, 0, 0) != 0) {
+        perror("[Log] sem_init failed, logging synchronously");
+        return -1;
+    }
+    atomic_store(&g_running, true);
+    if (pthread_create(&g_flusher, NULL, log_flusher_thread, NULL) != 0) {
+        atomic_store(&g_running, false);
+        sem_destroy(&g_flush_wakeup);
+        fprintf(stderr, "[Log] Could not start the log flusher, logging synchronously.\n");
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&g_running, false)) return;
+    sem_post(&g_flush_wakeup);
+    pthread_join(g_flusher, NULL);
+    log_drain();
+    sem_destroy(&g_flush_wakeup);
+}
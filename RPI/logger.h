@@ -0,0 +1,59 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+
+/**
+ * @file logger.h
+ * @brief Asynchronous logging for the controller's threads.
+ *
+ * LOG_INFO() and friends take a printf format and its arguments but do not
+ * format them. The calling thread copies the format pointer, a timestamp and the
+ * raw arguments (strings by value) into its own lock-free ring and returns. A
+ * flusher thread started by log_start() drains every ring in timestamp order,
+ * formats the records and writes them to stdout (DEBUG, INFO) or stderr (WARN,
+ * ERROR), so no thread waits on a slow terminal or SSH session.
+ *
+ * Logging never blocks: a record that does not fit in its thread's ring is
+ * dropped and the flusher reports how many were lost. Formats must be string
+ * literals, since they are read after the call returns.
+ *
+ * Before log_start(), after log_stop(), and on threads beyond LOG_MAX_THREADS,
+ * messages are printed directly by the caller.
+ */
+
+typedef enum {
+    LOG_LEVEL_DEBUG, // Raw traffic: every frame, payload and server reply
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+// Threads that can log concurrently through rings. A ring is released when its
+// thread exits, so short-lived threads reuse them.
+#define LOG_MAX_THREADS 16
+
+// Starts the flusher. Returns 0 on success, -1 if the thread could not be created
+// (messages are then printed directly).
+int log_start(void);
+
+// Writes out everything still queued and stops the flusher.
+void log_stop(void);
+
+// Messages below level are discarded at the call site. Defaults to LOG_LEVEL_INFO.
+void log_set_level(LogLevel level);
+bool log_enabled(LogLevel level);
+
+// Maps "debug", "info", "warn" or "error" to a level. Returns 0, or -1 if unknown.
+int log_parse_level(const char* name, LogLevel* level);
+
+void log_write(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Arguments are not evaluated when the level is disabled.
+#define LOG_AT(level, ...) do { if (log_enabled(level)) log_write((level), __VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif // LOGGER_H
@@ -0,0 +1,230 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+
+// Largest snapshot; well inside one UDP datagram
+#define METRICS_REPLY_MAX 4096
+
+typedef struct {
+    atomic_ullong buckets[METRIC_HIST_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum_us;
+    atomic_ullong max_us;
+} MetricHist;
+
+static atomic_ullong g_counters[METRIC_COUNTERS];
+static atomic_llong g_gauges[METRIC_GAUGES];
+static MetricHist g_hists[METRIC_HISTS];
+static uint64_t g_start_ns;
+
+static const char* const METRIC_COUNTER_NAMES[METRIC_COUNTERS] = {
+    [METRIC_ANDROID_MSGS_RX] = "android_msgs_rx",
+    [METRIC_ANDROID_MSGS_TX] = "android_msgs_tx",
+    [METRIC_ANDROID_TX_DROPPED] = "android_tx_dropped",
+    [METRIC_ANDROID_RETRANSMITS] = "android_retransmits",
+    [METRIC_ANDROID_WRITES] = "android_writes",
+    [METRIC_ANDROID_WRITE_FAILURES] = "android_write_failures",
+    [METRIC_STM32_FRAMES_RX] = "stm32_frames_rx",
+    [METRIC_STM32_CMDS_SENT] = "stm32_cmds_sent",
+    [METRIC_STM32_DONE] = "stm32_done",
+    [METRIC_STM32_ERRORS] = "stm32_errors",
+    [METRIC_STM32_ACK_TIMEOUTS] = "stm32_ack_timeouts",
+    [METRIC_STM32_CREDIT_STALLS] = "stm32_credit_stalls",
+    [METRIC_STM32_RESETS] = "stm32_resets",
+    [METRIC_STM32_FAULTS] = "stm32_faults",
+    [METRIC_STM32_TELEMETRY_RX] = "stm32_telemetry_rx",
+    [METRIC_SNAPSHOTS_QUEUED] = "snapshots_queued",
+    [METRIC_IMAGE_UPLOADS] = "image_uploads",
+    [METRIC_IMAGE_UPLOAD_FAILURES] = "image_upload_failures",
+    [METRIC_IMAGE_DETECTIONS] = "image_detections",
+    [METRIC_IMAGE_LOCAL_DETECTIONS] = "image_local_detections",
+    [METRIC_ROUTE_SWAPS] = "route_swaps",
+    [METRIC_ROUTE_CORRECTIONS] = "route_corrections",
+    [METRIC_SNAPSHOT_RETRIES] = "snapshot_retries",
+    [METRIC_RETRIES_PLANNED_AHEAD] = "retries_planned_ahead",
+    [METRIC_LIVE_FEED_DROPPED] = "live_feed_dropped",
+    [METRIC_LIVE_FEED_LINES_DROPPED] = "live_feed_lines_dropped",
+    [METRIC_SERIAL_WRITES] = "serial_writes",
+    [METRIC_SERIAL_STALLS] = "serial_stalls",
+    [METRIC_STM32_PROGRESS_RX] = "stm32_progress_rx",
+    [METRIC_CAMERA_PREARMS] = "camera_prearms",
+    [METRIC_APPROACH_FRAMES] = "approach_frames",
+    [METRIC_APPROACH_DETECTIONS] = "approach_detections",
+    [METRIC_ROUTE_CHECK_FAILURES] = "route_check_failures",
+    [METRIC_ROUTE_REPAIRS] = "route_repairs",
+    [METRIC_IMAGE_FRAMES_REJECTED] = "image_frames_rejected",
+    [METRIC_IMAGE_RECAPTURES] = "image_recaptures",
+    [METRIC_CAPTURE_TIMEOUTS] = "capture_timeouts",
+    [METRIC_SETTLE_TIMEOUTS] = "settle_timeouts",
+    [METRIC_SENSED_REPLANS] = "sensed_replans",
+};
+
+static const char* const METRIC_GAUGE_NAMES[METRIC_GAUGES] = {
+    [METRIC_GAUGE_NAV_STATE] = "nav_state",
+    [METRIC_GAUGE_STM32_IN_FLIGHT] = "stm32_in_flight",
+    [METRIC_GAUGE_IMAGE_QUEUE_DEPTH] = "image_queue_depth",
+    [METRIC_GAUGE_IMAGE_WORKERS_BUSY] = "image_workers_busy",
+    [METRIC_GAUGE_ANDROID_UNACKED] = "android_unacked",
+    [METRIC_GAUGE_HEADING_DRIFT_DDEG] = "heading_drift_ddeg",
+    [METRIC_GAUGE_UPLOAD_WIDTH] = "upload_width",
+    [METRIC_GAUGE_UPLOAD_QUALITY] = "upload_quality",
+    [METRIC_GAUGE_LIVE_FEED_SUBSCRIBERS] = "live_feed_subscribers",
+    [METRIC_GAUGE_STM32_CLOCK_RTT_US] = "stm32_clock_rtt_us",
+    [METRIC_GAUGE_STM32_CLOCK_DRIFT_PPB] = "stm32_clock_drift_ppb",
+    [METRIC_GAUGE_SOC_TEMP_MC] = "soc_temp_mc",
+    [METRIC_GAUGE_CPU_FREQ_KHZ] = "cpu_freq_khz",
+    [METRIC_GAUGE_SOC_THROTTLED] = "soc_throttled",
+    [METRIC_GAUGE_SENSED_CELLS] = "sensed_cells",
+    [METRIC_GAUGE_STM32_BOOT_MS] = "stm32_boot_ms",
+};
+
+static const char* const METRIC_HIST_NAMES[METRIC_HISTS] = {
+    [METRIC_HIST_STM32_ACK_US] = "stm32_ack_us",
+    [METRIC_HIST_ANDROID_WRITE_US] = "android_write_us",
+    [METRIC_HIST_IMAGE_UPLOAD_US] = "image_upload_us",
+    [METRIC_HIST_IMAGE_SHM_US] = "image_shm_us",
+    [METRIC_HIST_LOCAL_INFER_US] = "local_infer_us",
+    [METRIC_HIST_SNAPSHOT_US] = "snapshot_us",
+    [METRIC_HIST_ACK_TO_NEXT_CMD_US] = "stm32_ack_to_next_cmd_us",
+};
+
+void metric_inc(MetricCounter counter) {
+    atomic_fetch_add_explicit(&g_counters[counter], 1, memory_order_relaxed);
+}
+
+uint64_t metric_counter_get(MetricCounter counter) {
+    return atomic_load_explicit(&g_counters[counter], memory_order_relaxed);
+}
+
+void metric_gauge_set(MetricGauge gauge, int64_t value) {
+    atomic_store_explicit(&g_gauges[gauge], value, memory_order_relaxed);
+}
+
+void metric_gauge_add(MetricGauge gauge, int64_t delta) {
+    atomic_fetch_add_explicit(&g_gauges[gauge], delta, memory_order_relaxed);
+}
+
+int64_t metric_gauge_get(MetricGauge gauge) {
+    return atomic_load_explicit(&g_gauges[gauge], memory_order_relaxed);
+}
+
+void metric_observe_us(MetricHistogram hist, uint64_t us) {
+    MetricHist* h = &g_hists[hist];
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= METRIC_HIST_BUCKETS) bucket = METRIC_HIST_BUCKETS - 1;
+    atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_us, us, memory_order_relaxed);
+    // Several image workers record into the same histograms
+    unsigned long long max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(&h->max_us, &max, us, memory_order_relaxed,
+                                                              memory_order_relaxed)) {}
+}
+
+void metric_observe_since(MetricHistogram hist, uint64_t start_ns) {
+    uint64_t now = latency_now_ns();
+    metric_observe_us(hist, now > start_ns ? (now - start_ns) / 1000 : 0);
+}
+
+void metrics_write_json(JsonWriter* w) {
+    jw_begin_object(w);
+    jw_key(w, "uptime_ms");
+    jw_uint(w, g_start_ns ? (latency_now_ns() - g_start_ns) / 1000000 : 0);
+
+    jw_key(w, "counters");
+    jw_begin_object(w);
+    for (int i = 0; i < METRIC_COUNTERS; i++) {
+        jw_key(w, METRIC_COUNTER_NAMES[i]);
+        jw_uint(w, atomic_load_explicit(&g_counters[i], memory_order_relaxed));
+    }
+    jw_end_object(w);
+
+    jw_key(w, "gauges");
+    jw_begin_object(w);
+    for (int i = 0; i < METRIC_GAUGES; i++) {
+        jw_key(w, METRIC_GAUGE_NAMES[i]);
+        jw_int(w, (long)atomic_load_explicit(&g_gauges[i], memory_order_relaxed));
+    }
+    jw_end_object(w);
+
+    jw_key(w, "bucket_ge_us");
+    jw_begin_array(w);
+    for (int b = 0; b < METRIC_HIST_BUCKETS; b++) jw_uint(w, b == 0 ? 0 : 1ULL << (b - 1));
+    jw_end_array(w);
+
+    jw_key(w, "histograms");
+    jw_begin_object(w);
+    for (int i = 0; i < METRIC_HISTS; i++) {
+        MetricHist* h = &g_hists[i];
+        jw_key(w, METRIC_HIST_NAMES[i]);
+        jw_begin_object(w);
+        jw_key(w, "count");
+        jw_uint(w, atomic_load_explicit(&h->count, memory_order_relaxed));
+        jw_key(w, "sum");
+        jw_uint(w, atomic_load_explicit(&h->sum_us, memory_order_relaxed));
+        jw_key(w, "max");
+        jw_uint(w, atomic_load_explicit(&h->max_us, memory_order_relaxed));
+        jw_key(w, "buckets");
+        jw_begin_array(w);
+        for (int b = 0; b < METRIC_HIST_BUCKETS; b++) jw_uint(w, atomic_load_explicit(&h->buckets[b], memory_order_relaxed));
+        jw_end_array(w);
+        jw_end_object(w);
+    }
+    jw_end_object(w);
+    jw_end_object(w);
+}
+
+int metrics_open_socket(int port) {
+    g_start_ns = latency_now_ns();
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("[Metrics] socket failed");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("[Metrics] bind failed");
+        close(fd);
+        return -1;
+    }
+    LOG_INFO("[Metrics] Serving snapshots on UDP port %d.\n", port);
+    return fd;
+}
+
+void metrics_serve(int fd) {
+    for (;;) {
+        char request[64];
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        ssize_t n = recvfrom(fd, request, sizeof(request), 0, (struct sockaddr*)&peer, &peer_len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("[Metrics] recvfrom failed");
+            return;
+        }
+        char reply[METRICS_REPLY_MAX];
+        JsonWriter w;
+        jw_init(&w, reply, sizeof(reply));
+        metrics_write_json(&w);
+        if (!jw_str(&w)) {
+            LOG_ERROR("[Metrics] Snapshot exceeds %d bytes, not sent.\n", METRICS_REPLY_MAX);
+            continue;
+        }
+        if (sendto(fd, reply, jw_len(&w), 0, (struct sockaddr*)&peer, peer_len) < 0 && errno != EAGAIN) {
+            perror("[Metrics] sendto failed");
+        }
+    }
+}
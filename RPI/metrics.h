@@ -0,0 +1,121 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "json_writer.h"
+
+/**
+ * @file metrics.h
+ * @brief Live counters, gauges and histograms for a run in progress.
+ *
+ * Any thread updates a metric with one relaxed atomic operation, so the nav,
+ * reactor and image paths record as they go. The I/O reactor answers every
+ * datagram sent to METRICS_UDP_PORT with a JSON snapshot of all of them;
+ * metrics_cli.py polls it:
+ *
+ *   {"uptime_ms":..,"counters":{"stm32_cmds_sent":..,..},"gauges":{"nav_state":..,..},
+ *    "bucket_ge_us":[0,1,2,4,..],"histograms":{"stm32_ack_us":{"count":..,"sum":..,"max":..,"buckets":[..]},..}}
+ *
+ * Counters and histograms run for the life of the process; gauges hold the
+ * latest value set.
+ */
+
+typedef enum {
+    METRIC_ANDROID_MSGS_RX,
+    METRIC_ANDROID_MSGS_TX,     // Queued for the writer (android_tx.h)
+    METRIC_ANDROID_TX_DROPPED,  // Queue full
+    METRIC_ANDROID_RETRANSMITS, // Sequenced messages sent again after their timeout
+    METRIC_ANDROID_WRITES,      // write() calls; one carries every message queued meanwhile
+    METRIC_ANDROID_WRITE_FAILURES,
+    METRIC_STM32_FRAMES_RX,
+    METRIC_STM32_CMDS_SENT,
+    METRIC_STM32_DONE,
+    METRIC_STM32_ERRORS,
+    METRIC_STM32_ACK_TIMEOUTS,
+    METRIC_STM32_CREDIT_STALLS, // A windowed command waited for room in the firmware's queue
+    METRIC_STM32_RESETS,        // The firmware's watchdog (or a fault) rebooted it mid-mission
+    METRIC_STM32_FAULTS,        // The firmware gave up on a command it could not finish (a stall)
+    METRIC_STM32_TELEMETRY_RX,
+    METRIC_SNAPSHOTS_QUEUED,
+    METRIC_IMAGE_UPLOADS,
+    METRIC_IMAGE_UPLOAD_FAILURES,
+    METRIC_IMAGE_DETECTIONS,
+    METRIC_IMAGE_LOCAL_DETECTIONS, // Frames the on-Pi model recognised
+    METRIC_ROUTE_SWAPS,            // Mid-mission map updates swapped into the running route
+    METRIC_ROUTE_CORRECTIONS,      // Commands resized for the error earlier DONEs reported
+    METRIC_SNAPSHOT_RETRIES,       // Failed snapshots rerouted to another face of the obstacle
+    METRIC_RETRIES_PLANNED_AHEAD,  // Of those reroutes, planned while the robot drove (speculative retries)
+    METRIC_LIVE_FEED_DROPPED,      // Live feed messages that found its queue full (live_feed.h)
+    METRIC_LIVE_FEED_LINES_DROPPED, // Oldest lines dropped from a slow subscriber's backlog
+    METRIC_SERIAL_WRITES,          // writev() calls to either link; one carries every frame queued meanwhile
+    METRIC_SERIAL_STALLS,          // Writes that found the link full and waited for it (serial_tx.h)
+    METRIC_STM32_PROGRESS_RX,      // PROGRESS events during moves and turns (stm32_protocol.h)
+    METRIC_CAMERA_PREARMS,         // Captures the camera was readied for before the robot stopped
+    METRIC_APPROACH_FRAMES,        // Frames looked at while approaching a snapshot
+    METRIC_APPROACH_DETECTIONS,    // Snapshots answered on the way in, without a stop
+    METRIC_ROUTE_CHECK_FAILURES,   // Routes the pre-drive simulation found colliding or off their snap positions
+    METRIC_ROUTE_REPAIRS,          // Of those, replaced by the native planner's route
+    METRIC_IMAGE_FRAMES_REJECTED,  // Burst frames the quality gate kept from the detector
+    METRIC_IMAGE_RECAPTURES,       // Frames captured again because the first was blurred or badly exposed
+    METRIC_CAPTURE_TIMEOUTS,       // Snapshots the nav thread gave up waiting for the capture of
+    METRIC_SETTLE_TIMEOUTS,        // Snapshots taken without the firmware's SETTLED
+    METRIC_SENSED_REPLANS,         // Routes swapped for one around what the range sensor found ahead
+    METRIC_COUNTERS
+} MetricCounter;
+
+typedef enum {
+    METRIC_GAUGE_NAV_STATE, // SystemState
+    METRIC_GAUGE_STM32_IN_FLIGHT,
+    METRIC_GAUGE_IMAGE_QUEUE_DEPTH,
+    METRIC_GAUGE_IMAGE_WORKERS_BUSY,
+    METRIC_GAUGE_ANDROID_UNACKED, // Sequenced messages Android has not acked
+    METRIC_GAUGE_HEADING_DRIFT_DDEG, // STM32 odometry heading minus the route's, 0.1 degree
+    METRIC_GAUGE_UPLOAD_WIDTH,       // Largest width the last frame could be shrunk to
+    METRIC_GAUGE_UPLOAD_QUALITY,     // JPEG quality it was encoded at
+    METRIC_GAUGE_LIVE_FEED_SUBSCRIBERS,
+    METRIC_GAUGE_STM32_CLOCK_RTT_US,    // Best SYNC round trip kept (clock_sync.h)
+    METRIC_GAUGE_STM32_CLOCK_DRIFT_PPB, // Pi clock rate over the STM32's, less 1
+    METRIC_GAUGE_SOC_TEMP_MC,           // SoC temperature, millidegrees C (soc_monitor.h); -1 unknown
+    METRIC_GAUGE_CPU_FREQ_KHZ,          // ARM clock now
+    METRIC_GAUGE_SOC_THROTTLED,         // Firmware throttle flags (SOC_THROTTLE_*)
+    METRIC_GAUGE_SENSED_CELLS,          // Cells the range sensor found blocked off the map (occupancy_map.h)
+    METRIC_GAUGE_STM32_BOOT_MS,         // ms from the STM32's last boot to its READY
+    METRIC_GAUGES
+} MetricGauge;
+
+typedef enum {
+    METRIC_HIST_STM32_ACK_US,       // Command sent -> !id/DONE
+    METRIC_HIST_ANDROID_WRITE_US,   // One write() to the Bluetooth link
+    METRIC_HIST_IMAGE_UPLOAD_US,    // Upload started -> server reply
+    METRIC_HIST_IMAGE_SHM_US,       // Frame handed to the shared-memory detector -> its result
+    METRIC_HIST_LOCAL_INFER_US,     // One frame through the on-Pi model, decode included
+    METRIC_HIST_SNAPSHOT_US,        // Snapshot dequeued by a worker -> result sent to Android
+    METRIC_HIST_ACK_TO_NEXT_CMD_US, // DONE that freed a full window -> next command written
+    METRIC_HISTS
+} MetricHistogram;
+
+// Bucket 0 counts 0 us; bucket b counts [2^(b-1), 2^b) us. The last bucket also
+// takes everything above (from ~4.2 s).
+#define METRIC_HIST_BUCKETS 24
+
+void metric_inc(MetricCounter counter);
+uint64_t metric_counter_get(MetricCounter counter);
+void metric_gauge_set(MetricGauge gauge, int64_t value);
+void metric_gauge_add(MetricGauge gauge, int64_t delta);
+int64_t metric_gauge_get(MetricGauge gauge);
+void metric_observe_us(MetricHistogram hist, uint64_t us);
+// Records the time from start_ns (CLOCK_MONOTONIC, see latency_now_ns()) to now.
+void metric_observe_since(MetricHistogram hist, uint64_t start_ns);
+
+// Appends the JSON snapshot described above.
+void metrics_write_json(JsonWriter* w);
+
+// Opens a non-blocking UDP socket on port (all interfaces) for metrics_serve().
+// Returns the fd, or -1 on failure.
+int metrics_open_socket(int port);
+
+// Answers every pending request on fd with a snapshot. Returns without blocking.
+void metrics_serve(int fd);
+
+#endif // METRICS_H
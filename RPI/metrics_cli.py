@@ -0,0 +1,108 @@
+"""
+Polls the controller's metrics endpoint (metrics.h) and prints counters, gauges
+and histogram percentiles. Any datagram sent to the port is answered with one
+JSON snapshot.
+
+    python3 metrics_cli.py --host 192.168.22.22            # one snapshot
+    python3 metrics_cli.py --host 192.168.22.22 --watch 1  # refresh every second
+    python3 metrics_cli.py --json                          # raw snapshot
+
+With --watch, counters are also shown as a rate over the last interval.
+"""
+import argparse
+import json
+import socket
+import sys
+import time
+
+DEFAULT_PORT = 5600  # METRICS_UDP_PORT in multithread_communication.c
+NAV_STATES = {0: "IDLE", 1: "PATHFINDING", 2: "NAVIGATING", 3: "ERROR"}
+
+
+def fetch(host, port, timeout):
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+        sock.settimeout(timeout)
+        sock.sendto(b"metrics", (host, port))
+        data, _ = sock.recvfrom(65536)
+    return json.loads(data)
+
+
+def percentile_us(bounds, buckets, count, q):
+    """Upper edge of the bucket holding quantile q, or None without samples."""
+    if count == 0:
+        return None
+    rank = min(int(q * count), count - 1)
+    seen = 0
+    for i, n in enumerate(buckets):
+        seen += n
+        if seen > rank:
+            return bounds[i + 1] if i + 1 < len(bounds) else bounds[i] * 2
+    return bounds[-1] * 2
+
+
+def fmt_ms(us):
+    return "-" if us is None else f"{us / 1000:.1f}"
+
+
+def render(snap, previous, interval):
+    lines = [f"uptime {snap['uptime_ms'] / 1000:.1f} s"]
+    lines.append("")
+    gauges = snap["gauges"]
+    for name, value in gauges.items():
+        if name == "nav_state":
+            value = NAV_STATES.get(value, value)
+        lines.append(f"  {name:<24} {value}")
+    lines.append("")
+    for name, value in snap["counters"].items():
+        rate = ""
+        if previous and interval > 0:
+            rate = f"{(value - previous['counters'].get(name, 0)) / interval:8.1f}/s"
+        lines.append(f"  {name:<24} {value:>10} {rate}")
+    lines.append("")
+    bounds = snap["bucket_ge_us"]
+    lines.append(f"  {'histogram':<18} {'n':>7} {'mean ms':>9} {'p50 ms':>9} {'p95 ms':>9} {'p99 ms':>9} {'max ms':>9}")
+    for name, h in snap["histograms"].items():
+        count = h["count"]
+        mean = h["sum"] / count if count else None
+        p = [percentile_us(bounds, h["buckets"], count, q) for q in (0.50, 0.95, 0.99)]
+        # A bucket edge can overshoot the largest sample
+        p = [None if v is None else min(v, h["max"]) for v in p]
+        lines.append(f"  {name:<18} {count:>7} {fmt_ms(mean):>9} {fmt_ms(p[0]):>9} {fmt_ms(p[1]):>9} "
+                     f"{fmt_ms(p[2]):>9} {fmt_ms(h['max'] if count else None):>9}")
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=DEFAULT_PORT)
+    parser.add_argument("--watch", type=float, metavar="SECONDS", help="Poll repeatedly at this interval")
+    parser.add_argument("--json", action="store_true", help="Print the raw snapshot")
+    parser.add_argument("--timeout", type=float, default=1.0)
+    args = parser.parse_args()
+
+    previous, previous_t = None, None
+    while True:
+        try:
+            snap = fetch(args.host, args.port, args.timeout)
+        except (socket.timeout, OSError) as e:
+            print(f"No reply from {args.host}:{args.port} ({e})", file=sys.stderr)
+            if not args.watch:
+                return 1
+            time.sleep(args.watch)
+            continue
+        now = time.monotonic()
+        if args.json:
+            print(json.dumps(snap))
+        else:
+            if args.watch:
+                print("\033[H\033[J", end="")  # Clear the terminal between refreshes
+            print(render(snap, previous, now - previous_t if previous_t else 0))
+        if not args.watch:
+            return 0
+        previous, previous_t = snap, now
+        time.sleep(args.watch)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
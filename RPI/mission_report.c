@@ -0,0 +1,271 @@
+#include "mission_report.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "soc_monitor.h"
+
+#define NS_PER_MS 1000000ULL
+
+// Counters a report takes its mission's share of, in MissionReport's order
+static const MetricCounter REPORT_COUNTERS[] = {
+    METRIC_SNAPSHOT_RETRIES, METRIC_IMAGE_RECAPTURES, METRIC_STM32_RESETS,
+    METRIC_STM32_ACK_TIMEOUTS, METRIC_CAPTURE_TIMEOUTS, METRIC_SETTLE_TIMEOUTS,
+};
+#define REPORT_COUNTER_COUNT (sizeof(REPORT_COUNTERS) / sizeof(REPORT_COUNTERS[0]))
+
+static const char* const OUTCOME_NAMES[] = {"complete", "aborted", "no_route"};
+
+typedef struct {
+    bool open;    // Between begin and completion
+    bool ended;   // mission_report_end() called
+    bool aborted;
+    bool ready;   // Complete, not yet taken
+    uint64_t arena_ns, route_ns, end_ns, last_answer_ns;
+    uint64_t first_sent_ns, busy_ns, settle_ns, snapshot_ns;
+    uint64_t counters_at_begin[REPORT_COUNTER_COUNT];
+    int pending; // Snapshots queued and not yet answered
+    MissionReport report;
+} ReportState;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static ReportState g_state;
+
+static int64_t span_ms(uint64_t from_ns, uint64_t to_ns) {
+    if (from_ns == 0 || to_ns < from_ns) return -1;
+    return (int64_t)((to_ns - from_ns) / NS_PER_MS);
+}
+
+static MissionTarget* target_for(MissionReport* r, int obstacle_id) {
+    for (int i = 0; i < r->target_count; i++) {
+        if (r->targets[i].obstacle_id == obstacle_id) return &r->targets[i];
+    }
+    if (r->target_count >= MAX_OBSTACLES) return NULL;
+    MissionTarget* t = &r->targets[r->target_count++];
+    memset(t, 0, sizeof(*t));
+    t->obstacle_id = obstacle_id;
+    t->target_ms = -1;
+    return t;
+}
+
+// Fills in the totals and marks the report ready. Caller holds g_lock.
+static void complete_locked(void) {
+    ReportState* s = &g_state;
+    MissionReport* r = &s->report;
+    if (!s->route_ns) r->outcome = MISSION_NO_ROUTE;
+    else r->outcome = s->aborted ? MISSION_ABORTED : MISSION_COMPLETE;
+    r->plan_ms = span_ms(s->arena_ns, s->route_ns);
+    r->start_ms = span_ms(s->route_ns, s->first_sent_ns);
+    r->motion_ms = (int64_t)(s->busy_ns / NS_PER_MS);
+    r->settle_ms = (int64_t)(s->settle_ns / NS_PER_MS);
+    r->snapshot_ms = (int64_t)(s->snapshot_ns / NS_PER_MS);
+    uint64_t last_ns = s->end_ns > s->last_answer_ns ? s->end_ns : s->last_answer_ns;
+    r->total_ms = span_ms(s->arena_ns, last_ns);
+    r->unanswered = s->pending > 0 ? s->pending : 0;
+
+    uint64_t delta[REPORT_COUNTER_COUNT];
+    for (size_t i = 0; i < REPORT_COUNTER_COUNT; i++) {
+        delta[i] = metric_counter_get(REPORT_COUNTERS[i]) - s->counters_at_begin[i];
+    }
+    r->snapshot_retries = (unsigned)delta[0];
+    r->recaptures = (unsigned)delta[1];
+    r->stm32_resets = (unsigned)delta[2];
+    r->ack_timeouts = (unsigned)delta[3];
+    r->capture_timeouts = (unsigned)delta[4];
+    r->settle_timeouts = (unsigned)delta[5];
+
+    SocWindow soc;
+    soc_window_get(&soc);
+    r->soc_temp_max_mc = soc.temp_max_mc;
+    r->cpu_freq_min_mhz = soc.freq_min_khz < 0 ? -1 : soc.freq_min_khz / 1000;
+    r->throttled = soc.throttled;
+
+    s->open = false;
+    s->ready = true;
+}
+
+bool mission_report_begin(unsigned epoch, uint64_t arena_ns, MissionReport* unfinished) {
+    bool flushed = false;
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open && g_state.ended) {
+        complete_locked();
+        if (unfinished) *unfinished = g_state.report;
+        flushed = true;
+    }
+    memset(&g_state, 0, sizeof(g_state));
+    g_state.open = true;
+    g_state.arena_ns = arena_ns;
+    g_state.report.mission = epoch;
+    for (size_t i = 0; i < REPORT_COUNTER_COUNT; i++) {
+        g_state.counters_at_begin[i] = metric_counter_get(REPORT_COUNTERS[i]);
+    }
+    soc_window_begin();
+    pthread_mutex_unlock(&g_lock);
+    return flushed;
+}
+
+void mission_report_route_ready(uint64_t ns) {
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open && !g_state.route_ns) g_state.route_ns = ns;
+    pthread_mutex_unlock(&g_lock);
+}
+
+void mission_report_snapshot_wait(uint64_t started_ns, uint64_t ended_ns) {
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open && ended_ns > started_ns) g_state.snapshot_ns += ended_ns - started_ns;
+    pthread_mutex_unlock(&g_lock);
+}
+
+void mission_report_snapshot_queued(int obstacle_id) {
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open) {
+        MissionTarget* t = target_for(&g_state.report, obstacle_id);
+        if (t) t->attempts++;
+        g_state.pending++;
+    }
+    pthread_mutex_unlock(&g_lock);
+}
+
+bool mission_report_answered(unsigned epoch, int obstacle_id, bool detected, uint64_t capture_ns, uint64_t answered_ns) {
+    bool completed = false;
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open && g_state.report.mission == epoch) {
+        MissionTarget* t = target_for(&g_state.report, obstacle_id);
+        if (t) {
+            t->answered = true;
+            if (detected && !t->detected) {
+                t->detected = true;
+                t->target_ms = (int32_t)span_ms(capture_ns, answered_ns);
+            }
+        }
+        if (g_state.pending > 0) g_state.pending--;
+        if (answered_ns > g_state.last_answer_ns) g_state.last_answer_ns = answered_ns;
+        if (g_state.ended && g_state.pending == 0) {
+            complete_locked();
+            completed = true;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return completed;
+}
+
+void mission_report_abort(void) {
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open) g_state.aborted = true;
+    pthread_mutex_unlock(&g_lock);
+}
+
+bool mission_report_end(uint64_t ns, uint64_t first_sent_ns, uint64_t busy_ns, uint64_t settle_ns) {
+    bool completed = false;
+    pthread_mutex_lock(&g_lock);
+    if (g_state.open && !g_state.ended) {
+        g_state.ended = true;
+        g_state.end_ns = ns;
+        if (g_state.route_ns) { // Otherwise the totals are the last mission's
+            g_state.first_sent_ns = first_sent_ns;
+            g_state.busy_ns = busy_ns;
+            g_state.settle_ns = settle_ns;
+        }
+        // A stopped mission's outstanding answers are not worth waiting for
+        if (g_state.aborted || !g_state.route_ns || g_state.pending == 0) {
+            complete_locked();
+            completed = true;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return completed;
+}
+
+bool mission_report_take(MissionReport* out) {
+    pthread_mutex_lock(&g_lock);
+    bool ready = g_state.ready;
+    if (ready) {
+        *out = g_state.report;
+        g_state.ready = false;
+    }
+    pthread_mutex_unlock(&g_lock);
+    return ready;
+}
+
+void mission_report_write_json(JsonWriter* w, const MissionReport* r) {
+    jw_key(w, "mission");
+    jw_uint(w, r->mission);
+    jw_key(w, "outcome");
+    jw_string(w, OUTCOME_NAMES[r->outcome]);
+    jw_key(w, "plan_ms");
+    jw_int(w, (long)r->plan_ms);
+    jw_key(w, "start_ms");
+    jw_int(w, (long)r->start_ms);
+    jw_key(w, "motion_ms");
+    jw_int(w, (long)r->motion_ms);
+    jw_key(w, "settle_ms");
+    jw_int(w, (long)r->settle_ms);
+    jw_key(w, "snapshot_ms");
+    jw_int(w, (long)r->snapshot_ms);
+    jw_key(w, "total_ms");
+    jw_int(w, (long)r->total_ms);
+    // Compact [id, ms] pairs; ms is -1 for an obstacle with no TARGET
+    jw_key(w, "targets");
+    jw_begin_array(w);
+    for (int i = 0; i < r->target_count; i++) {
+        jw_begin_array(w);
+        jw_int(w, r->targets[i].obstacle_id);
+        jw_int(w, r->targets[i].target_ms);
+        jw_end_array(w);
+    }
+    jw_end_array(w);
+    jw_key(w, "unanswered");
+    jw_int(w, r->unanswered);
+    jw_key(w, "retries");
+    jw_uint(w, r->snapshot_retries);
+    jw_key(w, "recaptures");
+    jw_uint(w, r->recaptures);
+    jw_key(w, "resets");
+    jw_uint(w, r->stm32_resets);
+    jw_key(w, "ack_timeouts");
+    jw_uint(w, r->ack_timeouts);
+    jw_key(w, "capture_timeouts");
+    jw_uint(w, r->capture_timeouts);
+    jw_key(w, "settle_timeouts");
+    jw_uint(w, r->settle_timeouts);
+    jw_key(w, "soc_temp_max_mc");
+    jw_int(w, r->soc_temp_max_mc);
+    jw_key(w, "cpu_freq_min_mhz");
+    jw_int(w, r->cpu_freq_min_mhz);
+    jw_key(w, "throttled");
+    jw_uint(w, r->throttled);
+}
+
+int mission_report_append_csv(const char* path, const MissionReport* r) {
+    struct stat st;
+    bool fresh = stat(path, &st) != 0 || st.st_size == 0;
+    FILE* f = fopen(path, "a");
+    if (!f) {
+        LOG_ERROR("[Report] Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fresh) {
+        fprintf(f, "mission,outcome,plan_ms,start_ms,motion_ms,settle_ms,snapshot_ms,total_ms,"
+                   "targets,unanswered,retries,recaptures,resets,ack_timeouts,capture_timeouts,"
+                   "settle_timeouts,soc_temp_max_mc,cpu_freq_min_mhz,throttled\n");
+    }
+    fprintf(f, "%u,%s,%lld,%lld,%lld,%lld,%lld,%lld,", r->mission, OUTCOME_NAMES[r->outcome],
+            (long long)r->plan_ms, (long long)r->start_ms, (long long)r->motion_ms,
+            (long long)r->settle_ms, (long long)r->snapshot_ms, (long long)r->total_ms);
+    // "id:ms" pairs separated by spaces, so the column needs no quoting
+    for (int i = 0; i < r->target_count; i++) {
+        fprintf(f, "%s%d:%d", i ? " " : "", r->targets[i].obstacle_id, (int)r->targets[i].target_ms);
+    }
+    fprintf(f, ",%d,%u,%u,%u,%u,%u,%u,%d,%d,0x%x\n", r->unanswered, r->snapshot_retries, r->recaptures,
+            r->stm32_resets, r->ack_timeouts, r->capture_timeouts, r->settle_timeouts,
+            (int)r->soc_temp_max_mc, (int)r->cpu_freq_min_mhz, (unsigned)r->throttled);
+    int rc = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0) rc = -1;
+    if (rc != 0) LOG_ERROR("[Report] Failed writing %s.\n", path);
+    return rc;
+}
@@ -0,0 +1,102 @@
+#ifndef MISSION_REPORT_H
+#define MISSION_REPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "json_writer.h"
+#include "shared_types.h" // For MAX_OBSTACLES
+
+/**
+ * @file mission_report.h
+ * @brief End-of-mission KPI report, broken down by phase.
+ *
+ * The nav thread opens a report when it takes a mission and closes it when
+ * the mission ends; the image workers and the approach scanner add each
+ * snapshot's answer. A finished mission's report is complete once every
+ * snapshot it queued has been answered, or straight away when it was
+ * stopped or found no route; a report still waiting when the next mission
+ * begins is completed then, its missing answers counted as unanswered.
+ * Whichever call completes it returns true, and its caller takes the report
+ * with mission_report_take() and sends it on.
+ *
+ * Phases, all in ms (-1: never reached):
+ *   plan         arena received -> route ready (navigation starts)
+ *   start        route ready -> first command sent to the STM32
+ *   motion       sum over commands of start (send, or the previous DONE) -> DONE,
+ *                which takes in the firmware's pre-move cooldown
+ *   settle       sum of DONE -> SETTLED, for firmware that reports it
+ *   snapshot     time the nav thread waited for captures
+ *   total        arena received -> the later of the mission's end and its last answer
+ * and per obstacle, capture (the burst's dequeue, or the approach frame) -> TARGET.
+ * Retries and timeouts are the mission's share of the metrics counters. The
+ * SoC fields are the worst of the soc_monitor.h samples taken meanwhile.
+ *
+ * Thread-safe.
+ */
+
+typedef enum {
+    MISSION_COMPLETE,
+    MISSION_ABORTED,  // Stopped, or a command or capture failed
+    MISSION_NO_ROUTE, // Never started driving
+} MissionOutcome;
+
+typedef struct {
+    int obstacle_id;
+    bool answered;
+    bool detected;     // A TARGET went to Android
+    int32_t target_ms; // Capture -> TARGET, -1 without one
+    int attempts;      // Snapshots queued for it
+} MissionTarget;
+
+typedef struct {
+    unsigned mission; // Mission epoch
+    MissionOutcome outcome;
+    int64_t plan_ms, start_ms, motion_ms, settle_ms, snapshot_ms, total_ms;
+    MissionTarget targets[MAX_OBSTACLES];
+    int target_count;
+    int unanswered;
+    unsigned snapshot_retries, recaptures, stm32_resets; // Retries
+    unsigned ack_timeouts, capture_timeouts, settle_timeouts;
+    int32_t soc_temp_max_mc;  // Hottest sample, -1 without any
+    int32_t cpu_freq_min_mhz; // Slowest ARM clock, -1 without any
+    uint32_t throttled;       // SOC_THROTTLE_* flags seen
+} MissionReport;
+
+// Opens the report of mission epoch, whose arena arrived at arena_ns. Returns
+// true with *unfinished filled if the last mission's report was still waiting
+// for answers (see above).
+bool mission_report_begin(unsigned epoch, uint64_t arena_ns, MissionReport* unfinished);
+
+// Navigation started at ns.
+void mission_report_route_ready(uint64_t ns);
+
+// The nav thread waited from started_ns to ended_ns for a capture.
+void mission_report_snapshot_wait(uint64_t started_ns, uint64_t ended_ns);
+
+// A snapshot of obstacle_id went to the image workers.
+void mission_report_snapshot_queued(int obstacle_id);
+
+// obstacle_id's snapshot in mission epoch was answered at answered_ns, from a
+// frame captured at capture_ns. Answers from other missions are ignored.
+// Returns true if the report is now complete.
+bool mission_report_answered(unsigned epoch, int obstacle_id, bool detected, uint64_t capture_ns, uint64_t answered_ns);
+
+// The mission was abandoned: the report completes at its end without waiting.
+void mission_report_abort(void);
+
+// The mission ended at ns. first_sent_ns (0 for none), busy_ns and settle_ns
+// are its LatencyStats totals. Returns true if the report is now complete.
+bool mission_report_end(uint64_t ns, uint64_t first_sent_ns, uint64_t busy_ns, uint64_t settle_ns);
+
+// Copies out the completed report. Returns false if there is none, or it was taken.
+bool mission_report_take(MissionReport* out);
+
+// Appends r's members to an open JSON object.
+void mission_report_write_json(JsonWriter* w, const MissionReport* r);
+
+// Appends r to the CSV at path, with a header line if the file is new.
+// Returns 0, or -1 on error.
+int mission_report_append_csv(const char* path, const MissionReport* r);
+
+#endif // MISSION_REPORT_H
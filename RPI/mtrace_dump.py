@@ -0,0 +1,108 @@
+"""
+Fetches the MDP firmware's 1 kHz motion trace and writes it as CSV.
+
+The firmware records every move and turn it runs, from dispatch until 150 ms
+after the robot stops (so the brake pulse is included), in a 2048-sample RAM
+ring. Once the robot is idle, "MTRACE <n>" sends back the last n moves as
+binary frames (see the Motion trace section of STM/MDP/Core/Src/main.c).
+
+    python3 mtrace_dump.py /dev/ttyUSB0 --moves 4 -o trace.csv
+
+Each row is one millisecond of one move: move number (0 = oldest), command,
+argument, sample index, HAL tick, signed duty and raw encoder count of each
+wheel, wheel speed in rps, yaw in degrees and servo pulse in microseconds.
+"""
+import argparse
+import csv
+import struct
+import sys
+import time
+
+import serial
+
+from fake_stm import FRAME_SYNC, crc16_ccitt
+
+MDP_BAUD = 1000000
+TYPE_MOVE = 0x81
+TYPE_DATA = 0x82
+MOVE_FIELDS = struct.Struct("<BBBiIH")        # move, moves, op, arg, tick, samples
+DATA_HEADER = struct.Struct("<BH")            # move, first sample
+SAMPLE = struct.Struct("<hhHHhhhH")           # pwm A/D, cnt A/D, rps A/D, yaw, servo
+OPS = ["TURN", "TURN_REV", "TURN_ABS", "MOVE_FWD", "MOVE_BACK", "PARAM", "CAL", "SYSID", "ODOCAL"]  # cmd_op_t order
+REPLY_TIMEOUT_SECONDS = 5.0
+
+COLUMNS = ["move", "op", "arg", "sample", "tick_ms", "pwm_a", "pwm_d", "cnt_a", "cnt_d",
+           "rps_a", "rps_d", "yaw_deg", "servo_us"]
+
+
+def read_dump(port, moves):
+    """Sends MTRACE and returns ({move: header}, [(move, index, sample)]) once ACK arrives."""
+    port.reset_input_buffer()
+    port.write(f"MTRACE {moves}\n".encode("ascii"))
+    headers, samples, buf = {}, [], b""
+    deadline = time.monotonic() + REPLY_TIMEOUT_SECONDS
+    while time.monotonic() < deadline:
+        buf += port.read(port.in_waiting or 1)
+        while buf:
+            if buf[0] == FRAME_SYNC:
+                if len(buf) < 2 or len(buf) < buf[1] + 4:
+                    break  # Rest of the frame still on the wire
+                end = buf[1] + 2
+                body = buf[2:end]
+                if crc16_ccitt(buf[1:end]) != int.from_bytes(buf[end:end + 2], "little"):
+                    raise ValueError("MTRACE frame with a bad CRC")
+                buf = buf[end + 2:]
+                if body[0] == TYPE_MOVE:
+                    fields = MOVE_FIELDS.unpack(body[1:])
+                    headers[fields[0]] = fields
+                elif body[0] == TYPE_DATA:
+                    move, first = DATA_HEADER.unpack_from(body, 1)
+                    data = body[1 + DATA_HEADER.size:]
+                    for i in range(len(data) // SAMPLE.size):
+                        samples.append((move, first + i, SAMPLE.unpack_from(data, i * SAMPLE.size)))
+                continue
+            line, sep, rest = buf.partition(b"\n")
+            if not sep:
+                break
+            buf = rest
+            text = line.decode("ascii", errors="replace").strip()
+            if text.startswith("ACK MTRACE"):
+                return headers, samples
+            if text.startswith("ERR MTRACE"):
+                raise RuntimeError(f"firmware refused the dump: {text} (is the robot still moving?)")
+    raise TimeoutError("no ACK MTRACE from the firmware")
+
+
+def write_csv(out, headers, samples):
+    writer = csv.writer(out)
+    writer.writerow(COLUMNS)
+    for move, index, s in samples:
+        _, _, op, arg, tick_ms, _ = headers[move]
+        pwm_a, pwm_d, cnt_a, cnt_d, rps_a, rps_d, yaw, servo = s
+        writer.writerow([move, OPS[op] if op < len(OPS) else op, arg, index, tick_ms + index,
+                         pwm_a, pwm_d, cnt_a, cnt_d, rps_a / 1000, rps_d / 1000, yaw / 100, servo])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("device", help="MDP USART3 serial device")
+    parser.add_argument("--moves", type=int, default=1, help="moves to fetch, newest last (1-16)")
+    parser.add_argument("--baud", type=int, default=MDP_BAUD)
+    parser.add_argument("-o", "--output", help="CSV file (default: stdout)")
+    args = parser.parse_args()
+
+    with serial.Serial(args.device, args.baud, timeout=0.1) as port:
+        headers, samples = read_dump(port, args.moves)
+    for move, _, op, arg, tick_ms, count in sorted(headers.values()):
+        kept = sum(1 for m, _, _ in samples if m == move)
+        print(f"move {move}: {OPS[op] if op < len(OPS) else op} {arg} at {tick_ms} ms, "
+              f"{count} samples ({kept} still in the ring)", file=sys.stderr)
+    if args.output:
+        with open(args.output, "w", newline="") as out:
+            write_csv(out, headers, samples)
+    else:
+        write_csv(sys.stdout, headers, samples)
+
+
+if __name__ == "__main__":
+    main()
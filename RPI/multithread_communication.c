@@ -3,13 +3,49 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <curl/curl.h>
-#include <time.h> // For pthread_cond_timedwait
-#include <errno.h> // For ETIMEDOUT
+#include <time.h> // For struct itimerspec
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <termios.h> // tcflush
 
 #include "shared_types.h"
 #include "rpi_hal.h"
 #include "json_parser.h" // New include
+#include "json_schema.h"
+#include "latency_stats.h"
+#include "route_cache.h"
+#include "planner.h"
+#include "stm32_protocol.h"
+#include "route_optimizer.h"
+#include "image_preprocess.h"
+#include "trace.h"
+#include "protocol_keywords.h"
+#include "json_writer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "rt_profile.h"
+#include "android_tx.h"
+#include "shm_detector.h"
+#include "local_detector.h"
+#include "timeline.h"
+#include "stm32_sim.h"
+#include "server_channel.h"
+#include "live_feed.h"
+#include "clock_sync.h"
+#include "serial_tx.h"
+#include "checkpoint.h"
+#include "runtime_config.h"
+#include "mission_report.h"
+#include "soc_monitor.h"
+#include "occupancy_map.h"
 
 // Definition for DIR_MAP_ANDROID_STR, declared in shared_types.h
 const char* DIR_MAP_ANDROID_STR[8] = {
@@ -22,21 +58,377 @@ const char* STM32_DEVICE_WRITE = "rpi_to_stm";
 const char* STM32_DEVICE_READ = "stm_to_rpi";
 const char* ANDROID_DEVICE = "/dev/rfcomm0";
 const char* PATHFINDING_SERVER_URL = "http://192.168.22.26:5000/path";
+const char* PATHFINDING_STREAM_URL = "http://192.168.22.26:5000/path/stream";
 const char* IMAGE_SERVER_URL = "http://192.168.22.26:4000/detect";
+int PATHFINDING_CHANNEL_PORT = 5001;
+int IMAGE_CHANNEL_PORT = 4001;
 #elif defined(FAKE_ANDROID_SIMULATION)
 const char* STM32_DEVICE = "/dev/ttyACM0";
 const char* ANDROID_DEVICE = "android_to_rpi";
 const char* PATHFINDING_SERVER_URL = "http://192.168.22.24:5000/path";
+const char* PATHFINDING_STREAM_URL = "http://192.168.22.24:5000/path/stream";
 const char* IMAGE_SERVER_URL = "http://192.168.22.21:5000/detect";
+int PATHFINDING_CHANNEL_PORT = 5001;
+int IMAGE_CHANNEL_PORT = 5001;
 #else
 const char* STM32_DEVICE = "/dev/ttyACM0";
 const char* ANDROID_DEVICE = "/dev/rfcomm0";
 const char* PATHFINDING_SERVER_URL = "http://192.168.22.24:5000/path";
+const char* PATHFINDING_STREAM_URL = "http://192.168.22.24:5000/path/stream";
 const char* IMAGE_SERVER_URL = "http://192.168.22.21:5000/detect";
+int PATHFINDING_CHANNEL_PORT = 5001;
+int IMAGE_CHANNEL_PORT = 5001;
 #endif
 
-const int BAUD_RATE = 115200;
-const char* CAPTURE_FILENAME = "capture.jpg";
+// The STM32 UART runs at 1 Mbaud, which both firmware targets divide exactly from
+// their APB1 clocks (MX_USART3_UART_Init); change both ends together. RFCOMM
+// ignores the rate.
+const int STM32_BAUD_RATE = 1000000;
+// Fastest rate the Pi's end of the STM32 link is trusted with. The HELLO
+// handshake moves the link up to it when the firmware can follow (stm32_protocol.h).
+const int STM32_MAX_BAUD_RATE = 2000000;
+const int ANDROID_BAUD_RATE = 115200;
+// Frames are uploaded straight from memory. Build with -DCAPTURE_DEBUG_DUMP to also
+// write each worker's last frame to disk for inspection.
+const char* CAPTURE_FILENAME_FMT = "capture_%d.jpg";
+
+// Routes for previously seen arenas, keyed by obstacle layout + start pose
+const char* ROUTE_CACHE_DIR = "route_cache";
+// Fitted command times written after every mission; copy it to the pathfinding
+// server's COST_MODEL_PATH (it reloads the file when it changes).
+const char* COST_MODEL_PATH = "cost_model.json";
+// Log of the mission under way, for picking it up again after a restart
+const char* CHECKPOINT_PATH = "mission.ckpt";
+// Each mission's KPI report (mission_report.h), one line per mission
+const char* MISSION_REPORT_PATH = "mission_report.csv";
+
+const char* CAMERA_DEVICE = "/dev/video0";
+const int CAMERA_WIDTH = 640;
+const int CAMERA_HEIGHT = 480;
+
+// Persistent image workers. Snapshots beyond IMAGE_TASK_QUEUE_SIZE block the nav thread.
+#define IMAGE_WORKER_COUNT 2
+// Frames captured per snapshot and uploaded concurrently. The first reply whose
+// detection reaches IMAGE_CONFIDENCE_THRESHOLD is used and the rest are cancelled.
+#define IMAGE_BURST_FRAMES 3
+#define IMAGE_CONFIDENCE_THRESHOLD 0.5
+
+// Snapshots taken close together go up in one multipart request, one image and
+// object_id pair per frame, when the image server advertises "X-Detect-Batch: N"
+// on the warm-up HEAD. A worker that has captured a snapshot holds its upload
+// for IMAGE_BATCH_HOLD_MS; a snapshot queued meanwhile goes to that worker,
+// which captures it and holds again, up to IMAGE_BATCH_MAX snapshots. Results
+// come hold-delayed but over one request. Only plain uploads batch: not with an
+// on-Pi model, a shared-memory detector, an image channel (its requests already
+// share one connection and carry no headers), or while recording a trace. Set
+// IMAGE_BATCH_HOLD_MS to 0 to upload every snapshot on its own.
+#ifndef IMAGE_BATCH_HOLD_MS
+#define IMAGE_BATCH_HOLD_MS 1500
+#endif
+#define IMAGE_BATCH_MAX 3
+_Static_assert(IMAGE_BATCH_MAX * IMAGE_BURST_FRAMES <= DETECTION_BATCH_MAX_RESULTS, "a batch's results all fit");
+
+// Crop each snapshot to where the symbol should be and shrink it before upload
+// (image_preprocess.h). Frames that fail to decode are sent as captured.
+#ifndef USE_IMAGE_PREPROCESS
+#define USE_IMAGE_PREPROCESS 1
+#endif
+
+// Check each burst frame for motion blur and bad exposure before the nav thread
+// is released (image_quality_measure()) and capture a bad one again, up to
+// IMAGE_QUALITY_RECAPTURES times a burst. Frames that still fail are not sent;
+// if none passes, the sharpest is. Frames that cannot be decoded pass.
+#ifndef USE_IMAGE_QUALITY_GATE
+#define USE_IMAGE_QUALITY_GATE 1
+#endif
+#define IMAGE_QUALITY_RECAPTURES 3
+
+// Take a snapshot at rest from the camera's frame ring (CAMERA_RING_FRAMES):
+// the sharpest frames exposed since the firmware's SETTLED or SNAP said the
+// robot came to rest, so none has to be shot after the request. 0 waits for
+// fresh frames after every request, as before.
+#ifndef USE_FRAME_RING
+#define USE_FRAME_RING 1
+#endif
+
+// Hand bursts to a detector on this Pi through shared memory (shm_detector.h)
+// when one has created DETECTOR_SHM_NAME, instead of uploading them over HTTP.
+// Without a detector, or once it stops answering, uploads go to IMAGE_SERVER_URL.
+#ifndef USE_SHM_DETECTOR
+#define USE_SHM_DETECTOR 1
+#endif
+const char* DETECTOR_SHM_NAME = SHM_DETECTOR_NAME;
+_Static_assert(IMAGE_WORKER_COUNT <= SHM_DETECTOR_LANES, "one shared-memory lane per image worker");
+_Static_assert(IMAGE_BURST_FRAMES <= SHM_DETECTOR_SLOTS, "a whole burst fits a lane");
+
+// Who recognises a snapshot when an on-Pi model (local_detector.h) is loaded:
+//   DETECT_SERVER_FIRST  the server (or shared-memory detector); the model only if that fails
+//   DETECT_LOCAL_FIRST   the model; the server if it finds nothing confident
+//   DETECT_RACE          both at once over HTTP; the first confident answer wins
+// The shared-memory detector shares the Pi's CPUs with the model, so with one
+// attached DETECT_RACE behaves as DETECT_SERVER_FIRST. Without a model every
+// policy uses the server alone. --detect-policy overrides this.
+typedef enum { DETECT_SERVER_FIRST, DETECT_LOCAL_FIRST, DETECT_RACE } DetectPolicy;
+#ifndef IMAGE_DETECT_POLICY
+#define IMAGE_DETECT_POLICY DETECT_SERVER_FIRST
+#endif
+static DetectPolicy g_detect_policy = IMAGE_DETECT_POLICY;
+const char* LOCAL_MODEL_PATH = "detector.tflite";
+const char* LOCAL_LABELS_PATH = "detector_labels.txt";
+
+// Look for the snapshot's answer while the robot is still driving up to it
+// (see "Approach detection"). 0 photographs every snapshot after the stop, as before.
+#ifndef USE_APPROACH_DETECTION
+#define USE_APPROACH_DETECTION 0
+#endif
+#define APPROACH_FRAME_INTERVAL_MS 150 // Shortest gap between approach frames
+#define APPROACH_FRAME_WIDTH 320       // Approach frames are shrunk to this before they leave the Pi
+#define APPROACH_FRAME_QUALITY 60
+#define APPROACH_MAX_KBPS 1500         // Upload budget for approach frames on the image channel
+#define APPROACH_REPLY_TIMEOUT_MS 1000
+#define APPROACH_CONFIDENCE 0.8        // Well above IMAGE_CONFIDENCE_THRESHOLD: a wrong early TARGET is not retried
+#define APPROACH_AGREE_FRAMES 2        // Frames in a row that must name the same image
+#define APPROACH_SHM_LANE IMAGE_WORKER_COUNT // The lane after the image workers'
+_Static_assert(APPROACH_SHM_LANE < SHM_DETECTOR_LANES, "a shared-memory lane for the approach scanner");
+
+// Photograph the snapshots the robot can drive through on the move (see
+// "Rolling snapshots"): it creeps the last ROLLING_CREEP_CM into the viewing
+// pose and the frame is taken there at a short exposure while the next command
+// runs. 0 stops and settles for every snapshot, as before.
+#ifndef USE_ROLLING_SNAPSHOTS
+#define USE_ROLLING_SNAPSHOTS 1
+#endif
+#define ROLLING_CREEP_CM 10
+#define ROLLING_CAPTURE_LATE_MS 150 // A frame dequeued later than this after the pass is off the pose
+
+// Drive the in-process STM32 simulator (stm32_sim.h) instead of the serial port
+// or fake_stm.py's pipes. --stm32-sim SPEC does the same at run time and sets its
+// parameters; a build with this set uses STM32_SIM_SPEC unless overridden.
+#ifndef USE_STM32_SIM
+#define USE_STM32_SIM 0
+#endif
+#ifndef STM32_SIM_SPEC
+#define STM32_SIM_SPEC "default"
+#endif
+static const char* g_stm32_sim_spec = USE_STM32_SIM ? STM32_SIM_SPEC : NULL;
+static Stm32SimConfig g_stm32_sim_config;
+
+// Number of motion commands allowed in flight to the STM32 before the nav thread
+// waits for an ACK. 1 gives the old stop-and-wait behaviour. Keep this at or below
+// the depth of the firmware's command queue (+1 for the command being executed).
+#ifndef STM32_CMD_WINDOW
+#define STM32_CMD_WINDOW 3
+#endif
+// Motion commands are given until they should have finished
+// (latency_cmd_timeout_ms()); this covers everything else the firmware confirms,
+// such as route frames and snapshot steps.
+#define STM32_ACK_TIMEOUT_SEC 10
+// Longest a snapshot waits after DONE for the firmware's SETTLED event before
+// capturing anyway.
+#define STM32_SETTLE_TIMEOUT_MS 1500
+// Longest a frame for the STM32 waits for the tty to take another byte
+#define STM32_TX_STALL_MS 200
+// PROGRESS events asked for: every this many percent, and when braking starts
+#define STM32_PROGRESS_EVERY_PCT 50
+#define STM32_PROGRESS_BRAKE true
+
+// Plan cache misses on the Pi (planner.c) instead of waiting on the server. The
+// server is still asked in the background and its route replaces the cached one
+// if they differ. The server stays the fallback when the native planner gives up.
+#ifndef USE_NATIVE_PLANNER
+#define USE_NATIVE_PLANNER 1
+#endif
+
+// Replay every complete route before it is driven (planner_simulate_route()). One
+// that clips an obstacle's clearance box or reaches a snapshot away from its snap
+// position is swapped for the native planner's, else refused. The native planner
+// then turns forward only: the FL90/FR90 its reverse turns are sent as drive
+// another arc. Streamed routes are driven before they are complete and go unchecked.
+#ifndef USE_ROUTE_VALIDATION
+#define USE_ROUTE_VALIDATION 1
+#endif
+
+// Retry a snapshot answered with no image or the bullseye from the obstacle's next
+// face, rerouting on the Pi from the retry table the planner keeps (planner.h).
+// Answers still out when the route ends are waited for up to
+// SNAPSHOT_ANSWER_WAIT_SEC.
+#ifndef USE_SNAPSHOT_RETRIES
+#define USE_SNAPSHOT_RETRIES 1
+#endif
+#define SNAPSHOT_ANSWER_WAIT_SEC 10
+
+// While the robot drives, plan ahead the reroute each snapshot still to be
+// answered would call for if it failed, so that a failure is acted on without
+// planning at the stop (see "Speculative retries"). 0 plans at the stop, as before.
+#ifndef USE_SPECULATIVE_RETRIES
+#define USE_SPECULATIVE_RETRIES 1
+#endif
+#define SPECULATIVE_RETRY_SLOTS 8
+
+// Map what the STM32's range sensor sees in its telemetry (occupancy_map.h) and,
+// when something no mission obstacle explains blocks the rest of a windowed
+// route, stop and reroute around it on the retry table (see "Sensed
+// obstacles"). Firmware without telemetry, or 0, drives the route as planned.
+#ifndef USE_OCCUPANCY_MAP
+#define USE_OCCUPANCY_MAP 1
+#endif
+#define OCC_SENSED_MAX 64 // Cells handed to the planner; a real obstacle is a few
+
+// Log each mission as it runs (checkpoint.h) and, when the controller starts with
+// one unfinished, drive the rest of it rather than wait for a new sendArena.
+// Firmware that answers WHERE is asked how far it got, after up to
+// CHECKPOINT_WHERE_WAIT_MS for the commands it still had; without WHERE a
+// mission resumes only if every command it sent had finished.
+#ifndef USE_CHECKPOINTS
+#define USE_CHECKPOINTS 1
+#endif
+#define CHECKPOINT_WHERE_WAIT_MS 30000
+
+// Ask the server for the best route it can find in this many ms (its anytime mode)
+// rather than the exact one. 0 leaves the key out and the server plans exactly.
+#ifndef PATHFINDING_TIME_BUDGET_MS
+#define PATHFINDING_TIME_BUDGET_MS 300
+#endif
+
+// Ask the server to drive each leg on its continuous-pose (hybrid A*) path where
+// that is shorter: turns of any angle, so FL/FR carry degrees other than 90.
+// The native planner's routes stay on the lattice.
+#ifndef USE_HYBRID_PLANNER
+#define USE_HYBRID_PLANNER 0
+#endif
+
+// Drive each move and turn at the speed class its route gives it: long clear
+// straights fast, tight manoeuvres next to an obstacle slow. The server is asked
+// for classes and the native planner always adds them; with this off every
+// command goes at the default move and turn speeds as before.
+#ifndef USE_SPEED_CLASSES
+#define USE_SPEED_CLASSES 1
+#endif
+
+// Ask the server for its NDJSON route stream and start driving on the first command
+// instead of waiting for the whole route. Falls back to PATHFINDING_SERVER_URL if
+// the stream produces nothing.
+#ifndef USE_ROUTE_STREAMING
+#define USE_ROUTE_STREAMING 1
+#endif
+
+// Upload complete routes to firmware that advertises the route executor and let
+// it drive them itself; the Pi then only captures at snapshot steps and stops.
+// Streamed routes, and firmware without it, use the ACK window instead.
+#ifndef USE_STM32_ROUTE_EXECUTOR
+#define USE_STM32_ROUTE_EXECUTOR 1
+#endif
+
+// Offer the STM32 the compact binary command frames (stm32_protocol.h) at start-up.
+// Firmware without binary support ignores the probe and the link stays ASCII.
+#ifndef USE_STM32_BINARY_PROTOCOL
+#define USE_STM32_BINARY_PROTOCOL 1
+#endif
+
+// Hand log messages to a background flusher (logger.h) instead of printing them
+// on the calling thread. 0 prints every message synchronously, as before.
+#ifndef USE_ASYNC_LOG
+#define USE_ASYNC_LOG 1
+#endif
+
+// Send everything for Android through one writer thread (android_tx.h) that packs
+// queued messages into single RFCOMM writes. 0 writes on the calling thread, as before.
+#ifndef USE_ANDROID_TX_WRITER
+#define USE_ANDROID_TX_WRITER 1
+#endif
+
+// Write both links non-blocking through serial_tx.h, and send the window's
+// pipelined commands that are ready together in one writev(). 0 writes each
+// frame with a blocking write() on the sending thread, as before.
+#ifndef USE_SERIAL_TX
+#define USE_SERIAL_TX 1
+#endif
+
+// Ask firmware advertising PROGRESS for its events during moves and turns, and
+// get the camera ready on the move that ends at a snapshot rather than once the
+// robot has settled. 0 leaves them off, as before.
+#ifndef USE_STM32_PROGRESS_EVENTS
+#define USE_STM32_PROGRESS_EVENTS 1
+#endif
+
+// Ask firmware advertising CREDIT to report the room in its command queue, and
+// keep a mission's windowed commands within it instead of STM32_CMD_WINDOW, so
+// none waits in the firmware for a slot or is refused for want of one (see
+// "STM32 credits"). 0 keeps the fixed window, as before. The in-flight cap keeps
+// the ACK and resend tables' slots apart whatever depth a firmware reports.
+#ifndef USE_STM32_CREDITS
+#define USE_STM32_CREDITS 1
+#endif
+#define STM32_CREDIT_MAX_IN_FLIGHT 16
+#define STM32_MAX_IN_FLIGHT (USE_STM32_CREDITS && STM32_CREDIT_MAX_IN_FLIGHT > STM32_CMD_WINDOW \
+                             ? STM32_CREDIT_MAX_IN_FLIGHT : STM32_CMD_WINDOW)
+
+// Run the reactor and nav threads under SCHED_FIFO, away from the image workers'
+// core, with memory locked and stacks preallocated (rt_profile.h), so ACK handling
+// and the next command are not delayed behind uploads or system daemons. Needs
+// CAP_SYS_NICE and CAP_IPC_LOCK; without them it warns and carries on as before.
+#ifndef USE_REALTIME_PROFILE
+#define USE_REALTIME_PROFILE 1
+#endif
+
+// Move every CPU to the performance governor while a mission runs and restore
+// the previous one after it (soc_monitor.h), so the ARM clock does not ramp up
+// from idle under the first commands. Needs root. 0 leaves cpufreq alone, as before.
+#ifndef USE_PERFORMANCE_GOVERNOR
+#define USE_PERFORMANCE_GOVERNOR 0
+#endif
+
+// UDP port the reactor answers with a metrics snapshot (metrics.h,
+// metrics_cli.py). 0 disables the endpoint; the metrics are still kept.
+#ifndef METRICS_UDP_PORT
+#define METRICS_UDP_PORT 5600
+#endif
+
+// Keep a persistent framed connection (server_channel.h) to each server's channel
+// port, on the host of its URL, and send pathfinding and detection requests over
+// it: no per-request HTTP headers, JPEGs as raw bytes, a burst's frames
+// multiplexed on one connection, and revised routes pushed by the server. While
+// a channel is down, or for a server without one, requests go over HTTP as
+// before; so do recorded runs, so the trace holds every exchange.
+// --path-channel/--image-channel PORT override the ports; 0 leaves one off.
+#ifndef USE_SERVER_CHANNEL
+#define USE_SERVER_CHANNEL 1
+#endif
+#define PATH_CHANNEL_TIMEOUT_MS 20000  // As the HTTP request's
+#define IMAGE_CHANNEL_TIMEOUT_MS 30000
+// Swapped by a config reload; each user loads one once per request
+static _Atomic(ServerChannel*) g_path_channel;
+static _Atomic(ServerChannel*) g_image_channel;
+
+// TCP port of the live feed (live_feed.h): pose, commands, queues, detections
+// and telemetry for `dashboard.py --live`. 0 disables it; --live-feed PORT
+// overrides the port.
+#ifndef LIVE_FEED_PORT
+#define LIVE_FEED_PORT 5602
+#endif
+static int g_live_feed_port = LIVE_FEED_PORT;
+
+static bool channel_usable(const ServerChannel* ch) {
+    return USE_SERVER_CHANNEL && server_channel_available(ch) && !trace_enabled();
+}
+
+// --- Runtime configuration ---
+// Server endpoints, channel ports, devices and drive speeds (runtime_config.h):
+// the compiled defaults above, overlaid by the config file (--config FILE,
+// default CONFIG_PATH, fine to be missing) and then by the command line. A
+// SIGHUP or an Android "config" message reads the file again on top of what is
+// running (see "Config reload"). Readers take config_now() once per request;
+// a config that is replaced stays valid for CONFIG_RETIRE_MS.
+#ifndef CONFIG_PATH
+#define CONFIG_PATH "controller.conf"
+#endif
+static RuntimeConfig g_boot_config;
+static _Atomic(const RuntimeConfig*) g_config = &g_boot_config;
+static const char* g_config_path = CONFIG_PATH;
+
+static const RuntimeConfig* config_now(void) {
+    return atomic_load(&g_config);
+}
 
 // --- Global Shared Application Context ---
 SharedAppContext g_app_context;
@@ -48,569 +440,6110 @@ int g_stm32_ack_fd = -1;
 #endif
 
 
-// =================================================================================
-// THREAD 3: Image Processing (Temporary, "Fire-and-Forget")
-// =================================================================================
-// Updated post_image_to_server_thread to return response for parsing
-static int post_image_to_server_thread(int obstacle_id, char* response_buffer, int buffer_size) {
-    CURL* curl;
-    CURLcode res;
-    int result = -1;
-
-    struct MemoryStruct chunk = { .memory = malloc(1), .size = 0 };
-    if (chunk.memory == NULL) { // Check for malloc failure
-        fprintf(stderr, "[ImgThread] Failed to allocate memory for CURL response.\n");
+// --- Nav wakeups ---
+// The nav thread sleeps in read() on an eventfd. Any thread that changes state
+// the nav thread may be waiting on (an STM32 completion, an image result, a stop
+// or an expired deadline) publishes it first and then calls wake_nav(). Waiters
+// re-check their condition after every wakeup, so spurious wakeups are harmless.
+
+static void wake_nav(SharedAppContext* context) {
+    uint64_t one = 1;
+    if (write(context->nav_wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("[NavThread] eventfd write failed");
+    }
+}
+
+static void nav_wait(SharedAppContext* context) {
+    uint64_t count;
+    if (read(context->nav_wakeup_fd, &count, sizeof(count)) != sizeof(count) && errno != EINTR) {
+        perror("[NavThread] eventfd read failed");
+    }
+}
+
+// --- Live feed ---
+// What the nav, image and reactor threads publish to live_feed.h subscribers.
+// Each builder returns at once when nobody is subscribed. Poses and telemetry go
+// out in integer units, as on the STM32 link: mm, 0.1 degree, and thousandths of
+// a rev/s.
+
+static const char* const FEED_COMMAND_NAMES[] = {
+    [CMD_MOVE_FORWARD] = "FW", [CMD_MOVE_BACKWARD] = "BW", [CMD_TURN_LEFT] = "FL",
+    [CMD_TURN_RIGHT] = "FR", [CMD_SNAPSHOT] = "SP",
+};
+
+static void feed_state(const char* phase, int commands) {
+    if (!live_feed_active()) return;
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_STATE);
+    jw_key(w, "phase");
+    jw_string(w, phase);
+    if (commands >= 0) {
+        jw_key(w, "commands");
+        jw_int(w, commands);
+    }
+    live_feed_publish(&msg);
+}
+
+static void feed_command_sent(uint32_t cmd_id, const Command* cmd, uint32_t in_flight) {
+    if (!live_feed_active()) return;
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_COMMAND);
+    jw_key(w, "id");
+    jw_uint(w, cmd_id);
+    jw_key(w, "status");
+    jw_string(w, "sent");
+    jw_key(w, "cmd");
+    jw_string(w, FEED_COMMAND_NAMES[cmd->type]);
+    jw_key(w, "value");
+    jw_int(w, cmd->value);
+    jw_key(w, "in_flight");
+    jw_uint(w, in_flight);
+    live_feed_publish(&msg);
+}
+
+// An STM32 reply, and the odometry pose it carried (or NULL).
+static void feed_command_reply(uint32_t cmd_id, int8_t status, const Stm32Pose* pose) {
+    if (!live_feed_active()) return;
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_COMMAND);
+    jw_key(w, "id");
+    jw_uint(w, cmd_id);
+    jw_key(w, "status");
+    switch (status) {
+        case STM32_ACK_ACCEPTED: jw_string(w, "accepted"); break;
+        case STM32_ACK_DONE: jw_string(w, "done"); break;
+        case STM32_ACK_SETTLED: jw_string(w, "settled"); break;
+        default: jw_string(w, "error"); break;
+    }
+    live_feed_publish(&msg);
+    if (!pose) return;
+    w = live_feed_begin(&msg, LIVE_TOPIC_POSE);
+    jw_key(w, "x_mm");
+    jw_int(w, lroundf(pose->x_cm * 10.0f));
+    jw_key(w, "y_mm");
+    jw_int(w, lroundf(pose->y_cm * 10.0f));
+    jw_key(w, "theta_ddeg");
+    jw_int(w, lroundf(pose->theta_deg * 10.0f));
+    jw_key(w, "sd_xy_mm");
+    jw_int(w, lroundf(fmaxf(pose->sd_x_cm, pose->sd_y_cm) * 10.0f));
+    live_feed_publish(&msg);
+}
+
+static void feed_robot(int obstacle_id, const SnapPosition* at) {
+    if (!live_feed_active()) return;
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_ROBOT);
+    jw_key(w, "obstacle");
+    jw_int(w, obstacle_id);
+    jw_key(w, "x");
+    jw_int(w, at->x);
+    jw_key(w, "y");
+    jw_int(w, at->y);
+    jw_key(w, "d");
+    jw_int(w, at->d);
+    live_feed_publish(&msg);
+}
+
+// A snapshot's answer; detection is NULL when no frame produced one.
+static void feed_detection(int obstacle_id, const Detection* detection) {
+    if (!live_feed_active()) return;
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_DETECTION);
+    jw_key(w, "obstacle");
+    jw_int(w, obstacle_id);
+    jw_key(w, "img_id");
+    jw_int(w, detection ? detection->img_id : -1);
+    if (detection) {
+        char label[64];
+        int len = detection->class_label.len < (int)sizeof(label) - 1 ? detection->class_label.len : (int)sizeof(label) - 1;
+        if (len > 0) memcpy(label, detection->class_label.ptr, (size_t)len);
+        label[len] = '\0';
+        jw_key(w, "label");
+        jw_string(w, label);
+        jw_key(w, "confidence_pct");
+        jw_int(w, lround(detection->confidence * 100.0));
+    }
+    live_feed_publish(&msg);
+}
+
+static void feed_telemetry(const Stm32Telemetry* t) {
+    LiveFeedMessage msg;
+    JsonWriter* w = live_feed_begin(&msg, LIVE_TOPIC_TELEMETRY);
+    jw_key(w, "tick_ms");
+    jw_uint(w, t->tick_ms);
+    jw_key(w, "rps_a_milli");
+    jw_int(w, lroundf(t->rps_a * 1000.0f));
+    jw_key(w, "rps_d_milli");
+    jw_int(w, lroundf(t->rps_d * 1000.0f));
+    jw_key(w, "pwm_a");
+    jw_int(w, t->pwm_a);
+    jw_key(w, "pwm_d");
+    jw_int(w, t->pwm_d);
+    jw_key(w, "yaw_ddeg");
+    jw_int(w, lroundf(t->yaw_deg * 10.0f));
+    jw_key(w, "yaw_rate_ddps");
+    jw_int(w, lroundf(t->yaw_rate_dps * 10.0f));
+    jw_key(w, "ir_mm");
+    jw_uint(w, t->ir_mm);
+    live_feed_publish(&msg);
+}
+
+// --- Mission report ---
+// Each mission's KPIs by phase (mission_report.h) go to Android, the live feed
+// and MISSION_REPORT_PATH once its last snapshot is answered.
+
+static void send_mission_report(SharedAppContext* context, const MissionReport* r) {
+    LOG_INFO("[Report] Mission %u %s: plan %lld ms, start %lld ms, motion %lld ms, settle %lld ms, "
+             "snapshot wait %lld ms, total %lld ms; %d target(s), %d unanswered, %u retries, %u timeouts.\n",
+             r->mission, r->outcome == MISSION_COMPLETE ? "complete" : r->outcome == MISSION_ABORTED ? "aborted" : "without a route",
+             (long long)r->plan_ms, (long long)r->start_ms, (long long)r->motion_ms, (long long)r->settle_ms,
+             (long long)r->snapshot_ms, (long long)r->total_ms, r->target_count, r->unanswered,
+             r->snapshot_retries + r->recaptures + r->stm32_resets,
+             r->ack_timeouts + r->capture_timeouts + r->settle_timeouts);
+    if (r->soc_temp_max_mc >= 0 || r->cpu_freq_min_mhz >= 0) {
+        LOG_INFO("[Report] Mission %u on the Pi: up to %.1f C, down to %d MHz%s.\n", r->mission,
+                 r->soc_temp_max_mc / 1000.0, r->cpu_freq_min_mhz, r->throttled ? ", THROTTLED" : "");
+    }
+
+    // Format: {"type":"report","value":{...}}\n
+    char buffer[ANDROID_TX_MAX_MESSAGE];
+    JsonWriter w;
+    jw_init(&w, buffer, sizeof(buffer));
+    jw_begin_object(&w);
+    jw_key(&w, "type");
+    jw_string(&w, "report");
+    jw_key(&w, "value");
+    jw_begin_object(&w);
+    mission_report_write_json(&w, r);
+    jw_end_object(&w);
+    jw_end_object(&w);
+    jw_raw(&w, "\n", 1);
+    if (jw_str(&w)) {
+        android_tx_send(context->android_fd, buffer, jw_len(&w));
+    } else {
+        LOG_ERROR("[Report] Mission %u's report is too long for Android.\n", r->mission);
+    }
+
+    if (live_feed_active()) {
+        LiveFeedMessage msg;
+        mission_report_write_json(live_feed_begin(&msg, LIVE_TOPIC_REPORT), r);
+        live_feed_publish(&msg);
+    }
+    mission_report_append_csv(MISSION_REPORT_PATH, r);
+}
+
+// Sends the report a mission_report_*() call just completed.
+static void emit_mission_report(SharedAppContext* context) {
+    MissionReport report;
+    if (mission_report_take(&report)) send_mission_report(context, &report);
+}
+
+// =================================================================================
+// THREAD 3: Image Processing (Persistent Worker Pool)
+// =================================================================================
+// A JPEG as the data of one mime part, with curl's read cursor into it.
+typedef struct {
+    const struct MemoryStruct* frame;
+    size_t read_pos;
+} FramePart;
+
+// One frame of a snapshot burst and the upload that carries it.
+typedef struct {
+    CURL* curl; // Warm handle: keeps its connection to the image server between uploads
+    struct MemoryStruct frame; // Encoded JPEG, reused between captures
+    FramePart part; // frame as the upload's image part
+    struct MemoryStruct response; // Server reply, reused between uploads
+    curl_mime* form;
+    bool active; // Added to the worker's multi handle
+    uint64_t started_ns; // When the upload was handed to curl
+} BurstUpload;
+
+// A snapshot that joined a worker's held upload (IMAGE_BATCH_HOLD_MS).
+typedef struct {
+    ImageTask task;
+    uint64_t started_ns;
+    int frame_count;
+    struct MemoryStruct frames[IMAGE_BURST_FRAMES]; // Reused between batches
+} HeldSnapshot;
+
+// Per-worker state, created once at startup and reused for every snapshot.
+typedef struct {
+    SharedAppContext* context;
+    int worker_id;
+    CURLM* multi; // Drives the burst's uploads concurrently
+    BurstUpload uploads[IMAGE_BURST_FRAMES];
+    ImagePreprocessor preprocessor; // Scratch for cropping/shrinking frames before upload
+    ShmResult shm_result; // Last shared-memory detection; its class_label backs the Detection
+    ChannelMessage channel_reply; // Reply behind the last channel detection, likewise
+    LocalDetector* local; // This worker's interpreter for the on-Pi model; NULL without one
+    HeldSnapshot held[IMAGE_BATCH_MAX - 1]; // Snapshots riding on this worker's batched upload
+    FramePart batch_parts[IMAGE_BATCH_MAX * IMAGE_BURST_FRAMES];
+    char capture_filename[32]; // Debug dump target, one per worker
+    unsigned mission_epoch; // Of the task in hand
+    Detection parsed_objects[DETECTION_MAX_OBJECTS]; // Every object of the last server reply parsed
+    int parsed_count;
+    Detection reply_objects[DETECTION_MAX_OBJECTS]; // Those of the reply the burst's answer came from
+    int reply_count;
+    ImageRoi upload_view; // Part of the frame the uploaded frames show, and their size
+    int upload_width, upload_height;
+    struct MemoryStruct ring_frames[CAMERA_RING_FRAMES > 0 ? CAMERA_RING_FRAMES : 1]; // Candidates from the ring
+} ImageWorker;
+
+static ImageWorker g_image_workers[IMAGE_WORKER_COUNT];
+
+// Whether a STOP has cancelled the mission of the worker's task since it was queued.
+static bool worker_cancelled(const ImageWorker* worker) {
+    return worker->mission_epoch != atomic_load(&worker->context->mission_epoch);
+}
+
+// CURLOPT_XFERINFOFUNCTION for a worker's uploads: aborts them once a STOP has
+// cancelled their mission.
+static int upload_progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                    curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    return worker_cancelled((const ImageWorker*)clientp) ? 1 : 0;
+}
+
+// Snapshots per request the image server takes, from its X-Detect-Batch header
+// (warm_image_connections). 0 or 1: no batching.
+static atomic_int g_image_batch_max;
+
+// curl_mime_data_cb callbacks: curl pulls the JPEG straight out of the upload's
+// frame buffer instead of copying it or reading it back from a file.
+static size_t frame_read_callback(char* buffer, size_t size, size_t nitems, void* arg) {
+    FramePart* part = (FramePart*)arg;
+    size_t remaining = part->frame->size - part->read_pos;
+    size_t n = size * nitems;
+    if (n > remaining) n = remaining;
+    memcpy(buffer, part->frame->memory + part->read_pos, n);
+    part->read_pos += n;
+    return n;
+}
+
+static int frame_seek_callback(void* arg, curl_off_t offset, int origin) {
+    FramePart* part = (FramePart*)arg;
+    if (origin != SEEK_SET || offset < 0 || (size_t)offset > part->frame->size) return CURL_SEEKFUNC_FAIL;
+    part->read_pos = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+// Adds part's frame and the obstacle it shows to form. Returns 0 on success.
+static int add_image_part(curl_mime* form, FramePart* part, int obstacle_id) {
+    curl_mimepart* field = curl_mime_addpart(form);
+    if (!field) return -1;
+    curl_mime_name(field, "image");
+    curl_mime_data_cb(field, (curl_off_t)part->frame->size, frame_read_callback, frame_seek_callback, NULL, part);
+    curl_mime_filename(field, "capture.jpg"); curl_mime_type(field, "image/jpeg");
+    char id_str[12]; snprintf(id_str, sizeof(id_str), "%d", obstacle_id);
+    field = curl_mime_addpart(form);
+    if (!field) return -1;
+    curl_mime_name(field, "object_id"); curl_mime_data(field, id_str, CURL_ZERO_TERMINATED);
+    return 0;
+}
+
+// Prepares upload's handle to POST its frame for obstacle_id. Returns 0 on success.
+static int prepare_image_upload(BurstUpload* upload, int obstacle_id) {
+    CURL* curl = upload->curl;
+    curl_easy_reset(curl); // Clears options from the last upload but keeps the connection cache
+    http_configure_handle(curl);
+    upload->form = curl_mime_init(curl);
+    if (!upload->form) return -1;
+
+    upload->part = (FramePart){ &upload->frame, 0 };
+    upload->response.size = 0;
+    if (add_image_part(upload->form, &upload->part, obstacle_id) != 0) return -1;
+
+    curl_easy_setopt(curl, CURLOPT_URL, config_now()->image_url);
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, upload->form);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&upload->response);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    return 0;
+}
+
+// Hands a finished upload's timings to the upload sizing (image_preprocess.h):
+// its size, request to first reply byte, and the TCP handshake if it opened a
+// connection.
+static void observe_upload_link(CURL* curl) {
+    curl_off_t bytes = 0, pretransfer = 0, starttransfer = 0, lookup = 0, connect = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &bytes);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    if (bytes <= 0 || starttransfer <= pretransfer) return;
+    double rtt_s = connect > lookup ? (double)(connect - lookup) / 1e6 : -1.0; // Reused: no connect phase
+    image_upload_observe((size_t)bytes, (double)(starttransfer - pretransfer) / 1e6, rtt_s);
+}
+
+// Detach an upload from the multi handle; aborts it if still in flight.
+static void finish_image_upload(ImageWorker* worker, BurstUpload* upload) {
+    if (upload->active) curl_multi_remove_handle(worker->multi, upload->curl);
+    upload->active = false;
+    curl_mime_free(upload->form);
+    upload->form = NULL;
+}
+
+/* Compatible with object_detection_server.py: server returns success, detected, count, objects[] with class_label, img_id, confidence, bbox.
+ * Use "count" for detection (integer); prefer "img_id" from JSON; do not skip Bullseye — use the most confident object with a valid img_id.
+ * Returns 0 and fills out with that object (its class_label points into the response), or -1 if the response holds none.
+ * With a worker, every object is also kept in worker->parsed_objects, for a shared snapshot. */
+static int parse_detection(ImageWorker* worker, const char* image_server_response, size_t len, int obstacle_id,
+                           Detection* out) {
+    Detection scratch[DETECTION_MAX_OBJECTS];
+    Detection* objects = worker ? worker->parsed_objects : scratch;
+    int count = parse_detection_json(image_server_response, len, objects, DETECTION_MAX_OBJECTS);
+    if (worker) worker->parsed_count = count > 0 ? count : 0;
+    if (count < 0) {
+        LOG_ERROR("[ImgThread] Malformed image server response for obstacle %d.\n", obstacle_id);
+        return -1;
+    }
+    if (count == 0) {
+        LOG_INFO("[ImgThread] No object detected by image server for obstacle %d.\n", obstacle_id);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (objects[i].img_id >= 0) {
+            *out = objects[i];
+            return 0;
+        }
+        if (objects[i].class_label.len > 0) {
+            LOG_ERROR("[ImgThread] Unknown class label received or invalid img_id: %.*s\n",
+                    objects[i].class_label.len, objects[i].class_label.ptr);
+        }
+    }
+    LOG_ERROR("[ImgThread] No valid object with img_id for obstacle %d.\n", obstacle_id);
+    return -1;
+}
+
+// The burst's answer now comes from the reply parse_detection() last read.
+// Its labels point into that reply, which the worker keeps until the next snapshot.
+static void adopt_reply_objects(ImageWorker* worker) {
+    memcpy(worker->reply_objects, worker->parsed_objects, (size_t)worker->parsed_count * sizeof(Detection));
+    worker->reply_count = worker->parsed_count;
+}
+
+// Runs the on-Pi model on one frame. Returns 0 with *out filled, or -1.
+static int local_detect_frame(ImageWorker* worker, const struct MemoryStruct* frame, Detection* out) {
+    uint64_t started_ns = latency_now_ns();
+    int rc = local_detect(worker->local, &worker->preprocessor, frame, out);
+    metric_observe_since(METRIC_HIST_LOCAL_INFER_US, started_ns);
+    if (rc == 0) metric_inc(METRIC_IMAGE_LOCAL_DETECTIONS);
+    return rc;
+}
+
+// Runs the on-Pi model over the burst, stopping at the first confident frame.
+// Returns 0 with *best filled, or -1 if no frame was recognised.
+static int local_detect_burst(ImageWorker* worker, int frame_count, Detection* best) {
+    bool found = false;
+    for (int i = 0; i < frame_count; i++) {
+        Detection detection;
+        if (local_detect_frame(worker, &worker->uploads[i].frame, &detection) != 0) continue;
+        if (!found || detection.confidence > best->confidence) *best = detection;
+        found = true;
+        if (best->confidence >= IMAGE_CONFIDENCE_THRESHOLD) break;
+    }
+    return found ? 0 : -1;
+}
+
+// Uploads the first frame_count frames concurrently. The first detection at or
+// above IMAGE_CONFIDENCE_THRESHOLD wins and the other transfers are cancelled;
+// otherwise the most confident detection among all replies is used. With race,
+// the worker also runs the on-Pi model on one frame after another between polls,
+// and its answers compete with the replies.
+// Returns 0 with *best filled, or -1 if no reply held a detection.
+static int upload_burst(ImageWorker* worker, int obstacle_id, int frame_count, bool race, Detection* best) {
+    bool found = false;
+    bool confident = false;
+    int running = 0;
+    int local_next = race ? 0 : frame_count; // Next frame for the model
+
+    for (int i = 0; i < frame_count; i++) {
+        BurstUpload* upload = &worker->uploads[i];
+        if (!upload->curl || prepare_image_upload(upload, obstacle_id) != 0) continue;
+        if (curl_multi_add_handle(worker->multi, upload->curl) != CURLM_OK) {
+            finish_image_upload(worker, upload);
+            continue;
+        }
+        upload->active = true;
+        upload->started_ns = latency_now_ns();
+        metric_inc(METRIC_IMAGE_UPLOADS);
+        if (trace_enabled()) {
+            // The replay only needs to know which obstacle a frame was for, not the JPEG
+            char id_str[12];
+            int id_len = snprintf(id_str, sizeof(id_str), "%d", obstacle_id);
+            trace_record(TRACE_CH_HTTP_IMAGE, TRACE_DIR_OUT, 0, id_str, (size_t)id_len);
+        }
+        running++;
+    }
+    if (running == 0) {
+        LOG_ERROR("[ImgThread %d] No upload could be started.\n", worker->worker_id);
+        if (!race) return -1;
+    }
+
+    while ((running > 0 || local_next < frame_count) && !confident && !worker_cancelled(worker)) {
+        if (running > 0 && curl_multi_perform(worker->multi, &running) != CURLM_OK) running = 0;
+
+        CURLMsg* msg;
+        int queued;
+        while (!confident && (msg = curl_multi_info_read(worker->multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            BurstUpload* upload = NULL;
+            for (int i = 0; i < frame_count; i++) {
+                if (worker->uploads[i].active && worker->uploads[i].curl == msg->easy_handle) upload = &worker->uploads[i];
+            }
+            if (!upload) continue;
+            CURLcode res = msg->data.result; // msg is invalid once the handle is removed
+            finish_image_upload(worker, upload);
+
+            long code = 0;
+            curl_easy_getinfo(upload->curl, CURLINFO_RESPONSE_CODE, &code);
+            if (res == CURLE_OK && code >= 200 && code < 300) observe_upload_link(upload->curl);
+            // The uploads overlap, so each reply is a mark inside the worker's detect span
+            timeline_instant(latency_now_ns(), "reply frame %d: %ld", (int)(upload - worker->uploads),
+                             res == CURLE_OK ? code : -1L);
+            trace_record(TRACE_CH_HTTP_IMAGE, TRACE_DIR_IN, res == CURLE_OK ? (uint16_t)code : 0,
+                         upload->response.memory, res == CURLE_OK ? upload->response.size : 0);
+            if (res != CURLE_OK) {
+                LOG_ERROR("[ImgThread] Image upload failed: %s\n", curl_easy_strerror(res));
+                metric_inc(METRIC_IMAGE_UPLOAD_FAILURES);
+                continue;
+            }
+            metric_observe_since(METRIC_HIST_IMAGE_UPLOAD_US, upload->started_ns);
+            if (code < 200 || code >= 300) {
+                LOG_ERROR("[ImgThread] Image server returned non-2xx response: %ld\n", code);
+                metric_inc(METRIC_IMAGE_UPLOAD_FAILURES);
+                continue;
+            }
+            LOG_DEBUG("[ImgThread] Image server response (frame %d): %s\n", (int)(upload - worker->uploads),
+                   upload->response.memory ? upload->response.memory : "");
+
+            Detection detection;
+            if (upload->response.memory &&
+                parse_detection(worker, upload->response.memory, upload->response.size, obstacle_id, &detection) == 0 &&
+                (!found || detection.confidence > best->confidence)) {
+                adopt_reply_objects(worker);
+                *best = detection;
+                found = true;
+                confident = detection.confidence >= IMAGE_CONFIDENCE_THRESHOLD;
+            }
+        }
+        if (confident) break;
+        if (local_next < frame_count) {
+            // The uploads carry on in the kernel's socket buffers meanwhile
+            Detection detection;
+            if (local_detect_frame(worker, &worker->uploads[local_next++].frame, &detection) == 0 &&
+                (!found || detection.confidence > best->confidence)) {
+                *best = detection;
+                found = true;
+                confident = detection.confidence >= IMAGE_CONFIDENCE_THRESHOLD;
+            }
+            continue;
+        }
+        // A STOP wakes the poll (cancel_mission())
+        if (running > 0) curl_multi_poll(worker->multi, NULL, 0, 1000, NULL);
+    }
+
+    // Cancel whatever is still uploading; its answer is no longer needed.
+    for (int i = 0; i < frame_count; i++) {
+        if (worker->uploads[i].form) finish_image_upload(worker, &worker->uploads[i]);
+    }
+    return found ? 0 : -1;
+}
+
+// Hands the burst to the shared-memory detector on the worker's own lane.
+// Returns 0 with *best filled (its class_label points into the worker), -1 if no
+// frame was recognised, or -2 if the detector is unavailable (upload instead).
+static int detect_burst_shm(ImageWorker* worker, int obstacle_id, int frame_count, Detection* best) {
+    struct MemoryStruct frames[IMAGE_BURST_FRAMES];
+    for (int i = 0; i < frame_count; i++) frames[i] = worker->uploads[i].frame;
+    ShmResult* result = &worker->shm_result;
+    int rc = shm_detect_burst(worker->worker_id, obstacle_id, frames, frame_count, IMAGE_CONFIDENCE_THRESHOLD, result);
+    if (rc != 0) return rc;
+    best->img_id = result->img_id;
+    best->confidence = result->confidence;
+    best->class_label = (JsonSpan){ result->class_label, (int)strlen(result->class_label) };
+    best->has_bbox = result->has_bbox != 0;
+    for (int i = 0; i < 4; i++) best->bbox[i] = result->bbox[i];
+    return 0;
+}
+
+// Sends the burst's frames as concurrent requests on the image server's channel.
+// The rule is upload_burst()'s: the first confident reply wins, the rest are
+// cancelled, and with race the on-Pi model runs between replies. Returns 0 with
+// *best filled (its class_label points into worker->channel_reply), -1 if no
+// reply held a detection, or -2 if the channel went down before anything was
+// recognised (upload instead).
+static int detect_burst_channel(ImageWorker* worker, int obstacle_id, int frame_count, bool race, Detection* best) {
+    char meta[32];
+    int meta_len = snprintf(meta, sizeof(meta), "{\"object_id\":%d}", obstacle_id);
+    ServerChannel* channel = atomic_load(&g_image_channel);
+    uint32_t ids[IMAGE_BURST_FRAMES] = {0};
+    int pending = 0;
+    for (int i = 0; i < frame_count; i++) {
+        BurstUpload* upload = &worker->uploads[i];
+        upload->started_ns = latency_now_ns();
+        ids[i] = server_channel_send(channel, CHANNEL_OP_DETECT, meta, (size_t)meta_len,
+                                     upload->frame.memory, upload->frame.size);
+        if (ids[i] == 0) continue;
+        metric_inc(METRIC_IMAGE_UPLOADS);
+        pending++;
+    }
+    if (pending == 0) return -2;
+    server_channel_message_free(&worker->channel_reply); // The last snapshot has been reported
+
+    bool found = false;
+    bool confident = false;
+    int local_next = race ? 0 : frame_count; // Next frame for the model
+    uint64_t deadline_ns = latency_now_ns() + (uint64_t)IMAGE_CHANNEL_TIMEOUT_MS * 1000000ULL;
+    while (pending > 0 && !confident && !worker_cancelled(worker)) {
+        int64_t left_ms = ((int64_t)deadline_ns - (int64_t)latency_now_ns()) / 1000000;
+        if (left_ms <= 0) {
+            LOG_ERROR("[ImgThread %d] No channel reply within %d ms.\n", worker->worker_id, IMAGE_CHANNEL_TIMEOUT_MS);
+            break;
+        }
+        // While the model has frames left, only collect replies that are already in
+        int which;
+        ChannelMessage reply;
+        int rc = server_channel_wait_any(channel, ids, frame_count, local_next < frame_count ? 0 : (int)left_ms,
+                                         &which, &reply);
+        if (rc == 0 || rc == -1) {
+            BurstUpload* upload = &worker->uploads[which];
+            ids[which] = 0;
+            pending--;
+            timeline_instant(latency_now_ns(), "reply frame %d: channel%s", which, rc == 0 ? "" : " error");
+            if (rc != 0) {
+                metric_inc(METRIC_IMAGE_UPLOAD_FAILURES);
+                continue;
+            }
+            metric_observe_since(METRIC_HIST_IMAGE_UPLOAD_US, upload->started_ns);
+            image_upload_observe(upload->frame.size, (double)(latency_now_ns() - upload->started_ns) / 1e9, -1.0);
+            LOG_DEBUG("[ImgThread] Image server response (frame %d, channel): %s\n", which, reply.meta);
+
+            Detection detection;
+            if (parse_detection(worker, reply.meta, reply.meta_len, obstacle_id, &detection) == 0 &&
+                (!found || detection.confidence > best->confidence)) {
+                server_channel_message_free(&worker->channel_reply);
+                worker->channel_reply = reply;
+                adopt_reply_objects(worker);
+                *best = detection;
+                found = true;
+                confident = detection.confidence >= IMAGE_CONFIDENCE_THRESHOLD;
+            } else {
+                server_channel_message_free(&reply);
+            }
+            continue;
+        }
+        if (rc == -3) continue; // Woken by a STOP: the loop condition decides
+        if (!server_channel_available(channel)) {
+            LOG_WARN("[ImgThread %d] Image channel dropped mid-burst.\n", worker->worker_id);
+            break; // Every request failed with the connection
+        }
+        if (local_next < frame_count) {
+            Detection detection;
+            if (local_detect_frame(worker, &worker->uploads[local_next++].frame, &detection) == 0 &&
+                (!found || detection.confidence > best->confidence)) {
+                *best = detection;
+                found = true;
+                confident = detection.confidence >= IMAGE_CONFIDENCE_THRESHOLD;
+            }
+        }
+    }
+
+    // Whatever is still being recognised is no longer needed
+    for (int i = 0; i < frame_count; i++) {
+        if (ids[i]) server_channel_cancel(channel, ids[i]);
+    }
+    if (!found && !server_channel_available(channel)) return -2;
+    return found ? 0 : -1;
+}
+
+// The server's answer for the burst: through shared memory when a detector is
+// attached, else on the image server's channel when it is up, else over HTTP
+// (racing the on-Pi model if race). Recorded runs stay on HTTP so the trace
+// holds every detector reply. Returns 0 or -1.
+static int remote_detect_burst(ImageWorker* worker, int obstacle_id, int frame_count, bool race, Detection* best) {
+    int detected = -2;
+    if (shm_detector_available() && !trace_enabled()) {
+        detected = detect_burst_shm(worker, obstacle_id, frame_count, best);
+    }
+    if (detected == -2 && channel_usable(atomic_load(&g_image_channel))) {
+        detected = detect_burst_channel(worker, obstacle_id, frame_count, race, best);
+    }
+    if (detected == -2) detected = upload_burst(worker, obstacle_id, frame_count, race, best);
+    return detected;
+}
+
+// Picks the answer for a burst under g_detect_policy. Returns 0 with *best
+// filled, or -1 if neither the server nor the model recognised a frame.
+static int detect_burst(ImageWorker* worker, int obstacle_id, int frame_count, Detection* best) {
+    if (!worker->local) return remote_detect_burst(worker, obstacle_id, frame_count, false, best);
+
+    if (g_detect_policy == DETECT_LOCAL_FIRST) {
+        Detection local;
+        bool have_local = local_detect_burst(worker, frame_count, &local) == 0;
+        if (have_local && local.confidence >= IMAGE_CONFIDENCE_THRESHOLD) {
+            *best = local;
+            return 0;
+        }
+        if (remote_detect_burst(worker, obstacle_id, frame_count, false, best) == 0 &&
+            (!have_local || best->confidence >= local.confidence)) {
+            return 0;
+        }
+        if (have_local) *best = local;
+        return have_local ? 0 : -1;
+    }
+    bool race = g_detect_policy == DETECT_RACE && !(shm_detector_available() && !trace_enabled());
+    if (remote_detect_burst(worker, obstacle_id, frame_count, race, best) == 0) return 0;
+    if (race) return -1; // The model has already seen every frame
+    LOG_INFO("[ImgThread %d] No answer from the server; trying the on-Pi model.\n", worker->worker_id);
+    return local_detect_burst(worker, frame_count, best);
+}
+
+// Member m of task's frame as a snapshot of its own: task itself for 0, else
+// the task of shared obstacle m - 1, from the same pose.
+static void snapshot_member(const ImageTask* task, int m, ImageTask* out) {
+    *out = *task;
+    out->shared_count = 0;
+    if (m == 0) return;
+    out->obstacle_id = task->shared[m - 1].obstacle_id;
+    out->has_obstacle = task->shared[m - 1].has_obstacle;
+    out->obstacle = task->shared[m - 1].obstacle;
+    out->ticket = task->shared[m - 1].ticket;
+}
+
+// Where the symbol of task's obstacle alone should be; see snapshot_roi().
+static const ImageRoi* obstacle_roi(const ImageTask* task, ImageRoi* roi) {
+    *roi = (ImageRoi){ 0, 0, CAMERA_WIDTH, CAMERA_HEIGHT };
+    if (task->has_obstacle &&
+        image_roi_for_snapshot(&task->robot_snap_position, &task->obstacle, CAMERA_WIDTH, CAMERA_HEIGHT, roi) == 0) {
+        return roi;
+    }
+    return NULL;
+}
+
+// Where task's symbol should be in its frames (image_roi_for_snapshot()): roi,
+// or NULL for the whole frame. roi is filled either way. A shared snapshot
+// keeps the box around all its obstacles', or the whole frame if one has none.
+static const ImageRoi* snapshot_roi(const ImageTask* task, ImageRoi* roi) {
+    if (!obstacle_roi(task, roi)) return NULL;
+    for (int m = 1; m <= task->shared_count; m++) {
+        ImageTask member;
+        ImageRoi other;
+        snapshot_member(task, m, &member);
+        if (!obstacle_roi(&member, &other)) {
+            *roi = other; // The whole frame
+            return NULL;
+        }
+        int x2 = roi->x + roi->width > other.x + other.width ? roi->x + roi->width : other.x + other.width;
+        int y2 = roi->y + roi->height > other.y + other.height ? roi->y + roi->height : other.y + other.height;
+        if (other.x < roi->x) roi->x = other.x;
+        if (other.y < roi->y) roi->y = other.y;
+        roi->width = x2 - roi->x;
+        roi->height = y2 - roi->y;
+    }
+    return roi;
+}
+
+static void swap_frames(struct MemoryStruct* a, struct MemoryStruct* b) {
+    struct MemoryStruct held = *a;
+    *a = *b;
+    *b = held;
+}
+
+// The quality gate (USE_IMAGE_QUALITY_GATE): measures each of the frame_count
+// frames in the symbol's region and captures a failing one again while
+// recaptures last. Returns how many frames to keep, moved to the front; 0 only
+// if every recapture of every frame failed.
+static int gate_burst(ImageWorker* worker, const ImageTask* task, struct MemoryStruct* const frames[],
+                      int frame_count) {
+    ImageRoi roi;
+    const ImageRoi* crop = snapshot_roi(task, &roi);
+    int recaptures = 0, kept = 0, sharpest = -1;
+    double sharpest_value = -1.0;
+    for (int i = 0; i < frame_count; i++) {
+        ImageQuality quality;
+        const char* problem = NULL;
+        while (image_quality_measure(&worker->preprocessor, frames[i], crop, &quality) == 0 &&
+               (problem = image_quality_problem(&quality)) != NULL && recaptures < IMAGE_QUALITY_RECAPTURES) {
+            LOG_INFO("[ImgThread %d] Frame %d is %s (sharpness %.0f, %.0f%% dark, %.0f%% bright); capturing it again.\n",
+                     worker->worker_id, i + 1, problem, quality.sharpness, quality.dark * 100.0, quality.bright * 100.0);
+            metric_inc(METRIC_IMAGE_RECAPTURES);
+            recaptures++;
+            problem = NULL;
+            if (capture_image(frames[i]) != 0) {
+                problem = "lost";
+                break;
+            }
+        }
+        if (!problem) {
+            if (sharpest == kept) sharpest = i; // Swapped to where frame i was
+            swap_frames(frames[kept++], frames[i]);
+            continue;
+        }
+        metric_inc(METRIC_IMAGE_FRAMES_REJECTED);
+        if (frames[i]->size > 0 && quality.sharpness > sharpest_value) {
+            sharpest = i;
+            sharpest_value = quality.sharpness;
+        }
+    }
+    if (kept == 0 && sharpest >= 0) {
+        LOG_WARN("[ImgThread %d] No frame passed the quality gate; sending the sharpest.\n", worker->worker_id);
+        swap_frames(frames[0], frames[sharpest]);
+        kept = 1;
+    } else if (kept < frame_count) {
+        LOG_INFO("[ImgThread %d] Quality gate kept %d of %d frame(s) after %d recapture(s).\n", worker->worker_id,
+                 kept, frame_count, recaptures);
+    }
+    return kept;
+}
+
+// Fills frames[] with the sharpest IMAGE_BURST_FRAMES of the ring's frames
+// exposed since task->rest_ns, sharpest first and measured in the symbol's
+// region; frames that cannot be measured rank last, and ties go to the
+// earlier. Returns how many, 0 if none arrived in time, -1 without the ring.
+static int pick_ring_frames(ImageWorker* worker, const ImageTask* task, struct MemoryStruct* const frames[]) {
+    enum { CANDIDATES = sizeof(worker->ring_frames) / sizeof(worker->ring_frames[0]) };
+    struct MemoryStruct* candidates[CANDIDATES];
+    uint64_t exposed_ns[CANDIDATES];
+    for (int i = 0; i < CANDIDATES; i++) candidates[i] = &worker->ring_frames[i];
+    int count = capture_image_since(task->rest_ns, candidates, exposed_ns, CANDIDATES);
+    if (count <= 0) return count;
+
+    ImageRoi roi;
+    const ImageRoi* crop = snapshot_roi(task, &roi);
+    double sharpness[CANDIDATES];
+    for (int i = 0; i < count; i++) {
+        ImageQuality quality;
+        sharpness[i] = image_quality_measure(&worker->preprocessor, candidates[i], crop, &quality) == 0
+                           ? quality.sharpness : -1.0;
+    }
+    int picked = count < IMAGE_BURST_FRAMES ? count : IMAGE_BURST_FRAMES;
+    bool used[CANDIDATES] = { false };
+    for (int k = 0; k < picked; k++) {
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            if (!used[i] && (best < 0 || sharpness[i] > sharpness[best])) best = i;
+        }
+        used[best] = true;
+        swap_frames(frames[k], candidates[best]); // Both allocations are kept
+    }
+    uint64_t now_ns = latency_now_ns();
+    LOG_INFO("[ImgThread %d] Picked %d of %d ring frame(s) exposed since rest, %llu ms ago.\n", worker->worker_id,
+             picked, count, (unsigned long long)(now_ns > task->rest_ns ? (now_ns - task->rest_ns) / 1000000ULL : 0));
+    return picked;
+}
+
+// Replaces frame with its cropped, downscaled re-encode when that works, sized
+// for the current Wi-Fi (image_upload_pick()).
+// Runs after the nav thread has been released, so it only delays the upload.
+static void shrink_frame_for_upload(ImageWorker* worker, const ImageTask* task, struct MemoryStruct* frame) {
+    ImageRoi roi;
+    const ImageRoi* crop = snapshot_roi(task, &roi);
+    ImageUploadSettings settings = image_upload_pick(roi.width, roi.height);
+    metric_gauge_set(METRIC_GAUGE_UPLOAD_WIDTH, settings.max_width);
+    metric_gauge_set(METRIC_GAUGE_UPLOAD_QUALITY, settings.quality);
+    if (image_preprocess(&worker->preprocessor, frame, crop, settings.max_width, settings.quality) != 0) {
+        LOG_ERROR("[ImgThread %d] Could not preprocess frame; uploading it as captured.\n", worker->worker_id);
+        return;
+    }
+    LOG_INFO("[ImgThread %d] Frame reduced from %zu to %zu bytes for upload (%dx%d, quality %d).\n",
+           worker->worker_id, frame->size, worker->preprocessor.jpeg.size, worker->preprocessor.width,
+           worker->preprocessor.height, settings.quality);
+    worker->upload_view = worker->preprocessor.crop;
+    worker->upload_width = worker->preprocessor.width;
+    worker->upload_height = worker->preprocessor.height;
+    // Swap buffers so both allocations are kept for the next snapshot
+    struct MemoryStruct captured = *frame;
+    *frame = worker->preprocessor.jpeg;
+    worker->preprocessor.jpeg = captured;
+}
+
+// Sends the robot's position at obstacle_id's snapshot to Android (Python's
+// ROBOT,x,y,d) and the live feed.
+static void send_robot_position(SharedAppContext* context, int obstacle_id, const SnapPosition* at) {
+    char robot_pos_msg[64];
+    JsonWriter w;
+    // Use +1 for x and y to match Python's 1-indexed coordinates for Android
+    const char* dir_str = (at->d >= 0 && at->d < 8) ? DIR_MAP_ANDROID_STR[at->d] : "U"; // U for unknown
+    jw_init(&w, robot_pos_msg, sizeof(robot_pos_msg));
+    jw_raw_str(&w, "\"ROBOT,");
+    jw_raw_int(&w, at->x + 1);
+    jw_raw(&w, ",", 1);
+    jw_raw_int(&w, at->y + 1);
+    jw_raw(&w, ",", 1);
+    jw_raw_str(&w, dir_str);
+    jw_raw(&w, "\"\n", 2);
+    send_message_to_android_with_ack(context->android_fd, robot_pos_msg);
+    LOG_INFO("[ImgThread] Sent robot position to Android: %s", robot_pos_msg);
+    feed_robot(obstacle_id, at);
+}
+
+static void snapshot_answered(SharedAppContext* context, uint32_t ticket, bool failed);
+
+// context->lock held. ticket's entry, NULL once a newer ticket has its slot.
+static SnapshotTicket* snapshot_ticket(SharedAppContext* context, uint32_t ticket) {
+    SnapshotTicket* entry = &context->snapshot_tickets[ticket % SNAPSHOT_TICKETS];
+    return ticket != 0 && entry->ticket == ticket ? entry : NULL;
+}
+
+// Where ticket stands; a ticket whose slot was reused counts as failed.
+static SnapshotTicketState snapshot_ticket_state(SharedAppContext* context, uint32_t ticket) {
+    pthread_mutex_lock(&context->lock);
+    const SnapshotTicket* entry = snapshot_ticket(context, ticket);
+    SnapshotTicketState state = entry ? entry->state : TICKET_CAPTURE_FAILED;
+    pthread_mutex_unlock(&context->lock);
+    return state;
+}
+
+// Records the capture of task_args and each obstacle sharing its frame, and
+// wakes the nav thread, which waits on the first one's ticket.
+static void snapshot_captured(SharedAppContext* context, const ImageTask* task_args, bool captured) {
+    uint64_t now_ns = latency_now_ns();
+    pthread_mutex_lock(&context->lock);
+    for (int m = 0; m <= task_args->shared_count; m++) {
+        SnapshotTicket* entry =
+            snapshot_ticket(context, m == 0 ? task_args->ticket : task_args->shared[m - 1].ticket);
+        if (!entry || entry->state != TICKET_QUEUED) continue;
+        entry->state = captured ? TICKET_CAPTURED : TICKET_CAPTURE_FAILED;
+        if (captured) entry->captured_ns = now_ns;
+    }
+    pthread_mutex_unlock(&context->lock);
+    wake_nav(context);
+}
+
+// Answers a rolling snapshot that got no frame as failed, to be retried from a stop.
+static void rolling_snapshot_failed(SharedAppContext* context, const ImageTask* task_args, uint64_t started_ns) {
+    bool report_done = mission_report_answered(task_args->mission_epoch, task_args->obstacle_id, false, started_ns,
+                                               latency_now_ns());
+    snapshot_answered(context, task_args->ticket, true);
+    if (report_done) emit_mission_report(context);
+}
+
+// Captures task_args's burst into frames[], recapturing frames the quality
+// gate rejects, and lets the nav thread move on, then reports the robot's position to Android and shrinks the frames for
+// upload. Returns the number of frames captured; 0 when the capture failed
+// (the nav thread has been told, or a rolling snapshot answered as failed).
+static int capture_snapshot(ImageWorker* worker, const ImageTask* task_args, struct MemoryStruct* const frames[],
+                            uint64_t started_ns) {
+    SharedAppContext* context = worker->context;
+    bool rolling = task_args->pass_ns != 0; // The nav thread is not waiting; the robot is driving on
+    if (rolling && started_ns - task_args->pass_ns > (uint64_t)ROLLING_CAPTURE_LATE_MS * 1000000ULL) {
+        LOG_WARN("[ImgThread] Obstacle %d's pass was %llu ms ago; the robot is off its viewing pose.\n",
+                 task_args->obstacle_id, (unsigned long long)((started_ns - task_args->pass_ns) / 1000000ULL));
+        camera_set_motion_exposure(false);
+        rolling_snapshot_failed(context, task_args, started_ns);
+        return 0;
+    }
+
+    // The robot holds still until the nav thread hears back, so grab the whole
+    // burst first: from the frame ring when the firmware said when it came to
+    // rest, otherwise each capture is a fresh frame from the warm stream.
+    int frame_count = 0;
+    if (!rolling && task_args->rest_ns != 0) frame_count = pick_ring_frames(worker, task_args, frames);
+    if (frame_count <= 0) {
+        frame_count = 0;
+        LOG_INFO("[ImgThread] Capturing %d frames for obstacle %d...\n", IMAGE_BURST_FRAMES, task_args->obstacle_id);
+        while (frame_count < IMAGE_BURST_FRAMES && capture_image(frames[frame_count]) == 0) {
+            frame_count++;
+        }
+    }
+    uint64_t captured_ns = latency_now_ns();
+    timeline_span(started_ns, captured_ns, "capture x%d", frame_count);
+    if (rolling) camera_set_motion_exposure(false);
+    // A recapture of a rolling snapshot would be taken past its pose
+    if (USE_IMAGE_QUALITY_GATE && frame_count > 0 && !rolling) {
+        frame_count = gate_burst(worker, task_args, frames, frame_count);
+        timeline_span(captured_ns, latency_now_ns(), "quality gate");
+    }
+    if (frame_count == 0) {
+        LOG_ERROR("[ImgThread] Failed to capture image.\n");
+        if (rolling) {
+            rolling_snapshot_failed(context, task_args, started_ns);
+            return 0;
+        }
+        snapshot_captured(context, task_args, false);
+        return 0;
+    }
+
+    LOG_INFO("[ImgThread] Captured %d frame(s) for obstacle %d.\n", frame_count, task_args->obstacle_id);
+#ifdef CAPTURE_DEBUG_DUMP
+    FILE* dump = fopen(worker->capture_filename, "wb");
+    if (dump) {
+        fwrite(frames[0]->memory, 1, frames[0]->size, dump);
+        fclose(dump);
+    }
+#endif
+    snapshot_captured(context, task_args, true); // The nav thread waits for this unless rolling
+
+    send_robot_position(context, task_args->obstacle_id, &task_args->robot_snap_position);
+
+    worker->upload_view = (ImageRoi){ 0, 0, CAMERA_WIDTH, CAMERA_HEIGHT }; // Until a frame is shrunk
+    worker->upload_width = CAMERA_WIDTH;
+    worker->upload_height = CAMERA_HEIGHT;
+    if (USE_IMAGE_PREPROCESS) {
+        uint64_t preprocess_ns = latency_now_ns();
+        for (int i = 0; i < frame_count; i++) shrink_frame_for_upload(worker, task_args, frames[i]);
+        timeline_span(preprocess_ns, latency_now_ns(), "preprocess");
+    }
+    return frame_count;
+}
+
+// The bullseye marks the faces of an obstacle that carry no image.
+static bool detection_is_bullseye(const Detection* detection) {
+    return detection->class_label.len >= 8 && strncasecmp(detection->class_label.ptr, "Bullseye", 8) == 0;
+}
+
+// Records the answer to the snapshot of ticket and wakes the nav thread, which
+// retries a failed one (see "Snapshot retries"). The obstacle's outcome only
+// takes the answer of its latest snapshot.
+static void snapshot_answered(SharedAppContext* context, uint32_t ticket, bool failed) {
+    int obstacle_id = 0;
+    pthread_mutex_lock(&context->lock);
+    SnapshotTicket* entry = snapshot_ticket(context, ticket);
+    if (entry && entry->state != TICKET_ANSWERED) {
+        entry->state = TICKET_ANSWERED;
+        obstacle_id = entry->obstacle_id;
+        for (int i = 0; i < context->snapshot_outcome_count; i++) {
+            SnapshotOutcome* outcome = &context->snapshot_outcomes[i];
+            if (outcome->ticket == ticket && outcome->status == SNAPSHOT_PENDING) {
+                outcome->status = failed ? SNAPSHOT_FAILED : SNAPSHOT_DETECTED;
+            }
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    if (obstacle_id == 0) {
+        LOG_WARN("[ImgThread] Snapshot ticket %u was answered already or is gone; ignoring the answer.\n", ticket);
+        return;
+    }
+    if (!failed) checkpoint_reported(obstacle_id);
+    wake_nav(context);
+}
+
+// Whether ticket still waits for its answer.
+static bool snapshot_ticket_open(SharedAppContext* context, uint32_t ticket) {
+    SnapshotTicketState state = snapshot_ticket_state(context, ticket);
+    return state == TICKET_QUEUED || state == TICKET_CAPTURED;
+}
+
+// Sends a snapshot's answer (detected == 0) to Android.
+static void report_snapshot(ImageWorker* worker, const ImageTask* task_args, uint64_t started_ns, int detected,
+                            const Detection* detection) {
+    SharedAppContext* context = worker->context;
+    if (worker_cancelled(worker)) {
+        LOG_INFO("[ImgThread %d] Mission stopped; dropping the answer for obstacle %d.\n", worker->worker_id,
+                 task_args->obstacle_id);
+        return;
+    }
+    if (!snapshot_ticket_open(context, task_args->ticket)) {
+        LOG_WARN("[ImgThread %d] Snapshot ticket %u (obstacle %d) is closed; dropping its answer.\n",
+                 worker->worker_id, task_args->ticket, task_args->obstacle_id);
+        return;
+    }
+    timeline_span(started_ns, latency_now_ns(), "snapshot %d -> %d", task_args->obstacle_id,
+                  detected == 0 ? detection->img_id : -1);
+    bool bullseye = detected == 0 && detection_is_bullseye(detection);
+    feed_detection(task_args->obstacle_id, detected == 0 ? detection : NULL);
+    if (bullseye) {
+        LOG_INFO("[ImgThread] Obstacle %d showed the bullseye: this face has no image.\n", task_args->obstacle_id);
+    } else if (detected == 0) {
+        /* Send TARGET,object_id,img_id to Android (e.g. "TARGET,1,11") */
+        send_target_result_to_android(context->android_fd, task_args->obstacle_id, detection->img_id);
+        metric_inc(METRIC_IMAGE_DETECTIONS);
+        metric_observe_since(METRIC_HIST_SNAPSHOT_US, started_ns);
+        LOG_INFO("[ImgThread] Sent image detection result to Android: obstacle_id=%d, class_label=%.*s, img_id=%d, confidence=%.2f\n",
+               task_args->obstacle_id, detection->class_label.len, detection->class_label.ptr, detection->img_id,
+               detection->confidence);
+        if (detection->has_bbox) {
+            LOG_INFO("[ImgThread] Obstacle %d bbox: (%.0f, %.0f)-(%.0f, %.0f)\n", task_args->obstacle_id,
+                   detection->bbox[0], detection->bbox[1], detection->bbox[2], detection->bbox[3]);
+        }
+    } else {
+        LOG_ERROR("[ImgThread] No frame of the burst produced a detection for obstacle %d.\n", task_args->obstacle_id);
+    }
+    bool report_done = mission_report_answered(task_args->mission_epoch, task_args->obstacle_id,
+                                               detected == 0 && !bullseye, started_ns, latency_now_ns());
+    // After the TARGET, which Android should see before the mission ends
+    snapshot_answered(context, task_args->ticket, detected != 0 || bullseye);
+    if (report_done) emit_mission_report(context);
+}
+
+static bool same_detection(const Detection* a, const Detection* b) {
+    return a->img_id == b->img_id && a->confidence == b->confidence && a->has_bbox == b->has_bbox &&
+           memcmp(a->bbox, b->bbox, sizeof(a->bbox)) == 0;
+}
+
+// Sends the answer of a shared snapshot (ImageTask::shared) for each of its
+// obstacles. Every object of the reply the answer came from goes to the
+// obstacle whose predicted region is nearest its box's centre, and each
+// obstacle takes its most confident one. An answer without boxes stays with
+// the first obstacle, and the others count as not recognised.
+static void report_shared_snapshot(ImageWorker* worker, const ImageTask* task_args, uint64_t started_ns,
+                                   int detected, const Detection* detection) {
+    int count = task_args->shared_count + 1;
+    ImageTask members[SNAPSHOT_GROUP_MAX];
+    ImageRoi rois[SNAPSHOT_GROUP_MAX];
+    bool has_roi[SNAPSHOT_GROUP_MAX];
+    Detection answers[SNAPSHOT_GROUP_MAX];
+    bool found[SNAPSHOT_GROUP_MAX] = { false };
+    for (int m = 0; m < count; m++) {
+        snapshot_member(task_args, m, &members[m]);
+        has_roi[m] = obstacle_roi(&members[m], &rois[m]) != NULL;
+    }
+
+    if (detected == 0) {
+        // A local or shared-memory answer carries only itself
+        const Detection* objects = detection;
+        int n = 1;
+        for (int i = 0; i < worker->reply_count; i++) {
+            if (same_detection(&worker->reply_objects[i], detection)) {
+                objects = worker->reply_objects;
+                n = worker->reply_count;
+            }
+        }
+        bool boxed = false;
+        for (int i = 0; i < n; i++) {
+            const Detection* object = &objects[i];
+            if (!object->has_bbox || object->img_id < 0 || worker->upload_width <= 0 || worker->upload_height <= 0) {
+                continue;
+            }
+            // Back from the uploaded frame to the full frame
+            const ImageRoi* view = &worker->upload_view;
+            double cx = view->x + (object->bbox[0] + object->bbox[2]) / 2.0 * view->width / worker->upload_width;
+            double cy = view->y + (object->bbox[1] + object->bbox[3]) / 2.0 * view->height / worker->upload_height;
+            int owner = -1;
+            double owner_dist = 0.0;
+            for (int m = 0; m < count; m++) {
+                if (!has_roi[m]) continue;
+                double dx = cx - (rois[m].x + rois[m].width / 2.0);
+                double dy = cy - (rois[m].y + rois[m].height / 2.0);
+                if (owner < 0 || dx * dx + dy * dy < owner_dist) {
+                    owner = m;
+                    owner_dist = dx * dx + dy * dy;
+                }
+            }
+            if (owner < 0) continue;
+            boxed = true;
+            if (!found[owner] || object->confidence > answers[owner].confidence) answers[owner] = *object;
+            found[owner] = true;
+        }
+        if (!boxed) {
+            answers[0] = *detection;
+            found[0] = true;
+        }
+    }
+    for (int m = 0; m < count; m++) {
+        report_snapshot(worker, &members[m], started_ns, found[m] ? 0 : -1, &answers[m]);
+    }
+}
+
+// Takes the oldest queued task. The caller holds queue->mutex and has checked
+// that one is queued.
+static void image_task_pop(ImageTaskQueue* queue, ImageTask* out) {
+    *out = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) % IMAGE_TASK_QUEUE_SIZE;
+    queue->count--;
+    metric_gauge_set(METRIC_GAUGE_IMAGE_QUEUE_DEPTH, queue->count);
+    pthread_cond_signal(&queue->not_full);
+}
+
+// Whether this worker's snapshots go up in batches (IMAGE_BATCH_HOLD_MS).
+static bool image_batching(const ImageWorker* worker) {
+    return IMAGE_BATCH_HOLD_MS > 0 && atomic_load(&g_image_batch_max) > 1 && !worker->local &&
+           !shm_detector_available() && !channel_usable(atomic_load(&g_image_channel)) && !trace_enabled();
+}
+
+// Holds the worker's upload for the next snapshot: each one queued within
+// IMAGE_BATCH_HOLD_MS of the last capture is taken by this worker (the others
+// leave the queue alone meanwhile) and captured into worker->held. Returns how
+// many joined, at most max_held.
+static int hold_for_batch(ImageWorker* worker, int max_held) {
+    ImageTaskQueue* queue = &worker->context->image_queue;
+    int held = 0;
+    while (held < max_held) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline); // The queue's condition variables use the default clock
+        deadline.tv_sec += IMAGE_BATCH_HOLD_MS / 1000;
+        deadline.tv_nsec += (long)(IMAGE_BATCH_HOLD_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        HeldSnapshot* snap = &worker->held[held];
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->batch_holder >= 0) {
+            pthread_mutex_unlock(&queue->mutex); // Another worker is already collecting
+            break;
+        }
+        queue->batch_holder = worker->worker_id;
+        int rc = 0;
+        while (queue->count == 0 && !queue->shutdown && !worker_cancelled(worker) && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&queue->not_empty, &queue->mutex, &deadline);
+        }
+        queue->batch_holder = -1;
+        // A shared snapshot is answered on its own (report_shared_snapshot())
+        bool joined = queue->count > 0 && queue->tasks[queue->head].shared_count == 0 && !queue->shutdown &&
+                      !worker_cancelled(worker);
+        if (joined) image_task_pop(queue, &snap->task);
+        pthread_cond_broadcast(&queue->not_empty); // The other workers may take tasks again
+        pthread_mutex_unlock(&queue->mutex);
+        if (!joined) break;
+
+        snap->started_ns = latency_now_ns();
+        struct MemoryStruct* frames[IMAGE_BURST_FRAMES];
+        for (int i = 0; i < IMAGE_BURST_FRAMES; i++) frames[i] = &snap->frames[i];
+        snap->frame_count = capture_snapshot(worker, &snap->task, frames, snap->started_ns);
+        if (snap->frame_count == 0) break; // The nav thread aborts the run
+        held++;
+    }
+    return held;
+}
+
+// One snapshot of a batched upload.
+typedef struct {
+    const ImageTask* task;
+    uint64_t started_ns;
+    int frame_count;
+    struct MemoryStruct* frames[IMAGE_BURST_FRAMES];
+    bool found;
+    Detection best;
+} BatchEntry;
+
+// Uploads every frame of entries[count] in one request on the worker's first
+// handle and keeps each obstacle's most confident detection. The detections'
+// labels point into that handle's response. Returns 0 once the server has
+// answered for the batch, -1 if the request or its reply failed.
+static int upload_batch(ImageWorker* worker, BatchEntry* entries, int count) {
+    BurstUpload* upload = &worker->uploads[0];
+    CURL* curl = upload->curl;
+    if (!curl) return -1;
+    curl_easy_reset(curl);
+    http_configure_handle(curl);
+    upload->form = curl_mime_init(curl);
+    if (!upload->form) return -1;
+    upload->response.size = 0;
+    int images = 0;
+    for (int e = 0; e < count; e++) {
+        for (int i = 0; i < entries[e].frame_count; i++) {
+            FramePart* part = &worker->batch_parts[images++];
+            *part = (FramePart){ entries[e].frames[i], 0 };
+            if (add_image_part(upload->form, part, entries[e].task->obstacle_id) != 0) {
+                finish_image_upload(worker, upload);
+                return -1;
+            }
+        }
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, config_now()->image_url);
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, upload->form);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&upload->response);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, upload_progress_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)worker);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+    LOG_INFO("[ImgThread %d] Uploading %d snapshots (%d frames) in one request.\n", worker->worker_id, count, images);
+    uint64_t started_ns = latency_now_ns();
+    metric_inc(METRIC_IMAGE_UPLOADS);
+    CURLcode res = curl_easy_perform(curl);
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    if (res == CURLE_OK && code >= 200 && code < 300) observe_upload_link(curl);
+    finish_image_upload(worker, upload);
+    if (res != CURLE_OK || code < 200 || code >= 300 || !upload->response.memory) {
+        LOG_ERROR("[ImgThread %d] Batched upload failed: %s (HTTP %ld)\n", worker->worker_id,
+                  res == CURLE_OK ? "bad status" : curl_easy_strerror(res), code);
+        metric_inc(METRIC_IMAGE_UPLOAD_FAILURES);
+        return -1;
+    }
+    metric_observe_since(METRIC_HIST_IMAGE_UPLOAD_US, started_ns);
+    LOG_DEBUG("[ImgThread] Image server response (batch): %s\n", upload->response.memory);
+
+    DetectionResultSpan results[DETECTION_BATCH_MAX_RESULTS];
+    int n = parse_detection_batch_json(upload->response.memory, upload->response.size, results,
+                                       DETECTION_BATCH_MAX_RESULTS);
+    if (n < 0) {
+        LOG_ERROR("[ImgThread %d] Malformed batched image server response.\n", worker->worker_id);
+        metric_inc(METRIC_IMAGE_UPLOAD_FAILURES);
+        return -1;
+    }
+    for (int r = 0; r < n; r++) {
+        BatchEntry* entry = NULL;
+        for (int e = 0; e < count; e++) {
+            if (entries[e].task->obstacle_id == results[r].object_id) entry = &entries[e];
+        }
+        Detection detection;
+        if (!entry || parse_detection(NULL, results[r].reply.ptr, (size_t)results[r].reply.len, results[r].object_id,
+                                      &detection) != 0) {
+            continue;
+        }
+        if (!entry->found || detection.confidence > entry->best.confidence) entry->best = detection;
+        entry->found = true;
+    }
+    return 0;
+}
+
+// Answers the worker's snapshot and those that joined it with one request,
+// falling back to a request per snapshot if the batch fails.
+static void detect_batch(ImageWorker* worker, BatchEntry* entries, int count) {
+    uint64_t detect_ns = latency_now_ns();
+    if (upload_batch(worker, entries, count) == 0) {
+        timeline_span(detect_ns, latency_now_ns(), "detect batch x%d", count);
+        for (int e = 0; e < count; e++) {
+            report_snapshot(worker, entries[e].task, entries[e].started_ns, entries[e].found ? 0 : -1, &entries[e].best);
+        }
+        return;
+    }
+    LOG_WARN("[ImgThread %d] Uploading the %d snapshots one by one instead.\n", worker->worker_id, count);
+    for (int e = 0; e < count; e++) {
+        // upload_burst sends the worker's own frames, so swap the held ones in
+        if (e > 0) {
+            for (int i = 0; i < entries[e].frame_count; i++) {
+                struct MemoryStruct own = worker->uploads[i].frame;
+                worker->uploads[i].frame = *entries[e].frames[i];
+                *entries[e].frames[i] = own;
+            }
+        }
+        Detection detection;
+        uint64_t snap_ns = latency_now_ns();
+        int detected = upload_burst(worker, entries[e].task->obstacle_id, entries[e].frame_count, false, &detection);
+        timeline_span(snap_ns, latency_now_ns(), "detect obstacle %d", entries[e].task->obstacle_id);
+        report_snapshot(worker, entries[e].task, entries[e].started_ns, detected, &detection);
+    }
+}
+
+static void process_image_task(ImageWorker* worker, const ImageTask* task_args) {
+    worker->mission_epoch = task_args->mission_epoch;
+    if (worker_cancelled(worker)) {
+        LOG_INFO("[ImgThread %d] Mission stopped; skipping obstacle %d.\n", worker->worker_id, task_args->obstacle_id);
+        return;
+    }
+    uint64_t started_ns = latency_now_ns();
+    struct MemoryStruct* frames[IMAGE_BURST_FRAMES];
+    for (int i = 0; i < IMAGE_BURST_FRAMES; i++) frames[i] = &worker->uploads[i].frame;
+    worker->reply_count = 0;
+    int frame_count = capture_snapshot(worker, task_args, frames, started_ns);
+    if (frame_count == 0) return;
+
+    if (image_batching(worker) && task_args->shared_count == 0) {
+        int max_held = atomic_load(&g_image_batch_max);
+        if (max_held > IMAGE_BATCH_MAX) max_held = IMAGE_BATCH_MAX;
+        int held = hold_for_batch(worker, max_held - 1);
+        if (held > 0) {
+            BatchEntry entries[IMAGE_BATCH_MAX];
+            entries[0] = (BatchEntry){ .task = task_args, .started_ns = started_ns, .frame_count = frame_count };
+            for (int i = 0; i < frame_count; i++) entries[0].frames[i] = frames[i];
+            for (int h = 0; h < held; h++) {
+                HeldSnapshot* snap = &worker->held[h];
+                entries[h + 1] = (BatchEntry){ .task = &snap->task, .started_ns = snap->started_ns,
+                                               .frame_count = snap->frame_count };
+                for (int i = 0; i < snap->frame_count; i++) entries[h + 1].frames[i] = &snap->frames[i];
+            }
+            detect_batch(worker, entries, held + 1);
+            return;
+        }
+    }
+
+    Detection detection;
+    uint64_t detect_ns = latency_now_ns();
+    int detected = detect_burst(worker, task_args->obstacle_id, frame_count, &detection);
+    timeline_span(detect_ns, latency_now_ns(), "detect obstacle %d", task_args->obstacle_id);
+    if (task_args->shared_count > 0) {
+        report_shared_snapshot(worker, task_args, started_ns, detected, &detection);
+    } else {
+        report_snapshot(worker, task_args, started_ns, detected, &detection);
+    }
+}
+
+// Queues a snapshot job for the worker pool. Blocks while the queue is full,
+// which caps how far snapshots can run ahead of the workers.
+// Returns 0 on success, -1 if the pool is shutting down.
+static int enqueue_image_task(ImageTaskQueue* queue, const ImageTask* task) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == IMAGE_TASK_QUEUE_SIZE && !queue->shutdown) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    if (queue->shutdown) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+    int tail = (queue->head + queue->count) % IMAGE_TASK_QUEUE_SIZE;
+    queue->tasks[tail] = *task;
+    queue->count++;
+    metric_inc(METRIC_SNAPSHOTS_QUEUED);
+    metric_gauge_set(METRIC_GAUGE_IMAGE_QUEUE_DEPTH, queue->count);
+    // A worker holding a batch waits on not_empty too, and only it may take the task
+    if (queue->batch_holder >= 0) pthread_cond_broadcast(&queue->not_empty);
+    else pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+    return 0;
+}
+
+// Drops every queued snapshot, for a stopped mission, and wakes whoever waits
+// on the queue. Returns how many were dropped.
+static int drain_image_queue(ImageTaskQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    int dropped = queue->count;
+    queue->count = 0;
+    metric_gauge_set(METRIC_GAUGE_IMAGE_QUEUE_DEPTH, 0);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_cond_broadcast(&queue->not_empty); // A worker holding a batch stops holding it
+    pthread_mutex_unlock(&queue->mutex);
+    return dropped;
+}
+
+// Start-up progress shared by main() and the image workers (see run_startup()).
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool camera_done; // camera_init() has returned, successfully or not
+    int workers_warm; // Image workers through warm_image_worker()
+} g_startup = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0 };
+
+// CURLOPT_HEADERFUNCTION for the warm-up HEAD: picks up X-Detect-Batch.
+static size_t image_server_header_callback(char* buffer, size_t size, size_t nitems, void* arg) {
+    (void)arg;
+    static const char name[] = "X-Detect-Batch:";
+    size_t n = size * nitems;
+    if (n > sizeof(name) - 1 && strncasecmp(buffer, name, sizeof(name) - 1) == 0) {
+        char value[16];
+        size_t len = n - (sizeof(name) - 1) < sizeof(value) - 1 ? n - (sizeof(name) - 1) : sizeof(value) - 1;
+        memcpy(value, buffer + sizeof(name) - 1, len);
+        value[len] = '\0';
+        atomic_store(&g_image_batch_max, atoi(value));
+    }
+    return n;
+}
+
+// Opens one connection to the image server per burst frame by sending a HEAD
+// down every upload handle at once; they stay in the shared pool for the first
+// real burst. The replies also say whether the server takes batches of
+// snapshots. Returns the number of handles that connected.
+static int warm_image_connections(ImageWorker* worker) {
+    int running = 0;
+    for (int i = 0; i < IMAGE_BURST_FRAMES; i++) {
+        BurstUpload* upload = &worker->uploads[i];
+        if (!upload->curl || !worker->multi) continue;
+        curl_easy_reset(upload->curl);
+        http_configure_handle(upload->curl);
+        curl_easy_setopt(upload->curl, CURLOPT_URL, config_now()->image_url);
+        curl_easy_setopt(upload->curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(upload->curl, CURLOPT_TIMEOUT, 3L);
+        curl_easy_setopt(upload->curl, CURLOPT_HEADERFUNCTION, image_server_header_callback);
+        if (curl_multi_add_handle(worker->multi, upload->curl) != CURLM_OK) continue;
+        upload->active = true;
+        running++;
+    }
+
+    int connected = 0;
+    while (running > 0) {
+        if (curl_multi_perform(worker->multi, &running) != CURLM_OK) break;
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(worker->multi, &queued)) != NULL) {
+            // Any HTTP status counts, only transport errors are failures
+            if (msg->msg == CURLMSG_DONE && msg->data.result == CURLE_OK) connected++;
+        }
+        if (running > 0) curl_multi_wait(worker->multi, NULL, 0, 1000, NULL);
+    }
+    for (int i = 0; i < IMAGE_BURST_FRAMES; i++) {
+        BurstUpload* upload = &worker->uploads[i];
+        if (upload->active) curl_multi_remove_handle(worker->multi, upload->curl);
+        upload->active = false;
+    }
+    return connected;
+}
+
+// Everything a worker's first snapshot would otherwise set up: its image server
+// connections, then (once the camera is up) a capture and a preprocess pass so
+// the frame buffer, the crop scratch and libjpeg's state are already allocated.
+static void warm_image_worker(ImageWorker* worker) {
+    int connected = warm_image_connections(worker);
+    if (connected < IMAGE_BURST_FRAMES) {
+        LOG_WARN("[ImgThread %d] Only %d of %d image server connections opened.\n", worker->worker_id, connected,
+                 IMAGE_BURST_FRAMES);
+    }
+    if (worker->worker_id == 0 && atomic_load(&g_image_batch_max) > 1) {
+        LOG_INFO("[ImgThread] Image server takes up to %d snapshots per request.\n", atomic_load(&g_image_batch_max));
+    }
+
+    pthread_mutex_lock(&g_startup.lock);
+    while (!g_startup.camera_done) pthread_cond_wait(&g_startup.changed, &g_startup.lock);
+    pthread_mutex_unlock(&g_startup.lock);
+    struct MemoryStruct* frame = &worker->uploads[0].frame;
+    if (capture_image(frame) == 0 && USE_IMAGE_PREPROCESS) {
+#ifndef RPI_TESTING // The test-mode frame is not a JPEG
+        image_preprocess(&worker->preprocessor, frame, NULL, IMAGE_UPLOAD_MAX_WIDTH, IMAGE_UPLOAD_QUALITY);
+#endif
+    }
+
+    pthread_mutex_lock(&g_startup.lock);
+    g_startup.workers_warm++;
+    pthread_cond_broadcast(&g_startup.changed);
+    pthread_mutex_unlock(&g_startup.lock);
+}
+
+void* image_worker_thread(void* args) {
+    ImageWorker* worker = (ImageWorker*)args;
+    ImageTaskQueue* queue = &worker->context->image_queue;
+
+    char track[16];
+    snprintf(track, sizeof(track), "image %d", worker->worker_id);
+    timeline_thread(track);
+    warm_image_worker(worker);
+    LOG_INFO("[ImgThread %d] Worker ready.\n", worker->worker_id);
+    while (1) {
+        pthread_mutex_lock(&queue->mutex);
+        // While another worker holds a batch open, queued snapshots are its
+        while ((queue->count == 0 || queue->batch_holder >= 0) && !queue->shutdown) {
+            pthread_cond_wait(&queue->not_empty, &queue->mutex);
+        }
+        if (queue->count == 0 && queue->shutdown) {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        ImageTask task;
+        image_task_pop(queue, &task);
+        pthread_mutex_unlock(&queue->mutex);
+
+        metric_gauge_add(METRIC_GAUGE_IMAGE_WORKERS_BUSY, 1);
+        process_image_task(worker, &task);
+        metric_gauge_add(METRIC_GAUGE_IMAGE_WORKERS_BUSY, -1);
+    }
+    return NULL;
+}
+
+
+// --- Approach detection ---
+// With USE_APPROACH_DETECTION, a scanner thread watches the camera while the
+// robot drives the move that ends at a snapshot. At most every
+// APPROACH_FRAME_INTERVAL_MS it hands a frame to the on-Pi model. Without one,
+// it shrinks the frame to APPROACH_FRAME_WIDTH and sends it to the
+// shared-memory detector or, failing that, down the image channel, where
+// APPROACH_MAX_KBPS caps what the frames may use. It waits while an image
+// worker is busy, so a real snapshot always has the camera and the link.
+// APPROACH_AGREE_FRAMES frames in a row that name the same image at
+// APPROACH_CONFIDENCE or more (the bullseye does not count) answer the snapshot
+// at once: TARGET goes to Android, and the nav thread skips the snapshot's stop
+// and capture (see approach_take()). A weaker sighting changes nothing.
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // CLOCK_MONOTONIC
+    bool stop;
+    int obstacle_id;    // Being approached, 0 for none
+    unsigned epoch;     // context->mission_epoch of the approach
+    int answered_id;    // Obstacle the scan answered, until the nav thread takes it; 0 for none
+    int candidate_img;  // Image the last frames agreed on
+    int agreed;         // How many frames in a row
+    // Scanner thread only
+    LocalDetector* local; // Its own interpreter for the on-Pi model; NULL without one
+    ImagePreprocessor preprocessor;
+    struct MemoryStruct frame;
+    ShmResult shm_result;
+    ChannelMessage channel_reply; // Behind the last channel detection's class_label
+} g_approach = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Whether any detector could look at an approach frame right now
+static bool approach_detector_ready(void) {
+    return g_approach.local || (shm_detector_available() && !trace_enabled()) ||
+           channel_usable(atomic_load(&g_image_channel));
+}
+
+// Recognises the scanner's frame for obstacle_id. Returns 0 with *out filled
+// (its class_label valid until the next call), -1 if nothing was recognised,
+// or -2 if no detector answered. *uploaded is the bytes sent over Wi-Fi.
+static int approach_detect(int obstacle_id, Detection* out, size_t* uploaded) {
+    *uploaded = 0;
+    if (g_approach.local) {
+        uint64_t started_ns = latency_now_ns();
+        int rc = local_detect(g_approach.local, &g_approach.preprocessor, &g_approach.frame, out);
+        metric_observe_since(METRIC_HIST_LOCAL_INFER_US, started_ns);
+        return rc;
+    }
+    const struct MemoryStruct* frame = &g_approach.frame;
+    if (image_preprocess(&g_approach.preprocessor, frame, NULL, APPROACH_FRAME_WIDTH, APPROACH_FRAME_QUALITY) == 0) {
+        frame = &g_approach.preprocessor.jpeg;
+    }
+    if (shm_detector_available() && !trace_enabled()) {
+        ShmResult* result = &g_approach.shm_result;
+        int rc = shm_detect_burst(APPROACH_SHM_LANE, obstacle_id, frame, 1, APPROACH_CONFIDENCE, result);
+        if (rc != -2) {
+            if (rc != 0) return -1;
+            *out = (Detection){ .img_id = result->img_id, .confidence = result->confidence,
+                                .class_label = { result->class_label, (int)strlen(result->class_label) } };
+            return 0;
+        }
+    }
+    ServerChannel* channel = atomic_load(&g_image_channel);
+    if (!channel_usable(channel)) return -2;
+    char meta[32];
+    int meta_len = snprintf(meta, sizeof(meta), "{\"object_id\":%d}", obstacle_id);
+    server_channel_message_free(&g_approach.channel_reply);
+    uint64_t started_ns = latency_now_ns();
+    int rc = server_channel_request(channel, CHANNEL_OP_DETECT, meta, (size_t)meta_len, frame->memory,
+                                    frame->size, APPROACH_REPLY_TIMEOUT_MS, &g_approach.channel_reply);
+    *uploaded = frame->size;
+    if (rc != 0) return rc == -1 ? -1 : -2;
+    image_upload_observe(frame->size, (double)(latency_now_ns() - started_ns) / 1e9, -1.0);
+    return parse_detection(NULL, g_approach.channel_reply.meta, g_approach.channel_reply.meta_len, obstacle_id, out);
+}
+
+// Counts one frame's answer, captured at captured_ns, towards the approach to
+// obstacle_id. Sends the TARGET once enough agree. Call with g_approach.lock held.
+static void approach_consider(SharedAppContext* context, int obstacle_id, unsigned epoch, const Detection* detection,
+                              uint64_t captured_ns) {
+    if (g_approach.obstacle_id != obstacle_id || g_approach.epoch != epoch) return; // The robot has arrived
+    if (!detection || detection->confidence < APPROACH_CONFIDENCE || detection_is_bullseye(detection)) {
+        g_approach.agreed = 0;
+        return;
+    }
+    if (g_approach.agreed == 0 || detection->img_id != g_approach.candidate_img) {
+        g_approach.candidate_img = detection->img_id;
+        g_approach.agreed = 0;
+    }
+    if (++g_approach.agreed < APPROACH_AGREE_FRAMES) return;
+    if (epoch != atomic_load(&context->mission_epoch)) return; // Stopped meanwhile
+    g_approach.answered_id = obstacle_id;
+    g_approach.obstacle_id = 0;
+    send_target_result_to_android(context->android_fd, obstacle_id, detection->img_id);
+    feed_detection(obstacle_id, detection);
+    mission_report_snapshot_queued(obstacle_id);
+    if (mission_report_answered(epoch, obstacle_id, true, captured_ns, latency_now_ns())) emit_mission_report(context);
+    metric_inc(METRIC_IMAGE_DETECTIONS);
+    metric_inc(METRIC_APPROACH_DETECTIONS);
+    timeline_instant(latency_now_ns(), "approach %d -> %d", obstacle_id, detection->img_id);
+    LOG_INFO("[Approach] Obstacle %d recognised on the way in: class_label=%.*s, img_id=%d, confidence=%.2f\n",
+             obstacle_id, detection->class_label.len, detection->class_label.ptr, detection->img_id,
+             detection->confidence);
+    wake_nav(context);
+}
+
+// Waits on g_approach.changed until due_ns (0: until signalled). Call with
+// g_approach.lock held.
+static void approach_wait_until(uint64_t due_ns) {
+    if (due_ns == 0) {
+        pthread_cond_wait(&g_approach.changed, &g_approach.lock);
+        return;
+    }
+    struct timespec due = { .tv_sec = (time_t)(due_ns / 1000000000ull), .tv_nsec = (long)(due_ns % 1000000000ull) };
+    pthread_cond_timedwait(&g_approach.changed, &g_approach.lock, &due);
+}
+
+void* approach_scanner_thread(void* args) {
+    SharedAppContext* context = (SharedAppContext*)args;
+    timeline_thread("approach");
+    uint64_t next_ns = 0; // Earliest the next frame may be taken
+    pthread_mutex_lock(&g_approach.lock);
+    while (!g_approach.stop) {
+        int obstacle_id = g_approach.obstacle_id;
+        unsigned epoch = g_approach.epoch;
+        uint64_t now_ns = latency_now_ns();
+        if (obstacle_id == 0) {
+            approach_wait_until(0);
+            continue;
+        }
+        bool workers_busy = metric_gauge_get(METRIC_GAUGE_IMAGE_WORKERS_BUSY) > 0;
+        if (now_ns < next_ns || workers_busy || !approach_detector_ready()) {
+            approach_wait_until(now_ns < next_ns ? next_ns : now_ns + APPROACH_FRAME_INTERVAL_MS * 1000000ull);
+            continue;
+        }
+        pthread_mutex_unlock(&g_approach.lock);
+
+        Detection detection;
+        size_t uploaded = 0;
+        bool found = capture_image(&g_approach.frame) == 0 && approach_detect(obstacle_id, &detection, &uploaded) == 0;
+        metric_inc(METRIC_APPROACH_FRAMES);
+        timeline_span(now_ns, latency_now_ns(), "approach frame %d%s", obstacle_id, found ? "" : " (nothing)");
+        next_ns = now_ns + APPROACH_FRAME_INTERVAL_MS * 1000000ull;
+        uint64_t budget_ns = (uint64_t)uploaded * 8 * 1000000ull / APPROACH_MAX_KBPS; // bits / (kbit/ms)
+        if (now_ns + budget_ns > next_ns) next_ns = now_ns + budget_ns;
+
+        pthread_mutex_lock(&g_approach.lock);
+        approach_consider(context, obstacle_id, epoch, found ? &detection : NULL, now_ns);
+    }
+    pthread_mutex_unlock(&g_approach.lock);
+    return NULL;
+}
+
+// Starts the scanner. Returns 0, or -1 if its thread could not be created.
+static int approach_start(SharedAppContext* context, pthread_t* tid) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // latency_now_ns() deadlines
+    pthread_cond_init(&g_approach.changed, &attr);
+    pthread_condattr_destroy(&attr);
+    return rt_thread_create(tid, RT_ROLE_IMAGE, false, approach_scanner_thread, context);
+}
+
+static void approach_stop(pthread_t tid) {
+    pthread_mutex_lock(&g_approach.lock);
+    g_approach.stop = true;
+    pthread_cond_signal(&g_approach.changed);
+    pthread_mutex_unlock(&g_approach.lock);
+    pthread_join(tid, NULL);
+    pthread_cond_destroy(&g_approach.changed);
+    free(g_approach.frame.memory);
+    image_preprocessor_free(&g_approach.preprocessor);
+    server_channel_message_free(&g_approach.channel_reply);
+    local_detector_destroy(g_approach.local);
+}
+
+// Nav thread: the robot is now driving towards obstacle_id's snapshot in
+// mission epoch. Keeps a scan of the same obstacle going.
+static void approach_begin(int obstacle_id, unsigned epoch) {
+    if (!USE_APPROACH_DETECTION) return;
+    pthread_mutex_lock(&g_approach.lock);
+    if (g_approach.obstacle_id != obstacle_id || g_approach.epoch != epoch) {
+        g_approach.obstacle_id = obstacle_id;
+        g_approach.epoch = epoch;
+        g_approach.agreed = 0;
+        g_approach.answered_id = 0;
+        pthread_cond_signal(&g_approach.changed);
+    }
+    pthread_mutex_unlock(&g_approach.lock);
+}
+
+// Nav thread: the snapshot of obstacle_id is due. Ends its scan and returns
+// true if the scan already answered it (its TARGET has gone out).
+static bool approach_take(int obstacle_id) {
+    if (!USE_APPROACH_DETECTION) return false;
+    pthread_mutex_lock(&g_approach.lock);
+    bool answered = g_approach.answered_id == obstacle_id;
+    if (g_approach.obstacle_id == obstacle_id) g_approach.obstacle_id = 0;
+    g_approach.answered_id = 0;
+    pthread_mutex_unlock(&g_approach.lock);
+    return answered;
+}
+
+// Nav thread: whether obstacle_id is still being scanned for
+static bool approach_scanning(int obstacle_id) {
+    if (!USE_APPROACH_DETECTION) return false;
+    pthread_mutex_lock(&g_approach.lock);
+    bool scanning = g_approach.obstacle_id == obstacle_id;
+    pthread_mutex_unlock(&g_approach.lock);
+    return scanning;
+}
+
+// Nav thread, at the end of a mission: no scan outlives it
+static void approach_cancel(void) {
+    if (!USE_APPROACH_DETECTION) return;
+    pthread_mutex_lock(&g_approach.lock);
+    g_approach.obstacle_id = 0;
+    g_approach.answered_id = 0;
+    pthread_mutex_unlock(&g_approach.lock);
+}
+
+
+// --- STM32 event ring ---
+// Lock-free SPSC channel from the I/O reactor (producer) to the nav thread
+// (consumer). Each index is written by exactly one side; the release store
+// publishes the slot contents before the index moves.
+
+// Returns -1 if the ring is full. pose may be NULL.
+static int stm32_event_push(Stm32EventRing* ring, uint32_t cmd_id, int8_t status, const Stm32Pose* pose,
+                            int32_t remaining, uint64_t rx_ns) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= STM32_EVENT_RING_SIZE) return -1;
+    Stm32Event* slot = &ring->slots[head & (STM32_EVENT_RING_SIZE - 1)];
+    slot->cmd_id = cmd_id;
+    slot->status = status;
+    slot->has_pose = pose != NULL;
+    if (pose) slot->pose = *pose;
+    slot->remaining = remaining;
+    slot->rx_ns = rx_ns;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+// Returns -1 if the ring is empty.
+static int stm32_event_pop(Stm32EventRing* ring, Stm32Event* out) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) return -1;
+    *out = ring->slots[tail & (STM32_EVENT_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+// --- Nav deadlines ---
+// Nav-side waits block on nav_wakeup_fd. Their deadlines come from a timerfd
+// serviced by the I/O reactor rather than pthread_cond_timedwait.
+
+// Arms the one-shot nav deadline. When it fires, the reactor sets deadline_expired
+// and wakes the nav thread. Passing 0 disarms it.
+static void arm_nav_deadline_ms(SharedAppContext* context, int timeout_ms) {
+    atomic_store(&context->deadline_expired, false);
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    if (timerfd_settime(context->deadline_timer_fd, 0, &its, NULL) == -1) {
+        perror("[Reactor] timerfd_settime failed");
+    }
+}
+
+static void arm_nav_deadline(SharedAppContext* context, int timeout_sec) {
+    arm_nav_deadline_ms(context, timeout_sec * 1000);
+}
+
+// Wakes the nav thread so it re-checks stop_requested / deadline_expired.
+static void wake_nav_waiters(SharedAppContext* context, bool expire_deadline) {
+    if (expire_deadline) atomic_store(&context->deadline_expired, true);
+    wake_nav(context);
+}
+
+// =================================================================================
+// THREAD 2: Navigation Executor (Main Logic)
+// =================================================================================
+
+// STM32 round-trip latencies for the current mission. Recorded by the nav thread.
+static LatencyStats g_latency_stats;
+
+// Mission start for the timeline: when the reactor accepted the arena (under
+// context->lock), and when the nav thread began planning it.
+static uint64_t g_arena_received_ns;
+static uint64_t g_plan_start_ns;
+// context->mission_epoch when the nav thread took the current mission; its snapshots carry it
+static unsigned g_nav_epoch;
+
+// --- Odometry drift ---
+// Firmware that reports its pose (stm32_protocol.h) lets the nav thread see
+// drift as it builds up rather than when a snapshot misses its obstacle. After
+// each command the pose's heading should have moved from the mission's first
+// report by exactly the turns commanded in between; positions are not checked,
+// since the route does not model the arcs turns drive. The first report fixes
+// the origin, so drift in the mission's first command goes unseen.
+#define POSE_DRIFT_WARN_DEG 5.0f
+#define POSE_CHECK_SLOTS 256 // Covers an uploaded route (STM32_ROUTE_MAX_STEPS) as well as the window
+
+// Nav thread only
+static struct {
+    float expected_deg[POSE_CHECK_SLOTS]; // Commanded heading after cmd_id % POSE_CHECK_SLOTS
+    float commanded_deg;                  // Sum of the turns handed to the STM32 so far
+    bool have_origin;
+    float origin_deg; // Pose heading the commanded headings count from
+    bool warned;      // Once per mission
+} g_pose_check;
+
+static void pose_check_reset(void) {
+    memset(&g_pose_check, 0, sizeof(g_pose_check));
+}
+
+// Records the heading cmd should leave the robot at.
+static void pose_check_sent(uint32_t cmd_id, const Command* cmd) {
+    if (cmd->type == CMD_TURN_LEFT) g_pose_check.commanded_deg += cmd->value;
+    if (cmd->type == CMD_TURN_RIGHT) g_pose_check.commanded_deg -= cmd->value;
+    g_pose_check.expected_deg[cmd_id % POSE_CHECK_SLOTS] = g_pose_check.commanded_deg;
+}
+
+// Takes the commanded heading back to where cmd_id left it, for a route
+// uploaded in full and abandoned after cmd_id.
+static void pose_check_rewind(uint32_t cmd_id) {
+    g_pose_check.commanded_deg = g_pose_check.expected_deg[cmd_id % POSE_CHECK_SLOTS];
+}
+
+static float wrap_deg(float deg) {
+    return deg - 360.0f * roundf(deg / 360.0f);
+}
+
+// Compares a reported pose with the heading expected after cmd_id.
+static void pose_check_report(uint32_t cmd_id, const Stm32Pose* pose) {
+    float expected = g_pose_check.expected_deg[cmd_id % POSE_CHECK_SLOTS];
+    if (!g_pose_check.have_origin) {
+        g_pose_check.origin_deg = pose->theta_deg - expected;
+        g_pose_check.have_origin = true;
+    }
+    float drift = wrap_deg(pose->theta_deg - g_pose_check.origin_deg - expected);
+    metric_gauge_set(METRIC_GAUGE_HEADING_DRIFT_DDEG, lroundf(drift * 10));
+    LOG_DEBUG("[NavThread] Pose after #%u: (%.1f, %.1f) cm, %.1f deg (+-%.1f); heading drift %.1f deg.\n", cmd_id,
+              pose->x_cm, pose->y_cm, pose->theta_deg, pose->sd_theta_deg, drift);
+    // Beyond what the firmware's own uncertainty explains as well
+    if (!g_pose_check.warned && fabsf(drift) > POSE_DRIFT_WARN_DEG && fabsf(drift) > 3 * pose->sd_theta_deg) {
+        g_pose_check.warned = true;
+        LOG_WARN("[NavThread] Heading off the route by %.1f deg after command %u (odometry +-%.1f deg).\n", drift,
+                 cmd_id, pose->sd_theta_deg);
+        timeline_instant(latency_now_ns(), "heading drift %.1f deg", drift);
+    }
+}
+
+// --- STM32 credits ---
+// Firmware advertising CREDIT says how much room its command queue has
+// (stm32_protocol.h): the depth when the reports are turned on, then a limit,
+// the highest ID it can take, each time it starts a queued command. A mission's
+// windowed commands go out while their IDs are within the limit rather than
+// while fewer than STM32_CMD_WINDOW are in flight, so the window is as deep as
+// the firmware's queue, and a command never arrives to a full one. IDs restart
+// with every run, so a run starts from the depth and only takes limits for
+// commands it has sent.
+
+static atomic_bool g_stm32_credit;      // The firmware reports credits and they are wanted
+static atomic_int g_stm32_credit_depth; // From its OK/CREDIT; 0 until reports are on
+
+typedef struct {
+    bool on;            // This run is paced by credits
+    int depth;
+    uint32_t limit;     // Highest ID there is room for
+    uint32_t sent;      // Highest ID sent this run
+    uint64_t raised_ns; // When the last report raised limit
+} CreditState;
+
+// Nav thread only
+static CreditState g_credit;
+
+static void credit_reset(void) {
+    int depth = atomic_load(&g_stm32_credit_depth);
+    g_credit = (CreditState){ 0 };
+    g_credit.on = USE_STM32_CREDITS && atomic_load(&g_stm32_credit) && depth > 0;
+    g_credit.depth = depth;
+    g_credit.limit = (uint32_t)depth; // Nothing queued yet
+}
+
+// A CREDIT report for cmd_id, received at rx_ns
+static void credit_report(uint32_t cmd_id, uint32_t limit, uint64_t rx_ns) {
+    if (!g_credit.on || cmd_id == 0 || cmd_id > g_credit.sent) return; // From an earlier run
+    if (limit > g_credit.limit) {
+        g_credit.limit = limit;
+        g_credit.raised_ns = rx_ns;
+    }
+}
+
+// Whether command next_cmd_id must wait for room: in the firmware's queue when
+// the run is paced by credits, else in the window.
+static bool stm32_window_full(uint32_t oldest_unacked, uint32_t next_cmd_id) {
+    if (!g_credit.on) return next_cmd_id - oldest_unacked >= STM32_CMD_WINDOW;
+    return next_cmd_id > g_credit.limit || next_cmd_id - oldest_unacked >= STM32_CREDIT_MAX_IN_FLIGHT;
+}
+
+// --- Sensed obstacles ---
+// The nav thread follows a windowed route's poses as it sends each command
+// (planner_track_command()) and, at each DONE, hands occupancy_map.h the poses
+// the command took the robot between, so the range readings that came in
+// meanwhile are cast from where the route had the robot. Before each command
+// it sends, if the map has changed, the rest of the route is replayed against
+// what was sensed (planner_simulate_route()); a route that would hit something
+// it is otherwise clear of is swapped, once the robot stops, for a reroute on
+// the retry table with the sensed cells blocked. Routes uploaded whole to the
+// firmware are driven as planned.
+
+#define SENSING_CELL_CM 10 // The planner's cells
+
+typedef struct {
+    uint32_t cmd_id;
+    PlannerTrack from, to; // The route's poses before and after it
+    bool straight;
+    uint64_t sent_ns;
+} SensedMove;
+
+// Nav thread only
+static struct {
+    PlannerTrack pose; // Where the route leaves the robot once everything sent has run
+    bool pose_known;   // Not after a turn the lattice does not model
+    SensedMove sent[STM32_ACK_TABLE_SIZE];
+    uint64_t last_done_ns; // The previous command's DONE, when the next one started
+    uint32_t generation;   // occupancy_generation() the route was last checked at
+} g_sensing;
+
+// Starts a mission's map from its obstacles, with nothing sensed.
+static void sensing_begin(const SharedAppContext* context) {
+    if (!USE_OCCUPANCY_MAP) return;
+    occupancy_reset(context->obstacles, context->obstacle_count);
+    planner_set_sensed(NULL, 0);
+    metric_gauge_set(METRIC_GAUGE_SENSED_CELLS, 0);
+    g_sensing.generation = occupancy_generation();
+}
+
+// Forgets what was sent: IDs restart with every run.
+static void sensing_reset(void) {
+    memset(g_sensing.sent, 0, sizeof(g_sensing.sent));
+    g_sensing.pose_known = false;
+    g_sensing.last_done_ns = 0;
+}
+
+// The robot stands at cell (x, y) facing d, the next command's start.
+static void sensing_route_start(int x, int y, int d) {
+    g_sensing.pose = (PlannerTrack){ x * SENSING_CELL_CM, y * SENSING_CELL_CM, d };
+    g_sensing.pose_known = true;
+}
+
+// Moves the pose over cmd, the route's command sent as cmd_id.
+static void sensing_sent(uint32_t cmd_id, const Command* cmd, uint64_t sent_ns) {
+    if (!USE_OCCUPANCY_MAP || !g_sensing.pose_known) return;
+    PlannerTrack from = g_sensing.pose;
+    if (!planner_track_command(&g_sensing.pose, cmd)) {
+        g_sensing.pose_known = false;
+        return;
+    }
+    bool straight = cmd->type == CMD_MOVE_FORWARD || cmd->type == CMD_MOVE_BACKWARD;
+    g_sensing.sent[cmd_id % STM32_ACK_TABLE_SIZE] = (SensedMove){ cmd_id, from, g_sensing.pose, straight, sent_ns };
+}
+
+// Casts the readings cmd_id's run took, now that its DONE came in at rx_ns.
+static void sensing_done(uint32_t cmd_id, uint64_t rx_ns) {
+    if (!USE_OCCUPANCY_MAP) return;
+    const SensedMove* sent = &g_sensing.sent[cmd_id % STM32_ACK_TABLE_SIZE];
+    if (sent->cmd_id == cmd_id) {
+        if (sent->straight) {
+            uint64_t from_ns = sent->sent_ns > g_sensing.last_done_ns ? sent->sent_ns : g_sensing.last_done_ns;
+            occupancy_observe_straight(&sent->from, &sent->to, from_ns, rx_ns);
+        } else {
+            occupancy_observe_at(&sent->to, rx_ns);
+        }
+    }
+    g_sensing.last_done_ns = rx_ns;
+}
+
+// --- Closed-loop correction ---
+// Firmware advertising ACHIEVED reports on each DONE how far its command really
+// drove and turned (stm32_protocol.h). The windowed path folds the difference
+// from what the route asked for into commands it has not sent yet: heading
+// error into the next turn, and travel error into the next straight of the same
+// leg. Once a turn is sent, the leg's travel error points sideways, which no
+// straight can take out, so it is dropped. Commands sent before their
+// predecessors reported carry part of the correction already, so what each
+// carries is held back from the error until its own DONE shows what it did.
+// An uploaded route is on the STM32 in full and runs uncorrected.
+#define CORRECT_MIN_DEG 1.0f  // Heading error within a turn's repeatability is left alone
+#define CORRECT_MAX_DEG 10.0f // Per turn; more than this is odometry trouble, not overshoot
+#define CORRECT_MIN_CM 0.5f
+#define CORRECT_MAX_CM 5.0f // Per straight
+
+typedef struct {
+    uint32_t cmd_id;
+    bool turn;
+    unsigned leg;
+    float intended;   // cm forward or degrees counter-clockwise the route asked for
+    float correction; // Taken off the error by the value sent, same units
+} CorrectedCommand;
+
+// Nav thread only
+static struct {
+    CorrectedCommand sent[STM32_ACK_TABLE_SIZE]; // By cmd_id % STM32_ACK_TABLE_SIZE
+    float heading_err_deg; // Reported heading change minus intended, counter-clockwise
+    float along_err_cm;    // This leg's reported travel minus intended
+    float pending_deg, pending_cm; // Corrections sent and not yet reported
+    unsigned leg;                  // Turns sent so far
+} g_correct;
+
+static void correct_reset(void) {
+    memset(&g_correct, 0, sizeof(g_correct));
+}
+
+// What an in-flight command reports is lost with a firmware reset.
+static void correct_forget_in_flight(void) {
+    for (int i = 0; i < STM32_ACK_TABLE_SIZE; i++) g_correct.sent[i].cmd_id = 0;
+    g_correct.pending_deg = 0;
+    g_correct.pending_cm = 0;
+}
+
+// Resizes cmd, about to go out as cmd_id, for the error reported so far.
+static void correct_command(uint32_t cmd_id, Command* cmd) {
+    if (cmd->type == CMD_SNAPSHOT) return;
+    bool turn = cmd->type == CMD_TURN_LEFT || cmd->type == CMD_TURN_RIGHT;
+    float sign = cmd->type == CMD_TURN_RIGHT || cmd->type == CMD_MOVE_BACKWARD ? -1.0f : 1.0f;
+    if (turn) {
+        g_correct.leg++;
+        g_correct.along_err_cm = 0;
+        g_correct.pending_cm = 0;
+    }
+    float err = turn ? g_correct.heading_err_deg - g_correct.pending_deg : g_correct.along_err_cm - g_correct.pending_cm;
+    float min = turn ? CORRECT_MIN_DEG : CORRECT_MIN_CM;
+    float max = turn ? CORRECT_MAX_DEG : CORRECT_MAX_CM;
+    int value = cmd->value;
+    if (fabsf(err) >= min) {
+        float c = fminf(fmaxf(err, -max), max);
+        value = (int)lroundf(cmd->value - sign * c);
+        if (value < 1) value = cmd->value; // Would turn or drive the other way; leave it
+    }
+    float correction = sign * (float)(cmd->value - value);
+    g_correct.sent[cmd_id % STM32_ACK_TABLE_SIZE] = (CorrectedCommand){
+        .cmd_id = cmd_id, .turn = turn, .leg = g_correct.leg, .intended = sign * (float)cmd->value,
+        .correction = correction };
+    if (value == cmd->value) return;
+    if (turn) g_correct.pending_deg += correction;
+    else g_correct.pending_cm += correction;
+    LOG_DEBUG("[NavThread] Command %u: %d instead of %d to take out %.1f %s.\n", cmd_id, value, cmd->value, err,
+              turn ? "deg" : "cm");
+    metric_inc(METRIC_ROUTE_CORRECTIONS);
+    cmd->value = value;
+}
+
+// Folds what the DONE of cmd_id reported into the error.
+static void correct_report(uint32_t cmd_id, const Stm32Pose* pose) {
+    CorrectedCommand* slot = &g_correct.sent[cmd_id % STM32_ACK_TABLE_SIZE];
+    if (slot->cmd_id != cmd_id) return; // Not sent from the window
+    slot->cmd_id = 0;
+    g_correct.heading_err_deg += pose->turned_deg - (slot->turn ? slot->intended : 0);
+    if (slot->turn) {
+        g_correct.pending_deg -= slot->correction;
+    } else if (slot->leg == g_correct.leg) {
+        g_correct.along_err_cm += pose->achieved_cm - slot->intended;
+        g_correct.pending_cm -= slot->correction;
+    }
+}
+
+// --- Firmware resets ---
+// When the stm32-motor firmware's watchdog (or a fault) resets the board, it
+// says so at boot with "!id/RESET/remaining/cause;" (stm32_protocol.h). Its
+// queue is gone, so the nav thread resends the rest of the command that was
+// cut short and everything queued behind it, under the same IDs, rather than
+// waiting out the DONE timeout. Only the windowed path keeps what it sent; an
+// uploaded route is lost with the reset, and the mission aborts.
+
+// Nav thread only
+static struct {
+    Command sent[STM32_ACK_TABLE_SIZE]; // As sent, by cmd_id % STM32_ACK_TABLE_SIZE
+    uint32_t next_id;                   // One past the last ID sent; 0 when nothing can be resent
+    bool pending;                       // A RESET is still to be handled
+    uint32_t reset_id;
+    int32_t remaining;
+} g_resend;
+
+static void resend_reset(void) {
+    memset(&g_resend, 0, sizeof(g_resend));
+}
+
+static void resend_sent(uint32_t cmd_id, const Command* cmd) {
+    g_resend.sent[cmd_id % STM32_ACK_TABLE_SIZE] = *cmd;
+    g_resend.next_id = cmd_id + 1;
+}
+
+// Moves every pending STM32 reply from the event ring into the nav-owned
+// completion table and the latency histograms.
+// --- Camera pre-arm ---
+// The nav thread names the move that ends at the next snapshot; the first
+// PROGRESS event for it readies the camera (camera_prearm()) while the robot
+// is still driving, so the capture after SETTLED skips less. Nav thread only.
+
+static uint32_t g_prearm_cmd_id; // 0 for none
+
+// Pre-arms on cmd_id's progress
+static void prearm_before_snapshot(uint32_t cmd_id) {
+    g_prearm_cmd_id = cmd_id;
+}
+
+static void prearm_progress(const Stm32Event* event) {
+    if (event->cmd_id != g_prearm_cmd_id || g_prearm_cmd_id == 0) return;
+    g_prearm_cmd_id = 0;
+    if (camera_prearm() != 0) return;
+    metric_inc(METRIC_CAMERA_PREARMS);
+    timeline_instant(latency_now_ns(), "camera pre-arm #%u, %d ms out", event->cmd_id, event->remaining);
+}
+
+static void rolling_passed(SharedAppContext* context, uint32_t cmd_id, uint64_t rx_ns);
+
+// When the robot last came to rest (latency_now_ns() clock), from the SETTLED
+// or SNAP that said so, or when that arrived; 0 since a command finished
+// without one. Nav thread only.
+static uint64_t g_rest_ns;
+
+// Pi time the robot came to rest at for a SETTLED or SNAP received at rx_ns:
+// its "/@tick" mapped through clock sync, never later than rx_ns.
+static uint64_t rest_since(const Stm32Event* event) {
+    uint64_t rest_ns;
+    if (!event->has_pose || !event->pose.has_rest || !clock_sync_tick_to_local(event->pose.rest_tick_ms, &rest_ns) ||
+        rest_ns > event->rx_ns) {
+        return event->rx_ns;
+    }
+    return rest_ns;
+}
+
+static void drain_stm32_events(SharedAppContext* context) {
+    Stm32Event event;
+    while (stm32_event_pop(&context->stm32_events, &event) == 0) {
+        if (event.status == STM32_ACK_PROGRESS) {
+            prearm_progress(&event);
+            continue;
+        }
+        if (event.status == STM32_ACK_CREDIT) {
+            credit_report(event.cmd_id, (uint32_t)event.remaining, event.rx_ns);
+            continue;
+        }
+        latency_cmd_event(&g_latency_stats, event.cmd_id, event.status, event.rx_ns);
+        if (event.status == STM32_ACK_ACCEPTED) continue;
+        if (event.status == STM32_ACK_RESET) {
+            g_resend.pending = true;
+            g_resend.reset_id = event.cmd_id;
+            g_resend.remaining = event.remaining;
+            correct_forget_in_flight();
+            continue;
+        }
+        if (event.has_pose) pose_check_report(event.cmd_id, &event.pose);
+        if (event.has_pose && event.pose.has_achieved && event.status == STM32_ACK_DONE) {
+            correct_report(event.cmd_id, &event.pose);
+        }
+        Stm32AckSlot* slot = &context->stm32_ack_table[event.cmd_id % STM32_ACK_TABLE_SIZE];
+        if (event.status == STM32_ACK_SETTLED) {
+            // Always follows the command's DONE on the wire
+            g_rest_ns = rest_since(&event);
+            context->stm32_reports_settled = true;
+            if (slot->cmd_id == event.cmd_id) slot->settled = true;
+            continue;
+        }
+        slot->cmd_id = event.cmd_id;
+        slot->status = event.status;
+        slot->settled = false;
+        slot->done_ns = event.rx_ns;
+        // A SNAP's DONE says when the robot came to rest; any other may still rock
+        g_rest_ns = event.status == STM32_ACK_DONE && event.has_pose && event.pose.has_rest ? rest_since(&event) : 0;
+        if (event.status == STM32_ACK_DONE) {
+            checkpoint_done(event.cmd_id);
+            rolling_passed(context, event.cmd_id, event.rx_ns);
+            sensing_done(event.cmd_id, event.rx_ns);
+        }
+    }
+}
+
+// Looks up cmd_id in the ACK completion table. Call drain_stm32_events() first.
+static int8_t stm32_ack_status(SharedAppContext* context, uint32_t cmd_id) {
+    const Stm32AckSlot* slot = &context->stm32_ack_table[cmd_id % STM32_ACK_TABLE_SIZE];
+    return slot->cmd_id == cmd_id ? slot->status : STM32_ACK_PENDING;
+}
+
+// Marks cmd_id DONE for a completion the firmware reported lost in a reset.
+static void stm32_ack_assume_done(SharedAppContext* context, uint32_t cmd_id, uint64_t now_ns) {
+    Stm32AckSlot* slot = &context->stm32_ack_table[cmd_id % STM32_ACK_TABLE_SIZE];
+    slot->cmd_id = cmd_id;
+    slot->status = STM32_ACK_DONE;
+    slot->settled = true; // The board rebooted standing still
+    slot->done_ns = now_ns;
+    checkpoint_done(cmd_id);
+}
+
+// Handles g_resend's RESET. The firmware runs commands in order, so those
+// before reset_id are finished, reset_id itself is finished (remaining 0), has
+// remaining left or an unknown amount (resent whole), and the rest never ran.
+// Returns 0 once they are resent, -1 if they cannot be.
+static int resend_after_stm32_reset(SharedAppContext* context) {
+    g_resend.pending = false;
+    uint32_t reset_id = g_resend.reset_id;
+    uint64_t now_ns = latency_now_ns();
+    timeline_instant(now_ns, "STM32 reset #%u", reset_id);
+    if (g_resend.next_id == 0) {
+        LOG_ERROR("[NavThread] STM32 reset during command %u; its uploaded route is lost.\n", reset_id);
+        return -1;
+    }
+    uint32_t next = g_resend.next_id;
+    uint32_t first = next > STM32_MAX_IN_FLIGHT ? next - STM32_MAX_IN_FLIGHT : 1; // Nothing older is in flight
+    while (first < next && stm32_ack_status(context, first) == STM32_ACK_DONE) first++;
+    if (reset_id >= first && reset_id < next) {
+        for (uint32_t id = first; id < reset_id; id++) stm32_ack_assume_done(context, id, now_ns);
+        first = reset_id;
+        if (g_resend.remaining == 0) stm32_ack_assume_done(context, first++, now_ns);
+    }
+    LOG_WARN("[NavThread] STM32 reset during command %u (%d left); resending %u command(s) from %u.\n", reset_id,
+             g_resend.remaining, next - first, first);
+    serial_tx_hold(context->stm32_fd); // All of them in one write
+    for (uint32_t id = first; id < next; id++) {
+        if (stm32_ack_status(context, id) == STM32_ACK_DONE) continue;
+        Command cmd = g_resend.sent[id % STM32_ACK_TABLE_SIZE];
+        if (id == reset_id && g_resend.remaining > 0 && g_resend.remaining < cmd.value) cmd.value = g_resend.remaining;
+        latency_cmd_sent(&g_latency_stats, id, cmd.type, stm32_command_timed_value(cmd), latency_now_ns());
+        if (send_command_to_stm32(context->stm32_fd, cmd, id) == 0) {
+            LOG_ERROR("[NavThread] Failed to resend command %u to STM32.\n", id);
+            serial_tx_release(context->stm32_fd);
+            return -1;
+        }
+    }
+    if (serial_tx_release(context->stm32_fd) != 0) {
+        LOG_ERROR("[NavThread] Failed to resend commands from %u to STM32.\n", first);
+        return -1;
+    }
+    return 0;
+}
+
+// Waits until every command in [first_id, last_id] has completed. Completions may
+// arrive in any order. Returns 0 when all are DONE, -1 on timeout, a firmware
+// ERROR reply, or a stop request.
+static int wait_for_stm32_acks(SharedAppContext* context, uint32_t first_id, uint32_t last_id) {
+    uint64_t wait_ns = latency_now_ns();
+    int ack_result = 0; // 0 for success, -1 for error/timeout
+    uint32_t id = first_id;
+    uint32_t armed_id = 0; // Command the deadline is set for
+    int timeout_ms = 0;
+    while (id <= last_id && !atomic_load(&context->stop_requested)) {
+        drain_stm32_events(context);
+        if (g_resend.pending) {
+            if (resend_after_stm32_reset(context) != 0) break;
+            armed_id = 0; // The resent command gets a fresh deadline
+            continue;
+        }
+        int8_t status = stm32_ack_status(context, id);
+        if (status == STM32_ACK_DONE) {
+            LOG_DEBUG("[NavThread] Received ACK for command %u.\n", id);
+            id++;
+            continue;
+        }
+        if (armed_id != id) {
+            // Each command gets its own deadline once everything ahead of it is done
+            timeout_ms = latency_cmd_timeout_ms(&g_latency_stats, id, latency_now_ns());
+            if (timeout_ms < 0) timeout_ms = STM32_ACK_TIMEOUT_SEC * 1000;
+            arm_nav_deadline_ms(context, timeout_ms);
+            armed_id = id;
+            continue; // Re-check: the DONE may have landed while arming
+        }
+        if (status == STM32_ACK_ERROR) {
+            LOG_ERROR("[NavThread] STM32 reported an error for command %u.\n", id);
+            ack_result = -1;
+            break;
+        }
+        if (atomic_load(&context->deadline_expired)) {
+            LOG_ERROR("[NavThread] Timeout waiting for ACK for command %u (after %d ms).\n", id, timeout_ms);
+            metric_inc(METRIC_STM32_ACK_TIMEOUTS);
+            ack_result = -1; // Indicate error
+            break;
+        }
+        nav_wait(context);
+    }
+    if (id <= last_id) ack_result = -1; // Timed out or woken up by a stop request
+    arm_nav_deadline(context, 0);
+    timeline_span(wait_ns, latency_now_ns(), "wait DONE #%u-%u%s", first_id, last_id, ack_result ? " (failed)" : "");
+    return ack_result;
+}
+
+// Waits until the firmware has room for next_cmd_id (stm32_window_full()) or
+// oldest_unacked completes, whichever is first. Returns 0, or -1 on oldest's
+// timeout, a firmware ERROR reply, or a stop request.
+static int wait_for_stm32_credit(SharedAppContext* context, uint32_t oldest_unacked, uint32_t next_cmd_id) {
+    uint64_t wait_ns = latency_now_ns();
+    int result = 0;
+    bool armed = false;
+    int timeout_ms = 0;
+    metric_inc(METRIC_STM32_CREDIT_STALLS);
+    while (!atomic_load(&context->stop_requested)) {
+        drain_stm32_events(context);
+        if (g_resend.pending) {
+            if (resend_after_stm32_reset(context) != 0) {
+                result = -1;
+                break;
+            }
+            armed = false;
+            continue;
+        }
+        if (!stm32_window_full(oldest_unacked, next_cmd_id)) break;
+        int8_t status = stm32_ack_status(context, oldest_unacked);
+        if (status == STM32_ACK_DONE) break;
+        if (!armed) {
+            timeout_ms = latency_cmd_timeout_ms(&g_latency_stats, oldest_unacked, latency_now_ns());
+            if (timeout_ms < 0) timeout_ms = STM32_ACK_TIMEOUT_SEC * 1000;
+            arm_nav_deadline_ms(context, timeout_ms);
+            armed = true;
+            continue; // Re-check: the report may have landed while arming
+        }
+        if (status == STM32_ACK_ERROR) {
+            LOG_ERROR("[NavThread] STM32 reported an error for command %u.\n", oldest_unacked);
+            result = -1;
+            break;
+        }
+        if (atomic_load(&context->deadline_expired)) {
+            LOG_ERROR("[NavThread] Timeout waiting for room for command %u (command %u after %d ms).\n", next_cmd_id,
+                      oldest_unacked, timeout_ms);
+            metric_inc(METRIC_STM32_ACK_TIMEOUTS);
+            result = -1;
+            break;
+        }
+        nav_wait(context);
+    }
+    if (atomic_load(&context->stop_requested)) result = -1;
+    arm_nav_deadline(context, 0);
+    timeline_span(wait_ns, latency_now_ns(), "wait CREDIT #%u%s", next_cmd_id, result ? " (failed)" : "");
+    return result;
+}
+
+// Waits for the firmware to report that the chassis has stopped moving after
+// cmd_id (already DONE), so a snapshot is not blurred by the robot rocking on
+// its suspension. Gives up after STM32_SETTLE_TIMEOUT_MS; firmware that never
+// sends SETTLED is not waited for at all.
+static void wait_for_stm32_settled(SharedAppContext* context, uint32_t cmd_id) {
+    drain_stm32_events(context);
+    if (!context->stm32_reports_settled) return;
+
+    uint64_t wait_ns = latency_now_ns();
+    arm_nav_deadline_ms(context, STM32_SETTLE_TIMEOUT_MS);
+    const Stm32AckSlot* slot = &context->stm32_ack_table[cmd_id % STM32_ACK_TABLE_SIZE];
+    while (!(slot->cmd_id == cmd_id && slot->settled) && !atomic_load(&context->stop_requested)) {
+        if (atomic_load(&context->deadline_expired)) {
+            LOG_ERROR("[NavThread] No SETTLED for command %u; capturing anyway.\n", cmd_id);
+            metric_inc(METRIC_SETTLE_TIMEOUTS);
+            break;
+        }
+        nav_wait(context);
+        drain_stm32_events(context);
+    }
+    arm_nav_deadline(context, 0);
+    timeline_span(wait_ns, latency_now_ns(), "wait SETTLED #%u", cmd_id);
+}
+
+// Copies published command index into out. Returns true once it is available,
+// false if the route ended before it or a stop was requested. Buffered routes
+// are published in one go.
+static bool wait_for_route_command(SharedAppContext* context, int index, Command* out) {
+    while (!atomic_load(&context->stop_requested)) {
+        // Load the count before the items pointer: the producer stores them in the opposite order.
+        int published = atomic_load_explicit(&context->route_commands_published, memory_order_acquire);
+        if (index >= published && atomic_load_explicit(&context->route_complete, memory_order_acquire)) {
+            // route_complete is stored after the last command, so this count is final
+            published = atomic_load_explicit(&context->route_commands_published, memory_order_acquire);
+            if (index >= published) return false;
+        }
+        if (index < published) {
+            *out = atomic_load_explicit(&context->route_command_items, memory_order_acquire)[index];
+            return true;
+        }
+        nav_wait(context);
+    }
+    return false;
+}
+
+// The obstacle of route command index if that is published already and is a
+// snapshot, else 0
+static int route_snapshot_queued(SharedAppContext* context, int index) {
+    if (index >= atomic_load_explicit(&context->route_commands_published, memory_order_acquire)) return 0;
+    Command cmd = atomic_load_explicit(&context->route_command_items, memory_order_acquire)[index];
+    return cmd.type == CMD_SNAPSHOT ? cmd.value : 0;
+}
+
+// Whether cmd is a snapshot taken on the move (see "Rolling snapshots").
+static bool snapshot_rolls(const Command* cmd) {
+    return USE_ROLLING_SNAPSHOTS && cmd->type == CMD_SNAPSHOT && cmd->speed == SPEED_CREEP;
+}
+
+// True if route command index is published already and is a rolling snapshot.
+static bool route_snapshot_rolls(SharedAppContext* context, int index) {
+    if (index >= atomic_load_explicit(&context->route_commands_published, memory_order_acquire)) return false;
+    Command cmd = atomic_load_explicit(&context->route_command_items, memory_order_acquire)[index];
+    return snapshot_rolls(&cmd);
+}
+
+// True if route command index is published already and is one for the STM32,
+// so the window loop sends it straight after the one before.
+static bool route_command_queued(SharedAppContext* context, int index) {
+    // The count before the items pointer, as in wait_for_route_command()
+    if (index >= atomic_load_explicit(&context->route_commands_published, memory_order_acquire)) return false;
+    return atomic_load_explicit(&context->route_command_items, memory_order_acquire)[index].type != CMD_SNAPSHOT;
+}
+
+// Copies snap position index into out if it has been published.
+static bool route_snap_position(SharedAppContext* context, int index, SnapPosition* out) {
+    if (index >= atomic_load_explicit(&context->route_snaps_published, memory_order_acquire)) return false;
+    *out = atomic_load_explicit(&context->route_snap_items, memory_order_acquire)[index];
+    return true;
+}
+
+// Publishes the next streamed entries. Call after pushing to context->commands /
+// snap_positions, which may have moved the items.
+static void publish_route_progress(SharedAppContext* context) {
+    atomic_store_explicit(&context->route_snap_items, context->snap_positions.items, memory_order_release);
+    atomic_store_explicit(&context->route_snaps_published, context->snap_positions.count, memory_order_release);
+    atomic_store_explicit(&context->route_command_items, context->commands.items, memory_order_release);
+    atomic_store_explicit(&context->route_commands_published, context->commands.count, memory_order_release);
+}
+
+static const char* const ROUTE_SIM_PROBLEMS[] = {
+    [ROUTE_SIM_OK] = "is clear",
+    [ROUTE_SIM_COLLISION] = "hits an obstacle or the arena edge",
+    [ROUTE_SIM_SNAP_MISMATCH] = "misses a snap position",
+    [ROUTE_SIM_UNMODELLED] = "turns by an angle the simulator does not model",
+};
+
+// Replays commands from (x, y) facing d against the mission's obstacles before
+// they are published. A route that fails is replaced in place by the native
+// planner's from the same pose if repair is set and that one passes. Returns 0
+// if the route may be driven, -1 if not.
+static int validate_route(SharedAppContext* context, int x, int y, int d,
+                          CommandList* commands, SnapList* snap_positions, bool repair) {
+    if (!USE_ROUTE_VALIDATION) return 0;
+    uint64_t started_ns = latency_now_ns();
+    RouteSimResult sim;
+    RouteSimStatus status = planner_simulate_route(context->obstacles, context->obstacle_count, x, y, d,
+                                                   commands, snap_positions, &sim);
+    timeline_span(started_ns, latency_now_ns(), "route check");
+    if (status == ROUTE_SIM_OK) return 0;
+    if (status == ROUTE_SIM_UNMODELLED) {
+        // A hybrid route's arcs; it was clear up to there
+        LOG_DEBUG("[NavThread] Route check stopped at command %d: %s.\n", sim.command, ROUTE_SIM_PROBLEMS[status]);
+        return 0;
+    }
+
+    metric_inc(METRIC_ROUTE_CHECK_FAILURES);
+    LOG_WARN("[NavThread] Route %s at command %d of %d, at (%d, %d) facing %d.\n", ROUTE_SIM_PROBLEMS[status],
+             sim.command, commands->count, sim.pose.x, sim.pose.y, sim.pose.d);
+    timeline_instant(latency_now_ns(), "route check failed at #%d", sim.command);
+    if (repair && USE_NATIVE_PLANNER) {
+        CommandList fixed;
+        SnapList fixed_snaps;
+        if (planner_plan_forward_route(context->obstacles, context->obstacle_count, x, y, d,
+                                       &context->mission_arena, &fixed, &fixed_snaps) == 0 &&
+            planner_simulate_route(context->obstacles, context->obstacle_count, x, y, d,
+                                   &fixed, &fixed_snaps, &sim) == ROUTE_SIM_OK) {
+            *commands = fixed;
+            *snap_positions = fixed_snaps;
+            metric_inc(METRIC_ROUTE_REPAIRS);
+            LOG_INFO("[NavThread] Driving the native planner's %d-command route instead.\n", fixed.count);
+            return 0;
+        }
+    }
+    LOG_ERROR("[NavThread] Refusing the route.\n");
+    return -1;
+}
+
+// Marks all of context->commands and snap_positions ready for execute_navigation().
+// Straight runs are merged first and, if rolling, the snapshots the robot can
+// drive through are marked (route_roll_snapshots()); the cache keeps the route
+// as planned.
+static void publish_complete_route(SharedAppContext* context, bool rolling) {
+    int removed = route_optimize(&context->commands);
+    if (removed > 0) {
+        LOG_INFO("[NavThread] Route optimizer merged away %d commands (%d left).\n", removed, context->commands.count);
+    }
+    int rolled = USE_ROLLING_SNAPSHOTS && rolling
+                 ? route_roll_snapshots(&context->mission_arena, &context->commands, ROLLING_CREEP_CM) : 0;
+    if (rolled > 0) {
+        LOG_INFO("[NavThread] %d snapshot(s) will be taken on the move (%d commands).\n", rolled, context->commands.count);
+    }
+    atomic_store(&context->route_failed, false);
+    publish_route_progress(context);
+    atomic_store_explicit(&context->route_complete, true, memory_order_release);
+}
+
+// --- Mission updates ---
+// A sendArena that arrives mid-mission is queued (context->queued_map) rather
+// than refused. At the next snapshot the robot is stationary at a pose the route
+// names, so the nav thread plans from there to the updated map's obstacles it has
+// not photographed yet and swaps that in for the rest of the route. Android
+// resends the whole arena for every edit, so the update is first diffed against
+// the mission: one that changes none of those obstacles keeps the route, and
+// the rest are planned on the retry table brought up to date for the change
+// (planner_update_retries()) before falling back to a planner from scratch. An
+// update that finds no snapshot ahead becomes the next mission instead. Nav
+// thread only.
+
+static struct {
+    int visited_ids[MAX_OBSTACLES]; // Obstacles photographed this mission
+    int visited_count;
+    SnapPosition pose; // Where the robot stands while pose_known
+    bool pose_known;   // At a snapshot, before the next move
+    bool swapped;      // The route no longer matches the mission's RouteKey
+} g_progress;
+
+static void progress_reset(void) {
+    memset(&g_progress, 0, sizeof(g_progress));
+}
+
+static void progress_snapped(int obstacle_id, const SnapPosition* pose) {
+    if (g_progress.visited_count < MAX_OBSTACLES) g_progress.visited_ids[g_progress.visited_count++] = obstacle_id;
+    g_progress.pose = *pose;
+    g_progress.pose_known = pose->x >= 0;
+}
+
+static bool progress_visited(int obstacle_id) {
+    for (int i = 0; i < g_progress.visited_count; i++) {
+        if (g_progress.visited_ids[i] == obstacle_id) return true;
+    }
+    return false;
+}
+
+// Makes map the mission: its obstacles less those already photographed, from
+// start (the robot's pose) or, when that is NULL, the pose the map gives.
+static void apply_map_update(SharedAppContext* context, const ArenaMap* map, const SnapPosition* start) {
+    context->obstacle_count = 0;
+    for (int i = 0; i < map->obstacle_count; i++) {
+        if (!progress_visited(map->obstacles[i].id)) context->obstacles[context->obstacle_count++] = map->obstacles[i];
+    }
+    context->robot_start_x = start ? start->x : map->robot_x;
+    context->robot_start_y = start ? start->y : map->robot_y;
+    context->robot_start_dir = start ? start->d : map->robot_dir;
+}
+
+// Takes the queued map update, if any. Returns true with *out filled.
+static bool take_map_update(SharedAppContext* context, ArenaMap* out) {
+    pthread_mutex_lock(&context->lock);
+    bool queued = context->map_update_queued;
+    if (queued) *out = context->queued_map;
+    context->map_update_queued = false;
+    pthread_mutex_unlock(&context->lock);
+    return queued;
+}
+
+// Replans the rest of the route from a queued map update; defined with the
+// planning steps further down. Returns 1 if the route was swapped, 0 if there was
+// nothing to swap, -1 if the replan failed and the old route stands.
+static int swap_route_for_update(SharedAppContext* context);
+
+// Looks up the mission's obstacle with the given ID.
+static bool find_obstacle(const SharedAppContext* context, int obstacle_id, Obstacle* out) {
+    for (int i = 0; i < context->obstacle_count; i++) {
+        if (context->obstacles[i].id == obstacle_id) {
+            *out = context->obstacles[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the lowest ID at or after oldest that has not completed yet.
+static uint32_t advance_oldest_unacked(SharedAppContext* context, uint32_t oldest, uint32_t next_cmd_id) {
+    drain_stm32_events(context);
+    while (oldest < next_cmd_id && stm32_ack_status(context, oldest) == STM32_ACK_DONE) oldest++;
+    return oldest;
+}
+
+// --- Snapshot retries ---
+// A snapshot answered with no image, or with the bullseye (the robot was at a
+// face without one), is taken again from another face of the obstacle. The nav
+// thread moves on as soon as a frame is captured, so answers come in while it
+// drives. At the next snapshot, or at the end of the route once the answers
+// still out are in, it plans from where it stands to the failed obstacle's
+// cheapest face not tried yet and every obstacle not photographed yet, on the
+// retry table planner_prepare_retries() built for the mission, and swaps that in
+// the way a map update is. Each face is photographed at most once. Missions
+// beyond the native planner's range get no table and keep their route.
+
+static bool g_retry_ready; // The planner's retry table matches the mission; nav thread only
+
+// A reroute planned ahead for one snapshot failing (see "Speculative retries")
+typedef struct {
+    bool valid;
+    int obstacle_id;   // The snapshot it is for
+    SnapPosition from; // Where it was planned from
+    PlannerVisit visits[PLANNER_MAX_TARGETS];
+    int count;
+    int rc; // 0, or -1 if it could not be planned or failed the route check
+    int faces[PLANNER_MAX_TARGETS];
+    CommandList commands;
+    SnapList snap_positions;
+} SpeculativeRetry;
+
+static SpeculativeRetry g_speculative[SPECULATIVE_RETRY_SLOTS]; // Nav thread only
+static int g_speculative_next; // Slot the next plan goes to
+
+// Drops every plan made ahead: the retry table or the route they assumed changed.
+static void speculative_reset(void) {
+    memset(g_speculative, 0, sizeof(g_speculative));
+    g_speculative_next = 0;
+}
+
+// Builds the retry table for the mission's obstacles.
+static void prepare_snapshot_retries(SharedAppContext* context) {
+    g_retry_ready = false;
+    speculative_reset();
+    if (!USE_SNAPSHOT_RETRIES) return;
+    uint64_t started_ns = latency_now_ns();
+    g_retry_ready = planner_prepare_retries(context->obstacles, context->obstacle_count, context->robot_start_x,
+                                            context->robot_start_y, context->robot_start_dir,
+                                            USE_ROUTE_VALIDATION) == 0;
+    timeline_span(started_ns, latency_now_ns(), "retry table");
+    if (g_retry_ready) {
+        LOG_INFO("[NavThread] Retry table for %d obstacle(s) ready in %.1f ms.\n", context->obstacle_count,
+                 (latency_now_ns() - started_ns) / 1e6);
+    } else {
+        LOG_INFO("[NavThread] No retry table for %d obstacle(s); failed snapshots will not be retried.\n",
+                 context->obstacle_count);
+    }
+}
+
+// Brings the retry table up to date for an edited mission, rebuilding it if
+// there is none to update.
+static void update_snapshot_retries(SharedAppContext* context) {
+    if (!g_retry_ready) {
+        prepare_snapshot_retries(context);
+        return;
+    }
+    speculative_reset();
+    uint64_t started_ns = latency_now_ns();
+    int kept = planner_update_retries(context->obstacles, context->obstacle_count, context->robot_start_x,
+                                      context->robot_start_y, context->robot_start_dir);
+    g_retry_ready = kept >= 0;
+    timeline_span(started_ns, latency_now_ns(), "retry table update");
+    if (g_retry_ready) {
+        LOG_INFO("[NavThread] Retry table updated in %.2f ms; %d search(es) repaired rather than redone.\n",
+                 (latency_now_ns() - started_ns) / 1e6, kept);
+    } else {
+        LOG_INFO("[NavThread] No retry table for %d obstacle(s); failed snapshots will not be retried.\n",
+                 context->obstacle_count);
+    }
+}
+
+// context->lock held. The outcome for obstacle_id, NULL if it was never photographed.
+static SnapshotOutcome* snapshot_outcome(SharedAppContext* context, int obstacle_id) {
+    for (int i = 0; i < context->snapshot_outcome_count; i++) {
+        if (context->snapshot_outcomes[i].obstacle_id == obstacle_id) return &context->snapshot_outcomes[i];
+    }
+    return NULL;
+}
+
+// Opens task's ticket and marks the snapshot of its obstacle, from its image's
+// face or the face a retry planned, as waiting for that ticket's answer.
+static void snapshot_queued(SharedAppContext* context, const ImageTask* task) {
+    pthread_mutex_lock(&context->lock);
+    SnapshotTicket* entry = &context->snapshot_tickets[task->ticket % SNAPSHOT_TICKETS];
+    if (entry->ticket != 0 && (entry->state == TICKET_QUEUED || entry->state == TICKET_CAPTURED)) {
+        LOG_WARN("[NavThread] Snapshot ticket %u (obstacle %d) is still open; ticket %u takes its slot.\n",
+                 entry->ticket, entry->obstacle_id, task->ticket);
+    }
+    *entry = (SnapshotTicket){ task->ticket, task->obstacle_id, task->robot_snap_position, task->mission_epoch,
+                               latency_now_ns(), 0, TICKET_QUEUED };
+    SnapshotOutcome* outcome = snapshot_outcome(context, task->obstacle_id);
+    if (!outcome && context->snapshot_outcome_count < MAX_OBSTACLES) {
+        outcome = &context->snapshot_outcomes[context->snapshot_outcome_count++];
+        *outcome = (SnapshotOutcome){ task->obstacle_id, SNAPSHOT_PENDING, task->has_obstacle ? task->obstacle.d : -1, 0, 0 };
+    }
+    if (outcome) {
+        outcome->status = SNAPSHOT_PENDING;
+        outcome->ticket = task->ticket;
+        if (outcome->face >= 0) outcome->faces_tried |= 1u << (outcome->face / 2);
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+static bool snapshots_pending(SharedAppContext* context) {
+    bool pending = false;
+    pthread_mutex_lock(&context->lock);
+    for (int i = 0; i < context->snapshot_outcome_count; i++) {
+        if (context->snapshot_outcomes[i].status == SNAPSHOT_PENDING) pending = true;
+    }
+    pthread_mutex_unlock(&context->lock);
+    return pending;
+}
+
+// --- Speculative retries ---
+// The reroute a failed snapshot calls for is planned at the next stop the
+// robot makes at a snapshot, or at the end of the route. While the robot
+// drives there, the nav thread mostly waits for DONEs, so from those waits it
+// plans ahead, for each obstacle whose answer is still to come (photographed
+// already, or further along the route), the reroute that obstacle failing
+// would call for: from the snap position the robot will stand at when it acts
+// on the answer, through that obstacle's faces not tried yet and the
+// obstacles that will still be left then. A success needs no plan, and
+// neither does a failure with no face left: the route stands. Plans are
+// cached by obstacle, together with the pose and the exact visits they were
+// made for, and swap_route_for_retry() drives one that matches what it would
+// plan. Anything else (two failures at once, a rolling snapshot where a stop
+// was expected) misses and is planned at the stop as before. A plan is a
+// Held-Karp on the retry table, well under a millisecond; one is made per wait.
+
+typedef struct {
+    int obstacle_id;
+    SnapPosition pose;
+    bool rolls; // Taken on the move, so no stop to plan from
+    bool joins; // Shares the frame of the snapshot before it
+} RouteSnap;
+
+// The route's snapshots from the next one on. Returns how many; *ends_on_snapshot
+// is set if the route's last command is a snapshot.
+static int route_snaps_ahead(SharedAppContext* context, RouteSnap out[], int max, bool* ends_on_snapshot) {
+    const Command* commands = atomic_load_explicit(&context->route_command_items, memory_order_acquire);
+    int total = atomic_load_explicit(&context->route_commands_published, memory_order_acquire);
+    int count = 0, snap = 0;
+    bool after_snapshot = false;
+    *ends_on_snapshot = total > 0 && commands[total - 1].type == CMD_SNAPSHOT;
+    for (int i = 0; i < total && count < max; i++) {
+        if (commands[i].type != CMD_SNAPSHOT) {
+            after_snapshot = false;
+            continue;
+        }
+        SnapPosition pose;
+        if (snap >= context->snap_position_idx && route_snap_position(context, snap, &pose)) {
+            const RouteSnap* prev = count > 0 ? &out[count - 1] : NULL;
+            bool joins = after_snapshot && prev && prev->pose.x == pose.x && prev->pose.y == pose.y && prev->pose.d == pose.d;
+            out[count++] = (RouteSnap){ commands[i].value, pose, snapshot_rolls(&commands[i]), joins };
+        }
+        snap++;
+        after_snapshot = true;
+    }
+    return count;
+}
+
+static bool in_route_snaps(const RouteSnap snaps[], int count, int obstacle_id) {
+    for (int i = 0; i < count; i++) {
+        if (snaps[i].obstacle_id == obstacle_id) return true;
+    }
+    return false;
+}
+
+// The reroute swap_route_for_retry() would plan if the snapshot of obstacle_id
+// failed and every other answer still out succeeded: *from and visits[] as it
+// would build them. at is obstacle_id's index in ahead[], or -1 if it has been
+// photographed. Returns false if no reroute would be planned.
+static bool predict_retry(SharedAppContext* context, const RouteSnap ahead[], int count, bool ends_on_snapshot,
+                          int obstacle_id, int at, SnapPosition* from, PlannerVisit visits[], int* visit_count) {
+    // The stop it is acted on at: the next stationary snapshot after its own
+    // (and the rest of that one's frame), else the route's end
+    int stop = at + 1;
+    while (stop < count && (ahead[stop].rolls || ahead[stop].joins)) stop++;
+    int taken; // Snapshots in ahead[] photographed by then
+    if (stop < count) {
+        *from = ahead[stop].pose;
+        taken = stop + 1;
+        while (taken < count && ahead[taken].joins) taken++;
+    } else if (count > 0) {
+        if (!ends_on_snapshot || ahead[count - 1].rolls) return false; // Nowhere known to plan from
+        *from = ahead[count - 1].pose;
+        taken = count;
+    } else {
+        if (!g_progress.pose_known) return false;
+        *from = g_progress.pose;
+        taken = 0;
+    }
+
+    *visit_count = 0;
+    bool planned = false;
+    pthread_mutex_lock(&context->lock);
+    for (int i = 0; i < context->obstacle_count && *visit_count < PLANNER_MAX_TARGETS; i++) {
+        const Obstacle* obs = &context->obstacles[i];
+        const SnapshotOutcome* outcome = snapshot_outcome(context, obs->id);
+        bool retaken = in_route_snaps(ahead, taken, obs->id);
+        if (obs->id == obstacle_id) {
+            // Its snapshot ahead is from the face a retry planned, else its image's
+            int face = outcome && outcome->face >= 0 ? outcome->face : obs->d;
+            unsigned left = 0xFu & ~((outcome ? outcome->faces_tried : 0u) | 1u << (face / 2));
+            if (left == 0) break; // Given up on instead
+            visits[(*visit_count)++] = (PlannerVisit){ obs->id, left };
+            planned = true;
+        } else if (outcome && (outcome->status == SNAPSHOT_FAILED || (outcome->status == SNAPSHOT_REROUTED && !retaken))) {
+            unsigned left = 0xFu & ~outcome->faces_tried;
+            if (left) visits[(*visit_count)++] = (PlannerVisit){ obs->id, left };
+        } else if (!progress_visited(obs->id) && !retaken) {
+            visits[(*visit_count)++] = (PlannerVisit){ obs->id, 1u << (obs->d / 2) };
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    return planned;
+}
+
+// The plan made ahead for visits from pose, if there is one.
+static const SpeculativeRetry* speculative_find(const SnapPosition* from, const PlannerVisit visits[], int count) {
+    for (int i = 0; i < SPECULATIVE_RETRY_SLOTS; i++) {
+        const SpeculativeRetry* s = &g_speculative[i];
+        if (!s->valid || s->count != count || s->from.x != from->x || s->from.y != from->y || s->from.d != from->d) {
+            continue;
+        }
+        bool same = true;
+        for (int v = 0; v < count && same; v++) {
+            same = s->visits[v].obstacle_id == visits[v].obstacle_id && s->visits[v].faces == visits[v].faces;
+        }
+        if (same) return s;
+    }
+    return NULL;
+}
+
+// Plans ahead the first contingency that has no plan yet: the snapshots
+// waiting for their answer first, then those ahead on the route, up to
+// SPECULATIVE_RETRY_SLOTS of them. Returns true if it planned one.
+static bool speculate_retry(SharedAppContext* context) {
+    if (!USE_SPECULATIVE_RETRIES || !g_retry_ready || !atomic_load(&context->route_complete)) return false;
+    RouteSnap ahead[MAX_OBSTACLES];
+    bool ends_on_snapshot;
+    int count = route_snaps_ahead(context, ahead, MAX_OBSTACLES, &ends_on_snapshot);
+
+    int ids[SPECULATIVE_RETRY_SLOTS], at[SPECULATIVE_RETRY_SLOTS], candidates = 0;
+    pthread_mutex_lock(&context->lock);
+    for (int i = 0; i < context->snapshot_outcome_count && candidates < SPECULATIVE_RETRY_SLOTS; i++) {
+        if (context->snapshot_outcomes[i].status != SNAPSHOT_PENDING) continue;
+        ids[candidates] = context->snapshot_outcomes[i].obstacle_id;
+        at[candidates++] = -1;
+    }
+    pthread_mutex_unlock(&context->lock);
+    for (int n = 0; n < count && candidates < SPECULATIVE_RETRY_SLOTS; n++) {
+        ids[candidates] = ahead[n].obstacle_id;
+        at[candidates++] = n;
+    }
+
+    for (int c = 0; c < candidates; c++) {
+        SnapPosition from;
+        PlannerVisit visits[PLANNER_MAX_TARGETS];
+        int visit_count;
+        if (!predict_retry(context, ahead, count, ends_on_snapshot, ids[c], at[c], &from, visits, &visit_count) ||
+            speculative_find(&from, visits, visit_count)) {
+            continue;
+        }
+        uint64_t started_ns = latency_now_ns();
+        SpeculativeRetry* s = &g_speculative[g_speculative_next];
+        g_speculative_next = (g_speculative_next + 1) % SPECULATIVE_RETRY_SLOTS;
+        *s = (SpeculativeRetry){ .valid = true, .obstacle_id = ids[c], .from = from, .count = visit_count };
+        memcpy(s->visits, visits, sizeof(visits[0]) * (size_t)visit_count);
+        s->rc = planner_plan_visits(visits, visit_count, from.x, from.y, from.d, &context->mission_arena,
+                                    &s->commands, &s->snap_positions, s->faces);
+        if (s->rc == 0 && validate_route(context, from.x, from.y, from.d, &s->commands, &s->snap_positions, false) != 0) {
+            s->rc = -1;
+        }
+        timeline_span(started_ns, latency_now_ns(), "plan ahead %d", ids[c]);
+        LOG_DEBUG("[NavThread] Planned ahead for obstacle %d failing: %d command(s) from (%d, %d) facing %d in %.2f ms.\n",
+                  ids[c], s->rc == 0 ? s->commands.count : 0, from.x, from.y, from.d,
+                  (latency_now_ns() - started_ns) / 1e6);
+        return true;
+    }
+    return false;
+}
+
+// Replans the rest of the route for the failed snapshots answered so far.
+// Returns 1 if the route was swapped, 0 if nothing needed a retry, -1 if the
+// retries could not be planned (they are given up and the old route stands).
+// Obstacles to photograph: the retries from their faces not tried yet, the
+// rest from their image's face. A retry the route already heads for is
+// planned again, since the route is about to change. Returns the count;
+// *retries is how many failures are among them that no reroute took yet.
+static int remaining_visits(SharedAppContext* context, PlannerVisit visits[PLANNER_MAX_TARGETS], int* retries) {
+    int count = 0;
+    *retries = 0;
+    pthread_mutex_lock(&context->lock);
+    for (int i = 0; i < context->obstacle_count && count < PLANNER_MAX_TARGETS; i++) {
+        const Obstacle* obs = &context->obstacles[i];
+        SnapshotOutcome* outcome = snapshot_outcome(context, obs->id);
+        if (outcome && (outcome->status == SNAPSHOT_FAILED || outcome->status == SNAPSHOT_REROUTED)) {
+            unsigned left = 0xFu & ~outcome->faces_tried;
+            if (left == 0) {
+                LOG_INFO("[NavThread] Obstacle %d: every face tried; giving up on it.\n", obs->id);
+                outcome->status = SNAPSHOT_GIVEN_UP;
+                continue;
+            }
+            if (outcome->status == SNAPSHOT_FAILED) (*retries)++;
+            visits[count++] = (PlannerVisit){ obs->id, left };
+        } else if (!progress_visited(obs->id)) {
+            visits[count++] = (PlannerVisit){ obs->id, 1u << (obs->d / 2) };
+        }
+    }
+    // Failures for obstacles a map update has dropped
+    for (int i = 0; i < context->snapshot_outcome_count; i++) {
+        SnapshotOutcome* outcome = &context->snapshot_outcomes[i];
+        Obstacle unused;
+        if (outcome->status == SNAPSHOT_FAILED && !find_obstacle(context, outcome->obstacle_id, &unused)) {
+            outcome->status = SNAPSHOT_GIVEN_UP;
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    return count;
+}
+
+// Books what a reroute through visits planned (rc 0, faces from
+// planner_plan_visits()) or failed to (rc -1) for the retries among them.
+static void book_reroute(SharedAppContext* context, const PlannerVisit visits[], int count, const int faces[], int rc) {
+    pthread_mutex_lock(&context->lock);
+    for (int v = 0; v < count; v++) {
+        SnapshotOutcome* outcome = snapshot_outcome(context, visits[v].obstacle_id);
+        if (!outcome || (outcome->status != SNAPSHOT_FAILED && outcome->status != SNAPSHOT_REROUTED)) continue;
+        if (rc == 0 && faces[v] >= 0) {
+            LOG_INFO("[NavThread] Obstacle %d: retrying from face %d.\n", outcome->obstacle_id, faces[v]);
+            if (outcome->status == SNAPSHOT_FAILED) metric_inc(METRIC_SNAPSHOT_RETRIES);
+            outcome->status = SNAPSHOT_REROUTED;
+            outcome->face = faces[v];
+        } else {
+            LOG_INFO("[NavThread] Obstacle %d: no untried face is reachable; giving up on it.\n", outcome->obstacle_id);
+            outcome->status = SNAPSHOT_GIVEN_UP;
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+}
+
+static int swap_route_for_retry(SharedAppContext* context) {
+    if (!g_retry_ready || !atomic_load(&context->route_complete) || !g_progress.pose_known) return 0;
+
+    PlannerVisit visits[PLANNER_MAX_TARGETS];
+    int retries;
+    int count = remaining_visits(context, visits, &retries);
+    if (retries == 0) return 0;
+
+    uint64_t started_ns = latency_now_ns();
+    int faces[PLANNER_MAX_TARGETS];
+    CommandList commands;
+    SnapList snap_positions;
+    int rc;
+    const SpeculativeRetry* ahead = speculative_find(&g_progress.pose, visits, count);
+    if (ahead) {
+        LOG_INFO("[NavThread] Snapshot retry: rerouting through %d obstacle(s) from (%d, %d) facing %d, planned ahead.\n",
+                 count, g_progress.pose.x, g_progress.pose.y, g_progress.pose.d);
+        metric_inc(METRIC_RETRIES_PLANNED_AHEAD);
+        rc = ahead->rc;
+        commands = ahead->commands;
+        snap_positions = ahead->snap_positions;
+        memcpy(faces, ahead->faces, sizeof(faces[0]) * (size_t)count);
+    } else {
+        LOG_INFO("[NavThread] Snapshot retry: rerouting through %d obstacle(s) from (%d, %d) facing %d.\n", count,
+                 g_progress.pose.x, g_progress.pose.y, g_progress.pose.d);
+        rc = planner_plan_visits(visits, count, g_progress.pose.x, g_progress.pose.y, g_progress.pose.d,
+                                 &context->mission_arena, &commands, &snap_positions, faces);
+        if (rc == 0 && validate_route(context, g_progress.pose.x, g_progress.pose.y, g_progress.pose.d,
+                                      &commands, &snap_positions, false) != 0) {
+            rc = -1;
+        }
+        timeline_span(started_ns, latency_now_ns(), "reroute");
+    }
+    speculative_reset(); // Planned for the route being replaced, whose commands the swap rewrites
+    book_reroute(context, visits, count, faces, rc);
+    if (rc != 0) {
+        LOG_ERROR("[NavThread] Snapshot retry could not be planned; keeping the current route.\n");
+        return -1;
+    }
+
+    context->commands = commands;
+    context->snap_positions = snap_positions;
+    g_progress.swapped = true;
+    publish_complete_route(context, false); // A retry is taken from a stop
+    LOG_INFO("[NavThread] Swapped in a %d-command retry route after %.2f ms.\n", context->commands.count,
+             (latency_now_ns() - started_ns) / 1e6);
+    send_message_to_android_with_ack(context->android_fd, "\"Snapshot failed. Retrying from another face.\"\n"); // Using ack send
+    feed_state("navigating", context->commands.count);
+    return 1;
+}
+
+// Swaps the rest of the route at a snapshot for a queued map update, else for
+// the snapshot retries due. Returns as swap_route_for_update() does.
+static int swap_route_at_snapshot(SharedAppContext* context) {
+    int rc = swap_route_for_update(context);
+    return rc != 0 ? rc : swap_route_for_retry(context);
+}
+
+// At the end of the route: waits for the answers still out, then swaps in a
+// route for the retries they call for. Returns as swap_route_for_retry().
+static int retry_at_route_end(SharedAppContext* context) {
+    if (!g_retry_ready || !g_progress.pose_known) return 0;
+    if (snapshots_pending(context)) {
+        LOG_INFO("[NavThread] Route done; waiting for the last snapshot answers.\n");
+        uint64_t started_ns = latency_now_ns();
+        arm_nav_deadline(context, SNAPSHOT_ANSWER_WAIT_SEC);
+        while (snapshots_pending(context) && !atomic_load(&context->stop_requested) &&
+               !atomic_load(&context->deadline_expired)) {
+            if (!speculate_retry(context)) nav_wait(context);
+        }
+        arm_nav_deadline(context, 0);
+        timeline_span(started_ns, latency_now_ns(), "wait answers");
+    }
+    if (atomic_load(&context->stop_requested)) return 0;
+    return swap_route_for_retry(context);
+}
+
+// The nearest cell to the tracked pose
+static SnapPosition sensing_cell(void) {
+    return (SnapPosition){ (int)lroundf((float)g_sensing.pose.x_cm / SENSING_CELL_CM),
+                           (int)lroundf((float)g_sensing.pose.y_cm / SENSING_CELL_CM), g_sensing.pose.d };
+}
+
+// Before command i of a complete route: true if what the range sensor has found
+// since the last check blocks the rest of the route, which is clear without it.
+static bool sensing_blocked_ahead(SharedAppContext* context, int i) {
+    if (!USE_OCCUPANCY_MAP || !g_retry_ready || !g_sensing.pose_known || !atomic_load(&context->route_complete)) {
+        return false;
+    }
+    uint32_t generation = occupancy_generation();
+    if (generation == g_sensing.generation) return false;
+    g_sensing.generation = generation;
+
+    PlannerCell cells[OCC_SENSED_MAX];
+    int count = occupancy_sensed(cells, OCC_SENSED_MAX);
+    metric_gauge_set(METRIC_GAUGE_SENSED_CELLS, count);
+    planner_set_sensed(cells, count);
+    update_snapshot_retries(context); // Searched around them from here on
+
+    int snaps = 0;
+    for (int k = 0; k < i; k++) {
+        if (context->commands.items[k].type == CMD_SNAPSHOT) snaps++;
+    }
+    CommandList rest = { context->commands.items + i, context->commands.count - i, 0 };
+    SnapList rest_snaps = { context->snap_positions.items + snaps, context->snap_positions.count - snaps, 0 };
+    SnapPosition at = sensing_cell();
+    RouteSimResult sim;
+    if (planner_simulate_route(context->obstacles, context->obstacle_count, at.x, at.y, at.d, &rest, &rest_snaps,
+                               &sim) != ROUTE_SIM_COLLISION) {
+        return false;
+    }
+    // A route that hits a mission obstacle regardless is what the route check is for
+    planner_set_sensed(NULL, 0);
+    RouteSimResult clear;
+    bool blocked = planner_simulate_route(context->obstacles, context->obstacle_count, at.x, at.y, at.d, &rest,
+                                          &rest_snaps, &clear) != ROUTE_SIM_COLLISION;
+    planner_set_sensed(cells, count);
+    if (blocked) {
+        LOG_WARN("[NavThread] %d sensed cell(s) block the route at command %d, at (%d, %d) facing %d.\n", count,
+                 i + sim.command, sim.pose.x, sim.pose.y, sim.pose.d);
+        timeline_instant(latency_now_ns(), "sensed block at #%d", i + sim.command);
+    }
+    return blocked;
+}
+
+// From a stop at the tracked pose, swaps the rest of the route for one through
+// every obstacle still to photograph around the sensed cells. Returns 1 if the
+// route was swapped, -1 if no reroute was found and the old route stands.
+static int swap_route_for_sensed(SharedAppContext* context) {
+    g_progress.pose = sensing_cell();
+    g_progress.pose_known = true;
+    PlannerVisit visits[PLANNER_MAX_TARGETS];
+    int retries;
+    int count = remaining_visits(context, visits, &retries);
+    uint64_t started_ns = latency_now_ns();
+    LOG_INFO("[NavThread] Rerouting through %d obstacle(s) from (%d, %d) facing %d around what was sensed.\n",
+             count, g_progress.pose.x, g_progress.pose.y, g_progress.pose.d);
+    int faces[PLANNER_MAX_TARGETS];
+    CommandList commands;
+    SnapList snap_positions;
+    int rc = count > 0 ? planner_plan_visits(visits, count, g_progress.pose.x, g_progress.pose.y, g_progress.pose.d,
+                                             &context->mission_arena, &commands, &snap_positions, faces)
+                       : -1;
+    if (rc == 0 && validate_route(context, g_progress.pose.x, g_progress.pose.y, g_progress.pose.d, &commands,
+                                  &snap_positions, false) != 0) {
+        rc = -1;
+    }
+    timeline_span(started_ns, latency_now_ns(), "sensed reroute");
+    speculative_reset();
+    book_reroute(context, visits, count, faces, rc);
+    if (rc != 0) {
+        LOG_ERROR("[NavThread] No route around what was sensed; keeping the current route.\n");
+        return -1;
+    }
+
+    context->commands = commands;
+    context->snap_positions = snap_positions;
+    g_progress.swapped = true;
+    publish_complete_route(context, false);
+    metric_inc(METRIC_SENSED_REPLANS);
+    LOG_INFO("[NavThread] Swapped in a %d-command route around what was sensed after %.2f ms.\n",
+             context->commands.count, (latency_now_ns() - started_ns) / 1e6);
+    send_message_to_android_with_ack(context->android_fd, "\"Obstacle ahead. Route updated.\"\n"); // Using ack send
+    feed_state("navigating", context->commands.count);
+    return 1;
+}
+
+// Captures obstacle_id at the current snap position and waits for the image
+// server's answer. The robot must already be stationary. Returns 0 to carry on
+// (including when the capture had to be skipped), -1 to abort the run.
+// Fills task for obstacle_id's snapshot at the route's next snap position.
+static void snapshot_task(SharedAppContext* context, int obstacle_id, ImageTask* task) {
+    task->obstacle_id = obstacle_id;
+    if (++context->next_snapshot_ticket == 0) context->next_snapshot_ticket = 1; // 0 is no ticket
+    task->ticket = context->next_snapshot_ticket;
+    task->mission_epoch = g_nav_epoch;
+    task->has_obstacle = find_obstacle(context, obstacle_id, &task->obstacle);
+    task->shared_count = 0;
+    task->pass_ns = 0; // Taken at rest unless rolling_fire() says otherwise
+    task->rest_ns = USE_FRAME_RING ? g_rest_ns : 0;
+    // Get current snap position from context
+    if (route_snap_position(context, context->snap_position_idx, &task->robot_snap_position)) {
+        context->snap_position_idx++;
+    } else {
+        // Fallback if snap positions don't match commands, should not happen with correct parsing
+        task->robot_snap_position = (SnapPosition){.x = -1, .y = -1, .d = -1};
+        LOG_WARN("[NavThread] Warning: Snap position index out of bounds.\n");
+    }
+}
+
+// Books the snapshot of obstacle_id that the approach scan answered: Android
+// has had its TARGET, and gets the robot's position as after a capture. A
+// robot that did not stop (!stationary) leaves no pose to replan from.
+static void snapshot_answered_on_approach(SharedAppContext* context, int obstacle_id, bool stationary) {
+    ImageTask task;
+    snapshot_task(context, obstacle_id, &task);
+    LOG_INFO("[NavThread] Obstacle %d was recognised on the way in; %s.\n", obstacle_id,
+             stationary ? "resuming at once" : "not stopping for it");
+    snapshot_queued(context, &task);
+    send_robot_position(context, obstacle_id, &task.robot_snap_position);
+    snapshot_answered(context, task.ticket, false);
+    SnapPosition unknown = { .x = -1, .y = -1, .d = -1 };
+    progress_snapped(obstacle_id, stationary ? &task.robot_snap_position : &unknown);
+}
+
+// Window path, at obstacle_id's snapshot with commands [oldest, next) in
+// flight: waits while the approach scan is still looking and the move into
+// the snapshot is not done. Returns true if the scan answered the snapshot,
+// which then needs neither the stop nor a capture.
+static bool wait_for_approach(SharedAppContext* context, int obstacle_id, uint32_t oldest, uint32_t next) {
+    if (oldest == next || !approach_scanning(obstacle_id)) return approach_take(obstacle_id);
+    uint32_t last_id = next - 1;
+    arm_nav_deadline(context, STM32_ACK_TIMEOUT_SEC); // wait_for_stm32_acks() takes over after it
+    while (approach_scanning(obstacle_id) && !atomic_load(&context->stop_requested) &&
+           !atomic_load(&context->deadline_expired)) {
+        drain_stm32_events(context);
+        int8_t status = stm32_ack_status(context, last_id);
+        if (g_resend.pending || status == STM32_ACK_DONE || status == STM32_ACK_ERROR) break;
+        nav_wait(context);
+    }
+    arm_nav_deadline(context, 0);
+    return approach_take(obstacle_id);
+}
+
+// The obstacles of the snapshot at route command index: its own and those of
+// the snapshots straight after it at the same snap position, which the
+// planner emits back to back for a shared viewing position and one frame
+// answers. Fills ids and returns how many, at least 1.
+static int route_snapshot_group(SharedAppContext* context, int index, int ids[SNAPSHOT_GROUP_MAX]) {
+    int count = 0;
+    ids[count++] = route_snapshot_queued(context, index);
+    SnapPosition first, next;
+    if (!route_snap_position(context, context->snap_position_idx, &first)) return count;
+    while (count < SNAPSHOT_GROUP_MAX) {
+        int id = route_snapshot_queued(context, index + count);
+        if (!id || !route_snap_position(context, context->snap_position_idx + count, &next) ||
+            next.x != first.x || next.y != first.y || next.d != first.d) {
+            break;
+        }
+        ids[count++] = id;
+    }
+    return count;
+}
+
+// Captures ids[0] and the count - 1 obstacles sharing its frame (see
+// route_snapshot_group()) in one snapshot, taking a snap position each.
+static int run_snapshot(SharedAppContext* context, const int* ids, int count) {
+    uint64_t started_ns = latency_now_ns();
+    int obstacle_id = ids[0];
+    LOG_INFO("[NavThread] --- Queueing snapshot for obstacle %d ---\n", obstacle_id);
+    ImageTask task;
+    snapshot_task(context, obstacle_id, &task);
+    for (int m = 1; m < count; m++) {
+        ImageTask member;
+        snapshot_task(context, ids[m], &member);
+        task.shared[task.shared_count++] = (SnapshotTarget){ ids[m], member.has_obstacle, member.obstacle, member.ticket };
+        LOG_INFO("[NavThread] Obstacle %d shares the frame of obstacle %d.\n", ids[m], obstacle_id);
+    }
+
+    for (int m = 0; m < count; m++) {
+        ImageTask member;
+        snapshot_member(&task, m, &member);
+        snapshot_queued(context, &member); // Before a worker can answer it
+        mission_report_snapshot_queued(ids[m]);
+    }
+    if (enqueue_image_task(&context->image_queue, &task) != 0) {
+        LOG_ERROR("[NavThread] Image worker pool is shut down. Skipping obstacle %d.\n", obstacle_id);
+        for (int m = 0; m < count; m++) {
+            ImageTask member;
+            snapshot_member(&task, m, &member);
+            snapshot_answered(context, member.ticket, false); // No answer will come, and no retry could be taken
+            mission_report_answered(task.mission_epoch, ids[m], false, 0, latency_now_ns());
+        }
+        return 0;
+    }
+
+    LOG_INFO("[NavThread] Queued snapshot for obstacle %d. Waiting for image capture confirmation...\n", obstacle_id);
+
+    arm_nav_deadline(context, 10); // Wait for up to 10 seconds for image capture confirmation
+
+    int img_ack_result = 0; // 0 for success, -1 for error/timeout
+    SnapshotTicketState state;
+    while ((state = snapshot_ticket_state(context, task.ticket)) == TICKET_QUEUED &&
+           !atomic_load(&context->stop_requested)) {
+        if (atomic_load(&context->deadline_expired)) {
+            LOG_ERROR("[NavThread] Timeout waiting for image capture confirmation for obstacle %d.\n", obstacle_id);
+            metric_inc(METRIC_CAPTURE_TIMEOUTS);
+            img_ack_result = -1; // Indicate error
+            break;
+        }
+        nav_wait(context);
+    }
+
+    if (img_ack_result == 0 && state == TICKET_CAPTURE_FAILED) {
+        LOG_ERROR("[NavThread] Image capture for obstacle %d indicated failure. Aborting navigation.\n", obstacle_id);
+        img_ack_result = -1; // Treat as failure for navigation flow
+    }
+    if (img_ack_result == 0 && state != TICKET_QUEUED) {
+        LOG_INFO("[NavThread] Received image capture confirmation for obstacle %d. Proceeding.\n", obstacle_id);
+        for (int m = 0; m < count; m++) progress_snapped(ids[m], &task.robot_snap_position);
+    }
+    arm_nav_deadline(context, 0);
+    uint64_t ended_ns = latency_now_ns();
+    timeline_span(started_ns, ended_ns, "wait capture %d", obstacle_id);
+    mission_report_snapshot_wait(started_ns, ended_ns);
+
+    if (img_ack_result == -1 || atomic_load(&context->stop_requested)) return -1;
+    return 0;
+}
+
+// --- Rolling snapshots ---
+// A snapshot route_roll_snapshots() marked is taken without stopping. The
+// robot creeps the last ROLLING_CREEP_CM into the viewing pose with the camera
+// on a short exposure, and the frame is queued the moment the firmware
+// reports it there: the creep's DONE in the window, the step's PASS on the
+// route executor. The firmware drives straight on and the nav thread waits
+// for neither the settle nor the capture. A frame that fails or is dequeued
+// too late is answered as failed, and retried from a stop like any other
+// (see "Snapshot retries"). Nav thread only.
+
+static struct {
+    uint32_t trigger_id; // The report that the robot is at the pose, 0 for none armed
+    ImageTask task;
+} g_rolling;
+
+// Queues the armed snapshot; the robot passed its pose at passed_ns.
+static void rolling_fire(SharedAppContext* context, uint64_t passed_ns) {
+    ImageTask* task = &g_rolling.task;
+    g_rolling.trigger_id = 0;
+    task->pass_ns = passed_ns;
+    if (enqueue_image_task(&context->image_queue, task) != 0) {
+        LOG_ERROR("[NavThread] Image worker pool is shut down. Skipping obstacle %d.\n", task->obstacle_id);
+        snapshot_answered(context, task->ticket, false);
+        mission_report_answered(task->mission_epoch, task->obstacle_id, false, 0, latency_now_ns());
+        return;
+    }
+    timeline_instant(passed_ns, "pass %d", task->obstacle_id);
+    LOG_INFO("[NavThread] Passing obstacle %d's viewing pose; capturing on the move.\n", task->obstacle_id);
+}
+
+// Fires the armed snapshot if its trigger is DONE already.
+static void rolling_check(SharedAppContext* context) {
+    if (g_rolling.trigger_id == 0) return;
+    const Stm32AckSlot* slot = &context->stm32_ack_table[g_rolling.trigger_id % STM32_ACK_TABLE_SIZE];
+    if (slot->cmd_id == g_rolling.trigger_id && slot->status == STM32_ACK_DONE) rolling_fire(context, slot->done_ns);
+}
+
+static void rolling_passed(SharedAppContext* context, uint32_t cmd_id, uint64_t rx_ns) {
+    if (g_rolling.trigger_id != 0 && cmd_id == g_rolling.trigger_id) rolling_fire(context, rx_ns);
+}
+
+// Books obstacle_id's snapshot at the route's next snap position, to be queued
+// once trigger_id reports the robot at it. One snapshot is armed at a time:
+// the caller waits out an earlier trigger first.
+static void rolling_arm(SharedAppContext* context, int obstacle_id, uint32_t trigger_id) {
+    rolling_check(context); // A trigger a reset marked DONE without a report
+    snapshot_task(context, obstacle_id, &g_rolling.task);
+    snapshot_queued(context, &g_rolling.task);
+    mission_report_snapshot_queued(obstacle_id);
+    SnapPosition unknown = { .x = -1, .y = -1, .d = -1 };
+    progress_snapped(obstacle_id, &unknown); // The robot will not stand there to replan from
+    camera_set_motion_exposure(true);
+    g_rolling.trigger_id = trigger_id;
+    LOG_INFO("[NavThread] Obstacle %d is taken on the move, at the end of command %u.\n", obstacle_id, trigger_id);
+    rolling_check(context);
+}
+
+// Forgets a snapshot the robot never reached (the run was abandoned).
+static void rolling_disarm(void) {
+    if (g_rolling.trigger_id == 0) return;
+    g_rolling.trigger_id = 0;
+    camera_set_motion_exposure(false);
+}
+
+// --- Mission checkpoints ---
+// Each mission is logged as it goes (checkpoint.h): its arena, every route it
+// drives, the ID each command went out under, each DONE and each image Android
+// was sent. A controller that restarts mid-mission finds the log unfinished,
+// asks the firmware how far it got (resume_locate(), during the link
+// handshake) and drives the rest of the route before it looks at Android.
+// Streamed routes are only logged once a swap replaces them.
+
+static CheckpointMission g_resume; // The unfinished mission the log held
+static bool g_resume_pending;      // ...still to be driven; set before the nav thread starts
+
+// Logs the route execute_navigation() drives from here, once it is complete.
+static void checkpoint_current_route(SharedAppContext* context) {
+    if (!atomic_load(&context->route_complete)) return;
+    int commands = atomic_load_explicit(&context->route_commands_published, memory_order_acquire);
+    int snaps = atomic_load_explicit(&context->route_snaps_published, memory_order_acquire);
+    checkpoint_route(atomic_load_explicit(&context->route_command_items, memory_order_acquire), commands,
+                     atomic_load_explicit(&context->route_snap_items, memory_order_acquire), snaps);
+}
+
+// Starts the log for the mission execute_navigation() is about to drive. A
+// resumed mission carries its images over.
+static void checkpoint_mission(SharedAppContext* context) {
+    checkpoint_begin(context->obstacles, context->obstacle_count, context->robot_start_x, context->robot_start_y,
+                     context->robot_start_dir);
+    pthread_mutex_lock(&context->lock);
+    for (int i = 0; i < context->snapshot_outcome_count; i++) {
+        if (context->snapshot_outcomes[i].status == SNAPSHOT_DETECTED) {
+            checkpoint_reported(context->snapshot_outcomes[i].obstacle_id);
+        }
+    }
+    pthread_mutex_unlock(&context->lock);
+    checkpoint_current_route(context);
+}
+
+// True when the mission's route can be handed to the firmware in one go.
+static bool route_runs_on_stm32(SharedAppContext* context) {
+#if USE_STM32_ROUTE_EXECUTOR
+    if (!stm32_protocol_route() || !atomic_load(&context->route_complete)) return false;
+    int total = atomic_load_explicit(&context->route_commands_published, memory_order_acquire);
+    return total > 0 && total <= STM32_ROUTE_MAX_STEPS;
+#else
+    (void)context;
+    return false;
+#endif
+}
+
+// Uploads the whole route in ROUTE frames and follows the firmware through it
+// (stm32_protocol.h). Frame i has ID *first_id + i and route step k reports as
+// base_id + k, so the usual ACK table tracks both; a SNAP step arrives as that
+// step's DONE. Each step is stamped for the latency stats when the one before
+// it finishes, which is when the firmware starts it. On failure the firmware
+// is told to STOP. Returns 0 once the last step is done, 1 if a map update
+// replaced the rest of the route at a snapshot (the firmware has dropped this
+// one), -1 otherwise. *first_id is then the next free command ID.
+static int execute_route_on_stm32(SharedAppContext* context, uint32_t* first_id) {
+    const Command* commands = atomic_load_explicit(&context->route_command_items, memory_order_acquire);
+    int total = atomic_load_explicit(&context->route_commands_published, memory_order_acquire);
+    int frames = (total + STM32_ROUTE_STEPS_PER_FRAME - 1) / STM32_ROUTE_STEPS_PER_FRAME;
+    uint32_t base_id = *first_id + (uint32_t)frames;
+    *first_id = base_id + (uint32_t)total + 1; // The STOP takes the last one
+    LOG_INFO("[NavThread] Uploading %d commands to the STM32 route executor (%d frames).\n", total, frames);
+    for (int k = 0; k < total; k++) {
+        pose_check_sent(base_id + (uint32_t)k, &commands[k]);
+        checkpoint_sent(base_id + (uint32_t)k, k);
+    }
+
+    int result = 0;
+    for (int f = 0; f < frames && result == 0; f++) {
+        int first = f * STM32_ROUTE_STEPS_PER_FRAME;
+        int count = total - first < STM32_ROUTE_STEPS_PER_FRAME ? total - first : STM32_ROUTE_STEPS_PER_FRAME;
+        uint32_t frame_id = base_id - (uint32_t)frames + (uint32_t)f;
+        // The firmware starts driving as soon as the last frame is stored
+        if (f == frames - 1 && commands[0].type != CMD_SNAPSHOT) {
+            latency_cmd_sent(&g_latency_stats, base_id, commands[0].type, stm32_command_timed_value(commands[0]),
+                             latency_now_ns());
+            feed_command_sent(base_id, &commands[0], (uint32_t)total);
+        }
+        if (send_route_to_stm32(context->stm32_fd, commands, first, count, total, frame_id, base_id) != 0 ||
+            wait_for_stm32_acks(context, frame_id, frame_id) != 0) {
+            LOG_ERROR("[NavThread] STM32 did not take route frame %u.\n", frame_id);
+            result = -1;
+        }
+    }
+
+    int shared_left = 0; // SNAP steps still to come whose obstacles the last frame answered
+    for (int k = 0; k < total && result == 0; k++) {
+        uint32_t id = base_id + (uint32_t)k;
+        if (k + 1 < total && commands[k + 1].type == CMD_SNAPSHOT && commands[k].type != CMD_SNAPSHOT) {
+            prearm_before_snapshot(id);
+            if (snapshot_rolls(&commands[k + 1]) && stm32_protocol_pass()) {
+                rolling_arm(context, commands[k + 1].value, id + 1); // Fired by the step's PASS
+            } else {
+                approach_begin(commands[k + 1].value, g_nav_epoch);
+            }
+        }
+        if (commands[k].type != CMD_SNAPSHOT) speculate_retry(context); // While the robot drives it
+        if (wait_for_stm32_acks(context, id, id) != 0) {
+            result = -1;
+            break;
+        }
+        // Sent as a PASS step (send_route_to_stm32()): queued already, and the firmware has driven on
+        bool rolling = snapshot_rolls(&commands[k]) && stm32_protocol_pass();
+        if (commands[k].type == CMD_SNAPSHOT && shared_left > 0) {
+            shared_left--; // Taken with the first; the firmware still waits for its RESUME
+        } else if (commands[k].type == CMD_SNAPSHOT && !rolling) {
+            // Sent once the chassis has settled, so capture straight away
+            int ids[SNAPSHOT_GROUP_MAX];
+            int count = route_snapshot_group(context, k, ids);
+            if (approach_take(commands[k].value)) {
+                snapshot_answered_on_approach(context, commands[k].value, true);
+            } else if (run_snapshot(context, ids, count) != 0) {
+                result = -1;
+                break;
+            } else {
+                shared_left = count - 1;
+            }
+            // STOP rather than RESUME drops the rest while the robot waits
+            if (swap_route_at_snapshot(context) > 0) {
+                send_route_control_to_stm32(context->stm32_fd, STM32_OP_STOP, base_id + (uint32_t)total);
+                pose_check_rewind(id);
+                return 1;
+            }
+        }
+        if (k + 1 < total && commands[k + 1].type != CMD_SNAPSHOT) {
+            latency_cmd_sent(&g_latency_stats, id + 1, commands[k + 1].type, stm32_command_timed_value(commands[k + 1]),
+                             latency_now_ns());
+            feed_command_sent(id + 1, &commands[k + 1], (uint32_t)(total - k - 1));
+        }
+        if (commands[k].type == CMD_SNAPSHOT && !rolling) {
+            if (send_route_control_to_stm32(context->stm32_fd, STM32_OP_RESUME, id) != 0) result = -1;
+            if (k + 1 < total) g_progress.pose_known = false; // A route's last snapshot leaves it there
+        }
+    }
+
+    if (result != 0) {
+        rolling_disarm();
+        LOG_ERROR("[NavThread] Abandoning the route on the STM32.\n");
+        send_route_control_to_stm32(context->stm32_fd, STM32_OP_STOP, base_id + (uint32_t)total);
+    }
+    return result;
+}
+
+// Waits until command next_cmd_id can be sent (stm32_window_full()), moving
+// *oldest_unacked past what has completed. *freed_ns is when the report that
+// made room arrived, or 0 if there was room already. Returns 0, or -1 as the
+// waits do.
+static int wait_for_stm32_room(SharedAppContext* context, uint32_t* oldest_unacked, uint32_t next_cmd_id,
+                               uint64_t* freed_ns) {
+    *freed_ns = 0;
+    *oldest_unacked = advance_oldest_unacked(context, *oldest_unacked, next_cmd_id);
+    if (!stm32_window_full(*oldest_unacked, next_cmd_id)) return 0;
+    speculate_retry(context); // The robot has the window to drive meanwhile
+    while (stm32_window_full(*oldest_unacked, next_cmd_id)) {
+        uint32_t waited = *oldest_unacked;
+        if (waited == next_cmd_id) {
+            // Nothing in flight: the firmware's queue is empty, whatever it reported
+            g_credit.limit = next_cmd_id - 1 + (uint32_t)g_credit.depth;
+            break;
+        }
+        int rc = g_credit.on ? wait_for_stm32_credit(context, waited, next_cmd_id)
+                             : wait_for_stm32_acks(context, waited, waited);
+        if (rc != 0) return -1;
+        if (g_credit.on && next_cmd_id <= g_credit.limit && g_credit.raised_ns) {
+            *freed_ns = g_credit.raised_ns;
+        } else {
+            *freed_ns = context->stm32_ack_table[waited % STM32_ACK_TABLE_SIZE].done_ns;
+        }
+        *oldest_unacked = advance_oldest_unacked(context, waited, next_cmd_id);
+    }
+    return 0;
+}
+
+void execute_navigation() {
+    SharedAppContext* context = &g_app_context;
+    uint64_t started_ns = latency_now_ns();
+    uint64_t sim_started_ns = stm32_sim_running() ? stm32_sim_clock_ns() : 0;
+    timeline_span(g_plan_start_ns, started_ns, "plan");
+    mission_report_route_ready(started_ns);
+    if (atomic_load(&context->route_complete)) {
+        LOG_INFO("[NavThread] State: [NAVIGATING]. Executing %d commands (window %d).\n",
+               atomic_load(&context->route_commands_published), STM32_CMD_WINDOW);
+    } else {
+        LOG_INFO("[NavThread] State: [NAVIGATING]. Executing streamed route (window %d).\n", STM32_CMD_WINDOW);
+    }
+    feed_state("navigating", atomic_load(&context->route_complete) ? atomic_load(&context->route_commands_published) : -1);
+
+    context->snap_position_idx = 0; // Reset snap position index for new navigation
+    prepare_snapshot_retries(context);
+
+    // IDs restart from 1 for every run, so forget ACKs from the previous one
+    // (including those of the last manual commands).
+    drain_stm32_events(context);
+    memset(context->stm32_ack_table, 0, sizeof(context->stm32_ack_table));
+    atomic_store(&context->stm32_last_ack_id, 0);
+    latency_reset(&g_latency_stats);
+    pose_check_reset();
+    sensing_reset();
+    resend_reset();
+    correct_reset();
+    credit_reset();
+    prearm_before_snapshot(0);
+    checkpoint_mission(context);
+
+    uint32_t next_cmd_id = 1;   // ID for the next command sent to the STM32
+    uint32_t oldest_unacked = 1; // Lowest ID still waiting for an ACK
+    bool aborted = false;
+
+    bool on_stm32 = route_runs_on_stm32(context);
+    while (on_stm32) {
+        int rc = execute_route_on_stm32(context, &next_cmd_id);
+        oldest_unacked = next_cmd_id; // The firmware has finished with or dropped everything sent
+        if (rc == 0 && retry_at_route_end(context) > 0) rc = 1;
+        if (rc <= 0) {
+            aborted = rc != 0;
+            break;
+        }
+        // A swapped-in route too long for the firmware runs windowed from here
+        context->snap_position_idx = 0;
+        checkpoint_current_route(context);
+        on_stm32 = route_runs_on_stm32(context);
+    }
+    if (next_cmd_id == 1) {
+        sensing_route_start(context->robot_start_x, context->robot_start_y, context->robot_start_dir);
+    } else if (g_progress.pose_known) {
+        sensing_route_start(g_progress.pose.x, g_progress.pose.y, g_progress.pose.d); // After a retry swap
+    }
+
+    for (int i = 0; !on_stm32; i++) {
+        // Blocks only while a streamed route's next command is still being planned.
+        Command cmd;
+        bool have_command = wait_for_route_command(context, i, &cmd);
+        if (atomic_exchange(&context->stop_requested, false)) {
+            LOG_INFO("[NavThread] Stop requested. Aborting navigation.\n");
+            atomic_store(&context->state, STATE_IDLE);
+            aborted = true;
+            break;
+        }
+        if (!have_command) {
+            if (atomic_load(&context->route_failed)) {
+                LOG_ERROR("[NavThread] Route stream failed after %d commands. Aborting navigation.\n", i);
+                aborted = true;
+            } else if (retry_at_route_end(context) > 0) {
+                context->snap_position_idx = 0;
+                checkpoint_current_route(context);
+                i = -1;
+                continue;
+            }
+            break;
+        }
+
+        if (snapshot_rolls(&cmd) && next_cmd_id > 1) {
+            // Taken as the creep before it ends; the window runs on past it
+            if (g_rolling.trigger_id != 0 &&
+                wait_for_stm32_acks(context, g_rolling.trigger_id, g_rolling.trigger_id) != 0) {
+                aborted = true;
+                break;
+            }
+            rolling_arm(context, cmd.value, next_cmd_id - 1);
+        } else if (cmd.type == CMD_SNAPSHOT) {
+            // Answered on the way in: the robot drives straight on
+            if (wait_for_approach(context, cmd.value, oldest_unacked, next_cmd_id)) {
+                snapshot_answered_on_approach(context, cmd.value, false);
+                continue;
+            }
+            // Snapshot is a barrier: the robot must be stationary at the snap position.
+            if (oldest_unacked < next_cmd_id) {
+                if (wait_for_stm32_acks(context, oldest_unacked, next_cmd_id - 1) != 0) {
+                    aborted = true;
+                    break;
+                }
+                oldest_unacked = next_cmd_id;
+            }
+            if (next_cmd_id > 1) wait_for_stm32_settled(context, next_cmd_id - 1);
+
+            int ids[SNAPSHOT_GROUP_MAX];
+            int count = route_snapshot_group(context, i, ids);
+            if (run_snapshot(context, ids, count) != 0) {
+                aborted = true;
+                break; // Exit the command execution loop
+            }
+            i += count - 1; // The rest of the group was answered by the same frame
+            if (swap_route_at_snapshot(context) > 0) {
+                context->snap_position_idx = 0;
+                checkpoint_current_route(context);
+                i = -1; // The new route starts with the next command
+            }
+
+
+        } else {
+            if (sensing_blocked_ahead(context, i)) {
+                // Stop where the route has the robot now and go around
+                if (oldest_unacked < next_cmd_id) {
+                    if (wait_for_stm32_acks(context, oldest_unacked, next_cmd_id - 1) != 0) {
+                        aborted = true;
+                        break;
+                    }
+                    oldest_unacked = next_cmd_id;
+                }
+                if (next_cmd_id > 1) wait_for_stm32_settled(context, next_cmd_id - 1);
+                if (swap_route_for_sensed(context) > 0) {
+                    context->snap_position_idx = 0;
+                    checkpoint_current_route(context);
+                    i = -1; // The new route starts from here
+                    continue;
+                }
+            }
+            // Window full: wait for room before queueing another.
+            uint64_t freed_ns; // When the report that opened the window arrived
+            if (wait_for_stm32_room(context, &oldest_unacked, next_cmd_id, &freed_ns) != 0) {
+                aborted = true;
+                break;
+            }
+
+            // Send command to STM32 with a sequential ID, resized for the error so far
+            uint32_t sent_cmd_id = next_cmd_id;
+            Command sent = cmd;
+            correct_command(sent_cmd_id, &sent);
+            uint64_t sent_ns = latency_now_ns();
+            latency_cmd_sent(&g_latency_stats, sent_cmd_id, sent.type, stm32_command_timed_value(sent), sent_ns);
+            timeline_instant(sent_ns, "send #%u", sent_cmd_id);
+            serial_tx_hold(context->stm32_fd);
+            if (send_command_to_stm32(context->stm32_fd, sent, sent_cmd_id) == 0) {
+                LOG_ERROR("[NavThread] Failed to send command %u to STM32.\n", sent_cmd_id);
+                aborted = true;
+                break;
+            }
+            if (freed_ns) metric_observe_since(METRIC_HIST_ACK_TO_NEXT_CMD_US, freed_ns);
+            pose_check_sent(sent_cmd_id, &cmd); // The route's heading, not the corrected one
+            sensing_sent(sent_cmd_id, &cmd, sent_ns);
+            checkpoint_sent(sent_cmd_id, i);
+            resend_sent(sent_cmd_id, &sent);
+            g_credit.sent = sent_cmd_id;
+            int next_snapshot = route_snapshot_queued(context, i + 1);
+            if (next_snapshot) {
+                prearm_before_snapshot(sent_cmd_id);
+                // No scan for a rolling one: its frame costs the robot nothing
+                if (!route_snapshot_rolls(context, i + 1)) approach_begin(next_snapshot, g_nav_epoch);
+            }
+            g_progress.pose_known = false;
+            next_cmd_id++;
+            metric_gauge_set(METRIC_GAUGE_STM32_IN_FLIGHT, next_cmd_id - oldest_unacked);
+            feed_command_sent(sent_cmd_id, &sent, next_cmd_id - oldest_unacked);
+            LOG_INFO("[NavThread] Sent command %u to STM32 (%u in flight).\n", sent_cmd_id, next_cmd_id - oldest_unacked);
+            // The window's free places go out together when their commands are ready
+            if (stm32_window_full(oldest_unacked, next_cmd_id) || !route_command_queued(context, i + 1)) {
+                if (serial_tx_release(context->stm32_fd) != 0) {
+                    LOG_ERROR("[NavThread] Failed to write commands up to %u to STM32.\n", sent_cmd_id);
+                    aborted = true;
+                    break;
+                }
+            }
+        }
+    } // End of command loop
+    serial_tx_release(context->stm32_fd); // Whatever an abort left queued
+    approach_cancel();
+
+    // Drain whatever is still queued on the STM32 before reporting completion.
+    if (!aborted && oldest_unacked < next_cmd_id) {
+        if (wait_for_stm32_acks(context, oldest_unacked, next_cmd_id - 1) != 0) {
+            aborted = true;
+        }
+    }
+    rolling_disarm(); // Fired by now unless the run was abandoned
+
+    if (aborted) {
+        // If there was an error or stop was requested while waiting, propagate the stop state.
+        // Commands already queued on the STM32 cannot be recalled from here.
+        if (oldest_unacked < next_cmd_id) {
+            LOG_ERROR("[NavThread] Navigation aborted with %u command(s) still in flight.\n", next_cmd_id - oldest_unacked);
+        }
+        atomic_store(&context->stop_requested, true); // Ensure stop state is propagated
+        atomic_store(&context->state, STATE_IDLE);
+        mission_report_abort();
+    }
+    metric_gauge_set(METRIC_GAUGE_STM32_IN_FLIGHT, aborted ? next_cmd_id - oldest_unacked : 0);
+    latency_dump(&g_latency_stats, "Mission STM32 latency");
+    ClockSyncStatus clock;
+    if (clock_sync_status(&clock)) {
+        LOG_INFO("[NavThread] STM32 clock: %d of %d syncs fitted, best round trip %.1f us, drift %.2f ppm.\n",
+                 clock.fitted, clock.samples, clock.rtt_ns / 1e3, clock.drift_ppm);
+    }
+    if (stm32_sim_running()) {
+        // Simulated commands run on a compressed clock; keep them out of the real robot's cost model
+        LOG_INFO("[NavThread] Simulated mission: %.3f s of robot time in %.3f s.\n",
+                 (stm32_sim_clock_ns() - sim_started_ns) / 1e9, (latency_now_ns() - started_ns) / 1e9);
+    } else {
+        latency_write_cost_model(&g_latency_stats, COST_MODEL_PATH);
+    }
+    timeline_span(started_ns, latency_now_ns(), aborted ? "navigate (aborted)" : "navigate");
+    checkpoint_end();
+
+    // Using send_message_to_android_with_ack for navigation completion status
+    send_message_to_android_with_ack(context->android_fd, "\"Navigation complete.\"\n");
+}
+
+// Serializes the current mission into the pathfinding server's request format.
+// time_budget_ms > 0 asks for the server's anytime mode; 0 asks for the exact route.
+// The payload is built in arena; returns NULL if it runs out of memory.
+static const char* build_pathfinding_payload(const SharedAppContext* context, int time_budget_ms, Arena* arena) {
+    JsonWriter w;
+    jw_init_arena(&w, arena, 128 + 48 * (size_t)context->obstacle_count);
+
+    jw_begin_object(&w);
+    jw_key(&w, "obstacles");
+    jw_begin_array(&w);
+    for (int i = 0; i < context->obstacle_count; i++) {
+        // Obstacle x, y are 0-indexed internally, server expects 0-indexed
+        // Direction 'd' is integer, server expects integer
+        jw_begin_object(&w);
+        jw_key(&w, "id"); jw_int(&w, context->obstacles[i].id);
+        jw_key(&w, "x"); jw_int(&w, context->obstacles[i].x);
+        jw_key(&w, "y"); jw_int(&w, context->obstacles[i].y);
+        jw_key(&w, "d"); jw_int(&w, context->obstacles[i].d);
+        jw_end_object(&w);
+    }
+    jw_end_array(&w);
+
+    // Robot initial state and retrying flag
+    jw_key(&w, "robot_x"); jw_int(&w, context->robot_start_x);
+    jw_key(&w, "robot_y"); jw_int(&w, context->robot_start_y);
+    jw_key(&w, "robot_dir"); jw_int(&w, context->robot_start_dir);
+    jw_key(&w, "retrying"); jw_bool(&w, false);
+    if (time_budget_ms > 0) {
+        jw_key(&w, "time_budget_ms"); jw_int(&w, time_budget_ms);
+    }
+    if (USE_HYBRID_PLANNER) {
+        jw_key(&w, "planner"); jw_string(&w, "hybrid");
+    }
+    if (USE_SPEED_CLASSES) {
+        jw_key(&w, "speed_classes"); jw_bool(&w, true);
+    }
+    jw_end_object(&w);
+    return jw_str(&w);
+}
+
+// --- Pathfinding requests ---
+// A buffered route request goes over the pathfinding server's channel when it is
+// up, else as a POST to PATHFINDING_SERVER_URL. The server can revise a route it
+// sent over the channel by pushing a new one (CHANNEL_OP_ROUTE) with the
+// request's ID. The robot keeps driving the route it has; the push replaces the
+// arena's cache entry, as a background confirmation that differs would.
+
+#define ROUTE_PUSH_SLOTS 4 // Recent channel requests a push may still refer to
+static struct {
+    pthread_mutex_t lock;
+    uint32_t ids[ROUTE_PUSH_SLOTS];
+    RouteKey keys[ROUTE_PUSH_SLOTS];
+    int next;
+} g_route_pushes = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// post_data_to_server() for the route of key's arena. cancel (may be NULL)
+// becoming true abandons the request.
+static int request_route(const char* payload, const RouteKey* key, Arena* arena, const char** response,
+                         const atomic_bool* cancel) {
+    const char* url = config_now()->path_url;
+    ServerChannel* channel = atomic_load(&g_path_channel);
+    uint32_t id = channel_usable(channel)
+                  ? server_channel_send(channel, CHANNEL_OP_PATH, payload, strlen(payload), NULL, 0) : 0;
+    if (id == 0) return post_data_to_server(url, payload, arena, response, cancel);
+
+    pthread_mutex_lock(&g_route_pushes.lock);
+    g_route_pushes.ids[g_route_pushes.next] = id;
+    g_route_pushes.keys[g_route_pushes.next] = *key;
+    g_route_pushes.next = (g_route_pushes.next + 1) % ROUTE_PUSH_SLOTS;
+    pthread_mutex_unlock(&g_route_pushes.lock);
+
+    int which;
+    ChannelMessage reply;
+    uint64_t request_ns = latency_now_ns();
+    uint64_t deadline_ns = request_ns + (uint64_t)PATH_CHANNEL_TIMEOUT_MS * 1000000ULL;
+    int rc;
+    do { // A STOP wakes the wait (cancel_mission()); anyone else's request waits on
+        int64_t left_ms = ((int64_t)deadline_ns - (int64_t)latency_now_ns()) / 1000000;
+        rc = server_channel_wait_any(channel, &id, 1, left_ms > 0 ? (int)left_ms : 0, &which, &reply);
+    } while (rc == -3 && !(cancel && atomic_load(cancel)));
+    timeline_span(request_ns, latency_now_ns(), "channel path request %u", id);
+    if (rc == 0) {
+        char* copy = arena_alloc(arena, reply.meta_len + 1);
+        if (copy) memcpy(copy, reply.meta, reply.meta_len + 1);
+        server_channel_message_free(&reply);
+        if (!copy) return -1;
+        *response = copy;
+        return 0;
+    }
+    if (rc == -2 && !server_channel_available(channel)) {
+        LOG_WARN("[Path] Channel dropped during the request; asking over HTTP.\n");
+        return post_data_to_server(url, payload, arena, response, cancel);
+    }
+    if (rc == -2) {
+        LOG_ERROR("[Path] No route over the channel within %d ms.\n", PATH_CHANNEL_TIMEOUT_MS);
+        server_channel_cancel(channel, id);
+    } else if (rc == -3) {
+        LOG_INFO("[Path] Route request %u cancelled.\n", id);
+        server_channel_cancel(channel, id);
+    }
+    return -1;
+}
+
+// g_path_channel's push handler, on its reader thread.
+static void on_route_push(uint32_t id, const ChannelMessage* msg, void* userdata) {
+    (void)userdata;
+    if (msg->op != CHANNEL_OP_ROUTE) return;
+    RouteKey key;
+    bool known = false;
+    pthread_mutex_lock(&g_route_pushes.lock);
+    for (int i = 0; i < ROUTE_PUSH_SLOTS && !known; i++) {
+        if (id != 0 && g_route_pushes.ids[i] == id) {
+            key = g_route_pushes.keys[i];
+            known = true;
+        }
+    }
+    pthread_mutex_unlock(&g_route_pushes.lock);
+    if (!known) {
+        LOG_INFO("[RouteCache] Ignoring a pushed route for unknown request %u.\n", id);
+        return;
+    }
+
+    Arena arena;
+    arena_init(&arena, ARENA_DEFAULT_BLOCK_SIZE);
+    CommandList commands;
+    SnapList snap_positions;
+    if (parse_command_route_from_server(msg->meta, &arena, &commands, &snap_positions) == 0) {
+        route_cache_store(ROUTE_CACHE_DIR, &key, &commands, &snap_positions);
+        LOG_INFO("[RouteCache] Server pushed a revised route for %016llx (%d commands); cache updated for the next run.\n",
+                 (unsigned long long)key.hash, commands.count);
+    } else {
+        LOG_ERROR("[RouteCache] Could not parse the route pushed for request %u.\n", id);
+    }
+    arena_destroy(&arena);
+}
+
+// --- Background route confirmation ---
+// On a cache hit the robot starts on the cached route straight away. The server is
+// still asked for the route on a detached thread; if its answer differs, the cache
+// entry is replaced so the next run of this arena uses the new route.
+
+typedef struct {
+    RouteKey key;
+    Arena arena; // Outlives the mission, so the task keeps its own copies here
+    const char* payload;
+    CommandList commands;
+    SnapList snap_positions;
+} RouteConfirmTask;
+
+static bool routes_equal(const CommandList* a, const SnapList* a_snaps, const CommandList* b, const SnapList* b_snaps) {
+    if (a->count != b->count || a_snaps->count != b_snaps->count) return false;
+    for (int i = 0; i < a->count; i++) {
+        if (a->items[i].type != b->items[i].type || a->items[i].value != b->items[i].value ||
+            a->items[i].speed != b->items[i].speed) return false;
+    }
+    for (int i = 0; i < a_snaps->count; i++) {
+        const SnapPosition* sa = &a_snaps->items[i];
+        const SnapPosition* sb = &b_snaps->items[i];
+        if (sa->x != sb->x || sa->y != sb->y || sa->d != sb->d) return false;
+    }
+    return true;
+}
+
+static void free_route_confirm_task(RouteConfirmTask* task) {
+    arena_destroy(&task->arena);
+    free(task);
+}
+
+static void* route_confirm_thread(void* args) {
+    RouteConfirmTask* task = (RouteConfirmTask*)args;
+    timeline_thread("route confirm");
+    const char* response = NULL;
+    CommandList commands;
+    SnapList snap_positions;
+
+    if (request_route(task->payload, &task->key, &task->arena, &response, NULL) != 0) {
+        LOG_ERROR("[RouteCache] Server unreachable, keeping cached route %016llx.\n", (unsigned long long)task->key.hash);
+    } else if (parse_command_route_from_server(response, &task->arena, &commands, &snap_positions) != 0) {
+        LOG_ERROR("[RouteCache] Could not parse confirmation route, keeping cached route %016llx.\n", (unsigned long long)task->key.hash);
+    } else if (routes_equal(&commands, &snap_positions, &task->commands, &task->snap_positions)) {
+        LOG_INFO("[RouteCache] Server confirmed cached route %016llx.\n", (unsigned long long)task->key.hash);
+    } else {
+        LOG_INFO("[RouteCache] Server route differs from cached route %016llx; cache updated for the next run.\n",
+               (unsigned long long)task->key.hash);
+        route_cache_store(ROUTE_CACHE_DIR, &task->key, &commands, &snap_positions);
+    }
+    free_route_confirm_task(task);
+    return NULL;
+}
+
+static void start_route_confirmation(const SharedAppContext* context, const RouteKey* key, const char* payload) {
+    RouteConfirmTask* task = malloc(sizeof(*task));
+    if (!task) return;
+    task->key = *key;
+    arena_init(&task->arena, ARENA_DEFAULT_BLOCK_SIZE);
+
+    // Exact-size copies of the mission's payload and route
+    task->payload = arena_strdup(&task->arena, payload);
+    task->commands = (CommandList){0};
+    task->snap_positions = (SnapList){0};
+    task->commands.items = arena_array_grow(&task->arena, NULL, 0, &task->commands.capacity,
+                                            context->commands.count, sizeof(Command));
+    task->snap_positions.items = arena_array_grow(&task->arena, NULL, 0, &task->snap_positions.capacity,
+                                                  context->snap_positions.count, sizeof(SnapPosition));
+    if (!task->payload || (context->commands.count > 0 && !task->commands.items) ||
+        (context->snap_positions.count > 0 && !task->snap_positions.items)) {
+        LOG_ERROR("[RouteCache] Out of memory starting route confirmation.\n");
+        free_route_confirm_task(task);
+        return;
+    }
+    if (context->commands.count > 0) {
+        memcpy(task->commands.items, context->commands.items, (size_t)context->commands.count * sizeof(Command));
+    }
+    if (context->snap_positions.count > 0) {
+        memcpy(task->snap_positions.items, context->snap_positions.items,
+               (size_t)context->snap_positions.count * sizeof(SnapPosition));
+    }
+    task->commands.count = context->commands.count;
+    task->snap_positions.count = context->snap_positions.count;
+
+    pthread_t tid;
+    if (rt_thread_create(&tid, RT_ROLE_BACKGROUND, true, route_confirm_thread, task) != 0) {
+        LOG_ERROR("[RouteCache] Could not start confirmation thread.\n");
+        free_route_confirm_task(task);
+    }
+}
+
+// --- Streamed routes ---
+// PATHFINDING_STREAM_URL answers with one NDJSON line per command, sent as each leg
+// of the route is planned. A helper thread appends them to context->commands and
+// publishes them, so execute_navigation() drives the first leg while the server is
+// still planning the rest.
+
+typedef struct {
+    SharedAppContext* context;
+    const char* payload;
+    bool received_done; // Read by the nav thread after joining
+} RouteStreamTask;
+
+static int on_route_stream_line(const char* line, void* userdata) {
+    RouteStreamTask* task = (RouteStreamTask*)userdata;
+    SharedAppContext* context = task->context;
+    Command cmd;
+    SnapPosition snap;
+    bool has_snap, done;
+
+    if (atomic_load(&context->route_stream_cancel)) return -1;
+    if (parse_route_ndjson_line(line, &cmd, &snap, &has_snap, &done) != 0) return -1;
+    if (done) {
+        task->received_done = true;
+        atomic_store_explicit(&context->route_complete, true, memory_order_release);
+        wake_nav(context);
+        return 0;
+    }
+
+    // The snap position goes out with its SP command so the nav thread never sees one without the other.
+    if ((has_snap && snap_list_push(&context->mission_arena, &context->snap_positions, snap) != 0) ||
+        command_list_push(&context->mission_arena, &context->commands, cmd) != 0) {
+        LOG_ERROR("[NavThread] Out of memory storing the streamed route.\n");
+        return -1;
+    }
+    publish_route_progress(context);
+    wake_nav(context);
+    return 0;
+}
+
+static void* route_stream_thread(void* args) {
+    RouteStreamTask* task = (RouteStreamTask*)args;
+    SharedAppContext* context = task->context;
+    timeline_thread("route stream");
+
+    post_data_to_server_ndjson(config_now()->stream_url, task->payload, on_route_stream_line, task,
+                               &context->route_stream_cancel);
+    // Anything short of the server's "done" line leaves the route incomplete.
+    if (!atomic_load(&context->route_complete)) {
+        if (!atomic_load(&context->route_stream_cancel)) atomic_store(&context->route_failed, true);
+        atomic_store_explicit(&context->route_complete, true, memory_order_release);
+    }
+    wake_nav(context);
+    return NULL;
+}
+
+// Streams the route for the current mission and executes it as it arrives. Returns 0
+// once the mission has been handled, -1 if the stream produced no commands and the
+// caller should fall back to the buffered request.
+static int run_streamed_route(SharedAppContext* context, const RouteKey* route_key, const char* payload) {
+    context->commands = (CommandList){0};
+    context->snap_positions = (SnapList){0};
+    atomic_store(&context->route_stream_cancel, false);
+    atomic_store(&context->route_failed, false);
+    atomic_store(&context->route_complete, false);
+    publish_route_progress(context);
+
+    RouteStreamTask task = { .context = context, .payload = payload, .received_done = false };
+    pthread_t tid;
+    if (rt_thread_create(&tid, RT_ROLE_BACKGROUND, false, route_stream_thread, &task) != 0) {
+        LOG_ERROR("[NavThread] Could not start route stream thread.\n");
+        return -1;
+    }
+
+    // Hold "Navigating" back until there is something to drive.
+    while (atomic_load_explicit(&context->route_commands_published, memory_order_acquire) == 0 &&
+           !atomic_load(&context->route_complete) && !atomic_load(&context->stop_requested)) {
+        nav_wait(context);
+    }
+
+    int result = 0;
+    bool started = atomic_load(&context->route_commands_published) > 0;
+    if (started) {
+        LOG_INFO("[NavThread] First route command received; navigating while the server finishes planning.\n");
+        send_message_to_android_with_ack(context->android_fd, "\"Route calculated. Navigating.\"\n"); // Using ack send
+        execute_navigation();
+    } else if (!atomic_load(&context->stop_requested)) {
+        result = -1;
+    }
+
+    // Only still running if navigation stopped early
+    atomic_store(&context->route_stream_cancel, true);
+    http_wake_transfers();
+    pthread_join(tid, NULL);
+
+    if (task.received_done && !g_progress.swapped) {
+        route_cache_store(ROUTE_CACHE_DIR, route_key, &context->commands, &context->snap_positions);
+    } else if (started && atomic_load(&context->route_failed)) {
+        send_message_to_android_with_ack(context->android_fd, "\"Error: Route stream ended early.\"\n"); // Using ack send
+    }
+    return result;
+}
+
+// --- Route planning ---
+
+// The cached route for key, else the native planner's (cached, and confirmed by
+// the server in the background). Returns 0 with context->commands and
+// snap_positions filled, or -1 if the server has to be asked.
+static int plan_route_locally(SharedAppContext* context, const RouteKey* key, const char* exact_payload) {
+    if (route_cache_load(ROUTE_CACHE_DIR, key, &context->mission_arena, &context->commands,
+                         &context->snap_positions) == 0) {
+        LOG_INFO("[NavThread] Route cache hit (%016llx, %d commands). Skipping server round trip.\n",
+               (unsigned long long)key->hash, context->commands.count);
+        start_route_confirmation(context, key, exact_payload);
+        return 0;
+    }
+    // Checked routes come from the forward-turn planner, which passes the check
+    int (*plan)(const Obstacle[], int, int, int, int, Arena*, CommandList*, SnapList*) =
+        USE_ROUTE_VALIDATION ? planner_plan_forward_route : planner_plan_route;
+    if (USE_NATIVE_PLANNER &&
+        plan(context->obstacles, context->obstacle_count,
+             context->robot_start_x, context->robot_start_y, context->robot_start_dir,
+             &context->mission_arena, &context->commands, &context->snap_positions) == 0) {
+        LOG_INFO("[NavThread] Native planner produced %d commands. Server will confirm in the background.\n",
+               context->commands.count);
+        route_cache_store(ROUTE_CACHE_DIR, key, &context->commands, &context->snap_positions);
+        start_route_confirmation(context, key, exact_payload);
+        return 0;
+    }
+    return -1;
+}
+
+// Plans the mission in context as a complete route, from whichever source
+// answers first without streaming. Returns 0 with context->commands and
+// snap_positions filled, or -1.
+static int plan_complete_route(SharedAppContext* context) {
+    const char* payload = build_pathfinding_payload(context, PATHFINDING_TIME_BUDGET_MS, &context->mission_arena);
+    const char* exact_payload = build_pathfinding_payload(context, 0, &context->mission_arena);
+    if (!payload || !exact_payload) return -1;
+    RouteKey key;
+    route_cache_make_key(context, &key);
+    if (plan_route_locally(context, &key, exact_payload) == 0) return 0;
+
+    const char* response = NULL;
+    if (request_route(payload, &key, &context->mission_arena, &response, &context->stop_requested) != 0 ||
+        parse_command_route_from_server(response, &context->mission_arena, &context->commands,
+                                        &context->snap_positions) != 0) {
+        return -1;
+    }
+    route_cache_store(ROUTE_CACHE_DIR, &key, &context->commands, &context->snap_positions);
+    return 0;
+}
+
+// What a map update does to the obstacles the mission has still to photograph
+typedef struct {
+    int added;
+    int removed;
+    int changed; // Moved or turned
+} MapDelta;
+
+static MapDelta map_delta(const SharedAppContext* context, const ArenaMap* map) {
+    MapDelta delta = {0};
+    int kept = 0;
+    for (int i = 0; i < map->obstacle_count; i++) {
+        const Obstacle* obs = &map->obstacles[i];
+        if (progress_visited(obs->id)) continue;
+        Obstacle old;
+        if (!find_obstacle(context, obs->id, &old)) {
+            delta.added++;
+            continue;
+        }
+        kept++;
+        if (old.x != obs->x || old.y != obs->y || old.d != obs->d) delta.changed++;
+    }
+    for (int i = 0; i < context->obstacle_count; i++) delta.removed += !progress_visited(context->obstacles[i].id);
+    delta.removed -= kept;
+    return delta;
+}
+
+// Plans the rest of the mission on the retry table, each obstacle from its image
+// face. Returns 0 with context->commands and snap_positions filled, or -1.
+static int plan_on_retry_table(SharedAppContext* context) {
+    if (!g_retry_ready) return -1;
+    PlannerVisit visits[PLANNER_MAX_TARGETS];
+    int faces[PLANNER_MAX_TARGETS];
+    int count = context->obstacle_count;
+    if (count > PLANNER_MAX_TARGETS) return -1;
+    for (int i = 0; i < count; i++) {
+        visits[i] = (PlannerVisit){ context->obstacles[i].id, 1u << (context->obstacles[i].d / 2) };
+    }
+    if (planner_plan_visits(visits, count, context->robot_start_x, context->robot_start_y, context->robot_start_dir,
+                            &context->mission_arena, &context->commands, &context->snap_positions, faces) != 0) {
+        return -1;
+    }
+    int skipped = 0;
+    for (int i = 0; i < count; i++) skipped += faces[i] < 0;
+    if (skipped > 0) LOG_INFO("[NavThread] Skipping %d obstacle(s) with no reachable viewing position.\n", skipped);
+    return 0;
+}
+
+static int swap_route_for_update(SharedAppContext* context) {
+    // A route still streaming in cannot be swapped, and only a snapshot pins the pose down
+    if (!atomic_load(&context->route_complete) || !g_progress.pose_known) return 0;
+    ArenaMap map;
+    if (!take_map_update(context, &map)) return 0;
+
+    MapDelta delta = map_delta(context, &map);
+    if (delta.added == 0 && delta.removed == 0 && delta.changed == 0) {
+        LOG_INFO("[NavThread] Map update changes no obstacle left to photograph; keeping the current route.\n");
+        return 0;
+    }
+    uint64_t started_ns = latency_now_ns();
+    apply_map_update(context, &map, &g_progress.pose);
+    g_progress.swapped = true;
+    LOG_INFO("[NavThread] Map update (%d added, %d removed, %d changed): replanning for %d obstacle(s) left, "
+             "from (%d, %d) facing %d.\n", delta.added, delta.removed, delta.changed, context->obstacle_count,
+             context->robot_start_x, context->robot_start_y, context->robot_start_dir);
+    update_snapshot_retries(context);
+    // Fresh lists, so that the route being driven stays intact if this fails
+    context->commands = (CommandList){0};
+    context->snap_positions = (SnapList){0};
+    int rc = 0;
+    if (context->obstacle_count > 0 && plan_on_retry_table(context) != 0) {
+        context->commands = (CommandList){0};
+        context->snap_positions = (SnapList){0};
+        rc = plan_complete_route(context);
+    }
+    if (rc == 0 && validate_route(context, context->robot_start_x, context->robot_start_y, context->robot_start_dir,
+                                  &context->commands, &context->snap_positions, true) != 0) {
+        rc = -1;
+    }
+    timeline_span(started_ns, latency_now_ns(), "replan");
+    if (rc != 0) {
+        LOG_ERROR("[NavThread] Replanning failed; keeping the current route.\n");
+        send_message_to_android_with_ack(context->android_fd, "\"Error: Replanning failed. Keeping the current route.\"\n"); // Using ack send
+        return -1;
+    }
+    publish_complete_route(context, true);
+    metric_inc(METRIC_ROUTE_SWAPS);
+    LOG_INFO("[NavThread] Swapped in a %d-command route after %.1f ms.\n", context->commands.count,
+             (latency_now_ns() - started_ns) / 1e6);
+    send_message_to_android_with_ack(context->android_fd, "\"Route updated. Navigating.\"\n"); // Using ack send
+    feed_state("navigating", context->commands.count);
+    return 1;
+}
+
+// Makes the rest of g_resume's route the mission: from its first command not
+// finished, less the snapshots Android has the image of. Snapshots passed
+// without one are booked as failed, so the retries go back for them. Returns
+// the commands left.
+static int resume_load(SharedAppContext* context) {
+    const CheckpointMission* m = &g_resume;
+    int from = m->done;
+    // Parked at a snapshot whose image never arrived: take it again from here
+    if (from > 0 && m->commands.items[from - 1].type == CMD_SNAPSHOT &&
+        !checkpoint_was_reported(m, m->commands.items[from - 1].value)) {
+        from--;
+    }
+
+    pthread_mutex_lock(&context->lock);
+    memcpy(context->obstacles, m->obstacles, sizeof(m->obstacles));
+    context->obstacle_count = m->obstacle_count;
+    context->robot_start_x = m->start_x;
+    context->robot_start_y = m->start_y;
+    context->robot_start_dir = m->start_dir;
+    context->commands = (CommandList){0};
+    context->snap_positions = (SnapList){0};
+    context->snapshot_outcome_count = 0;
+    g_nav_epoch = atomic_load(&context->mission_epoch);
+    progress_reset();
+    SnapPosition unknown = { .x = -1, .y = -1, .d = -1 };
+    for (int i = 0; i < m->reported_count; i++) {
+        context->snapshot_outcomes[context->snapshot_outcome_count++] =
+            (SnapshotOutcome){ m->reported_ids[i], SNAPSHOT_DETECTED, -1, 0, 0 };
+        progress_snapped(m->reported_ids[i], &unknown);
+    }
+
+    int snap = 0;
+    for (int k = 0; k < m->commands.count; k++) {
+        Command cmd = m->commands.items[k];
+        if (cmd.type != CMD_SNAPSHOT) {
+            if (k >= from) command_list_push(&context->mission_arena, &context->commands, cmd);
+            continue;
+        }
+        SnapPosition at = snap < m->snap_positions.count ? m->snap_positions.items[snap] : unknown;
+        snap++;
+        if (checkpoint_was_reported(m, cmd.value)) {
+            if (k == from - 1) progress_snapped(cmd.value, &at); // Still standing there
+            continue;
+        }
+        if (k < from) {
+            if (context->snapshot_outcome_count < MAX_OBSTACLES) {
+                context->snapshot_outcomes[context->snapshot_outcome_count++] =
+                    (SnapshotOutcome){ cmd.value, SNAPSHOT_FAILED, -1, 0, 0 };
+            }
+            continue;
+        }
+        command_list_push(&context->mission_arena, &context->commands, cmd);
+        snap_list_push(&context->mission_arena, &context->snap_positions, at);
+    }
+    pthread_mutex_unlock(&context->lock);
+    LOG_INFO("[NavThread] Checkpointed mission: %d of %d route command(s) done, %d image(s) reported, %d command(s) left.\n",
+             from, m->commands.count, m->reported_count, context->commands.count);
+    return context->commands.count;
+}
+
+// Opens the report of the mission g_nav_epoch names, timed from arena_ns;
+// the last one goes out now if it was still waiting for answers.
+static void begin_mission_report(SharedAppContext* context, uint64_t arena_ns) {
+    MissionReport unfinished;
+    if (mission_report_begin(g_nav_epoch, arena_ns, &unfinished)) send_mission_report(context, &unfinished);
+    if (USE_PERFORMANCE_GOVERNOR) soc_governor_pin();
+    soc_monitor_sample(NULL); // The SoC as the mission starts, however short it is
+}
+
+static void end_mission_report(SharedAppContext* context) {
+    soc_monitor_sample(NULL);
+    if (USE_PERFORMANCE_GOVERNOR) soc_governor_restore();
+    if (mission_report_end(latency_now_ns(), g_latency_stats.first_sent_ns, g_latency_stats.busy_ns,
+                           g_latency_stats.settle_ns)) {
+        emit_mission_report(context);
+    }
+}
+
+// Drives the rest of the mission the checkpoint log held, if there is one.
+static void resume_mission(SharedAppContext* context) {
+    if (!g_resume_pending) return;
+    g_resume_pending = false;
+    atomic_store(&context->state, STATE_PATHFINDING);
+    g_plan_start_ns = latency_now_ns();
+    if (resume_load(context) == 0) {
+        checkpoint_end();
+    } else {
+        begin_mission_report(context, g_plan_start_ns); // Timed from the restart
+        sensing_begin(context);
+        send_message_to_android_with_ack(context->android_fd, "\"Mission resumed.\"\n"); // Using ack send
+        publish_complete_route(context, true);
+        execute_navigation();
+        end_mission_report(context);
+    }
+    atomic_store(&context->state, STATE_IDLE);
+    feed_state("idle", -1);
+}
+
+// --- Manual commands ---
+// Direct "stm" commands from Android never wait on the reactor: it queues them
+// (context->manual_queue) and the nav thread, while no mission runs, sends them
+// on the windowed path of a mission's commands, up to STM32_CMD_WINDOW in
+// flight, taking more as they arrive so a stream of them keeps the firmware's
+// queue full. Each result goes to Android as
+// {"type":"stm","value":{"seq":n,"cmd":"...","status":"..."}}, status one of
+// done, error, timeout, stopped (a STOP caught it in flight) or cancelled (it
+// never ran: a mission started, or one ahead of it timed out).
+
+static ManualCommand g_manual_sent[STM32_CMD_WINDOW]; // In flight, by cmd_id % STM32_CMD_WINDOW; nav thread only
+
+static void report_manual_command(SharedAppContext* context, const ManualCommand* m, const char* status) {
+    LOG_INFO("[NavThread] Manual command #%u (%s): %s.\n", m->seq, m->text, status);
+    char buffer[128];
+    JsonWriter w;
+    jw_init(&w, buffer, sizeof(buffer));
+    jw_begin_object(&w);
+    jw_key(&w, "type");
+    jw_string(&w, "stm");
+    jw_key(&w, "value");
+    jw_begin_object(&w);
+    jw_key(&w, "seq");
+    jw_uint(&w, m->seq);
+    jw_key(&w, "cmd");
+    jw_string(&w, m->text);
+    jw_key(&w, "status");
+    jw_string(&w, status);
+    jw_end_object(&w);
+    jw_end_object(&w);
+    jw_raw(&w, "\n", 1);
+    if (jw_str(&w)) android_tx_send(context->android_fd, buffer, jw_len(&w));
+}
+
+// Moves every queued manual command to out, oldest first. Caller holds `lock`.
+static int manual_queue_take_all(SharedAppContext* context, ManualCommand out[MANUAL_QUEUE_SIZE]) {
+    int n = context->manual_count;
+    for (int i = 0; i < n; i++) out[i] = context->manual_queue[(context->manual_head + i) % MANUAL_QUEUE_SIZE];
+    context->manual_head = 0;
+    context->manual_count = 0;
+    return n;
+}
+
+static void report_manual_commands(SharedAppContext* context, const ManualCommand* list, int n, const char* status) {
+    for (int i = 0; i < n; i++) report_manual_command(context, &list[i], status);
+}
+
+// Takes the oldest queued manual command. Returns false if there is none, or
+// a mission is waiting to start.
+static bool manual_queue_pop(SharedAppContext* context, ManualCommand* out) {
+    pthread_mutex_lock(&context->lock);
+    bool have = context->manual_count > 0 && !context->new_map_received;
+    if (have) {
+        *out = context->manual_queue[context->manual_head];
+        context->manual_head = (context->manual_head + 1) % MANUAL_QUEUE_SIZE;
+        context->manual_count--;
+    }
+    pthread_mutex_unlock(&context->lock);
+    return have;
+}
+
+// Runs queued manual commands until the queue and the window are empty, a stop
+// is requested or a command times out. IDs restart from 1, as for a mission.
+static void run_manual_commands(SharedAppContext* context) {
+    atomic_store(&context->state, STATE_MANUAL);
+    feed_state("manual", -1);
+    drain_stm32_events(context);
+    memset(context->stm32_ack_table, 0, sizeof(context->stm32_ack_table));
+    atomic_store(&context->stm32_last_ack_id, 0);
+    resend_reset();
+
+    uint32_t next_id = 1; // ID for the next command sent
+    uint32_t oldest = 1;  // Lowest ID not reported yet
+    uint32_t armed_id = 0; // Command the deadline is set for
+    int timeout_ms = 0;
+    const char* failure = NULL; // What became of the rest when the run is cut short
+    while (!failure) {
+        if (atomic_load(&context->stop_requested)) {
+            failure = "stopped";
+            break;
+        }
+        drain_stm32_events(context);
+        if (g_resend.pending) {
+            // Commands cut short by a firmware reset go again under their IDs
+            if (oldest == next_id) g_resend.pending = false;
+            else if (resend_after_stm32_reset(context) != 0) failure = "error";
+            armed_id = 0;
+            continue;
+        }
+        if (oldest < next_id) {
+            int8_t status = stm32_ack_status(context, oldest);
+            if (status == STM32_ACK_DONE || status == STM32_ACK_ERROR) {
+                report_manual_command(context, &g_manual_sent[oldest % STM32_CMD_WINDOW],
+                                      status == STM32_ACK_DONE ? "done" : "error");
+                oldest++;
+                continue;
+            }
+        }
+        ManualCommand m;
+        if (next_id - oldest < STM32_CMD_WINDOW && manual_queue_pop(context, &m)) {
+            latency_cmd_sent(&g_latency_stats, next_id, m.cmd.type, stm32_command_timed_value(m.cmd), latency_now_ns());
+            if (send_command_to_stm32(context->stm32_fd, m.cmd, next_id) == 0) {
+                LOG_ERROR("[NavThread] Failed to send manual command #%u to STM32.\n", m.seq);
+                report_manual_command(context, &m, "error");
+                continue;
+            }
+            resend_sent(next_id, &m.cmd);
+            g_manual_sent[next_id % STM32_CMD_WINDOW] = m;
+            next_id++;
+            LOG_INFO("[NavThread] Sent manual command #%u as %u (%u in flight).\n", m.seq, next_id - 1, next_id - oldest);
+            continue;
+        }
+        if (oldest == next_id) break; // Nothing in flight, nothing queued
+        if (armed_id != oldest) {
+            timeout_ms = latency_cmd_timeout_ms(&g_latency_stats, oldest, latency_now_ns());
+            if (timeout_ms < 0) timeout_ms = STM32_ACK_TIMEOUT_SEC * 1000;
+            arm_nav_deadline_ms(context, timeout_ms);
+            armed_id = oldest;
+            continue; // Re-check: the DONE may have landed while arming
+        }
+        if (atomic_load(&context->deadline_expired)) {
+            LOG_ERROR("[NavThread] Timeout waiting for ACK for manual command %u (after %d ms).\n", oldest, timeout_ms);
+            metric_inc(METRIC_STM32_ACK_TIMEOUTS);
+            failure = "timeout";
+            break;
+        }
+        nav_wait(context); // Woken by a reply, a newly queued command or a stop
+    }
+    arm_nav_deadline(context, 0);
+    for (; oldest < next_id; oldest++) report_manual_command(context, &g_manual_sent[oldest % STM32_CMD_WINDOW], failure);
+    if (failure && strcmp(failure, "timeout") == 0) {
+        // The firmware is not keeping up; don't pile more on it
+        ManualCommand dropped[MANUAL_QUEUE_SIZE];
+        pthread_mutex_lock(&context->lock);
+        int n = manual_queue_take_all(context, dropped);
+        pthread_mutex_unlock(&context->lock);
+        report_manual_commands(context, dropped, n, "cancelled");
+    }
+}
+
+void* navigation_executor_thread(void* args) {
+    SharedAppContext* context = (SharedAppContext*)args;
+    timeline_thread("nav");
+    resume_mission(context);
+
+    while (1) {
+        pthread_mutex_lock(&context->lock);
+        while (!context->new_map_received && !atomic_load(&context->stop_requested) && context->manual_count == 0) {
+            LOG_INFO("[NavThread] State: [IDLE]. Waiting for new mission...\n");
+            pthread_cond_wait(&context->new_task_cond, &context->lock);
+        }
+
+        if (atomic_exchange(&context->stop_requested, false)) {
+            atomic_store(&context->state, STATE_IDLE);
+        }
+
+        uint64_t arena_ns = g_arena_received_ns;
+        ManualCommand cancelled[MANUAL_QUEUE_SIZE];
+        int cancelled_count = 0;
+        bool manual = false;
+        if (context->new_map_received) {
+            atomic_store(&context->state, STATE_PATHFINDING);
+            context->new_map_received = false;
+            g_nav_epoch = atomic_load(&context->mission_epoch);
+            progress_reset();
+            context->snapshot_outcome_count = 0;
+            cancelled_count = manual_queue_take_all(context, cancelled); // Not to run after the mission
+            feed_state("pathfinding", -1);
+        } else {
+            manual = context->manual_count > 0;
+        }
+        pthread_mutex_unlock(&context->lock);
+        report_manual_commands(context, cancelled, cancelled_count, "cancelled");
+        if (manual) run_manual_commands(context);
+
+        if (atomic_load(&context->state) == STATE_PATHFINDING) {
+            g_plan_start_ns = latency_now_ns();
+            begin_mission_report(context, arena_ns);
+            sensing_begin(context);
+            // Everything the previous mission allocated goes in one step.
+            arena_reset(&context->mission_arena);
+            context->commands = (CommandList){0};
+            context->snap_positions = (SnapList){0};
+
+            // The robot waits on the budgeted request; the background confirmation
+            // can afford the exact route, which is what the cache should keep.
+            const char* payload = build_pathfinding_payload(context, PATHFINDING_TIME_BUDGET_MS, &context->mission_arena);
+            const char* exact_payload = build_pathfinding_payload(context, 0, &context->mission_arena);
+            RouteKey route_key;
+            route_cache_make_key(context, &route_key);
+
+            if (!payload || !exact_payload) {
+                LOG_ERROR("[NavThread] Out of memory building the pathfinding request.\n");
+                send_message_to_android_with_ack(context->android_fd, "\"Error: Pathfinding request too large.\"\n"); // Using ack send
+            } else if (plan_route_locally(context, &route_key, exact_payload) == 0 &&
+                       validate_route(context, context->robot_start_x, context->robot_start_y,
+                                      context->robot_start_dir, &context->commands, &context->snap_positions,
+                                      true) == 0) {
+                send_message_to_android_with_ack(context->android_fd, "\"Route calculated. Navigating.\"\n"); // Using ack send
+                publish_complete_route(context, true);
+                execute_navigation();
+            } else if (USE_ROUTE_STREAMING && run_streamed_route(context, &route_key, payload) == 0) {
+                // Mission handled while the route streamed in
+            } else {
+                LOG_INFO("[NavThread] State: [PATHFINDING]. Requesting route from server...\n");
+                LOG_DEBUG("[NavThread] Pathfinding payload: %s\n", payload);
+
+                const char* response = NULL;
+                if (request_route(payload, &route_key, &context->mission_arena, &response,
+                                  &context->stop_requested) == 0) {
+                    // --- DEBUG: Print raw server response ---
+                    LOG_DEBUG("[NavThread] Raw server response:\n---\n%s\n---\n", response);
+
+                    // Call the modified parse_command_route_from_server
+                    if (parse_command_route_from_server(response, &context->mission_arena,
+                                                        &context->commands, &context->snap_positions) == 0) {
+                        route_cache_store(ROUTE_CACHE_DIR, &route_key, &context->commands, &context->snap_positions);
+                        if (validate_route(context, context->robot_start_x, context->robot_start_y,
+                                           context->robot_start_dir, &context->commands, &context->snap_positions,
+                                           true) == 0) {
+                            send_message_to_android_with_ack(context->android_fd, "\"Route calculated. Navigating.\"\n"); // Using ack send
+                            publish_complete_route(context, true);
+                            execute_navigation();
+                        } else {
+                            send_message_to_android_with_ack(context->android_fd, "\"Error: Route failed validation.\"\n"); // Using ack send
+                        }
+                    } else {
+                        send_message_to_android_with_ack(context->android_fd, "\"Error: Pathfinding failed to parse route.\"\n"); // Using ack send
+                    }
+                } else if (!atomic_load(&context->stop_requested)) {
+                    send_message_to_android_with_ack(context->android_fd, "\"Error: Pathfinding server communication failed.\"\n"); // Using ack send
+                }
+            }
+            // Image workers may still be answering the last snapshot; they land in the next write
+            timeline_span(arena_ns, latency_now_ns(), "mission");
+            end_mission_report(context);
+            timeline_write();
+        }
+
+        // An update that met no snapshot before the route ended is the next mission
+        pthread_mutex_lock(&context->lock);
+        if (context->map_update_queued) {
+            context->map_update_queued = false;
+            apply_map_update(context, &context->queued_map, g_progress.pose_known ? &g_progress.pose : NULL);
+            if (context->obstacle_count > 0) {
+                LOG_INFO("[NavThread] Running the map update as the next mission (%d obstacle(s) left).\n",
+                         context->obstacle_count);
+                g_arena_received_ns = latency_now_ns();
+                context->new_map_received = true;
+            }
+        }
+        pthread_mutex_unlock(&context->lock);
+        atomic_store(&context->state, STATE_IDLE);
+        feed_state("idle", -1);
+    }
+    return NULL;
+}
+
+
+// =================================================================================
+// THREAD 1: I/O Reactor (Android + STM32 links, deadlines, wakeups)
+// =================================================================================
+// One epoll loop services both serial links, the nav thread's deadline timer and
+// an eventfd used by other threads to wake the loop. Handlers run on this thread
+// and must never block waiting for the other link.
+
+enum {
+    REACTOR_SRC_ANDROID,
+    REACTOR_SRC_STM32,
+    REACTOR_SRC_DEADLINE,
+    REACTOR_SRC_WAKEUP,
+    REACTOR_SRC_METRICS,
+    REACTOR_SRC_CLOCK_SYNC,
+    REACTOR_SRC_SIGNAL,
+    REACTOR_SRC_SOC
+};
+
+#define REACTOR_MAX_EVENTS 8
+
+// Asks the reactor loop to exit.
+static void reactor_request_shutdown(SharedAppContext* context) {
+    uint64_t one = 1;
+    atomic_store(&context->reactor_shutdown, true);
+    if (write(context->reactor_wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("[Reactor] eventfd write failed");
+    }
+}
+
+// Cancels the mission in progress from an Android STOP. Every layer hears of it
+// at once rather than at its next check: the firmware (ESTOP), the nav thread's
+// waits, the route request in flight, the snapshots still queued, and the image
+// workers' uploads and channel waits, which see mission_epoch move on. The nav
+// thread then halts a route on the STM32 and goes idle.
+static void cancel_mission(SharedAppContext* context) {
+    bool busy = atomic_load(&context->state) != STATE_IDLE;
+    // Firmware that can stop out of band does so now, not once the nav thread
+    // gets round to it; the route STOP frame that follows is then a no-op
+    if (stm32_protocol_estop() && busy) send_estop_to_stm32(context->stm32_fd);
+
+    atomic_fetch_add(&context->mission_epoch, 1);
+    atomic_store(&context->stop_requested, true);
+    // Take the lock so the signal cannot slip in before the idle wait starts
+    ManualCommand dropped_manual[MANUAL_QUEUE_SIZE];
+    pthread_mutex_lock(&context->lock);
+    context->map_update_queued = false;
+    int dropped_manual_count = manual_queue_take_all(context, dropped_manual);
+    if (busy) pthread_cond_signal(&context->new_task_cond);
+    pthread_mutex_unlock(&context->lock);
+    report_manual_commands(context, dropped_manual, dropped_manual_count, "stopped");
+    wake_nav_waiters(context, false); // Don't let a pending ACK wait run to its deadline
+    http_wake_transfers();
+    server_channel_wake(atomic_load(&g_path_channel));
+
+    int dropped = drain_image_queue(&context->image_queue);
+    server_channel_wake(atomic_load(&g_image_channel));
+    for (int i = 0; i < IMAGE_WORKER_COUNT; i++) {
+        if (g_image_workers[i].multi) curl_multi_wakeup(g_image_workers[i].multi);
+    }
+    LOG_INFO("[Reactor] Mission cancelled%s; %d queued snapshot(s) dropped.\n", busy ? "" : " (idle)", dropped);
+}
+
+// Queues a direct "stm" command for the nav thread (see "Manual commands").
+// Refused while a mission runs or when the queue is full.
+static void queue_manual_command(SharedAppContext* context, const char* category, const char* text, const Command* cmd) {
+    const char* error = NULL;
+    unsigned seq = 0;
+    pthread_mutex_lock(&context->lock);
+    SystemState state = atomic_load(&context->state);
+    if (context->new_map_received || (state != STATE_IDLE && state != STATE_MANUAL)) {
+        error = "Error: STM command refused, a mission is running.";
+    } else if (context->manual_count >= MANUAL_QUEUE_SIZE) {
+        error = "Error: STM command queue full.";
+    } else {
+        ManualCommand* m = &context->manual_queue[(context->manual_head + context->manual_count++) % MANUAL_QUEUE_SIZE];
+        m->seq = seq = ++context->manual_seq;
+        m->cmd = *cmd;
+        snprintf(m->text, sizeof(m->text), "%s", text);
+        pthread_cond_signal(&context->new_task_cond);
+    }
+    pthread_mutex_unlock(&context->lock);
+    if (error) {
+        LOG_WARN("[AndroidThread] Direct command %s refused.\n", text);
+        send_android_ack(context->android_fd, category, error);
+        return;
+    }
+    wake_nav(context); // A manual run waits on the eventfd, not the condition
+    char status[48];
+    snprintf(status, sizeof(status), "STM command queued as #%u.", seq);
+    send_android_ack(context->android_fd, category, status);
+}
+
+// --- Config reload ---
+// config_reload_request() wakes the reload thread, which reads the config file
+// on top of the running config. An endpoint that moved is connected before it
+// is swapped in: HEADs leave warm connections to the new servers in curl's
+// shared pool (one per burst frame for the image server), and a new channel is
+// given CONFIG_WARM_TIMEOUT_MS to finish its HELLO. The config and channel
+// pointers are then swapped, so a mission carries on without a gap: requests
+// under way finish on what they started with, and the next ones go to the new
+// servers. What was replaced is kept for CONFIG_RETIRE_MS, longer than any
+// request takes, and then closed. Devices are only opened at start.
+
+#define CONFIG_RETIRE_MS 60000
+#define CONFIG_WARM_TIMEOUT_MS 3000
+#define CONFIG_RETIRED_MAX 8 // Reloads per CONFIG_RETIRE_MS
+
+typedef struct {
+    RuntimeConfig* config; // NULL for the boot config, which is never freed
+    ServerChannel* path_channel;
+    ServerChannel* image_channel;
+    uint64_t due_ns;
+} RetiredConfig;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // On CLOCK_MONOTONIC
+    bool requested;
+    bool stop;
+    int reply_fd;           // Android link to tell, or -1
+    RetiredConfig retired[CONFIG_RETIRED_MAX]; // Oldest first
+    int retired_count;
+    pthread_t tid;
+    bool running;
+} g_reload = { .lock = PTHREAD_MUTEX_INITIALIZER, .reply_fd = -1 };
+
+// Asks for the config file to be read again. android_fd (or -1) hears how it went.
+static void config_reload_request(int android_fd) {
+    pthread_mutex_lock(&g_reload.lock);
+    g_reload.requested = true;
+    if (android_fd != -1) g_reload.reply_fd = android_fd;
+    pthread_cond_signal(&g_reload.changed);
+    pthread_mutex_unlock(&g_reload.lock);
+}
+
+static void config_retire(const RetiredConfig* r) {
+    server_channel_close(r->path_channel);
+    server_channel_close(r->image_channel);
+    free(r->config);
+}
+
+// Opens the channel a reload moved to and waits for its HELLO. NULL if it has no port.
+static ServerChannel* config_open_channel(const char* name, const char* url, int port, ChannelPushHandler on_push) {
+    if (!USE_SERVER_CHANNEL || port <= 0) return NULL;
+    ServerChannel* ch = server_channel_open(name, url, port, on_push, NULL);
+    uint64_t deadline_ns = latency_now_ns() + CONFIG_WARM_TIMEOUT_MS * 1000000ull;
+    while (ch && !server_channel_available(ch) && latency_now_ns() < deadline_ns) usleep(20000);
+    if (ch && !server_channel_available(ch)) {
+        LOG_WARN("[Config] %s channel on port %d not up yet; HTTP until it is.\n", name, port);
+    }
+    return ch;
+}
+
+// Reads the config file and swaps in what changed. Returns the message for Android.
+static const char* config_reload(void) {
+    const RuntimeConfig* cur = config_now();
+    RuntimeConfig* next = malloc(sizeof(*next));
+    if (!next) return "Error: Out of memory.";
+    *next = *cur;
+    int rc = config_load(g_config_path, next);
+    if (rc != 0 || memcmp(next, cur, sizeof(*next)) == 0) {
+        free(next);
+        if (rc > 0) LOG_WARN("[Config] %s not found; nothing reloaded.\n", g_config_path);
+        if (rc == 0) LOG_INFO("[Config] %s unchanged.\n", g_config_path);
+        return rc < 0 ? "Error: Config file rejected; nothing changed." :
+               rc > 0 ? "Error: No config file." : "Configuration unchanged.";
+    }
+
+    bool path_moved = strcmp(next->path_url, cur->path_url) != 0;
+    bool image_moved = strcmp(next->image_url, cur->image_url) != 0;
+    bool path_channel_moved = path_moved || next->path_channel_port != cur->path_channel_port;
+    bool image_channel_moved = image_moved || next->image_channel_port != cur->image_channel_port;
+    pthread_mutex_lock(&g_reload.lock);
+    bool full = g_reload.retired_count == CONFIG_RETIRED_MAX;
+    pthread_mutex_unlock(&g_reload.lock);
+    if (full) { // Only this thread adds to the list
+        free(next);
+        LOG_WARN("[Config] %d earlier configs still draining; reload refused.\n", CONFIG_RETIRED_MAX);
+        return "Error: Too many reloads; try again in a minute.";
+    }
+
+    if (path_moved) http_prewarm(next->path_url);
+    if (image_moved) {
+        atomic_store(&g_image_batch_max, 0); // Until the new server's HEAD says otherwise
+        http_prewarm_many(next->image_url, IMAGE_BURST_FRAMES, image_server_header_callback);
+    }
+    RetiredConfig retired = { .config = cur == &g_boot_config ? NULL : (RuntimeConfig*)cur };
+    if (path_channel_moved) {
+        ServerChannel* ch = config_open_channel("path", next->path_url, next->path_channel_port, on_route_push);
+        retired.path_channel = atomic_exchange(&g_path_channel, ch);
+    }
+    if (image_channel_moved) {
+        ServerChannel* ch = config_open_channel("image", next->image_url, next->image_channel_port, NULL);
+        retired.image_channel = atomic_exchange(&g_image_channel, ch);
+    }
+    atomic_store(&g_config, next);
+    stm32_set_speeds(&next->speeds);
+
+    retired.due_ns = latency_now_ns() + CONFIG_RETIRE_MS * 1000000ull;
+    pthread_mutex_lock(&g_reload.lock);
+    g_reload.retired[g_reload.retired_count++] = retired;
+    pthread_mutex_unlock(&g_reload.lock);
+
+    if (strcmp(next->android_device, cur->android_device) != 0 || strcmp(next->stm32_device, cur->stm32_device) != 0) {
+        LOG_WARN("[Config] Device changes take effect at the next start.\n");
+    }
+    const Stm32Speeds* v = &next->speeds;
+    LOG_INFO("[Config] Reloaded %s: path %s (channel %d), image %s (channel %d), speeds %d/%d, slow %d/%d, fast %d, creep %d.\n",
+             g_config_path, next->path_url, next->path_channel_port, next->image_url, next->image_channel_port,
+             v->move, v->turn, v->slow_move, v->slow_turn, v->fast_move, v->creep_move);
+    return "Configuration reloaded.";
+}
+
+static void* config_reload_thread(void* arg) {
+    (void)arg;
+    timeline_thread("config");
+    pthread_mutex_lock(&g_reload.lock);
+    while (!g_reload.stop) {
+        if (g_reload.requested) {
+            int reply_fd = g_reload.reply_fd;
+            g_reload.requested = false;
+            g_reload.reply_fd = -1;
+            pthread_mutex_unlock(&g_reload.lock);
+            const char* outcome = config_reload();
+            if (reply_fd != -1) send_android_ack(reply_fd, "config", outcome);
+            pthread_mutex_lock(&g_reload.lock);
+            continue;
+        }
+        if (g_reload.retired_count > 0 && latency_now_ns() >= g_reload.retired[0].due_ns) {
+            RetiredConfig r = g_reload.retired[0];
+            g_reload.retired_count--;
+            memmove(&g_reload.retired[0], &g_reload.retired[1], g_reload.retired_count * sizeof(r));
+            pthread_mutex_unlock(&g_reload.lock);
+            config_retire(&r);
+            pthread_mutex_lock(&g_reload.lock);
+            continue;
+        }
+        if (g_reload.retired_count == 0) {
+            pthread_cond_wait(&g_reload.changed, &g_reload.lock);
+            continue;
+        }
+        struct timespec until = { .tv_sec = (time_t)(g_reload.retired[0].due_ns / 1000000000ull),
+                                  .tv_nsec = (long)(g_reload.retired[0].due_ns % 1000000000ull) };
+        pthread_cond_timedwait(&g_reload.changed, &g_reload.lock, &until);
+    }
+    pthread_mutex_unlock(&g_reload.lock);
+    return NULL;
+}
+
+static int config_reload_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // latency_now_ns()'s clock
+    pthread_cond_init(&g_reload.changed, &attr);
+    pthread_condattr_destroy(&attr);
+    g_reload.running = rt_thread_create(&g_reload.tid, RT_ROLE_BACKGROUND, false, config_reload_thread, NULL) == 0;
+    return g_reload.running ? 0 : -1;
+}
+
+// Stops the reload thread and closes what it still held; nothing is in flight by now.
+static void config_reload_stop(void) {
+    if (g_reload.running) {
+        pthread_mutex_lock(&g_reload.lock);
+        g_reload.stop = true;
+        pthread_cond_signal(&g_reload.changed);
+        pthread_mutex_unlock(&g_reload.lock);
+        pthread_join(g_reload.tid, NULL);
+        g_reload.running = false;
+    }
+    for (int i = 0; i < g_reload.retired_count; i++) config_retire(&g_reload.retired[i]);
+    g_reload.retired_count = 0;
+}
+
+// Enough for a sendArena message with MAX_OBSTACLES obstacles
+#define ANDROID_MSG_MAX_TOKENS (MAX_OBSTACLES * 9 + 32)
+
+static void handle_android_message(SharedAppContext* context, char* buffer) {
+    trace_record(TRACE_CH_ANDROID, TRACE_DIR_IN, 0, buffer, strlen(buffer));
+    metric_inc(METRIC_ANDROID_MSGS_RX);
+    LOG_DEBUG("[AndroidThread] Received: %s\n", buffer);
+
+    // Check for JSON message first; the message is tokenized once for every lookup below
+    JsonToken tokens[ANDROID_MSG_MAX_TOKENS];
+    JsonDoc doc;
+    AndroidMessage msg = { .value = -1 };
+    if (json_parse(&doc, buffer, strlen(buffer), tokens, ANDROID_MSG_MAX_TOKENS) == 0 &&
+        json_decode_android_message(&doc, 0, &msg, NULL) == 0) {
+        const char* category = msg.cat;
+        int value = msg.value;
+        int cat = kw_android_category(category, strlen(category));
+        if (cat == KW_CAT_SEND_ARENA) {
+            if (value >= 0) {
+                if (doc.tokens[value].type == JSON_OBJECT) {
+                    pthread_mutex_lock(&context->lock);
+                    if (atomic_load(&context->state) == STATE_IDLE) {
+                        if (parse_android_map_doc(&doc, value, context) == 0) {
+                            g_arena_received_ns = latency_now_ns();
+                            timeline_instant(g_arena_received_ns, "arena received");
+                            context->new_map_received = true;
+                            send_android_ack(context->android_fd, category, "Map received. Pathfinding...");
+                            pthread_cond_signal(&context->new_task_cond);
+                        } else {
+                            send_android_ack(context->android_fd, category, "Error: Invalid map format.");
+                        }
+                    } else {
+                        // Mid-mission: the nav thread replans from it (see "Mission updates")
+                        ArenaMap map;
+                        if (parse_android_map_into(&doc, value, &map) == 0) {
+                            context->queued_map = map;
+                            context->map_update_queued = true;
+                            send_android_ack(context->android_fd, category, "Map update received. Replanning at the next snapshot...");
+                        } else {
+                            send_android_ack(context->android_fd, category, "Error: Invalid map format.");
+                        }
+                    }
+                    pthread_mutex_unlock(&context->lock);
+                } else {
+                    LOG_ERROR("[AndroidThread] Malformed 'sendArena': 'value' object not found.\n");
+                    send_android_ack(context->android_fd, category, "Error: Malformed 'sendArena' message.");
+                }
+            } else {
+                LOG_ERROR("[AndroidThread] Malformed 'sendArena': 'value' key not found.\n");
+                send_android_ack(context->android_fd, category, "Error: Malformed 'sendArena' message.");
+            }
+        } else if (cat == KW_CAT_STOP) { // STOP command as JSON
+            cancel_mission(context);
+            send_android_ack(context->android_fd, category, "STOP command received.");
+        } else if (cat == KW_CAT_ACK) { // Delivery ack for sequenced messages (android_tx.h)
+            int cum = 0;
+            if (value < 0 || doc.tokens[value].type != JSON_OBJECT ||
+                json_token_int(&doc, json_object_get(&doc, value, "cum"), &cum) != 0 || cum < 0) {
+                LOG_ERROR("[AndroidThread] Malformed 'ack' message.\n");
+                return;
+            }
+            uint32_t sack = 0;
+            int list = json_object_get(&doc, value, "sack");
+            if (list >= 0 && doc.tokens[list].type == JSON_ARRAY) {
+                int item = list + 1;
+                for (int i = 0; i < doc.tokens[list].size; i++, item = json_next(&doc, item)) {
+                    int seq;
+                    if (json_token_int(&doc, item, &seq) == 0 && seq > cum && seq - cum <= 32) sack |= 1u << (seq - cum - 1);
+                }
+            }
+            android_tx_ack((uint32_t)cum, sack);
+        } else if (cat == KW_CAT_CONFIG) { // Read the config file again (see "Config reload")
+            config_reload_request(context->android_fd);
+            send_android_ack(context->android_fd, category, "Reloading configuration...");
+        } else if (cat == KW_CAT_STATS) { // Dump STM32 latency histograms on demand
+            latency_dump(&g_latency_stats, "STM32 latency (on demand)");
+            send_android_ack(context->android_fd, category, "Latency stats written to log.");
+        } else if (cat == KW_CAT_STM) { // Direct STM command from Android
+            char stm_command_str[100]; // Buffer for the command string like "<FR090>"
+            Command cmd;
+            if (json_token_string(&doc, value, stm_command_str, sizeof(stm_command_str)) != 0) {
+                LOG_ERROR("[AndroidThread] Malformed 'stm' command: 'value' key not found.\n");
+                send_android_ack(context->android_fd, category, "Error: Malformed STM command.");
+            } else if (parse_android_stm_command(stm_command_str, &cmd) == 0) {
+                queue_manual_command(context, category, stm_command_str, &cmd);
+            } else {
+                send_android_ack(context->android_fd, category, "Error: Malformed STM command.");
+            }
+        } else {
+            LOG_ERROR("[AndroidThread] Unrecognized JSON category from Android: %s\n", category);
+        }
+    }
+    // All other messages are considered malformed or unrecognized by AndroidThread
+    else {
+        LOG_ERROR("[AndroidThread] Malformed or unrecognized message from Android: %s\n", buffer);
+    }
+}
+
+// Publishes a reply for cmd_id, with the pose it carried (or NULL), to the nav
+// thread. Only completions wake it; an accept is picked up with the next completion.
+static void complete_stm32_command(SharedAppContext* context, uint32_t cmd_id, int8_t status, const Stm32Pose* pose,
+                                   uint64_t rx_ns) {
+    if (stm32_event_push(&context->stm32_events, cmd_id, status, pose, -1, rx_ns) != 0) {
+        LOG_ERROR("[STM32Thread] Event ring full, dropping reply for CMD ID %u.\n", cmd_id);
+    }
+    feed_command_reply(cmd_id, status, pose);
+    if (status == STM32_ACK_ACCEPTED) return;
+    if (status == STM32_ACK_DONE) atomic_store(&context->stm32_last_ack_id, cmd_id);
+    wake_nav(context);
+}
+
+// CSV log of STM32 telemetry frames (--telemetry); NULL when not logging
+static FILE* g_telemetry_log = NULL;
+
+static int telemetry_open(const char* path) {
+    g_telemetry_log = fopen(path, "w");
+    if (!g_telemetry_log) {
+        perror("[STM32Thread] Cannot open telemetry log");
+        return -1;
+    }
+    fprintf(g_telemetry_log, "tick_ms,enc_a,enc_d,rps_a,rps_d,pwm_a,pwm_d,yaw_deg,yaw_rate_dps,ir_mm\n");
+    return 0;
+}
+
+// One telemetry frame, already length- and CRC-checked by find_stm32_frame().
+// At up to 200 Hz these are only counted, logged and fed to the timeline's
+// motion track, never traced or printed.
+static void handle_stm32_telemetry(const uint8_t* frame) {
+    metric_inc(METRIC_STM32_TELEMETRY_RX);
+    if (!USE_OCCUPANCY_MAP && !g_telemetry_log && !timeline_enabled() && !live_feed_active()) return;
+    uint64_t rx_ns = latency_now_ns();
+    Stm32Telemetry t;
+    stm32_decode_telemetry(frame, &t);
+    if (USE_OCCUPANCY_MAP) occupancy_range_sample(rx_ns, t.enc_a, t.enc_d, t.ir_mm);
+    timeline_stm32_telemetry(&t, rx_ns);
+    if (live_feed_active()) feed_telemetry(&t);
+    if (!g_telemetry_log) return;
+    fprintf(g_telemetry_log, "%u,%d,%d,%.3f,%.3f,%d,%d,%.2f,%.2f,%u\n", t.tick_ms, t.enc_a, t.enc_d, t.rps_a,
+            t.rps_d, t.pwm_a, t.pwm_d, t.yaw_deg, t.yaw_rate_dps, t.ir_mm);
+}
+
+static bool g_stm32_hello_done; // HELLO was answered; no probe needed
+static atomic_bool g_stm32_sync; // The firmware answers SYNC (clock_sync.h)
+static atomic_bool g_stm32_progress; // The firmware sends PROGRESS events and they are wanted
+static int g_stm32_link_baud;    // Rate the link runs at, 0 off a real serial port or over native USB
+
+// Applies what a HELLO reply advertised. Also used by the reactor for a reply
+// that arrives after the handshake gave up (the STM32 booted late).
+static void stm32_link_apply(const Stm32LinkCaps* caps) {
+    LOG_INFO("[STM32 link] Firmware %d, link v%d:%s%s%s%s%s%s%s%s%s%s%s%s%s, %s%d baud.\n", caps->firmware_version,
+             caps->link_version, caps->binary ? " binary" : " ASCII only", caps->route ? ", routes" : "",
+             caps->pass ? " with pass steps" : "", caps->pose ? ", pose" : "", caps->reset ? ", reset reports" : "",
+             caps->telemetry ? ", telemetry" : "", caps->estop ? ", emergency stop" : "",
+             caps->achieved ? ", achieved motion" : "", caps->sync ? ", clock sync" : "",
+             caps->progress ? ", progress" : "", caps->where ? ", where" : "",
+             caps->credit ? ", credit" : "", caps->ready ? ", ready reports" : "",
+             caps->usb ? "over native USB, USART up to " : "up to ", caps->max_baud);
+    stm32_protocol_set_estop(caps->estop);
+    atomic_store(&g_stm32_sync, caps->sync);
+    atomic_store(&g_stm32_progress, USE_STM32_PROGRESS_EVENTS && caps->progress);
+    atomic_store(&g_stm32_credit, USE_STM32_CREDITS && caps->credit);
+    if (USE_STM32_BINARY_PROTOCOL && caps->binary) {
+        stm32_protocol_set_binary(true);
+        stm32_protocol_set_route(caps->route);
+        stm32_protocol_set_pass(caps->route && caps->pass);
+    }
+}
+
+// Turns the PROGRESS events on, after HELLO and again after the firmware
+// rebooted (which turns them off). The reactor drops the reply.
+static void stm32_progress_configure(int fd) {
+    if (!atomic_load(&g_stm32_progress)) return;
+    if (send_progress_config_to_stm32(fd, STM32_PROGRESS_EVERY_PCT, STM32_PROGRESS_BRAKE) != 0) {
+        LOG_WARN("[STM32 link] Could not ask for PROGRESS events.\n");
+    }
+}
+
+// Turns the CREDIT reports on, after HELLO and again after the firmware
+// rebooted. Its reply carries the queue's depth (handle_stm32_message()).
+static void stm32_credit_configure(int fd) {
+    if (!atomic_load(&g_stm32_credit)) return;
+    if (send_credit_config_to_stm32(fd, true) != 0) {
+        LOG_WARN("[STM32 link] Could not ask for CREDIT reports.\n");
+    }
+}
+
+// "!id/CREDIT/limit;": goes to the nav thread, which sends up to limit
+static void handle_stm32_credit(SharedAppContext* context, uint32_t cmd_id, uint32_t limit, uint64_t rx_ns) {
+    timeline_stm32_instant(TIMELINE_STM32_REPLIES, rx_ns, "CREDIT #%u, to #%u", cmd_id, limit);
+    if (stm32_event_push(&context->stm32_events, cmd_id, STM32_ACK_CREDIT, NULL, (int)limit, rx_ns) != 0) return;
+    wake_nav(context);
+}
+
+// "!id/PROGRESS/...;": goes to the nav thread, which may pre-arm the camera on it
+static void handle_stm32_progress(SharedAppContext* context, uint32_t cmd_id, int pct, int eta_ms, uint64_t rx_ns) {
+    metric_inc(METRIC_STM32_PROGRESS_RX);
+    if (pct < 0) timeline_stm32_instant(TIMELINE_STM32_REPLIES, rx_ns, "BRAKE #%u, %d ms out", cmd_id, eta_ms);
+    else timeline_stm32_instant(TIMELINE_STM32_REPLIES, rx_ns, "%d%% #%u, %d ms out", pct, cmd_id, eta_ms);
+    if (stm32_event_push(&context->stm32_events, cmd_id, STM32_ACK_PROGRESS, NULL, eta_ms, rx_ns) != 0) return;
+    wake_nav(context);
+}
+
+// "!id/LAP/...;" from the Task 2 firmware: the lap's phases, costliest first,
+// so a run's log shows where its time went
+static void log_task2_lap(const Stm32Task2Lap* lap, uint64_t rx_ns) {
+    timeline_stm32_instant(TIMELINE_STM32_REPLIES, rx_ns, "LAP #%u, %ld ms", lap->cmd_id, lap->total_ms);
+    char captures[2][16];
+    for (int i = 0; i < 2; i++) {
+        if (lap->capture_ms[i] < 0) snprintf(captures[i], sizeof(captures[i]), "unanswered");
+        else snprintf(captures[i], sizeof(captures[i]), "%ld ms", lap->capture_ms[i]);
+    }
+    LOG_INFO("[Task2] Lap of command %u took %ld ms; capture1 decided in %s, capture2 in %s.\n", lap->cmd_id,
+             lap->total_ms, captures[0], captures[1]);
+
+    int order[STM32_TASK2_STATES];
+    for (int i = 0; i < STM32_TASK2_STATES; i++) order[i] = i;
+    for (int i = 1; i < STM32_TASK2_STATES; i++) { // Insertion sort, by time spent
+        int s = order[i], j = i;
+        for (; j > 0 && lap->state_ms[order[j - 1]] < lap->state_ms[s]; j--) order[j] = order[j - 1];
+        order[j] = s;
+    }
+    for (int i = 0; i < STM32_TASK2_STATES; i++) {
+        int s = order[i];
+        if (lap->entries[s] == 0) continue;
+        LOG_INFO("[Task2]   %-12s %6ld ms  %4.1f%%  entered %u, %u retries\n", STM32_TASK2_STATE_NAMES[s],
+                 lap->state_ms[s], lap->total_ms > 0 ? 100.0 * lap->state_ms[s] / lap->total_ms : 0.0,
+                 lap->entries[s], lap->retries[s]);
+    }
+}
+
+// --- STM32 clock sync ---
+// Every CLOCK_SYNC_PERIOD_MS the reactor sends SYNC to firmware that answers
+// it and hands the reply to clock_sync.h, which maps board timestamps onto
+// the Pi's clock. One exchange is outstanding at a time; a reply that misses
+// the next period is dropped. Missions sent in ASCII are left alone, as the
+// firmware has two ASCII frame buffers and a SYNC landing between commands
+// sent back to back could cost one of them.
+
+static uint64_t g_sync_sent_ns; // When the outstanding SYNC was written; 0 if none. Reactor only.
+
+// Time len bytes take on the wire (8N1), 0 off a real serial port
+static uint64_t stm32_wire_ns(size_t len) {
+    return g_stm32_link_baud > 0 ? (uint64_t)len * 10 * 1000000000ull / (uint64_t)g_stm32_link_baud : 0;
+}
+
+static void stm32_clock_sync_send(SharedAppContext* context) {
+    g_sync_sent_ns = 0;
+    if (!atomic_load(&g_stm32_sync)) return;
+    SystemState state = atomic_load(&context->state);
+    if ((state == STATE_NAVIGATING || state == STATE_MANUAL) && !stm32_protocol_binary()) return;
+    uint64_t sent_ns = latency_now_ns();
+    if (send_sync_to_stm32(context->stm32_fd) == 0) g_sync_sent_ns = sent_ns;
+}
+
+static void stm32_clock_sync_reply(const char* buffer, const Stm32SyncReply* reply, uint64_t rx_ns) {
+    if (g_sync_sent_ns == 0) return; // Late, or not ours
+    clock_sync_add(g_sync_sent_ns, rx_ns, stm32_wire_ns(strlen(STM32_SYNC_REQUEST)), stm32_wire_ns(strlen(buffer)), reply);
+    g_sync_sent_ns = 0;
+}
+
+// Handles one complete "!<cmdId>/...;" or telemetry frame from the STM32.
+static void handle_stm32_message(SharedAppContext* context, char* buffer) {
+    if ((uint8_t)buffer[0] == STM32_FRAME_SYNC) {
+        handle_stm32_telemetry((const uint8_t*)buffer);
+        return;
+    }
+    uint64_t rx_ns = latency_now_ns(); // Stamp before logging so printf is not counted
+    trace_record(TRACE_CH_STM32, TRACE_DIR_IN, 0, buffer, strlen(buffer));
+    metric_inc(METRIC_STM32_FRAMES_RX);
+    LOG_DEBUG("[STM32Thread] Received: %s\n", buffer);
+
+    // Handshake, clock and probe replies, not tied to any queued command
+    Stm32SyncReply sync;
+    if (stm32_parse_sync(buffer, &sync) == 0) {
+        stm32_clock_sync_reply(buffer, &sync, rx_ns);
+        return;
+    }
+    Stm32LinkCaps caps;
+    if (stm32_parse_hello(buffer, &caps) == 0) {
+        if (!g_stm32_hello_done) {
+            stm32_link_apply(&caps);
+            stm32_progress_configure(context->stm32_fd);
+            stm32_credit_configure(context->stm32_fd);
+        }
+        return;
+    }
+    if (strncmp(buffer, STM32_PROGRESS_REPLY, strlen(STM32_PROGRESS_REPLY)) == 0) return;
+    bool credit_on;
+    int credit_depth;
+    if (stm32_parse_credit_config(buffer, &credit_on, &credit_depth) == 0) {
+        atomic_store(&g_stm32_credit_depth, credit_on ? credit_depth : 0);
+        LOG_INFO("[STM32Thread] STM32 reports queue room (%d deep).\n", credit_depth);
+        return;
+    }
+    if (strncmp(buffer, STM32_BINARY_PROBE_REPLY, strlen(STM32_BINARY_PROBE_REPLY)) == 0) {
+        stm32_protocol_set_binary(true);
+        LOG_INFO("[STM32Thread] STM32 supports binary frames; switching command encoding.\n");
+        if (strncmp(buffer, STM32_BINARY_PROBE_ROUTE_REPLY, strlen(STM32_BINARY_PROBE_ROUTE_REPLY)) == 0) {
+            stm32_protocol_set_route(true);
+            LOG_INFO("[STM32Thread] STM32 runs uploaded routes itself.\n");
+        }
+        return;
+    }
+
+    uint32_t cmd_id;
+    int pct, eta_ms;
+    if (stm32_parse_progress(buffer, &cmd_id, &pct, &eta_ms) == 0) {
+        handle_stm32_progress(context, cmd_id, pct, eta_ms, rx_ns);
+        return;
+    }
+    uint32_t credit_limit;
+    if (stm32_parse_credit(buffer, &cmd_id, &credit_limit) == 0) {
+        handle_stm32_credit(context, cmd_id, credit_limit, rx_ns);
+        return;
+    }
+    Stm32Task2Lap lap;
+    if (stm32_parse_task2_lap(buffer, &lap) == 0) {
+        log_task2_lap(&lap, rx_ns);
+        return;
+    }
+    char status[64];
+    if (sscanf(buffer, "!%u/%63[^/;]", &cmd_id, status) != 2) {
+        LOG_ERROR("[STM32Thread] Unrecognized message format from STM32: %s\n", buffer);
+        return;
+    }
+    timeline_stm32_instant(TIMELINE_STM32_REPLIES, rx_ns, "%s #%u", status, cmd_id);
+    Stm32Pose parsed_pose;
+    const Stm32Pose* pose = stm32_parse_pose(buffer, &parsed_pose) == 0 ? &parsed_pose : NULL;
+
+    if (strcmp(status, "DONE") == 0) {
+        complete_stm32_command(context, cmd_id, STM32_ACK_DONE, pose, rx_ns);
+        metric_inc(METRIC_STM32_DONE);
+        LOG_DEBUG("[STM32Thread] Processed ACK for CMD ID: %u\n", cmd_id);
+    } else if (strcmp(status, "OK") == 0) {
+        // Firmware accepted the command into its queue; completion follows as DONE.
+        complete_stm32_command(context, cmd_id, STM32_ACK_ACCEPTED, pose, rx_ns);
+    } else if (strcmp(status, "SETTLED") == 0) {
+        complete_stm32_command(context, cmd_id, STM32_ACK_SETTLED, pose, rx_ns);
+    } else if (strcmp(status, "SNAP") == 0) {
+        // Route executor reached a snapshot step and is holding still for it
+        complete_stm32_command(context, cmd_id, STM32_ACK_DONE, pose, rx_ns);
+        LOG_DEBUG("[STM32Thread] Snapshot requested at route step %u\n", cmd_id);
+    } else if (strcmp(status, "PASS") == 0) {
+        // Route executor is driving through a rolling snapshot's viewing pose
+        complete_stm32_command(context, cmd_id, STM32_ACK_DONE, pose, rx_ns);
+        LOG_DEBUG("[STM32Thread] Passing the viewing pose at route step %u\n", cmd_id);
+    } else if (strcmp(status, "RESET") == 0) {
+        // The firmware rebooted; the nav thread resends what it lost
+        int remaining = -1;
+        char cause[16] = "?";
+        sscanf(buffer, "!%*u/RESET/%d/%15[^/;]", &remaining, cause);
+        metric_inc(METRIC_STM32_RESETS);
+        clock_sync_reset(); // Its clock started again from 0
+        stm32_progress_configure(context->stm32_fd);
+        stm32_credit_configure(context->stm32_fd);
+        LOG_WARN("[STM32Thread] STM32 rebooted (%s) during command %u with %d left.\n", cause, cmd_id, remaining);
+        if (stm32_event_push(&context->stm32_events, cmd_id, STM32_ACK_RESET, NULL, remaining, rx_ns) != 0) {
+            LOG_ERROR("[STM32Thread] Event ring full, dropping RESET for CMD ID %u.\n", cmd_id);
+        }
+        wake_nav(context);
+    } else if (strcmp(status, "READY") == 0) {
+        // Booted and safe to move; anything sent since it came up starts now
+        unsigned boot_ms = 0;
+        sscanf(buffer, "!%*u/READY/%u", &boot_ms);
+        metric_gauge_set(METRIC_GAUGE_STM32_BOOT_MS, boot_ms);
+        LOG_INFO("[STM32Thread] STM32 ready to move %u ms after boot.\n", boot_ms);
+    } else if (strcmp(status, "STOPPED") == 0) {
+        // Answer to an emergency stop; the nav thread is already unwinding
+        int remaining = -1;
+        sscanf(buffer, "!%*u/STOPPED/%d", &remaining);
+        LOG_WARN("[STM32Thread] STM32 stopped at once during command %u with %d left.\n", cmd_id, remaining);
+        wake_nav(context);
+    } else if (strcmp(status, "FAULT") == 0) {
+        // Given up on, with the wheels stopped and its queue dropped: fail it now
+        char cause[16] = "?";
+        sscanf(buffer, "!%*u/FAULT/%15[^/;]", cause);
+        complete_stm32_command(context, cmd_id, STM32_ACK_ERROR, pose, rx_ns);
+        metric_inc(METRIC_STM32_FAULTS);
+        LOG_ERROR("[STM32Thread] STM32 gave up on CMD ID %u: %s.\n", cmd_id, cause);
+    } else if (strcmp(status, "ERROR") == 0) {
+        complete_stm32_command(context, cmd_id, STM32_ACK_ERROR, pose, rx_ns);
+        metric_inc(METRIC_STM32_ERRORS);
+        LOG_ERROR("[STM32Thread] STM32 rejected CMD ID %u: %s\n", cmd_id, buffer);
+    } else {
+        LOG_ERROR("[STM32Thread] Unrecognized status from STM32: %s\n", buffer);
+    }
+}
+
+// --- Stream framing ---
+// Serial reads return arbitrary slices of the byte stream: one read can hold
+// several frames, and a frame can span reads. Bytes accumulate in a StreamFramer
+// and complete frames are handed to the link's handler one at a time.
+
+#define STM32_FRAMER_CAPACITY 512
+#define ANDROID_FRAMER_CAPACITY 8192
+
+typedef struct {
+    char* data;
+    size_t capacity;
+    size_t len;
+    // Returns the length of the first complete frame in data[0..len), or 0 if
+    // more bytes are needed. May also report leading garbage to discard via *skip.
+    size_t (*find_frame)(const char* data, size_t len, size_t* skip);
+    void (*handler)(SharedAppContext*, char*);
+    const char* tag;
+} StreamFramer;
+
+// STM32 frames are "!...;" replies or binary telemetry frames (stm32_protocol.h).
+// Anything else (CR/LF, the MDP firmware's text lines, line noise) is dropped,
+// as is a sync byte that fails the telemetry length/CRC check. Replies never
+// contain the sync byte, so a '!' followed by one was not a reply either.
+static size_t find_stm32_frame(const char* data, size_t len, size_t* skip) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t start = 0;
+    for (;;) {
+        while (start < len && p[start] != '!' && p[start] != STM32_FRAME_SYNC) start++;
+        *skip = start;
+        if (start == len) return 0;
+        if (p[start] == STM32_FRAME_SYNC) {
+            int n = stm32_telemetry_check(p + start, len - start);
+            if (n >= 0) return (size_t)n;
+            start++;
+            continue;
+        }
+        size_t i = start + 1;
+        while (i < len && p[i] != ';' && p[i] != STM32_FRAME_SYNC) i++;
+        if (i == len) return 0;
+        if (p[i] == ';') return i - start + 1;
+        start = i;
+    }
+}
+
+// Android messages are JSON objects, possibly pretty-printed across several lines
+// and split over several RFCOMM packets. A frame ends where the outermost
+// brace closes; braces inside string literals are ignored. Text outside an
+// object (e.g. a bare quoted "STOP") is framed by newline instead.
+static size_t find_android_frame(const char* data, size_t len, size_t* skip) {
+    size_t start = 0;
+    while (start < len && (data[start] == '\n' || data[start] == '\r' || data[start] == ' ' || data[start] == '\t')) start++;
+    *skip = start;
+    if (start == len) return 0;
+
+    if (data[start] != '{') {
+        for (size_t i = start; i < len; i++) {
+            if (data[i] == '\n') return i - start + 1;
+        }
+        return 0;
+    }
+
+    int depth = 0;
+    bool in_string = false;
+    for (size_t i = start; i < len; i++) {
+        char c = data[i];
+        if (in_string) {
+            if (c == '\\') i++; // Skip the escaped character
+            else if (c == '"') in_string = false;
+        } else if (c == '"') {
+            in_string = true;
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            if (--depth == 0) return i - start + 1;
+        }
+    }
+    return 0;
+}
+
+// Hands every complete frame in the buffer to the handler, then compacts the remainder.
+static void framer_dispatch(StreamFramer* framer, SharedAppContext* context) {
+    size_t consumed = 0;
+    while (consumed < framer->len) {
+        size_t skip = 0;
+        size_t frame_len = framer->find_frame(framer->data + consumed, framer->len - consumed, &skip);
+        consumed += skip;
+        if (frame_len == 0) break;
+
+        // Terminate the frame in place; the byte after it is saved and restored.
+        char* frame = framer->data + consumed;
+        char saved = frame[frame_len];
+        frame[frame_len] = '\0';
+        framer->handler(context, frame);
+        frame[frame_len] = saved;
+        consumed += frame_len;
+    }
+    if (consumed > 0) {
+        memmove(framer->data, framer->data + consumed, framer->len - consumed);
+        framer->len -= consumed;
+    }
+}
+
+// Reads whatever is available on fd straight into the link's framer. Only called
+// when epoll reports the fd readable, so the read never blocks.
+// Returns -1 if the peer closed the link.
+static int reactor_read(SharedAppContext* context, int fd, StreamFramer* framer) {
+    if (framer->len >= framer->capacity - 1) { // Keep one byte for the terminator
+        LOG_ERROR("[%s] Receive buffer overflow without a complete frame, dropping %zu bytes.\n",
+                framer->tag, framer->len);
+        framer->len = 0;
+    }
+    ssize_t bytes_read = read(fd, framer->data + framer->len, framer->capacity - 1 - framer->len);
+    if (bytes_read > 0) {
+        framer->len += (size_t)bytes_read;
+        framer_dispatch(framer, context);
+        return 0;
+    }
+    if (bytes_read == 0) {
+        LOG_INFO("[%s] Read 0 bytes, link closed by peer.\n", framer->tag);
         return -1;
     }
+    if (errno != EAGAIN && errno != EINTR) {
+        LOG_ERROR("[%s] Error reading from serial port: %s\n", framer->tag, strerror(errno));
+    }
+    return 0;
+}
 
-    curl = curl_easy_init();
-    if (curl) {
-        curl_mime *form = curl_mime_init(curl);
-        curl_mimepart *field;
-
-        field = curl_mime_addpart(form); curl_mime_name(field, "image"); curl_mime_filedata(field, CAPTURE_FILENAME);
-        char id_str[10]; snprintf(id_str, sizeof(id_str), "%d", obstacle_id);
-        field = curl_mime_addpart(form); curl_mime_name(field, "object_id"); curl_mime_data(field, id_str, CURL_ZERO_TERMINATED);
-
-        curl_easy_setopt(curl, CURLOPT_URL, IMAGE_SERVER_URL);
-        curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
-
-        res = curl_easy_perform(curl);
-        if (res == CURLE_OK) {
-            long code; curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-            if (code >= 200 && code < 300) {
-                if (response_buffer != NULL && chunk.memory != NULL) { // Only copy if buffer provided and memory exists
-                    strncpy(response_buffer, chunk.memory, buffer_size - 1);
-                    response_buffer[buffer_size - 1] = '\0';
-                }
-                result = 0;
-            } else {
-                fprintf(stderr, "[ImgThread] Image server returned non-2xx response: %ld\n", code);
-            }
-        } else {
-            fprintf(stderr, "[ImgThread] post_image_to_server_thread failed: %s\n", curl_easy_strerror(res));
-        }
-        curl_easy_cleanup(curl);
-        curl_mime_free(form);
-    } else {
-        fprintf(stderr, "[ImgThread] curl_easy_init() failed.\n");
+static int reactor_add(int epfd, int fd, uint32_t source) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = source;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("[Reactor] epoll_ctl ADD failed");
+        return -1;
     }
-    free(chunk.memory); // Free after curl_easy_cleanup
-    return result;
+    return 0;
 }
 
-void* process_image_thread(void* args) {
-    ImageTaskArgs* task_args = (ImageTaskArgs*)args;
-    SharedAppContext* context = task_args->context;
-    char image_server_response[2048]; // Buffer for image server JSON response
-    char class_label[100]; // To hold the detected class label
-
-    printf("[ImgThread] Capturing image for obstacle %d...\n", task_args->obstacle_id);
-    if (capture_image(CAPTURE_FILENAME) != 0) {
-        fprintf(stderr, "[ImgThread] Failed to capture image.\n");
-        // Signal image capture failure by setting ID to 0 or another error code, or just don't signal
-        pthread_mutex_lock(&context->image_capture_mutex);
-        context->last_image_capture_id = 0; // Indicate failure or no successful capture
-        pthread_cond_signal(&context->image_capture_cond);
-        pthread_mutex_unlock(&context->image_capture_mutex);
-    } else {
-        printf("[ImgThread] Image captured successfully for obstacle %d.\n", task_args->obstacle_id);
-        // Signal image capture success
-        pthread_mutex_lock(&context->image_capture_mutex);
-        context->last_image_capture_id = task_args->obstacle_id;
-        pthread_cond_signal(&context->image_capture_cond);
-        pthread_mutex_unlock(&context->image_capture_mutex);
-
-        // Send robot position to Android (Python's ROBOT,x,y,d)
-        char robot_pos_msg[100];
-        // Use +1 for x and y to match Python's 1-indexed coordinates for Android
-        const char* dir_str = (task_args->robot_snap_position.d >= 0 && task_args->robot_snap_position.d < 8) ?
-                               DIR_MAP_ANDROID_STR[task_args->robot_snap_position.d] : "U"; // U for unknown
-        snprintf(robot_pos_msg, sizeof(robot_pos_msg), "\"ROBOT,%d,%d,%s\"\n",
-                 task_args->robot_snap_position.x + 1, task_args->robot_snap_position.y + 1, dir_str);
-        send_message_to_android_with_ack(context->android_fd, robot_pos_msg);
-        printf("[ImgThread] Sent robot position to Android: %s", robot_pos_msg);
-
-
-        // Post image and get response
-        if (post_image_to_server_thread(task_args->obstacle_id, image_server_response, sizeof(image_server_response)) == 0) {
-            printf("[ImgThread] Image server response: %s\n", image_server_response);
-
-            /* Compatible with object_detection_server.py: server returns success, detected, count, objects[] with class_label, img_id, confidence, bbox.
-             * Use "count" for detection (integer); prefer "img_id" from JSON; do not skip Bullseye — use first object with valid img_id. */
-            int count = 0;
-            if (get_json_int(image_server_response, "count", &count) != 0 || count <= 0) {
-                printf("[ImgThread] No object detected by image server for obstacle %d.\n", task_args->obstacle_id);
-            } else {
-                const char* objects_array_start = strstr(image_server_response, "\"objects\":[");
-                if (objects_array_start) {
-                    objects_array_start += strlen("\"objects\":[");
-                    const char* ptr = objects_array_start;
-                    int sent = 0;
-                    while (*ptr && sent == 0) {
-                        const char* obj_start = strchr(ptr, '{');
-                        if (!obj_start) break;
-                        int depth = 1;
-                        const char* p = obj_start + 1;
-                        while (*p && depth > 0) {
-                            if (*p == '{') depth++;
-                            else if (*p == '}') depth--;
-                            p++;
-                        }
-                        if (depth != 0) break;
-                        const char* obj_end = p - 1;
-                        size_t obj_len = (size_t)(obj_end - obj_start + 1);
-                        char single_obj_json[512];
-                        if (obj_len >= sizeof(single_obj_json)) obj_len = sizeof(single_obj_json) - 1;
-                        strncpy(single_obj_json, obj_start, obj_len);
-                        single_obj_json[obj_len] = '\0';
-
-                        if (get_json_string(single_obj_json, "class_label", class_label, sizeof(class_label)) != 0)
-                            get_json_string(single_obj_json, "class", class_label, sizeof(class_label));
-                        if (class_label[0] != '\0') {
-                            /* Strip " - ..." suffix if present (server may send "Number 4 - 4") */
-                            char* dash = strstr(class_label, " - ");
-                            if (dash) *dash = '\0';
-                            int img_id = -1;
-                            if (get_json_int(single_obj_json, "img_id", &img_id) != 0 || img_id < 0)
-                                img_id = get_img_id_from_class_name(class_label);
-                            if (img_id >= 0) {
-                                /* Send TARGET,object_id,img_id to Android (e.g. "TARGET,1,11") */
-                                send_target_result_to_android(context->android_fd, task_args->obstacle_id, img_id);
-                                printf("[ImgThread] Sent image detection result to Android: obstacle_id=%d, class_label=%s, img_id=%d\n", task_args->obstacle_id, class_label, img_id);
-                                sent = 1;
-                            } else {
-                                fprintf(stderr, "[ImgThread] Unknown class label received or invalid img_id: %s\n", class_label);
-                            }
-                        }
-                        ptr = p;
+void* io_reactor_thread(void* args) {
+    SharedAppContext* context = (SharedAppContext*)args;
+    timeline_thread("reactor");
+    static char android_buffer[ANDROID_FRAMER_CAPACITY]; // Receive buffer for Android messages
+    static char stm32_buffer[STM32_FRAMER_CAPACITY];     // Receive buffer for STM32 frames
+    StreamFramer android_framer = { android_buffer, sizeof(android_buffer), 0, find_android_frame, handle_android_message, "AndroidThread" };
+    StreamFramer stm32_framer = { stm32_buffer, sizeof(stm32_buffer), 0, find_stm32_frame, handle_stm32_message, "STM32Thread" };
+
+#ifdef RPI_TESTING
+    // In test mode, read from the dedicated ACK pipe.
+    int stm32_read_fd = g_stm32_ack_fd;
+#else
+    // In normal mode, read from the bidirectional serial port.
+    int stm32_read_fd = context->stm32_fd;
+#endif
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("[Reactor] epoll_create1 failed");
+        return NULL;
+    }
+    if (reactor_add(epfd, context->android_fd, REACTOR_SRC_ANDROID) != 0 ||
+        reactor_add(epfd, stm32_read_fd, REACTOR_SRC_STM32) != 0 ||
+        reactor_add(epfd, context->deadline_timer_fd, REACTOR_SRC_DEADLINE) != 0 ||
+        reactor_add(epfd, context->reactor_wakeup_fd, REACTOR_SRC_WAKEUP) != 0) {
+        close(epfd);
+        return NULL;
+    }
+    // Optional: a run without the endpoint is still a working run
+    int metrics_fd = METRICS_UDP_PORT > 0 ? metrics_open_socket(METRICS_UDP_PORT) : -1;
+    if (metrics_fd != -1 && reactor_add(epfd, metrics_fd, REACTOR_SRC_METRICS) != 0) {
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+    // Also optional: without it, STM32 timestamps keep their rougher mapping
+    int sync_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec sync_period = {
+        .it_interval = { .tv_sec = CLOCK_SYNC_PERIOD_MS / 1000, .tv_nsec = (CLOCK_SYNC_PERIOD_MS % 1000) * 1000000L },
+        .it_value = { .tv_sec = CLOCK_SYNC_PERIOD_MS / 1000, .tv_nsec = (CLOCK_SYNC_PERIOD_MS % 1000) * 1000000L },
+    };
+    if (sync_fd != -1 && (timerfd_settime(sync_fd, 0, &sync_period, NULL) == -1 ||
+                          reactor_add(epfd, sync_fd, REACTOR_SRC_CLOCK_SYNC) != 0)) {
+        close(sync_fd);
+        sync_fd = -1;
+    }
+    // And again: without it, the soc_* gauges only move at missions' ends
+    int soc_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec soc_period = {
+        .it_interval = { .tv_sec = SOC_MONITOR_PERIOD_MS / 1000, .tv_nsec = (SOC_MONITOR_PERIOD_MS % 1000) * 1000000L },
+        .it_value = { .tv_sec = 0, .tv_nsec = 1000000L },
+    };
+    if (soc_fd != -1 && (timerfd_settime(soc_fd, 0, &soc_period, NULL) == -1 ||
+                         reactor_add(epfd, soc_fd, REACTOR_SRC_SOC) != 0)) {
+        close(soc_fd);
+        soc_fd = -1;
+    }
+    // SIGHUP reloads the config; main() blocked it in every thread
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    int signal_fd = signalfd(-1, &reload_signals, SFD_CLOEXEC);
+    if (signal_fd != -1 && reactor_add(epfd, signal_fd, REACTOR_SRC_SIGNAL) != 0) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+
+    LOG_INFO("[Reactor] Listening on Android and STM32 links...\n");
+    while (!atomic_load(&context->reactor_shutdown)) {
+        struct epoll_event events[REACTOR_MAX_EVENTS];
+        int n = epoll_wait(epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            perror("[Reactor] epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t ticks;
+            switch (events[i].data.u32) {
+                case REACTOR_SRC_ANDROID:
+                    if (reactor_read(context, context->android_fd, &android_framer) != 0) {
+                        // Closed RFCOMM/pipe stays readable; stop watching it instead of spinning.
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, context->android_fd, NULL);
+                    }
+                    break;
+                case REACTOR_SRC_STM32:
+                    if (reactor_read(context, stm32_read_fd, &stm32_framer) != 0) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, stm32_read_fd, NULL);
+                    }
+                    break;
+                case REACTOR_SRC_DEADLINE:
+                    if (read(context->deadline_timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+                        wake_nav_waiters(context, true);
+                    }
+                    break;
+                case REACTOR_SRC_WAKEUP:
+                    if (read(context->reactor_wakeup_fd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+                        perror("[Reactor] eventfd read failed");
                     }
-                    if (sent == 0)
-                        fprintf(stderr, "[ImgThread] No valid object with img_id for obstacle %d.\n", task_args->obstacle_id);
+                    break;
+                case REACTOR_SRC_METRICS:
+                    metric_gauge_set(METRIC_GAUGE_NAV_STATE, atomic_load(&context->state));
+                    metrics_serve(metrics_fd);
+                    break;
+                case REACTOR_SRC_CLOCK_SYNC:
+                    if (read(sync_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) stm32_clock_sync_send(context);
+                    break;
+                case REACTOR_SRC_SOC:
+                    if (read(soc_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) soc_monitor_sample(NULL);
+                    break;
+                case REACTOR_SRC_SIGNAL: {
+                    struct signalfd_siginfo info;
+                    if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                        LOG_INFO("[Reactor] SIGHUP: reloading %s.\n", g_config_path);
+                        config_reload_request(-1);
+                    }
+                    break;
                 }
             }
-        } else {
-            fprintf(stderr, "[ImgThread] Failed to upload image or no ACK received from image server.\n");
         }
     }
-    free(task_args); // Free the dynamically allocated arguments
+
+    if (signal_fd != -1) close(signal_fd);
+    if (soc_fd != -1) close(soc_fd);
+    if (sync_fd != -1) close(sync_fd);
+    if (metrics_fd != -1) close(metrics_fd);
+    close(epfd);
     return NULL;
 }
 
 
 // =================================================================================
-// THREAD 2: Navigation Executor (Main Logic)
+// Main Function (Initialization and Thread Management)
 // =================================================================================
 
-void execute_navigation() {
-    SharedAppContext* context = &g_app_context;
-    printf("[NavThread] State: [NAVIGATING]. Executing %d commands.\n", context->command_count);
-
-    pthread_mutex_lock(&context->lock);
-    context->snap_position_idx = 0; // Reset snap position index for new navigation
-    pthread_mutex_unlock(&context->lock);
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [--record FILE] [--log-level LEVEL] [--android DEVICE] [--path-server BASE_URL] [--image-server URL]\n"
+            "          [--telemetry FILE] [--detector-shm NAME] [--local-model FILE] [--local-labels FILE]\n"
+            "          [--detect-policy POLICY] [--timeline FILE] [--stm32-sim SPEC] [--path-channel PORT] [--image-channel PORT]\n"
+            "          [--live-feed PORT] [--config FILE]\n"
+            "  --record FILE          Write every Android/STM32/HTTP exchange to a trace (see trace.h)\n"
+            "  --log-level LEVEL      debug, info (default), warn or error; debug also logs every raw frame and reply\n"
+            "  --android DEVICE       Override the Android link device, e.g. the pty printed by replay_trace.py\n"
+            "  --path-server BASE_URL Pathfinding server, e.g. http://127.0.0.1:5000 (/path and /path/stream)\n"
+            "  --image-server URL     Image recognition endpoint, e.g. http://127.0.0.1:4000/detect\n"
+            "  --telemetry FILE       Write STM32 telemetry frames (TELEM on the MDP firmware) to FILE as CSV\n"
+            "  --detector-shm NAME    Shared-memory region of a local detector (default " SHM_DETECTOR_NAME ")\n"
+            "  --local-model FILE     TFLite model for on-Pi recognition (default detector.tflite)\n"
+            "  --local-labels FILE    Its class labels, one per line (default detector_labels.txt)\n"
+            "  --detect-policy POLICY server (default), local or race: who answers a snapshot when a model is loaded\n"
+            "  --timeline FILE        Write each mission's Pi and STM32 activity to FILE as Chrome trace JSON (timeline.h)\n"
+            "  --stm32-sim SPEC       Run against the in-process STM32 simulator, e.g. speed=0,accel=60 or default (stm32_sim.h)\n"
+            "  --path-channel PORT    Pathfinding server's channel port (server_channel.h), 0 for HTTP only (default %d)\n"
+            "  --image-channel PORT   Image server's channel port, 0 for HTTP only (default %d)\n"
+            "  --live-feed PORT       TCP port of the live feed for dashboard.py --live (live_feed.h), 0 for none (default %d)\n"
+            "  --config FILE          Settings file (runtime_config.h), read again on SIGHUP (default " CONFIG_PATH ");\n"
+            "                         the options above win over it at start\n",
+            prog, PATHFINDING_CHANNEL_PORT, IMAGE_CHANNEL_PORT, g_live_feed_port);
+}
 
-    uint32_t current_cmd_id = 1; // Start command IDs from 1 for the sequence
+// The compiled settings, as g_boot_config starts out.
+static void config_defaults(RuntimeConfig* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    snprintf(cfg->path_url, sizeof(cfg->path_url), "%s", PATHFINDING_SERVER_URL);
+    snprintf(cfg->stream_url, sizeof(cfg->stream_url), "%s", PATHFINDING_STREAM_URL);
+    snprintf(cfg->image_url, sizeof(cfg->image_url), "%s", IMAGE_SERVER_URL);
+    cfg->path_channel_port = PATHFINDING_CHANNEL_PORT;
+    cfg->image_channel_port = IMAGE_CHANNEL_PORT;
+    snprintf(cfg->android_device, sizeof(cfg->android_device), "%s", ANDROID_DEVICE);
+#ifdef RPI_TESTING
+    snprintf(cfg->stm32_device, sizeof(cfg->stm32_device), "%s", STM32_DEVICE_WRITE); // Unused: two pipes
+#else
+    snprintf(cfg->stm32_device, sizeof(cfg->stm32_device), "%s", STM32_DEVICE);
+#endif
+    stm32_get_speeds(&cfg->speeds);
+}
 
-    for (int i = 0; i < context->command_count; i++) {
-        pthread_mutex_lock(&context->lock);
-        if (context->stop_requested) {
-            printf("[NavThread] Stop requested. Aborting navigation.\n");
-            context->stop_requested = false;
-            context->state = STATE_IDLE;
-            pthread_mutex_unlock(&context->lock);
-            break;
+// Fills g_boot_config: the compiled settings, then the config file, then the
+// options. Returns 0, or -1 on an unknown option, a missing value or a config
+// file that does not parse.
+static int parse_args(int argc, char** argv, const char** record_path, const char** telemetry_path,
+                      const char** timeline_path) {
+    RuntimeConfig* cfg = &g_boot_config;
+    config_defaults(cfg);
+    bool config_given = false;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--config") == 0) {
+            g_config_path = argv[i + 1];
+            config_given = true;
         }
-        pthread_mutex_unlock(&context->lock);
+    }
+    int loaded = config_load(g_config_path, cfg);
+    if (loaded < 0 || (loaded > 0 && config_given)) {
+        LOG_ERROR("Fatal: Cannot use config file %s.\n", g_config_path);
+        return -1;
+    }
+    if (loaded == 0) LOG_INFO("[Config] Read %s.\n", g_config_path);
 
-        Command cmd = context->commands[i];
-        if (cmd.type == CMD_SNAPSHOT) {
-            printf("[NavThread] --- Spawning image thread for obstacle %d ---\n", cmd.value);
-            pthread_t tid;
-            ImageTaskArgs* args = malloc(sizeof(ImageTaskArgs));
-            if (!args) {
-                fprintf(stderr, "[NavThread] Failed to allocate ImageTaskArgs.\n");
-                continue;
+    for (int i = 1; i < argc; i++) {
+        const char* opt = argv[i];
+        if (i + 1 >= argc) {
+            print_usage(argv[0]);
+            return -1;
+        }
+        const char* value = argv[++i];
+        if (strcmp(opt, "--record") == 0) {
+            *record_path = value;
+        } else if (strcmp(opt, "--log-level") == 0) {
+            LogLevel level;
+            if (log_parse_level(value, &level) != 0) {
+                print_usage(argv[0]);
+                return -1;
+            }
+            log_set_level(level);
+        } else if (strcmp(opt, "--config") == 0) {
+            // Read above, before the other options
+        } else if (strcmp(opt, "--android") == 0) {
+            snprintf(cfg->android_device, sizeof(cfg->android_device), "%s", value);
+        } else if (strcmp(opt, "--path-server") == 0) {
+            if (config_set_path_server(cfg, value) != 0) {
+                print_usage(argv[0]);
+                return -1;
             }
-            args->context = context;
-            args->obstacle_id = cmd.value;
-            // Get current snap position from context
-            pthread_mutex_lock(&context->lock);
-            if (context->snap_position_idx < context->snap_position_count) {
-                args->robot_snap_position = context->snap_positions[context->snap_position_idx];
-                context->snap_position_idx++;
+        } else if (strcmp(opt, "--image-server") == 0) {
+            snprintf(cfg->image_url, sizeof(cfg->image_url), "%s", value);
+        } else if (strcmp(opt, "--telemetry") == 0) {
+            *telemetry_path = value;
+        } else if (strcmp(opt, "--timeline") == 0) {
+            *timeline_path = value;
+        } else if (strcmp(opt, "--stm32-sim") == 0) {
+            g_stm32_sim_spec = value;
+        } else if (strcmp(opt, "--path-channel") == 0) {
+            cfg->path_channel_port = atoi(value);
+        } else if (strcmp(opt, "--image-channel") == 0) {
+            cfg->image_channel_port = atoi(value);
+        } else if (strcmp(opt, "--live-feed") == 0) {
+            g_live_feed_port = atoi(value);
+        } else if (strcmp(opt, "--detector-shm") == 0) {
+            DETECTOR_SHM_NAME = value;
+        } else if (strcmp(opt, "--local-model") == 0) {
+            LOCAL_MODEL_PATH = value;
+        } else if (strcmp(opt, "--local-labels") == 0) {
+            LOCAL_LABELS_PATH = value;
+        } else if (strcmp(opt, "--detect-policy") == 0) {
+            if (strcmp(value, "server") == 0) {
+                g_detect_policy = DETECT_SERVER_FIRST;
+            } else if (strcmp(value, "local") == 0) {
+                g_detect_policy = DETECT_LOCAL_FIRST;
+            } else if (strcmp(value, "race") == 0) {
+                g_detect_policy = DETECT_RACE;
             } else {
-                // Fallback if snap positions don't match commands, should not happen with correct parsing
-                args->robot_snap_position = (SnapPosition){.x = -1, .y = -1, .d = -1};
-                fprintf(stderr, "[NavThread] Warning: Snap position index out of bounds.\n");
+                print_usage(argv[0]);
+                return -1;
             }
-            pthread_mutex_unlock(&context->lock);
-
+        } else {
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-            pthread_create(&tid, NULL, process_image_thread, args);
-            pthread_detach(tid); // Detach to allow thread to clean up its resources automatically
+// --- Startup ---
+// Everything the first mission would otherwise pay for is done before "ready"
+// goes to Android, and in parallel: each StartupStep runs on its own thread while
+// the image workers warm themselves up (warm_image_worker()). Startup then takes
+// as long as its slowest part rather than their sum, and the first mission finds
+// the same warm ports, camera, connections and buffers as every later one.
 
-            printf("[NavThread] Spawning image thread for obstacle %d. Waiting for image capture confirmation...\n", cmd.value);
+typedef struct {
+    const char* name;
+    int (*run)(SharedAppContext* context); // 0 on success
+    bool fatal; // The controller cannot run without it
+    int result;
+    uint64_t elapsed_ns;
+    pthread_t tid;
+    bool threaded; // Ran on tid rather than inline
+} StartupStep;
 
-            struct timespec ts_img;
-            clock_gettime(CLOCK_REALTIME, &ts_img);
-            ts_img.tv_sec += 10; // Wait for up to 10 seconds for image capture confirmation
+// --- STM32 link handshake ---
+// Runs inside the "STM32 link" start-up step, before the reactor reads the
+// link: HELLO, then BAUD if both ends can go faster (stm32_protocol.h). Firmware
+// that predates HELLO gets the binary probe from main() instead, as before.
+// g_stm32_hello_done and stm32_link_apply() sit with the reactor's handler.
 
-            int img_ack_result = 0; // 0 for success, -1 for error/timeout
-            pthread_mutex_lock(&context->image_capture_mutex);
-            while (context->last_image_capture_id != (uint32_t)cmd.value && !context->stop_requested) {
-                int rc = pthread_cond_timedwait(&context->image_capture_cond, &context->image_capture_mutex, &ts_img);
-                if (rc == ETIMEDOUT) {
-                    fprintf(stderr, "[NavThread] Timeout waiting for image capture confirmation for obstacle %d.\n", cmd.value);
-                    img_ack_result = -1; // Indicate error
-                    break;
-                } else if (rc != 0) {
-                    fprintf(stderr, "[NavThread] Error waiting for image capture condition variable: %d\n", rc);
-                    img_ack_result = -1; // Indicate error
-                    break;
-                }
-            }
+#define STM32_HELLO_TIMEOUT_MS 300
+#define STM32_BAUD_SWITCH_MS 10 // Firmware reprograms USART3 once its reply is out
 
-            if (img_ack_result == 0 && context->last_image_capture_id == (uint32_t)cmd.value) {
-                printf("[NavThread] Received image capture confirmation for obstacle %d. Proceeding.\n", cmd.value);
-            } else if (img_ack_result == 0 && context->last_image_capture_id == 0) {
-                // This means an image capture failed (last_image_capture_id was set to 0)
-                fprintf(stderr, "[NavThread] Image capture for obstacle %d indicated failure. Aborting navigation.\n", cmd.value);
-                img_ack_result = -1; // Treat as failure for navigation flow
-            }
-            pthread_mutex_unlock(&context->image_capture_mutex);
+static int stm32_link_write(int fd, const char* line) {
+    size_t len = strlen(line);
+    if (serial_tx_send(fd, line, len) != 0) {
+        perror("[STM32 link] Write failed");
+        return -1;
+    }
+    LOG_DEBUG("[STM32 link] Sent %s\n", line);
+    return 0;
+}
 
-            if (img_ack_result == -1 || context->stop_requested) {
-                // If there was an error or stop was requested while waiting, break out of navigation
-                pthread_mutex_lock(&context->lock);
-                context->stop_requested = true; // Ensure stop state is propagated
-                context->state = STATE_IDLE;
-                pthread_mutex_unlock(&context->lock);
-                break; // Exit the command execution loop
-            }
+// Waits up to timeout_ms for a "!0/...;" reply on fd and copies it into out
+// without the ';'. Replies to other IDs (a RESET report from before start-up)
+// are dropped. Returns 0, or -1 on a timeout.
+static int stm32_link_wait_reply(int fd, char* out, size_t size, int timeout_ms) {
+    uint64_t deadline_ns = latency_now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    size_t len = 0;
+    bool in_reply = false;
+    for (;;) {
+        uint64_t now_ns = latency_now_ns();
+        if (now_ns >= deadline_ns) return -1;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, (int)((deadline_ns - now_ns + 999999) / 1000000));
+        if (ready < 0 && errno == EINTR) continue;
+        char c;
+        if (ready <= 0 || read(fd, &c, 1) != 1) return -1;
+        if (c == '!') {
+            in_reply = true;
+            len = 0;
+        }
+        if (!in_reply) continue;
+        if (c != ';') {
+            if (len < size - 1) out[len++] = c;
+            continue;
+        }
+        out[len] = '\0';
+        in_reply = false;
+        LOG_DEBUG("[STM32 link] Received %s\n", out);
+        if (strncmp(out, "!0/", 3) == 0) return 0;
+    }
+}
 
+// Asks the firmware where it is. Returns 0, or -1 if it did not say.
+static int stm32_link_where(int fd, int read_fd, Stm32Where* out) {
+    char reply[128];
+    if (stm32_link_write(fd, STM32_WHERE_REQUEST) != 0) return -1;
+    // Skips the answers to what the handshake sent before
+    while (stm32_link_wait_reply(read_fd, reply, sizeof(reply), STM32_HELLO_TIMEOUT_MS) == 0) {
+        if (stm32_parse_where(reply, out) == 0) return 0;
+    }
+    return -1;
+}
 
-        } else {
-            // Send command to STM32 with a sequential ID
-            uint32_t sent_cmd_id = current_cmd_id++; // Store the ID we're sending
-            send_command_to_stm32(context->stm32_fd, cmd, sent_cmd_id);
-            printf("[NavThread] Sent command %u to STM32. Waiting for ACK...\n", sent_cmd_id);
-
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 10; // Wait for up to 5 seconds for ACK
-
-            int ack_result = 0; // 0 for success, -1 for error/timeout
-            pthread_mutex_lock(&context->stm32_ack_mutex);
-            while (context->stm32_last_ack_id != sent_cmd_id && !context->stop_requested) {
-                int rc = pthread_cond_timedwait(&context->stm32_ack_cond, &context->stm32_ack_mutex, &ts);
-                if (rc == ETIMEDOUT) {
-                    fprintf(stderr, "[NavThread] Timeout waiting for ACK for command %u.\n", sent_cmd_id);
-                    ack_result = -1; // Indicate error
-                    break;
-                } else if (rc != 0) {
-                    fprintf(stderr, "[NavThread] Error waiting for ACK condition variable: %d\n", rc);
-                    ack_result = -1; // Indicate error
-                    break;
-                }
-            }
+// Works out how far the firmware got with g_resume: it drove on with what it
+// had queued while the controller was down, so it is waited for, and a route it
+// left parked at a snapshot is dropped there (its STOP answers as ID 0, which
+// no mission uses). g_resume_pending is cleared if that cannot be told.
+static void resume_locate(int fd, int read_fd, bool where) {
+    if (!g_resume_pending) return;
+    CheckpointMission* m = &g_resume;
+    if (!where) {
+        for (int k = m->done; k < m->commands.count; k++) {
+            if (!m->sent_ids[k]) continue;
+            LOG_WARN("[Checkpoint] Route command %d was still running and the firmware cannot say where it stopped; "
+                     "not resuming.\n", k);
+            g_resume_pending = false;
+            return;
+        }
+        return;
+    }
 
-            if (ack_result == 0 && context->stm32_last_ack_id == sent_cmd_id) {
-                printf("[NavThread] Received ACK for command %u.\n", sent_cmd_id);
-            }
-            pthread_mutex_unlock(&context->stm32_ack_mutex);
+    uint64_t deadline_ns = latency_now_ns() + CHECKPOINT_WHERE_WAIT_MS * 1000000ull;
+    Stm32Where at;
+    for (;;) {
+        if (stm32_link_where(fd, read_fd, &at) != 0) {
+            LOG_WARN("[Checkpoint] Firmware did not say where it is; not resuming.\n");
+            g_resume_pending = false;
+            return;
+        }
+        if (at.state != STM32_WHERE_BUSY) break;
+        if (latency_now_ns() >= deadline_ns) {
+            LOG_WARN("[Checkpoint] Firmware still busy after %d ms; not resuming.\n", CHECKPOINT_WHERE_WAIT_MS);
+            g_resume_pending = false;
+            return;
+        }
+        usleep(200000);
+    }
 
-            if (ack_result == -1 || context->stop_requested) {
-                // If there was an error or stop was requested while waiting, break out of navigation
-                pthread_mutex_lock(&context->lock);
-                context->stop_requested = true; // Ensure stop state is propagated
-                context->state = STATE_IDLE;
-                pthread_mutex_unlock(&context->lock);
-                break; // Exit the command execution loop
-            }
+    int k = checkpoint_route_index(m, at.cmd_id);
+    if (at.state == STM32_WHERE_SNAP) {
+        char reply[128];
+        if (send_route_control_to_stm32(fd, STM32_OP_STOP, 0) != 0 ||
+            stm32_link_wait_reply(read_fd, reply, sizeof(reply), STM32_HELLO_TIMEOUT_MS) != 0) {
+            LOG_WARN("[Checkpoint] Firmware did not drop its route at snapshot %u; not resuming.\n", at.cmd_id);
+            g_resume_pending = false;
+            return;
         }
-    } // End of for loop
-    // Using send_message_to_android_with_ack for navigation completion status
-    send_message_to_android_with_ack(context->android_fd, "\"Navigation complete.\"\n");
+    }
+    if (k + 1 > m->done) m->done = k + 1; // The snapshot's DONE was its SNAP
+    LOG_INFO("[Checkpoint] Firmware %s at command %u (%.1f, %.1f) cm, %.1f deg: route command %d of %d done.\n",
+             at.state == STM32_WHERE_SNAP ? "parked" : "idle", at.cmd_id, at.pose.x_cm, at.pose.y_cm,
+             at.pose.theta_deg, m->done, m->commands.count);
 }
 
-void* navigation_executor_thread(void* args) {
-    SharedAppContext* context = (SharedAppContext*)args;
+// Sends HELLO and reads the reply into caps. Returns 0, or -1 if the firmware
+// did not answer or answered like firmware without HELLO.
+static int stm32_link_hello(int fd, int read_fd, Stm32LinkCaps* caps) {
+    char line[64], reply[128];
+    snprintf(line, sizeof(line), STM32_HELLO_FMT, STM32_LINK_VERSION, STM32_MAX_BAUD_RATE);
+    if (stm32_link_write(fd, line) != 0 || stm32_link_wait_reply(read_fd, reply, sizeof(reply), STM32_HELLO_TIMEOUT_MS) != 0) {
+        return -1;
+    }
+    return stm32_parse_hello(reply, caps);
+}
 
-    while (1) {
-        pthread_mutex_lock(&context->lock);
-        while (!context->new_map_received && !context->stop_requested) {
-            printf("[NavThread] State: [IDLE]. Waiting for new mission...\n");
-            pthread_cond_wait(&context->new_task_cond, &context->lock);
+// Moves the link to the fastest rate both ends support. Only real serial
+// ports have a rate; pipes and the sim's socket stay as they are.
+static void stm32_link_raise_baud(int fd, int read_fd, const Stm32LinkCaps* caps) {
+    static const int RATES[] = { 4000000, 3000000, 2000000, 1500000 }; // Fastest first
+    int limit = caps->max_baud < STM32_MAX_BAUD_RATE ? caps->max_baud : STM32_MAX_BAUD_RATE;
+    if (!isatty(fd) || limit <= STM32_BAUD_RATE) return;
+    char line[64], reply[128];
+    for (size_t i = 0; i < sizeof(RATES) / sizeof(RATES[0]); i++) {
+        int rate = RATES[i];
+        if (rate > limit || rate <= STM32_BAUD_RATE) continue;
+        snprintf(line, sizeof(line), STM32_BAUD_FMT, rate);
+        if (stm32_link_write(fd, line) != 0 || stm32_link_wait_reply(read_fd, reply, sizeof(reply), STM32_HELLO_TIMEOUT_MS) != 0) {
+            return;
         }
-
-        if (context->stop_requested) {
-            context->state = STATE_IDLE;
-            context->stop_requested = false;
+        if (strncmp(reply, STM32_BAUD_REPLY, strlen(STM32_BAUD_REPLY)) != 0) continue; // Its divider cannot make it
+        Stm32LinkCaps confirm;
+        usleep(STM32_BAUD_SWITCH_MS * 1000);
+        if (set_serial_baud(fd, rate) == 0 && stm32_link_hello(fd, read_fd, &confirm) == 0) {
+            g_stm32_link_baud = rate;
+            LOG_INFO("[STM32 link] Running at %d baud.\n", rate);
+            return;
         }
+        // The firmware goes back on its own once STM32_BAUD_CONFIRM_MS pass without a HELLO
+        LOG_WARN("[STM32 link] No reply at %d baud; staying at %d.\n", rate, STM32_BAUD_RATE);
+        set_serial_baud(fd, STM32_BAUD_RATE);
+        usleep((STM32_BAUD_CONFIRM_MS + STM32_HELLO_TIMEOUT_MS) * 1000);
+        tcflush(read_fd, TCIFLUSH); // Whatever arrived at the wrong rate
+        if (stm32_link_hello(fd, read_fd, &confirm) != 0) LOG_ERROR("[STM32 link] No reply at %d baud either.\n", STM32_BAUD_RATE);
+        return;
+    }
+}
 
-        if (context->new_map_received) {
-            context->state = STATE_PATHFINDING;
-            context->new_map_received = false;
-        }
-        pthread_mutex_unlock(&context->lock);
+static void stm32_link_handshake(int fd, int read_fd) {
+    g_stm32_link_baud = isatty(fd) ? STM32_BAUD_RATE : 0;
+    Stm32LinkCaps caps;
+    if (stm32_link_hello(fd, read_fd, &caps) != 0) {
+        LOG_INFO("[STM32 link] Firmware did not answer HELLO; probing for binary frames instead.\n");
+        resume_locate(fd, read_fd, false);
+        return;
+    }
+    g_stm32_hello_done = true;
+    stm32_link_apply(&caps);
+    if (caps.usb) {
+        g_stm32_link_baud = 0; // Frames go at USB frame timing, not byte-serial time
+    } else {
+        stm32_link_raise_baud(fd, read_fd, &caps);
+    }
+    stm32_progress_configure(fd);
+    stm32_credit_configure(fd);
+    resume_locate(fd, read_fd, caps.where);
+}
 
-        if (context->state == STATE_PATHFINDING) {
-            printf("[NavThread] State: [PATHFINDING]. Requesting route from server...\n");
-            char payload[2048];
-            char obstacles_str[1500] = ""; // To build the obstacles array string
-
-            for (int i = 0; i < context->obstacle_count; i++) {
-                char obs_item[100]; // Buffer for a single obstacle JSON object
-                // Obstacle x, y are 0-indexed internally, server expects 0-indexed
-                // Direction 'd' is integer, server expects integer
-                snprintf(obs_item, sizeof(obs_item), "{\"id\":%d,\"x\":%d,\"y\":%d,\"d\":%d}",
-                         context->obstacles[i].id, context->obstacles[i].x, context->obstacles[i].y, context->obstacles[i].d);
-                strcat(obstacles_str, obs_item);
-                if (i < context->obstacle_count - 1) strcat(obstacles_str, ",");
-            }
-
-            // Construct the full payload including robot initial state and retrying flag
-            snprintf(payload, sizeof(payload), "{\"obstacles\":[%s],\"robot_x\":%d,\"robot_y\":%d,\"robot_dir\":%d,\"retrying\":false}",
-                     obstacles_str, context->robot_start_x, context->robot_start_y, context->robot_start_dir);
-            printf("[NavThread] Pathfinding payload: %s\n", payload);
-
-            char response[4096]; // Increased response buffer size
-            if (post_data_to_server(PATHFINDING_SERVER_URL, payload, response, sizeof(response)) == 0) {
-                // --- DEBUG: Print raw server response ---
-                printf("[NavThread] Raw server response:\n---\n%s\n---\n", response);
-
-                // Call the modified parse_command_route_from_server
-                if (parse_command_route_from_server(response, context->commands, &context->command_count,
-                                                    context->snap_positions, &context->snap_position_count) == 0) {
-                    send_message_to_android_with_ack(context->android_fd, "\"Route calculated. Navigating.\"\n"); // Using ack send
-                    execute_navigation();
-                } else {
-                    send_message_to_android_with_ack(context->android_fd, "\"Error: Pathfinding failed to parse route.\"\n"); // Using ack send
-                }
-            } else {
-                send_message_to_android_with_ack(context->android_fd, "\"Error: Pathfinding server communication failed.\"\n"); // Using ack send
-            }
-        }
+static int open_stm32_link(SharedAppContext* context) {
+    if (g_stm32_sim_spec) {
+        if (stm32_sim_start(&g_stm32_sim_config, &context->stm32_fd) != 0) return -1;
+#ifdef RPI_TESTING
+        g_stm32_ack_fd = dup(context->stm32_fd); // The reactor reads the testing link's second fd
+        if (g_stm32_ack_fd == -1) return -1;
+        stm32_link_handshake(context->stm32_fd, g_stm32_ack_fd);
+#else
+        stm32_link_handshake(context->stm32_fd, context->stm32_fd);
+#endif
+        return 0;
+    }
+#ifdef RPI_TESTING
+    // In test mode, use separate pipes for writing commands and reading ACKs.
+    context->stm32_fd = init_serial_port(STM32_DEVICE_WRITE, STM32_BAUD_RATE);
+    g_stm32_ack_fd = init_serial_port(STM32_DEVICE_READ, STM32_BAUD_RATE);
+    if (context->stm32_fd == -1 || g_stm32_ack_fd == -1) return -1;
+    stm32_link_handshake(context->stm32_fd, g_stm32_ack_fd);
+#else
+    context->stm32_fd = init_serial_port(config_now()->stm32_device, STM32_BAUD_RATE);
+    if (context->stm32_fd == -1) return -1;
+    stm32_link_handshake(context->stm32_fd, context->stm32_fd);
+#endif
+    return 0;
+}
 
-        pthread_mutex_lock(&context->lock);
-        context->state = STATE_IDLE;
-        pthread_mutex_unlock(&context->lock);
+static int open_android_link(SharedAppContext* context) {
+    context->android_fd = init_serial_port(config_now()->android_device, ANDROID_BAUD_RATE);
+    return context->android_fd == -1 ? -1 : 0;
+}
+
+// Brings the camera up so the first snapshot does not pay for sensor power-up,
+// then lets the image workers take their warm-up frames.
+static int start_camera(SharedAppContext* context) {
+    (void)context;
+    int result = camera_init(CAMERA_DEVICE, CAMERA_WIDTH, CAMERA_HEIGHT);
+    if (result != 0) LOG_WARN("Warning: Camera stream unavailable, snapshots will use raspistill.\n");
+    pthread_mutex_lock(&g_startup.lock);
+    g_startup.camera_done = true;
+    pthread_cond_broadcast(&g_startup.changed);
+    pthread_mutex_unlock(&g_startup.lock);
+    return result;
+}
+
+static int open_route_cache(SharedAppContext* context) {
+    (void)context;
+    if (route_cache_init(ROUTE_CACHE_DIR) != 0) {
+        LOG_WARN("Warning: Route cache unavailable, every mission will wait for the server.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// The image server is connected by the workers, one connection per burst frame
+// Nothing is lost without it: the image workers upload over HTTP instead.
+static int attach_shm_detector(SharedAppContext* context) {
+    (void)context;
+    return shm_detector_open(DETECTOR_SHM_NAME);
+}
+
+// Without a model snapshots go to the server alone. The workers only look at their
+// interpreter once startup is over, so it is handed to them here.
+static int load_local_model(SharedAppContext* context) {
+    (void)context;
+    if (local_detector_load(LOCAL_MODEL_PATH, LOCAL_LABELS_PATH) != 0) return -1;
+    int ready = 0;
+    for (int i = 0; i < IMAGE_WORKER_COUNT; i++) {
+        g_image_workers[i].local = local_detector_create();
+        if (g_image_workers[i].local) ready++;
+    }
+    if (USE_APPROACH_DETECTION) g_approach.local = local_detector_create();
+    return ready > 0 ? 0 : -1;
+}
+
+static int connect_path_server(SharedAppContext* context) {
+    (void)context;
+    return http_prewarm(config_now()->path_url);
+}
+
+// Requests go over HTTP while a channel is down; each keeps reconnecting on its own.
+static int open_server_channels(SharedAppContext* context) {
+    (void)context;
+    const RuntimeConfig* cfg = config_now();
+    if (!USE_SERVER_CHANNEL || (cfg->path_channel_port <= 0 && cfg->image_channel_port <= 0)) return 0;
+    if (cfg->path_channel_port > 0) {
+        atomic_store(&g_path_channel, server_channel_open("path", cfg->path_url, cfg->path_channel_port, on_route_push, NULL));
+    }
+    if (cfg->image_channel_port > 0) {
+        atomic_store(&g_image_channel, server_channel_open("image", cfg->image_url, cfg->image_channel_port, NULL, NULL));
     }
+    return server_channel_available(atomic_load(&g_path_channel)) ||
+           server_channel_available(atomic_load(&g_image_channel)) ? 0 : -1;
+}
+
+static void* startup_step_thread(void* arg) {
+    StartupStep* step = (StartupStep*)arg;
+    uint64_t start_ns = latency_now_ns();
+    step->result = step->run(&g_app_context);
+    step->elapsed_ns = latency_now_ns() - start_ns;
     return NULL;
 }
-            
-            
-            // =================================================================================
-            // THREAD 1: Android Listener (High-level Commands)
-            // =================================================================================
-            
-            void* android_listener_thread(void* args) {
-                SharedAppContext* context = (SharedAppContext*)args;
-                char buffer[8192]; // Buffer for incoming Android messages
-            
-                while (1) {
-                    printf("[AndroidThread] Listening for messages...\n");
-                    // Blocking read until a message is received
-                    ssize_t bytes_read = read(context->android_fd, buffer, sizeof(buffer) - 1);
-            
-                    if (bytes_read > 0) {
-                        buffer[bytes_read] = '\0';
-                        printf("[AndroidThread] Received: %s\n", buffer);
-            
-                        // Check for JSON message first
-                        char category[50];
-                        if (get_json_string(buffer, "cat", category, sizeof(category)) == 0) {
-                            if (strcmp(category, "sendArena") == 0) {
-                                const char* value_ptr = strstr(buffer, "\"value\":");
-                                if (value_ptr) {
-                                    const char* map_json_start = strchr(value_ptr, '{');
-                                    if (map_json_start) {
-                                        pthread_mutex_lock(&context->lock);
-                                        if (context->state == STATE_IDLE) {
-                                            if (parse_android_map_and_obstacles(map_json_start, context) == 0) {
-                                                context->new_map_received = true;
-                                                send_android_ack(context->android_fd, category, "Map received. Pathfinding...");
-                                                pthread_cond_signal(&context->new_task_cond);
-                                            } else {
-                                                send_android_ack(context->android_fd, category, "Error: Invalid map format.");
-                                            }
-                                        } else {
-                                            send_android_ack(context->android_fd, category, "Error: Robot is busy. Cannot start new mission.");
-                                        }
-                                        pthread_mutex_unlock(&context->lock);
-                                    } else {
-                                        fprintf(stderr, "[AndroidThread] Malformed 'sendArena': 'value' object not found.\n");
-                                        send_android_ack(context->android_fd, category, "Error: Malformed 'sendArena' message.");
-                                    }
-                                } else {
-                                    fprintf(stderr, "[AndroidThread] Malformed 'sendArena': 'value' key not found.\n");
-                                    send_android_ack(context->android_fd, category, "Error: Malformed 'sendArena' message.");
-                                }
-                            } else if (strcmp(category, "stop") == 0) { // STOP command as JSON
-                                pthread_mutex_lock(&context->lock);
-                                send_android_ack(context->android_fd, category, "STOP command received.");
-                                context->stop_requested = true;
-                                if(context->state != STATE_IDLE) {
-                                    pthread_cond_signal(&context->new_task_cond);
-                                }
-                                pthread_mutex_unlock(&context->lock);
-                            } else if (strcmp(category, "stm") == 0) { // Direct STM command from Android
-                                char stm_command_str[100]; // Buffer for the command string like "<FR090>"
-                                if (get_json_string(buffer, "value", stm_command_str, sizeof(stm_command_str)) == 0) {
-                                    // Parse and execute the STM command. This function will be in rpi_hal.c
-                                    // It will also handle waiting for ACK from STM32
-                                    parse_and_execute_android_command(context->stm32_fd, stm_command_str, context);
-                                } else {
-                                    fprintf(stderr, "[AndroidThread] Malformed 'stm' command: 'value' key not found.\n");
-                                    send_android_ack(context->android_fd, category, "Error: Malformed STM command.");
-                                }
-                            } else {
-                                fprintf(stderr, "[AndroidThread] Unrecognized JSON category from Android: %s\n", category);
-                            }
-                        }
-                        // All other messages are considered malformed or unrecognized by AndroidThread
-                        else {
-                            fprintf(stderr, "[AndroidThread] Malformed or unrecognized message from Android: %s\n", buffer);
-                        }
-                    } else if (bytes_read == 0) {
-                        printf("[AndroidThread] Read 0 bytes, serial port might be closed or empty.\n");
-                        usleep(10000); // Small delay to prevent busy-waiting
-                    } else {
-                        perror("[AndroidThread] Error reading from serial port");
-                        usleep(100000); // 100ms
-                    }
-                }
-                return NULL;
-            }
-            
-            
-            // =================================================================================
-            // New THREAD: STM32 Listener
-            // =================================================================================
-            void* stm32_listener_thread(void* args) {
-                SharedAppContext* context = (SharedAppContext*)args;
-                char buffer[256]; // Buffer for incoming STM32 messages
-                ssize_t bytes_read;
-            
-                printf("[STM32Thread] Listening for messages...\n");
-            
-                while (1) {
-                    #ifdef RPI_TESTING
-                        // In test mode, read from the dedicated ACK pipe.
-                        bytes_read = read(g_stm32_ack_fd, buffer, sizeof(buffer) - 1);
-                    #else
-                        // In normal mode, read from the bidirectional serial port.
-                        bytes_read = read(context->stm32_fd, buffer, sizeof(buffer) - 1);
-                    #endif
-            
-                    if (bytes_read > 0) {
-                        buffer[bytes_read] = '\0';
-                        printf("[STM32Thread] Received: %s", buffer); // Use %s directly, as it might contain \n
-            
-                        // Check for ACK message format: !cmdId/DONE;
-                        uint32_t cmd_id;
-                        // Assuming the format is !<cmdId>/DONE;
-                        if (sscanf(buffer, "!%u/DONE;", &cmd_id) == 1) {
-                            pthread_mutex_lock(&context->stm32_ack_mutex);
-                            context->stm32_last_ack_id = cmd_id;
-                            pthread_cond_signal(&context->stm32_ack_cond);
-                            pthread_mutex_unlock(&context->stm32_ack_mutex);
-                            printf("[STM32Thread] Processed ACK for CMD ID: %u\n", cmd_id);
-                        } else {
-                            fprintf(stderr, "[STM32Thread] Unrecognized message format from STM32: %s\n", buffer);
-                        }
-                    } else if (bytes_read == 0) {
-                        // No data for a while, small delay to prevent busy-waiting
-                        usleep(10000); // 10ms
-                    } else {
-                        perror("[STM32Thread] Error reading from serial port");
-                        usleep(100000); // 100ms delay on error
-                    }
-                }
-                return NULL;
-            }
-            
-            
-            // =================================================================================
-            // Main Function (Initialization and Thread Management)
-            // =================================================================================
 
-// =================================================================================
-// Main Function (Initialization and Thread Management)
-// =================================================================================
+// Runs steps[0 .. count) in parallel and waits for all of them, then for the
+// image workers to finish warming up. Returns 0, or -1 if a fatal step failed.
+static int run_startup(StartupStep* steps, int count) {
+    for (int i = 0; i < count; i++) {
+        steps[i].threaded = rt_thread_create(&steps[i].tid, RT_ROLE_BACKGROUND, false, startup_step_thread, &steps[i]) == 0;
+        if (!steps[i].threaded) startup_step_thread(&steps[i]); // No thread to spare: run it here
+    }
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (steps[i].threaded) pthread_join(steps[i].tid, NULL);
+        LOG_INFO("[Startup] %s: %s in %.1f ms\n", steps[i].name, steps[i].result == 0 ? "ok" : "failed",
+                 steps[i].elapsed_ns / 1e6);
+        if (steps[i].result != 0 && steps[i].fatal) result = -1;
+    }
+    if (result != 0) return -1;
+
+    // Each worker finishes within its connect timeout plus one frame
+    pthread_mutex_lock(&g_startup.lock);
+    while (g_startup.workers_warm < IMAGE_WORKER_COUNT) pthread_cond_wait(&g_startup.changed, &g_startup.lock);
+    pthread_mutex_unlock(&g_startup.lock);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* record_path = NULL;
+    const char* telemetry_path = NULL;
+    const char* timeline_path = NULL;
+    // Before any thread starts, so SIGHUP only ever reaches the reactor's signalfd
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_signals, NULL);
+    if (parse_args(argc, argv, &record_path, &telemetry_path, &timeline_path) != 0) return 1;
+    if (record_path && trace_open(record_path) != 0) return 1;
+    if (telemetry_path && telemetry_open(telemetry_path) != 0) return 1;
+    if (timeline_path && timeline_open(timeline_path) != 0) return 1; // Before any thread starts, so each names its track
+    if (g_stm32_sim_spec && stm32_sim_parse(g_stm32_sim_spec, &g_stm32_sim_config) != 0) return 1;
+    // Registered so early error returns still write out what was queued
+    if (USE_ASYNC_LOG && log_start() == 0) atexit(log_stop);
+    // Before anything large is allocated, so it is all locked as it is mapped
+    rt_profile_init(USE_REALTIME_PROFILE);
+    soc_monitor_init();
+    if (USE_PERFORMANCE_GOVERNOR) atexit(soc_governor_restore); // A mission cut short by an exit
+    stm32_set_speed_classes(USE_SPEED_CLASSES);
+    stm32_set_speeds(&g_boot_config.speeds);
 
-int main() {
     curl_global_init(CURL_GLOBAL_ALL); // Initialize curl once for the application lifecycle
+    if (http_client_init() != 0) {
+        LOG_WARN("Warning: HTTP client init failed, server requests will fail.\n");
+    }
     memset(&g_app_context, 0, sizeof(SharedAppContext));
     pthread_mutex_init(&g_app_context.lock, NULL);
     pthread_cond_init(&g_app_context.new_task_cond, NULL);
-    g_app_context.state = STATE_IDLE;
-    g_app_context.snap_position_count = 0; // Initialize new fields
+    atomic_init(&g_app_context.state, STATE_IDLE);
     g_app_context.snap_position_idx = 0;   // Initialize new fields
+    arena_init(&g_app_context.mission_arena, ARENA_DEFAULT_BLOCK_SIZE);
+    if (USE_CHECKPOINTS) {
+        g_resume_pending = checkpoint_open(CHECKPOINT_PATH, &g_app_context.mission_arena, &g_resume) == 1;
+        if (g_resume_pending) {
+            LOG_INFO("[Checkpoint] %s holds an unfinished mission: %d obstacle(s), %d of %d command(s) done.\n",
+                     CHECKPOINT_PATH, g_resume.obstacle_count, g_resume.done, g_resume.commands.count);
+        }
+    }
 
-    // Initialize STM32 ACK synchronization mechanisms
-    g_app_context.stm32_last_ack_id = 0;
-    pthread_mutex_init(&g_app_context.stm32_ack_mutex, NULL);
-    pthread_cond_init(&g_app_context.stm32_ack_cond, NULL);
-
-    // Initialize Image capture synchronization mechanisms
-    g_app_context.last_image_capture_id = 0;
-    pthread_mutex_init(&g_app_context.image_capture_mutex, NULL);
-    pthread_cond_init(&g_app_context.image_capture_cond, NULL);
+    // Lock-free flags and channels between the reactor, nav and image threads
+    atomic_init(&g_app_context.stop_requested, false);
+    atomic_init(&g_app_context.mission_epoch, 0);
+    atomic_init(&g_app_context.deadline_expired, false);
+    atomic_init(&g_app_context.reactor_shutdown, false);
+    atomic_init(&g_app_context.stm32_last_ack_id, 0);
+    atomic_init(&g_app_context.route_stream_cancel, false);
+    atomic_init(&g_app_context.route_command_items, NULL);
+    atomic_init(&g_app_context.route_snap_items, NULL);
+    atomic_init(&g_app_context.route_commands_published, 0);
+    atomic_init(&g_app_context.route_snaps_published, 0);
+    atomic_init(&g_app_context.route_complete, false);
+    atomic_init(&g_app_context.route_failed, false);
+    atomic_init(&g_app_context.stm32_events.head, 0);
+    atomic_init(&g_app_context.stm32_events.tail, 0);
 
+    // Initialize the image worker queue
+    pthread_mutex_init(&g_app_context.image_queue.mutex, NULL);
+    g_app_context.image_queue.batch_holder = -1;
+    pthread_cond_init(&g_app_context.image_queue.not_empty, NULL);
+    pthread_cond_init(&g_app_context.image_queue.not_full, NULL);
 
-    // Initialize serial ports / test pipes
-    g_app_context.android_fd = init_serial_port(ANDROID_DEVICE, BAUD_RATE);
+    // Reactor plumbing: nav deadline timer and cross-thread wakeups
+    g_app_context.deadline_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    g_app_context.reactor_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    g_app_context.nav_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_app_context.deadline_timer_fd == -1 || g_app_context.reactor_wakeup_fd == -1 || g_app_context.nav_wakeup_fd == -1) {
+        perror("Fatal: Failed to create reactor timer/eventfds");
+        return 1;
+    }
 
-    #ifdef RPI_TESTING
-        printf("--- RPI_TESTING mode enabled ---\n");
-        // In test mode, use separate pipes for writing commands and reading ACKs.
-        g_app_context.stm32_fd = init_serial_port(STM32_DEVICE_WRITE, BAUD_RATE);
-        g_stm32_ack_fd = init_serial_port(STM32_DEVICE_READ, BAUD_RATE);
-        if (g_app_context.stm32_fd == -1 || g_stm32_ack_fd == -1 || g_app_context.android_fd == -1) {
-            fprintf(stderr, "Fatal: Failed to initialize serial ports/pipes. Exiting.\n");
-            return 1;
+    // Start the image worker pool, each with its own warm curl handles. The
+    // workers warm up while the startup steps run.
+    pthread_t image_tids[IMAGE_WORKER_COUNT];
+    for (int i = 0; i < IMAGE_WORKER_COUNT; i++) {
+        ImageWorker* worker = &g_image_workers[i];
+        worker->context = &g_app_context;
+        worker->worker_id = i;
+        worker->multi = curl_multi_init();
+        if (!worker->multi) {
+            LOG_ERROR("[ImgThread %d] curl_multi_init() failed.\n", i);
+        }
+        for (int f = 0; f < IMAGE_BURST_FRAMES; f++) {
+            BurstUpload* upload = &worker->uploads[f];
+            *upload = (BurstUpload){0};
+            upload->curl = curl_easy_init();
+            if (!upload->curl) {
+                LOG_ERROR("[ImgThread %d] curl_easy_init() failed.\n", i);
+            }
         }
-    #else
-        g_app_context.stm32_fd = init_serial_port(STM32_DEVICE, BAUD_RATE);
-        if (g_app_context.stm32_fd == -1 || g_app_context.android_fd == -1) {
-            fprintf(stderr, "Fatal: Failed to initialize serial ports. Exiting.\n");
+        snprintf(worker->capture_filename, sizeof(worker->capture_filename), CAPTURE_FILENAME_FMT, i);
+        if (rt_thread_create(&image_tids[i], RT_ROLE_IMAGE, false, image_worker_thread, worker) != 0) {
+            LOG_ERROR("Fatal: Failed to start image worker %d.\n", i);
             return 1;
         }
+    }
+
+    #ifdef RPI_TESTING
+        LOG_INFO("--- RPI_TESTING mode enabled ---\n");
     #endif
+    g_app_context.stm32_fd = -1;
+    g_app_context.android_fd = -1;
+    // Up before the links, so a dashboard can watch start-up as well
+    if (g_live_feed_port > 0 && live_feed_start(g_live_feed_port) != 0) {
+        LOG_WARN("Warning: Live feed unavailable on port %d.\n", g_live_feed_port);
+    }
+    StartupStep steps[] = {
+        { .name = "STM32 link",   .run = open_stm32_link,     .fatal = true },
+        { .name = "Android link", .run = open_android_link,   .fatal = true },
+        { .name = "Camera",       .run = start_camera,        .fatal = false },
+        { .name = "Route cache",  .run = open_route_cache,    .fatal = false },
+        { .name = "Path server",  .run = connect_path_server, .fatal = false },
+        { .name = "Channels",     .run = open_server_channels, .fatal = false },
+        { .name = "Local model",  .run = load_local_model,    .fatal = false },
+        { .name = "Shm detector", .run = attach_shm_detector, .fatal = false },
+    };
+    int step_count = (int)(sizeof(steps) / sizeof(steps[0]));
+    if (!USE_SHM_DETECTOR) step_count--; // Its step is last
+    uint64_t startup_ns = latency_now_ns();
+    if (run_startup(steps, step_count) != 0) {
+        LOG_ERROR("Fatal: Failed to initialize serial ports/pipes. Exiting.\n");
+        return 1;
+    }
+
+    trace_bind_fd(g_app_context.android_fd, TRACE_CH_ANDROID);
+    trace_bind_fd(g_app_context.stm32_fd, TRACE_CH_STM32);
+    if (USE_SERIAL_TX) {
+        serial_tx_attach(g_app_context.stm32_fd, "STM32 tx", STM32_TX_STALL_MS);
+        serial_tx_attach(g_app_context.android_fd, "Android tx", ANDROID_TX_STALL_MS);
+    }
+    if (USE_ANDROID_TX_WRITER && android_tx_start(g_app_context.android_fd) != 0) {
+        LOG_WARN("Warning: Android writer unavailable, messages are written by their senders.\n");
+    }
+
+    // Only for firmware that did not answer HELLO. The reply is picked up by the
+    // reactor once it starts; commands sent before then simply go out as ASCII.
+    if (USE_STM32_BINARY_PROTOCOL && !g_stm32_hello_done) {
+        if (serial_tx_send(g_app_context.stm32_fd, STM32_BINARY_PROBE, strlen(STM32_BINARY_PROBE)) != 0) {
+            perror("Warning: Failed to send STM32 binary protocol probe");
+        }
+    }
 
+    LOG_INFO("--- RPi Control Centre Initialized in %.1f ms ---\n", (latency_now_ns() - startup_ns) / 1e6);
 
-    printf("--- RPi Control Centre Initialized ---\n");
+    pthread_t approach_tid;
+    bool approach_running = USE_APPROACH_DETECTION && approach_start(&g_app_context, &approach_tid) == 0;
+    if (USE_APPROACH_DETECTION && !approach_running) {
+        LOG_WARN("Warning: Approach scanner unavailable, every snapshot waits for the stop.\n");
+    }
 
-    pthread_t android_tid, nav_tid, stm32_tid;
-    pthread_create(&android_tid, NULL, android_listener_thread, &g_app_context);
-    pthread_create(&nav_tid, NULL, navigation_executor_thread, &g_app_context);
-    pthread_create(&stm32_tid, NULL, stm32_listener_thread, &g_app_context); // Create the new STM32 listener thread
+    if (config_reload_start() != 0) LOG_WARN("Warning: Config reload unavailable.\n");
+    pthread_t reactor_tid, nav_tid;
+    if (rt_thread_create(&reactor_tid, RT_ROLE_REACTOR, false, io_reactor_thread, &g_app_context) != 0 ||
+        rt_thread_create(&nav_tid, RT_ROLE_NAV, false, navigation_executor_thread, &g_app_context) != 0) {
+        LOG_ERROR("Fatal: Failed to start the reactor and nav threads.\n");
+        return 1;
+    }
+    send_status_to_android(g_app_context.android_fd, "ready");
 
-    pthread_join(android_tid, NULL);
     pthread_join(nav_tid, NULL);
-    pthread_join(stm32_tid, NULL); // Join the new STM32 listener thread
+    reactor_request_shutdown(&g_app_context);
+    pthread_join(reactor_tid, NULL);
+    if (approach_running) approach_stop(approach_tid);
+
+    // Let the image workers finish any queued snapshots, then release their handles
+    pthread_mutex_lock(&g_app_context.image_queue.mutex);
+    g_app_context.image_queue.shutdown = true;
+    pthread_cond_broadcast(&g_app_context.image_queue.not_empty);
+    pthread_cond_broadcast(&g_app_context.image_queue.not_full);
+    pthread_mutex_unlock(&g_app_context.image_queue.mutex);
+    for (int i = 0; i < IMAGE_WORKER_COUNT; i++) {
+        pthread_join(image_tids[i], NULL);
+        for (int f = 0; f < IMAGE_BURST_FRAMES; f++) {
+            BurstUpload* upload = &g_image_workers[i].uploads[f];
+            if (upload->curl) curl_easy_cleanup(upload->curl);
+            free(upload->frame.memory);
+            free(upload->response.memory);
+        }
+        for (int h = 0; h < IMAGE_BATCH_MAX - 1; h++) {
+            for (int f = 0; f < IMAGE_BURST_FRAMES; f++) free(g_image_workers[i].held[h].frames[f].memory);
+        }
+        for (size_t f = 0; f < sizeof(g_image_workers[i].ring_frames) / sizeof(g_image_workers[i].ring_frames[0]); f++) {
+            free(g_image_workers[i].ring_frames[f].memory);
+        }
+        if (g_image_workers[i].multi) curl_multi_cleanup(g_image_workers[i].multi);
+        server_channel_message_free(&g_image_workers[i].channel_reply);
+        image_preprocessor_free(&g_image_workers[i].preprocessor);
+        local_detector_destroy(g_image_workers[i].local);
+    }
 
+    arena_destroy(&g_app_context.mission_arena);
     pthread_mutex_destroy(&g_app_context.lock);
     pthread_cond_destroy(&g_app_context.new_task_cond);
-    pthread_mutex_destroy(&g_app_context.stm32_ack_mutex); // Destroy new mutex
-    pthread_cond_destroy(&g_app_context.stm32_ack_cond);   // Destroy new condition variable
-    pthread_mutex_destroy(&g_app_context.image_capture_mutex); // Destroy image capture mutex
-    pthread_cond_destroy(&g_app_context.image_capture_cond);   // Destroy image capture condition variable
+    pthread_mutex_destroy(&g_app_context.image_queue.mutex);
+    pthread_cond_destroy(&g_app_context.image_queue.not_empty);
+    pthread_cond_destroy(&g_app_context.image_queue.not_full);
     
+    android_tx_stop(); // Flush what the workers queued before the link closes
+    serial_tx_detach(g_app_context.android_fd);
+    serial_tx_detach(g_app_context.stm32_fd);
+    config_reload_stop();
+    server_channel_close(atomic_load(&g_path_channel));
+    server_channel_close(atomic_load(&g_image_channel));
+    live_feed_stop();
+    shm_detector_close();
+    local_detector_unload();
+
     // Close file descriptors
     #ifdef RPI_TESTING
         if (g_stm32_ack_fd != -1) close(g_stm32_ack_fd);
     #endif
     if (g_app_context.stm32_fd != -1) close(g_app_context.stm32_fd);
     if (g_app_context.android_fd != -1) close(g_app_context.android_fd);
+    close(g_app_context.deadline_timer_fd);
+    close(g_app_context.reactor_wakeup_fd);
+    close(g_app_context.nav_wakeup_fd);
+    stm32_sim_stop();
+    checkpoint_close();
 
 
+    camera_shutdown();
+    http_client_cleanup();
     curl_global_cleanup(); // Clean up curl once at application shutdown
+    trace_close();
+    if (g_telemetry_log) fclose(g_telemetry_log);
+    timeline_close();
     return 0;
 }
 
@@ -625,15 +6558,15 @@ but with the fake servers, follow these steps.
 **Prerequisites:**
 1.  Ensure you have `python3` installed.
 2.  Ensure you have `curl` development libraries installed (e.g., `libcurl4-openssl-dev` on Debian/Ubuntu).
-3.  Ensure `json_parser.c`, `json_parser.h`, `rpi_hal.c`, `rpi_hal.h`, and `shared_types.h` are in the same directory or accessible via include paths.
+3.  Ensure `arena.c`, `arena.h`, `json_parser.c`, `json_parser.h`, `rpi_hal.c`, `rpi_hal.h`, `latency_stats.c`, `latency_stats.h`, `route_cache.c`, `route_cache.h`, `planner.c`, `planner.h`, `stm32_protocol.c`, `stm32_protocol.h`, `route_optimizer.c`, `route_optimizer.h`, `image_preprocess.c`, `image_preprocess.h`, `trace.c`, `trace.h`, `json_writer.c`, `json_writer.h`, `logger.c`, `logger.h`, `metrics.c`, `metrics.h`, `rt_profile.c`, `rt_profile.h`, `android_tx.c`, `android_tx.h`, `serial_tx.c`, `serial_tx.h`, `shm_detector.c`, `shm_detector.h`, `local_detector.c`, `local_detector.h`, `timeline.c`, `timeline.h`, `stm32_sim.c`, `stm32_sim.h`, `server_channel.c`, `server_channel.h`, `live_feed.c`, `live_feed.h`, `clock_sync.c`, `clock_sync.h`, `checkpoint.c`, `checkpoint.h`, `runtime_config.c`, `runtime_config.h`, `mission_report.c`, `mission_report.h`, `soc_monitor.c`, `soc_monitor.h`, `occupancy_map.c`, `occupancy_map.h`, `json_schema.h`, `protocol_keywords.h`, and `shared_types.h` are in the same directory or accessible via include paths. `protocol_keywords.h` is generated by `gen_protocol_keywords.py` (which also writes the firmware copy); re-run it after changing a keyword list.
 
 **Step 1: Compile the RPI communication module**
 
 Open your terminal in the `RPI` directory and compile with the `RPI_TESTING` flag defined:
 
-    gcc -g -Wall -DRPI_TESTING multithread_communication.c json_parser.c rpi_hal.c -o test_center -lpthread -lcurl
-    gcc -g -Wall -DFAKE_ANDROID_SIMULATION multithread_communication.c json_parser.c rpi_hal.c -o STtest_center -lpthread -lcurl
-    gcc -Wall multithread_communication.c json_parser.c rpi_hal.c -o ctrl_center -lpthread -lcurl
+    gcc -g -Wall -DRPI_TESTING multithread_communication.c arena.c json_parser.c rpi_hal.c latency_stats.c route_cache.c planner.c stm32_protocol.c route_optimizer.c image_preprocess.c trace.c json_writer.c logger.c metrics.c rt_profile.c android_tx.c serial_tx.c shm_detector.c local_detector.c timeline.c stm32_sim.c server_channel.c live_feed.c clock_sync.c checkpoint.c runtime_config.c mission_report.c soc_monitor.c occupancy_map.c -o test_center -lpthread -lcurl -ljpeg -lm -lrt
+    gcc -g -Wall -DFAKE_ANDROID_SIMULATION multithread_communication.c arena.c json_parser.c rpi_hal.c latency_stats.c route_cache.c planner.c stm32_protocol.c route_optimizer.c image_preprocess.c trace.c json_writer.c logger.c metrics.c rt_profile.c android_tx.c serial_tx.c shm_detector.c local_detector.c timeline.c stm32_sim.c server_channel.c live_feed.c clock_sync.c checkpoint.c runtime_config.c mission_report.c soc_monitor.c occupancy_map.c -o STtest_center -lpthread -lcurl -ljpeg -lm -lrt
+    gcc -Wall multithread_communication.c arena.c json_parser.c rpi_hal.c latency_stats.c route_cache.c planner.c stm32_protocol.c route_optimizer.c image_preprocess.c trace.c json_writer.c logger.c metrics.c rt_profile.c android_tx.c serial_tx.c shm_detector.c local_detector.c timeline.c stm32_sim.c server_channel.c live_feed.c clock_sync.c checkpoint.c runtime_config.c mission_report.c soc_monitor.c occupancy_map.c -o ctrl_center -lpthread -lcurl -ljpeg -lm -lrt
     Make `fake_stm.py` executable:
         chmod +x fake_stm.py
 
@@ -641,6 +6574,11 @@ Open your terminal in the `RPI` directory and compile with the `RPI_TESTING` fla
 *   `-o test_center`: Specifies the output executable name.
 *   `-lpthread`: Links the POSIX threads library.
 *   `-lcurl`: Links the libcurl library.
+*   `-ljpeg`: Links libjpeg (`libjpeg-dev`), used to shrink snapshots before upload.
+*   `-lm`: Links the math library (used by the native planner).
+*   `-lrt`: Links `shm_open()` on older glibc (the shared-memory detector).
+*   Add `-DHAVE_TFLITE -ltensorflowlite_c` to recognise snapshots on the Pi as well (`local_detector.h`); without it the model options are accepted and ignored.
+*   Run as root (or with CAP_SYS_NICE and an unlimited memlock limit) for the real-time profile; otherwise it warns and runs without it.
 
 **Step 2: Create Named Pipes (FIFOs) for simulated serial communication**
 
@@ -660,12 +6598,23 @@ Open two SEPARATE terminal windows/tabs, navigate to the `RPI` directory in each
     ```
     You should see: `Fake Pathfinding Server running on http://localhost:5000 ...`
 
+    It also listens for the controller's persistent channel (`server_channel.h`) on port 5001,
+    and answers routes there instead of over HTTP. Run it with `--reroute` to have it push each
+    route again a second later, as a server that found a better one would; the controller logs
+    `Server pushed a revised route` and updates its route cache.
+
 *   **Terminal 2 (Fake Image Server):**
     ```bash
     python3 fake_image_server.py
     ```
     You should see: `Fake Image Recognition Server running on http://localhost:5000 ...`
 
+    Its channel port is 4001: each burst frame goes up as one binary request on the same
+    connection. Start the controller with `--image-channel 0` (or `--path-channel 0`) to use HTTP.
+
+    To skip HTTP for snapshots, run `python3 shm_detector.py` instead before starting the
+    program; it answers through shared memory (`shm_detector.h`) with the same fake results.
+
 *   **Terminal 3 (Fake STM32 Simulation):**
     ```bash
     python3 fake_stm.py
@@ -677,7 +6626,9 @@ Open a THIRD terminal window/tab, navigate to the `RPI` directory, and run the c
 
     ./test_center
 
-You should see initialization messages like: `--- RPi Control Centre Initialized ---` and `[AndroidThread] Listening for messages...` and `[NavThread] State: [IDLE]. Waiting for new mission...`
+You should see initialization messages like: `--- RPi Control Centre Initialized ---` and `[Reactor] Listening on Android and STM32 links...` and `[NavThread] State: [IDLE]. Waiting for new mission...`
+
+Messages are written by a background flusher (`logger.h`), so they can trail the event by up to 10 ms. Raw traffic (every received frame, the pathfinding payload, server replies) is logged at debug level; run `./test_center --log-level debug` to see it, which the expected output below assumes.
 
 **Step 5: Simulate Android Input (Trigger Pathfinding and Image Processing)**
 
@@ -707,11 +6658,11 @@ You should see the RPI program:
 1.  Receive the START message.
 2.  Transition to `STATE_PATHFINDING`.
 3.  Print the pathfinding payload.
-4.  Make a request to `http://localhost:5000/path` (handled by `fake_path_server.py`).
-5.  Receive and parse the route (commands and snap positions).
-6.  Start `execute_navigation()`.
-7.  For each `CMD_SNAPSHOT` command, it will print `--- Spawning image thread for obstacle X ---`.
-8.  The image thread will capture image (simulated), post to `http://localhost:5000/detect` (handled by `fake_image_server.py`), and print the image server's response.
+4.  Make a request to `http://localhost:5000/path/stream` (handled by `fake_path_server.py`), or `/path` if the stream yields nothing.
+5.  Receive and parse the route (commands and snap positions). A streamed route is parsed line by line.
+6.  Start `execute_navigation()` as soon as the first command arrives.
+7.  For each `CMD_SNAPSHOT` command, it will print `--- Queueing snapshot for obstacle X ---`.
+8.  An image worker will capture image (simulated), post to `http://localhost:5000/detect` (handled by `fake_image_server.py`), and print the image server's response. The fake server advertises batching, so snapshots taken within `IMAGE_BATCH_HOLD_MS` of each other go up in one request with one `image`/`object_id` pair per frame, answered with `{"results":[{"object_id":N, ...}, ...]}`. Run it with `--no-batch` to get an upload per snapshot. Run it with `--bullseye 1,3` to answer the first snapshot of obstacles 1 and 3 with the bullseye: the nav thread reroutes to another face of each on the Pi (`Snapshot retry: rerouting ...`) and photographs it again.
 9.  It will then simulate sending a robot position and image detection result to Android (these messages will be written to `rpi_to_stm`, but since no one is reading from `rpi_to_stm` in this test, you won't see them directly unless you monitor the pipe).
 10. Finally, it will print `"Navigation complete."` and return to `STATE_IDLE`.
 
@@ -731,6 +6682,75 @@ To simulate stopping the robot mid-navigation (or just sending a stop command wh
 
 The `rpi_comm` program should acknowledge the STOP command. If navigation is in progress, it will abort.
 
+**Step 8: Record a run and replay it faster (Optional)**
+
+Add `--record mission.trace` to any run to capture every Android, STM32 and HTTP exchange with its timestamp (format in `trace.h`). To replay it against a `-DRPI_TESTING` build at 10x speed, with nothing else attached to the pipes or ports 5000/4000:
+
+    mv route_cache route_cache.bak   # A cached route would make the replay diverge from the recording
+    python3 replay_trace.py mission.trace --speed 10
+
+then start the controller with the command line it prints (`--android /dev/pts/N --path-server ... --image-server ...`). The replay answers each STM32 command and server request with the recorded reply after the recorded delay divided by the speed, and prints the recorded and replayed mission durations when the controller has sent as many Android messages as it did in the recording.
+
+**Step 9: Benchmark and fuzz the JSON parsers (Optional)**
+
+`json_corpus/` holds real sendArena, route, route-line and detection payloads. Run the benchmark before and after touching `json_parser.c`; it prints ns per message and MB/s for each payload:
+
+    gcc -O2 -Wall json_bench.c json_parser.c arena.c -o json_bench
+    ./json_bench json_corpus/[a-z]*
+
+`json_fuzz.c` is a libFuzzer harness over every parser entry point (build line at the top of the file). Without clang, build it with `-DJSON_FUZZ_STANDALONE` under ASan to replay the corpus and every truncation of it. Add any payload that ever breaks a run to `json_corpus/`.
+
+**Step 10: Watch live metrics (Optional)**
+
+While the controller runs, it answers any UDP datagram on port `METRICS_UDP_PORT` (5600; build with `-DMETRICS_UDP_PORT=0` to disable) with a JSON snapshot of its counters, gauges and latency histograms. Poll it from the Pi or from a laptop on the same network:
+
+    python3 metrics_cli.py --host 127.0.0.1 --watch 1
+
+**Step 11: Log STM32 telemetry (Optional)**
+
+The MDP firmware streams binary state frames (encoder counts, RPS, PWM, yaw, yaw rate, IR; layout in `stm32_protocol.h`) after `TELEM <hz>` on its UART, up to 200 Hz (`TELEM 0` stops it). The controller separates them from the text replies, counts them as `stm32_telemetry_rx` and, with `--telemetry FILE`, writes one CSV row per frame. To exercise it without hardware:
+
+    python3 fake_stm.py --telemetry 200
+
+and add `--telemetry telemetry.csv` to the controller's command line.
+
+**Step 12: Look at a mission's timeline (Optional)**
+
+With `--timeline timeline.json` the controller writes every mission as Chrome trace JSON (`timeline.h`), rewritten when each mission ends. Open it at https://ui.perfetto.dev: the Pi's threads (nav waits, image worker capture/preprocess/detect, HTTP requests, Android writes) sit above the STM32's commands, replies and, with telemetry on (`fake_stm.py --telemetry 200`), its drive/brake/settle phases, all from "arena received" to the end of the mission.
+
+Firmware that advertises SYNC in its HELLO reply is sent a clock exchange every second (`clock_sync.h`). Its ms ticks then land on the Pi's clock to within about half the link's round trip, plus drift. Each mission's end logs `STM32 clock: ... best round trip ... drift ... ppm`. Without SYNC, telemetry is placed by its earliest arrival, as before.
+
+**Step 13: Run missions against the simulated STM32 (Optional)**
+
+`--stm32-sim speed=0` replaces `fake_stm.py` with the in-process simulator (`stm32_sim.h`): commands are executed on a kinematic model (acceleration, turn rate, braking, cooldown, settle) on a virtual clock, so the STM32's part of a mission takes milliseconds. Start only the fake servers, and skip the named pipes. After each mission the nav thread logs `Simulated mission: X s of robot time`, which is what to compare between controller or planner changes. Add `speed=1` to run in real time, `telemetry=200` to stream telemetry, or `protocol=ascii` to exercise the ASCII path; see `stm32_sim.h` for the other parameters.
+
+**Step 14: Measure the STM32 link's latency (Optional)**
+
+With the controller stopped, `link_bench` sends a burst of PINGs to firmware that advertises PING. It prints a histogram for each stage of the round trip: the Pi's write, the frame on the wire, the RX interrupt to the receive task, dispatch, the reply's transmission and the rest, which is the USB-serial adapter and the kernel. The firmware times its stages on its cycle counter and also toggles its LINK_PROBE pin (PE10) at each one, for a scope. Run it before and after a transport change (a higher `-s` rate, `--binary`, `-w` to keep several in flight):
+
+    gcc -O2 -Wall link_bench.c stm32_protocol.c stm32_sim.c latency_stats.c logger.c metrics.c timeline.c clock_sync.c json_writer.c arena.c -o link_bench -lpthread -lm
+    ./link_bench -n 2000 /dev/ttyUSB0
+
+**Step 15: Watch the robot live from the dashboard (Optional)**
+
+The controller publishes a live feed on TCP port `LIVE_FEED_PORT` (5602; `--live-feed PORT` to move it, 0 to turn it off): mission phase, each command and its outcome, the odometry pose, queue depths, snapshot positions, detections and, with telemetry on, STM32 telemetry, one JSON line each (`live_feed.h`). Up to four subscribers at once, each throttled to its own rate for the fast topics; one that reads slowly loses its oldest lines, and nothing on the robot waits for it. From a laptop:
+
+    python3 ../mdp_algo_v13/dashboard.py --live <pi-address>
+
+or `nc 127.0.0.1 5602` for the raw lines. A subscriber may send `{"topics":["pose","command"],"max_hz":5}` to narrow what it gets.
+
+**Step 16: Tell a slow Pi from slow code (Optional)**
+
+The reactor reads the SoC temperature, the ARM clock and the firmware's throttle flags every second into the `soc_temp_mc`, `cpu_freq_khz` and `soc_throttled` gauges (`soc_monitor.h`; `metrics_cli.py` shows them). A throttle flag turning on is logged as a warning. Each mission report and `mission_report.csv` row carries the mission's hottest temperature, slowest clock and any throttle flags, so a latency regression can be checked against them before blaming the code. Build with `-DUSE_PERFORMANCE_GOVERNOR=1` and run as root to hold every CPU on the performance governor for each mission; the previous governor comes back when the mission ends.
+
+**Step 17: Load-test the pathfinding and image servers (Optional)**
+
+`server_bench` sends the controller's own requests to either server: the pathfinding payload for a sendArena map (`json_corpus/sendarena_8.json` unless `--arena`), or the multipart snapshot upload (`--batch K` images in one request). It keeps `-c` in flight, and with `-r` sends a fixed rate whatever the server does. It prints latency percentiles, throughput and how many answers failed or were unusable. Run it against a new server build before it goes on the robot:
+
+    gcc -O2 -Wall server_bench.c json_parser.c json_writer.c arena.c -o server_bench -lcurl -ljpeg -lm
+    ./server_bench --path http://127.0.0.1:5000/path -n 500 -c 4
+    ./server_bench --image http://127.0.0.1:4000/detect -n 100 -c 2 -r 1 --jpeg capture.jpg
+
 **Cleanup:**
 
 *   Press `Ctrl+C` in all terminal windows running the servers and `rpi_comm`.
@@ -0,0 +1,166 @@
+#include "occupancy_map.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OCC_GRID_SIZE 20   // The planner's arena, in its 10 cm cells
+#define OCC_CELL_CM 10
+#define OCC_STEP_CM 2.5f   // Along a beam; a quarter cell misses none it crosses
+
+typedef struct {
+    uint64_t rx_ns;
+    int32_t enc_a, enc_d;
+    unsigned ir_mm;
+} OccSample;
+
+static const int HEADING[8][2] = { [0] = {0, 1}, [2] = {1, 0}, [4] = {0, -1}, [6] = {-1, 0} };
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static OccSample g_samples[OCC_SAMPLES];
+static uint64_t g_sample_head; // Readings ever taken; slots by head % OCC_SAMPLES
+
+static int8_t g_cells[OCC_GRID_SIZE][OCC_GRID_SIZE];
+static bool g_known[OCC_GRID_SIZE][OCC_GRID_SIZE]; // On or next to a mission obstacle
+static uint32_t g_generation;
+
+static bool in_grid(int x, int y) {
+    return x >= 0 && x < OCC_GRID_SIZE && y >= 0 && y < OCC_GRID_SIZE;
+}
+
+static int cell_of(float cm) {
+    return (int)lroundf(cm / OCC_CELL_CM);
+}
+
+void occupancy_reset(const Obstacle obstacles[], int obstacle_count) {
+    pthread_mutex_lock(&g_lock);
+    memset(g_cells, 0, sizeof(g_cells));
+    memset(g_known, 0, sizeof(g_known));
+    for (int i = 0; i < obstacle_count; i++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            for (int dy = -1; dy <= 1; dy++) {
+                int x = obstacles[i].x + dx, y = obstacles[i].y + dy;
+                if (in_grid(x, y)) g_known[x][y] = true;
+            }
+        }
+    }
+    g_generation++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+void occupancy_range_sample(uint64_t rx_ns, int32_t enc_a, int32_t enc_d, unsigned ir_mm) {
+    pthread_mutex_lock(&g_lock);
+    g_samples[g_sample_head % OCC_SAMPLES] = (OccSample){ rx_ns, enc_a, enc_d, ir_mm };
+    g_sample_head++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+// g_lock held. Moves cell (x, y) by delta, noting a change to what occupancy_sensed() lists.
+static void cell_update(int x, int y, int delta) {
+    if (!in_grid(x, y) || g_known[x][y]) return;
+    int8_t was = g_cells[x][y];
+    int v = was + delta;
+    g_cells[x][y] = (int8_t)(v < OCC_MIN ? OCC_MIN : v > OCC_MAX ? OCC_MAX : v);
+    if ((was >= OCC_OCCUPIED) != (g_cells[x][y] >= OCC_OCCUPIED)) g_generation++;
+}
+
+// g_lock held. One reading from the robot's centre at (x_cm, y_cm) facing d.
+static void cast(float x_cm, float y_cm, int d, unsigned ir_mm) {
+    if (ir_mm == 0) return; // No reading
+    float dx = (float)HEADING[d][0], dy = (float)HEADING[d][1];
+    float ox = x_cm + dx * OCC_IR_OFFSET_CM, oy = y_cm + dy * OCC_IR_OFFSET_CM;
+    bool hit = ir_mm < OCC_RANGE_MAX_MM;
+    float range_cm = (hit ? ir_mm : OCC_RANGE_MAX_MM) / 10.0f;
+    float end_cm = range_cm + (hit ? OCC_HIT_DEPTH_CM : 0);
+    int hit_x = cell_of(ox + dx * end_cm), hit_y = cell_of(oy + dy * end_cm);
+    int last_x = -1, last_y = -1;
+    for (float s = 0; s < range_cm; s += OCC_STEP_CM) {
+        int x = cell_of(ox + dx * s), y = cell_of(oy + dy * s);
+        if ((x == last_x && y == last_y) || (hit && x == hit_x && y == hit_y)) continue;
+        cell_update(x, y, -OCC_MISS);
+        last_x = x;
+        last_y = y;
+    }
+    if (hit) cell_update(hit_x, hit_y, OCC_HIT);
+}
+
+static int valid_heading(int d) {
+    return (d == 0 || d == 2 || d == 4 || d == 6) ? d : -1;
+}
+
+int occupancy_observe_straight(const PlannerTrack* from, const PlannerTrack* to, uint64_t from_ns,
+                               uint64_t to_ns) {
+    int d = valid_heading(from->d);
+    if (d < 0 || to_ns <= from_ns) return 0;
+    pthread_mutex_lock(&g_lock);
+    uint64_t oldest = g_sample_head > OCC_SAMPLES ? g_sample_head - OCC_SAMPLES : 0;
+    uint64_t first = g_sample_head, last = g_sample_head;
+    for (uint64_t i = g_sample_head; i > oldest; i--) {
+        const OccSample* s = &g_samples[(i - 1) % OCC_SAMPLES];
+        if (s->rx_ns > to_ns) continue;
+        if (s->rx_ns <= from_ns) break;
+        if (last == g_sample_head) last = i - 1;
+        first = i - 1;
+    }
+    int cast_count = 0;
+    if (last < g_sample_head) {
+        // Travel from the reading before the straight, or its first
+        const OccSample* base = &g_samples[(first > oldest ? first - 1 : first) % OCC_SAMPLES];
+        const OccSample* end = &g_samples[last % OCC_SAMPLES];
+        float total = 0.5f * (float)(labs((long)end->enc_a - base->enc_a) + labs((long)end->enc_d - base->enc_d));
+        for (uint64_t i = first; i <= last; i++) {
+            const OccSample* s = &g_samples[i % OCC_SAMPLES];
+            float done = 0.5f * (float)(labs((long)s->enc_a - base->enc_a) + labs((long)s->enc_d - base->enc_d));
+            float f = total > 0 ? fminf(done / total, 1.0f) : 1.0f;
+            cast(from->x_cm + f * (float)(to->x_cm - from->x_cm), from->y_cm + f * (float)(to->y_cm - from->y_cm), d,
+                 s->ir_mm);
+            cast_count++;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return cast_count;
+}
+
+int occupancy_observe_at(const PlannerTrack* pose, uint64_t at_ns) {
+    int d = valid_heading(pose->d);
+    if (d < 0) return 0;
+    pthread_mutex_lock(&g_lock);
+    uint64_t oldest = g_sample_head > OCC_SAMPLES ? g_sample_head - OCC_SAMPLES : 0;
+    const OccSample* best = NULL;
+    uint64_t best_gap = (uint64_t)OCC_NEAREST_MS * 1000000ull + 1;
+    for (uint64_t i = g_sample_head; i > oldest; i--) {
+        const OccSample* s = &g_samples[(i - 1) % OCC_SAMPLES];
+        uint64_t gap = s->rx_ns > at_ns ? s->rx_ns - at_ns : at_ns - s->rx_ns;
+        if (gap < best_gap) {
+            best = s;
+            best_gap = gap;
+        } else if (s->rx_ns < at_ns) {
+            break; // Only further away from here back
+        }
+    }
+    if (best) cast((float)pose->x_cm, (float)pose->y_cm, d, best->ir_mm);
+    pthread_mutex_unlock(&g_lock);
+    return best != NULL;
+}
+
+int occupancy_sensed(PlannerCell out[], int max) {
+    int n = 0;
+    pthread_mutex_lock(&g_lock);
+    for (int x = 0; x < OCC_GRID_SIZE; x++) {
+        for (int y = 0; y < OCC_GRID_SIZE; y++) {
+            if (g_known[x][y] || g_cells[x][y] < OCC_OCCUPIED) continue;
+            if (n < max) out[n] = (PlannerCell){ x, y };
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    return n < max ? n : max;
+}
+
+uint32_t occupancy_generation(void) {
+    pthread_mutex_lock(&g_lock);
+    uint32_t generation = g_generation;
+    pthread_mutex_unlock(&g_lock);
+    return generation;
+}
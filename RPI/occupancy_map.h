@@ -0,0 +1,69 @@
+#ifndef OCCUPANCY_MAP_H
+#define OCCUPANCY_MAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "planner.h"      // For PlannerCell, PlannerTrack
+#include "shared_types.h" // For Obstacle
+
+/**
+ * @file occupancy_map.h
+ * @brief What the robot's own range sensor has seen of the arena, for replanning.
+ *
+ * One log-odds value per 10 cm planner cell. The reactor keeps the last
+ * OCC_SAMPLES range readings from the STM32's telemetry frames (the MDP
+ * firmware's front IR, stm32_protocol.h) with their encoder counts. The nav
+ * thread casts them once it knows where the robot was: over a straight, from
+ * the poses the route leaves the robot at before and after it, each reading
+ * placed by its share of the straight's encoder travel (which needs no
+ * distance scale); after a turn, only the reading nearest its DONE. Every
+ * reading lowers the cells its beam crosses and raises the one it ends in,
+ * if it ends inside OCC_RANGE_MAX_MM; a cell at OCC_OCCUPIED or above is
+ * occupied. Cells on or next to a mission obstacle are left alone, so what is
+ * left over is something Android's map does not have: a misplaced or missing
+ * obstacle, or anything else in the way.
+ *
+ * occupancy_sensed() lists those cells for planner_set_sensed(), and
+ * occupancy_generation() changes whenever the list would, so the nav thread
+ * checks the route ahead only when there is news. The poses are the route's,
+ * so a robot off its route sees its obstacles in the wrong cells; the known
+ * obstacles' margin takes up a cell of that.
+ *
+ * Thread-safe.
+ */
+
+#define OCC_SAMPLES 1024       // ~5 s of telemetry at 200 Hz: the longest straight
+#define OCC_RANGE_MAX_MM 600   // Beyond this the IR's fit no longer resolves a cell
+#define OCC_IR_OFFSET_CM 10    // Sensor ahead of the robot's centre
+#define OCC_HIT_DEPTH_CM 5     // A reading ends on a face; the body is behind it
+#define OCC_HIT 3              // Log-odds steps, clamped to [OCC_MIN, OCC_MAX]
+#define OCC_MISS 1
+#define OCC_MIN (-8)
+#define OCC_MAX 12
+#define OCC_OCCUPIED 6         // Two hits more than misses
+#define OCC_NEAREST_MS 50      // A turn's reading must be this close to its DONE
+
+// Starts a mission: every cell unknown, obstacles as the known ones.
+void occupancy_reset(const Obstacle obstacles[], int obstacle_count);
+
+// Reactor: one telemetry frame's range and encoder counts, received at rx_ns
+// (latency_now_ns() clock).
+void occupancy_range_sample(uint64_t rx_ns, int32_t enc_a, int32_t enc_d, unsigned ir_mm);
+
+// Casts the readings received over (from_ns, to_ns], during a straight that
+// took the robot from from to to facing from->d. Returns how many were cast.
+int occupancy_observe_straight(const PlannerTrack* from, const PlannerTrack* to, uint64_t from_ns,
+                               uint64_t to_ns);
+
+// Casts the reading nearest at_ns (within OCC_NEAREST_MS) from pose. Returns
+// 1, or 0 if there was none.
+int occupancy_observe_at(const PlannerTrack* pose, uint64_t at_ns);
+
+// Occupied cells no known obstacle explains, up to max. Returns the count.
+int occupancy_sensed(PlannerCell out[], int max);
+
+// Changes whenever a cell becomes or stops being one occupancy_sensed() lists
+uint32_t occupancy_generation(void);
+
+#endif // OCCUPANCY_MAP_H
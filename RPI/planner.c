@@ -0,0 +1,1248 @@
+#include "planner.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Arena and motion constants, matching mdp_algo_v13/algorithms/utils/consts.py
+#define PLAN_GRID_SIZE 20
+#define PLAN_MIN_PADDING 1    // Robot centre must stay within [1, 18]
+#define PLAN_MAX_PADDING 18
+#define PLAN_EXPANDED_CELL 2  // Clearance box around every obstacle
+#define PLAN_TURN_RADIUS 3    // 90-degree turns displace the robot 3 cells on each axis
+#define PLAN_TURN_COST 20
+#define PLAN_TURN_MOVE_COST (PLAN_TURN_COST + PLAN_TURN_RADIUS) // What a turn costs the search
+#define PLAN_SCREENSHOT_COST 50
+#define PLAN_VIEW_DISTANCE 3  // Cells between obstacle and camera position
+#define PLAN_CELL_CM 10
+#define PLAN_MAX_STRAIGHT_CM 90 // Longest single FW/BW the server emits
+#define PLAN_SLOW_SLACK 0     // Speed classes (consts.py section 6, commands/speed.py)
+#define PLAN_FAST_SLACK 2
+#define PLAN_FAST_MIN_CM 50
+
+#define PLAN_STATE_COUNT (PLAN_GRID_SIZE * PLAN_GRID_SIZE * 4)
+#define PLAN_MAX_NEIGHBORS 6   // FW, BW, FL, FR, BL, BR
+#define PLAN_INF (INT_MAX / 4)
+
+// Robot pose on the grid. d is 0/2/4/6 (N/E/S/W).
+typedef struct {
+    int x;
+    int y;
+    int d;
+} PlanPose;
+
+typedef struct {
+    PlanPose pose;
+    int penalty;      // Extra cost for photographing from this spot
+    int obstacle_id;
+    bool valid;
+} ViewPoint;
+
+// Blocked cells as one bitboard row per y: bit (x + PLAN_BOARD_MARGIN) of
+// rows[y + PLAN_BOARD_MARGIN] is cell (x, y). The margin is always blocked, so a
+// move's footprint can be tested from any in-grid pose without bounds checks.
+#define PLAN_BOARD_MARGIN 3   // Farthest cell a move touches (a turn's 3-cell offset)
+#define PLAN_BOARD_SIZE (PLAN_GRID_SIZE + 2 * PLAN_BOARD_MARGIN)
+_Static_assert(PLAN_BOARD_SIZE <= 32, "bitboard rows are uint32_t");
+
+typedef struct {
+    uint32_t rows[PLAN_BOARD_SIZE];
+    int moves; // Moves searched per heading: the first this many of each FootprintSet
+} PlanGrid;
+
+// One move from a given heading: where it ends, and every cell the robot body
+// touches on the way as row masks relative to the start (bit dx + PLAN_BOARD_MARGIN
+// of mask[k] is cell (dx, first_dy + k)).
+typedef struct {
+    int dx, dy, d;
+    int cost;
+    int first_dy;
+    int row_count;
+    uint32_t mask[PLAN_TURN_RADIUS + 1];
+} Footprint;
+
+typedef struct {
+    Footprint moves[PLAN_MAX_NEIGHBORS];
+    int count;
+} FootprintSet;
+
+typedef struct {
+    double f;
+    int g;
+    int state;
+} HeapEntry;
+
+typedef struct {
+    HeapEntry entries[PLAN_STATE_COUNT * PLAN_MAX_NEIGHBORS + 1];
+    int size;
+} PlanHeap;
+
+// Per-search scratch, kept static so a search does not put ~100 KB on the nav thread's stack
+typedef struct {
+    int g[PLAN_STATE_COUNT];
+    int parent[PLAN_STATE_COUNT];
+    bool closed[PLAN_STATE_COUNT];
+    PlanHeap heap;
+} AStarScratch;
+
+static AStarScratch g_scratch;
+
+static int state_index(PlanPose p) {
+    return (p.x * PLAN_GRID_SIZE + p.y) * 4 + p.d / 2;
+}
+
+static PlanPose state_pose(int idx) {
+    PlanPose p;
+    p.d = (idx % 4) * 2;
+    idx /= 4;
+    p.y = idx % PLAN_GRID_SIZE;
+    p.x = idx / PLAN_GRID_SIZE;
+    return p;
+}
+
+// planner_set_sensed()'s cells, as grid_build() takes obstacle cells
+static uint32_t g_sensed[PLAN_BOARD_SIZE];
+
+static void grid_build(PlanGrid* grid, const Obstacle obstacles[], int obstacle_count) {
+    const uint32_t board = (uint32_t)((1ull << PLAN_BOARD_SIZE) - 1);
+    const uint32_t inside = ((1u << (PLAN_MAX_PADDING - PLAN_MIN_PADDING + 1)) - 1) << (PLAN_MIN_PADDING + PLAN_BOARD_MARGIN);
+
+    // Obstacle cells; any farther out than the margin cannot reach the arena
+    uint32_t occupied[PLAN_BOARD_SIZE];
+    memcpy(occupied, g_sensed, sizeof(occupied));
+    for (int i = 0; i < obstacle_count; i++) {
+        int bx = obstacles[i].x + PLAN_BOARD_MARGIN, by = obstacles[i].y + PLAN_BOARD_MARGIN;
+        if (bx < 0 || bx >= PLAN_BOARD_SIZE || by < 0 || by >= PLAN_BOARD_SIZE) continue;
+        occupied[by] |= 1u << bx;
+    }
+
+    // Dilate by the clearance box: shifts along each row, then OR across rows
+    uint32_t wide[PLAN_BOARD_SIZE];
+    for (int y = 0; y < PLAN_BOARD_SIZE; y++) {
+        uint32_t row = occupied[y], w = row;
+        for (int s = 1; s <= PLAN_EXPANDED_CELL; s++) w |= (row << s) | (row >> s);
+        wide[y] = w;
+    }
+    for (int y = 0; y < PLAN_BOARD_SIZE; y++) {
+        uint32_t blocked = 0;
+        for (int dy = -PLAN_EXPANDED_CELL; dy <= PLAN_EXPANDED_CELL; dy++) {
+            if (y + dy >= 0 && y + dy < PLAN_BOARD_SIZE) blocked |= wide[y + dy];
+        }
+        int gy = y - PLAN_BOARD_MARGIN;
+        bool row_inside = gy >= PLAN_MIN_PADDING && gy <= PLAN_MAX_PADDING;
+        grid->rows[y] = (blocked | ~(row_inside ? inside : 0)) & board;
+    }
+    grid->moves = PLAN_MAX_NEIGHBORS;
+}
+
+static bool grid_reachable(const PlanGrid* grid, int x, int y) {
+    if (x < 0 || x >= PLAN_GRID_SIZE || y < 0 || y >= PLAN_GRID_SIZE) return false;
+    return !((grid->rows[y + PLAN_BOARD_MARGIN] >> (x + PLAN_BOARD_MARGIN)) & 1u);
+}
+
+// Moves per heading / 2, in the server's neighbour order (ties break the same way)
+static FootprintSet g_footprints[4];
+enum { PLAN_MOVE_FW, PLAN_MOVE_BW, PLAN_MOVE_FL, PLAN_MOVE_FR, PLAN_MOVE_BL, PLAN_MOVE_BR };
+#define PLAN_FORWARD_MOVES PLAN_MOVE_BL // FW, BW, FL and FR come first
+
+static void footprint_add(FootprintSet* set, int dx, int dy, int d, int cost, const int cells[][2], int cell_count) {
+    Footprint* fp = &set->moves[set->count++];
+    *fp = (Footprint){dx, dy, d, cost, 0, 0, {0}};
+    int lo = cells[0][1], hi = cells[0][1];
+    for (int i = 1; i < cell_count; i++) {
+        if (cells[i][1] < lo) lo = cells[i][1];
+        if (cells[i][1] > hi) hi = cells[i][1];
+    }
+    fp->first_dy = lo;
+    fp->row_count = hi - lo + 1;
+    for (int i = 0; i < cell_count; i++) fp->mask[cells[i][1] - lo] |= 1u << (cells[i][0] + PLAN_BOARD_MARGIN);
+}
+
+// Builds g_footprints (algorithms/pathfinding/lattice.py); the motion model is fixed,
+// so this runs once.
+static void footprints_build(void) {
+    static bool built = false;
+    if (built) return;
+    static const int STEP[8][2] = {{0, 1}, {0, 0}, {1, 0}, {0, 0}, {0, -1}, {0, 0}, {-1, 0}, {0, 0}};
+    const int r = PLAN_TURN_RADIUS;
+    // (dx, dy, new heading) per turn, indexed by heading / 2
+    const int TURNS[4][4][3] = {
+        {{-r, r, 6}, {r, r, 0}, {r, -r, 2}, {-r, -r, 4}},   // FL: N->W, E->N, S->E, W->S
+        {{r, r, 2}, {r, -r, 4}, {-r, -r, 6}, {-r, r, 0}},   // FR: N->E, E->S, S->W, W->N
+        {{-r, -r, 2}, {-r, r, 4}, {r, r, 6}, {r, -r, 0}},   // BL: N->E, E->S, S->W, W->N
+        {{r, -r, 6}, {-r, -r, 0}, {-r, r, 2}, {r, r, 4}},   // BR: N->W, E->N, S->E, W->S
+    };
+
+    for (int h = 0; h < 4; h++) {
+        FootprintSet* set = &g_footprints[h];
+        set->count = 0;
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            const int cell[1][2] = {{STEP[h * 2][0] * sign, STEP[h * 2][1] * sign}};
+            footprint_add(set, cell[0][0], cell[0][1], h * 2, 1, cell, 1);
+        }
+        for (int t = 0; t < 4; t++) {
+            const int* turn = TURNS[t][h];
+            int tdx = turn[0], tdy = turn[1];
+            // Destination plus the cells swept by the robot body during the arc,
+            // so it cannot clip a corner
+            int sx = tdx > 0 ? 1 : -1, sy = tdy > 0 ? 1 : -1;
+            const int cells[9][2] = {
+                {tdx, tdy}, {sx, 0}, {0, sy}, {sx, sy}, {2 * sx, sy}, {sx, 2 * sy}, {2 * sx, 2 * sy},
+                {2 * sx, 3 * sy}, {3 * sx, 2 * sy}
+            };
+            footprint_add(set, tdx, tdy, turn[2], PLAN_TURN_MOVE_COST, cells, 9);
+        }
+    }
+    built = true;
+}
+
+// --- A* over (x, y, heading) ---
+
+static void heap_push(PlanHeap* heap, double f, int g, int state) {
+    int i = heap->size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->entries[parent].f <= f) break;
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
+    }
+    heap->entries[i] = (HeapEntry){f, g, state};
+}
+
+static HeapEntry heap_pop(PlanHeap* heap) {
+    HeapEntry top = heap->entries[0];
+    HeapEntry last = heap->entries[--heap->size];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap->size) break;
+        if (child + 1 < heap->size && heap->entries[child + 1].f < heap->entries[child].f) child++;
+        if (heap->entries[child].f >= last.f) break;
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    heap->entries[i] = last;
+    return top;
+}
+
+static double heuristic(PlanPose a, PlanPose b) {
+    double dx = a.x - b.x, dy = a.y - b.y;
+    return sqrt(dx * dx + dy * dy);
+}
+
+// True if move fp from p, an in-grid pose, touches a blocked cell: one AND per row
+static bool footprint_hits(const PlanGrid* grid, PlanPose p, const Footprint* fp) {
+    const uint32_t* rows = &grid->rows[p.y + fp->first_dy + PLAN_BOARD_MARGIN];
+    uint32_t hit = 0;
+    for (int k = 0; k < fp->row_count; k++) hit |= (rows[k] >> p.x) & fp->mask[k];
+    return hit != 0;
+}
+
+// Fills out[] with the poses reachable in one move from p (algorithms/pathfinding/astar.py).
+// A move is legal if its footprint, shifted to p, hits no blocked bit.
+static int get_neighbors(const PlanGrid* grid, PlanPose p, PlanPose out[], int costs[]) {
+    const FootprintSet* set = &g_footprints[p.d / 2];
+    int n = 0;
+    for (int m = 0; m < set->count && m < grid->moves; m++) {
+        const Footprint* fp = &set->moves[m];
+        if (footprint_hits(grid, p, fp)) continue;
+
+        out[n] = (PlanPose){p.x + fp->dx, p.y + fp->dy, fp->d};
+        costs[n++] = fp->cost;
+    }
+    return n;
+}
+
+// Returns the cost from start to goal, or -1 if unreachable. If path is non-NULL
+// it receives the poses from start to goal and *path_len their count.
+static int astar_search(const PlanGrid* grid, PlanPose start, PlanPose goal, PlanPose* path, int* path_len) {
+    AStarScratch* s = &g_scratch;
+    for (int i = 0; i < PLAN_STATE_COUNT; i++) {
+        s->g[i] = PLAN_INF;
+        s->closed[i] = false;
+    }
+    s->heap.size = 0;
+
+    int start_idx = state_index(start), goal_idx = state_index(goal);
+    s->g[start_idx] = 0;
+    s->parent[start_idx] = -1;
+    heap_push(&s->heap, heuristic(start, goal), 0, start_idx);
+
+    while (s->heap.size > 0) {
+        HeapEntry cur = heap_pop(&s->heap);
+        if (cur.state == goal_idx) {
+            if (path) {
+                int len = 0;
+                for (int idx = goal_idx; idx != -1; idx = s->parent[idx]) len++;
+                *path_len = len;
+                for (int idx = goal_idx; idx != -1; idx = s->parent[idx]) path[--len] = state_pose(idx);
+            }
+            return cur.g;
+        }
+        if (s->closed[cur.state]) continue;
+        s->closed[cur.state] = true;
+
+        PlanPose neighbors[PLAN_MAX_NEIGHBORS];
+        int costs[PLAN_MAX_NEIGHBORS];
+        int n = get_neighbors(grid, state_pose(cur.state), neighbors, costs);
+        for (int i = 0; i < n; i++) {
+            int idx = state_index(neighbors[i]);
+            if (s->closed[idx]) continue;
+            int g = s->g[cur.state] + costs[i];
+            if (g < s->g[idx]) {
+                s->g[idx] = g;
+                s->parent[idx] = cur.state;
+                heap_push(&s->heap, g + heuristic(neighbors[i], goal), g, idx);
+            }
+        }
+    }
+    return -1;
+}
+
+#define PLAN_UNREACHED INT16_MIN // Parent of a state the search did not reach
+
+// Searches every state reachable from start (Dijkstra: A* with no goal). Leaves
+// each state's cost in g_scratch.g, PLAN_INF if unreachable, and writes the
+// search tree to parent (-1 at start, PLAN_UNREACHED where it did not get), from
+// which path_from_tree() reads the way to any of them.
+static void search_tree(const PlanGrid* grid, PlanPose start, int16_t parent[]) {
+    _Static_assert(PLAN_STATE_COUNT <= INT16_MAX, "states fit the int16_t tree");
+    AStarScratch* s = &g_scratch;
+    for (int i = 0; i < PLAN_STATE_COUNT; i++) {
+        s->g[i] = PLAN_INF;
+        s->closed[i] = false;
+        parent[i] = PLAN_UNREACHED;
+    }
+    s->heap.size = 0;
+
+    int start_idx = state_index(start);
+    s->g[start_idx] = 0;
+    parent[start_idx] = -1;
+    heap_push(&s->heap, 0, 0, start_idx);
+    while (s->heap.size > 0) {
+        HeapEntry cur = heap_pop(&s->heap);
+        if (s->closed[cur.state]) continue;
+        s->closed[cur.state] = true;
+
+        PlanPose neighbors[PLAN_MAX_NEIGHBORS];
+        int costs[PLAN_MAX_NEIGHBORS];
+        int n = get_neighbors(grid, state_pose(cur.state), neighbors, costs);
+        for (int i = 0; i < n; i++) {
+            int idx = state_index(neighbors[i]);
+            int g = cur.g + costs[i];
+            if (s->closed[idx] || g >= s->g[idx]) continue;
+            s->g[idx] = g;
+            parent[idx] = (int16_t)cur.state;
+            heap_push(&s->heap, g, g, idx);
+        }
+    }
+}
+
+// Poses from the tree's root to goal, which the tree must reach. Returns their count.
+static int path_from_tree(const int16_t parent[], PlanPose goal, PlanPose path[]) {
+    int goal_idx = state_index(goal);
+    int len = 0;
+    for (int idx = goal_idx; idx != -1; idx = parent[idx]) len++;
+    int n = len;
+    for (int idx = goal_idx; idx != -1; idx = parent[idx]) path[--len] = state_pose(idx);
+    return n;
+}
+
+// --- Viewing positions ---
+
+// Fills cand[4] with the camera positions for an image on face (0/2/4/6) of obs,
+// in the server's order of preference. Returns false for an unknown face.
+static bool view_candidates(const Obstacle* obs, int face, ViewPoint cand[4]) {
+    const int o1 = PLAN_VIEW_DISTANCE, o2 = PLAN_VIEW_DISTANCE + 1;
+    switch (face) {
+        case 0: // Image faces north: stand north of it, facing south
+            cand[0] = (ViewPoint){{obs->x, obs->y + o1, 4}, 0, obs->id, true};
+            cand[1] = (ViewPoint){{obs->x, obs->y + o2, 4}, 5, obs->id, true};
+            cand[2] = (ViewPoint){{obs->x - 1, obs->y + o1, 4}, PLAN_SCREENSHOT_COST, obs->id, true};
+            cand[3] = (ViewPoint){{obs->x + 1, obs->y + o1, 4}, PLAN_SCREENSHOT_COST, obs->id, true};
+            return true;
+        case 4:
+            cand[0] = (ViewPoint){{obs->x, obs->y - o1, 0}, 0, obs->id, true};
+            cand[1] = (ViewPoint){{obs->x, obs->y - o2, 0}, 5, obs->id, true};
+            cand[2] = (ViewPoint){{obs->x - 1, obs->y - o1, 0}, PLAN_SCREENSHOT_COST, obs->id, true};
+            cand[3] = (ViewPoint){{obs->x + 1, obs->y - o1, 0}, PLAN_SCREENSHOT_COST, obs->id, true};
+            return true;
+        case 2:
+            cand[0] = (ViewPoint){{obs->x + o1, obs->y, 6}, 0, obs->id, true};
+            cand[1] = (ViewPoint){{obs->x + o2, obs->y, 6}, 5, obs->id, true};
+            cand[2] = (ViewPoint){{obs->x + o1, obs->y - 1, 6}, PLAN_SCREENSHOT_COST, obs->id, true};
+            cand[3] = (ViewPoint){{obs->x + o1, obs->y + 1, 6}, PLAN_SCREENSHOT_COST, obs->id, true};
+            return true;
+        case 6:
+            cand[0] = (ViewPoint){{obs->x - o1, obs->y, 2}, 0, obs->id, true};
+            cand[1] = (ViewPoint){{obs->x - o2, obs->y, 2}, 5, obs->id, true};
+            cand[2] = (ViewPoint){{obs->x - o1, obs->y - 1, 2}, PLAN_SCREENSHOT_COST, obs->id, true};
+            cand[3] = (ViewPoint){{obs->x - o1, obs->y + 1, 2}, PLAN_SCREENSHOT_COST, obs->id, true};
+            return true;
+        default:
+            return false; // No known image face
+    }
+}
+
+// Picks the camera position for one obstacle: the first candidate that is free and
+// reachable from the start, else the first free one, as the server does.
+static ViewPoint select_view_point(const PlanGrid* grid, const Obstacle* obs, PlanPose start) {
+    ViewPoint none = {{-1, -1, 0}, 0, obs->id, false};
+    ViewPoint cand[4];
+    if (!view_candidates(obs, obs->d, cand)) return none;
+
+    int first_free = -1;
+    for (int i = 0; i < 4; i++) {
+        if (!grid_reachable(grid, cand[i].pose.x, cand[i].pose.y)) continue;
+        if (first_free < 0) first_free = i;
+        if (astar_search(grid, start, cand[i].pose, NULL, NULL) >= 0) return cand[i];
+    }
+    return first_free >= 0 ? cand[first_free] : none;
+}
+
+// --- Held-Karp ---
+
+// The table holds saturating 16-bit costs, so one 128-bit vector covers 8
+// successors and sums need no overflow checks. A finite leg never exceeds
+// HK_MAX_LEG (far beyond any path on the grid), so a full route stays below HK_INF.
+#define HK_INF UINT16_MAX
+#define HK_MAX_LEG ((HK_INF - 1) / PLANNER_MAX_TARGETS)
+// From this many targets each subset layer is split across HK_MAX_THREADS threads
+#define HK_THREAD_MIN_TARGETS 15
+#define HK_MAX_THREADS 4
+#define HK_BLOCK_MASKS 64 // Consecutive masks a thread takes at a time
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HK_USE_AVX2 1
+#define HK_LANES 16
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HK_USE_NEON 1
+#define HK_LANES 8
+#else
+#define HK_LANES 8
+#endif
+
+typedef struct {
+    uint16_t* dp;       // dp[mask * stride + n]: cheapest open route over mask ending at n
+    const uint16_t* leg; // leg[j * stride + n]: cost j -> n, HK_INF padded to stride
+    int k;
+    int stride;         // k rounded up to HK_LANES
+    size_t masks;
+} HkTable;
+
+typedef struct {
+    const HkTable* table;
+    int layer;  // Popcount of the masks extended
+    int share;  // This job's HK_BLOCK_MASKS blocks are share, share + shares, ...
+    int shares;
+} HkJob;
+
+static inline uint16_t hk_add(uint16_t a, uint16_t b) {
+    unsigned sum = (unsigned)a + b;
+    return sum > HK_INF ? HK_INF : (uint16_t)sum;
+}
+
+// out[n] = min over j in mask of dp[mask][j] + leg[j][n], for every n < stride:
+// a min-plus product of mask's row with the leg rows, one successor per lane.
+static void hk_extend_row(const HkTable* t, size_t mask, uint16_t* out) {
+    const uint16_t* row = t->dp + mask * (size_t)t->stride;
+    for (int v = 0; v < t->stride; v += HK_LANES) {
+#if defined(HK_USE_AVX2)
+        __m256i best = _mm256_set1_epi16((short)HK_INF);
+        for (size_t bits = mask; bits; bits &= bits - 1) {
+            int j = __builtin_ctzl(bits);
+            if (row[j] == HK_INF) continue;
+            __m256i leg = _mm256_loadu_si256((const __m256i*)(t->leg + (size_t)j * t->stride + v));
+            best = _mm256_min_epu16(best, _mm256_adds_epu16(_mm256_set1_epi16((short)row[j]), leg));
+        }
+        _mm256_storeu_si256((__m256i*)(out + v), best);
+#elif defined(HK_USE_NEON)
+        uint16x8_t best = vdupq_n_u16(HK_INF);
+        for (size_t bits = mask; bits; bits &= bits - 1) {
+            int j = __builtin_ctzl(bits);
+            if (row[j] == HK_INF) continue;
+            uint16x8_t leg = vld1q_u16(t->leg + (size_t)j * t->stride + v);
+            best = vminq_u16(best, vqaddq_u16(vdupq_n_u16(row[j]), leg));
+        }
+        vst1q_u16(out + v, best);
+#else
+        uint16_t best[HK_LANES];
+        for (int n = 0; n < HK_LANES; n++) best[n] = HK_INF;
+        for (size_t bits = mask; bits; bits &= bits - 1) {
+            int j = __builtin_ctzl(bits);
+            if (row[j] == HK_INF) continue;
+            const uint16_t* leg = t->leg + (size_t)j * t->stride + v;
+            // Branch-free so the compiler can vectorize it for whatever the target has
+            for (int n = 0; n < HK_LANES; n++) {
+                unsigned c = (unsigned)row[j] + leg[n];
+                c = c > HK_INF ? HK_INF : c;
+                best[n] = c < best[n] ? (uint16_t)c : best[n];
+            }
+        }
+        memcpy(out + v, best, sizeof(best));
+#endif
+    }
+}
+
+// Every route over a mask of job->layer targets, extended by each target not in it.
+// dp[mask | n][n] has exactly one predecessor mask, so the layer's masks write
+// disjoint entries and its jobs need no locking.
+static void* hk_extend_layer(void* arg) {
+    const HkJob* job = arg;
+    const HkTable* t = job->table;
+    uint16_t out[PLANNER_MAX_TARGETS + HK_LANES];
+    size_t full = t->masks - 1;
+    for (size_t block = (size_t)job->share * HK_BLOCK_MASKS; block < t->masks;
+         block += (size_t)job->shares * HK_BLOCK_MASKS) {
+        size_t end = block + HK_BLOCK_MASKS < t->masks ? block + HK_BLOCK_MASKS : t->masks;
+        for (size_t mask = block; mask < end; mask++) {
+            if (__builtin_popcountl(mask) != job->layer) continue;
+            hk_extend_row(t, mask, out);
+            for (size_t bits = full & ~mask; bits; bits &= bits - 1) {
+                int n = __builtin_ctzl(bits);
+                t->dp[(mask | ((size_t)1 << n)) * t->stride + n] = out[n];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Runs one layer on up to threads threads, the caller taking the first share.
+// A thread that cannot be started has its share run here instead.
+static void hk_run_layer(const HkTable* t, int layer, int threads) {
+    HkJob jobs[HK_MAX_THREADS];
+    pthread_t tids[HK_MAX_THREADS];
+    bool started[HK_MAX_THREADS] = {false};
+    pthread_attr_t attr;
+    if (threads > 1) {
+        // The nav thread may be SCHED_FIFO; helpers are put back on SCHED_OTHER
+        pthread_attr_init(&attr);
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+        pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 64 * 1024);
+    }
+    for (int i = 0; i < threads; i++) {
+        jobs[i] = (HkJob){t, layer, i, threads};
+        if (i > 0) started[i] = pthread_create(&tids[i], &attr, hk_extend_layer, &jobs[i]) == 0;
+    }
+    hk_extend_layer(&jobs[0]);
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) pthread_join(tids[i], NULL);
+        else hk_extend_layer(&jobs[i]);
+    }
+    if (threads > 1) pthread_attr_destroy(&attr);
+}
+
+// Finds the visiting order that photographs as many targets as possible at the
+// lowest cost. cost[i][j] is the leg cost between nodes (0 = start). The route is
+// open: it ends at the last target. Returns the number of targets in order[].
+// Subsets are extended a popcount layer at a time (see hk_extend_layer()); the
+// table is scratch, allocated and freed here.
+static int solve_visit_order(int k, int cost[][PLANNER_MAX_TARGETS + 1], int order[]) {
+    int stride = (k + HK_LANES - 1) / HK_LANES * HK_LANES;
+    size_t masks = (size_t)1 << k;
+    uint16_t* leg = malloc((size_t)k * stride * sizeof(uint16_t));
+    uint16_t* dp = malloc(masks * stride * sizeof(uint16_t));
+    if (!leg || !dp) {
+        fprintf(stderr, "[Planner] Out of memory for the visiting order (%d targets).\n", k);
+        free(leg);
+        free(dp);
+        return 0;
+    }
+    for (size_t i = 0; i < (size_t)k * stride; i++) leg[i] = HK_INF;
+    for (int j = 0; j < k; j++) {
+        for (int n = 0; n < k; n++) {
+            int c = cost[j + 1][n + 1];
+            if (j != n && c <= HK_MAX_LEG) leg[j * stride + n] = (uint16_t)c;
+        }
+    }
+    for (size_t i = 0; i < masks * stride; i++) dp[i] = HK_INF;
+    for (int j = 0; j < k; j++) {
+        int c = cost[0][j + 1];
+        if (c <= HK_MAX_LEG) dp[((size_t)1 << j) * stride + j] = (uint16_t)c;
+    }
+
+    HkTable table = {dp, leg, k, stride, masks};
+    int threads = 1;
+    if (k >= HK_THREAD_MIN_TARGETS) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > HK_MAX_THREADS ? HK_MAX_THREADS : (int)cpus;
+    }
+    for (int layer = 1; layer < k; layer++) hk_run_layer(&table, layer, threads);
+
+    // Prefer visiting more targets; break ties on cost.
+    int best_count = 0, best_last = -1;
+    uint16_t best_cost = HK_INF;
+    size_t best_mask = 0;
+    for (size_t mask = 1; mask < masks; mask++) {
+        int count = __builtin_popcountl(mask);
+        if (count < best_count) continue;
+        for (int j = 0; j < k; j++) {
+            uint16_t c = dp[mask * stride + j];
+            if (c == HK_INF) continue;
+            if (count > best_count || c < best_cost) {
+                best_count = count;
+                best_cost = c;
+                best_last = j;
+                best_mask = mask;
+            }
+        }
+    }
+
+    // No predecessor table: each step back is the lowest j whose extension gives
+    // the entry's cost, which is the one the first-minimum scan would have kept.
+    for (int pos = best_count - 1, n = best_last; pos >= 0; pos--) {
+        order[pos] = n;
+        size_t from = best_mask & ~((size_t)1 << n);
+        uint16_t c = dp[best_mask * stride + n];
+        int p = -1;
+        for (size_t bits = from; bits && p < 0; bits &= bits - 1) {
+            int j = __builtin_ctzl(bits);
+            if (hk_add(dp[from * stride + j], leg[j * stride + n]) == c) p = j;
+        }
+        best_mask = from;
+        n = p;
+    }
+    free(leg);
+    free(dp);
+    return best_count;
+}
+
+// --- Command generation (mirrors algorithms/commands/generator.py) ---
+
+typedef struct {
+    Arena* arena;
+    CommandList* commands;
+    const Obstacle* obstacles; // For speed classes
+    int obstacle_count;
+    CommandType straight_type;
+    int straight_cm;    // Pending merged FW/BW distance
+    int straight_slack; // Least slack the pending straight has entered
+    bool out_of_memory;
+} CommandWriter;
+
+// Free cells (Chebyshev) from (x, y) to the nearest obstacle's clearance box;
+// the arena padding does not count, as in the server's speed.slack()
+static int writer_slack(const CommandWriter* w, int x, int y) {
+    int slack = 2 * PLAN_GRID_SIZE;
+    for (int i = 0; i < w->obstacle_count; i++) {
+        int dx = abs(w->obstacles[i].x - x), dy = abs(w->obstacles[i].y - y);
+        int s = (dx > dy ? dx : dy) - PLAN_EXPANDED_CELL - 1;
+        if (s < slack) slack = s;
+    }
+    return slack;
+}
+
+// Least slack of a turn: at both ends and 45 degrees round the arc
+static int writer_turn_slack(const CommandWriter* w, PlanPose prev, PlanPose cur) {
+    static const int heading[8][2] = { [0] = {0, 1}, [2] = {1, 0}, [4] = {0, -1}, [6] = {-1, 0} };
+    int hx = heading[prev.d][0], hy = heading[prev.d][1];
+    int dx = cur.x - prev.x, dy = cur.y - prev.y;
+    int forward = dx * hx + dy * hy;
+    int side_x = dx - forward * hx, side_y = dy - forward * hy;
+    int mid_x = prev.x + (int)lround(forward * hx * M_SQRT1_2) + (int)lround(side_x * (1.0 - M_SQRT1_2));
+    int mid_y = prev.y + (int)lround(forward * hy * M_SQRT1_2) + (int)lround(side_y * (1.0 - M_SQRT1_2));
+    int slack = writer_slack(w, prev.x, prev.y);
+    int s = writer_slack(w, mid_x, mid_y);
+    if (s < slack) slack = s;
+    s = writer_slack(w, cur.x, cur.y);
+    return s < slack ? s : slack;
+}
+
+static void writer_emit(CommandWriter* w, CommandType type, int value, SpeedClass speed) {
+    if (command_list_push(w->arena, w->commands, (Command){type, value, speed}) != 0) w->out_of_memory = true;
+}
+
+static void writer_flush_straight(CommandWriter* w) {
+    SpeedClass speed = SPEED_NORMAL;
+    if (w->straight_slack <= PLAN_SLOW_SLACK) speed = SPEED_SLOW;
+    else if (w->straight_slack >= PLAN_FAST_SLACK && w->straight_cm >= PLAN_FAST_MIN_CM) speed = SPEED_FAST;
+    while (w->straight_cm > 0) {
+        int chunk = w->straight_cm > PLAN_MAX_STRAIGHT_CM ? PLAN_MAX_STRAIGHT_CM : w->straight_cm;
+        writer_emit(w, w->straight_type, chunk, speed);
+        w->straight_cm -= chunk;
+    }
+}
+
+static void writer_straight(CommandWriter* w, CommandType type, int cm, int slack) {
+    if (w->straight_cm > 0 && w->straight_type != type) writer_flush_straight(w);
+    if (w->straight_cm == 0 || slack < w->straight_slack) w->straight_slack = slack;
+    w->straight_type = type;
+    w->straight_cm += cm;
+}
+
+// Drives the poses segment[len] and photographs target at the end.
+static void writer_leg(CommandWriter* w, const PlanPose segment[], int len, const ViewPoint* target,
+                       SnapList* snap_positions) {
+    for (int i = 1; i < len; i++) {
+        PlanPose prev = segment[i - 1], cur = segment[i];
+        if (prev.d == cur.d) {
+            int dx = cur.x - prev.x, dy = cur.y - prev.y;
+            bool forward = (prev.d == 0 && dy > 0) || (prev.d == 4 && dy < 0) ||
+                           (prev.d == 2 && dx > 0) || (prev.d == 6 && dx < 0);
+            writer_straight(w, forward ? CMD_MOVE_FORWARD : CMD_MOVE_BACKWARD, PLAN_CELL_CM,
+                            writer_slack(w, cur.x, cur.y));
+        } else {
+            // Like the server's generator, a turn is encoded by its heading change
+            // alone, so reverse turns come out as FL90/FR90 too.
+            writer_flush_straight(w);
+            int diff = ((cur.d - prev.d) % 8 + 8) % 8;
+            // Turns are never fast: the turn primitives are measured at the normal speed
+            SpeedClass speed = writer_turn_slack(w, prev, cur) <= PLAN_SLOW_SLACK ? SPEED_SLOW : SPEED_NORMAL;
+            writer_emit(w, diff == 6 ? CMD_TURN_LEFT : CMD_TURN_RIGHT, 90, speed);
+            if (diff == 4) writer_emit(w, CMD_TURN_RIGHT, 90, speed);
+        }
+    }
+
+    writer_flush_straight(w);
+    writer_emit(w, CMD_SNAPSHOT, target->obstacle_id, SPEED_NORMAL);
+    if (snap_list_push(w->arena, snap_positions, (SnapPosition){target->pose.x, target->pose.y, target->pose.d}) != 0) {
+        w->out_of_memory = true;
+    }
+}
+
+static int plan_route(const Obstacle obstacles[], int obstacle_count,
+                      int robot_x, int robot_y, int robot_dir, int moves,
+                      Arena* arena, CommandList* commands, SnapList* snap_positions) {
+    *commands = (CommandList){0};
+    *snap_positions = (SnapList){0};
+    if (obstacle_count <= 0 || obstacle_count > PLANNER_MAX_TARGETS) {
+        fprintf(stderr, "[Planner] %d obstacles is outside the native planner's range.\n", obstacle_count);
+        return -1;
+    }
+
+    if (robot_x < 0 || robot_x >= PLAN_GRID_SIZE || robot_y < 0 || robot_y >= PLAN_GRID_SIZE) {
+        fprintf(stderr, "[Planner] Robot start (%d, %d) is off the grid.\n", robot_x, robot_y);
+        return -1;
+    }
+
+    PlanGrid grid;
+    footprints_build();
+    grid_build(&grid, obstacles, obstacle_count);
+    grid.moves = moves;
+    int start_dir = (robot_dir == 0 || robot_dir == 2 || robot_dir == 4 || robot_dir == 6) ? robot_dir : 0;
+    PlanPose start = {robot_x, robot_y, start_dir};
+
+    int k = obstacle_count;
+    ViewPoint views[PLANNER_MAX_TARGETS];
+    for (int i = 0; i < k; i++) views[i] = select_view_point(&grid, &obstacles[i], start);
+
+    // Leg costs between the start (node 0) and every viewing position
+    int cost[PLANNER_MAX_TARGETS + 1][PLANNER_MAX_TARGETS + 1];
+    for (int i = 0; i <= k; i++) {
+        for (int j = 0; j <= k; j++) {
+            if (i == j || j == 0) {
+                cost[i][j] = 0;
+                continue;
+            }
+            const ViewPoint* to = &views[j - 1];
+            PlanPose from = i == 0 ? start : views[i - 1].pose;
+            if ((i > 0 && !views[i - 1].valid) || !to->valid) {
+                cost[i][j] = PLAN_INF;
+                continue;
+            }
+            int c = astar_search(&grid, from, to->pose, NULL, NULL);
+            cost[i][j] = c < 0 ? PLAN_INF : c + to->penalty;
+        }
+    }
+
+    int order[PLANNER_MAX_TARGETS];
+    int visits = solve_visit_order(k, cost, order);
+    if (visits == 0) {
+        fprintf(stderr, "[Planner] No obstacle has a reachable viewing position.\n");
+        return -1;
+    }
+    if (visits < k) {
+        printf("[Planner] Skipping %d obstacle(s) with no reachable viewing position.\n", k - visits);
+    }
+
+    // Walk each leg with A* and turn the poses into STM32 commands.
+    static PlanPose segment[PLAN_STATE_COUNT];
+    CommandWriter w = {arena, commands, obstacles, obstacle_count, CMD_MOVE_FORWARD, 0, 0, false};
+    PlanPose at = start;
+    for (int v = 0; v < visits; v++) {
+        const ViewPoint* target = &views[order[v]];
+        int len = 0;
+        if (astar_search(&grid, at, target->pose, segment, &len) < 0) continue;
+
+        writer_leg(&w, segment, len, target, snap_positions);
+        at = target->pose;
+    }
+
+    if (w.out_of_memory) {
+        fprintf(stderr, "[Planner] Out of memory storing the route.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int planner_plan_route(const Obstacle obstacles[], int obstacle_count,
+                       int robot_x, int robot_y, int robot_dir,
+                       Arena* arena, CommandList* commands, SnapList* snap_positions) {
+    return plan_route(obstacles, obstacle_count, robot_x, robot_y, robot_dir, PLAN_MAX_NEIGHBORS,
+                      arena, commands, snap_positions);
+}
+
+int planner_plan_forward_route(const Obstacle obstacles[], int obstacle_count,
+                               int robot_x, int robot_y, int robot_dir,
+                               Arena* arena, CommandList* commands, SnapList* snap_positions) {
+    return plan_route(obstacles, obstacle_count, robot_x, robot_y, robot_dir, PLAN_FORWARD_MOVES,
+                      arena, commands, snap_positions);
+}
+
+// --- Retries (planner.h) ---
+
+#define PLAN_FACES 4
+#define PLAN_RETRY_NODES (PLANNER_MAX_TARGETS * PLAN_FACES)
+
+// Node f of obstacle i is i * PLAN_FACES + face / 2.
+typedef struct {
+    bool ready;
+    PlanGrid grid;
+    Obstacle obstacles[PLANNER_MAX_TARGETS];
+    int count;
+    ViewPoint views[PLAN_RETRY_NODES];
+    int cost[PLAN_RETRY_NODES][PLAN_RETRY_NODES]; // Leg plus the destination's penalty
+    int16_t tree[PLAN_RETRY_NODES][PLAN_STATE_COUNT]; // Search tree from each node
+    int16_t start_tree[PLAN_STATE_COUNT]; // Last planner_plan_visits() start that is no node
+} RetryTable;
+
+static RetryTable g_retry;
+static RetryTable g_retry_prev; // The table planner_update_retries() is updating
+
+// Node's cost from the tree just searched (g_scratch.g).
+static int tree_cost(int node) {
+    const ViewPoint* v = &g_retry.views[node];
+    if (!v->valid) return PLAN_INF;
+    int g = g_scratch.g[state_index(v->pose)];
+    return g >= PLAN_INF ? PLAN_INF : g + v->penalty;
+}
+
+// Fills node's row of the cost matrix from the tree just searched (g_scratch.g).
+static void retry_cost_row(int from) {
+    int nodes = g_retry.count * PLAN_FACES;
+    for (int to = 0; to < nodes; to++) g_retry.cost[from][to] = to == from ? 0 : tree_cost(to);
+}
+
+// Puts obstacles in the table with a grid of the given moves and picks each
+// face's camera position, as select_view_point() would but with one search from
+// the start answering for every candidate. Leaves the trees and costs to the caller.
+static void retry_load(const Obstacle obstacles[], int obstacle_count, PlanPose start, int moves) {
+    grid_build(&g_retry.grid, obstacles, obstacle_count);
+    g_retry.grid.moves = moves;
+    memcpy(g_retry.obstacles, obstacles, (size_t)obstacle_count * sizeof(Obstacle));
+    g_retry.count = obstacle_count;
+
+    search_tree(&g_retry.grid, start, g_retry.start_tree);
+    int nodes = obstacle_count * PLAN_FACES;
+    for (int node = 0; node < nodes; node++) {
+        const Obstacle* obs = &obstacles[node / PLAN_FACES];
+        ViewPoint cand[4];
+        ViewPoint* view = &g_retry.views[node];
+        *view = (ViewPoint){{-1, -1, 0}, 0, obs->id, false};
+        view_candidates(obs, (node % PLAN_FACES) * 2, cand);
+        for (int i = 0; i < 4; i++) {
+            if (!grid_reachable(&g_retry.grid, cand[i].pose.x, cand[i].pose.y)) continue;
+            if (!view->valid) *view = cand[i];
+            if (g_scratch.g[state_index(cand[i].pose)] < PLAN_INF) {
+                *view = cand[i];
+                break;
+            }
+        }
+    }
+}
+
+int planner_prepare_retries(const Obstacle obstacles[], int obstacle_count,
+                            int robot_x, int robot_y, int robot_dir, bool forward_only) {
+    g_retry.ready = false;
+    if (obstacle_count <= 0 || obstacle_count > PLANNER_MAX_TARGETS ||
+        robot_x < 0 || robot_x >= PLAN_GRID_SIZE || robot_y < 0 || robot_y >= PLAN_GRID_SIZE) {
+        return -1;
+    }
+    footprints_build();
+    int start_dir = (robot_dir == 0 || robot_dir == 2 || robot_dir == 4 || robot_dir == 6) ? robot_dir : 0;
+    retry_load(obstacles, obstacle_count, (PlanPose){robot_x, robot_y, start_dir},
+               forward_only ? PLAN_FORWARD_MOVES : PLAN_MAX_NEIGHBORS);
+
+    int nodes = obstacle_count * PLAN_FACES;
+    for (int from = 0; from < nodes; from++) {
+        if (!g_retry.views[from].valid) {
+            for (int to = 0; to < nodes; to++) g_retry.cost[from][to] = PLAN_INF;
+            continue;
+        }
+        search_tree(&g_retry.grid, g_retry.views[from].pose, g_retry.tree[from]);
+        retry_cost_row(from);
+    }
+    g_retry.ready = true;
+    return 0;
+}
+
+// The move among the first moves of p's heading that ends at q, or NULL
+static const Footprint* move_between(int moves, PlanPose p, PlanPose q) {
+    const FootprintSet* set = &g_footprints[p.d / 2];
+    for (int m = 0; m < set->count && m < moves; m++) {
+        const Footprint* fp = &set->moves[m];
+        if (p.x + fp->dx == q.x && p.y + fp->dy == q.y && fp->d == q.d) return fp;
+    }
+    return NULL;
+}
+
+static bool grid_has(const PlanGrid* grid, int x, int y) {
+    return (grid->rows[y + PLAN_BOARD_MARGIN] >> (x + PLAN_BOARD_MARGIN)) & 1u;
+}
+
+// Marks in out every cell within a move's reach (PLAN_BOARD_MARGIN) of one marked
+// in cells: a move from anywhere else cannot touch them.
+static void grid_reach(const PlanGrid* cells, PlanGrid* out) {
+    uint32_t wide[PLAN_BOARD_SIZE];
+    for (int y = 0; y < PLAN_BOARD_SIZE; y++) {
+        uint32_t row = cells->rows[y], w = row;
+        for (int s = 1; s <= PLAN_BOARD_MARGIN; s++) w |= (row << s) | (row >> s);
+        wide[y] = w;
+    }
+    for (int y = 0; y < PLAN_BOARD_SIZE; y++) {
+        uint32_t r = 0;
+        for (int dy = -PLAN_BOARD_MARGIN; dy <= PLAN_BOARD_MARGIN; dy++) {
+            if (y + dy >= 0 && y + dy < PLAN_BOARD_SIZE) r |= wide[y + dy];
+        }
+        out->rows[y] = r;
+    }
+}
+
+// Leaves the cost along tree of every state in g_scratch.g, PLAN_INF where it does
+// not reach, and flags in g_scratch.closed the states whose way from the root
+// takes a move that hits blocked. Returns false if the tree takes a move near
+// blocked that grid does not have.
+static bool tree_relabel(const PlanGrid* grid, const PlanGrid* blocked, const int16_t tree[]) {
+    PlanGrid near_blocked;
+    grid_reach(blocked, &near_blocked);
+    int* g = g_scratch.g;
+    bool* cut = g_scratch.closed;
+    int* chain = g_scratch.parent; // Free outside astar_search()
+    for (int i = 0; i < PLAN_STATE_COUNT; i++) {
+        g[i] = tree[i] == PLAN_UNREACHED ? PLAN_INF : -1; // -1: not costed yet
+        cut[i] = false;
+    }
+    for (int i = 0; i < PLAN_STATE_COUNT; i++) {
+        // Up to the root or a state costed already, then back down
+        int n = 0, idx = i;
+        while (g[idx] < 0) {
+            if (tree[idx] == -1) {
+                g[idx] = 0;
+                break;
+            }
+            chain[n++] = idx;
+            idx = tree[idx];
+        }
+        while (n > 0) {
+            int child = chain[--n], parent = tree[child];
+            // Same heading (state % 4): a straight
+            g[child] = g[parent] + (parent % 4 == child % 4 ? 1 : PLAN_TURN_MOVE_COST);
+            cut[child] = cut[parent];
+            PlanPose from = state_pose(parent);
+            if (cut[child] || !grid_has(&near_blocked, from.x, from.y)) continue;
+            const Footprint* fp = move_between(grid->moves, from, state_pose(child));
+            if (!fp) return false;
+            cut[child] = footprint_hits(blocked, from, fp);
+        }
+    }
+    return true;
+}
+
+// Brings tree, searched before an edit of the arena, up to date on g_retry.grid
+// as search_tree() would leave it (costs in g_scratch.g), without searching from
+// scratch: the states cut off by cells the edit blocked are reached again from
+// the rest, and moves through cells it freed are followed where they do better.
+// Returns false if the tree could not be repaired and has to be searched.
+static bool tree_repair(int16_t tree[], const PlanGrid* blocked, const PlanGrid* freed) {
+    const PlanGrid* grid = &g_retry.grid;
+    if (!tree_relabel(grid, blocked, tree)) return false;
+    int* g = g_scratch.g;
+    const bool* cut = g_scratch.closed;
+    PlanHeap* heap = &g_scratch.heap;
+    const int heap_max = (int)(sizeof(heap->entries) / sizeof(heap->entries[0]));
+    PlanGrid changed = *freed, near;
+    for (int s = 0; s < PLAN_STATE_COUNT; s++) {
+        if (!cut[s]) continue;
+        g[s] = PLAN_INF;
+        tree[s] = PLAN_UNREACHED;
+        PlanPose p = state_pose(s);
+        changed.rows[p.y + PLAN_BOARD_MARGIN] |= 1u << (p.x + PLAN_BOARD_MARGIN);
+    }
+    grid_reach(&changed, &near);
+
+    // Every state the edit left in place keeps its cost, which is still the
+    // least unless a move it opened says otherwise, so the search restarts from
+    // the moves into cut-off states and through freed cells alone.
+    heap->size = 0;
+    for (int s = 0; s < PLAN_STATE_COUNT; s++) {
+        PlanPose p = state_pose(s);
+        if (g[s] >= PLAN_INF || !grid_has(&near, p.x, p.y)) continue;
+        const FootprintSet* set = &g_footprints[p.d / 2];
+        for (int m = 0; m < set->count && m < grid->moves; m++) {
+            const Footprint* fp = &set->moves[m];
+            int to = state_index((PlanPose){p.x + fp->dx, p.y + fp->dy, fp->d});
+            if (!cut[to] && g[to] < PLAN_INF && !footprint_hits(freed, p, fp)) continue;
+            if (g[s] + fp->cost >= g[to] || footprint_hits(grid, p, fp)) continue;
+            if (heap->size >= heap_max) return false;
+            g[to] = g[s] + fp->cost;
+            tree[to] = (int16_t)s;
+            heap_push(heap, g[to], g[to], to);
+        }
+    }
+    while (heap->size > 0) {
+        HeapEntry cur = heap_pop(heap);
+        if (cur.g > g[cur.state]) continue; // Improved on since
+        PlanPose neighbors[PLAN_MAX_NEIGHBORS];
+        int costs[PLAN_MAX_NEIGHBORS];
+        int n = get_neighbors(grid, state_pose(cur.state), neighbors, costs);
+        for (int i = 0; i < n; i++) {
+            int idx = state_index(neighbors[i]);
+            if (cur.g + costs[i] >= g[idx]) continue;
+            if (heap->size >= heap_max) return false;
+            g[idx] = cur.g + costs[i];
+            tree[idx] = (int16_t)cur.state;
+            heap_push(heap, g[idx], g[idx], idx);
+        }
+    }
+    return true;
+}
+
+int planner_update_retries(const Obstacle obstacles[], int obstacle_count,
+                           int robot_x, int robot_y, int robot_dir) {
+    if (!g_retry.ready) return -1;
+    g_retry.ready = false;
+    if (obstacle_count <= 0 || obstacle_count > PLANNER_MAX_TARGETS ||
+        robot_x < 0 || robot_x >= PLAN_GRID_SIZE || robot_y < 0 || robot_y >= PLAN_GRID_SIZE) {
+        return -1;
+    }
+    g_retry_prev = g_retry;
+    int start_dir = (robot_dir == 0 || robot_dir == 2 || robot_dir == 4 || robot_dir == 6) ? robot_dir : 0;
+    retry_load(obstacles, obstacle_count, (PlanPose){robot_x, robot_y, start_dir}, g_retry_prev.grid.moves);
+
+    // What the edit changed, as grids of their own
+    PlanGrid blocked, freed;
+    for (int y = 0; y < PLAN_BOARD_SIZE; y++) {
+        blocked.rows[y] = g_retry.grid.rows[y] & ~g_retry_prev.grid.rows[y];
+        freed.rows[y] = g_retry_prev.grid.rows[y] & ~g_retry.grid.rows[y];
+    }
+
+    // A tree depends on nothing but its root and the grid, so an old node at the
+    // same camera position lends its tree to be repaired
+    int nodes = obstacle_count * PLAN_FACES, old_nodes = g_retry_prev.count * PLAN_FACES, reused = 0;
+    for (int from = 0; from < nodes; from++) {
+        const ViewPoint* view = &g_retry.views[from];
+        if (!view->valid) {
+            for (int to = 0; to < nodes; to++) g_retry.cost[from][to] = PLAN_INF;
+            continue;
+        }
+        int old = 0;
+        for (; old < old_nodes; old++) {
+            const ViewPoint* v = &g_retry_prev.views[old];
+            if (v->valid && v->pose.x == view->pose.x && v->pose.y == view->pose.y && v->pose.d == view->pose.d) break;
+        }
+        bool repaired = false;
+        if (old < old_nodes) {
+            memcpy(g_retry.tree[from], g_retry_prev.tree[old], sizeof(g_retry.tree[from]));
+            repaired = tree_repair(g_retry.tree[from], &blocked, &freed);
+        }
+        if (repaired) reused++;
+        else search_tree(&g_retry.grid, view->pose, g_retry.tree[from]);
+        retry_cost_row(from);
+    }
+    g_retry.ready = true;
+    return reused;
+}
+
+int planner_plan_visits(const PlannerVisit visits[], int visit_count,
+                        int robot_x, int robot_y, int robot_dir,
+                        Arena* arena, CommandList* commands, SnapList* snap_positions, int faces[]) {
+    *commands = (CommandList){0};
+    *snap_positions = (SnapList){0};
+    for (int i = 0; i < visit_count; i++) faces[i] = -1;
+    if (!g_retry.ready || visit_count <= 0 || visit_count > PLANNER_MAX_TARGETS) return -1;
+    if (robot_x < 0 || robot_x >= PLAN_GRID_SIZE || robot_y < 0 || robot_y >= PLAN_GRID_SIZE) return -1;
+    int start_dir = (robot_dir == 0 || robot_dir == 2 || robot_dir == 4 || robot_dir == 6) ? robot_dir : 0;
+    PlanPose start = {robot_x, robot_y, start_dir};
+
+    // Costs from the start: the row of the node the robot stands on, else one search
+    int nodes = g_retry.count * PLAN_FACES;
+    int start_cost[PLAN_RETRY_NODES];
+    const int16_t* start_tree = NULL;
+    for (int node = 0; node < nodes && !start_tree; node++) {
+        const PlanPose* p = &g_retry.views[node].pose;
+        if (!g_retry.views[node].valid || p->x != start.x || p->y != start.y || p->d != start.d) continue;
+        start_tree = g_retry.tree[node];
+        for (int to = 0; to < nodes; to++) {
+            // The penalty is on the way in; standing there already costs nothing more
+            start_cost[to] = to == node ? 0 : g_retry.cost[node][to];
+        }
+    }
+    if (!start_tree) {
+        search_tree(&g_retry.grid, start, g_retry.start_tree);
+        start_tree = g_retry.start_tree;
+        for (int to = 0; to < nodes; to++) start_cost[to] = tree_cost(to);
+    }
+
+    // Each visit's cheapest allowed face from the start
+    int node_of[PLANNER_MAX_TARGETS];
+    for (int i = 0; i < visit_count; i++) {
+        node_of[i] = -1;
+        for (int o = 0; o < g_retry.count; o++) {
+            if (g_retry.obstacles[o].id != visits[i].obstacle_id) continue;
+            for (int f = 0; f < PLAN_FACES; f++) {
+                int node = o * PLAN_FACES + f;
+                if (!(visits[i].faces & (1u << f)) || start_cost[node] >= PLAN_INF) continue;
+                if (node_of[i] < 0 || start_cost[node] < start_cost[node_of[i]]) node_of[i] = node;
+            }
+            break;
+        }
+    }
+
+    // Node 0 is the start, as in planner_plan_route()
+    int k = visit_count;
+    int cost[PLANNER_MAX_TARGETS + 1][PLANNER_MAX_TARGETS + 1];
+    for (int i = 0; i <= k; i++) {
+        for (int j = 0; j <= k; j++) {
+            int from = i == 0 ? -1 : node_of[i - 1], to = j == 0 ? -1 : node_of[j - 1];
+            if (i == j || j == 0) cost[i][j] = 0;
+            else if (to < 0 || (i > 0 && from < 0)) cost[i][j] = PLAN_INF;
+            else cost[i][j] = i == 0 ? start_cost[to] : g_retry.cost[from][to];
+        }
+    }
+    int order[PLANNER_MAX_TARGETS];
+    int count = solve_visit_order(k, cost, order);
+    if (count == 0) return -1;
+
+    static PlanPose segment[PLAN_STATE_COUNT];
+    CommandWriter w = {arena, commands, g_retry.obstacles, g_retry.count, CMD_MOVE_FORWARD, 0, 0, false};
+    const int16_t* tree = start_tree;
+    for (int v = 0; v < count; v++) {
+        int node = node_of[order[v]];
+        const ViewPoint* target = &g_retry.views[node];
+        int len = path_from_tree(tree, target->pose, segment);
+        writer_leg(&w, segment, len, target, snap_positions);
+        faces[order[v]] = (node % PLAN_FACES) * 2;
+        tree = g_retry.tree[node];
+    }
+    return w.out_of_memory ? -1 : 0;
+}
+
+// --- Route simulation (planner.h) ---
+
+// Nearest cell to a position in cm
+static int sim_cell(int cm) {
+    return (int)lround((double)cm / PLAN_CELL_CM);
+}
+
+RouteSimStatus planner_simulate_route(const Obstacle obstacles[], int obstacle_count,
+                                      int robot_x, int robot_y, int robot_dir,
+                                      const CommandList* commands, const SnapList* snap_positions,
+                                      RouteSimResult* result) {
+    static const int heading[8][2] = { [0] = {0, 1}, [2] = {1, 0}, [4] = {0, -1}, [6] = {-1, 0} };
+    PlanGrid grid;
+    footprints_build();
+    grid_build(&grid, obstacles, obstacle_count);
+
+    // Centimetres, so that a straight that is no whole number of cells carries into the next
+    int x_cm = robot_x * PLAN_CELL_CM, y_cm = robot_y * PLAN_CELL_CM;
+    int d = (robot_dir == 0 || robot_dir == 2 || robot_dir == 4 || robot_dir == 6) ? robot_dir : 0;
+    int snaps = 0, i = 0;
+    RouteSimStatus status = ROUTE_SIM_OK;
+    for (; i < commands->count && status == ROUTE_SIM_OK; i++) {
+        const Command* cmd = &commands->items[i];
+        switch (cmd->type) {
+            case CMD_MOVE_FORWARD:
+            case CMD_MOVE_BACKWARD: {
+                int sign = cmd->type == CMD_MOVE_FORWARD ? 1 : -1;
+                for (int done = 0; done < cmd->value && status == ROUTE_SIM_OK; done += PLAN_CELL_CM) {
+                    int step = cmd->value - done < PLAN_CELL_CM ? cmd->value - done : PLAN_CELL_CM;
+                    x_cm += sign * heading[d][0] * step;
+                    y_cm += sign * heading[d][1] * step;
+                    if (!grid_reachable(&grid, sim_cell(x_cm), sim_cell(y_cm))) status = ROUTE_SIM_COLLISION;
+                }
+                break;
+            }
+            case CMD_TURN_LEFT:
+            case CMD_TURN_RIGHT:
+                if (cmd->value <= 0 || cmd->value % 90 != 0) {
+                    status = ROUTE_SIM_UNMODELLED;
+                    break;
+                }
+                for (int q = 0; q < cmd->value / 90 && status == ROUTE_SIM_OK; q++) {
+                    PlanPose p = {sim_cell(x_cm), sim_cell(y_cm), d};
+                    const Footprint* fp = &g_footprints[d / 2].moves[cmd->type == CMD_TURN_LEFT ? PLAN_MOVE_FL : PLAN_MOVE_FR];
+                    if (!grid_reachable(&grid, p.x, p.y) || footprint_hits(&grid, p, fp)) {
+                        status = ROUTE_SIM_COLLISION;
+                        break;
+                    }
+                    x_cm += fp->dx * PLAN_CELL_CM;
+                    y_cm += fp->dy * PLAN_CELL_CM;
+                    d = fp->d;
+                }
+                break;
+            case CMD_SNAPSHOT: {
+                const SnapPosition* snap = snaps < snap_positions->count ? &snap_positions->items[snaps] : NULL;
+                snaps++;
+                if (!snap || snap->x != sim_cell(x_cm) || snap->y != sim_cell(y_cm) || snap->d != d) {
+                    status = ROUTE_SIM_SNAP_MISMATCH;
+                }
+                break;
+            }
+        }
+    }
+    if (status != ROUTE_SIM_OK) {
+        i--; // The failing command
+    } else if (snaps != snap_positions->count) {
+        status = ROUTE_SIM_SNAP_MISMATCH;
+    }
+    *result = (RouteSimResult){status, i, {sim_cell(x_cm), sim_cell(y_cm), d}};
+    return status;
+}
+
+// --- Sensed cells (planner.h) ---
+
+void planner_set_sensed(const PlannerCell cells[], int count) {
+    memset(g_sensed, 0, sizeof(g_sensed));
+    for (int i = 0; i < count; i++) {
+        int bx = cells[i].x + PLAN_BOARD_MARGIN, by = cells[i].y + PLAN_BOARD_MARGIN;
+        if (bx < 0 || bx >= PLAN_BOARD_SIZE || by < 0 || by >= PLAN_BOARD_SIZE) continue;
+        g_sensed[by] |= 1u << bx;
+    }
+}
+
+bool planner_track_command(PlannerTrack* pose, const Command* cmd) {
+    static const int heading[8][2] = { [0] = {0, 1}, [2] = {1, 0}, [4] = {0, -1}, [6] = {-1, 0} };
+    int d = (pose->d == 0 || pose->d == 2 || pose->d == 4 || pose->d == 6) ? pose->d : 0;
+    switch (cmd->type) {
+        case CMD_MOVE_FORWARD:
+        case CMD_MOVE_BACKWARD: {
+            int sign = cmd->type == CMD_MOVE_FORWARD ? 1 : -1;
+            pose->x_cm += sign * heading[d][0] * cmd->value;
+            pose->y_cm += sign * heading[d][1] * cmd->value;
+            return true;
+        }
+        case CMD_TURN_LEFT:
+        case CMD_TURN_RIGHT:
+            if (cmd->value <= 0 || cmd->value % 90 != 0) return false;
+            footprints_build();
+            for (int q = 0; q < cmd->value / 90; q++) {
+                const Footprint* fp = &g_footprints[d / 2].moves[cmd->type == CMD_TURN_LEFT ? PLAN_MOVE_FL : PLAN_MOVE_FR];
+                pose->x_cm += fp->dx * PLAN_CELL_CM;
+                pose->y_cm += fp->dy * PLAN_CELL_CM;
+                d = fp->d;
+            }
+            pose->d = d;
+            return true;
+        case CMD_SNAPSHOT:
+            return true;
+    }
+    return true;
+}
@@ -0,0 +1,130 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "shared_types.h" // For Obstacle, Command, SnapPosition
+
+/**
+ * @file planner.h
+ * @brief Native route planner, a C port of the pathfinding server's algorithm.
+ *
+ * Takes the same inputs the nav thread sends to PATHFINDING_SERVER_URL
+ * (0-indexed obstacle cells and robot start pose) and produces the Command and
+ * SnapPosition arrays directly. Visiting order is solved exactly with Held-Karp
+ * over A* costs between viewing positions; obstacles with no reachable viewing
+ * position are skipped, as the server does. Moves and turns carry the speed
+ * classes the server adds when asked for speed_classes.
+ */
+
+// Held-Karp is exponential in the number of targets: at the full arena the table
+// is 2^20 subsets x 24 (32 with AVX2) 16-bit entries, vectorized over successors
+// and, from 15 targets, threaded over each subset layer.
+#define PLANNER_MAX_TARGETS MAX_OBSTACLES
+
+// Returns 0 on success, -1 if no obstacle can be reached or the input is too large.
+// The route lists are reset and grown in arena.
+// Uses static scratch space, so only one thread (the nav thread) may call it.
+int planner_plan_route(const Obstacle obstacles[], int obstacle_count,
+                       int robot_x, int robot_y, int robot_dir,
+                       Arena* arena, CommandList* commands, SnapList* snap_positions);
+
+// As planner_plan_route(), but turning only forward (FW, BW, FL, FR). The
+// lattice also turns in reverse, which is sent as the FL90/FR90 of the same
+// heading change and driven forward, so such a route's poses are not the
+// robot's; this one's are (see planner_simulate_route()).
+int planner_plan_forward_route(const Obstacle obstacles[], int obstacle_count,
+                               int robot_x, int robot_y, int robot_dir,
+                               Arena* arena, CommandList* commands, SnapList* snap_positions);
+
+// --- Retries ---
+// A snapshot that finds no image (or the bullseye on a blank face) is retried
+// from another face of the obstacle without asking the server. For the
+// mission's arena, planner_prepare_retries() picks a camera position for every
+// face of every obstacle and searches the whole grid once from each: the costs
+// between every pair and the search trees that hold their paths are kept, so a
+// reroute is a Held-Karp over that cost matrix plus walking the trees.
+// Nav thread only, like planner_plan_route().
+
+// One obstacle to photograph in planner_plan_visits()
+typedef struct {
+    int obstacle_id;
+    unsigned faces; // Bit d / 2 for each face (0/2/4/6) it may be photographed from
+} PlannerVisit;
+
+// Builds the retry table for the mission's obstacles (its whole arena, which
+// stays the collision map), choosing camera positions as seen from the robot's
+// start. With forward_only the reroutes turn as planner_plan_forward_route()'s do.
+// Returns 0, or -1 if the arena is outside the planner's range, in which case
+// planner_plan_visits() fails until the next success.
+int planner_prepare_retries(const Obstacle obstacles[], int obstacle_count,
+                            int robot_x, int robot_y, int robot_dir, bool forward_only);
+
+// Brings the prepared table up to date for an edited arena: obstacles is the
+// whole new list, and the robot's pose picks the camera positions as in
+// planner_prepare_retries(). A search is only run again for a camera position
+// that is new, or whose old search tree the edit invalidates (a move it takes
+// now clips an obstacle, or a freed cell opens a cheaper way somewhere), so
+// moving one obstacle redoes the few searches that pass near it. Returns the
+// number of searches kept, or -1 if there was no table or the new arena is
+// outside the planner's range, which leaves none.
+int planner_update_retries(const Obstacle obstacles[], int obstacle_count,
+                           int robot_x, int robot_y, int robot_dir);
+
+// Plans a route from the robot's pose through visits[] on the prepared table:
+// each from its allowed face cheapest to reach from the pose, in the cheapest
+// order. faces[i] receives the face visits[i] is photographed from, or -1 if it
+// was left out as unreachable. Returns 0, or -1 if nothing can be reached, the
+// table is not ready, or the route does not fit the arena.
+int planner_plan_visits(const PlannerVisit visits[], int visit_count,
+                        int robot_x, int robot_y, int robot_dir,
+                        Arena* arena, CommandList* commands, SnapList* snap_positions, int faces[]);
+
+// --- Route simulation ---
+// Replays a route the way the STM32 drives it, from the start pose against the
+// planner's collision map (obstacles grown by their clearance box, arena
+// padding): FW/BW in 10 cm steps, FL/FR in 90-degree steps as the forward arc
+// the firmware turns, each sweeping the cells the lattice's turn footprint does.
+// Each CMD_SNAPSHOT must find the robot on the cell and heading of the matching
+// snap position. Takes microseconds; nav thread only, like planner_plan_route().
+
+typedef enum {
+    ROUTE_SIM_OK,
+    ROUTE_SIM_COLLISION,     // The robot's centre enters a blocked cell, or a turn sweeps one
+    ROUTE_SIM_SNAP_MISMATCH, // A snapshot away from its snap position, or the counts differ
+    ROUTE_SIM_UNMODELLED     // A turn that is not a multiple of 90 degrees; checked up to there
+} RouteSimStatus;
+
+typedef struct {
+    RouteSimStatus status;
+    int command;      // Index of the failing command, or the command count
+    SnapPosition pose; // Simulated pose there, nearest cell
+} RouteSimResult;
+
+// Returns result->status.
+RouteSimStatus planner_simulate_route(const Obstacle obstacles[], int obstacle_count,
+                                      int robot_x, int robot_y, int robot_dir,
+                                      const CommandList* commands, const SnapList* snap_positions,
+                                      RouteSimResult* result);
+
+// --- Sensed cells ---
+// Cells the robot's own range sensors found blocked that no mission obstacle
+// accounts for (occupancy_map.h). Every collision map built after the call,
+// for planning, the retry table and route simulation, blocks each with an
+// obstacle's clearance box; none is ever a target. Replaces the previous set;
+// count 0 clears it. Nav thread only.
+
+typedef struct {
+    int x, y;
+} PlannerCell;
+
+void planner_set_sensed(const PlannerCell cells[], int count);
+
+// A pose in cm, d as in SnapPosition, for following a route as it is sent
+typedef struct {
+    int x_cm, y_cm, d;
+} PlannerTrack;
+
+// Moves pose over cmd the way planner_simulate_route() drives it. Returns
+// false, leaving pose alone, for a turn that is not a multiple of 90 degrees.
+bool planner_track_command(PlannerTrack* pose, const Command* cmd);
+
+#endif // PLANNER_H
@@ -0,0 +1,273 @@
+/*
+ * Native planner benchmark over the arena corpus written by
+ * mdp_algo_v13/algorithms/tests/benchmark.py (one /path request per line).
+ *
+ *   gcc -O2 -Wall planner_bench.c planner.c json_parser.c json_writer.c arena.c -o planner_bench -lm -lpthread
+ *   ./planner_bench [-j WORKERS] [-o RESULTS.ndjson] CORPUS.ndjson
+ *
+ * Prints plan-time percentiles, route cost, skipped obstacles and command
+ * counts per corpus kind. The results file has benchmark.py's format, so
+ * `benchmark.py --compare` and `--summarize` read it too. route_cost is
+ * measured on the commands as benchmark.py does: one per 10 cm of FW/BW and
+ * TURN_COST + TURN_RADIUS per 90-degree turn.
+ *
+ * planner_plan_route() keeps static scratch, so the workers (default: one per
+ * core) are forked processes, each planning every WORKERS-th arena into a
+ * shared results array.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "json_parser.h"
+#include "json_writer.h"
+#include "planner.h"
+
+#define BENCH_NAME_LEN 64
+#define BENCH_TURN_COST 23 // PLAN_TURN_COST + PLAN_TURN_RADIUS in planner.c
+#define BENCH_MAX_KINDS 16
+
+typedef struct {
+    char name[BENCH_NAME_LEN];
+    char kind[BENCH_NAME_LEN];
+    Obstacle obstacles[MAX_OBSTACLES];
+    int obstacle_count;
+    int robot_x, robot_y, robot_dir;
+} BenchArena;
+
+typedef struct {
+    long time_us;
+    int planned; // 0 if the arena never reached the planner (bad line)
+    int visited;
+    int skipped;
+    int commands;
+    int route_cost;
+} BenchResult;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int field_int(const JsonDoc* doc, int object, const char* key, int fallback) {
+    int value;
+    return json_token_int(doc, json_object_get(doc, object, key), &value) == 0 ? value : fallback;
+}
+
+// Parses one corpus line. Returns 0, or -1 if it is not an arena.
+static int parse_arena(const char* line, BenchArena* arena) {
+    JsonToken tokens[MAX_OBSTACLES * 9 + 32];
+    JsonDoc doc;
+    if (json_parse(&doc, line, strlen(line), tokens, (int)(sizeof(tokens) / sizeof(tokens[0]))) != 0) return -1;
+
+    memset(arena, 0, sizeof(*arena));
+    if (json_token_string(&doc, json_object_get(&doc, 0, "name"), arena->name, sizeof(arena->name)) != 0) return -1;
+    json_token_string(&doc, json_object_get(&doc, 0, "kind"), arena->kind, sizeof(arena->kind));
+    arena->robot_x = field_int(&doc, 0, "robot_x", 1);
+    arena->robot_y = field_int(&doc, 0, "robot_y", 1);
+    arena->robot_dir = field_int(&doc, 0, "robot_dir", 0);
+
+    int list = json_object_get(&doc, 0, "obstacles");
+    if (list < 0 || doc.tokens[list].type != JSON_ARRAY) return -1;
+    int obs = list + 1;
+    for (int i = 0; i < doc.tokens[list].size && arena->obstacle_count < MAX_OBSTACLES; i++, obs = json_next(&doc, obs)) {
+        Obstacle* o = &arena->obstacles[arena->obstacle_count++];
+        o->id = field_int(&doc, obs, "id", 0);
+        o->x = field_int(&doc, obs, "x", 0);
+        o->y = field_int(&doc, obs, "y", 0);
+        o->d = field_int(&doc, obs, "d", 0);
+    }
+    return 0;
+}
+
+static void plan_arena(const BenchArena* arena, Arena* mem, BenchResult* r) {
+    CommandList commands;
+    SnapList snaps;
+    arena_reset(mem);
+    double start = now_seconds();
+    int rc = planner_plan_route(arena->obstacles, arena->obstacle_count, arena->robot_x, arena->robot_y,
+                                arena->robot_dir, mem, &commands, &snaps);
+    r->time_us = (long)((now_seconds() - start) * 1e6);
+    r->planned = 1;
+    if (rc != 0) {
+        // Nothing reachable: the server answers with an empty route
+        r->skipped = arena->obstacle_count;
+        return;
+    }
+
+    for (int i = 0; i < commands.count; i++) {
+        const Command* c = &commands.items[i];
+        if (c->type == CMD_MOVE_FORWARD || c->type == CMD_MOVE_BACKWARD) r->route_cost += c->value / 10;
+        else if (c->type == CMD_TURN_LEFT || c->type == CMD_TURN_RIGHT) r->route_cost += BENCH_TURN_COST * c->value / 90;
+        else if (c->type == CMD_SNAPSHOT) r->visited++;
+    }
+    r->commands = commands.count;
+    r->skipped = arena->obstacle_count - r->visited;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted[n], as benchmark.py computes it
+static double percentile(const double* sorted, int n, double p) {
+    if (n == 0) return 0.0;
+    int rank = (int)(p / 100.0 * n + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_row(const char* kind, const BenchArena* arenas, const BenchResult* results, int count) {
+    double* times = malloc(sizeof(double) * (size_t)(count > 0 ? count : 1));
+    int n = 0, errors = 0, skipped = 0, with_skips = 0;
+    double cost = 0, commands = 0;
+    for (int i = 0; i < count; i++) {
+        if (kind && strcmp(arenas[i].kind[0] ? arenas[i].kind : "-", kind) != 0) continue;
+        if (!results[i].planned) {
+            errors++;
+            continue;
+        }
+        times[n++] = results[i].time_us / 1000.0;
+        cost += results[i].route_cost;
+        commands += results[i].commands;
+        skipped += results[i].skipped;
+        with_skips += results[i].skipped > 0;
+    }
+    qsort(times, (size_t)n, sizeof(double), compare_double);
+    int ok = n > 0 ? n : 1;
+    printf("  %-8s %6d %4d %8.2f %8.2f %8.2f %8.2f %7.1f %7d %6d %6.1f\n", kind ? kind : "all", n + errors, errors,
+           percentile(times, n, 50), percentile(times, n, 90), percentile(times, n, 99), n ? times[n - 1] : 0.0,
+           cost / ok, skipped, with_skips, commands / ok);
+    free(times);
+}
+
+static int write_results(const char* path, const BenchArena* arenas, const BenchResult* results, int count) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        char buf[512];
+        JsonWriter w;
+        jw_init(&w, buf, sizeof(buf));
+        jw_begin_object(&w);
+        jw_key(&w, "name"); jw_string(&w, arenas[i].name);
+        jw_key(&w, "kind"); jw_string(&w, arenas[i].kind);
+        jw_key(&w, "obstacles"); jw_int(&w, arenas[i].obstacle_count);
+        jw_key(&w, "time_us"); jw_int(&w, results[i].time_us);
+        if (results[i].planned) {
+            jw_key(&w, "visited"); jw_int(&w, results[i].visited);
+            jw_key(&w, "skipped"); jw_int(&w, results[i].skipped);
+            jw_key(&w, "commands"); jw_int(&w, results[i].commands);
+            jw_key(&w, "route_cost"); jw_int(&w, results[i].route_cost);
+        } else {
+            jw_key(&w, "error"); jw_string(&w, "unparsed corpus line");
+        }
+        jw_end_object(&w);
+        if (jw_str(&w)) fprintf(f, "%s\n", buf);
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char* results_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+        if (opt == 'j') workers = atoi(optarg);
+        else if (opt == 'o') results_path = optarg;
+        else optind = argc + 1;
+    }
+    if (optind != argc - 1 || workers <= 0) {
+        fprintf(stderr, "Usage: %s [-j WORKERS] [-o RESULTS.ndjson] CORPUS.ndjson\n", argv[0]);
+        return 1;
+    }
+
+    FILE* f = fopen(argv[optind], "r");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    int count = 0, capacity = 0;
+    BenchArena* arenas = NULL;
+    char line[8192];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '\n' || line[0] == '\0') continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            arenas = realloc(arenas, sizeof(BenchArena) * (size_t)capacity);
+            if (!arenas) return 1;
+        }
+        if (parse_arena(line, &arenas[count]) != 0) {
+            memset(&arenas[count], 0, sizeof(BenchArena));
+            snprintf(arenas[count].name, BENCH_NAME_LEN, "line %d", count + 1);
+            arenas[count].obstacle_count = -1;
+        }
+        count++;
+    }
+    fclose(f);
+
+    // Planner chatter (skips, unreachable arenas) would drown the report
+    fflush(stdout);
+    FILE* quiet = fopen("/dev/null", "w");
+
+    BenchResult* results = mmap(NULL, sizeof(BenchResult) * (size_t)(count > 0 ? count : 1),
+                                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(results, 0, sizeof(BenchResult) * (size_t)count);
+
+    double start = now_seconds();
+    for (int w = 0; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            if (quiet) {
+                dup2(fileno(quiet), STDOUT_FILENO);
+                dup2(fileno(quiet), STDERR_FILENO);
+            }
+            Arena mem;
+            arena_init(&mem, 0);
+            for (int i = w; i < count; i += workers) {
+                if (arenas[i].obstacle_count >= 0) plan_arena(&arenas[i], &mem, &results[i]);
+            }
+            arena_destroy(&mem);
+            _exit(0);
+        }
+    }
+    while (wait(NULL) > 0) {}
+    if (quiet) fclose(quiet);
+
+    printf("Planned %d arenas on %d worker(s) in %.1f s\n", count, workers, now_seconds() - start);
+    printf("Native planner\n");
+    printf("  %-8s %6s %4s %8s %8s %8s %8s %7s %7s %6s %6s\n", "kind", "arenas", "err", "p50 ms", "p90 ms",
+           "p99 ms", "max ms", "cost", "skipped", "w/skip", "cmds");
+    print_row(NULL, arenas, results, count);
+    const char* kinds[BENCH_MAX_KINDS];
+    int kind_count = 0;
+    for (int i = 0; i < count; i++) {
+        const char* kind = arenas[i].kind[0] ? arenas[i].kind : "-";
+        int k = 0;
+        while (k < kind_count && strcmp(kinds[k], kind) != 0) k++;
+        if (k == kind_count && kind_count < BENCH_MAX_KINDS) kinds[kind_count++] = kind;
+    }
+    for (int k = 0; k < kind_count; k++) print_row(kinds[k], arenas, results, count);
+
+    int rc = results_path ? write_results(results_path, arenas, results, count) : 0;
+    munmap(results, sizeof(BenchResult) * (size_t)(count > 0 ? count : 1));
+    free(arenas);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+"""
+Fits the planner's motion-primitive table from MDP motion traces.
+
+The planner assumes a 90-degree turn lands exactly TURN_RADIUS cells ahead and
+to the side. The firmware's bang-bang turn stops where the gyro says 90 degrees,
+so where it really lands depends on the steering and floor. This reads
+calibration runs recorded by the firmware (mtrace_dump.py CSVs), dead-reckons
+each move from the wheel encoders and the yaw, and writes the table the server
+plans with (mdp_algo_v13/algorithms/pathfinding/lattice.py):
+
+    python3 mtrace_dump.py /dev/ttyUSB0 --moves 16 -o run1.csv   # after FL90 x4, FR90 x4, ...
+    python3 primitive_fit.py run1.csv run2.csv -o ../mdp_algo_v13/motion_primitives.json
+
+Each primitive is named by the command that executes it, so the firmware runs
+the plan's moves exactly as they were measured:
+
+    {"version": 1, "cell_cm": 10, "sources": [..], "primitives": {
+      "FL90": {"n": .., "forward_cm": a, "left_cm": b, "turn_deg": 90.4,
+               "forward_cells": 3, "left_cells": 3, "swept": [[f, l], ..],
+               "duration_s": .., "duration_max_s": ..},
+      "FR90": {..},
+      "FW": {"n": .., "per_cmd_s": a, "per_cm_s": b, "travel_ratio": r}, "BW": {..}}}
+
+Turn displacements are in the robot's frame at the start (forward, left) and
+rounded to cells. swept is every cell the robot's centre passed through in
+any run, which is what the planner tests against its obstacle clearance.
+Straight moves stay one cell per lattice step (the firmware closes the loop on
+distance); their a + b * cm fit prices them. Durations run from dispatch to
+the last sample in which a wheel turned, so they leave out the link and the
+RPi, which the RPi's cost_model.json fit includes; the server prefers that one
+when it has both.
+
+Reverse turns (BL/BR) are not fitted: the RPi only sends forward turns.
+"""
+import argparse
+import csv
+import json
+import math
+import sys
+from collections import defaultdict
+
+CELL_CM = 10
+# STM/MDP/Core/Src/main.c: WHEEL_DIAMETER_CM, COUNTS_PER_REV
+CM_PER_COUNT = math.pi * 6.50 / 1560.0
+TURN_TOLERANCE_DEG = 10.0  # A run this far off 90 degrees is left out
+SPREAD_WARN_CM = CELL_CM / 2
+
+
+def read_moves(paths):
+    """Returns [(source, op, arg, [row, ..])], one per move in the CSVs."""
+    moves = []
+    for path in paths:
+        by_move = defaultdict(list)
+        with open(path, newline="") as f:
+            for row in csv.DictReader(f):
+                by_move[int(row["move"])].append(row)
+        for move in sorted(by_move):
+            rows = sorted(by_move[move], key=lambda r: int(r["sample"]))
+            moves.append((f"{path}#{move}", rows[0]["op"], int(rows[0]["arg"]), rows))
+    return moves
+
+
+def counts_delta(now, before):
+    d = (now - before) & 0xFFFF
+    return d - 0x10000 if d > 0x8000 else d
+
+
+def dead_reckon(rows, reverse):
+    """(forward cm, left cm, turn deg, centre path, duration s) of one move."""
+    sign = -1.0 if reverse else 1.0
+    x = y = 0.0
+    prev_yaw = float(rows[0]["yaw_deg"])
+    turned = 0.0
+    path = [(0.0, 0.0)]
+    last_motion = 0
+    for k in range(1, len(rows)):
+        a, b = rows[k - 1], rows[k]
+        da = abs(counts_delta(int(b["cnt_a"]), int(a["cnt_a"])))
+        dd = abs(counts_delta(int(b["cnt_d"]), int(a["cnt_d"])))
+        if da or dd:
+            last_motion = k
+        step = sign * (da + dd) / 2 * CM_PER_COUNT
+        yaw = float(b["yaw_deg"])
+        dyaw = (yaw - prev_yaw + 180.0) % 360.0 - 180.0
+        prev_yaw = yaw
+        heading = math.radians(turned + dyaw / 2)
+        x += step * math.cos(heading)
+        y += step * math.sin(heading)
+        turned += dyaw
+        path.append((x, y))
+    return x, y, turned, path, (last_motion + 1) / 1000.0
+
+
+def path_cells(path):
+    """Cells (forward, left) the centre passes through, the start cell excluded."""
+    cells = set()
+    for x, y in path:
+        cells.add((round(x / CELL_CM), round(y / CELL_CM)))
+    cells.discard((0, 0))
+    return cells
+
+
+def mean(values):
+    return sum(values) / len(values)
+
+
+def spread(values):
+    m = mean(values)
+    return math.sqrt(sum((v - m) ** 2 for v in values) / len(values))
+
+
+def fit_turn(name, runs, out):
+    """runs: dead_reckon() results of one turn command."""
+    want = 90 if name == "FL90" else -90
+    kept = [r for r in runs if abs(r[2] - want) <= TURN_TOLERANCE_DEG]
+    if len(kept) < len(runs):
+        print(f"{name}: {len(runs) - len(kept)} of {len(runs)} runs turned more than "
+              f"{TURN_TOLERANCE_DEG:g} deg off {want} and are left out", file=out)
+    if not kept:
+        return None
+    forward = [r[0] for r in kept]
+    left = [r[1] for r in kept]
+    cells = (round(mean(forward) / CELL_CM), round(mean(left) / CELL_CM))
+    swept = set().union(*(path_cells(r[3]) for r in kept))
+    swept.add(cells)
+    if max(spread(forward), spread(left)) > SPREAD_WARN_CM:
+        print(f"{name}: runs end up to {max(spread(forward), spread(left)):.1f} cm apart (1 sd); "
+              f"the turn is not repeatable enough for one table entry", file=out)
+    entry = {
+        "n": len(kept),
+        "forward_cm": round(mean(forward), 1),
+        "left_cm": round(mean(left), 1),
+        "turn_deg": round(mean([r[2] for r in kept]), 1),
+        "forward_cells": cells[0],
+        "left_cells": cells[1],
+        "swept": sorted([list(c) for c in swept]),
+        "duration_s": round(mean([r[4] for r in kept]), 3),
+        "duration_max_s": round(max(r[4] for r in kept), 3),
+    }
+    print(f"{name}: {entry['n']} runs, lands {entry['forward_cm']} cm ahead, {entry['left_cm']} cm left "
+          f"-> ({cells[0]}, {cells[1]}) cells, {len(swept)} cells swept, {entry['duration_s']} s", file=out)
+    return entry
+
+
+def fit_straight(name, runs, out):
+    """runs: (commanded cm, dead_reckon() result) of one straight command."""
+    cm = [c for c, _ in runs]
+    seconds = [r[4] for _, r in runs]
+    travel = [abs(r[0]) / c for c, r in runs]
+    if len(set(cm)) >= 2:
+        mc, ms = mean(cm), mean(seconds)
+        b = sum((c - mc) * (s - ms) for c, s in zip(cm, seconds)) / sum((c - mc) ** 2 for c in cm)
+        a = ms - b * mc
+    else:
+        print(f"{name}: all runs were {cm[0]} cm; fitting time per cm only", file=out)
+        a, b = 0.0, mean(seconds) / cm[0]
+    if a < 0 or b <= 0:
+        print(f"{name}: fit came out {a:.3f} s + {b:.4f} s/cm; vary the distances more", file=out)
+        return None
+    entry = {"n": len(runs), "per_cmd_s": round(a, 4), "per_cm_s": round(b, 5),
+             "travel_ratio": round(mean(travel), 3)}
+    print(f"{name}: {entry['n']} runs, {a:.3f} s + {b * CELL_CM:.3f} s per cell, "
+          f"travels {entry['travel_ratio']:.3f} of the commanded distance", file=out)
+    return entry
+
+
+def fit(moves, out):
+    turns, straights = defaultdict(list), defaultdict(list)
+    skipped = 0
+    for _, op, arg, rows in moves:
+        if op == "TURN" and abs(arg) == 90:
+            turns["FL90" if arg > 0 else "FR90"].append(dead_reckon(rows, False))
+        elif op in ("MOVE_FWD", "MOVE_BACK") and arg > 0:
+            straights["FW" if op == "MOVE_FWD" else "BW"].append((arg, dead_reckon(rows, op == "MOVE_BACK")))
+        else:
+            skipped += 1
+    if skipped:
+        print(f"{skipped} moves are not primitives (reverse, absolute or non-90 turns) and are left out",
+              file=out)
+    table = {}
+    for name in ("FL90", "FR90"):
+        if turns[name] and (entry := fit_turn(name, turns[name], out)):
+            table[name] = entry
+    for name in ("FW", "BW"):
+        if straights[name] and (entry := fit_straight(name, straights[name], out)):
+            table[name] = entry
+    return table
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("traces", nargs="+", help="mtrace_dump.py CSV files of calibration runs")
+    parser.add_argument("-o", "--output", help="table to write (default: stdout)")
+    args = parser.parse_args()
+
+    table = fit(read_moves(args.traces), sys.stderr)
+    if "FL90" not in table or "FR90" not in table:
+        print("need runs of both FL90 and FR90 for a table", file=sys.stderr)
+        sys.exit(1)
+    text = json.dumps({"version": 1, "cell_cm": CELL_CM, "sources": args.traces, "primitives": table},
+                      indent=1) + "\n"
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text)
+    else:
+        sys.stdout.write(text)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,183 @@
+/* Generated by RPI/gen_protocol_keywords.py -- do not edit, re-run the script. */
+#ifndef PROTOCOL_KEYWORDS_H
+#define PROTOCOL_KEYWORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @file protocol_keywords.h
+ * @brief Perfect-hash keyword lookups shared by the Pi and the STM32 firmware.
+ *
+ * Every table slot holds at most one keyword, so a lookup is one FNV-1a hash
+ * of the input and one memcmp against the slot it lands in. Inputs are
+ * (pointer, length) pairs and need not be NUL-terminated.
+ */
+
+typedef struct {
+    const char* name;
+    uint8_t len;
+    int16_t value;
+} KeywordEntry;
+
+static inline uint32_t keyword_hash(const char* s, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline int keyword_lookup(const KeywordEntry* table, uint32_t mask, uint32_t seed,
+                                 const char* s, size_t len, int missing) {
+    const KeywordEntry* e = &table[keyword_hash(s, len, seed) & mask];
+    if (e->name && e->len == len && memcmp(e->name, s, len) == 0) return e->value;
+    return missing;
+}
+
+// Image recognition class label -> image ID (11..40) sent to Android. Returns -1 if not found.
+static inline int kw_image_class(const char* s, size_t len) {
+    static const KeywordEntry table[64] = {
+        [0] = {"Number 3", 8, 13},
+        [4] = {"Alphabet E", 10, 24},
+        [5] = {"Number 4", 8, 14},
+        [7] = {"Alphabet T", 10, 29},
+        [9] = {"Alphabet Z", 10, 35},
+        [12] = {"Number 7", 8, 17},
+        [14] = {"Alphabet S", 10, 28},
+        [16] = {"Alphabet Y", 10, 34},
+        [17] = {"Number 8", 8, 18},
+        [19] = {"Number 2", 8, 12},
+        [21] = {"Down Arrow", 10, 37},
+        [23] = {"Alphabet D", 10, 23},
+        [24] = {"Left Arrow", 10, 39},
+        [26] = {"Alphabet W", 10, 32},
+        [27] = {"Right Arrow", 11, 38},
+        [30] = {"Alphabet C", 10, 22},
+        [31] = {"Number 6", 8, 16},
+        [35] = {"Alphabet X", 10, 33},
+        [36] = {"Up Arrow", 8, 36},
+        [38] = {"Number 1", 8, 11},
+        [41] = {"Stop sign", 9, 40},
+        [42] = {"Alphabet G", 10, 26},
+        [45] = {"Alphabet V", 10, 31},
+        [49] = {"Alphabet B", 10, 21},
+        [50] = {"Number 5", 8, 15},
+        [51] = {"Alphabet H", 10, 27},
+        [52] = {"Alphabet U", 10, 30},
+        [56] = {"Alphabet A", 10, 20},
+        [61] = {"Alphabet F", 10, 25},
+        [62] = {"Number 9", 8, 19},
+    };
+    return keyword_lookup(table, 63u, 0x0015u, s, len, -1);
+}
+
+enum {
+    KW_CAT_SEND_ARENA = 1,
+    KW_CAT_STOP = 2,
+    KW_CAT_STATS = 3,
+    KW_CAT_STM = 4,
+    KW_CAT_ACK = 5,
+    KW_CAT_CONFIG = 6,
+};
+
+// "cat" field of an Android JSON message. Returns 0 if not found.
+static inline int kw_android_category(const char* s, size_t len) {
+    static const KeywordEntry table[16] = {
+        [2] = {"ack", 3, KW_CAT_ACK},
+        [5] = {"stop", 4, KW_CAT_STOP},
+        [7] = {"config", 6, KW_CAT_CONFIG},
+        [12] = {"stats", 5, KW_CAT_STATS},
+        [13] = {"stm", 3, KW_CAT_STM},
+        [14] = {"sendArena", 9, KW_CAT_SEND_ARENA},
+    };
+    return keyword_lookup(table, 15u, 0x0000u, s, len, 0);
+}
+
+enum {
+    KW_COMPONENT_MOTOR = 1,
+    KW_COMPONENT_GENERAL = 2,
+    KW_COMPONENT_SENSOR = 3,
+};
+
+// Component field of an ASCII command (":id/COMPONENT/COMMAND/...;"). Returns 0 if not found.
+static inline int kw_stm_component(const char* s, size_t len) {
+    static const KeywordEntry table[8] = {
+        [2] = {"SENSOR", 6, KW_COMPONENT_SENSOR},
+        [4] = {"GENERAL", 7, KW_COMPONENT_GENERAL},
+        [5] = {"MOTOR", 5, KW_COMPONENT_MOTOR},
+    };
+    return keyword_lookup(table, 7u, 0x0001u, s, len, 0);
+}
+
+enum {
+    KW_MOTOR_FWD = 0,
+    KW_MOTOR_REV = 1,
+    KW_MOTOR_STOP = 2,
+    KW_MOTOR_TURNL = 3,
+    KW_MOTOR_TURNR = 4,
+    KW_MOTOR_TURN90L = 5,
+    KW_MOTOR_TURN90R = 6,
+    KW_MOTOR_TASK2 = 7,
+    KW_MOTOR_PWMTURNL = 8,
+    KW_MOTOR_PWMTURNR = 9,
+};
+
+// MOTOR command field; values match enum cmdList in the firmware. Returns -1 if not found.
+static inline int kw_motor_command(const char* s, size_t len) {
+    static const KeywordEntry table[32] = {
+        [1] = {"TURNR", 5, KW_MOTOR_TURNR},
+        [4] = {"TURN90L", 7, KW_MOTOR_TURN90L},
+        [7] = {"PWMTURNL", 8, KW_MOTOR_PWMTURNL},
+        [15] = {"TASK2", 5, KW_MOTOR_TASK2},
+        [18] = {"STOP", 4, KW_MOTOR_STOP},
+        [19] = {"REV", 3, KW_MOTOR_REV},
+        [22] = {"TURN90R", 7, KW_MOTOR_TURN90R},
+        [23] = {"FWD", 3, KW_MOTOR_FWD},
+        [25] = {"PWMTURNR", 8, KW_MOTOR_PWMTURNR},
+        [31] = {"TURNL", 5, KW_MOTOR_TURNL},
+    };
+    return keyword_lookup(table, 31u, 0x000fu, s, len, -1);
+}
+
+enum {
+    KW_GENERAL_CAPTURE = 1,
+    KW_GENERAL_DONE = 2,
+    KW_GENERAL_BINARY = 3,
+    KW_GENERAL_CAPTURE1 = 4,
+    KW_GENERAL_CAPTURE2 = 5,
+    KW_GENERAL_HELLO = 6,
+    KW_GENERAL_BAUD = 7,
+    KW_GENERAL_PING = 8,
+    KW_GENERAL_SCHED = 9,
+    KW_GENERAL_SYNC = 10,
+    KW_GENERAL_PROGRESS = 11,
+    KW_GENERAL_PROF = 12,
+    KW_GENERAL_WHERE = 13,
+    KW_GENERAL_CREDIT = 14,
+};
+
+// GENERAL command field, plus the CAPTURE1/CAPTURE2 tuning commands. Returns 0 if not found.
+static inline int kw_general_command(const char* s, size_t len) {
+    static const KeywordEntry table[32] = {
+        [0] = {"SYNC", 4, KW_GENERAL_SYNC},
+        [7] = {"CAPTURE2", 8, KW_GENERAL_CAPTURE2},
+        [8] = {"PROF", 4, KW_GENERAL_PROF},
+        [10] = {"BINARY", 6, KW_GENERAL_BINARY},
+        [11] = {"PING", 4, KW_GENERAL_PING},
+        [14] = {"WHERE", 5, KW_GENERAL_WHERE},
+        [15] = {"CAPTURE", 7, KW_GENERAL_CAPTURE},
+        [19] = {"DONE", 4, KW_GENERAL_DONE},
+        [22] = {"CREDIT", 6, KW_GENERAL_CREDIT},
+        [24] = {"PROGRESS", 8, KW_GENERAL_PROGRESS},
+        [26] = {"CAPTURE1", 8, KW_GENERAL_CAPTURE1},
+        [27] = {"BAUD", 4, KW_GENERAL_BAUD},
+        [29] = {"HELLO", 5, KW_GENERAL_HELLO},
+        [30] = {"SCHED", 5, KW_GENERAL_SCHED},
+    };
+    return keyword_lookup(table, 31u, 0x0002u, s, len, 0);
+}
+
+#endif // PROTOCOL_KEYWORDS_H
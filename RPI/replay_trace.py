@@ -0,0 +1,313 @@
+"""
+Replays a trace recorded with `test_center --record FILE` against a controller
+built with -DRPI_TESTING, at N times the recorded speed.
+
+The controller's inputs come back as they were recorded: Android messages on a
+pty, STM32 replies on the fake_stm.py pipes (each reply is sent when the
+controller issues the matching command ID, after the recorded delay / N), and
+the path and image server answers on ports 5000 and 4000. The controller's own
+outputs are only counted, so the replay measures how the controller itself
+keeps up with the recorded traffic.
+
+    python3 replay_trace.py mission.trace --speed 10
+    ./test_center --android /dev/pts/N --path-server http://127.0.0.1:5000 \
+                  --image-server http://127.0.0.1:4000/detect
+"""
+import argparse
+import os
+import re
+import struct
+import threading
+import time
+import tty
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+from fake_stm import RPI_TO_STM_PIPE, STM_TO_RPI_PIPE, FRAME_SYNC, FRAME_LEN, parse_binary_frame
+
+# See trace.h
+TRACE_MAGIC = b"MDPTRACE"
+FILE_HEADER = struct.Struct("<8sII")
+RECORD_HEADER = struct.Struct("<QBBHI")
+CH_ANDROID, CH_STM32, CH_HTTP_PATH, CH_HTTP_STREAM, CH_HTTP_IMAGE = 1, 2, 3, 4, 5
+DIR_IN, DIR_OUT = 0, 1
+
+STM_REPLY_ID = re.compile(rb"!(\d+)/")
+STM_COMMAND_ID = re.compile(rb":(\d+)/")
+
+
+def read_trace(path):
+    """Returns [(t_seconds, channel, direction, status, payload)]."""
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, version, _ = FILE_HEADER.unpack_from(data, 0)
+    if magic != TRACE_MAGIC or version != 1:
+        raise ValueError(f"{path} is not a version 1 controller trace")
+    records, pos = [], FILE_HEADER.size
+    while pos + RECORD_HEADER.size <= len(data):
+        t_ns, channel, direction, status, length = RECORD_HEADER.unpack_from(data, pos)
+        pos += RECORD_HEADER.size
+        if pos + length > len(data):
+            break  # Recording was cut off mid-record
+        records.append((t_ns / 1e9, channel, direction, status, data[pos:pos + length]))
+        pos += length
+    return records
+
+
+def stm_command_id(payload):
+    if payload and payload[0] == FRAME_SYNC and len(payload) == FRAME_LEN:
+        return int.from_bytes(payload[3:5], "little")
+    match = STM_COMMAND_ID.match(payload)
+    return int(match.group(1)) if match else None
+
+
+class Script:
+    """The recorded traffic, grouped the way the replay hands it out."""
+
+    def __init__(self, records):
+        self.android = [(t, p) for t, ch, d, _, p in records if ch == CH_ANDROID and d == DIR_IN]
+        self.android_outputs = sum(1 for _, ch, d, _, _ in records if ch == CH_ANDROID and d == DIR_OUT)
+        self.first_t = self.android[0][0] if self.android else 0.0
+        self.last_output_t = max((t for t, ch, d, _, _ in records if ch == CH_ANDROID and d == DIR_OUT),
+                                 default=self.first_t)
+
+        # STM32: per command ID, a FIFO of [(delay, reply)] lists, one per time the ID was sent
+        self.stm = {}
+        open_commands = {}
+        # Path: FIFO of (delay, status, body); stream: FIFO of ([(delay, line)], end_delay, status)
+        self.path, self.stream = [], []
+        path_sent = stream_sent = None
+        # Images: per obstacle ID, a FIFO of bursts [frames_sent, [(delay, status, body)]]
+        self.images = {}
+        burst = None
+        for t, ch, d, status, payload in records:
+            if ch == CH_STM32 and d == DIR_OUT:
+                cmd_id = stm_command_id(payload)
+                if cmd_id is not None:
+                    replies = []
+                    self.stm.setdefault(cmd_id, []).append(replies)
+                    open_commands[cmd_id] = (t, replies)
+            elif ch == CH_STM32 and d == DIR_IN:
+                match = STM_REPLY_ID.match(payload)
+                if match and int(match.group(1)) in open_commands:
+                    sent_t, replies = open_commands[int(match.group(1))]
+                    replies.append((t - sent_t, payload))
+            elif ch == CH_HTTP_PATH:
+                if d == DIR_OUT:
+                    path_sent = t
+                elif path_sent is not None:
+                    self.path.append((t - path_sent, status, payload))
+                    path_sent = None
+            elif ch == CH_HTTP_STREAM:
+                if d == DIR_OUT:
+                    stream_sent = (t, [])
+                elif stream_sent is not None:
+                    if payload:
+                        stream_sent[1].append((t - stream_sent[0], payload))
+                    else:
+                        self.stream.append((stream_sent[1], t - stream_sent[0], status))
+                        stream_sent = None
+            elif ch == CH_HTTP_IMAGE:
+                if d == DIR_OUT:
+                    obstacle = payload.decode(errors="ignore")
+                    if burst is None or burst[0] != obstacle or burst[3]:
+                        burst = [obstacle, t, [0, []], False]
+                        self.images.setdefault(obstacle, []).append(burst[2])
+                    burst[2][0] += 1
+                elif burst is not None:
+                    burst[3] = True  # A reply closes the burst to further frames
+                    burst[2][1].append((t - burst[1], status, payload))
+        self.lock = threading.Lock()
+        self.image_served = {}
+
+    def next_stm_replies(self, cmd_id):
+        with self.lock:
+            queue = self.stm.get(cmd_id)
+            return queue.pop(0) if queue else None
+
+    def next_path(self):
+        with self.lock:
+            return self.path.pop(0) if self.path else None
+
+    def next_stream(self):
+        with self.lock:
+            return self.stream.pop(0) if self.stream else None
+
+    def next_image(self, obstacle):
+        """The k-th frame of a burst gets the k-th recorded reply (or the last one)."""
+        with self.lock:
+            bursts = self.images.get(obstacle)
+            if not bursts:
+                return None
+            frames, replies = bursts[0]
+            served = self.image_served.get(obstacle, 0)
+            if served + 1 >= frames:
+                bursts.pop(0)
+                self.image_served[obstacle] = 0
+            else:
+                self.image_served[obstacle] = served + 1
+            return replies[min(served, len(replies) - 1)] if replies else None
+
+
+def make_handler(script, speed):
+    class ReplayServer(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, fmt, *args):
+            pass
+
+        def reply(self, status, body, content_type="application/json"):
+            self.send_response(status or 500)
+            self.send_header("Content-type", content_type)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def do_POST(self):
+            body = self.rfile.read(int(self.headers["Content-Length"]))
+            if self.path == "/path/stream":
+                entry = script.next_stream()
+                if entry is None:
+                    return self.reply(404, b"")
+                lines, end_delay, status = entry
+                started = time.monotonic()
+                self.send_response(status or 500)
+                self.send_header("Content-type", "application/x-ndjson")
+                self.send_header("Transfer-Encoding", "chunked")
+                self.end_headers()
+                for delay, line in lines:
+                    time.sleep(max(0.0, started + delay / speed - time.monotonic()))
+                    chunk = line + b"\n"
+                    self.wfile.write(f"{len(chunk):x}\r\n".encode("ascii") + chunk + b"\r\n")
+                    self.wfile.flush()
+                time.sleep(max(0.0, started + end_delay / speed - time.monotonic()))
+                self.wfile.write(b"0\r\n\r\n")
+            elif self.path == "/path":
+                entry = script.next_path()
+                if entry is None:
+                    return self.reply(404, b"")
+                delay, status, response = entry
+                time.sleep(delay / speed)
+                self.reply(status, response)
+            elif self.path == "/detect":
+                match = re.search(rb'name="object_id"\r\n\r\n(\S+)', body)
+                entry = script.next_image(match.group(1).decode() if match else "")
+                if entry is None:
+                    return self.reply(200, b'{"success": true, "count": 0, "objects": []}')
+                delay, status, response = entry
+                time.sleep(delay / speed)
+                self.reply(status, response)
+            else:
+                self.reply(404, b"")
+
+    return ReplayServer
+
+
+def serve(port, handler):
+    httpd = ThreadingHTTPServer(("127.0.0.1", port), handler)
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+
+
+def replay_stm(script, speed, read_fd, write_fd):
+    write_lock = threading.Lock()
+
+    def send_replies(replies):
+        started = time.monotonic()
+        for delay, reply in replies:
+            time.sleep(max(0.0, started + delay / speed - time.monotonic()))
+            with write_lock:
+                os.write(write_fd, reply + b"\n")  # Recorded with its ';'
+
+    buffer = b""
+    while True:
+        chunk = os.read(read_fd, 4096)
+        if not chunk:
+            return
+        buffer += chunk
+        while buffer:
+            if buffer[0] == FRAME_SYNC:
+                if len(buffer) < FRAME_LEN:
+                    break
+                cmd_id, buffer = parse_binary_frame(buffer[:FRAME_LEN]), buffer[FRAME_LEN:]
+            else:
+                end = buffer.find(b";")
+                if end == -1:
+                    break
+                cmd_id, buffer = stm_command_id(buffer[:end]), buffer[end + 1:]
+            if cmd_id is None:
+                continue
+            replies = script.next_stm_replies(cmd_id)
+            if replies is None:
+                print(f"[Replay] Command {cmd_id} was not in the recording; no reply sent.")
+                continue
+            threading.Thread(target=send_replies, args=(replies,), daemon=True).start()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trace")
+    parser.add_argument("--speed", type=float, default=1.0, help="Playback speed multiplier (default 1)")
+    parser.add_argument("--lead", type=float, default=1.0,
+                        help="Seconds to wait after the controller connects before the first Android message")
+    parser.add_argument("--idle-timeout", type=float, default=10.0,
+                        help="Give up once the controller has been silent this long after the last input")
+    args = parser.parse_args()
+
+    script = Script(read_trace(args.trace))
+    print(f"[Replay] {len(script.android)} Android messages, {sum(len(q) for q in script.stm.values())} STM32 commands, "
+          f"{len(script.path)} path / {len(script.stream)} stream / "
+          f"{sum(len(b) for b in script.images.values())} image requests at {args.speed:g}x.")
+
+    handler = make_handler(script, args.speed)
+    serve(5000, handler)
+    serve(4000, handler)
+
+    master_fd, slave_fd = os.openpty()
+    tty.setraw(slave_fd)  # No echo or line editing between the controller and the replay
+    for pipe_name in (RPI_TO_STM_PIPE, STM_TO_RPI_PIPE):
+        if not os.path.exists(pipe_name):
+            os.mkfifo(pipe_name)
+    print(f"[Replay] Start the controller with --android {os.ttyname(slave_fd)} "
+          "--path-server http://127.0.0.1:5000 --image-server http://127.0.0.1:4000/detect")
+
+    # Same open order as fake_stm.py, which matches the controller's
+    stm_read_fd = os.open(RPI_TO_STM_PIPE, os.O_RDONLY)
+    stm_write_fd = os.open(STM_TO_RPI_PIPE, os.O_WRONLY)
+    threading.Thread(target=replay_stm, args=(script, args.speed, stm_read_fd, stm_write_fd), daemon=True).start()
+
+    outputs = 0
+    last_output = time.monotonic()
+
+    def count_outputs():
+        nonlocal outputs, last_output
+        while True:
+            try:
+                chunk = os.read(master_fd, 4096)
+            except OSError:
+                return
+            if not chunk:
+                return
+            outputs += chunk.count(b"\n")
+            last_output = time.monotonic()
+
+    threading.Thread(target=count_outputs, daemon=True).start()
+
+    time.sleep(args.lead)
+    started = time.monotonic()
+    for t, message in script.android:
+        time.sleep(max(0.0, started + (t - script.first_t) / args.speed - time.monotonic()))
+        os.write(master_fd, message + b"\n")
+    last_output = max(last_output, time.monotonic())
+
+    while outputs < script.android_outputs and time.monotonic() - last_output < args.idle_timeout:
+        time.sleep(0.05)
+    finished = last_output if outputs >= script.android_outputs else time.monotonic()
+
+    recorded = script.last_output_t - script.first_t
+    replayed = finished - started
+    print(f"[Replay] Controller sent {outputs}/{script.android_outputs} Android messages.")
+    print(f"[Replay] Recorded {recorded:.3f} s, replayed in {replayed:.3f} s "
+          f"({recorded / replayed if replayed > 0 else 0:.1f}x).")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,223 @@
+#include "route_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ROUTE_CACHE_MAGIC 0x31435452u // "RTC1" little-endian
+#define ROUTE_CACHE_VERSION 2u // 2: commands carry their speed class
+
+// File layout: header, canonical key, then commands as (type, value, speed) and snap
+// positions as (x, y, d), all int32 so the mapped file can be read in place.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t command_count;
+    uint32_t snap_count;
+    uint32_t reserved;
+} RouteCacheHeader;
+
+static void route_cache_path(const char* dir, uint64_t hash, char* path, size_t path_size) {
+    snprintf(path, path_size, "%s/%016llx.route", dir, (unsigned long long)hash);
+}
+
+int route_cache_init(const char* dir) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "[RouteCache] Cannot create %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_obstacle_id(const void* a, const void* b) {
+    const Obstacle* oa = (const Obstacle*)a;
+    const Obstacle* ob = (const Obstacle*)b;
+    if (oa->id != ob->id) return oa->id < ob->id ? -1 : 1;
+    if (oa->x != ob->x) return oa->x < ob->x ? -1 : 1;
+    if (oa->y != ob->y) return oa->y < ob->y ? -1 : 1;
+    return oa->d < ob->d ? -1 : (oa->d > ob->d);
+}
+
+void route_cache_make_key(const SharedAppContext* context, RouteKey* key) {
+    // Android may list the same arena in any order, so sort before hashing.
+    Obstacle sorted[MAX_OBSTACLES];
+    int count = context->obstacle_count < MAX_OBSTACLES ? context->obstacle_count : MAX_OBSTACLES;
+    memcpy(sorted, context->obstacles, (size_t)count * sizeof(Obstacle));
+    qsort(sorted, (size_t)count, sizeof(Obstacle), compare_obstacle_id);
+
+    uint32_t n = 0;
+    for (int i = 0; i < count; i++) {
+        key->canon[n++] = sorted[i].id;
+        key->canon[n++] = sorted[i].x;
+        key->canon[n++] = sorted[i].y;
+        key->canon[n++] = sorted[i].d;
+    }
+    key->canon[n++] = context->robot_start_x;
+    key->canon[n++] = context->robot_start_y;
+    key->canon[n++] = context->robot_start_dir;
+    key->canon_len = n;
+
+    uint64_t hash = 0xcbf29ce484222325ull; // FNV-1a 64
+    const unsigned char* bytes = (const unsigned char*)key->canon;
+    for (size_t i = 0; i < n * sizeof(int32_t); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    key->hash = hash;
+}
+
+int route_cache_load(const char* dir, const RouteKey* key, Arena* arena,
+                     CommandList* commands, SnapList* snap_positions) {
+    char path[256];
+    route_cache_path(dir, key->hash, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1; // Plain miss
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(RouteCacheHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("[RouteCache] mmap failed");
+        return -1;
+    }
+
+    int result = -1;
+    const RouteCacheHeader* hdr = (const RouteCacheHeader*)map;
+    // 64-bit so a corrupt count cannot wrap around to match the file size
+    uint64_t expected = sizeof(*hdr) + ((uint64_t)hdr->key_len + 3ull * hdr->command_count + 3ull * hdr->snap_count) * sizeof(int32_t);
+    if (hdr->magic != ROUTE_CACHE_MAGIC || hdr->version != ROUTE_CACHE_VERSION || hdr->hash != key->hash ||
+        hdr->command_count > INT_MAX || hdr->snap_count > INT_MAX || expected != size) {
+        fprintf(stderr, "[RouteCache] Ignoring stale or corrupt entry %s\n", path);
+    } else if (hdr->key_len != key->canon_len ||
+               memcmp(hdr + 1, key->canon, key->canon_len * sizeof(int32_t)) != 0) {
+        fprintf(stderr, "[RouteCache] Hash collision on %s, treating as miss\n", path);
+    } else {
+        *commands = (CommandList){0};
+        *snap_positions = (SnapList){0};
+        commands->items = arena_array_grow(arena, NULL, 0, &commands->capacity, (int)hdr->command_count, sizeof(Command));
+        snap_positions->items = arena_array_grow(arena, NULL, 0, &snap_positions->capacity, (int)hdr->snap_count, sizeof(SnapPosition));
+        if ((hdr->command_count > 0 && !commands->items) || (hdr->snap_count > 0 && !snap_positions->items)) {
+            fprintf(stderr, "[RouteCache] Out of memory loading %s\n", path);
+        } else {
+            const int32_t* p = (const int32_t*)(hdr + 1) + hdr->key_len;
+            for (uint32_t i = 0; i < hdr->command_count; i++, p += 3) {
+                commands->items[i].type = (CommandType)p[0];
+                commands->items[i].value = p[1];
+                commands->items[i].speed = (SpeedClass)p[2];
+            }
+            for (uint32_t i = 0; i < hdr->snap_count; i++, p += 3) {
+                snap_positions->items[i].x = p[0];
+                snap_positions->items[i].y = p[1];
+                snap_positions->items[i].d = p[2];
+            }
+            commands->count = (int)hdr->command_count;
+            snap_positions->count = (int)hdr->snap_count;
+            result = 0;
+        }
+    }
+    munmap(map, size);
+    return result;
+}
+
+// Buffered writer for a cache entry, so storing a route allocates nothing.
+#define ROUTE_CACHE_WRITE_CHUNK 4096
+
+typedef struct {
+    int fd;
+    bool failed;
+    size_t used;
+    unsigned char buf[ROUTE_CACHE_WRITE_CHUNK];
+} CacheWriter;
+
+static void cache_flush(CacheWriter* w) {
+    size_t done = 0;
+    while (!w->failed && done < w->used) {
+        ssize_t n = write(w->fd, w->buf + done, w->used - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) w->failed = true;
+        else done += (size_t)n;
+    }
+    w->used = 0;
+}
+
+static void cache_put(CacheWriter* w, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    while (len > 0) {
+        if (w->used == sizeof(w->buf)) cache_flush(w);
+        size_t n = sizeof(w->buf) - w->used < len ? sizeof(w->buf) - w->used : len;
+        memcpy(w->buf + w->used, p, n);
+        w->used += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void cache_put_i32(CacheWriter* w, int32_t value) {
+    cache_put(w, &value, sizeof(value));
+}
+
+int route_cache_store(const char* dir, const RouteKey* key, const CommandList* commands,
+                      const SnapList* snap_positions) {
+    int command_count = commands->count;
+    int snap_position_count = snap_positions->count;
+    if (command_count < 0 || snap_position_count < 0) return -1;
+
+    RouteCacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ROUTE_CACHE_MAGIC;
+    hdr.version = ROUTE_CACHE_VERSION;
+    hdr.hash = key->hash;
+    hdr.key_len = key->canon_len;
+    hdr.command_count = (uint32_t)command_count;
+    hdr.snap_count = (uint32_t)snap_position_count;
+
+    // Write to a temp file and rename so a reader never maps a half-written entry.
+    char path[256], tmp_path[272];
+    route_cache_path(dir, key->hash, path, sizeof(path));
+    static atomic_uint tmp_seq; // Nav and confirm threads may store concurrently
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%u", path, (long)getpid(), atomic_fetch_add(&tmp_seq, 1));
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "[RouteCache] Cannot create %s: %s\n", tmp_path, strerror(errno));
+        return -1;
+    }
+    CacheWriter w;
+    w.fd = fd;
+    w.failed = false;
+    w.used = 0;
+    cache_put(&w, &hdr, sizeof(hdr));
+    cache_put(&w, key->canon, key->canon_len * sizeof(int32_t));
+    for (int i = 0; i < command_count; i++) {
+        cache_put_i32(&w, (int32_t)commands->items[i].type);
+        cache_put_i32(&w, commands->items[i].value);
+        cache_put_i32(&w, (int32_t)commands->items[i].speed);
+    }
+    for (int i = 0; i < snap_position_count; i++) {
+        cache_put_i32(&w, snap_positions->items[i].x);
+        cache_put_i32(&w, snap_positions->items[i].y);
+        cache_put_i32(&w, snap_positions->items[i].d);
+    }
+    cache_flush(&w);
+    close(fd);
+    if (w.failed || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "[RouteCache] Failed to write %s\n", path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef ROUTE_CACHE_H
+#define ROUTE_CACHE_H
+
+#include <stdint.h>
+
+#include "shared_types.h" // For Obstacle, Command, SnapPosition, SharedAppContext
+
+/**
+ * @file route_cache.h
+ * @brief On-disk cache of planned routes, keyed by the arena layout.
+ *
+ * The key is the obstacle set (order-independent) plus the robot start pose.
+ * Each route is stored as one small binary file named by the key hash, written
+ * atomically (temp file + rename) and mmap'd on load.
+ */
+
+// Canonical form of one arena: obstacles sorted by ID, then robot start pose.
+#define ROUTE_KEY_MAX_INTS (4 * MAX_OBSTACLES + 3)
+
+typedef struct {
+    uint64_t hash; // FNV-1a over canon[]
+    int32_t canon[ROUTE_KEY_MAX_INTS];
+    uint32_t canon_len;
+} RouteKey;
+
+// Creates the cache directory if needed. Returns 0 on success, -1 on error.
+int route_cache_init(const char* dir);
+
+// Builds the cache key for the mission currently stored in context.
+void route_cache_make_key(const SharedAppContext* context, RouteKey* key);
+
+// Loads a cached route for key into lists allocated in arena. Returns 0 on a hit,
+// -1 on a miss or a corrupt entry.
+int route_cache_load(const char* dir, const RouteKey* key, Arena* arena,
+                     CommandList* commands, SnapList* snap_positions);
+
+// Stores a route for key, replacing any previous entry. Returns 0 on success, -1 on error.
+int route_cache_store(const char* dir, const RouteKey* key, const CommandList* commands,
+                      const SnapList* snap_positions);
+
+#endif // ROUTE_CACHE_H
@@ -0,0 +1,91 @@
+#include "route_optimizer.h"
+
+static bool is_straight(CommandType type) {
+    return type == CMD_MOVE_FORWARD || type == CMD_MOVE_BACKWARD;
+}
+
+// Slow over normal over fast
+static SpeedClass cautious(SpeedClass a, SpeedClass b) {
+    if (a == SPEED_SLOW || b == SPEED_SLOW) return SPEED_SLOW;
+    return a == SPEED_NORMAL || b == SPEED_NORMAL ? SPEED_NORMAL : SPEED_FAST;
+}
+
+// Forward distance of a straight move; backward moves are negative.
+static int signed_distance(const Command* cmd) {
+    return cmd->type == CMD_MOVE_FORWARD ? cmd->value : -cmd->value;
+}
+
+int route_optimize(CommandList* commands) {
+    Command* items = commands->items;
+    int out = 0;
+
+    for (int i = 0; i < commands->count; i++) {
+        Command cmd = items[i];
+        if (!is_straight(cmd.type)) {
+            items[out++] = cmd;
+            continue;
+        }
+        if (cmd.value == 0) continue;
+
+        // A creep is already the tail of a move into a rolling snapshot
+        if (out > 0 && is_straight(items[out - 1].type) && items[out - 1].speed != SPEED_CREEP &&
+            cmd.speed != SPEED_CREEP) {
+            int net = signed_distance(&items[out - 1]) + signed_distance(&cmd);
+            if (net == 0) {
+                out--; // Moves cancel out
+            } else {
+                items[out - 1].type = net > 0 ? CMD_MOVE_FORWARD : CMD_MOVE_BACKWARD;
+                items[out - 1].value = net > 0 ? net : -net;
+                items[out - 1].speed = cautious(items[out - 1].speed, cmd.speed);
+            }
+        } else {
+            items[out++] = cmd;
+        }
+    }
+
+    int removed = commands->count - out;
+    commands->count = out;
+    return removed;
+}
+
+// Whether items[i] is a snapshot the robot can drive through (see the header);
+// i - 1 and i + 1 must be in range.
+static bool rolls_through(const Command* items, int i) {
+    return items[i].type == CMD_SNAPSHOT && items[i - 1].type == CMD_MOVE_FORWARD &&
+           (items[i + 1].type == CMD_MOVE_FORWARD || items[i + 1].type == CMD_TURN_LEFT ||
+            items[i + 1].type == CMD_TURN_RIGHT);
+}
+
+int route_roll_snapshots(Arena* arena, CommandList* commands, int creep_cm) {
+    const Command* items = commands->items;
+    int count = commands->count;
+    int rolling = 0, splits = 0;
+    for (int i = 1; i + 1 < count; i++) {
+        if (!rolls_through(items, i)) continue;
+        rolling++;
+        if (items[i - 1].value > creep_cm) splits++;
+    }
+    if (rolling == 0) return 0;
+
+    int capacity = 0;
+    Command* out = arena_array_grow(arena, NULL, 0, &capacity, count + splits, sizeof(Command));
+    if (!out) return -1;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        Command cmd = items[i];
+        if (i + 2 < count && rolls_through(items, i + 1)) {
+            if (cmd.value > creep_cm) {
+                out[n++] = (Command){ CMD_MOVE_FORWARD, cmd.value - creep_cm, cmd.speed };
+                cmd.value = creep_cm;
+            }
+            cmd.speed = SPEED_CREEP;
+        } else if (i > 0 && i + 1 < count && rolls_through(items, i)) {
+            cmd.speed = SPEED_CREEP;
+        }
+        out[n++] = cmd;
+    }
+    commands->items = out;
+    commands->count = n;
+    commands->capacity = capacity;
+    return rolling;
+}
@@ -0,0 +1,35 @@
+#ifndef ROUTE_OPTIMIZER_H
+#define ROUTE_OPTIMIZER_H
+
+#include "shared_types.h" // For CommandList
+
+/**
+ * @file route_optimizer.h
+ * @brief Peephole pass over a complete route before it is driven.
+ *
+ * Every command costs a round trip to the STM32 plus the firmware's settle time,
+ * so consecutive straight moves are folded into one: FW10,FW10,FW20 becomes FW40
+ * and FW30,BW10 becomes FW20. A run that nets to zero is dropped. A folded move
+ * takes the most cautious speed class of its parts (slow, then normal, then fast).
+ *
+ * Snapshots and turns are barriers: nothing is merged or moved across them, and
+ * snapshots are never removed, so the n-th CMD_SNAPSHOT still pairs with
+ * snap_positions[n]. Turns are arcs on this robot and are left alone.
+ *
+ * route_roll_snapshots() then picks the snapshots the robot need not stop for:
+ * one reached by a forward move and left by a forward move or a turn, with no
+ * other snapshot at its pose. The last creep_cm of the move in is split off at
+ * SPEED_CREEP and the snapshot is marked SPEED_CREEP; the frame is taken as
+ * that creep ends, without a stop. route_optimize() leaves creeps as they are,
+ * so a route that has been through both can go through them again.
+ */
+
+// Rewrites commands in place. Returns the number of commands removed.
+int route_optimize(CommandList* commands);
+
+// Marks commands' rolling snapshots (above), moving the list to new storage in
+// arena if a move is split. Returns how many were marked, or -1 if arena is
+// out of memory (commands is left as it was).
+int route_roll_snapshots(Arena* arena, CommandList* commands, int creep_cm);
+
+#endif // ROUTE_OPTIMIZER_H
@@ -9,72 +9,85 @@
 #include <errno.h>
 #include <curl/curl.h>
 #include <time.h> // For usleep in send_message_to_android_with_ack
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h> // ASYNC_LOW_LATENCY
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <linux/videodev2.h>
 
 #include "json_parser.h" // New include for JSON parsing helpers
+#include "stm32_protocol.h"
+#include "trace.h"
+#include "protocol_keywords.h"
+#include "json_writer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "android_tx.h"
+#include "latency_stats.h" // For latency_now_ns()
+#include "timeline.h"
+#include "serial_tx.h"
+#include "rt_profile.h"
 
 /**
  * @file rpi_hal.c
  * @brief Implements the Hardware Abstraction Layer for the RPi Robot Controller.
  */
 
-// --- Configuration for Android Communication ---
-#define ANDROID_COMM_MAX_RETRIES 3
-#define ANDROID_COMM_RETRY_DELAY_US 300000 // 300ms
-
-// --- Mappings from Python task1.py ---
-// These are static and internal to rpi_hal.c
-
-// Maps class names to image IDs
-static const struct {
-    const char* class_name;
-    int img_id;
-} IMAGE_MAPPING_C[] = {
-    {"Number 1", 11}, {"Number 2", 12}, {"Number 3", 13}, {"Number 4", 14},
-    {"Number 5", 15}, {"Number 6", 16}, {"Number 7", 17}, {"Number 8", 18},
-    {"Number 9", 19}, {"Alphabet A", 20}, {"Alphabet B", 21}, {"Alphabet C", 22},
-    {"Alphabet D", 23}, {"Alphabet E", 24}, {"Alphabet F", 25}, {"Alphabet G", 26},
-    {"Alphabet H", 27}, {"Alphabet S", 28}, {"Alphabet T", 29}, {"Alphabet U", 30},
-    {"Alphabet V", 31}, {"Alphabet W", 32}, {"Alphabet X", 33}, {"Alphabet Y", 34},
-    {"Alphabet Z", 35}, {"Up Arrow", 36}, {"Down Arrow", 37}, {"Right Arrow", 38},
-    {"Left Arrow", 39}, {"Stop sign", 40}
-};
-static const size_t IMAGE_MAPPING_COUNT = sizeof(IMAGE_MAPPING_C) / sizeof(IMAGE_MAPPING_C[0]);
+// --- Configuration for the V4L2 camera ---
+#define CAMERA_BUFFER_COUNT 4
+#define CAMERA_FRAME_TIMEOUT_SEC 2
+#define CAMERA_MOTION_EXPOSURE 20 // 2 ms in V4L2's 100 us units: under 1 mm of blur at the creep speed
+#define CAMERA_RING_POLL_MS 200   // How often the ring thread looks up from select() for a shutdown
+#define CAMERA_RING_SLOTS (CAMERA_RING_FRAMES > 0 ? CAMERA_RING_FRAMES : 1)
 
-// Function to map class name string to image ID
+// Function to map class name string to image ID. The class -> ID table (the
+// mapping from Python task1.py) lives in protocol_keywords.h.
 int get_img_id_from_class_name(const char* class_name) {
-    for (size_t i = 0; i < IMAGE_MAPPING_COUNT; i++) {
-        if (strcmp(IMAGE_MAPPING_C[i].class_name, class_name) == 0) {
-            return IMAGE_MAPPING_C[i].img_id;
-        }
-    }
-    return -1; // Not found
+    return kw_image_class(class_name, strlen(class_name));
 }
 
 
 // --- Internal Helper Functions ---
 
-// Helper to write a string to a serial port.
+// Helper to write a string to a serial port; the link's writer (serial_tx.h)
+// sends all of it or fails.
 static int write_to_serial(int fd, const char* message) {
-    ssize_t bytes_written = write(fd, message, strlen(message));
-    if (bytes_written < 0) {
+    if (serial_tx_send(fd, message, strlen(message)) != 0) {
         perror("write_to_serial: Failed to write");
         return -1;
     }
     return 0;
 }
 
-// Callback for libcurl to write data from a response.
+// Hands a message for the Bluetooth link to its writer thread (android_tx.h),
+// which times and retries the write, so no caller waits on RFCOMM.
+static int write_to_android(int fd, const char* message, size_t len) {
+    return android_tx_send(fd, message, len);
+}
+
+// Smallest buffer WriteMemoryCallback allocates; a JPEG frame needs a few of these
+#define MEMORY_STRUCT_MIN_CAPACITY 4096
+
+// Callback for libcurl to write data from a response. Only reallocates when the
+// buffer has to grow, which for a reused buffer stops after the first few frames.
 size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
     struct MemoryStruct *mem = (struct MemoryStruct *)userp;
 
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if(ptr == NULL) {
-        printf("not enough memory (realloc returned NULL)\n");
-        return 0;
+    size_t needed = mem->size + realsize + 1;
+    if (needed > mem->capacity) {
+        size_t capacity = mem->capacity ? mem->capacity : MEMORY_STRUCT_MIN_CAPACITY;
+        while (capacity < needed) capacity *= 2;
+        char *ptr = realloc(mem->memory, capacity);
+        if(ptr == NULL) {
+            LOG_INFO("not enough memory (realloc returned NULL)\n");
+            return 0;
+        }
+        mem->memory = ptr;
+        mem->capacity = capacity;
     }
 
-    mem->memory = ptr;
     memcpy(&(mem->memory[mem->size]), contents, realsize);
     mem->size += realsize;
     mem->memory[mem->size] = 0;
@@ -84,7 +97,46 @@ size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *user
 
 // --- Public API Implementation ---
 
+// termios speed for baud_rate, or B0 if it is not one the links use.
+static speed_t serial_speed(int baud_rate) {
+    switch (baud_rate) {
+        case 9600:    return B9600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 3000000: return B3000000;
+        case 4000000: return B4000000;
+        default:      return B0;
+    }
+}
+
+#ifndef RPI_TESTING
+// Asks the UART driver to push received bytes to the tty right away rather than
+// batching them (the FTDI default holds them for up to 16 ms). Drivers without
+// the flag (CDC-ACM, RFCOMM) do not implement TIOCGSERIAL and are left as they are.
+static void serial_set_low_latency(int fd, const char* device) {
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) != 0) {
+        LOG_DEBUG("Serial port %s has no low-latency mode (%s).\n", device, strerror(errno));
+        return;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) != 0) {
+        LOG_WARN("Serial port %s: could not enable low-latency mode: %s\n", device, strerror(errno));
+    }
+}
+#endif
+
 int init_serial_port(const char* device, int baud_rate) {
+    speed_t speed = serial_speed(baud_rate);
+    if (speed == B0) {
+        LOG_ERROR("init_serial_port: Unsupported baud rate %d for %s\n", baud_rate, device);
+        return -1;
+    }
     int fd = open(device, O_RDWR | O_NOCTTY | O_NDELAY);
     if (fd == -1) {
         perror("init_serial_port: Unable to open device");
@@ -95,85 +147,125 @@ int init_serial_port(const char* device, int baud_rate) {
     // For named pipes, termios settings are not applicable.
     // We just need the file descriptor.
     fcntl(fd, F_SETFL, 0); // Ensure blocking write for named pipes
-    printf("Named pipe %s opened successfully for testing.\n", device);
+    LOG_INFO("Named pipe %s opened successfully for testing.\n", device);
     return fd;
 #else
     // For real serial ports, apply termios settings
     fcntl(fd, F_SETFL, 0); // Set to blocking mode
 
     struct termios options;
-    tcgetattr(fd, &options);
-
-    speed_t speed;
-    switch (baud_rate) {
-        case 9600:   speed = B9600;   break;
-        case 115200: speed = B115200; break;
-        default:     fprintf(stderr, "Unsupported baud rate\n"); close(fd); return -1;
+    if (tcgetattr(fd, &options) != 0) {
+        perror("init_serial_port: tcgetattr failed");
+        close(fd);
+        return -1;
     }
+    // Raw 8N1: no line discipline, so STM32 frames (';'-terminated or binary) and
+    // Android JSON reach the reactor's framers byte-for-byte as they arrive, with
+    // nothing held back waiting for a newline or rewritten on the way out.
+    cfmakeraw(&options);
     cfsetispeed(&options, speed);
     cfsetospeed(&options, speed);
-
     options.c_cflag |= (CLOCAL | CREAD);
-    options.c_cflag &= ~CSIZE;
-    options.c_cflag |= CS8;
-    options.c_cflag &= ~PARENB;
-    options.c_cflag &= ~CSTOPB;
-    options.c_lflag |= ICANON; // Use canonical mode to read line by line
+    options.c_cflag &= ~(CSTOPB | CRTSCTS);
+    // The reactor only reads once epoll reports data, so return whatever is
+    // there rather than waiting for more (VMIN 0 would read 0 and look like EOF).
     options.c_cc[VMIN] = 1;
     options.c_cc[VTIME] = 0;
 
-    tcflush(fd, TCIFLUSH);
-    tcsetattr(fd, TCSANOW, &options);
+    tcflush(fd, TCIOFLUSH);
+    if (tcsetattr(fd, TCSANOW, &options) != 0) {
+        perror("init_serial_port: tcsetattr failed");
+        close(fd);
+        return -1;
+    }
+    serial_set_low_latency(fd, device);
 
-    printf("Serial port %s initialized successfully.\n", device);
+    LOG_INFO("Serial port %s initialized at %d baud (raw).\n", device, baud_rate);
     return fd;
 #endif
 }
 
+int set_serial_baud(int fd, int baud_rate) {
+    speed_t speed = serial_speed(baud_rate);
+    struct termios options;
+    if (speed == B0 || !isatty(fd) || tcgetattr(fd, &options) != 0) return -1;
+    tcdrain(fd); // What is queued still goes out at the old rate
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    if (tcsetattr(fd, TCSANOW, &options) != 0) {
+        perror("set_serial_baud: tcsetattr failed");
+        return -1;
+    }
+    return 0;
+}
+
 // --- Android Communication ---
 
 int send_status_to_android(int fd, const char* status) {
     char buffer[256];
-    // Format: {"type": "status", "value": "\"message\""}\n (message itself is quoted)
-    snprintf(buffer, sizeof(buffer), "{\"type\": \"status\", \"value\": \"%s\"}\n", status);
-    return write_to_serial(fd, buffer);
+    JsonWriter w;
+    // Format: {"type":"status","value":"message"}\n
+    jw_init(&w, buffer, sizeof(buffer));
+    jw_begin_object(&w);
+    jw_key(&w, "type");
+    jw_string(&w, "status");
+    jw_key(&w, "value");
+    jw_string(&w, status);
+    jw_end_object(&w);
+    jw_raw(&w, "\n", 1);
+    if (!jw_str(&w)) {
+        LOG_ERROR("[AndroidComm] Status message too long, not sent: %s\n", status);
+        return -1;
+    }
+    return write_to_android(fd, buffer, jw_len(&w));
 }
 
-// New function: Sends a message to Android with retries (mimics Python's send_with_ack)
+// New function: Sends a message to Android with retries (mimics Python's send_with_ack).
+// The retries happen on the writer thread; this only queues the message.
 int send_message_to_android_with_ack(int fd, const char* message) {
-    for (int attempt = 0; attempt < ANDROID_COMM_MAX_RETRIES; attempt++) {
-        printf("[AndroidComm] Attempt %d: Sending %s", attempt + 1, message);
-        if (write_to_serial(fd, message) == 0) {
-            // For now, we assume success after writing.
-            // A full ACK mechanism would involve reading from 'fd' for a response.
-            return 0; // Success
-        }
-        usleep(ANDROID_COMM_RETRY_DELAY_US); // Delay before retry
+    LOG_DEBUG("[AndroidComm] Queueing %s", message);
+    if (write_to_android(fd, message, strlen(message)) != 0) {
+        LOG_ERROR("[AndroidComm] Failed to send message: %s", message);
+        return -1;
     }
-    fprintf(stderr, "[AndroidComm] Failed to send message after %d attempts: %s", ANDROID_COMM_MAX_RETRIES, message);
-    return -1; // Failure
+    return 0;
 }
 
 
 // New function: send_target_result_to_android (replaces old send_image_result_to_android)
 int send_target_result_to_android(int fd, int obstacle_id, int recognized_image_id) {
-    char buffer[256];
-    char json_buffer[512]; // Buffer to hold the full JSON string
+    char buffer[64];
+    JsonWriter w;
     // Python format: resp = "TARGET," + str(object_id) + "," + str(class_name)
     // Then json.dumps(resp) + "\n"
-    snprintf(buffer, sizeof(buffer), "TARGET,%d,%d", obstacle_id, recognized_image_id);
-    snprintf(json_buffer, sizeof(json_buffer), "\"%s\"\n", buffer); // Enclose in quotes and add newline
-
-    return send_message_to_android_with_ack(fd, json_buffer);
+    jw_init(&w, buffer, sizeof(buffer));
+    jw_raw_str(&w, "\"TARGET,");
+    jw_raw_int(&w, obstacle_id);
+    jw_raw(&w, ",", 1);
+    jw_raw_int(&w, recognized_image_id);
+    jw_raw(&w, "\"\n", 2);
+    return send_message_to_android_with_ack(fd, buffer);
 }
 
 // New function to send standardized ACK messages to Android
 int send_android_ack(int fd, const char* original_cat, const char* status_message) {
     char json_ack_buffer[512];
-    // Format: {"cat": "original_cat_value", "status": "status_message_value"}\n
-    snprintf(json_ack_buffer, sizeof(json_ack_buffer), "{\"cat\": \"%s\", \"status\": \"%s\"}\n", original_cat, status_message);
-    printf("[AndroidComm] Sending ACK: %s", json_ack_buffer);
-    return write_to_serial(fd, json_ack_buffer);
+    JsonWriter w;
+    // Format: {"cat":"original_cat_value","status":"status_message_value"}\n
+    jw_init(&w, json_ack_buffer, sizeof(json_ack_buffer));
+    jw_begin_object(&w);
+    jw_key(&w, "cat");
+    jw_string(&w, original_cat);
+    jw_key(&w, "status");
+    jw_string(&w, status_message);
+    jw_end_object(&w);
+    jw_raw(&w, "\n", 1);
+    if (!jw_str(&w)) {
+        LOG_ERROR("[AndroidComm] ACK too long, not sent: %s\n", status_message);
+        return -1;
+    }
+    LOG_DEBUG("[AndroidComm] Sending ACK: %s", json_ack_buffer);
+    return write_to_android(fd, json_ack_buffer, jw_len(&w));
 }
 
 // New function: parse_android_map_and_obstacles (replaces old parse_obstacle_map_from_android)
@@ -181,12 +273,12 @@ int parse_android_map_and_obstacles(const char* json_string, SharedAppContext* c
     return parse_android_map_json(json_string, context);
 }
 
-// New function: parse and execute direct Android commands
-int parse_and_execute_android_command(int stm32_fd, const char* android_command_str, SharedAppContext* context) {
-    printf("[RPI_HAL] Received Android command for STM: %s\n", android_command_str);
+// Parses a direct Android STM command such as "<FW10>" into cmd.
+// Returns 0 on success, -1 if the string is malformed or the type is unknown.
+int parse_android_stm_command(const char* android_command_str, Command* out_cmd) {
     char command_type_str[5]; // e.g., "FW", "BW", "FL", "FR", "TL", "TR"
     int value = 0;
-    Command cmd;
+    Command cmd = {0};
     int parse_success = -1;
 
     // Extract content between '<' and '>'
@@ -198,7 +290,7 @@ int parse_and_execute_android_command(int stm32_fd, const char* android_command_
             char clean_command_content[50];
             size_t len = end_ptr - start_ptr;
             if (len >= sizeof(clean_command_content)) {
-                fprintf(stderr, "[RPI_HAL] Android command content too long.\n");
+                LOG_ERROR("[RPI_HAL] Android command content too long.\n");
                 return -1;
             }
             strncpy(clean_command_content, start_ptr, len);
@@ -235,120 +327,455 @@ int parse_and_execute_android_command(int stm32_fd, const char* android_command_
                     cmd.value = value;
                     parse_success = 0;
                 } else {
-                    fprintf(stderr, "[RPI_HAL] Unrecognized command type: %s\n", command_type_str);
+                    LOG_ERROR("[RPI_HAL] Unrecognized command type: %s\n", command_type_str);
                 }
             } else {
-                fprintf(stderr, "[RPI_HAL] Failed to parse command content: %s\n", clean_command_content);
+                LOG_ERROR("[RPI_HAL] Failed to parse command content: %s\n", clean_command_content);
             }
         } else {
-            fprintf(stderr, "[RPI_HAL] Malformed Android command: Missing closing '>'.\n");
+            LOG_ERROR("[RPI_HAL] Malformed Android command: Missing closing '>'.\n");
         }
     } else {
-        fprintf(stderr, "[RPI_HAL] Malformed Android command: Missing opening '<'.\n");
-    }
-
-    if (parse_success == 0) {
-        printf("[RPI_HAL] Translating Android command: Type %d, Value %d\n", cmd.type, cmd.value);
-        // Send command to STM32 with a unique ID for this direct command
-        uint32_t expected_cmd_id = send_command_to_stm32(stm32_fd, cmd, 0); // 0 means generate new ID
-        
-        if (expected_cmd_id != 0) { // If a command was actually sent to STM32
-            int ack_result = 0; // 0 for success, -1 for error/timeout
-            pthread_mutex_lock(&context->stm32_ack_mutex);
-            
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 5; // Wait for up to 5 seconds for ACK
-
-            // Wait until the specific ACK for this command ID is received
-            while (context->stm32_last_ack_id != expected_cmd_id && !context->stop_requested) {
-                int rc = pthread_cond_timedwait(&context->stm32_ack_cond, &context->stm32_ack_mutex, &ts);
-                if (rc == ETIMEDOUT) {
-                    fprintf(stderr, "[RPI_HAL] Timeout waiting for ACK for direct command %u.\n", expected_cmd_id);
-                    ack_result = -1; // Indicate error
-                    break;
-                } else if (rc != 0) {
-                    fprintf(stderr, "[RPI_HAL] Error waiting for ACK condition variable for direct command: %d\n", rc);
-                    ack_result = -1; // Indicate error
-                    break;
-                }
-            }
+        LOG_ERROR("[RPI_HAL] Malformed Android command: Missing opening '<'.\n");
+    }
 
-            if (ack_result == 0 && context->stm32_last_ack_id == expected_cmd_id) {
-                printf("[RPI_HAL] Received ACK for direct command %u.\n", expected_cmd_id);
-            }
-            pthread_mutex_unlock(&context->stm32_ack_mutex);
-        } else {
-            fprintf(stderr, "[RPI_HAL] send_command_to_stm32 returned 0, no command sent to STM32.\n");
-            parse_success = -1; // Mark as failed because no command was actually sent
+    if (parse_success == 0) *out_cmd = cmd;
+    return parse_success;
+}
+
+// --- PC/Server Communication ---
+
+// Connection reuse: every handle shares one DNS cache and connection pool, and
+// the pathfinding client keeps a single long-lived handle. Without this each
+// request paid for DNS resolution and a fresh TCP connect on the lab Wi-Fi.
+static CURLSH* g_curl_share = NULL;
+static pthread_mutex_t g_curl_share_locks[CURL_LOCK_DATA_LAST];
+static CURL* g_path_curl = NULL;
+static pthread_mutex_t g_path_curl_lock = PTHREAD_MUTEX_INITIALIZER;
+// Runs g_path_curl's transfers so that http_wake_transfers() can interrupt them
+static CURLM* g_path_multi = NULL;
+
+static void curl_share_lock_cb(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+    (void)handle; (void)access; (void)userptr;
+    pthread_mutex_lock(&g_curl_share_locks[data]);
+}
+
+static void curl_share_unlock_cb(CURL* handle, curl_lock_data data, void* userptr) {
+    (void)handle; (void)userptr;
+    pthread_mutex_unlock(&g_curl_share_locks[data]);
+}
+
+int http_client_init(void) {
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&g_curl_share_locks[i], NULL);
+
+    g_curl_share = curl_share_init();
+    if (g_curl_share) {
+        curl_share_setopt(g_curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock_cb);
+        curl_share_setopt(g_curl_share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock_cb);
+        curl_share_setopt(g_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(g_curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    } else {
+        LOG_ERROR("http_client_init: curl_share_init() failed, connections will not be shared.\n");
+    }
+
+    g_path_curl = curl_easy_init();
+    if (!g_path_curl) {
+        LOG_ERROR("http_client_init: curl_easy_init() failed.\n");
+        return -1;
+    }
+    g_path_multi = curl_multi_init();
+    if (!g_path_multi) LOG_WARN("http_client_init: curl_multi_init() failed, route requests cannot be interrupted.\n");
+    return 0;
+}
+
+void http_client_cleanup(void) {
+    if (g_path_multi) {
+        curl_multi_cleanup(g_path_multi);
+        g_path_multi = NULL;
+    }
+    if (g_path_curl) {
+        curl_easy_cleanup(g_path_curl);
+        g_path_curl = NULL;
+    }
+    if (g_curl_share) {
+        curl_share_cleanup(g_curl_share);
+        g_curl_share = NULL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_destroy(&g_curl_share_locks[i]);
+}
+
+void http_configure_handle(CURL* curl) {
+    if (g_curl_share) curl_easy_setopt(curl, CURLOPT_SHARE, g_curl_share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);       // Safe with multiple threads
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);    // Small JSON bodies should not wait on Nagle
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);  // Keep idle connections from being dropped by the AP
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 10L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 5L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+}
+
+int http_prewarm(const char* url) {
+    return http_prewarm_many(url, 1, NULL) == 1 ? 0 : -1;
+}
+
+int http_prewarm_many(const char* url, int count, curl_write_callback on_header) {
+    // HEAD requests, all at once so each opens its own connection, resolve the
+    // host and leave the connections in the shared pool. Any HTTP status
+    // counts, only transport errors are failures.
+    CURL* handles[HTTP_PREWARM_MAX] = {0};
+    CURLM* multi = curl_multi_init();
+    if (!multi) return 0;
+    if (count > HTTP_PREWARM_MAX) count = HTTP_PREWARM_MAX;
+    int running = 0;
+    for (int i = 0; i < count; i++) {
+        handles[i] = curl_easy_init();
+        if (!handles[i]) continue;
+        http_configure_handle(handles[i]);
+        curl_easy_setopt(handles[i], CURLOPT_URL, url);
+        curl_easy_setopt(handles[i], CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_TIMEOUT, 3L);
+        if (on_header) curl_easy_setopt(handles[i], CURLOPT_HEADERFUNCTION, on_header);
+        if (curl_multi_add_handle(multi, handles[i]) == CURLM_OK) running++;
+    }
+
+    int connected = 0;
+    CURLcode failure = CURLE_OK;
+    while (running > 0) {
+        if (curl_multi_perform(multi, &running) != CURLM_OK) break;
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            if (msg->data.result == CURLE_OK) connected++;
+            else failure = msg->data.result;
         }
-        return parse_success;
+        if (running > 0) curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        if (!handles[i]) continue;
+        curl_multi_remove_handle(multi, handles[i]);
+        curl_easy_cleanup(handles[i]);
+    }
+    curl_multi_cleanup(multi);
+    if (connected == 0) {
+        LOG_ERROR("http_prewarm: %s unreachable: %s\n", url, curl_easy_strerror(failure));
     } else {
-        return -1; // Parse failed
+        LOG_INFO("[HTTP] Pre-connected to %s (%d of %d)\n", url, connected, count);
     }
+    return connected;
+}
+
+void http_wake_transfers(void) {
+    if (g_path_multi) curl_multi_wakeup(g_path_multi);
 }
 
+// CURLOPT_XFERINFOFUNCTION for the pathfinding handle: aborts once *clientp is set.
+static int CancelProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    const atomic_bool* cancel = (const atomic_bool*)clientp;
+    return cancel && atomic_load(cancel) ? 1 : 0;
+}
 
-// --- PC/Server Communication ---
+// curl_easy_perform() for g_path_curl, with g_path_curl_lock held. The transfer
+// runs on g_path_multi, whose wait http_wake_transfers() cuts short, so a cancel
+// takes effect at once rather than at the next progress callback.
+static CURLcode path_perform(CURL* curl, const atomic_bool* cancel) {
+    if (!g_path_multi || curl_multi_add_handle(g_path_multi, curl) != CURLM_OK) return curl_easy_perform(curl);
+    CURLcode res = CURLE_OK;
+    int running = 1;
+    while (running > 0) {
+        if (curl_multi_perform(g_path_multi, &running) != CURLM_OK) {
+            res = CURLE_FAILED_INIT;
+            break;
+        }
+        if (cancel && atomic_load(cancel)) {
+            res = CURLE_ABORTED_BY_CALLBACK; // What the progress callback would have made it
+            break;
+        }
+        if (running > 0) curl_multi_poll(g_path_multi, NULL, 0, 1000, NULL);
+    }
+    CURLMsg* msg;
+    int queued;
+    while ((msg = curl_multi_info_read(g_path_multi, &queued)) != NULL) {
+        if (msg->msg == CURLMSG_DONE && res == CURLE_OK) res = msg->data.result;
+    }
+    curl_multi_remove_handle(g_path_multi, curl);
+    return res;
+}
 
-int post_data_to_server(const char* url, const char* payload, char* response_buffer, int buffer_size) {
+// Callback for libcurl that appends the response body to a StrBuilder.
+static size_t StrBuilderWriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    StrBuilder* body = (StrBuilder*)userp;
+    size_t realsize = size * nmemb;
+    sb_append_n(body, (const char*)contents, realsize);
+    return body->failed ? 0 : realsize;
+}
+
+int post_data_to_server(const char* url, const char* payload, Arena* arena, const char** response,
+                        const atomic_bool* cancel) {
     CURL* curl;
     CURLcode res;
     int result = -1;
 
-    struct MemoryStruct chunk;
-    chunk.memory = malloc(1);
-    chunk.size = 0;
+    StrBuilder body;
+    sb_init(&body, arena, 4096);
 
-    // curl_global_init(CURL_GLOBAL_ALL); // This is now done once in main
-    curl = curl_easy_init();
+    pthread_mutex_lock(&g_path_curl_lock);
+    curl = g_path_curl;
     if (curl) {
+        curl_easy_reset(curl); // Drops the previous request's options, keeps the connection
+        http_configure_handle(curl);
         struct curl_slist *headers = NULL;
         headers = curl_slist_append(headers, "Content-Type: application/json");
 
         curl_easy_setopt(curl, CURLOPT_URL, url);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, StrBuilderWriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&body);
+        if (cancel) {
+            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, CancelProgressCallback);
+            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)cancel);
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        }
         curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
 
-        res = curl_easy_perform(curl);
+        trace_record(TRACE_CH_HTTP_PATH, TRACE_DIR_OUT, 0, payload, strlen(payload));
+        uint64_t request_ns = latency_now_ns();
+        res = path_perform(curl, cancel);
+        timeline_span(request_ns, latency_now_ns(), "POST %s", url);
         if (res != CURLE_OK) {
-            fprintf(stderr, "post_data_to_server failed: %s\n", curl_easy_strerror(res));
+            LOG_ERROR("post_data_to_server failed: %s\n", curl_easy_strerror(res));
+            trace_record(TRACE_CH_HTTP_PATH, TRACE_DIR_IN, 0, NULL, 0);
         } else {
             long response_code;
             curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+            trace_record(TRACE_CH_HTTP_PATH, TRACE_DIR_IN, (uint16_t)response_code, body.data, body.failed ? 0 : body.len);
             if (response_code >= 200 && response_code < 300) {
-                strncpy(response_buffer, chunk.memory, buffer_size - 1);
-                response_buffer[buffer_size - 1] = '\0';
+                *response = sb_str(&body);
                 result = 0; // Success
             } else {
-                fprintf(stderr, "post_data_to_server received non-2xx response: %ld\n", response_code);
+                LOG_ERROR("post_data_to_server received non-2xx response: %ld\n", response_code);
             }
         }
         curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
     } else {
-        fprintf(stderr, "post_data_to_server: curl_easy_init() failed.\n");
+        LOG_ERROR("post_data_to_server: HTTP client not initialized.\n");
     }
-    free(chunk.memory);
-    // curl_global_cleanup(); // This is now done once in main
+    pthread_mutex_unlock(&g_path_curl_lock);
+    return result;
+}
+
+// Splits a streamed response body into lines for post_data_to_server_ndjson.
+struct NdjsonStream {
+    CURL* curl;
+    int (*on_line)(const char* line, void* userdata);
+    void* userdata;
+    const atomic_bool* cancel;
+    bool status_checked;
+    long response_code;
+    char line[NDJSON_MAX_LINE];
+    size_t line_len;
+};
+
+static size_t NdjsonWriteCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct NdjsonStream* stream = (struct NdjsonStream*)userp;
+    size_t realsize = size * nmemb;
+    const char* data = (const char*)contents;
+
+    // An error page is not a route, so bail out before handing anything on.
+    if (!stream->status_checked) {
+        long response_code = 0;
+        curl_easy_getinfo(stream->curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (response_code < 200 || response_code >= 300) {
+            LOG_ERROR("post_data_to_server_ndjson received non-2xx response: %ld\n", response_code);
+            return 0;
+        }
+        stream->status_checked = true;
+        stream->response_code = response_code;
+    }
+
+    for (size_t i = 0; i < realsize; i++) {
+        if (data[i] == '\n') {
+            stream->line[stream->line_len] = '\0';
+            size_t len = stream->line_len;
+            stream->line_len = 0;
+            if (len > 0) trace_record(TRACE_CH_HTTP_STREAM, TRACE_DIR_IN, (uint16_t)stream->response_code, stream->line, len);
+            if (len > 0 && stream->on_line(stream->line, stream->userdata) != 0) {
+                return 0; // Caller cancelled; curl aborts with CURLE_WRITE_ERROR
+            }
+        } else if (stream->line_len < sizeof(stream->line) - 1) {
+            stream->line[stream->line_len++] = data[i];
+        } else {
+            LOG_ERROR("post_data_to_server_ndjson: line exceeds %d bytes.\n", NDJSON_MAX_LINE);
+            return 0;
+        }
+    }
+    return realsize;
+}
+
+// Lets a cancel request interrupt the transfer while it is waiting for the next line.
+static int NdjsonProgressCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    const struct NdjsonStream* stream = (const struct NdjsonStream*)clientp;
+    return stream->cancel && atomic_load(stream->cancel) ? 1 : 0;
+}
+
+int post_data_to_server_ndjson(const char* url, const char* payload,
+                               int (*on_line)(const char* line, void* userdata), void* userdata,
+                               const atomic_bool* cancel) {
+    int result = -1;
+    pthread_mutex_lock(&g_path_curl_lock);
+    // One stream per request on the shared handle, so one buffer, under its lock
+    static struct NdjsonStream s_stream;
+    struct NdjsonStream* stream = &s_stream;
+    stream->status_checked = false;
+    stream->response_code = 0;
+    stream->line_len = 0;
+    stream->on_line = on_line;
+    stream->userdata = userdata;
+    stream->cancel = cancel;
+
+    CURL* curl = g_path_curl;
+    if (curl) {
+        stream->curl = curl;
+        curl_easy_reset(curl);
+        http_configure_handle(curl);
+        struct curl_slist *headers = NULL;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, NdjsonWriteCallback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)stream);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, NdjsonProgressCallback);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void *)stream);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+        trace_record(TRACE_CH_HTTP_STREAM, TRACE_DIR_OUT, 0, payload, strlen(payload));
+        uint64_t request_ns = latency_now_ns();
+        CURLcode res = path_perform(curl, cancel);
+        timeline_span(request_ns, latency_now_ns(), "POST %s", url);
+        if (res != CURLE_OK) {
+            LOG_ERROR("post_data_to_server_ndjson failed: %s\n", curl_easy_strerror(res));
+        } else if (stream->line_len > 0) {
+            // Tolerate a final line without its newline
+            stream->line[stream->line_len] = '\0';
+            trace_record(TRACE_CH_HTTP_STREAM, TRACE_DIR_IN, (uint16_t)stream->response_code, stream->line, stream->line_len);
+            result = on_line(stream->line, userdata) == 0 ? 0 : -1;
+        } else {
+            result = 0;
+        }
+        // An empty record marks where the stream ended (status 0 if it broke off)
+        long end_code = 0;
+        if (res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &end_code);
+        trace_record(TRACE_CH_HTTP_STREAM, TRACE_DIR_IN, (uint16_t)end_code, NULL, 0);
+        curl_slist_free_all(headers);
+    } else {
+        LOG_ERROR("post_data_to_server_ndjson: HTTP client not initialized.\n");
+    }
+    pthread_mutex_unlock(&g_path_curl_lock);
     return result;
 }
 
 // Modified parse_command_route_from_server
-int parse_command_route_from_server(const char* json_string, Command commands[], int* command_count, SnapPosition snap_positions[], int* snap_position_count) {
-    return parse_route_json(json_string, commands, command_count, snap_positions, snap_position_count);
+int parse_command_route_from_server(const char* json_string, Arena* arena, CommandList* commands, SnapList* snap_positions) {
+    return parse_route_json(json_string, arena, commands, snap_positions);
 }
 
 // --- STM32 Communication ---
 
+#define DEFAULT_MOVE_SPEED_PERCENTAGE 70 // 70% speed
+#define DEFAULT_TURN_SPEED_PERCENTAGE 60 // 60% speed
+#define SLOW_MOVE_SPEED_PERCENTAGE 45
+#define FAST_MOVE_SPEED_PERCENTAGE 95
+#define SLOW_TURN_SPEED_PERCENTAGE 40  // Turns are never fast: the planner's turn primitives are measured at 60%
+#define CREEP_MOVE_SPEED_PERCENTAGE 25 // Slow enough that a short exposure is sharp on the move
+
+static atomic_bool g_speed_classes = true;
+// Stm32Speeds, field by field, so a command mid-send sees each one whole
+static atomic_int g_move_speed = DEFAULT_MOVE_SPEED_PERCENTAGE;
+static atomic_int g_turn_speed = DEFAULT_TURN_SPEED_PERCENTAGE;
+static atomic_int g_slow_move_speed = SLOW_MOVE_SPEED_PERCENTAGE;
+static atomic_int g_fast_move_speed = FAST_MOVE_SPEED_PERCENTAGE;
+static atomic_int g_slow_turn_speed = SLOW_TURN_SPEED_PERCENTAGE;
+static atomic_int g_creep_move_speed = CREEP_MOVE_SPEED_PERCENTAGE;
+
+void stm32_set_speed_classes(bool enabled) {
+    atomic_store(&g_speed_classes, enabled);
+}
+
+void stm32_get_speeds(Stm32Speeds* out) {
+    out->move = atomic_load(&g_move_speed);
+    out->turn = atomic_load(&g_turn_speed);
+    out->slow_move = atomic_load(&g_slow_move_speed);
+    out->fast_move = atomic_load(&g_fast_move_speed);
+    out->slow_turn = atomic_load(&g_slow_turn_speed);
+    out->creep_move = atomic_load(&g_creep_move_speed);
+}
+
+void stm32_set_speeds(const Stm32Speeds* speeds) {
+    atomic_store(&g_move_speed, speeds->move);
+    atomic_store(&g_turn_speed, speeds->turn);
+    atomic_store(&g_slow_move_speed, speeds->slow_move);
+    atomic_store(&g_fast_move_speed, speeds->fast_move);
+    atomic_store(&g_slow_turn_speed, speeds->slow_turn);
+    atomic_store(&g_creep_move_speed, speeds->creep_move);
+}
+
+// Drive speed of a command, by its class (defaults with classes off, except
+// the creep, which the planner never chose).
+static int stm32_command_speed(const Command* command) {
+    bool move = command->type == CMD_MOVE_FORWARD || command->type == CMD_MOVE_BACKWARD;
+    SpeedClass speed = command->speed == SPEED_CREEP || atomic_load(&g_speed_classes) ? command->speed : SPEED_NORMAL;
+    if (speed == SPEED_SLOW) return atomic_load(move ? &g_slow_move_speed : &g_slow_turn_speed);
+    if (speed == SPEED_FAST && move) return atomic_load(&g_fast_move_speed);
+    if (speed == SPEED_CREEP && move) return atomic_load(&g_creep_move_speed);
+    return atomic_load(move ? &g_move_speed : &g_turn_speed);
+}
+
+int stm32_command_timed_value(Command command) {
+    if (command.type == CMD_SNAPSHOT || command.speed == SPEED_NORMAL) return command.value;
+    Command normal = command;
+    normal.speed = SPEED_NORMAL;
+    int speed = stm32_command_speed(&command);
+    return (int)(((int64_t)command.value * stm32_command_speed(&normal) + speed / 2) / speed);
+}
+
+// Firmware name, binary opcode and speed for a motion command. Returns 0, or -1
+// for commands the STM32 does not execute (snapshots).
+static int stm32_command_fields(const Command* command, const char** stm_name, uint8_t* opcode, int* speed) {
+    *speed = stm32_command_speed(command);
+    switch (command->type) {
+        case CMD_MOVE_FORWARD:
+            // STM32 format: :<cmdid>/MOTOR/FWD/<param1Speed>/<param2DistAngle>;
+            *stm_name = "FWD";
+            *opcode = STM32_OP_FWD;
+            return 0;
+        case CMD_MOVE_BACKWARD: // Added for BW command
+            // STM32 format: :<cmdid>/MOTOR/BWD/<param1Speed>/<param2DistAngle>;
+            *stm_name = "BWD";
+            *opcode = STM32_OP_REV;
+            return 0;
+        case CMD_TURN_LEFT:
+            // STM32 format: :<cmdid>/MOTOR/TURNL/<param1Speed>/<param2DistAngle>;
+            *stm_name = "TURNL";
+            *opcode = STM32_OP_TURNL;
+            return 0;
+        case CMD_TURN_RIGHT:
+            // STM32 format: :<cmdid>/MOTOR/TURNR/<param1Speed>/<param2DistAngle>;
+            *stm_name = "TURNR";
+            *opcode = STM32_OP_TURNR;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
 uint32_t send_command_to_stm32(int fd, Command command, uint32_t external_cmd_id) {
-    char stm_command[128];
     static uint32_t internal_cmd_id_counter = 0; // Static to maintain ID across calls
-    const int DEFAULT_MOVE_SPEED_PERCENTAGE = 70; // 70% speed
-    const int DEFAULT_TURN_SPEED_PERCENTAGE = 60; // 60% speed
 
     uint32_t cmd_id_to_use;
     if (external_cmd_id != 0) {
@@ -360,84 +787,568 @@ uint32_t send_command_to_stm32(int fd, Command command, uint32_t external_cmd_id
         cmd_id_to_use = internal_cmd_id_counter;
     }
 
-    int write_result = -1; // Flag to check if a command was written to serial
+    const char* stm_name;  // ASCII command name
+    uint8_t opcode;        // Binary frame opcode
+    int speed;
+    if (command.type == CMD_SNAPSHOT) {
+        LOG_INFO("[To STM32]: Skipping snapshot command (handled by RPi).\n");
+        return 0; // Indicate no STM command was sent
+    }
+    if (stm32_command_fields(&command, &stm_name, &opcode, &speed) != 0) {
+        LOG_ERROR("send_command_to_stm32: Unknown command type (%d)\n", command.type);
+        return 0; // Indicate no STM command was sent
+    }
 
-    switch (command.type) {
-        case CMD_MOVE_FORWARD:
-            // STM32 format: :<cmdid>/MOTOR/FWD/<param1Speed>/<param2DistAngle>;
-            snprintf(stm_command, sizeof(stm_command), ":%u/MOTOR/FWD/%d/%d;",
-                     cmd_id_to_use, DEFAULT_MOVE_SPEED_PERCENTAGE, command.value);
-            write_result = write_to_serial(fd, stm_command);
-            break;
-        case CMD_MOVE_BACKWARD: // Added for BW command
-            // STM32 format: :<cmdid>/MOTOR/BWD/<param1Speed>/<param2DistAngle>;
-            snprintf(stm_command, sizeof(stm_command), ":%u/MOTOR/BWD/%d/%d;",
-                     cmd_id_to_use, DEFAULT_MOVE_SPEED_PERCENTAGE, command.value);
-            write_result = write_to_serial(fd, stm_command);
-            break;
-        case CMD_TURN_LEFT:
-            // STM32 format: :<cmdid>/MOTOR/TURNL/<param1Speed>/<param2DistAngle>;
-            snprintf(stm_command, sizeof(stm_command), ":%u/MOTOR/TURNL/%d/%d;",
-                     cmd_id_to_use, DEFAULT_TURN_SPEED_PERCENTAGE, command.value);
-            write_result = write_to_serial(fd, stm_command);
-            break;
-        case CMD_TURN_RIGHT:
-            // STM32 format: :<cmdid>/MOTOR/TURNR/<param1Speed>/<param2DistAngle>;
-            snprintf(stm_command, sizeof(stm_command), ":%u/MOTOR/TURNR/%d/%d;",
-                     cmd_id_to_use, DEFAULT_TURN_SPEED_PERCENTAGE, command.value);
-            write_result = write_to_serial(fd, stm_command);
-            break;
-        case CMD_SNAPSHOT:
-            printf("[To STM32]: Skipping snapshot command (handled by RPi).\n");
-            return 0; // Indicate no STM command was sent
-        default:
-            fprintf(stderr, "send_command_to_stm32: Unknown command type (%d)\n", command.type);
-            return 0; // Indicate no STM command was sent
+    // Binary frames once the firmware has answered the probe; ASCII otherwise, or
+    // when a field does not fit the frame's 16-bit slots.
+    uint8_t frame[STM32_FRAME_LEN];
+    if (stm32_protocol_binary() &&
+        stm32_encode_frame(opcode, cmd_id_to_use, speed, command.value, frame) == 0) {
+        if (serial_tx_send(fd, frame, sizeof(frame)) != 0) {
+            perror("[To STM32]: Failed to write binary frame");
+            return 0;
+        }
+        LOG_INFO("[To STM32]: #%u %s/%d/%d (binary)\n", cmd_id_to_use, stm_name, speed, command.value);
+        metric_inc(METRIC_STM32_CMDS_SENT);
+        return cmd_id_to_use;
     }
 
-    if (write_result == 0) {
-        printf("[To STM32]: %s\n", stm_command); // Add newline for clear logging, STM32 expects ';' as terminator
+    char stm_command[128];
+    snprintf(stm_command, sizeof(stm_command), ":%u/MOTOR/%s/%d/%d;",
+             cmd_id_to_use, stm_name, speed, command.value);
+    if (write_to_serial(fd, stm_command) == 0) {
+        LOG_INFO("[To STM32]: %s\n", stm_command); // Add newline for clear logging, STM32 expects ';' as terminator
+        metric_inc(METRIC_STM32_CMDS_SENT);
         return cmd_id_to_use; // Successfully sent, return the command ID
     } else {
-        fprintf(stderr, "[To STM32]: Failed to write command to serial.\n");
+        LOG_ERROR("[To STM32]: Failed to write command to serial.\n");
         return 0; // Failed to send command
     }
 }
 
+int send_route_to_stm32(int fd, const Command* commands, int first, int count, int total,
+                        uint32_t cmd_id, uint32_t base_id) {
+    Stm32RouteStep steps[STM32_ROUTE_STEPS_PER_FRAME];
+    if (count < 1 || count > STM32_ROUTE_STEPS_PER_FRAME) return -1;
+    for (int i = 0; i < count; i++) {
+        const Command* cmd = &commands[first + i];
+        const char* stm_name;
+        uint8_t opcode;
+        int speed = 0;
+        if (cmd->type == CMD_SNAPSHOT) {
+            // A rolling snapshot needs firmware that drives straight through it
+            opcode = cmd->speed == SPEED_CREEP && stm32_protocol_pass() ? STM32_ROUTE_PASS : STM32_ROUTE_SNAP;
+        } else if (stm32_command_fields(cmd, &stm_name, &opcode, &speed) != 0) {
+            LOG_ERROR("send_route_to_stm32: Unknown command type (%d)\n", cmd->type);
+            return -1;
+        }
+        if (cmd->value < 0 || cmd->value > 0xFFFF) return -1;
+        steps[i] = (Stm32RouteStep){ .opcode = opcode, .speed = (uint8_t)speed, .dist_angle = (uint16_t)cmd->value };
+    }
+
+    uint8_t frame[STM32_ROUTE_FRAME_MAX];
+    int len = stm32_encode_route_frame(cmd_id, base_id, first, total, steps, count, frame);
+    if (len < 0) return -1;
+    if (serial_tx_send(fd, frame, (size_t)len) != 0) {
+        perror("[To STM32]: Failed to write route frame");
+        return -1;
+    }
+    LOG_INFO("[To STM32]: #%u ROUTE steps %d-%d of %d (IDs from %u)\n", cmd_id, first, first + count - 1, total, base_id);
+    metric_inc(METRIC_STM32_CMDS_SENT);
+    return 0;
+}
+
+int send_route_control_to_stm32(int fd, uint8_t opcode, uint32_t cmd_id) {
+    uint8_t frame[STM32_FRAME_LEN];
+    if (stm32_encode_frame(opcode, cmd_id, 0, 0, frame) != 0) return -1;
+    if (serial_tx_send(fd, frame, sizeof(frame)) != 0) {
+        perror("[To STM32]: Failed to write control frame");
+        return -1;
+    }
+    LOG_INFO("[To STM32]: #%u control 0x%02x (binary)\n", cmd_id, opcode);
+    return 0;
+}
+
+int send_estop_to_stm32(int fd) {
+    const uint8_t estop = STM32_ESTOP_BYTE;
+    if (serial_tx_send(fd, &estop, 1) != 0) {
+        perror("[To STM32]: Failed to write emergency stop");
+        return -1;
+    }
+    LOG_INFO("[To STM32]: emergency stop\n");
+    return 0;
+}
+
+int send_sync_to_stm32(int fd) {
+    if (write_to_serial(fd, STM32_SYNC_REQUEST) != 0) return -1;
+    LOG_DEBUG("[To STM32]: %s\n", STM32_SYNC_REQUEST);
+    return 0;
+}
+
+int send_progress_config_to_stm32(int fd, int every_pct, bool brake) {
+    char line[48];
+    snprintf(line, sizeof(line), STM32_PROGRESS_FMT, every_pct, brake ? 1 : 0);
+    if (write_to_serial(fd, line) != 0) return -1;
+    LOG_DEBUG("[To STM32]: %s\n", line);
+    return 0;
+}
+
+int send_credit_config_to_stm32(int fd, bool on) {
+    char line[32];
+    snprintf(line, sizeof(line), STM32_CREDIT_FMT, on ? 1 : 0);
+    if (write_to_serial(fd, line) != 0) return -1;
+    LOG_DEBUG("[To STM32]: %s\n", line);
+    return 0;
+}
+
 // --- Camera/Image Processing ---
 
-int capture_image(const char* filename) {
+// State of the warm V4L2 stream. The sensor is opened once by camera_init() and
+// left streaming so AE/AWB stay converged between snapshots. With the frame
+// ring, a thread dequeues every frame as it arrives and keeps the last
+// CAMERA_RING_FRAMES, each with when its exposure began.
+static struct {
+    int fd;
+    bool streaming;
+    void* buffers[CAMERA_BUFFER_COUNT];
+    size_t lengths[CAMERA_BUFFER_COUNT];
+    unsigned int buffer_count;
+    pthread_mutex_t lock; // Image workers may capture concurrently
+
+    bool ring_running;            // The ring thread owns the driver queue
+    bool ring_stop;
+    bool ring_started;            // ring_thread is to be joined
+    pthread_t ring_thread;
+    pthread_cond_t ring_changed;  // A frame was stored, or the ring stopped
+    struct MemoryStruct ring[CAMERA_RING_SLOTS];
+    uint64_t ring_exposed_ns[CAMERA_RING_SLOTS];
+    uint64_t ring_seq;            // Frames stored; the newest is slot (ring_seq - 1) % CAMERA_RING_SLOTS
+    uint64_t ring_last_stamp_ns;  // Of the last frame, for the frame period
+    uint64_t ring_period_ns;
+} g_camera = { .fd = -1, .streaming = false, .buffer_count = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// ioctl wrapper that retries when interrupted by a signal.
+static int xioctl(int fd, unsigned long request, void* arg) {
+    int r;
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+#ifndef RPI_TESTING
+// CLOCK_MONOTONIC ns at which buf's exposure began. The driver stamps either the
+// start of exposure or the end of the frame; for the latter (and for a frame
+// with no monotonic stamp, stamped at the dequeue) the exposure is taken to
+// have begun one measured frame period earlier. Must be called with
+// g_camera.lock held.
+static uint64_t camera_exposed_ns(const struct v4l2_buffer* buf) {
+    uint64_t now_ns = latency_now_ns();
+    uint64_t stamp_ns = (uint64_t)buf->timestamp.tv_sec * 1000000000ull + (uint64_t)buf->timestamp.tv_usec * 1000ull;
+    bool monotonic = (buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    if (!monotonic || stamp_ns == 0 || stamp_ns > now_ns) stamp_ns = now_ns;
+    if (g_camera.ring_last_stamp_ns && stamp_ns > g_camera.ring_last_stamp_ns) {
+        g_camera.ring_period_ns = stamp_ns - g_camera.ring_last_stamp_ns;
+    }
+    g_camera.ring_last_stamp_ns = stamp_ns;
+    if (monotonic && (buf->flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_SOE) return stamp_ns;
+    return stamp_ns > g_camera.ring_period_ns ? stamp_ns - g_camera.ring_period_ns : 0;
+}
+
+// Moves one frame from the driver queue into the ring. Returns 1 if one was
+// stored, 0 if none was waiting, or -1 on a driver error. Must be called with
+// g_camera.lock held.
+static int camera_ring_store(void) {
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(g_camera.fd, VIDIOC_DQBUF, &buf) == -1) {
+        if (errno == EAGAIN) return 0;
+        perror("[Camera] VIDIOC_DQBUF failed");
+        return -1;
+    }
+    size_t slot = g_camera.ring_seq % CAMERA_RING_SLOTS;
+    struct MemoryStruct* frame = &g_camera.ring[slot];
+    frame->size = 0;
+    int stored = 1;
+    if (WriteMemoryCallback(g_camera.buffers[buf.index], 1, buf.bytesused, frame) != buf.bytesused) {
+        LOG_ERROR("[Camera] Failed to copy %u byte frame into the ring.\n", buf.bytesused);
+        stored = 0; // Dropped; the slot is reused by the next one
+    }
+    if (stored) {
+        g_camera.ring_exposed_ns[slot] = camera_exposed_ns(&buf);
+        g_camera.ring_seq++;
+        pthread_cond_broadcast(&g_camera.ring_changed);
+    }
+    xioctl(g_camera.fd, VIDIOC_QBUF, &buf); // Hand the buffer back to the driver
+    return stored;
+}
+
+// Keeps the ring filled until camera_shutdown() or a driver error.
+static void* camera_ring_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_camera.lock);
+    while (!g_camera.ring_stop) {
+        int fd = g_camera.fd;
+        pthread_mutex_unlock(&g_camera.lock);
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        struct timeval tv = { .tv_sec = 0, .tv_usec = CAMERA_RING_POLL_MS * 1000 };
+        int r = select(fd + 1, &fds, NULL, NULL, &tv);
+        pthread_mutex_lock(&g_camera.lock);
+        if (r < 0 && errno != EINTR) {
+            perror("[Camera] select failed");
+            break;
+        }
+        if (r > 0 && !g_camera.ring_stop && camera_ring_store() < 0) break;
+    }
+    if (!g_camera.ring_stop) LOG_ERROR("[Camera] Frame ring stopped; captures wait for fresh frames.\n");
+    g_camera.ring_running = false;
+    pthread_cond_broadcast(&g_camera.ring_changed);
+    pthread_mutex_unlock(&g_camera.lock);
+    return NULL;
+}
+
+// Starts the ring thread on the open stream (CAMERA_RING_FRAMES > 0). On
+// failure captures wait for fresh frames, as without the ring.
+static void camera_ring_start(void) {
+    if (CAMERA_RING_FRAMES <= 0) return;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g_camera.ring_changed, &attr);
+    pthread_condattr_destroy(&attr);
+    g_camera.ring_seq = 0;
+    g_camera.ring_last_stamp_ns = g_camera.ring_period_ns = 0;
+    g_camera.ring_stop = false;
+    g_camera.ring_running = true;
+    g_camera.ring_started = rt_thread_create(&g_camera.ring_thread, RT_ROLE_IMAGE, false, camera_ring_thread, NULL) == 0;
+    if (!g_camera.ring_started) {
+        LOG_WARN("[Camera] Could not start the frame ring thread.\n");
+        g_camera.ring_running = false;
+    }
+}
+
+// Waits with g_camera.lock held until the ring has stored more than seq frames.
+// Returns false on a timeout or when the ring stopped.
+static bool camera_ring_wait(uint64_t seq) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += CAMERA_FRAME_TIMEOUT_SEC;
+    while (g_camera.ring_running && g_camera.ring_seq <= seq) {
+        if (pthread_cond_timedwait(&g_camera.ring_changed, &g_camera.lock, &deadline) == ETIMEDOUT) break;
+    }
+    return g_camera.ring_running && g_camera.ring_seq > seq;
+}
+#endif
+
+int camera_init(const char* device, int width, int height) {
 #ifdef RPI_TESTING
-    printf("[Camera] (TEST MODE) Faking image capture: %s\n", filename);
-    // Create a dummy file for testing purposes
-    FILE* fp = fopen(filename, "w");
-    if (fp) {
-        // Write a minimal valid JPEG header (or just some dummy content)
-        // This is a very simplified placeholder. A real dummy JPEG would be larger.
-        // For testing the *flow*, an empty file or a small dummy is usually enough.
-        fprintf(fp, "Fake JPEG content for %s", filename);
-        fclose(fp);
-        return 0; // Success
-    } else {
-        fprintf(stderr, "[Camera] (TEST MODE) Failed to create dummy image file.\n");
+    LOG_INFO("[Camera] (TEST MODE) Skipping V4L2 init for %s.\n", device);
+    return 0;
+#else
+    int fd = open(device, O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        perror("[Camera] Unable to open video device");
+        return -1;
+    }
+
+    // Ask the driver for JPEG directly so no encoding is done on the Pi's CPU.
+    struct v4l2_format fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
+    fmt.fmt.pix.field = V4L2_FIELD_NONE;
+    if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1 || fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG) {
+        LOG_ERROR("[Camera] Device %s does not support %dx%d JPEG capture.\n", device, width, height);
+        close(fd);
+        return -1;
+    }
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = CAMERA_BUFFER_COUNT;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1 || req.count < 2) {
+        perror("[Camera] VIDIOC_REQBUFS failed");
+        close(fd);
+        return -1;
+    }
+
+    g_camera.fd = fd;
+    g_camera.buffer_count = 0;
+    for (unsigned int i = 0; i < req.count && i < CAMERA_BUFFER_COUNT; i++) {
+        struct v4l2_buffer buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+            perror("[Camera] VIDIOC_QUERYBUF failed");
+            camera_shutdown();
+            return -1;
+        }
+        g_camera.lengths[i] = buf.length;
+        g_camera.buffers[i] = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buf.m.offset);
+        if (g_camera.buffers[i] == MAP_FAILED) {
+            perror("[Camera] mmap failed");
+            camera_shutdown();
+            return -1;
+        }
+        g_camera.buffer_count++;
+        if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+            perror("[Camera] VIDIOC_QBUF failed");
+            camera_shutdown();
+            return -1;
+        }
+    }
+
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+        perror("[Camera] VIDIOC_STREAMON failed");
+        camera_shutdown();
+        return -1;
+    }
+    g_camera.streaming = true;
+    camera_ring_start();
+    LOG_INFO("[Camera] %s streaming %dx%d JPEG with %u buffers%s.\n", device, width, height, g_camera.buffer_count,
+             g_camera.ring_running ? " into a frame ring" : "");
+    return 0;
+#endif
+}
+
+void camera_shutdown(void) {
+    pthread_mutex_lock(&g_camera.lock);
+#ifndef RPI_TESTING
+    if (g_camera.ring_started) {
+        g_camera.ring_stop = true;
+        g_camera.ring_started = false;
+        pthread_mutex_unlock(&g_camera.lock); // It takes the lock to notice
+        pthread_join(g_camera.ring_thread, NULL);
+        pthread_mutex_lock(&g_camera.lock);
+    }
+    for (int i = 0; i < CAMERA_RING_SLOTS; i++) {
+        free(g_camera.ring[i].memory);
+        memset(&g_camera.ring[i], 0, sizeof(g_camera.ring[i]));
+    }
+#endif
+    if (g_camera.streaming) {
+        enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        xioctl(g_camera.fd, VIDIOC_STREAMOFF, &type);
+        g_camera.streaming = false;
+    }
+    for (unsigned int i = 0; i < g_camera.buffer_count; i++) {
+        if (g_camera.buffers[i] && g_camera.buffers[i] != MAP_FAILED) munmap(g_camera.buffers[i], g_camera.lengths[i]);
+        g_camera.buffers[i] = NULL;
+    }
+    g_camera.buffer_count = 0;
+    if (g_camera.fd != -1) {
+        close(g_camera.fd);
+        g_camera.fd = -1;
+    }
+    pthread_mutex_unlock(&g_camera.lock);
+}
+
+#ifndef RPI_TESTING
+// Hands every frame waiting in the driver queue straight back to it. Returns
+// how many there were, or -1 on a driver error. Must be called with
+// g_camera.lock held.
+static int camera_recycle_stale(void) {
+    struct v4l2_buffer buf;
+    int recycled = 0;
+    while (1) {
+        memset(&buf, 0, sizeof(buf));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(g_camera.fd, VIDIOC_DQBUF, &buf) == -1) {
+            if (errno == EAGAIN) return recycled;
+            perror("[Camera] VIDIOC_DQBUF failed");
+            return -1;
+        }
+        xioctl(g_camera.fd, VIDIOC_QBUF, &buf);
+        recycled++;
+    }
+}
+
+// Copies the next frame from the warm stream into frame. Frames that were
+// already sitting in the driver queue were exposed before the robot settled,
+// so they are recycled and the first frame produced after the call is used.
+// With the ring running, that is the next frame it stores. Must be called with
+// g_camera.lock held.
+static int camera_grab_fresh_frame(struct MemoryStruct* frame) {
+    struct v4l2_buffer buf;
+
+    if (g_camera.ring_running) {
+        if (!camera_ring_wait(g_camera.ring_seq)) {
+            LOG_ERROR("[Camera] Timeout waiting for frame.\n");
+            return -1;
+        }
+        const struct MemoryStruct* newest = &g_camera.ring[(g_camera.ring_seq - 1) % CAMERA_RING_SLOTS];
+        return WriteMemoryCallback(newest->memory, 1, newest->size, frame) == newest->size ? 0 : -1;
+    }
+    if (camera_recycle_stale() < 0) return -1;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(g_camera.fd, &fds);
+    struct timeval tv = { .tv_sec = CAMERA_FRAME_TIMEOUT_SEC, .tv_usec = 0 };
+    int r = select(g_camera.fd + 1, &fds, NULL, NULL, &tv);
+    if (r <= 0) {
+        LOG_ERROR("[Camera] %s waiting for frame.\n", r == 0 ? "Timeout" : "Error");
+        return -1;
+    }
+
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(g_camera.fd, VIDIOC_DQBUF, &buf) == -1) {
+        perror("[Camera] VIDIOC_DQBUF failed");
+        return -1;
+    }
+
+    // One copy out of the mmap'd buffer so it can go straight back to the driver.
+    int result = 0;
+    if (WriteMemoryCallback(g_camera.buffers[buf.index], 1, buf.bytesused, frame) != buf.bytesused) {
+        LOG_ERROR("[Camera] Failed to copy %u byte frame.\n", buf.bytesused);
+        result = -1;
+    }
+
+    xioctl(g_camera.fd, VIDIOC_QBUF, &buf); // Hand the buffer back to the driver
+    return result;
+}
+#endif
+
+int camera_prearm(void) {
+#ifdef RPI_TESTING
+    LOG_DEBUG("[Camera] (TEST MODE) Pre-arming the stream.\n");
+    return 0;
+#else
+    if (pthread_mutex_trylock(&g_camera.lock) != 0) return -1;
+    // The ring thread keeps the driver queue empty already
+    int result = !g_camera.streaming ? -1 : g_camera.ring_running ? 0 : camera_recycle_stale();
+    pthread_mutex_unlock(&g_camera.lock);
+    if (result > 0) LOG_DEBUG("[Camera] Pre-armed; %d stale frame(s) recycled.\n", result);
+    return result < 0 ? -1 : 0;
+#endif
+}
+
+int camera_set_motion_exposure(bool on) {
+#ifdef RPI_TESTING
+    LOG_DEBUG("[Camera] (TEST MODE) %s the motion exposure.\n", on ? "Setting" : "Clearing");
+    return 0;
+#else
+    pthread_mutex_lock(&g_camera.lock);
+    int result = -1;
+    if (g_camera.streaming) {
+        struct v4l2_control mode = { .id = V4L2_CID_EXPOSURE_AUTO,
+                                     .value = on ? V4L2_EXPOSURE_MANUAL : V4L2_EXPOSURE_AUTO };
+        struct v4l2_control time = { .id = V4L2_CID_EXPOSURE_ABSOLUTE, .value = CAMERA_MOTION_EXPOSURE };
+        result = xioctl(g_camera.fd, VIDIOC_S_CTRL, &mode);
+        if (result == 0 && on) result = xioctl(g_camera.fd, VIDIOC_S_CTRL, &time);
+        if (result != 0 && on) {
+            mode.value = V4L2_EXPOSURE_AUTO; // Half set is worse than not at all
+            xioctl(g_camera.fd, VIDIOC_S_CTRL, &mode);
+        }
+    }
+    pthread_mutex_unlock(&g_camera.lock);
+    if (result != 0) LOG_DEBUG("[Camera] Motion exposure not %s.\n", on ? "set" : "cleared");
+    return result;
+#endif
+}
+
+int capture_image(struct MemoryStruct* frame) {
+    frame->size = 0; // Reuse whatever the caller already allocated
+#ifdef RPI_TESTING
+    LOG_INFO("[Camera] (TEST MODE) Faking image capture into memory.\n");
+    // For testing the *flow*, a small dummy payload is enough.
+    const char fake_jpeg[] = "Fake JPEG content";
+    if (WriteMemoryCallback((void*)fake_jpeg, 1, sizeof(fake_jpeg) - 1, frame) != sizeof(fake_jpeg) - 1) {
+        LOG_ERROR("[Camera] (TEST MODE) Failed to allocate dummy frame.\n");
         return -1; // Failure
     }
+    return 0; // Success
 #else
-    char command[256];
+    pthread_mutex_lock(&g_camera.lock);
+    if (g_camera.streaming) {
+        int grab_result = camera_grab_fresh_frame(frame);
+        pthread_mutex_unlock(&g_camera.lock);
+        if (grab_result == 0) {
+            LOG_INFO("[Camera] Image captured: %zu bytes\n", frame->size);
+            return 0;
+        }
+        LOG_ERROR("[Camera] Warm capture failed, falling back to raspistill.\n");
+        frame->size = 0;
+    } else {
+        pthread_mutex_unlock(&g_camera.lock);
+    }
+
     // Use raspistill for Buster OS compatibility. Arguments are slightly different.
     // -n: No preview
     // -t 200: Take picture after 200ms delay (gives camera time to adjust)
     // -w 640 -h 480: Set resolution
-    // -o: Output file
-    // Added -q 75 for quality to reduce file size slightly, though not critical for function
-    snprintf(command, sizeof(command), "raspistill -n -t 200 -w 640 -h 480 -q 75 -o %s", filename);
-    printf("[Camera] Executing command: %s\n", command);
-    int result = system(command);
-    if (result == 0) {
-        printf("[Camera] Image captured: %s\n", filename);
-    } else {
-        fprintf(stderr, "[Camera] Failed to capture image. Error code: %d\n", result);
+    // -q 75: Quality, to reduce size slightly
+    // -o -: Write the JPEG to stdout so it never touches the SD card
+    const char* command = "raspistill -n -t 200 -w 640 -h 480 -q 75 -o -";
+    LOG_INFO("[Camera] Executing command: %s\n", command);
+    FILE* pipe = popen(command, "r");
+    if (!pipe) {
+        perror("[Camera] Failed to start raspistill");
+        return -1;
     }
-    return result;
+    char chunk[4096];
+    size_t n;
+    int result = 0;
+    while ((n = fread(chunk, 1, sizeof(chunk), pipe)) > 0) {
+        if (WriteMemoryCallback(chunk, 1, n, frame) != n) {
+            result = -1;
+            break;
+        }
+    }
+    int status = pclose(pipe);
+    if (result == 0 && status == 0 && frame->size > 0) {
+        LOG_INFO("[Camera] Image captured: %zu bytes\n", frame->size);
+        return 0;
+    }
+    LOG_ERROR("[Camera] Failed to capture image. Error code: %d\n", status);
+    return -1;
 #endif
-}
\ No newline at end of file
+}
+
+int capture_image_since(uint64_t since_ns, struct MemoryStruct* const frames[], uint64_t exposed_ns[], int max) {
+#ifdef RPI_TESTING
+    if (max < 1 || capture_image(frames[0]) != 0) return -1;
+    exposed_ns[0] = latency_now_ns();
+    return 1;
+#else
+    pthread_mutex_lock(&g_camera.lock);
+    if (!g_camera.streaming || !g_camera.ring_running) {
+        pthread_mutex_unlock(&g_camera.lock);
+        return -1;
+    }
+    // Nothing exposed since: take the next frame
+    if (g_camera.ring_seq == 0 ||
+        g_camera.ring_exposed_ns[(g_camera.ring_seq - 1) % CAMERA_RING_SLOTS] < since_ns) {
+        camera_ring_wait(g_camera.ring_seq);
+    }
+    uint64_t first = g_camera.ring_seq > CAMERA_RING_SLOTS ? g_camera.ring_seq - CAMERA_RING_SLOTS : 0;
+    int count = 0;
+    for (uint64_t seq = first; seq < g_camera.ring_seq && count < max; seq++) {
+        size_t slot = seq % CAMERA_RING_SLOTS;
+        if (g_camera.ring_exposed_ns[slot] < since_ns) continue;
+        frames[count]->size = 0;
+        if (WriteMemoryCallback(g_camera.ring[slot].memory, 1, g_camera.ring[slot].size, frames[count]) !=
+            g_camera.ring[slot].size) {
+            continue;
+        }
+        exposed_ns[count++] = g_camera.ring_exposed_ns[slot];
+    }
+    pthread_mutex_unlock(&g_camera.lock);
+    if (count > 0) LOG_INFO("[Camera] %d ring frame(s) exposed since the robot came to rest.\n", count);
+    return count;
+#endif
+}
@@ -1,12 +1,17 @@
 #ifndef RPI_HAL_H
 #define RPI_HAL_H
 
+#include <curl/curl.h>
+
 #include "shared_types.h"
 
-// Struct to hold data for curl's WriteMemoryCallback
+// Struct to hold data for curl's WriteMemoryCallback. The buffer is kept by its
+// owner and reused: setting size to 0 starts the next response or frame in the
+// same storage, which has room for capacity bytes and grows by doubling.
 struct MemoryStruct {
   char *memory;
   size_t size;
+  size_t capacity;
 };
 
 /**
@@ -19,6 +24,9 @@ struct MemoryStruct {
 
 // --- Initialization ---
 int init_serial_port(const char* device, int baud_rate);
+// Changes an open serial port's rate. Returns 0, or -1 if fd is not a tty (a
+// pipe or socket has no rate) or the rate is not one the links use.
+int set_serial_baud(int fd, int baud_rate);
 
 // --- Android Communication ---
 int send_status_to_android(int fd, const char* status);
@@ -26,23 +34,111 @@ int send_status_to_android(int fd, const char* status);
 int send_target_result_to_android(int fd, int obstacle_id, int recognized_image_id);
 // New function to parse the full Android JSON, including obstacles with 'd' and robot start position
 int parse_android_map_and_obstacles(const char* json_string, SharedAppContext* context);
-// New function to parse and execute direct STM commands from Android
-int parse_and_execute_android_command(int stm32_fd, const char* android_command_str, SharedAppContext* context);
+// Parses a direct STM command from Android (e.g. "<FW10>") without sending it
+int parse_android_stm_command(const char* android_command_str, Command* out_cmd);
 // New function for sending messages to Android with acknowledgment/retries
 int send_message_to_android_with_ack(int fd, const char* message);
 // New function to send standardized ACK messages to Android
 int send_android_ack(int fd, const char* original_cat, const char* status_message);
 
 // --- PC/Server Communication ---
-int post_data_to_server(const char* url, const char* payload, char* response_buffer, int buffer_size);
+// Sets up the shared DNS/connection cache and the long-lived pathfinding handle.
+// Call once after curl_global_init().
+int http_client_init(void);
+void http_client_cleanup(void);
+// Applies the shared cache and keep-alive options to a handle (again after curl_easy_reset).
+void http_configure_handle(CURL* curl);
+// Resolves and connects to url ahead of the first real request.
+int http_prewarm(const char* url);
+#define HTTP_PREWARM_MAX 8
+// Opens up to count (at most HTTP_PREWARM_MAX) connections to url at once, for
+// bursts that use several, and leaves them in the shared pool. on_header (may
+// be NULL) sees the replies' headers. Returns the number that connected.
+int http_prewarm_many(const char* url, int count, curl_write_callback on_header);
+// POSTs payload as JSON. On a 2xx reply, *response points at the body, allocated in arena.
+// cancel (may be NULL) becoming true aborts the request; http_wake_transfers()
+// makes it notice at once.
+int post_data_to_server(const char* url, const char* payload, Arena* arena, const char** response,
+                        const atomic_bool* cancel);
+// Cuts short the wait of the pathfinding transfer in progress, which then
+// checks its cancel flag. Safe from any thread.
+void http_wake_transfers(void);
+// Streams a newline-delimited response, calling on_line for each line as it arrives.
+// A non-zero return from on_line, or cancel becoming true, aborts the transfer.
+// Returns 0 if the whole body was read.
+#define NDJSON_MAX_LINE 512
+int post_data_to_server_ndjson(const char* url, const char* payload,
+                               int (*on_line)(const char* line, void* userdata), void* userdata,
+                               const atomic_bool* cancel);
 // Modified to pass SharedAppContext to store snap_positions and robot initial position
-int parse_command_route_from_server(const char* json_string, Command commands[], int* command_count, SnapPosition snap_positions[], int* snap_position_count);
+int parse_command_route_from_server(const char* json_string, Arena* arena, CommandList* commands, SnapList* snap_positions);
 
 // --- STM32 Communication ---
+// Whether commands are driven at their speed class (shared_types.h) or all at
+// the default move and turn speeds. On unless switched off.
+void stm32_set_speed_classes(bool enabled);
+
+// Drive speeds in percent of full PWM, by class (normal move and turn, slow
+// move, fast move, slow turn, and the creep through a rolling snapshot's
+// viewing pose); there is no fast or creeping turn. Changes apply from the
+// next command sent.
+typedef struct {
+    int move, turn, slow_move, fast_move, slow_turn, creep_move;
+} Stm32Speeds;
+void stm32_get_speeds(Stm32Speeds* out);
+void stm32_set_speeds(const Stm32Speeds* speeds);
+// The value a command would need at its type's default speed to take as long,
+// for the latency model and timeouts, which are fitted at the defaults.
+int stm32_command_timed_value(Command command);
 uint32_t send_command_to_stm32(int fd, Command command, uint32_t external_cmd_id);
+// Uploads commands[first .. first + count) of a total-command route as one ROUTE
+// frame with ID cmd_id; route step k reports as base_id + k (stm32_protocol.h).
+// Needs the binary link. Returns 0, or -1 if the frame cannot be built or written.
+int send_route_to_stm32(int fd, const Command* commands, int first, int count, int total,
+                        uint32_t cmd_id, uint32_t base_id);
+// Sends a parameterless binary frame (STM32_OP_RESUME, STM32_OP_STOP). Returns 0 or -1.
+int send_route_control_to_stm32(int fd, uint8_t opcode, uint32_t cmd_id);
+// Sends STM32_ESTOP_BYTE, which firmware advertising ESTOP acts on at once.
+// Returns 0 or -1.
+int send_estop_to_stm32(int fd);
+// Sends STM32_SYNC_REQUEST (clock_sync.h). Returns 0 or -1.
+int send_sync_to_stm32(int fd);
+// Asks firmware advertising PROGRESS for its motion events (STM32_PROGRESS_FMT);
+// 0 and false turn them off. Returns 0 or -1.
+int send_progress_config_to_stm32(int fd, int every_pct, bool brake);
+// Turns the queue room reports of firmware advertising CREDIT on or off
+// (STM32_CREDIT_FMT). Returns 0 or -1.
+int send_credit_config_to_stm32(int fd, bool on);
 
 // --- Camera/Image Processing ---
-int capture_image(const char* filename);
+// Frames the warm stream keeps copied out of the driver, each with when its
+// exposure began, for capture_image_since(). 0 leaves them in the driver queue
+// and every capture waits for a fresh one, as before.
+#ifndef CAMERA_RING_FRAMES
+#define CAMERA_RING_FRAMES 8
+#endif
+
+// Opens the camera once and keeps it streaming. Returns 0 on success; on failure
+// capture_image() falls back to spawning raspistill.
+int camera_init(const char* device, int width, int height);
+void camera_shutdown(void);
+// Captures one JPEG into frame (reusing its allocation). Nothing is written to disk.
+int capture_image(struct MemoryStruct* frame);
+// Readies the warm stream for a capture that is coming shortly: hands back the
+// frames exposed while the robot moves, so the driver is not left with a full
+// queue and the capture has only the last few to skip. Never waits. Returns 0,
+// or -1 if the stream is down or a capture holds it.
+int camera_prearm(void);
+// Switches the warm stream to a short fixed exposure for a frame taken on the
+// move (on) or back to auto exposure (off). A driver without the controls
+// keeps auto exposure. Returns 0, or -1 if the stream is down or refused.
+int camera_set_motion_exposure(bool on);
+// Copies up to max frames of the ring whose exposure began at or after since_ns
+// (latency_now_ns() clock) into frames[], oldest first, with those times in
+// exposed_ns[]. Waits for the next frame if none qualifies yet, rather than
+// for a whole burst. Returns the number copied (0: none arrived in time), or
+// -1 if the stream or the ring is down.
+int capture_image_since(uint64_t since_ns, struct MemoryStruct* const frames[], uint64_t exposed_ns[], int max);
 
 int get_img_id_from_class_name(const char* class_name);
 
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE // pthread_attr_setaffinity_np, CPU_SET
+#include "rt_profile.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+static bool g_enabled = false; // Set once by main() before any thread starts
+static atomic_bool g_warned_sched; // Each fallback is reported once
+static atomic_bool g_warned_stack;
+
+int rt_profile_init(bool enabled) {
+    g_enabled = enabled;
+    if (!enabled) return 0;
+
+    // Keep freed heap mapped (and locked) instead of trimming it, and serve large
+    // allocations from the heap rather than fresh mmaps that would fault on first use.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+
+    // With MCL_FUTURE every later mapping counts against RLIMIT_MEMLOCK, so under
+    // a finite limit (no CAP_IPC_LOCK) allocations would start failing instead
+    struct rlimit limit;
+    if (geteuid() != 0 && (getrlimit(RLIMIT_MEMLOCK, &limit) != 0 || limit.rlim_cur != RLIM_INFINITY)) {
+        LOG_WARN("[RT] Memory lock limit is finite; not locking memory (run as root or raise memlock).\n");
+        return -1;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        LOG_WARN("[RT] mlockall failed (%s); pages may fault in mid-mission.\n", strerror(errno));
+        return -1;
+    }
+    LOG_INFO("[RT] Memory locked; FIFO threads at %d/%d, image workers on CPU %d.\n",
+             RT_REACTOR_PRIORITY, RT_NAV_PRIORITY, RT_IMAGE_CPU);
+    return 0;
+}
+
+// Stack of RT_STACK_SIZE with a guard page below it, every page touched so the
+// thread never faults on it. Long-lived threads keep theirs for the life of the
+// process. Returns NULL on failure.
+static void* stack_alloc(void) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char* base = mmap(NULL, RT_STACK_SIZE + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    mprotect(base, page, PROT_NONE);
+    memset(base + page, 0, RT_STACK_SIZE);
+    return base + page;
+}
+
+// CPUs for role: RT_IMAGE_CPU alone, or every other online CPU. false when there
+// is nothing to split (one core, or RT_IMAGE_CPU not online).
+static bool role_cpus(RtRole role, cpu_set_t* set) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 2 || RT_IMAGE_CPU >= cpus) return false;
+    CPU_ZERO(set);
+    if (role == RT_ROLE_IMAGE) {
+        CPU_SET(RT_IMAGE_CPU, set);
+    } else {
+        for (int cpu = 0; cpu < cpus; cpu++) {
+            if (cpu != RT_IMAGE_CPU) CPU_SET(cpu, set);
+        }
+    }
+    return true;
+}
+
+int rt_thread_create(pthread_t* tid, RtRole role, bool detached, void* (*start)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (detached) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (!g_enabled) {
+        int rc = pthread_create(tid, &attr, start, arg);
+        pthread_attr_destroy(&attr);
+        return rc;
+    }
+
+    bool fifo = role == RT_ROLE_REACTOR || role == RT_ROLE_NAV;
+
+    // Threads inherit their creator's policy and CPUs by default, so helpers
+    // started from the nav thread are put back on SCHED_OTHER explicitly.
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    struct sched_param param = { .sched_priority = 0 };
+    if (fifo) param.sched_priority = role == RT_ROLE_REACTOR ? RT_REACTOR_PRIORITY : RT_NAV_PRIORITY;
+    pthread_attr_setschedpolicy(&attr, fifo ? SCHED_FIFO : SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+
+    cpu_set_t cpus;
+    if (role == RT_ROLE_BACKGROUND) {
+        CPU_ZERO(&cpus);
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++) CPU_SET(cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    } else if (role_cpus(role, &cpus)) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    if (role == RT_ROLE_BACKGROUND) {
+        // Short-lived: glibc caches and reuses these, but keep them as small as the rest
+        pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+    } else {
+        void* stack = stack_alloc();
+        if (stack) {
+            pthread_attr_setstack(&attr, stack, RT_STACK_SIZE);
+        } else if (!atomic_exchange(&g_warned_stack, true)) {
+            LOG_WARN("[RT] Could not preallocate a thread stack (%s); using the default.\n", strerror(errno));
+        }
+    }
+
+    int rc = pthread_create(tid, &attr, start, arg);
+    if (rc == EPERM && fifo) {
+        // No CAP_SYS_NICE: keep the stack and CPUs, drop the real-time policy
+        if (!atomic_exchange(&g_warned_sched, true)) {
+            LOG_WARN("[RT] SCHED_FIFO not permitted; real-time threads run under the default scheduler.\n");
+        }
+        param.sched_priority = 0;
+        pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+        pthread_attr_setschedparam(&attr, &param);
+        rc = pthread_create(tid, &attr, start, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return rc;
+}
@@ -0,0 +1,59 @@
+#ifndef RT_PROFILE_H
+#define RT_PROFILE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/**
+ * @file rt_profile.h
+ * @brief Real-time scheduling profile for the controller's threads.
+ *
+ * rt_profile_init() locks the process's memory and stops glibc from handing
+ * freed heap back to the kernel, so the threads on the STM32 command path do not
+ * page-fault mid-mission. Threads started with rt_thread_create() get a stack
+ * allocated and touched up front, plus the scheduling their role asks for:
+ *
+ *   RT_ROLE_REACTOR     SCHED_FIFO RT_REACTOR_PRIORITY, off RT_IMAGE_CPU (reads STM32 replies)
+ *   RT_ROLE_NAV         SCHED_FIFO RT_NAV_PRIORITY, off RT_IMAGE_CPU     (sends the next command)
+ *   RT_ROLE_IMAGE       SCHED_OTHER, pinned to RT_IMAGE_CPU            (capture, JPEG, uploads)
+ *   RT_ROLE_BACKGROUND  SCHED_OTHER on every CPU                       (helpers the RT threads spawn)
+ *
+ * Each step degrades on its own: SCHED_FIFO needs CAP_SYS_NICE, memory is only
+ * locked as root or under an unlimited memlock limit (a finite one would make
+ * later allocations fail), and a single core has no CPUs to split. Whatever is
+ * unavailable is reported once and skipped. With the profile disabled, every
+ * thread starts with default attributes, as before.
+ */
+
+#ifndef RT_REACTOR_PRIORITY
+#define RT_REACTOR_PRIORITY 80
+#endif
+#ifndef RT_NAV_PRIORITY
+#define RT_NAV_PRIORITY 70
+#endif
+// Core left to the image workers (and whatever else the kernel puts there); the
+// FIFO threads run on all the others.
+#ifndef RT_IMAGE_CPU
+#define RT_IMAGE_CPU 0
+#endif
+// Preallocated per long-lived thread; the deepest paths (curl, libjpeg) use well
+// under this. Locked in full, unlike the default 8 MB stacks under mlockall.
+#define RT_STACK_SIZE (1024 * 1024)
+
+typedef enum {
+    RT_ROLE_REACTOR,
+    RT_ROLE_NAV,
+    RT_ROLE_IMAGE,
+    RT_ROLE_BACKGROUND
+} RtRole;
+
+// Turns the profile on (enabled) or leaves every thread on default attributes.
+// Call once from main() before starting threads. Returns 0, or -1 if memory
+// could not be locked (the rest of the profile still applies).
+int rt_profile_init(bool enabled);
+
+// pthread_create() with role's attributes; detached if detached is true.
+// Returns pthread_create()'s result.
+int rt_thread_create(pthread_t* tid, RtRole role, bool detached, void* (*start)(void*), void* arg);
+
+#endif // RT_PROFILE_H
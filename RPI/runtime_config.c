@@ -0,0 +1,93 @@
+#include "runtime_config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+int config_set_path_server(RuntimeConfig* cfg, const char* base) {
+    char path[CONFIG_URL_MAX], stream[CONFIG_URL_MAX];
+    int n = snprintf(path, sizeof(path), "%s/path", base);
+    int m = snprintf(stream, sizeof(stream), "%s/path/stream", base);
+    if (n < 0 || m < 0 || n >= (int)sizeof(path) || m >= (int)sizeof(stream)) return -1;
+    memcpy(cfg->path_url, path, sizeof(path));
+    memcpy(cfg->stream_url, stream, sizeof(stream));
+    return 0;
+}
+
+static char* trim(char* s) {
+    while (isspace((unsigned char)*s)) s++;
+    char* end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) *--end = '\0';
+    return s;
+}
+
+static int copy_value(char* dst, size_t size, const char* value) {
+    size_t len = strlen(value);
+    if (len == 0 || len >= size) return -1;
+    memcpy(dst, value, len + 1);
+    return 0;
+}
+
+// value as an int in [lo, hi]
+static int parse_int(const char* value, int lo, int hi, int* out) {
+    char* end;
+    errno = 0;
+    long v = strtol(value, &end, 10);
+    if (errno || end == value || *end != '\0' || v < lo || v > hi) return -1;
+    *out = (int)v;
+    return 0;
+}
+
+static int apply_setting(RuntimeConfig* cfg, const char* key, const char* value) {
+    Stm32Speeds* s = &cfg->speeds;
+    if (strcmp(key, "path_server") == 0) return value[0] ? config_set_path_server(cfg, value) : -1;
+    if (strcmp(key, "image_server") == 0) return copy_value(cfg->image_url, sizeof(cfg->image_url), value);
+    if (strcmp(key, "path_channel") == 0) return parse_int(value, 0, 65535, &cfg->path_channel_port);
+    if (strcmp(key, "image_channel") == 0) return parse_int(value, 0, 65535, &cfg->image_channel_port);
+    if (strcmp(key, "android") == 0) return copy_value(cfg->android_device, sizeof(cfg->android_device), value);
+    if (strcmp(key, "stm32") == 0) return copy_value(cfg->stm32_device, sizeof(cfg->stm32_device), value);
+    if (strcmp(key, "move_speed") == 0) return parse_int(value, 1, 100, &s->move);
+    if (strcmp(key, "turn_speed") == 0) return parse_int(value, 1, 100, &s->turn);
+    if (strcmp(key, "slow_move_speed") == 0) return parse_int(value, 1, 100, &s->slow_move);
+    if (strcmp(key, "fast_move_speed") == 0) return parse_int(value, 1, 100, &s->fast_move);
+    if (strcmp(key, "slow_turn_speed") == 0) return parse_int(value, 1, 100, &s->slow_turn);
+    if (strcmp(key, "creep_move_speed") == 0) return parse_int(value, 1, 100, &s->creep_move);
+    return -1;
+}
+
+int config_load(const char* path, RuntimeConfig* cfg) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT) return 1;
+        LOG_ERROR("[Config] Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // Into a copy, so a file with one bad line changes nothing
+    RuntimeConfig next = *cfg;
+    char line[512];
+    int line_no = 0;
+    int rc = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char* hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char* s = trim(line);
+        if (*s == '\0') continue;
+        char* eq = strchr(s, '=');
+        if (eq) *eq = '\0';
+        const char* key = trim(s);
+        const char* value = eq ? trim(eq + 1) : "";
+        if (!eq || apply_setting(&next, key, value) != 0) {
+            LOG_ERROR("[Config] %s:%d: bad setting '%s'.\n", path, line_no, key);
+            rc = -1;
+            break;
+        }
+    }
+    fclose(f);
+    if (rc == 0) *cfg = next;
+    return rc;
+}
@@ -0,0 +1,49 @@
+#ifndef RUNTIME_CONFIG_H
+#define RUNTIME_CONFIG_H
+
+#include "rpi_hal.h" // For Stm32Speeds
+
+/**
+ * @file runtime_config.h
+ * @brief Settings the controller reads from a file, at start and again on reload.
+ *
+ * The file holds one "key = value" per line; '#' starts a comment and blank
+ * lines are skipped. Keys:
+ *
+ *   path_server     base URL of the pathfinding server (/path and /path/stream are appended)
+ *   image_server    full URL of the image server's detect endpoint
+ *   path_channel    channel ports (server_channel.h) on those hosts; 0 leaves one off
+ *   image_channel
+ *   android         Android serial device
+ *   stm32           STM32 serial device
+ *   move_speed, turn_speed, slow_move_speed, fast_move_speed, slow_turn_speed,
+ *   creep_move_speed
+ *                   drive speeds in percent (rpi_hal.h's Stm32Speeds)
+ *
+ * Keys left out keep the value the RuntimeConfig already had, so a file only
+ * needs the settings it changes. The devices are only opened at start.
+ */
+
+#define CONFIG_URL_MAX 256
+#define CONFIG_DEVICE_MAX 128
+
+typedef struct {
+    char path_url[CONFIG_URL_MAX];   // <path_server>/path
+    char stream_url[CONFIG_URL_MAX]; // <path_server>/path/stream
+    char image_url[CONFIG_URL_MAX];
+    int path_channel_port;
+    int image_channel_port;
+    char android_device[CONFIG_DEVICE_MAX];
+    char stm32_device[CONFIG_DEVICE_MAX];
+    Stm32Speeds speeds;
+} RuntimeConfig;
+
+// Points cfg's pathfinding URLs at the server whose base URL is base.
+// Returns 0, or -1 if base is too long (cfg unchanged).
+int config_set_path_server(RuntimeConfig* cfg, const char* base);
+
+// Applies the file at path on top of cfg. Returns 0, 1 if there is no such
+// file (cfg unchanged), or -1 if it does not parse (logged; cfg unchanged).
+int config_load(const char* path, RuntimeConfig* cfg);
+
+#endif // RUNTIME_CONFIG_H
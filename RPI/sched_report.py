@@ -0,0 +1,256 @@
+"""
+Checks the firmware's tasks and ISRs for rate-monotonic schedulability.
+
+Both boards measure, per task loop iteration, the CPU cycles the task itself
+ran (preemption and blocking left out) and, per ISR call, its cycles and the
+shortest gap between calls (STM/Common/Inc/task_wcet.h). "SCHED" hands back
+those figures since the previous SCHED and clears them:
+
+    python3 sched_report.py /dev/ttyUSB0 --board mdp --window 30
+    python3 sched_report.py /dev/ttyACM0 --board motor
+    python3 sched_report.py --input sched.log
+
+--window sends one SCHED to clear the figures, waits (run the mission then)
+and sends the one that is reported. --input reads a saved reply of either
+board instead of a port.
+
+Each task gets C = its longest iteration and T = its period, or for a task
+woken by events (period 0) the shortest gap between two releases. The ISRs
+preempt every task, so they are counted as interference at the top. The
+report gives the total utilisation against the Liu & Layland bound
+n(2^(1/n) - 1), the exact worst-case response time of every task under its
+current priority (equal priorities round-robin, so they count against each
+other) and the priorities rate-monotonic order would give, with the factor
+by which every rate could still rise before a deadline is missed.
+"""
+import argparse
+import math
+import re
+import sys
+import time
+
+import serial
+
+LINK_BAUD = 1000000
+REPLY_TIMEOUT_SECONDS = 5.0
+# CMSIS-RTOS2 osPriority_t levels, each with +1..+7 steps above it
+PRIORITY_LEVELS = {8: "Low", 16: "BelowNormal", 24: "Normal", 32: "AboveNormal", 40: "High", 48: "Realtime"}
+PROPOSAL_LOWEST = 16   # osPriorityBelowNormal: leaves Low for the idle-time work
+PROPOSAL_HIGHEST = 47  # below osPriorityRealtime
+
+MDP_TASK = re.compile(r"SCHED TASK (\S+) P(\d+) T(\d+) N(\d+) C(\d+)/(\d+) G(\d+)")
+MDP_UNTRACKED = re.compile(r"SCHED TASK (\S+) P(\d+) -")
+MDP_ISR = re.compile(r"SCHED ISR (\S+) N(\d+) C(\d+)/(\d+) G(\d+)")
+MDP_CLOCK = re.compile(r"SCHED CLOCK (\d+)")
+MOTOR_TASK = re.compile(r"SCHED/T/([^/]+)/(\d+)/(\d+)/(\d+)/(\d+)/(\d+)/(\d+)")
+MOTOR_ISR = re.compile(r"SCHED/I/([^/]+)/(\d+)/(\d+)/(\d+)/(\d+)")
+MOTOR_CLOCK = re.compile(r"OK/SCHED/(\d+)")
+
+
+def priority_name(value):
+    base = max((b for b in PRIORITY_LEVELS if b <= value), default=None)
+    if base is None:
+        return str(value)
+    step = value - base
+    return "osPriority" + PRIORITY_LEVELS[base] + (str(step) if step else "")
+
+
+def request(port, board, seq):
+    """Sends SCHED and returns the reply lines, through its final line."""
+    port.reset_input_buffer()
+    if board == "mdp":
+        port.write(b"SCHED\n")
+        last = "ACK SCHED"
+    else:
+        port.write(f":{seq}/GENERAL/SCHED;".encode())
+        last = "OK/SCHED/"
+    lines, buf = [], b""
+    deadline = time.monotonic() + REPLY_TIMEOUT_SECONDS
+    while time.monotonic() < deadline:
+        buf += port.read(512)
+        # The motor board ends its replies with ';' or a newline, MDP with CRLF
+        *done, buf = re.split(rb"[;\r\n]+", buf)
+        for raw in done:
+            text = raw.decode("ascii", errors="replace").strip()
+            if not text:
+                continue
+            lines.append(text)
+            if last in text:
+                return lines
+    raise TimeoutError("no end of the SCHED reply from the firmware")
+
+
+def parse(lines):
+    """Returns (clock Hz, tasks, isrs, untracked) from either board's reply."""
+    clock, tasks, isrs, untracked = None, [], [], []
+    for text in lines:
+        if m := MDP_CLOCK.search(text) or MOTOR_CLOCK.search(text):
+            clock = int(m.group(1))
+        elif m := MDP_TASK.search(text):
+            name, prio, period, n, mean, cmax, gap = m.groups()
+            tasks.append(dict(name=name, prio=int(prio), period_us=int(period), n=int(n),
+                              mean=int(mean), max=int(cmax), gap=int(gap)))
+        elif m := MOTOR_TASK.search(text):
+            name, prio, period, n, mean, cmax, gap = m.groups()
+            tasks.append(dict(name=name, prio=int(prio), period_us=int(period), n=int(n),
+                              mean=int(mean), max=int(cmax), gap=int(gap)))
+        elif m := MDP_UNTRACKED.search(text):
+            untracked.append(m.group(1))
+        elif m := MDP_ISR.search(text) or MOTOR_ISR.search(text):
+            name, n, mean, cmax, gap = m.groups()
+            isrs.append(dict(name=name, n=int(n), mean=int(mean), max=int(cmax), gap=int(gap)))
+    if clock is None:
+        raise ValueError("no SCHED clock line in the reply")
+    return clock, tasks, isrs, untracked
+
+
+def to_us(cycles, clock):
+    return cycles * 1e6 / clock
+
+
+def response_times(tasks, isrs, scale=1.0):
+    """Exact worst-case response time of each task (None if it misses T).
+
+    Periods are divided by scale, so scale > 1 asks what faster rates would do.
+    """
+    result = []
+    for t in tasks:
+        deadline = t["T"] / scale
+        others = [o for o in tasks if o is not t and o["prio"] >= t["prio"]]
+        r = t["C"]
+        while True:
+            nxt = t["C"]
+            nxt += sum(math.ceil(r / (o["T"] / scale)) * o["C"] for o in others)
+            nxt += sum(math.ceil(r / i["T"]) * i["C"] for i in isrs)
+            if nxt > deadline:
+                result.append(None)
+                break
+            if nxt == r:
+                result.append(r)
+                break
+            r = nxt
+    return result
+
+
+def rate_monotonic(tasks):
+    """Priority per task: shorter period higher, equal periods equal."""
+    periods = sorted({t["T"] for t in tasks}, reverse=True)
+    span = PROPOSAL_HIGHEST - PROPOSAL_LOWEST
+    step = max(1, min(8, span // (len(periods) - 1))) if len(periods) > 1 else 0
+    level = {p: min(PROPOSAL_LOWEST + k * step, PROPOSAL_HIGHEST) for k, p in enumerate(periods)}
+    return [level[t["T"]] for t in tasks]
+
+
+def headroom(tasks, isrs):
+    """Largest factor every task rate can be multiplied by and stay schedulable."""
+    if None in response_times(tasks, isrs):
+        return 0.0
+    lo, hi = 1.0, 1.0
+    while hi < 1024 and None not in response_times(tasks, isrs, hi * 2):
+        hi *= 2
+    hi *= 2
+    for _ in range(30):
+        mid = (lo + hi) / 2
+        if None in response_times(tasks, isrs, mid):
+            hi = mid
+        else:
+            lo = mid
+    return lo
+
+
+def report(clock, tasks, isrs, untracked, out):
+    print(f"clock {clock / 1e6:.1f} MHz", file=out)
+    live, skipped = [], []
+    for t in tasks:
+        if t["n"] == 0:
+            skipped.append(f"{t['name']} (never ran)")
+            continue
+        period = t["period_us"] or to_us(t["gap"], clock)
+        if period <= 0:
+            skipped.append(f"{t['name']} (released once, no period)")
+            continue
+        live.append(dict(t, C=to_us(t["max"], clock), T=period))
+    irq = []
+    for i in isrs:
+        if i["n"] < 2 or i["gap"] == 0:
+            if i["n"]:
+                skipped.append(f"{i['name']} ISR (fewer than two calls)")
+            continue
+        irq.append(dict(i, C=to_us(i["max"], clock), T=to_us(i["gap"], clock)))
+
+    print(f"\n{'task':<16}{'prio':>6}{'T us':>10}{'src':>5}{'n':>8}{'mean us':>10}{'C us':>10}{'U %':>8}",
+          file=out)
+    for t in sorted(live, key=lambda t: -t["prio"]):
+        print(f"{t['name']:<16}{t['prio']:>6}{t['T']:>10.0f}{'cfg' if t['period_us'] else 'gap':>5}{t['n']:>8}"
+              f"{to_us(t['mean'], clock):>10.1f}{t['C']:>10.1f}{100 * t['C'] / t['T']:>8.2f}", file=out)
+    print(f"\n{'isr':<16}{'min gap us':>16}{'n':>8}{'mean us':>10}{'C us':>10}{'U %':>8}", file=out)
+    for i in irq:
+        print(f"{i['name']:<16}{i['T']:>16.0f}{i['n']:>8}{to_us(i['mean'], clock):>10.2f}{i['C']:>10.2f}"
+              f"{100 * i['C'] / i['T']:>8.2f}", file=out)
+    for s in skipped + [f"{u} (not measured)" for u in untracked]:
+        print(f"skipped: {s}", file=out)
+    if not live:
+        print("\nno task ran in the window", file=out)
+        return 1
+
+    u_tasks = sum(t["C"] / t["T"] for t in live)
+    u_isr = sum(i["C"] / i["T"] for i in irq)
+    n = len(live) + len(irq)
+    bound = n * (2 ** (1 / n) - 1)
+    total = u_tasks + u_isr
+    verdict = "schedulable by the bound" if total <= bound else \
+        "over the bound: the response times below decide" if total <= 1 else "overloaded"
+    print(f"\nutilisation {100 * total:.1f}% (tasks {100 * u_tasks:.1f}%, ISRs {100 * u_isr:.1f}%), "
+          f"Liu & Layland bound for {n}: {100 * bound:.1f}% -> {verdict}", file=out)
+
+    current = response_times(live, irq)
+    proposed_prio = rate_monotonic(live)
+    proposed = [dict(t, prio=p) for t, p in zip(live, proposed_prio)]
+    rm = response_times(proposed, irq)
+    print(f"\n{'task':<16}{'T us':>10}{'R now us':>12}{'slack %':>9}   {'RM priority':<32}{'R RM us':>10}",
+          file=out)
+    for t, r_now, p, r_rm in sorted(zip(live, current, proposed_prio, rm), key=lambda x: x[0]["T"]):
+        now = f"{r_now:>12.1f}{100 * (1 - r_now / t['T']):>9.1f}" if r_now is not None else f"{'MISS':>12}{'':>9}"
+        change = priority_name(p) + ("" if p == t["prio"] else f" (now {t['prio']})")
+        later = f"{r_rm:>10.1f}" if r_rm is not None else f"{'MISS':>10}"
+        print(f"{t['name']:<16}{t['T']:>10.0f}{now}   {change:<32}{later}", file=out)
+
+    print(f"\nrate headroom: now x{headroom(live, irq):.2f}, rate-monotonic x{headroom(proposed, irq):.2f}",
+          file=out)
+    print("(event-driven tasks use their shortest gap as T; C includes the interrupts taken while a task ran)",
+          file=out)
+    return 0 if None not in current else 2
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("device", nargs="?", help="serial device of the board")
+    parser.add_argument("--board", choices=["mdp", "motor"], default="mdp",
+                        help="mdp: STM/MDP USART3; motor: STM/stm32-motor link")
+    parser.add_argument("--baud", type=int, default=LINK_BAUD)
+    parser.add_argument("--window", type=float, default=0,
+                        help="clear the figures first and measure this many seconds")
+    parser.add_argument("--input", help="saved SCHED reply to analyse instead of a port")
+    parser.add_argument("-o", "--output", help="also save the raw reply to this file")
+    args = parser.parse_args()
+
+    if args.input:
+        with open(args.input) as f:
+            lines = f.read().replace(";", "\n").splitlines()
+    elif args.device:
+        with serial.Serial(args.device, args.baud, timeout=0.1) as port:
+            if args.window > 0:
+                request(port, args.board, 1)
+                print(f"measuring for {args.window:g} s...", file=sys.stderr)
+                time.sleep(args.window)
+            lines = request(port, args.board, 2)
+    else:
+        parser.error("give a device or --input")
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write("\n".join(lines) + "\n")
+    sys.exit(report(*parse(lines), sys.stdout))
+
+
+if __name__ == "__main__":
+    main()
@@ -34,8 +34,8 @@ def send_path_to_stm(device_path, json_path_string):
             # with line buffering but without adding extra newlines.
             ser = open(device_path, 'w', buffering=1)
         else:
-            print(f"Opening serial port: {device_path} at 115200 baud...")
-            ser = serial.Serial(device_path, 115200, timeout=1) # 115200 baud rate from C code, 1s timeout
+            print(f"Opening serial port: {device_path} at 1000000 baud...")
+            ser = serial.Serial(device_path, 1000000, timeout=1) # STM32_BAUD_RATE from C code, 1s timeout
     except serial.SerialException as e:
         print(f"Error opening serial port {device_path}: {e}", file=sys.stderr)
         print("Please ensure 'pyserial' is installed ('pip install pyserial') if using a physical serial port.", file=sys.stderr)
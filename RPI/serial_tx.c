@@ -0,0 +1,229 @@
+#include "serial_tx.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+
+typedef struct {
+    atomic_bool attached;
+    int fd;
+    const char* tag;
+    int stall_ms;
+    pthread_mutex_t lock;
+    bool held;
+    pthread_t holder;
+    // Queued frames, back to back in buf. Frame 0 may have had head_sent
+    // bytes written already, by a write that stalled partway.
+    int frames;
+    size_t lens[SERIAL_TX_MAX_FRAMES];
+    size_t used;
+    size_t head_sent;
+    uint8_t buf[SERIAL_TX_BUFFER_BYTES];
+} SerialTx;
+
+static SerialTx g_links[SERIAL_TX_LINKS];
+static pthread_mutex_t g_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SerialTx* tx_find(int fd) {
+    for (int i = 0; i < SERIAL_TX_LINKS; i++) {
+        if (atomic_load_explicit(&g_links[i].attached, memory_order_acquire) && g_links[i].fd == fd) return &g_links[i];
+    }
+    return NULL;
+}
+
+// Waits for fd to take more bytes. *deadline_ns is set on the first call after
+// the write last made progress. Returns -1 once it has passed.
+static int tx_wait_writable(int fd, int stall_ms, uint64_t* deadline_ns) {
+    uint64_t now_ns = latency_now_ns();
+    if (*deadline_ns == 0) *deadline_ns = now_ns + (uint64_t)stall_ms * 1000000ull;
+    metric_inc(METRIC_SERIAL_STALLS);
+    while (now_ns < *deadline_ns) {
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        int ready = poll(&pfd, 1, (int)((*deadline_ns - now_ns + 999999) / 1000000));
+        if (ready > 0) return (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) ? -1 : 0;
+        if (ready < 0 && errno != EINTR) return -1;
+        now_ns = latency_now_ns();
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// Writes the n frames of iov with as few writev()s as fd allows; starts[i] is
+// where frame i begins and lens[i] its length, iov[0] may begin partway into
+// it. Completed frames are traced. Returns the number of frames completed; if
+// that is short of n, errno says why and iov[return] holds what is left of the
+// frame that was cut short.
+static int tx_writev(int fd, int stall_ms, struct iovec* iov, const uint8_t* const* starts, const size_t* lens,
+                     int n) {
+    int done = 0;
+    uint64_t deadline_ns = 0;
+    while (done < n) {
+        ssize_t written = writev(fd, iov + done, n - done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && tx_wait_writable(fd, stall_ms, &deadline_ns) == 0) continue;
+            return done;
+        }
+        metric_inc(METRIC_SERIAL_WRITES);
+        deadline_ns = 0; // stall_ms counts from the last progress
+        size_t left = (size_t)written;
+        while (left > 0 || (done < n && iov[done].iov_len == 0)) {
+            size_t take = left < iov[done].iov_len ? left : iov[done].iov_len;
+            iov[done].iov_base = (uint8_t*)iov[done].iov_base + take;
+            iov[done].iov_len -= take;
+            left -= take;
+            if (iov[done].iov_len == 0) {
+                trace_record_fd_write(fd, starts[done], lens[done]);
+                done++;
+            }
+        }
+    }
+    return done;
+}
+
+// Writes the queued frames, then extra (extra_len bytes the caller owns) if
+// given. On a stall, the part of a frame already started stays queued and
+// the rest are dropped. Call with tx->lock held.
+static int tx_flush_locked(SerialTx* tx, const void* extra, size_t extra_len) {
+    struct iovec iov[SERIAL_TX_MAX_FRAMES + 1];
+    const uint8_t* starts[SERIAL_TX_MAX_FRAMES + 1];
+    size_t lens[SERIAL_TX_MAX_FRAMES + 1];
+    int n = 0;
+    size_t offset = 0;
+    for (int i = 0; i < tx->frames; i++) {
+        starts[n] = tx->buf + offset;
+        lens[n] = tx->lens[i];
+        iov[n++] = (struct iovec){ .iov_base = tx->buf + offset, .iov_len = tx->lens[i] };
+        offset += tx->lens[i];
+    }
+    if (extra_len > 0) {
+        starts[n] = extra;
+        lens[n] = extra_len;
+        iov[n++] = (struct iovec){ .iov_base = (void*)extra, .iov_len = extra_len };
+    }
+    if (n == 0) return 0;
+    iov[0].iov_base = (uint8_t*)iov[0].iov_base + tx->head_sent;
+    iov[0].iov_len -= tx->head_sent;
+
+    int done = tx_writev(tx->fd, tx->stall_ms, iov, starts, lens, n);
+    tx->frames = 0;
+    tx->used = 0;
+    tx->head_sent = 0;
+    if (done == n) return 0;
+
+    int saved_errno = errno;
+    size_t sent = lens[done] - iov[done].iov_len;
+    if (sent > 0 && lens[done] <= SERIAL_TX_BUFFER_BYTES) {
+        memmove(tx->buf, starts[done], lens[done]);
+        tx->frames = 1;
+        tx->lens[0] = lens[done];
+        tx->used = lens[done];
+        tx->head_sent = sent;
+    } else if (sent > 0) {
+        LOG_ERROR("[%s] A %zu byte frame was cut short after %zu bytes.\n", tx->tag, lens[done], sent);
+    }
+    LOG_ERROR("[%s] Write failed, %d frame(s) not sent: %s\n", tx->tag, n - done - (tx->frames ? 1 : 0),
+              strerror(saved_errno));
+    errno = saved_errno;
+    return -1;
+}
+
+int serial_tx_attach(int fd, const char* tag, int stall_ms) {
+    pthread_mutex_lock(&g_attach_lock);
+    SerialTx* tx = NULL;
+    for (int i = 0; i < SERIAL_TX_LINKS && !tx; i++) {
+        if (!atomic_load(&g_links[i].attached)) tx = &g_links[i];
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (!tx || flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        pthread_mutex_unlock(&g_attach_lock);
+        LOG_WARN("[%s] No writer for fd %d; writing it directly.\n", tag, fd);
+        return -1;
+    }
+    pthread_mutex_init(&tx->lock, NULL);
+    tx->fd = fd;
+    tx->tag = tag;
+    tx->stall_ms = stall_ms;
+    tx->held = false;
+    tx->frames = 0;
+    tx->used = 0;
+    tx->head_sent = 0;
+    atomic_store_explicit(&tx->attached, true, memory_order_release);
+    pthread_mutex_unlock(&g_attach_lock);
+    return 0;
+}
+
+void serial_tx_detach(int fd) {
+    pthread_mutex_lock(&g_attach_lock);
+    SerialTx* tx = tx_find(fd);
+    if (tx) {
+        pthread_mutex_lock(&tx->lock);
+        tx_flush_locked(tx, NULL, 0);
+        atomic_store_explicit(&tx->attached, false, memory_order_release);
+        int flags = fcntl(fd, F_GETFL);
+        if (flags != -1) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        pthread_mutex_unlock(&tx->lock);
+        pthread_mutex_destroy(&tx->lock);
+    }
+    pthread_mutex_unlock(&g_attach_lock);
+}
+
+int serial_tx_send(int fd, const void* data, size_t len) {
+    SerialTx* tx = tx_find(fd);
+    if (!tx) {
+        struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+        const uint8_t* start = data;
+        return len == 0 || tx_writev(fd, SERIAL_TX_STALL_MS, &iov, &start, &len, 1) == 1 ? 0 : -1;
+    }
+    pthread_mutex_lock(&tx->lock);
+    int result = 0;
+    if (tx->held && pthread_equal(tx->holder, pthread_self())) {
+        if (tx->frames == SERIAL_TX_MAX_FRAMES || tx->used + len > SERIAL_TX_BUFFER_BYTES) {
+            result = tx_flush_locked(tx, NULL, 0);
+        }
+        if (result == 0 && len > SERIAL_TX_BUFFER_BYTES) {
+            result = tx_flush_locked(tx, data, len);
+        } else if (result == 0) {
+            memcpy(tx->buf + tx->used, data, len);
+            tx->lens[tx->frames++] = len;
+            tx->used += len;
+        }
+    } else {
+        result = tx_flush_locked(tx, data, len);
+    }
+    pthread_mutex_unlock(&tx->lock);
+    return result;
+}
+
+void serial_tx_hold(int fd) {
+    SerialTx* tx = tx_find(fd);
+    if (!tx) return;
+    pthread_mutex_lock(&tx->lock);
+    if (!tx->held) {
+        tx->held = true;
+        tx->holder = pthread_self();
+    }
+    pthread_mutex_unlock(&tx->lock);
+}
+
+int serial_tx_release(int fd) {
+    SerialTx* tx = tx_find(fd);
+    if (!tx) return 0;
+    pthread_mutex_lock(&tx->lock);
+    if (tx->held && pthread_equal(tx->holder, pthread_self())) tx->held = false;
+    int result = tx_flush_locked(tx, NULL, 0);
+    pthread_mutex_unlock(&tx->lock);
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef SERIAL_TX_H
+#define SERIAL_TX_H
+
+#include <stddef.h>
+
+/**
+ * @file serial_tx.h
+ * @brief Frame writer shared by the STM32 and Android links.
+ *
+ * Every write to either link goes through serial_tx_send(), which sends the
+ * whole frame or fails: a short write is continued where it stopped, never
+ * taken for success. serial_tx_attach() puts a link's fd in non-blocking mode
+ * and gives it a writer. An attached link's writes are serialized, so frames
+ * from different threads never interleave, and a write the tty cannot take
+ * yet (EAGAIN) waits for POLLOUT rather than sleeping in the kernel with the
+ * fd's other users locked out.
+ *
+ * Batching. Between serial_tx_hold() and serial_tx_release(), the holding
+ * thread's frames are queued instead of written. The release sends all of them
+ * with one writev(), so a window of pipelined commands costs one syscall. A
+ * write from any other thread meanwhile (a SYNC, an emergency stop) goes out
+ * with everything queued ahead of it, in order.
+ *
+ * A link that takes nothing for its stall_ms makes the write give up with -1.
+ * Frames not yet started are dropped then. The rest of one that was cut short
+ * is kept and written first next time, so the peer's framer never sees a
+ * frame end early.
+ *
+ * An fd that is not attached (or after serial_tx_detach()) is written
+ * directly, one write per frame, as before. Thread-safe.
+ */
+
+#define SERIAL_TX_LINKS 4
+// Frames and bytes one hold can queue; a send that would overflow either
+// writes out what is queued first
+#define SERIAL_TX_MAX_FRAMES 32
+#define SERIAL_TX_BUFFER_BYTES 4096
+// How long a write waits for an unattached fd that returns EAGAIN
+#define SERIAL_TX_STALL_MS 500
+
+// Gives fd a writer and makes it non-blocking. tag prefixes its log lines.
+// Returns 0, or -1 if every writer is taken or fcntl() failed (the fd is then
+// written directly).
+int serial_tx_attach(int fd, const char* tag, int stall_ms);
+
+// Writes out what is queued, then puts fd back in blocking mode. Call once
+// the link's other users have stopped.
+void serial_tx_detach(int fd);
+
+// Writes len bytes of data to fd, or queues them while this thread holds fd.
+// Returns 0 once written (or queued), -1 on a write error or stall.
+int serial_tx_send(int fd, const void* data, size_t len);
+
+// Queues this thread's sends on fd until serial_tx_release(). One thread holds
+// a writer at a time; a hold by another is ignored. No-op for unattached fds.
+void serial_tx_hold(int fd);
+
+// Ends the hold and writes out everything queued. Returns 0, or -1 if that
+// write failed (queued frames are then lost, see above).
+int serial_tx_release(int fd);
+
+#endif // SERIAL_TX_H
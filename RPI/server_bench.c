@@ -0,0 +1,589 @@
+/*
+ * Load generator and latency benchmark for the pathfinding and image servers.
+ * Sends the controller's own requests, at a set concurrency and rate, and
+ * reports how long the server took to answer them and how many it failed:
+ *
+ *   gcc -O2 -Wall server_bench.c json_parser.c json_writer.c arena.c -o server_bench -lcurl -ljpeg -lm
+ *   ./server_bench --path URL [--arena SENDARENA.json] [--budget MS] [OPTIONS]
+ *   ./server_bench --image URL [--jpeg CAPTURE.jpg] [--batch K] [--arena SENDARENA.json] [OPTIONS]
+ *
+ *   OPTIONS: [-n COUNT] [-c CONCURRENCY] [-r RATE] [--warmup N] [--fresh] [-o SAMPLES.csv]
+ *
+ * --path POSTs the pathfinding payload build_pathfinding_payload() makes for
+ * the map of an Android sendArena message (default json_corpus/sendarena_8.json),
+ * with the controller's default flags; --budget adds the anytime time budget
+ * the nav thread asks for. --image POSTs the multipart upload of a snapshot:
+ * an "image" part (capture.jpg, image/jpeg) and an "object_id" part, K times
+ * for a batched upload, the ids taken in turn from the map's obstacles. The
+ * frame is --jpeg, else a synthetic 640x480 capture. A reply counts as an
+ * error unless it is a 2xx the controller's parser accepts (parse_route_json,
+ * parse_detection_json or parse_detection_batch_json); a detection without
+ * any object is still a valid answer.
+ *
+ * CONCURRENCY requests are kept in flight at most (default 1), each slot on a
+ * warm handle that keeps its connection, as the image workers do; --fresh
+ * opens a new connection for every request. Without -r, a slot sends its next
+ * request as soon as its last is answered (closed loop). With -r, requests are
+ * due RATE times a second whatever the server does (open loop), and latency
+ * counts from when a request was due, so time spent waiting for a free slot
+ * shows up instead of slowing the load down. The first --warmup requests are
+ * sent but left out of the results.
+ *
+ * Stages of one request:
+ *   queue    due to started: waiting for a free slot (open loop only)
+ *   connect  TCP handshake, when the request opened a connection
+ *   send     started to its last byte sent: connect, upload, and for a large
+ *            upload the second curl waits for a "100 Continue"
+ *   server   last byte sent to the first byte of the reply
+ *   request  started to the reply in hand
+ *   total    due to the reply in hand
+ *
+ * -o writes every measured request as CSV.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+#include <jpeglib.h>
+
+#include "arena.h"
+#include "json_parser.h"
+#include "json_schema.h"
+#include "json_writer.h"
+
+#define BENCH_DEFAULT_ARENA "json_corpus/sendarena_8.json"
+#define BENCH_MAX_CONCURRENCY 64
+#define BENCH_MAX_BATCH 16    // DETECTION_BATCH_MAX_RESULTS
+#define BENCH_TIMEOUT_S 30L  // The controller's image upload timeout
+#define BENCH_FRAME_WIDTH 640 // CAMERA_WIDTH x CAMERA_HEIGHT
+#define BENCH_FRAME_HEIGHT 480
+#define BENCH_FRAME_QUALITY 85
+#define BENCH_HIST_BUCKETS 24 // Up to 2^23 us, ~8 s
+#define BENCH_HIST_WIDTH 50
+
+typedef enum {
+    STAGE_QUEUE,
+    STAGE_CONNECT,
+    STAGE_SEND,
+    STAGE_SERVER,
+    STAGE_REQUEST,
+    STAGE_TOTAL,
+    STAGES
+} BenchStage;
+
+static const char* const STAGE_NAMES[STAGES] = {"queue", "connect", "send", "server", "request", "total"};
+
+typedef enum {
+    RESULT_OK,
+    RESULT_TRANSPORT, // curl failed: refused, reset, timed out
+    RESULT_HTTP,      // Answered with a non-2xx status
+    RESULT_REPLY,     // 2xx, but not a reply the controller can use
+    RESULTS
+} BenchResult;
+
+static const char* const RESULT_NAMES[RESULTS] = {"ok", "transport", "http", "reply"};
+
+// One request. ns[] holds -1 for a stage that is not known.
+typedef struct {
+    uint64_t due_ns;
+    BenchResult result;
+    long status;
+    int64_t ns[STAGES];
+} BenchSample;
+
+typedef struct {
+    char* data;
+    size_t len, cap;
+} BenchBuffer;
+
+typedef struct {
+    CURL* curl;
+    curl_mime* form;
+    BenchBuffer reply;
+    int sample; // Request in flight, or -1
+    uint64_t started_ns, sent_ns, first_byte_ns; // 0 until then
+} BenchSlot;
+
+typedef struct {
+    int image; // Else the pathfinding server
+    const char* url;
+    const char* payload; // Pathfinding request
+    BenchBuffer jpeg;    // Image upload frame
+    int object_ids[BENCH_MAX_BATCH];
+    int batch;
+    int fresh;
+} BenchTarget;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t buffer_write(void* contents, size_t size, size_t nmemb, void* userp) {
+    BenchBuffer* b = userp;
+    size_t n = size * nmemb;
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n + 1) cap *= 2;
+        char* data = realloc(b->data, cap);
+        if (!data) return 0;
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, contents, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+    return n;
+}
+
+// CURLOPT_WRITEFUNCTION of a slot: stamps the reply's first byte.
+static size_t slot_write(void* contents, size_t size, size_t nmemb, void* userp) {
+    BenchSlot* slot = userp;
+    if (!slot->first_byte_ns) slot->first_byte_ns = now_ns();
+    return buffer_write(contents, size, nmemb, &slot->reply);
+}
+
+// CURLOPT_XFERINFOFUNCTION of a slot: stamps the request's last byte sent.
+// curl's own STARTTRANSFER time marks the start of an upload, not its reply.
+static int slot_progress(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow;
+    BenchSlot* slot = clientp;
+    if (!slot->sent_ns && ultotal > 0 && ulnow >= ultotal) slot->sent_ns = now_ns();
+    return 0;
+}
+
+static int read_file(const char* path, BenchBuffer* out) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char chunk[8192];
+    size_t n;
+    out->len = 0;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (buffer_write(chunk, 1, n, out) != n) break;
+    }
+    int failed = ferror(f) || !out->data;
+    fclose(f);
+    return failed ? -1 : 0;
+}
+
+// The map of an Android sendArena message, as the controller parses it.
+static int load_arena(const char* path, SharedAppContext* context) {
+    BenchBuffer text = {0};
+    if (read_file(path, &text) != 0) return -1;
+    JsonToken tokens[MAX_OBSTACLES * 9 + 32];
+    JsonDoc doc;
+    AndroidMessage msg = { .value = -1 };
+    int rc = -1;
+    if (json_parse(&doc, text.data, text.len, tokens, (int)(sizeof(tokens) / sizeof(tokens[0]))) == 0
+        && json_decode_android_message(&doc, 0, &msg, NULL) == 0 && strcmp(msg.cat, "sendArena") == 0) {
+        rc = parse_android_map_doc(&doc, msg.value, context);
+    }
+    if (rc != 0) fprintf(stderr, "%s: not a sendArena message\n", path);
+    free(text.data);
+    return rc;
+}
+
+// build_pathfinding_payload() with USE_HYBRID_PLANNER 0 and USE_SPEED_CLASSES 1
+static const char* build_payload(const SharedAppContext* context, int time_budget_ms, Arena* arena) {
+    JsonWriter w;
+    jw_init_arena(&w, arena, 128 + 48 * (size_t)context->obstacle_count);
+    jw_begin_object(&w);
+    jw_key(&w, "obstacles");
+    jw_begin_array(&w);
+    for (int i = 0; i < context->obstacle_count; i++) {
+        jw_begin_object(&w);
+        jw_key(&w, "id"); jw_int(&w, context->obstacles[i].id);
+        jw_key(&w, "x"); jw_int(&w, context->obstacles[i].x);
+        jw_key(&w, "y"); jw_int(&w, context->obstacles[i].y);
+        jw_key(&w, "d"); jw_int(&w, context->obstacles[i].d);
+        jw_end_object(&w);
+    }
+    jw_end_array(&w);
+    jw_key(&w, "robot_x"); jw_int(&w, context->robot_start_x);
+    jw_key(&w, "robot_y"); jw_int(&w, context->robot_start_y);
+    jw_key(&w, "robot_dir"); jw_int(&w, context->robot_start_dir);
+    jw_key(&w, "retrying"); jw_bool(&w, false);
+    if (time_budget_ms > 0) {
+        jw_key(&w, "time_budget_ms"); jw_int(&w, time_budget_ms);
+    }
+    jw_key(&w, "speed_classes"); jw_bool(&w, true);
+    jw_end_object(&w);
+    return jw_str(&w);
+}
+
+// A capture-sized frame with a camera's noise, so it compresses like one.
+static int synthetic_jpeg(BenchBuffer* out) {
+    uint8_t* row = malloc(BENCH_FRAME_WIDTH * 3);
+    if (!row) return -1;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr err;
+    unsigned char* data = NULL;
+    unsigned long size = 0;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &data, &size);
+    cinfo.image_width = BENCH_FRAME_WIDTH;
+    cinfo.image_height = BENCH_FRAME_HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, BENCH_FRAME_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    uint32_t seed = 12345;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        for (int x = 0; x < BENCH_FRAME_WIDTH * 3; x++) {
+            seed = seed * 1103515245u + 12345u;
+            row[x] = (uint8_t)((x / 3 + cinfo.next_scanline) / 5 + (seed >> 27));
+        }
+        JSAMPROW p = row;
+        jpeg_write_scanlines(&cinfo, &p, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+    out->len = 0;
+    int rc = buffer_write(data, 1, size, out) == size ? 0 : -1;
+    free(data);
+    return rc;
+}
+
+// Points slot's handle at the next request. Returns 0 on success.
+static int prepare_request(BenchSlot* slot, const BenchTarget* target, struct curl_slist* json_headers) {
+    CURL* curl = slot->curl;
+    curl_easy_reset(curl); // Keeps the connection, as the controller's handles do
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, BENCH_TIMEOUT_S);
+    curl_easy_setopt(curl, CURLOPT_URL, target->url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, slot_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)slot);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, slot_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void*)slot);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    if (target->fresh) {
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+    }
+    slot->reply.len = 0;
+    slot->started_ns = now_ns();
+    slot->sent_ns = slot->first_byte_ns = 0;
+    if (!target->image) {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, target->payload);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, json_headers);
+        return 0;
+    }
+    curl_mime_free(slot->form);
+    slot->form = curl_mime_init(curl);
+    if (!slot->form) return -1;
+    for (int i = 0; i < target->batch; i++) {
+        curl_mimepart* field = curl_mime_addpart(slot->form);
+        if (!field) return -1;
+        curl_mime_name(field, "image");
+        curl_mime_data(field, target->jpeg.data, target->jpeg.len);
+        curl_mime_filename(field, "capture.jpg"); curl_mime_type(field, "image/jpeg");
+        char id_str[12]; snprintf(id_str, sizeof(id_str), "%d", target->object_ids[i]);
+        field = curl_mime_addpart(slot->form);
+        if (!field) return -1;
+        curl_mime_name(field, "object_id"); curl_mime_data(field, id_str, CURL_ZERO_TERMINATED);
+    }
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, slot->form);
+    return 0;
+}
+
+// Whether the controller would take reply as an answer.
+static int reply_valid(const BenchTarget* target, const BenchBuffer* reply, Arena* arena) {
+    if (!reply->data) return 0;
+    if (!target->image) {
+        CommandList commands;
+        SnapList snaps;
+        arena_reset(arena);
+        return parse_route_json(reply->data, arena, &commands, &snaps) == 0;
+    }
+    Detection objects[DETECTION_MAX_OBJECTS];
+    if (target->batch == 1) return parse_detection_json(reply->data, reply->len, objects, DETECTION_MAX_OBJECTS) >= 0;
+    DetectionResultSpan results[BENCH_MAX_BATCH];
+    int count = parse_detection_batch_json(reply->data, reply->len, results, BENCH_MAX_BATCH);
+    if (count != target->batch) return 0;
+    for (int i = 0; i < count; i++) {
+        if (parse_detection_json(results[i].reply.ptr, (size_t)results[i].reply.len, objects,
+                                 DETECTION_MAX_OBJECTS) < 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Fills in sample from the slot's finished transfer, and first_error (if not
+// NULL) with the first failure's description.
+static void finish_request(BenchSample* s, BenchSlot* slot, CURLcode code, const BenchTarget* target, Arena* arena,
+                           uint64_t done_ns, char* first_error, size_t error_size) {
+    curl_off_t lookup = 0, connect = 0;
+    curl_easy_getinfo(slot->curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    curl_easy_getinfo(slot->curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(slot->curl, CURLINFO_RESPONSE_CODE, &s->status);
+    s->ns[STAGE_CONNECT] = connect > lookup ? (int64_t)(connect - lookup) * 1000 : -1; // Reused: no connect phase
+    if (slot->sent_ns) s->ns[STAGE_SEND] = (int64_t)(slot->sent_ns - slot->started_ns);
+    if (slot->sent_ns && slot->first_byte_ns >= slot->sent_ns) {
+        s->ns[STAGE_SERVER] = (int64_t)(slot->first_byte_ns - slot->sent_ns);
+    }
+    s->ns[STAGE_REQUEST] = (int64_t)(done_ns - slot->started_ns);
+    s->ns[STAGE_TOTAL] = (int64_t)(done_ns - s->due_ns);
+
+    char error[160] = "";
+    if (code != CURLE_OK) {
+        s->result = RESULT_TRANSPORT;
+        snprintf(error, sizeof(error), "%s", curl_easy_strerror(code));
+    } else if (s->status < 200 || s->status >= 300) {
+        s->result = RESULT_HTTP;
+        snprintf(error, sizeof(error), "HTTP %ld", s->status);
+    } else if (!reply_valid(target, &slot->reply, arena)) {
+        s->result = RESULT_REPLY;
+        snprintf(error, sizeof(error), "unusable reply: %.100s", slot->reply.data ? slot->reply.data : "(empty)");
+    } else {
+        s->result = RESULT_OK;
+    }
+    if (error[0] && first_error && !first_error[0]) snprintf(first_error, error_size, "%s", error);
+}
+
+static int cmp_i64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void print_stage(const BenchSample* samples, int count, BenchStage stage, int64_t* scratch) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (samples[i].result == RESULT_OK && samples[i].ns[stage] >= 0) scratch[n++] = samples[i].ns[stage];
+    }
+    if (n == 0) {
+        printf("%-8s no samples\n", STAGE_NAMES[stage]);
+        return;
+    }
+    qsort(scratch, (size_t)n, sizeof(scratch[0]), cmp_i64);
+    printf("%-8s n=%-6d p50 %9.2f ms  p90 %9.2f  p99 %9.2f  max %9.2f\n", STAGE_NAMES[stage], n,
+           scratch[n / 2] / 1e6, scratch[n * 9 / 10] / 1e6, scratch[n * 99 / 100] / 1e6, scratch[n - 1] / 1e6);
+    if (stage != STAGE_TOTAL) return;
+    int buckets[BENCH_HIST_BUCKETS] = {0}, peak = 0, first = BENCH_HIST_BUCKETS, last = 0;
+    for (int i = 0; i < n; i++) {
+        int b = 0;
+        for (int64_t us = scratch[i] / 1000; us > 0 && b < BENCH_HIST_BUCKETS - 1; us >>= 1) b++;
+        if (++buckets[b] > peak) peak = buckets[b];
+        if (b < first) first = b;
+        if (b > last) last = b;
+    }
+    for (int b = first; b <= last; b++) {
+        long lo = b ? 1L << (b - 1) : 0, hi = 1L << b;
+        int bar = (buckets[b] * BENCH_HIST_WIDTH + peak - 1) / peak;
+        printf("  [%7ld, %7ld) us %6d %.*s\n", lo, hi, buckets[b], bar,
+               "##################################################");
+    }
+}
+
+static int write_samples(const char* path, const BenchSample* samples, int count) {
+    FILE* f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fprintf(f, "id,result,status");
+    for (int s = 0; s < STAGES; s++) fprintf(f, ",%s_ns", STAGE_NAMES[s]);
+    fprintf(f, "\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(f, "%d,%s,%ld", i + 1, RESULT_NAMES[samples[i].result], samples[i].status);
+        for (int s = 0; s < STAGES; s++) {
+            if (samples[i].ns[s] >= 0) fprintf(f, ",%lld", (long long)samples[i].ns[s]);
+            else fprintf(f, ",");
+        }
+        fprintf(f, "\n");
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s --path URL [--budget MS] | --image URL [--jpeg FILE] [--batch K]\n"
+            "       [--arena SENDARENA.json] [-n COUNT] [-c CONCURRENCY] [-r RATE] [--warmup N] [--fresh]"
+            " [-o SAMPLES.csv]\n",
+            argv0);
+}
+
+int main(int argc, char** argv) {
+    int count = 200, concurrency = 1, warmup = 0, budget_ms = 0;
+    double rate = 0.0;
+    const char *arena_path = BENCH_DEFAULT_ARENA, *jpeg_path = NULL, *out_path = NULL;
+    BenchTarget target = { .batch = 1 };
+    for (int i = 1; i < argc; i++) {
+        const char* opt = argv[i];
+        if (strcmp(opt, "--fresh") == 0) {
+            target.fresh = 1;
+        } else if (i + 1 < argc && strcmp(opt, "--path") == 0) {
+            target.url = argv[++i];
+            target.image = 0;
+        } else if (i + 1 < argc && strcmp(opt, "--image") == 0) {
+            target.url = argv[++i];
+            target.image = 1;
+        } else if (i + 1 < argc && strcmp(opt, "--arena") == 0) {
+            arena_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(opt, "--budget") == 0) {
+            budget_ms = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "--jpeg") == 0) {
+            jpeg_path = argv[++i];
+        } else if (i + 1 < argc && strcmp(opt, "--batch") == 0) {
+            target.batch = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-n") == 0) {
+            count = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-c") == 0) {
+            concurrency = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-r") == 0) {
+            rate = atof(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "--warmup") == 0) {
+            warmup = atoi(argv[++i]);
+        } else if (i + 1 < argc && strcmp(opt, "-o") == 0) {
+            out_path = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!target.url || count < 1 || warmup < 0 || concurrency < 1 || concurrency > BENCH_MAX_CONCURRENCY
+        || rate < 0.0 || target.batch < 1 || target.batch > BENCH_MAX_BATCH) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    static SharedAppContext context;
+    Arena arena;
+    arena_init(&arena, ARENA_DEFAULT_BLOCK_SIZE);
+    Arena reply_arena;
+    arena_init(&reply_arena, ARENA_DEFAULT_BLOCK_SIZE);
+    if (load_arena(arena_path, &context) != 0) return 1;
+    if (target.image) {
+        if (jpeg_path ? read_file(jpeg_path, &target.jpeg) != 0 : synthetic_jpeg(&target.jpeg) != 0) return 1;
+        for (int i = 0; i < target.batch; i++) {
+            target.object_ids[i] = context.obstacle_count > 0 ? context.obstacles[i % context.obstacle_count].id : i + 1;
+        }
+    } else {
+        target.payload = build_payload(&context, budget_ms, &arena);
+    }
+
+    int total_requests = warmup + count;
+    BenchSample* samples = calloc((size_t)total_requests, sizeof(BenchSample));
+    int64_t* scratch = calloc((size_t)total_requests, sizeof(int64_t));
+    BenchSlot slots[BENCH_MAX_CONCURRENCY] = {{0}};
+    struct curl_slist* json_headers = curl_slist_append(NULL, "Content-Type: application/json");
+    curl_global_init(CURL_GLOBAL_ALL); // As the controller
+    CURLM* multi = curl_multi_init();
+    int status = 1;
+    if (!samples || !scratch || !json_headers || !multi) goto out;
+    for (int i = 0; i < concurrency; i++) {
+        slots[i].curl = curl_easy_init();
+        slots[i].sample = -1;
+        if (!slots[i].curl) goto out;
+    }
+    if (target.image) {
+        printf("%s: %d upload(s) of %d image(s) (%zu bytes each)", target.url, count, target.batch, target.jpeg.len);
+    } else {
+        printf("%s: %d route request(s) for %d obstacle(s) (%zu bytes)", target.url, count, context.obstacle_count,
+               strlen(target.payload));
+    }
+    if (rate > 0.0) printf(", %.1f/s", rate);
+    printf(", concurrency %d%s, %d warm-up\n", concurrency, target.fresh ? ", fresh connections" : "", warmup);
+
+    char first_error[200] = "";
+    uint64_t start_ns = now_ns(), measured_ns = 0, last_ns = 0;
+    int next = 0, done = 0, in_flight = 0;
+    while (done < total_requests) {
+        uint64_t now = now_ns();
+        while (next < total_requests && in_flight < concurrency) {
+            uint64_t due = rate > 0.0 ? start_ns + (uint64_t)(next * 1e9 / rate) : now;
+            if (due > now) break;
+            BenchSlot* slot = NULL;
+            for (int i = 0; i < concurrency && !slot; i++) {
+                if (slots[i].sample < 0) slot = &slots[i];
+            }
+            BenchSample* s = &samples[next];
+            for (int st = 0; st < STAGES; st++) s->ns[st] = -1;
+            s->due_ns = due;
+            if (next == warmup) measured_ns = now;
+            if (prepare_request(slot, &target, json_headers) != 0 || curl_multi_add_handle(multi, slot->curl) != CURLM_OK) {
+                fprintf(stderr, "Cannot set up request %d\n", next + 1);
+                goto out;
+            }
+            s->ns[STAGE_QUEUE] = (int64_t)(slot->started_ns - due);
+            slot->sample = next++;
+            in_flight++;
+        }
+
+        int running;
+        curl_multi_perform(multi, &running);
+        CURLMsg* msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            BenchSlot* slot = NULL;
+            for (int i = 0; i < concurrency && !slot; i++) {
+                if (slots[i].curl == msg->easy_handle) slot = &slots[i];
+            }
+            CURLcode code = msg->data.result;
+            curl_multi_remove_handle(multi, slot->curl);
+            last_ns = now_ns();
+            finish_request(&samples[slot->sample], slot, code, &target, &reply_arena, last_ns,
+                           slot->sample >= warmup ? first_error : NULL, sizeof(first_error));
+            slot->sample = -1;
+            done++;
+            in_flight--;
+        }
+        if (done == total_requests) break;
+
+        // Sleep until a reply, or until the next request is due
+        int wait_ms = 100;
+        if (rate > 0.0 && next < total_requests && in_flight < concurrency) {
+            uint64_t due = start_ns + (uint64_t)(next * 1e9 / rate), after = now_ns();
+            wait_ms = due > after ? (int)((due - after) / 1000000ull) : 0;
+        }
+        if (in_flight > 0 && wait_ms > 0) curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+        else if (wait_ms > 0) {
+            struct timespec pause = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    BenchSample* measured = samples + warmup;
+    int results[RESULTS] = {0};
+    for (int i = 0; i < count; i++) results[measured[i].result]++;
+    double seconds = (double)(last_ns - measured_ns) / 1e9;
+    printf("%d ok, %d transport error(s), %d HTTP error(s), %d unusable repl%s (%.1f%% failed)\n", results[RESULT_OK],
+           results[RESULT_TRANSPORT], results[RESULT_HTTP], results[RESULT_REPLY],
+           results[RESULT_REPLY] == 1 ? "y" : "ies", 100.0 * (count - results[RESULT_OK]) / count);
+    if (first_error[0]) printf("first error: %s\n", first_error);
+    printf("throughput %.1f answer(s)/s over %.2f s\n", seconds > 0 ? results[RESULT_OK] / seconds : 0.0, seconds);
+    for (int st = 0; st < STAGES; st++) {
+        if (st == STAGE_QUEUE && rate == 0.0) continue; // Always 0 in a closed loop
+        print_stage(measured, count, (BenchStage)st, scratch);
+    }
+    status = out_path && write_samples(out_path, measured, count) != 0;
+out:
+    for (int i = 0; i < concurrency; i++) {
+        if (slots[i].curl) {
+            if (slots[i].sample >= 0) curl_multi_remove_handle(multi, slots[i].curl);
+            curl_easy_cleanup(slots[i].curl);
+        }
+        curl_mime_free(slots[i].form);
+        free(slots[i].reply.data);
+    }
+    if (multi) curl_multi_cleanup(multi);
+    curl_slist_free_all(json_headers);
+    curl_global_cleanup();
+    free(samples);
+    free(scratch);
+    free(target.jpeg.data);
+    arena_destroy(&arena);
+    arena_destroy(&reply_arena);
+    return status;
+}
@@ -0,0 +1,513 @@
+#include "server_channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "rt_profile.h"
+
+#define CHANNEL_HEADER_LEN 12 // length field + type, op, meta_len, id
+
+enum { SLOT_FREE, SLOT_WAITING, SLOT_DONE, SLOT_FAILED, SLOT_DROPPED };
+
+typedef struct {
+    uint32_t id;
+    int state;
+    ChannelMessage msg; // SLOT_DONE: the reply
+} PendingSlot;
+
+struct ServerChannel {
+    char name[16];
+    char host[128];
+    int port;
+    ChannelPushHandler on_push;
+    void* userdata;
+    pthread_t reader;
+    pthread_mutex_t write_lock; // Held for a whole frame; fd only changes under both locks
+    pthread_mutex_t lock;       // fd, pending and next_id
+    pthread_cond_t changed;     // A reply arrived, the connection dropped, close, or server_channel_wake()
+    int fd;                     // -1 while disconnected
+    atomic_bool up;
+    atomic_bool closing;
+    uint32_t next_id;
+    unsigned wakeups; // server_channel_wake() calls
+    PendingSlot pending[CHANNEL_MAX_PENDING];
+};
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Sends one frame on fd. Returns 0, or -1 if the connection failed.
+static int write_frame(int fd, uint8_t type, uint8_t op, uint32_t id, const char* meta, size_t meta_len,
+                       const void* blob, size_t blob_len) {
+    uint8_t header[CHANNEL_HEADER_LEN];
+    put_u32(header, (uint32_t)(CHANNEL_HEADER_LEN - 4 + meta_len + blob_len));
+    header[4] = type;
+    header[5] = op;
+    put_u16(&header[6], (uint16_t)meta_len);
+    put_u32(&header[8], id);
+
+    struct iovec iov[3] = {
+        { header, sizeof(header) },
+        { (void*)meta, meta_len },
+        { (void*)blob, blob_len },
+    };
+    struct iovec* next = iov;
+    int left = 3;
+    while (left > 0) {
+        struct msghdr msg = { .msg_iov = next, .msg_iovlen = (size_t)left };
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Skip what went out, including empty parts
+        while (left > 0 && (size_t)n >= next->iov_len) {
+            n -= (ssize_t)next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0) {
+            next->iov_base = (uint8_t*)next->iov_base + n;
+            next->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+static int read_full(int fd, void* buf, size_t len) {
+    uint8_t* p = (uint8_t*)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Reads one frame. Returns 0 with *type, *id and *msg filled (msg->meta owns
+// the allocation), or -1 if the connection failed or the frame is malformed.
+static int read_frame(int fd, uint8_t* type, uint32_t* id, ChannelMessage* msg) {
+    uint8_t header[CHANNEL_HEADER_LEN];
+    if (read_full(fd, header, sizeof(header)) != 0) return -1;
+    uint32_t length = get_u32(header);
+    uint16_t meta_len = get_u16(&header[6]);
+    if (length < CHANNEL_HEADER_LEN - 4 + (uint32_t)meta_len || length > CHANNEL_MAX_FRAME) return -1;
+    size_t blob_len = length - (CHANNEL_HEADER_LEN - 4) - meta_len;
+
+    // meta, its terminator, then blob
+    char* buf = malloc((size_t)meta_len + 1 + blob_len);
+    if (!buf) return -1;
+    if (read_full(fd, buf, meta_len) != 0 || read_full(fd, buf + meta_len + 1, blob_len) != 0) {
+        free(buf);
+        return -1;
+    }
+    buf[meta_len] = '\0';
+    *type = header[4];
+    *id = get_u32(&header[8]);
+    *msg = (ChannelMessage){ header[5], buf, meta_len, (const uint8_t*)buf + meta_len + 1, blob_len };
+    return 0;
+}
+
+void server_channel_message_free(ChannelMessage* msg) {
+    free(msg->meta);
+    *msg = (ChannelMessage){0};
+}
+
+// Opens a TCP connection to the channel's server within CHANNEL_CONNECT_TIMEOUT_MS.
+// Returns the socket, or -1.
+static int channel_connect(const ServerChannel* ch) {
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", ch->port);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* addrs = NULL;
+    if (getaddrinfo(ch->host, port_str, &hints, &addrs) != 0) return -1;
+
+    int fd = -1;
+    for (struct addrinfo* a = addrs; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) continue;
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int rc = connect(fd, a->ai_addr, a->ai_addrlen);
+        if (rc != 0 && errno == EINPROGRESS) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (poll(&pfd, 1, CHANNEL_CONNECT_TIMEOUT_MS) == 1 &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0) {
+                rc = 0;
+            }
+        }
+        if (rc != 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        fcntl(fd, F_SETFL, flags);
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // Replies are small and awaited
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    return fd;
+}
+
+// Exchanges HELLO on a fresh connection. Returns 0 if the server speaks this
+// version of the channel.
+static int channel_hello(int fd) {
+    char meta[32];
+    int meta_len = snprintf(meta, sizeof(meta), "{\"version\":%d}", CHANNEL_VERSION);
+    if (write_frame(fd, CHANNEL_MSG_HELLO, CHANNEL_OP_NONE, 0, meta, (size_t)meta_len, NULL, 0) != 0) return -1;
+
+    // A plain HTTP server never answers, so the reply is only waited for so long
+    struct timeval tv = { CHANNEL_CONNECT_TIMEOUT_MS / 1000, (CHANNEL_CONNECT_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    uint8_t type;
+    uint32_t id;
+    ChannelMessage reply;
+    if (read_frame(fd, &type, &id, &reply) != 0) return -1;
+    const char* version = strstr(reply.meta, "\"version\":");
+    int ok = type == CHANNEL_MSG_HELLO && version && atoi(version + strlen("\"version\":")) == CHANNEL_VERSION;
+    server_channel_message_free(&reply);
+    tv = (struct timeval){0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return ok ? 0 : -1;
+}
+
+// One connection attempt. Returns 0 once the channel is up.
+static int channel_establish(ServerChannel* ch) {
+    int fd = channel_connect(ch);
+    if (fd < 0) return -1;
+    if (channel_hello(fd) != 0) {
+        LOG_DEBUG("[Channel %s] %s:%d does not speak channel v%d.\n", ch->name, ch->host, ch->port, CHANNEL_VERSION);
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_lock(&ch->write_lock);
+    pthread_mutex_lock(&ch->lock);
+    ch->fd = fd;
+    atomic_store(&ch->up, true);
+    pthread_mutex_unlock(&ch->lock);
+    pthread_mutex_unlock(&ch->write_lock);
+    LOG_INFO("[Channel %s] Connected to %s:%d.\n", ch->name, ch->host, ch->port);
+    return 0;
+}
+
+// Closes the connection and fails every pending request.
+static void channel_drop(ServerChannel* ch) {
+    pthread_mutex_lock(&ch->write_lock); // No sender is using fd once this is held
+    pthread_mutex_lock(&ch->lock);
+    if (ch->fd >= 0) close(ch->fd);
+    ch->fd = -1;
+    atomic_store(&ch->up, false);
+    for (int i = 0; i < CHANNEL_MAX_PENDING; i++) {
+        if (ch->pending[i].state == SLOT_WAITING) ch->pending[i].state = SLOT_DROPPED;
+    }
+    pthread_cond_broadcast(&ch->changed);
+    pthread_mutex_unlock(&ch->lock);
+    pthread_mutex_unlock(&ch->write_lock);
+}
+
+static PendingSlot* find_slot(ServerChannel* ch, uint32_t id) {
+    for (int i = 0; i < CHANNEL_MAX_PENDING; i++) {
+        if (ch->pending[i].state != SLOT_FREE && ch->pending[i].id == id) return &ch->pending[i];
+    }
+    return NULL;
+}
+
+static void release_slot(PendingSlot* slot) {
+    if (slot->state == SLOT_DONE) server_channel_message_free(&slot->msg);
+    slot->state = SLOT_FREE;
+}
+
+static void channel_dispatch(ServerChannel* ch, uint8_t type, uint32_t id, ChannelMessage* msg) {
+    if (type == CHANNEL_MSG_PUSH) {
+        if (ch->on_push) ch->on_push(id, msg, ch->userdata);
+        server_channel_message_free(msg);
+        return;
+    }
+    if (type != CHANNEL_MSG_REPLY && type != CHANNEL_MSG_ERROR) {
+        server_channel_message_free(msg);
+        return;
+    }
+    pthread_mutex_lock(&ch->lock);
+    PendingSlot* slot = find_slot(ch, id);
+    if (slot && slot->state == SLOT_WAITING) {
+        if (type == CHANNEL_MSG_REPLY) {
+            slot->msg = *msg;
+            slot->state = SLOT_DONE;
+            *msg = (ChannelMessage){0};
+        } else {
+            LOG_ERROR("[Channel %s] Request %u failed: %s\n", ch->name, id, msg->meta);
+            slot->state = SLOT_FAILED;
+        }
+        pthread_cond_broadcast(&ch->changed);
+    }
+    pthread_mutex_unlock(&ch->lock);
+    server_channel_message_free(msg); // Cancelled or unknown requests' replies are dropped
+}
+
+static void* channel_reader_thread(void* arg) {
+    ServerChannel* ch = (ServerChannel*)arg;
+    while (!atomic_load(&ch->closing)) {
+        if (!atomic_load(&ch->up) && channel_establish(ch) != 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += CHANNEL_RECONNECT_MS / 1000;
+            deadline.tv_nsec += (long)(CHANNEL_RECONNECT_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&ch->lock);
+            int rc = 0;
+            while (!atomic_load(&ch->closing) && rc != ETIMEDOUT) {
+                rc = pthread_cond_timedwait(&ch->changed, &ch->lock, &deadline);
+            }
+            pthread_mutex_unlock(&ch->lock);
+            continue;
+        }
+
+        // Only this thread reads, and fd only changes here or in close
+        uint8_t type;
+        uint32_t id;
+        ChannelMessage msg;
+        if (read_frame(ch->fd, &type, &id, &msg) != 0) {
+            if (!atomic_load(&ch->closing)) {
+                LOG_WARN("[Channel %s] Connection to %s:%d lost; using HTTP until it is back.\n", ch->name, ch->host,
+                         ch->port);
+            }
+            channel_drop(ch);
+            continue;
+        }
+        channel_dispatch(ch, type, id, &msg);
+    }
+    return NULL;
+}
+
+// Copies the host out of an http:// or https:// URL. Returns 0, or -1.
+static int url_host(const char* url, char* host, size_t size) {
+    const char* start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    size_t len = strcspn(start, ":/");
+    if (len == 0 || len >= size) return -1;
+    memcpy(host, start, len);
+    host[len] = '\0';
+    return 0;
+}
+
+ServerChannel* server_channel_open(const char* name, const char* url, int port, ChannelPushHandler on_push,
+                                   void* userdata) {
+    ServerChannel* ch = calloc(1, sizeof(*ch));
+    if (!ch) return NULL;
+    if (url_host(url, ch->host, sizeof(ch->host)) != 0) {
+        LOG_ERROR("[Channel %s] No host in %s.\n", name, url);
+        free(ch);
+        return NULL;
+    }
+    snprintf(ch->name, sizeof(ch->name), "%s", name);
+    ch->port = port;
+    ch->on_push = on_push;
+    ch->userdata = userdata;
+    ch->fd = -1;
+    atomic_init(&ch->up, false);
+    atomic_init(&ch->closing, false);
+    pthread_mutex_init(&ch->write_lock, NULL);
+    pthread_mutex_init(&ch->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ch->changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (channel_establish(ch) != 0) {
+        LOG_INFO("[Channel %s] No channel at %s:%d; using HTTP, retrying every %d ms.\n", ch->name, ch->host, port,
+                 CHANNEL_RECONNECT_MS);
+    }
+    if (rt_thread_create(&ch->reader, RT_ROLE_BACKGROUND, false, channel_reader_thread, ch) != 0) {
+        LOG_ERROR("[Channel %s] Could not start the reader thread.\n", ch->name);
+        if (ch->fd >= 0) close(ch->fd);
+        pthread_mutex_destroy(&ch->write_lock);
+        pthread_mutex_destroy(&ch->lock);
+        pthread_cond_destroy(&ch->changed);
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+void server_channel_close(ServerChannel* ch) {
+    if (!ch) return;
+    pthread_mutex_lock(&ch->lock);
+    atomic_store(&ch->closing, true);
+    if (ch->fd >= 0) shutdown(ch->fd, SHUT_RDWR); // Wakes the reader out of read()
+    pthread_cond_broadcast(&ch->changed);
+    pthread_mutex_unlock(&ch->lock);
+    pthread_join(ch->reader, NULL);
+
+    channel_drop(ch);
+    for (int i = 0; i < CHANNEL_MAX_PENDING; i++) {
+        if (ch->pending[i].state != SLOT_FREE) release_slot(&ch->pending[i]);
+    }
+    pthread_mutex_destroy(&ch->write_lock);
+    pthread_mutex_destroy(&ch->lock);
+    pthread_cond_destroy(&ch->changed);
+    free(ch);
+}
+
+bool server_channel_available(const ServerChannel* ch) {
+    return ch && atomic_load(&ch->up);
+}
+
+uint32_t server_channel_send(ServerChannel* ch, uint8_t op, const char* meta, size_t meta_len, const void* blob,
+                             size_t blob_len) {
+    if (!server_channel_available(ch) || meta_len > UINT16_MAX ||
+        CHANNEL_HEADER_LEN - 4 + meta_len + blob_len > CHANNEL_MAX_FRAME) {
+        return 0;
+    }
+    // Registered before the frame goes out, so the reply always finds its slot
+    pthread_mutex_lock(&ch->lock);
+    PendingSlot* slot = NULL;
+    for (int i = 0; i < CHANNEL_MAX_PENDING && !slot; i++) {
+        if (ch->pending[i].state == SLOT_FREE) slot = &ch->pending[i];
+    }
+    uint32_t id = 0;
+    if (slot) {
+        if (++ch->next_id == 0) ch->next_id = 1; // 0 is "no request" in a push
+        id = ch->next_id;
+        *slot = (PendingSlot){ .id = id, .state = SLOT_WAITING };
+    }
+    pthread_mutex_unlock(&ch->lock);
+    if (!slot) {
+        LOG_WARN("[Channel %s] %d requests already pending.\n", ch->name, CHANNEL_MAX_PENDING);
+        return 0;
+    }
+
+    pthread_mutex_lock(&ch->write_lock);
+    int rc = ch->fd >= 0 ? write_frame(ch->fd, CHANNEL_MSG_REQUEST, op, id, meta, meta_len, blob, blob_len) : -1;
+    if (rc != 0 && ch->fd >= 0) shutdown(ch->fd, SHUT_RDWR); // The reader notices and reconnects
+    pthread_mutex_unlock(&ch->write_lock);
+    if (rc != 0) {
+        pthread_mutex_lock(&ch->lock);
+        release_slot(slot);
+        pthread_mutex_unlock(&ch->lock);
+        return 0;
+    }
+    return id;
+}
+
+int server_channel_wait_any(ServerChannel* ch, const uint32_t* ids, int count, int timeout_ms, int* which,
+                            ChannelMessage* reply) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&ch->lock);
+    unsigned wakeups = ch->wakeups;
+    int result = -2;
+    for (;;) {
+        bool waiting = false;
+        for (int i = 0; i < count; i++) {
+            PendingSlot* slot = ids[i] ? find_slot(ch, ids[i]) : NULL;
+            if (!slot) continue;
+            if (slot->state == SLOT_WAITING) {
+                waiting = true;
+                continue;
+            }
+            if (slot->state == SLOT_DROPPED) {
+                release_slot(slot);
+                continue;
+            }
+            *which = i;
+            if (slot->state == SLOT_DONE) {
+                *reply = slot->msg;
+                slot->msg = (ChannelMessage){0};
+                result = 0;
+            } else {
+                result = -1;
+            }
+            release_slot(slot);
+            goto out;
+        }
+        if (!waiting) break;
+        if (ch->wakeups != wakeups) {
+            result = -3;
+            break;
+        }
+        if (pthread_cond_timedwait(&ch->changed, &ch->lock, &deadline) == ETIMEDOUT) break;
+    }
+out:
+    pthread_mutex_unlock(&ch->lock);
+    return result;
+}
+
+int server_channel_request(ServerChannel* ch, uint8_t op, const char* meta, size_t meta_len, const void* blob,
+                           size_t blob_len, int timeout_ms, ChannelMessage* reply) {
+    uint32_t id = server_channel_send(ch, op, meta, meta_len, blob, blob_len);
+    if (id == 0) return -2;
+    int which;
+    int rc = server_channel_wait_any(ch, &id, 1, timeout_ms, &which, reply);
+    if (rc == -2 || rc == -3) server_channel_cancel(ch, id);
+    return rc;
+}
+
+void server_channel_wake(ServerChannel* ch) {
+    if (!ch) return;
+    pthread_mutex_lock(&ch->lock);
+    ch->wakeups++;
+    pthread_cond_broadcast(&ch->changed);
+    pthread_mutex_unlock(&ch->lock);
+}
+
+void server_channel_cancel(ServerChannel* ch, uint32_t id) {
+    pthread_mutex_lock(&ch->lock);
+    PendingSlot* slot = find_slot(ch, id);
+    bool was_waiting = slot && slot->state == SLOT_WAITING;
+    if (slot) release_slot(slot);
+    pthread_mutex_unlock(&ch->lock);
+    if (!was_waiting) return;
+
+    pthread_mutex_lock(&ch->write_lock);
+    if (ch->fd >= 0) write_frame(ch->fd, CHANNEL_MSG_CANCEL, CHANNEL_OP_NONE, id, NULL, 0, NULL, 0);
+    pthread_mutex_unlock(&ch->write_lock);
+}
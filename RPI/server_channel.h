@@ -0,0 +1,112 @@
+#ifndef SERVER_CHANNEL_H
+#define SERVER_CHANNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file server_channel.h
+ * @brief Persistent framed TCP channel to a PC server.
+ *
+ * The pathfinding and image servers can listen on a channel port next to their
+ * HTTP one. The controller keeps one connection to each. Request and reply
+ * are then a single frame each way:
+ * - There are no HTTP request headers and no multipart encoding.
+ * - JPEGs travel as raw bytes.
+ * - Several requests can be in flight at once, matched to replies by ID.
+ * - The server can push messages nobody asked for, such as a revised route.
+ *
+ * Every message is one frame, little-endian:
+ *
+ *   u32 length     bytes after this field (8 + meta_len + blob length)
+ *   u8  type       CHANNEL_MSG_*
+ *   u8  op         CHANNEL_OP_*
+ *   u16 meta_len
+ *   u32 id         request ID, echoed in its reply; for a push, the request it concerns (0: none)
+ *   meta           JSON, meta_len bytes
+ *   blob           binary payload, the rest of the frame
+ *
+ * The meta of a request and of its reply is the JSON body the HTTP endpoint
+ * would take and return. On connect the client sends CHANNEL_MSG_HELLO with
+ * {"version":N}. A server that answers with a HELLO of the same version speaks
+ * the channel. Anything else closes the connection.
+ *
+ * A reader thread per channel matches replies to waiting requests and hands
+ * pushes to the channel's handler. A dropped connection fails every pending
+ * request with -2. The reader then reconnects every CHANNEL_RECONNECT_MS.
+ * Callers use HTTP whenever server_channel_available() is false.
+ * fake_channel.py is the Python side; change both together and bump
+ * CHANNEL_VERSION.
+ */
+
+#define CHANNEL_VERSION 1
+#define CHANNEL_MAX_FRAME (1024 * 1024)
+#define CHANNEL_MAX_PENDING 16
+#define CHANNEL_CONNECT_TIMEOUT_MS 1000
+#define CHANNEL_RECONNECT_MS 2000
+
+enum {
+    CHANNEL_MSG_HELLO = 1,
+    CHANNEL_MSG_REQUEST = 2,
+    CHANNEL_MSG_REPLY = 3,
+    CHANNEL_MSG_ERROR = 4,  // Reply whose meta is {"error":"..."}
+    CHANNEL_MSG_CANCEL = 5, // From the client: the reply to id is no longer wanted
+    CHANNEL_MSG_PUSH = 6,
+};
+
+enum {
+    CHANNEL_OP_NONE = 0,
+    CHANNEL_OP_PATH = 1,   // Meta: pathfinding payload; reply: route as from /path
+    CHANNEL_OP_DETECT = 2, // Meta: {"object_id":N}, blob: JPEG; reply: detection as from /detect
+    CHANNEL_OP_ROUTE = 3,  // Push: revised route (as from /path) for path request id
+};
+
+typedef struct ServerChannel ServerChannel;
+
+typedef struct {
+    uint8_t op;
+    char* meta; // NUL-terminated
+    size_t meta_len;
+    const uint8_t* blob;
+    size_t blob_len;
+} ChannelMessage;
+
+// Called on the reader thread for every push. msg is freed once it returns.
+typedef void (*ChannelPushHandler)(uint32_t id, const ChannelMessage* msg, void* userdata);
+
+// Starts a channel to port on the host named in url (an http:// URL of the
+// same server) and makes the first connection attempt. Returns the channel,
+// which keeps trying to connect in the background, or NULL if url has no host
+// or the reader thread could not start.
+ServerChannel* server_channel_open(const char* name, const char* url, int port, ChannelPushHandler on_push,
+                                   void* userdata);
+// Stops the reader and fails anything still pending. ch may be NULL.
+void server_channel_close(ServerChannel* ch);
+// Whether the channel is connected and its server has answered HELLO. ch may be NULL.
+bool server_channel_available(const ServerChannel* ch);
+
+// Sends a request. Returns its ID, or 0 if the channel is down or no pending
+// slot is free.
+uint32_t server_channel_send(ServerChannel* ch, uint8_t op, const char* meta, size_t meta_len, const void* blob,
+                             size_t blob_len);
+// Waits up to timeout_ms for the reply to any of ids[0 .. count). A reply that
+// arrives for one of them sets *which to its index. Returns 0 with *reply filled
+// (free it with server_channel_message_free()), -1 if the server answered with
+// an error, -2 on timeout or a dropped connection, or -3 if server_channel_wake()
+// was called meanwhile. The id returned with 0 or -1, and every id whose
+// connection dropped, is released. After a timeout or a wake the rest stay
+// pending, for another wait or server_channel_cancel().
+int server_channel_wait_any(ServerChannel* ch, const uint32_t* ids, int count, int timeout_ms, int* which,
+                            ChannelMessage* reply);
+// Sends a request and waits for its reply.
+int server_channel_request(ServerChannel* ch, uint8_t op, const char* meta, size_t meta_len, const void* blob,
+                           size_t blob_len, int timeout_ms, ChannelMessage* reply);
+// Makes every wait in progress return -3 at once, so that callers can check
+// whether they still want their replies. ch may be NULL.
+void server_channel_wake(ServerChannel* ch);
+// Releases id's slot and tells the server to drop it. A late reply is discarded.
+void server_channel_cancel(ServerChannel* ch, uint32_t id);
+void server_channel_message_free(ChannelMessage* msg);
+
+#endif // SERVER_CHANNEL_H
@@ -2,9 +2,13 @@
 #define SHARED_TYPES_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "arena.h"
+#include "stm32_protocol.h" // For Stm32Pose
+
 /**
  * @file shared_types.h
  * @brief Defines common data structures and types used across the RPi project.
@@ -15,6 +19,7 @@ typedef enum {
     STATE_IDLE,
     STATE_PATHFINDING,
     STATE_NAVIGATING,
+    STATE_MANUAL, // Running direct "stm" commands from Android
     STATE_ERROR
 } SystemState;
 
@@ -43,28 +48,213 @@ typedef enum {
     CMD_SNAPSHOT
 } CommandType;
 
+// How fast a move or turn is driven. The planner picks it from the clearance
+// along the command; routes carry it as a letter after the value ("FW90F",
+// "FR90S"), none for normal. SPEED_CREEP is never planned: the route optimizer
+// gives it to the short pass through a rolling snapshot's viewing pose, and to
+// that CMD_SNAPSHOT itself to mark it taken on the move.
+typedef enum {
+    SPEED_NORMAL,
+    SPEED_SLOW,
+    SPEED_FAST,
+    SPEED_CREEP
+} SpeedClass;
+
 typedef struct {
     CommandType type;
     int value; // For move commands, this is distance; for turn, this is angle; for snapshot, this is obstacle ID.
+    SpeedClass speed;
 } Command;
 
 #define MAX_OBSTACLES 20
-#define MAX_COMMANDS 100
+
+// A sendArena map, 0-indexed, before it becomes a mission.
+typedef struct {
+    Obstacle obstacles[MAX_OBSTACLES];
+    int obstacle_count;
+    int robot_x;
+    int robot_y;
+    int robot_dir;
+} ArenaMap;
+
+// Growable route arrays. items live in an Arena (normally the mission arena) and
+// are never freed individually.
+typedef struct {
+    Command* items;
+    int count;
+    int capacity;
+} CommandList;
+
+typedef struct {
+    SnapPosition* items;
+    int count;
+    int capacity;
+} SnapList;
+
+// Appends to a list, growing it in arena. Returns 0 on success, -1 if out of memory.
+static inline int command_list_push(Arena* arena, CommandList* list, Command command) {
+    if (list->count == list->capacity) {
+        Command* items = arena_array_grow(arena, list->items, list->count, &list->capacity, list->count + 1, sizeof(Command));
+        if (!items) return -1;
+        list->items = items;
+    }
+    list->items[list->count++] = command;
+    return 0;
+}
+
+static inline int snap_list_push(Arena* arena, SnapList* list, SnapPosition snap) {
+    if (list->count == list->capacity) {
+        SnapPosition* items = arena_array_grow(arena, list->items, list->count, &list->capacity, list->count + 1, sizeof(SnapPosition));
+        if (!items) return -1;
+        list->items = items;
+    }
+    list->items[list->count++] = snap;
+    return 0;
+}
+
 // An array to map integer directions to string representations for Android.
 extern const char* DIR_MAP_ANDROID_STR[8];
 
 // --- Threading and Shared State Management ---
 
-#define MAX_SNAP_POSITIONS 100
+#define IMAGE_TASK_QUEUE_SIZE 8
+#define SNAPSHOT_GROUP_MAX 3 // Obstacles one frame may answer (a shared viewing position)
+
+// Another obstacle in the frame of a snapshot.
+typedef struct {
+    int obstacle_id;
+    bool has_obstacle;
+    Obstacle obstacle;
+    uint32_t ticket; // Its own snapshot ticket
+} SnapshotTarget;
+
+// A single snapshot job handed from the nav thread to the image worker pool.
+typedef struct {
+    int obstacle_id;
+    uint32_t ticket; // SharedAppContext::snapshot_tickets entry its capture and answer go to
+    SnapPosition robot_snap_position; // Robot's position at the time of snapshot
+    bool has_obstacle; // obstacle holds the target's cell, used to crop the frame
+    Obstacle obstacle;
+    unsigned mission_epoch; // SharedAppContext::mission_epoch when queued; any STOP since cancels the task
+    int shared_count; // More obstacles the same frame answers (back-to-back SPs at one pose)
+    SnapshotTarget shared[SNAPSHOT_GROUP_MAX - 1];
+    uint64_t pass_ns; // Rolling snapshot: when the robot passed the viewing pose; 0 for one taken at rest
+    uint64_t rest_ns; // When the robot came to rest, for frames from the ring (USE_FRAME_RING); 0: shoot fresh ones
+} ImageTask;
+
+// Bounded FIFO of pending snapshot jobs. Protected by its own mutex so the
+// nav thread never blocks on the main context lock while enqueueing.
+typedef struct {
+    ImageTask tasks[IMAGE_TASK_QUEUE_SIZE];
+    int head;  // Index of the oldest task
+    int count; // Number of queued tasks
+    int batch_holder; // Worker holding its upload for the next snapshot (IMAGE_BATCH_HOLD_MS), -1 if none
+    bool shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ImageTaskQueue;
+
+// Per-command completion state reported by the STM32.
+#define STM32_ACK_TABLE_SIZE 64 // Must exceed the nav thread's in-flight window
+#define STM32_ACK_PENDING 0
+#define STM32_ACK_DONE 1
+#define STM32_ACK_ERROR -1
+#define STM32_ACK_ACCEPTED 2 // !id/OK seen; only carried on the event ring
+#define STM32_ACK_SETTLED 3  // !id/SETTLED seen after DONE: chassis at rest; only carried on the event ring
+#define STM32_ACK_RESET 4    // !id/RESET seen: the firmware rebooted and lost its queue; only carried on the event ring
+#define STM32_ACK_PROGRESS 5 // !id/PROGRESS seen: cmd_id is under way; only carried on the event ring
+#define STM32_ACK_CREDIT 6   // !id/CREDIT seen: cmd_id started, the firmware has room up to remaining; event ring only
+
+typedef struct {
+    uint32_t cmd_id; // ID that last completed in this slot
+    int8_t status;   // STM32_ACK_DONE or STM32_ACK_ERROR
+    bool settled;    // SETTLED arrived for cmd_id
+    uint64_t done_ns; // When the reactor received the completion (CLOCK_MONOTONIC)
+} Stm32AckSlot;
+
+// Size used to keep fields written by different threads on separate cache lines.
+#define CACHE_LINE_SIZE 64
+
+// One STM32 reply as seen by the I/O reactor, stamped on receipt.
+typedef struct {
+    uint32_t cmd_id;
+    int8_t status;  // STM32_ACK_ACCEPTED, STM32_ACK_DONE, STM32_ACK_ERROR, STM32_ACK_SETTLED, STM32_ACK_RESET,
+                    // STM32_ACK_PROGRESS or STM32_ACK_CREDIT
+    bool has_pose;  // The reply carried the firmware's odometry
+    int32_t remaining; // STM32_ACK_RESET: cm or degrees of cmd_id left; STM32_ACK_PROGRESS: ms left; -1 unknown;
+                       // STM32_ACK_CREDIT: the highest command ID the firmware has queue room for
+    uint64_t rx_ns; // CLOCK_MONOTONIC receive time
+    Stm32Pose pose;
+} Stm32Event;
+
+// Single-producer/single-consumer ring of STM32 replies, pushed by the I/O
+// reactor and drained by the nav thread. head and tail each sit on their own
+// cache line so neither side writes a line the other is polling.
+#define STM32_EVENT_RING_SIZE 64 // Must be a power of two
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head; // Next slot to write (producer only)
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail; // Next slot to read (consumer only)
+    _Alignas(CACHE_LINE_SIZE) Stm32Event slots[STM32_EVENT_RING_SIZE];
+} Stm32EventRing;
+
+// What became of a mission's snapshot of one obstacle (multithread_communication.c).
+typedef enum {
+    SNAPSHOT_PENDING,   // Captured, no answer yet
+    SNAPSHOT_DETECTED,
+    SNAPSHOT_FAILED,    // No image, or the bullseye: to be retried from another face
+    SNAPSHOT_REROUTED,  // The route now visits another face
+    SNAPSHOT_GIVEN_UP   // No face left to try
+} SnapshotStatus;
+
+typedef struct {
+    int obstacle_id;
+    SnapshotStatus status;
+    int face;             // Face (0/2/4/6) the latest snapshot is or will be taken from
+    unsigned faces_tried; // Bit face / 2 of each face photographed
+    uint32_t ticket;      // The latest snapshot's ticket; only its answer sets status
+} SnapshotOutcome;
+
+// One snapshot from the moment the nav thread queues it to its answer. The
+// capture confirmation and the answer carry the ticket and are joined to it,
+// not to the obstacle, so workers may finish in any order, late or retried,
+// and each result still lands on the snapshot it belongs to.
+#define SNAPSHOT_TICKETS 32 // Must exceed the snapshots outstanding at once
+
+typedef enum {
+    TICKET_QUEUED,         // Waiting for a worker's capture
+    TICKET_CAPTURED,       // Frames taken; the answer is to come
+    TICKET_CAPTURE_FAILED, // No frames; no answer will come
+    TICKET_ANSWERED
+} SnapshotTicketState;
+
+typedef struct {
+    uint32_t ticket; // 0: slot never used
+    int obstacle_id;
+    SnapPosition pose; // Where the robot takes it, {-1, -1, -1} if unknown
+    unsigned mission_epoch;
+    uint64_t queued_ns;
+    uint64_t captured_ns; // 0 until captured
+    SnapshotTicketState state;
+} SnapshotTicket;
+
+// A direct "stm" command from Android, waiting for the nav thread.
+#define MANUAL_QUEUE_SIZE 16
+typedef struct {
+    unsigned seq;  // Numbers the command's result for Android
+    Command cmd;
+    char text[24]; // As Android sent it
+} ManualCommand;
 
 // A structure to hold all application state that is shared between threads.
-// Access to this struct MUST be protected by the mutex.
+// Mission data is handed from the reactor to the nav thread under `lock`; once
+// navigation starts, the nav thread owns it. Everything the command loop touches
+// per command is atomic or a lock-free channel.
 typedef struct {
     pthread_mutex_t lock;
-    SystemState state;
 
-    // Flags for cross-thread communication
-    bool stop_requested;
+    // Set with `lock` held when a new map is ready.
     bool new_map_received;
 
     // Condition variable to signal the navigation thread that a new task is ready.
@@ -76,33 +266,84 @@ typedef struct {
     int robot_start_x;
     int robot_start_y;
     int robot_start_dir; // Initial robot direction for pathfinding
-    Command commands[MAX_COMMANDS];
-    int command_count;
-    SnapPosition snap_positions[MAX_SNAP_POSITIONS]; // To store robot positions at snapshot events
-    int snap_position_count; // Number of valid snap positions
-    int snap_position_idx;
+    CommandList commands;
+    SnapList snap_positions; // Robot positions at snapshot events
+    int snap_position_idx;   // Nav thread only
+
+    // A sendArena that arrived mid-mission, set with `lock` held. The nav thread
+    // replans the rest of the run from it at the next snapshot, or runs it once
+    // the mission ends. A newer one replaces it; a STOP drops it.
+    ArenaMap queued_map;
+    bool map_update_queued;
+
+    // One entry per obstacle photographed this mission, under `lock`. The nav
+    // thread adds it when it queues the snapshot; an image worker fills in the
+    // answer and wakes the nav thread.
+    SnapshotOutcome snapshot_outcomes[MAX_OBSTACLES];
+    int snapshot_outcome_count;
+
+    // Every snapshot's ticket, indexed by ticket % SNAPSHOT_TICKETS, under
+    // `lock`. The nav thread issues tickets (next_snapshot_ticket is its own);
+    // the image workers record the capture and the answer.
+    SnapshotTicket snapshot_tickets[SNAPSHOT_TICKETS];
+    uint32_t next_snapshot_ticket;
+
+    // Direct "stm" commands, oldest first, under `lock`. The reactor queues them
+    // while no mission runs; the nav thread sends them and reports each result.
+    ManualCommand manual_queue[MANUAL_QUEUE_SIZE];
+    int manual_head, manual_count;
+    unsigned manual_seq; // seq of the last command queued
+
+    // Backs the payload, server response and route arrays of the current mission.
+    // Reset by the nav thread when a mission starts. While a route is streaming
+    // only the route stream thread allocates from it.
+    Arena mission_arena;
 
     // File descriptors needed by multiple threads
     int android_fd;
     int stm32_fd;
 
-    // STM32 ACK synchronization
-    volatile uint32_t stm32_last_ack_id;
-    pthread_mutex_t stm32_ack_mutex;
-    pthread_cond_t stm32_ack_cond;
+    // eventfd used to wake the I/O reactor from other threads
+    int reactor_wakeup_fd;
+    // eventfd the nav thread blocks on; written after any change it may be waiting for
+    int nav_wakeup_fd;
+    // Nav-side deadline timer (timerfd) serviced by the I/O reactor
+    int deadline_timer_fd;
 
-    // Image capture synchronization
-    volatile uint32_t last_image_capture_id;
-    pthread_mutex_t image_capture_mutex;
-    pthread_cond_t image_capture_cond;
+    // Per-command completion table, indexed by cmd_id % STM32_ACK_TABLE_SIZE.
+    // Owned by the nav thread, which fills it from stm32_events.
+    Stm32AckSlot stm32_ack_table[STM32_ACK_TABLE_SIZE];
+    // Set once the firmware has sent any SETTLED event; older firmware never does.
+    bool stm32_reports_settled;
 
-} SharedAppContext;
+    // Work queue feeding the persistent image worker threads
+    ImageTaskQueue image_queue;
 
-// --- Thread-specific arguments ---
-typedef struct {
-    SharedAppContext* context; // Pointer to the shared context
-    int obstacle_id;
-    SnapPosition robot_snap_position; // Robot's position at the time of snapshot
-} ImageTaskArgs;
+    // --- Written by the nav thread ---
+    _Alignas(CACHE_LINE_SIZE) _Atomic(SystemState) state;
+    atomic_bool route_stream_cancel; // Asks the route stream thread to drop the transfer
+
+    // --- Written by the route stream thread ---
+    // The route as execute_navigation() reads it. Entries below the counts are
+    // final. A list that grows moves to new arena storage, so the items pointer is
+    // stored before the count and both with release order.
+    _Alignas(CACHE_LINE_SIZE) _Atomic(Command*) route_command_items;
+    _Atomic(SnapPosition*) route_snap_items;
+    atomic_int route_commands_published;
+    atomic_int route_snaps_published;
+    atomic_bool route_complete; // No more commands will be published
+    atomic_bool route_failed;   // The stream ended before the server said "done"
+
+    // --- Written by the I/O reactor ---
+    _Alignas(CACHE_LINE_SIZE) atomic_bool stop_requested;
+    atomic_uint mission_epoch; // Bumped by every STOP; work tagged with an older epoch is abandoned
+    atomic_bool deadline_expired;
+    atomic_bool reactor_shutdown;
+    atomic_uint stm32_last_ack_id; // Most recent DONE, for single-command callers
+
+    // STM32 replies, reactor -> nav
+    Stm32EventRing stm32_events;
+
+} SharedAppContext;
 
 #endif // SHARED_TYPES_H
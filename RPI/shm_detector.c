@@ -0,0 +1,162 @@
+#include "shm_detector.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+#include "metrics.h"
+
+_Static_assert((SHM_DETECTOR_SLOTS & (SHM_DETECTOR_SLOTS - 1)) == 0, "SHM_DETECTOR_SLOTS must be a power of two");
+_Static_assert(sizeof(atomic_uint) == sizeof(uint32_t), "futex words are 32 bits");
+
+static ShmDetectorRegion* g_region;
+static size_t g_region_size;
+// Cleared when the detector stops answering, so later bursts go straight to HTTP
+static atomic_bool g_available;
+
+// The region is shared between processes, so the futexes cannot be private.
+static int futex_wait(atomic_uint* word, unsigned expected, int timeout_ms) {
+    struct timespec ts = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+    return (int)syscall(SYS_futex, (unsigned*)word, FUTEX_WAIT, expected, &ts, NULL, 0);
+}
+
+static void futex_wake(atomic_uint* word, int waiters) {
+    syscall(SYS_futex, (unsigned*)word, FUTEX_WAKE, waiters, NULL, NULL, 0);
+}
+
+int shm_detector_open(const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        LOG_INFO("[ShmDetector] No detector at %s (%s).\n", name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmDetectorRegion)) {
+        LOG_ERROR("[ShmDetector] %s is %lld bytes; this build expects %zu.\n", name,
+                  (long long)st.st_size, sizeof(ShmDetectorRegion));
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, sizeof(ShmDetectorRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the region
+    if (map == MAP_FAILED) {
+        LOG_ERROR("[ShmDetector] mmap of %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    ShmDetectorRegion* region = (ShmDetectorRegion*)map;
+    // The detector writes magic last, once the rest of the header is in place
+    if (__atomic_load_n(&region->magic, __ATOMIC_ACQUIRE) != SHM_DETECTOR_MAGIC ||
+        region->version != SHM_DETECTOR_VERSION || region->lanes != SHM_DETECTOR_LANES ||
+        region->slots != SHM_DETECTOR_SLOTS || region->frame_max != SHM_DETECTOR_FRAME_MAX ||
+        region->result_size != sizeof(ShmResult)) {
+        LOG_ERROR("[ShmDetector] %s has a different layout (version %u); not using it.\n", name, region->version);
+        munmap(map, sizeof(ShmDetectorRegion));
+        return -1;
+    }
+
+    g_region = region;
+    g_region_size = sizeof(ShmDetectorRegion);
+    atomic_store(&g_available, true);
+    LOG_INFO("[ShmDetector] Attached to %s (%d lanes of %d slots).\n", name, SHM_DETECTOR_LANES, SHM_DETECTOR_SLOTS);
+    return 0;
+}
+
+void shm_detector_close(void) {
+    atomic_store(&g_available, false);
+    if (g_region) munmap(g_region, g_region_size);
+    g_region = NULL;
+}
+
+bool shm_detector_available(void) {
+    return atomic_load_explicit(&g_available, memory_order_relaxed);
+}
+
+// Keeps result in *best if it is recognised and beats the best so far.
+static bool take_result(const ShmResult* result, bool found, ShmResult* best) {
+    if (result->img_id < 0) return false;
+    if (found && result->confidence <= best->confidence) return false;
+    *best = *result;
+    best->class_label[SHM_DETECTOR_LABEL_MAX - 1] = '\0';
+    return true;
+}
+
+int shm_detect_burst(int lane_index, int obstacle_id, const struct MemoryStruct* frames, int count,
+                     double threshold, ShmResult* best) {
+    if (!shm_detector_available() || lane_index < 0 || lane_index >= SHM_DETECTOR_LANES) return -2;
+    ShmLane* lane = &g_region->lane[lane_index];
+
+    // Drop replies still waiting from an earlier burst that stopped early; any
+    // that arrive later are told apart by their request_id
+    unsigned res_head = atomic_load_explicit(&lane->res_head, memory_order_acquire);
+    unsigned res_tail = res_head;
+    atomic_store_explicit(&lane->res_tail, res_tail, memory_order_release);
+
+    // Requests are numbered by their ring index, so first .. first + sent are this burst's
+    unsigned head = atomic_load_explicit(&lane->req_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&lane->req_tail, memory_order_acquire);
+    unsigned first = head;
+    int sent = 0;
+    for (int i = 0; i < count; i++) {
+        if (frames[i].size == 0 || frames[i].size > SHM_DETECTOR_FRAME_MAX) {
+            LOG_ERROR("[ShmDetector] Frame of %zu bytes does not fit a slot; skipped.\n", frames[i].size);
+            continue;
+        }
+        if (head - tail >= SHM_DETECTOR_SLOTS) break; // Detector still busy with an old burst
+        ShmRequest* request = &lane->requests[head % SHM_DETECTOR_SLOTS];
+        request->request_id = head;
+        request->obstacle_id = obstacle_id;
+        request->frame_len = (uint32_t)frames[i].size;
+        memcpy(request->frame, frames[i].memory, frames[i].size);
+        head++;
+        sent++;
+    }
+    if (sent == 0) return -2;
+    uint64_t started_ns = latency_now_ns();
+    atomic_store_explicit(&lane->req_head, head, memory_order_release);
+    atomic_fetch_add_explicit(&g_region->doorbell, 1, memory_order_release);
+    futex_wake(&g_region->doorbell, 1);
+
+    bool found = false;
+    bool confident = false;
+    int received = 0;
+    uint64_t deadline_ns = started_ns + (uint64_t)SHM_DETECTOR_TIMEOUT_MS * 1000000ULL;
+    while (received < sent && !confident) {
+        res_head = atomic_load_explicit(&lane->res_head, memory_order_acquire);
+        while (res_tail != res_head && !confident) {
+            const ShmResult* result = &lane->results[res_tail % SHM_DETECTOR_SLOTS];
+            if (result->request_id - first < (unsigned)sent) {
+                received++;
+                metric_observe_since(METRIC_HIST_IMAGE_SHM_US, started_ns);
+                if (take_result(result, found, best)) {
+                    found = true;
+                    confident = best->confidence >= threshold;
+                }
+            }
+            res_tail++;
+            atomic_store_explicit(&lane->res_tail, res_tail, memory_order_release);
+        }
+        if (received == sent || confident) break;
+
+        uint64_t now_ns = latency_now_ns();
+        if (now_ns >= deadline_ns) {
+            LOG_ERROR("[ShmDetector] Detector answered %d of %d frames within %d ms; using HTTP from now on.\n",
+                      received, sent, SHM_DETECTOR_TIMEOUT_MS);
+            atomic_store(&g_available, false);
+            return found ? 0 : -2;
+        }
+        int wait_ms = (int)((deadline_ns - now_ns + 999999) / 1000000);
+        futex_wait(&lane->res_head, res_head, wait_ms);
+    }
+    // Whatever the detector still sends for this burst is skipped by the next one
+    return found ? 0 : -1;
+}
@@ -0,0 +1,91 @@
+#ifndef SHM_DETECTOR_H
+#define SHM_DETECTOR_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rpi_hal.h" // For struct MemoryStruct
+
+/**
+ * @file shm_detector.h
+ * @brief Shared-memory transport to an image detector on the same machine.
+ *
+ * A detector process running next to the controller (shm_detector.py) creates
+ * a POSIX shared-memory region, and shm_detector_open() maps it. Snapshots then
+ * skip the multipart HTTP upload and the reply JSON:
+ * - Each image worker owns one lane: a ring of request slots it writes JPEGs
+ *   into, and a ring of result slots the detector fills in.
+ * - Both rings are single-producer/single-consumer, so neither side takes a
+ *   lock.
+ * - A worker publishes a request, bumps the region's doorbell and wakes the
+ *   detector with a futex on it. The detector publishes a result and wakes the
+ *   worker with a futex on the lane's res_head.
+ * - Capture-to-result latency is then the inference time plus two wakeups.
+ *
+ * Indices count up forever; slot i is i % SHM_DETECTOR_SLOTS. Both processes
+ * share the machine, so all fields are native-endian. shm_detector.py mirrors
+ * this layout; change both together and bump SHM_DETECTOR_VERSION.
+ */
+
+#define SHM_DETECTOR_NAME "/mdp_detector"
+#define SHM_DETECTOR_MAGIC 0x5244504Du // "MPDR"
+#define SHM_DETECTOR_VERSION 1
+#define SHM_DETECTOR_LANES 4          // At least IMAGE_WORKER_COUNT
+#define SHM_DETECTOR_SLOTS 4          // Per lane, a power of two, at least IMAGE_BURST_FRAMES
+#define SHM_DETECTOR_FRAME_MAX (256 * 1024)
+#define SHM_DETECTOR_LABEL_MAX 48
+// A burst whose replies take longer than this goes over HTTP instead
+#define SHM_DETECTOR_TIMEOUT_MS 5000
+
+typedef struct {
+    uint32_t request_id; // Lane-local, echoed in the result
+    int32_t obstacle_id;
+    uint32_t frame_len;
+    uint32_t reserved;
+    uint8_t frame[SHM_DETECTOR_FRAME_MAX]; // JPEG
+} ShmRequest;
+
+typedef struct {
+    uint32_t request_id;
+    int32_t img_id;                           // -1 if nothing was recognised
+    float confidence;
+    uint32_t has_bbox;
+    float bbox[4];                            // x1, y1, x2, y2 in frame pixels
+    char class_label[SHM_DETECTOR_LABEL_MAX]; // NUL-terminated
+} ShmResult;
+
+typedef struct {
+    _Alignas(64) atomic_uint req_head; // Written by the worker
+    _Alignas(64) atomic_uint req_tail; // Written by the detector
+    _Alignas(64) atomic_uint res_head; // Written by the detector; the worker's futex
+    _Alignas(64) atomic_uint res_tail; // Written by the worker
+    ShmRequest requests[SHM_DETECTOR_SLOTS];
+    ShmResult results[SHM_DETECTOR_SLOTS];
+} ShmLane;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t lanes;
+    uint32_t slots;
+    uint32_t frame_max;
+    uint32_t result_size;
+    _Alignas(64) atomic_uint doorbell; // Bumped on every request; the detector's futex
+    _Alignas(64) ShmLane lane[SHM_DETECTOR_LANES];
+} ShmDetectorRegion;
+
+// Maps the region the detector created under name. Returns 0, or -1 if there
+// is no detector or its layout does not match this build.
+int shm_detector_open(const char* name);
+void shm_detector_close(void);
+bool shm_detector_available(void);
+
+// Sends frames[0 .. count) down lane and collects the replies as they arrive.
+// The first with confidence >= threshold ends the wait; otherwise the most
+// confident recognised one is kept. Returns 0 with *best filled, -1 if no frame
+// was recognised, or -2 if the detector did not answer in time (use HTTP).
+int shm_detect_burst(int lane, int obstacle_id, const struct MemoryStruct* frames, int count,
+                     double threshold, ShmResult* best);
+
+#endif // SHM_DETECTOR_H
@@ -0,0 +1,154 @@
+"""Detector side of the shared-memory image transport (shm_detector.h).
+
+Creates the region the controller attaches to at startup, then answers every
+burst the image workers write into it. The default detector returns the same
+fake result as fake_image_server.py; pass a real model in through
+ShmDetectorServer(detect=...) to use this on the robot:
+
+    python3 shm_detector.py [--name /mdp_detector] [--delay SECONDS]
+
+Start it before the controller. The layout below must match shm_detector.h.
+"""
+import argparse
+import ctypes
+import ctypes.util
+import mmap
+import os
+import platform
+import struct
+import time
+
+SHM_DETECTOR_NAME = "/mdp_detector"
+SHM_DETECTOR_MAGIC = 0x5244504D
+SHM_DETECTOR_VERSION = 1
+LANES = 4
+SLOTS = 4
+FRAME_MAX = 256 * 1024
+LABEL_MAX = 48
+
+# Header: magic, version, lanes, slots, frame_max, result_size; doorbell on its own line
+DOORBELL_OFFSET = 64
+LANE_OFFSET = 128
+# Lane: req_head, req_tail, res_head, res_tail each on its own line, then the rings
+REQ_HEAD, REQ_TAIL, RES_HEAD, RES_TAIL = 0, 64, 128, 192
+REQUEST_HEADER = struct.Struct("=IiII")  # request_id, obstacle_id, frame_len, reserved
+REQUEST_SIZE = REQUEST_HEADER.size + FRAME_MAX
+RESULT = struct.Struct(f"=IifI4f{LABEL_MAX}s")  # request_id, img_id, confidence, has_bbox, bbox, label
+REQUESTS_OFFSET = RES_TAIL + 4
+RESULTS_OFFSET = REQUESTS_OFFSET + SLOTS * REQUEST_SIZE
+LANE_SIZE = (RESULTS_OFFSET + SLOTS * RESULT.size + 63) // 64 * 64
+REGION_SIZE = LANE_OFFSET + LANES * LANE_SIZE
+
+# The controller reads and writes the indices with C11 atomics; libatomic gives
+# the same acquire/release ordering from here.
+ATOMIC_ACQUIRE, ATOMIC_RELEASE = 2, 3
+FUTEX_WAIT, FUTEX_WAKE = 0, 1  # Not FUTEX_PRIVATE_FLAG: the words are shared between processes
+SYS_FUTEX = {"x86_64": 202, "aarch64": 98, "armv7l": 240, "armv6l": 240, "i686": 240}[platform.machine()]
+
+
+class Timespec(ctypes.Structure):
+    _fields_ = [("tv_sec", ctypes.c_long), ("tv_nsec", ctypes.c_long)]
+
+
+def fake_detect(obstacle_id, jpeg):
+    """Returns (img_id, confidence, class_label, bbox or None) for one frame."""
+    return obstacle_id + 10, 0.95, f"test_object_{obstacle_id}", (10.0, 20.0, 30.0, 40.0)
+
+
+class ShmDetectorServer:
+    def __init__(self, name=SHM_DETECTOR_NAME, detect=fake_detect, delay=0.0):
+        self.name = name
+        self.detect = detect
+        self.delay = delay
+        self.libc = ctypes.CDLL(ctypes.util.find_library("c"), use_errno=True)
+        libatomic = ctypes.CDLL(ctypes.util.find_library("atomic") or "libatomic.so.1")
+        # getattr, as a double-underscore name written in a class body would be mangled
+        self.atomic_load = getattr(libatomic, "__atomic_load_4")
+        self.atomic_load.restype = ctypes.c_uint32
+        self.atomic_load.argtypes = [ctypes.c_void_p, ctypes.c_int]
+        self.atomic_store = getattr(libatomic, "__atomic_store_4")
+        self.atomic_store.argtypes = [ctypes.c_void_p, ctypes.c_uint32, ctypes.c_int]
+
+        self.path = "/dev/shm" + name
+        if os.path.exists(self.path):
+            os.unlink(self.path)  # Left by a detector that did not exit cleanly
+        fd = os.open(self.path, os.O_CREAT | os.O_EXCL | os.O_RDWR, 0o600)
+        try:
+            os.ftruncate(fd, REGION_SIZE)
+            self.mem = mmap.mmap(fd, REGION_SIZE, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+        finally:
+            os.close(fd)
+        self.anchor = ctypes.c_char.from_buffer(self.mem)  # Pins the mapping while its address is in use
+        self.base = ctypes.addressof(self.anchor)
+        struct.pack_into("=IIIII", self.mem, 4, SHM_DETECTOR_VERSION, LANES, SLOTS, FRAME_MAX, RESULT.size)
+        self.store(0, SHM_DETECTOR_MAGIC)  # Last, so the controller never sees half a header
+
+    def load(self, offset):
+        return self.atomic_load(self.base + offset, ATOMIC_ACQUIRE)
+
+    def store(self, offset, value):
+        self.atomic_store(self.base + offset, value & 0xFFFFFFFF, ATOMIC_RELEASE)
+
+    def futex_wait(self, offset, expected, timeout):
+        ts = Timespec(int(timeout), int((timeout % 1) * 1e9))
+        self.libc.syscall(SYS_FUTEX, ctypes.c_void_p(self.base + offset), FUTEX_WAIT,
+                          ctypes.c_uint32(expected), ctypes.byref(ts), None, 0)
+
+    def futex_wake(self, offset):
+        self.libc.syscall(SYS_FUTEX, ctypes.c_void_p(self.base + offset), FUTEX_WAKE, 0x7FFFFFFF, None, None, 0)
+
+    def serve_lane(self, lane):
+        """Answers every request waiting on lane; returns how many there were."""
+        base = LANE_OFFSET + lane * LANE_SIZE
+        tail = self.load(base + REQ_TAIL)
+        head = self.load(base + REQ_HEAD)
+        served = 0
+        while tail != head:
+            request = base + REQUESTS_OFFSET + (tail % SLOTS) * REQUEST_SIZE
+            request_id, obstacle_id, frame_len, _ = REQUEST_HEADER.unpack_from(self.mem, request)
+            frame_start = request + REQUEST_HEADER.size
+            jpeg = bytes(self.mem[frame_start:frame_start + min(frame_len, FRAME_MAX)])
+            print(f"[Shm Detector] Lane {lane}: frame {request_id} for obstacle {obstacle_id} ({frame_len} bytes)")
+            if self.delay:
+                time.sleep(self.delay)
+            img_id, confidence, label, bbox = self.detect(obstacle_id, jpeg)
+
+            # The worker consumes results as they come, so the ring is only full briefly
+            res_head = self.load(base + RES_HEAD)
+            while (res_head - self.load(base + RES_TAIL)) & 0xFFFFFFFF >= SLOTS:
+                time.sleep(0.001)
+            RESULT.pack_into(self.mem, base + RESULTS_OFFSET + (res_head % SLOTS) * RESULT.size,
+                             request_id, img_id, confidence, bbox is not None, *(bbox or (0.0,) * 4),
+                             label.encode("utf-8")[:LABEL_MAX - 1])
+            self.store(base + RES_HEAD, res_head + 1)
+            self.futex_wake(base + RES_HEAD)
+            tail = (tail + 1) & 0xFFFFFFFF
+            self.store(base + REQ_TAIL, tail)
+            served += 1
+        return served
+
+    def serve_forever(self):
+        print(f"Shared-memory detector serving {self.name} ({REGION_SIZE} bytes) ...")
+        while True:
+            doorbell = self.load(DOORBELL_OFFSET)
+            if sum(self.serve_lane(lane) for lane in range(LANES)) == 0:
+                self.futex_wait(DOORBELL_OFFSET, doorbell, 1.0)
+
+    def close(self):
+        del self.anchor
+        self.mem.close()
+        os.unlink(self.path)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--name", default=SHM_DETECTOR_NAME)
+    parser.add_argument("--delay", type=float, default=0.0, help="Seconds to spend on each frame")
+    args = parser.parse_args()
+    server = ShmDetectorServer(args.name, delay=args.delay)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
@@ -0,0 +1,193 @@
+#include "soc_monitor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+#define SOC_TEMP_PATH "/sys/class/thermal/thermal_zone0/temp"
+#define SOC_FREQ_PATH "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq"
+#define SOC_THROTTLED_PATH "/sys/devices/platform/soc/soc:firmware/get_throttled"
+#define SOC_GOVERNOR_FMT "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor"
+#define SOC_MAX_CPUS 8
+#define SOC_GOVERNOR_LEN 32
+
+typedef struct {
+    const char* path;
+    const char* what;
+    int base; // strtol base of what the file holds
+    int fd;   // -1 once missing
+} SocSource;
+
+static SocSource g_sources[3] = {
+    { SOC_TEMP_PATH, "SoC temperature", 10, -1 },
+    { SOC_FREQ_PATH, "CPU clock", 10, -1 },
+    { SOC_THROTTLED_PATH, "throttle flags", 16, -1 },
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static SocWindow g_window;
+static int32_t g_last_throttled = -1; // To log the flags as they change
+
+static struct {
+    pthread_mutex_t lock;
+    bool pinned;
+    char saved[SOC_MAX_CPUS][SOC_GOVERNOR_LEN]; // "" for a CPU left alone
+    bool warned;
+} g_governor = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char* const THROTTLE_NAMES[] = { "under-voltage", "clock capped", "throttled", "soft temperature limit" };
+
+void soc_monitor_init(void) {
+    for (size_t i = 0; i < sizeof(g_sources) / sizeof(g_sources[0]); i++) {
+        g_sources[i].fd = open(g_sources[i].path, O_RDONLY | O_CLOEXEC);
+        if (g_sources[i].fd < 0) {
+            LOG_WARN("[SoC] No %s (%s: %s); not monitored.\n", g_sources[i].what, g_sources[i].path, strerror(errno));
+        }
+    }
+    soc_window_begin();
+}
+
+// The number src holds, or -1. sysfs attributes are read again from offset 0.
+static int32_t read_source(SocSource* src) {
+    if (src->fd < 0) return -1;
+    char text[32];
+    ssize_t n = pread(src->fd, text, sizeof(text) - 1, 0);
+    if (n <= 0) return -1;
+    text[n] = '\0';
+    char* end;
+    long value = strtol(text, &end, src->base);
+    return end == text || value < 0 ? -1 : (int32_t)value;
+}
+
+static void log_throttle_change(int32_t was, const SocSample* s) {
+    unsigned now = (unsigned)s->throttled & SOC_THROTTLE_NOW_MASK;
+    unsigned before = was < 0 ? 0u : (unsigned)was & SOC_THROTTLE_NOW_MASK;
+    for (int bit = 0; bit < 4; bit++) {
+        unsigned flag = 1u << bit;
+        if ((now ^ before) & flag) {
+            if (now & flag) {
+                LOG_WARN("[SoC] %s at %.1f C, CPU at %d MHz.\n", THROTTLE_NAMES[bit], s->temp_mc / 1000.0,
+                         s->freq_khz / 1000);
+            } else {
+                LOG_INFO("[SoC] %s cleared at %.1f C, CPU at %d MHz.\n", THROTTLE_NAMES[bit], s->temp_mc / 1000.0,
+                         s->freq_khz / 1000);
+            }
+        }
+    }
+    if (was < 0 && SOC_THROTTLE_SINCE_BOOT(s->throttled)) {
+        LOG_WARN("[SoC] Throttled since boot (flags 0x%x); latencies from then are suspect.\n", (unsigned)s->throttled);
+    }
+}
+
+void soc_monitor_sample(SocSample* out) {
+    SocSample s = {
+        read_source(&g_sources[0]),
+        read_source(&g_sources[1]),
+        read_source(&g_sources[2]),
+    };
+    metric_gauge_set(METRIC_GAUGE_SOC_TEMP_MC, s.temp_mc);
+    metric_gauge_set(METRIC_GAUGE_CPU_FREQ_KHZ, s.freq_khz);
+    metric_gauge_set(METRIC_GAUGE_SOC_THROTTLED, s.throttled);
+
+    pthread_mutex_lock(&g_lock);
+    g_window.samples++;
+    if (s.temp_mc > g_window.temp_max_mc) g_window.temp_max_mc = s.temp_mc;
+    if (s.freq_khz >= 0 && (g_window.freq_min_khz < 0 || s.freq_khz < g_window.freq_min_khz)) {
+        g_window.freq_min_khz = s.freq_khz;
+    }
+    if (s.throttled >= 0) g_window.throttled |= (uint32_t)s.throttled & SOC_THROTTLE_NOW_MASK;
+    int32_t was = g_last_throttled;
+    if (s.throttled >= 0) g_last_throttled = s.throttled;
+    pthread_mutex_unlock(&g_lock);
+
+    if (s.throttled >= 0 && (was < 0 || ((was ^ s.throttled) & SOC_THROTTLE_NOW_MASK))) log_throttle_change(was, &s);
+    if (out) *out = s;
+}
+
+void soc_window_begin(void) {
+    pthread_mutex_lock(&g_lock);
+    g_window = (SocWindow){ 0, -1, -1, 0 };
+    pthread_mutex_unlock(&g_lock);
+}
+
+void soc_window_get(SocWindow* out) {
+    pthread_mutex_lock(&g_lock);
+    *out = g_window;
+    pthread_mutex_unlock(&g_lock);
+}
+
+static int read_governor(int cpu, char* out, size_t size) {
+    char path[96];
+    snprintf(path, sizeof(path), SOC_GOVERNOR_FMT, cpu);
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    int rc = fgets(out, (int)size, f) ? 0 : -1;
+    fclose(f);
+    out[strcspn(out, "\n")] = '\0';
+    return rc;
+}
+
+static int write_governor(int cpu, const char* governor) {
+    char path[96];
+    snprintf(path, sizeof(path), SOC_GOVERNOR_FMT, cpu);
+    FILE* f = fopen(path, "w");
+    if (!f) return -1;
+    int rc = fputs(governor, f) >= 0 ? 0 : -1;
+    if (fclose(f) != 0) rc = -1; // sysfs reports a refused write here
+    return rc;
+}
+
+int soc_governor_pin(void) {
+    int rc = 0, moved = 0;
+    pthread_mutex_lock(&g_governor.lock);
+    if (!g_governor.pinned) {
+        long cpus = sysconf(_SC_NPROCESSORS_CONF);
+        for (int cpu = 0; cpu < cpus && cpu < SOC_MAX_CPUS; cpu++) {
+            char* saved = g_governor.saved[cpu];
+            if (read_governor(cpu, saved, SOC_GOVERNOR_LEN) != 0) {
+                saved[0] = '\0'; // Offline, or no cpufreq
+                continue;
+            }
+            if (strcmp(saved, "performance") == 0) {
+                saved[0] = '\0';
+                continue;
+            }
+            if (write_governor(cpu, "performance") != 0) {
+                if (!g_governor.warned) {
+                    LOG_WARN("[SoC] Cannot set cpu%d's governor (%s); leaving it at %s.\n", cpu, strerror(errno), saved);
+                }
+                saved[0] = '\0';
+                rc = -1;
+                continue;
+            }
+            moved++;
+        }
+        g_governor.pinned = true;
+        if (rc != 0) g_governor.warned = true;
+        if (moved) LOG_INFO("[SoC] %d CPU(s) on the performance governor for the mission.\n", moved);
+    }
+    pthread_mutex_unlock(&g_governor.lock);
+    return rc;
+}
+
+void soc_governor_restore(void) {
+    pthread_mutex_lock(&g_governor.lock);
+    if (g_governor.pinned) {
+        for (int cpu = 0; cpu < SOC_MAX_CPUS; cpu++) {
+            char* saved = g_governor.saved[cpu];
+            if (saved[0] && write_governor(cpu, saved) != 0) {
+                LOG_WARN("[SoC] Cannot give cpu%d its %s governor back (%s).\n", cpu, saved, strerror(errno));
+            }
+            saved[0] = '\0';
+        }
+        g_governor.pinned = false;
+    }
+    pthread_mutex_unlock(&g_governor.lock);
+}
@@ -0,0 +1,78 @@
+#ifndef SOC_MONITOR_H
+#define SOC_MONITOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file soc_monitor.h
+ * @brief SoC temperature, CPU clock and firmware throttling, beside the metrics.
+ *
+ * A warm Pi lowers its ARM clock (soft limit at 60 C on a Pi 4, throttling
+ * from 80 C, under-voltage at any temperature), and everything on the Pi
+ * slows down with it: JPEG work, curl, the reactor. The reactor samples every
+ * SOC_MONITOR_PERIOD_MS and the nav thread at each mission's start and end:
+ *
+ *   temperature  /sys/class/thermal/thermal_zone0/temp, millidegrees C
+ *   clock        cpu0's scaling_cur_freq, kHz (the cores share one clock)
+ *   throttled    the firmware's get_throttled flags (SOC_THROTTLE_*), as
+ *                vcgencmd get_throttled prints them
+ *
+ * into the soc_* gauges (metrics.h). A file that is not there (not a Pi, or
+ * an older kernel) is reported once at startup and its gauge stays at -1.
+ * A throttle flag coming on (or going off) is logged with the temperature and
+ * clock at the time. Each mission's report
+ * (mission_report.h) carries its hottest sample, its slowest clock and every
+ * flag seen, so a slow mission shows whether the code or the Pi was slower.
+ *
+ * soc_governor_pin() moves every CPU to the performance governor for a
+ * mission and soc_governor_restore() puts back what was there. That takes
+ * root; without it, it warns once and changes nothing.
+ *
+ * Thread-safe.
+ */
+
+#define SOC_MONITOR_PERIOD_MS 1000
+
+// get_throttled bits. The low ones hold now; each has a sticky copy 16 bits up
+// that holds if it happened since boot.
+#define SOC_THROTTLE_UNDERVOLT   0x1u // Supply below 4.63 V
+#define SOC_THROTTLE_FREQ_CAPPED 0x2u // ARM clock capped (soft temperature limit)
+#define SOC_THROTTLE_THROTTLED   0x4u // ARM clock throttled (hard limit)
+#define SOC_THROTTLE_SOFT_TEMP   0x8u // Soft temperature limit reached
+#define SOC_THROTTLE_NOW_MASK    0xFu
+#define SOC_THROTTLE_SINCE_BOOT(flags) (((flags) >> 16) & SOC_THROTTLE_NOW_MASK)
+
+typedef struct {
+    int32_t temp_mc;  // -1: unknown
+    int32_t freq_khz; // -1: unknown
+    int32_t throttled; // SOC_THROTTLE_* flags, -1: unknown
+} SocSample;
+
+// Worst of the samples since soc_window_begin()
+typedef struct {
+    int samples;
+    int32_t temp_max_mc;  // -1: no reading
+    int32_t freq_min_khz; // -1: no reading
+    uint32_t throttled;   // SOC_THROTTLE_NOW_MASK flags seen in any sample
+} SocWindow;
+
+// Opens the sysfs files. Call once from main() before the reactor starts.
+void soc_monitor_init(void);
+
+// Takes a sample into the gauges and the window, and *out if it is not NULL.
+void soc_monitor_sample(SocSample* out);
+
+// Starts a new window; the mission report calls it as a mission opens.
+void soc_window_begin(void);
+void soc_window_get(SocWindow* out);
+
+// Moves every CPU to the performance governor, remembering each one's.
+// Returns 0, or -1 if any could not be moved.
+int soc_governor_pin(void);
+
+// Gives every CPU soc_governor_pin() moved its governor back. Safe to call
+// without a pin.
+void soc_governor_restore(void);
+
+#endif // SOC_MONITOR_H
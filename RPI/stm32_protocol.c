@@ -0,0 +1,334 @@
+#include "stm32_protocol.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+static atomic_bool g_binary_enabled = false;
+static atomic_bool g_route_enabled = false;
+static atomic_bool g_pass_enabled = false;
+static atomic_bool g_estop_enabled = false;
+
+// CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF, no reflection, no final XOR.
+// Bitwise is plenty for 9-byte frames and matches the firmware's implementation.
+uint16_t stm32_crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v & 0xFF);
+    p[1] = (uint8_t)(v >> 8);
+}
+
+int stm32_encode_frame(uint8_t opcode, uint32_t cmd_id, int speed, int dist_angle, uint8_t out[STM32_FRAME_LEN]) {
+    if (cmd_id > 0xFFFF || speed < 0 || speed > 0xFFFF || dist_angle < 0 || dist_angle > 0xFFFF) {
+        return -1;
+    }
+    out[0] = STM32_FRAME_SYNC;
+    out[1] = STM32_FRAME_PAYLOAD_LEN;
+    out[2] = opcode;
+    put_u16(&out[3], (uint16_t)cmd_id);
+    put_u16(&out[5], (uint16_t)speed);
+    put_u16(&out[7], (uint16_t)dist_angle);
+    put_u16(&out[9], stm32_crc16(&out[1], 1 + STM32_FRAME_PAYLOAD_LEN));
+    return 0;
+}
+
+int stm32_encode_route_frame(uint32_t cmd_id, uint32_t base_id, int first, int total,
+                             const Stm32RouteStep* steps, int count, uint8_t out[STM32_ROUTE_FRAME_MAX]) {
+    if (cmd_id > 0xFFFF || base_id + (uint32_t)total > 0xFFFF || count < 1 || count > STM32_ROUTE_STEPS_PER_FRAME ||
+        first < 0 || total > 0xFF || first + count > total) {
+        return -1;
+    }
+    uint8_t payload = (uint8_t)(STM32_ROUTE_HEADER_LEN + 4 * count);
+    out[0] = STM32_FRAME_SYNC;
+    out[1] = payload;
+    out[2] = STM32_OP_ROUTE;
+    put_u16(&out[3], (uint16_t)cmd_id);
+    put_u16(&out[5], (uint16_t)base_id);
+    out[7] = (uint8_t)first;
+    out[8] = (uint8_t)total;
+    uint8_t* p = &out[9];
+    for (int i = 0; i < count; i++, p += 4) {
+        p[0] = steps[i].opcode;
+        p[1] = steps[i].speed;
+        put_u16(&p[2], steps[i].dist_angle);
+    }
+    put_u16(p, stm32_crc16(&out[1], 1 + payload));
+    return 2 + payload + 2;
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+int stm32_telemetry_check(const uint8_t* data, size_t len) {
+    if (len < 3) return 0;
+    if (data[1] != STM32_TELEM_PAYLOAD_LEN || data[2] != STM32_TELEM_TYPE) return -1;
+    if (len < STM32_TELEM_FRAME_LEN) return 0;
+    uint16_t crc = get_u16(&data[2 + STM32_TELEM_PAYLOAD_LEN]);
+    if (stm32_crc16(&data[1], 1 + STM32_TELEM_PAYLOAD_LEN) != crc) return -1;
+    return STM32_TELEM_FRAME_LEN;
+}
+
+void stm32_decode_telemetry(const uint8_t frame[STM32_TELEM_FRAME_LEN], Stm32Telemetry* out) {
+    const uint8_t* p = &frame[3];
+    out->tick_ms = get_u32(p);
+    out->enc_a = (int32_t)get_u32(p + 4);
+    out->enc_d = (int32_t)get_u32(p + 8);
+    out->rps_a = (int16_t)get_u16(p + 12) / 1000.0f;
+    out->rps_d = (int16_t)get_u16(p + 14) / 1000.0f;
+    out->pwm_a = (int16_t)get_u16(p + 16);
+    out->pwm_d = (int16_t)get_u16(p + 18);
+    out->yaw_deg = (int32_t)get_u32(p + 20) / 100.0f;
+    out->yaw_rate_dps = (int16_t)get_u16(p + 24) / 100.0f;
+    out->ir_mm = get_u16(p + 26);
+}
+
+int stm32_parse_pose(const char* reply, Stm32Pose* out) {
+    const char* fields = strchr(reply, '/'); // After the ID
+    if (fields) fields = strchr(fields + 1, '/'); // After the status
+    long x, y, theta;
+    unsigned long sd_x, sd_y, sd_theta;
+    int end = 0;
+    if (!fields || sscanf(fields, "/%ld/%ld/%ld/%lu/%lu/%lu%n", &x, &y, &theta, &sd_x, &sd_y, &sd_theta, &end) != 6) {
+        return -1;
+    }
+    long along, turned;
+    int achieved_end = 0;
+    out->has_achieved = sscanf(fields + end, "/%ld/%ld%n", &along, &turned, &achieved_end) == 2;
+    if (out->has_achieved) end += achieved_end;
+    unsigned rest;
+    out->has_rest = sscanf(fields + end, "/@%u", &rest) == 1;
+    out->rest_tick_ms = out->has_rest ? rest : 0;
+    out->achieved_cm = out->has_achieved ? along / 10.0f : 0;
+    out->turned_deg = out->has_achieved ? turned / 10.0f : 0;
+    out->x_cm = x / 10.0f;
+    out->y_cm = y / 10.0f;
+    out->theta_deg = theta / 10.0f;
+    out->sd_x_cm = sd_x / 10.0f;
+    out->sd_y_cm = sd_y / 10.0f;
+    out->sd_theta_deg = sd_theta / 10.0f;
+    return 0;
+}
+
+int stm32_format_pose(const Stm32Pose* pose, char* out, size_t size) {
+    int n = snprintf(out, size, "%ld/%ld/%ld/%lu/%lu/%lu", lroundf(pose->x_cm * 10), lroundf(pose->y_cm * 10),
+                     lroundf(pose->theta_deg * 10), (unsigned long)lroundf(pose->sd_x_cm * 10),
+                     (unsigned long)lroundf(pose->sd_y_cm * 10), (unsigned long)lroundf(pose->sd_theta_deg * 10));
+    if (pose->has_achieved && n >= 0 && (size_t)n < size) {
+        n += snprintf(out + n, size - (size_t)n, "/%ld/%ld", lroundf(pose->achieved_cm * 10),
+                      lroundf(pose->turned_deg * 10));
+    }
+    if (!pose->has_rest || n < 0 || (size_t)n >= size) return n;
+    return n + snprintf(out + n, size - (size_t)n, "/@%u", (unsigned)pose->rest_tick_ms);
+}
+
+// Whether the '+'-separated list holds word
+static bool list_has(const char* list, size_t len, const char* word) {
+    size_t word_len = strlen(word);
+    for (size_t i = 0; i < len;) {
+        size_t end = i;
+        while (end < len && list[end] != '+') end++;
+        if (end - i == word_len && memcmp(list + i, word, word_len) == 0) return true;
+        i = end + 1;
+    }
+    return false;
+}
+
+int stm32_parse_ping(const char* reply, uint32_t* cmd_id, Stm32PingStages* out) {
+    unsigned id, rx, wake, dispatch, tx;
+    int end = 0;
+    if (sscanf(reply, "!%u/OK/PING/%u/%u/%u/%u%n", &id, &rx, &wake, &dispatch, &tx, &end) != 5) return -1;
+    if (reply[end] != ';' && reply[end] != '\0') return -1;
+    *cmd_id = id;
+    out->rx_ns = rx;
+    out->wake_ns = wake;
+    out->dispatch_ns = dispatch;
+    out->prev_tx_ns = tx;
+    return 0;
+}
+
+int stm32_parse_sync(const char* reply, Stm32SyncReply* out) {
+    unsigned rx, tx, tick;
+    int end = 0;
+    if (sscanf(reply, "!0/OK/SYNC/%u/%u/%u%n", &rx, &tx, &tick, &end) != 3) return -1;
+    if (reply[end] != ';' && reply[end] != '\0') return -1;
+    out->rx_us = rx;
+    out->tx_us = tx;
+    out->tick_ms = tick;
+    return 0;
+}
+
+int stm32_parse_progress(const char* reply, uint32_t* cmd_id, int* pct, int* eta_ms) {
+    unsigned id;
+    int mark, eta, end = 0;
+    if (sscanf(reply, "!%u/PROGRESS/%d/%d%n", &id, &mark, &eta, &end) == 3) {
+        if (mark < 0 || mark > 100) return -1;
+    } else if (sscanf(reply, "!%u/PROGRESS/BRAKE/%d%n", &id, &eta, &end) == 2) {
+        mark = -1;
+    } else {
+        return -1;
+    }
+    if (reply[end] != ';' && reply[end] != '\0') return -1;
+    *cmd_id = id;
+    *pct = mark;
+    *eta_ms = eta < 0 ? -1 : eta;
+    return 0;
+}
+
+int stm32_parse_credit_config(const char* reply, bool* on, int* depth) {
+    size_t prefix = strlen(STM32_CREDIT_REPLY);
+    if (strncmp(reply, STM32_CREDIT_REPLY, prefix) != 0) return -1;
+    int enabled, slots;
+    if (sscanf(reply + prefix, "%d/%d", &enabled, &slots) != 2 || slots < 0) return -1;
+    *on = enabled != 0;
+    *depth = slots;
+    return 0;
+}
+
+int stm32_parse_credit(const char* reply, uint32_t* cmd_id, uint32_t* limit) {
+    unsigned id, room;
+    int end = 0;
+    if (sscanf(reply, "!%u/CREDIT/%u%n", &id, &room, &end) != 2) return -1;
+    if (reply[end] != ';' && reply[end] != '\0') return -1;
+    *cmd_id = id;
+    *limit = room;
+    return 0;
+}
+
+int stm32_parse_where(const char* reply, Stm32Where* out) {
+    static const char* const STATES[] = { [STM32_WHERE_IDLE] = "IDLE", [STM32_WHERE_BUSY] = "BUSY",
+                                          [STM32_WHERE_SNAP] = "SNAP" };
+    char state[8];
+    unsigned id;
+    long x, y, theta;
+    unsigned long sd_x, sd_y, sd_theta;
+    if (sscanf(reply, "!0/OK/WHERE/%7[A-Z]/%u/%ld/%ld/%ld/%lu/%lu/%lu", state, &id, &x, &y, &theta, &sd_x, &sd_y,
+               &sd_theta) != 8) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(STATES) / sizeof(STATES[0]); i++) {
+        if (strcmp(state, STATES[i]) != 0) continue;
+        out->state = (Stm32WhereState)i;
+        out->cmd_id = id;
+        out->pose = (Stm32Pose){ .x_cm = x / 10.0f, .y_cm = y / 10.0f, .theta_deg = theta / 10.0f,
+                                 .sd_x_cm = sd_x / 10.0f, .sd_y_cm = sd_y / 10.0f, .sd_theta_deg = sd_theta / 10.0f };
+        return 0;
+    }
+    return -1;
+}
+
+const char* const STM32_TASK2_STATE_NAMES[STM32_TASK2_STATES] = {
+    "OBS1FORWARD", "OBS1CAPTURE", "OBS1TURN", "OBS2FORWARD", "OBS2CAPTURE",
+    "OBS2TURN1", "OBS2FOLLOW", "OBS2TURN2", "OBS2RETURN", "PARKING",
+};
+
+// Reads "/v,v,..;" of STM32_TASK2_STATES values at *p. Returns 0 and advances *p.
+static int parse_lap_list(const char** p, long out[STM32_TASK2_STATES]) {
+    for (int i = 0; i < STM32_TASK2_STATES; i++) {
+        int n = 0;
+        if (sscanf(*p, i ? ",%ld%n" : "/%ld%n", &out[i], &n) != 1 || n == 0) return -1;
+        *p += n;
+    }
+    return 0;
+}
+
+int stm32_parse_task2_lap(const char* reply, Stm32Task2Lap* out) {
+    unsigned id;
+    long total, cap1, cap2;
+    int end = 0;
+    if (sscanf(reply, "!%u/LAP/%ld/%ld/%ld%n", &id, &total, &cap1, &cap2, &end) != 4 || end == 0) return -1;
+    const char* p = reply + end;
+    long entries[STM32_TASK2_STATES], retries[STM32_TASK2_STATES];
+    if (parse_lap_list(&p, out->state_ms) != 0 || parse_lap_list(&p, entries) != 0 ||
+        parse_lap_list(&p, retries) != 0) {
+        return -1;
+    }
+    if (*p != ';' && *p != '\0') return -1;
+    out->cmd_id = id;
+    out->total_ms = total;
+    out->capture_ms[0] = cap1;
+    out->capture_ms[1] = cap2;
+    for (int i = 0; i < STM32_TASK2_STATES; i++) {
+        out->entries[i] = entries[i] < 0 ? 0 : (unsigned)entries[i];
+        out->retries[i] = retries[i] < 0 ? 0 : (unsigned)retries[i];
+    }
+    return 0;
+}
+
+int stm32_parse_hello(const char* reply, Stm32LinkCaps* caps) {
+    size_t prefix = strlen(STM32_HELLO_REPLY);
+    if (strncmp(reply, STM32_HELLO_REPLY, prefix) != 0) return -1;
+    int firmware, link, formats_start, formats_end, features_start, features_end;
+    long max_baud;
+    if (sscanf(reply + prefix, "%d/%d/%n%*[^/]%n/%n%*[^/]%n/%ld", &firmware, &link, &formats_start, &formats_end,
+               &features_start, &features_end, &max_baud) != 3) {
+        return -1;
+    }
+    const char* fields = reply + prefix;
+    memset(caps, 0, sizeof(*caps));
+    caps->firmware_version = firmware;
+    caps->link_version = link;
+    caps->binary = list_has(fields + formats_start, (size_t)(formats_end - formats_start), "BINARY");
+    caps->route = list_has(fields + features_start, (size_t)(features_end - features_start), "ROUTE");
+    caps->pose = list_has(fields + features_start, (size_t)(features_end - features_start), "POSE");
+    caps->reset = list_has(fields + features_start, (size_t)(features_end - features_start), "RESET");
+    caps->telemetry = list_has(fields + features_start, (size_t)(features_end - features_start), "TELEM");
+    caps->estop = list_has(fields + features_start, (size_t)(features_end - features_start), "ESTOP");
+    caps->ping = list_has(fields + features_start, (size_t)(features_end - features_start), "PING");
+    caps->achieved = list_has(fields + features_start, (size_t)(features_end - features_start), "ACHIEVED");
+    caps->sync = list_has(fields + features_start, (size_t)(features_end - features_start), "SYNC");
+    caps->progress = list_has(fields + features_start, (size_t)(features_end - features_start), "PROGRESS");
+    caps->where = list_has(fields + features_start, (size_t)(features_end - features_start), "WHERE");
+    caps->pass = list_has(fields + features_start, (size_t)(features_end - features_start), "PASS");
+    caps->credit = list_has(fields + features_start, (size_t)(features_end - features_start), "CREDIT");
+    caps->ready = list_has(fields + features_start, (size_t)(features_end - features_start), "READY");
+    caps->usb = list_has(fields + features_start, (size_t)(features_end - features_start), "USB");
+    caps->max_baud = (int)max_baud;
+    return 0;
+}
+
+void stm32_protocol_set_binary(bool enabled) {
+    atomic_store(&g_binary_enabled, enabled);
+}
+
+bool stm32_protocol_binary(void) {
+    return atomic_load(&g_binary_enabled);
+}
+
+void stm32_protocol_set_route(bool enabled) {
+    atomic_store(&g_route_enabled, enabled);
+}
+
+bool stm32_protocol_route(void) {
+    return atomic_load(&g_route_enabled);
+}
+
+void stm32_protocol_set_pass(bool enabled) {
+    atomic_store(&g_pass_enabled, enabled);
+}
+
+bool stm32_protocol_pass(void) {
+    return atomic_load(&g_pass_enabled);
+}
+
+void stm32_protocol_set_estop(bool enabled) {
+    atomic_store(&g_estop_enabled, enabled);
+}
+
+bool stm32_protocol_estop(void) {
+    return atomic_load(&g_estop_enabled);
+}
@@ -0,0 +1,361 @@
+#ifndef STM32_PROTOCOL_H
+#define STM32_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file stm32_protocol.h
+ * @brief Binary frames on the RPi <-> STM32 link.
+ *
+ * The link starts in the ASCII protocol (":id/MOTOR/FWD/speed/dist;"). At start-up
+ * the Pi sends a HELLO with its link version and fastest rate, and the firmware
+ * answers with what it speaks:
+ *
+ *   ":0/GENERAL/HELLO/link/max_baud;"
+ *   "!0/OK/HELLO/firmware/link/formats/features/max_baud;"
+ *
+ * formats and features are '+'-separated lists (ASCII, BINARY; ROUTE, POSE,
+ * RESET, TELEM, ESTOP, PING, ...). If both ends can go faster than STM32_BAUD_RATE, the Pi sends
+ * ":0/GENERAL/BAUD/rate;", and the firmware replies "!0/OK/BAUD/rate;" at the
+ * old rate before it switches. The new rate is used only if a HELLO then gets
+ * through at it. Otherwise the firmware reverts after STM32_BAUD_CONFIRM_MS and
+ * so does the Pi.
+ *
+ * Firmware built with its native USB link answers a HELLO that came in over
+ * USB with USB in its features. Replies then go out over USB, and the Pi keeps
+ * the rate it opened at, as a CDC port's rate is only a setting.
+ *
+ * Firmware older than HELLO replies "!0/ERROR/INVALID_COMMAND;". The Pi then
+ * sends STM32_BINARY_PROBE; firmware that understands binary frames replies
+ * with STM32_BINARY_PROBE_REPLY. Either way, once binary frames are known to
+ * work every later motion command goes out as an 11-byte frame:
+ *
+ *   0xA5 | LEN=7 | OPCODE | ID (u16) | SPEED (u16) | DIST/ANGLE (u16) | CRC-16 (u16)
+ *
+ * Multi-byte fields are little-endian. The CRC is CRC-16/CCITT-FALSE over LEN
+ * through DIST/ANGLE. Firmware replies stay ASCII ("!id/OK/...;") in both modes.
+ * Keep the opcodes in step with enum cmdList in the stm32-motor firmware.
+ *
+ * Firmware that replies STM32_BINARY_PROBE_ROUTE_REPLY also runs whole routes on
+ * its own. The route goes up in ROUTE frames of up to STM32_ROUTE_STEPS_PER_FRAME
+ * steps, each acknowledged with "!id/DONE;" once stored:
+ *
+ *   0xA5 | LEN=7+4n | 0x20 | ID (u16) | BASE (u16) | FIRST (u8) | TOTAL (u8)
+ *   | n x STEP | CRC-16,    STEP = OPCODE (u8) | SPEED (u8) | DIST/ANGLE (u16)
+ *
+ * Step k is reported under ID BASE + k. Motion steps send the usual DONE and
+ * SETTLED. A STM32_ROUTE_SNAP step (DIST/ANGLE = obstacle ID) sends
+ * "!id/SNAP;" once the robot has settled, then waits for a RESUME frame with
+ * that ID. Firmware advertising PASS also takes STM32_ROUTE_PASS steps, for a
+ * snapshot taken on the move: it sends "!id/PASS;" as the move before it ends
+ * and drives straight on into the next step without braking, settling or
+ * waiting. The firmware starts the route when step TOTAL - 1 is stored. A STOP
+ * frame abandons it.
+ *
+ * The stm32-motor firmware appends its odometry pose (Stm32Pose) to every DONE,
+ * SNAP, PASS and SETTLED that follows motion: "!id/DONE/x/y/theta/sd_x/sd_y/sd_theta;"
+ * in mm, mm and 0.1 degree, standard deviations in the same units. Older
+ * firmware sends the bare status. Firmware advertising ACHIEVED adds what the
+ * command itself did to its DONE: ".../sd_theta/along/turned;", the travel in
+ * mm along the heading it started on (negative backwards) and the heading
+ * change in 0.1 degree, counter-clockwise positive and not wrapped. SETTLED
+ * and a route's SNAP end in ".../sd_theta/@tick;": the HAL_GetTick() ms the
+ * chassis came to rest at, which clock_sync_tick_to_local() maps onto the RPi
+ * clock so camera frames exposed since then can be used.
+ *
+ * After a reset it did not ask for (watchdog, fault, reset button) the
+ * stm32-motor firmware sends "!id/RESET/remaining/cause;" at boot. id is the
+ * command it was running, remaining the cm or degrees of it still to go (-1
+ * when the primitive cannot tell), and cause WATCHDOG, ERROR or BUTTON. With
+ * nothing running, id is the last command it finished and remaining 0 (id 0:
+ * none since power-on). Its queue did not survive; the pose did.
+ *
+ * Firmware advertising STALL gives up within a few hundred ms on a command
+ * whose wheels are driven without turning, or on a turn whose heading will
+ * not move: "!id/FAULT/STALL/<pose>;". The wheels are stopped, and the queue
+ * and route behind the command are dropped, as for an emergency stop. Nothing
+ * else follows for id.
+ *
+ * Firmware that advertises ESTOP stops on a single STM32_ESTOP_BYTE sent
+ * between frames, in the RX interrupt rather than in queue order: the wheels
+ * stop, the route and every command received before the byte are dropped, and
+ * it replies "!id/STOPPED/remaining;" with id and remaining as for RESET. A
+ * write() of one frame is not split by the tty, so the byte cannot land inside
+ * a frame another thread is sending.
+ *
+ * Firmware advertising PING answers ":id/GENERAL/PING/0/0;", or a binary frame
+ * with STM32_OP_PING, with "!id/OK/PING/rx/wake/dispatch/tx;" and does nothing
+ * else. The fields are ns measured on the board's cycle counter: the frame's
+ * first byte to its last (the wire), the last byte to the receive task taking
+ * it up (ISR and wakeup), that to the reply being queued (parse and dispatch),
+ * and for the previous PING reply, queued to its last bit sent (0 for the
+ * first). Its LINK_PROBE pin toggles at each of those points. link_bench.c
+ * times a burst of them.
+ *
+ * Firmware advertising SYNC answers ":0/GENERAL/SYNC/0/0;" with
+ * "!0/OK/SYNC/rx/tx/tick;": the frame's last byte and the reply being
+ * formatted, in us since boot (low 32 bits), and HAL_GetTick() at tx.
+ * clock_sync.h turns a run of them into a mapping onto the Pi's clock.
+ *
+ * Firmware advertising PROGRESS reports on moves and turns under way once
+ * ":0/GENERAL/PROGRESS/every/brake;" turns it on (answered
+ * "!0/OK/PROGRESS/every/brake;"; 0/0 turns it off again, and a reboot does
+ * too): "!id/PROGRESS/pct/eta;" as the command passes each multiple of every
+ * percent of its length, and with brake 1 "!id/PROGRESS/BRAKE/eta;" when its
+ * approach profile starts slowing it down. eta is ms left at the current
+ * rate, -1 before the firmware has measured one.
+ *
+ * Firmware advertising CREDIT reports room in its command queue once
+ * ":0/GENERAL/CREDIT/1/0;" turns that on (answered "!0/OK/CREDIT/1/depth;",
+ * depth being how many commands it can hold queued behind the one running; 0
+ * turns it off, and a reboot does too). Each time it takes a command off the
+ * queue it sends "!id/CREDIT/limit;": id is the command it started and limit
+ * the highest ID it has room for, the last command accepted plus the slots free.
+ * A reply formatted after a command was accepted counts that command, so a
+ * limit never promises a slot already taken. With nothing sent since it
+ * started on, the first depth IDs fit. A command sent beyond the limit still
+ * waits in the firmware's receive task for up to 100 ms and is then refused
+ * with "!id/ERROR/MOTOR_COMMAND_QUEUE_IS_FULL;".
+ *
+ * Firmware advertising READY holds the commands it receives after a boot
+ * (power-on or RESET) in its queue until its servo is centred and its IMU is
+ * tracking the heading, then sends "!0/READY/ms;", ms being HAL_GetTick() at
+ * the time. Commands resent after a RESET simply start then.
+ *
+ * Firmware advertising WHERE answers ":0/GENERAL/WHERE/0/0;" with
+ * "!0/OK/WHERE/state/id/<pose>;", for a controller resuming a mission after it
+ * restarted (checkpoint.h). state is BUSY while a command runs or is queued or
+ * a route is under way, SNAP while the route waits at its snapshot step id for
+ * RESUME, and IDLE otherwise, with id the last command finished (as for RESET).
+ *
+ * The Task 2 firmware (STM/MDP_test) ends a TASK2 command with
+ * "!id/LAP/total/capture1/capture2/<ms,..>/<entries,..>/<retries,..>;" before
+ * its DONE: the lap's ms, ms from each "!CAPTURE<n>;" request to the decision
+ * (-1 unanswered), then per task2State from OBS1FORWARD to PARKING the ms
+ * spent in it, how often it was entered and its retries.
+ *
+ * In the other direction, the MDP firmware can interleave telemetry frames with
+ * its replies (TELEM <hz> over USART3 starts them) using the same framing:
+ *
+ *   0xA5 | LEN=29 | TYPE=0x80 | TICK ms (u32) | ENC_A, ENC_D counts (i32)
+ *   | RPS_A, RPS_D (i16, 1/1000 rps) | PWM_A, PWM_D (i16, + = forward)
+ *   | YAW (i32, 1/100 deg) | YAW_RATE (i16, 1/100 dps) | IR (u16, mm) | CRC-16
+ */
+
+#define STM32_FRAME_SYNC 0xA5
+#define STM32_FRAME_PAYLOAD_LEN 7 // OPCODE + ID + SPEED + DIST
+#define STM32_FRAME_LEN (2 + STM32_FRAME_PAYLOAD_LEN + 2)
+
+#define STM32_OP_FWD 0x10
+#define STM32_OP_REV 0x11
+#define STM32_OP_STOP 0x12
+#define STM32_OP_TURNL 0x13
+#define STM32_OP_TURNR 0x14
+#define STM32_OP_TURN90L 0x15
+#define STM32_OP_TURN90R 0x16
+#define STM32_OP_TASK2 0x17
+#define STM32_OP_PWMTURNL 0x18
+#define STM32_OP_PWMTURNR 0x19
+#define STM32_OP_ROUTE 0x20
+#define STM32_OP_RESUME 0x21
+#define STM32_OP_PING 0x22
+#define STM32_ROUTE_SNAP 0x30 // Step opcode for a snapshot point
+#define STM32_ROUTE_PASS 0x31 // Step opcode for a snapshot point driven through (PASS)
+
+#define STM32_ROUTE_MAX_STEPS 128      // Firmware route buffer (ROUTE_MAX_STEPS)
+#define STM32_ROUTE_STEPS_PER_FRAME 32 // Keeps LEN well inside a byte
+#define STM32_ROUTE_HEADER_LEN 7       // OPCODE + ID + BASE + FIRST + TOTAL
+#define STM32_ROUTE_FRAME_MAX (2 + STM32_ROUTE_HEADER_LEN + 4 * STM32_ROUTE_STEPS_PER_FRAME + 2)
+
+#define STM32_TELEM_TYPE 0x80
+#define STM32_TELEM_PAYLOAD_LEN 29 // TYPE + fields
+#define STM32_TELEM_FRAME_LEN (2 + STM32_TELEM_PAYLOAD_LEN + 2)
+
+typedef struct {
+    uint32_t tick_ms;
+    int32_t enc_a, enc_d;
+    float rps_a, rps_d;
+    int pwm_a, pwm_d;
+    float yaw_deg;
+    float yaw_rate_dps;
+    unsigned ir_mm;
+} Stm32Telemetry;
+
+// Dead-reckoned pose from wheels and gyro. x is forward and y to the left of
+// where the STM32 booted, theta counter-clockwise in (-180, 180].
+typedef struct {
+    float x_cm, y_cm;
+    float theta_deg;
+    float sd_x_cm, sd_y_cm, sd_theta_deg; // 1 sigma
+    bool has_achieved; // A DONE that reported what its command did (ACHIEVED)
+    float achieved_cm; // Travel along the heading the command started on
+    float turned_deg;  // Heading change over the command
+    bool has_rest;         // SETTLED or SNAP that said when motion stopped
+    uint32_t rest_tick_ms; // STM32 tick of that moment
+} Stm32Pose;
+
+#define STM32_LINK_VERSION 1
+#define STM32_HELLO_FMT ":0/GENERAL/HELLO/%d/%d;" // STM32_LINK_VERSION, the Pi's max baud
+#define STM32_HELLO_REPLY "!0/OK/HELLO/"
+#define STM32_BAUD_FMT ":0/GENERAL/BAUD/%d;"
+#define STM32_BAUD_REPLY "!0/OK/BAUD/"
+#define STM32_BAUD_CONFIRM_MS 500 // Firmware's LINK_BAUD_CONFIRM_MS
+#define STM32_ESTOP_BYTE 0x18     // ASCII CAN; firmware ESTOP_BYTE
+
+// What a HELLO reply advertised
+typedef struct {
+    int firmware_version;
+    int link_version;
+    bool binary;    // Binary command frames
+    bool route;     // ROUTE uploads with SNAP/RESUME
+    bool pose;      // Odometry pose on DONE/SNAP/SETTLED
+    bool reset;     // RESET reports after an unplanned reboot
+    bool telemetry; // Telemetry frames
+    bool estop;     // STM32_ESTOP_BYTE
+    bool ping;      // GENERAL/PING latency probe
+    bool achieved;  // Achieved travel and turn on DONE
+    bool sync;      // GENERAL/SYNC clock exchange
+    bool progress;  // GENERAL/PROGRESS events during motion
+    bool where;     // GENERAL/WHERE position query
+    bool pass;      // STM32_ROUTE_PASS route steps
+    bool credit;    // GENERAL/CREDIT queue room reports
+    bool ready;     // READY once motion is safe after a boot
+    bool usb;       // The link is the firmware's native USB CDC port
+    int max_baud;
+} Stm32LinkCaps;
+
+#define STM32_BINARY_PROBE ":0/GENERAL/BINARY/1/0;"
+#define STM32_BINARY_PROBE_REPLY "!0/OK/BINARY_V1"
+#define STM32_BINARY_PROBE_ROUTE_REPLY "!0/OK/BINARY_V1/ROUTE" // Also runs ROUTE uploads
+
+uint16_t stm32_crc16(const uint8_t* data, size_t len);
+
+// Writes one frame into out[STM32_FRAME_LEN]. Returns 0, or -1 if a field does
+// not fit its 16-bit slot (the caller should fall back to ASCII).
+int stm32_encode_frame(uint8_t opcode, uint32_t cmd_id, int speed, int dist_angle, uint8_t out[STM32_FRAME_LEN]);
+
+typedef struct {
+    uint8_t opcode; // STM32_OP_* motion opcode, STM32_ROUTE_SNAP or STM32_ROUTE_PASS
+    uint8_t speed;
+    uint16_t dist_angle;
+} Stm32RouteStep;
+
+// Writes the ROUTE frame carrying steps[first .. first + count) of a total-step
+// route into out[STM32_ROUTE_FRAME_MAX]. Returns the frame length, or -1 if
+// count is out of 1..STM32_ROUTE_STEPS_PER_FRAME or an ID does not fit 16 bits.
+int stm32_encode_route_frame(uint32_t cmd_id, uint32_t base_id, int first, int total,
+                             const Stm32RouteStep* steps, int count, uint8_t out[STM32_ROUTE_FRAME_MAX]);
+
+// Checks for a telemetry frame at data[0] (which must be STM32_FRAME_SYNC).
+// Returns STM32_TELEM_FRAME_LEN for a valid frame, 0 if more bytes are needed
+// to decide, or -1 if the sync byte does not start one (wrong LEN/TYPE or CRC).
+int stm32_telemetry_check(const uint8_t* data, size_t len);
+
+// Decodes a frame that stm32_telemetry_check() accepted.
+void stm32_decode_telemetry(const uint8_t frame[STM32_TELEM_FRAME_LEN], Stm32Telemetry* out);
+
+// Reads the pose after the status of a "!id/STATUS/...;" reply. Returns 0, or
+// -1 if the reply carries none.
+int stm32_parse_pose(const char* reply, Stm32Pose* out);
+// Writes the reply fields for pose ("x/y/theta/sd_x/sd_y/sd_theta", no leading
+// '/', then "/along/turned" if it has_achieved and "/@tick" if it has_rest) into out. Returns the length,
+// as snprintf().
+int stm32_format_pose(const Stm32Pose* pose, char* out, size_t size);
+
+#define STM32_PING_FMT ":%u/GENERAL/PING/0/0;"
+
+// Firmware-side stages of one PING, in ns (see above)
+typedef struct {
+    uint32_t rx_ns;
+    uint32_t wake_ns;
+    uint32_t dispatch_ns;
+    uint32_t prev_tx_ns;
+} Stm32PingStages;
+
+// Reads an "!id/OK/PING/...;" reply. Returns 0 and sets *cmd_id, or -1 if reply
+// is not one.
+int stm32_parse_ping(const char* reply, uint32_t* cmd_id, Stm32PingStages* out);
+
+#define STM32_SYNC_REQUEST ":0/GENERAL/SYNC/0/0;"
+
+// Board clock readings of one SYNC (see above)
+typedef struct {
+    uint32_t rx_us;
+    uint32_t tx_us;
+    uint32_t tick_ms;
+} Stm32SyncReply;
+
+// Reads a "!0/OK/SYNC/...;" reply. Returns 0, or -1 if reply is not one.
+int stm32_parse_sync(const char* reply, Stm32SyncReply* out);
+
+#define STM32_PROGRESS_FMT ":0/GENERAL/PROGRESS/%d/%d;" // every percent, brake
+#define STM32_PROGRESS_REPLY "!0/OK/PROGRESS/"
+
+// Reads an "!id/PROGRESS/...;" event. Returns 0 and sets *cmd_id, *pct (-1 for
+// BRAKE) and *eta_ms (-1 unknown), or -1 if reply is not one.
+int stm32_parse_progress(const char* reply, uint32_t* cmd_id, int* pct, int* eta_ms);
+
+#define STM32_CREDIT_FMT ":0/GENERAL/CREDIT/%d/0;" // 1 on, 0 off
+#define STM32_CREDIT_REPLY "!0/OK/CREDIT/"
+
+// Reads a "!0/OK/CREDIT/on/depth;" reply. Returns 0, or -1 if reply is not one.
+int stm32_parse_credit_config(const char* reply, bool* on, int* depth);
+
+// Reads an "!id/CREDIT/limit;" report. Returns 0, or -1 if reply is not one.
+int stm32_parse_credit(const char* reply, uint32_t* cmd_id, uint32_t* limit);
+
+#define STM32_WHERE_REQUEST ":0/GENERAL/WHERE/0/0;"
+
+typedef enum {
+    STM32_WHERE_IDLE,
+    STM32_WHERE_BUSY,
+    STM32_WHERE_SNAP
+} Stm32WhereState;
+
+typedef struct {
+    Stm32WhereState state;
+    uint32_t cmd_id; // Running, parked at (SNAP) or last finished (IDLE)
+    Stm32Pose pose;
+} Stm32Where;
+
+// Reads a "!0/OK/WHERE/...;" reply. Returns 0, or -1 if reply is not one.
+int stm32_parse_where(const char* reply, Stm32Where* out);
+
+#define STM32_TASK2_STATES 10
+
+typedef struct {
+    uint32_t cmd_id;
+    long total_ms;
+    long capture_ms[2]; // -1: not answered
+    long state_ms[STM32_TASK2_STATES];
+    unsigned entries[STM32_TASK2_STATES];
+    unsigned retries[STM32_TASK2_STATES];
+} Stm32Task2Lap;
+
+// task2State names, in the firmware's order
+extern const char* const STM32_TASK2_STATE_NAMES[STM32_TASK2_STATES];
+
+// Reads an "!id/LAP/...;" report. Returns 0, or -1 if reply is not one.
+int stm32_parse_task2_lap(const char* reply, Stm32Task2Lap* out);
+
+// Reads a "!0/OK/HELLO/...;" reply. Returns 0, or -1 if reply is not one.
+// Unknown formats and features are ignored.
+int stm32_parse_hello(const char* reply, Stm32LinkCaps* caps);
+
+// Negotiated link mode. Set from the HELLO or probe reply; read by whichever
+// thread sends commands.
+void stm32_protocol_set_binary(bool enabled);
+bool stm32_protocol_binary(void);
+// Whether the probe reply also advertised the route executor
+void stm32_protocol_set_route(bool enabled);
+bool stm32_protocol_route(void);
+// Whether the route executor also takes STM32_ROUTE_PASS steps
+void stm32_protocol_set_pass(bool enabled);
+bool stm32_protocol_pass(void);
+// Whether the firmware acts on STM32_ESTOP_BYTE
+void stm32_protocol_set_estop(bool enabled);
+bool stm32_protocol_estop(void);
+
+#endif // STM32_PROTOCOL_H
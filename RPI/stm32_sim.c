@@ -0,0 +1,896 @@
+#include "stm32_sim.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+#include "stm32_protocol.h"
+
+// Rear wheels as fitted on the robot, for telemetry encoder counts and RPS
+#define STM32_SIM_WHEEL_CIRCUMFERENCE_CM 21.4
+#define STM32_SIM_COUNTS_PER_REV 1320
+#define STM32_SIM_PWM_MAX 7199
+#define STM32_SIM_IR_MM 800 // No arena: the IR never sees anything in range (occupancy_map.h)
+#define STM32_SIM_RX_BUFFER 1024
+#define STM32_SIM_STEP_S 0.01 // Model step without telemetry; how finely a STOP can cut a motion
+
+typedef struct {
+    uint32_t id;
+    uint8_t opcode; // STM32_OP_* or STM32_ROUTE_SNAP / STM32_ROUTE_PASS
+    int speed;
+    int value;
+    bool credited; // Queued as one command, so it counts against the CREDIT depth
+} SimCommand;
+
+// One command's motion: accelerate, cruise, brake. Units are cm or degrees.
+typedef struct {
+    bool turn;
+    double sign; // +1 forward / left, -1 back / right
+    double v_peak;
+    double accel;
+    double brake;
+    double t_accel, t_cruise, t_brake; // Seconds
+    int pwm;
+} SimProfile;
+
+static struct {
+    Stm32SimConfig config;
+    bool running;
+    int fd; // The sim's end of the socketpair
+    pthread_t reader;
+    pthread_t executor;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // CLOCK_MONOTONIC
+    pthread_mutex_t write_lock;
+
+    SimCommand queue[STM32_SIM_QUEUE_SIZE];
+    int head, count;
+    Stm32RouteStep route[STM32_ROUTE_MAX_STEPS];
+    int route_len;
+    uint32_t resume_id; // Last RESUME received
+    uint32_t snap_id;   // Route SNAP step waiting for its RESUME, 0 if none
+    bool abort;         // STOP: drop the command in progress
+    uint32_t last_id;   // Command running, or the last one finished, for STOPPED
+    double left;        // cm or degrees of last_id still to go, < 0 if unknown
+    int progress_every; // GENERAL/PROGRESS, off (0/false) after every boot
+    bool progress_brake;
+    bool credit;          // GENERAL/CREDIT, off after every boot
+    int credit_queued;    // Credited commands waiting in the queue
+    uint32_t credit_last; // Last one accepted
+    bool stop;          // Shutting down
+
+    // Virtual clock: advanced by motion while busy, follows real time while idle
+    bool busy;
+    uint64_t virtual_ns;
+    uint64_t idle_real_ns;
+
+    // Executor only
+    double enc_a, enc_d; // Counts
+    double yaw_deg;      // + = left
+    double x_cm, y_cm;   // From where the sim started, x forward
+    int motions;         // Motion commands started, for reset_at and stall_at
+    bool passing;        // The last step was a PASS: the next motion starts without a cooldown
+    uint32_t rest_ms;    // Virtual tick the last motion came to rest at, for SETTLED and SNAP
+} g_sim = { .lock = PTHREAD_MUTEX_INITIALIZER, .write_lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static const Stm32SimConfig STM32_SIM_DEFAULTS = {
+    .speed = STM32_SIM_DEFAULT_SPEED,
+    .max_speed_cms = STM32_SIM_DEFAULT_MAX_SPEED_CMS,
+    .accel_cms2 = STM32_SIM_DEFAULT_ACCEL_CMS2,
+    .brake_cms2 = STM32_SIM_DEFAULT_BRAKE_CMS2,
+    .turn_rate_dps = STM32_SIM_DEFAULT_TURN_RATE_DPS,
+    .turn_accel_dps2 = STM32_SIM_DEFAULT_TURN_ACCEL_DPS2,
+    .turn_radius_cm = STM32_SIM_DEFAULT_TURN_RADIUS_CM,
+    .cooldown_ms = STM32_SIM_DEFAULT_COOLDOWN_MS,
+    .settle_ms = STM32_SIM_DEFAULT_SETTLE_MS,
+    .telemetry_hz = 0.0,
+    .drive_gain = 1.0,
+    .turn_gain = 1.0,
+    .protocol = STM32_SIM_ROUTE,
+};
+
+int stm32_sim_parse(const char* spec, Stm32SimConfig* config) {
+    *config = STM32_SIM_DEFAULTS;
+    if (strcmp(spec, "default") == 0) return 0;
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    char* saveptr = NULL;
+    for (char* item = strtok_r(buffer, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+        char* eq = strchr(item, '=');
+        if (!eq) {
+            LOG_ERROR("[Sim] Expected key=value, got '%s'.\n", item);
+            return -1;
+        }
+        *eq = '\0';
+        const char* key = item;
+        const char* value = eq + 1;
+        if (strcmp(key, "protocol") == 0) {
+            if (strcmp(value, "ascii") == 0) {
+                config->protocol = STM32_SIM_ASCII;
+            } else if (strcmp(value, "binary") == 0) {
+                config->protocol = STM32_SIM_BINARY;
+            } else if (strcmp(value, "route") == 0) {
+                config->protocol = STM32_SIM_ROUTE;
+            } else {
+                LOG_ERROR("[Sim] Unknown protocol '%s'.\n", value);
+                return -1;
+            }
+            continue;
+        }
+
+        char* end;
+        double number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0) {
+            LOG_ERROR("[Sim] Bad value for %s: '%s'.\n", key, value);
+            return -1;
+        }
+        if (strcmp(key, "speed") == 0) config->speed = number;
+        else if (strcmp(key, "max_speed") == 0) config->max_speed_cms = number;
+        else if (strcmp(key, "accel") == 0) config->accel_cms2 = number;
+        else if (strcmp(key, "brake") == 0) config->brake_cms2 = number;
+        else if (strcmp(key, "turn_rate") == 0) config->turn_rate_dps = number;
+        else if (strcmp(key, "turn_accel") == 0) config->turn_accel_dps2 = number;
+        else if (strcmp(key, "turn_radius") == 0) config->turn_radius_cm = number;
+        else if (strcmp(key, "cooldown_ms") == 0) config->cooldown_ms = number;
+        else if (strcmp(key, "settle_ms") == 0) config->settle_ms = number;
+        else if (strcmp(key, "telemetry") == 0) config->telemetry_hz = number;
+        else if (strcmp(key, "reset") == 0) config->reset_at = (int)number;
+        else if (strcmp(key, "stall") == 0) config->stall_at = (int)number;
+        else if (strcmp(key, "drive_gain") == 0) config->drive_gain = number;
+        else if (strcmp(key, "turn_gain") == 0) config->turn_gain = number;
+        else {
+            LOG_ERROR("[Sim] Unknown key '%s'.\n", key);
+            return -1;
+        }
+    }
+    if (config->max_speed_cms <= 0 || config->accel_cms2 <= 0 || config->brake_cms2 <= 0 ||
+        config->turn_rate_dps <= 0 || config->turn_accel_dps2 <= 0) {
+        LOG_ERROR("[Sim] Speeds and accelerations must be positive.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 0, or -1 for an opcode the sim does not execute.
+static int profile_build(const Stm32SimConfig* config, int opcode, int speed, int value, SimProfile* p) {
+    double distance;
+    double v_max;
+    memset(p, 0, sizeof(*p));
+    if (speed <= 0 || speed > 100) speed = 100;
+    switch (opcode) {
+        case STM32_OP_FWD:
+        case STM32_OP_REV:
+            p->turn = false;
+            p->sign = opcode == STM32_OP_FWD ? 1.0 : -1.0;
+            distance = value;
+            v_max = config->max_speed_cms * speed / 100.0;
+            p->accel = config->accel_cms2;
+            p->brake = config->brake_cms2;
+            break;
+        case STM32_OP_TURNL:
+        case STM32_OP_TURNR:
+        case STM32_OP_PWMTURNL:
+        case STM32_OP_PWMTURNR:
+        case STM32_OP_TURN90L:
+        case STM32_OP_TURN90R:
+            p->turn = true;
+            p->sign = (opcode == STM32_OP_TURNL || opcode == STM32_OP_PWMTURNL || opcode == STM32_OP_TURN90L) ? 1.0 : -1.0;
+            distance = (opcode == STM32_OP_TURN90L || opcode == STM32_OP_TURN90R) ? 90 : value;
+            v_max = config->turn_rate_dps * speed / 100.0;
+            p->accel = p->brake = config->turn_accel_dps2;
+            break;
+        default:
+            return -1;
+    }
+    p->pwm = STM32_SIM_PWM_MAX * speed / 100;
+    if (distance <= 0) return 0;
+
+    double d_accel = v_max * v_max / (2 * p->accel);
+    double d_brake = v_max * v_max / (2 * p->brake);
+    if (d_accel + d_brake <= distance) {
+        p->v_peak = v_max;
+        p->t_cruise = (distance - d_accel - d_brake) / v_max;
+    } else {
+        // Too short to reach v_max: brake straight from the peak
+        p->v_peak = sqrt(2 * distance * p->accel * p->brake / (p->accel + p->brake));
+    }
+    p->t_accel = p->v_peak / p->accel;
+    p->t_brake = p->v_peak / p->brake;
+    return 0;
+}
+
+static double profile_velocity(const SimProfile* p, double t) {
+    if (t < p->t_accel) return p->accel * t;
+    t -= p->t_accel;
+    if (t < p->t_cruise) return p->v_peak;
+    t -= p->t_cruise;
+    double v = p->v_peak - p->brake * t;
+    return v > 0 ? v : 0;
+}
+
+// Travel from the start of the profile to t
+static double profile_distance(const SimProfile* p, double t) {
+    if (t < p->t_accel) return p->accel * t * t / 2;
+    double d = p->accel * p->t_accel * p->t_accel / 2;
+    t -= p->t_accel;
+    if (t < p->t_cruise) return d + p->v_peak * t;
+    d += p->v_peak * p->t_cruise;
+    t -= p->t_cruise;
+    if (t > p->t_brake) t = p->t_brake;
+    return d + p->v_peak * t - p->brake * t * t / 2;
+}
+
+int64_t stm32_sim_command_ns(const Stm32SimConfig* config, int opcode, int speed, int value) {
+    SimProfile p;
+    if (profile_build(config, opcode, speed, value, &p) != 0) return -1;
+    return (int64_t)((config->cooldown_ms / 1e3 + p.t_accel + p.t_cruise + p.t_brake) * 1e9);
+}
+
+static void sim_reply(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static void sim_reply(const char* format, ...) {
+    char line[160]; // HELLO is the longest, ~127
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len >= (int)sizeof(line)) len = (int)sizeof(line) - 1;
+    pthread_mutex_lock(&g_sim.write_lock);
+    if (write(g_sim.fd, line, (size_t)len) != len) LOG_DEBUG("[Sim] Reply dropped: %s", line);
+    pthread_mutex_unlock(&g_sim.write_lock);
+}
+
+static void put_le(uint8_t* p, uint32_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+// Sends one telemetry frame for the executor's current state.
+static void sim_telemetry(double wheel_cms, double yaw_rate_dps, int pwm) {
+    uint8_t frame[STM32_TELEM_FRAME_LEN];
+    double rps = wheel_cms / STM32_SIM_WHEEL_CIRCUMFERENCE_CM;
+    pthread_mutex_lock(&g_sim.lock);
+    uint32_t tick_ms = (uint32_t)(g_sim.virtual_ns / 1000000);
+    pthread_mutex_unlock(&g_sim.lock);
+    frame[0] = STM32_FRAME_SYNC;
+    frame[1] = STM32_TELEM_PAYLOAD_LEN;
+    frame[2] = STM32_TELEM_TYPE;
+    put_le(&frame[3], tick_ms, 4);
+    put_le(&frame[7], (uint32_t)(int32_t)lround(g_sim.enc_a), 4);
+    put_le(&frame[11], (uint32_t)(int32_t)lround(g_sim.enc_d), 4);
+    put_le(&frame[15], (uint16_t)(int16_t)lround(rps * 1000), 2);
+    put_le(&frame[17], (uint16_t)(int16_t)lround(rps * 1000), 2);
+    put_le(&frame[19], (uint16_t)(int16_t)pwm, 2);
+    put_le(&frame[21], (uint16_t)(int16_t)pwm, 2);
+    put_le(&frame[23], (uint32_t)(int32_t)lround(g_sim.yaw_deg * 100), 4);
+    put_le(&frame[27], (uint16_t)(int16_t)lround(yaw_rate_dps * 100), 2);
+    put_le(&frame[29], STM32_SIM_IR_MM, 2);
+    put_le(&frame[31], stm32_crc16(&frame[1], 1 + STM32_TELEM_PAYLOAD_LEN), 2);
+    pthread_mutex_lock(&g_sim.write_lock);
+    if (write(g_sim.fd, frame, sizeof(frame)) != (ssize_t)sizeof(frame)) LOG_DEBUG("[Sim] Telemetry frame dropped.\n");
+    pthread_mutex_unlock(&g_sim.write_lock);
+}
+
+// Moves the virtual clock on by dt_ns, sleeping dt_ns / speed in real time.
+// Returns false if a STOP or shutdown cut it short. Call without the lock.
+static bool sim_advance(uint64_t dt_ns) {
+    pthread_mutex_lock(&g_sim.lock);
+    if (g_sim.config.speed > 0) {
+        uint64_t due_ns = latency_now_ns() + (uint64_t)(dt_ns / g_sim.config.speed);
+        struct timespec due = { .tv_sec = (time_t)(due_ns / 1000000000ull), .tv_nsec = (long)(due_ns % 1000000000ull) };
+        while (!g_sim.abort && !g_sim.stop && latency_now_ns() < due_ns) {
+            pthread_cond_timedwait(&g_sim.changed, &g_sim.lock, &due);
+        }
+    }
+    bool completed = !g_sim.abort && !g_sim.stop;
+    if (completed) g_sim.virtual_ns += dt_ns;
+    pthread_mutex_unlock(&g_sim.lock);
+    return completed;
+}
+
+// Runs duration_s of the profile from t0 (p NULL: standing still), one
+// telemetry frame per period. Returns false if cut short.
+static bool sim_run(const SimProfile* p, double t0, double duration_s) {
+    double step_s = g_sim.config.telemetry_hz > 0 ? 1.0 / g_sim.config.telemetry_hz : STM32_SIM_STEP_S;
+    for (double t = 0; t < duration_s - 1e-9; t += step_s) {
+        double dt = duration_s - t < step_s ? duration_s - t : step_s;
+        if (!sim_advance((uint64_t)(dt * 1e9))) return false;
+        if (p) {
+            pthread_mutex_lock(&g_sim.lock);
+            if (g_sim.left >= 0) g_sim.left -= profile_distance(p, t0 + t + dt) - profile_distance(p, t0 + t);
+            pthread_mutex_unlock(&g_sim.lock);
+        }
+        double wheel_cms = 0, yaw_rate = 0;
+        int pwm = 0;
+        if (p) {
+            double v = profile_velocity(p, t0 + t + dt);
+            // Turns are forward arcs; braking drives the wheels against their turning
+            pwm = p->turn ? p->pwm : (int)(p->sign * p->pwm);
+            if (t0 + t + dt > p->t_accel + p->t_cruise) pwm = -pwm / 2;
+            // Exact travel over the step, however long it is (turns: degrees), as
+            // far off the profile as the chassis runs
+            double d = (profile_distance(p, t0 + t + dt) - profile_distance(p, t0 + t)) *
+                       (p->turn ? g_sim.config.turn_gain : g_sim.config.drive_gain);
+            double wheel_cm, chord_cm, yaw_step = 0;
+            if (p->turn) {
+                double radius = g_sim.config.turn_radius_cm;
+                wheel_cms = v * M_PI / 180.0 * radius;
+                yaw_rate = p->sign * v;
+                yaw_step = p->sign * d;
+                wheel_cm = d * M_PI / 180.0 * radius;
+                chord_cm = 2 * radius * sin(d * M_PI / 360.0);
+            } else {
+                wheel_cms = p->sign * v;
+                wheel_cm = chord_cm = p->sign * d;
+            }
+            double mid = (g_sim.yaw_deg + yaw_step / 2) * M_PI / 180.0; // The chord's direction
+            g_sim.x_cm += chord_cm * cos(mid);
+            g_sim.y_cm += chord_cm * sin(mid);
+            g_sim.yaw_deg += yaw_step;
+            double counts = wheel_cm / STM32_SIM_WHEEL_CIRCUMFERENCE_CM * STM32_SIM_COUNTS_PER_REV;
+            g_sim.enc_a += counts;
+            g_sim.enc_d += counts;
+        }
+        if (g_sim.config.telemetry_hz > 0) sim_telemetry(wheel_cms, yaw_rate, pwm);
+    }
+    return true;
+}
+
+typedef struct {
+    double x_cm, y_cm, yaw_deg;
+} SimPosition;
+
+// The firmware's pose fields for the modelled position. The model is exact, so
+// the standard deviations are 0. With start (a DONE) they also hold what the
+// command did since it started from start; with rest (SETTLED, SNAP) they end
+// in when the robot came to rest.
+static void sim_pose(char* out, size_t size, const SimPosition* start, bool rest) {
+    Stm32Pose pose = { .x_cm = (float)g_sim.x_cm, .y_cm = (float)g_sim.y_cm,
+                       .theta_deg = (float)(g_sim.yaw_deg - 360.0 * round(g_sim.yaw_deg / 360.0)) };
+    if (start) {
+        double heading = start->yaw_deg * M_PI / 180.0;
+        pose.has_achieved = true;
+        pose.achieved_cm = (float)((g_sim.x_cm - start->x_cm) * cos(heading) + (g_sim.y_cm - start->y_cm) * sin(heading));
+        pose.turned_deg = (float)(g_sim.yaw_deg - start->yaw_deg);
+    }
+    pose.has_rest = rest;
+    pose.rest_tick_ms = g_sim.rest_ms;
+    stm32_format_pose(&pose, out, size);
+}
+
+// Watchdog reset halfway through cmd: the queue and any route go, the pose
+// stays, and the firmware reports how much of cmd was left once it has booted.
+static void sim_reset(const SimCommand* cmd, const SimProfile* p, double motion_s) {
+    if (!sim_run(NULL, 0, g_sim.config.cooldown_ms / 1e3) || !sim_run(p, 0, motion_s / 2)) return;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.count = 0;
+    g_sim.credit_queued = 0;
+    g_sim.route_len = 0;
+    g_sim.progress_every = 0;
+    g_sim.progress_brake = false;
+    g_sim.credit = false;
+    pthread_mutex_unlock(&g_sim.lock);
+    if (!sim_run(NULL, 0, STM32_SIM_BOOT_MS / 1e3)) return;
+    bool resumable = cmd->opcode == STM32_OP_FWD || cmd->opcode == STM32_OP_REV || cmd->opcode == STM32_OP_TURNL ||
+                     cmd->opcode == STM32_OP_TURNR;
+    long remaining = resumable ? lround(cmd->value - profile_distance(p, motion_s / 2)) : -1;
+    LOG_INFO("[Sim] Resetting during command %u.\n", cmd->id);
+    sim_reply("!%u/RESET/%ld/WATCHDOG;\n", cmd->id, remaining);
+    sim_reply("!0/READY/%u;\n", (unsigned)STM32_SIM_BOOT_MS); // Nothing to wait for: the IMU state carried over
+}
+
+// The command runs into something halfway: the wheels stay driven without
+// turning until the stall detector gives up on it and drops the queue.
+static void sim_stall(const SimCommand* cmd, const SimProfile* p, double motion_s) {
+    if (!sim_run(NULL, 0, g_sim.config.cooldown_ms / 1e3) || !sim_run(p, 0, motion_s / 2) ||
+        !sim_run(NULL, 0, STM32_SIM_STALL_MS / 1e3)) {
+        return;
+    }
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.count = 0;
+    g_sim.credit_queued = 0;
+    g_sim.route_len = 0;
+    g_sim.left = 0;
+    pthread_mutex_unlock(&g_sim.lock);
+    char pose[80];
+    sim_pose(pose, sizeof(pose), NULL, false);
+    LOG_INFO("[Sim] Stalling during command %u.\n", cmd->id);
+    sim_reply("!%u/FAULT/STALL/%s;\n", cmd->id, pose);
+}
+
+// When p has covered distance, by bisection on profile_distance()
+static double profile_time(const SimProfile* p, double distance, double motion_s) {
+    double lo = 0, hi = motion_s;
+    for (int i = 0; i < 40; i++) {
+        double mid = (lo + hi) / 2;
+        if (profile_distance(p, mid) < distance) lo = mid;
+        else hi = mid;
+    }
+    return hi;
+}
+
+// Runs p for motion_s, stopping on the way for the PROGRESS events asked for
+// (stm32_protocol.h). Commands without a target send none. The ETAs are
+// exact, as the model knows the rest of the profile.
+static bool sim_drive(const SimCommand* cmd, const SimProfile* p, double motion_s, bool resumable) {
+    pthread_mutex_lock(&g_sim.lock);
+    int every = resumable ? g_sim.progress_every : 0;
+    bool brake = resumable && g_sim.progress_brake;
+    pthread_mutex_unlock(&g_sim.lock);
+    double total = profile_distance(p, motion_s);
+    double brake_t = brake && p->t_brake > 0 ? p->t_accel + p->t_cruise : -1;
+    int mark = every > 0 ? every : 100;
+    double t = 0;
+    for (;;) {
+        double mark_t = mark < 100 ? profile_time(p, total * mark / 100.0, motion_s) : motion_s;
+        bool braking = brake_t >= 0 && brake_t <= mark_t;
+        double next_t = braking ? brake_t : mark_t;
+        if (next_t >= motion_s) break;
+        if (!sim_run(p, t, next_t - t)) return false;
+        t = next_t;
+        long eta_ms = lround((motion_s - t) * 1000);
+        if (braking) {
+            brake_t = -1;
+            sim_reply("!%u/PROGRESS/BRAKE/%ld;\n", cmd->id, eta_ms);
+        } else {
+            sim_reply("!%u/PROGRESS/%d/%ld;\n", cmd->id, mark, eta_ms);
+            mark += every;
+        }
+    }
+    return sim_run(p, t, motion_s - t);
+}
+
+static void sim_execute(const SimCommand* cmd) {
+    char pose[80];
+    if (cmd->opcode == STM32_ROUTE_SNAP) {
+        sim_pose(pose, sizeof(pose), NULL, true);
+        sim_reply("!%u/SNAP/%s;\n", cmd->id, pose);
+        pthread_mutex_lock(&g_sim.lock);
+        g_sim.snap_id = cmd->id;
+        while (g_sim.resume_id != cmd->id && !g_sim.abort && !g_sim.stop) {
+            pthread_cond_wait(&g_sim.changed, &g_sim.lock);
+        }
+        g_sim.snap_id = 0;
+        pthread_mutex_unlock(&g_sim.lock);
+        return;
+    }
+    if (cmd->opcode == STM32_ROUTE_PASS) {
+        sim_pose(pose, sizeof(pose), NULL, false);
+        sim_reply("!%u/PASS/%s;\n", cmd->id, pose);
+        g_sim.passing = true;
+        return;
+    }
+    bool passing = g_sim.passing;
+    g_sim.passing = false;
+    SimProfile p;
+    if (profile_build(&g_sim.config, cmd->opcode, cmd->speed, cmd->value, &p) != 0) return; // Refused on receipt
+    double motion_s = p.t_accel + p.t_cruise + p.t_brake;
+    bool resumable = cmd->opcode == STM32_OP_FWD || cmd->opcode == STM32_OP_REV || cmd->opcode == STM32_OP_TURNL ||
+                     cmd->opcode == STM32_OP_TURNR;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.last_id = cmd->id;
+    g_sim.left = resumable ? cmd->value : -1;
+    pthread_mutex_unlock(&g_sim.lock);
+    if (++g_sim.motions == g_sim.config.reset_at) {
+        sim_reset(cmd, &p, motion_s);
+        return;
+    }
+    if (g_sim.motions == g_sim.config.stall_at) {
+        sim_stall(cmd, &p, motion_s);
+        return;
+    }
+    if (!passing && !sim_run(NULL, 0, g_sim.config.cooldown_ms / 1e3)) return;
+    SimPosition start = { g_sim.x_cm, g_sim.y_cm, g_sim.yaw_deg };
+    if (!sim_drive(cmd, &p, motion_s, resumable)) return;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.left = 0;
+    pthread_mutex_unlock(&g_sim.lock);
+    sim_pose(pose, sizeof(pose), &start, false);
+    sim_reply("!%u/DONE/%s;\n", cmd->id, pose);
+    pthread_mutex_lock(&g_sim.lock);
+    bool pass_next = g_sim.count > 0 && g_sim.queue[g_sim.head].opcode == STM32_ROUTE_PASS;
+    pthread_mutex_unlock(&g_sim.lock);
+    if (pass_next) return; // Driven straight through: no settle to wait for
+    g_sim.rest_ms = (uint32_t)(g_sim.virtual_ns / 1000000);
+    sim_pose(pose, sizeof(pose), NULL, true);
+    if (!sim_run(NULL, 0, g_sim.config.settle_ms / 1e3)) return;
+    sim_reply("!%u/SETTLED/%s;\n", cmd->id, pose);
+}
+
+static void* sim_executor_thread(void* args) {
+    (void)args;
+    pthread_mutex_lock(&g_sim.lock);
+    while (!g_sim.stop) {
+        if (g_sim.count == 0) {
+            if (g_sim.busy) {
+                g_sim.busy = false;
+                g_sim.idle_real_ns = latency_now_ns();
+            }
+            pthread_cond_wait(&g_sim.changed, &g_sim.lock);
+            continue;
+        }
+        if (!g_sim.busy) {
+            // The robot stood still for as long as the controller took to send this
+            g_sim.virtual_ns += latency_now_ns() - g_sim.idle_real_ns;
+            g_sim.busy = true;
+        }
+        SimCommand cmd = g_sim.queue[g_sim.head];
+        g_sim.head = (g_sim.head + 1) % STM32_SIM_QUEUE_SIZE;
+        g_sim.count--;
+        g_sim.abort = false;
+        bool report = cmd.credited && g_sim.credit;
+        if (cmd.credited) g_sim.credit_queued--;
+        uint32_t limit = g_sim.credit_last + (uint32_t)(STM32_SIM_CREDIT_DEPTH - g_sim.credit_queued);
+        pthread_mutex_unlock(&g_sim.lock);
+        if (report) sim_reply("!%u/CREDIT/%u;\n", cmd.id, limit); // As the firmware does on taking it off its queue
+        sim_execute(&cmd);
+        pthread_mutex_lock(&g_sim.lock);
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    return NULL;
+}
+
+// Queues commands for the executor. Returns -1 if they do not fit. Call with the lock.
+static int sim_enqueue(const SimCommand* cmds, int n) {
+    if (g_sim.count + n > STM32_SIM_QUEUE_SIZE) return -1;
+    for (int i = 0; i < n; i++) {
+        g_sim.queue[(g_sim.head + g_sim.count) % STM32_SIM_QUEUE_SIZE] = cmds[i];
+        g_sim.count++;
+    }
+    pthread_cond_broadcast(&g_sim.changed);
+    return 0;
+}
+
+static void sim_accept(uint32_t id, uint8_t opcode, int speed, int value) {
+    SimProfile p;
+    if (profile_build(&g_sim.config, opcode, speed, value, &p) != 0) {
+        sim_reply("!%u/ERROR/UNKNOWN_COMMAND;\n", id);
+        return;
+    }
+    SimCommand cmd = { .id = id, .opcode = opcode, .speed = speed, .value = value, .credited = true };
+    pthread_mutex_lock(&g_sim.lock);
+    // The queue here has room for a route; the firmware's has STM32_SIM_CREDIT_DEPTH
+    if (g_sim.credit && g_sim.credit_queued >= STM32_SIM_CREDIT_DEPTH) {
+        LOG_WARN("[Sim] Command %u sent beyond its credit.\n", id);
+    }
+    int queued = sim_enqueue(&cmd, 1);
+    if (queued == 0) {
+        g_sim.credit_queued++;
+        g_sim.credit_last = id;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    if (queued == 0) {
+        sim_reply("!%u/OK/MOTOR_CONTROL_SUCCESS;\n", id);
+    } else {
+        sim_reply("!%u/ERROR/QUEUE_FULL;\n", id);
+    }
+}
+
+static void sim_stop_motion(uint32_t id) {
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.count = 0;
+    g_sim.credit_queued = 0;
+    g_sim.route_len = 0;
+    g_sim.abort = true;
+    pthread_cond_broadcast(&g_sim.changed);
+    pthread_mutex_unlock(&g_sim.lock);
+    sim_reply("!%u/OK/MOTOR_CONTROL_SUCCESS;\n", id);
+    sim_reply("!%u/DONE;\n", id);
+}
+
+// STM32_ESTOP_BYTE: as STOP, but ahead of everything queued, and the reply
+// says what was cut short.
+static void sim_estop(void) {
+    pthread_mutex_lock(&g_sim.lock);
+    bool running = g_sim.busy;
+    g_sim.count = 0;
+    g_sim.credit_queued = 0;
+    g_sim.route_len = 0;
+    g_sim.abort = true;
+    uint32_t id = g_sim.last_id;
+    long left = !running ? 0 : g_sim.left < 0 ? -1 : lround(g_sim.left);
+    pthread_cond_broadcast(&g_sim.changed);
+    pthread_mutex_unlock(&g_sim.lock);
+    LOG_INFO("[Sim] Emergency stop during command %u.\n", id);
+    sim_reply("!%u/STOPPED/%ld;\n", id, left);
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Stores one ROUTE frame and starts the route once its last step is in.
+static void sim_route_frame(const uint8_t* frame, int len) {
+    uint32_t id = get_u16(&frame[3]);
+    uint32_t base_id = get_u16(&frame[5]);
+    int first = frame[7], total = frame[8];
+    int count = (len - 4 - STM32_ROUTE_HEADER_LEN) / 4;
+    if (g_sim.config.protocol != STM32_SIM_ROUTE || total > STM32_ROUTE_MAX_STEPS || first + count > total) {
+        sim_reply("!%u/ERROR/BAD_ROUTE;\n", id);
+        return;
+    }
+    pthread_mutex_lock(&g_sim.lock);
+    if (first == 0) g_sim.route_len = 0;
+    if (first != g_sim.route_len) {
+        pthread_mutex_unlock(&g_sim.lock);
+        sim_reply("!%u/ERROR/BAD_ROUTE;\n", id);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        const uint8_t* step = &frame[2 + STM32_ROUTE_HEADER_LEN + 4 * i];
+        g_sim.route[first + i] = (Stm32RouteStep){ .opcode = step[0], .speed = step[1], .dist_angle = get_u16(&step[2]) };
+    }
+    g_sim.route_len = first + count;
+    int queued = 0;
+    if (g_sim.route_len == total) {
+        SimCommand steps[STM32_ROUTE_MAX_STEPS];
+        for (int k = 0; k < total; k++) {
+            steps[k] = (SimCommand){ .id = base_id + (uint32_t)k, .opcode = g_sim.route[k].opcode,
+                                     .speed = g_sim.route[k].speed, .value = g_sim.route[k].dist_angle };
+        }
+        queued = sim_enqueue(steps, total);
+        g_sim.route_len = 0;
+    }
+    pthread_mutex_unlock(&g_sim.lock);
+    if (queued == 0) {
+        sim_reply("!%u/DONE;\n", id);
+    } else {
+        sim_reply("!%u/ERROR/QUEUE_FULL;\n", id);
+    }
+}
+
+// The sim has no UART or ISR to time, so every stage is 0
+#define SIM_PING_REPLY "!%u/OK/PING/0/0/0/0;\n"
+
+static void sim_binary_frame(const uint8_t* frame, int len) {
+    if (frame[2] == STM32_OP_ROUTE) {
+        sim_route_frame(frame, len);
+        return;
+    }
+    uint32_t id = get_u16(&frame[3]);
+    int speed = get_u16(&frame[5]);
+    int value = get_u16(&frame[7]);
+    if (frame[2] == STM32_OP_PING) {
+        sim_reply(SIM_PING_REPLY, id);
+    } else if (frame[2] == STM32_OP_RESUME) {
+        pthread_mutex_lock(&g_sim.lock);
+        g_sim.resume_id = id;
+        pthread_cond_broadcast(&g_sim.changed);
+        pthread_mutex_unlock(&g_sim.lock);
+    } else if (frame[2] == STM32_OP_STOP) {
+        sim_stop_motion(id);
+    } else {
+        sim_accept(id, frame[2], speed, value);
+    }
+}
+
+static void sim_ascii_message(const char* message) {
+    uint32_t id;
+    char group[16], verb[16];
+    int speed, value;
+    if (sscanf(message, ":%u/%15[^/]/%15[^/]/%d/%d", &id, group, verb, &speed, &value) != 5) {
+        LOG_DEBUG("[Sim] Ignoring '%s'.\n", message);
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "BINARY") == 0) {
+        if (g_sim.config.protocol == STM32_SIM_ROUTE) sim_reply("%s;\n", STM32_BINARY_PROBE_ROUTE_REPLY);
+        else if (g_sim.config.protocol == STM32_SIM_BINARY) sim_reply("%s;\n", STM32_BINARY_PROBE_REPLY);
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "HELLO") == 0 && g_sim.config.protocol != STM32_SIM_ASCII) {
+        // The ASCII sim stands for firmware from before HELLO, which rejects it
+        sim_reply("!%u/OK/HELLO/%d/%d/ASCII+BINARY/%sPOSE+RESET+ESTOP+PING+ACHIEVED+SYNC+PROGRESS+STALL+WHERE+CREDIT+READY%s/%d;\n", id,
+                  STM32_SIM_FIRMWARE_VERSION, STM32_LINK_VERSION, g_sim.config.protocol == STM32_SIM_ROUTE ? "ROUTE+PASS+" : "",
+                  g_sim.config.telemetry_hz > 0 ? "+TELEM" : "", STM32_SIM_MAX_BAUD);
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "PING") == 0) {
+        sim_reply(SIM_PING_REPLY, id);
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "SYNC") == 0) {
+        // The robot's clock. Faster than real time it runs ahead during each
+        // command, which clock_sync.h takes for a jump and starts over from.
+        uint64_t now_us = stm32_sim_clock_ns() / 1000;
+        sim_reply("!%u/OK/SYNC/%u/%u/%u;\n", id, (unsigned)now_us, (unsigned)now_us, (unsigned)(now_us / 1000));
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "WHERE") == 0) {
+        // The position is the executor's, so it is only settled while IDLE or SNAP
+        char pose[80];
+        pthread_mutex_lock(&g_sim.lock);
+        const char* state = g_sim.snap_id ? "SNAP" : g_sim.busy || g_sim.count > 0 ? "BUSY" : "IDLE";
+        uint32_t at = g_sim.snap_id ? g_sim.snap_id : g_sim.last_id;
+        sim_pose(pose, sizeof(pose), NULL, false);
+        pthread_mutex_unlock(&g_sim.lock);
+        sim_reply("!%u/OK/WHERE/%s/%u/%s;\n", id, state, at, pose);
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "PROGRESS") == 0) {
+        if (speed < 0 || speed > 99 || value < 0 || value > 1) {
+            sim_reply("!%u/ERROR/INVALID_PERCENT_PARAM_SHOULD_BE_INTEGER_0_TO_99;\n", id);
+            return;
+        }
+        pthread_mutex_lock(&g_sim.lock);
+        g_sim.progress_every = speed;
+        g_sim.progress_brake = value != 0;
+        pthread_mutex_unlock(&g_sim.lock);
+        sim_reply("!%u/OK/PROGRESS/%d/%d;\n", id, speed, value);
+        return;
+    }
+    if (strcmp(group, "GENERAL") == 0 && strcmp(verb, "CREDIT") == 0) {
+        pthread_mutex_lock(&g_sim.lock);
+        g_sim.credit = speed != 0;
+        pthread_mutex_unlock(&g_sim.lock);
+        sim_reply("!%u/OK/CREDIT/%d/%d;\n", id, speed != 0, STM32_SIM_CREDIT_DEPTH);
+        return;
+    }
+    static const struct { const char* verb; uint8_t opcode; } VERBS[] = {
+        { "FWD", STM32_OP_FWD }, { "BWD", STM32_OP_REV }, { "TURNL", STM32_OP_TURNL }, { "TURNR", STM32_OP_TURNR },
+    };
+    if (strcmp(group, "MOTOR") == 0 && strcmp(verb, "STOP") == 0) {
+        sim_stop_motion(id);
+        return;
+    }
+    for (size_t i = 0; strcmp(group, "MOTOR") == 0 && i < sizeof(VERBS) / sizeof(VERBS[0]); i++) {
+        if (strcmp(verb, VERBS[i].verb) == 0) {
+            sim_accept(id, VERBS[i].opcode, speed, value);
+            return;
+        }
+    }
+    sim_reply("!%u/ERROR/UNKNOWN_COMMAND;\n", id);
+}
+
+// Handles every complete frame at the start of buf; returns how many bytes it used.
+static size_t sim_dispatch(uint8_t* buf, size_t len) {
+    size_t used = 0;
+    while (used < len) {
+        uint8_t* p = buf + used;
+        size_t left = len - used;
+        if (p[0] == STM32_ESTOP_BYTE && g_sim.config.protocol != STM32_SIM_ASCII) {
+            sim_estop();
+            used++;
+            continue;
+        }
+        if (p[0] == STM32_FRAME_SYNC) {
+            if (left < 2) break;
+            size_t frame_len = (size_t)p[1] + 4;
+            if (frame_len < STM32_FRAME_LEN || frame_len > STM32_ROUTE_FRAME_MAX) {
+                used++; // Not a frame start
+                continue;
+            }
+            if (left < frame_len) break;
+            if (stm32_crc16(&p[1], frame_len - 3) != get_u16(&p[frame_len - 2])) {
+                sim_reply("!0/ERROR/BAD_FRAME_CRC;\n");
+            } else {
+                sim_binary_frame(p, (int)frame_len);
+            }
+            used += frame_len;
+            continue;
+        }
+        size_t end = 0;
+        while (end < left && p[end] != ';' && p[end] != STM32_FRAME_SYNC &&
+               !(p[end] == STM32_ESTOP_BYTE && g_sim.config.protocol != STM32_SIM_ASCII)) end++;
+        if (end == left) break;
+        if (p[end] == ';') {
+            p[end] = '\0';
+            const char* message = (const char*)p;
+            while (*message == '\r' || *message == '\n' || *message == ' ') message++;
+            if (*message) sim_ascii_message(message);
+            end++;
+        }
+        used += end; // An unterminated message before a frame or stop is dropped, as the firmware does
+    }
+    return used;
+}
+
+static void* sim_reader_thread(void* args) {
+    (void)args;
+    uint8_t buf[STM32_SIM_RX_BUFFER];
+    size_t len = 0;
+    for (;;) {
+        if (len == sizeof(buf)) len = 0; // Nothing in it parses; start over
+        ssize_t n = read(g_sim.fd, buf + len, sizeof(buf) - len);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        len += (size_t)n;
+        size_t used = sim_dispatch(buf, len);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+    }
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.stop = true; // The controller closed the link
+    pthread_cond_broadcast(&g_sim.changed);
+    pthread_mutex_unlock(&g_sim.lock);
+    return NULL;
+}
+
+int stm32_sim_start(const Stm32SimConfig* config, int* fd) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        perror("[Sim] socketpair failed");
+        return -1;
+    }
+    g_sim.config = *config;
+    g_sim.fd = fds[1];
+    g_sim.head = g_sim.count = g_sim.route_len = 0;
+    g_sim.resume_id = 0;
+    g_sim.abort = g_sim.stop = g_sim.busy = false;
+    g_sim.virtual_ns = 0;
+    g_sim.idle_real_ns = latency_now_ns();
+    g_sim.enc_a = g_sim.enc_d = g_sim.yaw_deg = g_sim.x_cm = g_sim.y_cm = 0;
+    g_sim.motions = 0;
+    g_sim.rest_ms = 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // latency_now_ns() deadlines
+    pthread_cond_init(&g_sim.changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&g_sim.executor, NULL, sim_executor_thread, NULL) != 0) {
+        LOG_ERROR("[Sim] Could not start the executor thread.\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pthread_create(&g_sim.reader, NULL, sim_reader_thread, NULL) != 0) {
+        LOG_ERROR("[Sim] Could not start the reader thread.\n");
+        pthread_mutex_lock(&g_sim.lock);
+        g_sim.stop = true;
+        pthread_cond_broadcast(&g_sim.changed);
+        pthread_mutex_unlock(&g_sim.lock);
+        pthread_join(g_sim.executor, NULL);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    g_sim.running = true;
+    *fd = fds[0];
+    if (config->speed > 0) {
+        LOG_INFO("[Sim] Simulated STM32 at %gx real time (%.0f cm/s, %.0f deg/s at full speed).\n", config->speed,
+                 config->max_speed_cms, config->turn_rate_dps);
+    } else {
+        LOG_INFO("[Sim] Simulated STM32 without waiting (%.0f cm/s, %.0f deg/s at full speed).\n",
+                 config->max_speed_cms, config->turn_rate_dps);
+    }
+    return 0;
+}
+
+void stm32_sim_stop(void) {
+    if (!g_sim.running) return;
+    pthread_mutex_lock(&g_sim.lock);
+    g_sim.stop = true;
+    pthread_cond_broadcast(&g_sim.changed);
+    pthread_mutex_unlock(&g_sim.lock);
+    shutdown(g_sim.fd, SHUT_RDWR); // Ends the reader's read()
+    pthread_join(g_sim.reader, NULL);
+    pthread_join(g_sim.executor, NULL);
+    close(g_sim.fd);
+    g_sim.fd = -1;
+    pthread_cond_destroy(&g_sim.changed);
+    g_sim.running = false;
+    LOG_INFO("[Sim] Stopped after %.3f s of robot time.\n", g_sim.virtual_ns / 1e9);
+}
+
+bool stm32_sim_running(void) {
+    return g_sim.running;
+}
+
+uint64_t stm32_sim_clock_ns(void) {
+    pthread_mutex_lock(&g_sim.lock);
+    uint64_t now_ns = g_sim.busy ? g_sim.virtual_ns : g_sim.virtual_ns + (latency_now_ns() - g_sim.idle_real_ns);
+    pthread_mutex_unlock(&g_sim.lock);
+    return now_ns;
+}
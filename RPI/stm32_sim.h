@@ -0,0 +1,106 @@
+#ifndef STM32_SIM_H
+#define STM32_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * @file stm32_sim.h
+ * @brief In-process STM32 stand-in with a kinematic model, for benchmarks and CI.
+ *
+ * Started with `--stm32-sim SPEC` (or built with USE_STM32_SIM), it replaces
+ * the serial link (or fake_stm.py's pipes) with one end of a socketpair. A
+ * reader thread and an executor thread speak the firmware's side of
+ * stm32_protocol.h: ASCII and binary motion commands, HELLO and the binary
+ * probe, PING, SYNC, PROGRESS events, CREDIT reports, READY after a reset,
+ * ROUTE uploads with SNAP/RESUME and PASS, STOP and the emergency stop byte.
+ * Replies are byte-for-byte what the stm32-motor firmware sends, so the
+ * reactor cannot tell the difference.
+ *
+ * Commands run in order from a queue, as on the firmware:
+ * - each one waits cooldown_ms, then drives a trapezoidal profile (accel up
+ *   to the commanded share of max_speed, cruise, brake to a stop);
+ * - turns use the same profile over the angle, with turn_rate and turn_accel;
+ * - DONE goes out at the stop and SETTLED settle_ms later, both (and SNAP)
+ *   with the modelled pose, DONE also with what the command did;
+ * - a motion followed by a PASS step sends no SETTLED, and the motion after
+ *   the PASS starts without the cooldown.
+ *
+ * Time is virtual. Robot motion advances the sim's clock by the modelled
+ * duration while the thread sleeps that long divided by speed. speed=1 is real
+ * time, speed=0 never sleeps. While the queue is empty the clock follows the
+ * real clock, so stm32_sim_clock_ns() measures a mission as modelled robot
+ * time plus the controller's real overheads.
+ *
+ * SPEC is a comma-separated list of key=value, e.g. "speed=0,accel=60":
+ * speed, max_speed (cm/s at 100 %), accel, brake (cm/s^2), turn_rate (deg/s at
+ * 100 %), turn_accel (deg/s^2), turn_radius (cm), cooldown_ms, settle_ms,
+ * telemetry (Hz of telemetry frames, 0 for none), protocol (ascii, binary
+ * or route), reset (the Nth motion command resets the "board" halfway
+ * through, which then reports RESET as the firmware does; 0 for never), stall
+ * (the Nth motion command stops halfway and reports FAULT/STALL; 0 for never),
+ * and
+ * drive_gain and turn_gain (how far the chassis really goes per cm or degree
+ * of the profile, e.g. 1.05 for a 5 % overshoot; the pose sees it, as the
+ * firmware's odometry does).
+ * "default" takes the STM32_SIM_DEFAULT_* values.
+ */
+
+#define STM32_SIM_DEFAULT_SPEED 0.0
+#define STM32_SIM_DEFAULT_MAX_SPEED_CMS 25.0
+#define STM32_SIM_DEFAULT_ACCEL_CMS2 50.0
+#define STM32_SIM_DEFAULT_BRAKE_CMS2 80.0
+#define STM32_SIM_DEFAULT_TURN_RATE_DPS 50.0
+#define STM32_SIM_DEFAULT_TURN_ACCEL_DPS2 120.0
+#define STM32_SIM_DEFAULT_TURN_RADIUS_CM 25.0
+#define STM32_SIM_DEFAULT_COOLDOWN_MS 300.0
+#define STM32_SIM_DEFAULT_SETTLE_MS 200.0
+#define STM32_SIM_BOOT_MS 50.0 // From a reset to the RESET reply
+#define STM32_SIM_STALL_MS 300.0 // Driven without moving before FAULT/STALL, as the firmware's STALL_MS
+#define STM32_SIM_FIRMWARE_VERSION 6 // Reported by HELLO, as stm32-motor
+#define STM32_SIM_MAX_BAUD 1000000
+#define STM32_SIM_QUEUE_SIZE 256 // Covers a full route plus queued commands
+#define STM32_SIM_CREDIT_DEPTH 2 // Queue room GENERAL/CREDIT reports, as stm32-motor's MOTOR_COMMAND_QUEUE_LEN
+
+typedef enum {
+    STM32_SIM_ASCII,  // Rejects HELLO and ignores the binary probe
+    STM32_SIM_BINARY, // Binary frames, no route executor
+    STM32_SIM_ROUTE   // Binary frames and ROUTE uploads
+} Stm32SimProtocol;
+
+typedef struct {
+    double speed;
+    double max_speed_cms;
+    double accel_cms2;
+    double brake_cms2;
+    double turn_rate_dps;
+    double turn_accel_dps2;
+    double turn_radius_cm;
+    double cooldown_ms;
+    double settle_ms;
+    double telemetry_hz;
+    int reset_at; // 1-based motion command cut short by a watchdog reset, 0 for none
+    int stall_at; // 1-based motion command that stalls halfway, 0 for none
+    double drive_gain, turn_gain; // Travel per cm or degree profiled, 1 exact
+    Stm32SimProtocol protocol;
+} Stm32SimConfig;
+
+// Fills config from spec on top of the defaults. Returns 0, or -1 on an unknown
+// key or a bad value.
+int stm32_sim_parse(const char* spec, Stm32SimConfig* config);
+
+// Modelled time for one command (opcode from stm32_protocol.h, speed in %,
+// value in cm or degrees), from the start of its cooldown to DONE. Returns -1
+// for an opcode the sim does not execute.
+int64_t stm32_sim_command_ns(const Stm32SimConfig* config, int opcode, int speed, int value);
+
+// Starts the sim and sets *fd to the controller's end of the link. Returns 0 or -1.
+int stm32_sim_start(const Stm32SimConfig* config, int* fd);
+// Stops both threads and closes the sim's end. Safe to call when it never started.
+void stm32_sim_stop(void);
+bool stm32_sim_running(void);
+
+// The sim's virtual clock, which starts at 0.
+uint64_t stm32_sim_clock_ns(void);
+
+#endif // STM32_SIM_H
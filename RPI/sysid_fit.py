@@ -0,0 +1,416 @@
+"""
+Identifies the MDP drive and steering and suggests gains for them.
+
+The firmware's SYSID command runs an open-loop test sequence (see the System
+identification section of STM/MDP/Core/Src/main.c): a step or a chirp of duty
+on one wheel, or of the servo with both wheels driving. This runs the
+sequences on the robot, fetches each one's motion trace and fits a
+first-order-plus-dead-time (FOPDT) model to it:
+
+    wheel   tau * dv/dt = K * max(u(t - theta) - u0, 0) - v    (v cm/s, u duty)
+    steer   tau * dr/dt = Kd * d(t - theta) - r                (r dps, d servo deg)
+
+    python3 sysid_fit.py --device /dev/ttyUSB0 -o sysid/         # ~2 m of floor, ahead
+    python3 sysid_fit.py sysid/*.csv                             # refit saved runs
+    python3 sysid_fit.py --device /dev/ttyUSB0 --apply --save    # and write the gains
+
+The steps give the gain, deadband and time constants (two plateaus, then
+Smith's 28/63 % points refined by least squares); the chirps are simulated
+through the fitted model as a check, and a fit that explains little of a
+chirp is flagged. Gains follow the SIMC rules for the closed-loop time
+constant tc (--tc-ms, default the loop's effective dead time), where the
+effective dead time adds the control period's sample-and-hold, half the
+encoder window and the speed filter's lag to the fitted one:
+
+    VKP = tau / (K (tc + theta))        VKI = VKP / min(tau, 4 (tc + theta))
+    HKS = 1 / (Kd(v) (tc + theta))      HH_KD_STEER = HKS * tau_s
+
+Kd grows with speed, so HKS is worked out per gain-schedule row at the row's
+speed. DKP/DKI (the loop used with VP_ENABLE 0) come from the same wheel
+model in rps. The VP_PWM_* feedforward line and the wheel bias are printed
+as suggestions for main.c and CAL; the deadband is printed next to TMIN for
+comparison. --apply sends the PARAM and CAL lines, --save stores them.
+
+Every sequence drives the robot forward: give it a clear straight run.
+"""
+import argparse
+import csv
+import math
+import os
+import sys
+import time
+from collections import defaultdict
+
+from mtrace_dump import MDP_BAUD, read_dump, write_csv
+
+# STM/MDP/Core/Src/main.c
+CM_PER_COUNT = math.pi * 6.50 / 1560.0      # WHEEL_DIAMETER_CM, COUNTS_PER_REV
+WHEEL_CIRC_CM = math.pi * 6.50
+US_PER_SERVO_DEG = 600.0 / 36.0             # steer_deg_to_pulse()
+MC_PERIOD_MS = 50
+ENC_WINDOW_MS = 20                          # ENC_SAMPLE_US
+SPEED_FILTER_LAG_MS = 56                    # MotorCtl_Step's RPFC low-pass, sqrt(2) / (2 pi fc) at 4 Hz
+GS_SPEEDS = (30.0, 60.0, 90.0)              # GS_DEFAULT_ROW speeds
+CRUISE_CMS = 60.0                           # VP_CRUISE_CMS, where the bias is matched
+TURN_PWM_MIN = 4250
+SYSID_WHEEL_PWM = 3000
+SYSID_STEER_PWM = 3000
+TARGETS = "ADS"
+SEQS = ("STEP", "CHIRP")
+# STEP edges, ms into the sequence
+WHEEL_STEP_ON, WHEEL_STEP_HALF, WHEEL_STEP_OFF = 100, 900, 1500
+STEER_STEP_ON, STEER_STEP_OFF = 400, 1100
+SPEED_HALF_WINDOW = ENC_WINDOW_MS // 2
+MIN_CHIRP_R2 = 0.7
+SEQUENCE_TIMEOUT_SECONDS = 5.0
+
+
+def counts_delta(now, before):
+    d = (now - before) & 0xFFFF
+    return d - 0x10000 if d > 0x8000 else d
+
+
+def read_runs(paths):
+    """Returns [(source, target, seq, amp, rows)] of the SYSID records in mtrace_dump.py CSVs."""
+    runs = []
+    for path in paths:
+        by_move = defaultdict(list)
+        with open(path, newline="") as f:
+            for row in csv.DictReader(f):
+                by_move[int(row["move"])].append(row)
+        for move in sorted(by_move):
+            rows = sorted(by_move[move], key=lambda r: int(r["sample"]))
+            if rows[0]["op"] != "SYSID":
+                continue
+            arg = int(rows[0]["arg"])
+            kind, amp = arg >> 16, arg & 0xFFFF
+            if kind >= len(TARGETS) * 2:
+                continue
+            runs.append((f"{path}#{move}", TARGETS[kind // 2], SEQS[kind % 2], amp, rows))
+    return runs
+
+
+def wheel_signal(rows, side):
+    """(duty, speed cm/s) per ms of one wheel; the speed is over a centred ENC_WINDOW_MS."""
+    key = "cnt_a" if side == "A" else "cnt_d"
+    pos, p = [0], 0
+    for k in range(1, len(rows)):
+        p += counts_delta(int(rows[k][key]), int(rows[k - 1][key]))
+        pos.append(p)
+    sign = -1.0 if pos[-1] < 0 else 1.0   # Whichever way the encoder counts forward
+    n, w = len(rows), SPEED_HALF_WINDOW
+    speed = []
+    for k in range(n):
+        lo, hi = max(k - w, 0), min(k + w, n - 1)
+        speed.append(sign * (pos[hi] - pos[lo]) * CM_PER_COUNT * 1000.0 / max(hi - lo, 1))
+    duty = [abs(int(r["pwm_a" if side == "A" else "pwm_d"])) for r in rows]
+    return duty, speed
+
+
+def steer_signal(rows):
+    """(servo deg left of centre, yaw rate dps, mean wheel speed cm/s) per ms."""
+    centre = int(rows[0]["servo_us"])
+    steer = [(centre - int(r["servo_us"])) / US_PER_SERVO_DEG for r in rows]
+    yaw, turned = [0.0], 0.0
+    for k in range(1, len(rows)):
+        d = float(rows[k]["yaw_deg"]) - float(rows[k - 1]["yaw_deg"])
+        turned += (d + 180.0) % 360.0 - 180.0
+        yaw.append(turned)
+    n, w = len(rows), SPEED_HALF_WINDOW
+    rate = []
+    for k in range(n):
+        lo, hi = max(k - w, 0), min(k + w, n - 1)
+        rate.append((yaw[hi] - yaw[lo]) * 1000.0 / max(hi - lo, 1))
+    _, va = wheel_signal(rows, "A")
+    _, vd = wheel_signal(rows, "D")
+    return steer, rate, [(a + d) / 2 for a, d in zip(va, vd)]
+
+
+def mean(values):
+    return sum(values) / len(values) if values else 0.0
+
+
+def simulate(u, tau, theta, gain, u0, y0=0.0, floor=True):
+    """Euler-steps tau * y' = gain * (u(t - theta) - u0) - y at 1 ms; u is per ms."""
+    y, out, lag = y0, [], int(round(theta))
+    for k in range(len(u)):
+        x = u[k - lag] if k >= lag else u[0]
+        drive = gain * (max(x - u0, 0.0) if floor else x - u0)
+        y += (drive - y) / max(tau, 1.0)
+        out.append(y)
+    return out
+
+
+def sse(y, model, lo=0, hi=None):
+    hi = len(y) if hi is None else hi
+    return sum((a - b) ** 2 for a, b in zip(y[lo:hi], model[lo:hi]))
+
+
+def r_squared(y, model, lo=0):
+    m = mean(y[lo:])
+    total = sum((a - m) ** 2 for a in y[lo:])
+    return 1.0 - sse(y, model, lo) / total if total > 0 else 0.0
+
+
+def smith(y, t_on, y_from, y_to):
+    """Smith's method on the edge at t_on: (tau, theta) in ms, or None without a response."""
+    span = y_to - y_from
+    if abs(span) < 1e-6:
+        return None
+    t28 = t63 = None
+    for k in range(t_on, len(y)):
+        f = (y[k] - y_from) / span
+        if t28 is None and f >= 0.283:
+            t28 = k - t_on
+        if f >= 0.632:
+            t63 = k - t_on
+            break
+    if t28 is None or t63 is None:
+        return None
+    tau = max(1.5 * (t63 - t28), 1.0)
+    return tau, max(t63 - tau, 0.0)
+
+
+def refine(y, u, tau, theta, gain, u0, floor, lo=0, hi=None):
+    """Least-squares (tau, theta) about the Smith estimates, gain and u0 held."""
+    best = (sse(y, simulate(u, tau, theta, gain, u0, floor=floor), lo, hi), tau, theta)
+    step_tau, step_theta = max(tau / 4, 2.0), max(theta / 2, 4.0)
+    while step_tau >= 1.0 or step_theta >= 1.0:
+        improved = False
+        _, t0, d0 = best
+        for dt, dd in ((step_tau, 0), (-step_tau, 0), (0, step_theta), (0, -step_theta)):
+            t, d = t0 + dt, d0 + dd
+            if t < 1.0 or d < 0.0:
+                continue
+            e = sse(y, simulate(u, t, d, gain, u0, floor=floor), lo, hi)
+            if e < best[0]:
+                best, improved = (e, t, d), True
+        if not improved:
+            step_tau, step_theta = step_tau / 2, step_theta / 2
+    return best[1], best[2]
+
+
+def fit_wheel_step(duty, speed):
+    """{K, u0, tau, theta} from a wheel STEP, or None. K is cm/s per duty as applied."""
+    u1 = mean(duty[WHEEL_STEP_ON + 300:WHEEL_STEP_HALF])
+    u2 = mean(duty[WHEEL_STEP_HALF + 300:WHEEL_STEP_OFF])
+    v1 = mean(speed[WHEEL_STEP_HALF - 300:WHEEL_STEP_HALF - SPEED_HALF_WINDOW])
+    v2 = mean(speed[WHEEL_STEP_OFF - 200:WHEEL_STEP_OFF - SPEED_HALF_WINDOW])
+    if u1 <= u2 or v1 <= v2 or v1 <= 0:
+        return None
+    gain = (v1 - v2) / (u1 - u2)
+    u0 = u1 - v1 / gain
+    first = smith(speed, WHEEL_STEP_ON, 0.0, v1)
+    if first is None:
+        return None
+    tau, theta = refine(speed, duty, first[0], first[1], gain, u0, True, 0, WHEEL_STEP_OFF)
+    return {"K": gain, "u0": u0, "tau": tau, "theta": theta}
+
+
+def fit_steer_step(steer, rate):
+    """{Kd, tau, theta, r0} from a steer STEP, or None. Kd is dps per servo deg."""
+    r0 = mean(rate[STEER_STEP_ON - 200:STEER_STEP_ON - SPEED_HALF_WINDOW])
+    d1 = mean(steer[STEER_STEP_ON + 100:STEER_STEP_OFF])
+    r1 = mean(rate[STEER_STEP_OFF - 300:STEER_STEP_OFF - SPEED_HALF_WINDOW])
+    if abs(d1) < 1e-3 or abs(r1 - r0) < 1.0:
+        return None
+    gain = (r1 - r0) / d1
+    first = smith(rate, STEER_STEP_ON, r0, r1)
+    if first is None:
+        return None
+    # Referenced to the drift before the step, as an offset on the input
+    u0 = -r0 / gain
+    tau, theta = refine(rate, steer, first[0], first[1], gain, u0, False,
+                        STEER_STEP_ON - 200, STEER_STEP_OFF)
+    return {"Kd": gain, "tau": tau, "theta": theta, "r0": r0}
+
+
+def identify(runs, out):
+    wheels, steers, checks = defaultdict(list), [], []
+    for source, target, seq, amp, rows in runs:
+        if target in "AD":
+            duty, speed = wheel_signal(rows, target)
+            if seq == "CHIRP":
+                checks.append((source, target, duty, speed))
+                continue
+            m = fit_wheel_step(duty, speed)
+            if m is None:
+                print(f"{source}: wheel {target} step shows no usable response; left out", file=out)
+                continue
+            # Battery scaling, so gains come out in the duty the controllers command
+            on = [d for d in duty[WHEEL_STEP_ON + 300:WHEEL_STEP_HALF]]
+            m["scale"] = mean(on) / amp if amp else 1.0
+            wheels[target].append(m)
+            print(f"{source}: wheel {target} K {m['K'] * 1000:.2f} cm/s per 1000 duty, deadband "
+                  f"{m['u0']:.0f}, tau {m['tau']:.0f} ms, theta {m['theta']:.0f} ms, "
+                  f"battery x{m['scale']:.3f}", file=out)
+        else:
+            steer, rate, speed = steer_signal(rows)
+            if seq == "CHIRP":
+                checks.append((source, "S", steer, rate))
+                continue
+            m = fit_steer_step(steer, rate)
+            if m is None:
+                print(f"{source}: steering step shows no usable response; left out", file=out)
+                continue
+            m["v"] = mean(speed[STEER_STEP_ON - 200:STEER_STEP_OFF])
+            steers.append(m)
+            print(f"{source}: steer Kd {m['Kd']:.2f} dps per deg at {m['v']:.1f} cm/s, "
+                  f"tau {m['tau']:.0f} ms, theta {m['theta']:.0f} ms", file=out)
+
+    models = {}
+    for side, fits in wheels.items():
+        models[side] = {k: mean([f[k] for f in fits]) for k in fits[0]}
+    if steers:
+        models["S"] = {k: mean([f[k] for f in steers]) for k in steers[0]}
+        models["S"]["Kd_per_cms"] = mean([f["Kd"] / f["v"] for f in steers if f["v"] > 0])
+
+    for source, target, u, y in checks:
+        m = models.get(target)
+        if m is None:
+            print(f"{source}: no {target} step fit to check the chirp against", file=out)
+            continue
+        if target == "S":
+            model = simulate(u, m["tau"], m["theta"], m["Kd"], -m["r0"] / m["Kd"], y[0], False)
+            lo = STEER_STEP_ON
+        else:
+            model = simulate(u, m["tau"], m["theta"], m["K"], m["u0"])
+            lo = WHEEL_STEP_ON
+        r2 = r_squared(y, model, lo)
+        note = "" if r2 >= MIN_CHIRP_R2 else " (poor: the plant is not first-order here; treat the gains with care)"
+        print(f"{source}: {target} chirp R^2 {r2:.2f} against the step fit{note}", file=out)
+    return models
+
+
+def tune(models, tc_ms, out):
+    """Returns [(command, ...)] PARAM/CAL lines and prints the suggestions."""
+    lines = []
+    loop_lag = MC_PERIOD_MS / 2 + ENC_WINDOW_MS / 2 + SPEED_FILTER_LAG_MS
+    wheels = [models[s] for s in "AD" if s in models]
+    if wheels:
+        # Controllers command pre-scaling duty: K per commanded duty is K * scale
+        gain = mean([w["K"] * w["scale"] for w in wheels])
+        tau = mean([w["tau"] for w in wheels])
+        theta = mean([w["theta"] for w in wheels]) + loop_lag
+        tc = tc_ms if tc_ms is not None else theta
+        vkp = tau / (gain * (tc + theta))
+        vki = vkp / (min(tau, 4 * (tc + theta)) / 1000.0)
+        gain_rps = gain / WHEEL_CIRC_CM
+        dkp = tau / (gain_rps * (tc + theta))
+        dki = dkp / (min(tau, 4 * (tc + theta)) / 1000.0)
+        print(f"wheel loop: effective dead time {theta:.0f} ms, tc {tc:.0f} ms -> VKP {vkp:.1f}, "
+              f"VKI {vki:.1f}; DKP {dkp:.0f}, DKI {dki:.0f} (used with VP_ENABLE 0)", file=out)
+        for row in range(len(GS_SPEEDS)):
+            lines += [f"PARAM VKP {row} {vkp:.2f}", f"PARAM VKI {row} {vki:.2f}",
+                      f"PARAM DKP {row} {dkp:.1f}", f"PARAM DKI {row} {dki:.1f}"]
+
+        u0 = {s: models[s]["u0"] / models[s]["scale"] for s in "AD" if s in models}
+        per_cms = {s: 1.0 / (models[s]["K"] * models[s]["scale"]) for s in "AD" if s in models}
+        static = mean(list(u0.values()))
+        slope = mean(list(per_cms.values()))
+        print(f"feedforward: VP_PWM_STATIC {static:.0f}, VP_PWM_PER_CMS {slope:.1f} "
+              f"(main.c #defines)", file=out)
+        print(f"deadband {static:.0f} duty commanded; TMIN is {TURN_PWM_MIN}", file=out)
+        if len(u0) == 2:
+            at = {s: u0[s] + per_cms[s] * CRUISE_CMS for s in u0}
+            centre = mean(list(at.values()))
+            # + makes that wheel faster: a wheel that needs more duty gets it added
+            lines += [f"CAL BIASA {at['A'] - centre:.0f}", f"CAL BIASD {at['D'] - centre:.0f}"]
+            print(f"wheel bias at {CRUISE_CMS:.0f} cm/s: A {at['A'] - centre:+.0f}, "
+                  f"D {at['D'] - centre:+.0f}", file=out)
+
+    if "S" in models:
+        s = models["S"]
+        theta = s["theta"] + MC_PERIOD_MS / 2
+        tc = tc_ms if tc_ms is not None else theta
+        for row, v in enumerate(GS_SPEEDS):
+            kd = s["Kd_per_cms"] * v
+            if kd <= 0:
+                continue
+            hks = 1.0 / (kd * (tc + theta) / 1000.0)
+            lines.append(f"PARAM HKS {row} {hks:.3f}")
+            print(f"heading loop at {v:.0f} cm/s: Kd {kd:.2f} dps per deg, tc {tc:.0f} ms -> "
+                  f"HKS {hks:.2f}, HH_KD_STEER {hks * s['tau'] / 1000.0:.3f}", file=out)
+    return lines
+
+
+def send_line(port, line, expect):
+    """Writes one command line; returns the reply line starting with expect, or raises."""
+    port.reset_input_buffer()
+    port.write((line + "\n").encode("ascii"))
+    deadline = time.monotonic() + SEQUENCE_TIMEOUT_SECONDS
+    buf = b""
+    while time.monotonic() < deadline:
+        buf += port.read(port.in_waiting or 1)
+        while b"\n" in buf:
+            raw, buf = buf.split(b"\n", 1)
+            text = raw.decode("ascii", errors="replace").strip()
+            if text.startswith(expect):
+                return text
+            if text.startswith("ERR") or text.startswith("STOPPED"):
+                raise RuntimeError(f"{line}: {text}")
+    raise TimeoutError(f"{line}: no {expect}")
+
+
+def run_sequences(port, out_dir, skip_steer):
+    """Runs every sequence and returns the mtrace_dump.py CSV paths."""
+    paths = []
+    os.makedirs(out_dir, exist_ok=True)
+    for target in ("AD" if skip_steer else TARGETS):
+        for seq in SEQS:
+            print(f"SYSID {target} {seq} ...", file=sys.stderr)
+            send_line(port, f"SYSID {target} {seq}", "DONE SYSID")
+            time.sleep(0.3)  # Past the trace's tail
+            headers, samples = read_dump(port, 1)
+            path = os.path.join(out_dir, f"sysid_{target}_{seq.lower()}.csv")
+            with open(path, "w", newline="") as f:
+                write_csv(f, headers, samples)
+            paths.append(path)
+    return paths
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("traces", nargs="*", help="mtrace_dump.py CSVs of SYSID runs to fit")
+    parser.add_argument("--device", help="MDP USART3 serial device: run the sequences first")
+    parser.add_argument("--baud", type=int, default=MDP_BAUD)
+    parser.add_argument("-o", "--output-dir", default=".", help="where --device saves the traces")
+    parser.add_argument("--skip-steer", action="store_true", help="wheel sequences only")
+    parser.add_argument("--tc-ms", type=float, help="closed-loop time constant (default: the dead time)")
+    parser.add_argument("--apply", action="store_true", help="send the PARAM and CAL lines (needs --device)")
+    parser.add_argument("--save", action="store_true", help="and PARAM SAVE / CAL SAVE them")
+    args = parser.parse_args()
+
+    if not args.traces and not args.device:
+        parser.error("give SYSID traces or --device")
+    if args.apply and not args.device:
+        parser.error("--apply needs --device")
+
+    port = None
+    paths = list(args.traces)
+    if args.device:
+        import serial
+        port = serial.Serial(args.device, args.baud, timeout=0.1)
+        paths += run_sequences(port, args.output_dir, args.skip_steer)
+
+    runs = read_runs(paths)
+    if not runs:
+        print("no SYSID records in the traces", file=sys.stderr)
+        sys.exit(1)
+    lines = tune(identify(runs, sys.stderr), args.tc_ms, sys.stderr)
+    for line in lines:
+        print(line)
+
+    if args.apply and lines:
+        for line in lines:
+            send_line(port, line, "ACK " + line.split()[0])
+        if args.save:
+            for kind in sorted({line.split()[0] for line in lines}):
+                send_line(port, f"{kind} SAVE", f"ACK {kind} SAVE")
+        print(f"applied {len(lines)} settings{' and saved them' if args.save else ''}", file=sys.stderr)
+    if port:
+        port.close()
+
+
+if __name__ == "__main__":
+    main()
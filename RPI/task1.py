@@ -11,6 +11,7 @@ from picamera import PiCamera
 SERIAL_PORT_STM32 =  "/dev/ttyACM0"
 SERIAL_PORT_ANDROID = "/dev/rfcomm0"
 BAUD_RATE = 115200
+STM32_BAUD_RATE = 1000000  # Must match MX_USART3_UART_Init on the STM32
 SERVER_URL_IMAGE = "http://192.168.22.21:5000/detect"
 SERVER_URL_COORDINATES = "http://192.168.7.230:4000/path"
 TIMEOUT = 60  # HTTP request timeout in seconds
@@ -387,7 +388,7 @@ def main():
     """Main execution loop"""
     # Initialize serial connection
     print(f"Opening serial port: {SERIAL_PORT_STM32}")
-    ser_stm32 = serial.Serial(SERIAL_PORT_STM32, BAUD_RATE, timeout=1)
+    ser_stm32 = serial.Serial(SERIAL_PORT_STM32, STM32_BAUD_RATE, timeout=1)
 
     print(f"Opening Android Serial Port: {SERIAL_PORT_ANDROID}")
     ser_android = serial.Serial(SERIAL_PORT_ANDROID, BAUD_RATE, timeout=1)
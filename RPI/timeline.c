@@ -0,0 +1,294 @@
+#include "timeline.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock_sync.h"
+#include "latency_stats.h" // For latency_now_ns()
+#include "logger.h"
+
+#define TIMELINE_MAX_THREADS 64
+#define TIMELINE_PID_PI 1
+#define TIMELINE_PID_STM32 2
+// Below these the chassis counts as still (telemetry)
+#define TIMELINE_STILL_RPS 0.02f
+#define TIMELINE_STILL_DPS 1.0f
+
+typedef struct {
+    atomic_bool ready; // Set once the rest is filled in
+    char phase;        // 'X' (span) or 'i' (instant)
+    uint8_t pid;
+    uint8_t tid;
+    uint64_t ts_ns;
+    uint64_t dur_ns;
+    char label[TIMELINE_LABEL_MAX];
+} TimelineEvent;
+
+static atomic_bool g_enabled;
+static TimelineEvent* g_events;
+static atomic_uint g_count; // Claimed slots; may run past TIMELINE_MAX_EVENTS
+static const char* g_path;
+static uint64_t g_origin_ns;
+static pthread_mutex_t g_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char g_thread_names[TIMELINE_MAX_THREADS][TIMELINE_LABEL_MAX];
+static atomic_uint g_thread_count;
+static pthread_mutex_t g_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local int t_track = -1;
+
+static const char* TIMELINE_STM32_TRACK_NAMES[TIMELINE_STM32_TRACKS] = {"commands", "replies", "motion"};
+
+// Telemetry-derived motion state. Reactor only.
+static struct {
+    bool synced;
+    int64_t offset_ns; // Pi time - tick time, smallest seen
+    bool driving;
+    bool brake_seen;
+    bool settling;
+    uint64_t drive_start_ns;
+    uint64_t stop_ns;
+} g_motion;
+
+// Where board tick 0 falls on the Pi's clock, from the latest telemetry mapping
+static atomic_llong g_tick0_ns;
+static atomic_bool g_tick0_known;
+
+bool timeline_enabled(void) {
+    return atomic_load_explicit(&g_enabled, memory_order_relaxed);
+}
+
+int timeline_open(const char* path) {
+    g_events = calloc(TIMELINE_MAX_EVENTS, sizeof(TimelineEvent));
+    if (!g_events) {
+        LOG_ERROR("[Timeline] Out of memory for %d events.\n", TIMELINE_MAX_EVENTS);
+        return -1;
+    }
+    FILE* f = fopen(path, "w"); // Fail now rather than at the end of the first mission
+    if (!f) {
+        LOG_ERROR("[Timeline] Cannot create %s: %s\n", path, strerror(errno));
+        free(g_events);
+        g_events = NULL;
+        return -1;
+    }
+    fclose(f);
+    g_path = path;
+    g_origin_ns = latency_now_ns();
+    atomic_store(&g_enabled, true);
+    return 0;
+}
+
+void timeline_close(void) {
+    if (!timeline_enabled()) return;
+    timeline_write();
+    atomic_store(&g_enabled, false);
+    // Threads still running may be mid-record, so the buffer is left to process exit
+}
+
+static int timeline_track(void) {
+    if (t_track < 0) {
+        unsigned index = atomic_fetch_add(&g_thread_count, 1);
+        if (index >= TIMELINE_MAX_THREADS) {
+            atomic_fetch_sub(&g_thread_count, 1);
+            return TIMELINE_MAX_THREADS - 1; // Shares the last track
+        }
+        t_track = (int)index;
+    }
+    return t_track;
+}
+
+void timeline_thread(const char* name) {
+    if (!timeline_enabled()) return;
+    pthread_mutex_lock(&g_thread_lock);
+    // Threads started once per mission come back to the same track
+    unsigned count = atomic_load(&g_thread_count);
+    for (unsigned i = 0; i < count; i++) {
+        if (strncmp(g_thread_names[i], name, TIMELINE_LABEL_MAX - 1) == 0) {
+            t_track = (int)i;
+            pthread_mutex_unlock(&g_thread_lock);
+            return;
+        }
+    }
+    snprintf(g_thread_names[timeline_track()], TIMELINE_LABEL_MAX, "%s", name);
+    pthread_mutex_unlock(&g_thread_lock);
+}
+
+static void timeline_record(char phase, uint8_t pid, uint8_t tid, uint64_t ts_ns, uint64_t dur_ns,
+                            const char* format, va_list args) {
+    unsigned index = atomic_fetch_add_explicit(&g_count, 1, memory_order_relaxed);
+    if (index >= TIMELINE_MAX_EVENTS) return;
+    TimelineEvent* e = &g_events[index];
+    e->phase = phase;
+    e->pid = pid;
+    e->tid = tid;
+    e->ts_ns = ts_ns;
+    e->dur_ns = dur_ns;
+    vsnprintf(e->label, sizeof(e->label), format, args);
+    atomic_store_explicit(&e->ready, true, memory_order_release);
+}
+
+void timeline_span(uint64_t start_ns, uint64_t end_ns, const char* format, ...) {
+    if (!timeline_enabled()) return;
+    va_list args;
+    va_start(args, format);
+    timeline_record('X', TIMELINE_PID_PI, (uint8_t)timeline_track(), start_ns,
+                    end_ns > start_ns ? end_ns - start_ns : 0, format, args);
+    va_end(args);
+}
+
+void timeline_instant(uint64_t ts_ns, const char* format, ...) {
+    if (!timeline_enabled()) return;
+    va_list args;
+    va_start(args, format);
+    timeline_record('i', TIMELINE_PID_PI, (uint8_t)timeline_track(), ts_ns, 0, format, args);
+    va_end(args);
+}
+
+void timeline_stm32_span(TimelineStm32Track track, uint64_t start_ns, uint64_t end_ns, const char* format, ...) {
+    if (!timeline_enabled()) return;
+    va_list args;
+    va_start(args, format);
+    timeline_record('X', TIMELINE_PID_STM32, (uint8_t)track, start_ns, end_ns > start_ns ? end_ns - start_ns : 0,
+                    format, args);
+    va_end(args);
+}
+
+void timeline_stm32_instant(TimelineStm32Track track, uint64_t ts_ns, const char* format, ...) {
+    if (!timeline_enabled()) return;
+    va_list args;
+    va_start(args, format);
+    timeline_record('i', TIMELINE_PID_STM32, (uint8_t)track, ts_ns, 0, format, args);
+    va_end(args);
+}
+
+// A wheel driven against the way it is turning is braking
+static bool opposes(int pwm, float rps) {
+    return fabsf(rps) > TIMELINE_STILL_RPS && ((pwm > 0 && rps < 0) || (pwm < 0 && rps > 0));
+}
+
+void timeline_stm32_telemetry(const Stm32Telemetry* t, uint64_t rx_ns) {
+    if (!timeline_enabled()) return;
+    int64_t tick_ns = (int64_t)t->tick_ms * 1000000;
+    int64_t offset_ns = (int64_t)rx_ns - tick_ns;
+    if (!g_motion.synced || offset_ns < g_motion.offset_ns) g_motion.offset_ns = offset_ns;
+    g_motion.synced = true;
+    uint64_t ts_ns = (uint64_t)(tick_ns + g_motion.offset_ns);
+    uint64_t synced_ns;
+    if (clock_sync_tick_to_local(t->tick_ms, &synced_ns)) ts_ns = synced_ns;
+    atomic_store(&g_tick0_ns, (long long)ts_ns - tick_ns);
+    atomic_store(&g_tick0_known, true);
+
+    bool driving = t->pwm_a != 0 || t->pwm_d != 0;
+    bool still = fabsf(t->rps_a) < TIMELINE_STILL_RPS && fabsf(t->rps_d) < TIMELINE_STILL_RPS &&
+                 fabsf(t->yaw_rate_dps) < TIMELINE_STILL_DPS;
+    if (driving && !g_motion.driving) {
+        if (g_motion.settling) timeline_stm32_span(TIMELINE_STM32_MOTION, g_motion.stop_ns, ts_ns, "settle (cut short)");
+        g_motion.settling = false;
+        g_motion.drive_start_ns = ts_ns;
+        g_motion.brake_seen = false;
+    }
+    if (driving && !g_motion.brake_seen && (opposes(t->pwm_a, t->rps_a) || opposes(t->pwm_d, t->rps_d))) {
+        timeline_stm32_instant(TIMELINE_STM32_MOTION, ts_ns, "brake");
+        g_motion.brake_seen = true;
+    }
+    if (!driving && g_motion.driving) {
+        timeline_stm32_span(TIMELINE_STM32_MOTION, g_motion.drive_start_ns, ts_ns, "drive");
+        g_motion.stop_ns = ts_ns;
+        g_motion.settling = true;
+    }
+    if (!driving && g_motion.settling && still) {
+        timeline_stm32_span(TIMELINE_STM32_MOTION, g_motion.stop_ns, ts_ns, "settle");
+        g_motion.settling = false;
+    }
+    g_motion.driving = driving;
+}
+
+// Labels are formatted by the controller, but may carry a URL or a class label
+static void write_json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void write_track_name(FILE* f, int pid, int tid, const char* name) {
+    fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, tid);
+    write_json_string(f, name);
+    fprintf(f, "}}");
+}
+
+int timeline_write(void) {
+    if (!timeline_enabled()) return 0;
+    pthread_mutex_lock(&g_write_lock);
+    char tmp_path[512];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", g_path);
+    FILE* f = fopen(tmp_path, "w");
+    if (!f) {
+        LOG_ERROR("[Timeline] Cannot create %s: %s\n", tmp_path, strerror(errno));
+        pthread_mutex_unlock(&g_write_lock);
+        return -1;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",");
+    if (atomic_load(&g_tick0_known)) {
+        // For ktrace_dump.py --merge, which places board-side events by their tick
+        fprintf(f, "\"otherData\":{\"stm32_tick0_us\":%.3f},",
+                (double)(atomic_load(&g_tick0_ns) - (long long)g_origin_ns) / 1000.0);
+    }
+    fprintf(f, "\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"Raspberry Pi\"}},\n",
+            TIMELINE_PID_PI);
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"STM32\"}}", TIMELINE_PID_STM32);
+    unsigned threads = atomic_load(&g_thread_count);
+    for (unsigned i = 0; i < threads && i < TIMELINE_MAX_THREADS; i++) {
+        char fallback[TIMELINE_LABEL_MAX];
+        snprintf(fallback, sizeof(fallback), "thread %u", i);
+        write_track_name(f, TIMELINE_PID_PI, (int)i, g_thread_names[i][0] ? g_thread_names[i] : fallback);
+    }
+    for (int i = 0; i < TIMELINE_STM32_TRACKS; i++) {
+        write_track_name(f, TIMELINE_PID_STM32, i, TIMELINE_STM32_TRACK_NAMES[i]);
+    }
+
+    unsigned claimed = atomic_load_explicit(&g_count, memory_order_relaxed);
+    unsigned count = claimed < TIMELINE_MAX_EVENTS ? claimed : TIMELINE_MAX_EVENTS;
+    for (unsigned i = 0; i < count; i++) {
+        const TimelineEvent* e = &g_events[i];
+        if (!atomic_load_explicit(&e->ready, memory_order_acquire)) continue; // Still being recorded
+        double ts_us = e->ts_ns >= g_origin_ns ? (e->ts_ns - g_origin_ns) / 1000.0 : 0.0;
+        fprintf(f, ",\n{\"ph\":\"%c\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,", e->phase, e->pid, e->tid, ts_us);
+        if (e->phase == 'X') {
+            fprintf(f, "\"dur\":%.3f,", e->dur_ns / 1000.0);
+        } else {
+            fprintf(f, "\"s\":\"t\",");
+        }
+        fprintf(f, "\"name\":");
+        write_json_string(f, e->label);
+        fputc('}', f);
+    }
+    fprintf(f, "\n]}\n");
+
+    int result = 0;
+    if (fclose(f) != 0 || rename(tmp_path, g_path) != 0) {
+        LOG_ERROR("[Timeline] Failed to write %s\n", g_path);
+        unlink(tmp_path);
+        result = -1;
+    } else if (claimed > count) {
+        LOG_WARN("[Timeline] Buffer full: %u events dropped.\n", claimed - count);
+    }
+    pthread_mutex_unlock(&g_write_lock);
+    return result;
+}
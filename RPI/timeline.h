@@ -0,0 +1,73 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stm32_protocol.h" // For Stm32Telemetry
+
+/**
+ * @file timeline.h
+ * @brief Mission timeline across the Pi's threads and the STM32, for Perfetto.
+ *
+ * Started with `--timeline <file>`. Spans and instants from the nav thread,
+ * reactor, image workers, Android writer and HTTP requests go on one track per
+ * thread, named by timeline_thread(). The STM32 gets its own process with three
+ * tracks:
+ * - commands: each command's execution, start to DONE;
+ * - replies: OK, DONE, SETTLED and ERROR as they arrive;
+ * - motion: drive, brake and settle phases, from telemetry when the firmware
+ *   streams it (TELEM <hz>).
+ *
+ * Everything is on the Pi's CLOCK_MONOTONIC (latency_now_ns()). Telemetry ticks
+ * are mapped onto it by clock_sync.h once the firmware has answered a SYNC, and
+ * until then with the smallest (receive time - tick) seen, which leaves them
+ * late by at most the link's minimum delay. Once telemetry has arrived, the
+ * file's otherData.stm32_tick0_us is where board tick 0 falls on its time axis,
+ * so ktrace_dump.py --merge can add the MDP firmware's kernel trace.
+ *
+ * Events are copied into a preallocated buffer with one atomic increment, so any
+ * thread can record. The buffer is written out as Chrome Trace Event JSON by
+ * timeline_write() (at the end of every mission) and timeline_close(). Open the
+ * file at ui.perfetto.dev or chrome://tracing. Once TIMELINE_MAX_EVENTS are
+ * recorded, later events are dropped and counted. When no timeline is open,
+ * each hook is a single atomic load.
+ */
+
+#define TIMELINE_MAX_EVENTS 65536
+#define TIMELINE_LABEL_MAX 40
+
+typedef enum {
+    TIMELINE_STM32_COMMANDS,
+    TIMELINE_STM32_REPLIES,
+    TIMELINE_STM32_MOTION,
+    TIMELINE_STM32_TRACKS
+} TimelineStm32Track;
+
+// Returns 0, or -1 if the file cannot be created or memory is short.
+int timeline_open(const char* path);
+// Writes the file one last time and stops recording.
+void timeline_close(void);
+bool timeline_enabled(void);
+
+// Names the calling thread's track; a thread with a name already in use shares
+// that track. Threads that never call it get "thread N".
+void timeline_thread(const char* name);
+
+// start_ns .. end_ns on the calling thread's track. Labels longer than
+// TIMELINE_LABEL_MAX - 1 are cut.
+void timeline_span(uint64_t start_ns, uint64_t end_ns, const char* format, ...) __attribute__((format(printf, 3, 4)));
+void timeline_instant(uint64_t ts_ns, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void timeline_stm32_span(TimelineStm32Track track, uint64_t start_ns, uint64_t end_ns, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+void timeline_stm32_instant(TimelineStm32Track track, uint64_t ts_ns, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Feeds one telemetry frame received at rx_ns into the motion track. Reactor only.
+void timeline_stm32_telemetry(const Stm32Telemetry* t, uint64_t rx_ns);
+
+// Rewrites the file with everything recorded so far. Returns 0, or -1 on a write error.
+int timeline_write(void);
+
+#endif // TIMELINE_H
@@ -0,0 +1,110 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_MAX_FDS 4
+
+static atomic_bool g_trace_enabled = false;
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* g_trace_file = NULL;
+static struct timespec g_trace_start;
+
+static struct {
+    int fd;
+    TraceChannel channel;
+} g_trace_fds[TRACE_MAX_FDS];
+static int g_trace_fd_count = 0;
+
+static uint64_t trace_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - g_trace_start.tv_sec) * 1000000000ULL + (uint64_t)now.tv_nsec - (uint64_t)g_trace_start.tv_nsec;
+}
+
+int trace_open(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        perror("trace_open: Unable to create trace file");
+        return -1;
+    }
+    TraceFileHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.reserved = 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        perror("trace_open: Unable to write trace header");
+        fclose(file);
+        return -1;
+    }
+
+    pthread_mutex_lock(&g_trace_lock);
+    g_trace_file = file;
+    clock_gettime(CLOCK_MONOTONIC, &g_trace_start);
+    pthread_mutex_unlock(&g_trace_lock);
+    atomic_store(&g_trace_enabled, true);
+    printf("[Trace] Recording to %s\n", path);
+    return 0;
+}
+
+void trace_close(void) {
+    atomic_store(&g_trace_enabled, false);
+    pthread_mutex_lock(&g_trace_lock);
+    if (g_trace_file) {
+        fclose(g_trace_file);
+        g_trace_file = NULL;
+    }
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+bool trace_enabled(void) {
+    return atomic_load(&g_trace_enabled);
+}
+
+// Called during start-up, before any thread writes to the fds.
+void trace_bind_fd(int fd, TraceChannel channel) {
+    if (fd < 0 || g_trace_fd_count >= TRACE_MAX_FDS) return;
+    g_trace_fds[g_trace_fd_count].fd = fd;
+    g_trace_fds[g_trace_fd_count].channel = channel;
+    g_trace_fd_count++;
+}
+
+void trace_record(TraceChannel channel, TraceDirection direction, uint16_t status, const void* data, size_t length) {
+    if (!atomic_load(&g_trace_enabled)) return;
+
+    pthread_mutex_lock(&g_trace_lock);
+    if (g_trace_file) {
+        // Stamp under the lock so records are in time order in the file
+        TraceRecordHeader header = {
+            .t_ns = trace_now_ns(),
+            .channel = (uint8_t)channel,
+            .direction = (uint8_t)direction,
+            .status = status,
+            .length = (uint32_t)length,
+        };
+        if (fwrite(&header, sizeof(header), 1, g_trace_file) != 1 ||
+            (length > 0 && fwrite(data, length, 1, g_trace_file) != 1)) {
+            perror("trace_record: Write failed, recording stopped");
+            fclose(g_trace_file);
+            g_trace_file = NULL;
+            atomic_store(&g_trace_enabled, false);
+        } else {
+            // A run usually ends with Ctrl+C, so do not leave records sitting in stdio
+            fflush(g_trace_file);
+        }
+    }
+    pthread_mutex_unlock(&g_trace_lock);
+}
+
+void trace_record_fd_write(int fd, const void* data, size_t length) {
+    if (!atomic_load(&g_trace_enabled)) return;
+    for (int i = 0; i < g_trace_fd_count; i++) {
+        if (g_trace_fds[i].fd == fd) {
+            trace_record(g_trace_fds[i].channel, TRACE_DIR_OUT, 0, data, length);
+            return;
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file trace.h
+ * @brief Records every exchange with Android, the STM32 and the servers.
+ *
+ * Started with `--record <file>`. The trace is a binary file: a TraceFileHeader
+ * followed by one TraceRecordHeader + payload per message, stamped with
+ * CLOCK_MONOTONIC relative to trace_open(). replay_trace.py plays a trace back
+ * against the controller at N times the recorded speed. When no trace is open
+ * every hook is a single atomic load.
+ */
+
+#define TRACE_MAGIC "MDPTRACE"
+#define TRACE_VERSION 1
+
+typedef enum {
+    TRACE_CH_ANDROID = 1,
+    TRACE_CH_STM32 = 2,
+    TRACE_CH_HTTP_PATH = 3,   // post_data_to_server() (complete routes, confirmations)
+    TRACE_CH_HTTP_STREAM = 4, // post_data_to_server_ndjson(), one record per line
+    TRACE_CH_HTTP_IMAGE = 5   // Snapshot uploads; requests record the obstacle ID only
+} TraceChannel;
+
+// Relative to the Pi
+typedef enum {
+    TRACE_DIR_IN = 0,
+    TRACE_DIR_OUT = 1
+} TraceDirection;
+
+// All fields little-endian, as written by the Pi.
+typedef struct __attribute__((packed)) {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} TraceFileHeader;
+
+typedef struct __attribute__((packed)) {
+    uint64_t t_ns;     // Since trace_open()
+    uint8_t channel;   // TraceChannel
+    uint8_t direction; // TraceDirection
+    uint16_t status;   // HTTP status on HTTP replies (0 = transfer failed), else 0
+    uint32_t length;   // Payload bytes that follow
+} TraceRecordHeader;
+
+// Returns 0 on success, -1 if the file could not be created.
+int trace_open(const char* path);
+void trace_close(void);
+bool trace_enabled(void);
+
+// Lets trace_record_fd_write() tell which link a raw write went to.
+void trace_bind_fd(int fd, TraceChannel channel);
+
+void trace_record(TraceChannel channel, TraceDirection direction, uint16_t status, const void* data, size_t length);
+
+// Records bytes the Pi wrote to a bound fd. Unbound fds are ignored.
+void trace_record_fd_write(int fd, const void* data, size_t length);
+
+#endif // TRACE_H
@@ -0,0 +1,90 @@
+#ifndef HOST_CMSIS_H
+#define HOST_CMSIS_H
+
+/*
+ * Stands in for cmsis_gcc.h when a board's sources are built on the host (see
+ * host_hal.h). Force-included ahead of everything else, it takes the real
+ * header's include guard, so core_cm4.h keeps its register maps and NVIC
+ * helpers but gets these definitions instead of Cortex-M inline assembly.
+ * Barriers are compiler barriers and PRIMASK is a plain variable.
+ */
+
+#define __CMSIS_GCC_H
+
+#include <stdint.h>
+
+#define __ASM                  __asm
+#define __INLINE               inline
+#define __STATIC_INLINE        static inline
+#define __STATIC_FORCEINLINE   __attribute__((always_inline)) static inline
+#define __NO_RETURN            __attribute__((__noreturn__))
+#define __USED                 __attribute__((used))
+#define __WEAK                 __attribute__((weak))
+#define __PACKED               __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT        struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION         union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)           __attribute__((aligned(x)))
+#define __RESTRICT             __restrict
+#define __COMPILER_BARRIER()   __asm volatile("" ::: "memory")
+
+#define __NOP()                __COMPILER_BARRIER()
+#define __ISB()                __COMPILER_BARRIER()
+#define __DSB()                __COMPILER_BARRIER()
+#define __DMB()                __COMPILER_BARRIER()
+#define __WFI()                __COMPILER_BARRIER()
+#define __WFE()                __COMPILER_BARRIER()
+#define __SEV()                __COMPILER_BARRIER()
+#define __BKPT(value)          __builtin_trap()
+#define __CLZ(x)               ((uint8_t)((x) ? __builtin_clz(x) : 32))
+#define __REV(x)               __builtin_bswap32(x)
+#define __RBIT(x)              host_rbit(x)
+
+extern volatile uint32_t host_primask;
+
+__STATIC_FORCEINLINE void __disable_irq(void){
+	host_primask = 1;
+	__COMPILER_BARRIER();
+}
+
+__STATIC_FORCEINLINE void __enable_irq(void){
+	__COMPILER_BARRIER();
+	host_primask = 0;
+}
+
+__STATIC_FORCEINLINE uint32_t __get_PRIMASK(void){
+	return host_primask;
+}
+
+__STATIC_FORCEINLINE void __set_PRIMASK(uint32_t primask){
+	__COMPILER_BARRIER();
+	host_primask = primask;
+}
+
+// Thread mode, no BASEPRI masking and a clear FPSCR
+__STATIC_FORCEINLINE uint32_t __get_IPSR(void){
+	return 0;
+}
+
+__STATIC_FORCEINLINE uint32_t __get_BASEPRI(void){
+	return 0;
+}
+
+__STATIC_FORCEINLINE void __set_BASEPRI(uint32_t basepri){
+	(void)basepri;
+}
+
+__STATIC_FORCEINLINE uint32_t __get_FPSCR(void){
+	return 0;
+}
+
+__STATIC_FORCEINLINE void __set_FPSCR(uint32_t fpscr){
+	(void)fpscr;
+}
+
+__STATIC_FORCEINLINE uint32_t host_rbit(uint32_t v){
+	uint32_t r = 0;
+	for(int i = 0; i < 32; i++, v >>= 1) r = (r << 1) | (v & 1u);
+	return r;
+}
+
+#endif // HOST_CMSIS_H
@@ -0,0 +1,747 @@
+// Mock HAL and RTOS for the host builds; see host_hal.h.
+
+#define _GNU_SOURCE
+#include "host_hal.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "cmsis_os.h"
+#include "event_groups.h"
+#include "queue.h"
+#include "task.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define HOST_FLASH_SIZE  0x00100000u // STM32F407xG
+#define HOST_PERIPH_SIZE 0x10100000u // APB1 .. AHB2
+#define HOST_CORE_BASE   0xE0000000u
+#define HOST_CORE_SIZE   0x00100000u
+#define HOST_MAX_TASKS   16
+#define HOST_MAX_TIMERS  8
+
+// The boards carry different HAL releases; the newer one (stm32-motor) takes
+// the configuration structs as const and is the one with IS_TIM_PERIOD.
+#ifdef IS_TIM_PERIOD
+#define HOST_CFG const
+#else
+#define HOST_CFG
+#endif
+
+volatile uint32_t host_tick_ms;
+volatile uint32_t uwTick;
+volatile uint32_t host_primask;
+volatile uint32_t host_critical_nesting;
+volatile uint32_t host_yields;
+uint32_t SystemCoreClock = HSI_VALUE;
+
+static uint32_t hostPclk1 = HSI_VALUE, hostPclk2 = HSI_VALUE;
+static uint32_t hostPllSource = HSI_VALUE / 16;  // PLL input, VCO and P divider as configured
+static uint32_t hostPllVco = 0, hostPllP = 2;
+static jmp_buf hostBootJmp;
+
+/* === Registers === */
+
+static void hostMap(uintptr_t base, size_t size, int fill){
+	void *p = mmap((void *)base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE
+			| MAP_NORESERVE, -1, 0);
+	if(p != (void *)base){
+		fprintf(stderr, "host_hal: cannot map 0x%08lx for the registers\n", (unsigned long)base);
+		exit(1);
+	}
+	if(fill) memset(p, fill, size);
+}
+
+__attribute__((constructor)) static void hostMapRegisters(void){
+	hostMap(FLASH_BASE, HOST_FLASH_SIZE, 0xFF); // Erased
+	hostMap(PERIPH_BASE, HOST_PERIPH_SIZE, 0);
+	hostMap(HOST_CORE_BASE, HOST_CORE_SIZE, 0);
+	// Transmitters idle, as after reset
+	USART_TypeDef *ports[] = {USART1, USART2, USART3, UART4, UART5, USART6};
+	for(size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); i++) ports[i]->SR = USART_SR_TXE | USART_SR_TC;
+}
+
+/* === Time === */
+
+uint64_t host_now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void host_advance_ms(uint32_t ms){
+	host_tick_ms += ms;
+}
+
+// Weak as in the HAL: a board that counts kernel ticks overrides it
+__weak uint32_t HAL_GetTick(void){
+	return host_tick_ms;
+}
+
+void HAL_IncTick(void){
+	host_tick_ms++;
+}
+
+// Weak too: stm32-motor's sleeps in a task
+__weak void HAL_Delay(uint32_t Delay){
+	host_tick_ms += Delay;
+}
+
+/* === Core, clocks and power === */
+
+HAL_StatusTypeDef HAL_Init(void){
+	return HAL_OK;
+}
+
+void HAL_NVIC_SetPriorityGrouping(uint32_t PriorityGroup){
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority){
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn){
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn){
+}
+
+// Keeps what SYSCLK will be once HAL_RCC_ClockConfig() selects the PLL
+HAL_StatusTypeDef HAL_RCC_OscConfig(HOST_CFG RCC_OscInitTypeDef *RCC_OscInitStruct){
+	if(RCC_OscInitStruct->PLL.PLLState == RCC_PLL_ON){
+		uint32_t in = RCC_OscInitStruct->PLL.PLLSource == RCC_PLLSOURCE_HSE ? HSE_VALUE : HSI_VALUE;
+		hostPllSource = in / RCC_OscInitStruct->PLL.PLLM;
+		hostPllVco = hostPllSource * RCC_OscInitStruct->PLL.PLLN;
+		hostPllP = RCC_OscInitStruct->PLL.PLLP;
+	}
+	return HAL_OK;
+}
+
+static uint32_t hostAhbDiv(uint32_t div){
+	return div < RCC_SYSCLK_DIV2 ? 1u : div < RCC_SYSCLK_DIV64 ? 2u << ((div - RCC_SYSCLK_DIV2) >> 4)
+			: 64u << ((div - RCC_SYSCLK_DIV64) >> 4);
+}
+
+static uint32_t hostApbDiv(uint32_t div){
+	return div < RCC_HCLK_DIV2 ? 1u : 2u << ((div - RCC_HCLK_DIV2) >> 10);
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(HOST_CFG RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency){
+	uint32_t sysclk = RCC_ClkInitStruct->SYSCLKSource == RCC_SYSCLKSOURCE_PLLCLK ? hostPllVco / hostPllP
+			: RCC_ClkInitStruct->SYSCLKSource == RCC_SYSCLKSOURCE_HSE ? HSE_VALUE : HSI_VALUE;
+	SystemCoreClock = sysclk / hostAhbDiv(RCC_ClkInitStruct->AHBCLKDivider);
+	hostPclk1 = SystemCoreClock / hostApbDiv(RCC_ClkInitStruct->APB1CLKDivider);
+	hostPclk2 = SystemCoreClock / hostApbDiv(RCC_ClkInitStruct->APB2CLKDivider);
+	return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void){
+	return SystemCoreClock;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void){
+	return hostPclk1;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void){
+	return hostPclk2;
+}
+
+void HAL_PWR_EnableBkUpAccess(void){
+}
+
+void HAL_PWR_DisableBkUpAccess(void){
+}
+
+// Writes land in the mapped flash as they would after an erase
+HAL_StatusTypeDef HAL_FLASH_Unlock(void){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *SectorError){
+	static const uint32_t sector_kb[12] = {16, 16, 16, 16, 64, 128, 128, 128, 128, 128, 128, 128};
+	uint32_t addr = FLASH_BASE;
+	for(uint32_t s = 0; s < 12; s++){
+		if(s >= pEraseInit->Sector && s < pEraseInit->Sector + pEraseInit->NbSectors){
+			memset((void *)(uintptr_t)addr, 0xFF, sector_kb[s] * 1024u);
+		}
+		addr += sector_kb[s] * 1024u;
+	}
+	*SectorError = 0xFFFFFFFFu;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data){
+	size_t len = TypeProgram == FLASH_TYPEPROGRAM_BYTE ? 1 : TypeProgram == FLASH_TYPEPROGRAM_HALFWORD ? 2
+			: TypeProgram == FLASH_TYPEPROGRAM_WORD ? 4 : 8;
+	memcpy((void *)(uintptr_t)Address, &Data, len);
+	return HAL_OK;
+}
+
+/* === GPIO and DMA === */
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init){
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin){
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin){
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState){
+	if(PinState != GPIO_PIN_RESET) GPIOx->ODR |= GPIO_Pin;
+	else GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin){
+	GPIOx->ODR ^= GPIO_Pin;
+}
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma){
+	hdma->State = HAL_DMA_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *hdma){
+	hdma->State = HAL_DMA_STATE_RESET;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma){
+	hdma->State = HAL_DMA_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_DMA_StateTypeDef HAL_DMA_GetState(DMA_HandleTypeDef *hdma){
+	return hdma->State;
+}
+
+/* === Peripheral set-up ===
+ * Init runs the project's MspInit as the HAL does; the weak defaults are for
+ * the peripherals a project has none for. */
+
+__weak void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim){
+}
+
+__weak void HAL_TIM_PWM_MspInit(TIM_HandleTypeDef *htim){
+}
+
+__weak void HAL_TIM_IC_MspInit(TIM_HandleTypeDef *htim){
+}
+
+__weak void HAL_TIM_Encoder_MspInit(TIM_HandleTypeDef *htim){
+}
+
+__weak void HAL_UART_MspInit(UART_HandleTypeDef *huart){
+}
+
+__weak void HAL_I2C_MspInit(I2C_HandleTypeDef *hi2c){
+}
+
+__weak void HAL_I2C_MspDeInit(I2C_HandleTypeDef *hi2c){
+}
+
+__weak void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim){
+	HAL_TIM_Base_MspInit(htim);
+	htim->Instance->ARR = htim->Init.Period;
+	htim->Instance->PSC = htim->Init.Prescaler;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Init(TIM_HandleTypeDef *htim){
+	HAL_TIM_PWM_MspInit(htim);
+	htim->Instance->ARR = htim->Init.Period;
+	htim->Instance->PSC = htim->Init.Prescaler;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Init(TIM_HandleTypeDef *htim){
+	HAL_TIM_IC_MspInit(htim);
+	htim->Instance->ARR = htim->Init.Period;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Encoder_Init(TIM_HandleTypeDef *htim, HOST_CFG TIM_Encoder_InitTypeDef *sConfig){
+	HAL_TIM_Encoder_MspInit(htim);
+	htim->Instance->ARR = htim->Init.Period;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_ConfigClockSource(TIM_HandleTypeDef *htim, HOST_CFG TIM_ClockConfigTypeDef *sClockSourceConfig){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_ConfigChannel(TIM_HandleTypeDef *htim, HOST_CFG TIM_OC_InitTypeDef *sConfig, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_ConfigChannel(TIM_HandleTypeDef *htim, HOST_CFG TIM_IC_InitTypeDef *sConfig, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_MasterConfigSynchronization(TIM_HandleTypeDef *htim,
+		HOST_CFG TIM_MasterConfigTypeDef *sMasterConfig){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIMEx_ConfigBreakDeadTime(TIM_HandleTypeDef *htim,
+		HOST_CFG TIM_BreakDeadTimeConfigTypeDef *sBreakDeadTimeConfig){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start(TIM_HandleTypeDef *htim){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef *htim, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef *htim, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Start(TIM_HandleTypeDef *htim, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_IC_Start_IT(TIM_HandleTypeDef *htim, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Encoder_Start(TIM_HandleTypeDef *htim, uint32_t Channel){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_GenerateEvent(TIM_HandleTypeDef *htim, uint32_t EventSource){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_DMABurst_MultiWriteStart(TIM_HandleTypeDef *htim, uint32_t BurstBaseAddress,
+		uint32_t BurstRequestSrc, HOST_CFG uint32_t *BurstBuffer, uint32_t BurstLength, uint32_t DataLength){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_DMABurst_WriteStop(TIM_HandleTypeDef *htim, uint32_t BurstRequestSrc){
+	return HAL_OK;
+}
+
+uint32_t HAL_TIM_ReadCapturedValue(HOST_CFG TIM_HandleTypeDef *htim, uint32_t Channel){
+	return *(&htim->Instance->CCR1 + (Channel >> 2));
+}
+
+#ifdef HAL_ADC_MODULE_ENABLED
+__weak void HAL_ADC_MspInit(ADC_HandleTypeDef *hadc){
+}
+
+HAL_StatusTypeDef HAL_ADC_Init(ADC_HandleTypeDef *hadc){
+	HAL_ADC_MspInit(hadc);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_ConfigChannel(ADC_HandleTypeDef *hadc, ADC_ChannelConfTypeDef *sConfig){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_ADC_Start_DMA(ADC_HandleTypeDef *hadc, uint32_t *pData, uint32_t Length){
+	return HAL_OK;
+}
+#endif
+
+// No device answers: reads fail as a bus with nothing on it would
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c){
+	HAL_I2C_MspInit(hi2c);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c){
+	HAL_I2C_MspDeInit(hi2c);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+		uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout){
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read_DMA(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+		uint16_t MemAddSize, uint8_t *pData, uint16_t Size){
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+		uint16_t MemAddSize, uint8_t *pData, uint16_t Size, uint32_t Timeout){
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Read_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+		uint16_t MemAddSize, uint8_t *pData, uint16_t Size){
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_I2C_Mem_Write_IT(I2C_HandleTypeDef *hi2c, uint16_t DevAddress, uint16_t MemAddress,
+		uint16_t MemAddSize, uint8_t *pData, uint16_t Size){
+	return HAL_ERROR;
+}
+
+/* === UART === */
+
+typedef struct {
+	UART_HandleTypeDef *huart;    // Transfer in flight, or NULL
+	char data[HOST_UART_CAPTURE];
+	size_t len;                   // Bytes sent since the last host_uart_take()
+} HostUart;
+
+static HostUart hostUarts[6];
+
+static HostUart *hostUart(USART_TypeDef *usart){
+	USART_TypeDef *ports[] = {USART1, USART2, USART3, UART4, UART5, USART6};
+	for(size_t i = 0; i < sizeof(ports) / sizeof(ports[0]); i++){
+		if(ports[i] == usart) return &hostUarts[i];
+	}
+	return NULL;
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart){
+	HAL_UART_MspInit(huart);
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size){
+	HostUart *u = hostUart(huart->Instance);
+	if(!u || u->huart) return HAL_BUSY;
+	for(uint16_t i = 0; i < Size; i++, u->len++){
+		if(u->len < sizeof(u->data)) u->data[u->len] = (char)pData[i];
+	}
+	u->huart = huart;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size){
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size){
+	return HAL_OK;
+}
+
+size_t host_uart_take(USART_TypeDef *usart, char *out, size_t size){
+	HostUart *u = hostUart(usart);
+	if(!u) return 0;
+	while(u->huart){
+		UART_HandleTypeDef *huart = u->huart;
+		u->huart = NULL;
+		HAL_UART_TxCpltCallback(huart); // May start the next run of its ring
+	}
+	size_t sent = u->len;
+	if(size){
+		size_t n = sent < sizeof(u->data) ? sent : sizeof(u->data);
+		if(n > size - 1) n = size - 1;
+		memcpy(out, u->data, n);
+		out[n] = '\0';
+	}
+	u->len = 0;
+	return sent;
+}
+
+/* === Kernel === */
+
+typedef struct {
+	osThreadFunc_t func;
+	const char *name;
+	osPriority_t priority;
+	uint32_t notify;   // Value, as the notify calls leave it
+	uint8_t pending;   // A notification has not been taken
+} HostTask;
+
+typedef struct {
+	uint8_t *items;
+	UBaseType_t length, size;
+	UBaseType_t head, count;
+} HostQueue;
+
+typedef struct {
+	EventBits_t bits;
+} HostEventGroup;
+
+typedef struct {
+	osTimerFunc_t func;
+	void *argument;
+	uint32_t period;
+	uint8_t running;
+} HostTimer;
+
+_Static_assert(sizeof(HostQueue) <= sizeof(StaticQueue_t), "HostQueue must fit the static queue buffer");
+_Static_assert(sizeof(HostEventGroup) <= sizeof(StaticEventGroup_t), "HostEventGroup must fit the static group buffer");
+
+static HostTask hostTasks[HOST_MAX_TASKS];
+static HostTimer hostTimers[HOST_MAX_TIMERS];
+static uint8_t hostTaskCount, hostTimerCount;
+
+int host_boot(int (*entry)(void)){
+	if(setjmp(hostBootJmp)) return 0;
+	entry();
+	return -1;
+}
+
+osStatus_t osKernelInitialize(void){
+	return osOK;
+}
+
+osStatus_t osKernelStart(void){
+	longjmp(hostBootJmp, 1);
+}
+
+uint32_t osKernelGetTickCount(void){
+	return host_tick_ms;
+}
+
+TickType_t xTaskGetTickCount(void){
+	return host_tick_ms;
+}
+
+// Running as far as the firmware can tell, so HAL_GetTick() overrides read
+// the kernel tick, which is host_tick_ms
+BaseType_t xTaskGetSchedulerState(void){
+	return taskSCHEDULER_RUNNING;
+}
+
+osStatus_t osDelay(uint32_t ticks){
+	host_tick_ms += ticks;
+	return osOK;
+}
+
+osStatus_t osDelayUntil(uint32_t ticks){
+	if((int32_t)(ticks - host_tick_ms) > 0) host_tick_ms = ticks;
+	return osOK;
+}
+
+void vTaskDelay(const TickType_t xTicksToDelay){
+	host_tick_ms += xTicksToDelay;
+}
+
+void vTaskDelayUntil(TickType_t *const pxPreviousWakeTime, const TickType_t xTimeIncrement){
+	*pxPreviousWakeTime += xTimeIncrement;
+	if((int32_t)(*pxPreviousWakeTime - host_tick_ms) > 0) host_tick_ms = *pxPreviousWakeTime;
+}
+
+osThreadId_t osThreadNew(osThreadFunc_t func, void *argument, const osThreadAttr_t *attr){
+	if(hostTaskCount == HOST_MAX_TASKS) return NULL;
+	HostTask *t = &hostTasks[hostTaskCount++];
+	t->func = func;
+	t->name = attr ? attr->name : NULL;
+	t->priority = attr ? attr->priority : osPriorityNormal;
+	return (osThreadId_t)t;
+}
+
+const char *osThreadGetName(osThreadId_t thread_id){
+	return thread_id ? ((HostTask *)thread_id)->name : NULL;
+}
+
+osPriority_t osThreadGetPriority(osThreadId_t thread_id){
+	return thread_id ? ((HostTask *)thread_id)->priority : osPriorityError;
+}
+
+BaseType_t xTaskGenericNotify(TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction,
+		uint32_t *pulPreviousNotificationValue){
+	HostTask *t = (HostTask *)xTaskToNotify;
+	if(pulPreviousNotificationValue) *pulPreviousNotificationValue = t->notify;
+	switch(eAction){
+	case eSetBits: t->notify |= ulValue; break;
+	case eIncrement: t->notify++; break;
+	case eSetValueWithOverwrite: t->notify = ulValue; break;
+	case eSetValueWithoutOverwrite:
+		if(t->pending) return pdFAIL;
+		t->notify = ulValue;
+		break;
+	case eNoAction: break;
+	}
+	t->pending = 1;
+	return pdPASS;
+}
+
+BaseType_t xTaskGenericNotifyFromISR(TaskHandle_t xTaskToNotify, uint32_t ulValue, eNotifyAction eAction,
+		uint32_t *pulPreviousNotificationValue, BaseType_t *pxHigherPriorityTaskWoken){
+	if(pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdTRUE;
+	return xTaskGenericNotify(xTaskToNotify, ulValue, eAction, pulPreviousNotificationValue);
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t *pxHigherPriorityTaskWoken){
+	xTaskGenericNotifyFromISR(xTaskToNotify, 0, eIncrement, NULL, pxHigherPriorityTaskWoken);
+}
+
+// No task is current on the host, so a wait has nothing to take and times out
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait){
+	return 0;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t ulBitsToClearOnEntry, uint32_t ulBitsToClearOnExit,
+		uint32_t *pulNotificationValue, TickType_t xTicksToWait){
+	if(pulNotificationValue) *pulNotificationValue = 0;
+	return pdFALSE;
+}
+
+UBaseType_t uxTaskGetSystemState(TaskStatus_t *const pxTaskStatusArray, const UBaseType_t uxArraySize,
+		uint32_t *const pulTotalRunTime){
+	if(pulTotalRunTime) *pulTotalRunTime = 0;
+	return 0;
+}
+
+// No task runs, so none has a tag (task_wcet.h then measures nothing)
+void vTaskSetApplicationTaskTag(TaskHandle_t xTask, TaskHookFunction_t pxHookFunction){
+}
+
+TaskHookFunction_t xTaskGetApplicationTaskTag(TaskHandle_t xTask){
+	return NULL;
+}
+
+size_t xPortGetFreeHeapSize(void){
+	return 0;
+}
+
+size_t xPortGetMinimumEverFreeHeapSize(void){
+	return 0;
+}
+
+/* === Queues, event groups and timers === */
+
+static HostQueue *hostQueueInit(HostQueue *q, UBaseType_t length, UBaseType_t size, uint8_t *items){
+	q->items = items;
+	q->length = length;
+	q->size = size;
+	q->head = q->count = 0;
+	return q;
+}
+
+QueueHandle_t xQueueGenericCreateStatic(const UBaseType_t uxQueueLength, const UBaseType_t uxItemSize,
+		uint8_t *pucQueueStorage, StaticQueue_t *pxStaticQueue, const uint8_t ucQueueType){
+	return (QueueHandle_t)hostQueueInit((HostQueue *)pxStaticQueue, uxQueueLength, uxItemSize, pucQueueStorage);
+}
+
+BaseType_t xQueueGenericReset(QueueHandle_t xQueue, BaseType_t xNewQueue){
+	HostQueue *q = (HostQueue *)xQueue;
+	q->head = q->count = 0;
+	return pdPASS;
+}
+
+BaseType_t xQueueGenericSend(QueueHandle_t xQueue, const void *const pvItemToQueue, TickType_t xTicksToWait,
+		const BaseType_t xCopyPosition){
+	HostQueue *q = (HostQueue *)xQueue;
+	if(xCopyPosition == queueOVERWRITE && q->count == q->length) q->count--;
+	if(q->count == q->length) return errQUEUE_FULL;
+	UBaseType_t slot;
+	if(xCopyPosition == queueSEND_TO_FRONT){
+		q->head = (q->head + q->length - 1) % q->length;
+		slot = q->head;
+	}else{
+		slot = (q->head + q->count) % q->length;
+	}
+	memcpy(q->items + slot * q->size, pvItemToQueue, q->size);
+	q->count++;
+	return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t xQueue, void *const pvBuffer, TickType_t xTicksToWait){
+	HostQueue *q = (HostQueue *)xQueue;
+	if(q->count == 0) return pdFALSE;
+	memcpy(pvBuffer, q->items + q->head * q->size, q->size);
+	q->head = (q->head + 1) % q->length;
+	q->count--;
+	return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(const QueueHandle_t xQueue){
+	return ((HostQueue *)xQueue)->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(const QueueHandle_t xQueue){
+	HostQueue *q = (HostQueue *)xQueue;
+	return q->length - q->count;
+}
+
+// Names a queue for the kernel trace; host queues have no trace hooks
+void vQueueSetQueueNumber(QueueHandle_t xQueue, UBaseType_t uxQueueNumber){
+	(void)xQueue;
+	(void)uxQueueNumber;
+}
+
+osMessageQueueId_t osMessageQueueNew(uint32_t msg_count, uint32_t msg_size, const osMessageQueueAttr_t *attr){
+	HostQueue *q = attr && attr->cb_mem ? (HostQueue *)attr->cb_mem : calloc(1, sizeof(HostQueue));
+	uint8_t *items = attr && attr->mq_mem ? (uint8_t *)attr->mq_mem : calloc(msg_count, msg_size);
+	return (osMessageQueueId_t)hostQueueInit(q, msg_count, msg_size, items);
+}
+
+osStatus_t osMessageQueuePut(osMessageQueueId_t mq_id, const void *msg_ptr, uint8_t msg_prio, uint32_t timeout){
+	return xQueueGenericSend((QueueHandle_t)mq_id, msg_ptr, 0, queueSEND_TO_BACK) == pdPASS ? osOK : osErrorResource;
+}
+
+osStatus_t osMessageQueueGet(osMessageQueueId_t mq_id, void *msg_ptr, uint8_t *msg_prio, uint32_t timeout){
+	if(msg_prio) *msg_prio = 0;
+	return xQueueReceive((QueueHandle_t)mq_id, msg_ptr, 0) == pdPASS ? osOK : osErrorResource;
+}
+
+EventGroupHandle_t xEventGroupCreateStatic(StaticEventGroup_t *pxEventGroupBuffer){
+	HostEventGroup *g = (HostEventGroup *)pxEventGroupBuffer;
+	g->bits = 0;
+	return (EventGroupHandle_t)g;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToSet){
+	HostEventGroup *g = (HostEventGroup *)xEventGroup;
+	g->bits |= uxBitsToSet;
+	return g->bits;
+}
+
+// Returns the bits as they are, met or not: no other task can set them
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t xEventGroup, const EventBits_t uxBitsToWaitFor,
+		const BaseType_t xClearOnExit, const BaseType_t xWaitForAllBits, TickType_t xTicksToWait){
+	HostEventGroup *g = (HostEventGroup *)xEventGroup;
+	EventBits_t bits = g->bits;
+	int met = xWaitForAllBits ? (bits & uxBitsToWaitFor) == uxBitsToWaitFor : (bits & uxBitsToWaitFor) != 0;
+	if(met && xClearOnExit) g->bits &= ~uxBitsToWaitFor;
+	return bits;
+}
+
+osTimerId_t osTimerNew(osTimerFunc_t func, osTimerType_t type, void *argument, const osTimerAttr_t *attr){
+	if(hostTimerCount == HOST_MAX_TIMERS) return NULL;
+	HostTimer *t = &hostTimers[hostTimerCount++];
+	t->func = func;
+	t->argument = argument;
+	return (osTimerId_t)t;
+}
+
+osStatus_t osTimerStart(osTimerId_t timer_id, uint32_t ticks){
+	HostTimer *t = (HostTimer *)timer_id;
+	t->period = ticks;
+	t->running = 1;
+	return osOK;
+}
+
+osStatus_t osTimerStop(osTimerId_t timer_id){
+	((HostTimer *)timer_id)->running = 0;
+	return osOK;
+}
@@ -0,0 +1,63 @@
+#ifndef HOST_HAL_H
+#define HOST_HAL_H
+
+/*
+ * Host build of a board's firmware, for benchmarks and replays on a PC.
+ *
+ * A bench includes the board's Core/Src/main.c (so its static functions and
+ * state are in reach) and is compiled with gcc for x86-64 against the real
+ * HAL, CMSIS and FreeRTOS headers of that project, with host_cmsis.h forced in
+ * and this directory ahead of portable/GCC/ARM_CM4F (see mdp_bench.c for the
+ * command line). host_hal.c then provides what the target libraries would:
+ *
+ * Registers: the peripheral, core and flash address ranges are mapped as
+ *   plain memory before main() runs, so TIMx->CCR1 = duty, DWT->CYCCNT and
+ *   the calibration pages read back as stored (flash starts erased, 0xFF).
+ *   Nothing behind them moves: a counter only changes when a bench writes it.
+ * HAL: every call the boards make succeeds. The Init calls run the
+ *   project's MspInit, as the HAL does, so DMA handles get linked. Time is
+ *   host_tick_ms, stepped by host_advance_ms() and by HAL_Delay().
+ * UART: HAL_UART_Transmit_DMA copies into a per-port capture buffer and
+ *   completes on host_uart_take(), which runs HAL_UART_TxCpltCallback.
+ * RTOS: tasks, queues, event groups and timers are created but never
+ *   scheduled. Queues hold items, notifications accumulate per task and
+ *   event bits per group, and the wait calls return them at once; delays
+ *   only move the clock.
+ *
+ * host_boot() runs the firmware's main() up to osKernelStart(), so the board
+ * is initialised by its own code and in its own order.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32f4xx_hal.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HOST_UART_CAPTURE 4096
+
+extern volatile uint32_t host_tick_ms;
+
+// Calls entry (the firmware's main, renamed with -Dmain=firmware_main) and
+// returns once it starts the kernel. Returns 0, or -1 if entry returned.
+int host_boot(int (*entry)(void));
+
+// Moves HAL_GetTick() and the RTOS tick on.
+void host_advance_ms(uint32_t ms);
+
+// Completes the DMA transfers started on usart and copies out (up to size - 1
+// bytes, NUL-terminated) what they sent since the last call. Returns the bytes
+// sent, which may exceed what fitted.
+size_t host_uart_take(USART_TypeDef *usart, char *out, size_t size);
+
+// Monotonic nanoseconds, for the benches
+uint64_t host_now_ns(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HOST_HAL_H
@@ -0,0 +1,286 @@
+/*
+ * Host benchmark of the MDP firmware's control and parsing code: the real
+ * MDP/Core/Src/main.c, included below, over the mock HAL in host_hal.h.
+ * From STM/MDP:
+ *
+ *   F=Middlewares/Third_Party/FreeRTOS/Source
+ *   gcc -O2 -Wall -DSTM32F407xx -DUSE_HAL_DRIVER -Dmain=firmware_main -include ../Common/Host/host_cmsis.h \
+ *       -I../Common/Host -ICore/Inc -ICore/Src -I../Common/Inc -IPeripheralDriver/Inc \
+ *       -isystem Drivers/STM32F4xx_HAL_Driver/Inc -isystem Drivers/CMSIS/Device/ST/STM32F4xx/Include \
+ *       -isystem Drivers/CMSIS/Include -I$F/include -I$F/CMSIS_RTOS_V2 \
+ *       ../Common/Host/mdp_bench.c ../Common/Host/host_hal.c Core/Src/stm32f4xx_hal_msp.c \
+ *       PeripheralDriver/Src/oled.c -o mdp_bench -lm
+ *   ./mdp_bench [-n ITERATIONS] [TELEMETRY.csv ...]
+ *
+ * Times, in ns per call on this machine (best of BENCH_ROUNDS rounds), the
+ * angle helpers, the IR table lookup and DMA-half average, Cmd_Parse, a
+ * command line from Uart3_QueueLine through CommandQueue_TryDispatch and its
+ * reply, and one MotorCtl_Step. Host numbers rank alternatives; they are not
+ * Cortex-M4 cycles.
+ *
+ * Each telemetry file (the controller's --telemetry CSV) is then replayed
+ * through MotorCtl_Step: every run of rows with both wheels driven the same
+ * way and the heading held within BENCH_STRAIGHT_DEG is restarted as a move of
+ * the length the encoders show, fed the recorded speeds, distance and yaw at
+ * the MC_PERIOD_MS control rate, and its duty compared with what the robot
+ * applied. Turns are the servo task's and are skipped.
+ */
+#include "main.c"
+#undef main // -Dmain=firmware_main was for the firmware's
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_hal.h"
+
+#define BENCH_ROUNDS 5
+#define BENCH_STRAIGHT_DEG 10.0f
+#define BENCH_TRACE_COLUMNS 10
+
+static volatile float g_sink;
+static motor_ctl_t g_ctl;
+
+static const char *const g_lines[] = {"FW50", "BW30", "FL90", "FR90", "L45", "R30", "ABS90", "FW 120"};
+#define BENCH_LINES (sizeof(g_lines) / sizeof(g_lines[0]))
+
+static float angle_at(long i){
+	return (float)((i * 37) % 720) - 360.0f;
+}
+
+static void bench_smallest_err(long i){
+	g_sink += smallest_err_deg(angle_at(i), angle_at(i + 11));
+}
+
+static void bench_steer_pulse(long i){
+	g_sink += steer_deg_to_pulse((float)(i % 81) - 40.0f);
+}
+
+static void bench_ir_convert(long i){
+	g_sink += (float)IrConvert((int32_t)(i & 4095));
+}
+
+static void bench_ir_publish(long i){
+	Ir_Publish(&ir_dma_buf[(i & 1) * IR_OVERSAMPLE]);
+	g_sink += g_ir_mm;
+}
+
+static void bench_cmd_parse(long i){
+	static char upper[BENCH_LINES][16];
+	if(!upper[0][0]){
+		for(size_t l = 0; l < BENCH_LINES; l++){
+			for(size_t c = 0; g_lines[l][c]; c++) upper[l][c] = (char)toupper((unsigned char)g_lines[l][c]);
+		}
+	}
+	cmd_rec_t rec;
+	Cmd_Parse(upper[i % BENCH_LINES], &rec);
+	g_sink += rec.arg;
+}
+
+// Whatever the dispatched command started has finished
+static void bench_idle(void){
+	motionActive = 0;
+	g_steer_cmd.pending = 0;
+	g_steer_cmd.busy = 0;
+	g_cmd_cooldown_until_ms = 0;
+	Move_DisarmCompare();
+	host_uart_take(USART3, NULL, 0);
+}
+
+static void bench_dispatch(long i){
+	Uart3_QueueLine(g_lines[i % BENCH_LINES]);
+	CommandQueue_TryDispatch();
+	bench_idle();
+}
+
+// The wheel speeds MotorCtl_Step reads, in the form FIXED_POINT_CTL gives them
+static void set_wheel_rps(float a, float d){
+	rpsA = a;
+	rpsD = d;
+#if FIXED_POINT_CTL
+	cpsA_q16 = Q16_FromFloat(a * COUNTS_PER_REV);
+	cpsD_q16 = Q16_FromFloat(d * COUNTS_PER_REV);
+#endif
+}
+
+static void bench_motor_step(long i){
+	set_wheel_rps(1.0f + 0.01f * (float)(i & 15), 1.0f + 0.01f * (float)((i >> 4) & 15));
+	MotorCtl_Step(&g_ctl, (float)MC_PERIOD_MS / 1000.0f);
+	g_sink += (float)pwmA_val;
+}
+
+static void run(const char *label, void (*fn)(long), long iterations){
+	double best = 0.0;
+	for(int round = 0; round < BENCH_ROUNDS; round++){
+		uint64_t start = host_now_ns();
+		for(long i = 0; i < iterations; i++) fn(i);
+		double ns = (double)(host_now_ns() - start) / (double)iterations;
+		if(round == 0 || ns < best) best = ns;
+	}
+	printf("  %-24s %9.1f ns\n", label, best);
+}
+
+/* === Telemetry replay === */
+
+typedef struct {
+	uint32_t tick_ms;
+	int32_t enc_a, enc_d;
+	float rps_a, rps_d;
+	int pwm_a, pwm_d;
+	float yaw_deg, yaw_rate_dps;
+} TraceRow;
+
+typedef struct {
+	int moves, skipped, steps;
+	double sq_a, sq_d;   // Sum of squared duty differences
+	int max_a, max_d;
+} ReplayStats;
+
+static int trace_load(const char *path, TraceRow **rows){
+	FILE *f = fopen(path, "r");
+	if(!f){
+		perror(path);
+		return -1;
+	}
+	char line[256];
+	int count = 0, cap = 0;
+	*rows = NULL;
+	while(fgets(line, sizeof(line), f)){
+		TraceRow r;
+		unsigned ir_mm;
+		if(sscanf(line, "%u,%d,%d,%f,%f,%d,%d,%f,%f,%u", &r.tick_ms, &r.enc_a, &r.enc_d, &r.rps_a, &r.rps_d,
+				&r.pwm_a, &r.pwm_d, &r.yaw_deg, &r.yaw_rate_dps, &ir_mm) != BENCH_TRACE_COLUMNS){
+			continue; // Header
+		}
+		if(count == cap){
+			cap = cap ? 2 * cap : 1024;
+			TraceRow *grown = realloc(*rows, (size_t)cap * sizeof(TraceRow));
+			if(!grown){
+				fclose(f);
+				return -1;
+			}
+			*rows = grown;
+		}
+		(*rows)[count++] = r;
+	}
+	fclose(f);
+	return count;
+}
+
+static int row_driven(const TraceRow *r){
+	return r->pwm_a != 0 && r->pwm_d != 0 && (r->pwm_a > 0) == (r->pwm_d > 0);
+}
+
+// Signed duty as Telem_Send reports it
+static void applied_duty(int *a, int *d){
+	*a = (int)__HAL_TIM_GET_COMPARE(&htim4, TIM_CHANNEL_4) - (int)__HAL_TIM_GET_COMPARE(&htim4, TIM_CHANNEL_3);
+	*d = (int)__HAL_TIM_GET_COMPARE(&htim1, TIM_CHANNEL_3) - (int)__HAL_TIM_GET_COMPARE(&htim1, TIM_CHANNEL_4);
+}
+
+static void replay_compare(const TraceRow *r, ReplayStats *st){
+	int a, d;
+	applied_duty(&a, &d);
+	int ea = abs(a - r->pwm_a), ed = abs(d - r->pwm_d);
+	st->sq_a += (double)ea * ea;
+	st->sq_d += (double)ed * ed;
+	if(ea > st->max_a) st->max_a = ea;
+	if(ed > st->max_d) st->max_d = ed;
+	st->steps++;
+}
+
+static void replay_move(const TraceRow *rows, int n, ReplayStats *st){
+	const TraceRow *first = &rows[0];
+	float travelled = 0.5f * (float)(abs(rows[n - 1].enc_a - first->enc_a) + abs(rows[n - 1].enc_d - first->enc_d))
+			* CM_PER_COUNT;
+	bench_idle();
+	MotorCtl_Init(&g_ctl);
+	yaw_angle_deg = first->yaw_deg;
+	StartMoveCM((int)lroundf(travelled + MOVE_BRAKE_COMP_CM), first->pwm_a > 0 ? DIR_FWD : DIR_BACK, g_gs.cruise_cms);
+	uint32_t last_ms = first->tick_ms, next_ms = first->tick_ms;
+	int stepped = 0;
+	for(int i = 0; i < n; i++){
+		const TraceRow *r = &rows[i];
+		if((int32_t)(r->tick_ms - next_ms) < 0) continue;
+		if(stepped) replay_compare(&rows[i - 1], st); // What the robot applied after its own step
+		total_counts_A = r->enc_a - first->enc_a;
+		total_counts_D = r->enc_d - first->enc_d;
+		distance_cm_A = (float)total_counts_A * CM_PER_COUNT;
+		distance_cm_D = (float)total_counts_D * CM_PER_COUNT;
+		set_wheel_rps(fabsf(r->rps_a), fabsf(r->rps_d));
+		yaw_angle_deg = r->yaw_deg;
+		yaw_rate_dps = r->yaw_rate_dps;
+		float dt = (float)(r->tick_ms - last_ms) / 1000.0f;
+		MotorCtl_Step(&g_ctl, dt > 0.0f ? dt : (float)MC_PERIOD_MS / 1000.0f);
+		last_ms = r->tick_ms;
+		next_ms = r->tick_ms + MC_PERIOD_MS;
+		stepped = 1;
+	}
+	if(stepped) replay_compare(&rows[n - 1], st);
+	st->moves++;
+	bench_idle();
+	MotorCtl_Step(&g_ctl, (float)MC_PERIOD_MS / 1000.0f); // Idle tick: integrals reset
+}
+
+static void replay(const char *path){
+	TraceRow *rows = NULL;
+	int n = trace_load(path, &rows);
+	if(n <= 0){
+		printf("  %s: no telemetry rows\n", path);
+		free(rows);
+		return;
+	}
+	ReplayStats st = {0};
+	for(int i = 0; i < n;){
+		if(!row_driven(&rows[i])){
+			i++;
+			continue;
+		}
+		int end = i;
+		while(end < n && row_driven(&rows[end]) && (rows[end].pwm_a > 0) == (rows[i].pwm_a > 0)) end++;
+		if(fabsf(smallest_err_deg(rows[end - 1].yaw_deg, rows[i].yaw_deg)) < BENCH_STRAIGHT_DEG){
+			replay_move(&rows[i], end - i, &st);
+		}else{
+			st.skipped++;
+		}
+		i = end;
+	}
+	printf("  %s: %d rows, %d moves (%d turns skipped), %d control steps\n", path, n, st.moves, st.skipped, st.steps);
+	if(st.steps){
+		printf("    duty vs recorded  A rms %7.1f max %5d   D rms %7.1f max %5d\n", sqrt(st.sq_a / st.steps),
+				st.max_a, sqrt(st.sq_d / st.steps), st.max_d);
+	}
+	free(rows);
+}
+
+int main(int argc, char **argv){
+	long iterations = 200000;
+	int first = 1;
+	if(argc > 2 && strcmp(argv[1], "-n") == 0){
+		iterations = atol(argv[2]);
+		first = 3;
+	}
+	if(iterations <= 0){
+		fprintf(stderr, "Usage: %s [-n ITERATIONS] [TELEMETRY.csv ...]\n", argv[0]);
+		return 1;
+	}
+	if(host_boot(firmware_main) != 0){
+		fprintf(stderr, "firmware main() returned before starting the kernel\n");
+		return 1;
+	}
+	for(int i = 0; i < IR_DMA_LEN; i++) ir_dma_buf[i] = (uint16_t)(600 + 97 * i);
+
+	printf("MDP firmware on the host, %ld iterations\n", iterations);
+	run("smallest_err_deg", bench_smallest_err, iterations);
+	run("steer_deg_to_pulse", bench_steer_pulse, iterations);
+	run("IrConvert", bench_ir_convert, iterations);
+	run("Ir_Publish", bench_ir_publish, iterations);
+	run("Cmd_Parse", bench_cmd_parse, iterations);
+	run("queue + dispatch + reply", bench_dispatch, iterations);
+	MotorCtl_Init(&g_ctl);
+	StartMoveCM(1000, DIR_FWD, g_gs.cruise_cms);
+	run("MotorCtl_Step", bench_motor_step, iterations);
+	bench_idle();
+
+	if(first < argc) printf("Telemetry replay through MotorCtl_Step\n");
+	for(int i = first; i < argc; i++) replay(argv[i]);
+	return 0;
+}
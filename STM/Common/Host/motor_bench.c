@@ -0,0 +1,109 @@
+/*
+ * Host benchmark of the stm32-motor firmware's parsers: the real
+ * stm32-motor/Core/Src/main.c, included below, over the mock HAL in
+ * host_hal.h. From STM/stm32-motor:
+ *
+ *   F=Middlewares/Third_Party/FreeRTOS/Source
+ *   gcc -O2 -Wall -DSTM32F407xx -DUSE_HAL_DRIVER -Dmain=firmware_main -include ../Common/Host/host_cmsis.h \
+ *       -I../Common/Host -ICore/Inc -ICore/Src -I../Common/Inc -IPeripheralDriver/Inc \
+ *       -isystem Drivers/STM32F4xx_HAL_Driver/Inc -isystem Drivers/CMSIS/Device/ST/STM32F4xx/Include \
+ *       -isystem Drivers/CMSIS/Include -I$F/include -I$F/CMSIS_RTOS_V2 \
+ *       ../Common/Host/motor_bench.c ../Common/Host/host_hal.c Core/Src/stm32f4xx_hal_msp.c \
+ *       Core/Src/odometry.c Core/Src/recovery.c Core/Src/ir_sensor.c Core/Src/oled.c \
+ *       Core/Src/front_range.c -o motor_bench -lm
+ *   ./motor_bench [-n ITERATIONS]
+ *
+ * Times, in ns per call on this machine (best of BENCH_ROUNDS rounds),
+ * crc16Ccitt over a command frame, rxSerialParse on ASCII command lines and
+ * rxSerialParseBinary on the same commands as binary frames, each including
+ * the queueing and reply. Host numbers rank alternatives; they are not
+ * Cortex-M4 cycles.
+ */
+#include "main.c"
+#undef main // -Dmain=firmware_main was for the firmware's
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host_hal.h"
+
+#define BENCH_ROUNDS 5
+
+static volatile uint32_t g_sink;
+
+static const char *const g_lines[] = {"1/MOTOR/FWD/20/50", "2/MOTOR/REV/30/120", "3/MOTOR/TURNL/40/90",
+		"4/MOTOR/TURNR/40/45", "5/GENERAL/HELLO/2/115200"};
+#define BENCH_LINES (sizeof(g_lines) / sizeof(g_lines[0]))
+
+static uint8_t g_frames[4][BIN_FRAME_LEN];
+
+static void frame_build(uint8_t *f, uint8_t opcode, uint16_t id, uint16_t speed, uint16_t dist){
+	f[0] = BIN_SYNC;
+	f[1] = BIN_PAYLOAD_LEN;
+	f[2] = opcode;
+	f[3] = id & 0xFF; f[4] = id >> 8;
+	f[5] = speed & 0xFF; f[6] = speed >> 8;
+	f[7] = dist & 0xFF; f[8] = dist >> 8;
+	uint16_t crc = crc16Ccitt(&f[1], 1 + BIN_PAYLOAD_LEN);
+	f[BIN_FRAME_LEN - 2] = crc & 0xFF;
+	f[BIN_FRAME_LEN - 1] = crc >> 8;
+}
+
+// Whatever the parsed command queued or replied has been consumed
+static void bench_drain(void){
+	xQueueReset(motorCommandQueue);
+	host_uart_take(USART3, NULL, 0);
+}
+
+static void bench_crc(long i){
+	g_sink += crc16Ccitt(&g_frames[i & 3][1], 1 + BIN_PAYLOAD_LEN);
+}
+
+static void bench_parse_ascii(long i){
+	static char line[BENCH_LINES][RX_FRAME_SIZE];
+	if(!line[0][0]){
+		for(size_t l = 0; l < BENCH_LINES; l++) strncpy(line[l], g_lines[l], RX_FRAME_SIZE - 1);
+	}
+	rxSerialParse(line[i % BENCH_LINES]);
+	bench_drain();
+}
+
+static void bench_parse_binary(long i){
+	rxSerialParseBinary(g_frames[i & 3]);
+	bench_drain();
+}
+
+static void run(const char *label, void (*fn)(long), long iterations){
+	double best = 0.0;
+	for(int round = 0; round < BENCH_ROUNDS; round++){
+		uint64_t start = host_now_ns();
+		for(long i = 0; i < iterations; i++) fn(i);
+		double ns = (double)(host_now_ns() - start) / (double)iterations;
+		if(round == 0 || ns < best) best = ns;
+	}
+	printf("  %-24s %9.1f ns\n", label, best);
+}
+
+int main(int argc, char **argv){
+	long iterations = 200000;
+	if(argc > 2 && strcmp(argv[1], "-n") == 0) iterations = atol(argv[2]);
+	if(iterations <= 0 || (argc > 1 && argc != 3)){
+		fprintf(stderr, "Usage: %s [-n ITERATIONS]\n", argv[0]);
+		return 1;
+	}
+	if(host_boot(firmware_main) != 0){
+		fprintf(stderr, "firmware main() returned before starting the kernel\n");
+		return 1;
+	}
+	frame_build(g_frames[0], BIN_OPCODE_BASE + FWD, 1, 20, 50);
+	frame_build(g_frames[1], BIN_OPCODE_BASE + REV, 2, 30, 120);
+	frame_build(g_frames[2], BIN_OPCODE_BASE + TURNL, 3, 40, 90);
+	frame_build(g_frames[3], BIN_OPCODE_BASE + TURNR, 4, 40, 45);
+	bench_drain();
+
+	printf("stm32-motor firmware on the host, %ld iterations\n", iterations);
+	run("crc16Ccitt", bench_crc, iterations);
+	run("rxSerialParse", bench_parse_ascii, iterations);
+	run("rxSerialParseBinary", bench_parse_binary, iterations);
+	return 0;
+}
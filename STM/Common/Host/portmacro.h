@@ -0,0 +1,73 @@
+#ifndef PORTMACRO_H
+#define PORTMACRO_H
+
+/*
+ * FreeRTOS port layer for the host build (see host_hal.h), found ahead of
+ * portable/GCC/ARM_CM4F. Same types as the Cortex-M4F port, so the kernel
+ * headers and the static task, queue and timer buffers in main.c are laid out
+ * as usual. Nothing is scheduled: the critical sections and the yield count,
+ * and host_hal.c implements the kernel calls the boards make.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define portCHAR		char
+#define portFLOAT		float
+#define portDOUBLE		double
+#define portLONG		long
+#define portSHORT		short
+#define portSTACK_TYPE	uint32_t
+#define portBASE_TYPE	long
+
+typedef portSTACK_TYPE StackType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#if(configUSE_16_BIT_TICKS == 1)
+	typedef uint16_t TickType_t;
+	#define portMAX_DELAY (TickType_t)0xffff
+#else
+	typedef uint32_t TickType_t;
+	#define portMAX_DELAY (TickType_t)0xffffffffUL
+	#define portTICK_TYPE_IS_ATOMIC 1
+#endif
+
+#define portSTACK_GROWTH			(-1)
+#define portTICK_PERIOD_MS			((TickType_t)1000 / configTICK_RATE_HZ)
+#define portBYTE_ALIGNMENT			8
+
+extern volatile uint32_t host_critical_nesting;
+extern volatile uint32_t host_yields;
+
+#define portYIELD()										(host_yields++)
+#define portEND_SWITCHING_ISR(xSwitchRequired)			do{ if((xSwitchRequired) != pdFALSE) portYIELD(); }while(0)
+#define portYIELD_FROM_ISR(x)							portEND_SWITCHING_ISR(x)
+
+#define portSET_INTERRUPT_MASK_FROM_ISR()				(host_critical_nesting++, 0UL)
+#define portCLEAR_INTERRUPT_MASK_FROM_ISR(x)			((void)(x), host_critical_nesting--)
+#define portDISABLE_INTERRUPTS()						((void)0)
+#define portENABLE_INTERRUPTS()							((void)0)
+#define portENTER_CRITICAL()							(host_critical_nesting++)
+#define portEXIT_CRITICAL()								(host_critical_nesting--)
+
+#define portTASK_FUNCTION_PROTO(vFunction, pvParameters)	void vFunction(void *pvParameters)
+#define portTASK_FUNCTION(vFunction, pvParameters)		void vFunction(void *pvParameters)
+
+#define portNOP()
+#define portINLINE	__inline
+#define portFORCE_INLINE inline __attribute__((always_inline))
+#define portMEMORY_BARRIER() __asm volatile("" ::: "memory")
+
+static inline BaseType_t xPortIsInsideInterrupt(void){
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PORTMACRO_H
@@ -0,0 +1,12 @@
+#ifndef HOST_REENT_H
+#define HOST_REENT_H
+
+// newlib's per-task state, which FreeRTOS.h sizes StaticTask_t with when
+// configUSE_NEWLIB_REENTRANT is set. glibc has no such header; nothing on the
+// host reads it.
+struct _reent {
+	int _errno;
+	void *_reserved[8];
+};
+
+#endif // HOST_REENT_H
@@ -0,0 +1,62 @@
+#ifndef FAST_MEM_H
+#define FAST_MEM_H
+
+/*
+ * Where the hot paths run from, shared by the STM32 boards.
+ *
+ * Flash: the ART accelerator (prefetch, 64-line I-cache, 8-line D-cache) hides
+ * the FLASH_LATENCY wait states on loops that stay resident. HAL_Init() turns
+ * it on from stm32f4xx_hal_conf.h; FastMem_CheckArt() checks that it did.
+ *
+ * RAM code: FAST_CODE puts a function in .RamFunc, which the linker script
+ * keeps in .data (SRAM, copied at reset). CCM-RAM is on the D-bus only, so code
+ * cannot run from there. SRAM code dodges ART misses, which is what a rarely
+ * taken ISR mostly sees, but competes with DMA on the S-bus and calls out to
+ * flash HAL code through long calls. So it is a build option, off by default:
+ * add -DFAST_CODE_IN_RAM=1 and compare the profiler's numbers before keeping it.
+ *
+ * Hot data goes to CCM-RAM with each project's CCMRAM macro (see its main.c).
+ *
+ * Add Common/Inc to the project's include paths. Nothing here needs a .c file.
+ */
+
+#include "stm32f4xx_hal.h"
+
+#ifndef FAST_CODE_IN_RAM
+#define FAST_CODE_IN_RAM 0
+#endif
+
+#if FAST_CODE_IN_RAM
+#define FAST_CODE __attribute__((section(".RamFunc"), noinline, long_call))
+#else
+#define FAST_CODE
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FAST_MEM_ART_BITS (FLASH_ACR_PRFTEN | FLASH_ACR_ICEN | FLASH_ACR_DCEN)
+
+// Once after SystemClock_Config(). Turns on whatever part of the ART is off,
+// resetting a cache before enabling it as RM0090 asks, and returns the
+// FLASH_ACR bits that were missing: 0 when HAL_Init() had set them all.
+static inline uint32_t FastMem_CheckArt(void){
+	uint32_t missing = FAST_MEM_ART_BITS & ~FLASH->ACR;
+	if(missing & FLASH_ACR_ICEN){
+		FLASH->ACR |= FLASH_ACR_ICRST;
+		FLASH->ACR &= ~FLASH_ACR_ICRST;
+	}
+	if(missing & FLASH_ACR_DCEN){
+		FLASH->ACR |= FLASH_ACR_DCRST;
+		FLASH->ACR &= ~FLASH_ACR_DCRST;
+	}
+	FLASH->ACR |= missing;
+	return missing;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FAST_MEM_H
@@ -0,0 +1,169 @@
+#ifndef FMT_H
+#define FMT_H
+
+/*
+ * Small text formatter for the firmware's displays and replies, shared by the
+ * STM32 boards, so that neither links newlib's float printf (-u _printf_float):
+ * that path is several KB of flash, runs soft double conversions and takes a
+ * few hundred bytes of the calling task's stack.
+ *
+ *   Fmt f;
+ *   Fmt_Init(&f, buf, sizeof(buf));
+ *   Fmt_Str(&f, "x: ");
+ *   Fmt_Fixed(&f, x, 2, 6);          // "%6.2f"
+ *
+ * Every call appends and keeps buf NUL-terminated; what does not fit is cut
+ * off, as snprintf would. No heap, no varargs, a few words of stack. Widths
+ * pad on the left with spaces. Fmt_Fixed() is the hot one and stays in
+ * float and 32-bit integers; Fmt_Float() ("%g") uses double and is meant
+ * for reports, not loops.
+ *
+ * Integer-only printf (newlib-nano) is still fine for everything else.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} Fmt;
+
+static inline void Fmt_Init(Fmt *f, char *buf, size_t size){
+	f->buf = buf;
+	f->len = 0;
+	f->size = size;
+	if(size) buf[0] = '\0';
+}
+
+static inline void Fmt_Char(Fmt *f, char c){
+	if(f->len + 1 >= f->size) return;
+	f->buf[f->len++] = c;
+	f->buf[f->len] = '\0';
+}
+
+static inline void Fmt_Str(Fmt *f, const char *s){
+	while(*s) Fmt_Char(f, *s++);
+}
+
+// v in base, at least minDigits digits, '-' first if neg, the lot padded to width
+static inline void Fmt_Digits(Fmt *f, uint32_t v, uint8_t neg, uint32_t base, int minDigits, int width){
+	char tmp[32];
+	int n = 0;
+	do {
+		tmp[n++] = "0123456789ABCDEF"[v % base];
+		v /= base;
+	} while((v || n < minDigits) && n < (int)sizeof(tmp));
+	for(int pad = width - n - neg; pad > 0; pad--) Fmt_Char(f, ' ');
+	if(neg) Fmt_Char(f, '-');
+	while(n) Fmt_Char(f, tmp[--n]);
+}
+
+// "%*u"
+static inline void Fmt_Uint(Fmt *f, uint32_t v, int width){
+	Fmt_Digits(f, v, 0, 10, 1, width);
+}
+
+// "%*d"
+static inline void Fmt_Int(Fmt *f, int32_t v, int width){
+	Fmt_Digits(f, v < 0 ? 0u - (uint32_t)v : (uint32_t)v, v < 0, 10, 1, width);
+}
+
+// "%0*lX"
+static inline void Fmt_Hex(Fmt *f, uint32_t v, int digits){
+	Fmt_Digits(f, v, 0, 16, digits, 0);
+}
+
+// "%*.*f" for 0..4 decimals, rounded half away from zero; magnitudes past
+// 32 bits print as UINT32_MAX
+static inline void Fmt_Fixed(Fmt *f, float v, int decimals, int width){
+	static const uint32_t scale[5] = {1u, 10u, 100u, 1000u, 10000u};
+	if(decimals < 0) decimals = 0;
+	if(decimals > 4) decimals = 4;
+	if(v != v){
+		for(int pad = width - 3; pad > 0; pad--) Fmt_Char(f, ' ');
+		Fmt_Str(f, "nan");
+		return;
+	}
+	uint8_t neg = v < 0.0f;
+	float a = neg ? -v : v;
+	// Whole and fraction apart: the fraction is exact in a float, so only
+	// the last step rounds
+	uint32_t ip = a >= 4294967040.0f ? UINT32_MAX : (uint32_t)a;
+	uint32_t fp = (uint32_t)((a - (float)ip) * (float)scale[decimals] + 0.5f);
+	if(fp >= scale[decimals] && ip < UINT32_MAX){
+		fp -= scale[decimals];
+		ip++;
+	}else if(fp >= scale[decimals]){
+		fp = scale[decimals] - 1u;
+	}
+	if(ip == 0 && fp == 0) neg = 0; // No "-0.0"
+	int fracWidth = decimals ? decimals + 1 : 0;
+	Fmt_Digits(f, ip, neg, 10, 1, width - fracWidth);
+	if(!decimals) return;
+	Fmt_Char(f, '.');
+	Fmt_Digits(f, fp, 0, 10, decimals, 0);
+}
+
+// "%g": six significant digits, trailing zeros dropped, exponent form below
+// 1e-4 and from 1e6
+static inline void Fmt_Float(Fmt *f, float v){
+	if(v != v){
+		Fmt_Str(f, "nan");
+		return;
+	}
+	if(v < 0.0f){
+		Fmt_Char(f, '-');
+		v = -v;
+	}
+	if(v > 3.4028235e38f){
+		Fmt_Str(f, "inf");
+		return;
+	}
+	if(v == 0.0f){
+		Fmt_Char(f, '0');
+		return;
+	}
+	// One scaling by a power of ten (exact in a double), so one rounding
+	double a = v, p = 1.0;
+	int e = 0;
+	while(a >= p * 10.0){ p *= 10.0; e++; }
+	if(e > 0) a /= p;
+	while(a * p < 1.0){ p *= 10.0; e--; }
+	if(e < 0) a *= p;
+	uint32_t m = (uint32_t)(a * 100000.0 + 0.5); // 100000..1000000
+	if(m >= 1000000u){ m /= 10u; e++; }
+	char d[6];
+	for(int i = 5; i >= 0; i--){ d[i] = (char)('0' + m % 10u); m /= 10u; }
+	int last = 5;
+	while(last > 0 && d[last] == '0') last--;
+	if(e >= -4 && e < 6){
+		if(e < 0){
+			Fmt_Str(f, "0.");
+			for(int i = -1; i > e; i--) Fmt_Char(f, '0');
+			for(int i = 0; i <= last; i++) Fmt_Char(f, d[i]);
+			return;
+		}
+		for(int i = 0; i <= e; i++) Fmt_Char(f, d[i]);
+		if(last > e) Fmt_Char(f, '.');
+		for(int i = e + 1; i <= last; i++) Fmt_Char(f, d[i]);
+		return;
+	}
+	Fmt_Char(f, d[0]);
+	if(last > 0) Fmt_Char(f, '.');
+	for(int i = 1; i <= last; i++) Fmt_Char(f, d[i]);
+	Fmt_Char(f, 'e');
+	Fmt_Char(f, e < 0 ? '-' : '+');
+	Fmt_Digits(f, (uint32_t)(e < 0 ? -e : e), 0, 10, 2, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FMT_H
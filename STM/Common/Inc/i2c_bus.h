@@ -0,0 +1,213 @@
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+/*
+ * Non-blocking I2C for the STM32 boards: a queue of register transactions run
+ * back to back from the HAL's completion interrupts (reads of two or more
+ * bytes by DMA, the rest by interrupt), each with its own deadline and a
+ * completion callback, and bus recovery that does not wait for the next boot.
+ *
+ * I2cBus_Submit() queues a transaction and returns at once. Its done() runs
+ * once, from the I2C or DMA interrupt or from I2cBus_Poll(), with HAL_OK,
+ * HAL_ERROR (NACK, bus error, or the queue could not start it) or
+ * HAL_TIMEOUT. A NACK only fails its own transaction. A bus error, a missed
+ * deadline or a bus found BUSY while idle also recovers the bus before the
+ * next one starts:
+ *   - the peripheral is released (MspDeInit stops its DMA and interrupts);
+ *   - SCL is clocked by hand, up to nine times, until a slave that was cut
+ *     off mid-byte lets go of SDA;
+ *   - a STOP is sent;
+ *   - I2C is initialised again (SWRST, and MspInit puts the pins back).
+ *
+ * The board routes HAL_I2C_MemRxCpltCallback, HAL_I2C_MemTxCpltCallback and
+ * HAL_I2C_ErrorCallback to I2cBus_Complete(), and calls I2cBus_Poll() from
+ * the owning task whenever it wakes. Deadlines are checked there and
+ * recoveries run there (about 100 us, never in an interrupt). A transaction
+ * and its data must stay put until done() has run.
+ */
+
+#include "stm32f4xx_hal.h"
+
+#ifndef I2C_BUS_QUEUE
+#define I2C_BUS_QUEUE 8   // Transactions waiting; a power of two
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct I2cXfer I2cXfer;
+struct I2cXfer {
+	uint16_t addr;       // Shifted (8-bit) device address, as the HAL takes it
+	uint8_t reg;
+	uint8_t write;       // 0: read len bytes from reg, 1: write them
+	uint8_t *data;
+	uint16_t len;
+	uint16_t timeoutMs;  // From the moment it starts on the bus
+	void (*done)(I2cXfer *x, HAL_StatusTypeDef status);
+	void *ctx;           // The submitter's
+};
+
+typedef struct {
+	I2C_HandleTypeDef *hi2c;
+	GPIO_TypeDef *sclPort;
+	uint16_t sclPin;
+	GPIO_TypeDef *sdaPort;
+	uint16_t sdaPin;
+	I2cXfer *queue[I2C_BUS_QUEUE];
+	volatile uint8_t head, tail;
+	I2cXfer *volatile active; // On the bus, or NULL
+	volatile uint32_t startMs;
+	volatile uint8_t needRecover;
+	volatile uint32_t nacks, busErrors, timeouts, recoveries;
+} I2cBus;
+
+static inline uint32_t I2cBus_Lock(void){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	return primask;
+}
+
+static inline void I2cBus_Unlock(uint32_t primask){
+	__set_PRIMASK(primask);
+}
+
+// Roughly 5 us at 168 MHz: a 100 kHz half clock, slower than any slave needs
+static inline void I2cBus_HalfClock(void){
+	for(volatile uint32_t n = SystemCoreClock / 1000000u; n; n--){}
+}
+
+// Starts queued transactions while the bus is free; from a task or an ISR
+static inline void I2cBus_Kick(I2cBus *bus){
+	for(;;){
+		uint32_t primask = I2cBus_Lock();
+		if(bus->active || bus->needRecover || bus->head == bus->tail){
+			I2cBus_Unlock(primask);
+			return;
+		}
+		if(__HAL_I2C_GET_FLAG(bus->hi2c, I2C_FLAG_BUSY)){
+			// Nothing of ours is on it, so SDA is held: the HAL would spin 25 ms
+			bus->needRecover = 1;
+			I2cBus_Unlock(primask);
+			return;
+		}
+		I2cXfer *x = bus->queue[bus->tail];
+		bus->tail = (uint8_t)((bus->tail + 1u) & (I2C_BUS_QUEUE - 1u));
+		bus->active = x;
+		bus->startMs = HAL_GetTick();
+		I2cBus_Unlock(primask);
+
+		HAL_StatusTypeDef status;
+		if(x->write) status = HAL_I2C_Mem_Write_IT(bus->hi2c, x->addr, x->reg, I2C_MEMADD_SIZE_8BIT, x->data, x->len);
+		else if(x->len > 1) status = HAL_I2C_Mem_Read_DMA(bus->hi2c, x->addr, x->reg, I2C_MEMADD_SIZE_8BIT, x->data, x->len);
+		else status = HAL_I2C_Mem_Read_IT(bus->hi2c, x->addr, x->reg, I2C_MEMADD_SIZE_8BIT, x->data, x->len);
+		if(status == HAL_OK) return;
+
+		primask = I2cBus_Lock();
+		uint8_t ours = bus->active == x;
+		if(ours){
+			bus->active = NULL;
+			bus->needRecover = 1;
+			bus->busErrors++;
+		}
+		I2cBus_Unlock(primask);
+		if(ours && x->done) x->done(x, HAL_ERROR);
+	}
+}
+
+// Queues x. Returns 0, or -1 if the queue is full (done() will not run).
+static inline int I2cBus_Submit(I2cBus *bus, I2cXfer *x){
+	uint32_t primask = I2cBus_Lock();
+	uint8_t next = (uint8_t)((bus->head + 1u) & (I2C_BUS_QUEUE - 1u));
+	if(next == bus->tail){
+		I2cBus_Unlock(primask);
+		return -1;
+	}
+	bus->queue[bus->head] = x;
+	bus->head = next;
+	I2cBus_Unlock(primask);
+	I2cBus_Kick(bus);
+	return 0;
+}
+
+// From the HAL's completion and error callbacks for bus->hi2c
+static inline void I2cBus_Complete(I2cBus *bus, HAL_StatusTypeDef status){
+	uint32_t primask = I2cBus_Lock();
+	I2cXfer *x = bus->active;
+	bus->active = NULL;
+	if(x && status != HAL_OK){
+		if(bus->hi2c->ErrorCode & ~(uint32_t)HAL_I2C_ERROR_AF){
+			bus->busErrors++;
+			bus->needRecover = 1;
+		}else{
+			bus->nacks++; // The HAL has sent the STOP already
+		}
+	}
+	I2cBus_Unlock(primask);
+	if(!x) return; // Timed out already; recovery is on its way
+	if(x->done) x->done(x, status);
+	I2cBus_Kick(bus);
+}
+
+// Frees a stuck bus and brings the peripheral back; task context only
+static inline void I2cBus_Recover(I2cBus *bus){
+	bus->needRecover = 0;
+	bus->recoveries++;
+	HAL_I2C_DeInit(bus->hi2c);
+
+	GPIO_InitTypeDef gpio = {0};
+	gpio.Mode = GPIO_MODE_OUTPUT_OD;
+	gpio.Pull = GPIO_NOPULL;
+	gpio.Speed = GPIO_SPEED_FREQ_LOW;
+	HAL_GPIO_WritePin(bus->sclPort, bus->sclPin, GPIO_PIN_SET);
+	HAL_GPIO_WritePin(bus->sdaPort, bus->sdaPin, GPIO_PIN_SET);
+	gpio.Pin = bus->sclPin;
+	HAL_GPIO_Init(bus->sclPort, &gpio);
+	gpio.Pin = bus->sdaPin;
+	HAL_GPIO_Init(bus->sdaPort, &gpio);
+	I2cBus_HalfClock();
+
+	for(int i = 0; i < 9 && HAL_GPIO_ReadPin(bus->sdaPort, bus->sdaPin) == GPIO_PIN_RESET; i++){
+		HAL_GPIO_WritePin(bus->sclPort, bus->sclPin, GPIO_PIN_RESET);
+		I2cBus_HalfClock();
+		HAL_GPIO_WritePin(bus->sclPort, bus->sclPin, GPIO_PIN_SET);
+		I2cBus_HalfClock();
+	}
+	// STOP: SDA rises while SCL is high
+	HAL_GPIO_WritePin(bus->sclPort, bus->sclPin, GPIO_PIN_RESET);
+	I2cBus_HalfClock();
+	HAL_GPIO_WritePin(bus->sdaPort, bus->sdaPin, GPIO_PIN_RESET);
+	I2cBus_HalfClock();
+	HAL_GPIO_WritePin(bus->sclPort, bus->sclPin, GPIO_PIN_SET);
+	I2cBus_HalfClock();
+	HAL_GPIO_WritePin(bus->sdaPort, bus->sdaPin, GPIO_PIN_SET);
+	I2cBus_HalfClock();
+
+	HAL_I2C_Init(bus->hi2c); // SWRST, then MspInit: pins back to I2C, DMA and interrupts on
+}
+
+// Fails the transaction on the bus if it is past its deadline, recovers the
+// bus when it needs it and starts whatever is queued; from the owning task
+static inline void I2cBus_Poll(I2cBus *bus){
+	uint32_t primask = I2cBus_Lock();
+	I2cXfer *late = bus->active;
+	if(late && HAL_GetTick() - bus->startMs > late->timeoutMs){
+		bus->active = NULL;
+		bus->needRecover = 1;
+		bus->timeouts++;
+	}else{
+		late = NULL;
+	}
+	uint8_t recover = bus->needRecover && !bus->active;
+	I2cBus_Unlock(primask);
+	// Before done(): DeInit stops the DMA that may still be writing late->data
+	if(recover) I2cBus_Recover(bus);
+	if(late && late->done) late->done(late, HAL_TIMEOUT);
+	I2cBus_Kick(bus);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // I2C_BUS_H
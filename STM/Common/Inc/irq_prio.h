@@ -0,0 +1,102 @@
+#ifndef IRQ_PRIO_H
+#define IRQ_PRIO_H
+
+/*
+ * Interrupt priority scheme, shared by the STM32 boards.
+ *
+ * FreeRTOS wants every priority bit for preemption (NVIC_PRIORITYGROUP_4,
+ * no subpriorities), and an ISR that calls a FromISR function must sit at
+ * configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY (5) or below it, numerically
+ * 5..15. All of the boards' ISRs do, so the scheme uses 5..8 and leaves 15 to
+ * the kernel (PendSV, SysTick) and the HAL timebase:
+ *
+ *   5  IRQ_PRIO_CONTROL  the control loop's timer: its latency is jitter on
+ *                        every control step
+ *   6  IRQ_PRIO_CAPTURE  encoder and echo input capture. The counter latches
+ *                        the edge, so latency only costs reading it before
+ *                        the next edge, and stop triggers fire a little later
+ *   7  IRQ_PRIO_LINK     the RPi link: UART RX/TX and its DMA, USB. Bytes wait
+ *                        in the UART or the packet buffer
+ *   8  IRQ_PRIO_OTHER    everything else: I2C and its DMA, buttons, IR, PWM DMA
+ *   15 IRQ_PRIO_TIMEBASE the HAL tick, late by at most what runs above it
+ *
+ * Kernel critical sections mask 5..15 all alike, so the worst latency of the
+ * control timer is the longest critical section or __disable_irq() stretch,
+ * and each lower level adds the worst case of the levels above it (WCET_ISR_*
+ * in the SCHED report). Levels also decide which ISR can corrupt which: two
+ * ISRs on one level never interleave.
+ *
+ * CubeMX writes its own priorities into the MspInit functions, so each board
+ * lists its IRQs against these levels and calls IrqPrio_Apply() once every
+ * peripheral is initialised, before the scheduler starts. Anything enabled
+ * and not in the list goes to IRQ_PRIO_OTHER, so a new peripheral cannot
+ * outrank the control loop by accident.
+ *
+ * IrqPrio_TimerLatency() measures it: a timer counts from the hardware event
+ * (an update, or the edge a capture latched), so reading the counter inside
+ * the ISR gives the delay to that point. The boards add it to prof.h regions
+ * (LAT_*), whose max PROF prints.
+ */
+
+#include "stm32f4xx_hal.h"
+
+#define IRQ_PRIO_CONTROL   5
+#define IRQ_PRIO_CAPTURE   6
+#define IRQ_PRIO_LINK      7
+#define IRQ_PRIO_OTHER     8
+#define IRQ_PRIO_TIMEBASE  15
+#define IRQ_PRIO_EXTERNAL  (FPU_IRQn + 1) // STM32F407's device IRQs; FPU_IRQn is the last
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	IRQn_Type irq;
+	uint8_t prio;
+} IrqPrio;
+
+// Sets the grouping, each IRQ in map to its level and every other enabled
+// device IRQ to IRQ_PRIO_OTHER. Returns how many priorities it changed.
+static inline uint32_t IrqPrio_Apply(const IrqPrio *map, uint32_t n){
+	uint32_t changed = 0;
+	HAL_NVIC_SetPriorityGrouping(NVIC_PRIORITYGROUP_4);
+	for(int irq = 0; irq < IRQ_PRIO_EXTERNAL; irq++){
+		uint32_t prio = IRQ_PRIO_OTHER;
+		uint8_t listed = 0;
+		for(uint32_t i = 0; i < n; i++){
+			if(map[i].irq == (IRQn_Type)irq){
+				prio = map[i].prio;
+				listed = 1;
+			}
+		}
+		if(!listed && !NVIC_GetEnableIRQ((IRQn_Type)irq)) continue;
+		if(NVIC_GetPriority((IRQn_Type)irq) != prio){
+			NVIC_SetPriority((IRQn_Type)irq, prio);
+			changed++;
+		}
+	}
+	return changed;
+}
+
+// CPU cycles per count of tim, from the clock tree and its prescaler. Timers
+// on a divided APB bus run at twice its clock.
+static inline uint32_t IrqPrio_CyclesPerCount(const TIM_TypeDef *tim){
+	uint32_t pclk = (uintptr_t)tim >= APB2PERIPH_BASE ? HAL_RCC_GetPCLK2Freq() : HAL_RCC_GetPCLK1Freq();
+	uint32_t timClk = pclk == HAL_RCC_GetHCLKFreq() ? pclk : 2u * pclk;
+	return SystemCoreClock / timClk * (tim->PSC + 1u);
+}
+
+// CPU cycles since tim's counter was at count: the time from the hardware
+// event that left it there to this call, up to one counter period, to the
+// resolution of one count.
+static inline uint32_t IrqPrio_TimerLatency(const TIM_TypeDef *tim, uint32_t count, uint32_t cycPerCount){
+	uint32_t period = tim->ARR + 1;
+	return (tim->CNT + period - count) % period * cycPerCount;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // IRQ_PRIO_H
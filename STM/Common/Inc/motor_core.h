@@ -0,0 +1,155 @@
+#ifndef MOTOR_CORE_H
+#define MOTOR_CORE_H
+
+/*
+ * Motor, servo and encoder access shared by the STM32 boards.
+ *
+ * Each project keeps its pin/timer choices in Core/Inc/board.h as macros:
+ *   BOARD_MOTOR_x_TIM, _FWD, _REV  H-bridge timer and its two channel numbers
+ *   BOARD_MOTOR_x_HTIM             HAL handle, only used to start the PWM
+ *   BOARD_ENCODER_x_TIM            Quadrature timer, where x is A or B
+ *   BOARD_SERVO_TIM, _CH, _HTIM    Steering servo
+ *   BOARD_PWM_MAX                  Motor timer period (ARR)
+ *   BOARD_MOTOR_SYNC_TS            Optional: the trigger input (TIM_TS_ITRn) by
+ *                                  which motor A's timer sees motor B's
+ *                                  update, when the two timers can be chained
+ * Channel numbers are plain 1..4 so they can be pasted into CCRn. With the map
+ * known at compile time, and MotorId / EncoderId passed as constants, every
+ * helper below inlines to one or two stores to (or a load from) the timer
+ * registers, with no HAL handle or channel switch left at run time.
+ *
+ *
+ * Compare preload is on for every PWM channel (HAL_TIM_PWM_ConfigChannel sets
+ * OCxPE), so a CCR store only reaches the output at the timer's next update
+ * event and a pulse is never cut short or doubled. Motor_SetBoth() goes one
+ * step further for the two bridges: it holds updates off on both timers
+ * (UDIS), stores all four compare values and lets both timers update again,
+ * so the new duties take effect together. With BOARD_MOTOR_SYNC_TS, motor A's
+ * timer is reset by every update of motor B's, so both timers count in step
+ * and take the new duties on the same update event. Without it, each timer
+ * takes them at its own next update, at most one PWM period apart.
+ *
+ * Add Common/Inc to the project's include paths. Nothing here needs a .c file.
+ */
+
+#include "stm32f4xx_hal.h"
+#include "board.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {MOTOR_A, MOTOR_B} MotorId;
+typedef enum {ENCODER_A, ENCODER_B} EncoderId;
+
+#define MOTOR_CORE_CCR_(tim, ch) ((tim)->CCR##ch)
+#define MOTOR_CORE_CCR(tim, ch) MOTOR_CORE_CCR_(tim, ch) // Expands ch before pasting
+#define MOTOR_CORE_CHANNEL(ch) (((ch) - 1U) * 4U)         // 1..4 -> TIM_CHANNEL_1..4
+
+extern TIM_HandleTypeDef BOARD_MOTOR_A_HTIM;
+extern TIM_HandleTypeDef BOARD_MOTOR_B_HTIM;
+extern TIM_HandleTypeDef BOARD_SERVO_HTIM;
+
+// Both channels of both bridges, once after MX_TIMx_Init().
+static inline void Motor_Start(void){
+	HAL_TIM_PWM_Start(&BOARD_MOTOR_A_HTIM, MOTOR_CORE_CHANNEL(BOARD_MOTOR_A_FWD));
+	HAL_TIM_PWM_Start(&BOARD_MOTOR_A_HTIM, MOTOR_CORE_CHANNEL(BOARD_MOTOR_A_REV));
+	HAL_TIM_PWM_Start(&BOARD_MOTOR_B_HTIM, MOTOR_CORE_CHANNEL(BOARD_MOTOR_B_FWD));
+	HAL_TIM_PWM_Start(&BOARD_MOTOR_B_HTIM, MOTOR_CORE_CHANNEL(BOARD_MOTOR_B_REV));
+#ifdef BOARD_MOTOR_SYNC_TS
+	// B's update goes out on TRGO and resets A's counter (slave reset mode)
+	BOARD_MOTOR_B_TIM->CR2 = (BOARD_MOTOR_B_TIM->CR2 & ~TIM_CR2_MMS) | TIM_TRGO_UPDATE;
+	BOARD_MOTOR_A_TIM->SMCR = (BOARD_MOTOR_A_TIM->SMCR & ~(TIM_SMCR_TS | TIM_SMCR_SMS)) | BOARD_MOTOR_SYNC_TS
+			| TIM_SLAVEMODE_RESET;
+#endif
+}
+
+static inline void Servo_Start(void){
+	HAL_TIM_PWM_Start(&BOARD_SERVO_HTIM, MOTOR_CORE_CHANNEL(BOARD_SERVO_CH));
+}
+
+// dir 0 drives the FWD channel, 1 the REV channel; the other one is held low.
+// Which of them moves the robot forward depends on how the motor is mounted.
+static inline void Motor_Set(MotorId motor, uint16_t duty, uint8_t dir){
+	if(motor == MOTOR_A){
+		MOTOR_CORE_CCR(BOARD_MOTOR_A_TIM, BOARD_MOTOR_A_FWD) = dir ? 0 : duty;
+		MOTOR_CORE_CCR(BOARD_MOTOR_A_TIM, BOARD_MOTOR_A_REV) = dir ? duty : 0;
+	}else{
+		MOTOR_CORE_CCR(BOARD_MOTOR_B_TIM, BOARD_MOTOR_B_FWD) = dir ? 0 : duty;
+		MOTOR_CORE_CCR(BOARD_MOTOR_B_TIM, BOARD_MOTOR_B_REV) = dir ? duty : 0;
+	}
+}
+
+// Holds the compare values of both bridges in their preload registers until
+// Motor_Commit(). Anything stored in between, by Motor_Set(), Motor_Brake() or
+// Motor_Coast(), is applied in one go.
+static inline void Motor_Hold(void){
+	BOARD_MOTOR_A_TIM->CR1 |= TIM_CR1_UDIS;
+	BOARD_MOTOR_B_TIM->CR1 |= TIM_CR1_UDIS;
+}
+
+// B first: with BOARD_MOTOR_SYNC_TS its update is the one that also updates A.
+static inline void Motor_Commit(void){
+	BOARD_MOTOR_B_TIM->CR1 &= ~TIM_CR1_UDIS;
+	BOARD_MOTOR_A_TIM->CR1 &= ~TIM_CR1_UDIS;
+}
+
+// Both wheels together, for a control step. Arguments are as for Motor_Set().
+static inline void Motor_SetBoth(uint16_t dutyA, uint8_t dirA, uint16_t dutyB, uint8_t dirB){
+	Motor_Hold();
+	Motor_Set(MOTOR_A, dutyA, dirA);
+	Motor_Set(MOTOR_B, dutyB, dirB);
+	Motor_Commit();
+}
+
+// Both inputs high for duty counts of every period: the bridge shorts the
+// motor (slow decay) for that part and lets it coast for the rest, so the
+// braking torque scales with duty. It comes from the motor's own back-EMF,
+// not the battery.
+static inline void Motor_ShortBrake(MotorId motor, uint16_t duty){
+	if(motor == MOTOR_A){
+		MOTOR_CORE_CCR(BOARD_MOTOR_A_TIM, BOARD_MOTOR_A_FWD) = duty;
+		MOTOR_CORE_CCR(BOARD_MOTOR_A_TIM, BOARD_MOTOR_A_REV) = duty;
+	}else{
+		MOTOR_CORE_CCR(BOARD_MOTOR_B_TIM, BOARD_MOTOR_B_FWD) = duty;
+		MOTOR_CORE_CCR(BOARD_MOTOR_B_TIM, BOARD_MOTOR_B_REV) = duty;
+	}
+}
+
+// Shorted for the whole period, which stops the motor hard.
+static inline void Motor_Brake(MotorId motor){
+	Motor_ShortBrake(motor, BOARD_PWM_MAX);
+}
+
+// Both inputs low: the motor freewheels.
+static inline void Motor_Coast(MotorId motor){
+	Motor_Set(motor, 0, 0);
+}
+
+// Net drive on the motor in either direction, as the bridge sees it: 0 while
+// it coasts or is braked (both channels equal).
+static inline uint16_t Motor_Duty(MotorId motor){
+	uint32_t fwd = motor == MOTOR_A ? MOTOR_CORE_CCR(BOARD_MOTOR_A_TIM, BOARD_MOTOR_A_FWD)
+	                                : MOTOR_CORE_CCR(BOARD_MOTOR_B_TIM, BOARD_MOTOR_B_FWD);
+	uint32_t rev = motor == MOTOR_A ? MOTOR_CORE_CCR(BOARD_MOTOR_A_TIM, BOARD_MOTOR_A_REV)
+	                                : MOTOR_CORE_CCR(BOARD_MOTOR_B_TIM, BOARD_MOTOR_B_REV);
+	return (uint16_t)(fwd > rev ? fwd - rev : rev - fwd);
+}
+
+// Servo pulse in timer counts (the board's servo timer sets the unit). With
+// compare preload the new width starts with the next servo period.
+static inline void Servo_Set(uint16_t pulse){
+	MOTOR_CORE_CCR(BOARD_SERVO_TIM, BOARD_SERVO_CH) = pulse;
+}
+
+// Raw quadrature count. TIM2 and TIM5 are 32-bit, the others 16-bit; callers
+// that difference counts should cast to the width their ARR gives them.
+static inline uint32_t Encoder_Count(EncoderId encoder){
+	return encoder == ENCODER_A ? BOARD_ENCODER_A_TIM->CNT : BOARD_ENCODER_B_TIM->CNT;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MOTOR_CORE_H
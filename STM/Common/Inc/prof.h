@@ -0,0 +1,73 @@
+#ifndef PROF_H
+#define PROF_H
+
+/*
+ * Cycle-count profiling of named code regions, shared by the STM32 boards.
+ *
+ *   PROF_BEGIN(PR_PARSE);
+ *   ...
+ *   PROF_END(PR_PARSE);
+ *
+ * PROF_BEGIN reads DWT->CYCCNT into a local named after the region and
+ * PROF_END adds the cycles since then to profRegions[PR_PARSE]: count, min,
+ * max and sum, so the pair must sit in one block and regions can nest. The
+ * cycles are wall time: anything that preempts the region is in them, where
+ * task_wcet.h charges a task only for its own. A region is updated without a
+ * lock, so each one must only ever be entered from one task or one ISR.
+ *
+ * Each board's main.c names its regions in an enum ending in PR_REGIONS,
+ * defines profRegions[PR_REGIONS] and prints them with Prof_Take(). With
+ * PROF_ENABLE 0 the macros compile to nothing. DWT must already be counting
+ * (the boards start it for task_wcet.h).
+ */
+
+#include "stm32f4xx_hal.h"
+
+#ifndef PROF_ENABLE
+#define PROF_ENABLE 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	uint32_t n;
+	uint32_t cycMin;  // meaningful once n > 0
+	uint32_t cycMax;
+	uint64_t cycSum;
+} ProfRegion;
+
+extern ProfRegion profRegions[];
+
+static inline void Prof_Add(ProfRegion *r, uint32_t cyc){
+	if(!r->n || cyc < r->cycMin) r->cycMin = cyc;
+	if(cyc > r->cycMax) r->cycMax = cyc;
+	r->cycSum += cyc;
+	r->n++;
+}
+
+// Copies r to *out and starts it over, with interrupts masked so an ISR's
+// region is not torn
+static inline void Prof_Take(ProfRegion *r, ProfRegion *out){
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	*out = *r;
+	r->n = r->cycMin = r->cycMax = 0;
+	r->cycSum = 0;
+	__set_PRIMASK(primask);
+}
+
+#if PROF_ENABLE
+#define PROF_BEGIN(id) const uint32_t prof_t0_##id = DWT->CYCCNT
+#define PROF_END(id)   Prof_Add(&profRegions[id], DWT->CYCCNT - prof_t0_##id)
+#else
+#define PROF_BEGIN(id) ((void)0)
+#define PROF_END(id)   ((void)0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PROF_H
@@ -0,0 +1,99 @@
+#ifndef Q16_H
+#define Q16_H
+
+/*
+ * Q16.16 fixed point for the control loops, shared by the STM32 boards.
+ *
+ * A q16_t holds a value times 65536 in an int32_t: a sign, 15 integer bits to
+ * +-32767.99998 and steps of 1/65536. That covers what the loops carry (wheel
+ * speeds in counts/s or cm/s, PWM duties to BOARD_PWM_MAX, integrals, gains)
+ * with room to spare. Every operation below saturates at Q16_MIN/Q16_MAX
+ * instead of wrapping, so a runaway product clamps the way the float code's
+ * limits would rather than flipping sign. Products go through an int64_t:
+ * one SMULL and a shift on the Cortex-M4.
+ *
+ * Two things come with it. A q16_t is one aligned 32-bit word, which a single
+ * LDR or STR moves whole, so a value one task writes and others read needs no
+ * critical section. And integer arithmetic has no rounding to differ, so the
+ * host bench (Common/Host) replays a loop to the same bits the board computes.
+ *
+ * Q16_C(), Q16_FromFloat() and Q16_ToFloat() are for the edges only:
+ * constants, parameters from a calibration store, engineering units for
+ * telemetry and the commands. Nothing in a loop should need them.
+ *
+ * Add Common/Inc to the project's include paths. Nothing here needs a .c file.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int32_t q16_t;
+
+#define Q16_SHIFT 16
+#define Q16_ONE   ((q16_t)1 << Q16_SHIFT)
+#define Q16_MAX   INT32_MAX
+#define Q16_MIN   INT32_MIN
+
+// A constant for initialisers and #defines, which the compiler folds. f must
+// be in range.
+#define Q16_C(f) ((q16_t)((f) * 65536.0 + ((f) < 0 ? -0.5 : 0.5)))
+
+// An int64_t result brought back into range.
+static inline q16_t Q16_Sat(int64_t v){
+	if(v > (int64_t)Q16_MAX) return Q16_MAX;
+	if(v < (int64_t)Q16_MIN) return Q16_MIN;
+	return (q16_t)v;
+}
+
+static inline q16_t Q16_FromInt(int32_t n){
+	return Q16_Sat((int64_t)n * Q16_ONE);
+}
+
+// Rounds to the nearest step.
+static inline q16_t Q16_FromFloat(float f){
+	float s = f * (float)Q16_ONE;
+	if(s >= 2147483647.0f) return Q16_MAX;
+	if(s <= -2147483648.0f) return Q16_MIN;
+	return (q16_t)(s < 0.0f ? s - 0.5f : s + 0.5f);
+}
+
+static inline float Q16_ToFloat(q16_t q){
+	return (float)q * (1.0f / (float)Q16_ONE);
+}
+
+// Rounds to the nearest integer, halves away from zero.
+static inline int32_t Q16_ToInt(q16_t q){
+	int64_t half = q < 0 ? -(Q16_ONE / 2) : Q16_ONE / 2;
+	return (int32_t)(((int64_t)q + half) / Q16_ONE);
+}
+
+static inline q16_t Q16_Add(q16_t a, q16_t b){
+	return Q16_Sat((int64_t)a + b);
+}
+
+static inline q16_t Q16_Sub(q16_t a, q16_t b){
+	return Q16_Sat((int64_t)a - b);
+}
+
+// Rounds to the nearest step.
+static inline q16_t Q16_Mul(q16_t a, q16_t b){
+	return Q16_Sat(((int64_t)a * b + Q16_ONE / 2) >> Q16_SHIFT);
+}
+
+static inline q16_t Q16_Clamp(q16_t v, q16_t lo, q16_t hi){
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+// |v|; Q16_MIN has no positive twin and gives Q16_MAX.
+static inline q16_t Q16_Abs(q16_t v){
+	return v == Q16_MIN ? Q16_MAX : v < 0 ? -v : v;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // Q16_H
@@ -0,0 +1,116 @@
+#ifndef TASK_WCET_H
+#define TASK_WCET_H
+
+/*
+ * Worst-case execution time of the task loops and ISRs, shared by the STM32
+ * boards, for RPI/sched_report.py to check rate-monotonic schedulability.
+ *
+ * Tasks: what one iteration of a loop costs in CPU, not how long it took.
+ * A task registers a WcetTask as its FreeRTOS application tag, and the
+ * kernel's switch hook (traceTASK_SWITCHED_IN -> Wcet_TaskSwitchedIn() in
+ * FreeRTOSConfig.h) adds the DWT->CYCCNT cycles since the previous switch to
+ * the tag of the task that ran them. Wcet_Begin()/Wcet_End() around one
+ * iteration then give that iteration's own cycles, leaving out the time it
+ * was preempted or blocked (an osDelay inside a primitive). Interrupts taken
+ * while it runs are charged to it, so C is slightly pessimistic, and the ISRs
+ * are also budgeted on their own.
+ *
+ * Wcet_Begin() also keeps the shortest gap between two releases, which is
+ * the period the analysis uses for a task woken by events (gap, not period:
+ * a task that idled in between only makes the gap longer).
+ *
+ * ISRs: Wcet_Isr() at exit, with the DWT->CYCCNT read at entry, keeps the
+ * same count, sum and maximum plus the shortest gap between entries.
+ *
+ * Each board's main.c defines wcetCurrent, wcetSince and
+ * Wcet_TaskSwitchedIn(), and needs configUSE_APPLICATION_TASK_TAG. DWT must
+ * keep counting in sleep (DBGMCU_CR_DBG_SLEEP) for tickless idle.
+ */
+
+#include "stm32f4xx_hal.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	uint32_t run;     // own cycles so far, wrapping; only differences count
+	uint32_t begin;   // run at Wcet_Begin()
+	uint32_t release; // DWT->CYCCNT at Wcet_Begin()
+	uint8_t open;     // between Wcet_Begin() and Wcet_End()
+	uint32_t n;       // iterations ended
+	uint32_t cycMax;
+	uint32_t gapMin;  // shortest release to release; 0 until there are two
+	uint64_t cycSum;
+} WcetTask;
+
+typedef struct {
+	uint32_t last;    // DWT->CYCCNT at the previous entry
+	uint32_t n;
+	uint32_t cycMax;
+	uint32_t gapMin;  // shortest entry to entry; 0 until there are two
+	uint64_t cycSum;
+} WcetIsr;
+
+extern WcetTask *volatile wcetCurrent; // tag of the running task; NULL: untracked
+extern uint32_t wcetSince;             // DWT->CYCCNT when it was switched in
+
+// From the kernel's switch hook, with the tag of the task about to run
+static inline void Wcet_Switch(WcetTask *next){
+	uint32_t now = DWT->CYCCNT;
+	WcetTask *prev = wcetCurrent;
+	if(prev) prev->run += now - wcetSince;
+	wcetCurrent = next;
+	wcetSince = now;
+}
+
+// Once, from the task that t measures, before its first Wcet_Begin()
+static inline void Wcet_Register(WcetTask *t){
+	taskENTER_CRITICAL();
+	vTaskSetApplicationTaskTag(NULL, (TaskHookFunction_t)(void *)t);
+	Wcet_Switch(t);
+	taskEXIT_CRITICAL();
+}
+
+// Own cycles of the calling task; PendSV is masked while the two are read
+static inline uint32_t Wcet_Own(const WcetTask *t){
+	taskENTER_CRITICAL();
+	uint32_t own = t->run + (DWT->CYCCNT - wcetSince);
+	taskEXIT_CRITICAL();
+	return own;
+}
+
+static inline void Wcet_Begin(WcetTask *t){
+	uint32_t now = DWT->CYCCNT;
+	if(t->release && (!t->gapMin || now - t->release < t->gapMin)) t->gapMin = now - t->release;
+	t->release = now ? now : 1; // 0 means no release yet
+	t->begin = Wcet_Own(t);
+	t->open = 1;
+}
+
+// An iteration that ends without a Wcet_End() (an early continue) is not counted
+static inline void Wcet_End(WcetTask *t){
+	if(!t->open) return;
+	uint32_t cyc = Wcet_Own(t) - t->begin;
+	t->open = 0;
+	t->n++;
+	t->cycSum += cyc;
+	if(cyc > t->cycMax) t->cycMax = cyc;
+}
+
+static inline void Wcet_Isr(WcetIsr *t, uint32_t start){
+	uint32_t cyc = DWT->CYCCNT - start;
+	if(t->n && (!t->gapMin || start - t->last < t->gapMin)) t->gapMin = start - t->last;
+	t->last = start;
+	t->n++;
+	t->cycSum += cyc;
+	if(cyc > t->cycMax) t->cycMax = cyc;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TASK_WCET_H
@@ -52,6 +52,14 @@
   #include <stdint.h>
   extern uint32_t SystemCoreClock;
   void xPortSysTickHandler(void);
+/* USER CODE BEGIN 0 */
+  extern void configureTimerForRunTimeStats(void);
+  extern unsigned long getRunTimeCounterValue(void);
+  extern uint8_t MotionTrace_Recording(void);
+  extern void Wcet_TaskSwitchedIn(void *tag);
+  extern void KTrace_TaskSwitchedOut(void *tag, uint8_t ready);
+  extern void KTrace_Queue(uint8_t send, uint8_t queue, uint32_t waiting, uint8_t from_isr);
+/* USER CODE END 0 */
 #endif
 #ifndef CMSIS_device_header
 #define CMSIS_device_header "stm32f4xx.h"
@@ -64,14 +72,17 @@
 #define configSUPPORT_STATIC_ALLOCATION          1
 #define configSUPPORT_DYNAMIC_ALLOCATION         1
 #define configUSE_IDLE_HOOK                      0
-#define configUSE_TICK_HOOK                      0
+#define configUSE_TICK_HOOK                      1
+#define configUSE_TICKLESS_IDLE                  1
 #define configCPU_CLOCK_HZ                       ( SystemCoreClock )
 #define configTICK_RATE_HZ                       ((TickType_t)1000)
 #define configMAX_PRIORITIES                     ( 56 )
 #define configMINIMAL_STACK_SIZE                 ((uint16_t)128)
-#define configTOTAL_HEAP_SIZE                    ((size_t)15360)
+#define configTOTAL_HEAP_SIZE                    ((size_t)2048)
 #define configMAX_TASK_NAME_LEN                  ( 16 )
+#define configGENERATE_RUN_TIME_STATS            1
 #define configUSE_TRACE_FACILITY                 1
+#define configUSE_APPLICATION_TASK_TAG           1
 #define configUSE_16_BIT_TICKS                   0
 #define configUSE_MUTEXES                        1
 #define configQUEUE_REGISTRY_SIZE                8
@@ -164,8 +175,36 @@ standard names. */
 
 #define USE_CUSTOM_SYSTICK_HANDLER_IMPLEMENTATION 1
 
+/* Definitions needed when configGENERATE_RUN_TIME_STATS is on */
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS configureTimerForRunTimeStats
+#define portGET_RUN_TIME_COUNTER_VALUE getRunTimeCounterValue
+
 /* USER CODE BEGIN Defines */
 /* Section where parameter definitions can be added (for instance, to override default ones in FreeRTOS.h) */
+/* Tickless idle: with every task blocked for at least two ticks the kernel
+   stops SysTick and sleeps (WFI) until the next deadline or an interrupt.
+   Not while a motion trace is open: it samples from the tick hook, which
+   does not run for the ticks slept through. */
+#define configPRE_SUPPRESS_TICKS_AND_SLEEP_PROCESSING( x ) do { if (MotionTrace_Recording()) (x) = 0; } while (0)
+/* Task execution times for the schedulability report (task_wcet.h): the
+   switch hook charges the cycles since the last switch to the outgoing
+   task's tag and starts counting for the incoming one. */
+#define traceTASK_SWITCHED_IN()                  Wcet_TaskSwitchedIn((void *)pxCurrentTCB->pxTaskTag)
+/* Kernel trace (main.c): the switch hook above also records the incoming
+   task; these record the outgoing one, and whether it is still ready
+   (preempted) or has blocked, and each queue send and receive. 0: no
+   kernel trace, as before. */
+#ifndef KTRACE_ENABLED
+#define KTRACE_ENABLED 1
+#endif
+#if KTRACE_ENABLED
+#define traceTASK_SWITCHED_OUT()                 KTrace_TaskSwitchedOut((void *)pxCurrentTCB->pxTaskTag, \
+    (uint8_t)listIS_CONTAINED_WITHIN(&pxReadyTasksLists[pxCurrentTCB->uxPriority], &pxCurrentTCB->xStateListItem))
+#define traceQUEUE_SEND( pxQueue )               KTrace_Queue(1, (uint8_t)(pxQueue)->uxQueueNumber, (pxQueue)->uxMessagesWaiting, 0)
+#define traceQUEUE_SEND_FROM_ISR( pxQueue )      KTrace_Queue(1, (uint8_t)(pxQueue)->uxQueueNumber, (pxQueue)->uxMessagesWaiting, 1)
+#define traceQUEUE_RECEIVE( pxQueue )            KTrace_Queue(0, (uint8_t)(pxQueue)->uxQueueNumber, (pxQueue)->uxMessagesWaiting, 0)
+#define traceQUEUE_RECEIVE_FROM_ISR( pxQueue )   KTrace_Queue(0, (uint8_t)(pxQueue)->uxQueueNumber, (pxQueue)->uxMessagesWaiting, 1)
+#endif
 /* USER CODE END Defines */
 
 #endif /* FREERTOS_CONFIG_H */
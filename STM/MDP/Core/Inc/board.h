@@ -0,0 +1,38 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+// === MDP pin/timer map, read by Common/Inc/motor_core.h ===
+// Must match the .ioc; channel numbers are 1..4.
+#define BOARD_PWM_MAX         7199   // TIM4/TIM1 period
+
+// Motor A: TIM4 CH3 / CH4. Mounted mirrored: REV (dir 1) drives the robot forward.
+#define BOARD_MOTOR_A_TIM     TIM4
+#define BOARD_MOTOR_A_HTIM    htim4
+#define BOARD_MOTOR_A_FWD     3
+#define BOARD_MOTOR_A_REV     4
+
+// Motor D sits in the core's B slot: TIM1 CH3 / CH4. FWD (dir 0) drives the robot forward.
+#define BOARD_MOTOR_B_TIM     TIM1
+#define BOARD_MOTOR_B_HTIM    htim1
+#define BOARD_MOTOR_B_FWD     3
+#define BOARD_MOTOR_B_REV     4
+#define MOTOR_D               MOTOR_B
+#define ENCODER_D             ENCODER_B
+// TIM4 sees TIM1's TRGO on ITR0: both bridges count in step (72 MHz, same ARR)
+#define BOARD_MOTOR_SYNC_TS   TIM_TS_ITR0
+
+// Encoders: x4 quadrature on TIM2 (A) and TIM5 (D), period 65535
+#define BOARD_ENCODER_A_TIM   TIM2
+#define BOARD_ENCODER_B_TIM   TIM5
+
+// Battery sense: ADC2 IN11 on PC1, through the board's divider
+#define BOARD_VBATT_DIVIDER   5.0f   // pack volts per volt at the pin
+#define BOARD_VBATT_NOMINAL   12.0f  // pack voltage the PWM tables were tuned at
+
+// Steering servo: TIM12 CH2, period 19999
+#define BOARD_SERVO_TIM       TIM12
+#define BOARD_SERVO_HTIM      htim12
+#define BOARD_SERVO_CH        2
+// ================================================
+
+#endif // BOARD_H
@@ -55,6 +55,10 @@ void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+void SysId_Tick(void);
+void OdoCal_Tick(void);
+void MotionTrace_Tick(void);
+uint8_t MotionTrace_Recording(void);
 
 /* USER CODE END EFP */
 
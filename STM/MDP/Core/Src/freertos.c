@@ -52,6 +52,52 @@
 
 /* USER CODE END FunctionPrototypes */
 
+/* Hook prototypes */
+void configureTimerForRunTimeStats(void);
+unsigned long getRunTimeCounterValue(void);
+void vApplicationTickHook(void);
+
+/* USER CODE BEGIN 1 */
+/* Functions needed when configGENERATE_RUN_TIME_STATS is on */
+/* Run-time stats clock: DWT->CYCCNT / 64 (1.125 MHz at 72 MHz).
+ * CYCCNT wraps every ~60 s, so it is extended to 64 bits here; the kernel
+ * reads this on every context switch, far more often than that. The 32-bit
+ * result wraps after ~63 min, and STATS works on differences, so only a
+ * gap of that long between two STATS requests loses the CPU figures. */
+static uint32_t rts_last_cyc;
+static uint64_t rts_cyc;
+
+void configureTimerForRunTimeStats(void)
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  rts_last_cyc = DWT->CYCCNT;
+  rts_cyc = 0;
+}
+
+unsigned long getRunTimeCounterValue(void)
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();                       // called from tasks and from PendSV
+  uint32_t now = DWT->CYCCNT;
+  rts_cyc += (uint32_t)(now - rts_last_cyc);
+  rts_last_cyc = now;
+  uint64_t cyc = rts_cyc;
+  __set_PRIMASK(primask);
+  return (unsigned long)(cyc >> 6);
+}
+/* USER CODE END 1 */
+
+/* USER CODE BEGIN 3 */
+/* 1 kHz from SysTick: the SYSID and CAL ODO sequencers and the motion trace recorder in main.c */
+void vApplicationTickHook( void )
+{
+  SysId_Tick();
+  OdoCal_Tick();
+  MotionTrace_Tick();
+}
+/* USER CODE END 3 */
+
 /* Private application code --------------------------------------------------*/
 /* USER CODE BEGIN Application */
 
@@ -19,17 +19,28 @@
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
 #include "cmsis_os.h"
+#include "queue.h"    // vQueueSetQueueNumber() for the kernel trace
 #include <string.h>   // strlen, strncmp
 #include <stdlib.h>   // atoi
+#include <stddef.h>   // offsetof
 #include <ctype.h>    // toupper
 #include <math.h>
+#include <stdio.h>    // snprintf
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "../../PeripheralDriver/Inc/oled.h"
+#include "motor_core.h" /* Motor_Set(), Servo_Set(), Encoder_Count() on the board.h map */
+#include "fast_mem.h"   /* FAST_CODE, FastMem_CheckArt() */
+#include "task_wcet.h"  /* Wcet_Begin/End(), Wcet_Isr() for SCHED */
+#include "prof.h"       /* PROF_BEGIN/END() regions for PROF */
+#include "fmt.h"        /* Fmt_Float() for PARAM/CAL, without float printf */
+#include "i2c_bus.h"    /* Queued, non-blocking I2C2 for the IMU loop */
+#include "q16.h"        /* Saturating Q16.16 for FIXED_POINT_CTL */
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
+typedef StaticTask_t osStaticThreadDef_t;
 /* USER CODE BEGIN PTD */
 /* ---- ICM-20948 (Bank 0) ---- */
 #define ICM_REG_WHO_AM_I       0x00  /* expect 0xEA */
@@ -37,18 +48,39 @@
 #define ICM_REG_PWR_MGMT_2     0x07
 #define ICM_REG_GYRO_XOUT_H    0x33  /* XH,XL,YH,YL,ZH,ZL (6 bytes) */
 #define ICM_REG_BANK_SEL       0x7F  /* write (bank << 4) */
+#define ICM_REG_USER_CTRL      0x03  /* bit6 FIFO_EN */
+#define ICM_REG_INT_PIN_CFG    0x0F  /* 0x00: active high, push-pull, 50 us pulse */
+#define ICM_REG_INT_ENABLE_1   0x11  /* bit0 RAW_DATA_0_RDY_EN */
+#define ICM_REG_FIFO_EN_2      0x67  /* bit3 GYRO_Z_FIFO_EN */
+#define ICM_REG_FIFO_RST       0x68
+#define ICM_REG_FIFO_MODE      0x69  /* 0 = stream */
+#define ICM_REG_FIFO_COUNTH    0x70  /* COUNTH, COUNTL: 13-bit byte count */
+#define ICM_REG_FIFO_R_W       0x72
+#define ICM_B2_GYRO_SMPLRT_DIV 0x00  /* bank 2: ODR = 1125 Hz / (1 + div) */
+#define ICM_B2_GYRO_CONFIG_1   0x01  /* bank 2: DLPFCFG[5:3] FS_SEL[2:1] FCHOICE[0] */
 
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+/* Memory map (STM32F407VETX_FLASH.ld)
+ * CCM: 64K zero-wait RAM on the core's D-bus; DMA cannot reach it. It holds
+ * every task stack and TCB (placed by name in the linker script) and the
+ * CPU-only tables marked CCMRAM. Zeroed at reset like .bss; anything placed
+ * here must not need an initializer.
+ * SRAM: .data/.bss, the DMA buffers (UART, ADC, I2C FIFO) and the heap_4
+ * heap, which nothing allocates from at boot any more. */
+#define CCMRAM __attribute__((section(".ccmbss")))
+
 #define WHEEL_DIAMETER_CM 6.50f
 #define ENCODER_CPR 11.0f
 #define GEAR_RATIO 30.0f
 #define QUAD_MULT 4.0f
 #define WHEEL_CIRC_CM (3.1415926f * WHEEL_DIAMETER_CM)// = 20.42 cm
 #define COUNTS_PER_REV 1560.0f  // you can adjust
-#define CM_PER_COUNT (WHEEL_CIRC_CM / COUNTS_PER_REV)
+#define CM_PER_COUNT_DEFAULT (WHEEL_CIRC_CM / COUNTS_PER_REV)
+#define CM_PER_COUNT (g_cal.v.cm_per_count)         // CAL CMPC, which CAL ODO fits
+#define WHEEL_CM_PER_REV (CM_PER_COUNT * COUNTS_PER_REV)  // circumference as the floor sees it
 
 // TIM1/TIM4 PWM period from your MX init = 7199
 #define PWM_MAX             7199.0f
@@ -60,6 +92,48 @@
 volatile float rpsA = 0.0f;
 volatile float rpsD = 0.0f;
 
+/* Fixed-point control path. With FIXED_POINT_CTL the encoder task keeps the
+ * wheels in integer counts and publishes each speed as Q16 counts/s, and the
+ * per-wheel speed PI (and its rps filter) runs in saturating Q16. Every
+ * shared value is then one 32-bit word with one writer, so the encoder task
+ * publishes without a critical section. Engineering units (rpsA/rpsD, the
+ * distance_cm_* floats, the profile and the gain schedule) are only made at
+ * the edges. Needs VP_ENABLE. */
+#define FIXED_POINT_CTL 0   // 0 = float counts and loops, as before
+#if FIXED_POINT_CTL
+volatile q16_t cpsA_q16 = 0;   // |wheel speed|, counts/s; rpsA is this over COUNTS_PER_REV
+volatile q16_t cpsD_q16 = 0;
+static q16_t g_cm_per_count_q16;  // CM_PER_COUNT, kept by Odo_Configure()
+#endif
+
+/* Encoder sampling: TIM7 update (every ENC_SAMPLE_US, 1 MHz tick) latches both
+ * counters back to back with the DWT cycle count, so EncoderTask's velocity
+ * uses the exact time between latches instead of whole-ms HAL_GetTick(). */
+#define ENC_SAMPLE_US 20000u   // TIM7 period + 1
+typedef struct {
+  uint32_t cntA;
+  uint32_t cntD;
+  uint32_t cyc;     // DWT->CYCCNT at the latch
+} enc_latch_t;
+static volatile enc_latch_t enc_latch;
+volatile uint32_t enc_sample_us = 0;   // time of the latest rpsA/rpsD sample (us since boot)
+volatile uint32_t enc_dt_us     = 0;   // interval that sample was measured over
+
+/* Fused control step. With FUSED_CTL, TIM7 updates at FUSED_CTL_HZ and its
+ * ISR runs a whole FW/BW control step in one pass: it latches both encoders,
+ * takes the IMU task's latest yaw and rate, pre-steers or ends the move at
+ * its target, runs MotorCtl_Step and writes the PWM. The ISR is at the top
+ * kernel-aware level (5), so no task changes a move or a sample under the
+ * step. At 2 ms a wheel turns only a few counts, so the speeds still come
+ * from the counts over the last ENC_SAMPLE_US (FUSED_CTL_SPAN latches).
+ * Tasks keep the rest: EncoderTask wakes once per span for the brake,
+ * battery and settle polls, DistanceTask brakes, cools down and frees
+ * CmdTask after a move ends (as after the compare ISR), and MotorTask is
+ * not needed. Turns stay with ServoMotorTask, which runs per IMU batch. */
+#define FUSED_CTL       0       // 0 = encoder, motor and distance tasks at their own rates, as before
+#define FUSED_CTL_HZ    500u
+#define FUSED_CTL_SPAN  (FUSED_CTL_HZ * (ENC_SAMPLE_US / 1000u) / 1000u)   // latches per speed window
+
 //Running totals (signed). Visible across tasks if you want to display elsewhere.
 volatile int32_t total_counts_A = 0;
 volatile int32_t total_counts_D = 0;
@@ -75,17 +149,20 @@ volatile int pwmD_val;
 uint8_t  dir  = 0;
 
 #define MC_PERIOD_MS   50       // control period
-#define KP_DIFF        (25.0f * 60.0f)    // proportional [PWM per RPS]
-#define KI_DIFF        (0.6f * 60.0f)     // integral [PWM per RPS per second]
+#define DIST_PERIOD_MS 100      // DistanceTask poll while moving
+#define IR_PERIOD_MS   50       // IRTask report (20 Hz)
+#define KP_DIFF        (25.0f * 60.0f)    // proportional [PWM per RPS] (gain schedule default)
+#define KI_DIFF        (0.6f * 60.0f)     // integral [PWM per RPS per second] (default)
 #define KD_DIFF        (0.00f * 60.0f)   // derivative [PWM per RPS * second] (start at 0)
 
 #define I_MAX          4000.0f  // integral clamp (PWM units)
 #define PWM_MIN_CLAMP  2000
 #define PWM_MAX_CLAMP  7199     // clamp to ARR (0..7199)
 
-// wheel bias offsets (use to cancel static asymmetry; + makes that wheel faster)
-static int biasA = 0;   // e.g., +150 if A is habitually slower
-static int biasD = 0;
+// wheel bias offsets (use to cancel static asymmetry; + makes that wheel faster);
+// defaults for the calibration store, tuned with CAL BIASA / CAL BIASD
+#define BIAS_A_DEFAULT 0   // e.g., +150 if A is habitually slower
+#define BIAS_D_DEFAULT 0
 /* === Gyro state === */
 volatile uint8_t  ICM_addr        = 0;    // 0x68 or 0x69 (7-bit)
 static   uint8_t  ICM_whoami      = 0;    // expect 0xEA
@@ -96,30 +173,64 @@ volatile uint8_t  gyro_ready      = 0;    // set after bias calibration
 static   uint32_t _gyro_last_ms   = 0;
 
 static const float GYRO_SENS_LSB_PER_DPS = 131.0f;  // FS=±250/500/1000/2000dps -> adjust if needed
-static const float GYRO_LP_ALPHA         = 0.67f;   // IIR LPF coefficient
+
+/* Gyro FIFO pipeline: the ICM samples Z at IMU_ODR_HZ into its FIFO and pulses
+ * IMU_INT per sample. Every IMU_BATCH pulses the EXTI callback wakes IMUTask,
+ * which reads FIFO_COUNT and starts a DMA burst of that many bytes; the DMA
+ * completion wakes it again to integrate every sample. The sample period is
+ * the ICM clock measured against DWT, so yaw no longer integrates whole-ms
+ * HAL_GetTick() steps. Bank 0 stays selected after init. */
+#define IMU_ODR_HZ         1125.0f
+#define IMU_BATCH          4          // samples per FIFO read (~280 Hz, paces the steer loop)
+#define IMU_FIFO_READ_MAX  256        // bytes per DMA burst (128 samples)
+#define IMU_FIFO_RESET_AT  2048       // bytes: fell this far behind, drop the backlog
+#define IMU_BIAS_SAMPLES   450        // ~0.4 s at boot unless the calibration store has a bias; ZUPT refines it from there
+
+/* Zero-velocity updates: once the wheels have been still (and nothing is
+ * commanded) for ZUPT_HOLD_MS, the robot cannot be turning. Each gyro sample
+ * then nudges the bias toward itself (time constant ~1/ZUPT_ALPHA samples)
+ * instead of being integrated, so warm-up drift is trimmed during every
+ * cooldown and snapshot wait and yaw does not creep while parked. Samples
+ * above ZUPT_MAX_DPS are real rotation (robot bumped) and integrate as usual. */
+#define ZUPT_HOLD_MS       150u
+#define ZUPT_ALPHA         (1.0f / 2048.0f)   // ~1.8 s at 1125 Hz
+#define ZUPT_MAX_DPS       2.0f
+#define IMU_EVT_DRDY       0x01u
+#define IMU_EVT_DMA        0x02u
+#define IMU_EVT_ERR        0x04u
+#define IMU_EVT_COUNT      0x08u
+#define IMU_I2C_TIMEOUT_MS 10u        // per transaction; a 256-byte burst at 400 kHz takes ~6 ms
+static volatile uint16_t imu_drdy = 0;            // data-ready pulses since the last batch
+volatile uint32_t imu_zupt_samples = 0;           // samples used to refine the bias
+static uint8_t imu_fifo_buf[IMU_FIFO_READ_MAX];
+volatile uint32_t imu_sample_us = 0;   // time of the latest integrated sample (us since boot)
 
 /* ================= Steer control config ================= */
 #define STEER_US_LEFT      900     // +36°
-#define STEER_US_CENTER    1350    //  0°
+#define STEER_US_CENTER    1350    //  0°, default for CAL SCTR
 #define STEER_US_RIGHT     2400    // -36°
 #define STEER_MAX_DEG      36.0f
 #define STEER_DB_DEG       2.0f    // stop tolerance
 #define STEER_KP           0.65f   // proportional (deg -> deg cmd)
 #define STEER_KD           0.08f   // derivative (dps -> deg cmd) ~damping
-#define STEER_LOOP_HZ      50      // 50 Hz loop
+#define STEER_LOOP_HZ      250     // floor; the loop runs on every IMU batch (~280 Hz)
 #define STEER_CMD_TIMEOUT  8000U   // safety timeout per command (ms)
 
-#define YAW_COARSE_THRESH_DEG  5.0f   // > this → bang-bang
-#define YAW_FINE_DB_DEG         0.8f   // final tolerance to declare "done"
-#define YAW_STOP_DB_DEG         1.0f   // leave as your STEER_DB_DEG or a bit larger
+#define YAW_FINE_DB_DEG         0.8f   // below this the turn stops correcting
+#define YAW_STOP_DB_DEG         1.0f   // final tolerance to declare "done"
 
-#define TURN_PWM_MAX           5000    // your existing run level
-#define TURN_PWM_MIN           4250    // minimum that still spins both wheels
-#define MICRO_NUDGE_PWM        4500    // quick corrective pulse
-#define MICRO_NUDGE_MS         20      // 15–30ms works well
+#define TURN_PWM_MAX           5000    // correction ceiling (gain schedule default)
+#define TURN_PWM_MIN           4250    // minimum that still spins both wheels (default)
 
-#define FINE_KP_STEER          0.85f   // deg → wheel deg
-#define FINE_KD_RATE           0.10f   // dps → wheel deg
+/* Done once the profile has ended inside YAW_STOP_DB_DEG and the yaw rate has
+ * died down */
+#define STEER_SETTLE_DPS       3.0f
+
+/* ServoMotorTask notification bits */
+#define STEER_EVT_CMD          0x01u   // Servo_Request* latched a job
+#define STEER_EVT_IMU          0x02u   // IMUTask integrated a new batch
+
+#define FINE_KP_STEER          0.85f   // deg → wheel deg (gain schedule default)
 
 
 /* Public gyro (already in your file) */
@@ -143,56 +254,858 @@ typedef struct {
   volatile uint8_t  busy;           // task is executing a command
   volatile uint8_t  success;        // last result
 
+  volatile float    delta_deg;     // signed turn to target_heading; picks the side for +-180
+
   // NEW (bang-bang turn)
   volatile uint8_t  bangbang;      // 1 = hard lock servo, no PID
-  volatile uint16_t drive_pwm;     // PWM to use while driving forward
+  volatile uint16_t drive_pwm;     // outer-wheel PWM the turn profile cruises at
+  volatile float    speed_cms;     // speed the turn's gains are scheduled at
   // NEW: reverse drive for bang-bang turns
   volatile uint8_t  reverse_drive;   // 0 = forward (default), 1 = reverse
 } steer_cmd_t;
 
 
 /* --- Command Cooldown --- */
+/* After a move or turn the next command waits until the robot is physically
+ * still: both wheels and the gyro below the SETTLE_* rates for SETTLE_HOLD_MS
+ * (checked by Settle_Poll on every encoder sample). CMD_COOLDOWN_MS is only
+ * the upper bound, e.g. when the chassis keeps rocking. */
 #define CMD_COOLDOWN_MS   750u   // tweak 150–500 ms as you like
+#define SETTLE_RPS        0.05f  // per wheel; ~1.5 encoder counts per 20 ms sample
+#define SETTLE_GYRO_DPS   2.0f
+#define SETTLE_HOLD_MS    60u    // three quiet encoder samples in a row
 static volatile uint32_t g_cmd_cooldown_until_ms = 0;
+static volatile uint32_t g_cmd_cooldown_start_ms = 0;
+static volatile uint32_t g_settle_quiet_since_ms = 0;
+static volatile uint32_t g_settle_last_ms = 0;  // last actual dwell, for tuning in the debugger
 
 static inline void StartCooldown(uint32_t ms)
 {
-  g_cmd_cooldown_until_ms = HAL_GetTick() + ms;
+  taskENTER_CRITICAL();
+  uint32_t now = HAL_GetTick();
+  g_cmd_cooldown_start_ms = now;
+  g_settle_quiet_since_ms = now;  // The hold only counts from here
+  g_cmd_cooldown_until_ms = now + ms;
+  taskEXIT_CRITICAL();
+}
+
+/* Wakes CmdTask: a command was queued or the robot became free */
+extern osThreadId_t CmdTaskHandle;
+static inline void CmdTask_Notify(void)
+{
+  if (CmdTaskHandle != NULL) xTaskNotifyGive((TaskHandle_t)CmdTaskHandle);
 }
 
-static steer_cmd_t g_steer_cmd = {0};
+/* Ends a running cooldown early once the robot has been still for SETTLE_HOLD_MS */
+static void Settle_Poll(void)
+{
+  uint32_t now = HAL_GetTick();
+  uint8_t quiet = rpsA < SETTLE_RPS && rpsD < SETTLE_RPS
+               && (!gyro_ready || fabsf(yaw_rate_dps) < SETTLE_GYRO_DPS);
+  uint8_t settled = 0;
+
+  taskENTER_CRITICAL();
+  if ((int32_t)(g_cmd_cooldown_until_ms - now) > 0) {
+    if (!quiet) {
+      g_settle_quiet_since_ms = now;
+    } else if (now - g_settle_quiet_since_ms >= SETTLE_HOLD_MS) {
+      g_settle_last_ms = now - g_cmd_cooldown_start_ms;
+      g_cmd_cooldown_until_ms = now;
+      settled = 1;
+    }
+  }
+  taskEXIT_CRITICAL();
+
+  if (settled) CmdTask_Notify();
+}
 
-/* UART line buffer (one command) */
-static char uart3_line[32];
-static volatile uint8_t uart3_idx = 0;
+static steer_cmd_t g_steer_cmd = {0};
 
 /* === Command FIFO (queue) ============================================= */
-#define CMDQ_CAP 64
-typedef struct { char s[32]; } cmd_item_t;
+/* Lines are parsed once in UartRxTask (Cmd_Parse) and queued as 8-byte
+ * records; CmdTask is the only consumer and never looks at text again. Single
+ * producer, single consumer: each side writes only its own index, and the DMB
+ * publishes the record before head. The indices run free and wrap by masking,
+ * so all CMDQ_CAP slots are usable and head - tail is the fill level. */
+typedef enum {
+  CMD_TURN,       // bang-bang turn by arg degrees (+left), forward drive
+  CMD_TURN_REV,   // same, reverse drive
+  CMD_TURN_ABS,   // turn to absolute heading arg
+  CMD_MOVE_FWD,   // arg cm
+  CMD_MOVE_BACK,
+  CMD_PARAM,      // gain schedule read/edit/save, see Gains_Command()
+  CMD_CAL,        // calibration store read/edit/save, see Cal_Command()
+  CMD_SYSID,      // open-loop test sequence, see System identification
+  CMD_ODOCAL,     // CAL ODO, see Odometry calibration
+  CMD_REJECT      // bad line; reply is the error, sent in queue order
+} cmd_op_t;
+
+/* Fixed replies, sent by index so a record carries no pointer */
+typedef enum {
+  RPL_CMD,                                        // unknown line
+  RPL_ACK_FL, RPL_ACK_FR, RPL_ACK_BL, RPL_ACK_BR, // [rev][right], as Cmd_Parse indexes them
+  RPL_ERR_FL0, RPL_ERR_FR0, RPL_ERR_BL0, RPL_ERR_BR0,
+  RPL_ACK_L, RPL_ACK_R, RPL_ERR_L0, RPL_ERR_R0,
+  RPL_ACK_ABS,
+  RPL_ERR_FW, RPL_ERR_BW,
+  RPL_ERR_PARAM, RPL_ERR_CAL, RPL_ERR_SYSID
+} cmd_reply_t;
+
+static const char *const CMD_REPLY[] = {
+  [RPL_CMD]       = "CMD?\r\n",
+  [RPL_ACK_FL]    = "ACK FL\r\n",  [RPL_ACK_FR]  = "ACK FR\r\n",
+  [RPL_ACK_BL]    = "ACK BL\r\n",  [RPL_ACK_BR]  = "ACK BR\r\n",
+  [RPL_ERR_FL0]   = "ERR FL0\r\n", [RPL_ERR_FR0] = "ERR FR0\r\n",
+  [RPL_ERR_BL0]   = "ERR BL0\r\n", [RPL_ERR_BR0] = "ERR BR0\r\n",
+  [RPL_ACK_L]     = "ACK L\r\n",   [RPL_ACK_R]   = "ACK R\r\n",
+  [RPL_ERR_L0]    = "ERR L0\r\n",  [RPL_ERR_R0]  = "ERR R0\r\n",
+  [RPL_ACK_ABS]   = "ACK ABS\r\n",
+  [RPL_ERR_FW]    = "ERR (use FW###)\r\n",
+  [RPL_ERR_BW]    = "ERR (use BW###)\r\n",
+  [RPL_ERR_PARAM] = "ERR PARAM\r\n",
+  [RPL_ERR_CAL]   = "ERR CAL\r\n",
+  [RPL_ERR_SYSID] = "ERR SYSID\r\n",
+};
+
+typedef struct {
+  uint8_t op;      // cmd_op_t
+  uint8_t sub;     // PARAM, CAL: gs_action_t; turns, REJECT: cmd_reply_t; SYSID: sysid_seq_t
+  uint8_t field;   // PARAM, CAL: field index; turns, moves: spd_class_t; SYSID: sysid_target_t
+  int8_t  row;     // PARAM: row, -1 = cruise speed
+  union {
+    int32_t arg;   // turns: degrees (+left); moves: cm; SYSID, ODOCAL: amplitude
+    float   val;   // PARAM, CAL: new value
+  };
+} cmd_rec_t;
+
+_Static_assert(sizeof(cmd_rec_t) == 8, "cmd_rec_t should stay two words");
+
+typedef enum { GS_ACT_SHOW, GS_ACT_SET, GS_ACT_SAVE, GS_ACT_DEFAULTS } gs_action_t;
+
+/* Speed class: an S or F after a turn's or move's number ("FW90F", "FR90S").
+ * The planner sets it from the clearance around the command; none is NORMAL. */
+typedef enum { SPD_NORMAL, SPD_SLOW, SPD_FAST } spd_class_t;
+
+#define CMDQ_CAP  64 // Power of two
+#define CMDQ_MASK (CMDQ_CAP - 1)
+_Static_assert((CMDQ_CAP & CMDQ_MASK) == 0 && CMDQ_CAP <= 32768, "CMDQ_CAP must be a power of two");
 static volatile uint16_t cmdq_head = 0, cmdq_tail = 0;
-static cmd_item_t cmdq[CMDQ_CAP];
+static CCMRAM cmd_rec_t cmdq[CMDQ_CAP];
 
 static inline int cmdq_empty(void) { return cmdq_head == cmdq_tail; }
-static int cmdq_push(const char *cmd)
+static int cmdq_push(const cmd_rec_t *rec)
+{
+  uint16_t head = cmdq_head;
+  if ((uint16_t)(head - cmdq_tail) == CMDQ_CAP) return -1; // full
+  cmdq[head & CMDQ_MASK] = *rec;
+  __DMB();
+  cmdq_head = head + 1;
+  return 0;
+}
+static int cmdq_peek(cmd_rec_t *out)
 {
-  uint16_t next = (cmdq_head + 1) % CMDQ_CAP;
-  if (next == cmdq_tail) return -1; // full
-  strncpy((char*)cmdq[cmdq_head].s, cmd, sizeof(cmdq[0].s)-1);
-  cmdq[cmdq_head].s[sizeof(cmdq[0].s)-1] = '\0';
-  cmdq_head = next;
+  uint16_t tail = cmdq_tail;
+  if (tail == cmdq_head) return -1;
+  __DMB();
+  *out = cmdq[tail & CMDQ_MASK];
   return 0;
 }
-static int cmdq_pop(char *out, int maxlen)
+/* Consumer side: forget every record published before head */
+static inline void cmdq_drop_to(uint16_t head) { cmdq_tail = head; }
+static int cmdq_pop(cmd_rec_t *out)
 {
-  if (cmdq_empty()) return -1;
-  strncpy(out, (const char*)cmdq[cmdq_tail].s, maxlen-1);
-  out[maxlen-1] = '\0';
-  cmdq_tail = (cmdq_tail + 1) % CMDQ_CAP;
+  uint16_t tail = cmdq_tail;
+  if (tail == cmdq_head) return -1;
+  __DMB();
+  *out = cmdq[tail & CMDQ_MASK];
+  __DMB();
+  cmdq_tail = tail + 1;
   return 0;
 }
 
-/* single-byte RX buffer */
-static uint8_t uart3_rx_ch;
+/* === Command blending ================================================== */
+/* CmdTask looks at the next queued command when it starts one and, where the
+ * motion allows, joins the two without a full stop:
+ *   FW/BW -> same direction: merged into one move (one brake at the end)
+ *   FW -> forward turn:      steers into the turn for the last
+ *                            BLEND_PRESTEER_CM, then hands over without braking
+ *   forward turn -> FW:      leaves the turn at the stop window still driving
+ * Blended hand-overs skip the cooldown. Commands that are not queued yet when
+ * the previous one starts are not blended. */
+#define CMD_BLEND            1      // 0 = full stop between every command
+#define BLEND_PRESTEER_CM    8      // distance task runs at 10 Hz, so keep > one tick of travel
+#define BLEND_CARRY_PWM      pwm_fast
+/* === Gain schedule ===================================================== */
+/* Speed-dependent gains live in RAM as GS_ROWS rows keyed by commanded speed
+ * and are interpolated linearly between rows (clamped at the ends). PARAM
+ * lines over UART read and edit them between commands; PARAM SAVE writes them
+ * to flash sector 7, which Gains_Load() restores at boot. Moves look their
+ * gains up at the profile setpoint every control period, turns once at the
+ * cruise speed when ServoMotorTask latches them (g_turn_gains). */
+#define GS_ROWS              3
+#define GS_MAGIC             0x47530001u          // "GS", layout version 1
+#define GS_FLASH_SECTOR      FLASH_SECTOR_7
+#define GS_FLASH_ADDR        0x08060000u          // excluded from FLASH in the linker script
+
+typedef struct {              // all floats: Gains_At() interpolates field by field
+  float speed_cms;            // row key, ascending
+  float vp_kp, vp_ki;         // per-wheel speed PI (VP_ENABLE)
+  float hh_kp_steer;          // heading hold: servo deg per deg
+  float hh_kp_diff;           // heading hold: cm/s wheel split per deg
+  float kp_diff, ki_diff;     // A-D difference PI (VP_ENABLE 0)
+  float turn_pwm_max, turn_pwm_min;  // turn: correction ceiling, model deadband
+  float turn_pwm;             // turn: outer-wheel PWM the profile cruises at
+  float fine_kp_steer;        // turn: servo wheel deg per deg off the profile
+} gain_row_t;
+#define GS_FIELDS            (sizeof(gain_row_t) / sizeof(float))
+
+typedef struct {
+  uint32_t   magic;
+  float      cruise_cms;      // commanded FW/BW speed
+  gain_row_t row[GS_ROWS];
+  uint32_t   crc;             // FNV-1a of everything above
+} gain_sched_t;
+
+static gain_sched_t g_gs;
+static gain_row_t   g_turn_gains;  // set when a turn is latched
+
+/* === Calibration store ================================================= */
+/* Per-robot trims that used to be #defines, in one versioned block in flash
+ * sector 6. Cal_Load() restores it at boot (defaults if it is blank or from
+ * another layout); CAL lines over UART read and edit the RAM copy between
+ * commands and CAL SAVE writes it back, so retuning needs no reflash. A saved
+ * gyro bias seeds the IMU, which then skips its bias capture at boot and
+ * leaves ZUPT to track the drift. The odometry scale (CMPC) is fitted on the
+ * floor by CAL ODO, see Odometry calibration. */
+#define CAL_MAGIC            0x43410003u          // "CA", layout version 3
+#define CAL_FLASH_SECTOR     FLASH_SECTOR_6
+#define CAL_FLASH_ADDR       0x08040000u          // excluded from FLASH in the linker script
+
+typedef struct {              // all floats so CAL can edit them by index
+  float steer_us_center;      // servo pulse for straight wheels
+  float bias_a, bias_d;       // wheel PWM offsets (+ makes that wheel faster)
+  float ir_a, ir_b;           // center IR fit: cm = A * count^B
+  float cm_per_count;         // odometry scale, fitted by CAL ODO
+  float gyro_bias_lsb;        // Z bias seeded at boot; 0 = capture it
+  float gyro_fc_hz;           // low-pass cutoffs, see Signal filters; 0 = unfiltered
+  float ir_fc_hz;
+  float rps_fc_hz;
+} cal_vals_t;
+#define CAL_FIELDS           (sizeof(cal_vals_t) / sizeof(float))
+
+typedef struct {
+  uint32_t   magic;
+  cal_vals_t v;
+  uint32_t   crc;             // FNV-1a of everything above
+} cal_block_t;
+
+static cal_block_t g_cal;
+
+/* === Signal filters ===================================================== */
+/* Each noisy signal runs through one second-order Butterworth low-pass, a
+ * direct-form I biquad, with its cutoff from the calibration store (CAL GYFC,
+ * IRFC, RPFC in Hz; 0 or anything past 0.45 fs passes the signal through).
+ *   gyro  yaw_rate_dps, per FIFO sample at IMU_ODR_HZ (yaw integrates raw)
+ *   IR    g_ir_mm, per DMA half at FILT_IR_FS_HZ (g_ir_sample stays raw)
+ *   rps   MotorCtl_Step's wheel speeds, per MC_PERIOD_MS
+ * A DF1 section keeps only past inputs and outputs, so a retune between
+ * commands just swaps the coefficients: at most one sample mixes old and new.
+ * The gyro and rps defaults keep about the lag of the single-pole EMAs they
+ * replace, with 40 dB/decade above the cutoff instead of 20; the IR default
+ * adds ~4.5 ms. */
+#define FILT_GYRO_HZ_DEFAULT   15.0f
+#define FILT_IR_HZ_DEFAULT     50.0f
+#define FILT_RPS_HZ_DEFAULT    4.0f
+#define FILT_IR_FS_HZ          (10000.0f / IR_OVERSAMPLE)   // TIM8 rate over the oversampling
+#if FUSED_CTL
+#define FILT_RPS_FS_HZ         ((float)FUSED_CTL_HZ)
+#else
+#define FILT_RPS_FS_HZ         (1000.0f / MC_PERIOD_MS)
+#endif
+
+typedef struct { float b0, b1, b2, a1, a2; } biquad_coef_t;   // a0 = 1
+typedef struct { float x1, x2, y1, y2; } biquad_t;
+
+static biquad_coef_t g_filt_gyro, g_filt_ir, g_filt_rps;
+
+static inline float Biquad_Step(const biquad_coef_t *c, biquad_t *s, float x)
+{
+  float y = c->b0 * x + c->b1 * s->x1 + c->b2 * s->x2 - c->a1 * s->y1 - c->a2 * s->y2;
+  s->x2 = s->x1; s->x1 = x;
+  s->y2 = s->y1; s->y1 = y;
+  return y;
+}
+
+/* Bilinear-transform Butterworth at fc for sample rate fs, prewarped */
+static void Biquad_Design(biquad_coef_t *c, float fc, float fs)
+{
+  biquad_coef_t d = { 1.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+  if (fc > 0.0f && fc < 0.45f * fs) {
+    float k = tanf(3.1415926f * fc / fs);
+    float norm = 1.0f / (1.0f + 1.4142136f * k + k * k);
+    d.b0 = k * k * norm;
+    d.b1 = 2.0f * d.b0;
+    d.b2 = d.b0;
+    d.a1 = 2.0f * (k * k - 1.0f) * norm;
+    d.a2 = (1.0f - 1.4142136f * k + k * k) * norm;
+  }
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();   // the IR filter runs in the ADC callbacks; also fine before the scheduler
+  *c = d;
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+}
+
+#if FIXED_POINT_CTL
+/* g_filt_rps for the Q16 speed loop: the same coefficients in Q16, each
+ * sum of products in 64 bits */
+typedef struct { q16_t b0, b1, b2, a1, a2; } biquad_q16_coef_t;
+typedef struct { q16_t x1, x2, y1, y2; } biquad_q16_t;
+
+static biquad_q16_coef_t g_filt_rps_q16;
+
+static inline q16_t Biquad_StepQ16(const biquad_q16_coef_t *c, biquad_q16_t *s, q16_t x)
+{
+  int64_t acc = (int64_t)c->b0 * x + (int64_t)c->b1 * s->x1 + (int64_t)c->b2 * s->x2
+              - (int64_t)c->a1 * s->y1 - (int64_t)c->a2 * s->y2;
+  q16_t y = Q16_Sat((acc + Q16_ONE / 2) >> Q16_SHIFT);
+  s->x2 = s->x1; s->x1 = x;
+  s->y2 = s->y1; s->y1 = y;
+  return y;
+}
+#endif
+
+static void Gains_At(float v_cms, gain_row_t *out)
+{
+  const gain_row_t *lo = &g_gs.row[0], *hi = &g_gs.row[0];
+  float t = 0.0f;
+  for (int i = 1; i < GS_ROWS && v_cms > lo->speed_cms; i++) {
+    hi = &g_gs.row[i];
+    if (v_cms <= hi->speed_cms) {
+      t = (v_cms - lo->speed_cms) / (hi->speed_cms - lo->speed_cms);
+      break;
+    }
+    lo = hi;
+  }
+  const float *a = (const float *)lo, *b = (const float *)hi;
+  float *o = (float *)out;
+  for (unsigned f = 0; f < GS_FIELDS; f++) o[f] = a[f] + t * (b[f] - a[f]);
+}
+
+/* Cruise speed of a spd_class_t: SLOW and FAST run at the schedule's end rows,
+ * so their gains are tuned ones rather than extrapolated */
+static float Speed_ClassCms(uint8_t cls)
+{
+  float lo = g_gs.row[0].speed_cms, hi = g_gs.row[GS_ROWS - 1].speed_cms;
+  if (cls == SPD_SLOW) return lo < g_gs.cruise_cms ? lo : g_gs.cruise_cms;
+  if (cls == SPD_FAST) return hi > g_gs.cruise_cms ? hi : g_gs.cruise_cms;
+  return g_gs.cruise_cms;
+}
+
+/* === Kernel trace ====================================================== */
+/* The kernel's trace hooks (FreeRTOSConfig.h) and Trace_Isr() append 8-byte
+ * events to a ring of the last KTRACE_EVENTS: each task switched in and out,
+ * each traced ISR's entry and exit, and each send to and receive from a
+ * queue (the kernel's semaphores and mutexes are queues too). A slot is
+ * claimed with one LDREX/STREX increment, so an ISR may record in the middle
+ * of a task's or PendSV's event. About 20 cycles an event; KTRACE_ENABLED 0
+ * in FreeRTOSConfig.h leaves the hooks out, as before. KTRACE <n> stops the
+ * recording and sends the newest n events in the telemetry framing:
+ *
+ *   0xA5 | LEN=17 | TYPE=0x83 | EVENTS (u16) | LOST (u32, overwritten first)
+ *   | TICK ms and CYCCNT (u32 each, read together) | CYCLES per us (u16) | CRC-16
+ *   0xA5 | LEN | TYPE=0x84 | FIRST (u16, 0 = oldest) | up to KTRACE_CHUNK x EVENT | CRC-16
+ *
+ *   EVENT = CYCCNT (u32) | KIND (u8, ktrace_kind_t) | ID (u8) | ARG (u16)
+ *   TASK_IN, TASK_OUT  ID wcet_id_t, KT_UNTAGGED for idle and the timer task;
+ *                      ARG on TASK_OUT: 1 still ready (preempted), 0 blocked
+ *   ISR_ENTER, _EXIT   ID isr_trace_id_t
+ *   QUEUE_SEND, _RECV  ID ktrace_queue_t; ARG messages waiting before it,
+ *                      | KTRACE_FROM_ISR
+ *
+ * then "ACK KTRACE <events>", and recording starts over. RPI/ktrace_dump.py
+ * turns a dump into a Perfetto timeline. */
+#define KTRACE_EVENTS     1024u  // 8 KB of main SRAM; power of two
+#define KTRACE_MASK       (KTRACE_EVENTS - 1u)
+#define KTRACE_TYPE_HEAD  0x83
+#define KTRACE_TYPE_DATA  0x84
+#define KTRACE_HEAD_LEN   17     // TYPE + payload
+#define KTRACE_CHUNK      30     // Events per data frame; LEN stays below 256
+#define KTRACE_UNTAGGED   0xFF
+#define KTRACE_FROM_ISR   0x8000u
+_Static_assert((KTRACE_EVENTS & KTRACE_MASK) == 0, "KTRACE_EVENTS must be a power of two");
+
+typedef enum {
+  KT_TASK_IN, KT_TASK_OUT, KT_ISR_ENTER, KT_ISR_EXIT, KT_QUEUE_SEND, KT_QUEUE_RECV
+} ktrace_kind_t;
+
+/* Queue numbers (vQueueSetQueueNumber); the kernel's own are 0 */
+typedef enum { KQ_OTHER, KQ_DISPLAY } ktrace_queue_t;
+
+typedef struct {
+  uint32_t cyc;
+  uint8_t  kind;
+  uint8_t  id;
+  uint16_t arg;
+} ktrace_event_t;
+
+_Static_assert(sizeof(ktrace_event_t) == 8, "ktrace_event_t is sent as is");
+
+static ktrace_event_t g_kt_ring[KTRACE_EVENTS];
+static uint32_t g_kt_head = 0;             // Events ever claimed; indices run free
+static volatile uint8_t g_kt_paused = 0;   // KTRACE is sending the ring
+
+static inline void KTrace_Record(ktrace_kind_t kind, uint8_t id, uint16_t arg, uint32_t cyc)
+{
+  if (g_kt_paused) return;
+  uint32_t i = __atomic_fetch_add(&g_kt_head, 1u, __ATOMIC_RELAXED);
+  ktrace_event_t *e = &g_kt_ring[i & KTRACE_MASK];
+  e->cyc  = cyc;
+  e->kind = (uint8_t)kind;
+  e->id   = id;
+  e->arg  = arg;
+}
+
+/* From the kernel's queue hooks */
+FAST_CODE void KTrace_Queue(uint8_t send, uint8_t queue, uint32_t waiting, uint8_t from_isr)
+{
+  uint16_t arg = (uint16_t)(waiting < 0x7FFFu ? waiting : 0x7FFFu);
+  if (from_isr) arg |= KTRACE_FROM_ISR;
+  KTrace_Record(send ? KT_QUEUE_SEND : KT_QUEUE_RECV, queue, arg, DWT->CYCCNT);
+}
+
+/* === Loop tracer ======================================================= */
+/* The periodic loops stamp DWT->CYCCNT when they wake (Trace_Wake) and when
+ * their body ends (Trace_End). The stamps go into a per-loop ring of the last
+ * TRACE_RING loops, and each loop adds its period error |period - nominal|
+ * and its execution time to log2 histograms: a few stores, a divide and a
+ * CLZ per stamp. JITTER over UART prints the histograms gathered since the
+ * previous JITTER and the most recent loops from the ring. */
+#define TRACE_RING     32
+#define TRACE_BUCKETS  16   // bucket 0: 0 us; b: [2^(b-1), 2^b) us; the last also takes the rest
+#define TRACE_LAST     4    // recent loops printed by JITTER
+
+typedef enum { TR_MOTOR, TR_ENCODER, TR_SERVO, TR_IMU, TR_LOOPS } trace_id_t;
+
+typedef struct {
+  uint32_t wake, end;       // DWT cycles
+} trace_stamp_t;
+
+typedef struct {
+  uint32_t      nominal_us;
+  uint8_t       cpu;        // g_wcet slot: the loop's own cycles per iteration
+  uint8_t       have_prev;  // 0: the next wake starts a new series, no period
+  uint8_t       head;       // ring slot of the current loop
+  trace_stamp_t ring[TRACE_RING];
+  uint32_t      periods;
+  uint32_t      dev_max_us, exec_max_us;
+  uint32_t      dev_hist[TRACE_BUCKETS];
+  uint32_t      exec_hist[TRACE_BUCKETS];
+} loop_trace_t;
+
+/* Per task: own CPU cycles of each iteration (task_wcet.h), for SCHED. The
+ * traced loops count theirs between Trace_Wake and Trace_End; the others call
+ * Wcet_Begin/Wcet_End themselves. UltrasonicTask never runs and is not in it. */
+typedef enum {
+  W_DEFAULT, W_SHOW, W_MOTOR, W_ENCODER, W_DISTANCE, W_IMU, W_SERVO, W_IR, W_CMD, W_UARTRX, W_TASKS
+} wcet_id_t;
+
+WcetTask *volatile wcetCurrent;
+uint32_t wcetSince;
+static WcetTask g_wcet[W_TASKS];
+
+static inline uint8_t ktrace_task_id(void *tag)
+{
+  return tag ? (uint8_t)((WcetTask *)tag - g_wcet) : KTRACE_UNTAGGED;
+}
+
+FAST_CODE void Wcet_TaskSwitchedIn(void *tag)
+{
+  Wcet_Switch((WcetTask *)tag);
+#if KTRACE_ENABLED
+  KTrace_Record(KT_TASK_IN, ktrace_task_id(tag), 0, wcetSince);
+#endif
+}
+
+/* From traceTASK_SWITCHED_OUT, with the outgoing task's tag */
+FAST_CODE void KTrace_TaskSwitchedOut(void *tag, uint8_t ready)
+{
+  KTrace_Record(KT_TASK_OUT, ktrace_task_id(tag), ready, DWT->CYCCNT);
+}
+
+static loop_trace_t g_trace[TR_LOOPS] = {
+  [TR_MOTOR]   = { .nominal_us = MC_PERIOD_MS * 1000u, .cpu = W_MOTOR },
+  [TR_ENCODER] = { .nominal_us = ENC_SAMPLE_US, .cpu = W_ENCODER },
+  [TR_SERVO]   = { .nominal_us = (uint32_t)(1e6f * IMU_BATCH / IMU_ODR_HZ), .cpu = W_SERVO },  // one IMU batch
+  [TR_IMU]     = { .nominal_us = (uint32_t)(1e6f * IMU_BATCH / IMU_ODR_HZ), .cpu = W_IMU },
+};
+
+static inline uint8_t trace_bucket(uint32_t us)
+{
+  uint8_t b = us ? (uint8_t)(32 - __builtin_clz(us)) : 0;
+  return b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1;
+}
+
+static inline void Trace_Wake(trace_id_t id)
+{
+  loop_trace_t *t = &g_trace[id];
+  uint32_t now = DWT->CYCCNT;
+  if (t->have_prev) {
+    uint32_t period = (now - t->ring[t->head].wake) / (SystemCoreClock / 1000000u);
+    uint32_t dev = period > t->nominal_us ? period - t->nominal_us : t->nominal_us - period;
+    t->dev_hist[trace_bucket(dev)]++;
+    if (dev > t->dev_max_us) t->dev_max_us = dev;
+    t->periods++;
+  }
+  t->have_prev = 1;
+  t->head = (uint8_t)((t->head + 1) % TRACE_RING);
+  t->ring[t->head].wake = now;
+  t->ring[t->head].end  = now;   // until Trace_End
+  Wcet_Begin(&g_wcet[t->cpu]);
+}
+
+static inline void Trace_End(trace_id_t id)
+{
+  loop_trace_t *t = &g_trace[id];
+  uint32_t now  = DWT->CYCCNT;
+  uint32_t exec = (now - t->ring[t->head].wake) / (SystemCoreClock / 1000000u);
+  t->ring[t->head].end = now;
+  t->exec_hist[trace_bucket(exec)]++;
+  if (exec > t->exec_max_us) t->exec_max_us = exec;
+  Wcet_End(&g_wcet[t->cpu]);
+}
+
+/* For loops that idle between jobs: the gap is not a period */
+static inline void Trace_Restart(trace_id_t id)
+{
+  g_trace[id].have_prev = 0;
+}
+
+/* The hot interrupt callbacks count their own cycles the same way, from entry
+ * to exit (a higher-priority ISR that preempts them is included), for JITTER
+ * and SCHED to print. Build with and without FAST_CODE_IN_RAM (fast_mem.h) and
+ * compare. */
+typedef enum { TI_IMU_INT, TI_IR_ADC, TI_ENC_LATCH, TI_UART_RX, TI_ISRS } isr_trace_id_t;
+
+static WcetIsr g_isr_trace[TI_ISRS];
+static const char *const g_isr_names[TI_ISRS] = { "IMU_INT", "IR_ADC", "ENC_LATCH", "UART_RX" };
+static uint32_t g_art_missing;   // FLASH_ACR bits FastMem_CheckArt() had to set
+
+static inline void Trace_Isr(isr_trace_id_t id, uint32_t start)
+{
+  Wcet_Isr(&g_isr_trace[id], start);
+#if KTRACE_ENABLED
+  KTrace_Record(KT_ISR_ENTER, (uint8_t)id, 0, start);
+  KTrace_Record(KT_ISR_EXIT, (uint8_t)id, 0, DWT->CYCCNT);
+#endif
+}
+
+/* Finer-grained than the loops and ISRs above: the hot functions inside
+ * them (prof.h), min/mean/max cycles for PROF to print. */
+typedef enum {
+  PR_UART_RX, PR_PARSE, PR_DISPATCH, PR_GYRO, PR_IR, PR_MOTOR, PR_OLED, PR_REGIONS
+} prof_id_t;
+
+ProfRegion profRegions[PR_REGIONS];
+
+/* === Velocity profile for FW/BW moves ================================== */
+/* StartMoveCM() plans the move and motor() asks VelProfile_Step() for a speed
+ * setpoint every control period:
+ *   v = min(v + a*dt, cruise, sqrt(v_end^2 + 2*VP_DECEL_CMS2*remaining))
+ * with a ramped up to VP_ACCEL_CMS2 at VP_JERK_CMS3 (S-shaped start; 0 = plain
+ * trapezoid). The square-root term begins braking exactly where the rest of
+ * the move is needed to slow to v_end, so the robot arrives at VP_END_CMS and
+ * the stop overshoot no longer depends on the cruise speed. A move that hands
+ * over to a blended turn ends at VP_BLEND_CMS instead.
+ * Setpoints become PWM through a feed-forward line plus a speed PI on the mean
+ * wheel speed; the A-D difference loop is unchanged.
+ * VP_PWM_* come from driving at fixed PWM and reading the wheel speed. */
+#define VP_ENABLE            1      // 0 = constant PWM 5000 (and reverse-pulse brake without BRAKE_SHORT)
+#define VP_CRUISE_CMS        60.0f  // default for g_gs.cruise_cms
+#define VP_ACCEL_CMS2        80.0f
+#define VP_DECEL_CMS2        60.0f
+#define VP_JERK_CMS3         400.0f
+#define VP_END_CMS           6.0f   // arrival speed; the distance task stops here
+#define VP_BLEND_CMS         40.0f  // arrival speed when handing over to a turn
+#define VP_PWM_STATIC        1500.0f
+#define VP_PWM_PER_CMS       70.0f
+#define VP_KP                40.0f  // PWM per cm/s of speed error (gain schedule default)
+#define VP_KI                60.0f  // PWM per cm/s per second (default)
+#define VP_I_MAX             1500.0f
+#if FIXED_POINT_CTL && !VP_ENABLE
+#error "FIXED_POINT_CTL runs the per-wheel speed PI; it needs VP_ENABLE"
+#endif
+
+typedef struct {
+  volatile float goal_cm;  // travel at which the profile reaches v_end
+  volatile float v_end;    // cm/s
+  volatile float v_max;    // cruise, cm/s
+  volatile float v;        // current setpoint, cm/s
+  volatile float a;        // current acceleration, cm/s^2
+} vprof_t;
+static vprof_t g_vprof = {0};
+
+#if VP_ENABLE
+#define MOVE_BRAKE_COMP_CM   1      // arrival at VP_END_CMS only overshoots by the 10 Hz check
+#else
+#define MOVE_BRAKE_COMP_CM   5      // moves stop this much early to allow for the brake
+#endif
+
+typedef struct {
+  volatile uint8_t into_turn;   // current move hands over to a forward turn
+  volatile uint8_t turn_left;   // side of that turn
+  volatile uint8_t presteered;  // distance task has locked the steering
+  volatile float   yaw_ref;     // yaw when pre-steering began
+  volatile uint8_t into_move;   // current turn hands over to FW
+} blend_t;
+static blend_t g_blend = {0};
+
+/* === Heading hold for FW/BW moves ====================================== */
+/* With VP_ENABLE, motor() runs a cascade instead of the A-D difference PI.
+ * The outer loop works on the heading error from the yaw latched at
+ * StartMoveCM(). It turns that error into a small servo trim and a wheel
+ * speed difference. The inner loop then runs a PI per wheel toward its own
+ * share of the profile speed. Both outer outputs flip sign when reversing,
+ * since steering and a speed difference turn the car the other way. The
+ * trim stops once the distance task has pre-steered into a turn. */
+#define HH_KP_STEER          1.5f   // servo deg per deg of heading error (gain schedule default)
+#define HH_KD_STEER          0.05f  // servo deg per dps, damping
+#define HH_STEER_MAX_DEG     8.0f
+#define HH_KP_DIFF           1.0f   // wheel speed difference, cm/s per deg (default)
+#define HH_DIFF_MAX_CMS      8.0f
+
+typedef struct {
+  volatile float   yaw_ref;   // heading to hold for the current move
+  volatile uint8_t trimmed;   // servo left off centre by the heading hold
+} hhold_t;
+static hhold_t g_hhold = {0};
+
+/* USART3 RX: circular DMA, IDLE line wakes UartRxTask
+ * The DMA writes every byte into uart3_dma_buf with no CPU involvement. The
+ * IDLE-line (or buffer wrap) interrupt only publishes the DMA write index and
+ * notifies UartRxTask, which frames lines and fills the command queue. That is
+ * about one interrupt per command instead of one per byte. The buffer must
+ * hold everything that can arrive before UartRxTask runs (~10 ms at 1 Mbaud). */
+#define UART3_DMA_BUF_SIZE 1024
+static uint8_t uart3_dma_buf[UART3_DMA_BUF_SIZE];
+static volatile uint16_t uart3_dma_head = 0;     // DMA write index, set in the ISR
+static volatile uint8_t  uart3_rx_restarted = 0; // DMA restarted at index 0 after an error
+
+/* Emergency stop: ESTOP_BYTE anywhere in the stream (ASCII CAN, never part of a
+ * command line) is acted on by the RX event ISR itself, which cuts the wheels
+ * and ends the move or turn. UartRxTask later reaches the byte in order and
+ * marks where the stale commands end in cmdq; CmdTask drops them and replies
+ * "STOPPED <FW|BW|TURN|IDLE> <cm or deg left>". */
+#define ESTOP_BYTE 0x18
+#define ESTOP_CUT    1  // wheels cut by the ISR, queue boundary not known yet
+#define ESTOP_FLUSH  2  // UartRxTask has set g_estop_head
+static volatile uint8_t  g_estop = 0;           // ESTOP_CUT / ESTOP_FLUSH, 0 once CmdTask has replied
+static volatile uint16_t g_estop_head;          // cmdq_head when UartRxTask reached the byte
+static volatile uint16_t uart3_estop_scan = 0;  // next DMA index the ISR looks at
+static volatile int16_t  g_estop_left;          // cm or degrees the stopped motion had to go
+static const char       *g_estop_kind;
+
+/* USART3 TX: ring drained by DMA
+ * uart3_write() copies into the ring and returns at once; the DMA sends the
+ * oldest contiguous run and HAL_UART_TxCpltCallback starts the next one. No
+ * task ever waits on the UART. A reply that does not fit is dropped whole and
+ * counted rather than blocking the caller. */
+#define UART3_TX_RING_SIZE 1024
+static uint8_t uart3_tx_ring[UART3_TX_RING_SIZE];
+static volatile uint16_t uart3_tx_head = 0;     // next free byte
+static volatile uint16_t uart3_tx_tail = 0;     // oldest byte not yet sent
+static volatile uint16_t uart3_tx_inflight = 0; // bytes in the running DMA transfer
+static volatile uint32_t uart3_tx_dropped = 0;  // replies lost to a full ring
+
+/* Telemetry: binary state frames on USART3
+ * TELEM <hz> starts a periodic RTOS timer (0 stops it). Each expiry samples
+ * the control state and queues one fixed-layout frame on the TX ring next to
+ * the text replies; the ring keeps every write whole, so frames and lines
+ * never interleave. 33 bytes at 200 Hz is ~7% of the 1 Mbaud link.
+ *
+ *   0xA5 | LEN=29 | TYPE=0x80 | TICK ms (u32) | ENC_A, ENC_D counts (i32)
+ *   | RPS_A, RPS_D (i16, 1/1000 rps) | PWM_A, PWM_D (i16, + = forward)
+ *   | YAW (i32, 1/100 deg) | YAW_RATE (i16, 1/100 dps) | IR (u16, mm) | CRC-16
+ *
+ * Little-endian; CRC-16/CCITT-FALSE over LEN..IR, as the RPi
+ * stm32_protocol.h expects. Text replies never contain 0xA5. */
+#define TELEM_SYNC       0xA5
+#define TELEM_TYPE       0x80
+#define TELEM_LEN        29                      // TYPE + payload
+#define TELEM_FRAME_LEN  (2 + TELEM_LEN + 2)
+#define TELEM_MAX_HZ     200
+static osTimerId_t TelemTimerHandle;
+static CCMRAM StaticTimer_t TelemTimerControlBlock;
+static const osTimerAttr_t TelemTimer_attributes = {
+  .name = "TelemTimer",
+  .cb_mem = &TelemTimerControlBlock,
+  .cb_size = sizeof(TelemTimerControlBlock),
+};
+
+/* === Motion trace ======================================================= */
+/* CommandQueue_TryDispatch opens a record whenever it starts a move or a
+ * turn. From then on the FreeRTOS tick hook (MotionTrace_Tick, 1 kHz) appends
+ * one sample per ms until the robot has been idle for MTRACE_TAIL_MS, so the
+ * brake pulse and the settle are in the record too. The hook copies only
+ * registers and values the tasks have already published. No task reads or
+ * waits on it, and it returns at once while no record is open. All records
+ * share one ring, and the oldest samples are overwritten first. MTRACE <n>,
+ * sent while the robot is idle, dumps whatever is left of the last n moves in
+ * the telemetry framing:
+ *
+ *   0xA5 | LEN=14 | TYPE=0x81 | MOVE (u8, 0 = oldest) | MOVES (u8) | OP (u8, cmd_op_t)
+ *   | ARG (i32, cm or deg) | TICK ms at the first sample (u32) | SAMPLES (u16) | CRC-16
+ *   0xA5 | LEN | TYPE=0x82 | MOVE (u8) | FIRST (u16, sample index in the move)
+ *   | up to MTRACE_CHUNK x SAMPLE | CRC-16
+ *
+ *   SAMPLE = PWM_A, PWM_D (i16, + = forward) | CNT_A, CNT_D (u16, raw encoder)
+ *   | RPS_A, RPS_D (i16, 1/1000 rps, as EncoderTask last published)
+ *   | YAW (i16, 1/100 deg) | SERVO (u16, us)
+ *
+ * then "ACK MTRACE <moves>". RPI/mtrace_dump.py turns a dump into CSV. */
+#define MTRACE_SAMPLES     2048u  // 32 KB of main SRAM; power of two
+#define MTRACE_MASK        (MTRACE_SAMPLES - 1u)
+#define MTRACE_MOVES       16u    // Move records kept; power of two
+#define MTRACE_MOVES_MASK  (MTRACE_MOVES - 1u)
+#define MTRACE_TAIL_MS     150u   // Past the 73/77 ms brake pulse
+#define MTRACE_TYPE_MOVE   0x81
+#define MTRACE_TYPE_DATA   0x82
+#define MTRACE_MOVE_LEN    14     // TYPE + payload
+#define MTRACE_CHUNK       14     // Samples per data frame; LEN stays below 256
+_Static_assert((MTRACE_SAMPLES & MTRACE_MASK) == 0 && (MTRACE_MOVES & MTRACE_MOVES_MASK) == 0,
+               "MTRACE sizes must be powers of two");
+
+typedef struct {
+  int16_t  pwm_a, pwm_d;
+  uint16_t cnt_a, cnt_d;
+  int16_t  rps_a, rps_d;
+  int16_t  yaw;
+  uint16_t servo_us;
+} mtrace_sample_t;
+
+_Static_assert(sizeof(mtrace_sample_t) == 16, "mtrace_sample_t is sent as is");
+
+typedef struct {
+  uint32_t start;     // g_mt_head at the first sample
+  uint32_t n;         // Samples taken
+  uint32_t tick_ms;
+  int32_t  arg;
+  uint8_t  op;
+} mtrace_move_t;
+
+static mtrace_sample_t g_mt_ring[MTRACE_SAMPLES];
+static mtrace_move_t   g_mt_moves[MTRACE_MOVES];
+static volatile uint32_t g_mt_head = 0;        // Samples ever taken; indices run free
+static volatile uint32_t g_mt_moves_head = 0;  // Moves ever opened
+static volatile uint8_t  g_mt_open = 0;        // The newest move is still being recorded
+static volatile uint8_t  g_mt_paused = 0;      // MTRACE is sending the ring
+static uint16_t g_mt_idle_ms;
+
+/* === System identification ============================================== */
+/* SYSID <A|D|S> <STEP|CHIRP> [amp] runs one open-loop test sequence for
+ * RPI/sysid_fit.py, which fits first-order-plus-dead-time models to the
+ * responses and suggests PARAM gains and the VP_PWM_* feedforward. The motion
+ * trace records the sequence like a move, as op CMD_SYSID with arg
+ * (target * 2 + seq) << 16 | amp, and MTRACE 1 fetches it once "DONE SYSID"
+ * is sent. The tick hook (SysId_Tick) sets the outputs every ms, so the edges
+ * are exact to the sample; CmdTask only starts the sequence and, once it has
+ * run SYSID_MS, brakes and replies.
+ *   A, D   that wheel alone, duty amp (default SYSID_WHEEL_PWM), servo centred.
+ *          STEP:  0, amp from 100 ms, amp / 2 from 900 ms, 0 from 1500 ms
+ *          CHIRP: 0.6 amp +- 0.4 amp from 200 ms, 0.5 -> 8 Hz
+ *   S      both wheels at SYSID_STEER_PWM, servo amp us left of centre
+ *          (default SYSID_STEER_US), for the yaw rate's response.
+ *          STEP:  left from 400 ms to 1100 ms
+ *          CHIRP: +- amp from 400 ms, 0.5 -> 4 Hz
+ * Every sequence drives the robot forward: A and D about 30 cm on a curve, S
+ * about 50 cm. Duties are battery-scaled like a move's. A stop byte ends the
+ * sequence at the next tick (STOPPED SYSID). */
+#define SYSID_MS            1700u  // Sequence length; with MTRACE_TAIL_MS well inside the ring
+#define SYSID_WHEEL_PWM     3000   // ~20 cm/s on the VP_PWM_* line
+#define SYSID_STEER_PWM     3000
+#define SYSID_STEER_US      150    // ~9 servo degrees
+#define SYSID_STEER_US_MAX  400
+_Static_assert(SYSID_MS + MTRACE_TAIL_MS < MTRACE_SAMPLES, "a SYSID sequence must fit the motion trace");
+
+typedef enum { SYSID_A, SYSID_D, SYSID_S } sysid_target_t;
+typedef enum { SYSID_STEP, SYSID_CHIRP } sysid_seq_t;
+typedef enum { SYSID_IDLE, SYSID_RUNNING, SYSID_ENDED } sysid_state_t;
+
+typedef struct {
+  volatile uint8_t state;    // sysid_state_t; RUNNING: the tick hook owns the outputs
+  uint8_t  target, seq;
+  int32_t  amp;
+  uint32_t t_ms;             // Ticks run
+  volatile uint8_t stopped;  // Ended by a stop byte
+} sysid_t;
+static sysid_t g_sysid;
+
+/* === Odometry calibration =============================================== */
+/* CAL ODO [pwm] fits CMPC, the cm the robot travels per encoder count, which
+ * tyre wear and the floor move off WHEEL_CIRC_CM / COUNTS_PER_REV. Square the
+ * robot to a wall 70 cm or more ahead of the front IR and send it: the tick
+ * hook (OdoCal_Tick) drives both wheels at duty pwm (default ODO_PWM) plus
+ * the BIASA/BIASD trims, servo centred, and every ODO_SAMPLE_MS after
+ * ODO_SETTLE_MS of spin-up pairs the mean wheel count with g_ir_mm while the
+ * range is inside [ODO_NEAR_MM, ODO_FAR_MM]. It stops at ODO_NEAR_MM (or
+ * after ODO_MAX_MS, or on a stop byte) and CmdTask fits range against count
+ * by least squares: -slope is CMPC. The speed is near constant by then, so
+ * the IR filter's lag only offsets the range and leaves the slope alone. The
+ * reply is "DONE CAL ODO CMPC=<cm> N=<samples> RMS=<mm>", and the fit is in
+ * the RAM copy; CAL SAVE keeps it. A fit from fewer than ODO_MIN_SAMPLES, or
+ * more than ODO_TOL off the nominal scale (the wall was missed or is not
+ * square), is refused with "ERR CAL ODO" and CMPC left as it was. */
+#define ODO_PWM          3000    // ~20 cm/s on the VP_PWM_* line
+#define ODO_SETTLE_MS    400u
+#define ODO_SAMPLE_MS    10u
+#define ODO_FAR_MM       600u    // Where the IR fit still resolves a count's travel
+#define ODO_NEAR_MM      150u
+#define ODO_MAX_MS       10000u  // ~2 m at ODO_PWM: no wall
+#define ODO_MIN_SAMPLES  40u     // ~8 cm of the window at ODO_PWM
+#define ODO_TOL          0.25f
+
+typedef enum { ODOCAL_IDLE, ODOCAL_RUNNING, ODOCAL_ENDED } odocal_state_t;
+
+typedef struct {
+  volatile uint8_t state;    // odocal_state_t; RUNNING: the tick hook owns the outputs
+  volatile uint8_t stopped;  // Ended by a stop byte
+  int32_t  pwm;
+  uint32_t t_ms;
+  uint32_t n;                // Samples in the fit
+  float    mean_c, mean_r;   // Running means (counts, mm) and sums of products
+  float    s_cc, s_cr, s_rr; // about them, so float keeps its precision
+} odocal_t;
+static odocal_t g_odocal;
+
+/* Display: ShowTask owns the OLED
+ * Other tasks post disp_msg_t updates to DisplayQueue and never touch the
+ * panel. ShowTask keeps one line of text per row and, at most every
+ * DISP_PERIOD_MS, composes them into OLED_GRAM while the panel still shows
+ * the previous frame; OLED_Refresh_Gram() then sends only what changed.
+ * Values travel as hundredths, so senders do no float formatting. A post to a
+ * full queue is dropped; the next update of that row replaces it anyway. */
+#define DISP_ROWS       4      // 12 px font on 16 px rows
+#define DISP_COLS       16     // 8 px per character
+#define DISP_PERIOD_MS  100
+#define DISP_QUEUE_LEN  8
+typedef enum {
+  DISP_TEXT = 0,   // text as is
+  DISP_CENTI,      // text, then value / 100 as "%7.2f"
+} disp_kind_t;
+typedef struct {
+  uint8_t row;
+  uint8_t kind;
+  int32_t value;
+  char    text[DISP_COLS];  // NUL-padded, not terminated when full
+} disp_msg_t;
+static osMessageQueueId_t DisplayQueueHandle;
+static CCMRAM disp_msg_t DisplayQueueBuffer[DISP_QUEUE_LEN];
+static CCMRAM StaticQueue_t DisplayQueueControlBlock;
+static const osMessageQueueAttr_t DisplayQueue_attributes = {
+  .name = "DisplayQueue",
+  .cb_mem = &DisplayQueueControlBlock,
+  .cb_size = sizeof(DisplayQueueControlBlock),
+  .mq_mem = &DisplayQueueBuffer,
+  .mq_size = sizeof(DisplayQueueBuffer),
+};
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -202,93 +1115,191 @@ static uint8_t uart3_rx_ch;
 
 /* Private variables ---------------------------------------------------------*/
  ADC_HandleTypeDef hadc1;
+ADC_HandleTypeDef hadc2;
+DMA_HandleTypeDef hdma_adc1;
 
 I2C_HandleTypeDef hi2c2;
+DMA_HandleTypeDef hdma_i2c2_rx;
 
 TIM_HandleTypeDef htim1;
 TIM_HandleTypeDef htim2;
 TIM_HandleTypeDef htim3;
 TIM_HandleTypeDef htim4;
 TIM_HandleTypeDef htim5;
+TIM_HandleTypeDef htim7;
 TIM_HandleTypeDef htim8;
 TIM_HandleTypeDef htim11;
 TIM_HandleTypeDef htim12;
 
 UART_HandleTypeDef huart2;
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart3_rx;
+DMA_HandleTypeDef hdma_usart3_tx;
 
 /* Definitions for defaultTask */
 osThreadId_t defaultTaskHandle;
+uint32_t defaultTaskBuffer[ 128 ];
+osStaticThreadDef_t defaultTaskControlBlock;
 const osThreadAttr_t defaultTask_attributes = {
   .name = "defaultTask",
-  .stack_size = 128 * 4,
+  .cb_mem = &defaultTaskControlBlock,
+  .cb_size = sizeof(defaultTaskControlBlock),
+  .stack_mem = &defaultTaskBuffer[0],
+  .stack_size = sizeof(defaultTaskBuffer),
   .priority = (osPriority_t) osPriorityNormal,
 };
 /* Definitions for ShowTask */
 osThreadId_t ShowTaskHandle;
+uint32_t ShowTaskBuffer[ 256 ];
+osStaticThreadDef_t ShowTaskControlBlock;
 const osThreadAttr_t ShowTask_attributes = {
   .name = "ShowTask",
-  .stack_size = 128 * 4,
+  .cb_mem = &ShowTaskControlBlock,
+  .cb_size = sizeof(ShowTaskControlBlock),
+  .stack_mem = &ShowTaskBuffer[0],
+  .stack_size = sizeof(ShowTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for MotorTask */
 osThreadId_t MotorTaskHandle;
+uint32_t MotorTaskBuffer[ 256 ];
+osStaticThreadDef_t MotorTaskControlBlock;
 const osThreadAttr_t MotorTask_attributes = {
   .name = "MotorTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &MotorTaskControlBlock,
+  .cb_size = sizeof(MotorTaskControlBlock),
+  .stack_mem = &MotorTaskBuffer[0],
+  .stack_size = sizeof(MotorTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for EncoderTask */
 osThreadId_t EncoderTaskHandle;
+uint32_t EncoderTaskBuffer[ 256 ];
+osStaticThreadDef_t EncoderTaskControlBlock;
 const osThreadAttr_t EncoderTask_attributes = {
   .name = "EncoderTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &EncoderTaskControlBlock,
+  .cb_size = sizeof(EncoderTaskControlBlock),
+  .stack_mem = &EncoderTaskBuffer[0],
+  .stack_size = sizeof(EncoderTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for DistanceTask */
 osThreadId_t DistanceTaskHandle;
+uint32_t DistanceTaskBuffer[ 512 ];
+osStaticThreadDef_t DistanceTaskControlBlock;
 const osThreadAttr_t DistanceTask_attributes = {
   .name = "DistanceTask",
-  .stack_size = 512 * 4,
+  .cb_mem = &DistanceTaskControlBlock,
+  .cb_size = sizeof(DistanceTaskControlBlock),
+  .stack_mem = &DistanceTaskBuffer[0],
+  .stack_size = sizeof(DistanceTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for IMUTask */
 osThreadId_t IMUTaskHandle;
+uint32_t IMUTaskBuffer[ 1024 ];
+osStaticThreadDef_t IMUTaskControlBlock;
 const osThreadAttr_t IMUTask_attributes = {
   .name = "IMUTask",
-  .stack_size = 1024 * 4,
+  .cb_mem = &IMUTaskControlBlock,
+  .cb_size = sizeof(IMUTaskControlBlock),
+  .stack_mem = &IMUTaskBuffer[0],
+  .stack_size = sizeof(IMUTaskBuffer),
   .priority = (osPriority_t) osPriorityNormal,
 };
 /* Definitions for ServoMotorTask */
 osThreadId_t ServoMotorTaskHandle;
+uint32_t ServoMotorTaskBuffer[ 256 ];
+osStaticThreadDef_t ServoMotorTaskControlBlock;
 const osThreadAttr_t ServoMotorTask_attributes = {
   .name = "ServoMotorTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &ServoMotorTaskControlBlock,
+  .cb_size = sizeof(ServoMotorTaskControlBlock),
+  .stack_mem = &ServoMotorTaskBuffer[0],
+  .stack_size = sizeof(ServoMotorTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for IRTask */
 osThreadId_t IRTaskHandle;
+uint32_t IRTaskBuffer[ 256 ];
+osStaticThreadDef_t IRTaskControlBlock;
 const osThreadAttr_t IRTask_attributes = {
   .name = "IRTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &IRTaskControlBlock,
+  .cb_size = sizeof(IRTaskControlBlock),
+  .stack_mem = &IRTaskBuffer[0],
+  .stack_size = sizeof(IRTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for UltrasonicTask */
 osThreadId_t UltrasonicTaskHandle;
+uint32_t UltrasonicTaskBuffer[ 256 ];
+osStaticThreadDef_t UltrasonicTaskControlBlock;
 const osThreadAttr_t UltrasonicTask_attributes = {
   .name = "UltrasonicTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &UltrasonicTaskControlBlock,
+  .cb_size = sizeof(UltrasonicTaskControlBlock),
+  .stack_mem = &UltrasonicTaskBuffer[0],
+  .stack_size = sizeof(UltrasonicTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
+/* Definitions for CmdTask */
+osThreadId_t CmdTaskHandle;
+uint32_t CmdTaskBuffer[ 256 ];
+osStaticThreadDef_t CmdTaskControlBlock;
+const osThreadAttr_t CmdTask_attributes = {
+  .name = "CmdTask",
+  .cb_mem = &CmdTaskControlBlock,
+  .cb_size = sizeof(CmdTaskControlBlock),
+  .stack_mem = &CmdTaskBuffer[0],
+  .stack_size = sizeof(CmdTaskBuffer),
+  .priority = (osPriority_t) osPriorityAboveNormal,
+};
+/* Definitions for UartRxTask */
+osThreadId_t UartRxTaskHandle;
+uint32_t UartRxTaskBuffer[ 256 ];
+osStaticThreadDef_t UartRxTaskControlBlock;
+const osThreadAttr_t UartRxTask_attributes = {
+  .name = "UartRxTask",
+  .cb_mem = &UartRxTaskControlBlock,
+  .cb_size = sizeof(UartRxTaskControlBlock),
+  .stack_mem = &UartRxTaskBuffer[0],
+  .stack_size = sizeof(UartRxTaskBuffer),
+  .priority = (osPriority_t) osPriorityAboveNormal,
+};
 /* USER CODE BEGIN PV */
+/* I2C2 once the IMU loop runs: every access is a queued transaction
+ * (i2c_bus.h) that posts its IMU_EVT_ bit when done, so the loop never waits
+ * on the bus and a stuck SDA is cleared in place. The blocking icm_ helpers
+ * are for bring-up only, before anything is queued. */
+static I2cBus g_i2c2 = {
+  .hi2c = &hi2c2, .sclPort = GPIOB, .sclPin = GPIO_PIN_10, .sdaPort = GPIOB, .sdaPin = GPIO_PIN_11,
+};
+static uint8_t imu_count_raw[2];
+static volatile uint32_t imu_count_cyc;   // DWT->CYCCNT when the count read finished
+static uint8_t imu_fifo_rst[2] = { 0x1F, 0x00 };
+static I2cXfer imu_x_count, imu_x_fifo, imu_x_rst[2];
 uint8_t aRxBuffer[20];
-volatile uint16_t g_ir_sample = 0;   // latest ADC sample (0..4095)
+volatile uint16_t g_ir_sample = 0;   // latest ADC sample (0..4095), IR_OVERSAMPLE average
+volatile uint16_t g_ir_mm     = 0;   // g_ir_sample as distance (mm), interpolated from ir_lut_mm
+
+/* IR: TIM8 update (10 kHz) triggers ADC1, DMA2_Stream0 fills ir_dma_buf in
+ * circular mode. Each half is IR_OVERSAMPLE conversions; the half/full
+ * callbacks average it (1.25 kHz) and look the distance up in ir_lut_mm,
+ * built once from the IrConvert() fit, so no powf() runs after boot. */
+#define IR_OVERSAMPLE      8
+#define IR_DMA_LEN         (2 * IR_OVERSAMPLE)
+#define IR_LUT_MAX_MM      9000u   // clamp for tiny counts, where the fit runs off
+static uint16_t ir_dma_buf[IR_DMA_LEN];
+static CCMRAM uint16_t ir_lut_mm[4096];
 
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_TIM8_Init(void);
 static void MX_TIM2_Init(void);
 static void MX_USART2_UART_Init(void);
@@ -301,6 +1312,8 @@ static void MX_TIM3_Init(void);
 static void MX_TIM11_Init(void);
 static void MX_TIM12_Init(void);
 static void MX_ADC1_Init(void);
+static void MX_TIM7_Init(void);
+static void MX_ADC2_Init(void);
 void StartDefaultTask(void *argument);
 void show(void *argument);
 void motor(void *argument);
@@ -310,64 +1323,73 @@ void imu(void *argument);
 void servomotor(void *argument);
 void ir(void *argument);
 void ultrasonic(void *argument);
+void uartrx(void *argument);
+void cmdtask(void *argument);
 
 /* USER CODE BEGIN PFP */
+static void Uart3_StartRx(void);
+static void Gains_Load(void);
+static void Cal_Load(void);
+static void Odo_Configure(void);
+static void Telem_Send(void *argument);
+static void MotionTrace_Begin(uint8_t op, int32_t arg);
 /* ICM helpers */
 static HAL_StatusTypeDef icm_write(uint8_t addr7, uint8_t reg, uint8_t val);
 static HAL_StatusTypeDef icm_read (uint8_t addr7, uint8_t reg, uint8_t *val);
 static HAL_StatusTypeDef icm_select_bank(uint8_t addr7, uint8_t bank);
 static int               icm_probe(void);
 static void              icm_wake_enable_gyro(void);
-static HAL_StatusTypeDef icm_read_gyro_xyz(int16_t *gx, int16_t *gy, int16_t *gz);
+static void              icm_configure_fifo(void);
+static void              icm_fifo_reset(void);
+static void              icm_fifo_reset_queue(void);
 
-/* Helper to drive a dual-input H-bridge using two PWM channels */
-static inline void Motor_Set(TIM_HandleTypeDef *htim,
-                             uint32_t ch_fwd, uint32_t ch_rev,
-                             uint16_t duty, uint8_t dir)
+static inline void Servo_Wake(uint32_t evt)
 {
-  /* dir: 0 = CW, 1 = CCW */
-  if (dir == 0) {
-    __HAL_TIM_SET_COMPARE(htim, ch_fwd, duty);
-    __HAL_TIM_SET_COMPARE(htim, ch_rev, 0);
-  } else {
-    __HAL_TIM_SET_COMPARE(htim, ch_fwd, 0);
-    __HAL_TIM_SET_COMPARE(htim, ch_rev, duty);
-  }
+  if (ServoMotorTaskHandle != NULL) xTaskNotify((TaskHandle_t)ServoMotorTaskHandle, evt, eSetBits);
 }
+
 /* Request an absolute heading turn. Always resets yaw when done. */
 static inline int Servo_RequestTurnTo(float target_heading_deg)
 {
   if (g_steer_cmd.busy) return 1; // still handling previous command
   g_steer_cmd.target_heading = angle_wrap_180(target_heading_deg);
+  g_steer_cmd.delta_deg      = smallest_err_deg(g_steer_cmd.target_heading, yaw_angle_deg);
   g_steer_cmd.zero_yaw_after = 1;     // <-- always reset
   g_steer_cmd.pending        = 1;
+  Servo_Wake(STEER_EVT_CMD);
   return 0;
 }
 
-static inline int Servo_RequestBangBangTurn(float delta_deg, uint16_t pwm)
+static inline int Servo_RequestBangBangTurn(float delta_deg, uint16_t pwm, float speed_cms)
 {
   if (g_steer_cmd.busy) return 1;
 
   float tgt = angle_wrap_180(yaw_angle_deg + delta_deg);
   g_steer_cmd.target_heading = tgt;
+  g_steer_cmd.delta_deg      = delta_deg;
   g_steer_cmd.zero_yaw_after = 1;       // re-zero yaw after success (convenient chaining)
-  g_steer_cmd.drive_pwm      = pwm ? pwm : 3500;   // default if 0
+  g_steer_cmd.drive_pwm      = pwm;   // scheduled at speed_cms if 0
+  g_steer_cmd.speed_cms      = speed_cms;
   g_steer_cmd.bangbang       = 1;
   g_steer_cmd.pending        = 1;
+  Servo_Wake(STEER_EVT_CMD);
   return 0;
 }
 
-static inline int Servo_RequestBangBangTurnRev(float delta_deg, uint16_t pwm)
+static inline int Servo_RequestBangBangTurnRev(float delta_deg, uint16_t pwm, float speed_cms)
 {
   if (g_steer_cmd.busy) return 1;
 
   float tgt = angle_wrap_180(yaw_angle_deg + delta_deg);
   g_steer_cmd.target_heading = tgt;
+  g_steer_cmd.delta_deg      = delta_deg;
   g_steer_cmd.zero_yaw_after = 1;
-  g_steer_cmd.drive_pwm      = pwm ? pwm : 3500;
+  g_steer_cmd.drive_pwm      = pwm;
+  g_steer_cmd.speed_cms      = speed_cms;
   g_steer_cmd.bangbang       = 1;
   g_steer_cmd.reverse_drive  = 1;      // <<< reverse!
   g_steer_cmd.pending        = 1;
+  Servo_Wake(STEER_EVT_CMD);
   return 0;
 }
 
@@ -383,57 +1405,151 @@ static inline int Servo_RequestTurnBy(float delta_deg)
 #define DIR_FWD   0
 #define DIR_BACK  1
 
+/* === Battery compensation ====================================================
+ * The drive PWMs were tuned on a pack at BOARD_VBATT_NOMINAL: pwmBase, the
+ * turn PWMs, the VP_PWM_* line and the gain schedule all assume it. The motor
+ * sees duty times the pack voltage, so every drive duty is scaled by
+ * Vnominal/Vbatt as it is applied (Batt_Scale). A profile tuned on a full pack
+ * then behaves the same on a tired one. The encoder task reads ADC2 and starts
+ * the next conversion on every sample, so nothing waits on the ADC, and the
+ * EMA rides out the sag of a single start-up. The short brake runs on the
+ * motors' own back-EMF and is not scaled. */
+#define BATT_COMP_ENABLE   1
+#define BATT_EMA_ALPHA     0.05f  // per 20 ms sample, ~0.4 s
+#define BATT_SCALE_MIN     0.85f  // above nominal (charger still on)
+#define BATT_SCALE_MAX     1.30f  // a pack this flat is due a change anyway
+#define BATT_PRESENT_V     3.0f   // below this the divider reads nothing: USB power on the bench
+static volatile float g_batt_v     = 0.0f;  // pack volts, filtered
+static volatile float g_batt_scale = 1.0f;
+
+/* Encoder task, every sample */
+static void Batt_Poll(void)
+{
+  if (ADC2->SR & ADC_SR_EOC) {
+    float v = (float)(ADC2->DR & 0x0FFFu) * (3.3f / 4095.0f) * BOARD_VBATT_DIVIDER;
+    float f = g_batt_v > 0.0f ? g_batt_v + BATT_EMA_ALPHA * (v - g_batt_v) : v;
+    g_batt_v = f;
+    float scale = 1.0f;
+    if (BATT_COMP_ENABLE && f >= BATT_PRESENT_V) {
+      scale = BOARD_VBATT_NOMINAL / f;
+      if (scale < BATT_SCALE_MIN) scale = BATT_SCALE_MIN;
+      if (scale > BATT_SCALE_MAX) scale = BATT_SCALE_MAX;
+    }
+    g_batt_scale = scale;
+  }
+  ADC2->CR2 |= ADC_CR2_SWSTART;
+}
+
+static inline uint16_t Batt_Scale(int pwm)
+{
+  float s = (float)pwm * g_batt_scale;
+  if (s <= 0.0f) return 0;
+  return s >= (float)BOARD_PWM_MAX ? BOARD_PWM_MAX : (uint16_t)s;
+}
+
 static inline void AllStop(void)
 {
-  __HAL_TIM_SET_COMPARE(&htim4, TIM_CHANNEL_3, 0);
-  __HAL_TIM_SET_COMPARE(&htim4, TIM_CHANNEL_4, 0);
-  __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_3, 0);
-  __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_4, 0);
+  Motor_Hold();
+  Motor_Coast(MOTOR_A);
+  Motor_Coast(MOTOR_D);
+  Motor_Commit();
 }
 
-#define E_BRAKE_PWM   4500   // tweak 4000–5500
-#define E_BRAKE_MS    80     // tweak 60–120 ms
+/* === Short brake ===========================================================
+ * A move ends by shorting both motors through their H-bridges rather than by
+ * reversing them for a fixed time, so the stop does not depend on the speed
+ * or the battery, and nothing blocks while it happens. Brake_Start() shorts
+ * both motors fully. After that, Brake_Poll() runs on every encoder sample. It
+ * sets how much of each PWM period the motors are shorted (they coast for
+ * the rest) so that the mean wheel speed follows a ramp down at
+ * BRAKE_DECEL_CMS2. The wheels are cut below BRAKE_STOP_CMS, or after
+ * BRAKE_MAX_MS. A new drive command takes over at once. */
+#define BRAKE_SHORT        1        // 0 = cut the wheels (and reverse-pulse them without VP_ENABLE)
+#define BRAKE_DECEL_CMS2   300.0f   // ramp the wheels are braked along
+#define BRAKE_KP           300.0f   // shorted counts per cm/s above the ramp
+#define BRAKE_DUTY_MIN     1500.0f  // on or below the ramp
+#define BRAKE_STOP_CMS     1.0f     // about SETTLE_RPS, so the cooldown can end straight after
+#define BRAKE_MAX_MS       400u
 
-static inline void ActiveBrakeStopForward(void)
+typedef struct {
+  volatile uint8_t active;
+  float    v_ref;      // ramp, cm/s
+  uint32_t start_ms;
+  float    start_cm;   // mean travel when the brake began
+} brake_t;
+static brake_t g_brake = {0};
+static volatile float g_brake_last_cm = 0.0f;  // travel under the last brake, for tuning in the debugger
+
+static inline float Brake_SpeedCms(void)
 {
-  // During FL/FR we were driving "forward" as:
-  //   Motor A (TIM4) dir=1, Motor D (TIM1) dir=0.
-  // To brake, apply the reverse briefly:
-  Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, E_BRAKE_PWM, 0); // A reverse of forward
-  Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, E_BRAKE_PWM, 1); // D reverse of forward
-  osDelay(E_BRAKE_MS);
-  AllStop();
+  return 0.5f * (rpsA + rpsD) * WHEEL_CM_PER_REV;
 }
 
-static inline void ActiveBrakeStopBackward(void)
+static inline void AllBrake(void)
 {
-  // During BL/BR we were driving "backward" as:
-  //   Motor A dir=0, Motor D dir=1 (the reverse of your forward wiring)
-  // To brake, apply the forward briefly:
-  Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, E_BRAKE_PWM, 1); // A forward of backward
-  Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, E_BRAKE_PWM, 0); // D forward of backward
-  osDelay(E_BRAKE_MS);
-  AllStop();
+  Motor_Hold();
+  Motor_Brake(MOTOR_A);
+  Motor_Brake(MOTOR_D);
+  Motor_Commit();
+}
+
+static void Brake_Start(void)
+{
+  taskENTER_CRITICAL();
+  g_brake.v_ref    = Brake_SpeedCms();
+  g_brake.start_ms = HAL_GetTick();
+  g_brake.start_cm = 0.5f * (fabsf(distance_cm_A) + fabsf(distance_cm_D));
+  g_brake.active   = 1;
+  AllBrake();
+  taskEXIT_CRITICAL();
+}
+
+/* Drive commands call this before they set the wheels */
+static inline void Brake_Cancel(void)
+{
+  g_brake.active = 0;
+}
+
+/* Encoder task, after rpsA/rpsD for this sample */
+static void Brake_Poll(float dt_ms)
+{
+  if (!g_brake.active) return;
+  float v = Brake_SpeedCms();
+  g_brake.v_ref -= BRAKE_DECEL_CMS2 * dt_ms * 0.001f;
+  if (g_brake.v_ref < 0.0f) g_brake.v_ref = 0.0f;
+  float duty = BRAKE_DUTY_MIN + BRAKE_KP * (v - g_brake.v_ref);
+  if (duty < BRAKE_DUTY_MIN) duty = BRAKE_DUTY_MIN;
+  if (duty > (float)BOARD_PWM_MAX) duty = (float)BOARD_PWM_MAX;
+  uint8_t done = v < BRAKE_STOP_CMS || HAL_GetTick() - g_brake.start_ms >= BRAKE_MAX_MS;
+
+  taskENTER_CRITICAL();
+  if (!g_brake.active) {
+    // A drive command took over since the check above
+  } else if (done) {
+    g_brake.active = 0;
+    g_brake_last_cm = 0.5f * (fabsf(distance_cm_A) + fabsf(distance_cm_D)) - g_brake.start_cm;
+    AllStop();
+  } else {
+    Motor_Hold();
+    Motor_ShortBrake(MOTOR_A, (uint16_t)duty);
+    Motor_ShortBrake(MOTOR_D, (uint16_t)duty);
+    Motor_Commit();
+  }
+  taskEXIT_CRITICAL();
 }
 
 static inline void DriveForwardPWM(int pwmA, int pwmD)
 {
-  // A forward: TIM4 CH4 high
-  __HAL_TIM_SET_COMPARE(&htim4, TIM_CHANNEL_3, 0);
-  __HAL_TIM_SET_COMPARE(&htim4, TIM_CHANNEL_4, pwmA);
-  // D forward: TIM1 CH3 high
-  __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_3, pwmD);
-  __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_4, 0);
+  if (g_estop) { AllStop(); return; }  // A control step already under way must not restart them
+  Brake_Cancel();
+  Motor_SetBoth(Batt_Scale(pwmA), 1, Batt_Scale(pwmD), 0); // A forward: TIM4 CH4 high, D forward: TIM1 CH3 high
 }
 
 static inline void DriveBackwardPWM(int pwmA, int pwmD)
 {
-  // A backward: TIM4 CH3 high
-  __HAL_TIM_SET_COMPARE(&htim4, TIM_CHANNEL_4, 0);
-  __HAL_TIM_SET_COMPARE(&htim4, TIM_CHANNEL_3, pwmA);
-  // D backward: TIM1 CH4 high
-  __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_3, 0);
-  __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_4, pwmD);
+  if (g_estop) { AllStop(); return; }
+  Brake_Cancel();
+  Motor_SetBoth(Batt_Scale(pwmA), 0, Batt_Scale(pwmD), 1); // A backward: TIM4 CH3 high, D backward: TIM1 CH4 high
 }
 
 static inline void ResetDistanceCounts(void)
@@ -446,103 +1562,361 @@ static inline void ResetDistanceCounts(void)
   taskEXIT_CRITICAL();
 }
 
-static inline void StartMoveCM(int dist_cm, uint8_t dir_cmd)
+/* Exact-distance stop: StartMoveCM() arms TIM2 (wheel A) CC3 at start+n and
+ * CC4 at start-n counts, since either count direction can be forward. The
+ * first match interrupts within microseconds of the target instead of at the
+ * next 10 Hz DistanceTask check. Move_CompareISR() takes the average of both
+ * wheels straight from the hardware counters and re-arms for the shortfall if
+ * D lags; once there it cuts the wheels (not when handing over to a turn) and
+ * wakes DistanceTask to brake, start the cooldown and free CmdTask. The
+ * channels have no output enabled, so PB10/PB11 stay on I2C2. */
+static volatile uint32_t g_move_startA, g_move_startD;  // TIM2/TIM5 counts at start
+static volatile int32_t  g_move_goal_counts;            // per-wheel average
+static volatile uint8_t  g_move_reached = 0;            // set by the ISR for DistanceTask
+
+static inline int32_t enc_progress(uint32_t now, uint32_t start, uint32_t mod)
+{
+  int32_t d = (int32_t)((now + mod - start) % mod);
+  if (d > (int32_t)(mod / 2)) d -= (int32_t)mod;
+  return d < 0 ? -d : d;
+}
+
+static inline void Move_DisarmCompare(void)
+{
+  __HAL_TIM_DISABLE_IT(&htim2, TIM_IT_CC3 | TIM_IT_CC4);
+}
+
+static inline void Move_ArmCompare(int32_t goal_counts)
+{
+  const uint32_t mod = __HAL_TIM_GET_AUTORELOAD(&htim2) + 1;
+  taskENTER_CRITICAL();
+  Move_DisarmCompare();
+  g_move_reached = 0;
+  // Beyond half the counter range the direction is ambiguous: DistanceTask ends it
+  if (goal_counts > 0 && goal_counts < (int32_t)(mod / 2)) {
+    g_move_goal_counts = goal_counts;
+    g_move_startA = Encoder_Count(ENCODER_A);
+    g_move_startD = Encoder_Count(ENCODER_D);
+    __HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_3, (g_move_startA + (uint32_t)goal_counts) % mod);
+    __HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_4, (g_move_startA + mod - (uint32_t)goal_counts) % mod);
+    __HAL_TIM_CLEAR_FLAG(&htim2, TIM_FLAG_CC3 | TIM_FLAG_CC4);
+    __HAL_TIM_ENABLE_IT(&htim2, TIM_IT_CC3 | TIM_IT_CC4);
+  }
+  taskEXIT_CRITICAL();
+}
+
+static inline void VelProfile_Start(float goal_cm, float v_end, float v_max)
+{
+  g_vprof.goal_cm = goal_cm;
+  g_vprof.v_end   = v_end;
+  g_vprof.v_max   = v_max;
+  g_vprof.v       = 0.0f;
+  g_vprof.a       = 0.0f;
+}
+
+/* Next speed setpoint (cm/s) after travelled_cm, dt seconds after the last call. */
+static float VelProfile_Step(float travelled_cm, float dt)
+{
+  float a = g_vprof.a + VP_JERK_CMS3 * dt;
+  if (VP_JERK_CMS3 <= 0.0f || a > VP_ACCEL_CMS2) a = VP_ACCEL_CMS2;
+  g_vprof.a = a;
+
+  float v = g_vprof.v + a * dt;
+  if (v > g_vprof.v_max) v = g_vprof.v_max;
+
+  // Plan from where the robot will be at the next update, not where it was
+  float remaining = g_vprof.goal_cm - travelled_cm - v * dt;
+  if (remaining < 0.0f) remaining = 0.0f;
+  float v_stop = sqrtf(g_vprof.v_end * g_vprof.v_end + 2.0f * VP_DECEL_CMS2 * remaining);
+  if (v > v_stop) v = v_stop;
+
+  g_vprof.v = v;
+  return v;
+}
+
+static inline void StartMoveCM(int dist_cm, uint8_t dir_cmd, float cruise_cms)
 {
   if (dist_cm < 0) dist_cm = -dist_cm;
   ResetDistanceCounts();          // relative move
-  targetdistance_cm = dist_cm - 5; //Change to fine tune distance
+  targetdistance_cm = dist_cm - MOVE_BRAKE_COMP_CM; //Change to fine tune distance
   dir               = (dir_cmd == DIR_BACK) ? DIR_BACK : DIR_FWD;
+  g_hhold.yaw_ref   = yaw_angle_deg;
+  if (g_blend.into_turn) VelProfile_Start((float)dist_cm, VP_BLEND_CMS, cruise_cms);
+  else                   VelProfile_Start((float)targetdistance_cm, VP_END_CMS, cruise_cms);
+  Move_ArmCompare((int32_t)((float)(g_blend.into_turn ? dist_cm : targetdistance_cm) / CM_PER_COUNT));
   motionActive      = 1;
+  if (DistanceTaskHandle != NULL) xTaskNotifyGive((TaskHandle_t)DistanceTaskHandle);
 }
 
-static inline uint16_t scale_pwm_from_err(float abs_err)
-{
-  if (abs_err >= YAW_COARSE_THRESH_DEG) return TURN_PWM_MAX;
-  // linear map abs_err ∈ [0, YAW_COARSE_THRESH] → [TURN_PWM_MIN, TURN_PWM_MAX]
-  float t = abs_err / YAW_COARSE_THRESH_DEG;
-  float pwm = TURN_PWM_MIN + t * (TURN_PWM_MAX - TURN_PWM_MIN);
-  if (pwm < TURN_PWM_MIN) pwm = TURN_PWM_MIN;
-  if (pwm > TURN_PWM_MAX) pwm = TURN_PWM_MAX;
-  return (uint16_t)pwm;
-}
-
+/* Wheels for a turn towards the need_left side: pwm on the outer wheel, the
+ * inner one dragged at pwm_slow */
 static inline void turn(int need_left, uint16_t pwm, uint8_t rev_drive)
 {
+  if (g_estop) { AllStop(); return; }
+  Brake_Cancel();
+  const uint16_t pwm_coarse = Batt_Scale(pwm);
+  const uint16_t pwm_inner  = Batt_Scale(pwm_slow);
   if (!rev_drive) {
     // Forward mapping (your original, proven)
     if (need_left) {
       // A backward, D forward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_slow, 1);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_fast, 0);
+      Motor_SetBoth(pwm_inner, 1, pwm_coarse, 0);
     } else {
       // A forward, D backward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_fast, 1);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_slow, 0);
+      Motor_SetBoth(pwm_coarse, 1, pwm_inner, 0);
     }
   } else {
     // Reverse mapping (your fixed version)
     if (need_left) {
       // A forward, D backward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_slow, 0);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_fast, 1);
+      Motor_SetBoth(pwm_inner, 0, pwm_coarse, 1);
     } else {
       // A backward, D forward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_fast, 0);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm_slow, 1);
+      Motor_SetBoth(pwm_coarse, 0, pwm_inner, 1);
     }
   }
 }
-static inline void spin_in_place(int need_left, uint16_t pwm, uint8_t rev_drive)
+
+/* === Turn profiles ====================================================== */
+/* A turn follows a time-optimal yaw reference: the rate ramps at
+ * TP_ACCEL_DPS2 up to what the drive PWM sustains, cruises, and ramps down to
+ * arrive at the target with no rate left (a triangle when the turn is too
+ * short to cruise). The motors get feedforward from a first-order
+ * step-response model of yaw rate against outer-wheel PWM,
+ *     tau * d(rate)/dt = k * (pwm - turn_pwm_min) - rate,
+ * so pwm = turn_pwm_min + (rate + tau * accel) / k, and the servo goes to lock
+ * as the rate builds and back to centre as it falls. The gyro closes the loop:
+ * PD on the heading and rate lag for the PWM (driving the other way once the
+ * robot is ahead), fine_kp_steer on the heading error for the servo.
+ *
+ * References for TP_ANGLES, forward and reverse, are sampled every TP_STEP_MS
+ * into tables whenever the PWMs they were built for change. Other angles, and
+ * turns longer than a table, are evaluated on the spot. */
+#define TP_ACCEL_DPS2       600.0f  // yaw acceleration and braking limit
+#define TP_DPS_PER_PWM      0.18f   // model gain k, forward
+#define TP_DPS_PER_PWM_REV  0.15f   //                reversing
+#define TP_TAU_S            0.10f   // model time constant
+#define TP_KP_PWM           60.0f   // PWM per deg behind the reference
+#define TP_KD_PWM           2.0f    // PWM per dps behind the reference
+#define TP_MIN_RATE_DPS     10.0f   // floor for a drive PWM at or below the deadband
+#define TP_STEP_MS          20u
+#define TP_SAMPLES          128     // 2.56 s per table
+#define TP_ANGLES_N         3
+
+static const float TP_ANGLES[TP_ANGLES_N] = { 45.0f, 90.0f, 180.0f };
+
+typedef struct {
+  float yaw;     // deg turned since the start
+  float rate;    // dps
+  float accel;   // dps^2
+} tp_ref_t;
+
+typedef struct {
+  float angle;               // deg, > 0
+  float rate_max;            // cruise (or peak) rate
+  float t_ramp, t_cruise;    // s
+  float t_end;
+} tp_shape_t;
+
+typedef struct {
+  int16_t  yaw_cdeg;         // 0.01 deg
+  int16_t  rate_ddps;        // 0.1 dps
+  int16_t  pwm;              // feedforward above turn_pwm_min
+} tp_sample_t;
+
+typedef struct {
+  tp_shape_t  shape;
+  uint16_t    n;             // 0: longer than TP_SAMPLES, evaluated instead
+  tp_sample_t s[TP_SAMPLES];
+} tp_table_t;
+
+/* What ServoMotorTask follows for one turn */
+typedef struct {
+  tp_shape_t        shape;
+  float             k;
+  const tp_table_t *table;   // NULL: evaluate
+} turn_profile_t;
+
+static tp_table_t g_tp[2][TP_ANGLES_N];   // [reverse][angle]
+static float      g_tp_built_pwm = -1.0f, g_tp_built_pwm0 = -1.0f;
+
+static void tp_shape(float angle, float rate_max, tp_shape_t *sh)
 {
-  if (!rev_drive) {
-    // Forward mapping (your original, proven)
-    if (need_left) {
-      // A backward, D forward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 0);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 0);
-    } else {
-      // A forward, D backward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 1);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 1);
-    }
+  sh->angle = angle;
+  if (angle * TP_ACCEL_DPS2 < rate_max * rate_max) rate_max = sqrtf(angle * TP_ACCEL_DPS2);
+  sh->rate_max = rate_max;
+  sh->t_ramp   = rate_max / TP_ACCEL_DPS2;
+  sh->t_cruise = angle / rate_max - sh->t_ramp;
+  sh->t_end    = 2.0f * sh->t_ramp + sh->t_cruise;
+}
+
+static void tp_eval(const tp_shape_t *sh, float t, tp_ref_t *r)
+{
+  const float a = TP_ACCEL_DPS2;
+  if (t <= 0.0f) {
+    r->yaw = 0.0f; r->rate = 0.0f; r->accel = a;
+  } else if (t < sh->t_ramp) {
+    r->yaw = 0.5f * a * t * t; r->rate = a * t; r->accel = a;
+  } else if (t < sh->t_ramp + sh->t_cruise) {
+    r->yaw = sh->rate_max * (t - 0.5f * sh->t_ramp); r->rate = sh->rate_max; r->accel = 0.0f;
+  } else if (t < sh->t_end) {
+    float left = sh->t_end - t;
+    r->yaw = sh->angle - 0.5f * a * left * left; r->rate = a * left; r->accel = -a;
   } else {
-    // Reverse mapping (your fixed version)
-    if (need_left) {
-      // A forward, D backward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 1);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 1);
-    } else {
-      // A backward, D forward
-      Motor_Set(&htim4, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 0);
-      Motor_Set(&htim1, TIM_CHANNEL_3, TIM_CHANNEL_4, pwm, 0);
+    r->yaw = sh->angle; r->rate = 0.0f; r->accel = 0.0f;
+  }
+}
+
+/* Feedforward PWM above the deadband; negative while braking hard */
+static inline float tp_ff(const tp_ref_t *r, float k)
+{
+  return (r->rate + TP_TAU_S * r->accel) / k;
+}
+
+static float tp_rate_max(uint16_t pwm, float pwm0, float k)
+{
+  float rate = k * ((float)pwm - pwm0);
+  return rate > TP_MIN_RATE_DPS ? rate : TP_MIN_RATE_DPS;
+}
+
+/* Rebuilds the tables if pwm or the deadband differ from the last build */
+static void TurnProfile_Prepare(uint16_t pwm, float pwm0)
+{
+  if ((float)pwm == g_tp_built_pwm && pwm0 == g_tp_built_pwm0) return;
+  for (int rev = 0; rev < 2; rev++) {
+    float k = rev ? TP_DPS_PER_PWM_REV : TP_DPS_PER_PWM;
+    for (int i = 0; i < TP_ANGLES_N; i++) {
+      tp_table_t *tb = &g_tp[rev][i];
+      tp_shape(TP_ANGLES[i], tp_rate_max(pwm, pwm0, k), &tb->shape);
+      uint32_t n = (uint32_t)(tb->shape.t_end * 1000.0f / TP_STEP_MS) + 2u;  // through the end
+      tb->n = n <= TP_SAMPLES ? (uint16_t)n : 0;
+      for (uint16_t j = 0; j < tb->n; j++) {
+        tp_ref_t r;
+        tp_eval(&tb->shape, j * (TP_STEP_MS / 1000.0f), &r);
+        float ff = tp_ff(&r, k);
+        tb->s[j].yaw_cdeg  = (int16_t)lroundf(r.yaw * 100.0f);
+        tb->s[j].rate_ddps = (int16_t)lroundf(r.rate * 10.0f);
+        tb->s[j].pwm       = (int16_t)lroundf(ff);
+      }
     }
   }
+  g_tp_built_pwm = (float)pwm;
+  g_tp_built_pwm0 = pwm0;
 }
 
-/* Calibrated center IR: raw ADC count -> distance in mm */
-int32_t IrConvert(int32_t nc)
+static void TurnProfile_Start(turn_profile_t *tp, float angle, uint8_t rev, uint16_t pwm, float pwm0)
+{
+  tp->k = rev ? TP_DPS_PER_PWM_REV : TP_DPS_PER_PWM;
+  tp->table = NULL;
+  TurnProfile_Prepare(pwm, pwm0);
+  for (int i = 0; i < TP_ANGLES_N; i++) {
+    if (fabsf(angle - TP_ANGLES[i]) < 0.5f && g_tp[rev][i].n) tp->table = &g_tp[rev][i];
+  }
+  if (tp->table) tp->shape = tp->table->shape;
+  else           tp_shape(angle > 0.1f ? angle : 0.1f, tp_rate_max(pwm, pwm0, tp->k), &tp->shape);
+}
+
+/* Reference t s into the turn, and its feedforward PWM above the deadband */
+static void TurnProfile_At(const turn_profile_t *tp, float t, tp_ref_t *r, float *ff)
+{
+  const tp_table_t *tb = tp->table;
+  float pos = t * (1000.0f / TP_STEP_MS);
+  if (!tb || t <= 0.0f || pos >= (float)(tb->n - 1)) {
+    tp_eval(&tp->shape, t, r);
+    *ff = tp_ff(r, tp->k);
+    return;
+  }
+  uint16_t j = (uint16_t)pos;
+  float f = pos - (float)j;
+  const tp_sample_t *a = &tb->s[j], *b = &tb->s[j + 1];
+  r->yaw  = 0.01f * (a->yaw_cdeg + f * (b->yaw_cdeg - a->yaw_cdeg));
+  r->rate = 0.1f * (a->rate_ddps + f * (b->rate_ddps - a->rate_ddps));
+  r->accel = 0.0f;           // already in the sampled PWM
+  *ff = a->pwm + f * (b->pwm - a->pwm);
+}
+
+/* Calibrated center IR fit: raw ADC count -> distance in cm */
+#define IR_FIT_A_DEFAULT  2328857.1639444f
+#define IR_FIT_B_DEFAULT  -1.5603067800772f
+
+static float IrFit_cm(int32_t nc)
 {
     if (nc < 1)     nc = 1;      // avoid divide by zero / powf domain errors
     if (nc > 4095)  nc = 4095;   // ADC max
 
     float x = (float)nc;
 
-    // New fitted power-law model: y = A * x^B
-    const float A = 2328857.1639444f;
-    const float B = -1.5603067800772f;
-
-    // distance in cm
-    float d_cm = (A * powf(x, B));
+    // Fitted power-law model: y = A * x^B, A and B from the calibration store
+    float d_cm = (g_cal.v.ir_a * powf(x, g_cal.v.ir_b));
 
     if (d_cm < 0.0f) d_cm = 0.0f;   // no negative distance
 
-    return (int32_t)(d_cm);  // round to nearest cm
+    return d_cm;
+}
+
+static void IrLut_Build(void)
+{
+    for (int32_t nc = 0; nc < 4096; nc++) {
+        float mm = IrFit_cm(nc) * 10.0f + 0.5f;
+        ir_lut_mm[nc] = mm > (float)IR_LUT_MAX_MM ? (uint16_t)IR_LUT_MAX_MM : (uint16_t)mm;
+    }
+}
+
+/* Raw ADC count -> distance in cm (table lookup) */
+int32_t IrConvert(int32_t nc)
+{
+    if (nc < 0)     nc = 0;
+    if (nc > 4095)  nc = 4095;
+    return (int32_t)(ir_lut_mm[nc] / 10u);
+}
+
+/* Boot and after a CAL edit: all three from g_cal */
+static void Filters_Configure(void)
+{
+  Biquad_Design(&g_filt_gyro, g_cal.v.gyro_fc_hz, IMU_ODR_HZ);
+  Biquad_Design(&g_filt_ir,   g_cal.v.ir_fc_hz,   FILT_IR_FS_HZ);
+  Biquad_Design(&g_filt_rps,  g_cal.v.rps_fc_hz,  FILT_RPS_FS_HZ);
+#if FIXED_POINT_CTL
+  g_filt_rps_q16 = (biquad_q16_coef_t){ Q16_FromFloat(g_filt_rps.b0), Q16_FromFloat(g_filt_rps.b1),
+                                        Q16_FromFloat(g_filt_rps.b2), Q16_FromFloat(g_filt_rps.a1),
+                                        Q16_FromFloat(g_filt_rps.a2) };
+#endif
+}
+
+/* Averages one half of ir_dma_buf; sum keeps 3 extra bits to interpolate the table */
+static FAST_CODE void Ir_Publish(const uint16_t *half)
+{
+    PROF_BEGIN(PR_IR);
+    uint32_t sum = 0;
+    for (int i = 0; i < IR_OVERSAMPLE; i++) sum += half[i];
+    uint32_t idx  = sum / IR_OVERSAMPLE;
+    uint32_t frac = sum % IR_OVERSAMPLE;
+    uint32_t mm = ir_lut_mm[idx];
+    if (idx < 4095u) {
+        // table falls with count: step toward the next entry by frac/IR_OVERSAMPLE
+        mm -= ((mm - ir_lut_mm[idx + 1]) * frac) / IR_OVERSAMPLE;
+    }
+    static biquad_t filt;
+    float f = Biquad_Step(&g_filt_ir, &filt, (float)mm);
+    g_ir_sample = (uint16_t)idx;
+    g_ir_mm     = f > 0.0f ? (uint16_t)(f + 0.5f) : 0u;
+    PROF_END(PR_IR);
 }
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+/* With tickless idle SysTick fires once for a whole sleep, so uwTick falls
+ * behind; once the scheduler runs HAL_GetTick() counts kernel ticks instead,
+ * which the port steps over the time slept. hal_tick_base keeps it from
+ * jumping back. */
+static uint32_t hal_tick_base;
 
+uint32_t HAL_GetTick(void)
+{
+  if (xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) return uwTick;
+  return hal_tick_base + xTaskGetTickCount();
+}
 /* USER CODE END 0 */
 
 /**
@@ -568,11 +1942,12 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+  g_art_missing = FastMem_CheckArt();
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_TIM8_Init();
   MX_TIM2_Init();
   MX_USART2_UART_Init();
@@ -585,25 +1960,42 @@ int main(void)
   MX_TIM11_Init();
   MX_TIM12_Init();
   MX_ADC1_Init();
+  MX_TIM7_Init();
+  MX_ADC2_Init();
   /* USER CODE BEGIN 2 */
   OLED_Init();
-
-  // NEW:
-  HAL_UART_Receive_IT(&huart3, &uart3_rx_ch, 1);
+  Gains_Load();
+  Cal_Load();
+  Filters_Configure();
+  Odo_Configure();
+
+  __HAL_ADC_ENABLE(&hadc2);   // Batt_Poll() starts every conversion
+  // IR: table first, then the ADC runs on its own from TIM8
+  IrLut_Build();
+  HAL_ADC_Start_DMA(&hadc1, (uint32_t *)ir_dma_buf, IR_DMA_LEN);
+  HAL_TIM_Base_Start(&htim8);
+
+  // Cycle counter for encoder sample timestamps. Its clock is gated in Sleep,
+  // so keep it running through tickless idle or sample periods would read short.
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  DBGMCU->CR |= DBGMCU_CR_DBG_SLEEP;
+
+  // Started here so no byte is missed before the scheduler runs; UartRxTask
+  // picks up whatever is already in the buffer on its first notification.
+  Uart3_StartRx();
 
   /* ===== Start PWM/Encoder here too (idempotent) ===== */
   // PWM for both motors
-  HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_3);
-  HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4);
-  HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_3);
-  HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_4);
+  Motor_Start();
   __HAL_TIM_MOE_ENABLE(&htim1);
 
   // Encoders
   HAL_TIM_Encoder_Start(&htim2, TIM_CHANNEL_ALL);
   HAL_TIM_Encoder_Start(&htim5, TIM_CHANNEL_ALL);
 
-  HAL_TIM_PWM_Start(&htim12, TIM_CHANNEL_2);
+  Servo_Start();
   /* USER CODE END 2 */
 
   /* Init scheduler */
@@ -619,10 +2011,13 @@ int main(void)
 
   /* USER CODE BEGIN RTOS_TIMERS */
   /* start timers, add new ones, ... */
+  TelemTimerHandle = osTimerNew(Telem_Send, osTimerPeriodic, NULL, &TelemTimer_attributes);
   /* USER CODE END RTOS_TIMERS */
 
   /* USER CODE BEGIN RTOS_QUEUES */
   /* add queues, ... */
+  DisplayQueueHandle = osMessageQueueNew(DISP_QUEUE_LEN, sizeof(disp_msg_t), &DisplayQueue_attributes);
+  vQueueSetQueueNumber((QueueHandle_t)DisplayQueueHandle, KQ_DISPLAY);
   /* USER CODE END RTOS_QUEUES */
 
   /* Create the thread(s) */
@@ -630,7 +2025,7 @@ int main(void)
   //defaultTaskHandle = osThreadNew(StartDefaultTask, NULL, &defaultTask_attributes);
 
   /* creation of ShowTask */
-  //ShowTaskHandle = osThreadNew(show, NULL, &ShowTask_attributes);
+  ShowTaskHandle = osThreadNew(show, NULL, &ShowTask_attributes);
 
   /* creation of MotorTask */
   MotorTaskHandle = osThreadNew(motor, NULL, &MotorTask_attributes);
@@ -653,8 +2048,15 @@ int main(void)
   /* creation of UltrasonicTask */
   //UltrasonicTaskHandle = osThreadNew(ultrasonic, NULL, &UltrasonicTask_attributes);
 
+  /* creation of UartRxTask */
+  UartRxTaskHandle = osThreadNew(uartrx, NULL, &UartRxTask_attributes);
+
+  /* creation of CmdTask */
+  CmdTaskHandle = osThreadNew(cmdtask, NULL, &CmdTask_attributes);
+
   /* USER CODE BEGIN RTOS_THREADS */
   /* add threads, ... */
+  hal_tick_base = uwTick;   /* The kernel tick starts from 0 */
   /* USER CODE END RTOS_THREADS */
 
   /* USER CODE BEGIN RTOS_EVENTS */
@@ -747,11 +2149,11 @@ static void MX_ADC1_Init(void)
   hadc1.Init.ScanConvMode = DISABLE;
   hadc1.Init.ContinuousConvMode = DISABLE;
   hadc1.Init.DiscontinuousConvMode = DISABLE;
-  hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
-  hadc1.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  hadc1.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+  hadc1.Init.ExternalTrigConv = ADC_EXTERNALTRIGCONV_T8_TRGO;
   hadc1.Init.DataAlign = ADC_DATAALIGN_RIGHT;
   hadc1.Init.NbrOfConversion = 1;
-  hadc1.Init.DMAContinuousRequests = DISABLE;
+  hadc1.Init.DMAContinuousRequests = ENABLE;
   hadc1.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
   if (HAL_ADC_Init(&hadc1) != HAL_OK)
   {
@@ -762,7 +2164,7 @@ static void MX_ADC1_Init(void)
   */
   sConfig.Channel = ADC_CHANNEL_10;
   sConfig.Rank = 1;
-  sConfig.SamplingTime = ADC_SAMPLETIME_3CYCLES;
+  sConfig.SamplingTime = ADC_SAMPLETIME_84CYCLES;
   if (HAL_ADC_ConfigChannel(&hadc1, &sConfig) != HAL_OK)
   {
     Error_Handler();
@@ -789,7 +2191,7 @@ static void MX_I2C2_Init(void)
 
   /* USER CODE END I2C2_Init 1 */
   hi2c2.Instance = I2C2;
-  hi2c2.Init.ClockSpeed = 100000;
+  hi2c2.Init.ClockSpeed = 400000;
   hi2c2.Init.DutyCycle = I2C_DUTYCYCLE_2;
   hi2c2.Init.OwnAddress1 = 0;
   hi2c2.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
@@ -1107,25 +2509,117 @@ static void MX_TIM5_Init(void)
 }
 
 /**
-  * @brief TIM8 Initialization Function
+  * @brief TIM7 Initialization Function
   * @param None
   * @retval None
   */
-static void MX_TIM8_Init(void)
+static void MX_TIM7_Init(void)
 {
 
-  /* USER CODE BEGIN TIM8_Init 0 */
+  /* USER CODE BEGIN TIM7_Init 0 */
 
-  /* USER CODE END TIM8_Init 0 */
+  /* USER CODE END TIM7_Init 0 */
 
-  TIM_ClockConfigTypeDef sClockSourceConfig = {0};
   TIM_MasterConfigTypeDef sMasterConfig = {0};
 
-  /* USER CODE BEGIN TIM8_Init 1 */
+  /* USER CODE BEGIN TIM7_Init 1 */
 
-  /* USER CODE END TIM8_Init 1 */
-  htim8.Instance = TIM8;
-  htim8.Init.Prescaler = 0;
+  /* USER CODE END TIM7_Init 1 */
+  htim7.Instance = TIM7;
+  htim7.Init.Prescaler = 71;
+  htim7.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim7.Init.Period = 19999;
+  htim7.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_Base_Init(&htim7) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+  sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
+  if (HAL_TIMEx_MasterConfigSynchronization(&htim7, &sMasterConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* USER CODE BEGIN TIM7_Init 2 */
+#if FUSED_CTL
+  __HAL_TIM_SET_AUTORELOAD(&htim7, 1000000u / FUSED_CTL_HZ - 1u);   // 1 MHz tick
+#endif
+  /* USER CODE END TIM7_Init 2 */
+
+}
+
+/**
+  * @brief ADC2 Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_ADC2_Init(void)
+{
+
+  /* USER CODE BEGIN ADC2_Init 0 */
+
+  /* USER CODE END ADC2_Init 0 */
+
+  ADC_ChannelConfTypeDef sConfig = {0};
+
+  /* USER CODE BEGIN ADC2_Init 1 */
+
+  /* USER CODE END ADC2_Init 1 */
+
+  /** Configure the global features of the ADC (Clock, Resolution, Data Alignment and number of conversion)
+  */
+  hadc2.Instance = ADC2;
+  hadc2.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV2;
+  hadc2.Init.Resolution = ADC_RESOLUTION_12B;
+  hadc2.Init.ScanConvMode = DISABLE;
+  hadc2.Init.ContinuousConvMode = DISABLE;
+  hadc2.Init.DiscontinuousConvMode = DISABLE;
+  hadc2.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+  hadc2.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+  hadc2.Init.DataAlign = ADC_DATAALIGN_RIGHT;
+  hadc2.Init.NbrOfConversion = 1;
+  hadc2.Init.DMAContinuousRequests = DISABLE;
+  hadc2.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
+  if (HAL_ADC_Init(&hadc2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  /** Configure for the selected ADC regular channel its corresponding rank in the sequencer and its sample time.
+  */
+  sConfig.Channel = ADC_CHANNEL_11;
+  sConfig.Rank = 1;
+  sConfig.SamplingTime = ADC_SAMPLETIME_480CYCLES;
+  if (HAL_ADC_ConfigChannel(&hadc2, &sConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* USER CODE BEGIN ADC2_Init 2 */
+
+  /* USER CODE END ADC2_Init 2 */
+
+}
+
+/**
+  * @brief TIM8 Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_TIM8_Init(void)
+{
+
+  /* USER CODE BEGIN TIM8_Init 0 */
+
+  /* USER CODE END TIM8_Init 0 */
+
+  TIM_ClockConfigTypeDef sClockSourceConfig = {0};
+  TIM_MasterConfigTypeDef sMasterConfig = {0};
+
+  /* USER CODE BEGIN TIM8_Init 1 */
+
+  /* USER CODE END TIM8_Init 1 */
+  htim8.Instance = TIM8;
+  htim8.Init.Prescaler = 0;
   htim8.Init.CounterMode = TIM_COUNTERMODE_UP;
   htim8.Init.Period = 7199;
   htim8.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
@@ -1140,7 +2634,7 @@ static void MX_TIM8_Init(void)
   {
     Error_Handler();
   }
-  sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_UPDATE;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim8, &sMasterConfig) != HAL_OK)
   {
@@ -1298,7 +2792,7 @@ static void MX_USART3_UART_Init(void)
 
   /* USER CODE END USART3_Init 1 */
   huart3.Instance = USART3;
-  huart3.Init.BaudRate = 115200;
+  huart3.Init.BaudRate = 1000000;
   huart3.Init.WordLength = UART_WORDLENGTH_8B;
   huart3.Init.StopBits = UART_STOPBITS_1;
   huart3.Init.Parity = UART_PARITY_NONE;
@@ -1315,6 +2809,32 @@ static void MX_USART3_UART_Init(void)
 
 }
 
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA2_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Stream1_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream1_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream1_IRQn);
+  /* DMA1_Stream2_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream2_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream2_IRQn);
+  /* DMA1_Stream3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+  /* DMA2_Stream0_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
+}
+
 /**
   * @brief GPIO Initialization Function
   * @param None
@@ -1421,39 +2941,47 @@ static void icm_wake_enable_gyro(void)
   icm_select_bank(ICM_addr, 0);
   /* PWR_MGMT_1: 0x01 -> auto clock, sleep=0 */
   icm_write(ICM_addr, ICM_REG_PWR_MGMT_1, 0x01);
-  HAL_Delay(10);
+  osDelay(10);   // IMUTask only: sleeps while the other tasks come up
   /* PWR_MGMT_2: 0x00 -> enable all accel+gyro axes */
   icm_write(ICM_addr, ICM_REG_PWR_MGMT_2, 0x00);
-  HAL_Delay(10);
+  osDelay(10);
 }
 
-/* Burst read 6 bytes of gyro data */
-static HAL_StatusTypeDef icm_read_gyro_xyz(int16_t *gx, int16_t *gy, int16_t *gz)
+/* Gyro Z only into the FIFO at IMU_ODR_HZ, data-ready on INT1. Ends in bank 0. */
+static void icm_configure_fifo(void)
 {
-  extern I2C_HandleTypeDef hi2c2;
-  uint8_t buf[6];
-
-  if (icm_select_bank(ICM_addr, 0) != HAL_OK) return HAL_ERROR;
-
-  if (HAL_I2C_Mem_Read(&hi2c2, (ICM_addr << 1), ICM_REG_GYRO_XOUT_H,
-                       I2C_MEMADD_SIZE_8BIT, buf, 6, 100) != HAL_OK) {
-    return HAL_ERROR;
-  }
+  icm_select_bank(ICM_addr, 2);
+  icm_write(ICM_addr, ICM_B2_GYRO_SMPLRT_DIV, 0x00);   // 1125 Hz
+  icm_write(ICM_addr, ICM_B2_GYRO_CONFIG_1, 0x09);     // DLPF 152 Hz, ±250 dps, DLPF on
+  icm_select_bank(ICM_addr, 0);
+  icm_write(ICM_addr, ICM_REG_INT_PIN_CFG, 0x00);
+  icm_write(ICM_addr, ICM_REG_FIFO_MODE, 0x00);
+  icm_write(ICM_addr, ICM_REG_FIFO_EN_2, 0x08);
+  icm_write(ICM_addr, ICM_REG_USER_CTRL, 0x40);
+  icm_fifo_reset();
+  icm_write(ICM_addr, ICM_REG_INT_ENABLE_1, 0x01);
+}
 
-  *gx = (int16_t)((buf[0] << 8) | buf[1]);
-  *gy = (int16_t)((buf[2] << 8) | buf[3]);
-  *gz = (int16_t)((buf[4] << 8) | buf[5]);
-  return HAL_OK;
+static void icm_fifo_reset(void)
+{
+  icm_write(ICM_addr, ICM_REG_FIFO_RST, 0x1F);
+  icm_write(ICM_addr, ICM_REG_FIFO_RST, 0x00);
 }
 
+/* The same from the IMU loop, queued behind whatever is on the bus */
+static void icm_fifo_reset_queue(void)
+{
+  I2cBus_Submit(&g_i2c2, &imu_x_rst[0]);
+  I2cBus_Submit(&g_i2c2, &imu_x_rst[1]);
+}
 
 /* Map wheel angle (deg, +36..-36) to microseconds (900..2100) */
 static inline uint16_t steer_deg_to_pulse(float wheel_deg)
 {
   if (wheel_deg >  STEER_MAX_DEG) wheel_deg =  STEER_MAX_DEG;
   if (wheel_deg < -STEER_MAX_DEG) wheel_deg = -STEER_MAX_DEG;
-  /* 1500 - 16.6667*deg  (since +36° => 900us, -36° => 2100us) */
-  float usec = 1500.0f - (wheel_deg * (600.0f/36.0f));
+  /* 1500 - 16.6667*deg  (since +36° => 900us, -36° => 2100us); a center trim shifts the whole map */
+  float usec = 1500.0f + (g_cal.v.steer_us_center - (float)STEER_US_CENTER) - (wheel_deg * (600.0f/36.0f));
   if (usec < STEER_US_LEFT)  usec = STEER_US_LEFT;
   if (usec > STEER_US_RIGHT) usec = STEER_US_RIGHT;
   return (uint16_t)(usec + 0.5f);
@@ -1476,333 +3004,1947 @@ static inline float smallest_err_deg(float target, float current)
 /* Raw servo write on TIM12 CH2 (expects 20ms period already set) */
 static void steer_write_us(uint16_t usec)
 {
-  __HAL_TIM_SET_COMPARE(&htim12, TIM_CHANNEL_2, usec);
+  Servo_Set(usec);
 }
 
 /* Convenience: center wheels */
 static void steer_center(void)
 {
-  steer_write_us(STEER_US_CENTER);
+  steer_write_us((uint16_t)(g_cal.v.steer_us_center + 0.5f));
 }
 
-static void uart3_send(const char *s)
+/* Starts the DMA on the oldest contiguous run if it is idle. Call with the ring locked. */
+static void uart3_tx_kick(void)
 {
-  HAL_UART_Transmit(&huart3, (uint8_t*)s, (uint16_t)strlen(s), 0xFFFF);
+  if (uart3_tx_inflight || uart3_tx_head == uart3_tx_tail) return;
+  uint16_t tail = uart3_tx_tail;
+  uint16_t len = (uart3_tx_head > tail) ? (uint16_t)(uart3_tx_head - tail)
+                                       : (uint16_t)(UART3_TX_RING_SIZE - tail);
+  uart3_tx_inflight = len;
+  if (HAL_UART_Transmit_DMA(&huart3, &uart3_tx_ring[tail], len) != HAL_OK) {
+    uart3_tx_inflight = 0;  // Retried by the next write
+  }
 }
 
-static int clampi(int v, int lo, int hi)
+/* Queues len bytes for USART3 without blocking; safe from tasks and ISRs.
+ * Returns 0, or -1 if the ring has no room (nothing is queued). */
+static int uart3_write(const void *data, uint16_t len)
 {
-  if (v < lo) return lo;
-  if (v > hi) return hi;
-  return v;
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+  uint16_t used = (uint16_t)((uart3_tx_head - uart3_tx_tail + UART3_TX_RING_SIZE) % UART3_TX_RING_SIZE);
+  if (len > UART3_TX_RING_SIZE - 1 - used) {
+    uart3_tx_dropped++;
+    taskEXIT_CRITICAL_FROM_ISR(saved);
+    return -1;
+  }
+  uint16_t head = uart3_tx_head;
+  uint16_t first = (uint16_t)(UART3_TX_RING_SIZE - head);
+  if (first > len) first = len;
+  memcpy(&uart3_tx_ring[head], data, first);
+  memcpy(uart3_tx_ring, (const uint8_t*)data + first, len - first);
+  uart3_tx_head = (uint16_t)((head + len) % UART3_TX_RING_SIZE);
+  uart3_tx_kick();
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+  return 0;
 }
 
+static void uart3_send(const char *s)
+{
+  uart3_write(s, (uint16_t)strlen(s));
+}
 
-
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+/* Tasks only: waits for ring space instead of dropping, for replies larger
+ * than the TX ring */
+static void uart3_write_wait(const void *data, uint16_t len)
 {
-  if (huart->Instance == USART3) {
-    char ch = (char)uart3_rx_ch;
+  for (;;) {
+    taskENTER_CRITICAL();
+    uint16_t used = (uint16_t)((uart3_tx_head - uart3_tx_tail + UART3_TX_RING_SIZE) % UART3_TX_RING_SIZE);
+    taskEXIT_CRITICAL();
+    if (len <= UART3_TX_RING_SIZE - 1 - used && uart3_write(data, len) == 0) return;
+    osDelay(1);
+  }
+}
 
-    // Optional: local echo while typing
-    // HAL_UART_Transmit(&huart3, (uint8_t*)&uart3_rx_ch, 1, 0xFFFF);
+/* IMU_INT: one pulse per gyro sample; wake IMUTask once per IMU_BATCH */
+FAST_CODE void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+  uint32_t start = DWT->CYCCNT;
+  if (GPIO_Pin == IMU_INT_Pin && ++imu_drdy >= IMU_BATCH && IMUTaskHandle != NULL) {
+    BaseType_t woken = pdFALSE;
+    imu_drdy = 0;
+    xTaskNotifyFromISR((TaskHandle_t)IMUTaskHandle, IMU_EVT_DRDY, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+  Trace_Isr(TI_IMU_INT, start);
+}
 
-    if (ch == '\n' || ch == '\r') {
-      if (uart3_idx >= sizeof(uart3_line)) uart3_idx = sizeof(uart3_line) - 1;
-      uart3_line[uart3_idx] = '\0';
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+  if (hi2c->Instance == I2C2) I2cBus_Complete(&g_i2c2, HAL_OK);
+}
 
-      /* --- enqueue one uppercased command line --- */
-      char *p = uart3_line;
-      while (*p==' '||*p=='\t'||*p=='\r'||*p=='\n') ++p;
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+  if (hi2c->Instance == I2C2) I2cBus_Complete(&g_i2c2, HAL_OK);
+}
 
-      char cmd[32];
-      size_t i = 0;
-      while (i < sizeof(cmd)-1 && p[i] && p[i] != '\r' && p[i] != '\n') {
-        cmd[i] = (char)toupper((unsigned char)p[i]);
-        ++i;
-      }
-      cmd[i] = '\0';
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+  if (hi2c->Instance == I2C2) I2cBus_Complete(&g_i2c2, HAL_ERROR);
+}
 
-      if (cmd[0] != '\0') {
-        if (cmdq_push(cmd) != 0) {
-          const char *busy = "BUSY\r\n";
-          HAL_UART_Transmit(&huart3, (uint8_t*)busy, (uint16_t)strlen(busy), 0xFFFF);
-        }
-      }
-      uart3_idx = 0;
-    } else {
-      if (uart3_idx < sizeof(uart3_line)-1) {
-        uart3_line[uart3_idx++] = ch;
-      }
-    }
-    HAL_UART_Receive_IT(&huart3, &uart3_rx_ch, 1);  // re-arm at end
+/* An IMU transaction finished (interrupt, or I2cBus_Poll() on a timeout):
+ * post the bit in x->ctx, or IMU_EVT_ERR if it failed. The FIFO-reset writes
+ * have no done(): a dead IMU must not make the loop spin on resets. */
+static void imu_i2c_done(I2cXfer *x, HAL_StatusTypeDef status)
+{
+  uint32_t bits = status == HAL_OK ? (uint32_t)(uintptr_t)x->ctx : IMU_EVT_ERR;
+  if (x == &imu_x_count) imu_count_cyc = DWT->CYCCNT;
+  if (IMUTaskHandle == NULL) return;
+  if (xPortIsInsideInterrupt()) {
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR((TaskHandle_t)IMUTaskHandle, bits, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+  } else {
+    xTaskNotify((TaskHandle_t)IMUTaskHandle, bits, eSetBits);
   }
 }
 
+FAST_CODE void HAL_ADC_ConvHalfCpltCallback(ADC_HandleTypeDef *hadc)
+{
+  uint32_t start = DWT->CYCCNT;
+  if (hadc->Instance == ADC1) Ir_Publish(&ir_dma_buf[0]);
+  Trace_Isr(TI_IR_ADC, start);
+}
 
-/* USER CODE END 4 */
+FAST_CODE void HAL_ADC_ConvCpltCallback(ADC_HandleTypeDef *hadc)
+{
+  uint32_t start = DWT->CYCCNT;
+  if (hadc->Instance == ADC1) Ir_Publish(&ir_dma_buf[IR_OVERSAMPLE]);
+  Trace_Isr(TI_IR_ADC, start);
+}
 
-/* USER CODE BEGIN Header_StartDefaultTask */
-/**
-  * @brief  Function implementing the defaultTask thread.
-  * @param  argument: Not used
-  * @retval None
-  */
-/* USER CODE END Header_StartDefaultTask */
-void StartDefaultTask(void *argument)
+#if FUSED_CTL
+static void Fused_Step(uint32_t cntA, uint32_t cntD, uint32_t cyc);
+#endif
+
+/* TIM7 update: latch both encoders and wake EncoderTask, or with FUSED_CTL
+ * run the whole control step. */
+FAST_CODE void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
-  /* USER CODE BEGIN 5 */
-  /* Infinite loop */
-  uint8_t ch = 'A';
-  for(;;)
+  if (htim->Instance == TIM7)
   {
-	HAL_UART_Transmit(&huart3, (uint8_t *) &ch, 1, 0xFFFF);
-	if(ch < 'Z')
-		ch++;
-	else ch ='A';
-    HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
-    osDelay(5000);
+#if FUSED_CTL
+    uint32_t cntA = Encoder_Count(ENCODER_A);
+    uint32_t cyc  = DWT->CYCCNT;
+    Fused_Step(cntA, Encoder_Count(ENCODER_D), cyc);
+    Trace_Isr(TI_ENC_LATCH, cyc);
+#else
+    enc_latch.cntA = Encoder_Count(ENCODER_A);
+    enc_latch.cyc  = DWT->CYCCNT;
+    enc_latch.cntD = Encoder_Count(ENCODER_D);
+    if (EncoderTaskHandle != NULL) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR((TaskHandle_t)EncoderTaskHandle, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    Trace_Isr(TI_ENC_LATCH, enc_latch.cyc);
+#endif
   }
-  /* USER CODE END 5 */
 }
 
-static void CommandQueue_TryDispatch(void)
+/* A move has reached its target: cut the wheels (not when handing over to a
+ * turn) and wake DistanceTask for the rest. From the compare ISR, or the
+ * fused step. */
+static void Move_EndFromISR(void)
 {
-  if (motionActive || g_steer_cmd.busy) return;
-
-  // NEW: respect cooldown window
-  if (HAL_GetTick() < g_cmd_cooldown_until_ms) return;
-
-  if (cmdq_empty()) return;
-
-  char cmdline[32];
-  if (cmdq_pop(cmdline, sizeof cmdline) != 0) return;
-
-  char *s = cmdline;
-  while (*s == ' ' || *s == '\t') s++;
-  char c0 = (char)toupper((unsigned char)s[0]);
-  char c1 = (char)toupper((unsigned char)s[1]);
-  const char *p = s + 2;
-  while (*p == ' ' || *p == '\t') p++;
-
-  // FR/FL = 90° proper align
-  if (c0=='F' && c1=='L' && isdigit((unsigned char)s[2])) {
-    int deg = atoi(&s[2]);
-    if (deg <= 0) { uart3_send("ERR FL0\r\n"); return; }
-    if (Servo_RequestBangBangTurn(+ (float)deg, 4750) == 0)
-      uart3_send("ACK FL\r\n");
-    else
-      uart3_send("BUSY\r\n");
-    return;
+  Move_DisarmCompare();
+  if (!g_blend.into_turn) {
+    // The distance task takes over the brake when it wakes
+    if (BRAKE_SHORT) AllBrake();
+    else AllStop();
   }
-  if (c0=='F' && c1=='R' && isdigit((unsigned char)s[2])) {
-    int deg = atoi(&s[2]);
-    if (deg <= 0) { uart3_send("ERR FR0\r\n"); return; }
-    if (Servo_RequestBangBangTurn(- (float)deg, 4750) == 0)
-      uart3_send("ACK FR\r\n");
-    else
-      uart3_send("BUSY\r\n");
-    return;
+  motionActive   = 0;
+  g_move_reached = 1;
+  if (DistanceTaskHandle != NULL) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR((TaskHandle_t)DistanceTaskHandle, &woken);
+    portYIELD_FROM_ISR(woken);
   }
+}
 
-  // --- Reverse arbitrary degrees ---
-  // BL<deg>  => reverse + left  => negative delta
-  if (c0=='B' && c1=='L' && isdigit((unsigned char)s[2])) {
-    int deg = atoi(&s[2]);            // BL45, BL120, ...
-    if (deg <= 0) { uart3_send("ERR BL0\r\n"); return; }
-    if (Servo_RequestBangBangTurnRev(-(float)deg, 4750) == 0)
-      uart3_send("ACK BL\r\n");
-    else
-      uart3_send("BUSY\r\n");
+/* TIM2 CC3/CC4: wheel A has reached the armed move target (counting up/down). */
+void HAL_TIM_OC_DelayElapsedCallback(TIM_HandleTypeDef *htim)
+{
+  if (htim->Instance != TIM2) return;
+  if (!motionActive) { Move_DisarmCompare(); return; }
+
+  const uint8_t  up   = htim->Channel == HAL_TIM_ACTIVE_CHANNEL_3;
+  const uint32_t modA = __HAL_TIM_GET_AUTORELOAD(&htim2) + 1;
+  const uint32_t modD = __HAL_TIM_GET_AUTORELOAD(&htim5) + 1;
+  uint32_t cntA = Encoder_Count(ENCODER_A);
+  int32_t short_by = 2 * g_move_goal_counts - enc_progress(cntA, g_move_startA, modA)
+                     - enc_progress(Encoder_Count(ENCODER_D), g_move_startD, modD);
+  if (short_by > 0) {
+    // D lags: move this channel on by the shortfall, the other is not needed now
+    if (up) {
+      __HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_3, (cntA + (uint32_t)short_by) % modA);
+      __HAL_TIM_DISABLE_IT(&htim2, TIM_IT_CC4);
+    } else {
+      __HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_4, (cntA + modA - (uint32_t)short_by) % modA);
+      __HAL_TIM_DISABLE_IT(&htim2, TIM_IT_CC3);
+    }
     return;
   }
+  Move_EndFromISR();
+}
 
-  // BR<deg>  => reverse + right => positive delta
-  if (c0=='B' && c1=='R' && isdigit((unsigned char)s[2])) {
-    int deg = atoi(&s[2]);            // BR30, BR180, ...
-    if (deg <= 0) { uart3_send("ERR BR0\r\n"); return; }
-    if (Servo_RequestBangBangTurnRev(+ (float)deg, 4750) == 0)
-      uart3_send("ACK BR\r\n");
-    else
-      uart3_send("BUSY\r\n");
-    return;
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  if (huart->Instance == USART3) {
+    UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+    uart3_tx_tail = (uint16_t)((uart3_tx_tail + uart3_tx_inflight) % UART3_TX_RING_SIZE);
+    uart3_tx_inflight = 0;
+    uart3_tx_kick();
+    taskEXIT_CRITICAL_FROM_ISR(saved);
   }
+}
 
-  // Optional generic Lnn/Rnn
-  if (c0=='L' && isdigit((unsigned char)s[1])) { int deg=atoi(&s[1]); if (deg<=0){uart3_send("ERR L0\r\n");return;} if (Servo_RequestBangBangTurn(+ (float)deg,4500)==0) uart3_send("ACK L\r\n"); else uart3_send("BUSY\r\n"); return; }
-  if (c0=='R' && isdigit((unsigned char)s[1])) { int deg=atoi(&s[1]); if (deg<=0){uart3_send("ERR R0\r\n");return;} if (Servo_RequestBangBangTurn(- (float)deg,4500)==0) uart3_send("ACK R\r\n"); else uart3_send("BUSY\r\n"); return; }
+static int clampi(int v, int lo, int hi)
+{
+  if (v < lo) return lo;
+  if (v > hi) return hi;
+  return v;
+}
 
-  // ABS
-  if (c0=='A' && c1=='B' && toupper((unsigned char)s[2])=='S') { int absd=atoi(&s[3])%360; if (Servo_RequestTurnTo((float)absd)==0) uart3_send("ACK ABS\r\n"); else uart3_send("BUSY\r\n"); return; }
 
-  // Distance FW/BW
-  if (c0=='F' && c1=='W') { int cm=0; if (sscanf(p,"%d",&cm)==1 && cm>0){ StartMoveCM(cm, DIR_FWD); char b[32]; int n=snprintf(b,sizeof b,"ACK FW %d\r\n",cm); HAL_UART_Transmit(&huart3,(uint8_t*)b,(uint16_t)n,HAL_MAX_DELAY);} else uart3_send("ERR (use FW###)\r\n"); return; }
-  if (c0=='B' && c1=='W') { int cm=0; if (sscanf(p,"%d",&cm)==1 && cm>0){ StartMoveCM(cm, DIR_BACK); char b[32]; int n=snprintf(b,sizeof b,"ACK BW %d\r\n",cm); HAL_UART_Transmit(&huart3,(uint8_t*)b,(uint16_t)n,HAL_MAX_DELAY);} else uart3_send("ERR (use BW###)\r\n"); return; }
 
-  uart3_send("CMD?\r\n");
+static void Uart3_StartRx(void)
+{
+  uart3_dma_head = 0;
+  uart3_estop_scan = 0;
+  HAL_UARTEx_ReceiveToIdle_DMA(&huart3, uart3_dma_buf, UART3_DMA_BUF_SIZE);
+  // Wake only on IDLE and at the buffer wrap, not at half-transfer
+  __HAL_DMA_DISABLE_IT(&hdma_usart3_rx, DMA_IT_HT);
 }
 
-/* USER CODE BEGIN Header_show */
-/**
-* @brief Function implementing the ShowTask thread.
-* @param argument: Not used
-* @retval None
-*/
-/* USER CODE END Header_show */
-void show(void *argument)
+/* RX event ISR: ESTOP_BYTE arrived. Stops the wheels and notes what was cut
+ * short; UartRxTask and CmdTask do the rest. */
+static void Estop_FromIsr(void)
 {
-  /* USER CODE BEGIN show */
-  /* Infinite loop */
-  uint8_t hello[20] = "Hello World!\0";
-  for(;;)
-  {
-	sprintf(hello, "%s\0", aRxBuffer);
-	OLED_ShowString(10, 10, hello);
-	OLED_Refresh_Gram();
-    osDelay(1000);
+  float left = 0.0f;
+  g_estop_kind = "IDLE";
+  if (motionActive) {
+    float travelled = 0.5f * (fabsf(distance_cm_A) + fabsf(distance_cm_D));
+    left = (float)(targetdistance_cm + MOVE_BRAKE_COMP_CM) - travelled;
+    g_estop_kind = dir == DIR_BACK ? "BW" : "FW";
+  } else if (g_steer_cmd.busy || g_steer_cmd.pending) {
+    left = fabsf(smallest_err_deg(g_steer_cmd.target_heading, yaw_angle_deg));
+    g_estop_kind = "TURN";
+  } else if (g_sysid.state == SYSID_RUNNING) {
+    g_estop_kind = "SYSID";
+  } else if (g_odocal.state == ODOCAL_RUNNING) {
+    g_estop_kind = "CAL";
   }
-  /* USER CODE END show */
+  g_estop_left = (int16_t)(left > 0.0f ? left + 0.5f : 0.0f);
+  g_estop = ESTOP_CUT;
+  Brake_Cancel();
+  AllStop();
+  Move_DisarmCompare();
+  motionActive = 0;
+  g_steer_cmd.pending = 0;  // ServoMotorTask ends a running turn on g_estop
 }
 
-/* USER CODE BEGIN Header_motor */
-/**
-* @brief Function implementing the MotorTask thread.
-* @param argument: Not used
-* @retval None
-*/
-/* USER CODE END Header_motor */
-void motor(void *argument)
+/* IDLE line or buffer wrap: Size is the DMA write index (UART3_DMA_BUF_SIZE at the wrap) */
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size)
 {
-  /* USER CODE BEGIN motor */
-  const TickType_t period = pdMS_TO_TICKS(MC_PERIOD_MS);
-  TickType_t tick = xTaskGetTickCount();
-
-  float integ = 0.0f;
-  float prevErr = 0.0f;
-
-  // simple RPS smoothing (3-sample EMA)
-  float rpsA_f = 0.0f, rpsD_f = 0.0f;
-  const float alpha = 0.5f; // 0=no filter, 1=heavy filter
-  const int pwmBase = 5000; // your feed-forward
-  uint32_t last_ms = HAL_GetTick();
-  /* Infinite loop */
-  for(;;)
-  {
-    vTaskDelayUntil(&tick, period);
-    // --- ADD THIS GUARD ---
-    if (g_steer_cmd.busy) {
-        AllStop();
-        continue;   // skip rest of loop until steering done
+  uint32_t start = DWT->CYCCNT;
+  if (huart->Instance == USART3) {
+    PROF_BEGIN(PR_UART_RX);
+    uart3_dma_head = (Size >= UART3_DMA_BUF_SIZE) ? 0 : Size;
+    // Only the bytes since the last event; there are seldom more than a line's worth
+    uint16_t i = uart3_estop_scan;
+    for (; i != uart3_dma_head; i = (uint16_t)((i + 1) % UART3_DMA_BUF_SIZE)) {
+      if (uart3_dma_buf[i] == ESTOP_BYTE) Estop_FromIsr();
     }
-    // dt (s)
-    uint32_t now_ms = HAL_GetTick();
-    float dt = (float)(now_ms - last_ms) / 1000.0f;
-    if (dt <= 0.0f) dt = (float)MC_PERIOD_MS / 1000.0f;
-    last_ms = now_ms;
-
-    // filtered RPS
-    rpsA_f = alpha * rpsA_f + (1.0f - alpha) * rpsA;
-    rpsD_f = alpha * rpsD_f + (1.0f - alpha) * rpsD;
+    uart3_estop_scan = i;
+    if (UartRxTaskHandle != NULL) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR((TaskHandle_t)UartRxTaskHandle, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    PROF_END(PR_UART_RX);
+    Trace_Isr(TI_UART_RX, start);
+  }
+}
 
-    // error = A - D (want 0)
-    float err = rpsA_f - rpsD_f;
+/* An overrun aborts the DMA reception; restart it at index 0. Noise/framing
+ * errors leave it running (RxState still busy) and need nothing. A TX DMA
+ * error aborts the transfer: skip those bytes and go on with the rest. */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  if (huart->Instance == USART3 && uart3_tx_inflight && huart->gState == HAL_UART_STATE_READY) {
+    HAL_UART_TxCpltCallback(huart);
+  }
+  if (huart->Instance == USART3 && huart->RxState == HAL_UART_STATE_READY) {
+    uart3_rx_restarted = 1;
+    Uart3_StartRx();
+    if (UartRxTaskHandle != NULL) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR((TaskHandle_t)UartRxTaskHandle, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+  }
+}
 
-    // dt-scaled PI(D)
-    integ += err * (KI_DIFF * dt);           // integral in PWM units
-    if (integ > I_MAX) integ = I_MAX;
-    if (integ < -I_MAX) integ = -I_MAX;
+static const gain_sched_t GS_DEFAULTS = {
+  .magic      = GS_MAGIC,
+  .cruise_cms = VP_CRUISE_CMS,
+  .row = {
+#define GS_DEFAULT_ROW(v) { (v), VP_KP, VP_KI, HH_KP_STEER, HH_KP_DIFF, KP_DIFF, KI_DIFF, \
+                            TURN_PWM_MAX, TURN_PWM_MIN, pwm_fast, FINE_KP_STEER }
+    GS_DEFAULT_ROW(30.0f), GS_DEFAULT_ROW(60.0f), GS_DEFAULT_ROW(90.0f),
+#undef GS_DEFAULT_ROW
+  },
+};
 
-    float p = KP_DIFF * err;
-    float d = KD_DIFF * (err - prevErr) / dt; // 0 if KD=0
-    float corr = p + integ + d;
-    prevErr = err;
+/* PARAM names, in gain_row_t order */
+static const char *const GS_NAMES[GS_FIELDS] = {
+  "SPD", "VKP", "VKI", "HKS", "HKD", "DKP", "DKI", "TMAX", "TMIN", "TPWM", "FKP"
+};
 
-    // apply symmetric correction + biases
-    pwmA_val = pwmBase - (int)corr + biasA;
-    pwmD_val = pwmBase + (int)corr + biasD;
+static uint32_t fnv1a(const void *p, size_t len)
+{
+  const uint8_t *b = (const uint8_t *)p;
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) h = (h ^ b[i]) * 16777619u;
+  return h;
+}
 
-    // clamp
-    if (pwmA_val < PWM_MIN_CLAMP) pwmA_val = PWM_MIN_CLAMP;
-    if (pwmA_val > PWM_MAX_CLAMP) pwmA_val = PWM_MAX_CLAMP;
-    if (pwmD_val < PWM_MIN_CLAMP) pwmD_val = PWM_MIN_CLAMP;
-    if (pwmD_val > PWM_MAX_CLAMP) pwmD_val = PWM_MAX_CLAMP;
+static uint32_t gs_crc(const gain_sched_t *gs)
+{
+  return fnv1a(gs, offsetof(gain_sched_t, crc));
+}
 
-    if (motionActive)
-    {
-        // direction-aware drive
-        if (dir == DIR_FWD) {
-            DriveForwardPWM(pwmA_val, pwmD_val);
-        } else {
-            DriveBackwardPWM(pwmA_val, pwmD_val);
-        }
-    }
-    else
-    {
-        integ = 0.0f; // reset integral when idle
-        prevErr = 0.0f;
-    }
+/* Boot: the saved schedule if sector 7 holds a valid one, else the defaults */
+static void Gains_Load(void)
+{
+  const gain_sched_t *saved = (const gain_sched_t *)GS_FLASH_ADDR;
+  if (saved->magic == GS_MAGIC && saved->crc == gs_crc(saved)) g_gs = *saved;
+  else                                                         g_gs = GS_DEFAULTS;
+  Gains_At(g_gs.cruise_cms, &g_turn_gains);
+}
 
-    // optional: quick telemetry
-    //char msg[64]; int n=sprintf(msg,"%d,%d,%.0f\r\n",rpsA_f,rpsD_f,err);
-   // HAL_UART_Transmit_IT(&huart3,(uint8_t*)msg,(uint16_t)n);
+/* Erases one 128K sector and programs len bytes (a multiple of 4) at addr.
+ * The erase stalls every flash fetch (ISRs included) for ~1-2 s; CmdTask only
+ * gets here with the robot idle. Returns 0 on success. */
+static int Flash_WriteSector(uint32_t sector, uint32_t addr, const void *src, uint32_t len)
+{
+  FLASH_EraseInitTypeDef erase = {0};
+  uint32_t sector_err = 0;
+  const uint32_t *w = (const uint32_t *)src;
+  int rc = 0;
+
+  erase.TypeErase    = FLASH_TYPEERASE_SECTORS;
+  erase.Sector       = sector;
+  erase.NbSectors    = 1;
+  erase.VoltageRange = FLASH_VOLTAGE_RANGE_3;
+
+  HAL_FLASH_Unlock();
+  if (HAL_FLASHEx_Erase(&erase, &sector_err) != HAL_OK) rc = -1;
+  for (uint32_t i = 0; rc == 0 && i < len / 4u; i++) {
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, addr + 4u * i, w[i]) != HAL_OK) rc = -1;
   }
-  /* USER CODE END motor */
+  HAL_FLASH_Lock();
+  return rc;
 }
 
-/* USER CODE BEGIN Header_encoder */
-/**
-* @brief Function implementing the EncoderTask thread.
-* @param argument: Not used
-* @retval None
-*/
-/* USER CODE END Header_encoder */
-void encoder(void *argument)
+static int Gains_Save(void)
 {
-  /* USER CODE BEGIN encoder */
-  uint32_t cntA_prev = __HAL_TIM_GET_COUNTER(&htim2);
-  uint32_t cntD_prev = __HAL_TIM_GET_COUNTER(&htim5);
-  const int32_t modA = (int32_t)__HAL_TIM_GET_AUTORELOAD(&htim2) + 1; // 65536
-  const int32_t modD = (int32_t)__HAL_TIM_GET_AUTORELOAD(&htim5) + 1;
-
-  TickType_t tick = xTaskGetTickCount();
-  const TickType_t period = pdMS_TO_TICKS(20);   // 50 Hz
-  uint32_t last_ms = HAL_GetTick();
-
-  for (;;)
-  {
-	  vTaskDelayUntil(&tick, period);
+  g_gs.magic = GS_MAGIC;
+  g_gs.crc   = gs_crc(&g_gs);
+  return Flash_WriteSector(GS_FLASH_SECTOR, GS_FLASH_ADDR, &g_gs, sizeof(g_gs));
+}
 
-	  uint32_t now_ms = HAL_GetTick();
-	  float dt_ms = (float)(now_ms - last_ms);
-	  if (dt_ms <= 0) dt_ms = 1.0f;
+/* Decodes the text after "PARAM" into rec */
+static void Gains_Parse(const char *p, cmd_rec_t *rec)
+{
+  char name[8];
+  int  n = 0;
+  char *end;
 
-	  uint32_t cntA = __HAL_TIM_GET_COUNTER(&htim2);
-	  uint32_t cntD = __HAL_TIM_GET_COUNTER(&htim5);
+  rec->sub = RPL_ERR_PARAM;
+  while (*p == ' ') p++;
+  if (*p == '\0') { rec->op = CMD_PARAM; rec->sub = GS_ACT_SHOW; return; }
+  while (n < (int)sizeof(name) - 1 && isalpha((unsigned char)*p)) name[n++] = *p++;
+  name[n] = '\0';
 
-	  int32_t dA = (int32_t)cntA - (int32_t)cntA_prev;
-	  if      (dA >  (modA/2)) dA -= modA;
-	  else if (dA < -(modA/2)) dA += modA;
+  if (strcmp(name, "SAVE") == 0)     { rec->op = CMD_PARAM; rec->sub = GS_ACT_SAVE; return; }
+  if (strcmp(name, "DEFAULTS") == 0) { rec->op = CMD_PARAM; rec->sub = GS_ACT_DEFAULTS; return; }
 
-	  int32_t dD = (int32_t)cntD - (int32_t)cntD_prev;
-	  if      (dD >  (modD/2)) dD -= modD;
-	  else if (dD < -(modD/2)) dD += modD;
+  if (strcmp(name, "CRUISE") == 0) {
+    rec->row = -1;
+  } else {
+    unsigned f = 0;
+    while (f < GS_FIELDS && strcmp(name, GS_NAMES[f]) != 0) f++;
+    long row = strtol(p, &end, 10);
+    if (f == GS_FIELDS || end == p || row < 0 || row >= GS_ROWS) return;
+    rec->field = (uint8_t)f;
+    rec->row = (int8_t)row;
+    p = end;
+  }
+  rec->val = strtof(p, &end);
+  if (end == p) return;
+  rec->op = CMD_PARAM;
+  rec->sub = GS_ACT_SET;
+}
+
+/* CmdTask: runs one PARAM record between motions and replies */
+static void Gains_Command(const cmd_rec_t *rec)
+{
+  char b[160];
+  Fmt  out;
+
+  switch (rec->sub) {
+  case GS_ACT_SET:
+    if (rec->row < 0) {
+      if (rec->val <= 0.0f) { uart3_send("ERR PARAM\r\n"); return; }
+      g_gs.cruise_cms = rec->val;
+    } else {
+      // Rows stay sorted by speed, or Gains_At() would not find them
+      if (rec->field == 0 && ((rec->row > 0 && rec->val <= g_gs.row[rec->row - 1].speed_cms) ||
+                              (rec->row < GS_ROWS - 1 && rec->val >= g_gs.row[rec->row + 1].speed_cms))) {
+        uart3_send("ERR PARAM\r\n");
+        return;
+      }
+      ((float *)&g_gs.row[rec->row])[rec->field] = rec->val;
+    }
+    uart3_send("ACK PARAM\r\n");
+    return;
+  case GS_ACT_SAVE:
+    uart3_send(Gains_Save() == 0 ? "ACK PARAM SAVE\r\n" : "ERR PARAM SAVE\r\n");
+    return;
+  case GS_ACT_DEFAULTS:
+    g_gs = GS_DEFAULTS;
+    uart3_send("ACK PARAM DEFAULTS\r\n");
+    return;
+  default:
+    Fmt_Init(&out, b, sizeof b);
+    Fmt_Str(&out, "PARAM CRUISE ");
+    Fmt_Fixed(&out, g_gs.cruise_cms, 1, 0);
+    Fmt_Str(&out, "\r\n");
+    uart3_write(b, (uint16_t)out.len);
+    for (int r = 0; r < GS_ROWS; r++) {
+      const float *v = (const float *)&g_gs.row[r];
+      Fmt_Init(&out, b, sizeof b - 2);   // 2: CRLF
+      Fmt_Str(&out, "PARAM ");
+      Fmt_Int(&out, r, 0);
+      for (unsigned f = 0; f < GS_FIELDS; f++) {
+        Fmt_Char(&out, ' ');
+        Fmt_Str(&out, GS_NAMES[f]);
+        Fmt_Char(&out, '=');
+        Fmt_Float(&out, v[f]);
+      }
+      out.size = sizeof b;
+      Fmt_Str(&out, "\r\n");
+      uart3_write(b, (uint16_t)out.len);
+    }
+    uart3_send("ACK PARAM\r\n");
+    return;
+  }
+}
+
+static const cal_block_t CAL_DEFAULTS = {
+  .magic = CAL_MAGIC,
+  .v = {
+    .steer_us_center = STEER_US_CENTER,
+    .bias_a          = BIAS_A_DEFAULT,
+    .bias_d          = BIAS_D_DEFAULT,
+    .ir_a            = IR_FIT_A_DEFAULT,
+    .ir_b            = IR_FIT_B_DEFAULT,
+    .cm_per_count    = CM_PER_COUNT_DEFAULT,
+    .gyro_bias_lsb   = 0.0f,
+    .gyro_fc_hz      = FILT_GYRO_HZ_DEFAULT,
+    .ir_fc_hz        = FILT_IR_HZ_DEFAULT,
+    .rps_fc_hz       = FILT_RPS_HZ_DEFAULT,
+  },
+};
+
+/* CAL names, in cal_vals_t order */
+static const char *const CAL_NAMES[CAL_FIELDS] = {
+  "SCTR", "BIASA", "BIASD", "IRA", "IRB", "CMPC", "GYRO", "GYFC", "IRFC", "RPFC"
+};
+
+static uint32_t cal_crc(const cal_block_t *cal)
+{
+  return fnv1a(cal, offsetof(cal_block_t, crc));
+}
+
+/* Boot, before IrLut_Build() and the tasks: the saved block if sector 6
+ * holds a valid one, else the defaults */
+static void Cal_Load(void)
+{
+  const cal_block_t *saved = (const cal_block_t *)CAL_FLASH_ADDR;
+  if (saved->magic == CAL_MAGIC && saved->crc == cal_crc(saved)) g_cal = *saved;
+  else                                                           g_cal = CAL_DEFAULTS;
+}
+
+/* Also keeps the gyro bias ZUPT has settled on, so the next boot starts from it */
+static int Cal_Save(void)
+{
+  if (gyro_ready) g_cal.v.gyro_bias_lsb = _gyro_bias_lsb;
+  g_cal.magic = CAL_MAGIC;
+  g_cal.crc   = cal_crc(&g_cal);
+  return Flash_WriteSector(CAL_FLASH_SECTOR, CAL_FLASH_ADDR, &g_cal, sizeof(g_cal));
+}
+
+/* Boot and after a CAL edit: what is derived from CMPC */
+static void Odo_Configure(void)
+{
+#if FIXED_POINT_CTL
+  g_cm_per_count_q16 = Q16_FromFloat(CM_PER_COUNT);
+#endif
+}
+
+/* Decodes the text after "CAL ODO" into rec */
+static void OdoCal_Parse(const char *p, cmd_rec_t *rec)
+{
+  char *end;
+  long pwm = ODO_PWM;
+
+  while (*p == ' ') p++;
+  if (*p != '\0') {
+    pwm = strtol(p, &end, 10);
+    if (end == p || *end != '\0') return;
+  }
+  if (pwm < 1 || pwm > BOARD_PWM_MAX) return;
+  rec->op = CMD_ODOCAL;
+  rec->arg = (int32_t)pwm;
+}
+
+/* Decodes the text after "CAL" into rec */
+static void Cal_Parse(const char *p, cmd_rec_t *rec)
+{
+  char name[8];
+  int  n = 0;
+  char *end;
+
+  rec->sub = RPL_ERR_CAL;
+  while (*p == ' ') p++;
+  if (*p == '\0') { rec->op = CMD_CAL; rec->sub = GS_ACT_SHOW; return; }
+  while (n < (int)sizeof(name) - 1 && isalpha((unsigned char)*p)) name[n++] = *p++;
+  name[n] = '\0';
+
+  if (strcmp(name, "SAVE") == 0)     { rec->op = CMD_CAL; rec->sub = GS_ACT_SAVE; return; }
+  if (strcmp(name, "DEFAULTS") == 0) { rec->op = CMD_CAL; rec->sub = GS_ACT_DEFAULTS; return; }
+  if (strcmp(name, "ODO") == 0)      { OdoCal_Parse(p, rec); return; }
+
+  unsigned f = 0;
+  while (f < CAL_FIELDS && strcmp(name, CAL_NAMES[f]) != 0) f++;
+  if (f == CAL_FIELDS) return;
+  rec->field = (uint8_t)f;
+  rec->val = strtof(p, &end);
+  if (end == p) return;
+  rec->op = CMD_CAL;
+  rec->sub = GS_ACT_SET;
+}
+
+/* CmdTask: runs one CAL record between motions and replies */
+static void Cal_Command(const cmd_rec_t *rec)
+{
+  char b[160];
+  Fmt  out;
+
+  switch (rec->sub) {
+  case GS_ACT_SET:
+    ((float *)&g_cal.v)[rec->field] = rec->val;
+    if (rec->field == offsetof(cal_vals_t, ir_a) / sizeof(float) ||
+        rec->field == offsetof(cal_vals_t, ir_b) / sizeof(float)) IrLut_Build();
+    if (rec->field == offsetof(cal_vals_t, steer_us_center) / sizeof(float)) steer_center();
+    if (rec->field == offsetof(cal_vals_t, cm_per_count) / sizeof(float)) Odo_Configure();
+    if (rec->field >= offsetof(cal_vals_t, gyro_fc_hz) / sizeof(float)) Filters_Configure();
+    uart3_send("ACK CAL\r\n");
+    return;
+  case GS_ACT_SAVE:
+    uart3_send(Cal_Save() == 0 ? "ACK CAL SAVE\r\n" : "ERR CAL SAVE\r\n");
+    return;
+  case GS_ACT_DEFAULTS:
+    g_cal = CAL_DEFAULTS;
+    IrLut_Build();
+    Filters_Configure();
+    Odo_Configure();
+    steer_center();
+    uart3_send("ACK CAL DEFAULTS\r\n");
+    return;
+  default: {
+    const float *v = (const float *)&g_cal.v;
+    Fmt_Init(&out, b, sizeof b - 2);   // 2: CRLF
+    Fmt_Str(&out, "CAL");
+    for (unsigned f = 0; f < CAL_FIELDS; f++) {
+      Fmt_Char(&out, ' ');
+      Fmt_Str(&out, CAL_NAMES[f]);
+      Fmt_Char(&out, '=');
+      Fmt_Float(&out, v[f]);
+    }
+    out.size = sizeof b;
+    Fmt_Str(&out, "\r\n");
+    uart3_write(b, (uint16_t)out.len);
+    uart3_send("ACK CAL\r\n");
+    return;
+  }
+  }
+}
+
+/* Decodes the text after "SYSID" into rec */
+static void SysId_Parse(const char *p, cmd_rec_t *rec)
+{
+  char *end;
+  uint8_t target, seq;
+
+  rec->sub = RPL_ERR_SYSID;
+  while (*p == ' ') p++;
+  if      (*p == 'A') target = SYSID_A;
+  else if (*p == 'D') target = SYSID_D;
+  else if (*p == 'S') target = SYSID_S;
+  else return;
+  p++;
+  while (*p == ' ') p++;
+  if      (strncmp(p, "STEP", 4) == 0)  { seq = SYSID_STEP;  p += 4; }
+  else if (strncmp(p, "CHIRP", 5) == 0) { seq = SYSID_CHIRP; p += 5; }
+  else return;
+  while (*p == ' ') p++;
+
+  long amp = target == SYSID_S ? SYSID_STEER_US : SYSID_WHEEL_PWM;
+  if (*p != '\0') {
+    amp = strtol(p, &end, 10);
+    if (end == p || *end != '\0') return;
+  }
+  if (amp < 1 || amp > (target == SYSID_S ? SYSID_STEER_US_MAX : BOARD_PWM_MAX)) return;
+  rec->op = CMD_SYSID;
+  rec->field = target;
+  rec->sub = seq;
+  rec->arg = (int32_t)amp;
+}
+
+/* CmdTask, robot idle: hands the outputs to SysId_Tick */
+static void SysId_Start(const cmd_rec_t *rec)
+{
+  steer_center();
+  g_sysid.target  = rec->field;
+  g_sysid.seq     = rec->sub;
+  g_sysid.amp     = rec->arg;
+  g_sysid.t_ms    = 0;
+  g_sysid.stopped = 0;
+  MotionTrace_Begin(CMD_SYSID, (int32_t)(((uint32_t)(rec->field * 2u + rec->sub) << 16) | (uint32_t)rec->arg));
+  __DMB();
+  g_sysid.state = SYSID_RUNNING;
+  uart3_send("ACK SYSID\r\n");
+}
+
+/* CmdTask, once the tick hook has ended the sequence */
+static void SysId_Finish(void)
+{
+  if (g_sysid.target == SYSID_S) steer_center();
+  if (!g_sysid.stopped) Brake_Start();
+  StartCooldown(CMD_COOLDOWN_MS);
+  g_sysid.state = SYSID_IDLE;
+  if (!g_sysid.stopped) uart3_send("DONE SYSID\r\n");  // Otherwise the STOPPED reply says it
+}
+
+/* CmdTask, robot idle: hands the outputs to OdoCal_Tick */
+static void OdoCal_Start(const cmd_rec_t *rec)
+{
+  steer_center();
+  ResetDistanceCounts();
+  memset(&g_odocal, 0, sizeof g_odocal);
+  g_odocal.pwm = rec->arg;
+  __DMB();
+  g_odocal.state = ODOCAL_RUNNING;
+  uart3_send("ACK CAL ODO\r\n");
+}
+
+/* CmdTask, once the tick hook has ended the run: the fit */
+static void OdoCal_Finish(void)
+{
+  char b[64];
+  Fmt  out;
+  odocal_t *o = &g_odocal;
+
+  if (!o->stopped) Brake_Start();
+  StartCooldown(CMD_COOLDOWN_MS);
+  o->state = ODOCAL_IDLE;
+  if (o->stopped) return;  // The STOPPED reply says it
+
+  float cmpc = o->n >= ODO_MIN_SAMPLES && o->s_cc > 0.0f ? -0.1f * o->s_cr / o->s_cc : 0.0f;
+  if (fabsf(cmpc - CM_PER_COUNT_DEFAULT) > ODO_TOL * CM_PER_COUNT_DEFAULT) {
+    uart3_send("ERR CAL ODO\r\n");
+    return;
+  }
+  float res = o->s_rr - o->s_cr * o->s_cr / o->s_cc;  // Residual sum of squares
+  g_cal.v.cm_per_count = cmpc;
+  Odo_Configure();
+
+  Fmt_Init(&out, b, sizeof b);
+  Fmt_Str(&out, "DONE CAL ODO CMPC=");
+  Fmt_Float(&out, cmpc);
+  Fmt_Str(&out, " N=");
+  Fmt_Uint(&out, o->n, 0);
+  Fmt_Str(&out, " RMS=");
+  Fmt_Fixed(&out, sqrtf(res > 0.0f ? res / (float)o->n : 0.0f), 1, 0);
+  Fmt_Str(&out, "\r\n");
+  uart3_write(b, (uint16_t)out.len);
+}
+
+/* spd_class_t of the suffix after the number at s */
+static uint8_t Cmd_SpeedClass(const char *s)
+{
+  while (*s == ' ' || *s == '\t' || *s == '-' || *s == '+') s++;
+  while (isdigit((unsigned char)*s)) s++;
+  return *s == 'S' ? SPD_SLOW : *s == 'F' ? SPD_FAST : SPD_NORMAL;
+}
+
+/* Decodes one uppercased command line into rec; unknown or bad lines become CMD_REJECT */
+static void Cmd_Parse(const char *s, cmd_rec_t *rec)
+{
+  char c0 = s[0];
+  char c1 = c0 ? s[1] : '\0';
+  const char *p = s + (c1 ? 2 : 1);
+  while (*p == ' ' || *p == '\t') p++;
+
+  rec->op = CMD_REJECT;
+  rec->sub = RPL_CMD;
+  rec->field = 0;
+  rec->row = 0;
+  rec->arg = 0;
+
+  // FR/FL = 90° proper align; BL/BR reverse arbitrary degrees
+  if ((c0=='F' || c0=='B') && (c1=='L' || c1=='R') && isdigit((unsigned char)s[2])) {
+    int rev = (c0 == 'B'), right = (c1 == 'R');
+    int deg = atoi(&s[2]);
+    if (deg <= 0) { rec->sub = (uint8_t)(RPL_ERR_FL0 + 2 * rev + right); return; }
+    // FL => +, FR => -, BL (reverse + left) => -, BR (reverse + right) => +
+    rec->op = rev ? CMD_TURN_REV : CMD_TURN;
+    rec->arg = (right != rev) ? -deg : deg;
+    rec->sub = (uint8_t)(RPL_ACK_FL + 2 * rev + right);
+    rec->field = Cmd_SpeedClass(&s[2]);
+    return;
+  }
+
+  // Optional generic Lnn/Rnn
+  if ((c0=='L' || c0=='R') && isdigit((unsigned char)s[1])) {
+    int deg = atoi(&s[1]);
+    if (deg <= 0) { rec->sub = (c0=='L') ? RPL_ERR_L0 : RPL_ERR_R0; return; }
+    rec->op = CMD_TURN;
+    rec->arg = (c0=='L') ? deg : -deg;
+    rec->sub = (c0=='L') ? RPL_ACK_L : RPL_ACK_R;
+    rec->field = Cmd_SpeedClass(&s[1]);
+    return;
+  }
+
+  // ABS
+  if (c0=='A' && c1=='B' && s[2]=='S') {
+    rec->op = CMD_TURN_ABS;
+    rec->arg = atoi(&s[3]) % 360;
+    rec->sub = RPL_ACK_ABS;
+    return;
+  }
+
+  // PARAM [name row value | CRUISE value | SAVE | DEFAULTS]
+  if (strncmp(s, "PARAM", 5) == 0) {
+    Gains_Parse(s + 5, rec);
+    return;
+  }
+
+  // CAL [name value | SAVE | DEFAULTS]
+  if (strncmp(s, "CAL", 3) == 0) {
+    Cal_Parse(s + 3, rec);
+    return;
+  }
+
+  // SYSID <A|D|S> <STEP|CHIRP> [amp]
+  if (strncmp(s, "SYSID", 5) == 0) {
+    SysId_Parse(s + 5, rec);
+    return;
+  }
+
+  // Distance FW/BW
+  if ((c0=='F' || c0=='B') && c1=='W') {
+    int cm = 0;
+    if (sscanf(p, "%d", &cm) == 1 && cm > 0) {
+      rec->op = (c0=='F') ? CMD_MOVE_FWD : CMD_MOVE_BACK;
+      rec->arg = cm > 32767 ? 32767 : cm;
+      rec->field = Cmd_SpeedClass(p);
+    } else {
+      rec->sub = (c0=='F') ? RPL_ERR_FW : RPL_ERR_BW;
+    }
+  }
+}
+
+/* STATS: per-task CPU since the previous STATS (or boot), stack high-water
+ * marks (words never used) and heap_4 usage. Answered straight from
+ * UartRxTask rather than queued, so it also works in the middle of a move. */
+#define STATS_MAX_TASKS 16
+static void Stats_Report(void)
+{
+  static CCMRAM TaskStatus_t st[STATS_MAX_TASKS];
+  static CCMRAM uint32_t prev_run[STATS_MAX_TASKS];   // by xTaskNumber
+  static uint32_t prev_total = 0;
+  uint32_t total = 0;
+  char b[64];
+
+  UBaseType_t n = uxTaskGetSystemState(st, STATS_MAX_TASKS, &total);
+  uint32_t span = total - prev_total;          // run-time clock wraps; differences do not care
+  prev_total = total;
+
+  int len = snprintf(b, sizeof b, "STATS HEAP FREE %u MIN %u\r\n",
+                     (unsigned)xPortGetFreeHeapSize(), (unsigned)xPortGetMinimumEverFreeHeapSize());
+  uart3_write(b, (uint16_t)len);
+  for (UBaseType_t i = 0; i < n; i++) {
+    UBaseType_t id = st[i].xTaskNumber % STATS_MAX_TASKS;
+    uint32_t ran = st[i].ulRunTimeCounter - prev_run[id];
+    prev_run[id] = st[i].ulRunTimeCounter;
+    unsigned pm = span ? (unsigned)((uint64_t)ran * 1000u / span) : 0;   // per mille
+    len = snprintf(b, sizeof b, "STATS %-14s CPU %3u.%u%% STACK %u\r\n",
+                   st[i].pcTaskName, pm / 10u, pm % 10u, (unsigned)st[i].usStackHighWaterMark);
+    uart3_write(b, (uint16_t)len);
+  }
+  uart3_send("ACK STATS\r\n");
+}
+
+/* JITTER: per loop, |period - nominal| and execution-time histograms since the
+ * previous JITTER (nonzero buckets as bucket:count, bucket as in TRACE_BUCKETS)
+ * and the last TRACE_LAST loops as period/exec in us, then one ISR line:
+ * count/mean/max cycles per callback, the ART bits FastMem_CheckArt() had to
+ * set (0: HAL had them on) and FAST_CODE_IN_RAM. Kept short so the whole reply
+ * fits the TX ring. */
+static int trace_hist_fmt(char *b, size_t size, const char *tag, const uint32_t *hist)
+{
+  if (size < 32) return 0;
+  int n = snprintf(b, size, " %s", tag);
+  for (int i = 0; i < TRACE_BUCKETS && n < (int)size - 16; i++) {
+    if (hist[i]) n += snprintf(b + n, size - n, " %d:%lu", i, (unsigned long)hist[i]);
+  }
+  return n;
+}
+
+static void Jitter_Report(void)
+{
+  static const char *const names[TR_LOOPS] = { "MOTOR", "ENCODER", "SERVO", "IMU" };
+  static loop_trace_t snap;
+  const uint32_t cyc_per_us = SystemCoreClock / 1000000u;
+  char b[192];
+
+  for (int id = 0; id < TR_LOOPS; id++) {
+    loop_trace_t *t = &g_trace[id];
+    taskENTER_CRITICAL();
+    snap = *t;
+    t->periods = 0;
+    t->dev_max_us = t->exec_max_us = 0;
+    memset(t->dev_hist, 0, sizeof(t->dev_hist));
+    memset(t->exec_hist, 0, sizeof(t->exec_hist));
+    taskEXIT_CRITICAL();
+
+    int n = snprintf(b, sizeof b, "JITTER %s NOM %lu N %lu DEVMAX %lu EXECMAX %lu\r\n", names[id],
+                     (unsigned long)snap.nominal_us, (unsigned long)snap.periods,
+                     (unsigned long)snap.dev_max_us, (unsigned long)snap.exec_max_us);
+    uart3_write(b, (uint16_t)n);
+
+    n = snprintf(b, sizeof b, "JITTER %s", names[id]);
+    n += trace_hist_fmt(b + n, sizeof b - n - 48, "DEV", snap.dev_hist);   // 48: LAST and CRLF
+    n += trace_hist_fmt(b + n, sizeof b - n - 48, "EXEC", snap.exec_hist);
+    n += snprintf(b + n, sizeof b - n, " LAST");
+    for (int k = 0; k < TRACE_LAST && n < (int)sizeof b - 28; k++) {
+      const trace_stamp_t *cur  = &snap.ring[(snap.head + TRACE_RING - k) % TRACE_RING];
+      const trace_stamp_t *prev = &snap.ring[(snap.head + TRACE_RING - k - 1) % TRACE_RING];
+      n += snprintf(b + n, sizeof b - n, " %lu/%lu",
+                    (unsigned long)((cur->wake - prev->wake) / cyc_per_us),
+                    (unsigned long)((cur->end - cur->wake) / cyc_per_us));
+    }
+    n += snprintf(b + n, sizeof b - n, "\r\n");
+    uart3_write(b, (uint16_t)n);
+  }
+
+  int n = snprintf(b, sizeof b, "JITTER ISR");
+  for (int id = 0; id < TI_ISRS; id++) {
+    taskENTER_CRITICAL();
+    WcetIsr is = g_isr_trace[id];
+    memset(&g_isr_trace[id], 0, sizeof(g_isr_trace[id]));
+    taskEXIT_CRITICAL();
+    n += snprintf(b + n, sizeof b - n, " %s %lu/%lu/%lu", g_isr_names[id], (unsigned long)is.n,
+                  (unsigned long)(is.n ? is.cycSum / is.n : 0), (unsigned long)is.cycMax);
+  }
+  n += snprintf(b + n, sizeof b - n, " ART %lX RAMCODE %d\r\n", (unsigned long)g_art_missing, FAST_CODE_IN_RAM);
+  uart3_write(b, (uint16_t)n);
+  uart3_send("ACK JITTER\r\n");
+}
+
+/* SCHED: per task, base priority, period in us (0: woken by events) and, per
+ * iteration since the previous SCHED, count, mean/max own cycles and the
+ * shortest gap between releases; a task that is not measured shows "-".
+ * Then per ISR (the JITTER window) count, mean/max cycles and shortest gap.
+ * Waits for TX room, as the reply can outgrow the ring. RPI/sched_report.py
+ * turns it into a rate-monotonic check. */
+static const uint32_t wcet_period_us[W_TASKS] = {
+  [W_DEFAULT]  = 5000000u,
+  [W_SHOW]     = DISP_PERIOD_MS * 1000u,
+  [W_MOTOR]    = MC_PERIOD_MS * 1000u,
+  [W_ENCODER]  = ENC_SAMPLE_US,
+  [W_DISTANCE] = DIST_PERIOD_MS * 1000u,
+  [W_IMU]      = (uint32_t)(1e6f * IMU_BATCH / IMU_ODR_HZ),
+  [W_SERVO]    = (uint32_t)(1e6f * IMU_BATCH / IMU_ODR_HZ),
+  [W_IR]       = IR_PERIOD_MS * 1000u,
+};
+
+static void Sched_Report(void)
+{
+  static CCMRAM TaskStatus_t st[STATS_MAX_TASKS];
+  char b[96];
+
+  int len = snprintf(b, sizeof b, "SCHED CLOCK %lu\r\n", (unsigned long)SystemCoreClock);
+  uart3_write_wait(b, (uint16_t)len);
+  UBaseType_t n = uxTaskGetSystemState(st, STATS_MAX_TASKS, NULL);
+  for (UBaseType_t i = 0; i < n; i++) {
+    WcetTask *tag = (WcetTask *)(void *)xTaskGetApplicationTaskTag(st[i].xHandle);
+    if (tag == NULL) {
+      len = snprintf(b, sizeof b, "SCHED TASK %s P%u -\r\n", st[i].pcTaskName, (unsigned)st[i].uxBasePriority);
+      uart3_write_wait(b, (uint16_t)len);
+      continue;
+    }
+    WcetTask w;
+    taskENTER_CRITICAL();
+    w = *tag;
+    tag->n = tag->cycMax = tag->gapMin = 0;
+    tag->cycSum = 0;
+    taskEXIT_CRITICAL();
+    len = snprintf(b, sizeof b, "SCHED TASK %s P%u T%lu N%lu C%lu/%lu G%lu\r\n", st[i].pcTaskName,
+                   (unsigned)st[i].uxBasePriority, (unsigned long)wcet_period_us[tag - g_wcet],
+                   (unsigned long)w.n, (unsigned long)(w.n ? w.cycSum / w.n : 0),
+                   (unsigned long)w.cycMax, (unsigned long)w.gapMin);
+    uart3_write_wait(b, (uint16_t)len);
+  }
+  for (int id = 0; id < TI_ISRS; id++) {
+    taskENTER_CRITICAL();
+    WcetIsr is = g_isr_trace[id];
+    memset(&g_isr_trace[id], 0, sizeof(g_isr_trace[id]));
+    taskEXIT_CRITICAL();
+    len = snprintf(b, sizeof b, "SCHED ISR %s N%lu C%lu/%lu G%lu\r\n", g_isr_names[id], (unsigned long)is.n,
+                   (unsigned long)(is.n ? is.cycSum / is.n : 0), (unsigned long)is.cycMax,
+                   (unsigned long)is.gapMin);
+    uart3_write_wait(b, (uint16_t)len);
+  }
+  uart3_write_wait("ACK SCHED\r\n", 11);
+}
+
+/* PROF: per region (prof.h) since the previous PROF, count and min/mean/max
+ * cycles; "PROF OFF" if the build has PROF_ENABLE 0. */
+static void Prof_Report(void)
+{
+#if PROF_ENABLE
+  static const char *const names[PR_REGIONS] = {
+    "UART_RX", "PARSE", "DISPATCH", "GYRO", "IR", "MOTOR", "OLED"
+  };
+  char b[64];
+  for (int id = 0; id < PR_REGIONS; id++) {
+    ProfRegion r;
+    Prof_Take(&profRegions[id], &r);
+    int n = snprintf(b, sizeof b, "PROF %s N%lu C%lu/%lu/%lu\r\n", names[id], (unsigned long)r.n,
+                     (unsigned long)r.cycMin, (unsigned long)(r.n ? r.cycSum / r.n : 0),
+                     (unsigned long)r.cycMax);
+    uart3_write_wait(b, (uint16_t)n);
+  }
+#else
+  uart3_write_wait("PROF OFF\r\n", 10);
+#endif
+  uart3_write_wait("ACK PROF\r\n", 10);
+}
+
+/* CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF; bitwise is enough for 30 bytes */
+static uint16_t telem_crc16(const uint8_t *p, uint16_t n)
+{
+  uint16_t crc = 0xFFFF;
+  while (n--) {
+    crc ^= (uint16_t)(*p++) << 8;
+    for (int b = 0; b < 8; ++b)
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+  }
+  return crc;
+}
+
+static uint8_t *telem_put16(uint8_t *p, uint16_t v)
+{
+  p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+  return p + 2;
+}
+
+static uint8_t *telem_put32(uint8_t *p, uint32_t v)
+{
+  return telem_put16(telem_put16(p, (uint16_t)v), (uint16_t)(v >> 16));
+}
+
+static int16_t telem_sat16(float v)
+{
+  long x = lroundf(v);
+  return (int16_t)(x > 32767 ? 32767 : (x < -32768 ? -32768 : x));
+}
+
+/* TelemTimer callback (timer service task): one frame per expiry. A frame that
+ * finds the TX ring full is dropped like any other reply. */
+static void Telem_Send(void *argument)
+{
+  (void)argument;
+  uint8_t f[TELEM_FRAME_LEN];
+  uint8_t *p = f;
+  *p++ = TELEM_SYNC;
+  *p++ = TELEM_LEN;
+  *p++ = TELEM_TYPE;
+  p = telem_put32(p, HAL_GetTick());
+  p = telem_put32(p, (uint32_t)total_counts_A);
+  p = telem_put32(p, (uint32_t)total_counts_D);
+  p = telem_put16(p, (uint16_t)telem_sat16(rpsA * 1000.0f));
+  p = telem_put16(p, (uint16_t)telem_sat16(rpsD * 1000.0f));
+  // Signed duty from whichever H-bridge input is driven (see DriveForwardPWM)
+  p = telem_put16(p, (uint16_t)(int16_t)((int32_t)__HAL_TIM_GET_COMPARE(&htim4, TIM_CHANNEL_4)
+                                       - (int32_t)__HAL_TIM_GET_COMPARE(&htim4, TIM_CHANNEL_3)));
+  p = telem_put16(p, (uint16_t)(int16_t)((int32_t)__HAL_TIM_GET_COMPARE(&htim1, TIM_CHANNEL_3)
+                                       - (int32_t)__HAL_TIM_GET_COMPARE(&htim1, TIM_CHANNEL_4)));
+  p = telem_put32(p, (uint32_t)(int32_t)lroundf(yaw_angle_deg * 100.0f));
+  p = telem_put16(p, (uint16_t)telem_sat16(yaw_rate_dps * 100.0f));
+  p = telem_put16(p, g_ir_mm);
+  p = telem_put16(p, telem_crc16(&f[1], (uint16_t)(p - &f[1])));
+  uart3_write(f, (uint16_t)(p - f));
+}
+
+/* TELEM <hz>: 0 stops the stream; the period is rounded down to whole ms */
+static void Telem_Command(const char *arg)
+{
+  char *end;
+  long hz = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || hz < 0 || hz > TELEM_MAX_HZ || TelemTimerHandle == NULL) {
+    uart3_send("ERR TELEM\r\n");
+    return;
+  }
+  if (hz == 0) osTimerStop(TelemTimerHandle);
+  else osTimerStart(TelemTimerHandle, (uint32_t)(1000 / hz));
+  char b[24];
+  int n = snprintf(b, sizeof b, "ACK TELEM %ld\r\n", hz);
+  uart3_write(b, (uint16_t)n);
+}
+
+/* CmdTask: starts a record for the command it is about to dispatch */
+static void MotionTrace_Begin(uint8_t op, int32_t arg)
+{
+  taskENTER_CRITICAL();
+  mtrace_move_t *m = &g_mt_moves[g_mt_moves_head & MTRACE_MOVES_MASK];
+  m->start   = g_mt_head;
+  m->n       = 0;
+  m->tick_ms = HAL_GetTick();
+  m->arg     = arg;
+  m->op      = op;
+  g_mt_moves_head++;
+  g_mt_idle_ms = 0;
+  g_mt_open = 1;
+  taskEXIT_CRITICAL();
+}
+
+/* Whether a record is open: tickless idle waits until it closes */
+uint8_t MotionTrace_Recording(void)
+{
+  return g_mt_open && !g_mt_paused;
+}
+
+/* Linear sweep from f0 to f1 Hz over [t0, SYSID_MS) ms, at t ms */
+static float SysId_Chirp(uint32_t t, uint32_t t0, float f0, float f1)
+{
+  float s = (float)(t - t0) * 0.001f;
+  float T = (float)(SYSID_MS - t0) * 0.001f;
+  return sinf(2.0f * 3.1415926f * (f0 * s + 0.5f * (f1 - f0) / T * s * s));
+}
+
+/* Tick hook (SysTick, lowest priority), before the trace samples: sets the
+ * outputs for this ms of a running SYSID sequence */
+void SysId_Tick(void)
+{
+  if (g_sysid.state != SYSID_RUNNING) return;
+  uint32_t t = g_sysid.t_ms;
+  if (g_estop || t >= SYSID_MS) {
+    AllStop();
+    g_sysid.stopped = g_estop != 0;
+    g_sysid.state = SYSID_ENDED;
+    if (CmdTaskHandle != NULL) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR((TaskHandle_t)CmdTaskHandle, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    return;
+  }
+  int32_t amp = g_sysid.amp;
+  if (g_sysid.target == SYSID_S) {
+    float off = 0.0f;
+    if (g_sysid.seq == SYSID_STEP) off = (t >= 400u && t < 1100u) ? (float)amp : 0.0f;
+    else if (t >= 400u)            off = (float)amp * SysId_Chirp(t, 400u, 0.5f, 4.0f);
+    steer_write_us((uint16_t)(g_cal.v.steer_us_center - off + 0.5f));  // Fewer us is left
+    DriveForwardPWM(SYSID_STEER_PWM, SYSID_STEER_PWM);
+  } else {
+    int pwm;
+    if (g_sysid.seq == SYSID_STEP) pwm = t < 100u ? 0 : t < 900u ? amp : t < 1500u ? amp / 2 : 0;
+    else pwm = (int)((float)amp * (0.6f + (t < 200u ? 0.0f : 0.4f * SysId_Chirp(t, 200u, 0.5f, 8.0f))));
+    DriveForwardPWM(g_sysid.target == SYSID_A ? pwm : 0, g_sysid.target == SYSID_D ? pwm : 0);
+  }
+  g_sysid.t_ms = t + 1;
+}
+
+/* Tick hook (SysTick, lowest priority): drives a running CAL ODO and takes
+ * its samples into the fit */
+void OdoCal_Tick(void)
+{
+  odocal_t *o = &g_odocal;
+  if (o->state != ODOCAL_RUNNING) return;
+  uint32_t t = o->t_ms;
+  uint16_t r = g_ir_mm;
+  if (g_estop || t >= ODO_MAX_MS || (t >= ODO_SETTLE_MS && r < ODO_NEAR_MM)) {
+    AllStop();
+    o->stopped = g_estop != 0;
+    o->state = ODOCAL_ENDED;
+    if (CmdTaskHandle != NULL) {
+      BaseType_t woken = pdFALSE;
+      vTaskNotifyGiveFromISR((TaskHandle_t)CmdTaskHandle, &woken);
+      portYIELD_FROM_ISR(woken);
+    }
+    return;
+  }
+  DriveForwardPWM(o->pwm + (int)g_cal.v.bias_a, o->pwm + (int)g_cal.v.bias_d);
+  if (t >= ODO_SETTLE_MS && t % ODO_SAMPLE_MS == 0u && r <= ODO_FAR_MM) {
+    // Welford's update, for the means and the sums about them
+    float c  = 0.5f * (float)(abs(total_counts_A) + abs(total_counts_D));
+    float dc = c - o->mean_c, dr = (float)r - o->mean_r;
+    o->n++;
+    o->mean_c += dc / (float)o->n;
+    o->mean_r += dr / (float)o->n;
+    o->s_cc += dc * (c - o->mean_c);
+    o->s_cr += dc * ((float)r - o->mean_r);
+    o->s_rr += dr * ((float)r - o->mean_r);
+  }
+  o->t_ms = t + 1;
+}
+
+/* Tick hook (SysTick, lowest priority): one sample while a record is open */
+void MotionTrace_Tick(void)
+{
+  if (!g_mt_open || g_mt_paused) return;
+  if (motionActive || g_steer_cmd.busy || g_steer_cmd.pending || g_sysid.state != SYSID_IDLE) g_mt_idle_ms = 0;
+  else if (++g_mt_idle_ms > MTRACE_TAIL_MS) {
+    g_mt_open = 0;
+    return;
+  }
+  uint32_t head = g_mt_head;
+  mtrace_sample_t *s = &g_mt_ring[head & MTRACE_MASK];
+  s->pwm_a    = (int16_t)((int32_t)__HAL_TIM_GET_COMPARE(&htim4, TIM_CHANNEL_4)
+                          - (int32_t)__HAL_TIM_GET_COMPARE(&htim4, TIM_CHANNEL_3));
+  s->pwm_d    = (int16_t)((int32_t)__HAL_TIM_GET_COMPARE(&htim1, TIM_CHANNEL_3)
+                          - (int32_t)__HAL_TIM_GET_COMPARE(&htim1, TIM_CHANNEL_4));
+  s->cnt_a    = (uint16_t)Encoder_Count(ENCODER_A);
+  s->cnt_d    = (uint16_t)Encoder_Count(ENCODER_D);
+  s->rps_a    = telem_sat16(rpsA * 1000.0f);
+  s->rps_d    = telem_sat16(rpsD * 1000.0f);
+  s->yaw      = telem_sat16(angle_wrap_180(yaw_angle_deg) * 100.0f);
+  s->servo_us = (uint16_t)MOTOR_CORE_CCR(BOARD_SERVO_TIM, BOARD_SERVO_CH);
+  g_mt_head = head + 1;
+  g_mt_moves[(g_mt_moves_head - 1) & MTRACE_MOVES_MASK].n++;
+}
+
+/* Frames the TYPE..payload in body and queues it, waiting for ring space:
+ * a dump is far larger than the TX ring */
+static void mtrace_send(uint8_t *f, uint16_t body_len)
+{
+  f[0] = TELEM_SYNC;
+  f[1] = (uint8_t)body_len;
+  telem_put16(&f[2 + body_len], telem_crc16(&f[1], (uint16_t)(1 + body_len)));
+  uart3_write_wait(f, (uint16_t)(2 + body_len + 2));
+}
+
+/* MTRACE <n>: sends the last n move records (UartRxTask). A move started
+ * while the dump runs is not recorded. */
+static void MotionTrace_Command(const char *arg)
+{
+  static uint8_t f[2 + 5 + MTRACE_CHUNK * sizeof(mtrace_sample_t) + 2];
+  char *end;
+  long want = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || want < 1 || want > (long)MTRACE_MOVES) {
+    uart3_send("ERR MTRACE\r\n");
+    return;
+  }
+  taskENTER_CRITICAL();
+  uint8_t busy = g_mt_open || motionActive || g_steer_cmd.busy || g_steer_cmd.pending
+              || g_sysid.state != SYSID_IDLE;
+  if (!busy) g_mt_paused = 1;
+  uint32_t moves_head = g_mt_moves_head;
+  uint32_t head = g_mt_head;
+  taskEXIT_CRITICAL();
+  if (busy) {
+    uart3_send("ERR MTRACE BUSY\r\n");
+    return;
+  }
+
+  uint32_t moves = (uint32_t)want;
+  if (moves > moves_head) moves = moves_head;
+  for (uint32_t k = 0; k < moves; k++) {
+    const mtrace_move_t *m = &g_mt_moves[(moves_head - moves + k) & MTRACE_MOVES_MASK];
+    uint8_t *p = &f[2];
+    *p++ = MTRACE_TYPE_MOVE;
+    *p++ = (uint8_t)k;
+    *p++ = (uint8_t)moves;
+    *p++ = m->op;
+    p = telem_put32(p, (uint32_t)m->arg);
+    p = telem_put32(p, m->tick_ms);
+    p = telem_put16(p, (uint16_t)(m->n > 0xFFFF ? 0xFFFF : m->n));
+    mtrace_send(f, MTRACE_MOVE_LEN);
+
+    // Older samples of this move are gone if the ring has wrapped past them
+    uint32_t first = head - m->start > MTRACE_SAMPLES ? head - MTRACE_SAMPLES : m->start;
+    uint32_t stop  = m->start + m->n;
+    while ((int32_t)(stop - first) > 0) {
+      uint32_t count = stop - first < MTRACE_CHUNK ? stop - first : MTRACE_CHUNK;
+      p = &f[2];
+      *p++ = MTRACE_TYPE_DATA;
+      *p++ = (uint8_t)k;
+      p = telem_put16(p, (uint16_t)(first - m->start));
+      for (uint32_t i = 0; i < count; i++) {
+        memcpy(p, &g_mt_ring[(first + i) & MTRACE_MASK], sizeof(mtrace_sample_t));
+        p += sizeof(mtrace_sample_t);
+      }
+      mtrace_send(f, (uint16_t)(p - &f[2]));
+      first += count;
+    }
+  }
+  g_mt_paused = 0;
+  char b[24];
+  int n = snprintf(b, sizeof b, "ACK MTRACE %lu\r\n", (unsigned long)moves);
+  uart3_write(b, (uint16_t)n);
+}
+
+/* KTRACE <n>: sends the newest n kernel trace events (UartRxTask). The
+ * switches the dump itself causes are not recorded. */
+static void KernelTrace_Command(const char *arg)
+{
+  static uint8_t f[2 + 3 + KTRACE_CHUNK * sizeof(ktrace_event_t) + 2];
+  char *end;
+  long want = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || want < 1 || want > (long)KTRACE_EVENTS) {
+    uart3_send("ERR KTRACE\r\n");
+    return;
+  }
+  taskENTER_CRITICAL();
+  g_kt_paused = 1;
+  uint32_t head = g_kt_head;
+  uint32_t tick = HAL_GetTick();
+  uint32_t cyc  = DWT->CYCCNT;
+  taskEXIT_CRITICAL();
+
+  uint32_t kept = head < KTRACE_EVENTS ? head : KTRACE_EVENTS;
+  uint32_t events = (uint32_t)want < kept ? (uint32_t)want : kept;
+  uint8_t *p = &f[2];
+  *p++ = KTRACE_TYPE_HEAD;
+  p = telem_put16(p, (uint16_t)events);
+  p = telem_put32(p, head - kept);
+  p = telem_put32(p, tick);
+  p = telem_put32(p, cyc);
+  p = telem_put16(p, (uint16_t)(SystemCoreClock / 1000000u));
+  mtrace_send(f, KTRACE_HEAD_LEN);
+
+  for (uint32_t first = 0; first < events; ) {
+    uint32_t count = events - first < KTRACE_CHUNK ? events - first : KTRACE_CHUNK;
+    p = &f[2];
+    *p++ = KTRACE_TYPE_DATA;
+    p = telem_put16(p, (uint16_t)first);
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(p, &g_kt_ring[(head - events + first + i) & KTRACE_MASK], sizeof(ktrace_event_t));
+      p += sizeof(ktrace_event_t);
+    }
+    mtrace_send(f, (uint16_t)(p - &f[2]));
+    first += count;
+  }
+  g_kt_head = 0;   // A gap in the events would read as one long slice
+  g_kt_paused = 0;
+  char b[24];
+  int n = snprintf(b, sizeof b, "ACK KTRACE %lu\r\n", (unsigned long)events);
+  uart3_write(b, (uint16_t)n);
+}
+
+/* One complete line from USART3: trim, uppercase, parse and queue it */
+static void Uart3_QueueLine(const char *line)
+{
+  const char *p = line;
+  while (*p==' '||*p=='\t') ++p;
+
+  char cmd[32];
+  size_t i = 0;
+  while (i < sizeof(cmd)-1 && p[i]) {
+    cmd[i] = (char)toupper((unsigned char)p[i]);
+    ++i;
+  }
+  cmd[i] = '\0';
+
+  if (cmd[0] == '\0') return;
+  if (strcmp(cmd, "STATS") == 0) {
+    Stats_Report();
+    return;
+  }
+  if (strcmp(cmd, "JITTER") == 0) {
+    Jitter_Report();
+    return;
+  }
+  if (strcmp(cmd, "SCHED") == 0) {
+    Sched_Report();
+    return;
+  }
+  if (strcmp(cmd, "PROF") == 0) {
+    Prof_Report();
+    return;
+  }
+  if (strncmp(cmd, "TELEM ", 6) == 0) {
+    Telem_Command(cmd + 6);
+    return;
+  }
+  if (strncmp(cmd, "MTRACE ", 7) == 0) {
+    MotionTrace_Command(cmd + 7);
+    return;
+  }
+  if (strncmp(cmd, "KTRACE ", 7) == 0) {
+    KernelTrace_Command(cmd + 7);
+    return;
+  }
+  cmd_rec_t rec;
+  PROF_BEGIN(PR_PARSE);
+  Cmd_Parse(cmd, &rec);
+  PROF_END(PR_PARSE);
+  if (cmdq_push(&rec) != 0) {
+    uart3_send("BUSY\r\n");
+    return;
+  }
+  CmdTask_Notify();
+}
+
+/* USER CODE END 4 */
+
+/* USER CODE BEGIN Header_StartDefaultTask */
+/**
+  * @brief  Function implementing the defaultTask thread.
+  * @param  argument: Not used
+  * @retval None
+  */
+/* USER CODE END Header_StartDefaultTask */
+void StartDefaultTask(void *argument)
+{
+  /* USER CODE BEGIN 5 */
+  /* Infinite loop */
+  uint8_t ch = 'A';
+  Wcet_Register(&g_wcet[W_DEFAULT]);
+  for(;;)
+  {
+	Wcet_Begin(&g_wcet[W_DEFAULT]);
+	uart3_write(&ch, 1);
+	if(ch < 'Z')
+		ch++;
+	else ch ='A';
+    HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
+    Wcet_End(&g_wcet[W_DEFAULT]);
+    osDelay(5000);
+  }
+  /* USER CODE END 5 */
+}
+
+/* UartRxTask: every line before the stop byte has been queued. Hands CmdTask
+ * the point up to which cmdq is stale. */
+static void Estop_MarkQueue(void)
+{
+  g_estop_head = cmdq_head;
+  __DMB();
+  g_estop = ESTOP_FLUSH;
+  CmdTask_Notify();
+}
+
+/* Starts one queued command if the robot is free. Returns the ms to wait before
+ * trying again (cooldown), 0 after a dispatch, or portMAX_DELAY when nothing can
+ * start until CmdTask is notified. */
+static TickType_t CommandQueue_TryDispatch(void)
+{
+  if (g_estop == ESTOP_FLUSH) {
+    char b[32];
+    cmdq_drop_to(g_estop_head);
+    g_blend.into_turn = 0;
+    g_blend.into_move = 0;
+    g_blend.presteered = 0;
+    int n = snprintf(b, sizeof b, "STOPPED %s %d\r\n", g_estop_kind, g_estop_left);
+    taskENTER_CRITICAL();
+    if (g_estop == ESTOP_FLUSH) g_estop = 0;  // Not if another stop byte has come in since
+    taskEXIT_CRITICAL();
+    uart3_write(b, (uint16_t)n);
+  }
+  if (g_sysid.state == SYSID_ENDED) SysId_Finish();
+  if (g_odocal.state == ODOCAL_ENDED) OdoCal_Finish();
+  if (g_estop) return portMAX_DELAY;  // UartRxTask has still to reach the stop byte
+  // pending covers a turn handed over but not yet latched by ServoMotorTask
+  if (motionActive || g_steer_cmd.busy || g_steer_cmd.pending) return portMAX_DELAY;
+  if (g_sysid.state != SYSID_IDLE) return portMAX_DELAY;  // SysId_Tick wakes it at the end
+  if (g_odocal.state != ODOCAL_IDLE) return portMAX_DELAY;  // So does OdoCal_Tick
+  if (cmdq_empty()) return portMAX_DELAY;
+
+  // NEW: respect cooldown window
+  uint32_t now = HAL_GetTick();
+  if ((int32_t)(g_cmd_cooldown_until_ms - now) > 0) return pdMS_TO_TICKS(g_cmd_cooldown_until_ms - now);
+
+  cmd_rec_t rec;
+  if (cmdq_pop(&rec) != 0) return portMAX_DELAY;
+
+  cmd_rec_t next;
+  int has_next = CMD_BLEND && cmdq_peek(&next) == 0;
+  uint8_t blended_in = g_blend.into_turn;
+  uint8_t presteered = g_blend.presteered;
+  g_blend.into_turn = 0;
+  g_blend.presteered = 0;
+  g_blend.into_move = 0;
+
+  if (rec.op <= CMD_MOVE_BACK) MotionTrace_Begin(rec.op, rec.arg);
+
+  int rc = 0;
+  switch (rec.op) {
+  case CMD_TURN: {
+    float delta = (float)rec.arg;
+    // Part of the turn already happened while pre-steering
+    if (blended_in && presteered) delta -= smallest_err_deg(yaw_angle_deg, g_blend.yaw_ref);
+    g_blend.into_move = has_next && next.op == CMD_MOVE_FWD;
+    rc = Servo_RequestBangBangTurn(delta, 0, Speed_ClassCms(rec.field));
+    break;
+  }
+  case CMD_TURN_REV:  rc = Servo_RequestBangBangTurnRev((float)rec.arg, 0, Speed_ClassCms(rec.field)); break;
+  case CMD_TURN_ABS:  rc = Servo_RequestTurnTo((float)rec.arg); break;
+  case CMD_PARAM:     Gains_Command(&rec); return 0;
+  case CMD_CAL:       Cal_Command(&rec); return 0;
+  case CMD_SYSID:     SysId_Start(&rec); return 0;
+  case CMD_ODOCAL:    OdoCal_Start(&rec); return 0;
+  case CMD_MOVE_FWD:
+  case CMD_MOVE_BACK: {
+    char b[32];
+    int n = snprintf(b, sizeof b, "ACK %s %d\r\n", rec.op == CMD_MOVE_FWD ? "FW" : "BW", rec.arg);
+    uart3_write(b, (uint16_t)n);
+    int total = rec.arg;
+    while (has_next && next.op == rec.op && next.field == rec.field && total + next.arg <= 32767) {
+      cmdq_pop(&next);
+      total += next.arg;
+      n = snprintf(b, sizeof b, "ACK %s %d\r\n", rec.op == CMD_MOVE_FWD ? "FW" : "BW", next.arg);
+      uart3_write(b, (uint16_t)n);
+      has_next = cmdq_peek(&next) == 0;
+    }
+    if (rec.op == CMD_MOVE_FWD && has_next && next.op == CMD_TURN) {
+      g_blend.turn_left = next.arg > 0;
+      g_blend.into_turn = 1;
+    }
+    StartMoveCM(total, rec.op == CMD_MOVE_FWD ? DIR_FWD : DIR_BACK, Speed_ClassCms(rec.field));
+    return 0;
+  }
+  default:            uart3_send(CMD_REPLY[rec.sub]); return 0;
+  }
+  if (rc != 0) g_blend.into_move = 0;
+  uart3_send(rc == 0 ? CMD_REPLY[rec.sub] : "BUSY\r\n");
+  return 0;
+}
+
+/* Posts a display row update; never blocks the caller */
+static void Display_Post(uint8_t row, uint8_t kind, int32_t value, const char *text)
+{
+  disp_msg_t m = { .row = row, .kind = kind, .value = value };
+  strncpy(m.text, text, sizeof(m.text));
+  if (DisplayQueueHandle) osMessageQueuePut(DisplayQueueHandle, &m, 0, 0);
+}
+
+static void Display_Text(uint8_t row, const char *text)
+{
+  Display_Post(row, DISP_TEXT, 0, text);
+}
+
+/* label followed by v as "%7.2f" */
+static void Display_Value(uint8_t row, const char *label, float v)
+{
+  Display_Post(row, DISP_CENTI, (int32_t)lroundf(v * 100.0f), label);
+}
+
+/* ShowTask side: one message to a row of text, non-printables as spaces */
+static void Display_Format(char *row, const disp_msg_t *m)
+{
+  char text[DISP_COLS + 1];
+  memcpy(text, m->text, DISP_COLS);
+  text[DISP_COLS] = '\0';
+  if (m->kind == DISP_CENTI) {
+    char num[16];
+    uint32_t mag = (uint32_t)(m->value < 0 ? -(int64_t)m->value : m->value);
+    snprintf(num, sizeof(num), "%s%lu.%02lu", m->value < 0 ? "-" : "",
+             (unsigned long)(mag / 100u), (unsigned long)(mag % 100u));
+    snprintf(row, DISP_COLS + 1, "%s%7s", text, num);
+  } else {
+    snprintf(row, DISP_COLS + 1, "%s", text);
+  }
+  for (char *c = row; *c; c++)
+    if (*c < ' ' || *c > '~') *c = ' ';
+}
+
+/* === Encoder samples ===================================================== */
+/* One sample into the running totals and the wheel speeds: dA/dD counts since
+ * the last sample, and spanA/spanD counts over span_cyc cycles for the speeds
+ * (the same counts, unless FUSED_CTL). From EncoderTask, or the fused step. */
+static void Enc_Publish(int32_t dA, int32_t dD, int32_t spanA, int32_t spanD, uint32_t span_cyc)
+{
+#if FIXED_POINT_CTL
+  // The only writer, and each value is one word: no critical section
+  total_counts_A += dA;
+  total_counts_D += dD;
+  distance_cm_A  = (float)total_counts_A * CM_PER_COUNT;
+  distance_cm_D  = (float)total_counts_D * CM_PER_COUNT;
+
+  // Counts/s over span_cyc; the speed loop reads these
+  cpsA_q16 = Q16_Sat(((int64_t)abs(spanA) << Q16_SHIFT) * SystemCoreClock / span_cyc);
+  cpsD_q16 = Q16_Sat(((int64_t)abs(spanD) << Q16_SHIFT) * SystemCoreClock / span_cyc);
+  rpsA = Q16_ToFloat(cpsA_q16) / COUNTS_PER_REV;
+  rpsD = Q16_ToFloat(cpsD_q16) / COUNTS_PER_REV;
+#else
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+  total_counts_A += dA;
+  total_counts_D += dD;
+  distance_cm_A  = (float)total_counts_A * CM_PER_COUNT;
+  distance_cm_D  = (float)total_counts_D * CM_PER_COUNT;
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+
+  // RPS over span_cyc
+  float per_s = (float)SystemCoreClock / (float)span_cyc;
+  rpsA = fabsf((float)spanA) * per_s / (float)COUNTS_PER_REV;
+  rpsD = fabsf((float)spanD) * per_s / (float)COUNTS_PER_REV;
+#endif
+}
+
+/* Counts from then to now on a counter of mod counts, either way round */
+static inline int32_t Enc_Delta(uint32_t now, uint32_t then, int32_t mod)
+{
+  int32_t d = (int32_t)now - (int32_t)then;
+  if      (d >  (mod/2)) d -= mod;
+  else if (d < -(mod/2)) d += mod;
+  return d;
+}
+
+/* Locks the steering toward a blended turn while the move still drives
+ * straight, BLEND_PRESTEER_CM before its end. */
+static void Move_Presteer(float travelled_cm)
+{
+  if (motionActive && g_blend.into_turn && !g_blend.presteered
+      && travelled_cm >= (float)(targetdistance_cm + MOVE_BRAKE_COMP_CM - BLEND_PRESTEER_CM))
+  {
+    g_blend.yaw_ref = yaw_angle_deg;
+    g_blend.presteered = 1;
+    g_hhold.trimmed = 0;        // the turn owns the servo from here
+    steer_write_us(g_blend.turn_left ? STEER_US_LEFT : STEER_US_RIGHT);
+  }
+}
+
+/* === Speed loop ========================================================== */
+/* One MotorTask tick of the wheel control, split out of motor() so the host
+ * bench (Common/Host/mdp_bench.c) can replay recorded telemetry through the
+ * same code. Reads rpsA/rpsD, the travelled distance and the yaw; writes
+ * pwmA_val/pwmD_val and the motors while a move runs. */
+typedef struct {
+#if FIXED_POINT_CTL
+  q16_t integA, integD;     // per-wheel speed PI integrals (PWM units)
+  q16_t cmsA_f, cmsD_f;     // wheel speeds through g_filt_rps_q16, cm/s
+  biquad_q16_t filtA, filtD;
+#else
+#if VP_ENABLE
+  float integA, integD;     // per-wheel speed PI integrals (PWM units)
+#else
+  float integ;
+  float prevErr;
+  int   pwmBase;            // your feed-forward
+#endif
+  float rpsA_f, rpsD_f;     // RPS through g_filt_rps
+  biquad_t filtA, filtD;
+#endif
+} motor_ctl_t;
+
+#if FIXED_POINT_CTL
+#define VP_PWM_STATIC_Q16    Q16_C(VP_PWM_STATIC)
+#define VP_PWM_PER_CMS_Q16   Q16_C(VP_PWM_PER_CMS)
+#define VP_I_MAX_Q16         Q16_C(VP_I_MAX)
+#endif
+
+static void MotorCtl_Init(motor_ctl_t *c)
+{
+  memset(c, 0, sizeof(*c));
+#if !VP_ENABLE
+  c->pwmBase = 5000;
+#endif
+}
+
+static void MotorCtl_Step(motor_ctl_t *c, float dt)
+{
+#if FIXED_POINT_CTL
+  // filtered wheel speeds, counts/s to cm/s
+  c->cmsA_f = Biquad_StepQ16(&g_filt_rps_q16, &c->filtA, Q16_Mul(cpsA_q16, g_cm_per_count_q16));
+  c->cmsD_f = Biquad_StepQ16(&g_filt_rps_q16, &c->filtD, Q16_Mul(cpsD_q16, g_cm_per_count_q16));
+#else
+  // filtered RPS
+  c->rpsA_f = Biquad_Step(&g_filt_rps, &c->filtA, rpsA);
+  c->rpsD_f = Biquad_Step(&g_filt_rps, &c->filtD, rpsD);
+#endif
+
+#if VP_ENABLE
+  if (motionActive) {
+#if FIXED_POINT_CTL
+    float travelled = 0.5f * (float)(abs(total_counts_A) + abs(total_counts_D)) * CM_PER_COUNT;
+#else
+    float travelled = 0.5f * (fabsf(distance_cm_A) + fabsf(distance_cm_D));
+#endif
+    float v_sp = VelProfile_Step(travelled, dt);
+    gain_row_t g;
+    Gains_At(v_sp, &g);
+
+    // Outer: heading error (+ = needs to turn left) -> servo trim, speed split
+    float s     = (dir == DIR_FWD) ? 1.0f : -1.0f;
+    float h_err = smallest_err_deg(g_hhold.yaw_ref, yaw_angle_deg);
+    float dv    = s * g.hh_kp_diff * h_err;
+    if (dv >  HH_DIFF_MAX_CMS) dv =  HH_DIFF_MAX_CMS;
+    if (dv < -HH_DIFF_MAX_CMS) dv = -HH_DIFF_MAX_CMS;
+    if (!g_blend.presteered) {
+      float trim = s * (g.hh_kp_steer * h_err - HH_KD_STEER * yaw_rate_dps);
+      if (trim >  HH_STEER_MAX_DEG) trim =  HH_STEER_MAX_DEG;
+      if (trim < -HH_STEER_MAX_DEG) trim = -HH_STEER_MAX_DEG;
+      steer_write_us((uint16_t)(g_cal.v.steer_us_center - trim * (600.0f / 36.0f)));
+      g_hhold.trimmed = 1;
+    }
+
+    // Inner: PI per wheel; D is the right-hand wheel
+    float spA = v_sp - 0.5f * dv;
+    float spD = v_sp + 0.5f * dv;
+#if FIXED_POINT_CTL
+    // The profile and gain schedule stay in cm/s; they cross into Q16 here
+    q16_t kp    = Q16_FromFloat(g.vp_kp);
+    q16_t ki_dt = Q16_FromFloat(g.vp_ki * dt);
+    q16_t qA    = Q16_FromFloat(spA);
+    q16_t qD    = Q16_FromFloat(spD);
+    q16_t eA    = Q16_Sub(qA, c->cmsA_f);
+    q16_t eD    = Q16_Sub(qD, c->cmsD_f);
+    c->integA = Q16_Clamp(Q16_Add(c->integA, Q16_Mul(eA, ki_dt)), -VP_I_MAX_Q16, VP_I_MAX_Q16);
+    c->integD = Q16_Clamp(Q16_Add(c->integD, Q16_Mul(eD, ki_dt)), -VP_I_MAX_Q16, VP_I_MAX_Q16);
+    q16_t outA  = Q16_Add(Q16_Add(VP_PWM_STATIC_Q16, Q16_Mul(VP_PWM_PER_CMS_Q16, qA)),
+                          Q16_Add(Q16_Mul(kp, eA), c->integA));
+    q16_t outD  = Q16_Add(Q16_Add(VP_PWM_STATIC_Q16, Q16_Mul(VP_PWM_PER_CMS_Q16, qD)),
+                          Q16_Add(Q16_Mul(kp, eD), c->integD));
+    pwmA_val = Q16_ToInt(outA) + (int)g_cal.v.bias_a;
+    pwmD_val = Q16_ToInt(outD) + (int)g_cal.v.bias_d;
+#else
+    float eA  = spA - c->rpsA_f * WHEEL_CM_PER_REV;
+    float eD  = spD - c->rpsD_f * WHEEL_CM_PER_REV;
+    c->integA += eA * (g.vp_ki * dt);
+    c->integD += eD * (g.vp_ki * dt);
+    if (c->integA > VP_I_MAX) c->integA = VP_I_MAX;
+    if (c->integA < -VP_I_MAX) c->integA = -VP_I_MAX;
+    if (c->integD > VP_I_MAX) c->integD = VP_I_MAX;
+    if (c->integD < -VP_I_MAX) c->integD = -VP_I_MAX;
+    pwmA_val = (int)(VP_PWM_STATIC + VP_PWM_PER_CMS * spA + g.vp_kp * eA + c->integA) + (int)g_cal.v.bias_a;
+    pwmD_val = (int)(VP_PWM_STATIC + VP_PWM_PER_CMS * spD + g.vp_kp * eD + c->integD) + (int)g_cal.v.bias_d;
+#endif
+  }
+#else
+  // error = A - D (want 0)
+  float err = c->rpsA_f - c->rpsD_f;
+  gain_row_t g;
+  Gains_At(g_gs.cruise_cms, &g);
+
+  // dt-scaled PI(D)
+  c->integ += err * (g.ki_diff * dt);         // integral in PWM units
+  if (c->integ > I_MAX) c->integ = I_MAX;
+  if (c->integ < -I_MAX) c->integ = -I_MAX;
+
+  float p = g.kp_diff * err;
+  float d = KD_DIFF * (err - c->prevErr) / dt; // 0 if KD=0
+  float corr = p + c->integ + d;
+  c->prevErr = err;
+
+  // apply symmetric correction + biases
+  pwmA_val = c->pwmBase - (int)corr + (int)g_cal.v.bias_a;
+  pwmD_val = c->pwmBase + (int)corr + (int)g_cal.v.bias_d;
+#endif
+
+  // clamp
+  if (pwmA_val < PWM_MIN_CLAMP) pwmA_val = PWM_MIN_CLAMP;
+  if (pwmA_val > PWM_MAX_CLAMP) pwmA_val = PWM_MAX_CLAMP;
+  if (pwmD_val < PWM_MIN_CLAMP) pwmD_val = PWM_MIN_CLAMP;
+  if (pwmD_val > PWM_MAX_CLAMP) pwmD_val = PWM_MAX_CLAMP;
+
+  if (motionActive) {
+    // direction-aware drive
+    if (dir == DIR_FWD) {
+      DriveForwardPWM(pwmA_val, pwmD_val);
+    } else {
+      DriveBackwardPWM(pwmA_val, pwmD_val);
+    }
+  } else {
+#if VP_ENABLE
+    c->integA = c->integD = 0; // reset integrals when idle
+#else
+    c->integ = 0.0f; // reset integral when idle
+    c->prevErr = 0.0f;
+#endif
+    if (g_hhold.trimmed) {
+      steer_center();
+      g_hhold.trimmed = 0;
+    }
+  }
+}
+
+#if FUSED_CTL
+/* The fused step's state: the last FUSED_CTL_SPAN latches, oldest at head */
+static struct {
+  uint32_t cntA[FUSED_CTL_SPAN], cntD[FUSED_CTL_SPAN], cyc[FUSED_CTL_SPAN];
+  uint8_t  head;
+  uint8_t  primed;
+  uint32_t steps;
+  uint64_t elapsed_cyc;
+  motor_ctl_t ctl;
+} g_fused;
+
+/* TIM7's ISR, every 1/FUSED_CTL_HZ s: see FUSED_CTL */
+static void Fused_Step(uint32_t cntA, uint32_t cntD, uint32_t cyc)
+{
+  const int32_t  modA = (int32_t)__HAL_TIM_GET_AUTORELOAD(&htim2) + 1;
+  const int32_t  modD = (int32_t)__HAL_TIM_GET_AUTORELOAD(&htim5) + 1;
+  const uint32_t cyc_per_us = SystemCoreClock / 1000000u;
+
+  if (!g_fused.primed) {
+    // The first latch only sets the reference
+    for (uint8_t i = 0; i < FUSED_CTL_SPAN; i++) {
+      g_fused.cntA[i] = cntA;
+      g_fused.cntD[i] = cntD;
+      g_fused.cyc[i]  = cyc;
+    }
+    MotorCtl_Init(&g_fused.ctl);
+    g_fused.primed = 1;
+    return;
+  }
+  const uint8_t last = (uint8_t)((g_fused.head + FUSED_CTL_SPAN - 1u) % FUSED_CTL_SPAN);
+  uint32_t dcyc = cyc - g_fused.cyc[last];
+  uint32_t span_cyc = cyc - g_fused.cyc[g_fused.head];
+  if (dcyc == 0 || span_cyc == 0) return;
+
+  // Sense: counts since the last step, speeds over the span
+  Enc_Publish(Enc_Delta(cntA, g_fused.cntA[last], modA), Enc_Delta(cntD, g_fused.cntD[last], modD),
+              Enc_Delta(cntA, g_fused.cntA[g_fused.head], modA),
+              Enc_Delta(cntD, g_fused.cntD[g_fused.head], modD), span_cyc);
+  g_fused.cntA[g_fused.head] = cntA;
+  g_fused.cntD[g_fused.head] = cntD;
+  g_fused.cyc[g_fused.head]  = cyc;
+  g_fused.head = (uint8_t)((g_fused.head + 1u) % FUSED_CTL_SPAN);
+  g_fused.elapsed_cyc += dcyc;
+  enc_dt_us     = span_cyc / cyc_per_us;
+  enc_sample_us = (uint32_t)(g_fused.elapsed_cyc / cyc_per_us);
+
+  // Stop: the same checks DistanceTask makes, on this sample
+  if (motionActive) {
+    float travelled = 0.5f * (fabsf(distance_cm_A) + fabsf(distance_cm_D));
+    Move_Presteer(travelled);
+    if (travelled >= (float)(targetdistance_cm + (g_blend.into_turn ? MOVE_BRAKE_COMP_CM : 0))) {
+      Move_EndFromISR();
+    }
+  }
+
+  // Control and actuate; a turn in progress owns the wheels
+  if (!g_steer_cmd.busy) {
+    PROF_BEGIN(PR_MOTOR);
+    MotorCtl_Step(&g_fused.ctl, (float)dcyc / (float)SystemCoreClock);
+    PROF_END(PR_MOTOR);
+  }
+
+  if (++g_fused.steps % FUSED_CTL_SPAN == 0 && EncoderTaskHandle != NULL) {
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR((TaskHandle_t)EncoderTaskHandle, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
+}
+#endif
+
+/* USER CODE BEGIN Header_show */
+/**
+* @brief Function implementing the ShowTask thread.
+* @param argument: Not used
+* @retval None
+*/
+/* USER CODE END Header_show */
+void show(void *argument)
+{
+  /* USER CODE BEGIN show */
+  static char rows[DISP_ROWS][DISP_COLS + 1];
+  char       line[DISP_COLS + 1];
+  disp_msg_t m;
+  uint8_t    changed = 0;
+  uint32_t   next = osKernelGetTickCount();
+  Wcet_Register(&g_wcet[W_SHOW]);
+
+  /* Infinite loop */
+  for(;;)
+  {
+    if (!changed) {
+      /* Nothing to draw: sleep until a row changes */
+      if (osMessageQueueGet(DisplayQueueHandle, &m, NULL, osWaitForever) == osOK && m.row < DISP_ROWS) {
+        Display_Format(rows[m.row], &m);
+        changed = 1;
+      }
+      continue;
+    }
+    uint32_t now  = osKernelGetTickCount();
+    int32_t  wait = (int32_t)(next - now);
+    if (wait > 0) {
+      if (osMessageQueueGet(DisplayQueueHandle, &m, NULL, (uint32_t)wait) == osOK && m.row < DISP_ROWS) {
+        Display_Format(rows[m.row], &m);
+        changed = 1;
+      }
+      continue;
+    }
+    next = now + pdMS_TO_TICKS(DISP_PERIOD_MS);
+    Wcet_Begin(&g_wcet[W_SHOW]);   // a redraw; taking a row off the queue is not counted
+
+    /* Rows are padded to full width, so no OLED_Clear() is needed */
+    for (uint8_t r = 0; r < DISP_ROWS; r++) {
+      snprintf(line, sizeof(line), "%-*s", DISP_COLS, rows[r]);
+      OLED_ShowString(0, r * 16, (uint8_t *)line);
+    }
+    PROF_BEGIN(PR_OLED);
+    OLED_Refresh_Gram();
+    PROF_END(PR_OLED);
+    changed = 0;
+    Wcet_End(&g_wcet[W_SHOW]);
+  }
+  /* USER CODE END show */
+}
+
+/* USER CODE BEGIN Header_motor */
+/**
+* @brief Function implementing the MotorTask thread.
+* @param argument: Not used
+* @retval None
+*/
+/* USER CODE END Header_motor */
+void motor(void *argument)
+{
+  /* USER CODE BEGIN motor */
+  const TickType_t period = pdMS_TO_TICKS(MC_PERIOD_MS);
+  TickType_t tick = xTaskGetTickCount();
+  motor_ctl_t ctl;
+  MotorCtl_Init(&ctl);
+  uint32_t last_ms = HAL_GetTick();
+  Wcet_Register(&g_wcet[W_MOTOR]);
+#if FUSED_CTL
+  for (;;) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);   // the fused step runs the speed loop
+#endif
+  /* Infinite loop */
+  for(;;)
+  {
+    vTaskDelayUntil(&tick, period);
+    Trace_Wake(TR_MOTOR);
+    // --- ADD THIS GUARD ---
+    if (g_steer_cmd.busy) {
+        AllStop();
+        Trace_End(TR_MOTOR);
+        continue;   // skip rest of loop until steering done
+    }
+    // dt (s)
+    uint32_t now_ms = HAL_GetTick();
+    float dt = (float)(now_ms - last_ms) / 1000.0f;
+    if (dt <= 0.0f) dt = (float)MC_PERIOD_MS / 1000.0f;
+    last_ms = now_ms;
+
+    PROF_BEGIN(PR_MOTOR);
+    MotorCtl_Step(&ctl, dt);
+    PROF_END(PR_MOTOR);
+
+    // optional: quick telemetry
+    //char msg[64]; int n=sprintf(msg,"%d,%d,%.0f\r\n",rpsA_f,rpsD_f,err);
+   // HAL_UART_Transmit_IT(&huart3,(uint8_t*)msg,(uint16_t)n);
+    Trace_End(TR_MOTOR);
+  }
+  /* USER CODE END motor */
+}
+
+/* USER CODE BEGIN Header_encoder */
+/**
+* @brief Function implementing the EncoderTask thread.
+* @param argument: Not used
+* @retval None
+*/
+/* USER CODE END Header_encoder */
+void encoder(void *argument)
+{
+  /* USER CODE BEGIN encoder */
+  const int32_t modA = (int32_t)__HAL_TIM_GET_AUTORELOAD(&htim2) + 1; // 65536
+  const int32_t modD = (int32_t)__HAL_TIM_GET_AUTORELOAD(&htim5) + 1;
+  const uint32_t cyc_per_us = SystemCoreClock / 1000000u;
+  Wcet_Register(&g_wcet[W_ENCODER]);
+
+#if FUSED_CTL
+  // The fused step samples the encoders; this runs the polls once per span
+  (void)modA; (void)modD;
+  HAL_TIM_Base_Start_IT(&htim7);
+  uint32_t poll_prev = DWT->CYCCNT;
+  for (;;)
+  {
+	  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	  Trace_Wake(TR_ENCODER);
+	  uint32_t now = DWT->CYCCNT;
+	  Brake_Poll((float)(now - poll_prev) / (float)(cyc_per_us * 1000u));
+	  poll_prev = now;
+	  Batt_Poll();
+	  Settle_Poll();
+	  Trace_End(TR_ENCODER);
+  }
+#endif
+
+  // First latch only sets the reference
+  ulTaskNotifyTake(pdTRUE, 0);
+  HAL_TIM_Base_Start_IT(&htim7);
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  taskENTER_CRITICAL();
+  uint32_t cntA_prev = enc_latch.cntA;
+  uint32_t cntD_prev = enc_latch.cntD;
+  uint32_t cyc_prev  = enc_latch.cyc;
+  taskEXIT_CRITICAL();
+  uint64_t elapsed_cyc = 0;
+
+  for (;;)
+  {
+	  // TIM7 has stopped if this times out; the stale latch gives dA = dD = 0
+	  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+	  Trace_Wake(TR_ENCODER);
 
 	  taskENTER_CRITICAL();
-	  total_counts_A += dA;
-	  total_counts_D += dD;
-	  distance_cm_A  = (float)total_counts_A * CM_PER_COUNT;
-	  distance_cm_D  = (float)total_counts_D * CM_PER_COUNT;
+	  uint32_t cntA = enc_latch.cntA;
+	  uint32_t cntD = enc_latch.cntD;
+	  uint32_t cyc  = enc_latch.cyc;
 	  taskEXIT_CRITICAL();
 
-	  // RPS over dt
-	  float cpsA = fabsf((float)dA) * (1000.0f / dt_ms);
-	  float cpsD = fabsf((float)dD) * (1000.0f / dt_ms);
-	  rpsA = ((cpsA) / (float)COUNTS_PER_REV);
-	  rpsD = ((cpsD) / (float)COUNTS_PER_REV);
+	  uint32_t dcyc = cyc - cyc_prev;   // CYCCNT wraps every ~60 s; the difference does not
+	  if (dcyc == 0) continue;
+	  float dt_ms = (float)dcyc / (float)(cyc_per_us * 1000u);
+
+	  int32_t dA = Enc_Delta(cntA, cntA_prev, modA);
+	  int32_t dD = Enc_Delta(cntD, cntD_prev, modD);
+	  Enc_Publish(dA, dD, dA, dD, dcyc);
 
 	  cntA_prev = cntA;
 	  cntD_prev = cntD;
-	  last_ms   = now_ms;
+	  cyc_prev  = cyc;
+	  elapsed_cyc  += dcyc;
+	  enc_dt_us     = dcyc / cyc_per_us;
+	  enc_sample_us = (uint32_t)(elapsed_cyc / cyc_per_us);
+
+	  Brake_Poll(dt_ms);
+	  Batt_Poll();
+	  Settle_Poll();
+	  Trace_End(TR_ENCODER);
   }
   /* USER CODE END encoder */
 }
@@ -1817,31 +4959,54 @@ void encoder(void *argument)
 void distance(void *argument)
 {
   /* USER CODE BEGIN distance */
-  OLED_Clear();
-  OLED_Refresh_Gram();
-
   char line[24];
-  const TickType_t period = pdMS_TO_TICKS(100);   // 10 Hz UI
-  TickType_t tick = xTaskGetTickCount();
+  const TickType_t period = pdMS_TO_TICKS(DIST_PERIOD_MS);   // While moving; move starts and ends wake it early
+  Wcet_Register(&g_wcet[W_DISTANCE]);
 
   /* Infinite loop */
   for (;;)
   {
-    // 1) Pop & execute next command (only here; single consumer)
-    CommandQueue_TryDispatch();
-
+    Wcet_Begin(&g_wcet[W_DISTANCE]);
+    // 1) Commands are started by CmdTask; this task only ends moves
     // 2) Safety/e-brake when target distance reached
     float a   = fabsf(distance_cm_A);
     float d   = fabsf(distance_cm_D);
     float avg = 0.5f * (a + d);
 
-    if (motionActive && avg >= (float)targetdistance_cm)
+    Move_Presteer(avg);
+
+    // Ended by the compare-match ISR, or here if the compare was not armed
+    uint8_t ended = 0;
+    taskENTER_CRITICAL();
+    if (g_move_reached) {
+      g_move_reached = 0;
+      ended = 1;
+    } else if (motionActive
+               && avg >= (float)(targetdistance_cm + (g_blend.into_turn ? MOVE_BRAKE_COMP_CM : 0))) {
+      Move_DisarmCompare();
+      motionActive = 0;
+      ended = 1;
+    }
+    taskEXIT_CRITICAL();
+
+    if (ended && g_blend.into_turn)
     {
+      // No brake and no cooldown: CmdTask starts the turn with the wheels still turning
+      targetdistance_cm  = 0;
+      CmdTask_Notify();
+    }
+    else if (ended)
+    {
+#if BRAKE_SHORT
+      Brake_Start();
+#else
       AllStop();
-      motionActive       = 0;
+#endif
       targetdistance_cm  = 0;
 
-      // brief active brake opposite to motion
+#if !VP_ENABLE && !BRAKE_SHORT
+      // brief active brake opposite to motion (a profiled move already
+      // arrives at VP_END_CMS and only needs the wheels cut)
       if (dir == DIR_FWD) {
         DriveBackwardPWM(4250, 4250);
         osDelay(73);
@@ -1851,8 +5016,10 @@ void distance(void *argument)
         osDelay(77);
         AllStop();
       }
+#endif
 
       StartCooldown(CMD_COOLDOWN_MS);
+      CmdTask_Notify();
       // Optional: notify PC
       // const char *done = "DONE\r\n";
       // HAL_UART_Transmit(&huart3, (uint8_t*)done, (uint16_t)strlen(done), HAL_MAX_DELAY);
@@ -1871,7 +5038,9 @@ void distance(void *argument)
     //if (!motionActive) OLED_ShowString(10, 50, "STOP               ");
     //OLED_Refresh_Gram();
 
-    vTaskDelayUntil(&tick, period);
+    Wcet_End(&g_wcet[W_DISTANCE]);
+    // The fused step checks every FUSED_CTL_HZ and wakes this task itself
+    ulTaskNotifyTake(pdTRUE, (motionActive && !FUSED_CTL) ? period : portMAX_DELAY);
   }
   /* USER CODE END distance */
 }
@@ -1884,74 +5053,161 @@ void distance(void *argument)
 */
 /* USER CODE END Header_imu */
 
+/* IMUTask, once the gyro bias is known: turns and steered moves are safe
+ * from here, so the host hears "READY <ms since boot>" rather than timing
+ * its first command against a boot it cannot see */
+static void Imu_Ready(const char *how)
+{
+  gyro_ready = 1;
+  Display_Text(2, how);
+  char b[24];
+  snprintf(b, sizeof b, "READY %lu\r\n", (unsigned long)HAL_GetTick());
+  uart3_send(b);
+}
+
 void imu(void *argument)
 {
   /* USER CODE BEGIN imu */
-  OLED_ShowString(0,0,"ICM20948 init");
-  OLED_Refresh_Gram();
+  Display_Text(0, "ICM20948 init");
 
   if (!ICM_addr) {
     if (!icm_probe()) {
-      OLED_ShowString(0,16,"Probe FAIL");
-      OLED_Refresh_Gram();
+      Display_Text(1, "Probe FAIL");
       for(;;) osDelay(1000);
     }
   }
 
   icm_wake_enable_gyro();
-  OLED_ShowString(0,16,"Wake OK");
-  OLED_Refresh_Gram();
-
-  /* ---- Bias calibration (keep robot absolutely still) ---- */
-  int32_t sum = 0;
-  const int N = 400;        // ~2 s at 5 ms
-  int16_t gx, gy, gz;
-  for (int i = 0; i < N; ++i) {
-    if (icm_read_gyro_xyz(&gx,&gy,&gz) == HAL_OK) sum += gz;
-    osDelay(5);
-  }
-  _gyro_bias_lsb = (float)sum / (float)N;
-  yaw_rate_dps   = 0.0f;
-  yaw_angle_deg  = 0.0f;
-  _gyro_last_ms  = HAL_GetTick();
-  gyro_ready     = 1;
-
-  OLED_ShowString(0,32,"Bias OK");
-  OLED_Refresh_Gram();
-
+  icm_configure_fifo();
+  Display_Text(1, "Wake OK");
+
+  const float nominal_s = 1.0f / IMU_ODR_HZ;
+  float    period_s  = nominal_s;   // ICM sample period, tracked against DWT
+  biquad_t rate_filt = { 0 };       // yaw_rate_dps, see Signal filters
+  int32_t  bias_sum  = 0;           // first IMU_BIAS_SAMPLES: bias calibration
+  uint32_t bias_n    = 0;
+  uint8_t  i2c_busy  = 0;           // a count or FIFO read is queued or on the bus
+  uint16_t dma_len   = 0;
+  uint16_t fifo_left = 0;           // bytes left in the FIFO after the last burst
+  uint8_t  have_prev = 0;
+  uint32_t cyc_prev  = 0;
+  uint64_t elapsed_cyc = 0;
+  uint32_t still_since_ms = HAL_GetTick();
   uint32_t lastPrint = 0;
+
+  // A bias saved with CAL SAVE replaces the capture; ZUPT corrects what has drifted since
+  if (g_cal.v.gyro_bias_lsb != 0.0f) {
+    _gyro_bias_lsb = g_cal.v.gyro_bias_lsb;
+    bias_n         = IMU_BIAS_SAMPLES;
+    Imu_Ready("Bias CAL");
+  }
+
+  const uint16_t icm8 = (uint16_t)(ICM_addr << 1);
+  imu_x_count = (I2cXfer){ .addr = icm8, .reg = ICM_REG_FIFO_COUNTH, .data = imu_count_raw, .len = 2,
+                           .timeoutMs = IMU_I2C_TIMEOUT_MS, .done = imu_i2c_done, .ctx = (void *)IMU_EVT_COUNT };
+  imu_x_fifo  = (I2cXfer){ .addr = icm8, .reg = ICM_REG_FIFO_R_W, .data = imu_fifo_buf,
+                           .timeoutMs = IMU_I2C_TIMEOUT_MS, .done = imu_i2c_done, .ctx = (void *)IMU_EVT_DMA };
+  for (int i = 0; i < 2; i++)
+    imu_x_rst[i] = (I2cXfer){ .addr = icm8, .reg = ICM_REG_FIFO_RST, .write = 1, .data = &imu_fifo_rst[i],
+                              .len = 1, .timeoutMs = IMU_I2C_TIMEOUT_MS };
+
+  Wcet_Register(&g_wcet[W_IMU]);
   /* Infinite loop */
   for (;;)
   {
-    if (icm_read_gyro_xyz(&gx,&gy,&gz) == HAL_OK)
-    {
-      /* remove bias, convert to dps, low-pass */
-      float z_lsb = (float)gz - _gyro_bias_lsb;
-      float z_dps = z_lsb / GYRO_SENS_LSB_PER_DPS;
+    uint32_t evt = 0;
+    // A timeout still reads the FIFO, so lost pulses only add latency
+    xTaskNotifyWait(0, 0xFFFFFFFFu, &evt, pdMS_TO_TICKS(20));
+    I2cBus_Poll(&g_i2c2);   // deadlines, bus recovery
+
+    if (evt & IMU_EVT_ERR) {
+      i2c_busy = 0;
+      have_prev = 0;
+      icm_fifo_reset_queue();
+      continue;
+    }
 
-      yaw_rate_dps = yaw_rate_dps*(1.0f - GYRO_LP_ALPHA) + z_dps*GYRO_LP_ALPHA;
+    if (evt & IMU_EVT_DMA) {
+      Trace_Wake(TR_IMU);
+      PROF_BEGIN(PR_GYRO);
+      i2c_busy = 0;
+      uint32_t now_ms = HAL_GetTick();
+      uint8_t still = !motionActive && !g_steer_cmd.busy && !g_steer_cmd.pending
+                   && rpsA < SETTLE_RPS && rpsD < SETTLE_RPS;
+      if (!still) still_since_ms = now_ms;
+      uint8_t zupt = (now_ms - still_since_ms) >= ZUPT_HOLD_MS;
+      for (uint16_t i = 0; i + 1 < dma_len; i += 2) {
+        int16_t gz = (int16_t)((imu_fifo_buf[i] << 8) | imu_fifo_buf[i + 1]);
+        if (bias_n < IMU_BIAS_SAMPLES) {
+          bias_sum += gz;
+          if (++bias_n == IMU_BIAS_SAMPLES) {
+            _gyro_bias_lsb = (float)bias_sum / (float)IMU_BIAS_SAMPLES;
+            yaw_rate_dps   = 0.0f;
+            yaw_angle_deg  = 0.0f;
+            Imu_Ready("Bias OK");
+          }
+          continue;
+        }
+        /* remove bias, convert to dps, integrate, low-pass for readers */
+        float z_dps = ((float)gz - _gyro_bias_lsb) / GYRO_SENS_LSB_PER_DPS;
+        if (zupt && fabsf(z_dps) < ZUPT_MAX_DPS) {
+          _gyro_bias_lsb += ZUPT_ALPHA * ((float)gz - _gyro_bias_lsb);
+          imu_zupt_samples++;
+        } else {
+          yaw_angle_deg += z_dps * period_s;
+        }
+        yaw_rate_dps = Biquad_Step(&g_filt_gyro, &rate_filt, z_dps);
+      }
+      imu_sample_us = (uint32_t)(elapsed_cyc / (SystemCoreClock / 1000000u));
+      _gyro_last_ms = HAL_GetTick();
+      if (gyro_ready && g_steer_cmd.busy) Servo_Wake(STEER_EVT_IMU);
+      PROF_END(PR_GYRO);
+      Trace_End(TR_IMU);
+    }
 
-      /* integrate heading */
-      uint32_t now = HAL_GetTick();
-      float dt = (now - _gyro_last_ms) / 1000.0f;
-      _gyro_last_ms = now;
-      yaw_angle_deg += yaw_rate_dps * dt;
-
-      /* OLED debug every 200 ms */
-      if (now - lastPrint >= 200) {
-        char line[24];
-        OLED_Clear();
-        OLED_ShowString(0,0,"Gyro Z (dps):");
-        snprintf(line, sizeof(line), "%7.2f", yaw_rate_dps);
-        OLED_ShowString(0,16,line);
-        OLED_ShowString(0,32,"Yaw (deg):");
-        snprintf(line, sizeof(line), "%7.2f", yaw_angle_deg);
-        OLED_ShowString(0,48,line);
-        OLED_Refresh_Gram();
-        lastPrint = now;
+    if (!(evt & IMU_EVT_COUNT)) {
+      // Ask for the FIFO count; its completion comes back as IMU_EVT_COUNT
+      if (!i2c_busy && I2cBus_Submit(&g_i2c2, &imu_x_count) == 0) i2c_busy = 1;
+      continue;
+    }
+
+    i2c_busy = 0;
+    uint32_t cyc = imu_count_cyc;
+    uint16_t avail = (uint16_t)((((imu_count_raw[0] & 0x1F) << 8) | imu_count_raw[1]) & ~1u);
+    if (avail >= IMU_FIFO_RESET_AT) {
+      icm_fifo_reset_queue();
+      have_prev = 0;
+      continue;
+    }
+
+    // Samples produced since the last count read give the true sample period
+    if (have_prev && avail > fifo_left) {
+      uint32_t produced = (uint32_t)(avail - fifo_left) / 2u;
+      float measured = (float)(cyc - cyc_prev) / (float)SystemCoreClock / (float)produced;
+      if (measured > 0.9f * nominal_s && measured < 1.1f * nominal_s)
+        period_s = 0.95f * period_s + 0.05f * measured;
+    }
+    if (have_prev) elapsed_cyc += (uint32_t)(cyc - cyc_prev);
+    have_prev = 1;
+    cyc_prev  = cyc;
+
+    dma_len   = avail > IMU_FIFO_READ_MAX ? IMU_FIFO_READ_MAX : avail;
+    fifo_left = (uint16_t)(avail - dma_len);
+    if (dma_len == 0) continue;
+    imu_x_fifo.len = dma_len;
+    if (I2cBus_Submit(&g_i2c2, &imu_x_fifo) == 0) i2c_busy = 1;
+
+    /* OLED debug every 200 ms, drawn by ShowTask */
+    uint32_t now = HAL_GetTick();
+    if (gyro_ready && now - lastPrint >= 200) {
+      if (!lastPrint) {
+        Display_Text(0, "Gyro Z (dps):");
+        Display_Text(2, "Yaw (deg):");
       }
+      Display_Value(1, "", yaw_rate_dps);
+      Display_Value(3, "", yaw_angle_deg);
+      lastPrint = now;
     }
-    osDelay(10);
   }
   /* USER CODE END imu */
 }
@@ -1966,21 +5222,24 @@ void servomotor(void *argument)
 {
   /* USER CODE BEGIN servomotor */
   steer_center();
+  Wcet_Register(&g_wcet[W_SERVO]);
 
-  const uint32_t loop_ms = (1000U/STEER_LOOP_HZ);
-  TickType_t last = xTaskGetTickCount();
+  // Each IMU batch wakes the loop; the timeout only matters if they stop
+  const TickType_t imu_wait = pdMS_TO_TICKS(2000U / STEER_LOOP_HZ);
 
   /* Infinite loop */
   for (;;)
   {
     if (!g_steer_cmd.pending) {
-      vTaskDelay(pdMS_TO_TICKS(5));
+      xTaskNotifyWait(0, 0xFFFFFFFFu, NULL, portMAX_DELAY);  // Servo_Request* wakes us
       continue;
     }
 
     if (!gyro_ready) {
       g_steer_cmd.success = 0;
       g_steer_cmd.pending = 0;
+      AllStop();          // A blended hand-over may have left the wheels driving
+      CmdTask_Notify();
       steer_center();
       vTaskDelay(pdMS_TO_TICKS(5));
       continue;
@@ -1993,92 +5252,93 @@ void servomotor(void *argument)
 
     const float   target     = g_steer_cmd.target_heading;
     const uint8_t zero_after = g_steer_cmd.zero_yaw_after;
-    const uint8_t use_bang = g_steer_cmd.bangbang;
-    const uint16_t run_pwm = g_steer_cmd.drive_pwm ? g_steer_cmd.drive_pwm : 5000;
+    const float   delta      = g_steer_cmd.delta_deg;
     const uint8_t rev_drive = g_steer_cmd.reverse_drive;   // <<< NEW
+    const uint8_t blend_out = g_blend.into_move;           // next command is FW: do not stop
 
     // Clear it so next command defaults to PID again
     g_steer_cmd.bangbang = 0;
     g_steer_cmd.reverse_drive = 0;
+    Gains_At(g_steer_cmd.speed_cms, &g_turn_gains);
+    const uint16_t run_pwm = g_steer_cmd.drive_pwm ? g_steer_cmd.drive_pwm : (uint16_t)g_turn_gains.turn_pwm;
+    g_steer_cmd.drive_pwm = 0;
     uint32_t started_ms = HAL_GetTick();
 
-    /* IMPORTANT: reset the periodic scheduler baseline here */
-    last = xTaskGetTickCount();                          // <<< add this
+    /* One pass of the profile, then holding its end until the rate dies
+     * down; every batch drives the wheels and servo from the latest yaw */
+    const float pwm0  = g_turn_gains.turn_pwm_min;
+    const float side  = delta < 0.0f ? -1.0f : 1.0f;     // yaw direction of the turn
+    const float start = yaw_angle_deg;
+    turn_profile_t prof;
+    TurnProfile_Start(&prof, fabsf(delta), rev_drive, run_pwm, pwm0);
+    uint8_t done = 0;
 
-    float prev_err = smallest_err_deg(target, yaw_angle_deg);  // before loop
+    Trace_Restart(TR_SERVO);
+    while (!done) {
+      xTaskNotifyWait(0, 0xFFFFFFFFu, NULL, imu_wait);
+      Trace_Wake(TR_SERVO);
 
-    for (;;) {
-      vTaskDelayUntil(&last, pdMS_TO_TICKS(loop_ms));
-
-      float err = smallest_err_deg(target, yaw_angle_deg);
-      float abs_err = fabsf(err);
-
-      // Decide “left” based on forward/reverse semantics (your rule)
-      int need_left = rev_drive ? (err < 0.0f) : (err > 0.0f);
-
-      // --- Coarse vs Fine ---
-      if (abs_err > YAW_COARSE_THRESH_DEG) {
-        // COARSE: bang-bang + high PWM
-        uint16_t pwm = scale_pwm_from_err(abs_err);  // gives TURN_PWM_MAX here
-        // lock wheels hard to the side for fast yaw
-        steer_write_us(need_left ? STEER_US_LEFT : STEER_US_RIGHT);
-        turn(need_left, pwm, rev_drive);
-      } else {
-        // FINE: proportional steer + reduced PWM + rate damping
-        // steering angle = Kp*err - Kd*yaw_rate
-        float wheel_cmd_deg = FINE_KP_STEER*err - FINE_KD_RATE*yaw_rate_dps;
-        uint16_t usec = steer_deg_to_pulse(wheel_cmd_deg);
-        steer_write_us(usec);
-
-        uint16_t pwm = scale_pwm_from_err(abs_err);  // ramps 2600..5000
-        spin_in_place(need_left, pwm, rev_drive);
-      }
+      uint32_t now = HAL_GetTick();
+      float t = (now - started_ms) * 0.001f;
 
-      // --- Exit windows ---
-      if (abs_err <= YAW_STOP_DB_DEG) {
-        // brief stop and settle
+      if ((now - started_ms) > STEER_CMD_TIMEOUT || g_estop) {
         AllStop();
-        osDelay(30);
-        steer_center();
-        osDelay(30);
-
-        // verify and micro-nudge toward target if needed
-        float check_err = fabsf(smallest_err_deg(target, yaw_angle_deg));
-        if (check_err > YAW_FINE_DB_DEG) {
-          // one tiny corrective pulse, then re-evaluate next loop
-          int nudge_left = rev_drive ? ( (smallest_err_deg(target, yaw_angle_deg) < 0.0f) )
-                                     : ( (smallest_err_deg(target, yaw_angle_deg) > 0.0f) );
-          spin_in_place(nudge_left, MICRO_NUDGE_PWM, rev_drive);
-          osDelay(MICRO_NUDGE_MS);
-          AllStop();
-          // do NOT break; let loop re-check error and either finish or do another pass
-        } else {
-          g_steer_cmd.success = 1;
-          break;
-        }
+        g_steer_cmd.success = 0;
+        break;
       }
 
-      // Simple overshoot damper: sign flip with non-trivial magnitude
-      if ((prev_err > 0 && err < 0) || (prev_err < 0 && err > 0)) {
-        // quick, tiny counter-pulse to kill momentum
-        AllStop();
-        osDelay(10);
+      float final_err = smallest_err_deg(target, yaw_angle_deg);
+      if (t >= prof.shape.t_end && fabsf(final_err) <= YAW_STOP_DB_DEG &&
+          (blend_out || fabsf(yaw_rate_dps) <= STEER_SETTLE_DPS)) {
+        g_steer_cmd.success = 1;   // with blend_out the FW follows at once
+        done = 1;
+        break;
       }
-      prev_err = err;
 
-      if ((HAL_GetTick() - started_ms) > STEER_CMD_TIMEOUT) {
+      tp_ref_t ref;
+      float ff;
+      TurnProfile_At(&prof, t, &ref, &ff);
+      float err = smallest_err_deg(angle_wrap_180(start + side * ref.yaw), yaw_angle_deg);
+
+      // Along the turn: > 0 pushes on, < 0 drives the other way to pull back
+      float push = ff + TP_KP_PWM * side * err + TP_KD_PWM * (ref.rate - side * yaw_rate_dps);
+      if (t >= prof.shape.t_end && fabsf(err) <= YAW_FINE_DB_DEG) push = 0.0f;   // let it roll out
+      if (push == 0.0f) {
         AllStop();
-        osDelay(30);
         steer_center();
-        g_steer_cmd.success = 0;
-        break;
+        Trace_End(TR_SERVO);
+        continue;
       }
+      uint8_t drive_rev = push < 0.0f ? !rev_drive : rev_drive;
+
+      // Lock towards the turn (away from it while reversing), unwinding with
+      // the rate while braking so the wheels are straight at the end; plus the
+      // heading error, signed for the way the wheels are actually driven
+      float steer_sign = rev_drive ? -side : side;
+      float lock = (t < prof.shape.t_ramp + prof.shape.t_cruise || t >= prof.shape.t_end)
+                 ? 1.0f : ref.rate / prof.shape.rate_max;
+      float wheel_deg = steer_sign * STEER_MAX_DEG * lock
+                      + (drive_rev ? -1.0f : 1.0f) * g_turn_gains.fine_kp_steer * err;
+      steer_write_us(steer_deg_to_pulse(wheel_deg));
+
+      float pwm = pwm0 + fabsf(push);
+      float limit = pwm0 + fabsf(ff);
+      if (limit < g_turn_gains.turn_pwm_max) limit = g_turn_gains.turn_pwm_max;
+      if (pwm > limit) pwm = limit;
+      if (pwm > PWM_MAX) pwm = PWM_MAX;
+      turn(wheel_deg != 0.0f ? wheel_deg > 0.0f : steer_sign > 0.0f, (uint16_t)pwm, drive_rev);
+      Trace_End(TR_SERVO);
     }
 
     /* Wheels straight; keep the car at the new heading */
     steer_center();
     // After the for(;;) loop in ServoAlignTask
-    AllStop();
+    const uint8_t carry = blend_out && g_steer_cmd.success;
+    if (carry) {
+      DriveForwardPWM(BLEND_CARRY_PWM, BLEND_CARRY_PWM);  // until the FW's first control period
+    } else {
+      AllStop();
+    }
 
     /* By design we re-zero yaw so “now” becomes 0°, but the car
        physically remains 90° (or whatever you commanded) from the
@@ -2086,8 +5346,9 @@ void servomotor(void *argument)
     if (g_steer_cmd.success && zero_after) {
       yaw_angle_deg = 0.0f;
     }
-    StartCooldown(CMD_COOLDOWN_MS);   // NEW: pause before next command
+    if (!carry) StartCooldown(CMD_COOLDOWN_MS);   // NEW: pause before next command
     g_steer_cmd.busy = 0;
+    CmdTask_Notify();
   }
   /* USER CODE END servomotor */
 }
@@ -2103,37 +5364,30 @@ void ir(void *argument)
 {
   /* USER CODE BEGIN ir */
   const char *hdr = "t_ms,ir_raw,ir_inv,ir_cm\r\n";
-  HAL_UART_Transmit(&huart3, (uint8_t*)hdr, (uint16_t)strlen(hdr), 10);
+  uart3_send(hdr);
 
   TickType_t tick = xTaskGetTickCount();
-  const TickType_t period = pdMS_TO_TICKS(50); // 20 Hz
+  const TickType_t period = pdMS_TO_TICKS(IR_PERIOD_MS);
+  Wcet_Register(&g_wcet[W_IR]);
 
   /* Infinite loop */
   for(;;)
   {
-	    // Start one conversion now
-	    if (HAL_ADC_Start(&hadc1) == HAL_OK)
-	    {
-	      // Wait (briefly) for it to finish
-	      if (HAL_ADC_PollForConversion(&hadc1, 5) == HAL_OK)
-	      {
-	        uint32_t raw = HAL_ADC_GetValue(&hadc1);  // 0..4095
-	        uint32_t inv = 4095u - raw;
-
-	        int32_t d_cm =IrConvert((int32_t)raw);
-
-	        char line[64];
-	        int n = snprintf(line, sizeof(line), "%lu,%lu,%lu,%ld\r\n",
-	                         (unsigned long)HAL_GetTick(),
-	                         (unsigned long)raw,
-	                         (unsigned long)inv,
-	                         (long)d_cm);
-	        if (n > 0) HAL_UART_Transmit(&huart3, (uint8_t*)line, (uint16_t)n, 10);
-
-	      }
-	      HAL_ADC_Stop(&hadc1); // tidy up this conversion
-	    }
-
+	    Wcet_Begin(&g_wcet[W_IR]);
+	    // DMA keeps g_ir_sample / g_ir_mm current; this only reports them
+	    uint32_t raw = g_ir_sample;  // 0..4095
+	    uint32_t inv = 4095u - raw;
+	    int32_t d_cm = (int32_t)(g_ir_mm / 10u);
+
+	    char line[64];
+	    int n = snprintf(line, sizeof(line), "%lu,%lu,%lu,%ld\r\n",
+	                     (unsigned long)HAL_GetTick(),
+	                     (unsigned long)raw,
+	                     (unsigned long)inv,
+	                     (long)d_cm);
+	    if (n > 0) uart3_write(line, (uint16_t)n);
+
+	    Wcet_End(&g_wcet[W_IR]);
 	    vTaskDelayUntil(&tick, period);
   }
   /* USER CODE END ir */
@@ -2152,11 +5406,88 @@ void ultrasonic(void *argument)
   /* Infinite loop */
   for(;;)
   {
-    osDelay(1);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);   /* Nothing to do yet; never wakes the core */
   }
   /* USER CODE END ultrasonic */
 }
 
+/* USER CODE BEGIN Header_uartrx */
+/**
+* @brief Function implementing the UartRxTask thread.
+*        Frames USART3 bytes from the DMA ring into command lines.
+* @param argument: Not used
+* @retval None
+*/
+/* USER CODE END Header_uartrx */
+void uartrx(void *argument)
+{
+  /* USER CODE BEGIN uartrx */
+  char line[32];
+  uint8_t idx = 0;
+  uint16_t tail = 0;   // next byte to read from uart3_dma_buf
+  Wcet_Register(&g_wcet[W_UARTRX]);
+
+  /* Infinite loop */
+  for(;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    Wcet_Begin(&g_wcet[W_UARTRX]);
+
+    if (uart3_rx_restarted) {
+      // Bytes before the error are gone; drop the partial line with them
+      uart3_rx_restarted = 0;
+      tail = 0;
+      idx = 0;
+      if (g_estop == ESTOP_CUT) Estop_MarkQueue();  // The stop byte may have gone too
+    }
+
+    uint16_t head = uart3_dma_head;
+    while (tail != head) {
+      char ch = (char)uart3_dma_buf[tail];
+      tail = (uint16_t)((tail + 1) % UART3_DMA_BUF_SIZE);
+
+      if (ch == ESTOP_BYTE) {
+        idx = 0;  // The ISR has stopped the wheels; a half line goes with the queue
+        Estop_MarkQueue();
+      } else if (ch == '\n' || ch == '\r') {
+        line[idx] = '\0';
+        Uart3_QueueLine(line);
+        idx = 0;
+      } else if (idx < sizeof(line)-1) {
+        line[idx++] = ch;
+      }
+    }
+    Wcet_End(&g_wcet[W_UARTRX]);
+  }
+  /* USER CODE END uartrx */
+}
+
+/* USER CODE BEGIN Header_cmdtask */
+/**
+* @brief Function implementing the CmdTask thread.
+*        Sleeps until a command is queued or the robot becomes free.
+* @param argument: Not used
+* @retval None
+*/
+/* USER CODE END Header_cmdtask */
+void cmdtask(void *argument)
+{
+  /* USER CODE BEGIN cmdtask */
+  TickType_t wait = 0;
+  Wcet_Register(&g_wcet[W_CMD]);
+  /* Infinite loop */
+  for(;;)
+  {
+    if (wait) ulTaskNotifyTake(pdTRUE, wait);
+    Wcet_Begin(&g_wcet[W_CMD]);
+    PROF_BEGIN(PR_DISPATCH);
+    wait = CommandQueue_TryDispatch();
+    PROF_END(PR_DISPATCH);
+    Wcet_End(&g_wcet[W_CMD]);
+  }
+  /* USER CODE END cmdtask */
+}
+
 /**
   * @brief  This function is executed in case of error occurrence.
   * @retval None
@@ -91,6 +91,19 @@ LoopFillZerobss:
   cmp r2, r4
   bcc FillZerobss
 
+/* Zero fill the ccmbss segment (task stacks, TCBs, CCMRAM variables). */
+  ldr r2, =_sccmbss
+  ldr r4, =_eccmbss
+  b LoopFillZeroccm
+
+FillZeroccm:
+  str  r3, [r2]
+  adds r2, r2, #4
+
+LoopFillZeroccm:
+  cmp r2, r4
+  bcc FillZeroccm
+
 /* Call the clock system initialization function.*/
   bl  SystemInit   
 /* Call static constructors */
@@ -13,6 +13,8 @@
 #include "stm32f4xx_hal.h"
 
 //-----------------OLED Definition----------------
+//PD11-PD14 have no SPI alternate function, so the bus is bit-banged; pins are
+//driven through BSRR directly rather than through HAL_GPIO_WritePin calls.
 #define OLED_SCL_Pin GPIO_PIN_14
 #define OLED_SCL_GPIO_Port GPIOD
 #define OLED_SDA_Pin GPIO_PIN_13
@@ -22,17 +24,17 @@
 #define OLED_DC_Pin GPIO_PIN_11
 #define OLED_DC_GPIO_Port GPIOD
 
-#define OLED_RST_Clr() HAL_GPIO_WritePin(GPIOD,OLED_RST_Pin,GPIO_PIN_RESET)  //RST = 0
-#define OLED_RST_Set() HAL_GPIO_WritePin(GPIOD,OLED_RST_Pin,GPIO_PIN_SET)    //RST = 1
+#define OLED_RST_Clr() (GPIOD->BSRR=(uint32_t)OLED_RST_Pin<<16)  //RST = 0
+#define OLED_RST_Set() (GPIOD->BSRR=OLED_RST_Pin)    //RST = 1
 
-#define OLED_RS_Clr() HAL_GPIO_WritePin(GPIOD,OLED_DC_Pin,GPIO_PIN_RESET)   //DC = 0
-#define OLED_RS_Set() HAL_GPIO_WritePin(GPIOD,OLED_DC_Pin,GPIO_PIN_SET)     //DC = 1
+#define OLED_RS_Clr() (GPIOD->BSRR=(uint32_t)OLED_DC_Pin<<16)   //DC = 0
+#define OLED_RS_Set() (GPIOD->BSRR=OLED_DC_Pin)     //DC = 1
 
-#define OLED_SCLK_Clr()  HAL_GPIO_WritePin(GPIOD,OLED_SCL_Pin,GPIO_PIN_RESET)   //SCL
-#define OLED_SCLK_Set()  HAL_GPIO_WritePin(GPIOD,OLED_SCL_Pin,GPIO_PIN_SET)    //SCL
+#define OLED_SCLK_Clr()  (GPIOD->BSRR=(uint32_t)OLED_SCL_Pin<<16)   //SCL
+#define OLED_SCLK_Set()  (GPIOD->BSRR=OLED_SCL_Pin)    //SCL
 
-#define OLED_SDIN_Clr()  HAL_GPIO_WritePin(GPIOD,OLED_SDA_Pin,GPIO_PIN_RESET)    //SDA
-#define OLED_SDIN_Set()  HAL_GPIO_WritePin(GPIOD,OLED_SDA_Pin,GPIO_PIN_SET)    //SDA
+#define OLED_SDIN_Clr()  (GPIOD->BSRR=(uint32_t)OLED_SDA_Pin<<16)    //SDA
+#define OLED_SDIN_Set()  (GPIOD->BSRR=OLED_SDA_Pin)    //SDA
 #define OLED_CMD  0	//Write Command
 #define OLED_DATA 1	//Write Data
 
@@ -40,9 +42,9 @@
 void OLED_WR_Byte(uint8_t dat,uint8_t cmd);
 void OLED_Display_On(void);
 void OLED_Display_Off(void);
-void OLED_Refresh_Gram(void);
+void OLED_Refresh_Gram(void);	//Sends only what changed since the last call
 void OLED_Init(void);
-void OLED_Clear(void);
+void OLED_Clear(void);			//Clears OLED_GRAM; shown on the next OLED_Refresh_Gram()
 void OLED_DrawPoint(uint8_t x,uint8_t y,uint8_t t);
 void OLED_ShowChar(uint8_t x,uint8_t y,uint8_t chr,uint8_t size,uint8_t mode);
 void OLED_ShowNumber(uint8_t x,uint8_t y,uint32_t num,uint8_t len,uint8_t size);
@@ -1,20 +1,41 @@
 #include "../../PeripheralDriver/Inc/oled.h"
 
 #include "stdlib.h"
+#include "string.h"
 
 #include "../../PeripheralDriver/Inc/oledfont.h"
 
 uint8_t OLED_GRAM[128][8];	 
+static uint8_t OLED_SHOWN[128][8];	//What the panel currently holds
+static uint8_t OLED_Dirty;			//Bit i set: page i of OLED_GRAM was written since the last refresh
+
+/**************************************************************************
+Refresh OLED
+Only pages drawn since the last refresh are looked at, and of those only the
+column span that differs from the panel is sent, so redrawing unchanged text
+costs nothing on the wire.
+**************************************************************************/
 void OLED_Refresh_Gram(void)
 {
-	uint8_t i,n;		    
+	uint8_t i,n,first,last;		    
 	for(i=0;i<8;i++)  
 	{  
-		OLED_WR_Byte (0xb0+i,OLED_CMD);    
-		OLED_WR_Byte (0x00,OLED_CMD);      
-		OLED_WR_Byte (0x10,OLED_CMD);        
-		for(n=0;n<128;n++)OLED_WR_Byte(OLED_GRAM[n][i],OLED_DATA); 
+		if(!(OLED_Dirty&(1<<i)))continue;
+		for(first=0;first<128&&OLED_GRAM[first][i]==OLED_SHOWN[first][i];first++);
+		if(first<128)
+		{
+			for(last=127;OLED_GRAM[last][i]==OLED_SHOWN[last][i];last--);
+			OLED_WR_Byte (0xb0+i,OLED_CMD);    
+			OLED_WR_Byte (0x00+(first&0x0F),OLED_CMD);      //Lower column nibble
+			OLED_WR_Byte (0x10+(first>>4),OLED_CMD);        //Upper column nibble
+			for(n=first;n<=last;n++)
+			{
+				OLED_WR_Byte(OLED_GRAM[n][i],OLED_DATA); 
+				OLED_SHOWN[n][i]=OLED_GRAM[n][i];
+			}
+		}
 	}   
+	OLED_Dirty=0;
 }
 
 void OLED_WR_Byte(uint8_t dat,uint8_t cmd)
@@ -44,7 +65,7 @@ void OLED_Clear(void)
 {  
 	uint8_t i,n;  
 	for(i=0;i<8;i++)for(n=0;n<128;n++)OLED_GRAM[n][i]=0X00;  
-	OLED_Refresh_Gram();//Refresh
+	OLED_Dirty=0xFF;//Sent by the next OLED_Refresh_Gram()
 }
 
  /**************************************************************************
@@ -78,6 +99,7 @@ void OLED_DrawPoint(uint8_t x,uint8_t y,uint8_t t)
 	temp=1<<(7-bx);
 	if(t)OLED_GRAM[x][pos]|=temp;
 	else OLED_GRAM[x][pos]&=~temp;	    
+	OLED_Dirty|=1<<pos;
 }
 /**************************************************************************
 Show Char
@@ -196,5 +218,7 @@ void OLED_Init(void)
 	OLED_WR_Byte(0xA4,OLED_CMD); //Enable display outputs according to the GDDRAM contents
 	OLED_WR_Byte(0xA6,OLED_CMD); //Set normal display   						   
 	OLED_WR_Byte(0xAF,OLED_CMD); //DISPLAY ON	 
+	memset(OLED_SHOWN,0xFF,sizeof(OLED_SHOWN)); //Panel RAM is undefined after reset, send every byte once
 	OLED_Clear(); 
+	OLED_Refresh_Gram();
 }
\ No newline at end of file
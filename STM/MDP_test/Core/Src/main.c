@@ -25,8 +25,11 @@
 #include "oled.h"
 #include "math.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "queue.h"
 #include "ir_sensor.h"   // our PC6/PC9 sensor helpers
+#include "motor_core.h"  // Motor_Set(), Servo_Set(), Encoder_Count() on the board.h map
 #include "oled.h"        // your SSD1306 driver
 /* USER CODE END Includes */
 
@@ -440,16 +443,16 @@ void rxSerialParse(void);
 
 
 // ---------------- MOTOR A CONTROL ----------------
-void motorForwardA(int pwmVal);
+static inline void motorForwardA(int pwmVal);
 
-void motorReverseA(int pwmVal);
+static inline void motorReverseA(int pwmVal);
 
 // ---------------- MOTOR B CONTROL ----------------
-void motorForwardB(int pwmVal);
+static inline void motorForwardB(int pwmVal);
 
-void motorReverseB(int pwmVal);
+static inline void motorReverseB(int pwmVal);
 
-void setServoAngle(int pwm);
+static inline void setServoAngle(int pwm);
 
 static void OLED_PrintStatus(uint8_t leftDet, uint8_t rightDet){
   char line1[24];
@@ -500,24 +503,20 @@ void icm20948_init(void){
 QueueHandle_t motorCommandQueue;
 
 volatile float distance;
+volatile uint32_t distanceSeq = 0; // bumped by the ultrasonic task per reading
 volatile uint8_t leftNow;
 volatile uint8_t rightNow;
 
 void motorDriveEnable(void){
-	HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_3);
-	HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4);
-	HAL_TIM_PWM_Start(&htim9, TIM_CHANNEL_1);
-	HAL_TIM_PWM_Start(&htim9, TIM_CHANNEL_2);
+	Motor_Start();
 }
 
 void motorStopA(void){
-	__HAL_TIM_SetCompare(&htim4, TIM_CHANNEL_3, 7199);
-	__HAL_TIM_SetCompare(&htim4, TIM_CHANNEL_4, 7199);
+	Motor_Brake(MOTOR_A);
 }
 
 void motorStopB(void){
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_1, 7199);
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_2, 7199);
+	Motor_Brake(MOTOR_B);
 }
 
 void motorStop(void){
@@ -525,32 +524,20 @@ void motorStop(void){
 	motorStopB();
 }
 
-void motorForwardA(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4,0); // set IN1 to maximum PWM (7199) for '1'
-    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, pwmVal); // PWM to Motor A (IN2)
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4, 7199-pwmVal); // set IN1 to maximum PWM (7199) for '1'
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, 7199); // PWM to Motor A (IN2)
+static inline void motorForwardA(int pwmVal) {
+	Motor_Set(MOTOR_A, pwmVal, 0); // PWM to Motor A (IN2)
 }
 
-void motorReverseA(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, 0);
-    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4, pwmVal); // PWM to Motor A (IN1)
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, 7199-pwmVal);
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4, 7199); // PWM to Motor A (IN1)
+static inline void motorReverseA(int pwmVal) {
+	Motor_Set(MOTOR_A, pwmVal, 1); // PWM to Motor A (IN1)
 }
 
-void motorForwardB(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_2, 0);
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_1, pwmVal); // PWM to Motor B (IN2)
-//	__HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_2, 7199-pwmVal);
-//	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_1, 7199); // PWM to Motor B (IN2)
+static inline void motorForwardB(int pwmVal) {
+	Motor_Set(MOTOR_B, pwmVal, 0); // PWM to Motor B (IN2)
 }
 
-void motorReverseB(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_1, 0);
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_2, pwmVal); // PWM to Motor B (IN1)
-//    __HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_1, 7199-pwmVal);
-//    __HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_2, 7199); // PWM to Motor B (IN1)
+static inline void motorReverseB(int pwmVal) {
+	Motor_Set(MOTOR_B, pwmVal, 1); // PWM to Motor B (IN1)
 }
 
 uint8_t motorPidForward(MotorCommand_t cmd, uint8_t isStateChanged) {
@@ -585,14 +572,14 @@ uint8_t motorPidForward(MotorCommand_t cmd, uint8_t isStateChanged) {
 			hasTargetDistance = 0;
 			targetDistance = 0.0f;
 		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+		lastEncoderA = Encoder_Count(ENCODER_A);
+		lastEncoderB = Encoder_Count(ENCODER_B);
 	}
 
 	int32_t speedA = cmd.param1Speed;
 	int32_t speedB = cmd.param1Speed;
 
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
+	int32_t currentEncoderA = Encoder_Count(ENCODER_A);
 	int32_t diffA;
 	int32_t rawDiffA = currentEncoderA - lastEncoderA;
 	if (rawDiffA > 32767) {
@@ -609,7 +596,7 @@ uint8_t motorPidForward(MotorCommand_t cmd, uint8_t isStateChanged) {
 //	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
 	lastEncoderA = currentEncoderA;
 
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+	int32_t currentEncoderB = Encoder_Count(ENCODER_B);
 	int32_t diffB = 0;
 	int32_t rawDiffB = currentEncoderB - lastEncoderB;
 	if (rawDiffB > 32767) {
@@ -743,14 +730,14 @@ uint8_t motorPidForwardF(MotorCommandF_t cmd, uint8_t isStateChanged) {
 			hasTargetDistance = 0;
 			targetDistance = 0.0f;
 		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+		lastEncoderA = Encoder_Count(ENCODER_A);
+		lastEncoderB = Encoder_Count(ENCODER_B);
 	}
 
 	int32_t speedA = cmd.param1Speed;
 	int32_t speedB = cmd.param1Speed;
 
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
+	int32_t currentEncoderA = Encoder_Count(ENCODER_A);
 	int32_t diffA;
 	int32_t rawDiffA = currentEncoderA - lastEncoderA;
 	if (rawDiffA > 32767) {
@@ -767,7 +754,7 @@ uint8_t motorPidForwardF(MotorCommandF_t cmd, uint8_t isStateChanged) {
 //	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
 	lastEncoderA = currentEncoderA;
 
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+	int32_t currentEncoderB = Encoder_Count(ENCODER_B);
 	int32_t diffB = 0;
 	int32_t rawDiffB = currentEncoderB - lastEncoderB;
 	if (rawDiffB > 32767) {
@@ -875,6 +862,85 @@ uint8_t motorPidForwardF(MotorCommandF_t cmd, uint8_t isStateChanged) {
 	return 0;
 }
 
+// Task 2 lap instrumentation: time in each task2State, how often it was
+// entered and its retries (re-entries, and sub-state steps back to an earlier
+// phase), plus capture1/capture2 latency from the first request to the RPi's
+// decision. At TASK2DONE task2LapSend() reports it in one line:
+//   !<id>/LAP/<total ms>/<capture1 ms>/<capture2 ms>/<ms>,..../<entries>,..../<retries>,....;
+// with one comma-separated value per state from OBS1FORWARD to PARKING and -1
+// for a capture never answered.
+#define TASK2_LAP_STATES 10 // OBS1FORWARD .. PARKING
+
+typedef struct {
+	uint32_t startTick;
+	uint32_t enteredTick;
+	uint8_t state;
+	uint8_t sub;
+	uint32_t ms[TASK2_LAP_STATES];
+	uint16_t entries[TASK2_LAP_STATES];
+	uint16_t retries[TASK2_LAP_STATES];
+	uint32_t captureReqTick[2]; // 0: not requested yet
+	int32_t captureMs[2];
+} Task2Lap_t;
+
+static Task2Lap_t task2Lap;
+
+static void task2LapStart(void) {
+	memset(&task2Lap, 0, sizeof(task2Lap));
+	task2Lap.startTick = HAL_GetTick();
+	task2Lap.enteredTick = task2Lap.startTick;
+	task2Lap.state = 0xFF;
+	task2Lap.captureMs[0] = -1;
+	task2Lap.captureMs[1] = -1;
+}
+
+// Sends "!CAPTURE<n>;" and starts that capture's latency clock
+static void task2RequestCapture(uint8_t n) {
+	const uint8_t *req = n == 1 ? capture1Req : capture2Req;
+	if(task2Lap.captureReqTick[n - 1] == 0) task2Lap.captureReqTick[n - 1] = HAL_GetTick();
+	HAL_UART_Transmit(&huart3,(uint8_t *)req,strlen((const char *)req),0xFFFF);
+}
+
+// Once per task2Loop() pass: sub is the state's phase counter, 0 if it has none
+static void task2LapTrack(uint8_t state, uint8_t sub) {
+	uint32_t now = HAL_GetTick();
+	if(state != task2Lap.state) {
+		if(task2Lap.state < TASK2_LAP_STATES) task2Lap.ms[task2Lap.state] += now - task2Lap.enteredTick;
+		if(state < TASK2_LAP_STATES) {
+			if(task2Lap.entries[state]++ > 0) task2Lap.retries[state]++;
+		}
+		task2Lap.state = state;
+		task2Lap.enteredTick = now;
+	} else if(sub < task2Lap.sub && state < TASK2_LAP_STATES) {
+		task2Lap.retries[state]++;
+	}
+	task2Lap.sub = sub;
+	uint8_t decided[2] = { capture1, capture2 };
+	for(int i = 0; i < 2; i++) {
+		if(task2Lap.captureMs[i] < 0 && task2Lap.captureReqTick[i] != 0 && decided[i] != 0) {
+			task2Lap.captureMs[i] = (int32_t)(now - task2Lap.captureReqTick[i]);
+		}
+	}
+}
+
+static void task2LapAppend(char *out, size_t size, const uint32_t *v32, const uint16_t *v16) {
+	size_t len = strlen(out);
+	for(int i = 0; i < TASK2_LAP_STATES && len < size; i++) {
+		len += snprintf(out + len, size - len, "%s%lu", i ? "," : "/", v32 ? (unsigned long)v32[i] : (unsigned long)v16[i]);
+	}
+}
+
+static void task2LapSend(uint32_t cmdId) {
+	char frame[200];
+	snprintf(frame, sizeof(frame), "!%lu/LAP/%lu/%ld/%ld", (unsigned long)cmdId,
+			(unsigned long)(HAL_GetTick() - task2Lap.startTick), (long)task2Lap.captureMs[0], (long)task2Lap.captureMs[1]);
+	task2LapAppend(frame, sizeof(frame) - 2, task2Lap.ms, NULL);
+	task2LapAppend(frame, sizeof(frame) - 2, NULL, task2Lap.entries);
+	task2LapAppend(frame, sizeof(frame) - 2, NULL, task2Lap.retries);
+	strcat(frame, ";");
+	HAL_UART_Transmit(&huart3,(uint8_t *)frame,strlen(frame),0xFFFF);
+}
+
 uint8_t motorPidForwardTask2UntilSensor(MotorCommandF_t cmd, uint8_t isStateChanged, uint8_t *sensorNow, float *distPtr) {
     static float totalDistanceA = 0.0f;
     static float totalDistanceB = 0.0f;
@@ -898,15 +964,15 @@ uint8_t motorPidForwardTask2UntilSensor(MotorCommandF_t cmd, uint8_t isStateChan
 
         totalDistanceA = 0.0f;
         totalDistanceB = 0.0f;
-        lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-        lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+        lastEncoderA = Encoder_Count(ENCODER_A);
+        lastEncoderB = Encoder_Count(ENCODER_B);
     }
 
     int32_t speedA = cmd.param1Speed;
     int32_t speedB = cmd.param1Speed;
 
     // --- Encoder handling (same as your code) ---
-    int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
+    int32_t currentEncoderA = Encoder_Count(ENCODER_A);
     int32_t rawDiffA = currentEncoderA - lastEncoderA;
     int32_t diffA;
     if (rawDiffA > 32767) diffA = rawDiffA - 65536;
@@ -914,7 +980,7 @@ uint8_t motorPidForwardTask2UntilSensor(MotorCommandF_t cmd, uint8_t isStateChan
     else diffA = rawDiffA;
     lastEncoderA = currentEncoderA;
 
-    int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+    int32_t currentEncoderB = Encoder_Count(ENCODER_B);
     int32_t rawDiffB = currentEncoderB - lastEncoderB;
     int32_t diffB;
     if (rawDiffB > 32767) diffB = rawDiffB - 65536;
@@ -1013,14 +1079,14 @@ uint8_t motorPidForwardTask2Until(MotorCommandF_t cmd, uint8_t isStateChanged) {
 		}else{
 			targetDistanceFromObstacle = -1.0f;
 		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+		lastEncoderA = Encoder_Count(ENCODER_A);
+		lastEncoderB = Encoder_Count(ENCODER_B);
 	}
 
 	int32_t speedA = cmd.param1Speed;
 	int32_t speedB = cmd.param1Speed;
 
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
+	int32_t currentEncoderA = Encoder_Count(ENCODER_A);
 	int32_t diffA;
 	int32_t rawDiffA = currentEncoderA - lastEncoderA;
 	if (rawDiffA > 32767) {
@@ -1037,7 +1103,7 @@ uint8_t motorPidForwardTask2Until(MotorCommandF_t cmd, uint8_t isStateChanged) {
 //	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
 	lastEncoderA = currentEncoderA;
 
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+	int32_t currentEncoderB = Encoder_Count(ENCODER_B);
 	int32_t diffB = 0;
 	int32_t rawDiffB = currentEncoderB - lastEncoderB;
 	if (rawDiffB > 32767) {
@@ -1073,7 +1139,7 @@ uint8_t motorPidForwardTask2Until(MotorCommandF_t cmd, uint8_t isStateChanged) {
 	}
 
 	if(distance < targetDistanceFromObstacle+1500.0f && toSendReq1){ // for testing, change to 300
-		HAL_UART_Transmit(&huart3,(uint8_t *)capture1Req,strlen(capture1Req),0xFFFF);
+		task2RequestCapture(1);
 		toSendReq1 = 0;
 	}
 
@@ -1138,6 +1204,160 @@ uint8_t motorPidForwardTask2Until(MotorCommandF_t cmd, uint8_t isStateChanged) {
 	return 0;
 }
 
+// Range-adaptive approach: drives at up to APPROACH_V_MAX while the range
+// shows room, then follows v = sqrt(v_end^2 + 2 a d) down to the standoff,
+// so it brakes as late as the remaining range allows.
+// Param1 Speed: unused (the speed comes from the range)
+// Param2 Dist: standoff from the obstacle in mm
+// The range is the last ultrasonic reading less the encoder travel since its
+// ping (the echo read after each trigger belongs to the one before), so it
+// updates every loop instead of every ~60 ms; the closing rate is the encoder
+// speed. A reading far off the estimate is only believed when the one after
+// it is off too. *startRange gets the range at the start (travel + final range), in
+// mm, like getFilteredUltrasonicDist() gave without the blocking median.
+static const float APPROACH_V_MAX      = 800.0f;  // mm/s
+static const float APPROACH_V_END      = 150.0f;  // mm/s at the standoff
+static const float APPROACH_DECEL      = 600.0f;  // mm/s^2 the profile plans with
+static const float APPROACH_BRAKE      = 2000.0f; // mm/s^2 of a short brake, for the stop point
+static const float APPROACH_PWM_STATIC = 1500.0f; // feed-forward: PWM = static + per_mms * v
+static const float APPROACH_PWM_PER_MMS = 7.0f;
+static const float APPROACH_KP         = 3.0f;    // PWM per mm/s behind the profile
+static const float APPROACH_OVERSPEED  = 100.0f;  // mm/s over the profile: brake this loop
+static const float APPROACH_JUMP_MM    = 150.0f;  // reading this far off the estimate: wait for a second
+static const uint32_t APPROACH_STALE_MS = 300;    // no reading for this long: creep
+static const uint32_t APPROACH_SPEED_MS = 20;     // encoder speed window
+
+uint8_t motorApproachTask2(MotorCommandF_t cmd, uint8_t isStateChanged, float *startRange) {
+
+	static float totalDistanceA = 0.0f;
+	static float totalDistanceB = 0.0f;
+	static uint32_t lastEncoderA = 0;
+	static uint32_t lastEncoderB = 0;
+	static float headingIntegral = 0.0f;
+	static float prevHeadingError = 0.0f;
+	static uint8_t toSendReq1 = 0;
+	static uint32_t lastSeq = 0;
+	static uint32_t lastReadingTick = 0;
+	static float travelAtPing = 0.0f;   // mm, when the next reading's ping went out
+	static float rangeAtPing = 0.0f;    // mm, estimate at that point
+	static uint8_t haveRange = 0;
+	static uint8_t rejected = 0;
+	static float speedWindowTravel = 0.0f;
+	static uint32_t speedWindowTick = 0;
+	static float speed = 0.0f;          // mm/s
+
+	if(isStateChanged) {
+		headingIntegral = 0.0f;
+		prevHeadingError = 0.0f;
+		isFrontCalib = 1;
+		isTurning = 0;
+		setServoAngle(SERVO_CENTER);
+		isToMove = 1;
+		totalDistanceA = 0.0f;
+		totalDistanceB = 0.0f;
+		toSendReq1 = 1;
+		lastSeq = distanceSeq;
+		lastReadingTick = HAL_GetTick();
+		travelAtPing = 0.0f;
+		rangeAtPing = distance;  // latest reading; the robot is still
+		haveRange = rangeAtPing > 0.0f;
+		rejected = 0;
+		speedWindowTravel = 0.0f;
+		speedWindowTick = HAL_GetTick();
+		speed = 0.0f;
+		lastEncoderA = Encoder_Count(ENCODER_A);
+		lastEncoderB = Encoder_Count(ENCODER_B);
+	}
+
+	int32_t currentEncoderA = Encoder_Count(ENCODER_A);
+	int32_t rawDiffA = currentEncoderA - lastEncoderA;
+	int32_t diffA = rawDiffA > 32767 ? rawDiffA - 65536 : rawDiffA < -32767 ? rawDiffA + 65536 : rawDiffA;
+	lastEncoderA = currentEncoderA;
+	int32_t currentEncoderB = Encoder_Count(ENCODER_B);
+	int32_t rawDiffB = currentEncoderB - lastEncoderB;
+	int32_t diffB = rawDiffB > 32767 ? rawDiffB - 65536 : rawDiffB < -32767 ? rawDiffB + 65536 : rawDiffB;
+	lastEncoderB = currentEncoderB;
+	totalDistanceA += (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
+	totalDistanceB -= (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM; // MotorB Encoder is reverse
+	float travel = 5.0f * (totalDistanceA + totalDistanceB); // mm, mean of both wheels
+
+	uint32_t now = HAL_GetTick();
+	if(now - speedWindowTick >= APPROACH_SPEED_MS) {
+		speed = (travel - speedWindowTravel) * 1000.0f / (float)(now - speedWindowTick);
+		speedWindowTravel = travel;
+		speedWindowTick = now;
+	}
+
+	uint32_t seq = distanceSeq;
+	if(seq != lastSeq) {
+		lastSeq = seq;
+		float reading = distance; // the range when travelAtPing was taken
+		if(!haveRange || rejected || fabsf(reading - rangeAtPing) <= APPROACH_JUMP_MM) {
+			rangeAtPing = reading;
+			haveRange = reading > 0.0f;
+			rejected = 0;
+			lastReadingTick = now;
+		} else {
+			rejected = 1;
+		}
+		// This trigger's echo is the next reading
+		rangeAtPing -= travel - travelAtPing;
+		travelAtPing = travel;
+	}
+	float range = rangeAtPing - (travel - travelAtPing);
+	float remaining = range - cmd.param2DistAngle;
+
+	if(haveRange && remaining <= speed * speed / (2.0f * APPROACH_BRAKE)) {
+		motorStop();
+		isFrontCalib = 0;
+		setServoAngle(SERVO_CENTER);
+		*startRange = travel + range;
+		return 1;
+	}
+
+	if(haveRange && range < cmd.param2DistAngle + 1500.0f && toSendReq1){
+		task2RequestCapture(1);
+		toSendReq1 = 0;
+	}
+
+	// Speed the remaining range can still be braked from
+	float vRef = APPROACH_V_END;
+	if(!haveRange || now - lastReadingTick > APPROACH_STALE_MS) {
+		sprintf(buf1, "Range stale...");
+	} else {
+		float v2 = APPROACH_V_END * APPROACH_V_END + 2.0f * APPROACH_DECEL * remaining;
+		vRef = v2 > 0.0f ? sqrtf(v2) : 0.0f;
+		if(vRef > APPROACH_V_MAX) vRef = APPROACH_V_MAX;
+		sprintf(buf1, vRef < APPROACH_V_MAX ? "Slowing down..." : "GoGoGo...");
+	}
+
+	// MotorA & MotorB speed difference fix
+	float headingError = totalDistanceA - totalDistanceB;
+	headingIntegral += headingError;
+	if(headingIntegral > 100) headingIntegral = 100;
+	if(headingIntegral < -100) headingIntegral = -100;
+	float headingDerivative = headingError - prevHeadingError;
+	prevHeadingError = headingError;
+	float headingCorrection = headingError + headingIntegral + headingDerivative;
+
+	if(speed > vRef + APPROACH_OVERSPEED) {
+		motorStop(); // short brake until back on the profile
+		return 0;
+	}
+	float pwm = APPROACH_PWM_STATIC + APPROACH_PWM_PER_MMS * vRef + APPROACH_KP * (vRef - speed);
+	int32_t speedA = (int32_t)(pwm - headingCorrection);
+	int32_t speedB = (int32_t)(pwm + headingCorrection);
+	if (speedA > 7199) speedA = 7199;
+	if (speedA < 0) speedA = 0;
+	if (speedB > 7199) speedB = 7199;
+	if (speedB < 0) speedB = 0;
+	motorForwardA(speedA);
+	motorForwardB(speedB);
+
+	sprintf(buf2, "ObsD: %.1f", range);
+	return 0;
+}
+
 uint8_t motorPidForwardBackwardsUntil(MotorCommandF_t cmd, uint8_t isStateChanged) {
 
     static float headingIntegral = 0.0f;
@@ -1172,13 +1392,13 @@ uint8_t motorPidForwardBackwardsUntil(MotorCommandF_t cmd, uint8_t isStateChange
 
         totalDistanceA = 0.0f;
         totalDistanceB = 0.0f;
-        lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-        lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+        lastEncoderA = Encoder_Count(ENCODER_A);
+        lastEncoderB = Encoder_Count(ENCODER_B);
     }
 
     // Get encoder deltas (with wraparound handling)
-    int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-    int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+    int32_t currentEncoderA = Encoder_Count(ENCODER_A);
+    int32_t currentEncoderB = Encoder_Count(ENCODER_B);
 
     int32_t rawDiffA = currentEncoderA - lastEncoderA;
     if (rawDiffA > 32767) rawDiffA -= 65536;
@@ -1264,7 +1484,7 @@ uint8_t motorPidForwardBackwardsUntil(MotorCommandF_t cmd, uint8_t isStateChange
 				}
 				else {
 					if(toSendReq2){
-						HAL_UART_Transmit(&huart3,(uint8_t *)capture2Req,strlen(capture2Req),0xFFFF);
+						task2RequestCapture(2);
 						toSendReq2 = 0;
 					}
 					if (revSpeedA > 800){
@@ -1308,7 +1528,7 @@ uint8_t motorPidForwardBackwardsUntil(MotorCommandF_t cmd, uint8_t isStateChange
 			sprintf(buf1, "Slowing down..."	);
 
 			if(distance < targetDistanceFromObstacle+300.0f && toSendReq2){
-				HAL_UART_Transmit(&huart3,(uint8_t *)capture2Req,strlen(capture2Req),0xFFFF);
+				task2RequestCapture(2);
 				toSendReq2 = 0;
 			}
 		}else{
@@ -1385,14 +1605,14 @@ uint8_t motorPidReverse(MotorCommand_t cmd, uint8_t isStateChanged) {
 			hasTargetDistance = 0;
 			targetDistance = 0.0f;
 		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+		lastEncoderA = Encoder_Count(ENCODER_A);
+		lastEncoderB = Encoder_Count(ENCODER_B);
 	}
 
 	int32_t speedA = cmd.param1Speed;
 	int32_t speedB = cmd.param1Speed;
 
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
+	int32_t currentEncoderA = Encoder_Count(ENCODER_A);
 	int32_t diffA;
 	int32_t rawDiffA = currentEncoderA - lastEncoderA;
 	if (rawDiffA > 32767) {
@@ -1409,7 +1629,7 @@ uint8_t motorPidReverse(MotorCommand_t cmd, uint8_t isStateChanged) {
 //	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
 	lastEncoderA = currentEncoderA;
 
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+	int32_t currentEncoderB = Encoder_Count(ENCODER_B);
 	int32_t diffB = 0;
 	int32_t rawDiffB = currentEncoderB - lastEncoderB;
 	if (rawDiffB > 32767) {
@@ -1546,14 +1766,14 @@ uint8_t motorPidReverseF(MotorCommandF_t cmd, uint8_t isStateChanged) {
 			hasTargetDistance = 0;
 			targetDistance = 0.0f;
 		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+		lastEncoderA = Encoder_Count(ENCODER_A);
+		lastEncoderB = Encoder_Count(ENCODER_B);
 	}
 
 	int32_t speedA = cmd.param1Speed;
 	int32_t speedB = cmd.param1Speed;
 
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
+	int32_t currentEncoderA = Encoder_Count(ENCODER_A);
 	int32_t diffA;
 	int32_t rawDiffA = currentEncoderA - lastEncoderA;
 	if (rawDiffA > 32767) {
@@ -1570,7 +1790,7 @@ uint8_t motorPidReverseF(MotorCommandF_t cmd, uint8_t isStateChanged) {
 //	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
 	lastEncoderA = currentEncoderA;
 
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+	int32_t currentEncoderB = Encoder_Count(ENCODER_B);
 	int32_t diffB = 0;
 	int32_t rawDiffB = currentEncoderB - lastEncoderB;
 	if (rawDiffB > 32767) {
@@ -1861,8 +2081,8 @@ void playNote(uint16_t frequency, uint16_t duration) {
 //	return 0;
 //}
 
-void setServoAngle(int pwm) {
-    __HAL_TIM_SET_COMPARE(&htim12, TIM_CHANNEL_1, pwm);
+static inline void setServoAngle(int pwm) {
+	Servo_Set(pwm);
 }
 
 uint8_t motorTurn(MotorCommand_t cmd, uint8_t isStateChanged) {
@@ -2306,23 +2526,28 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
     static float obs2ReturnDistance = 0.0f;
 	static float turn_angle_rad;
 	static float turn_angle_deg;
+	static float startRange;
 
 	    if(isStateChanged) {
 	    	task2State = OBS1FORWARD;
 //	    	task2State = OBS2FOLLOW; // for testing only
 	        subStateChanged = 1;
+	        task2LapStart();
 	    }
+	    task2LapTrack(task2State, task2State == OBS1TURN ? obs1TurnPhase
+	    		: task2State == OBS2FOLLOW ? followSubState
+	    		: task2State == OBS2RETURN ? obs2ReturnPhase
+	    		: task2State == PARKING ? parkingSubState : 0);
 
 	    switch(task2State) {
 	    case OBS1FORWARD:
 	    	sprintf(buf, "OBS1FORWARD\0");
 	    	if(subStateChanged) {
-				x += getFilteredUltrasonicDist();
 	    		subCmd.command = FWD;
-	    		subCmd.param1Speed = 5000;
-	    		subCmd.param2DistAngle = 350; // Stop 30cm from the obstacle 1
+	    		subCmd.param2DistAngle = 350; // Stop 35cm from the obstacle 1
 	    	}
-	    	if(motorPidForwardTask2Until(subCmd, subStateChanged)) {
+	    	if(motorApproachTask2(subCmd, subStateChanged, &startRange)) {
+	    		x += startRange;
 	    		task2State = OBS1CAPTURE;
 	    		subStateChanged = 1;
 	    		osDelay(100);
@@ -2335,7 +2560,7 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	    	if(subStateChanged){
 	    		subStateChanged = 0;
 	    		if(capture1 == 0) {
-	    			HAL_UART_Transmit(&huart3,(uint8_t *)capture1Req,strlen(capture1Req),0xFFFF);
+	    			task2RequestCapture(1);
 	    		}
 	    		osDelay(50);
 	    	}
@@ -2530,7 +2755,7 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	    		subStateChanged = 0;
 	    		const uint8_t result[11] = "!CAPTURE2;\0";
 	    		if(capture2 == 0) {
-	    			HAL_UART_Transmit(&huart3,(uint8_t *)capture2Req,strlen(capture2Req),0xFFFF);
+	    			task2RequestCapture(2);
 	    		}
 	    	}
 	    	switch(capture2){
@@ -2888,6 +3113,7 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	            break;
 	        }
 	    case TASK2DONE:
+	    	task2LapSend(cmd.cmdId);
 	    	osDelay(500);
 	    	return 1;
 	    	break;
@@ -4132,16 +4358,16 @@ void encoder(void *argument)
   int cnt1A, cnt2A;
   int cnt1B, cnt2B;
 
-  cnt1A = __HAL_TIM_GET_COUNTER(&htim2);
-  cnt1B = __HAL_TIM_GET_COUNTER(&htim3);
+  cnt1A = Encoder_Count(ENCODER_A);
+  cnt1B = Encoder_Count(ENCODER_B);
 
   uint16_t dirA, dirB;
 
   /* Infinite loop */
   for(;;)
   {
-		cnt2A = __HAL_TIM_GET_COUNTER(&htim2);
-		cnt2B = __HAL_TIM_GET_COUNTER(&htim3);
+		cnt2A = Encoder_Count(ENCODER_A);
+		cnt2B = Encoder_Count(ENCODER_B);
 
 		// handle overflow / underflow
 		if (__HAL_TIM_IS_TIM_COUNTING_DOWN(&htim2)){
@@ -4185,8 +4411,8 @@ void encoder(void *argument)
 		dirB = __HAL_TIM_IS_TIM_COUNTING_DOWN(&htim3);
 //		sprintf(buf2, "MtrB:%5d | %1d", pidB.measured_speed, dirB);
 
-		cnt1A = __HAL_TIM_GET_COUNTER(&htim2);
-		cnt1B = __HAL_TIM_GET_COUNTER(&htim3);
+		cnt1A = Encoder_Count(ENCODER_A);
+		cnt1B = Encoder_Count(ENCODER_B);
     osDelay(10);
   }
   /* USER CODE END encoder */
@@ -4256,6 +4482,7 @@ void ultrasonic(void *argument)
 
 	  //measure
 	  distance = (float)echo * (171.5f) / 1000.0f;
+	  distanceSeq++;
 
 //	  sprintf(buf4, "Dist: %5.1f mm", distance);
   }
@@ -51,6 +51,11 @@
 #if defined(__ICCARM__) || defined(__CC_ARM) || defined(__GNUC__)
   #include <stdint.h>
   extern uint32_t SystemCoreClock;
+/* USER CODE BEGIN 0 */
+  void PreSleepProcessing(uint32_t ulExpectedIdleTime);
+  void PostSleepProcessing(uint32_t ulExpectedIdleTime);
+  extern void Wcet_TaskSwitchedIn(void *tag);
+/* USER CODE END 0 */
 #endif
 #ifndef CMSIS_device_header
 #define CMSIS_device_header "stm32f4xx.h"
@@ -64,13 +69,15 @@
 #define configSUPPORT_DYNAMIC_ALLOCATION         1
 #define configUSE_IDLE_HOOK                      0
 #define configUSE_TICK_HOOK                      0
+#define configUSE_TICKLESS_IDLE                  1
 #define configCPU_CLOCK_HZ                       ( SystemCoreClock )
 #define configTICK_RATE_HZ                       ((TickType_t)1000)
 #define configMAX_PRIORITIES                     ( 56 )
 #define configMINIMAL_STACK_SIZE                 ((uint16_t)128)
-#define configTOTAL_HEAP_SIZE                    ((size_t)15360)
+#define configTOTAL_HEAP_SIZE                    ((size_t)2048)
 #define configMAX_TASK_NAME_LEN                  ( 16 )
 #define configUSE_TRACE_FACILITY                 0
+#define configUSE_APPLICATION_TASK_TAG           1
 #define configCHECK_FOR_STACK_OVERFLOW           2
 #define configUSE_16_BIT_TICKS                   0
 #define configUSE_MUTEXES                        1
@@ -169,6 +176,15 @@ standard names. */
 
 /* USER CODE BEGIN Defines */
 /* Section where parameter definitions can be added (for instance, to override default ones in FreeRTOS.h) */
+/* Tickless idle: with every task blocked for at least two ticks the kernel
+   stops SysTick and sleeps (WFI) until the next deadline or an interrupt.
+   freertos.c pauses the TIM6 HAL tick around it. */
+#define configPRE_SLEEP_PROCESSING               PreSleepProcessing
+#define configPOST_SLEEP_PROCESSING              PostSleepProcessing
+/* Task execution times for the schedulability report (task_wcet.h): the
+   switch hook charges the cycles since the last switch to the outgoing
+   task's tag and starts counting for the incoming one. */
+#define traceTASK_SWITCHED_IN()                  Wcet_TaskSwitchedIn((void *)pxCurrentTCB->pxTaskTag)
 /* USER CODE END Defines */
 
 #endif /* FREERTOS_CONFIG_H */
@@ -0,0 +1,30 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+// === stm32-motor pin/timer map, read by Common/Inc/motor_core.h ===
+// Must match the .ioc; channel numbers are 1..4.
+#define BOARD_PWM_MAX         7199   // TIM4/TIM9 period
+
+// Motor A: TIM4 CH3 (IN2) / CH4 (IN1). FWD drives the robot forward.
+#define BOARD_MOTOR_A_TIM     TIM4
+#define BOARD_MOTOR_A_HTIM    htim4
+#define BOARD_MOTOR_A_FWD     3
+#define BOARD_MOTOR_A_REV     4
+
+// Motor B: TIM9 CH1 (IN2) / CH2 (IN1). FWD drives the robot forward.
+#define BOARD_MOTOR_B_TIM     TIM9
+#define BOARD_MOTOR_B_HTIM    htim9
+#define BOARD_MOTOR_B_FWD     1
+#define BOARD_MOTOR_B_REV     2
+
+// Encoders: x4 quadrature, 16-bit period
+#define BOARD_ENCODER_A_TIM   TIM2
+#define BOARD_ENCODER_B_TIM   TIM3
+
+// Steering servo: TIM12 CH1, period 2000
+#define BOARD_SERVO_TIM       TIM12
+#define BOARD_SERVO_HTIM      htim12
+#define BOARD_SERVO_CH        1
+// ================================================
+
+#endif // BOARD_H
@@ -0,0 +1,48 @@
+#ifndef FRONT_RANGE_H
+#define FRONT_RANGE_H
+
+#include <stdint.h>
+
+// Range to whatever is straight ahead, as a 1D Kalman filter. readIMU() predicts
+// it every IMU_READ_MS (200 Hz) from the wheels' travel, so it closes in between
+// the 20 Hz echoes; ultrasonic() corrects it with each echo. An echo too far from
+// the prediction is dropped as an outlier, unless FRONT_RANGE_REACQUIRE of them
+// in a row agree the obstacle has moved, and then the filter starts over there.
+// Range rate comes from the wheels alone: the obstacles do not move.
+
+// Noise, as variances
+#define FRONT_RANGE_ECHO_VAR       100.0f // mm^2 per echo: 10 mm (1 sigma)
+#define FRONT_RANGE_VAR_PER_MM     0.2f   // mm^2 per mm driven: wheel slip
+#define FRONT_RANGE_VAR_PER_S      25.0f  // mm^2 per second: whatever the wheels miss
+#define FRONT_RANGE_GATE_SIGMA     3.0f   // Innovations beyond this many sigma are outliers
+#define FRONT_RANGE_REACQUIRE      3
+#define FRONT_RANGE_RATE_TAU_S     0.02f  // Smoothing of the encoder range rate
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  float mm;      // Range
+  float rateMmS; // d(mm)/dt, negative while closing in
+  float var;     // mm^2
+  float ageS;    // Since the last echo it took
+  uint8_t valid; // An echo has been taken
+} FrontRange;
+
+// Prediction: dist is the chassis travel in cm (+ = forward) over dt s.
+// The odometry's stepping task only.
+void frontRangeStep(float dist, float dt);
+
+// Correction with a range of mm and variance var, measured ageS ago. Returns 1
+// if it was taken, 0 for an outlier. Any task.
+uint8_t frontRangeMeasure(float mm, float var, float ageS);
+
+// Consistent copy of the estimate; any task
+void frontRangeGet(FrontRange *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FRONT_RANGE_H
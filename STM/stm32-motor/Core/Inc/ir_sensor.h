@@ -19,6 +19,7 @@
 extern "C" {
 #endif
 
+// Inputs with pull-ups, interrupting on both edges (EXTI9_5)
 void IR_Sensors_Init(void);
 
 // Returns 1 = object detected, 0 = clear
@@ -55,7 +55,10 @@ void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
-
+// Native USB link (LINK_USB_CDC in main.c), for usbd_cdc_if.c's CDC_Receive_FS
+// and CDC_TransmitCplt_FS
+void linkUsbReceive(const uint8_t *data, uint32_t len);
+void linkUsbTxDone(void);
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
@@ -77,8 +80,8 @@ void Error_Handler(void);
 #define OLED_SCL_GPIO_Port GPIOD
 #define TIM8_CH2_ULTRASONIC_Pin GPIO_PIN_7
 #define TIM8_CH2_ULTRASONIC_GPIO_Port GPIOC
-#define ULTRASONIC_SENSOR_Pin GPIO_PIN_8
-#define ULTRASONIC_SENSOR_GPIO_Port GPIOC
+#define TIM8_CH3_ULTRASONIC_TRIG_Pin GPIO_PIN_8
+#define TIM8_CH3_ULTRASONIC_TRIG_GPIO_Port GPIOC
 #define TIM2_CH1_ENCODER_A_Pin GPIO_PIN_15
 #define TIM2_CH1_ENCODER_A_GPIO_Port GPIOA
 #define TIM2_CH2_ENCODER_A_Pin GPIO_PIN_3
@@ -96,6 +99,9 @@ void Error_Handler(void);
 #define USER_BTN_EXTI_IRQn EXTI0_IRQn
 
 /* USER CODE BEGIN Private defines */
+// Link latency probe (PING): toggled at each stage of a command's trip, see main.c
+#define LINK_PROBE_Pin GPIO_PIN_10
+#define LINK_PROBE_GPIO_Port GPIOE
 
 /* USER CODE END Private defines */
 
@@ -0,0 +1,42 @@
+#ifndef ODOMETRY_H
+#define ODOMETRY_H
+
+#include <stdint.h>
+
+// Dead-reckoned pose, stepped by readIMU() every IMU_READ_MS (200 Hz).
+// Distance is the mean of the two wheels' travel; heading comes from the gyro,
+// which slips far less than the wheels do on a steered chassis. x is forward
+// and y to the left of where the board booted, theta counter-clockwise.
+// P is the covariance of (x, y, theta), propagated with the linearised model.
+
+// Noise added per step, as variances
+#define ODOM_DIST_VAR_PER_CM  0.01f    // cm^2 per cm driven: 1 cm (1 sigma) after 1 m
+#define ODOM_YAW_VAR_PER_RAD  0.0003f  // rad^2 per rad turned: gyro scale error
+#define ODOM_YAW_VAR_PER_S    0.00002f // rad^2 per second: residual bias drift
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  float x, y;   // cm
+  float theta;  // rad, not wrapped
+  float P[3][3];
+} OdometryPose;
+
+// One step: dist is the chassis travel in cm (+ = forward), dYaw the heading
+// change in rad (+ = left) and dt the step length in s. One task only.
+void odometryStep(float dist, float dYaw, float dt);
+
+// Consistent copy of the latest pose; any task
+void odometryGet(OdometryPose *pose);
+
+// Starts from pose instead of the origin (a pose kept across a reset); the
+// stepping task, before its first odometryStep()
+void odometrySet(const OdometryPose *pose);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // ODOMETRY_H
@@ -0,0 +1,76 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <stdint.h>
+#include "odometry.h"
+
+// Fault recovery. The IWDG is only refreshed while every task that has checked
+// in keeps checking in, so a hung task or a spin in Error_Handler() resets the
+// board within RECOVERY_WDG_MS. A record in backup SRAM survives that reset:
+// the command that was running, how much of it was left, the IMU and pose
+// state, and the negotiated link rate. The next boot picks the heading and pose back up and tells the RPi
+// which command to resend ("!<cmdId>/RESET/<remaining>/<cause>;").
+
+#define RECOVERY_WDG_MS  1000u // IWDG timeout; the longest osDelay() in a motion primitive is 500 ms
+#define RECOVERY_KICK_MS 100u  // Supervisor period
+
+// Tasks whose liveness gates the watchdog, as bits
+#define RECOVERY_TASK_MOTOR   (1u << 0)
+#define RECOVERY_TASK_IMU     (1u << 1)
+#define RECOVERY_TASK_ENCODER (1u << 2)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {RECOVERY_WATCHDOG, RECOVERY_ERROR, RECOVERY_BUTTON} RecoveryCause;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t cmdId;        // Command running at the reset, or the last one finished
+  float remaining;       // cm or degrees of it still to go, < 0 if unknown
+  uint32_t fault;        // Set by recoveryFault() just before it resets
+  uint8_t imuValid;      // The IMU fields below have been written
+  float heading;         // currentAngle, degrees
+  float gyroBias;        // dps
+  float roll0, pitch0;   // IMU mounting attitude at rest, rad
+  OdometryPose pose;
+  uint32_t linkBaud;     // USART3 rate the RPi confirmed, 0 for the default
+} RecoveryRecord;
+
+// First thing in main(), before any task runs. Reads and clears the reset flags.
+void recoveryInit(void);
+
+// The record the previous run left, or NULL after a power-on (nothing to resume)
+const RecoveryRecord *recoveryLastRun(void);
+RecoveryCause recoveryCause(void);
+const char *recoveryCauseName(void);
+
+// Starts the IWDG; it cannot be stopped again
+void recoveryWatchdogStart(void);
+
+// Task side: call at least once per RECOVERY_WDG_MS from every loop iteration.
+// A task is watched from its first check-in on, so start-up delays are free.
+void recoveryCheckIn(uint32_t task);
+
+// Refreshes the watchdog if every watched task has checked in since the last
+// refresh. Every RECOVERY_KICK_MS from one task.
+void recoverySupervise(void);
+
+// State to resume from; plain stores, safe at the control rate
+void recoveryNoteCommand(uint32_t cmdId, float remaining);
+void recoveryNoteRemaining(float remaining);
+void recoveryNoteImu(float heading, float gyroBias, float roll0, float pitch0, const OdometryPose *pose);
+void recoveryNoteLinkBaud(uint32_t baud);
+// The command noted last, and into *remaining what is left of it: what a reset
+// would report now
+uint32_t recoveryCommand(float *remaining);
+
+// Records the fault and resets at once rather than waiting for the watchdog
+void recoveryFault(void) __attribute__((noreturn));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RECOVERY_H
@@ -52,6 +52,27 @@
 
 /* USER CODE END FunctionPrototypes */
 
+/* Pre/Post sleep processing prototypes */
+void PreSleepProcessing(uint32_t ulExpectedIdleTime);
+void PostSleepProcessing(uint32_t ulExpectedIdleTime);
+
+/* USER CODE BEGIN PREPOSTSLEEP */
+/* TIM6 drives HAL_IncTick() at 1 kHz and would wake the core every millisecond
+ * of a tickless sleep, so it stops for the sleep. HAL_GetTick() follows the
+ * kernel tick, which the port steps over the time slept (main.c). */
+void PreSleepProcessing(uint32_t ulExpectedIdleTime)
+{
+  (void)ulExpectedIdleTime;
+  HAL_SuspendTick();
+}
+
+void PostSleepProcessing(uint32_t ulExpectedIdleTime)
+{
+  (void)ulExpectedIdleTime;
+  HAL_ResumeTick();
+}
+/* USER CODE END PREPOSTSLEEP */
+
 /* Private application code --------------------------------------------------*/
 /* USER CODE BEGIN Application */
 
@@ -0,0 +1,53 @@
+#include "front_range.h"
+
+#include <math.h>
+#include "FreeRTOS.h"
+#include "task.h"
+
+static FrontRange range;   // Invalid until the first echo
+static uint8_t rejected;   // Outliers in a row
+
+void frontRangeStep(float dist, float dt){
+  float mm = dist * 10.0f;
+  taskENTER_CRITICAL(); // frontRangeMeasure() writes it too
+  range.mm -= mm;
+  range.var += FRONT_RANGE_VAR_PER_MM * fabsf(mm) + FRONT_RANGE_VAR_PER_S * dt;
+  range.ageS += dt;
+  if(dt > 0.0f){
+    float a = dt / (FRONT_RANGE_RATE_TAU_S + dt);
+    range.rateMmS += a * (-mm / dt - range.rateMmS);
+  }
+  taskEXIT_CRITICAL();
+}
+
+uint8_t frontRangeMeasure(float mm, float var, float ageS){
+  taskENTER_CRITICAL();
+  float z = mm + range.rateMmS * ageS; // What it would read now
+  float innovation = z - range.mm;
+  float s = range.var + var;
+  uint8_t outlier = range.valid && innovation * innovation > FRONT_RANGE_GATE_SIGMA * FRONT_RANGE_GATE_SIGMA * s;
+  if(outlier && ++rejected < FRONT_RANGE_REACQUIRE){
+    taskEXIT_CRITICAL();
+    return 0;
+  }
+  if(!range.valid || outlier){
+    // Start over at the echo
+    range.mm = z;
+    range.var = var;
+    range.valid = 1;
+  }else{
+    float k = range.var / s;
+    range.mm += k * innovation;
+    range.var *= 1.0f - k;
+  }
+  range.ageS = 0.0f;
+  rejected = 0;
+  taskEXIT_CRITICAL();
+  return 1;
+}
+
+void frontRangeGet(FrontRange *out){
+  taskENTER_CRITICAL();
+  *out = range;
+  taskEXIT_CRITICAL();
+}
@@ -5,7 +5,7 @@ void IR_Sensors_Init(void){
   __HAL_RCC_GPIOC_CLK_ENABLE();
 
   GPIO_InitTypeDef g = {0};
-  g.Mode  = GPIO_MODE_INPUT;
+  g.Mode  = GPIO_MODE_IT_RISING_FALLING; // Every edge goes to HAL_GPIO_EXTI_Callback()
   // g.Pull  = GPIO_NOPULL;
   g.Pull  = GPIO_PULLUP;          // Set to PULLUP to ensure a stable HIGH state when no sensor is connected
   g.Speed = GPIO_SPEED_FREQ_LOW;
@@ -17,4 +17,10 @@ void IR_Sensors_Init(void){
   // RIGHT -> PC9
   g.Pin = IR_RIGHT_Pin;
   HAL_GPIO_Init(IR_RIGHT_GPIO_Port, &g);
+
+  // PC6 and PC9 share EXTI9_5; EXTI9_5_IRQHandler() is in stm32f4xx_it.c.
+  // Priority 5 is the highest allowed to call FreeRTOS FromISR functions;
+  // main() then moves it to IRQ_PRIO_OTHER (irq_prio.h).
+  HAL_NVIC_SetPriority(EXTI9_5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
 }
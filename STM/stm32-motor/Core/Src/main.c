@@ -27,11 +27,33 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "queue.h"
+#include "event_groups.h" // bootReady, the readiness barrier motor() waits on
 #include "ir_sensor.h"   // our PC6/PC9 sensor helpers
+#include "motor_core.h"  // Motor_Set(), Servo_Set(), Encoder_Count() on the board.h map
+#include "odometry.h"    // Pose from the wheels and gyro, stepped in readIMU()
+#include "front_range.h" // Echoes and wheel travel fused into one front range
+#include "recovery.h"    // Watchdog and the state kept in backup SRAM across a reset
+#include "fast_mem.h"    // FAST_CODE for the hot ISRs, FastMem_CheckArt()
+#include "task_wcet.h"   // Per-iteration task and per-call ISR cycles for GENERAL/SCHED
+#include "prof.h"        // PROF_BEGIN/END() regions for GENERAL/PROF
+#include "fmt.h"         // Float fields for the OLED lines, without float printf
+#include "i2c_bus.h"     // Queued I2C2 with deadlines and bus recovery, for readIMU()
+#include "irq_prio.h"    // The NVIC levels every ISR runs at, IrqPrio_Apply()
 #include <string.h>        // your SSD1306 driver
+#include "protocol_keywords.h" // Generated by RPI/gen_protocol_keywords.py
+// Native USB CDC link next to USART3 (see "Link transports" below). 1 needs
+// CubeMX's USB_DEVICE middleware with the CDC class; 0 keeps USART3 alone, as before.
+#ifndef LINK_USB_CDC
+#define LINK_USB_CDC 0
+#endif
+#if LINK_USB_CDC
+#include "usb_device.h"
+#include "usbd_cdc_if.h" // CDC_Transmit_FS()
+#endif
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
+typedef StaticTask_t osStaticThreadDef_t;
 /* USER CODE BEGIN PTD */
 typedef struct {
     float Kp;
@@ -53,6 +75,7 @@ typedef struct {
 	uint32_t param1Speed;
 	uint32_t param2DistAngle;
 	uint32_t cmdId;
+	uint8_t epoch;       // estopCount when its frame arrived; the motor task drops older ones
 } MotorCommand_t;
 
 typedef struct {
@@ -61,16 +84,180 @@ typedef struct {
 	float param2DistAngle;
 	uint32_t cmdId;
 } MotorCommandF_t;
+
+// One step of an uploaded route; opcode is BIN_OPCODE_BASE + enum cmdList, ROUTE_SNAP or ROUTE_PASS
+typedef struct {
+	uint8_t opcode;
+	uint8_t speed;       // Percent, as in the ":id/MOTOR/..." P1
+	uint16_t distAngle;  // cm or degrees; obstacle ID for ROUTE_SNAP and ROUTE_PASS
+} RouteStep;
+
+// One step of a song, in TIM1 register order for a PSC..CCR1 DMA burst
+typedef struct {
+	uint32_t psc;
+	uint32_t arr;
+	uint32_t rcr; // Step lasts rcr + 1 timer periods
+	uint32_t ccr1;
+} ToneStep;
 /* USER CODE END PTD */
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+// Memory map (STM32F407VETX_FLASH.ld): task stacks and TCBs go to CCM-RAM by
+// name, with anything marked CCMRAM. CCM is zeroed at reset like .bss but DMA
+// cannot reach it, so DMA buffers stay in SRAM. Nothing allocates from the
+// FreeRTOS heap at boot.
+#define CCMRAM __attribute__((section(".ccmbss")))
+// Binary command frame from the RPi (see RPI/stm32_protocol.h), little-endian:
+// 0xA5 | LEN=7 | OPCODE | ID(2) | SPEED(2) | DIST/ANGLE(2) | CRC-16/CCITT-FALSE over LEN..DIST(2)
+// OPCODE is BIN_OPCODE_BASE + enum cmdList.
+#define BIN_SYNC 0xA5
+#define BIN_PAYLOAD_LEN 7
+#define BIN_FRAME_LEN (2 + BIN_PAYLOAD_LEN + 2)
+#define BIN_OPCODE_BASE 0x10
+#define BIN_RING_SIZE 4 // Frames buffered between the UART ISR and rxSerial
+// Route executor, also in RPI/stm32_protocol.h: the whole route arrives in
+// ROUTE frames (LEN = ROUTE_HEADER_LEN + 4 per step), then the motor task runs
+// it step by step without the RPi, stopping at ROUTE_SNAP steps until RESUME.
+// A ROUTE_PASS step is a snapshot taken on the move: the RPi is told and the
+// robot drives straight on into the next step.
+#define BIN_OP_ROUTE 0x20
+#define BIN_OP_RESUME 0x21
+#define BIN_OP_PING 0x22 // Latency probe, answered like GENERAL/PING
+#define ROUTE_SNAP 0x30
+#define ROUTE_PASS 0x31
+#define ROUTE_MAX_STEPS 128
+#define ROUTE_STEPS_PER_FRAME 32
+#define ROUTE_HEADER_LEN 7 // OPCODE | ID(2) | BASE(2) | FIRST | TOTAL
+#define BIN_ROUTE_MAX_PAYLOAD (ROUTE_HEADER_LEN + 4 * ROUTE_STEPS_PER_FRAME)
+// Emergency stop: this byte between frames (ASCII CAN; neither protocol can
+// start a frame with it) stops the wheels from the RX interrupt, drops the
+// route and every command received before it, and the motor task replies
+// "!id/STOPPED/remaining;".
+#define ESTOP_BYTE 0x18
+
+// Motion-settled detection after a command's DONE. The robot counts as at rest
+// once both encoders and the gyro stay below these rates for SETTLE_HOLD_MS.
+#define SETTLE_ENCODER_TICKS 2    // Encoder ticks per 10 ms sample
+#define SETTLE_GYRO_DPS 2.0f
+#define SETTLE_HOLD_MS 30
+#define SETTLE_TIMEOUT_MS 1000    // Report SETTLED anyway after this long
+
+// encoder() samples both wheels every ENCODER_SAMPLE_MS. Below
+// ENCODER_PERIOD_MAX_COUNTS per sample the speed comes from the TI1 edge
+// period instead, at most 1 kHz of CC1 interrupts per wheel.
+#define ENCODER_SAMPLE_MS 10
+#define ENCODER_PERIOD_MAX_COUNTS 40
+#define ENCODER_STALL_MS 100      // No edge for this long reads as stopped
+
+// motor() runs one control step per TIM7 update (16 MHz / 16 / 1000) and sleeps
+// in between. The primitives' per-step gains assume this rate.
+#define MOTOR_CTRL_HZ 1000
+// motorTask notification bits
+#define MOTOR_EVT_TICK    (1UL << 0) // TIM7 update
+#define MOTOR_EVT_COMMAND (1UL << 1) // motorCommandQueue has a new command
+#define MOTOR_EVT_CAPTURE (1UL << 2) // RPi answered CAPTURE1/CAPTURE2
+#define MOTOR_EVT_STOP    (1UL << 3) // An interrupt fired the armed stop trigger
+#define MOTOR_EVT_ESTOP   (1UL << 4) // The RX interrupt saw ESTOP_BYTE
+// An IR stop counts once the sensor has read "detected" this long since its
+// last edge; a shorter pulse is a glitch and the drive resumes
+#define IR_CONFIRM_MS 4
+
+// Task 2 obstacle approaches crawl over the last TASK2_DECIDE_MM while the
+// RPi's left/right answer is still outstanding, and stop only if they reach
+// the obstacle before it lands.
+#define TASK2_DECIDE_MM 150.0f
+
+// Task 2 drives home from obstacle 2 as one steered motion on the odometry pose
+// (task2HomeSpec below) and stops on the front range in the car park; 0 runs
+// OBS2TURN2, OBS2RETURN and PARKING's stop-start legs, as before.
+#ifndef TASK2_HOMING
+#define TASK2_HOMING 1
+#endif
+#define TRACK_HALF_CM 8.0f        // Half the rear track, for the wheel speeds on an arc
+#define HOME_RADIUS_CM 25.0f      // Turning radius at full lock
+#define HOME_LOOKAHEAD_CM 20.0f   // Pure pursuit: how far along the path the steering aims
+#define HOME_SIDE_CM 30.0f        // Offset from the centre line while passing obstacle 1
+#define HOME_CLEAR_CM 30.0f       // ... kept until this far past it
+#define HOME_FINAL_CM 20.0f       // Straight run into the car park on the centre line
+#define HOME_STOP_MM 100.0f       // Front range to the car park's back wall to stop at
+#define HOME_OVERSHOOT_CM 15.0f   // How far past home a range stop may run; without an echo, home
+
+// ultrasonic() keeps the last ULTRASONIC_WINDOW echoes (20 Hz, so 400 ms) and
+// publishes their mean without the ULTRASONIC_TRIM lowest and highest.
+#define ULTRASONIC_WINDOW 8
+#define ULTRASONIC_TRIM 2
+
+// The ultrasonic approaches stop on front_range.h's estimate, which the wheels
+// move on between echoes, while it has taken an echo in the last
+// FRONT_RANGE_STALE_S; 0 reads the last echo's `distance`, as before.
+#ifndef FRONT_RANGE_FUSION
+#define FRONT_RANGE_FUSION 1
+#endif
+#define FRONT_RANGE_STALE_S 0.3f
+
+// Fast boot: the robot takes commands within BOOT_READY_TARGET_MS of power-on
+// instead of after a second's servo sweep, a second's IMU power-up wait and a
+// second's bias capture in a row. The servo only centres, the IMU starts once
+// it answers and captures its bias for IMU_BIAS_CAPTURE_S (a reset still
+// carries the last bias over in backup SRAM), the OLED comes up in show()
+// rather than holding main(), and motor() takes the first command once the
+// servo and the IMU have both set their bit in bootReady. It then sends
+// "!0/READY/<ms since boot>;". 0 keeps the old start-up, without READY.
+#ifndef FAST_BOOT
+#define FAST_BOOT 1
+#endif
+#define BOOT_READY_TARGET_MS 300u
+#define BOOT_READY_TIMEOUT_MS 3000u  // Whatever has not come up by then, motor() starts without
+#define BOOT_SERVO_SETTLE_MS 150u    // Centre from wherever the servo was left
+#define BOOT_READY_SERVO (1u << 0)
+#define BOOT_READY_IMU   (1u << 1)
+#define BOOT_READY_ALL   (BOOT_READY_SERVO | BOOT_READY_IMU)
+
 #define ICM20948_I2C_ADDR   (0x68 << 1)
 #define AK09916_I2C_ADDR    (0x0C << 1) // AK09916's I2C address is 0x0C
 #define AK09916_ST1_REG     0x10        // Status 1 Register
 #define AK09916_HXL_REG     0x11        // X-axis magnetic data, lower byte
 #define AK09916_ST2_REG     0x18        // Status 2 Register
 #define AK09916_CNTL2_REG   0x31        // Control 2 Register
+// ICM-20948 registers; bank 0 unless noted, REG_BANK_SEL is visible in every bank
+#define ICM20948_WHO_AM_I         0x00  // Reads ICM20948_WHO_AM_I_VALUE
+#define ICM20948_WHO_AM_I_VALUE   0xEA
+#define ICM20948_USER_CTRL        0x03
+#define ICM20948_PWR_MGMT_1       0x06
+#define ICM20948_PWR_MGMT_2       0x07
+#define ICM20948_INT_PIN_CFG      0x0F
+#define ICM20948_FIFO_EN_2        0x67
+#define ICM20948_FIFO_RST         0x68
+#define ICM20948_FIFO_MODE        0x69
+#define ICM20948_FIFO_COUNTH      0x70
+#define ICM20948_FIFO_R_W         0x72
+#define ICM20948_REG_BANK_SEL     0x7F
+#define ICM20948_GYRO_SMPLRT_DIV  0x00  // Bank 2
+#define ICM20948_GYRO_CONFIG_1    0x01  // Bank 2
+#define ICM20948_ODR_ALIGN_EN     0x09  // Bank 2
+#define ICM20948_ACCEL_SMPLRT_DIV_2 0x11 // Bank 2
+#define ICM20948_ACCEL_CONFIG     0x14  // Bank 2
+
+// readIMU() drains the FIFO (accel + gyro at IMU_ODR_HZ) every IMU_READ_MS and
+// integrates each sample over the fixed 1/IMU_ODR_HZ step, reading the
+// magnetometer on every other pass (AK09916 runs at 100 Hz).
+#define IMU_ODR_HZ 225.0f              // 1125 Hz / (1 + 4) for both gyro and accel
+#define IMU_READ_MS 5
+#define IMU_I2C_TIMEOUT_MS 6u          // Per transaction; the longest (16 samples, 192 bytes) is ~4.5 ms at 400 kHz
+#define IMU_FIFO_SAMPLE_BYTES 12       // ACCEL_XYZ then GYRO_XYZ, big-endian
+#define IMU_FIFO_MAX_SAMPLES 16        // More than this in the FIFO means we fell behind; reset it
+#define IMU_GYRO_LSB_PER_DPS 65.5f     // +-500 dps
+#define IMU_MAG_TAU_S 0.5f             // Pull towards the compass heading; the old 0.02 per 10 ms
+#define IMU_BIAS_TAU_S 2.0f            // Gyro bias tracking while both wheels are still
+#define IMU_POWERUP_MS 100u            // Datasheet start-up to register access, the longest WHO_AM_I is polled for
+#define IMU_GYRO_STARTUP_MS 35u        // Gyro start-up once woken, before its samples are good
+#if FAST_BOOT
+#define IMU_BIAS_CAPTURE_S 0.2f        // At rest after power-on; the still-wheel tracking refines it
+#else
+#define IMU_BIAS_CAPTURE_S 1.0f
+#endif
+#define IMU_BIAS_SAMPLES ((uint32_t)(IMU_ODR_HZ * IMU_BIAS_CAPTURE_S))
 
 #define SERVO_CENTER 152
 #define SERVO_CENTER_A 145
@@ -82,6 +269,22 @@ typedef struct {
 #define SERVO_RIGHT1 200
 #define SERVO_RANGE (SERVO_RIGHT_MAX - SERVO_LEFT_MAX)
 
+// Songs play from ToneStep tables: every TIM1 update event DMA-loads the
+// next step into the preloaded PSC/ARR/RCR/CCR1, so it takes effect when the
+// current step's repetitions run out. Tones count a 1 MHz tick (at most 256
+// periods per step), rests a 1 kHz tick with the output held low.
+#define TONE_CLOCK_HZ 16000000
+#define TONE(hz, ms) {TONE_CLOCK_HZ / 1000000 - 1, 1000000 / (hz) - 1, (uint32_t)(hz) * (ms) / 1000 - 1, (1000000 / (hz) - 1) / 10}
+#define REST(ms) {TONE_CLOCK_HZ / 1000 - 1, (ms) - 1, 0, 0}
+// The DMA finishes when the final step is loaded, i.e. as the one before it
+// starts; two silent steps at the end let the last note play out in full.
+#define TONE_END REST(1), REST(1)
+#define TONE_PLAY(song) tonePlay(song, sizeof(song) / sizeof(ToneStep))
+#define BUZZER_MUSIC 0 // 1 lets BGM/CAPTURE/DONE play; the startup chime always does
+// buzzerTask notification bits
+#define BUZZER_EVT_SONG (1UL << 0) // music changed
+#define BUZZER_EVT_DONE (1UL << 1) // TIM1 DMA loaded the last step
+
 // Some notes for fun
 #define NOTE_B0  31
 #define NOTE_C1  33
@@ -173,88 +376,63 @@ typedef struct {
 #define NOTE_D8  4699
 #define NOTE_DS8 4978
 
-int melody[] = {
-  NOTE_E5, NOTE_E5, 0, NOTE_E5, 0, NOTE_C5, NOTE_E5, 0,
-  NOTE_G5, 0, 0, 0, NOTE_G4, 0, 0, 0,
-
-  NOTE_C5, 0, 0, NOTE_G4, 0, 0, NOTE_E4, 0,
-  0, NOTE_A4, 0, NOTE_B4, 0, NOTE_AS4, NOTE_A4, 0,
-  NOTE_G4, NOTE_E5, NOTE_G5, NOTE_A5, 0, NOTE_F5, NOTE_G5, 0,
-  NOTE_E5, 0, NOTE_C5, 0, NOTE_D5, NOTE_B4, 0, 0,
-
-  NOTE_C5, 0, 0, NOTE_G4, 0, 0, NOTE_E4, 0,
-  0, NOTE_A4, 0, NOTE_B4, 0, NOTE_AS4, NOTE_A4, 0,
-  NOTE_G4, NOTE_E5, NOTE_G5, NOTE_A5, 0, NOTE_F5, NOTE_G5, 0,
-  NOTE_E5, 0, NOTE_C5, 0, NOTE_D5, NOTE_B4, 0, 0,
-
-  0, NOTE_G5, NOTE_FS5, NOTE_F5, 0, NOTE_DS5, 0, NOTE_E5,
-  0, NOTE_GS4, NOTE_A4, NOTE_C5, 0, NOTE_A4, NOTE_C5, NOTE_D5,
-  0, NOTE_G5, NOTE_FS5, NOTE_F5, 0, NOTE_DS5, 0, NOTE_E5,
-  0, NOTE_C6, 0, NOTE_C6, NOTE_C6, 0, 0, 0,
-
-  NOTE_G5, NOTE_FS5, NOTE_F5, 0, NOTE_DS5, 0, NOTE_E5, 0,
-  NOTE_GS4, NOTE_A4, NOTE_C5, 0, NOTE_A4, NOTE_C5, NOTE_D5, 0,
-  NOTE_DS5, 0, 0, NOTE_D5, 0, 0, NOTE_C5, 0,
-  0, 0, 0, 0, 0, 0, 0, 0,
-
-  NOTE_G5, NOTE_FS5, NOTE_F5, 0, NOTE_DS5, 0, NOTE_E5, 0,
-  NOTE_GS4, NOTE_A4, NOTE_C5, 0, NOTE_A4, NOTE_C5, NOTE_D5, 0,
-  NOTE_G5, NOTE_FS5, NOTE_F5, 0, NOTE_DS5, 0, NOTE_E5, 0,
-  NOTE_C6, 0, NOTE_C6, NOTE_C6, 0, 0, 0, 0,
-
-  NOTE_G5, NOTE_FS5, NOTE_F5, 0, NOTE_DS5, 0, NOTE_E5, 0,
-  NOTE_GS4, NOTE_A4, NOTE_C5, 0, NOTE_A4, NOTE_C5, NOTE_D5, 0,
-  NOTE_DS5, 0, 0, NOTE_D5, 0, 0, NOTE_C5, 0
+const ToneStep melodySong[] = {
+  TONE(NOTE_E5, 125), TONE(NOTE_E5, 125), REST(125), TONE(NOTE_E5, 125), REST(167), TONE(NOTE_C5, 125), TONE(NOTE_E5, 125), REST(125),
+  TONE(NOTE_G5, 125), REST(375), REST(125), REST(125), TONE(NOTE_G4, 125), REST(375), REST(125), REST(125),
+
+  TONE(NOTE_C5, 125), REST(250), REST(125), TONE(NOTE_G4, 125), REST(250), REST(125), TONE(NOTE_E4, 125), REST(250),
+  REST(125), TONE(NOTE_A4, 125), REST(125), TONE(NOTE_B4, 125), REST(125), TONE(NOTE_AS4, 125), TONE(NOTE_A4, 42), REST(125),
+  TONE(NOTE_G4, 125), TONE(NOTE_E5, 125), TONE(NOTE_G5, 125), TONE(NOTE_A5, 125), REST(125), TONE(NOTE_F5, 125), TONE(NOTE_G5, 125), REST(125),
+  TONE(NOTE_E5, 125), REST(125), TONE(NOTE_C5, 125), REST(125), TONE(NOTE_D5, 125), TONE(NOTE_B4, 125), REST(125), REST(125),
+
+  TONE(NOTE_C5, 125), REST(250), REST(125), TONE(NOTE_G4, 125), REST(250), REST(125), TONE(NOTE_E4, 125), REST(250),
+  REST(125), TONE(NOTE_A4, 125), REST(125), TONE(NOTE_B4, 125), REST(125), TONE(NOTE_AS4, 125), TONE(NOTE_A4, 42), REST(125),
+  TONE(NOTE_G4, 125), TONE(NOTE_E5, 125), TONE(NOTE_G5, 125), TONE(NOTE_A5, 125), REST(125), TONE(NOTE_F5, 125), TONE(NOTE_G5, 125), REST(125),
+  TONE(NOTE_E5, 125), REST(125), TONE(NOTE_C5, 125), REST(125), TONE(NOTE_D5, 125), TONE(NOTE_B4, 125), REST(375), REST(125),
+
+  REST(125), TONE(NOTE_G5, 125), TONE(NOTE_FS5, 125), TONE(NOTE_F5, 125), REST(42), TONE(NOTE_DS5, 125), REST(125), TONE(NOTE_E5, 125),
+  REST(167), TONE(NOTE_GS4, 125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), REST(125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), TONE(NOTE_D5, 125),
+  REST(250), TONE(NOTE_G5, 125), TONE(NOTE_FS5, 125), TONE(NOTE_F5, 125), REST(42), TONE(NOTE_DS5, 125), REST(125), TONE(NOTE_E5, 125),
+  REST(167), TONE(NOTE_C6, 125), REST(125), TONE(NOTE_C6, 125), TONE(NOTE_C6, 125), REST(625), REST(125), REST(125),
+
+  TONE(NOTE_G5, 125), TONE(NOTE_FS5, 125), TONE(NOTE_F5, 125), REST(42), TONE(NOTE_DS5, 125), REST(125), TONE(NOTE_E5, 125), REST(167),
+  TONE(NOTE_GS4, 125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), REST(125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), TONE(NOTE_D5, 125), REST(250),
+  TONE(NOTE_DS5, 125), REST(250), REST(125), TONE(NOTE_D5, 125), REST(250), REST(125), TONE(NOTE_C5, 125), REST(1125),
+  REST(125), REST(125), REST(125), REST(125), REST(125), REST(125), REST(125), REST(125),
+
+  TONE(NOTE_G5, 125), TONE(NOTE_FS5, 125), TONE(NOTE_F5, 125), REST(42), TONE(NOTE_DS5, 125), REST(125), TONE(NOTE_E5, 125), REST(167),
+  TONE(NOTE_GS4, 125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), REST(125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), TONE(NOTE_D5, 125), REST(250),
+  TONE(NOTE_G5, 125), TONE(NOTE_FS5, 125), TONE(NOTE_F5, 125), REST(42), TONE(NOTE_DS5, 125), REST(125), TONE(NOTE_E5, 125), REST(167),
+  TONE(NOTE_C6, 125), REST(125), TONE(NOTE_C6, 125), TONE(NOTE_C6, 125), REST(625), REST(125), REST(125), REST(125),
+
+  TONE(NOTE_G5, 125), TONE(NOTE_FS5, 125), TONE(NOTE_F5, 125), REST(42), TONE(NOTE_DS5, 125), REST(125), TONE(NOTE_E5, 125), REST(167),
+  TONE(NOTE_GS4, 125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), REST(125), TONE(NOTE_A4, 125), TONE(NOTE_C5, 125), TONE(NOTE_D5, 125), REST(250),
+  TONE(NOTE_DS5, 125), REST(250), REST(125), TONE(NOTE_D5, 125), REST(250), REST(125), TONE(NOTE_C5, 125), REST(125),
+  REST(1000), TONE_END
 };
 
-int melody_durations[] = {
-  125, 125, 125, 125, 167, 125, 125, 125,
-  125, 375, 125, 125, 125, 375, 125, 125,
-
-  125, 250, 125, 125, 250, 125, 125, 250,
-  125, 125, 125, 125, 125, 125, 42, 125,
-  125, 125, 125, 125, 125, 125, 125, 125,
-  125, 125, 125, 125, 125, 125, 125, 125,
-
-  125, 250, 125, 125, 250, 125, 125, 250,
-  125, 125, 125, 125, 125, 125, 42, 125,
-  125, 125, 125, 125, 125, 125, 125, 125,
-  125, 125, 125, 125, 125, 125, 375, 125,
-
-  125, 125, 125, 125, 42, 125, 125, 125,
-  167, 125, 125, 125, 125, 125, 125, 125,
-  250, 125, 125, 125, 42, 125, 125, 125,
-  167, 125, 125, 125, 125, 625, 125, 125,
-
-  125, 125, 125, 42, 125, 125, 125, 167,
-  125, 125, 125, 125, 125, 125, 125, 250,
-  125, 250, 125, 125, 250, 125, 125, 1125,
-  125, 125, 125, 125, 125, 125, 125, 125,
-
-  125, 125, 125, 42, 125, 125, 125, 167,
-  125, 125, 125, 125, 125, 125, 125, 250,
-  125, 125, 125, 42, 125, 125, 125, 167,
-  125, 125, 125, 125, 625, 125, 125, 125,
-
-  125, 125, 125, 42, 125, 125, 125, 167,
-  125, 125, 125, 125, 125, 125, 125, 250,
-  125, 250, 125, 125, 250, 125, 125, 125
+const ToneStep zeldaSong[] = {
+  TONE(370, 40), TONE(466, 40), TONE(554, 40), TONE(740, 40), TONE(932, 40), TONE(370, 29),
+  TONE(466, 29), TONE(554, 29), TONE(698, 29), TONE(740, 29), TONE(932, 29), TONE(1109, 29),
+  TONE(370, 17), TONE(466, 17), TONE(494, 17), TONE(554, 17), TONE(622, 17), TONE(698, 17),
+  TONE(740, 17), TONE(740, 17), TONE(932, 17), TONE(988, 17), TONE(1109, 17), TONE(1245, 17),
+  TONE(740, 50), TONE(988, 50), TONE(1245, 50), TONE(1480, 50), TONE(740, 33), TONE(932, 33),
+  TONE(1109, 33), TONE(1480, 33), TONE(1480, 33), TONE(2217, 33), TONE(740, 100), TONE(1480, 100),
+  TONE(740, 100), TONE(1480, 100), TONE(740, 100), TONE(1480, 100), TONE(740, 100), TONE(1480, 100),
+  TONE_END
 };
 
-int zelda_hz[] = {
-  370, 466, 554, 740, 932, 370, 466, 554, 698, 740,
-  932, 1109, 370, 466, 494, 554, 622, 698, 740, 740,
-  932, 988, 1109, 1245, 740, 988, 1245, 1480, 740, 932,
-  1109, 1480, 1480, 2217, 740, 1480, 740, 1480, 740, 1480,
-  740, 1480
+// C6 down to C5; C5 is split in two because one step holds at most 256 periods
+const ToneStep doneSong[] = {
+  TONE(1047, 150), TONE(988, 150), TONE(880, 150), TONE(784, 150),
+  TONE(698, 150), TONE(659, 150), TONE(587, 150), TONE(523, 250), TONE(523, 250),
+  TONE_END
 };
 
-int zelda_durations[] = {
-  40, 40, 40, 40, 40, 29, 29, 29, 29, 29,
-  29, 29, 17, 17, 17, 17, 17, 17, 17, 17,
-  17, 17, 17, 17, 50, 50, 50, 50, 33, 33,
-  33, 33, 33, 33, 100, 100, 100, 100, 100, 100,
-  100, 100
+// C5 D5 E5 at power-up
+const ToneStep startupSong[] = {
+  TONE(523, 100), TONE(587, 100), TONE(659, 100),
+  TONE_END
 };
 /* USER CODE END PD */
 
@@ -265,93 +443,139 @@ int zelda_durations[] = {
 
 /* Private variables ---------------------------------------------------------*/
 I2C_HandleTypeDef hi2c2;
+DMA_HandleTypeDef hdma_i2c2_rx;
 
 TIM_HandleTypeDef htim1;
 TIM_HandleTypeDef htim2;
 TIM_HandleTypeDef htim3;
 TIM_HandleTypeDef htim4;
+TIM_HandleTypeDef htim7;
 TIM_HandleTypeDef htim8;
 TIM_HandleTypeDef htim9;
 TIM_HandleTypeDef htim12;
-TIM_HandleTypeDef htim14;
+DMA_HandleTypeDef hdma_tim1_up;
 
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart3_tx;
 
 /* Definitions for defaultTask */
 osThreadId_t defaultTaskHandle;
+uint32_t defaultTaskBuffer[ 128 ];
+osStaticThreadDef_t defaultTaskControlBlock;
 const osThreadAttr_t defaultTask_attributes = {
   .name = "defaultTask",
-  .stack_size = 128 * 4,
+  .cb_mem = &defaultTaskControlBlock,
+  .cb_size = sizeof(defaultTaskControlBlock),
+  .stack_mem = &defaultTaskBuffer[0],
+  .stack_size = sizeof(defaultTaskBuffer),
   .priority = (osPriority_t) osPriorityNormal,
 };
 /* Definitions for showTask */
 osThreadId_t showTaskHandle;
+uint32_t showTaskBuffer[ 256 ];
+osStaticThreadDef_t showTaskControlBlock;
 const osThreadAttr_t showTask_attributes = {
   .name = "showTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &showTaskControlBlock,
+  .cb_size = sizeof(showTaskControlBlock),
+  .stack_mem = &showTaskBuffer[0],
+  .stack_size = sizeof(showTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for motorTask */
 osThreadId_t motorTaskHandle;
+uint32_t motorTaskBuffer[ 512 ];
+osStaticThreadDef_t motorTaskControlBlock;
 const osThreadAttr_t motorTask_attributes = {
   .name = "motorTask",
-  .stack_size = 512 * 4,
+  .cb_mem = &motorTaskControlBlock,
+  .cb_size = sizeof(motorTaskControlBlock),
+  .stack_mem = &motorTaskBuffer[0],
+  .stack_size = sizeof(motorTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for encoderTask */
 osThreadId_t encoderTaskHandle;
+uint32_t encoderTaskBuffer[ 128 ];
+osStaticThreadDef_t encoderTaskControlBlock;
 const osThreadAttr_t encoderTask_attributes = {
   .name = "encoderTask",
-  .stack_size = 128 * 4,
+  .cb_mem = &encoderTaskControlBlock,
+  .cb_size = sizeof(encoderTaskControlBlock),
+  .stack_mem = &encoderTaskBuffer[0],
+  .stack_size = sizeof(encoderTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for servoTask */
 osThreadId_t servoTaskHandle;
+uint32_t servoTaskBuffer[ 128 ];
+osStaticThreadDef_t servoTaskControlBlock;
 const osThreadAttr_t servoTask_attributes = {
   .name = "servoTask",
-  .stack_size = 128 * 4,
+  .cb_mem = &servoTaskControlBlock,
+  .cb_size = sizeof(servoTaskControlBlock),
+  .stack_mem = &servoTaskBuffer[0],
+  .stack_size = sizeof(servoTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for ultrasonicTask */
 osThreadId_t ultrasonicTaskHandle;
+uint32_t ultrasonicTaskBuffer[ 128 ];
+osStaticThreadDef_t ultrasonicTaskControlBlock;
 const osThreadAttr_t ultrasonicTask_attributes = {
   .name = "ultrasonicTask",
-  .stack_size = 128 * 4,
+  .cb_mem = &ultrasonicTaskControlBlock,
+  .cb_size = sizeof(ultrasonicTaskControlBlock),
+  .stack_mem = &ultrasonicTaskBuffer[0],
+  .stack_size = sizeof(ultrasonicTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for readIMUTask */
 osThreadId_t readIMUTaskHandle;
+uint32_t readIMUTaskBuffer[ 512 ];
+osStaticThreadDef_t readIMUTaskControlBlock;
 const osThreadAttr_t readIMUTask_attributes = {
   .name = "readIMUTask",
-  .stack_size = 512 * 4,
+  .cb_mem = &readIMUTaskControlBlock,
+  .cb_size = sizeof(readIMUTaskControlBlock),
+  .stack_mem = &readIMUTaskBuffer[0],
+  .stack_size = sizeof(readIMUTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for rxSerialTask */
 osThreadId_t rxSerialTaskHandle;
+uint32_t rxSerialTaskBuffer[ 512 ];
+osStaticThreadDef_t rxSerialTaskControlBlock;
 const osThreadAttr_t rxSerialTask_attributes = {
   .name = "rxSerialTask",
-  .stack_size = 512 * 4,
+  .cb_mem = &rxSerialTaskControlBlock,
+  .cb_size = sizeof(rxSerialTaskControlBlock),
+  .stack_mem = &rxSerialTaskBuffer[0],
+  .stack_size = sizeof(rxSerialTaskBuffer),
   .priority = (osPriority_t) osPriorityHigh,
 };
 /* Definitions for frontWheelCalib */
 osThreadId_t frontWheelCalibHandle;
+uint32_t frontWheelCalibTaskBuffer[ 128 ];
+osStaticThreadDef_t frontWheelCalibTaskControlBlock;
 const osThreadAttr_t frontWheelCalib_attributes = {
   .name = "frontWheelCalib",
-  .stack_size = 128 * 4,
+  .cb_mem = &frontWheelCalibTaskControlBlock,
+  .cb_size = sizeof(frontWheelCalibTaskControlBlock),
+  .stack_mem = &frontWheelCalibTaskBuffer[0],
+  .stack_size = sizeof(frontWheelCalibTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* Definitions for buzzerTask */
 osThreadId_t buzzerTaskHandle;
+uint32_t buzzerTaskBuffer[ 128 ];
+osStaticThreadDef_t buzzerTaskControlBlock;
 const osThreadAttr_t buzzerTask_attributes = {
   .name = "buzzerTask",
-  .stack_size = 512 * 4,
-  .priority = (osPriority_t) osPriorityLow,
-};
-/* Definitions for irSensorTask */
-osThreadId_t irSensorTaskHandle;
-const osThreadAttr_t irSensorTask_attributes = {
-  .name = "irSensorTask",
-  .stack_size = 256 * 4,
+  .cb_mem = &buzzerTaskControlBlock,
+  .cb_size = sizeof(buzzerTaskControlBlock),
+  .stack_mem = &buzzerTaskBuffer[0],
+  .stack_size = sizeof(buzzerTaskBuffer),
   .priority = (osPriority_t) osPriorityLow,
 };
 /* USER CODE BEGIN PV */
@@ -361,21 +585,196 @@ const osThreadAttr_t irSensorTask_attributes = {
 
 
 // Ultrasonic
+// TIM8 runs the whole ranging cycle: CH3 drives the 10us trigger at the start
+// of every period, CH2 latches the echo rising edge and CH1 (TI2, indirect)
+// the falling edge. Only the falling edge interrupts; echo is the width in us.
 volatile uint16_t echo=0;
-volatile uint16_t tc1, tc2;
-volatile uint8_t isRising = 0;
+static float ultrasonicWindow[ULTRASONIC_WINDOW];
+static uint8_t ultrasonicHead = 0, ultrasonicCount = 0;
+volatile float ultrasonicFiltered = 0.0f;  // mm, trimmed mean of the window
+volatile uint32_t ultrasonicFilteredTick;  // HAL_GetTick() of its last update
 
 // RxSerial
-volatile uint8_t rxBuffer[256] = {0};
+// The ISR fills rxFrames[rxFill]; on ';' it hands that buffer to rxSerial
+// (rxReady) and switches to the other one, so a frame being parsed is never
+// written. A frame that completes while the previous one is still unparsed is
+// dropped, since both buffers are in use.
+#define RX_FRAME_SIZE 256
+volatile uint8_t rxFrames[2][RX_FRAME_SIZE];
 volatile uint8_t rxTemp = 0;
-volatile uint8_t bufferIndex = 0;     // Index for command buffer
-volatile uint8_t commandReady = 0;     // Flag to indicate complete command received
+volatile uint8_t rxFill = 0;          // Buffer the ISR is filling
+volatile uint8_t bufferIndex = 0;     // Bytes in rxFrames[rxFill]
+volatile int8_t rxReady = -1;         // Buffer waiting for rxSerial, -1 if none
+volatile uint16_t rxDropped = 0;      // ASCII frames lost because rxSerial was behind
+volatile uint8_t binIndex = 0;        // Bytes of the current binary frame received, 0 when idle
+volatile uint8_t binLen = 0;          // Its LEN byte
+volatile uint8_t *binTarget = NULL;   // Where its bytes go; NULL drops them
+volatile uint8_t binFrame[BIN_FRAME_LEN];
+volatile uint8_t binRoute[2 + BIN_ROUTE_MAX_PAYLOAD + 2]; // ROUTE frame awaiting rxSerial
+volatile uint8_t binRouteReady = 0;   // Set by the ISR, cleared by rxSerial
+volatile uint8_t binRing[BIN_RING_SIZE][BIN_FRAME_LEN]; // Complete frames awaiting rxSerial
+volatile uint8_t binHead = 0;         // Written by the ISR
+volatile uint8_t binTail = 0;         // Written by rxSerial
+volatile uint16_t binDropped = 0;     // Frames lost because the ring was full
+// Each complete frame is stamped with estopCount; rxSerial skips one stamped
+// before the latest stop byte, and motorCommandSubmit passes the stamp on.
+volatile uint8_t estopCount = 0;      // Stop bytes seen, written by the ISR
+volatile uint8_t estopLatched = 0;    // Set by the ISR, cleared by the motor task once it has stopped
+volatile uint8_t rxFrameEpoch[2];     // Per rxFrames buffer
+volatile uint8_t binRingEpoch[BIN_RING_SIZE];
+volatile uint8_t binRouteEpoch;
+static uint8_t rxSerialEpoch;         // Stamp of the frame rxSerial is parsing
+
+// TxSerial: replies are copied into this ring and sent by DMA, so no task waits
+// on the UART. HAL_UART_TxCpltCallback starts the next contiguous run.
+#define TX_RING_SIZE 1024
+uint8_t txRing[TX_RING_SIZE];
+volatile uint16_t txHead = 0;         // Next free byte
+volatile uint16_t txTail = 0;         // Oldest byte not yet sent
+volatile uint16_t txInFlight = 0;     // Bytes in the running DMA transfer
+volatile uint16_t txDropped = 0;      // Replies lost because the ring was full
+
+// Link latency (PING). The UART ISR stamps every frame with DWT->CYCCNT at its
+// first and last byte, rxSerial stamps when it takes the frame up, and a PING
+// reply is stamped when queued and when its last bit has left USART3. The PING
+// reply reports those intervals (serialPing), and LINK_PROBE toggles at each
+// stamp, so a scope on it and on the RX/TX lines shows the same breakdown.
+typedef struct {
+	uint32_t start;                   // DWT->CYCCNT at the ':' or sync byte
+	uint32_t end;                     // At the ';' or the last CRC byte
+} LinkStamp;
+static uint32_t linkRxStart;          // ISR: ASCII frame being received
+static uint32_t linkBinStart;         // ISR: binary frame being received
+volatile LinkStamp rxFrameStamp[2];   // Per rxFrames buffer
+volatile LinkStamp binRingStamp[BIN_RING_SIZE];
+static LinkStamp linkFrame;           // Frame rxSerial is parsing
+static uint32_t linkDispatch;         // DWT->CYCCNT when rxSerial took it up
+volatile uint8_t linkTxPending = 0;   // A PING reply ending before txRing[linkTxMark] is unsent
+volatile uint16_t linkTxMark;
+volatile uint32_t linkTxQueued;       // DWT->CYCCNT when it was queued
+volatile uint32_t linkTxCycles = 0;   // Queued -> sent, for the last PING reply that went out
+
+static inline void linkProbe(void){
+	HAL_GPIO_TogglePin(LINK_PROBE_GPIO_Port, LINK_PROBE_Pin);
+}
+
+// Board clock for SYNC: DWT->CYCCNT carried into 64 bits. It stays right as
+// long as it is read at least once per wrap (2^32 cycles, 25 s at 168 MHz);
+// the default task reads it every RECOVERY_KICK_MS.
+static uint64_t linkClockCycles;      // Cycles since DWT started, at linkClockLast
+static uint32_t linkClockLast;
+
+// Execution times (task_wcet.h) for RPI/sched_report.py. Every task counts its
+// own cycles per loop iteration, ending one just before it blocks for the next,
+// and the hot interrupt callbacks count theirs per call. GENERAL/SCHED sends
+// them (serialSched) and starts a new window. Periods are what each loop is
+// paced by; 0 is a task woken by events, for which the report takes the
+// shortest gap between releases.
+typedef enum {
+	WCET_DEFAULT, WCET_SHOW, WCET_MOTOR, WCET_ENCODER, WCET_SERVO, WCET_ULTRASONIC,
+	WCET_IMU, WCET_RX_SERIAL, WCET_FRONT_CALIB, WCET_BUZZER, WCET_TASKS
+} WcetTaskId;
+typedef enum {
+	WCET_ISR_UART_RX, WCET_ISR_ECHO, WCET_ISR_ENC_A, WCET_ISR_ENC_B, WCET_ISR_IR,
+	WCET_ISR_CTRL_TICK, WCET_ISR_HAL_TICK, WCET_ISRS
+} WcetIsrId;
+static const char *const wcetIsrNames[WCET_ISRS] = {"UART_RX", "ECHO", "ENC_A", "ENC_B", "IR", "CTRL_TICK", "HAL_TICK"};
+WcetTask *volatile wcetCurrent;
+uint32_t wcetSince;
+static WcetTask wcetTasks[WCET_TASKS];
+static WcetIsr wcetIsrs[WCET_ISRS];
+
+// traceTASK_SWITCHED_IN (FreeRTOSConfig.h), with the incoming task's tag
+FAST_CODE void Wcet_TaskSwitchedIn(void *tag){
+	Wcet_Switch((WcetTask *)tag);
+}
+
+// Hot functions inside those tasks and ISRs (prof.h), min/mean/max cycles per
+// call for GENERAL/PROF (serialProf). The LAT_ ones are not code but interrupt
+// latency (irq_prio.h): from the TIM7 update to the control tick's callback,
+// and from the echo's falling edge to the capture callback.
+typedef enum {
+	PR_UART_RX, PR_PARSE, PR_GYRO, PR_IR, PR_MOTOR, PR_OLED, PR_LAT_CTRL, PR_LAT_ECHO, PR_REGIONS
+} ProfId;
+ProfRegion profRegions[PR_REGIONS];
+
+// Every ISR's level (irq_prio.h); IrqPrio_Apply() puts the rest at IRQ_PRIO_OTHER
+static const IrqPrio irqLevels[] = {
+	{TIM7_IRQn, IRQ_PRIO_CONTROL},       // Control tick
+	{TIM2_IRQn, IRQ_PRIO_CAPTURE},       // Encoder A edges, overflows, STOP_COUNTS
+	{TIM3_IRQn, IRQ_PRIO_CAPTURE},       // Encoder B
+	{TIM8_CC_IRQn, IRQ_PRIO_CAPTURE},    // Echo
+	{USART3_IRQn, IRQ_PRIO_LINK},
+	{DMA1_Stream3_IRQn, IRQ_PRIO_LINK},  // USART3 TX
+#if LINK_USB_CDC
+	{OTG_FS_IRQn, IRQ_PRIO_LINK},
+#endif
+	{TIM6_DAC_IRQn, IRQ_PRIO_TIMEBASE},
+};
+static uint32_t ctrlCycPerCount, echoCycPerCount; // IrqPrio_CyclesPerCount() of TIM7, TIM8
+
+// Link handshake (stm32_protocol.h on the RPi). HELLO reports what this build
+// speaks; BAUD moves USART3 to a faster rate once its OK has gone out. The new
+// rate only sticks if a HELLO arrives at it within LINK_BAUD_CONFIRM_MS, so a
+// rate the RPi's adapter cannot really do falls back on its own.
+#define FIRMWARE_VERSION 9
+#define LINK_VERSION 1
+#define LINK_FORMATS "ASCII+BINARY"
+#if FAST_BOOT
+#define LINK_BOOT_FEATURES "+READY" // "!0/READY/<ms>;" at every boot, see FAST_BOOT
+#else
+#define LINK_BOOT_FEATURES ""
+#endif
+#define LINK_FEATURES "ROUTE+POSE+RESET+ESTOP+PING+ACHIEVED+SYNC+PROGRESS+STALL+WHERE+PASS+CREDIT" LINK_BOOT_FEATURES
+#define LINK_BAUD_CONFIRM_MS 500u
+static uint32_t linkBaudFallback = 0; // Rate to go back to, 0 once confirmed (rxSerial)
+static uint32_t linkBaudSince;        // HAL_GetTick() of the switch
+
+// Link transports. USART3 is always there; with LINK_USB_CDC the OTG FS port
+// also runs as a CDC device (full speed, 64-byte packets), whose usbd_cdc_if.c
+// hands each received packet to linkUsbReceive() and each finished transmit to
+// linkUsbTxDone(). Both feed one frame layer (linkRxByte) and drain the same
+// txRing. The transport a HELLO arrives on carries every reply from then on,
+// so the RPi picks one by the port it opens. OTG_FS_IRQn sits at USART3's
+// priority, so the two never interleave inside the frame layer.
+typedef enum {LINK_UART, LINK_USB} LinkTransport;
+volatile LinkTransport linkTransport = LINK_UART; // Where txRing drains
+volatile uint8_t rxFrameSource[2];    // Transport of each rxFrames buffer
+static LinkTransport rxSerialSource;  // Of the ASCII frame rxSerial is parsing
+
+// Uploaded route. rxSerial fills routeSteps only while the route is idle and
+// hands it over by setting ROUTE_RUNNING; the motor task then owns routeNext
+// until it parks in ROUTE_SNAP_WAIT, where RESUME (rxSerial again) moves on.
+static CCMRAM RouteStep routeSteps[ROUTE_MAX_STEPS];
+volatile uint8_t routeLen = 0;        // Steps stored so far
+volatile uint8_t routeNext = 0;       // Next step to run
+volatile uint16_t routeBaseId = 0;    // Step k replies as routeBaseId + k
+volatile uint8_t routeEpoch = 0;      // estopCount when it was started; a stop since ends it
+volatile enum {ROUTE_IDLE, ROUTE_RUNNING, ROUTE_SNAP_WAIT} routeState = ROUTE_IDLE;
+volatile uint8_t motorIdle = 1;       // The motor task runs no command (its currentState is STOP), for WHERE
+
+// Motion settle tracking, owned by the motor task
+uint8_t settlePending = 0;
+uint32_t settleCmdId = 0;
+uint32_t settleStartTick = 0;
+uint32_t settleQuietSinceTick = 0;
+uint32_t settleRestTick = 0; // HAL_GetTick() the chassis came to rest at, for SETTLED and SNAP
+OdometryPose cmdStartPose; // Where the running command started, for its DONE
 volatile uint8_t buf[256] = {0};
 volatile uint8_t buf1[256] = {0};
 volatile uint8_t buf2[256] = {0};
 volatile uint8_t buf3[256] = {0};
 volatile uint8_t buf4[256] = {0};
 
+// "<label><value, to decimals, padded to width><tail>" into one of buf1..buf4
+static void showValue(volatile uint8_t *line, const char *label, float value, int decimals, int width, const char *tail){
+	Fmt f;
+	Fmt_Init(&f, (char *)line, sizeof(buf1));
+	Fmt_Str(&f, label);
+	Fmt_Fixed(&f, value, decimals, width);
+	Fmt_Str(&f, tail);
+}
+
 // IMU
 volatile float gyro_z_dps = 0.0f;
 volatile float complementary_filter_angle = 0.0f; // Global to store the fused angle
@@ -384,7 +783,7 @@ volatile float complementary_filter_angle = 0.0f; // Global to store the fused a
 #endif
 
 // BGM
-volatile enum {MUTE, BGM, CAPTURE, DONE} music = MUTE;
+volatile enum songList {MUTE, BGM, CAPTURE, DONE} music = MUTE;
 
 volatile uint8_t isContinue = 1;
 
@@ -402,7 +801,7 @@ volatile uint8_t isToMove = 0;
 volatile float x = 0.0f;
 volatile float y = 0.0f;
 volatile float placeholder = 0.0f;
-volatile enum {OBS1FORWARD, OBS1CAPTURE, OBS1TURN, OBS2FORWARD, OBS2CAPTURE, OBS2TURN1, OBS2FOLLOW, OBS2TURN2, OBS2RETURN, PARKING, TASK2DONE} task2State = OBS1FORWARD;
+volatile enum {OBS1FORWARD, OBS1TURN, OBS2FORWARD, OBS2TURN1, OBS2FOLLOW, OBS2TURN2, OBS2RETURN, PARKING, OBS2HOME, TASK2DONE} task2State = OBS1FORWARD;
 const uint8_t capture1Req[11] = "!CAPTURE1;\0";
 const uint8_t capture2Req[11] = "!CAPTURE2;\0";
 
@@ -421,16 +820,17 @@ volatile int16_t magX, magY, magZ; // Raw magnetometer readings
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_TIM4_Init(void);
 static void MX_TIM2_Init(void);
 static void MX_TIM9_Init(void);
 static void MX_TIM12_Init(void);
 static void MX_TIM8_Init(void);
 static void MX_TIM3_Init(void);
-static void MX_TIM14_Init(void);
 static void MX_I2C2_Init(void);
 static void MX_USART3_UART_Init(void);
 static void MX_TIM1_Init(void);
+static void MX_TIM7_Init(void);
 void StartDefaultTask(void *argument);
 void show(void *argument);
 void motor(void *argument);
@@ -441,28 +841,43 @@ void readIMU(void *argument);
 void rxSerial(void *argument);
 void frontWheelCalibrationTask(void *argument);
 void buzzer(void *argument);
-void irSensor(void *argument);
 
 /* USER CODE BEGIN PFP */
-void delay_us(uint16_t us);
 void motorDriveEnable(void);
 void motorStop(void);
 float getFilteredUltrasonicDist(void);
+uint32_t getFilteredUltrasonicAge(void);
 uint8_t motorPidForward(MotorCommand_t cmd, uint8_t isStateChanged);
-void rxSerialParse(void);
+void rxSerialParse(const char *line);
+void rxSerialParseBinary(const uint8_t *frame);
+void rxSerialParseRoute(const uint8_t *frame);
+void motorCommandSubmit(MotorCommand_t *cmd);
+uint16_t crc16Ccitt(const uint8_t *data, uint16_t len);
+void motorAckDone(uint32_t cmdId);
+void motorFault(uint32_t cmdId, const char *cause);
+void motorSettlePoll(void);
+int uartTxWrite(const uint8_t *data, uint16_t len);
+void uartTxSend(const char *s);
+void serialReply(uint32_t cmdId, const char *status);
+void serialReplyPose(uint32_t cmdId, const char *status);
+void serialReplyRest(uint32_t cmdId, const char *status);
+static int serialFormatPose(char *s, size_t size, const char *status, const OdometryPose *p);
+void serialReplyDone(uint32_t cmdId);
+void linkSetBaud(uint32_t baud);
+static void linkSelect(LinkTransport transport);
 
 
 // ---------------- MOTOR A CONTROL ----------------
-void motorForwardA(int pwmVal);
+static inline void motorForwardA(int pwmVal);
 
-void motorReverseA(int pwmVal);
+static inline void motorReverseA(int pwmVal);
 
 // ---------------- MOTOR B CONTROL ----------------
-void motorForwardB(int pwmVal);
+static inline void motorForwardB(int pwmVal);
 
-void motorReverseB(int pwmVal);
+static inline void motorReverseB(int pwmVal);
 
-void setServoAngle(int pwm);
+static inline void setServoAngle(int pwm);
 
 static void OLED_PrintStatus(uint8_t leftDet, uint8_t rightDet){
   char line1[24];
@@ -477,518 +892,833 @@ static void OLED_PrintStatus(uint8_t leftDet, uint8_t rightDet){
 }
 
 // IMU20498
-void icm20948_init(void){
-    uint8_t data;
-
-    // Wake up
-    data = 0x01;
-    HAL_I2C_Mem_Write(&hi2c2, ICM20948_I2C_ADDR, 0x06, I2C_MEMADD_SIZE_8BIT, &data, 1, 1000);
-
-    // Enable accel & gyro
-    data = 0x00;
-    HAL_I2C_Mem_Write(&hi2c2, ICM20948_I2C_ADDR, 0x07, I2C_MEMADD_SIZE_8BIT, &data, 1, 1000);
-
-    // Disable ICM internal I2C master (required for BYPASS)
-	data = 0x00; // USER_CTRL (0x03)
-	HAL_I2C_Mem_Write(&hi2c2, ICM20948_I2C_ADDR, 0x03, I2C_MEMADD_SIZE_8BIT, &data, 1, 1000);
+// I2C2 goes through an i2c_bus.h queue. readIMU() is its only user and sleeps
+// on each transaction, but no longer than IMU_I2C_TIMEOUT_MS. A NACK or a
+// stuck SDA costs one pass, and the bus recovers itself instead of needing
+// a reset.
+static I2cBus imuBus = {
+	.hi2c = &hi2c2, .sclPort = GPIOB, .sclPin = GPIO_PIN_10, .sdaPort = GPIOB, .sdaPin = GPIO_PIN_11,
+};
 
-	// Enable BYPASS so MCU can talk to AK09916 at 0x0C
-	data = 0x02; // INT_PIN_CFG (0x0F): BYPASS_EN=1
-	HAL_I2C_Mem_Write(&hi2c2, 0x68<<1, 0x0F, I2C_MEMADD_SIZE_8BIT, &data, 1, 1000);
+// From the I2C/DMA interrupt, or from I2cBus_Poll() in readIMU() on a timeout
+static void imuTransferDone(I2cXfer *x, HAL_StatusTypeDef status){
+	*(volatile HAL_StatusTypeDef *)x->ctx = status;
+	if(xPortIsInsideInterrupt()){
+		BaseType_t woken = pdFALSE;
+		vTaskNotifyGiveFromISR((TaskHandle_t)readIMUTaskHandle, &woken);
+		portYIELD_FROM_ISR(woken);
+	}else{
+		xTaskNotifyGive((TaskHandle_t)readIMUTaskHandle);
+	}
+}
 
-	// Put AK09916 into continuous mode (e.g., 100 Hz)
-	data = 0x08; // CNTL2 (0x31): 100 Hz
-	HAL_I2C_Mem_Write(&hi2c2, 0x0C<<1, 0x31, I2C_MEMADD_SIZE_8BIT, &data, 1, 1000);
+// One register read or write, DMA for bursts; the calling task (readIMU) sleeps until it is done
+static HAL_StatusTypeDef imuTransfer(uint16_t devAddr, uint8_t reg, uint8_t write, uint8_t *data, uint16_t len){
+	volatile HAL_StatusTypeDef status = HAL_BUSY; // Until done() runs
+	I2cXfer x = {.addr = devAddr, .reg = reg, .write = write, .data = data, .len = len,
+			.timeoutMs = IMU_I2C_TIMEOUT_MS, .done = imuTransferDone, .ctx = (void *)&status};
+	ulTaskNotifyTake(pdTRUE, 0); // Drop a completion left over from a failed transaction
+	if(I2cBus_Submit(&imuBus, &x) != 0) return HAL_ERROR;
+	while(status == HAL_BUSY){
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(IMU_I2C_TIMEOUT_MS) + 1);
+		I2cBus_Poll(&imuBus); // Past its deadline: fails it and recovers the bus
+	}
+	return status;
 }
 
+static void icmWrite(uint16_t devAddr, uint8_t reg, uint8_t value){
+	imuTransfer(devAddr, reg, 1, &value, 1);
+}
 
+static HAL_StatusTypeDef imuRead(uint16_t devAddr, uint8_t reg, uint8_t *dst, uint16_t len){
+	return imuTransfer(devAddr, reg, 0, dst, len);
+}
 
+void icm20948_init(void){
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_REG_BANK_SEL, 0 << 4);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_PWR_MGMT_1, 0x01); // Wake up, auto clock
+	osDelay(10);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_PWR_MGMT_2, 0x00); // Enable accel & gyro
+
+	// ICM internal I2C master off and BYPASS on, so the MCU talks to the AK09916 at 0x0C
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_USER_CTRL, 0x00);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_INT_PIN_CFG, 0x02);
+	icmWrite(AK09916_I2C_ADDR, AK09916_CNTL2_REG, 0x08); // Continuous mode, 100 Hz
+
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_REG_BANK_SEL, 2 << 4);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_ODR_ALIGN_EN, 0x01);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_GYRO_SMPLRT_DIV, 4);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_GYRO_CONFIG_1, (3 << 3) | (1 << 1) | 1); // DLPF 51 Hz, +-500 dps
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_ACCEL_SMPLRT_DIV_2, 4);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_ACCEL_CONFIG, (3 << 3) | (0 << 1) | 1);  // DLPF 50 Hz, +-2 g
+
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_REG_BANK_SEL, 0 << 4);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_EN_2, 0x1E); // ACCEL and GYRO_X/Y/Z
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_MODE, 0x00); // Stream
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_RST, 0x1F);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_RST, 0x00);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_USER_CTRL, 0x40); // FIFO_EN, I2C master still off
+}
 
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
 
+// Tickless idle stops the TIM6 HAL tick while the core sleeps (freertos.c), so
+// once the scheduler runs HAL_GetTick() counts kernel ticks instead, which the
+// port steps over the time slept. halTickBase keeps it from jumping back.
+static uint32_t halTickBase;
+
+uint32_t HAL_GetTick(void){
+	if(xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED) return uwTick;
+	return halTickBase + xTaskGetTickCount();
+}
+
+// A driver's HAL_Delay() in a task sleeps rather than spins, so its wait
+// (OLED_Init()'s reset pulse) overlaps the other tasks' start-up. At least
+// Delay ms, as HAL's own.
+void HAL_Delay(uint32_t Delay){
+	if(xTaskGetSchedulerState() != taskSCHEDULER_RUNNING || xPortIsInsideInterrupt()){
+		uint32_t start = HAL_GetTick();
+		while(HAL_GetTick() - start < Delay + 1u){}
+		return;
+	}
+	vTaskDelay(pdMS_TO_TICKS(Delay) + 1);
+}
 
 QueueHandle_t motorCommandQueue;
+static EventGroupHandle_t bootReady; // BOOT_READY_* bits, set once each part is safe to move on
+static StaticEventGroup_t bootReadyControlBlock;
+#define MOTOR_COMMAND_QUEUE_LEN 2
+static CCMRAM uint8_t motorCommandQueueStorage[MOTOR_COMMAND_QUEUE_LEN * sizeof(MotorCommand_t)];
+static CCMRAM StaticQueue_t motorCommandQueueControlBlock;
 
 volatile float distance;
-volatile uint8_t leftNow;
-volatile uint8_t rightNow;
+
+// ---------------- IR SENSORS ----------------
+// PC6/PC9 interrupt on both edges (EXTI9_5). Each edge stores the new level
+// and its DWT->CYCCNT time, and may fire a STOP_IR trigger.
+typedef struct {
+	volatile uint8_t detected;    // Level after the latest edge
+	volatile uint32_t edgeCycles; // DWT->CYCCNT at that edge
+} IrSensor;
+
+IrSensor irLeft;
+IrSensor irRight;
 
 void motorDriveEnable(void){
-	HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_3);
-	HAL_TIM_PWM_Start(&htim4, TIM_CHANNEL_4);
-	HAL_TIM_PWM_Start(&htim9, TIM_CHANNEL_1);
-	HAL_TIM_PWM_Start(&htim9, TIM_CHANNEL_2);
+	Motor_Start();
 }
 
 void motorStopA(void){
-	__HAL_TIM_SetCompare(&htim4, TIM_CHANNEL_3, 7199);
-	__HAL_TIM_SetCompare(&htim4, TIM_CHANNEL_4, 7199);
+	Motor_Brake(MOTOR_A);
 }
 
 void motorStopB(void){
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_1, 7199);
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_2, 7199);
+	Motor_Brake(MOTOR_B);
 }
 
 void motorStop(void){
+	Motor_Hold();
 	motorStopA();
 	motorStopB();
+	Motor_Commit();
 }
 
-void motorForwardA(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4,0); // set IN1 to maximum PWM (7199) for '1'
-    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, pwmVal); // PWM to Motor A (IN2)
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4, 7199-pwmVal); // set IN1 to maximum PWM (7199) for '1'
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, 7199); // PWM to Motor A (IN2)
+// Until the motor task has seen an emergency stop, a primitive that was in the
+// middle of a step (or an osDelay) must not drive the wheels again.
+static inline void motorForwardA(int pwmVal) {
+	if(estopLatched){ motorStopA(); return; }
+	Motor_Set(MOTOR_A, pwmVal, 0); // PWM to Motor A (IN2)
 }
 
-void motorReverseA(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, 0);
-    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4, pwmVal); // PWM to Motor A (IN1)
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_3, 7199-pwmVal);
-//    __HAL_TIM_SetCompare(&htim4,TIM_CHANNEL_4, 7199); // PWM to Motor A (IN1)
+static inline void motorReverseA(int pwmVal) {
+	if(estopLatched){ motorStopA(); return; }
+	Motor_Set(MOTOR_A, pwmVal, 1); // PWM to Motor A (IN1)
 }
 
-void motorForwardB(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_2, 0);
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_1, pwmVal); // PWM to Motor B (IN2)
-//	__HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_2, 7199-pwmVal);
-//	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_1, 7199); // PWM to Motor B (IN2)
+static inline void motorForwardB(int pwmVal) {
+	if(estopLatched){ motorStopB(); return; }
+	Motor_Set(MOTOR_B, pwmVal, 0); // PWM to Motor B (IN2)
 }
 
-void motorReverseB(int pwmVal) {
-	__HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_1, 0);
-	__HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_2, pwmVal); // PWM to Motor B (IN1)
-//    __HAL_TIM_SetCompare(&htim9,TIM_CHANNEL_1, 7199-pwmVal);
-//    __HAL_TIM_SetCompare(&htim9, TIM_CHANNEL_2, 7199); // PWM to Motor B (IN1)
+static inline void motorReverseB(int pwmVal) {
+	if(estopLatched){ motorStopB(); return; }
+	Motor_Set(MOTOR_B, pwmVal, 1); // PWM to Motor B (IN1)
 }
 
-uint8_t motorPidForward(MotorCommand_t cmd, uint8_t isStateChanged) {
-//	float PoutA, PoutB, IoutA, IoutB, DoutA, DoutB, errorA, errorB, derivativeA, derivativeB;
-	static float totalDistanceA = 0.0f;
-	static float totalDistanceB = 0.0f;
-	static uint32_t lastEncoderA = 0;
-	static uint32_t lastEncoderB = 0;
-	static float targetDistance = 0.0f;
-	static uint32_t hasTargetDistance = 0;
-	static float headingIntegral = 0.0f;
-	static float prevHeadingError = 0.0f;
+// Both wheels in one commit, so they change on the same PWM update. rev 0 is
+// forward, as in motorForwardA/B.
+static inline void motorDrive(int pwmA, uint8_t revA, int pwmB, uint8_t revB) {
+	if(estopLatched){ motorStop(); return; }
+	Motor_SetBoth(pwmA, revA, pwmB, revB);
+}
 
-	if(isStateChanged) {
-//		pidA = defaultPid;
-//		pidB = defaultPid;
-//		pidA.target_speed = cmd.param1Speed;
-//		pidB.target_speed = cmd.param1Speed;
-		headingIntegral = 0.0f;
-		prevHeadingError = 0.0f;
-		isFrontCalib = 1;
-		isTurning = 0;
-		setServoAngle(SERVO_CENTER);
-		osDelay(10);
+// ---------------- ENCODERS ----------------
+// TIM2/TIM3 run in x4 quadrature mode with a 16-bit period. The update
+// interrupt extends each counter to a 32-bit position, and the CC1 interrupt
+// (TI1 rising edge, every 4 counts) stamps edges with DWT->CYCCNT so the
+// encoder task can measure speed from the edge period when the wheel is too
+// slow for a count difference to mean much.
+typedef struct {
+	TIM_HandleTypeDef *htim;
+	volatile int32_t high;          // Position above the 16-bit counter
+	volatile uint16_t edgeCount;    // CCR1 at the latest TI1 edge
+	volatile uint32_t edgeCycles;   // DWT->CYCCNT at that edge
+	volatile int16_t periodCounts;  // Counts between the last two edges: +-4, 0 after a reversal
+	volatile uint32_t periodCycles; // Cycles between them
+	volatile uint8_t edges;         // Edges seen since the CC1 interrupt was enabled, up to 2
+	int32_t lastPosition;           // Encoder task only
+	float speed;                    // counts/s, positive while the counter runs up
+} EncoderExt;
+
+EncoderExt encoderA = {&htim2};
+EncoderExt encoderB = {&htim3};
+
+static void encoderOverflow(EncoderExt *e){
+	e->high += __HAL_TIM_IS_TIM_COUNTING_DOWN(e->htim) ? -65536 : 65536;
+}
 
-		totalDistanceA = 0.0f;
-		totalDistanceB = 0.0f;
-		if(cmd.param2DistAngle > 0){
-			hasTargetDistance = 1;
-			targetDistance = (float)cmd.param2DistAngle; // param2 represents distance in cm
-		}else{
-			hasTargetDistance = 0;
-			targetDistance = 0.0f;
-		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+static FAST_CODE void encoderEdge(EncoderExt *e){
+	uint16_t count = HAL_TIM_ReadCapturedValue(e->htim, TIM_CHANNEL_1);
+	uint32_t now = DWT->CYCCNT;
+	e->periodCounts = (int16_t)(count - e->edgeCount);
+	e->periodCycles = now - e->edgeCycles;
+	e->edgeCount = count;
+	e->edgeCycles = now;
+	if(e->edges < 2) e->edges++;
+}
+
+// Task context only
+int32_t encoderPosition(EncoderExt *e){
+	taskENTER_CRITICAL();
+	int32_t high = e->high;
+	uint16_t cnt = __HAL_TIM_GET_COUNTER(e->htim);
+	if(__HAL_TIM_GET_FLAG(e->htim, TIM_FLAG_UPDATE)){
+		// Wrapped with the interrupt still pending; cnt may predate the wrap
+		cnt = __HAL_TIM_GET_COUNTER(e->htim);
+		high += __HAL_TIM_IS_TIM_COUNTING_DOWN(e->htim) ? -65536 : 65536;
 	}
+	taskEXIT_CRITICAL();
+	return high + cnt;
+}
+
+static void encoderStart(EncoderExt *e){
+	HAL_TIM_Encoder_Start(e->htim, TIM_CHANNEL_ALL);
+	__HAL_TIM_CLEAR_FLAG(e->htim, TIM_FLAG_UPDATE | TIM_FLAG_CC1);
+	__HAL_TIM_ENABLE_IT(e->htim, TIM_IT_UPDATE | TIM_IT_CC1);
+	e->lastPosition = encoderPosition(e);
+}
 
-	int32_t speedA = cmd.param1Speed;
-	int32_t speedB = cmd.param1Speed;
-
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-	int32_t diffA;
-	int32_t rawDiffA = currentEncoderA - lastEncoderA;
-	if (rawDiffA > 32767) {
-	    // Underflow: encoder went from small number to large number (reverse)
-	    diffA = rawDiffA - 65536;
-	} else if (rawDiffA < -32767) {
-	    // Overflow: encoder went from large number to small number (forward)
-	    diffA = rawDiffA + 65536;
-	} else {
-	    diffA = rawDiffA;
+// One ENCODER_SAMPLE_MS step. Fast wheels use the count difference and stop
+// the edge interrupt; slow ones use the last edge period, bounded by the time
+// since that edge so a wheel coming to rest decays to 0.
+static void encoderSample(EncoderExt *e){
+	int32_t position = encoderPosition(e);
+	int32_t delta = position - e->lastPosition;
+	e->lastPosition = position;
+	float countSpeed = delta * (1000.0f / ENCODER_SAMPLE_MS);
+
+	if(delta > ENCODER_PERIOD_MAX_COUNTS || delta < -ENCODER_PERIOD_MAX_COUNTS){
+		__HAL_TIM_DISABLE_IT(e->htim, TIM_IT_CC1);
+		e->speed = countSpeed;
+		return;
 	}
-//	sprintf(buf2, "RawDiff: %d    ", rawDiff);
-//	sprintf(buf3, "CEncA: %d    ", currentEncoderA);
-//	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
-	lastEncoderA = currentEncoderA;
-
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	int32_t diffB = 0;
-	int32_t rawDiffB = currentEncoderB - lastEncoderB;
-	if (rawDiffB > 32767) {
-		// Underflow: encoder went from small number to large number (reverse)
-		diffB = rawDiffB - 65536;
-	} else if (rawDiffB < -32767) {
-		// Overflow: encoder went from large number to small number (forward)
-		diffB = rawDiffB + 65536;
-	} else {
-		diffB = rawDiffB;
+	if(!__HAL_TIM_GET_IT_SOURCE(e->htim, TIM_IT_CC1)){
+		e->edges = 0;
+		__HAL_TIM_CLEAR_FLAG(e->htim, TIM_FLAG_CC1);
+		__HAL_TIM_ENABLE_IT(e->htim, TIM_IT_CC1);
 	}
-	lastEncoderB = currentEncoderB;
-
-	float distanceA = (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceA += distanceA;
-	float distanceB = (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceB -= distanceB; // MotorB Encoder is reverse
-
-	if (hasTargetDistance && totalDistanceA >= targetDistance - 1.6f) {
-	    motorStop();
-	    isFrontCalib = 0;
-	    // Display completion message
-	    sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	    sprintf(buf3, "EaD: %.1f", totalDistanceA);
-//	    sprintf(buf4, "EbD: %.1f", totalDistanceB);
-	    setServoAngle(SERVO_CENTER);
-	    return 1;
+
+	taskENTER_CRITICAL();
+	uint32_t since = DWT->CYCCNT - e->edgeCycles;
+	if(since > ENCODER_STALL_MS * (SystemCoreClock / 1000)) e->edges = 0; // Also keeps CYCCNT wrap out of `since`
+	uint8_t edges = e->edges;
+	int16_t counts = e->periodCounts;
+	uint32_t period = e->periodCycles;
+	taskEXIT_CRITICAL();
+
+	if(edges < 2){
+		e->speed = countSpeed; // No usable period: 0 at rest, coarse while the edges come in
+		return;
 	}
+	if(since > period) period = since;
+	e->speed = counts * (float)SystemCoreClock / period;
+}
 
-	if (hasTargetDistance && targetDistance-totalDistanceA < 50) { // Slow down in last 30cm
-			if(targetDistance-totalDistanceA<10) {
-				if(speedA>850){
-					speedA = 850;
-					speedB = 850;
-				}
-			}else if(targetDistance-totalDistanceA<20) {
-				if(speedA>3000){
-					speedA = 4000;
-					speedB = 4000;
-				}
-			}else {
-				if(speedA>5000){
-					speedA = 5000;
-					speedB = 5000;
-				}
-			}
-			sprintf(buf1, "Slowing down..."	);
-	//		sprintf(buf2, "pwmA: %d", speedA);
-	//		sprintf(buf3, "pwmB: %d", speedB);
-	//		motorForwardA(speedA);
-	//		motorForwardB(speedB);
-	//		return 0;
-		}else{
-			sprintf(buf1, "GoGoGo..."	);
-		}
+// ---------------- MOTION PRIMITIVES ----------------
+// Every drive and turn primitive is one MotionSpec run by motionRun() once per
+// control tick: encoder odometry -> stop predicate -> speed profile -> heading
+// correction -> PWM. The wrappers below only add their start-up moves (servo,
+// flags) and OLED text. One primitive runs at a time, so they share `motion`.
 
-	// MotorA & MotorB speed difference fix
-	float headingError = totalDistanceA - totalDistanceB;
-	const float Kp_heading = 1.2f;
-	const float Ki_heading = 0.01f;
-	const float Kd_heading = 0.0f;
+enum {MOTION_FORWARD, MOTION_REVERSE, MOTION_PIVOT_A, MOTION_PIVOT_B}; // PIVOT_x: only wheel x drives
+// HOLD: leave the PWM as it is this tick; WAIT: stop the wheels but keep checking
+typedef enum {MOTION_RUN, MOTION_HOLD, MOTION_WAIT, MOTION_DONE} MotionVerdict;
 
-	headingIntegral += headingError;
-	if(headingIntegral > 100) headingIntegral = 100;
-	if(headingIntegral < -100) headingIntegral = -100;
+#define MOTION_NO_TARGET 1e9f // Distance left when a primitive has no end point; no profile step applies
 
-	float headingDerivative = headingError - prevHeadingError;
-	prevHeadingError = headingError;
-	float headingCorrection = Kp_heading * headingError + Ki_heading * headingIntegral + Kd_heading * headingDerivative;
+// Speed cap: while the distance left is below `below` and the speed is above
+// `above`, drive at `cap`. A profile is checked in order and the first
+// matching `below` wins.
+typedef struct {
+	float below;
+	int32_t above;
+	int32_t cap;
+} SpeedStep;
+
+// Stop triggers: the interrupt that sees the sensor change checks the
+// condition and stops the wheels there, instead of waiting for the next
+// control tick. check() still decides when the primitive is done.
+typedef enum {
+	STOP_NONE,
+	STOP_IR,         // motion.sensor edge to "detected"
+	STOP_ECHO_BELOW, // an ultrasonic echo at or inside motion.target mm (+ STOP_ECHO_MARGIN_MM)
+	STOP_COUNTS      // wheel A reaches motion.target - stopEarly cm (TIM2 CC3/CC4 compare)
+} StopSource;
+
+#define STOP_ECHO_MARGIN_MM 8.0f // Same band as motionCheckObstacle()
+
+typedef struct MotionSpec MotionSpec;
+struct MotionSpec {
+	uint8_t drive;
+	const SpeedStep *profile;     // Approach caps, NULL for none
+	uint8_t profileLen;
+	const SpeedStep *backProfile; // Reverse caps while check() reports an overshoot (remaining < 0)
+	uint8_t backProfileLen;
+	float kp, ki, kd;             // Heading correction on the wheel distance difference
+	float stopEarly;              // For motionCheckDistance(): cm short of the target to stop at
+	// Stop predicate. Sets the distance left (cm, mm or degrees) for the profile.
+	MotionVerdict (*check)(const MotionSpec *spec, float *remaining);
+	StopSource stop;              // Armed by motionRun() for the same condition, from the sensor's interrupt
+	uint8_t resumable;            // remaining is in the command's own cm or degrees: a reset resends just that
+};
 
-	speedA -= headingCorrection;
-	speedB += headingCorrection;
+static struct {
+	float target;          // From the command: cm, mm from the obstacle or degrees; <= 0 for none
+	float travelledA;      // cm along the commanded direction
+	float travelledB;
+	float stepA;           // cm wheel A moved in the last tick
+	float stepB;
+	uint16_t lastEncoderA;
+	uint16_t lastEncoderB;
+	float headingIntegral;
+	float prevHeadingError;
+	uint8_t confirm;       // Debounce count for check()
+	uint8_t requestPending; // CAPTURE request still to send on the approach
+	IrSensor *sensor;      // IR sensor watched by motorPidForwardTask2UntilSensor()
+	float startHeading;    // Turns: currentAngle at the start
+	float angleTurned;
+	float curvature;       // 1/cm, + = left: check() steers, the inner wheel slows to match
+} motion;
+
+// Armed trigger. Written by the motor task with interrupts masked; interrupts only set `fired`.
+static struct {
+	volatile StopSource source;
+	IrSensor *ir;         // STOP_IR
+	uint16_t echoUs;      // STOP_ECHO_BELOW: echo width at the stop distance
+	volatile uint8_t fired;
+} stopTrigger;
+
+static void stopDisarm(void){
+	taskENTER_CRITICAL();
+	stopTrigger.source = STOP_NONE;
+	stopTrigger.fired = 0;
+	__HAL_TIM_DISABLE_IT(&htim2, TIM_IT_CC3 | TIM_IT_CC4);
+	taskEXIT_CRITICAL();
+}
 
-	if (speedA > 7199) speedA = 7199;
-	if (speedA < 0) speedA = 0;
-	if (speedB > 7199) speedB = 7199;
-	if (speedB < 0) speedB = 0;
+// Arms spec->stop against the primitive's target, if it has one the trigger can use
+static void stopArm(const MotionSpec *spec){
+	stopDisarm();
+	taskENTER_CRITICAL();
+	if(spec->stop == STOP_IR && motion.sensor != NULL){
+		stopTrigger.ir = motion.sensor;
+		stopTrigger.source = STOP_IR;
+	}else if(spec->stop == STOP_ECHO_BELOW && motion.target > 0.0f){
+		// distance = echo * 171.5 / 1000 (mm)
+		stopTrigger.echoUs = (uint16_t)((motion.target + STOP_ECHO_MARGIN_MM) * 1000.0f / 171.5f);
+		stopTrigger.source = STOP_ECHO_BELOW;
+	}else if(spec->stop == STOP_COUNTS && motion.target > 0.0f){
+		// CC3 for a counter running up (forward on wheel A), CC4 for down; beyond half
+		// the 16-bit range the compare would be ambiguous and check() ends it alone
+		float counts = (motion.target - spec->stopEarly) / WHEEL_CIRCUMFERENCE_CM * ENCODER_COUNTS_PER_REVOLUTION;
+		if(counts >= 1.0f && counts < 32768.0f){
+			uint16_t start = (uint16_t)Encoder_Count(ENCODER_A);
+			if(spec->drive == MOTION_REVERSE){
+				__HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_4, (uint16_t)(start - (uint16_t)counts));
+				__HAL_TIM_CLEAR_FLAG(&htim2, TIM_FLAG_CC4);
+				__HAL_TIM_ENABLE_IT(&htim2, TIM_IT_CC4);
+			}else{
+				__HAL_TIM_SET_COMPARE(&htim2, TIM_CHANNEL_3, (uint16_t)(start + (uint16_t)counts));
+				__HAL_TIM_CLEAR_FLAG(&htim2, TIM_FLAG_CC3);
+				__HAL_TIM_ENABLE_IT(&htim2, TIM_IT_CC3);
+			}
+			stopTrigger.source = STOP_COUNTS;
+		}
+	}
+	taskEXIT_CRITICAL();
+}
 
-//	sprintf(buf1, "fwd targetV: %d", pidA.target_speed);
-//	sprintf(buf2, "pwmA: %d", speedA);
-//	sprintf(buf3, "pwmB: %d", speedB);
-//	sprintf(buf2, "TargetD: %.1fcm", targetDistance);
-//	sprintf(buf3, "ActualA: %.1fcm", totalDistanceA);
-//	sprintf(buf4, "ActualB: %.1fcm", totalDistanceB);
-//	sprintf(buf3, "EncA: %d", currentEncoderA);
-//	sprintf(buf4, "EncB: %d", currentEncoderB);
+// Interrupt context: the armed condition just became true
+static void stopFire(void){
+	if(stopTrigger.fired) return;
+	stopTrigger.fired = 1;
+	motorStop();
+	BaseType_t woken = pdFALSE;
+	xTaskNotifyFromISR((TaskHandle_t)motorTaskHandle, MOTOR_EVT_STOP, eSetBits, &woken);
+	portYIELD_FROM_ISR(woken);
+}
 
-//	motorForwardA(cmd.param1Speed);
-//	motorForwardB(cmd.param1Speed);
+// Whether a fired condition still holds; a glitch re-arms the trigger
+static uint8_t stopHolds(void){
+	switch(stopTrigger.source){
+	case STOP_IR: return stopTrigger.ir->detected;
+	case STOP_ECHO_BELOW: return echo <= stopTrigger.echoUs;
+	case STOP_COUNTS: return 1;
+	default: return 0;
+	}
+}
 
-//  PID output
-	motorForwardA(speedA);
-	motorForwardB(speedB);
+// Signed counts moved since *last; the 16-bit counters wrap.
+static int32_t encoderDelta(EncoderId encoder, uint16_t *last){
+	uint16_t now = (uint16_t)Encoder_Count(encoder);
+	int16_t diff = (int16_t)(now - *last);
+	*last = now;
+	return diff;
+}
 
-	sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	sprintf(buf3, "ActualA: %.1f", totalDistanceA);
-//	sprintf(buf4, "HeadC: %.1f", headingCorrection);
+static int32_t motionLimitSpeed(int32_t speed, float remaining, const SpeedStep *profile, uint8_t len){
+	for(uint8_t i = 0; i < len; i++){
+		if(remaining < profile[i].below){
+			if(speed > profile[i].above) speed = profile[i].cap;
+			break;
+		}
+	}
+	return speed;
+}
 
-	return 0;
+// Progress events (PROGRESS in LINK_FEATURES). GENERAL/PROGRESS/<every>/<brake>
+// asks for "!id/PROGRESS/<pct>/<eta ms>;" each time a move or turn passes a
+// multiple of <every> percent of its target and, with <brake> 1,
+// "!id/PROGRESS/BRAKE/<eta ms>;" the first tick its approach profile cuts the
+// speed. The ETA is what is left at the rate over the last PROGRESS_RATE_MS,
+// -1 before there is one. The RPi gets the camera and the next leg ready on
+// them. Off (0/0) until asked for.
+#define PROGRESS_RATE_MS 50u
+static volatile uint8_t progressEvery = 0; // Percent; rxSerial writes, the motor task reads
+static volatile uint8_t progressBrake = 0;
+static struct {
+	uint32_t cmdId;
+	uint8_t nextMark;      // Next percentage to report, 0 for none
+	uint8_t braked;
+	float windowRemaining; // remaining at windowTick, < 0 before the first tick
+	uint32_t windowTick;
+	float rate;            // remaining per ms, 0 until measured
+} progress;
+
+// Motor task, when cmdId starts
+static void progressStart(uint32_t cmdId){
+	progress.cmdId = cmdId;
+	progress.nextMark = progressEvery;
+	progress.braked = 0;
+	progress.windowRemaining = -1.0f;
+	progress.rate = 0.0f;
 }
 
-uint8_t motorPidForwardF(MotorCommandF_t cmd, uint8_t isStateChanged) {
-//	float PoutA, PoutB, IoutA, IoutB, DoutA, DoutB, errorA, errorB, derivativeA, derivativeB;
-	static float totalDistanceA = 0.0f;
-	static float totalDistanceB = 0.0f;
-	static uint32_t lastEncoderA = 0;
-	static uint32_t lastEncoderB = 0;
-	static float targetDistance = 0.0f;
-	static uint32_t hasTargetDistance = 0;
-	static float headingIntegral = 0.0f;
-	static float prevHeadingError = 0.0f;
+static void progressReply(const char *mark, float remaining){
+	char s[32];
+	snprintf(s, sizeof(s), "PROGRESS/%s/%ld", mark, progress.rate > 0.0f ? lroundf(remaining / progress.rate) : -1L);
+	serialReply(progress.cmdId, s);
+}
 
-	if(isStateChanged) {
-//		pidA = defaultPid;
-//		pidB = defaultPid;
-//		pidA.target_speed = cmd.param1Speed;
-//		pidB.target_speed = cmd.param1Speed;
-		headingIntegral = 0.0f;
-		prevHeadingError = 0.0f;
-		isFrontCalib = 1;
-		isTurning = 0;
-		setServoAngle(SERVO_CENTER);
-		osDelay(10);
+// motionRun, every tick a resumable primitive drives: remaining of target in
+// the same units, and whether the profile is slowing it down
+static void progressPoll(float remaining, float target, uint8_t braking){
+	uint8_t every = progressEvery;
+	if((!every && !progressBrake) || target <= 0.0f || remaining >= MOTION_NO_TARGET) return;
+	uint32_t now = HAL_GetTick();
+	if(progress.windowRemaining < 0.0f){
+		progress.windowRemaining = remaining;
+		progress.windowTick = now;
+	}else if(now - progress.windowTick >= PROGRESS_RATE_MS){
+		progress.rate = (progress.windowRemaining - remaining) / (float)(now - progress.windowTick);
+		progress.windowRemaining = remaining;
+		progress.windowTick = now;
+	}
+	float pct = (1.0f - remaining / target) * 100.0f;
+	if(every && progress.nextMark && progress.nextMark < 100 && pct >= progress.nextMark){
+		uint8_t passed = (uint8_t)(pct / every) * every; // The last mark passed, if a tick skipped some
+		if(passed >= 100) passed = (uint8_t)((99 / every) * every);
+		char mark[4];
+		snprintf(mark, sizeof(mark), "%u", passed);
+		progressReply(mark, remaining);
+		progress.nextMark = passed + every;
+	}
+	if(progressBrake && braking && !progress.braked){
+		progress.braked = 1;
+		progressReply("BRAKE", remaining);
+	}
+}
 
-		totalDistanceA = 0.0f;
-		totalDistanceB = 0.0f;
-		if(cmd.param2DistAngle > 0){
-			hasTargetDistance = 1;
-			targetDistance = cmd.param2DistAngle; // param2 represents distance in cm
-		}else{
-			hasTargetDistance = 0;
-			targetDistance = 0.0f;
+// Queue credits (CREDIT in LINK_FEATURES). GENERAL/CREDIT/1/0 answers
+// "OK/CREDIT/1/<MOTOR_COMMAND_QUEUE_LEN>" and from then on, each time the motor
+// task takes a command off motorCommandQueue, sends "!id/CREDIT/<limit>;": the
+// highest command ID there is room for, the last one queued plus the free
+// slots. The RPi sends up to it instead of finding out from
+// MOTOR_COMMAND_QUEUE_IS_FULL, which stays for a sender that overruns. Route
+// steps do not come through the queue and send none. Off until asked for.
+static volatile uint8_t creditOn = 0;        // rxSerial writes, the motor task reads
+static volatile uint32_t creditLastId = 0;   // Last command queued (rxSerial)
+
+// rxSerial, once a command is in the queue. creditReport reads the ID before
+// the free count, so a command queued in between pairs the old ID with the new
+// count: a lower limit, never a higher one.
+static void creditQueued(uint32_t cmdId){
+	creditLastId = cmdId;
+}
+
+// Motor task, having taken cmdId off the queue
+static void creditReport(uint32_t cmdId){
+	if(!creditOn) return;
+	uint32_t last = creditLastId; // Before the free count; see creditQueued
+	char s[24];
+	snprintf(s, sizeof(s), "CREDIT/%lu", (unsigned long)(last + uxQueueSpacesAvailable(motorCommandQueue)));
+	serialReply(cmdId, s);
+}
+
+// Stall detection (STALL in LINK_FEATURES). A wheel driven at STALL_PWM or
+// more that turns less than STALL_CM in STALL_MS is stuck, e.g. on an
+// obstacle edge. A turn whose wheels are driven that hard while the heading
+// moves less than STALL_DEG in STALL_YAW_MS is not getting round, e.g. the
+// wheels slip. Either one ends the primitive with "!id/FAULT/STALL/<pose>;"
+// at once, rather than the RPi waiting out its ACK deadline.
+#define STALL_PWM 1500
+#define STALL_MS 300u
+#define STALL_CM 0.5f
+#define STALL_YAW_MS 800u
+#define STALL_DEG 2.0f
+static struct {
+	uint32_t since[2];  // Start of each wheel's window
+	float moved[2];     // cm in it
+	uint32_t yawSince;
+	float yawFrom;
+	uint8_t fired;      // The motor task reports it and abandons the command
+} stall;
+
+static void stallReset(void){
+	uint32_t now = HAL_GetTick();
+	stall.since[0] = stall.since[1] = stall.yawSince = now;
+	stall.moved[0] = stall.moved[1] = 0.0f;
+	stall.yawFrom = currentAngle;
+}
+
+// motionRun, after the PWM for this tick is set
+static void stallPoll(const MotionSpec *spec){
+	uint32_t now = HAL_GetTick();
+	const float step[2] = {motion.stepA, motion.stepB};
+	uint8_t driven = 0;
+	for(int w = 0; w < 2; w++){
+		if(Motor_Duty(w == 0 ? MOTOR_A : MOTOR_B) < STALL_PWM){
+			stall.since[w] = now;
+			stall.moved[w] = 0.0f;
+			continue;
+		}
+		driven = 1;
+		stall.moved[w] += fabsf(step[w]);
+		if(stall.moved[w] >= STALL_CM){
+			stall.since[w] = now;
+			stall.moved[w] = 0.0f;
+		}else if(now - stall.since[w] >= STALL_MS){
+			stall.fired = 1;
 		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
 	}
+	if(spec->drive != MOTION_PIVOT_A && spec->drive != MOTION_PIVOT_B) return;
+	float turned = currentAngle - stall.yawFrom;
+	if(turned > 180.0f) turned -= 360.0f;
+	else if(turned < -180.0f) turned += 360.0f;
+	if(!driven || fabsf(turned) >= STALL_DEG){
+		stall.yawSince = now;
+		stall.yawFrom = currentAngle;
+	}else if(now - stall.yawSince >= STALL_YAW_MS){
+		stall.fired = 1;
+	}
+	if(stall.fired) motorStop();
+}
 
-	int32_t speedA = cmd.param1Speed;
-	int32_t speedB = cmd.param1Speed;
-
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-	int32_t diffA;
-	int32_t rawDiffA = currentEncoderA - lastEncoderA;
-	if (rawDiffA > 32767) {
-	    // Underflow: encoder went from small number to large number (reverse)
-	    diffA = rawDiffA - 65536;
-	} else if (rawDiffA < -32767) {
-	    // Overflow: encoder went from large number to small number (forward)
-	    diffA = rawDiffA + 65536;
-	} else {
-	    diffA = rawDiffA;
+uint8_t motionRun(const MotionSpec *spec, int32_t speed, float target, uint8_t isStateChanged){
+	if(isStateChanged){
+		motion.target = target;
+		motion.travelledA = 0.0f;
+		motion.travelledB = 0.0f;
+		motion.headingIntegral = 0.0f;
+		motion.prevHeadingError = 0.0f;
+		motion.confirm = 0;
+		motion.curvature = 0.0f;
+		motion.lastEncoderA = Encoder_Count(ENCODER_A);
+		motion.lastEncoderB = Encoder_Count(ENCODER_B);
+		stopArm(spec);
+		stallReset();
 	}
-//	sprintf(buf2, "RawDiff: %d    ", rawDiff);
-//	sprintf(buf3, "CEncA: %d    ", currentEncoderA);
-//	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
-	lastEncoderA = currentEncoderA;
-
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	int32_t diffB = 0;
-	int32_t rawDiffB = currentEncoderB - lastEncoderB;
-	if (rawDiffB > 32767) {
-		// Underflow: encoder went from small number to large number (reverse)
-		diffB = rawDiffB - 65536;
-	} else if (rawDiffB < -32767) {
-		// Overflow: encoder went from large number to small number (forward)
-		diffB = rawDiffB + 65536;
-	} else {
-		diffB = rawDiffB;
+
+	// MotorB encoder counts the other way
+	float sign = spec->drive == MOTION_REVERSE ? -1.0f : 1.0f;
+	motion.stepA = sign * (float)encoderDelta(ENCODER_A, &motion.lastEncoderA) / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
+	motion.travelledA += motion.stepA;
+	motion.stepB = -sign * (float)encoderDelta(ENCODER_B, &motion.lastEncoderB) / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
+	motion.travelledB += motion.stepB;
+
+	float remaining = MOTION_NO_TARGET;
+	MotionVerdict verdict = spec->check(spec, &remaining);
+	if(spec->resumable) recoveryNoteRemaining(remaining < MOTION_NO_TARGET ? remaining : -1.0f);
+	if(stopTrigger.fired && verdict != MOTION_DONE){
+		if(stopHolds()) verdict = MOTION_WAIT; // Stay stopped until check() agrees
+		else stopTrigger.fired = 0;
 	}
-	lastEncoderB = currentEncoderB;
-
-	float distanceA = (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceA += distanceA;
-	float distanceB = (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceB -= distanceB; // MotorB Encoder is reverse
-
-	if (hasTargetDistance && totalDistanceA >= targetDistance - 0.8f) {
-	    motorStop();
-	    isFrontCalib = 0;
-	    // Display completion message
-	    sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	    sprintf(buf3, "EaD: %.1f", totalDistanceA);
-//	    sprintf(buf4, "EbD: %.1f", totalDistanceB);
-	    setServoAngle(SERVO_CENTER);
-	    return 1;
+	if(verdict == MOTION_DONE){
+		stopDisarm();
+		motorStop();
+		isFrontCalib = 0;
+		isTurning = 0;
+		setServoAngle(SERVO_CENTER);
+		return 1;
+	}
+	if(verdict == MOTION_HOLD) return 0;
+	if(verdict == MOTION_WAIT){
+		motorStop();
+		return 0;
+	}
+	if(spec->resumable){
+		uint8_t braking = spec->profile != NULL && motionLimitSpeed(speed, remaining, spec->profile, spec->profileLen) < speed;
+		progressPoll(remaining, motion.target, braking);
 	}
 
-	if (hasTargetDistance && targetDistance-totalDistanceA < 50) { // Slow down in last 30cm
-			if(targetDistance-totalDistanceA<5) {
-				if(speedA>800){
-					speedA = 800;
-					speedB = 800;
-				}
-			}else if(targetDistance-totalDistanceA<10) {
-				if(speedA>1200){
-					speedA = 1200;
-					speedB = 1200;
-				}
-			}
-			else if(targetDistance-totalDistanceA<20) {
-				if(speedA>3000){
-					speedA = 4000;
-					speedB = 4000;
-				}
-			}else {
-				if(speedA>5000){
-					speedA = 5000;
-					speedB = 5000;
-				}
-			}
-			sprintf(buf1, "Slowing down..."	);
-	//		sprintf(buf2, "pwmA: %d", speedA);
-	//		sprintf(buf3, "pwmB: %d", speedB);
-	//		motorForwardA(speedA);
-	//		motorForwardB(speedB);
-	//		return 0;
+	if(spec->drive == MOTION_PIVOT_A || spec->drive == MOTION_PIVOT_B){
+		speed = motionLimitSpeed(speed, remaining, spec->profile, spec->profileLen);
+		taskENTER_CRITICAL(); // A trigger firing from here on must not be overwritten
+		if(stopTrigger.fired){
+			// Stopped already
+		}else if(spec->drive == MOTION_PIVOT_A){
+			Motor_Hold();
+			motorForwardA(speed);
+			motorStopB();
+			Motor_Commit();
 		}else{
-			sprintf(buf1, "GoGoGo..."	);
+			Motor_Hold();
+			motorForwardB(speed);
+			motorStopA();
+			Motor_Commit();
 		}
+		taskEXIT_CRITICAL();
+		stallPoll(spec);
+		return 0;
+	}
 
-	// MotorA & MotorB speed difference fix
-	float headingError = totalDistanceA - totalDistanceB;
-	const float Kp_heading = 1.0f;
-	const float Ki_heading = 1.0f;
-	const float Kd_heading = 1.0f;
-
-	headingIntegral += headingError;
-	if(headingIntegral > 100) headingIntegral = 100;
-	if(headingIntegral < -100) headingIntegral = -100;
+	int32_t speedA = motionLimitSpeed(speed, remaining, spec->profile, spec->profileLen);
+	int32_t speedB = speedA;
+	if(spec->profile != NULL){
+		sprintf(buf1, remaining < spec->profile[spec->profileLen - 1].below ? "Slowing down..." : "GoGoGo...");
+	}
 
-	float headingDerivative = headingError - prevHeadingError;
-	prevHeadingError = headingError;
-	float headingCorrection = Kp_heading * headingError + Ki_heading * headingIntegral + Kd_heading * headingDerivative;
+	// MotorA & MotorB speed difference fix
+	float headingError = motion.travelledA - motion.travelledB;
+	motion.headingIntegral += headingError;
+	if(motion.headingIntegral > 100) motion.headingIntegral = 100;
+	if(motion.headingIntegral < -100) motion.headingIntegral = -100;
+	float headingDerivative = headingError - motion.prevHeadingError;
+	motion.prevHeadingError = headingError;
+	float headingCorrection = spec->kp * headingError + spec->ki * motion.headingIntegral + spec->kd * headingDerivative;
 
 	speedA -= headingCorrection;
 	speedB += headingCorrection;
-
+	// On a steered arc the inner wheel (A, the left one, for a left arc) runs the smaller circle
+	float k = motion.curvature * TRACK_HALF_CM;
+	if(k > 0.0f) speedA = (int32_t)((float)speedA * (1.0f - k) / (1.0f + k));
+	else if(k < 0.0f) speedB = (int32_t)((float)speedB * (1.0f + k) / (1.0f - k));
 	if (speedA > 7199) speedA = 7199;
 	if (speedA < 0) speedA = 0;
 	if (speedB > 7199) speedB = 7199;
 	if (speedB < 0) speedB = 0;
 
-//	sprintf(buf1, "fwd targetV: %d", pidA.target_speed);
-//	sprintf(buf2, "pwmA: %d", speedA);
-//	sprintf(buf3, "pwmB: %d", speedB);
-//	sprintf(buf2, "TargetD: %.1fcm", targetDistance);
-//	sprintf(buf3, "ActualA: %.1fcm", totalDistanceA);
-//	sprintf(buf4, "ActualB: %.1fcm", totalDistanceB);
-//	sprintf(buf3, "EncA: %d", currentEncoderA);
-//	sprintf(buf4, "EncB: %d", currentEncoderB);
-
-//	motorForwardA(cmd.param1Speed);
-//	motorForwardB(cmd.param1Speed);
-
-//  PID output
-	motorForwardA(speedA);
-	motorForwardB(speedB);
-
-	sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	sprintf(buf3, "ActualA: %.1f", totalDistanceA);
-//	sprintf(buf4, "HeadC: %.1f", headingCorrection);
-
+	int32_t backSpeed = motionLimitSpeed(speed, -remaining, spec->backProfile, spec->backProfileLen);
+	taskENTER_CRITICAL();
+	if(stopTrigger.fired){
+		// Stopped already
+	}else if(spec->drive == MOTION_REVERSE){
+		motorDrive(speedA, 1, speedB, 1);
+	}else if(remaining < 0.0f && spec->backProfile != NULL){
+		// Overshot: back off without heading correction
+		motorDrive(backSpeed, 1, backSpeed, 1);
+	}else{
+		motorDrive(speedA, 0, speedB, 0);
+	}
+	taskEXIT_CRITICAL();
+	stallPoll(spec);
 	return 0;
 }
 
-uint8_t motorPidForwardTask2UntilSensor(MotorCommandF_t cmd, uint8_t isStateChanged, uint8_t *sensorNow, float *distPtr) {
-    static float totalDistanceA = 0.0f;
-    static float totalDistanceB = 0.0f;
-    static uint32_t lastEncoderA = 0;
-    static uint32_t lastEncoderB = 0;
-    static float headingIntegral = 0.0f;
-    static float prevHeadingError = 0.0f;
-    static uint8_t confirmStop = 0;
-    static uint32_t debugCount = 0;
+// Encoder distance (cm) against motion.target
+static MotionVerdict motionCheckDistance(const MotionSpec *spec, float *remaining){
+	if(motion.target <= 0.0f) return MOTION_RUN;
+	if(motion.travelledA >= motion.target - spec->stopEarly) return MOTION_DONE;
+	*remaining = motion.target - motion.travelledA;
+	return MOTION_RUN;
+}
 
-    if(isStateChanged) {
-        headingIntegral = 0.0f;
-        prevHeadingError = 0.0f;
-        isFrontCalib = 1;
-        isTurning = 0;
-        setServoAngle(SERVO_CENTER);
-        confirmStop = 0;
-        isToMove = 1;
-        debugCount = 0;
-        osDelay(10);
-
-        totalDistanceA = 0.0f;
-        totalDistanceB = 0.0f;
-        lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-        lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-    }
+// Task 2: the approach may only finish once the RPi has answered (*capture != 0).
+// Until then it crawls over the last TASK2_DECIDE_MM and waits at the target.
+static MotionVerdict motionAwaitCapture(volatile uint8_t *capture, MotionVerdict verdict, float *remaining){
+	if (*capture != 0) return verdict;
+	if (verdict == MOTION_DONE) return MOTION_WAIT;
+	if (*remaining > 0.0f && *remaining < TASK2_DECIDE_MM) *remaining = 0.0f; // Slowest profile step
+	return verdict;
+}
 
-    int32_t speedA = cmd.param1Speed;
-    int32_t speedB = cmd.param1Speed;
-
-    // --- Encoder handling (same as your code) ---
-    int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-    int32_t rawDiffA = currentEncoderA - lastEncoderA;
-    int32_t diffA;
-    if (rawDiffA > 32767) diffA = rawDiffA - 65536;
-    else if (rawDiffA < -32767) diffA = rawDiffA + 65536;
-    else diffA = rawDiffA;
-    lastEncoderA = currentEncoderA;
-
-    int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-    int32_t rawDiffB = currentEncoderB - lastEncoderB;
-    int32_t diffB;
-    if (rawDiffB > 32767) diffB = rawDiffB - 65536;
-    else if (rawDiffB < -32767) diffB = rawDiffB + 65536;
-    else diffB = rawDiffB;
-    lastEncoderB = currentEncoderB;
-
-    float distanceA = (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-    totalDistanceA += distanceA;
-    (*distPtr) += distanceA;
-    float distanceB = (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-    totalDistanceB -= distanceB; // MotorB reversed
-
-    // --- Stop condition: sensor falling edge ---
-    if (*sensorNow == 1) {
-        confirmStop++;
-        if (confirmStop > 3) { // a few cycles to debounce
-            motorStop();
-            isFrontCalib = 0;
-            sprintf(buf1, "Sensor Stop!");
-            sprintf(buf2, "Dist: %.1f", *distPtr);
-            setServoAngle(SERVO_CENTER);
-            confirmStop = 0;
-            return 1; // completed
-        }
-    } else {
-        confirmStop = 0;
-    }
+// Range ahead (mm) for the ultrasonic approaches: the fused estimate while
+// echoes keep arriving, otherwise the last echo's `distance`
+static float frontRangeMm(void){
+#if FRONT_RANGE_FUSION
+	FrontRange r;
+	frontRangeGet(&r);
+	if(r.valid && r.ageS < FRONT_RANGE_STALE_S) return r.mm;
+#endif
+	return distance;
+}
 
+// Front range (mm) down to motion.target; asks the RPi for CAPTURE1 on the way
+static MotionVerdict motionCheckObstacle(const MotionSpec *spec, float *remaining){
+	if (motion.target < 0.0f && isToMove == 0) return MOTION_DONE;
+	float range = frontRangeMm();
+	if(range < motion.target + 1500.0f && motion.requestPending){ // for testing, change to 300
+		uartTxSend((char *)capture1Req);
+		motion.requestPending = 0;
+	}
+	if (motion.target <= 0.0f) return MOTION_RUN;
+	*remaining = range - motion.target;
+	MotionVerdict verdict = MOTION_RUN;
+	if (range <= motion.target + 8.0f) {
+		if(motion.confirm > 5) verdict = MOTION_DONE;
+		else motion.confirm += 1;
+	}else{
+		motion.confirm = 0;
+	}
+	return motionAwaitCapture(&capture1, verdict, remaining);
+}
+
+// Front range (mm) to within 8 mm of motion.target from either side; asks for CAPTURE2 on the way
+static MotionVerdict motionCheckObstacleBand(const MotionSpec *spec, float *remaining){
+	if (motion.target < 0.0f && isToMove == 0) return MOTION_DONE;
+	if (motion.target <= 0.0f) return MOTION_RUN;
+	*remaining = frontRangeMm() - motion.target;
+	if (*remaining <= 8.0f && *remaining >= -8.0f) {
+		if(motion.confirm > 3) return motionAwaitCapture(&capture2, MOTION_DONE, remaining);
+		motion.confirm += 1;
+		return MOTION_HOLD;
+	}
+	motion.confirm = 0;
+	if(*remaining < 300.0f && motion.requestPending){
+		uartTxSend((char *)capture2Req);
+		motion.requestPending = 0;
+	}
+	return motionAwaitCapture(&capture2, MOTION_RUN, remaining);
+}
 
-    // --- Heading correction (same as original) ---
-    float headingError = totalDistanceA - totalDistanceB;
-    const float Kp_heading = 1.0f;
-    const float Ki_heading = 1.0f;
-    const float Kd_heading = 1.0f;
+// IR sensor at motion.sensor has read "detected" for IR_CONFIRM_MS. The
+// STOP_IR trigger has already stopped the wheels; wait out the confirm time stopped.
+static MotionVerdict motionCheckSensor(const MotionSpec *spec, float *remaining){
+	IrSensor *sensor = motion.sensor;
+	if(!sensor->detected) return MOTION_RUN; // Not there yet, or the edge was a glitch
+	if(DWT->CYCCNT - sensor->edgeCycles >= IR_CONFIRM_MS * (SystemCoreClock / 1000)) return MOTION_DONE;
+	return MOTION_WAIT;
+}
 
-    headingIntegral += headingError;
-    if (headingIntegral > 100) headingIntegral = 100;
-    if (headingIntegral < -100) headingIntegral = -100;
+// EXTI context
+static void irEdge(IrSensor *sensor, uint8_t detected){
+	sensor->edgeCycles = DWT->CYCCNT;
+	sensor->detected = detected;
+	if(detected && stopTrigger.source == STOP_IR && stopTrigger.ir == sensor) stopFire();
+}
 
-    float headingDerivative = headingError - prevHeadingError;
-    prevHeadingError = headingError;
-    float headingCorrection = Kp_heading * headingError +
-                              Ki_heading * headingIntegral +
-                              Kd_heading * headingDerivative;
+FAST_CODE void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin){
+	uint32_t start = DWT->CYCCNT;
+	PROF_BEGIN(PR_IR);
+	if(GPIO_Pin == IR_LEFT_Pin){
+		irEdge(&irLeft, IR_LeftDetected());
+	}else if(GPIO_Pin == IR_RIGHT_Pin){
+		irEdge(&irRight, IR_RightDetected());
+	}
+	PROF_END(PR_IR);
+	Wcet_Isr(&wcetIsrs[WCET_ISR_IR], start);
+}
 
-    speedA -= headingCorrection;
-    speedB += headingCorrection;
+// Encoder approach caps (cm left); motorPidForward() still runs its older, softer set
+static const SpeedStep approachCm[] = {
+	{5.0f, 800, 800}, {10.0f, 1200, 1200}, {20.0f, 3000, 4000}, {50.0f, 5000, 5000},
+};
+static const SpeedStep approachCmFwd[] = {
+	{10.0f, 850, 850}, {20.0f, 3000, 4000}, {50.0f, 5000, 5000},
+};
+// Ultrasonic approach caps (mm left) and overshoot back-off caps (mm past)
+static const SpeedStep approachMm[] = {
+	{50.0f, 800, 800}, {100.0f, 1200, 1200}, {200.0f, 3000, 4000}, {500.0f, 5000, 5000},
+};
+static const SpeedStep backOffMm[] = {
+	{100.0f, 800, 800}, {150.0f, 1500, 1500}, {200.0f, 2000, 2000}, {MOTION_NO_TARGET, 3000, 3000},
+};
+// Turn caps (degrees left)
+static const SpeedStep approachDeg[] = {
+	{10.0f, 1000, 1000}, {30.0f, 2000, 2000}, {45.0f, 4000, 4000}, {60.0f, 5000, 5000},
+};
 
-    if (speedA > 7199) speedA = 7199;
-    if (speedA < 0) speedA = 0;
-    if (speedB > 7199) speedB = 7199;
-    if (speedB < 0) speedB = 0;
+#define PROFILE(p) (p), (uint8_t)(sizeof(p) / sizeof((p)[0]))
+static const MotionSpec forwardSpec = {MOTION_FORWARD, PROFILE(approachCmFwd), NULL, 0, 1.2f, 0.01f, 0.0f, 1.6f, motionCheckDistance, STOP_COUNTS, 1};
+static const MotionSpec forwardFSpec = {MOTION_FORWARD, PROFILE(approachCm), NULL, 0, 1.0f, 1.0f, 1.0f, 0.8f, motionCheckDistance, STOP_COUNTS, 1};
+static const MotionSpec reverseSpec = {MOTION_REVERSE, PROFILE(approachCm), NULL, 0, 1.0f, 1.0f, 1.0f, 0.8f, motionCheckDistance, STOP_COUNTS, 1};
+static const MotionSpec obstacleSpec = {MOTION_FORWARD, PROFILE(approachMm), NULL, 0, 1.0f, 1.0f, 1.0f, 0.0f, motionCheckObstacle, STOP_ECHO_BELOW};
+static const MotionSpec obstacleBandSpec = {MOTION_FORWARD, PROFILE(approachMm), PROFILE(backOffMm), 1.0f, 1.0f, 1.0f, 0.0f, motionCheckObstacleBand};
+static const MotionSpec sensorSpec = {MOTION_FORWARD, NULL, 0, NULL, 0, 1.0f, 1.0f, 1.0f, 0.0f, motionCheckSensor, STOP_IR};
+
+// Servo centred and front-wheel calibration on for the straight-ahead moves
+static void motorForwardStart(void){
+	isFrontCalib = 1;
+	xTaskNotifyGive((TaskHandle_t)servoTaskHandle);
+	xTaskNotifyGive((TaskHandle_t)frontWheelCalibHandle);
+	isTurning = 0;
+	setServoAngle(SERVO_CENTER);
+	osDelay(10);
+}
 
-    motorForwardA(speedA);
-    motorForwardB(speedB);
+uint8_t motorPidForward(MotorCommand_t cmd, uint8_t isStateChanged) {
+	if(isStateChanged) motorForwardStart();
+	uint8_t done = motionRun(&forwardSpec, cmd.param1Speed, (float)cmd.param2DistAngle, isStateChanged); // param2 represents distance in cm
+	showValue(buf2, "TargetD: ", motion.target, 1, 0, "");
+	return done;
+}
 
-    sprintf(buf2, "EncA: %.1f", totalDistanceA);
-    sprintf(buf3, "EncB: %.1f", totalDistanceB);
+uint8_t motorPidForwardF(MotorCommandF_t cmd, uint8_t isStateChanged) {
+	if(isStateChanged) motorForwardStart();
+	uint8_t done = motionRun(&forwardFSpec, cmd.param1Speed, cmd.param2DistAngle, isStateChanged);
+	showValue(buf2, "TargetD: ", motion.target, 1, 0, "");
+	return done;
+}
 
-    return 0;
+uint8_t motorPidForwardTask2UntilSensor(MotorCommandF_t cmd, uint8_t isStateChanged, IrSensor *sensor, float *distPtr) {
+	if(isStateChanged) {
+		motorForwardStart();
+		isToMove = 1;
+	}
+	motion.sensor = sensor; // Before motionRun() arms STOP_IR on it
+	uint8_t done = motionRun(&sensorSpec, cmd.param1Speed, 0.0f, isStateChanged);
+	(*distPtr) += motion.stepA;
+	if(done){
+		sprintf(buf1, "Sensor Stop!");
+		showValue(buf2, "Dist: ", *distPtr, 1, 0, "");
+	}else{
+		showValue(buf2, "EncA: ", motion.travelledA, 1, 0, "");
+		showValue(buf3, "EncB: ", motion.travelledB, 1, 0, "");
+	}
+	return done;
 }
 
 uint8_t motorPidForwardTask2Until(MotorCommandF_t cmd, uint8_t isStateChanged) {
@@ -996,719 +1726,71 @@ uint8_t motorPidForwardTask2Until(MotorCommandF_t cmd, uint8_t isStateChanged) {
 	// Param2 Dist: Stop until cmd.param2DistAngle (distance measured from the ultrasonic sensor)
 	// Param2 Dist: -1 - Stopping when isToMove=0;
 
-	static float totalDistanceA = 0.0f;
-	static float totalDistanceB = 0.0f;
-	static uint32_t lastEncoderA = 0;
-	static uint32_t lastEncoderB = 0;
-	static float targetDistanceFromObstacle = 0.0f;
-	static float headingIntegral = 0.0f;
-	static float prevHeadingError = 0.0f;
-	static uint8_t confirmStop = 0;
-	static uint32_t debugCount = 0;
-	static uint8_t toSendReq1 = 0;
-
 	if(isStateChanged) {
-		headingIntegral = 0.0f;
-		prevHeadingError = 0.0f;
-		isFrontCalib = 1;
-		isTurning = 0;
-		setServoAngle(SERVO_CENTER);
-		confirmStop = 0;
+		motorForwardStart();
 		isToMove = 1;
-		debugCount = 0;
-		osDelay(10);
-
-		totalDistanceA = 0.0f;
-		totalDistanceB = 0.0f;
-		if(cmd.param2DistAngle > 0.0f){
-			targetDistanceFromObstacle = cmd.param2DistAngle; // param2 represents distance in mm
-			toSendReq1 = 1;
-		}else{
-			targetDistanceFromObstacle = -1.0f;
-		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
+		motion.requestPending = cmd.param2DistAngle > 0.0f;
 	}
+	// param2 represents distance in mm
+	return motionRun(&obstacleSpec, cmd.param1Speed, cmd.param2DistAngle > 0.0f ? cmd.param2DistAngle : -1.0f, isStateChanged);
+}
 
-	int32_t speedA = cmd.param1Speed;
-	int32_t speedB = cmd.param1Speed;
-
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-	int32_t diffA;
-	int32_t rawDiffA = currentEncoderA - lastEncoderA;
-	if (rawDiffA > 32767) {
-	    // Underflow: encoder went from small number to large number (reverse)
-	    diffA = rawDiffA - 65536;
-	} else if (rawDiffA < -32767) {
-	    // Overflow: encoder went from large number to small number (forward)
-	    diffA = rawDiffA + 65536;
-	} else {
-	    diffA = rawDiffA;
-	}
-//	sprintf(buf2, "RawDiff: %d    ", rawDiff);
-//	sprintf(buf3, "CEncA: %d    ", currentEncoderA);
-//	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
-	lastEncoderA = currentEncoderA;
-
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	int32_t diffB = 0;
-	int32_t rawDiffB = currentEncoderB - lastEncoderB;
-	if (rawDiffB > 32767) {
-		// Underflow: encoder went from small number to large number (reverse)
-		diffB = rawDiffB - 65536;
-	} else if (rawDiffB < -32767) {
-		// Overflow: encoder went from large number to small number (forward)
-		diffB = rawDiffB + 65536;
-	} else {
-		diffB = rawDiffB;
-	}
-	lastEncoderB = currentEncoderB;
-
-	float distanceA = (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceA += distanceA;
-	float distanceB = (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceB -= distanceB; // MotorB Encoder is reverse
-
-	if (targetDistanceFromObstacle < 0.0f && isToMove == 0) return 1;
-
-	if (targetDistanceFromObstacle > 0.0f && distance <= targetDistanceFromObstacle +8.0f) {
-		if(confirmStop > 5){
-			motorStop();
-			isFrontCalib = 0;
-			setServoAngle(SERVO_CENTER);
-			confirmStop = 0;
-			return 1;
-		}else{
-			confirmStop += 1;
-		}
-	}else{
-		confirmStop = 0;
+uint8_t motorPidForwardBackwardsUntil(MotorCommandF_t cmd, uint8_t isStateChanged) {
+	if(isStateChanged) {
+		motorForwardStart();
+		isToMove = 1;
+		motion.requestPending = cmd.param2DistAngle > 0.0f;
 	}
+	// param2 represents distance in mm
+	return motionRun(&obstacleBandSpec, cmd.param1Speed, cmd.param2DistAngle > 0.0f ? cmd.param2DistAngle : -1.0f, isStateChanged);
+}
 
-	if(distance < targetDistanceFromObstacle+1500.0f && toSendReq1){ // for testing, change to 300
-		HAL_UART_Transmit(&huart3,(uint8_t *)capture1Req,strlen(capture1Req),0xFFFF);
-		toSendReq1 = 0;
+uint8_t motorPidReverse(MotorCommand_t cmd, uint8_t isStateChanged) {
+	if(isStateChanged) {
+		isFrontCalib = 0;
+		isTurning = 0;
 	}
-
-	if (targetDistanceFromObstacle > 0.0f && distance < targetDistanceFromObstacle+500.0f) { // Slow down in last 50cm
-			if(distance < targetDistanceFromObstacle+50.0f) {
-				if(speedA>800){
-					speedA = 800;
-					speedB = 800;
-				}
-			}else if(distance < targetDistanceFromObstacle+100.0f) {
-				if(speedA>1200){
-					speedA = 1200;
-					speedB = 1200;
-				}
-			}
-			else if(distance < targetDistanceFromObstacle+200.0f) {
-				if(speedA>3000){
-					speedA = 4000;
-					speedB = 4000;
-				}
-			}else {
-				if(speedA>5000){
-					speedA = 5000;
-					speedB = 5000;
-				}
-			}
-			sprintf(buf1, "Slowing down..."	);
-		}else{
-			sprintf(buf1, "GoGoGo..."	);
-		}
-
-	// MotorA & MotorB speed difference fix
-	float headingError = totalDistanceA - totalDistanceB;
-	const float Kp_heading = 1.0f;
-	const float Ki_heading = 1.0f;
-	const float Kd_heading = 1.0f;
-
-	headingIntegral += headingError;
-	if(headingIntegral > 100) headingIntegral = 100;
-	if(headingIntegral < -100) headingIntegral = -100;
-
-	float headingDerivative = headingError - prevHeadingError;
-	prevHeadingError = headingError;
-	float headingCorrection = Kp_heading * headingError + Ki_heading * headingIntegral + Kd_heading * headingDerivative;
-
-	speedA -= headingCorrection;
-	speedB += headingCorrection;
-
-	if (speedA > 7199) speedA = 7199;
-	if (speedA < 0) speedA = 0;
-	if (speedB > 7199) speedB = 7199;
-	if (speedB < 0) speedB = 0;
-
-//  PID output
-	motorForwardA(speedA);
-	motorForwardB(speedB);
-
-//	sprintf(buf2, "ObsD: %.1f", distance);
-//	sprintf(buf3, "ActualA: %.1f", totalDistanceA);
-//	sprintf(buf4, "HeadC: %.1f", headingCorrection);
-
-	return 0;
+	uint8_t done = motionRun(&reverseSpec, cmd.param1Speed, (float)cmd.param2DistAngle, isStateChanged); // param2 represents distance in cm
+	showValue(buf2, "TargetD: ", motion.target, 1, 0, "");
+	return done;
 }
 
-uint8_t motorPidForwardBackwardsUntil(MotorCommandF_t cmd, uint8_t isStateChanged) {
-
-    static float headingIntegral = 0.0f;
-    static float prevHeadingError = 0.0f;
-    static uint32_t lastEncoderA = 0;
-    static uint32_t lastEncoderB = 0;
-    static float totalDistanceA = 0.0f;
-    static float totalDistanceB = 0.0f;
-    static uint8_t confirmStop = 0;
-    static uint32_t debugCount = 0;
-	static float targetDistanceFromObstacle = 0.0f;
-	static float direction = 1.0f;
-	static uint8_t toSendReq2 = 0;
-
-    if (isStateChanged) {
-
-        headingIntegral = 0.0f;
-        prevHeadingError = 0.0f;
-        confirmStop = 0;
-        isFrontCalib = 1;
-        isTurning = 0;
-        isToMove = 1;
-        setServoAngle(SERVO_CENTER);
-        osDelay(10);
-
-		if(cmd.param2DistAngle > 0.0f){
-			targetDistanceFromObstacle = cmd.param2DistAngle; // param2 represents distance in mm
-			toSendReq2 = 1;
-		}else{
-			targetDistanceFromObstacle = -1.0f;
-		}
-
-        totalDistanceA = 0.0f;
-        totalDistanceB = 0.0f;
-        lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-        lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-    }
-
-    // Get encoder deltas (with wraparound handling)
-    int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-    int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-
-    int32_t rawDiffA = currentEncoderA - lastEncoderA;
-    if (rawDiffA > 32767) rawDiffA -= 65536;
-    else if (rawDiffA < -32767) rawDiffA += 65536;
-    lastEncoderA = currentEncoderA;
-
-    int32_t rawDiffB = currentEncoderB - lastEncoderB;
-    if (rawDiffB > 32767) rawDiffB -= 65536;
-    else if (rawDiffB < -32767) rawDiffB += 65536;
-    lastEncoderB = currentEncoderB;
-
-    float distanceA = (float)rawDiffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-    float distanceB = (float)rawDiffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-    totalDistanceA += distanceA;
-    totalDistanceB -= distanceB;   // Motor B is reverse
-//    *distPtr += distanceA;
-    // XS help to debug this
-
-    debugCount++;
+uint8_t motorPidReverseF(MotorCommandF_t cmd, uint8_t isStateChanged) {
+	if(isStateChanged) {
+		isFrontCalib = 0;
+		isTurning = 0;
+	}
+	uint8_t done = motionRun(&reverseSpec, cmd.param1Speed, cmd.param2DistAngle, isStateChanged);
+	showValue(buf2, "TargetD: ", motion.target, 1, 0, "");
+	return done;
+}
 
-    //----------------------------------------------------------------
-    // === Ultrasonic distance control logic ===
-    //----------------------------------------------------------------
+// Silences the buzzer and drops whatever is left of the song
+static void toneStop(void) {
+	HAL_TIM_PWM_Stop(&htim1, TIM_CHANNEL_1);
+	HAL_DMA_Abort(htim1.hdma[TIM_DMA_ID_UPDATE]); // Blocking, so the next song can start straight away
+	HAL_TIM_DMABurst_WriteStop(&htim1, TIM_DMA_UPDATE);
+}
 
-	if (targetDistanceFromObstacle < 0.0f && isToMove == 0) return 1;
+// Plays a TONE_END-terminated song in the background. Step 0 is written by
+// hand and latched with UG; that same update requests the DMA for step 1.
+static void tonePlay(const ToneStep *song, uint32_t steps) {
+	toneStop();
+	htim1.Instance->PSC = song[0].psc;
+	htim1.Instance->ARR = song[0].arr;
+	htim1.Instance->RCR = song[0].rcr;
+	htim1.Instance->CCR1 = song[0].ccr1;
+	HAL_TIM_DMABurst_MultiWriteStart(&htim1, TIM_DMABASE_PSC, TIM_DMA_UPDATE, &song[1].psc,
+			TIM_DMABURSTLENGTH_4TRANSFERS, (steps - 1) * (sizeof(ToneStep) / sizeof(uint32_t)));
+	HAL_TIM_GenerateEvent(&htim1, TIM_EVENTSOURCE_UPDATE);
+	HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_1);
+}
 
-	if(debugCount % 1000 == 0) {
-		//confirmStop = 1;
-	}
-
-	if (targetDistanceFromObstacle > 0.0f && distance <= targetDistanceFromObstacle -8.0f){
-		direction = -1.0f;
-	}
-	else {
-		direction = 1.0f;
-	}
-
-	if (targetDistanceFromObstacle > 0.0f && distance <= targetDistanceFromObstacle +8.0f && distance >= targetDistanceFromObstacle - 8.0f) {
-		if(confirmStop > 3){
-			motorStop();
-			isFrontCalib = 0;
-			// Display completion message
-//			sprintf(buf2, "ObsD: %.1f", distance);
-//			sprintf(buf3, "DPtr: %.1f", *distPtr);
-			setServoAngle(SERVO_CENTER);
-			confirmStop = 0;
-			return 1;
-		}else{
-			confirmStop += 1;
-			return 0;
-		}
-	}else{
-		confirmStop = 0;
-	}
-
-	int32_t speedA = cmd.param1Speed;
-	int32_t speedB = cmd.param1Speed;
-	int32_t revSpeedA = cmd.param1Speed;
-	int32_t revSpeedB = cmd.param1Speed;
-	if (targetDistanceFromObstacle > 0.0f && distance < targetDistanceFromObstacle) { // Change speed according to distance from obstacle (reverse)
-			if(distance < targetDistanceFromObstacle -50.0f) {
-				if (distance < targetDistanceFromObstacle - 100.0f){
-					if (distance < targetDistanceFromObstacle - 150.0f){
-						if (distance < targetDistanceFromObstacle - 200.0f){
-							if (revSpeedA > 3000){
-							revSpeedA = 3000;
-							revSpeedB = 3000;
-							}
-						}
-						else {
-							if (revSpeedA > 2000){
-								revSpeedA = 2000;
-								revSpeedB = 2000;
-							}
-						}
-					}
-					else {
-						if (revSpeedA > 1500){
-							revSpeedA = 1500;
-							revSpeedB = 1500;
-						}
-					}
-				}
-				else {
-					if(toSendReq2){
-						HAL_UART_Transmit(&huart3,(uint8_t *)capture2Req,strlen(capture2Req),0xFFFF);
-						toSendReq2 = 0;
-					}
-					if (revSpeedA > 800){
-						revSpeedA = 800;
-						revSpeedB = 800;
-					}
-				}
-			}
-			else {
-				if (revSpeedA > 800){
-					revSpeedA = 800;
-					revSpeedB = 800;
-				}
-			}
-	}
-
-
-	if (targetDistanceFromObstacle > 0.0f && distance < targetDistanceFromObstacle+500.0f) { // Slow down in last 50cm
-			if(distance < targetDistanceFromObstacle+50.0f) {
-				if(speedA>800){
-					speedA = 800;
-					speedB = 800;
-				}
-			}else if(distance < targetDistanceFromObstacle+100.0f) {
-				if(speedA>1200){
-					speedA = 1200;
-					speedB = 1200;
-				}
-			}
-			else if(distance < targetDistanceFromObstacle+200.0f) {
-				if(speedA>3000){
-					speedA = 4000;
-					speedB = 4000;
-				}
-			}else {
-				if(speedA>5000){
-					speedA = 5000;
-					speedB = 5000;
-				}
-			}
-			sprintf(buf1, "Slowing down..."	);
-
-			if(distance < targetDistanceFromObstacle+300.0f && toSendReq2){
-				HAL_UART_Transmit(&huart3,(uint8_t *)capture2Req,strlen(capture2Req),0xFFFF);
-				toSendReq2 = 0;
-			}
-		}else{
-			sprintf(buf1, "GoGoGo..."	);
-		}
-
-	// MotorA & MotorB speed difference fix
-	float headingError = totalDistanceA - totalDistanceB;
-	const float Kp_heading = 1.0f;
-	const float Ki_heading = 1.0f;
-	const float Kd_heading = 1.0f;
-
-	headingIntegral += headingError;
-	if(headingIntegral > 100) headingIntegral = 100;
-	if(headingIntegral < -100) headingIntegral = -100;
-
-	float headingDerivative = headingError - prevHeadingError;
-	prevHeadingError = headingError;
-	float headingCorrection = Kp_heading * headingError + Ki_heading * headingIntegral + Kd_heading * headingDerivative;
-
-	speedA -= headingCorrection;
-	speedB += headingCorrection;
-
-	if (speedA > 7199) speedA = 7199;
-	if (speedA < 0) speedA = 0;
-	if (speedB > 7199) speedB = 7199;
-	if (speedB < 0) speedB = 0;
-
-//  PID output
-	if (direction > 0){
-		motorForwardA(speedA);
-		motorForwardB(speedB);
-	}
-	else {
-		motorReverseA(revSpeedA);
-		motorReverseB(revSpeedB);
-	}
-
-
-//	sprintf(buf2, "ObsD: %.1f", distance);
-//	sprintf(buf3, "ActualA: %.1f", totalDistanceA);
-//	sprintf(buf4, "HeadC: %.1f", headingCorrection);
-
-	return 0;
-}
-
-uint8_t motorPidReverse(MotorCommand_t cmd, uint8_t isStateChanged) {
-//	float PoutA, PoutB, IoutA, IoutB, DoutA, DoutB, errorA, errorB, derivativeA, derivativeB;
-	static float totalDistanceA = 0.0f;
-	static float totalDistanceB = 0.0f;
-	static uint32_t lastEncoderA = 0;
-	static uint32_t lastEncoderB = 0;
-	static float targetDistance = 0.0f;
-	static uint32_t hasTargetDistance = 0;
-	static float headingIntegral = 0.0f;
-	static float prevHeadingError = 0.0f;
-
-	if(isStateChanged) {
-//		pidA = defaultPid;
-//		pidB = defaultPid;
-//		pidA.target_speed = cmd.param1Speed;
-//		pidB.target_speed = cmd.param1Speed;
-		headingIntegral = 0.0f;
-		prevHeadingError = 0.0f;
-		isFrontCalib = 0;
-		isTurning = 0;
-
-		totalDistanceA = 0.0f;
-		totalDistanceB = 0.0f;
-		if(cmd.param2DistAngle > 0){
-			hasTargetDistance = 1;
-			targetDistance = (float)cmd.param2DistAngle; // param2 represents distance in cm
-		}else{
-			hasTargetDistance = 0;
-			targetDistance = 0.0f;
-		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	}
-
-	int32_t speedA = cmd.param1Speed;
-	int32_t speedB = cmd.param1Speed;
-
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-	int32_t diffA;
-	int32_t rawDiffA = currentEncoderA - lastEncoderA;
-	if (rawDiffA > 32767) {
-	    // Underflow: encoder went from small number to large number (reverse)
-	    diffA = rawDiffA - 65536;
-	} else if (rawDiffA < -32767) {
-	    // Overflow: encoder went from large number to small number (forward)
-	    diffA = rawDiffA + 65536;
-	} else {
-	    diffA = rawDiffA;
-	}
-//	sprintf(buf2, "RawDiff: %d    ", rawDiff);
-//	sprintf(buf3, "CEncA: %d    ", currentEncoderA);
-//	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
-	lastEncoderA = currentEncoderA;
-
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	int32_t diffB = 0;
-	int32_t rawDiffB = currentEncoderB - lastEncoderB;
-	if (rawDiffB > 32767) {
-		// Underflow: encoder went from small number to large number (reverse)
-		diffB = rawDiffB - 65536;
-	} else if (rawDiffB < -32767) {
-		// Overflow: encoder went from large number to small number (forward)
-		diffB = rawDiffB + 65536;
-	} else {
-		diffB = rawDiffB;
-	}
-	lastEncoderB = currentEncoderB;
-
-	float distanceA = (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceA -= distanceA;
-	float distanceB = (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceB += distanceB; // MotorB Encoder is reverse
-
-	if (hasTargetDistance && totalDistanceA >= targetDistance - 0.8f) {
-	    motorStop();
-	    // Display completion message
-	    sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	    sprintf(buf3, "EaD: %.1f", totalDistanceA);
-//	    sprintf(buf4, "EbD: %.1f", totalDistanceB);
-	    setServoAngle(SERVO_CENTER);
-	    return 1;
-	}
-
-	if (hasTargetDistance && targetDistance-totalDistanceA < 50) { // Slow down in last 30cm
-			if(targetDistance-totalDistanceA<5) {
-				if(speedA>800){
-					speedA = 800;
-					speedB = 800;
-				}
-			}else if(targetDistance-totalDistanceA<10) {
-				if(speedA>1200){
-					speedA = 1200;
-					speedB = 1200;
-				}
-			}
-			else if(targetDistance-totalDistanceA<20) {
-				if(speedA>3000){
-					speedA = 4000;
-					speedB = 4000;
-				}
-			}else {
-				if(speedA>5000){
-					speedA = 5000;
-					speedB = 5000;
-				}
-			}
-			sprintf(buf1, "Slowing down..."	);
-	//		sprintf(buf2, "pwmA: %d", speedA);
-	//		sprintf(buf3, "pwmB: %d", speedB);
-	//		motorForwardA(speedA);
-	//		motorForwardB(speedB);
-	//		return 0;
-		}else{
-			sprintf(buf1, "GoGoGo..."	);
-		}
-
-	// MotorA & MotorB speed difference fix
-	float headingError = totalDistanceA - totalDistanceB;
-	const float Kp_heading = 1.0f;
-	const float Ki_heading = 1.0f;
-	const float Kd_heading = 1.0f;
-
-	headingIntegral += headingError;
-	if(headingIntegral > 100) headingIntegral = 100;
-	if(headingIntegral < -100) headingIntegral = -100;
-
-	float headingDerivative = headingError - prevHeadingError;
-	prevHeadingError = headingError;
-	float headingCorrection = Kp_heading * headingError + Ki_heading * headingIntegral + Kd_heading * headingDerivative;
-
-	speedA -= headingCorrection;
-	speedB += headingCorrection;
-
-	if (speedA > 7199) speedA = 7199;
-	if (speedA < 0) speedA = 0;
-	if (speedB > 7199) speedB = 7199;
-	if (speedB < 0) speedB = 0;
-
-//	sprintf(buf1, "fwd targetV: %d", pidA.target_speed);
-//	sprintf(buf2, "pwmA: %d", speedA);
-//	sprintf(buf3, "pwmB: %d", speedB);
-//	sprintf(buf2, "TargetD: %.1fcm", targetDistance);
-//	sprintf(buf3, "ActualA: %.1fcm", totalDistanceA);
-//	sprintf(buf4, "ActualB: %.1fcm", totalDistanceB);
-//	sprintf(buf3, "EncA: %d", currentEncoderA);
-//	sprintf(buf4, "EncB: %d", currentEncoderB);
-
-//	motorForwardA(cmd.param1Speed);
-//	motorForwardB(cmd.param1Speed);
-
-//  PID output
-	motorReverseA(speedA);
-	motorReverseB(speedB);
-
-	sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	sprintf(buf3, "ActualA: %.1f", totalDistanceA);
-//	sprintf(buf4, "HeadC: %.1f", headingCorrection);
-
-	return 0;
-}
-
-uint8_t motorPidReverseF(MotorCommandF_t cmd, uint8_t isStateChanged) {
-//	float PoutA, PoutB, IoutA, IoutB, DoutA, DoutB, errorA, errorB, derivativeA, derivativeB;
-	static float totalDistanceA = 0.0f;
-	static float totalDistanceB = 0.0f;
-	static uint32_t lastEncoderA = 0;
-	static uint32_t lastEncoderB = 0;
-	static float targetDistance = 0.0f;
-	static uint32_t hasTargetDistance = 0;
-	static float headingIntegral = 0.0f;
-	static float prevHeadingError = 0.0f;
-
-	if(isStateChanged) {
-//		pidA = defaultPid;
-//		pidB = defaultPid;
-//		pidA.target_speed = cmd.param1Speed;
-//		pidB.target_speed = cmd.param1Speed;
-		headingIntegral = 0.0f;
-		prevHeadingError = 0.0f;
-		isFrontCalib = 0;
-		isTurning = 0;
-
-		totalDistanceA = 0.0f;
-		totalDistanceB = 0.0f;
-		if(cmd.param2DistAngle > 0){
-			hasTargetDistance = 1;
-			targetDistance = cmd.param2DistAngle; // param2 represents distance in cm
-		}else{
-			hasTargetDistance = 0;
-			targetDistance = 0.0f;
-		}
-		lastEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-		lastEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	}
-
-	int32_t speedA = cmd.param1Speed;
-	int32_t speedB = cmd.param1Speed;
-
-	int32_t currentEncoderA = __HAL_TIM_GET_COUNTER(&htim2);
-	int32_t diffA;
-	int32_t rawDiffA = currentEncoderA - lastEncoderA;
-	if (rawDiffA > 32767) {
-	    // Underflow: encoder went from small number to large number (reverse)
-	    diffA = rawDiffA - 65536;
-	} else if (rawDiffA < -32767) {
-	    // Overflow: encoder went from large number to small number (forward)
-	    diffA = rawDiffA + 65536;
-	} else {
-	    diffA = rawDiffA;
-	}
-//	sprintf(buf2, "RawDiff: %d    ", rawDiff);
-//	sprintf(buf3, "CEncA: %d    ", currentEncoderA);
-//	sprintf(buf4, "LEncA: %d    ", lastEncoderA);
-	lastEncoderA = currentEncoderA;
-
-	int32_t currentEncoderB = __HAL_TIM_GET_COUNTER(&htim3);
-	int32_t diffB = 0;
-	int32_t rawDiffB = currentEncoderB - lastEncoderB;
-	if (rawDiffB > 32767) {
-		// Underflow: encoder went from small number to large number (reverse)
-		diffB = rawDiffB - 65536;
-	} else if (rawDiffB < -32767) {
-		// Overflow: encoder went from large number to small number (forward)
-		diffB = rawDiffB + 65536;
-	} else {
-		diffB = rawDiffB;
-	}
-	lastEncoderB = currentEncoderB;
-
-	float distanceA = (float)diffA / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceA -= distanceA;
-	float distanceB = (float)diffB / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
-	totalDistanceB += distanceB; // MotorB Encoder is reverse
-
-	if (hasTargetDistance && totalDistanceA >= targetDistance - 0.8f) {
-	    motorStop();
-	    // Display completion message
-	    sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	    sprintf(buf3, "EaD: %.1f", totalDistanceA);
-//	    sprintf(buf4, "EbD: %.1f", totalDistanceB);
-	    setServoAngle(SERVO_CENTER);
-	    return 1;
-	}
-
-	if (hasTargetDistance && targetDistance-totalDistanceA < 50) { // Slow down in last 30cm
-			if(targetDistance-totalDistanceA<5) {
-				if(speedA>800){
-					speedA = 800;
-					speedB = 800;
-				}
-			}else if(targetDistance-totalDistanceA<10) {
-				if(speedA>1200){
-					speedA = 1200;
-					speedB = 1200;
-				}
-			}
-			else if(targetDistance-totalDistanceA<20) {
-				if(speedA>3000){
-					speedA = 4000;
-					speedB = 4000;
-				}
-			}else {
-				if(speedA>5000){
-					speedA = 5000;
-					speedB = 5000;
-				}
-			}
-			sprintf(buf1, "Slowing down..."	);
-	//		sprintf(buf2, "pwmA: %d", speedA);
-	//		sprintf(buf3, "pwmB: %d", speedB);
-	//		motorForwardA(speedA);
-	//		motorForwardB(speedB);
-	//		return 0;
-		}else{
-			sprintf(buf1, "GoGoGo..."	);
-		}
-
-	// MotorA & MotorB speed difference fix
-	float headingError = totalDistanceA - totalDistanceB;
-	const float Kp_heading = 1.0f;
-	const float Ki_heading = 1.0f;
-	const float Kd_heading = 1.0f;
-
-	headingIntegral += headingError;
-	if(headingIntegral > 100) headingIntegral = 100;
-	if(headingIntegral < -100) headingIntegral = -100;
-
-	float headingDerivative = headingError - prevHeadingError;
-	prevHeadingError = headingError;
-	float headingCorrection = Kp_heading * headingError + Ki_heading * headingIntegral + Kd_heading * headingDerivative;
-
-	speedA -= headingCorrection;
-	speedB += headingCorrection;
-
-	if (speedA > 7199) speedA = 7199;
-	if (speedA < 0) speedA = 0;
-	if (speedB > 7199) speedB = 7199;
-	if (speedB < 0) speedB = 0;
-
-//	sprintf(buf1, "fwd targetV: %d", pidA.target_speed);
-//	sprintf(buf2, "pwmA: %d", speedA);
-//	sprintf(buf3, "pwmB: %d", speedB);
-//	sprintf(buf2, "TargetD: %.1fcm", targetDistance);
-//	sprintf(buf3, "ActualA: %.1fcm", totalDistanceA);
-//	sprintf(buf4, "ActualB: %.1fcm", totalDistanceB);
-//	sprintf(buf3, "EncA: %d", currentEncoderA);
-//	sprintf(buf4, "EncB: %d", currentEncoderB);
-
-//	motorForwardA(cmd.param1Speed);
-//	motorForwardB(cmd.param1Speed);
-
-//  PID output
-	motorReverseA(speedA);
-	motorReverseB(speedB);
-
-	sprintf(buf2, "TargetD: %.1f", targetDistance);
-//	sprintf(buf3, "ActualA: %.1f", totalDistanceA);
-//	sprintf(buf4, "HeadC: %.1f", headingCorrection);
-
-	return 0;
-}
-
-// A fun function for the buzzer
-void playNote(uint16_t frequency, uint16_t duration) {
-    if (frequency == 0) {
-        HAL_TIM_PWM_Stop(&htim1, TIM_CHANNEL_1);
-    } else {
-        // Timer Freq. 1MHz
-        uint32_t timerFreq = 1000000;
-        uint32_t arr = (timerFreq / frequency) - 1;
-
-        // Adjust ARR & CCR
-        __HAL_TIM_SET_AUTORELOAD(&htim1, arr);
-        __HAL_TIM_SET_COMPARE(&htim1, TIM_CHANNEL_1, arr / 10);  // 50% empty
-        __HAL_TIM_SET_COUNTER(&htim1, 0);  // 重置计数器
-        HAL_TIM_GenerateEvent(&htim1, TIM_EVENTSOURCE_UPDATE);
-        HAL_TIM_PWM_Start(&htim1, TIM_CHANNEL_1);
-    }
-    osDelay(duration);
-    HAL_TIM_PWM_Stop(&htim1, TIM_CHANNEL_1);
-}
+// Switches the background music; buzzerTask starts the matching song
+void buzzerRequest(enum songList song) {
+	music = song;
+	xTaskNotify((TaskHandle_t)buzzerTaskHandle, BUZZER_EVT_SONG, eSetBits);
+}
 
 
 
@@ -1874,399 +1956,115 @@ void playNote(uint16_t frequency, uint16_t duration) {
 //	return 0;
 //}
 
-void setServoAngle(int pwm) {
-    __HAL_TIM_SET_COMPARE(&htim12, TIM_CHANNEL_1, pwm);
+static inline void setServoAngle(int pwm) {
+	Servo_Set(pwm);
 }
 
-uint8_t motorTurn(MotorCommand_t cmd, uint8_t isStateChanged) {
-	static float startTurnHeading = 0.0f; // Stores the absolute heading at the start of the turn
-	static float targetTurnAngle = 0.0f; // The magnitude of the turn (e.g., 90 degrees)
-
-	if(isStateChanged) {
-		// Set servo direction based on command
-		if(cmd.command == TURNL) setServoAngle(SERVO_LEFT_MAX);
-		if(cmd.command == TURNR) setServoAngle(SERVO_RIGHT_MAX);
-
-		startTurnHeading = currentAngle; // Capture the absolute heading from the IMU
-		targetTurnAngle = cmd.param2DistAngle; // The desired magnitude of the turn
-
-		isTurning = 1; // Flag to indicate a turn is in progress
-		isFrontCalib = 0;
-		lastAngleUpdateTime = HAL_GetTick(); // Reset time for potential future delta time calculations
-		osDelay(100); // Small delay to allow servo to reach position
-	}
-
-	// Calculate the angle turned relative to the start of this command
-	float angleTurned = currentAngle - startTurnHeading;
-
+// IMU heading change since the turn started, against motion.target degrees
+static MotionVerdict motionCheckTurn(const MotionSpec *spec, float *remaining){
 	// Normalize angleTurned to be within -180 to 180 degrees to handle wrap-around
-	// e.g., if startTurnHeading=350 and currentAngle=10, angleTurned should be 20 degrees, not -340.
+	// e.g., if startHeading=350 and currentAngle=10, angleTurned should be 20 degrees, not -340.
+	float angleTurned = currentAngle - motion.startHeading;
 	if (angleTurned > 180.0f) angleTurned -= 360.0f;
 	else if (angleTurned < -180.0f) angleTurned += 360.0f;
+	motion.angleTurned = angleTurned;
 
-	// Determine if the target angle has been reached
-	uint8_t turnCompleted = 0;
-	if (cmd.command == TURNR) { // Turning Right (positive angle)
-		if (angleTurned >= targetTurnAngle) {
-			turnCompleted = 1;
-		}
-	} else if (cmd.command == TURNL) { // Turning Left (negative angle, or positive if targetTurnAngle is also positive)
-		// If targetTurnAngle is always given as a positive magnitude (e.g., 90 for left or right)
-		// then we compare against negative angle for left turn
-		if (angleTurned <= -targetTurnAngle) {
-			turnCompleted = 1;
-		}
-	}
-
-	if(turnCompleted) {
-		motorStop();
-		isTurning = 0;
-		setServoAngle(SERVO_CENTER); // Return servo to center
-		sprintf((char*)buf1,"Tgt: %.1f deg", targetTurnAngle);
-		sprintf((char*)buf2,"Actual:%.1f deg", angleTurned);
-		sprintf((char*)buf3,"StartH:%.1f", startTurnHeading);
-		sprintf((char*)buf4,"CurrentH:%.1f", currentAngle);
-		return 1; // Turn completed
-	}
-
-	// Speed adjustment (deceleration logic) as robot approaches target angle
-	int turnSpeed = cmd.param1Speed;
-	float angleRemaining = targetTurnAngle - fabs(angleTurned);
-
-	if(angleRemaining < 10.0f){
-		if(turnSpeed>1000){
-			turnSpeed = 1000;
-		}
-	}else if(angleRemaining < 30.0f){
-		if(turnSpeed>2000){
-			turnSpeed = 2000;
-		}
-	}else if(angleRemaining < 45.0f){
-		if(turnSpeed>4000){
-			turnSpeed = 4000;
-		}
-	}else if(angleRemaining < 60.0f){
-		if(turnSpeed>5000){
-			turnSpeed = 5000;
-		}
-	}
-
-	// Apply motor speeds
-	if(cmd.command == TURNR) {
-		motorForwardA(turnSpeed); // Left wheel forward (confirmed by user for right turn)
-		motorStopB();             // Right wheel stopped
-	}
-	if(cmd.command == TURNL) {
-		motorForwardB(turnSpeed); // Right wheel forward
-		motorStopA();             // Left wheel stopped
-	}
-
-    sprintf((char*)buf1,"Tgt: %.1f deg\n", targetTurnAngle);
-	HAL_UART_Transmit(&huart3,buf1,strlen(buf1),0xFFFF);
-	sprintf((char*)buf2,"Actual:%.1f deg\n", angleTurned);
-	HAL_UART_Transmit(&huart3,buf2,strlen(buf2),0xFFFF);
-	sprintf((char*)buf3,"StartH:%.1f\n", startTurnHeading);
-	HAL_UART_Transmit(&huart3,buf3,strlen(buf3),0xFFFF);
-	sprintf((char*)buf4,"CurrentH:%.1f\n", currentAngle);
-	HAL_UART_Transmit(&huart3,buf4,strlen(buf4),0xFFFF);
-
-	return 0; // Turn in progress
+	// Right turns count up, left turns down; the target is a positive magnitude
+	if (spec->drive == MOTION_PIVOT_A ? angleTurned >= motion.target : angleTurned <= -motion.target) return MOTION_DONE;
+	*remaining = motion.target - fabs(angleTurned);
+	return MOTION_RUN;
 }
 
-uint8_t motorTurnF(MotorCommandF_t cmd, uint8_t isStateChanged) {
-    static float startTurnHeading = 0.0f; // Stores the absolute heading at the start of the turn
-    static float targetTurnAngle = 0.0f; // The magnitude of the turn (e.g., 90 degrees)
-
-    if(isStateChanged) {
-        // Set servo direction based on command
-    	if(cmd.command == TURNL) setServoAngle(SERVO_LEFT_MAX);
-    	if(cmd.command == TURNR) setServoAngle(SERVO_RIGHT_MAX);
-
-        startTurnHeading = currentAngle; // Capture the absolute heading from the IMU
-        targetTurnAngle = cmd.param2DistAngle; // The desired magnitude of the turn
-
-        isTurning = 1; // Flag to indicate a turn is in progress
-        isFrontCalib = 0;
-        lastAngleUpdateTime = HAL_GetTick(); // Reset time for potential future delta time calculations
-        osDelay(100); // Small delay to allow servo to reach position
-    }
-
-    // Calculate the angle turned relative to the start of this command
-    float angleTurned = currentAngle - startTurnHeading;
-    // Normalize angleTurned to be within -180 to 180 degrees to handle wrap-around
-    // e.g., if startTurnHeading=350 and currentAngle=10, angleTurned should be 20 degrees, not -340.
-    if (angleTurned > 180.0f) angleTurned -= 360.0f;
-    else if (angleTurned < -180.0f) angleTurned += 360.0f;
-
-    // Determine if the target angle has been reached
-    uint8_t turnCompleted = 0;
-    if (cmd.command == TURNR) { // Turning Right (positive angle)
-        if (angleTurned >= targetTurnAngle) {
-            turnCompleted = 1;
-        }
-    } else if (cmd.command == TURNL) { // Turning Left (negative angle, or positive if targetTurnAngle is also positive)
-        // If targetTurnAngle is always given as a positive magnitude (e.g., 90 for left or right)
-        // then we compare against negative angle for left turn
-        if (angleTurned <= -targetTurnAngle) {
-            turnCompleted = 1;
-        }
-    }
-
-    if(turnCompleted) {
-        motorStop();
-        isTurning = 0;
-        setServoAngle(SERVO_CENTER); // Return servo to center
-        sprintf((char*)buf1,"Tgt: %.1f deg", targetTurnAngle);
-        sprintf((char*)buf2,"Actual:%.1f deg", angleTurned);
-        sprintf((char*)buf3,"StartH:%.1f", startTurnHeading);
-        sprintf((char*)buf4,"CurrentH:%.1f", currentAngle);
-        return 1; // Turn completed
-    }
-
-    // Speed adjustment (deceleration logic) as robot approaches target angle
-    int turnSpeed = cmd.param1Speed;
-    float angleRemaining = targetTurnAngle - fabs(angleTurned);
-
-    if(angleRemaining < 10.0f){
-    	if(turnSpeed>1000){
-    		turnSpeed = 1000;
-    	}
-    }else if(angleRemaining < 30.0f){
-    	if(turnSpeed>2000){
-    		turnSpeed = 2000;
-    	}
-    }else if(angleRemaining < 45.0f){
-    	if(turnSpeed>4000){
-    		turnSpeed = 4000;
-    	}
-    }else if(angleRemaining < 60.0f){
-    	if(turnSpeed>5000){
-    		turnSpeed = 5000;
-    	}
-    }
-
-    // Apply motor speeds
-    if(cmd.command == TURNR) {
-    	motorForwardA(turnSpeed); // Left wheel forward (confirmed by user for right turn)
-    	motorStopB();             // Right wheel stopped
-    }
-    if(cmd.command == TURNL) {
-    	motorForwardB(turnSpeed); // Right wheel forward
-    	motorStopA();             // Left wheel stopped
-    }
-
-    sprintf((char*)buf1,"Tgt: %.1f deg", targetTurnAngle);
-    HAL_UART_Transmit(&huart3,buf1,strlen(buf1),0xFFFF);
-    sprintf((char*)buf2,"Actual:%.1f deg", angleTurned);
-    HAL_UART_Transmit(&huart3,buf2,strlen(buf2),0xFFFF);
-    sprintf((char*)buf3,"StartH:%.1f", startTurnHeading);
-    HAL_UART_Transmit(&huart3,buf2,strlen(buf2),0xFFFF);
-    sprintf((char*)buf4,"CurrentH:%.1f", currentAngle);
-    HAL_UART_Transmit(&huart3,buf2,strlen(buf2),0xFFFF);
-
-    return 0; // Turn in progress
+// currentAngle (zeroed at the start) against motion.target degrees
+static MotionVerdict motionCheckPwmTurn(const MotionSpec *spec, float *remaining){
+	*remaining = fabs(motion.target) - fabs(currentAngle);
+	return *remaining < 0.0f ? MOTION_DONE : MOTION_RUN;
 }
 
-uint8_t motorTurnF1(MotorCommandF_t cmd, uint8_t isStateChanged) {
-	static float startTurnHeading = 0.0f; // Stores the absolute heading at the start of the turn
-	static float targetTurnAngle = 0.0f; // The magnitude of the turn (e.g., 90 degrees)
+static const MotionSpec turnRightSpec = {MOTION_PIVOT_A, PROFILE(approachDeg), NULL, 0, 0.0f, 0.0f, 0.0f, 0.0f, motionCheckTurn, STOP_NONE, 1};
+static const MotionSpec turnLeftSpec = {MOTION_PIVOT_B, PROFILE(approachDeg), NULL, 0, 0.0f, 0.0f, 0.0f, 0.0f, motionCheckTurn, STOP_NONE, 1};
+static const MotionSpec pwmTurnRightSpec = {MOTION_PIVOT_A, PROFILE(approachDeg), NULL, 0, 0.0f, 0.0f, 0.0f, 0.0f, motionCheckPwmTurn};
+static const MotionSpec pwmTurnLeftSpec = {MOTION_PIVOT_B, PROFILE(approachDeg), NULL, 0, 0.0f, 0.0f, 0.0f, 0.0f, motionCheckPwmTurn};
 
+// Steers full lock and pivots on the outer wheel (left wheel for TURNR) until
+// the IMU heading has changed by `angle`.
+static uint8_t motorTurnRun(enum cmdList command, int32_t speed, float angle, uint8_t isStateChanged){
 	if(isStateChanged) {
-		// Set servo direction based on command
-		if(cmd.command == TURNL) setServoAngle(SERVO_LEFT_MAX);
-		if(cmd.command == TURNR) setServoAngle(SERVO_RIGHT_MAX);
-
-		startTurnHeading = currentAngle; // Capture the absolute heading from the IMU
-		targetTurnAngle = cmd.param2DistAngle; // The desired magnitude of the turn
-
+		setServoAngle(command == TURNL ? SERVO_LEFT_MAX : SERVO_RIGHT_MAX);
+		motion.startHeading = currentAngle; // Capture the absolute heading from the IMU
 		isTurning = 1; // Flag to indicate a turn is in progress
 		isFrontCalib = 0;
 		lastAngleUpdateTime = HAL_GetTick(); // Reset time for potential future delta time calculations
 		osDelay(100); // Small delay to allow servo to reach position
 	}
+	return motionRun(command == TURNL ? &turnLeftSpec : &turnRightSpec, speed, angle, isStateChanged);
+}
 
-	// Calculate the angle turned relative to the start of this command
-	float angleTurned = currentAngle - startTurnHeading;
-
-	// Normalize angleTurned to be within -180 to 180 degrees to handle wrap-around
-	// e.g., if startTurnHeading=350 and currentAngle=10, angleTurned should be 20 degrees, not -340.
-	if (angleTurned > 180.0f) angleTurned -= 360.0f;
-	else if (angleTurned < -180.0f) angleTurned += 360.0f;
+static void motorTurnShow(const char *end){
+	char deg[8];
+	snprintf(deg, sizeof(deg), " deg%s", end);
+	showValue(buf1, "Tgt: ", motion.target, 1, 0, deg);
+	showValue(buf2, "Actual:", motion.angleTurned, 1, 0, deg);
+	showValue(buf3, "StartH:", motion.startHeading, 1, 0, end);
+	showValue(buf4, "CurrentH:", currentAngle, 1, 0, end);
+}
 
-	// Determine if the target angle has been reached
-	uint8_t turnCompleted = 0;
-	if (cmd.command == TURNR) { // Turning Right (positive angle)
-		if (angleTurned >= targetTurnAngle) {
-			turnCompleted = 1;
-		}
-	} else if (cmd.command == TURNL) { // Turning Left (negative angle, or positive if targetTurnAngle is also positive)
-		// If targetTurnAngle is always given as a positive magnitude (e.g., 90 for left or right)
-		// then we compare against negative angle for left turn
-		if (angleTurned <= -targetTurnAngle) {
-			turnCompleted = 1;
-		}
-	}
+static void motorTurnEcho(void){
+	uartTxSend((char *)buf1);
+	uartTxSend((char *)buf2);
+	uartTxSend((char *)buf3);
+	uartTxSend((char *)buf4);
+}
 
-	if(turnCompleted) {
-		motorStop();
-		isTurning = 0;
-		setServoAngle(SERVO_CENTER); // Return servo to center
-		sprintf((char*)buf1,"Tgt: %.1f deg", targetTurnAngle);
-		sprintf((char*)buf2,"Actual:%.1f deg", angleTurned);
-		sprintf((char*)buf3,"StartH:%.1f", startTurnHeading);
-		sprintf((char*)buf4,"CurrentH:%.1f", currentAngle);
+uint8_t motorTurn(MotorCommand_t cmd, uint8_t isStateChanged) {
+	if(motorTurnRun(cmd.command, cmd.param1Speed, (float)cmd.param2DistAngle, isStateChanged)){
+		motorTurnShow("");
 		return 1; // Turn completed
 	}
+	motorTurnShow("\n");
+	motorTurnEcho();
+	return 0; // Turn in progress
+}
 
-	// Speed adjustment (deceleration logic) as robot approaches target angle
-	int turnSpeed = cmd.param1Speed;
-	float angleRemaining = targetTurnAngle - fabs(angleTurned);
+uint8_t motorTurnF(MotorCommandF_t cmd, uint8_t isStateChanged) {
+	uint8_t done = motorTurnRun(cmd.command, cmd.param1Speed, cmd.param2DistAngle, isStateChanged);
+	motorTurnShow("");
+	if(!done) motorTurnEcho();
+	return done;
+}
 
-	if(angleRemaining < 10.0f){
-		if(turnSpeed>1000){
-			turnSpeed = 1000;
-		}
-	}else if(angleRemaining < 30.0f){
-		if(turnSpeed>2000){
-			turnSpeed = 2000;
-		}
-	}else if(angleRemaining < 45.0f){
-		if(turnSpeed>4000){
-			turnSpeed = 4000;
-		}
-	}else if(angleRemaining < 60.0f){
-		if(turnSpeed>5000){
-			turnSpeed = 5000;
-		}
-	}
+uint8_t motorTurnF1(MotorCommandF_t cmd, uint8_t isStateChanged) {
+	uint8_t done = motorTurnRun(cmd.command, cmd.param1Speed, cmd.param2DistAngle, isStateChanged);
+	motorTurnShow("");
+	return done;
+}
 
-	// Apply motor speeds
-	if(cmd.command == TURNR) {
-		motorForwardA(turnSpeed); // Left wheel forward (confirmed by user for right turn)
-		motorStopB();             // Right wheel stopped
-	}
-	if(cmd.command == TURNL) {
-		motorForwardB(turnSpeed); // Right wheel forward
-		motorStopA();             // Left wheel stopped
+// Servo held at param1, full PWM on one wheel until the gyro has integrated param2 degrees
+static uint8_t motorTurnPwm(const MotionSpec *spec, MotorCommand_t cmd, uint8_t isStateChanged) {
+	if(isStateChanged) {
+		// Reset
+		setServoAngle(cmd.param1Speed);
+		currentAngle = 0.0f;
+		targetAngle = cmd.param2DistAngle; // Target angle
+		isTurning = 1;
+		isFrontCalib = 0;
+		lastAngleUpdateTime = HAL_GetTick();
+		osDelay(200);
 	}
-
-	sprintf((char*)buf1,"Tgt: %.1f deg", targetTurnAngle);
-	sprintf((char*)buf2,"Actual:%.1f deg", angleTurned);
-	sprintf((char*)buf3,"StartH:%.1f", startTurnHeading);
-	sprintf((char*)buf4,"CurrentH:%.1f", currentAngle);
-
-	return 0; // Turn in progress
+	uint8_t done = motionRun(spec, 7199, targetAngle, isStateChanged);
+	showValue(buf1, "Target:  ", targetAngle, 3, 0, "");
+	showValue(buf2, "Current: ", currentAngle, 3, 0, "");
+	return done;
 }
 
 uint8_t motorTurnPwmL(MotorCommand_t cmd, uint8_t isStateChanged) {
-    if(isStateChanged) {
-        // Reset
-    	setServoAngle(cmd.param1Speed);
-        currentAngle = 0.0f;
-        targetAngle = cmd.param2DistAngle; // Target angle
-        isTurning = 1;
-        isFrontCalib = 0;
-        lastAngleUpdateTime = HAL_GetTick();
-        osDelay(200);
-    }
-
-//    OLED_ShowString(10, 20, rxBuffer);
-//    OLED_ShowString(10, 30, rxBuffer);
-
-    int turnSpeed = 7199;
-    float remaining = fabs(targetAngle) - fabs(currentAngle);
-
-    if(remaining < 0.0f) {
-        motorStop();
-        isTurning = 0;
-        setServoAngle(SERVO_CENTER);
-        sprintf(buf1,"Target:  %.3f", targetAngle);
-        sprintf(buf2,"Current: %.3f", currentAngle);
-//        sprintf(buf3,"Remain: %.3f", remaining);
-        return 1;
-    }else if(remaining < 10.0f){
-    	if(turnSpeed>1000){
-    		turnSpeed = 1000;
-    	}
-    }else if(remaining < 30.0f){
-    	if(turnSpeed>2000){
-    		turnSpeed = 2000;
-    	}
-    }else if(remaining < 45.0f){
-    	if(turnSpeed>4000){
-    		turnSpeed = 4000;
-    	}
-    }else if(remaining < 60.0f){
-    	if(turnSpeed>5000){
-    		turnSpeed = 5000;
-    	}
-    }
-
-    sprintf(buf1,"Target:  %.3f", targetAngle);
-    sprintf(buf2,"Current: %.3f", currentAngle);
-//    sprintf(buf3,"Remain: %.3f", remaining);
-
-    motorForwardB(turnSpeed);
-    motorStopA();
-
-    return 0;
+	return motorTurnPwm(&pwmTurnLeftSpec, cmd, isStateChanged);
 }
 
 uint8_t motorTurnPwmR(MotorCommand_t cmd, uint8_t isStateChanged) {
-    if(isStateChanged) {
-        // Reset
-    	setServoAngle(cmd.param1Speed);
-        currentAngle = 0.0f;
-        targetAngle = cmd.param2DistAngle; // Target angle
-        isTurning = 1;
-        isFrontCalib = 0;
-        lastAngleUpdateTime = HAL_GetTick();
-        osDelay(200);
-    }
-
-//    OLED_ShowString(10, 20, rxBuffer);
-//    OLED_ShowString(10, 30, rxBuffer);
-
-    int turnSpeed = 7199;
-    float remaining = fabs(targetAngle) - fabs(currentAngle);
-
-    if(remaining < 0.0f) {
-        motorStop();
-        isTurning = 0;
-        setServoAngle(SERVO_CENTER);
-        sprintf(buf1,"Target:  %.3f", targetAngle);
-        sprintf(buf2,"Current: %.3f", currentAngle);
-//        sprintf(buf3,"Remain: %.3f", remaining);
-        return 1;
-    }else if(remaining < 10.0f){
-    	if(turnSpeed>1000){
-    		turnSpeed = 1000;
-    	}
-    }else if(remaining < 30.0f){
-    	if(turnSpeed>2000){
-    		turnSpeed = 2000;
-    	}
-    }else if(remaining < 45.0f){
-    	if(turnSpeed>4000){
-    		turnSpeed = 4000;
-    	}
-    }else if(remaining < 60.0f){
-    	if(turnSpeed>5000){
-    		turnSpeed = 5000;
-    	}
-    }
-
-    sprintf(buf1,"Target:  %.3f", targetAngle);
-    sprintf(buf2,"Current: %.3f", currentAngle);
-//    sprintf(buf3,"Remain: %.3f", remaining);
-
-    motorForwardA(turnSpeed);
-    motorStopB();
-
-    return 0;
+	return motorTurnPwm(&pwmTurnRightSpec, cmd, isStateChanged);
 }
 
-
 uint8_t motorTurn90R(MotorCommand_t cmd, uint8_t isStateChanged) {
     static enum {BACKWARD_PRE, TURNING, BACKWARD_POST, COMPLETED} turnState = BACKWARD_PRE;
     static MotorCommandF_t subCmd;
@@ -2400,6 +2198,125 @@ uint8_t motorTurn90L(MotorCommand_t cmd, uint8_t isStateChanged) {
     return 0;
 }
 
+// One leg of a fixed Task 2 trajectory. Legs run back to back; each primitive
+// stops on its own target and the next one starts on the following tick.
+typedef struct {
+	enum cmdList command; // FWD, TURNL or TURNR
+	int32_t speed;
+	float param;          // cm or degrees
+	uint8_t addRange;     // Add the ultrasonic range to x as the leg starts
+} Task2Leg;
+
+// Round obstacle 1 on the side the RPi picked and come back onto the centre line
+#define TASK2_OBS1_LEGS 5
+static const Task2Leg obs1LeftLegs[TASK2_OBS1_LEGS] = {
+	{TURNL, 3550, 45.0f, 0}, {TURNR, 3550, 45.0f, 0}, {FWD, 5000, 15.0f, 1}, {TURNR, 3550, 45.0f, 0}, {TURNL, 3550, 40.0f, 0},
+};
+static const Task2Leg obs1RightLegs[TASK2_OBS1_LEGS] = {
+	{TURNR, 3550, 49.0f, 0}, {TURNL, 3550, 45.0f, 0}, {FWD, 5000, 15.0f, 1}, {TURNL, 3550, 45.0f, 0}, {TURNR, 3550, 45.0f, 0},
+};
+
+// Runs legs[*leg] one control step at a time; returns 1 after the last leg
+static uint8_t task2RunLegs(const Task2Leg *legs, uint8_t count, uint8_t *leg, uint8_t *legChanged){
+	static MotorCommandF_t legCmd;
+	if(*leg >= count) return 1;
+	const Task2Leg *l = &legs[*leg];
+	if(*legChanged) {
+		legCmd.cmdId = 0;
+		legCmd.command = l->command;
+		legCmd.param1Speed = l->speed;
+		legCmd.param2DistAngle = l->param;
+		if(l->addRange) x += getFilteredUltrasonicDist();
+	}
+	uint8_t done = l->command == FWD ? motorPidForwardF(legCmd, *legChanged) : motorTurnF1(legCmd, *legChanged);
+	*legChanged = done;
+	if(!done) return 0;
+	if(++(*leg) < count) return 0;
+	*leg = 0;
+	return 1;
+}
+
+// Task 2's way home, in the odometry frame: the car park pose taken at the
+// start, facing out, and the return path's offset from the centre line while
+// it passes obstacle 1
+static struct {
+	float x, y, heading;  // cm, rad
+	float obs1Cm;         // Obstacle 1's distance out from the car park
+	float side;           // cm, + = left of the inbound centre line
+} task2Home;
+
+// Offset (cm) of the path from the inbound centre line with `along` cm still
+// to go: task2Home.side until clear of obstacle 1, then a cosine blend onto the
+// line, reached HOME_FINAL_CM out (and held past the car park pose)
+static float task2HomeOffset(float along){
+	float blendFrom = task2Home.obs1Cm - HOME_CLEAR_CM;
+	if(along >= blendFrom) return task2Home.side;
+	if(along <= HOME_FINAL_CM || blendFrom <= HOME_FINAL_CM) return 0.0f;
+	float t = (along - HOME_FINAL_CM) / (blendFrom - HOME_FINAL_CM);
+	return task2Home.side * 0.5f * (1.0f - cosf((float)M_PI * t));
+}
+
+// Pure pursuit along task2HomeOffset() into the car park, stopping on the
+// front range to its back wall (HOME_STOP_MM) over the final run, or at the car
+// park pose without an echo there. Steers the servo itself; remaining is the
+// cm still to go.
+static MotionVerdict motionCheckHome(const MotionSpec *spec, float *remaining){
+	OdometryPose p;
+	odometryGet(&p);
+	float in = task2Home.heading + (float)M_PI; // Inbound direction
+	float ux = cosf(in), uy = sinf(in);
+	float along = -((p.x - task2Home.x) * ux + (p.y - task2Home.y) * uy); // Still to go to the car park pose
+
+	*remaining = along;
+	if(along <= HOME_FINAL_CM){
+		float range = frontRangeMm();
+		if(range < (along + HOME_OVERSHOOT_CM) * 10.0f + HOME_STOP_MM){ // The wall, not the far side of the arena
+			*remaining = (range - HOME_STOP_MM) / 10.0f;
+			if(*remaining <= 0.0f || along <= -HOME_OVERSHOOT_CM) return MOTION_DONE;
+		}else if(along <= 0.0f){
+			return MOTION_DONE;
+		}
+	}
+
+	// Aim at the path point HOME_LOOKAHEAD_CM further on; past the car park pose,
+	// that is on the centre line beyond it
+	float s = along - HOME_LOOKAHEAD_CM;
+	float off = task2HomeOffset(s);
+	float cx = task2Home.x - ux * s - uy * off, cy = task2Home.y - uy * s + ux * off;
+	float vx = cx - p.x, vy = cy - p.y;
+	float alpha = atan2f(vy, vx) - p.theta;
+	alpha = atan2f(sinf(alpha), cosf(alpha));
+	float d = sqrtf(vx * vx + vy * vy);
+	float curvature = 2.0f * sinf(alpha) / (d > 1.0f ? d : 1.0f); // The arc through the aim point
+	float lock = curvature * HOME_RADIUS_CM; // -1..1 of full lock
+	if(lock > 1.0f) lock = 1.0f;
+	if(lock < -1.0f) lock = -1.0f;
+	motion.curvature = lock / HOME_RADIUS_CM;
+	setServoAngle(lock > 0.0f ? SERVO_CENTER - (int)(lock * (SERVO_CENTER - SERVO_LEFT_MAX))
+	                          : SERVO_CENTER + (int)(-lock * (SERVO_RIGHT_MAX - SERVO_CENTER)));
+	return MOTION_RUN;
+}
+
+static const MotionSpec task2HomeSpec = {MOTION_FORWARD, PROFILE(approachCm), NULL, 0, 0.0f, 0.0f, 0.0f, 0.0f, motionCheckHome, STOP_NONE};
+
+// Drives home from wherever obstacle 2 was left. The side of the centre line
+// the robot is on picks which side of obstacle 1 it passes.
+static uint8_t task2DriveHome(int32_t speed, uint8_t isStateChanged){
+	if(isStateChanged){
+		OdometryPose p;
+		odometryGet(&p);
+		float in = task2Home.heading + (float)M_PI;
+		float across = cosf(in) * (p.y - task2Home.y) - sinf(in) * (p.x - task2Home.x);
+		task2Home.side = across < 0.0f ? -HOME_SIDE_CM : HOME_SIDE_CM;
+		isFrontCalib = 0;
+		isTurning = 1;
+	}
+	uint8_t done = motionRun(&task2HomeSpec, speed, MOTION_NO_TARGET, isStateChanged);
+	showValue(buf1, "Home: ", motion.travelledA, 1, 0, "cm");
+	if(done) isTurning = 0;
+	return done;
+}
+
 uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 
 	static MotorCommandF_t subCmd;
@@ -2418,6 +2335,11 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	static float turn_angle_deg;
 
 	    if(isStateChanged) {
+	    	OdometryPose start;
+	    	odometryGet(&start);
+	    	task2Home.x = start.x;
+	    	task2Home.y = start.y;
+	    	task2Home.heading = start.theta;
 	    	task2State = OBS1FORWARD;
 //	    	task2State = OBS2FOLLOW; // for testing only
 	        subStateChanged = 1;
@@ -2428,195 +2350,29 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	    	sprintf(buf, "OBS1FORWARD\0");
 	    	if(subStateChanged) {
 				x += getFilteredUltrasonicDist();
+				task2Home.obs1Cm = getFilteredUltrasonicDist() / 10.0f;
 	    		subCmd.command = FWD;
 	    		subCmd.param1Speed = 5000;
 	    		subCmd.param2DistAngle = 350; // Stop 30cm from the obstacle 1
 	    	}
+	    	// Only finishes once capture1 is in, so the weave can start straight away
 	    	if(motorPidForwardTask2Until(subCmd, subStateChanged)) {
-	    		task2State = OBS1CAPTURE;
+	    		task2State = OBS1TURN;
 	    		subStateChanged = 1;
-	    		osDelay(100);
 	    	}else{
 	    		subStateChanged = 0;
 	    	}
 	    	break;
-	    case OBS1CAPTURE:
-	    	sprintf(buf, "OBS1CAPTURE\0");
-	    	if(subStateChanged){
-	    		subStateChanged = 0;
-	    		if(capture1 == 0) {
-	    			HAL_UART_Transmit(&huart3,(uint8_t *)capture1Req,strlen(capture1Req),0xFFFF);
-	    		}
-	    		osDelay(50);
-	    	}
-	    	switch(capture1){
-	    	case 0:
-	    	default:
-	    		osDelay(100);
-	    		break;
-	    	case 1:
-	    	case 2:
-	    		task2State = OBS1TURN;
-	    		subStateChanged = 1;
-	    		break;
-	    	}
-	    	break;
 	    case OBS1TURN:
-	    {
 	    	sprintf(buf, "OBS1TURN\0");
 	    	if(subStateChanged){
 	    		obs1TurnPhase = 0;
 	    		obs1TurnStateChanged = 1;
 	    		subStateChanged = 0;
 	    	}
-	        // initialize the current step's command when we enter a new phase
-	        if (obs1TurnStateChanged)
-	        {
-	        	if (capture1 == 1){
-					switch (obs1TurnPhase)
-					{
-						case 0: // 45° LEFT
-							subCmd.command       = TURNL;
-							subCmd.param1Speed   = 3550;    // turning speed (your example uses fixed speed)
-							subCmd.param2DistAngle = 45.0f; // degrees
-							break;
-						case 1: // 45° RIGHT
-							subCmd.command       = TURNR;
-							subCmd.param1Speed   = 3550;
-							subCmd.param2DistAngle = 45.0f;
-							break;
-						case 2: // FORWARD 10 cm
-							subCmd.command       = FWD;
-							subCmd.param1Speed   = 5000;    // forward speed (same as your forward example)
-							subCmd.param2DistAngle = 15.0f; // 15 cm
-							break;
-						case 3: // 45° RIGHT
-							subCmd.command       = TURNR;
-							subCmd.param1Speed   = 3550;
-							subCmd.param2DistAngle = 45.0f;
-							break;
-						case 4: // 45° LEFT
-							subCmd.command       = TURNL;
-							subCmd.param1Speed   = 3550;
-							subCmd.param2DistAngle = 40.0f;
-							break;
-						default:
-							break;
-					}
-	        	}else if(capture1 == 2) {
-	        		switch(obs1TurnPhase){
-	        			case 0: // 45° RIGHT
-	        				subCmd.command       = TURNR;
-	        				subCmd.param1Speed   = 3550;    // turning speed (your example uses fixed speed)
-	        				subCmd.param2DistAngle = 49.0f; // degrees
-	        				break;
-	        			case 1: // 45° LEFT
-	        				subCmd.command       = TURNL;
-	        				subCmd.param1Speed   = 3550;
-	        				subCmd.param2DistAngle = 45.0f;
-	        				break;
-	        			case 2: // FORWARD 10 cm
-	        				subCmd.command       = FWD;
-	        				subCmd.param1Speed   = 5000;    // forward speed (same as your forward example)
-	        				subCmd.param2DistAngle = 15.0f; // 15 cm
-	        				break;
-	        			case 3: // 45° LEFT
-	        				subCmd.command       = TURNL;
-	        				subCmd.param1Speed   = 3550;
-	        				subCmd.param2DistAngle = 45.0f;
-	        				break;
-	        			case 4: // 45° RIGHT
-	        				subCmd.command       = TURNR;
-	        				subCmd.param1Speed   = 3550;
-	        				subCmd.param2DistAngle = 45.0f;
-	        				break;
-	        			default:
-	        				break;
-	        		}
-	        	}
-	        }
-	        // execute the current step and advance when done
-	        switch (obs1TurnPhase)
-	        {
-	            case 0: // First two 45 degree turns
-	            {
-	            	                if (motorTurnF1(subCmd, obs1TurnStateChanged))
-	            	                {
-	            	                    obs1TurnPhase++;
-	            	                    obs1TurnStateChanged = 1;
-	            	                    osDelay(100);
-	            	                }
-	            	                else
-	            	                {
-	            	                	obs1TurnStateChanged = 0;
-	            	                }
-	            	            } break;
-	            case 1:
-	            {
-	                if (motorTurnF1(subCmd, obs1TurnStateChanged))
-	                {
-	                    obs1TurnPhase++;
-	                    obs1TurnStateChanged = 1;
-	                    setServoAngle(SERVO_CENTER);
-	                    osDelay(40); // Got osDelay(10) in motorPidForwardF
-	                }
-	                else
-	                {
-	                	obs1TurnStateChanged = 0;
-	                }
-	            } break;
-	            case 2: // FWD 10 cm
-	            {
-	            	if(obs1TurnStateChanged){
-	            		x += getFilteredUltrasonicDist();
-	            	}
-	                // 'x' is whatever sensor/arg you already pass in your forward helper
-	                if (motorPidForwardF(subCmd, obs1TurnStateChanged))
-	                {
-	                    obs1TurnPhase++;
-	                    obs1TurnStateChanged = 1;
-	                    osDelay(10);
-	                }
-	                else
-	                {
-	                	obs1TurnStateChanged = 0;
-	                }
-	            } break;
-	            case 3: // L45
-	            {
-	                if (motorTurnF(subCmd, obs1TurnStateChanged))
-	                {
-	                    obs1TurnPhase++;
-	                    obs1TurnStateChanged = 1;
-	                    osDelay(10);
-	                }
-	                else
-	                {
-	                	obs1TurnStateChanged = 0;
-	                }
-	            } break;
-	            case 4: // R45 (final step)
-	            {
-	                if (motorTurnF(subCmd, obs1TurnStateChanged))
-	                {
-	                    // sequence complete -> move on
-	                    obs1TurnPhase   = 0;   // reset for next time we enter OBS1TURN
-	                    obs1TurnStateChanged = 1;
-	                    subStateChanged = 1;
-	                    task2State = OBS2FORWARD;
-	                    osDelay(100);
-	                }
-	                else
-	                {
-	                	obs1TurnStateChanged = 0;
-	                }
-	            } break;
-	            default:
-	                // safety: if something goes odd, reset phase
-	                obs1TurnPhase = 0;
-	                subStateChanged = 1;
-	                break;
-	        	}
+	    	if(task2RunLegs(capture1 == 1 ? obs1LeftLegs : obs1RightLegs, TASK2_OBS1_LEGS, &obs1TurnPhase, &obs1TurnStateChanged)) {
+	    		subStateChanged = 1;
+	    		task2State = OBS2FORWARD;
 	    	}
 	    	break;
 	    case OBS2FORWARD:
@@ -2625,37 +2381,15 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	    		subCmd.param1Speed = 5000;
 	    		subCmd.param2DistAngle = 250; // Stop 30cm from the obstacle 2
 	    	}
+	    	// Only finishes once capture2 is in
 	    	if(motorPidForwardBackwardsUntil(subCmd, subStateChanged)) { // TODO: Might need backward as well
-	    		task2State = OBS2CAPTURE;
+	    		task2State = OBS2TURN1;
 //	    		task2State = TASK2DONE; // for testing only
 	    		subStateChanged = 1;
-	    		osDelay(100);
 	    	}else{
 	    		subStateChanged = 0;
 	    	}
 	    	break;
-	    case OBS2CAPTURE:
-	    	sprintf(buf, "OBS2CAPTURE\0");
-	    	if(subStateChanged){
-	    		subStateChanged = 0;
-	    		const uint8_t result[11] = "!CAPTURE2;\0";
-	    		if(capture2 == 0) {
-	    			HAL_UART_Transmit(&huart3,(uint8_t *)capture2Req,strlen(capture2Req),0xFFFF);
-	    		}
-	    	}
-	    	switch(capture2){
-	    	case 0:
-	    	default:
-	    		osDelay(100);
-	    		break;
-	    	case 1:
-	    	case 2:
-	    		task2State = OBS2TURN1;
-	    		subStateChanged = 1;
-	    		osDelay(100);
-	    		break;
-	    	}
-	    	break;
 	    case OBS2TURN1:
 	    	sprintf(buf, "OBS2TURN1\0");
 	    	if(subStateChanged){
@@ -2722,7 +2456,7 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	    	switch (followSubState){
 	    	case 0:{ // Follow initial
 		    	if (capture2 == 1){
-					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &rightNow, &placeholder)) {
+					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &irRight, &placeholder)) {
 						// Move to next state
 						followSubState = 1;
 						followStateChanged = 1;
@@ -2732,7 +2466,7 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 					}
 		    	}
 		    	else if (capture2 == 2){
-					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &leftNow, &placeholder)) {
+					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &irLeft, &placeholder)) {
 						// Move to next state
 						followSubState = 1;
 						followStateChanged = 1;
@@ -2767,8 +2501,8 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	    	}
 	    	case 3:{ // Follow back
 		    	if (capture2 == 1){
-					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &rightNow, &y)) {
-						task2State = OBS2TURN2;
+					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &irRight, &y)) {
+						task2State = TASK2_HOMING ? OBS2HOME : OBS2TURN2;
 						followStateChanged = 1;
 						followSubState = 1;
 						subStateChanged = 1;
@@ -2778,8 +2512,8 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 					}
 		    	}
 		    	else if (capture2 == 2){
-					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &leftNow, &y)) {
-						task2State = OBS2TURN2;
+					if(motorPidForwardTask2UntilSensor(subCmd, followStateChanged, &irLeft, &y)) {
+						task2State = TASK2_HOMING ? OBS2HOME : OBS2TURN2;
 						followStateChanged = 1;
 						followSubState = 1;
 						subStateChanged = 1;
@@ -2860,8 +2594,10 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	                        subCmd.param1Speed = 3550;
 
 	                        // Debug output
-	                        sprintf(buf1, "Path:%d Turn:%.1f", capture2, turn_angle_deg);
-	                        sprintf(buf2, "Dist:%.1fcm", obs2ReturnDistance);
+	                        char path[24];
+	                        snprintf(path, sizeof(path), "Path:%d Turn:", capture2);
+	                        showValue(buf1, path, turn_angle_deg, 1, 0, "");
+	                        showValue(buf2, "Dist:", obs2ReturnDistance, 1, 0, "cm");
 	                    } else {
 	                        // Angle too small, skip to forward
 	                        obs2ReturnPhase = 1;
@@ -2990,6 +2726,15 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 	            }
 	            break;
 	        }
+	    case OBS2HOME:
+	    	sprintf((char *)buf, "OBS2HOME");
+	    	if(task2DriveHome(5000, subStateChanged)) {
+	    		task2State = TASK2DONE;
+	    		subStateChanged = 1;
+	    	} else {
+	    		subStateChanged = 0;
+	    	}
+	    	break;
 	    case TASK2DONE:
 	    	osDelay(500);
 	    	return 1;
@@ -2999,29 +2744,35 @@ uint8_t task2Loop(MotorCommand_t cmd, uint8_t isStateChanged){
 
 }
 
-float getFilteredUltrasonicDist(void) {
-	// Take multiple ultrasonic readings and filter outliers
-	float readings[10];
-	float last = 0.0f;
-	for(int i = 0; i < 10;) {
-		readings[i] = distance;
-		if (readings[i] != last){
-			last = readings[i];
-			i++;
-		}
-		osDelay(60);  // Small delay between readings
+// Adds one echo to the window and refreshes ultrasonicFiltered; ultrasonic() only
+static void ultrasonicFilterPush(float mm) {
+	ultrasonicWindow[ultrasonicHead] = mm;
+	ultrasonicHead = (ultrasonicHead + 1) % ULTRASONIC_WINDOW;
+	if(ultrasonicCount < ULTRASONIC_WINDOW) ultrasonicCount++;
+
+	// Insertion sort of a copy; the window is small and this runs once per echo
+	float sorted[ULTRASONIC_WINDOW];
+	for(int i = 0; i < ultrasonicCount; i++) {
+		float v = ultrasonicWindow[i];
+		int j = i;
+		for(; j > 0 && sorted[j-1] > v; j--) sorted[j] = sorted[j-1];
+		sorted[j] = v;
 	}
-	// Bubble sort
-	for(int i = 0; i < 9; i++) {
-		for(int j = 0; j < 9-i; j++) {
-			if(readings[j] > readings[j+1]) {
-				float temp = readings[j];
-				readings[j] = readings[j+1];
-				readings[j+1] = temp;
-			}
-		}
-	}
-	return (readings[3] + readings[4] + readings[5] + readings[6]) / 4.0f;
+	int trim = ultrasonicCount > 2 * ULTRASONIC_TRIM ? ULTRASONIC_TRIM : 0;
+	float sum = 0.0f;
+	for(int i = trim; i < ultrasonicCount - trim; i++) sum += sorted[i];
+	ultrasonicFiltered = sum / (float)(ultrasonicCount - 2 * trim);
+	ultrasonicFilteredTick = HAL_GetTick();
+}
+
+// Outlier-trimmed distance (mm) over the last 400 ms of echoes; does not block
+float getFilteredUltrasonicDist(void) {
+	return ultrasonicFiltered;
+}
+
+// ms since getFilteredUltrasonicDist() last changed
+uint32_t getFilteredUltrasonicAge(void) {
+	return HAL_GetTick() - ultrasonicFilteredTick;
 }
 
 //uint8_t motorTurn(MotorCommand_t cmd, uint8_t isStateChanged) {
@@ -3143,25 +2894,48 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+  FastMem_CheckArt(); // Prefetch and both caches, in case HAL_Init() left one off
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
   MX_GPIO_Init();
+  MX_DMA_Init();
   MX_TIM4_Init();
   MX_TIM2_Init();
   MX_TIM9_Init();
   MX_TIM12_Init();
   MX_TIM8_Init();
   MX_TIM3_Init();
-  MX_TIM14_Init();
   MX_I2C2_Init();
   MX_USART3_UART_Init();
   MX_TIM1_Init();
+  MX_TIM7_Init();
   /* USER CODE BEGIN 2 */
+  recoveryInit();
+  if(recoveryLastRun() && recoveryLastRun()->linkBaud) linkSetBaud(recoveryLastRun()->linkBaud); // The RPi is still there
+#if LINK_USB_CDC
+  MX_USB_DEVICE_Init(); // Enumerates on its own; replies move over once a HELLO comes in on it
+#endif
+#if !FAST_BOOT
   OLED_Init();
+#endif
   motorDriveEnable();
 
+  // Cycle counter for encoder edge timestamps. Its clock is gated in Sleep, so
+  // keep it running through tickless idle or edge periods would read short.
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  DBGMCU->CR |= DBGMCU_CR_DBG_SLEEP;
+  IR_Sensors_Init(); // Edges are timestamped with the cycle counter
+  irLeft.detected = IR_LeftDetected();
+  irRight.detected = IR_RightDetected();
+  // Over CubeMX's priorities, now that every peripheral has enabled its IRQs
+  IrqPrio_Apply(irqLevels, sizeof(irqLevels) / sizeof(irqLevels[0]));
+  ctrlCycPerCount = IrqPrio_CyclesPerCount(TIM7);
+  echoCycPerCount = IrqPrio_CyclesPerCount(TIM8);
+  recoveryWatchdogStart(); // Refreshed by StartDefaultTask from here on
+
   /* USER CODE END 2 */
 
   /* Init scheduler */
@@ -3181,7 +2955,8 @@ int main(void)
 
   /* USER CODE BEGIN RTOS_QUEUES */
   /* add queues, ... */
-  motorCommandQueue = xQueueCreate(2, sizeof(MotorCommand_t));
+  motorCommandQueue = xQueueCreateStatic(MOTOR_COMMAND_QUEUE_LEN, sizeof(MotorCommand_t), motorCommandQueueStorage, &motorCommandQueueControlBlock);
+  bootReady = xEventGroupCreateStatic(&bootReadyControlBlock);
   /* USER CODE END RTOS_QUEUES */
 
   /* Create the thread(s) */
@@ -3215,11 +2990,10 @@ int main(void)
   /* creation of buzzerTask */
   buzzerTaskHandle = osThreadNew(buzzer, NULL, &buzzerTask_attributes);
 
-  /* creation of irSensorTask */
-  irSensorTaskHandle = osThreadNew(irSensor, NULL, &irSensorTask_attributes);
 
   /* USER CODE BEGIN RTOS_THREADS */
   /* add threads, ... */
+  halTickBase = uwTick; // The kernel tick starts from 0
   /* USER CODE END RTOS_THREADS */
 
   /* USER CODE BEGIN RTOS_EVENTS */
@@ -3264,9 +3038,16 @@ void SystemClock_Config(void)
   RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
   RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
   RCC_OscInitStruct.PLL.PLLM = 4;
+#if LINK_USB_CDC
+  /* Same 64 MHz SYSCLK from a 384 MHz VCO, so PLLQ can give OTG FS its 48 MHz */
+  RCC_OscInitStruct.PLL.PLLN = 192;
+  RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV6;
+  RCC_OscInitStruct.PLL.PLLQ = 8;
+#else
   RCC_OscInitStruct.PLL.PLLN = 64;
   RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV2;
   RCC_OscInitStruct.PLL.PLLQ = 4;
+#endif
   if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
   {
     Error_Handler();
@@ -3347,7 +3128,7 @@ static void MX_TIM1_Init(void)
   htim1.Init.Period = 65535;
   htim1.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim1.Init.RepetitionCounter = 0;
-  htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  htim1.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_ENABLE;
   if (HAL_TIM_Base_Init(&htim1) != HAL_OK)
   {
     Error_Handler();
@@ -3557,6 +3338,44 @@ static void MX_TIM4_Init(void)
 
 }
 
+/**
+  * @brief TIM7 Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_TIM7_Init(void)
+{
+
+  /* USER CODE BEGIN TIM7_Init 0 */
+
+  /* USER CODE END TIM7_Init 0 */
+
+  TIM_MasterConfigTypeDef sMasterConfig = {0};
+
+  /* USER CODE BEGIN TIM7_Init 1 */
+
+  /* USER CODE END TIM7_Init 1 */
+  htim7.Instance = TIM7;
+  htim7.Init.Prescaler = 16-1;
+  htim7.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim7.Init.Period = 1000-1;
+  htim7.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+  if (HAL_TIM_Base_Init(&htim7) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+  sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
+  if (HAL_TIMEx_MasterConfigSynchronization(&htim7, &sMasterConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  /* USER CODE BEGIN TIM7_Init 2 */
+
+  /* USER CODE END TIM7_Init 2 */
+
+}
+
 /**
   * @brief TIM8 Initialization Function
   * @param None
@@ -3572,6 +3391,8 @@ static void MX_TIM8_Init(void)
   TIM_ClockConfigTypeDef sClockSourceConfig = {0};
   TIM_MasterConfigTypeDef sMasterConfig = {0};
   TIM_IC_InitTypeDef sConfigIC = {0};
+  TIM_OC_InitTypeDef sConfigOC = {0};
+  TIM_BreakDeadTimeConfigTypeDef sBreakDeadTimeConfig = {0};
 
   /* USER CODE BEGIN TIM8_Init 1 */
 
@@ -3579,7 +3400,7 @@ static void MX_TIM8_Init(void)
   htim8.Instance = TIM8;
   htim8.Init.Prescaler = 16-1;
   htim8.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim8.Init.Period = 65535;
+  htim8.Init.Period = 50000-1;
   htim8.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
   htim8.Init.RepetitionCounter = 0;
   htim8.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
@@ -3596,23 +3417,56 @@ static void MX_TIM8_Init(void)
   {
     Error_Handler();
   }
+  if (HAL_TIM_PWM_Init(&htim8) != HAL_OK)
+  {
+    Error_Handler();
+  }
   sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
   sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
   if (HAL_TIMEx_MasterConfigSynchronization(&htim8, &sMasterConfig) != HAL_OK)
   {
     Error_Handler();
   }
-  sConfigIC.ICPolarity = TIM_INPUTCHANNELPOLARITY_BOTHEDGE;
-  sConfigIC.ICSelection = TIM_ICSELECTION_DIRECTTI;
+  sConfigIC.ICPolarity = TIM_INPUTCHANNELPOLARITY_FALLING;
+  sConfigIC.ICSelection = TIM_ICSELECTION_INDIRECTTI;
   sConfigIC.ICPrescaler = TIM_ICPSC_DIV1;
   sConfigIC.ICFilter = 8;
+  if (HAL_TIM_IC_ConfigChannel(&htim8, &sConfigIC, TIM_CHANNEL_1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sConfigIC.ICPolarity = TIM_INPUTCHANNELPOLARITY_RISING;
+  sConfigIC.ICSelection = TIM_ICSELECTION_DIRECTTI;
   if (HAL_TIM_IC_ConfigChannel(&htim8, &sConfigIC, TIM_CHANNEL_2) != HAL_OK)
   {
     Error_Handler();
   }
+  sConfigOC.OCMode = TIM_OCMODE_PWM1;
+  sConfigOC.Pulse = 10;
+  sConfigOC.OCPolarity = TIM_OCPOLARITY_HIGH;
+  sConfigOC.OCNPolarity = TIM_OCNPOLARITY_HIGH;
+  sConfigOC.OCFastMode = TIM_OCFAST_DISABLE;
+  sConfigOC.OCIdleState = TIM_OCIDLESTATE_RESET;
+  sConfigOC.OCNIdleState = TIM_OCNIDLESTATE_RESET;
+  if (HAL_TIM_PWM_ConfigChannel(&htim8, &sConfigOC, TIM_CHANNEL_3) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  sBreakDeadTimeConfig.OffStateRunMode = TIM_OSSR_DISABLE;
+  sBreakDeadTimeConfig.OffStateIDLEMode = TIM_OSSI_DISABLE;
+  sBreakDeadTimeConfig.LockLevel = TIM_LOCKLEVEL_OFF;
+  sBreakDeadTimeConfig.DeadTime = 0;
+  sBreakDeadTimeConfig.BreakState = TIM_BREAK_DISABLE;
+  sBreakDeadTimeConfig.BreakPolarity = TIM_BREAKPOLARITY_HIGH;
+  sBreakDeadTimeConfig.AutomaticOutput = TIM_AUTOMATICOUTPUT_DISABLE;
+  if (HAL_TIMEx_ConfigBreakDeadTime(&htim8, &sBreakDeadTimeConfig) != HAL_OK)
+  {
+    Error_Handler();
+  }
   /* USER CODE BEGIN TIM8_Init 2 */
 
   /* USER CODE END TIM8_Init 2 */
+  HAL_TIM_MspPostInit(&htim8);
 
 }
 
@@ -3724,37 +3578,6 @@ static void MX_TIM12_Init(void)
 
 }
 
-/**
-  * @brief TIM14 Initialization Function
-  * @param None
-  * @retval None
-  */
-static void MX_TIM14_Init(void)
-{
-
-  /* USER CODE BEGIN TIM14_Init 0 */
-
-  /* USER CODE END TIM14_Init 0 */
-
-  /* USER CODE BEGIN TIM14_Init 1 */
-
-  /* USER CODE END TIM14_Init 1 */
-  htim14.Instance = TIM14;
-  htim14.Init.Prescaler = 16-1;
-  htim14.Init.CounterMode = TIM_COUNTERMODE_UP;
-  htim14.Init.Period = 65535;
-  htim14.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
-  htim14.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
-  if (HAL_TIM_Base_Init(&htim14) != HAL_OK)
-  {
-    Error_Handler();
-  }
-  /* USER CODE BEGIN TIM14_Init 2 */
-
-  /* USER CODE END TIM14_Init 2 */
-
-}
-
 /**
   * @brief USART3 Initialization Function
   * @param None
@@ -3771,267 +3594,1088 @@ static void MX_USART3_UART_Init(void)
 
   /* USER CODE END USART3_Init 1 */
   huart3.Instance = USART3;
-  huart3.Init.BaudRate = 115200;
+  huart3.Init.BaudRate = 1000000;
   huart3.Init.WordLength = UART_WORDLENGTH_8B;
   huart3.Init.StopBits = UART_STOPBITS_1;
   huart3.Init.Parity = UART_PARITY_NONE;
   huart3.Init.Mode = UART_MODE_TX_RX;
   huart3.Init.HwFlowCtl = UART_HWCONTROL_NONE;
-  huart3.Init.OverSampling = UART_OVERSAMPLING_16;
+  huart3.Init.OverSampling = UART_OVERSAMPLING_8;
   if (HAL_UART_Init(&huart3) != HAL_OK)
   {
     Error_Handler();
   }
   /* USER CODE BEGIN USART3_Init 2 */
 
-  /* USER CODE END USART3_Init 2 */
+  /* USER CODE END USART3_Init 2 */
+
+}
+
+/**
+  * Enable DMA controller clock
+  */
+static void MX_DMA_Init(void)
+{
+
+  /* DMA controller clock enable */
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+
+  /* DMA interrupt init */
+  /* DMA1_Stream2_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream2_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream2_IRQn);
+  /* DMA1_Stream3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 8, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+  /* DMA2_Stream5_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA2_Stream5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+
+}
+
+/**
+  * @brief GPIO Initialization Function
+  * @param None
+  * @retval None
+  */
+static void MX_GPIO_Init(void)
+{
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+  /* USER CODE BEGIN MX_GPIO_Init_1 */
+
+  /* USER CODE END MX_GPIO_Init_1 */
+
+  /* GPIO Ports Clock Enable */
+  __HAL_RCC_GPIOE_CLK_ENABLE();
+  __HAL_RCC_GPIOH_CLK_ENABLE();
+  __HAL_RCC_GPIOB_CLK_ENABLE();
+  __HAL_RCC_GPIOD_CLK_ENABLE();
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  __HAL_RCC_GPIOA_CLK_ENABLE();
+
+  /*Configure GPIO pin Output Level */
+  HAL_GPIO_WritePin(LED3_GPIO_Port, LED3_Pin, GPIO_PIN_RESET);
+
+  /*Configure GPIO pin Output Level */
+  HAL_GPIO_WritePin(GPIOD, OLED_DC_Pin|OLED_RES_Pin|OLED_SDA_Pin|OLED_SCL_Pin, GPIO_PIN_RESET);
+
+  /*Configure GPIO pin : LED3_Pin */
+  GPIO_InitStruct.Pin = LED3_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(LED3_GPIO_Port, &GPIO_InitStruct);
+
+  /*Configure GPIO pins : OLED_DC_Pin OLED_RES_Pin OLED_SDA_Pin OLED_SCL_Pin */
+  GPIO_InitStruct.Pin = OLED_DC_Pin|OLED_RES_Pin|OLED_SDA_Pin|OLED_SCL_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
+
+  /*Configure GPIO pin : USER_BTN_Pin */
+  GPIO_InitStruct.Pin = USER_BTN_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(USER_BTN_GPIO_Port, &GPIO_InitStruct);
+
+  /* EXTI interrupt init*/
+  HAL_NVIC_SetPriority(EXTI0_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(EXTI0_IRQn);
+
+  /* USER CODE BEGIN MX_GPIO_Init_2 */
+  HAL_GPIO_WritePin(LINK_PROBE_GPIO_Port, LINK_PROBE_Pin, GPIO_PIN_RESET);
+  GPIO_InitStruct.Pin = LINK_PROBE_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+  HAL_GPIO_Init(LINK_PROBE_GPIO_Port, &GPIO_InitStruct);
+
+  /* USER CODE END MX_GPIO_Init_2 */
+}
+
+/* USER CODE BEGIN 4 */
+// Wakes rxSerial for a complete frame; it sleeps until then.
+static void rxSerialWake(BaseType_t *woken){
+	if (rxSerialTaskHandle != NULL){
+		vTaskNotifyGiveFromISR((TaskHandle_t)rxSerialTaskHandle, woken);
+	}
+}
+
+// Interrupt context: PWM off now, and everything received so far goes stale. The
+// motor task flushes its queue and reports once it wakes.
+static void estopFire(BaseType_t *woken){
+	motorStop();
+	estopLatched = 1;
+	estopCount++;
+	routeState = ROUTE_IDLE;
+	bufferIndex = 0; // A half-received ASCII frame goes too
+	xTaskNotifyFromISR((TaskHandle_t)motorTaskHandle, MOTOR_EVT_ESTOP, eSetBits, woken);
+}
+
+// The frame layer, one received byte at a time from either transport's
+// interrupt; now is DWT->CYCCNT at its arrival.
+FAST_CODE static void linkRxByte(uint8_t byte, uint32_t now, LinkTransport source, BaseType_t *woken){
+	if (binIndex > 0)
+	{
+		// Inside a binary frame: collect 2 + LEN + 2 bytes, the task checks the CRC.
+		// Command frames queue in binRing. A ROUTE frame goes to binRoute; the RPi
+		// waits for each one's reply, so one still unparsed means this one is lost.
+		if (binIndex == 1){
+			binLen = byte;
+			if (byte == BIN_PAYLOAD_LEN){
+				binTarget = binFrame;
+			}else if (byte >= ROUTE_HEADER_LEN + 4 && byte <= BIN_ROUTE_MAX_PAYLOAD){
+				binTarget = binRouteReady ? NULL : binRoute;
+				if (binTarget) binTarget[0] = BIN_SYNC;
+			}else{
+				binIndex = 0;  // Not a frame after all
+			}
+		}
+		if (binIndex > 0){
+			if (binTarget) binTarget[binIndex] = byte;
+			binIndex++;
+			if (binIndex == 2 + binLen + 2){
+				uint8_t next = (binHead + 1) % BIN_RING_SIZE;
+				if (binTarget == binFrame && next != binTail){
+					for (uint8_t i = 0; i < BIN_FRAME_LEN; i++){
+						binRing[binHead][i] = binFrame[i];
+					}
+					binRingEpoch[binHead] = estopCount;
+					binRingStamp[binHead].start = linkBinStart;
+					binRingStamp[binHead].end = now;
+					linkProbe();
+					binHead = next;
+					rxSerialWake(woken);
+				}else if (binTarget == binRoute){
+					binRouteEpoch = estopCount;
+					binRouteReady = 1;
+					rxSerialWake(woken);
+				}else{
+					binDropped++;
+				}
+				binIndex = 0;
+			}
+		}
+	}
+	else if (byte == ESTOP_BYTE)
+	{
+		// Only between binary frames: inside one, any byte value is data
+		estopFire(woken);
+	}
+	else if (byte == BIN_SYNC)
+	{
+		// ASCII is 7-bit, so 0xA5 can only start a binary frame
+		binFrame[0] = byte;
+		binIndex = 1;
+		linkBinStart = now;
+		linkProbe();
+	}
+	else if (byte == ':')
+	{
+		bufferIndex = 0;  // Reset buffer for new command
+		linkRxStart = now;
+		linkProbe();
+	}
+	// Check for end of command ';'
+	else if (byte == ';'){
+		rxFrames[rxFill][bufferIndex] = '\0';  // Null terminate
+		bufferIndex = 0;
+		if (rxReady < 0){
+			rxFrameEpoch[rxFill] = estopCount;
+			rxFrameStamp[rxFill].start = linkRxStart;
+			rxFrameStamp[rxFill].end = now;
+			rxFrameSource[rxFill] = source;
+			linkProbe();
+			rxReady = rxFill;
+			rxFill ^= 1;
+			rxSerialWake(woken);
+		}else{
+			rxDropped++;
+		}
+	}
+	// Store data if we're in a command sequence
+	else if (bufferIndex < RX_FRAME_SIZE - 1){
+		rxFrames[rxFill][bufferIndex] = byte;
+		bufferIndex++;
+	}
+	else{
+		// Buffer overflow - reset
+		bufferIndex = 0;
+	}
+}
+
+FAST_CODE void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart){
+	/* prevent unused argument(s) compilation warning */
+
+	UNUSED(huart);
+	BaseType_t woken = pdFALSE;
+	uint32_t now = DWT->CYCCNT;
+	PROF_BEGIN(PR_UART_RX);
+	HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
+	linkRxByte(rxTemp, now, LINK_UART, &woken);
+	HAL_UART_Receive_IT(&huart3,&rxTemp,1);
+	PROF_END(PR_UART_RX);
+	Wcet_Isr(&wcetIsrs[WCET_ISR_UART_RX], now);
+	portYIELD_FROM_ISR(woken);
+}
+
+#if LINK_USB_CDC
+// usbd_cdc_if.c's CDC_Receive_FS, in the OTG FS interrupt: one OUT packet. The
+// whole packet shares its arrival stamp, so a PING's wire time is the USB
+// frame's rather than byte-serial time.
+FAST_CODE void linkUsbReceive(const uint8_t *data, uint32_t len){
+	BaseType_t woken = pdFALSE;
+	uint32_t now = DWT->CYCCNT;
+	PROF_BEGIN(PR_UART_RX);
+	for (uint32_t i = 0; i < len; i++){
+		linkRxByte(data[i], now, LINK_USB, &woken);
+	}
+	PROF_END(PR_UART_RX);
+	Wcet_Isr(&wcetIsrs[WCET_ISR_UART_RX], now);
+	portYIELD_FROM_ISR(woken);
+}
+#endif
+
+//HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+//{
+//	if(isMuted){
+//		isMuted = 0;
+//	}else{
+//		isMuted = 1;
+//	}
+//}
+
+FAST_CODE void HAL_TIM_IC_CaptureCallback(TIM_HandleTypeDef *htim){
+	uint32_t start = DWT->CYCCNT;
+	if(htim==&htim8){
+		// CC1 is the echo falling edge; CCR2 still holds the rising edge of the same ping
+		uint16_t fall = HAL_TIM_ReadCapturedValue(htim, TIM_CHANNEL_1);
+		uint16_t rise = HAL_TIM_ReadCapturedValue(htim, TIM_CHANNEL_2);
+#if PROF_ENABLE
+		Prof_Add(&profRegions[PR_LAT_ECHO], IrqPrio_TimerLatency(TIM8, fall, echoCycPerCount));
+#endif
+		echo = fall >= rise ? fall - rise : fall + __HAL_TIM_GET_AUTORELOAD(htim) + 1 - rise;
+		if(stopTrigger.source == STOP_ECHO_BELOW && echo <= stopTrigger.echoUs) stopFire();
+		BaseType_t woken = pdFALSE;
+		vTaskNotifyGiveFromISR((TaskHandle_t)ultrasonicTaskHandle, &woken);
+		Wcet_Isr(&wcetIsrs[WCET_ISR_ECHO], start);
+		portYIELD_FROM_ISR(woken);
+	}
+	else if(htim == &htim2){
+		encoderEdge(&encoderA);
+		Wcet_Isr(&wcetIsrs[WCET_ISR_ENC_A], start);
+	}
+	else if(htim == &htim3){
+		encoderEdge(&encoderB);
+		Wcet_Isr(&wcetIsrs[WCET_ISR_ENC_B], start);
+	}
+}
+
+// TIM2 CC3/CC4 have no input or output; their compare is the STOP_COUNTS trigger
+void HAL_TIM_OC_DelayElapsedCallback(TIM_HandleTypeDef *htim){
+	if(htim == &htim2){
+		__HAL_TIM_DISABLE_IT(htim, TIM_IT_CC3 | TIM_IT_CC4);
+		if(stopTrigger.source == STOP_COUNTS) stopFire();
+	}
+}
+
+// I2C2 transactions are all imuBus's (imuTransfer)
+void HAL_I2C_MemRxCpltCallback(I2C_HandleTypeDef *hi2c){
+	I2cBus_Complete(&imuBus, HAL_OK);
+}
+
+void HAL_I2C_MemTxCpltCallback(I2C_HandleTypeDef *hi2c){
+	I2cBus_Complete(&imuBus, HAL_OK);
+}
+
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c){
+	I2cBus_Complete(&imuBus, HAL_ERROR);
+}
+
+// ASCII commands arrive as ":id/COMPONENT/COMMAND/P1/P2;" and the ISR hands
+// "id/COMPONENT/COMMAND/P1/P2" over in an rxFrames buffer. rxSerialParse
+// slices it on '/' in place into (pointer, length) fields, resolves COMPONENT
+// and COMMAND with the perfect hashes in protocol_keywords.h and runs the
+// serialCommands row that
+// matches. P1 and P2 are optional (defaults 20 and 0), must be plain decimal
+// and are checked against the row's limits before the handler runs. The cost
+// is bounded by the 255-byte buffer and the table size; a new command is one
+// more row (plus its keyword in gen_protocol_keywords.py).
+#define SERIAL_MAX_FIELDS 5
+#define SERIAL_DEFAULT_SPEED 20
+
+typedef struct {
+	const char *s;
+	uint8_t len;
+} SerialField;
+
+typedef struct {
+	uint32_t max;        // Largest value accepted
+	const char *error;   // Reply status when the value is out of range
+} SerialParam;
+
+typedef struct {
+	uint8_t component;   // KW_COMPONENT_*; 0 matches any component but MOTOR
+	int8_t command;      // KW_MOTOR_* in MOTOR rows, KW_GENERAL_* otherwise
+	void (*handler)(MotorCommand_t *cmd, int command);
+	const SerialParam *p1;   // NULL: any 32-bit value
+	const SerialParam *p2;
+} SerialCommand;
+
+static const SerialParam serialSpeed = {7199 / 71, "ERROR/INVALID_SPEED_PARAM_SHOULD_BE_INTEGER_0_TO_101"};
+static const SerialParam serialAngle = {360, "ERROR/INVALID_ANGLE_PARAM_SHOULD_BE_INTEGER_0_TO_360"};
+static const SerialParam serialPercent = {99, "ERROR/INVALID_PERCENT_PARAM_SHOULD_BE_INTEGER_0_TO_99"};
+static const SerialParam serialFlag = {1, "ERROR/INVALID_FLAG_PARAM_SHOULD_BE_0_OR_1"};
+
+static void serialMotor(MotorCommand_t *cmd, int command){
+	cmd->command = (enum cmdList)command; // KW_MOTOR_* values follow enum cmdList
+	motorCommandSubmit(cmd);
+}
+
+static void serialCapture(MotorCommand_t *cmd, int command){
+	buzzerRequest(CAPTURE);
+}
+
+static void serialDone(MotorCommand_t *cmd, int command){
+	buzzerRequest(DONE);
+	isContinue = 0;
+}
+
+// Link-up probe: tell the RPi it may send binary frames, ROUTE uploads included
+static void serialBinary(MotorCommand_t *cmd, int command){
+	serialReply(cmd->cmdId, "OK/BINARY_V1/ROUTE");
+}
+
+// Fastest rate the USART3 divider can make from PCLK1
+static uint32_t linkMaxBaud(void){
+	return HAL_RCC_GetPCLK1Freq() / (huart3.Init.OverSampling == UART_OVERSAMPLING_8 ? 8u : 16u);
+}
+
+// Whether the divider gets within 2 % of baud
+static uint8_t linkBaudValid(uint32_t baud){
+	uint32_t over = huart3.Init.OverSampling == UART_OVERSAMPLING_8 ? 8u : 16u;
+	uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+	if(baud == 0 || baud > pclk / over) return 0;
+	uint32_t div = (pclk + baud / 2) / baud; // In 1/over steps of USARTDIV
+	uint32_t actual = pclk / div;
+	return (actual > baud ? actual - baud : baud - actual) * 50u <= baud;
+}
+
+// HELLO/<link version>/<RPi max baud>: answers
+// "OK/HELLO/<firmware>/<link>/<formats>/<features>/<max baud>" on the transport
+// it came in on, and confirms a rate BAUD just switched to. Over USB the
+// features end in USB, and there is no rate to raise.
+static void serialHello(MotorCommand_t *cmd, int command){
+	linkSelect(rxSerialSource);
+	if(linkBaudFallback){
+		linkBaudFallback = 0;
+		recoveryNoteLinkBaud(huart3.Init.BaudRate);
+	}
+	char s[112];
+	snprintf(s, sizeof(s), "OK/HELLO/%u/%u/" LINK_FORMATS "/" LINK_FEATURES "%s/%lu", FIRMWARE_VERSION, LINK_VERSION,
+			linkTransport == LINK_USB ? "+USB" : "", (unsigned long)linkMaxBaud());
+	serialReply(cmd->cmdId, s);
+}
+
+// BAUD/<rate>: replies at the current rate, then switches. Over USB the host's
+// rate is only a setting, so USART3 is left alone.
+static void serialBaud(MotorCommand_t *cmd, int command){
+	uint32_t baud = cmd->param1Speed;
+	if(!linkBaudValid(baud)){
+		serialReply(cmd->cmdId, "ERROR/INVALID_BAUD");
+		return;
+	}
+	char s[24];
+	snprintf(s, sizeof(s), "OK/BAUD/%lu", (unsigned long)baud);
+	serialReply(cmd->cmdId, s);
+	if(baud == huart3.Init.BaudRate || linkTransport == LINK_USB) return;
+	if(!linkBaudFallback) linkBaudFallback = huart3.Init.BaudRate;
+	linkBaudSince = HAL_GetTick();
+	linkSetBaud(baud);
+}
+
+// Reprograms USART3 once the TX ring, DMA and shift register are empty, so the
+// last reply still goes out at the old rate. Bytes half received at the switch
+// are dropped with the frame they belonged to.
+void linkSetBaud(uint32_t baud){
+	for(uint8_t tries = 0; tries < 50; tries++){
+		taskENTER_CRITICAL();
+		if(!txInFlight && txHead == txTail && (huart3.Instance->SR & USART_SR_TC)){
+			huart3.Init.BaudRate = baud;
+			__HAL_UART_DISABLE(&huart3);
+			huart3.Instance->BRR = huart3.Init.OverSampling == UART_OVERSAMPLING_8
+					? UART_BRR_SAMPLING8(HAL_RCC_GetPCLK1Freq(), baud)
+					: UART_BRR_SAMPLING16(HAL_RCC_GetPCLK1Freq(), baud);
+			__HAL_UART_ENABLE(&huart3);
+			bufferIndex = 0;
+			binIndex = 0;
+			taskEXIT_CRITICAL();
+			return;
+		}
+		taskEXIT_CRITICAL();
+		HAL_Delay(1); // Also before the scheduler runs
+	}
+}
+
+// rxSerial: back to the old rate if the RPi never confirmed the new one
+static void linkCheckBaud(void){
+	if(linkBaudFallback && HAL_GetTick() - linkBaudSince >= LINK_BAUD_CONFIRM_MS){
+		linkSetBaud(linkBaudFallback);
+		linkBaudFallback = 0;
+	}
+}
+
+static uint32_t linkNs(uint32_t cycles){
+	return (uint32_t)((uint64_t)cycles * 1000u / (SystemCoreClock / 1000000u));
+}
+
+// Microseconds since DWT started at stamp, a DWT->CYCCNT reading less than
+// one wrap old. Tasks only.
+static uint64_t linkClockUs(uint32_t stamp){
+	taskENTER_CRITICAL();
+	uint32_t now = DWT->CYCCNT;
+	linkClockCycles += now - linkClockLast;
+	linkClockLast = now;
+	uint64_t at = linkClockCycles - (now - stamp);
+	taskEXIT_CRITICAL();
+	return at / (SystemCoreClock / 1000000u);
+}
+
+// rxSerial: notes the stamps of the frame it is about to parse
+static void linkTakeUp(const volatile LinkStamp *stamp){
+	linkFrame.start = stamp->start;
+	linkFrame.end = stamp->end;
+	linkDispatch = DWT->CYCCNT;
+	linkProbe();
+}
+
+// PING: a no-op answering "OK/PING/<rx>/<wake>/<dispatch>/<tx>" in ns: its
+// first byte to its last (the wire), the last byte to rxSerial (ISR, task
+// wakeup), rxSerial to this reply (parse, dispatch), and from queueing to the
+// last bit sent for the previous PING reply (0 for the first). Also binary
+// opcode BIN_OP_PING.
+static void serialPing(MotorCommand_t *cmd, int command){
+	char s[56];
+	uint32_t now = DWT->CYCCNT;
+	snprintf(s, sizeof(s), "OK/PING/%lu/%lu/%lu/%lu", (unsigned long)linkNs(linkFrame.end - linkFrame.start),
+			(unsigned long)linkNs(linkDispatch - linkFrame.end), (unsigned long)linkNs(now - linkDispatch),
+			(unsigned long)linkNs(linkTxCycles));
+	taskENTER_CRITICAL(); // The reply must not go out before it is marked
+	serialReply(cmd->cmdId, s);
+	linkTxMark = txHead;
+	linkTxQueued = DWT->CYCCNT;
+	linkTxPending = 1;
+	linkTxCycles = 0;
+	taskEXIT_CRITICAL();
+	linkProbe();
+}
+
+// SYNC: "OK/SYNC/<rx>/<tx>/<tick>" for the RPi's clock_sync.c, which fits
+// the exchange NTP-style to its own clock. rx is when this frame's last byte
+// arrived and tx when the reply is formatted, in us since boot (low 32 bits,
+// so they wrap every 71 minutes); tick is HAL_GetTick() at tx and ties the ms
+// timestamps to the same clock.
+static void serialSync(MotorCommand_t *cmd, int command){
+	char s[48];
+	uint32_t rx = (uint32_t)linkClockUs(linkFrame.end);
+	uint32_t tx = (uint32_t)linkClockUs(DWT->CYCCNT);
+	uint32_t tick = HAL_GetTick();
+	snprintf(s, sizeof(s), "OK/SYNC/%lu/%lu/%lu", (unsigned long)rx, (unsigned long)tx, (unsigned long)tick);
+	serialReply(cmd->cmdId, s);
+}
+
+// WHERE: "OK/WHERE/<state>/<id>/<pose>" for an RPi controller that restarted
+// mid-mission and resumes from its checkpoint. state is BUSY while a command
+// runs or waits in the queue or a route is under way, SNAP while the route is
+// parked at its snapshot step id, and IDLE otherwise; id is then the command
+// running or, with nothing running, the last one finished, as for RESET.
+static void serialWhere(MotorCommand_t *cmd, int command){
+	OdometryPose p;
+	float remaining;
+	uint32_t id = recoveryCommand(&remaining);
+	const char *state = "IDLE";
+	if(routeState == ROUTE_SNAP_WAIT){
+		state = "SNAP";
+		id = (uint16_t)(routeBaseId + routeNext);
+	}else if(!motorIdle || routeState == ROUTE_RUNNING || uxQueueMessagesWaiting(motorCommandQueue) > 0){
+		state = "BUSY";
+	}
+	char status[32], s[96];
+	snprintf(status, sizeof(status), "OK/WHERE/%s/%lu", state, (unsigned long)id);
+	odometryGet(&p);
+	serialFormatPose(s, sizeof(s), status, &p);
+	serialReply(cmd->cmdId, s);
+}
+
+// PROGRESS/<every>/<brake>: turns the progress events on or off (see
+// progressPoll()) and answers "OK/PROGRESS/<every>/<brake>"
+static void serialProgress(MotorCommand_t *cmd, int command){
+	progressEvery = (uint8_t)cmd->param1Speed;
+	progressBrake = cmd->param2DistAngle != 0;
+	char s[32];
+	snprintf(s, sizeof(s), "OK/PROGRESS/%u/%u", progressEvery, progressBrake);
+	serialReply(cmd->cmdId, s);
+}
+
+// CREDIT/<on>/0: turns the queue credit reports on or off (see creditReport())
+// and answers "OK/CREDIT/<on>/<depth>"
+static void serialCredit(MotorCommand_t *cmd, int command){
+	creditOn = cmd->param1Speed != 0;
+	char s[24];
+	snprintf(s, sizeof(s), "OK/CREDIT/%u/%u", creditOn, MOTOR_COMMAND_QUEUE_LEN);
+	serialReply(cmd->cmdId, s);
+}
 
+// SCHED: "SCHED/T/<name>/<priority>/<period us>/<n>/<mean>/<max>/<gap>" per
+// task and "SCHED/I/<name>/<n>/<mean>/<max>/<gap>" per ISR, in cycles since the
+// previous SCHED, then "OK/SCHED/<SystemCoreClock>". Far more than one reply's
+// worth, so it waits whenever the TX ring is half full rather than drop any.
+static void serialSched(MotorCommand_t *cmd, int command){
+	static osThreadId_t *const handles[WCET_TASKS] = {
+		[WCET_DEFAULT] = &defaultTaskHandle, [WCET_SHOW] = &showTaskHandle, [WCET_MOTOR] = &motorTaskHandle,
+		[WCET_ENCODER] = &encoderTaskHandle, [WCET_SERVO] = &servoTaskHandle,
+		[WCET_ULTRASONIC] = &ultrasonicTaskHandle, [WCET_IMU] = &readIMUTaskHandle,
+		[WCET_RX_SERIAL] = &rxSerialTaskHandle, [WCET_FRONT_CALIB] = &frontWheelCalibHandle,
+		[WCET_BUZZER] = &buzzerTaskHandle,
+	};
+	static const uint32_t periodUs[WCET_TASKS] = {
+		[WCET_DEFAULT] = RECOVERY_KICK_MS * 1000u, [WCET_SHOW] = 100000u,
+		[WCET_MOTOR] = 1000000u / MOTOR_CTRL_HZ, [WCET_ENCODER] = ENCODER_SAMPLE_MS * 1000u,
+		[WCET_IMU] = IMU_READ_MS * 1000u,
+	};
+	char s[80];
+	for(int i = 0; i < WCET_TASKS + WCET_ISRS; i++){
+		while((uint16_t)((txHead - txTail + TX_RING_SIZE) % TX_RING_SIZE) > TX_RING_SIZE / 2) osDelay(1);
+		if(i < WCET_TASKS){
+			WcetTask *t = &wcetTasks[i];
+			taskENTER_CRITICAL();
+			WcetTask w = *t;
+			t->n = t->cycMax = t->gapMin = 0;
+			t->cycSum = 0;
+			taskEXIT_CRITICAL();
+			snprintf(s, sizeof(s), "SCHED/T/%s/%d/%lu/%lu/%lu/%lu/%lu", osThreadGetName(*handles[i]),
+					(int)osThreadGetPriority(*handles[i]), (unsigned long)periodUs[i], (unsigned long)w.n,
+					(unsigned long)(w.n ? w.cycSum / w.n : 0), (unsigned long)w.cycMax, (unsigned long)w.gapMin);
+		}else{
+			WcetIsr *t = &wcetIsrs[i - WCET_TASKS];
+			taskENTER_CRITICAL();
+			WcetIsr w = *t;
+			memset(t, 0, sizeof(*t));
+			taskEXIT_CRITICAL();
+			snprintf(s, sizeof(s), "SCHED/I/%s/%lu/%lu/%lu/%lu", wcetIsrNames[i - WCET_TASKS], (unsigned long)w.n,
+					(unsigned long)(w.n ? w.cycSum / w.n : 0), (unsigned long)w.cycMax, (unsigned long)w.gapMin);
+		}
+		serialReply(cmd->cmdId, s);
+	}
+	snprintf(s, sizeof(s), "OK/SCHED/%lu", (unsigned long)SystemCoreClock);
+	serialReply(cmd->cmdId, s);
 }
 
-/**
-  * @brief GPIO Initialization Function
-  * @param None
-  * @retval None
-  */
-static void MX_GPIO_Init(void)
-{
-  GPIO_InitTypeDef GPIO_InitStruct = {0};
-  /* USER CODE BEGIN MX_GPIO_Init_1 */
+// PROF: "PROF/<name>/<n>/<min>/<mean>/<max>" per region (prof.h), in cycles
+// since the previous PROF, then "OK/PROF/<SystemCoreClock>"; no regions when
+// built with PROF_ENABLE 0. Paced like SCHED.
+static void serialProf(MotorCommand_t *cmd, int command){
+	char s[64];
+#if PROF_ENABLE
+	static const char *const names[PR_REGIONS] = {"UART_RX", "PARSE", "GYRO", "IR", "MOTOR", "OLED", "LAT_CTRL",
+		"LAT_ECHO"};
+	for(int i = 0; i < PR_REGIONS; i++){
+		while((uint16_t)((txHead - txTail + TX_RING_SIZE) % TX_RING_SIZE) > TX_RING_SIZE / 2) osDelay(1);
+		ProfRegion r;
+		Prof_Take(&profRegions[i], &r);
+		snprintf(s, sizeof(s), "PROF/%s/%lu/%lu/%lu/%lu", names[i], (unsigned long)r.n, (unsigned long)r.cycMin,
+				(unsigned long)(r.n ? r.cycSum / r.n : 0), (unsigned long)r.cycMax);
+		serialReply(cmd->cmdId, s);
+	}
+#endif
+	snprintf(s, sizeof(s), "OK/PROF/%lu", (unsigned long)SystemCoreClock);
+	serialReply(cmd->cmdId, s);
+}
 
-  /* USER CODE END MX_GPIO_Init_1 */
+static void serialCaptureResult(MotorCommand_t *cmd, int command){
+	if(command == KW_GENERAL_CAPTURE1) capture1 = cmd->param1Speed;
+	else capture2 = cmd->param1Speed;
+	xTaskNotify((TaskHandle_t)motorTaskHandle, MOTOR_EVT_CAPTURE, eSetBits); // Act on it this tick
+}
 
-  /* GPIO Ports Clock Enable */
-  __HAL_RCC_GPIOE_CLK_ENABLE();
-  __HAL_RCC_GPIOH_CLK_ENABLE();
-  __HAL_RCC_GPIOB_CLK_ENABLE();
-  __HAL_RCC_GPIOD_CLK_ENABLE();
-  __HAL_RCC_GPIOC_CLK_ENABLE();
-  __HAL_RCC_GPIOA_CLK_ENABLE();
+static const SerialCommand serialCommands[] = {
+	{KW_COMPONENT_MOTOR, KW_MOTOR_FWD, serialMotor, &serialSpeed, NULL},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_REV, serialMotor, &serialSpeed, NULL},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_STOP, serialMotor, &serialSpeed, NULL},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_TURNL, serialMotor, &serialSpeed, &serialAngle},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_TURNR, serialMotor, &serialSpeed, &serialAngle},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_TURN90L, serialMotor, &serialSpeed, NULL},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_TURN90R, serialMotor, &serialSpeed, NULL},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_TASK2, serialMotor, &serialSpeed, NULL},
+	{KW_COMPONENT_MOTOR, KW_MOTOR_PWMTURNL, serialMotor, NULL, &serialAngle}, // P1 is a raw PWM value
+	{KW_COMPONENT_MOTOR, KW_MOTOR_PWMTURNR, serialMotor, NULL, &serialAngle},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_CAPTURE, serialCapture, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_DONE, serialDone, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_BINARY, serialBinary, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_HELLO, serialHello, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_BAUD, serialBaud, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_PING, serialPing, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_SCHED, serialSched, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_PROF, serialProf, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_SYNC, serialSync, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_PROGRESS, serialProgress, &serialPercent, &serialFlag},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_WHERE, serialWhere, NULL, NULL},
+	{KW_COMPONENT_GENERAL, KW_GENERAL_CREDIT, serialCredit, &serialFlag, NULL},
+	{0, KW_GENERAL_CAPTURE1, serialCaptureResult, NULL, NULL},
+	{0, KW_GENERAL_CAPTURE2, serialCaptureResult, NULL, NULL},
+};
 
-  /*Configure GPIO pin Output Level */
-  HAL_GPIO_WritePin(LED3_GPIO_Port, LED3_Pin, GPIO_PIN_RESET);
+// Fixed-base decimal parse of a whole field. Returns 0, or -1 if the field is
+// empty, holds anything but digits or does not fit in 32 bits.
+static int serialParseU32(const SerialField *f, uint32_t *out){
+	if(f->len == 0 || f->len > 10) return -1;
+	uint32_t v = 0;
+	for(uint8_t i = 0; i < f->len; i++){
+		uint32_t d = (uint8_t)f->s[i] - '0';
+		if(d > 9 || v > (0xFFFFFFFFu - d) / 10) return -1;
+		v = v * 10 + d;
+	}
+	*out = v;
+	return 0;
+}
 
-  /*Configure GPIO pin Output Level */
-  HAL_GPIO_WritePin(GPIOD, OLED_DC_Pin|OLED_RES_Pin|OLED_SDA_Pin|OLED_SCL_Pin, GPIO_PIN_RESET);
+// Reads optional field i into *out, keeping the default if it is absent.
+// Returns 0, or -1 if it is malformed or above param's limit.
+static int serialParam(const SerialField *fields, uint8_t n, uint8_t i, const SerialParam *param, uint32_t *out){
+	if(i >= n) return 0;
+	uint32_t v;
+	if(serialParseU32(&fields[i], &v) != 0) return -1;
+	if(param && v > param->max) return -1;
+	*out = v;
+	return 0;
+}
 
-  /*Configure GPIO pin Output Level */
-  HAL_GPIO_WritePin(ULTRASONIC_SENSOR_GPIO_Port, ULTRASONIC_SENSOR_Pin, GPIO_PIN_RESET);
+// Writes "<status>/<x>/<y>/<theta>/<sdX>/<sdY>/<sdTheta>" for pose p. Returns
+// the length, as snprintf().
+static int serialFormatPose(char *s, size_t size, const char *status, const OdometryPose *p){
+	float theta = remainderf(p->theta, 2.0f * M_PI) * (1800.0f / M_PI);
+	return snprintf(s, size, "%s/%ld/%ld/%d/%u/%u/%u", status, lroundf(p->x * 10.0f), lroundf(p->y * 10.0f),
+			(int)lroundf(theta), (unsigned)lroundf(sqrtf(p->P[0][0]) * 10.0f),
+			(unsigned)lroundf(sqrtf(p->P[1][1]) * 10.0f), (unsigned)lroundf(sqrtf(p->P[2][2]) * (1800.0f / M_PI)));
+}
 
-  /*Configure GPIO pin : LED3_Pin */
-  GPIO_InitStruct.Pin = LED3_Pin;
-  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
-  GPIO_InitStruct.Pull = GPIO_NOPULL;
-  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
-  HAL_GPIO_Init(LED3_GPIO_Port, &GPIO_InitStruct);
+// Sends "!<cmdId>/<status>/<x>/<y>/<theta>/<sdX>/<sdY>/<sdTheta>;" with the
+// odometry pose: mm, mm and 0.1 degree (-1800..1800], then the standard
+// deviations in the same units. Task context; the RPi reads <status> alone
+// from older firmware.
+void serialReplyPose(uint32_t cmdId, const char *status){
+	OdometryPose p;
+	odometryGet(&p);
+	char s[64];
+	serialFormatPose(s, sizeof(s), status, &p);
+	serialReply(cmdId, s);
+}
 
-  /*Configure GPIO pins : OLED_DC_Pin OLED_RES_Pin OLED_SDA_Pin OLED_SCL_Pin */
-  GPIO_InitStruct.Pin = OLED_DC_Pin|OLED_RES_Pin|OLED_SDA_Pin|OLED_SCL_Pin;
-  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
-  GPIO_InitStruct.Pull = GPIO_NOPULL;
-  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
-  HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
+// The pose, then "/@<tick>": settleRestTick, so the RPi can take camera
+// frames exposed since then (clock_sync_tick_to_local() maps it)
+void serialReplyRest(uint32_t cmdId, const char *status){
+	OdometryPose p;
+	odometryGet(&p);
+	char s[80];
+	int n = serialFormatPose(s, sizeof(s), status, &p);
+	snprintf(s + n, sizeof(s) - (size_t)n, "/@%lu", (unsigned long)settleRestTick);
+	serialReply(cmdId, s);
+}
 
-  /*Configure GPIO pin : ULTRASONIC_SENSOR_Pin */
-  GPIO_InitStruct.Pin = ULTRASONIC_SENSOR_Pin;
-  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
-  GPIO_InitStruct.Pull = GPIO_NOPULL;
-  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
-  HAL_GPIO_Init(ULTRASONIC_SENSOR_GPIO_Port, &GPIO_InitStruct);
+// DONE with the pose, then "/<achievedMm>/<turnedDdeg>": what the command
+// itself did since cmdStartPose. achievedMm is the travel along the heading it
+// started on (negative backwards), turnedDdeg the heading change in 0.1 degree
+// (counter-clockwise positive, not wrapped). The RPi corrects later commands by
+// the difference from what it asked for.
+void serialReplyDone(uint32_t cmdId){
+	OdometryPose p;
+	odometryGet(&p);
+	float along = (p.x - cmdStartPose.x) * cosf(cmdStartPose.theta) + (p.y - cmdStartPose.y) * sinf(cmdStartPose.theta);
+	char s[72];
+	int n = serialFormatPose(s, sizeof(s), "DONE", &p);
+	snprintf(s + n, sizeof(s) - (size_t)n, "/%ld/%ld", lroundf(along * 10.0f),
+			lroundf((p.theta - cmdStartPose.theta) * (1800.0f / M_PI)));
+	serialReply(cmdId, s);
+}
 
-  /*Configure GPIO pin : USER_BTN_Pin */
-  GPIO_InitStruct.Pin = USER_BTN_Pin;
-  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
-  GPIO_InitStruct.Pull = GPIO_NOPULL;
-  HAL_GPIO_Init(USER_BTN_GPIO_Port, &GPIO_InitStruct);
+// Sends "!<cmdId>/<status>;" without printf.
+void serialReply(uint32_t cmdId, const char *status){
+	char out[128]; // HELLO is the longest, ~100
+	char digits[10];
+	uint8_t n = 0, len = 0;
+	out[len++] = '!';
+	do{
+		digits[n++] = (char)('0' + cmdId % 10);
+		cmdId /= 10;
+	}while(cmdId);
+	while(n) out[len++] = digits[--n];
+	out[len++] = '/';
+	while(*status && len < sizeof(out) - 1) out[len++] = *status++;
+	out[len++] = ';';
+	uartTxWrite((const uint8_t *)out, len);
+}
 
-  /* EXTI interrupt init*/
-  HAL_NVIC_SetPriority(EXTI0_IRQn, 5, 0);
-  HAL_NVIC_EnableIRQ(EXTI0_IRQn);
+void rxSerialParse(const char *line){
+	SerialField fields[SERIAL_MAX_FIELDS];
+	uint8_t n = 0;
+	const char *start = line;
+	for(const char *p = line; n < SERIAL_MAX_FIELDS; p++){
+		if(*p == '/' || *p == '\0'){
+			fields[n].s = start;
+			fields[n].len = (uint8_t)(p - start);
+			n++;
+			if(*p == '\0') break;
+			start = p + 1;
+		}
+	}
 
-  /* USER CODE BEGIN MX_GPIO_Init_2 */
+	MotorCommand_t cmd;
+	cmd.param1Speed = SERIAL_DEFAULT_SPEED;
+	cmd.param2DistAngle = 0;
+	if(serialParseU32(&fields[0], &cmd.cmdId) != 0){
+		serialReply(0, "ERROR/INVALID_COMMAND_ID");
+		return;
+	}
+	int componentId = n > 1 ? kw_stm_component(fields[1].s, fields[1].len) : 0;
+	int commandId = -1;
+	if(n > 2){
+		commandId = componentId == KW_COMPONENT_MOTOR ? kw_motor_command(fields[2].s, fields[2].len)
+		                                              : kw_general_command(fields[2].s, fields[2].len);
+	}
+	for(uint8_t i = 0; i < sizeof(serialCommands) / sizeof(serialCommands[0]); i++){
+		const SerialCommand *row = &serialCommands[i];
+		if(row->command != commandId) continue;
+		if(row->component != componentId && (row->component != 0 || componentId == KW_COMPONENT_MOTOR)) continue;
+		if(serialParam(fields, n, 3, row->p1, &cmd.param1Speed) != 0){
+			serialReply(cmd.cmdId, row->p1 ? row->p1->error : "ERROR/INVALID_PARAM");
+			return;
+		}
+		if(serialParam(fields, n, 4, row->p2, &cmd.param2DistAngle) != 0){
+			serialReply(cmd.cmdId, row->p2 ? row->p2->error : "ERROR/INVALID_PARAM");
+			return;
+		}
+		row->handler(&cmd, commandId);
+		return;
+	}
+	serialReply(cmd.cmdId, componentId == KW_COMPONENT_MOTOR ? "ERROR/MOTOR_CONTROL_COMMAND_NOT_IMPLEMENTED_YET"
+	                                                       : "ERROR/INVALID_COMMAND");
+}
 
-  /* USER CODE END MX_GPIO_Init_2 */
+// Validates a motor command from either protocol, queues it and sends the OK/ERROR reply.
+void motorCommandSubmit(MotorCommand_t *cmd){
+	if(cmd->command != PWMTURNL && cmd->command != PWMTURNR){
+		cmd->param1Speed *= 71;
+		if(cmd->param1Speed > 7199){
+			serialReply(cmd->cmdId, serialSpeed.error);
+			return;
+		}
+	}
+	if((cmd->command == TURNL || cmd->command == TURNR || cmd->command == PWMTURNL || cmd->command == PWMTURNR)
+			&& cmd->param2DistAngle > 360) {
+		serialReply(cmd->cmdId, serialAngle.error);
+		return;
+	}
+	if(cmd->command == STOP){
+		routeState = ROUTE_IDLE; // Abandon an uploaded route; nothing more is fed to the motor task
+	}
+	cmd->epoch = rxSerialEpoch;
+	if(xQueueSend(motorCommandQueue, cmd, pdMS_TO_TICKS(100)) != pdPASS){
+		serialReply(cmd->cmdId, "ERROR/MOTOR_COMMAND_QUEUE_IS_FULL");
+		return;
+	}
+	creditQueued(cmd->cmdId);
+	xTaskNotify((TaskHandle_t)motorTaskHandle, MOTOR_EVT_COMMAND, eSetBits);
+	serialReply(cmd->cmdId, "OK/MOTOR_CONTROL_SUCCESS");
 }
 
-/* USER CODE BEGIN 4 */
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart){
-	/* prevent unused argument(s) compilation warning */
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF), same as stm32_crc16() on the RPi.
+uint16_t crc16Ccitt(const uint8_t *data, uint16_t len){
+	uint16_t crc = 0xFFFF;
+	for(uint16_t i = 0; i < len; i++){
+		crc ^= (uint16_t)data[i] << 8;
+		for(uint8_t bit = 0; bit < 8; bit++){
+			crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+		}
+	}
+	return crc;
+}
 
-	UNUSED(huart);
-	HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
-	if (rxTemp == ':')
-	{
-		bufferIndex = 0;  // Reset buffer for new command
-		commandReady = 0;
-		rxBuffer[0] = '\0';
+// Decodes one binary frame collected by the UART ISR. Replies are ASCII, as for
+// rxSerialParse, so the RPi handles ACKs the same way in both modes.
+void rxSerialParseBinary(const uint8_t *frame){
+	uint16_t crc = frame[BIN_FRAME_LEN - 2] | (frame[BIN_FRAME_LEN - 1] << 8);
+	if(crc16Ccitt(&frame[1], 1 + BIN_PAYLOAD_LEN) != crc){
+		// The ID cannot be trusted; the RPi times the command out
+		serialReply(0, "ERROR/BAD_FRAME_CRC");
+		return;
 	}
-	// Check for end of command ';'
-	else if (rxTemp == ';'){
-		rxBuffer[bufferIndex] = '\0';  // Null terminate
-		commandReady = 1;
+	uint8_t opcode = frame[2];
+	MotorCommand_t cmd;
+	cmd.cmdId = frame[3] | (frame[4] << 8);
+	cmd.param1Speed = frame[5] | (frame[6] << 8);
+	cmd.param2DistAngle = frame[7] | (frame[8] << 8);
+	if(opcode == BIN_OP_RESUME){
+		// The RPi has its snapshot; go on with the route
+		if(routeState == ROUTE_SNAP_WAIT && cmd.cmdId == (uint16_t)(routeBaseId + routeNext)){
+			routeNext++;
+			routeEpoch = rxSerialEpoch;
+			routeState = ROUTE_RUNNING;
+			xTaskNotify((TaskHandle_t)motorTaskHandle, MOTOR_EVT_COMMAND, eSetBits);
+		}else{
+			serialReply(cmd.cmdId, "ERROR/ROUTE_NOT_WAITING");
+		}
+		return;
 	}
-	// Store data if we're in a command sequence
-	else if (bufferIndex < 255){
-		rxBuffer[bufferIndex] = rxTemp;
-		bufferIndex++;
+	if(opcode == BIN_OP_PING){
+		serialPing(&cmd, 0);
+		return;
 	}
-	else{
-		// Buffer overflow - reset
-		bufferIndex = 0;
-		commandReady = 0;
-		rxBuffer[0] = '\0';
+	if(opcode < BIN_OPCODE_BASE || opcode > BIN_OPCODE_BASE + PWMTURNR){
+		serialReply(cmd.cmdId, "ERROR/MOTOR_CONTROL_COMMAND_NOT_IMPLEMENTED_YET");
+		return;
 	}
-	HAL_UART_Receive_IT(&huart3,&rxTemp,1);
+	cmd.command = (enum cmdList)(opcode - BIN_OPCODE_BASE);
+	motorCommandSubmit(&cmd);
 }
 
-//HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
-//{
-//	if(isMuted){
-//		isMuted = 0;
-//	}else{
-//		isMuted = 1;
-//	}
-//}
+// Stores one ROUTE frame collected by the UART ISR and replies "!id/DONE;". The
+// route starts once its last step is stored. Steps are checked here against the
+// same limits as motorCommandSubmit, so a bad one rejects the frame up front.
+void rxSerialParseRoute(const uint8_t *frame){
+	uint8_t len = frame[1];
+	uint16_t crc = frame[2 + len] | (frame[3 + len] << 8);
+	if(crc16Ccitt(&frame[1], 1 + len) != crc){
+		serialReply(0, "ERROR/BAD_FRAME_CRC");
+		return;
+	}
+	uint32_t cmdId = frame[3] | (frame[4] << 8);
+	uint16_t baseId = frame[5] | (frame[6] << 8);
+	uint8_t first = frame[7];
+	uint8_t total = frame[8];
+	uint8_t count = (len - ROUTE_HEADER_LEN) / 4;
+	if(frame[2] != BIN_OP_ROUTE || (len - ROUTE_HEADER_LEN) % 4 != 0){
+		serialReply(cmdId, "ERROR/INVALID_COMMAND");
+		return;
+	}
+	if(routeState != ROUTE_IDLE){
+		serialReply(cmdId, "ERROR/ROUTE_BUSY");
+		return;
+	}
+	if(total > ROUTE_MAX_STEPS || first + count > total){
+		serialReply(cmdId, "ERROR/ROUTE_TOO_LONG");
+		return;
+	}
+	if(first != 0 && first != routeLen){
+		serialReply(cmdId, "ERROR/ROUTE_OUT_OF_ORDER");
+		return;
+	}
+	for(uint8_t i = 0; i < count; i++){
+		const uint8_t *p = &frame[2 + ROUTE_HEADER_LEN + 4 * i];
+		uint8_t opcode = p[0];
+		uint16_t value = p[2] | (p[3] << 8);
+		uint8_t turn = opcode == BIN_OPCODE_BASE + TURNL || opcode == BIN_OPCODE_BASE + TURNR;
+		uint8_t motion = turn || opcode == BIN_OPCODE_BASE + FWD || opcode == BIN_OPCODE_BASE + REV
+				|| opcode == BIN_OPCODE_BASE + TURN90L || opcode == BIN_OPCODE_BASE + TURN90R;
+		if((opcode != ROUTE_SNAP && opcode != ROUTE_PASS && !motion) || (motion && p[1] > serialSpeed.max)
+				|| (turn && value > serialAngle.max)){
+			serialReply(cmdId, "ERROR/ROUTE_BAD_STEP");
+			return;
+		}
+		routeSteps[first + i].opcode = opcode;
+		routeSteps[first + i].speed = p[1];
+		routeSteps[first + i].distAngle = value;
+	}
+	routeLen = first + count;
+	routeBaseId = baseId;
+	serialReply(cmdId, "DONE");
+	if(routeLen == total){
+		routeNext = 0;
+		routeEpoch = rxSerialEpoch;
+		routeState = ROUTE_RUNNING;
+		xTaskNotify((TaskHandle_t)motorTaskHandle, MOTOR_EVT_COMMAND, eSetBits);
+	}
+}
 
-void delay_us(uint16_t us){
-	__HAL_TIM_SET_COUNTER(&htim14, 0);
-	HAL_TIM_Base_Start(&htim14);
+// Whether the route's next step is a ROUTE_PASS with a motion after it, so the
+// command that just finished hands its wheels straight to that motion.
+static uint8_t routeDrivesThrough(void){
+	return routeState == ROUTE_RUNNING && routeEpoch == estopCount && routeNext + 1 < routeLen
+			&& routeSteps[routeNext].opcode == ROUTE_PASS;
+}
+
+// Motor task: fills cmd with the next route step once the previous one is
+// done. A ROUTE_SNAP step waits for the chassis to settle, sends "!id/SNAP/<pose>;"
+// and parks the route until RESUME. A ROUTE_PASS step sends "!id/PASS/<pose>;"
+// and goes on at once, settled or not. Returns 1 if cmd was filled.
+static uint8_t routeNextCommand(MotorCommand_t *cmd){
+	if(routeState != ROUTE_RUNNING) return 0;
+	while(routeNext < routeLen && routeEpoch == estopCount && routeSteps[routeNext].opcode == ROUTE_PASS){
+		serialReplyPose((uint16_t)(routeBaseId + routeNext), "PASS");
+		routeNext++;
+	}
+	if(routeNext >= routeLen || routeEpoch != estopCount){
+		routeState = ROUTE_IDLE;
+		return 0;
+	}
+	const RouteStep *step = &routeSteps[routeNext];
+	uint32_t id = (uint16_t)(routeBaseId + routeNext);
+	if(step->opcode == ROUTE_SNAP){
+		if(settlePending) return 0; // Still rocking; motorSettlePoll clears this
+		routeState = ROUTE_SNAP_WAIT;
+		serialReplyRest(id, "SNAP"); // Settled already: at rest since the last SETTLED
+		return 0;
+	}
+	cmd->command = (enum cmdList)(step->opcode - BIN_OPCODE_BASE);
+	cmd->param1Speed = step->speed * 71;
+	cmd->param2DistAngle = step->distAngle;
+	cmd->cmdId = id;
+	cmd->epoch = routeEpoch;
+	routeNext++;
+	return 1;
+}
 
-	while(__HAL_TIM_GET_COUNTER(&htim14) < us);
-	HAL_TIM_Base_Stop(&htim14);
+// Hands one run of txRing to the selected transport. Returns 0 once it is on its way.
+static int linkTxStart(uint8_t *data, uint16_t len){
+#if LINK_USB_CDC
+	if(linkTransport == LINK_USB) return CDC_Transmit_FS(data, len) == USBD_OK ? 0 : -1;
+#endif
+	return HAL_UART_Transmit_DMA(&huart3, data, len) == HAL_OK ? 0 : -1;
 }
 
-void HAL_TIM_IC_CaptureCallback(TIM_HandleTypeDef *htim){
-	static count = 0;
-	if(htim==&htim8){
-		if(isRising==1){	//If pin on high, means positive edge
-			// 0xFFFF: only lower 16bits are defined!!! 1 = 0.1ms
-			tc1 = HAL_TIM_ReadCapturedValue(htim, TIM_CHANNEL_2) & 0xFFFF;	//Retrieve value and store in tc1
-//			sprintf(buf1, "t1.%d:%d", count, tc1);
-//			if(count==2){
-//				osDelay(1);
-//			}
-			isRising = 0;
-			HAL_TIM_IC_Stop_IT(htim, TIM_CHANNEL_2);
-			__HAL_TIM_SET_CAPTUREPOLARITY(htim, TIM_CHANNEL_2, TIM_INPUTCHANNELPOLARITY_FALLING);
-			__HAL_TIM_CLEAR_IT(htim, TIM_IT_CC2);
-			HAL_TIM_IC_Start_IT(htim, TIM_CHANNEL_2);
-		} else {	//If pin on low means negative edge
-			tc2 = HAL_TIM_ReadCapturedValue(htim, TIM_CHANNEL_2) & 0xFFFF;	//Retrieve val and store in tc2
-//			sprintf(buf2, "t2.%d:%d", count, tc2);
-			if (tc2 > tc1){
-				echo = tc2-tc1;		//Calculate the differnce = width of pulse
-			} else {
-				echo = (65536-tc1)+tc2;
-			}
-			isRising = 1;
-			HAL_TIM_IC_Stop_IT(htim, TIM_CHANNEL_2);
-			__HAL_TIM_SET_CAPTUREPOLARITY(htim, TIM_CHANNEL_2, TIM_INPUTCHANNELPOLARITY_RISING);
-			__HAL_TIM_CLEAR_IT(htim, TIM_IT_CC2);
-			HAL_TIM_IC_Start_IT(htim, TIM_CHANNEL_2);
-		}
-	count++;
+// Starts the DMA on the oldest contiguous run of txRing if it is idle. Call with the ring locked.
+static void uartTxKick(void){
+	if(txInFlight || txHead == txTail) return;
+	uint16_t tail = txTail;
+	uint16_t len = (txHead > tail) ? (uint16_t)(txHead - tail) : (uint16_t)(TX_RING_SIZE - tail);
+	txInFlight = len;
+	if(linkTxStart(&txRing[tail], len) != 0){
+		txInFlight = 0; // Retried by the next write
 	}
 }
 
-void rxSerialParse(void){
-	bufferIndex=0;
-			commandReady=0;
-			// Command parsing variables
-			int32_t cmdid = -1;
-			char component[20]; // The component to be controlled (e.g. MOTOR, SENSOR)
-			char command[20]; // Command (e.g. FWD)
-			uint8_t result[100];
-			// Parse command using sscanf
-			MotorCommand_t cmd;
-			cmd.param1Speed = 20;
-			cmd.param2DistAngle = 0;
-			sscanf(rxBuffer, "%d/%40[^/]/%40[^/]/%d/%d", &cmdid, &component, &command, &cmd.param1Speed, &cmd.param2DistAngle);
-			if(cmdid < 0) {
-				sprintf((uint8_t *)result, "!0/ERROR/INVALID_COMMAND_ID;");
-				HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-				return;
-			}
-			cmd.cmdId = cmdid;
-			if(strcmp(component, "MOTOR") == 0){
-				if(strcmp(command, "PWMTURNL") != 0 && strcmp(command, "PWMTURNR") != 0){
-					cmd.param1Speed *= 71;
-					if(cmd.param1Speed > 7199 || cmd.param1Speed < 0){
-						sprintf(result, "!%d/ERROR/INVALID_SPEED_PARAM_SHOULD_BE_INTEGER_0_TO_101;",cmdid);
-						HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-						return;
-					}
-				}
-				if(strcmp(command, "FWD") == 0){
-					cmd.command = FWD;
-				}else if(strcmp(command, "REV") == 0){
-					cmd.command = REV;
-				}else if(strcmp(command, "STOP") == 0){
-					cmd.command = STOP;
-				}else if(strcmp(command, "TURN90L") == 0){
-					cmd.command = TURN90L;
-				}else if(strcmp(command, "TURN90R") == 0){
-					cmd.command = TURN90R;
-				}else if(strcmp(command, "TURNL") == 0){
-					if(cmd.param2DistAngle > 360) {
-						sprintf(result, "!%d/ERROR/INVALID_ANGLE_PARAM_SHOULD_BE_INTEGER_0_TO_360;",cmdid);
-						HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-						return;
-					}
-					cmd.command = TURNL;
-				}else if(strcmp(command, "TURNR") == 0){
-					if(cmd.param2DistAngle > 360) {
-						sprintf(result, "!%d/ERROR/INVALID_ANGLE_PARAM_SHOULD_BE_INTEGER_0_TO_360;",cmdid);
-						HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-						return;
-					}
-					cmd.command = TURNR;
-				}else if(strcmp(command, "PWMTURNL") == 0){
-					if(cmd.param2DistAngle > 360) {
-						sprintf(result, "!%d/ERROR/INVALID_ANGLE_PARAM_SHOULD_BE_INTEGER_0_TO_360;",cmdid);
-						HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-						return;
-					}
-					cmd.command = PWMTURNL;
-				}else if(strcmp(command, "PWMTURNR") == 0){
-					if(cmd.param2DistAngle > 360) {
-						sprintf(result, "!%d/ERROR/INVALID_ANGLE_PARAM_SHOULD_BE_INTEGER_0_TO_360;",cmdid);
-						HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-						return;
-					}
-					cmd.command = PWMTURNR;
-				}else if(strcmp(command, "TASK2") == 0){
-					cmd.command = TASK2;
-				}else{
-					sprintf(result, "!%d/ERROR/MOTOR_CONTROL_COMMAND_NOT_IMPLEMENTED_YET;",cmdid);
-					HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-					return;
-				}
-				if(xQueueSend(motorCommandQueue, &cmd, pdMS_TO_TICKS(100)) != pdPASS){
-					sprintf(result, "!%d/ERROR/MOTOR_COMMAND_QUEUE_IS_FULL;",cmdid);
-					HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-					return;
-				}
-				sprintf(result, "!%d/OK/MOTOR_CONTROL_SUCCESS;",cmdid);
-				HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-				return;
-			}else if(strcmp(component, "GENERAL") == 0){
-				if(strcmp(command, "CAPTURE") == 0){
-					music = CAPTURE;
-				}else if(strcmp(command, "DONE") == 0){
-					music = DONE;
-					isContinue = 0;
-				}
-			}else if(strcmp(component, "SENSOR") == 0){
-				// REPORT SENSOR STATUS?
-			}else if(strcmp(command, "CAPTURE1") == 0){
-				capture1 = cmd.param1Speed;
-			}else if(strcmp(command, "CAPTURE2") == 0){
-				capture2 = cmd.param1Speed;
-			}else{
-				sprintf((uint8_t *)result, "!%d/ERROR/INVALID_COMMAND;",cmdid);
-				HAL_UART_Transmit(&huart3,(uint8_t *)result,strlen(result),0xFFFF);
-			}
+// Queues len bytes for the RPi without blocking; safe from tasks and ISRs.
+// Returns 0, or -1 if the ring has no room (nothing is queued).
+int uartTxWrite(const uint8_t *data, uint16_t len){
+	UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+	uint16_t used = (uint16_t)((txHead - txTail + TX_RING_SIZE) % TX_RING_SIZE);
+	if(len > TX_RING_SIZE - 1 - used){
+		txDropped++;
+		taskEXIT_CRITICAL_FROM_ISR(saved);
+		return -1;
+	}
+	uint16_t head = txHead;
+	uint16_t first = (uint16_t)(TX_RING_SIZE - head);
+	if(first > len) first = len;
+	memcpy(&txRing[head], data, first);
+	memcpy(txRing, data + first, len - first);
+	txHead = (uint16_t)((head + len) % TX_RING_SIZE);
+	uartTxKick();
+	taskEXIT_CRITICAL_FROM_ISR(saved);
+	return 0;
+}
+
+void uartTxSend(const char *s){
+	uartTxWrite((const uint8_t *)s, (uint16_t)strlen(s));
+}
+
+// The running transfer has gone out, on either transport: move on to the next run
+static void linkTxDone(void){
+	UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+	// Offset of the PING reply's last byte in the run that just finished
+	if(linkTxPending && (uint16_t)((linkTxMark + TX_RING_SIZE - 1 - txTail) % TX_RING_SIZE) < txInFlight){
+		linkTxCycles = DWT->CYCCNT - linkTxQueued;
+		linkTxPending = 0;
+		linkProbe();
+	}
+	txTail = (uint16_t)((txTail + txInFlight) % TX_RING_SIZE);
+	txInFlight = 0;
+	uartTxKick();
+	taskEXIT_CRITICAL_FROM_ISR(saved);
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
+	if(huart->Instance != USART3 || linkTransport != LINK_UART) return;
+	linkTxDone();
+}
+
+#if LINK_USB_CDC
+// usbd_cdc_if.c's CDC_TransmitCplt_FS: the host has taken the last IN packet
+void linkUsbTxDone(void){
+	if(linkTransport == LINK_USB) linkTxDone();
+}
+#endif
+
+// Moves txRing to transport. A run still in flight finishes where it started
+// (its completion is then dropped), so it is let go before switching.
+static void linkSelect(LinkTransport transport){
+	if(transport == linkTransport) return;
+	taskENTER_CRITICAL();
+	txTail = (uint16_t)((txTail + txInFlight) % TX_RING_SIZE);
+	txInFlight = 0;
+	linkTransport = transport;
+	uartTxKick();
+	taskEXIT_CRITICAL();
+}
+
+// A TX DMA error aborts the transfer: skip those bytes and go on with the rest.
+// An RX error stops HAL_UART_Receive_IT, so re-arm it.
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart){
+	if(huart->Instance != USART3) return;
+	if(txInFlight && huart->gState == HAL_UART_STATE_READY){
+		HAL_UART_TxCpltCallback(huart);
+	}
+	if(huart->RxState == HAL_UART_STATE_READY){
+		HAL_UART_Receive_IT(&huart3,&rxTemp,1);
+	}
+}
+
+// Reports a finished command and starts watching for the chassis to come to rest.
+void motorAckDone(uint32_t cmdId){
+	serialReplyDone(cmdId);
+	recoveryNoteCommand(cmdId, 0.0f); // Finished: a reset from here on resends only what came after it
+	settlePending = 1;
+	settleCmdId = cmdId;
+	settleStartTick = HAL_GetTick();
+	settleQuietSinceTick = settleStartTick;
+}
+
+// Abandons the running command: "!id/FAULT/<cause>/<pose>;". The queue and an
+// uploaded route behind it go too, as for an emergency stop, since they assumed
+// this command got where it was going.
+void motorFault(uint32_t cmdId, const char *cause){
+	xQueueReset(motorCommandQueue);
+	routeState = ROUTE_IDLE;
+	stopDisarm();
+	motorStop();
+	isFrontCalib = 0;
+	isTurning = 0;
+	setServoAngle(SERVO_CENTER);
+	char s[24];
+	snprintf(s, sizeof(s), "FAULT/%s", cause);
+	serialReplyPose(cmdId, s);
+	recoveryNoteCommand(cmdId, 0.0f); // Abandoned: a reset must not resume it
+	settlePending = 0;
+}
+
+// Called every motor task iteration. Sends "!id/SETTLED/<pose>/@<tick>;" once
+// wheel and yaw rates have stayed near zero for SETTLE_HOLD_MS, tick being when
+// they went quiet: the first moment a camera frame is sharp (now, after a
+// timeout). The RPi waits for it before a snapshot.
+void motorSettlePoll(void){
+	if(!settlePending) return;
+	uint32_t now = HAL_GetTick();
+	uint8_t quiet = pidA.measured_speed <= SETTLE_ENCODER_TICKS && pidB.measured_speed <= SETTLE_ENCODER_TICKS
+			&& fabsf(gyro_z_dps) < SETTLE_GYRO_DPS;
+	if(!quiet){
+		settleQuietSinceTick = now;
+	}
+	if((quiet && now - settleQuietSinceTick >= SETTLE_HOLD_MS) || now - settleStartTick >= SETTLE_TIMEOUT_MS){
+		settleRestTick = quiet ? settleQuietSinceTick : now;
+		serialReplyRest(settleCmdId, "SETTLED");
+		settlePending = 0;
+	}
 }
 /* USER CODE END 4 */
 
@@ -4047,9 +4691,20 @@ void StartDefaultTask(void *argument)
   /* USER CODE BEGIN 5 */
   uint8_t ch = 'A';
   HAL_UART_Receive_IT(&huart3,&rxTemp,1);
+  // Back from a reset the RPi did not ask for: say which command was cut short
+  // and how much of it is left, so it can resend from there without waiting
+  // out its ACK timeout
+  const RecoveryRecord *last = recoveryLastRun();
+  if(last){
+	  char s[40];
+	  snprintf(s, sizeof(s), "RESET/%ld/%s", last->remaining < 0.0f ? -1L : lroundf(last->remaining), recoveryCauseName());
+	  serialReply(last->cmdId, s);
+  }
+  Wcet_Register(&wcetTasks[WCET_DEFAULT]);
   /* Infinite loop */
   for(;;)
   {
+	Wcet_Begin(&wcetTasks[WCET_DEFAULT]);
 //	HAL_UART_Transmit(&huart3,(uint8_t *)&ch,1,0xFFFF);
 //	if (ch<'Z'){
 //		ch++;
@@ -4059,7 +4714,10 @@ void StartDefaultTask(void *argument)
 //	}
 
 	//HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
-    osDelay(1000);
+	recoverySupervise();
+	linkClockUs(DWT->CYCCNT); // Carries the SYNC clock over CYCCNT wraps
+	Wcet_End(&wcetTasks[WCET_DEFAULT]);
+    osDelay(RECOVERY_KICK_MS);
   }
   /* USER CODE END 5 */
 }
@@ -4076,23 +4734,31 @@ void show(void *argument)
 {
   /* USER CODE BEGIN show */
 //  uint8_t buf[20] = "SC2079 MDP G29\0";
+#if FAST_BOOT
+  OLED_Init(); // Its 100 ms reset pulse sleeps here while the rest comes up
+#endif
+  Wcet_Register(&wcetTasks[WCET_SHOW]);
 
   /* Infinite loop */
   for(;;)
   {
+	Wcet_Begin(&wcetTasks[WCET_SHOW]);
 //	sprintf(buf3, "%d us\0", echo);
 //	sprintf(buf4, "%7.2f mm\0", distance);
 	OLED_ShowString(10, 10, buf);
-	sprintf(buf3, "x: %6.2f\0", x);
-    sprintf(buf4, "y: %6.2f\0", y);
+	showValue(buf3, "x: ", x, 2, 6, "");
+	showValue(buf4, "y: ", y, 2, 6, "");
 //    sprintf(buf4, "lnow: %d\0", leftNow);
-    sprintf(buf2, "d: %6.2f\0", distance);
+	showValue(buf2, "d: ", distance, 2, 6, "");
 //	OLED_ShowString(10, 20, buf1);
 //	OLED_ShowString(10, 20, rxBuffer);
 	OLED_ShowString(10, 30, buf2);
 	OLED_ShowString(10, 40, buf3);
 	OLED_ShowString(10, 50, buf4);
+	PROF_BEGIN(PR_OLED);
 	OLED_Refresh_Gram();
+	PROF_END(PR_OLED);
+	Wcet_End(&wcetTasks[WCET_SHOW]);
     osDelay(100);
   }
   /* USER CODE END show */
@@ -4108,94 +4774,153 @@ void show(void *argument)
 void motor(void *argument)
 {
   /* USER CODE BEGIN motor */
-  MotorCommand_t cmd;
-  uint8_t ack[50] = {0};
-  setServoAngle(SERVO_RIGHT_MAX);
-  osDelay(500);
+  MotorCommand_t cmd, next;
+  uint32_t events;
+#if FAST_BOOT
+  // No sweep: centring is all a move needs, and it runs while the IMU comes up
   setServoAngle(SERVO_CENTER);
-  osDelay(500);
+  osDelay(BOOT_SERVO_SETTLE_MS);
+#else
+  if(!recoveryLastRun()){
+	  // Power-on servo check; skipped after a reset so the RPi's resend runs at once
+	  setServoAngle(SERVO_RIGHT_MAX);
+	  osDelay(500);
+	  setServoAngle(SERVO_CENTER);
+	  osDelay(500);
+  }
+#endif
+  xEventGroupSetBits(bootReady, BOOT_READY_SERVO);
   enum {FWD,REV,STOP,TURNL,TURNR, TURN90L, TURN90R, TASK2} currentState = STOP;
   uint8_t isStateChanged = 0;
+  uint8_t ticking = 1; // TIM7 runs; stopped while idle
+#if FAST_BOOT
+  // Commands queue meanwhile (the RPi's resend after a RESET included); none
+  // runs on a heading that is not being tracked yet
+  xEventGroupWaitBits(bootReady, BOOT_READY_ALL, pdFALSE, pdTRUE, pdMS_TO_TICKS(BOOT_READY_TIMEOUT_MS));
+  char ready[24];
+  snprintf(ready, sizeof(ready), "READY/%lu", (unsigned long)HAL_GetTick());
+  serialReply(0, ready);
+#endif
+  Wcet_Register(&wcetTasks[WCET_MOTOR]);
+  HAL_TIM_Base_Start_IT(&htim7);
   while(isContinue) {
-	  if(xQueueReceive(motorCommandQueue, &cmd, 0) == pdPASS){
+	  // Sleep until the next control tick, a new command or a capture answer; a
+	  // tick that fired while the last step ran (osDelay in a primitive) is taken at once.
+	  // Idle, only the watchdog check-in wakes it.
+	  Wcet_End(&wcetTasks[WCET_MOTOR]); // Every path of the last iteration comes through here
+	  BaseType_t woken = xTaskNotifyWait(0, MOTOR_EVT_TICK | MOTOR_EVT_COMMAND | MOTOR_EVT_CAPTURE | MOTOR_EVT_STOP | MOTOR_EVT_ESTOP,
+			  &events, ticking ? portMAX_DELAY : pdMS_TO_TICKS(RECOVERY_KICK_MS));
+	  Wcet_Begin(&wcetTasks[WCET_MOTOR]);
+	  recoveryCheckIn(RECOVERY_TASK_MOTOR);
+	  if(woken != pdTRUE) continue;
+	  if(!ticking){
+		  HAL_TIM_Base_Start_IT(&htim7);
+		  ticking = 1;
+	  }
+	  if(events & MOTOR_EVT_ESTOP){
+		  // The ISR has already cut the PWM; forget the queue and whatever was running
+		  xQueueReset(motorCommandQueue);
+		  stopDisarm();
+		  motorStop();
+		  isFrontCalib = 0;
+		  isTurning = 0;
+		  setServoAngle(SERVO_CENTER);
+		  float remaining;
+		  uint32_t id = recoveryCommand(&remaining);
+		  if(currentState == STOP) remaining = 0.0f; // Idle: id is the last one finished
+		  currentState = STOP;
+		  settlePending = 0;
+		  recoveryNoteCommand(id, 0.0f); // Abandoned: a reset must not resume it
+		  motorIdle = 1;
+		  estopLatched = 0;
+		  char s[24];
+		  snprintf(s, sizeof(s), "STOPPED/%ld", remaining < 0.0f ? -1L : lroundf(remaining));
+		  serialReply(id, s);
+		  continue;
+	  }
+	  PROF_BEGIN(PR_MOTOR); // From here on every path reaches PROF_END
+	  // Queued commands first; an uploaded route feeds its next step whenever the robot is idle.
+	  // One that arrived before an emergency stop slipped past the flush and is dropped.
+	  uint8_t dequeued = xQueueReceive(motorCommandQueue, &next, 0) == pdPASS;
+	  if(dequeued) creditReport(next.cmdId); // Its slot is free, even for one dropped below
+	  if((dequeued && next.epoch == estopCount)
+			  || (currentState == STOP && routeNextCommand(&next))){
+		  cmd = next;
 		  currentState = cmd.command;
+		  motorIdle = 0;
 		  isStateChanged = 1;
+		  stopDisarm(); // Whatever was running is abandoned
+		  settlePending = 0; // Moving again; nobody is waiting to capture
+		  recoveryNoteCommand(cmd.cmdId, -1.0f); // Until the primitive reports what is left
+		  progressStart(cmd.cmdId);
+		  odometryGet(&cmdStartPose);
 	  }else{
 		  isStateChanged = 0;
 	  }
-	  if(currentState != STOP && music == MUTE && isContinue) music=BGM;
+	  if(currentState != STOP && music == MUTE && isContinue) buzzerRequest(BGM);
 	  switch(currentState) {
 	  if(isContinue==0) currentState = STOP;
 	  case FWD:
 		  if(motorPidForward(cmd, isStateChanged)) {
 			  currentState = STOP;
-			  motorStop();
-			  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-			  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+			  if(!routeDrivesThrough()) motorStop(); // Else the next step takes over the moving wheels
+			  motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case REV:
 		  if(motorPidReverse(cmd, isStateChanged)) {
 		  	currentState = STOP;
 		  	motorStop();
-		  	sprintf(ack, "!%d/DONE;",cmd.cmdId);
-		  	HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+		  	motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case TURN90L:
 		  if(motorTurn90L(cmd, isStateChanged)){
 		  	currentState = STOP;
 		  	motorStop();
-		  	sprintf(ack, "!%d/DONE;",cmd.cmdId);
-		  	HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+		  	motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case TURN90R:
 		  if(motorTurn90R(cmd, isStateChanged)){
 			  currentState = STOP;
 			  motorStop();
-			  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-			  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+			  motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case TASK2:
 		  if(task2Loop(cmd, isStateChanged)){
 			  currentState = STOP;
 			  motorStop();
-			  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-			  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+			  motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case PWMTURNL:
 		  if(motorTurnPwmL(cmd, isStateChanged)){
 			  currentState = STOP;
 			  motorStop();
-			  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-			  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+			  motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case PWMTURNR:
 	  	  if(motorTurnPwmR(cmd, isStateChanged)){
 	  		  currentState = STOP;
 	  		  motorStop();
-	  		  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-	  		  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+	  		  motorAckDone(cmd.cmdId);
 	  	  }
 	  	  break;
 	  case TURNL:
 		  if(motorTurn(cmd, isStateChanged)){
 			  currentState = STOP;
 			  motorStop();
-			  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-			  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+			  motorAckDone(cmd.cmdId);
 		  }
 		  break;
 	  case TURNR:
 	  	  if(motorTurn(cmd, isStateChanged)){
 	  		  currentState = STOP;
 	  		  motorStop();
-	  		  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-	  		  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+	  		  motorAckDone(cmd.cmdId);
 	  	  }
 	  	  break;
 	  case STOP:
@@ -4204,18 +4929,36 @@ void motor(void *argument)
 			  isTurning = 0;
 			  motorStop();
 			  if(cmd.command == STOP){
-				  sprintf(ack, "!%d/DONE;",cmd.cmdId);
-				  HAL_UART_Transmit(&huart3,ack,strlen(ack),0xFFFF);
+				  motorAckDone(cmd.cmdId);
 			  }
 		  }
 	  }
-	  osDelay(1);
+	  if(stall.fired){
+		  stall.fired = 0;
+		  if(currentState != STOP){
+			  currentState = STOP;
+			  motorFault(cmd.cmdId, "STALL");
+		  }
+	  }
+	  motorIdle = currentState == STOP;
+	  motorSettlePoll();
+	  PROF_END(PR_MOTOR);
+	  // Nothing running, settling or left to feed from a route: stop the 1 kHz
+	  // control tick so the core can sleep. Commands, RESUME and ESTOP all notify.
+	  if(currentState == STOP && !settlePending && routeState != ROUTE_RUNNING){
+		  HAL_TIM_Base_Stop_IT(&htim7);
+		  ticking = 0;
+	  }
   }
 
+  HAL_TIM_Base_Stop_IT(&htim7);
   motorStop();
   setServoAngle(SERVO_CENTER);
 
-  for(;;) osDelay(1000);
+  for(;;){
+	  recoveryCheckIn(RECOVERY_TASK_MOTOR); // Finished on purpose, not hung
+	  osDelay(RECOVERY_KICK_MS);
+  }
   /* USER CODE END motor */
 }
 
@@ -4229,68 +4972,28 @@ void motor(void *argument)
 void encoder(void *argument)
 {
   /* USER CODE BEGIN encoder */
-  HAL_TIM_Encoder_Start(&htim2,TIM_CHANNEL_ALL);
-  HAL_TIM_Encoder_Start(&htim3,TIM_CHANNEL_ALL);
-
-  int cnt1A, cnt2A;
-  int cnt1B, cnt2B;
-
-  cnt1A = __HAL_TIM_GET_COUNTER(&htim2);
-  cnt1B = __HAL_TIM_GET_COUNTER(&htim3);
-
-  uint16_t dirA, dirB;
+  encoderStart(&encoderA);
+  encoderStart(&encoderB);
+  uint32_t wake = osKernelGetTickCount();
+  Wcet_Register(&wcetTasks[WCET_ENCODER]);
 
   /* Infinite loop */
   for(;;)
   {
-		cnt2A = __HAL_TIM_GET_COUNTER(&htim2);
-		cnt2B = __HAL_TIM_GET_COUNTER(&htim3);
-
-		// handle overflow / underflow
-		if (__HAL_TIM_IS_TIM_COUNTING_DOWN(&htim2)){
-			if (cnt2A < cnt1A){
-				pidA.measured_speed = cnt1A - cnt2A;
-			}
-			else{
-				pidA.measured_speed = (65535 - cnt2A) + cnt1A;
-			}
-		}
-		else{
-			if (cnt2A > cnt1A){
-				pidA.measured_speed = cnt2A - cnt1A;
-			}
-			else{
-				pidA.measured_speed = (65535 - cnt1A) + cnt2A;
-			}
-		}
-
-		// encoder for motorB
-		if (__HAL_TIM_IS_TIM_COUNTING_DOWN(&htim3)){
-			if (cnt2B < cnt1B){
-				pidB.measured_speed = cnt1B - cnt2B;
-			}
-			else{
-				pidB.measured_speed = (65535 - cnt2B) + cnt1B;
-			}
-		}
-		else{
-			if (cnt2B > cnt1B){
-				pidB.measured_speed = cnt2B - cnt1B;
-			}
-			else{
-				pidB.measured_speed = (65535 - cnt1B) + cnt2B;
-			}
-		}
-
-		dirA = __HAL_TIM_IS_TIM_COUNTING_DOWN(&htim2);
-//		sprintf(buf1, "MtrA:%5d | %1d", pidA.measured_speed, !dirA);
-
-		dirB = __HAL_TIM_IS_TIM_COUNTING_DOWN(&htim3);
-//		sprintf(buf2, "MtrB:%5d | %1d", pidB.measured_speed, dirB);
-
-		cnt1A = __HAL_TIM_GET_COUNTER(&htim2);
-		cnt1B = __HAL_TIM_GET_COUNTER(&htim3);
-    osDelay(10);
+		Wcet_Begin(&wcetTasks[WCET_ENCODER]);
+		recoveryCheckIn(RECOVERY_TASK_ENCODER);
+		encoderSample(&encoderA);
+		encoderSample(&encoderB);
+
+		// Counts per sample, as the settle check expects
+		pidA.measured_speed = (int)(fabsf(encoderA.speed) * ENCODER_SAMPLE_MS / 1000.0f + 0.5f);
+		pidB.measured_speed = (int)(fabsf(encoderB.speed) * ENCODER_SAMPLE_MS / 1000.0f + 0.5f);
+//		sprintf(buf1, "MtrA:%7.1f", encoderA.speed);
+//		sprintf(buf2, "MtrB:%7.1f", encoderB.speed);
+
+		Wcet_End(&wcetTasks[WCET_ENCODER]);
+		wake += pdMS_TO_TICKS(ENCODER_SAMPLE_MS);
+		osDelayUntil(wake);
   }
   /* USER CODE END encoder */
 }
@@ -4307,9 +5010,12 @@ void servo(void *argument)
   /* USER CODE BEGIN servo */
   HAL_TIM_PWM_Start(&htim12, TIM_CHANNEL_1);
   __HAL_TIM_SET_COMPARE(&htim12, TIM_CHANNEL_1, SERVO_CENTER);
+  Wcet_Register(&wcetTasks[WCET_SERVO]);
   /* Infinite loop */
   for(;;)
   {
+	  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // motorForwardStart() wakes it
+	  Wcet_Begin(&wcetTasks[WCET_SERVO]);
 	  if(isFrontCalib){
 		  for (int angle = SERVO_LEFT_MAX; angle <= SERVO_RIGHT_MAX; angle += SERVO_CENTER_A_PERCENTAGE){
 			  __HAL_TIM_SET_COMPARE(&htim12, TIM_CHANNEL_1, angle);
@@ -4322,7 +5028,7 @@ void servo(void *argument)
 		  __HAL_TIM_SET_COMPARE(&htim12, TIM_CHANNEL_1, SERVO_CENTER);
 		  isFrontCalib = 0;
 	  }
-    osDelay(100);
+	  Wcet_End(&wcetTasks[WCET_SERVO]);
   }
   /* USER CODE END servo */
 }
@@ -4337,27 +5043,23 @@ void servo(void *argument)
 void ultrasonic(void *argument)
 {
   /* USER CODE BEGIN ultrasonic */
-  /* Infinite loop */
   osDelay(500);
-  HAL_TIM_IC_Start_IT(&htim8, TIM_CHANNEL_2);
+  HAL_TIM_IC_Start(&htim8, TIM_CHANNEL_2);
+  HAL_TIM_IC_Start_IT(&htim8, TIM_CHANNEL_1);
+  HAL_TIM_PWM_Start(&htim8, TIM_CHANNEL_3); // Trigger every 50 ms from here on
+  Wcet_Register(&wcetTasks[WCET_ULTRASONIC]);
+  /* Infinite loop */
   for(;;)
   {
-	  __HAL_TIM_SET_COUNTER(&htim8, 0);
-	  // Capture rising (after sending)
-	  __HAL_TIM_SET_CAPTUREPOLARITY(&htim8, TIM_CHANNEL_2, TIM_INPUTCHANNELPOLARITY_RISING);
-	  isRising = 1;
-//	  Set TRIG to low for awhile
-	  HAL_GPIO_WritePin(ULTRASONIC_SENSOR_GPIO_Port, ULTRASONIC_SENSOR_Pin, GPIO_PIN_RESET);
-	  osDelay(50);
-	  //Output 1us of Trig
-	  HAL_GPIO_WritePin(ULTRASONIC_SENSOR_GPIO_Port, ULTRASONIC_SENSOR_Pin, GPIO_PIN_SET);
-	  delay_us(10);
-	  HAL_GPIO_WritePin(ULTRASONIC_SENSOR_GPIO_Port, ULTRASONIC_SENSOR_Pin, GPIO_PIN_RESET);
-
-	  // Assume the callback function has retrieved tc1 & tc2
-
-	  //measure
-	  distance = (float)echo * (171.5f) / 1000.0f;
+	  // Woken once per echo; with no echo (sensor unplugged) distance keeps its last value
+	  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	  Wcet_Begin(&wcetTasks[WCET_ULTRASONIC]);
+	  uint16_t width = echo;
+	  distance = (float)width * (171.5f) / 1000.0f;
+	  ultrasonicFilterPush(distance);
+	  // The range is the one halfway through the echo's flight
+	  frontRangeMeasure(distance, FRONT_RANGE_ECHO_VAR, (float)width * 0.5e-6f);
+	  Wcet_End(&wcetTasks[WCET_ULTRASONIC]);
 
 //	  sprintf(buf4, "Dist: %5.1f mm", distance);
   }
@@ -4374,149 +5076,159 @@ void ultrasonic(void *argument)
 void readIMU(void *argument)
 {
   /* USER CODE BEGIN readIMU */
-	uint8_t gyro_reg_addr = 0x37;    // start from GYRO_ZOUT_H
-	uint8_t gyro_rawData[2];         // to store MSB and LSB
-	int16_t gyro_z_raw;
-	float gyro_z_dps_calibrated = 0.0f; // Calibrated gyro Z-axis value
-
-	uint32_t currentTime;
-    static uint32_t lastLoopTime = 0; // Static to track time across iterations
-    float dt_sec = 0.0f;
-
-    float mag_heading_rad = 0.0f;
-    const float COMPLEMENTARY_FILTER_ALPHA = 0.02f; // Adjust based on sensor noise and desired responsiveness
+	static uint8_t fifo[IMU_FIFO_MAX_SAMPLES * IMU_FIFO_SAMPLE_BYTES];
+	uint8_t mag[9]; // ST1, HXL..HZH, TMPS, ST2; reading ST2 releases the next sample
+	const float dt = 1.0f / IMU_ODR_HZ;
+
+	float bias = 0.0f;         // Gyro Z offset, dps
+	uint32_t calibSamples = 0; // The first IMU_BIAS_SAMPLES only seed bias
+	float ax = 0.0f, ay = 0.0f, az = 1.0f; // Low-passed gravity
+	float roll0 = 0.0f, pitch0 = 0.0f;     // Mounting attitude at rest
+	float magHeading = 0.0f;
+	uint8_t magValid = 0;
+	uint8_t pass = 0;
+	uint8_t tracking = 0; // The heading is being integrated; BOOT_READY_IMU is set
+
+	// After a reset, carry on from the saved state instead of calibrating at rest:
+	// the robot may have been stopped mid-move, and the RPi expects the same frame
+	const RecoveryRecord *last = recoveryLastRun();
+	if (last && last->imuValid) {
+		bias = last->gyroBias;
+		roll0 = last->roll0;
+		pitch0 = last->pitch0;
+		calibSamples = IMU_BIAS_SAMPLES;
+		currentAngle = last->heading;
+		odometrySet(&last->pose);
+	}
 
+#if FAST_BOOT
+	// Straight on once it answers rather than a fixed wait; registers written
+	// before then are lost
+	uint8_t whoAmI = 0;
+	for (uint32_t waited = 0; waited < IMU_POWERUP_MS; waited += 2) {
+		if (imuRead(ICM20948_I2C_ADDR, ICM20948_WHO_AM_I, &whoAmI, 1) == HAL_OK && whoAmI == ICM20948_WHO_AM_I_VALUE) break;
+		osDelay(2);
+	}
+	icm20948_init();
+	osDelay(IMU_GYRO_STARTUP_MS);
+#else
 	icm20948_init();
 	osDelay(1000); //delay to make sure ICM 20948 power up
-
-	lastLoopTime = HAL_GetTick(); // Initialize lastLoopTime
+#endif
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_RST, 0x1F);
+	icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_RST, 0x00);
+	int32_t odomA = encoderPosition(&encoderA), odomB = encoderPosition(&encoderB);
+	uint32_t wake = osKernelGetTickCount();
+	Wcet_Register(&wcetTasks[WCET_IMU]);
 
   /* Infinite loop */
   for(;;)
   {
-      // Calculate delta time for this loop iteration
-      currentTime = HAL_GetTick();
-      dt_sec = (float)(currentTime - lastLoopTime) / 1000.0f; // Convert to seconds
-      lastLoopTime = currentTime;
-
-	  // -------------- GYROSCOPE READINGS ---------------------------------------
-      // Using HAL_I2C_Mem_Read for consistency and conciseness
-	  if (HAL_I2C_Mem_Read(&hi2c2, ICM20948_I2C_ADDR, gyro_reg_addr, I2C_MEMADD_SIZE_8BIT, gyro_rawData, 2, 1000)!=HAL_OK){
-	      // Error reading gyroscope data
-	  } else {
-	      // Combine into signed 16-bit value
-	      gyro_z_raw = (int16_t)((gyro_rawData[0] << 8) | gyro_rawData[1]);
-	      
-	      // Apply calibration/scaling (e.g., divide by sensitivity factor)
-	      // For ICM20948 with default settings, 131.0 LSB/dps for 250 dps range
-	      gyro_z_dps_calibrated = (float)gyro_z_raw / 131.0f;
-	      gyro_z_dps_calibrated = -gyro_z_dps_calibrated; // Invert sign for correct rotation direction
-	      if(fabs(gyro_z_dps_calibrated) < 0.5f){ // Small deadband to reduce noise integration
-	          gyro_z_dps_calibrated = 0.0f;
-	      }
-	      // Update global gyro_z_dps for other uses (e.g. debugging)
-	      gyro_z_dps = gyro_z_dps_calibrated;
+	  Wcet_End(&wcetTasks[WCET_IMU]); // The body has several early continues
+	  wake += pdMS_TO_TICKS(IMU_READ_MS);
+	  osDelayUntil(wake);
+	  Wcet_Begin(&wcetTasks[WCET_IMU]);
+	  recoveryCheckIn(RECOVERY_TASK_IMU);
+
+	  // -------------- FIFO (ACCEL + GYRO) ------------------------------------
+	  uint8_t countRaw[2];
+	  if (imuRead(ICM20948_I2C_ADDR, ICM20948_FIFO_COUNTH, countRaw, 2) != HAL_OK) continue;
+	  uint16_t count = ((countRaw[0] & 0x1F) << 8) | countRaw[1];
+	  uint16_t samples = count / IMU_FIFO_SAMPLE_BYTES;
+	  if (samples > IMU_FIFO_MAX_SAMPLES) {
+		  // Overflowed or stalled; realign on a fresh FIFO rather than integrate a gap
+		  icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_RST, 0x1F);
+		  icmWrite(ICM20948_I2C_ADDR, ICM20948_FIFO_RST, 0x00);
+		  continue;
+	  }
+	  PROF_BEGIN(PR_GYRO);
+	  HAL_StatusTypeDef fifoRead = samples > 0 ? imuRead(ICM20948_I2C_ADDR, ICM20948_FIFO_R_W, fifo, samples * IMU_FIFO_SAMPLE_BYTES) : HAL_OK;
+	  PROF_END(PR_GYRO);
+	  if (fifoRead != HAL_OK) continue;
+
+	  // -------------- MAGNETOMETER (every other pass) ------------------------
+	  // A missed or stale read suspends the compass correction until the next good one
+	  if ((pass++ & 1) == 0) {
+		  magValid = 0;
+		  if (imuRead(AK09916_I2C_ADDR, AK09916_ST1_REG, mag, sizeof(mag)) == HAL_OK
+				  && (mag[0] & 0x01) && !(mag[8] & 0x08)) { // DRDY, no overflow (HOFL)
+			  magX = (int16_t)(mag[2] << 8 | mag[1]);
+			  magY = (int16_t)(mag[4] << 8 | mag[3]);
+			  magZ = (int16_t)(mag[6] << 8 | mag[5]);
+
+			  // AK09916 axes in the accel frame are (X, -Y, -Z). Compensate for tilt
+			  // relative to the rest attitude; level, this is atan2(magY, -magX).
+			  float mx = (float)magX, my = -(float)magY, mz = -(float)magZ;
+			  float roll = atan2f(ay, az) - roll0;
+			  float pitch = atan2f(-ax, sqrtf(ay * ay + az * az)) - pitch0;
+			  float xh = mx * cosf(pitch) + my * sinf(pitch) * sinf(roll) + mz * sinf(pitch) * cosf(roll);
+			  float yh = my * cosf(roll) - mz * sinf(roll);
+			  magHeading = atan2f(-yh, -xh) * (180.0f / M_PI);
+			  if (magHeading < 0) magHeading += 360.0f;
+			  magValid = calibSamples >= IMU_BIAS_SAMPLES;
+		  }
 	  }
 
+	  // -------------- FUSION ---------------------------------------------------
+	  // Gyro integration at the FIFO rate, bias learnt whenever the wheels are still,
+	  // and a first-order pull towards the compass heading. No deadband: slow
+	  // rotation is real rotation once the bias is out.
+	  float heading = currentAngle;
+	  const float headingIn = heading;
+	  float rate = 0.0f;
+	  uint8_t still = pidA.measured_speed == 0 && pidB.measured_speed == 0;
+	  for (uint16_t i = 0; i < samples; i++) {
+		  const uint8_t *p = &fifo[i * IMU_FIFO_SAMPLE_BYTES];
+		  // Gravity only feeds the tilt correction, so a slow low-pass is enough
+		  ax += 0.02f * ((float)(int16_t)(p[0] << 8 | p[1]) - ax);
+		  ay += 0.02f * ((float)(int16_t)(p[2] << 8 | p[3]) - ay);
+		  az += 0.02f * ((float)(int16_t)(p[4] << 8 | p[5]) - az);
+		  float raw = -(float)(int16_t)(p[10] << 8 | p[11]) / IMU_GYRO_LSB_PER_DPS; // Invert sign for correct rotation direction
+
+		  if (calibSamples < IMU_BIAS_SAMPLES) {
+			  // Robot is at rest during bring-up: average the offset and the mounting attitude
+			  calibSamples++;
+			  bias += (raw - bias) / (float)calibSamples;
+			  roll0 = atan2f(ay, az);
+			  pitch0 = atan2f(-ax, sqrtf(ay * ay + az * az));
+			  continue;
+		  }
+		  if (still && fabsf(raw - bias) < SETTLE_GYRO_DPS) bias += (raw - bias) * dt / IMU_BIAS_TAU_S;
+
+		  rate = raw - bias;
+		  heading += rate * dt;
+		  if (magValid) {
+			  float err = magHeading - heading;
+			  if (err > 180.0f) err -= 360.0f;
+			  else if (err < -180.0f) err += 360.0f;
+			  heading += err * dt / IMU_MAG_TAU_S;
+		  }
+	  }
+	  if (samples == 0 || calibSamples < IMU_BIAS_SAMPLES) continue;
+	  if (!tracking) {
+		  tracking = 1;
+		  xEventGroupSetBits(bootReady, BOOT_READY_IMU);
+	  }
 
-	  // -------------- MAGNETOMETER READINGS ------------------------------------
-      uint8_t mag_data[8]; // 6 data bytes + 2 status bytes
-      uint8_t st1;
-      uint8_t retries = 5;
-
-      // Wait for data ready (DRDY bit 0 in ST1)
-      do {
-          if (HAL_I2C_Mem_Read(&hi2c2, AK09916_I2C_ADDR, AK09916_ST1_REG, I2C_MEMADD_SIZE_8BIT, &st1, 1, 100) != HAL_OK) {
-              // Error reading ST1, break loop for this iteration
-              break;
-          }
-          if (retries-- == 0) {
-              // Data never became ready within retries, break loop
-              break;
-          }
-          osDelay(1); // Small delay before re-checking
-      } while (!(st1 & 0x01)); // Check DRDY bit (bit 0)
-
-      if (retries > 0) { // Only read magnetic data if it was ready
-          // Read 8 bytes: HXL, HXH, HYL, HYH, HZL, HZH, ST2
-          if (HAL_I2C_Mem_Read(&hi2c2, AK09916_I2C_ADDR, AK09916_HXL_REG, I2C_MEMADD_SIZE_8BIT, mag_data, 8, 100) != HAL_OK) {
-              // Error reading magnetic data
-          } else {
-              // Combine bytes into 16-bit values (little-endian)
-              magX = (int16_t)(mag_data[1] << 8 | mag_data[0]);
-              magY = (int16_t)(mag_data[3] << 8 | mag_data[2]);
-              magZ = (int16_t)(mag_data[5] << 8 | mag_data[4]);
-
-              // Check ST2 register (mag_data[7] contains ST2) for overflow (HOFL bit 3)
-              if (mag_data[7] & 0x08) {
-                  // Magnetic sensor overflow has occurred.
-              }
-          }
-      }
-
-    // --- MAGNETOMETER YAW CALCULATION ---
-    // Convert raw magX, magY to heading. Requires calibration for best results.
-    // For now, a simple atan2 is used.
-    // Ensure to account for sensor orientation on the board relative to robot's forward.
-    // E.g., if +X is forward and +Y is left on the sensor, and robot +X is forward, +Y is left,
-    // then atan2(magY, magX) might give heading relative to sensor X-axis.
-    // Adjust based on how sensor is mounted.
-    mag_heading_rad = atan2f((float)magY, (float)-magX); // in radians
-    float mag_heading_deg = mag_heading_rad * (180.0f / M_PI); // Convert to degrees
-
-    // Normalize to 0-360 degrees
-    if (mag_heading_deg < 0) mag_heading_deg += 360.0f;
-
-
-    // --- COMPLEMENTARY FILTER FOR YAW ---
-    // dt_sec is already calculated at the beginning of the loop
-
-    if (dt_sec > 0) {
-        // Integrate gyro (angular velocity * time)
-        float gyro_angle_change = gyro_z_dps_calibrated * dt_sec;
-        float gyro_integrated_angle = currentAngle + gyro_angle_change; // currentAngle is our current best estimate
-
-        // Normalize mag_heading_deg to be close to gyro_integrated_angle for smooth blending
-        // This is important to avoid large jumps if mag_heading_deg crosses 0/360 boundary
-        float angle_diff = mag_heading_deg - gyro_integrated_angle;
-        if (angle_diff > 180.0f) angle_diff -= 360.0f;
-        if (angle_diff < -180.0f) angle_diff += 360.0f;
-        mag_heading_deg = gyro_integrated_angle + angle_diff;
-
-
-        // Complementary filter equation:
-        // long-term stability from magnetometer, short-term dynamics from gyroscope
-        complementary_filter_angle = COMPLEMENTARY_FILTER_ALPHA * mag_heading_deg + (1.0f - COMPLEMENTARY_FILTER_ALPHA) * gyro_integrated_angle;
-
-        // Normalize the final angle to 0-360
-        // (This assumes we want the output angle to be within 0-360 range for target comparison)
-        if (complementary_filter_angle >= 360.0f) complementary_filter_angle -= 360.0f;
-        if (complementary_filter_angle < 0.0f) complementary_filter_angle += 360.0f;
-
-        // Update currentAngle with the fused estimate
-        currentAngle = complementary_filter_angle;
-    }
-    // for debugging, angle seems to be stalling
-//    sprintf((char*)buf1,"gyro_z_raw: %.1f deg\n", gyro_z_raw);
-//	HAL_UART_Transmit(&huart3,buf1,strlen(buf1),0xFFFF);
-//	sprintf((char*)buf2,"mag_heading_deg:%.1f deg\n", mag_heading_deg);
-//	HAL_UART_Transmit(&huart3,buf2,strlen(buf2),0xFFFF);
-//	sprintf((char*)buf3,"gyro_z_dps_calibrated:%.1f\n", gyro_z_dps_calibrated);
-//	HAL_UART_Transmit(&huart3,buf3,strlen(buf3),0xFFFF);
-//	sprintf((char*)buf4,"complementary_filter_angle:%.1f\n", complementary_filter_angle);
-//	HAL_UART_Transmit(&huart3,buf4,strlen(buf4),0xFFFF);
-
-//   static uint32_t lastReadIMUPrintTime = 0;
-//   if (HAL_GetTick() - lastReadIMUPrintTime > 500) { // Print every 500ms
-//	   char debug_msg[150]; // Increased buffer size for multiple floats
-//	   int len = snprintf(debug_msg, sizeof(debug_msg),
-//	   "GZ_DPS:%.1f MAG_HDG:%.1f CFLT:%.1f CA:%.1f\r\n",
-//	   gyro_z_dps_calibrated, mag_heading_deg, complementary_filter_angle, currentAngle);
-//	   HAL_UART_Transmit(&huart3, (uint8_t*)debug_msg, len, HAL_MAX_DELAY);
-//	   lastReadIMUPrintTime = HAL_GetTick();
-//   }
-
-	osDelay(10); // Maintain the loop delay
+	  // -------------- ODOMETRY ---------------------------------------------------
+	  // Wheel B counts down going forward. The heading change is taken before the
+	  // wrap below; it grows clockwise, the pose's theta counter-clockwise.
+	  int32_t posA = encoderPosition(&encoderA), posB = encoderPosition(&encoderB);
+	  float dist = 0.5f * (float)((posA - odomA) - (posB - odomB)) / ENCODER_COUNTS_PER_REVOLUTION * WHEEL_CIRCUMFERENCE_CM;
+	  odomA = posA;
+	  odomB = posB;
+	  odometryStep(dist, (headingIn - heading) * (M_PI / 180.0f), samples * dt);
+	  frontRangeStep(dist, samples * dt);
+
+	  // Normalize the final angle to 0-360 for target comparison
+	  if (heading >= 360.0f) heading -= 360.0f;
+	  if (heading < 0.0f) heading += 360.0f;
+	  gyro_z_dps = rate;
+	  complementary_filter_angle = heading;
+	  currentAngle = heading;
+	  OdometryPose pose;
+	  odometryGet(&pose);
+	  recoveryNoteImu(heading, bias, roll0, pitch0, &pose);
   }
   /* USER CODE END readIMU */
 }
@@ -4531,13 +5243,38 @@ void readIMU(void *argument)
 void rxSerial(void *argument)
 {
   /* USER CODE BEGIN rxSerial */
+  Wcet_Register(&wcetTasks[WCET_RX_SERIAL]);
   /* Infinite loop */
   for(;;)
   {
-	if(commandReady){
-		rxSerialParse();
+	// Sleep until the ISR completes a frame; one wakeup may cover several
+	ulTaskNotifyTake(pdTRUE, linkBaudFallback ? pdMS_TO_TICKS(LINK_BAUD_CONFIRM_MS) : portMAX_DELAY);
+	Wcet_Begin(&wcetTasks[WCET_RX_SERIAL]);
+	linkCheckBaud();
+	// Frames that arrived before an emergency stop are dropped unanswered
+	if(rxReady >= 0){
+		rxSerialEpoch = rxFrameEpoch[rxReady];
+		rxSerialSource = (LinkTransport)rxFrameSource[rxReady];
+		linkTakeUp(&rxFrameStamp[rxReady]);
+		if(rxSerialEpoch == estopCount){
+			PROF_BEGIN(PR_PARSE);
+			rxSerialParse((const char *)rxFrames[rxReady]);
+			PROF_END(PR_PARSE);
+		}
+		rxReady = -1;  // Hands the buffer back to the ISR
 	}
-    osDelay(1);
+	while(binTail != binHead){
+		rxSerialEpoch = binRingEpoch[binTail];
+		linkTakeUp(&binRingStamp[binTail]);
+		if(rxSerialEpoch == estopCount) rxSerialParseBinary((const uint8_t *)binRing[binTail]);
+		binTail = (binTail + 1) % BIN_RING_SIZE;
+	}
+	if(binRouteReady){
+		rxSerialEpoch = binRouteEpoch;
+		if(rxSerialEpoch == estopCount) rxSerialParseRoute((const uint8_t *)binRoute);
+		binRouteReady = 0; // Hands the buffer back to the ISR
+	}
+	Wcet_End(&wcetTasks[WCET_RX_SERIAL]);
   }
   /* USER CODE END rxSerial */
 }
@@ -4554,8 +5291,10 @@ void frontWheelCalibrationTask(void *argument)
   /* USER CODE BEGIN frontWheelCalibrationTask */
   /* Infinite loop */
   static uint8_t isA = 0;
+  Wcet_Register(&wcetTasks[WCET_FRONT_CALIB]);
   for(;;)
   {
+	  Wcet_Begin(&wcetTasks[WCET_FRONT_CALIB]);
 	  if(isFrontCalib){
 		  if(isA){
 			  setServoAngle(SERVO_CENTER_B);
@@ -4567,8 +5306,9 @@ void frontWheelCalibrationTask(void *argument)
 			  osDelay(SERVO_CENTER_A_PERCENTAGE);
 		  }
 	  }else{
-		  osDelay(10);
+		  ulTaskNotifyTake(pdTRUE, portMAX_DELAY); // motorForwardStart() wakes it
 	  }
+	  Wcet_End(&wcetTasks[WCET_FRONT_CALIB]);
   }
   /* USER CODE END frontWheelCalibrationTask */
 }
@@ -4583,101 +5323,37 @@ void frontWheelCalibrationTask(void *argument)
 void buzzer(void *argument)
 {
   /* USER CODE BEGIN buzzer */
-	const uint8_t melodySize = sizeof(melody) / sizeof(int);
-	const uint8_t noteCount = sizeof(zelda_hz) / sizeof(int);
-	uint8_t i = 0;
+	// Playback runs in TIM1 + DMA; this task only starts and stops songs
+	uint32_t events;
+	TONE_PLAY(startupSong);
+	Wcet_Register(&wcetTasks[WCET_BUZZER]);
   /* Infinite loop */
-		playNote(523, 100);  // C5
-	    playNote(587, 100);  // D5
-	    playNote(659, 100);  // E5
-//	    playNote(698, 200);  // F5
-//	    playNote(784, 200);  // G5
-//	    playNote(880, 200);  // A5
-//	    playNote(988, 200);  // B5
-//	    playNote(1047, 500); // C6
-//	    osDelay(1000);
-	    MotorCommand_t cmd;
-	    cmd.param1Speed = 20;
-	    cmd.param2DistAngle = 0;
-	    cmd.cmdId = 1;
-	    cmd.command = TASK2;
-	    osDelay(5000);
-//	    xQueueSend(motorCommandQueue, &cmd, pdMS_TO_TICKS(100));
   for(;;)
   {
-
-	  osDelay(1000);
-//	  HAL_GPIO_TogglePin(LED3_GPIO_Port, LED3_Pin);
-//	  playNote(523, 200);
-	  continue;
-
-	  if(music==MUTE){
-		  osDelay(500);
-	  }else if(music==BGM){
-		  if(i==melodySize){
-			  i = 0;
-			  osDelay(1000);
-		  }
-	      playNote(melody[i], melody_durations[i]);
-	      i++;
-	  }else if(music==CAPTURE){
-		  osDelay(50);
-		  for(uint16_t i = 0; i < noteCount; i++) {
-		  	    playNote(zelda_hz[i], zelda_durations[i]);
-		  }
-		  music=BGM;
-		  osDelay(50);
-	  }else if(music==DONE){
-		  osDelay(50);
-		  playNote(1047, 150); // C6
-		  playNote(988, 150);  // B5
-		  playNote(880, 150);  // A5
-		  playNote(784, 150);  // G5
-		  playNote(698, 150);  // F5
-		  playNote(659, 150);  // E5
-		  playNote(587, 150);  // D5
-		  playNote(523, 500);  // C5
-		  music=MUTE;
-	  }else{
-		  osDelay(500);
+	  Wcet_End(&wcetTasks[WCET_BUZZER]);
+	  xTaskNotifyWait(0, BUZZER_EVT_SONG | BUZZER_EVT_DONE, &events, portMAX_DELAY);
+	  Wcet_Begin(&wcetTasks[WCET_BUZZER]);
+	  if(!(events & BUZZER_EVT_SONG)){
+		  // A song that was cut short can still report; ignore anything but the current one
+		  if(HAL_DMA_GetState(htim1.hdma[TIM_DMA_ID_UPDATE]) == HAL_DMA_STATE_BUSY) continue;
+		  toneStop();
+		  if(music == CAPTURE) music = BGM; // Back to the melody after the jingle
+		  else if(music == DONE) music = MUTE;
+	  }
+	  if(!BUZZER_MUSIC || music == MUTE){
+		  toneStop();
+	  }else if(music == BGM){
+		  TONE_PLAY(melodySong);
+	  }else if(music == CAPTURE){
+		  TONE_PLAY(zeldaSong);
+	  }else if(music == DONE){
+		  TONE_PLAY(doneSong);
 	  }
   }
   /* USER CODE END buzzer */
 }
 
 
-/* USER CODE BEGIN Header_irSensor */
-/**
-* @brief Function implementing the irSensorTask thread.
-* @param argument: Not used
-* @retval None
-*/
-/* USER CODE END Header_irSensor */
-void irSensor(void *argument)
-{
-  /* USER CODE BEGIN irSensor */
-  static uint8_t leftPrev  = 0;
-  static uint8_t rightPrev = 0;
-  IR_Sensors_Init();
-  leftPrev  = IR_LeftDetected();
-  rightPrev = IR_RightDetected();
-  /* Infinite loop */
-  for(;;)
-  {
-	  leftNow = IR_LeftDetected();
-	  rightNow = IR_RightDetected();
-	  if (leftNow != leftPrev || rightNow != rightPrev){
-	  	  //	OLED_PrintStatus(leftNow, rightNow);  // instant flip: DETECTED/CLEAR
-	  	  		leftPrev  = leftNow;
-	  	  		rightPrev = rightNow;
-	  }
-	  	  //	sprintf(buf4, "left detected: %d\0", leftNow);
-
-	  	  	// optional: small delay so we don’t spin at 100% CPU
-	  osDelay(50);
-  }
-  /* USER CODE END irSensor */
-}
 
 /**
   * @brief  Period elapsed callback in non blocking mode
@@ -4690,14 +5366,42 @@ void irSensor(void *argument)
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
 {
   /* USER CODE BEGIN Callback 0 */
-
+  uint32_t start = DWT->CYCCNT;
   /* USER CODE END Callback 0 */
   if (htim->Instance == TIM6)
   {
     HAL_IncTick();
   }
   /* USER CODE BEGIN Callback 1 */
-
+  if (htim->Instance == TIM6)
+  {
+    Wcet_Isr(&wcetIsrs[WCET_ISR_HAL_TICK], start);
+  }
+  else if (htim->Instance == TIM2)
+  {
+    encoderOverflow(&encoderA);
+  }
+  else if (htim->Instance == TIM3)
+  {
+    encoderOverflow(&encoderB);
+  }
+  else if (htim->Instance == TIM7)
+  {
+#if PROF_ENABLE
+    Prof_Add(&profRegions[PR_LAT_CTRL], IrqPrio_TimerLatency(TIM7, 0, ctrlCycPerCount));
+#endif
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR((TaskHandle_t)motorTaskHandle, MOTOR_EVT_TICK, eSetBits, &woken);
+    Wcet_Isr(&wcetIsrs[WCET_ISR_CTRL_TICK], start);
+    portYIELD_FROM_ISR(woken);
+  }
+  else if (htim->Instance == TIM1)
+  {
+    // Update DMA complete: the song's last step is loaded
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR((TaskHandle_t)buzzerTaskHandle, BUZZER_EVT_DONE, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+  }
   /* USER CODE END Callback 1 */
 }
 
@@ -4710,9 +5414,7 @@ void Error_Handler(void)
   /* USER CODE BEGIN Error_Handler_Debug */
   /* User can add his own implementation to report the HAL error return state */
   __disable_irq();
-  while (1)
-  {
-  }
+  recoveryFault(); // Reset now; the next boot reports the cut-short command as ERROR
   /* USER CODE END Error_Handler_Debug */
 }
 #ifdef USE_FULL_ASSERT
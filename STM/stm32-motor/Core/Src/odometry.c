@@ -0,0 +1,52 @@
+#include "odometry.h"
+
+#include <math.h>
+#include "FreeRTOS.h"
+#include "task.h"
+
+static OdometryPose pose; // Starts at the origin with zero covariance; written by the stepping task only
+
+void odometryStep(float dist, float dYaw, float dt){
+  OdometryPose next = pose; // Only this task writes pose, so no lock to read it
+
+  // Midpoint model: the chord is taken at the mean heading over the step
+  float mid = pose.theta + 0.5f * dYaw;
+  float c = cosf(mid), s = sinf(mid);
+  next.x += dist * c;
+  next.y += dist * s;
+  next.theta += dYaw;
+
+  // P = F P F^T + G Q G^T, F = d(x, y, theta)/d(x, y, theta), G = d(x, y, theta)/d(dist, dYaw)
+  const float F[3][3] = {{1.0f, 0.0f, -dist * s}, {0.0f, 1.0f, dist * c}, {0.0f, 0.0f, 1.0f}};
+  const float G[3][2] = {{c, -0.5f * dist * s}, {s, 0.5f * dist * c}, {0.0f, 1.0f}};
+  const float q[2] = {ODOM_DIST_VAR_PER_CM * fabsf(dist),
+                      ODOM_YAW_VAR_PER_RAD * fabsf(dYaw) + ODOM_YAW_VAR_PER_S * dt};
+  float FP[3][3];
+  for(int i = 0; i < 3; i++){
+    for(int j = 0; j < 3; j++){
+      FP[i][j] = F[i][0] * pose.P[0][j] + F[i][1] * pose.P[1][j] + F[i][2] * pose.P[2][j];
+    }
+  }
+  for(int i = 0; i < 3; i++){
+    for(int j = 0; j < 3; j++){
+      next.P[i][j] = FP[i][0] * F[j][0] + FP[i][1] * F[j][1] + FP[i][2] * F[j][2]
+                   + G[i][0] * q[0] * G[j][0] + G[i][1] * q[1] * G[j][1];
+    }
+  }
+
+  taskENTER_CRITICAL();
+  pose = next;
+  taskEXIT_CRITICAL();
+}
+
+void odometryGet(OdometryPose *out){
+  taskENTER_CRITICAL();
+  *out = pose;
+  taskEXIT_CRITICAL();
+}
+
+void odometrySet(const OdometryPose *in){
+  taskENTER_CRITICAL();
+  pose = *in;
+  taskEXIT_CRITICAL();
+}
@@ -0,0 +1,112 @@
+#include "recovery.h"
+
+#include "stm32f4xx_hal.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#define RECOVERY_MAGIC 0x52430002u // "RC", layout version 2
+
+// Backup SRAM keeps its contents across every reset but a power cycle (there is
+// no VBAT battery on this board). After a power cycle it holds noise, which the
+// magic word and the reset flags reject.
+static volatile RecoveryRecord *const live = (volatile RecoveryRecord *)BKPSRAM_BASE;
+static RecoveryRecord lastRun;
+static uint8_t lastRunValid;
+static RecoveryCause cause;
+
+static uint32_t checkedIn; // Tasks seen since the last refresh
+static uint32_t watched;   // Tasks seen at all
+
+void recoveryInit(void){
+  __HAL_RCC_PWR_CLK_ENABLE();
+  HAL_PWR_EnableBkUpAccess();
+  __HAL_RCC_BKPSRAM_CLK_ENABLE();
+
+  uint32_t csr = RCC->CSR;
+  RCC->CSR |= RCC_CSR_RMVF;
+  lastRun = *(const RecoveryRecord *)live;
+  lastRunValid = lastRun.magic == RECOVERY_MAGIC && !(csr & (RCC_CSR_PORRSTF | RCC_CSR_BORRSTF));
+  if(csr & RCC_CSR_IWDGRSTF) cause = RECOVERY_WATCHDOG;
+  else if((csr & RCC_CSR_SFTRSTF) && lastRun.fault) cause = RECOVERY_ERROR;
+  else cause = RECOVERY_BUTTON;
+
+  // The IMU, pose and link state carry over until this run writes its own
+  RecoveryRecord fresh = {0};
+  if(lastRunValid) fresh = lastRun;
+  fresh.magic = RECOVERY_MAGIC;
+  fresh.cmdId = 0;
+  fresh.remaining = 0.0f; // Idle: nothing of cmdId 0 left to run
+  fresh.fault = 0;
+  *(RecoveryRecord *)live = fresh;
+}
+
+const RecoveryRecord *recoveryLastRun(void){
+  return lastRunValid ? &lastRun : NULL;
+}
+
+RecoveryCause recoveryCause(void){
+  return cause;
+}
+
+const char *recoveryCauseName(void){
+  static const char *const names[] = {"WATCHDOG", "ERROR", "BUTTON"};
+  return names[cause];
+}
+
+void recoveryWatchdogStart(void){
+  DBGMCU->APB1FZ |= DBGMCU_APB1_FZ_DBG_IWDG_STOP; // A debugger halt is not a hang
+  IWDG->KR = 0xCCCCu;                     // Start; this also starts the LSI
+  IWDG->KR = 0x5555u;                     // Unlock PR and RLR
+  IWDG->PR = IWDG_PR_PR_1 | IWDG_PR_PR_0; // /32: ~1 count per ms from the 32 kHz LSI
+  IWDG->RLR = RECOVERY_WDG_MS;
+  while(IWDG->SR){}                       // Both written through
+  IWDG->KR = 0xAAAAu;
+}
+
+void recoveryCheckIn(uint32_t task){
+  taskENTER_CRITICAL();
+  checkedIn |= task;
+  watched |= task;
+  taskEXIT_CRITICAL();
+}
+
+void recoverySupervise(void){
+  taskENTER_CRITICAL();
+  uint8_t alive = (checkedIn & watched) == watched;
+  if(alive) checkedIn = 0;
+  taskEXIT_CRITICAL();
+  if(alive) IWDG->KR = 0xAAAAu;
+}
+
+void recoveryNoteCommand(uint32_t cmdId, float remaining){
+  live->remaining = remaining;
+  live->cmdId = cmdId;
+}
+
+void recoveryNoteRemaining(float remaining){
+  live->remaining = remaining;
+}
+
+void recoveryNoteImu(float heading, float gyroBias, float roll0, float pitch0, const OdometryPose *pose){
+  live->heading = heading;
+  live->gyroBias = gyroBias;
+  live->roll0 = roll0;
+  live->pitch0 = pitch0;
+  *(OdometryPose *)&live->pose = *pose;
+  live->imuValid = 1;
+}
+
+void recoveryNoteLinkBaud(uint32_t baud){
+  live->linkBaud = baud;
+}
+
+uint32_t recoveryCommand(float *remaining){
+  *remaining = live->remaining;
+  return live->cmdId;
+}
+
+void recoveryFault(void){
+  live->fault = 1;
+  __DSB();
+  NVIC_SystemReset();
+}
@@ -1,11 +1,16 @@
 # algorithms/commands/generator.py
-from typing import List
+from typing import List, Optional, Tuple
+from algorithms.commands import speed
+from algorithms.entities.grid import Grid
 from algorithms.utils.enums import Direction
 from algorithms.utils.types import CellState
 
 class CommandGenerator:
-    def generate_commands(self, path: List[CellState]) -> List[str]:
+    def generate_commands(self, path: List[CellState], append_fin: bool = True,
+                          grid: Optional[Grid] = None) -> List[str]:
+        # With a grid, moves and turns carry their speed class (commands/speed.py)
         commands = []
+        slacks = []   # Per raw command: least slack along it, None for SP/FIN
         for i in range(1, len(path)):
             prev = path[i-1]
             curr = path[i]
@@ -28,6 +33,8 @@ class CommandGenerator:
                 cmd = "FW" if is_forward else "BW"
                 # We append 10cm chunks, will compress later
                 commands.append(f"{cmd}10") 
+                if grid is not None:
+                    slacks.append(speed.slack(grid, curr.x, curr.y))
                 
             else:
                 # TURNING (90 Degree)
@@ -36,22 +43,32 @@ class CommandGenerator:
                 
                 diff = (int(curr.direction) - int(prev.direction)) % 8
                 
+                turns = 0
                 if diff == 2: # Right Turn (0->2, 2->4...)
-                    commands.append("FR90")
+                    commands.append("FR90"); turns = 1
                 elif diff == 6: # Left Turn (0->6, 6->4...)
-                    commands.append("FL90")
+                    commands.append("FL90"); turns = 1
                 elif diff == 4: # 180 Turn (Rare)
                     commands.append("FR90")
-                    commands.append("FR90")
+                    commands.append("FR90"); turns = 2
+                if grid is not None:
+                    slacks.extend([speed.turn_slack(grid, prev, curr)] * turns)
             
             # SNAPSHOT
             if curr.screenshot_id != -1:
-                commands.append(f"SP{curr.screenshot_id}")
+                # Back to back, so the RPi takes them in one stop and one frame
+                for sid in [curr.screenshot_id] + curr.shared_ids:
+                    commands.append(f"SP{sid}")
+                    if grid is not None:
+                        slacks.append(None)
                 
-        commands.append("FIN")
-        return self.compress_commands(commands)
+        if append_fin:
+            commands.append("FIN")
+            if grid is not None:
+                slacks.append(None)
+        return self.compress_commands(commands, slacks if grid is not None else None)
 
-    def compress_commands(self, commands: List[str]) -> List[str]:
+    def compress_commands(self, commands: List[str], slacks: Optional[List[Optional[int]]] = None) -> List[str]:
         # Same as your existing logic, but robust for FW/BW
         compressed = []
         if not commands: return []
@@ -65,43 +82,81 @@ class CommandGenerator:
                 return c[:2], int(c[2:])
             return c, 0
 
+        # Class suffix of a flushed move or turn; none without slacks
+        def cls(c, least):
+            if slacks is None or least is None:
+                return ""
+            return speed.straight_class(least, curr_val) if c in ["FW", "BW"] else speed.turn_class(least)
+
+        def flush(i):
+            c, _ = parse(commands[i])
+            if c in ["FW", "BW"]:
+                suffix = cls(c, run_slack)
+                # Split into 90 max
+                val = curr_val
+                while val > 90:
+                    compressed.append(f"{c}90{suffix}")
+                    val -= 90
+                if val > 0:
+                    compressed.append(f"{c}{val:02d}{suffix}")
+            else:
+                compressed.append(commands[i] + cls(c[:2], slacks[i] if slacks is not None else None))
+
+        run_slack = None
         for i in range(len(commands)):
             cmd = commands[i]
             type_str, val = parse(cmd)
+            slack = slacks[i] if slacks is not None else None
             
             # Start of list
             if i == 0:
                 curr_val = val
+                run_slack = slack
                 continue
             
             prev_type, _ = parse(commands[i-1])
             
             if type_str == prev_type and val > 0: # Mergeable
                 curr_val += val
+                run_slack = slack if run_slack is None else min(run_slack, slack)
             else:
                 # Flush previous
-                prev_real_type, _ = parse(commands[i-1])
-                if prev_real_type in ["FW", "BW"]:
-                    # Split into 90 max
-                    while curr_val > 90:
-                        compressed.append(f"{prev_real_type}90")
-                        curr_val -= 90
-                    if curr_val > 0:
-                        compressed.append(f"{prev_real_type}{curr_val:02d}")
-                else:
-                    compressed.append(commands[i-1])
-                
+                flush(i - 1)
                 curr_val = val
+                run_slack = slack
                 
         # Flush last
-        last_type, _ = parse(commands[-1])
-        if last_type in ["FW", "BW"]:
-             while curr_val > 90:
-                compressed.append(f"{last_type}90")
-                curr_val -= 90
-             if curr_val > 0:
-                compressed.append(f"{last_type}{curr_val:02d}")
-        else:
-            compressed.append(commands[-1])
+        flush(len(commands) - 1)
             
-        return compressed
\ No newline at end of file
+        return compressed
+    def segment_commands(self, segments: List[Tuple[str, float]],
+                         classes: Optional[List[str]] = None) -> List[str]:
+        """
+        Commands for a hybrid_astar.py path: (FW/BW, cm) and (FL/FR, degrees)
+        segments, whole units, at most 90 per command like the lattice's.
+        Angles are rounded on the running heading, so the rounding never
+        adds up and the leg still ends on its viewing heading.  classes, from
+        speed.segment_classes(), suffixes every command of its segment.
+        """
+        commands = []
+        exact = 0.0   # Heading change so far, + left
+        sent = 0
+        for k, (kind, amount) in enumerate(segments):
+            suffix = classes[k] if classes is not None else ""
+            if kind in ("FL", "FR"):
+                exact += amount if kind == "FL" else -amount
+                value = abs(round(exact) - sent)
+                sent = round(exact)
+            else:
+                value = int(round(amount))
+            while value > 0:
+                step = min(value, 90)
+                commands.append((f"{kind}{step:02d}" if kind in ("FW", "BW") else f"{kind}{step}") + suffix)
+                value -= step
+        return commands
+
+    @staticmethod
+    def command_segments(commands: List[str]) -> List[Tuple[str, float]]:
+        """segment_commands() backwards, for pricing a lattice leg the same way."""
+        plain = [speed.split(c)[0] for c in commands]
+        return [(c[:2], float(c[2:])) for c in plain if c[:2] in ("FW", "BW", "FL", "FR")]
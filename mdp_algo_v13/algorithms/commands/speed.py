@@ -0,0 +1,94 @@
+# algorithms/commands/speed.py
+#
+# Speed classes for the route's commands (consts.py, section 6).  The robot
+# used to run every move at one speed, the one that is safe next to an
+# obstacle.  Here each command is classed by the slack along it: tight
+# manoeuvres next to a safety box slow, long straights through open floor
+# fast, everything else normal.  The RPi maps a class to its drive speed and
+# the MDP firmware to a row of its gain schedule.
+#
+# The arena's padding does not count: the robot drives along it at the start
+# of nearly every route, straight and under heading hold, and a wall is not
+# what an off-course move runs into.  A straight is checked at every cell it
+# enters; the one it sets off from does not count, as the robot is only
+# creeping away from it.  A turn is checked at its start, its end and the
+# middle of its arc, where it bulges out towards the outside corner.
+# RPI/planner.c classes its routes the same way.
+
+import math
+from typing import List, Tuple
+
+from algorithms.entities.grid import Grid
+from algorithms.utils.consts import (
+    EXPANDED_CELL, FAST_MIN_CM, FAST_SLACK, GRID_SIZE, SLOW_SLACK
+)
+from algorithms.utils.types import CellState
+
+SLOW   = "S"
+NORMAL = ""
+FAST   = "F"
+
+SLACK_NONE = 2 * GRID_SIZE   # No obstacle at all
+
+# (dx, dy) a cell step forward, per lattice heading
+_HEADING = {0: (0, 1), 2: (1, 0), 4: (0, -1), 6: (-1, 0)}
+
+
+def _round(v: float) -> int:
+    # Half away from zero, as lround() in planner.c
+    return int(math.floor(abs(v) + 0.5)) * (1 if v >= 0 else -1)
+
+
+def slack(grid: Grid, x: int, y: int) -> int:
+    """Free cells (Chebyshev) from cell (x, y) to the nearest obstacle's box."""
+    s = SLACK_NONE
+    for obs in grid.obstacles:
+        s = min(s, max(abs(obs.x - x), abs(obs.y - y)) - EXPANDED_CELL - 1)
+    return s
+
+
+def turn_slack(grid: Grid, prev: CellState, curr: CellState) -> int:
+    """Least slack of a turn from prev to curr: at both ends and mid-arc."""
+    hx, hy = _HEADING[int(prev.direction)]
+    dx, dy = curr.x - prev.x, curr.y - prev.y
+    forward = dx * hx + dy * hy
+    side_x, side_y = dx - forward * hx, dy - forward * hy
+    # 45 degrees round an arc of radius r: r / sqrt(2) on, r (1 - 1 / sqrt(2)) across
+    mid_x = prev.x + _round(forward * hx / math.sqrt(2)) + _round(side_x * (1 - 1 / math.sqrt(2)))
+    mid_y = prev.y + _round(forward * hy / math.sqrt(2)) + _round(side_y * (1 - 1 / math.sqrt(2)))
+    return min(slack(grid, prev.x, prev.y), slack(grid, mid_x, mid_y), slack(grid, curr.x, curr.y))
+
+
+def straight_class(least_slack: int, cm: float) -> str:
+    if least_slack <= SLOW_SLACK:
+        return SLOW
+    if least_slack >= FAST_SLACK and cm >= FAST_MIN_CM:
+        return FAST
+    return NORMAL
+
+
+def turn_class(least_slack: int) -> str:
+    # Never fast: the turn primitives are measured at the normal speed
+    return SLOW if least_slack <= SLOW_SLACK else NORMAL
+
+
+def segment_classes(grid: Grid, segments, cells: List[List[Tuple[int, int]]]) -> List[str]:
+    """
+    Class of each hybrid_astar.py (kind, amount) segment, given the cells its
+    poses round to (HybridAStar.segment_cells()).
+    """
+    classes = []
+    for (kind, amount), seg_cells in zip(segments, cells):
+        if kind in ("FL", "FR"):
+            classes.append(turn_class(min(slack(grid, x, y) for x, y in seg_cells)))
+        else:
+            entered = seg_cells[1:] or seg_cells
+            classes.append(straight_class(min(slack(grid, x, y) for x, y in entered), amount))
+    return classes
+
+
+def split(command: str) -> Tuple[str, str]:
+    """("FW90", "F") for "FW90F"; commands without a class come back as they are."""
+    if command[:2] in ("FW", "BW", "FL", "FR") and command[-1:] in (SLOW, FAST):
+        return command[:-1], command[-1]
+    return command, NORMAL
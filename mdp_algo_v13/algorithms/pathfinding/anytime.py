@@ -0,0 +1,119 @@
+# algorithms/pathfinding/anytime.py
+#
+# Anytime visiting order for when the caller would rather go now than wait
+# for the exact Held-Karp answer (time_budget_ms in the /path payload).
+#
+#   1. Nearest neighbour from the start, skipping targets no leg can reach.
+#   2. Local search: insert skipped targets, then 2-opt and or-opt moves.
+#   3. Until the deadline: small arenas get the exact Held-Karp answer (it
+#      takes milliseconds there); larger ones perturb the best route with a
+#      random segment reversal and re-run the local search.
+#
+# Routes are compared like best_subset_route(): more targets first, then
+# lower cost.  Whatever is best when the deadline passes is returned.
+
+import random
+import time
+from typing import Iterator, List, Optional, Tuple
+
+import numpy as np
+
+from algorithms.pathfinding.held_karp import UNREACHABLE, best_subset_route
+
+# Held-Karp's table is 2^n x n: up to here it fits any sensible budget
+ANYTIME_EXACT_TARGETS = 10
+
+
+def _route_cost(cost_matrix: np.ndarray, route: List[int]) -> float:
+    legs = sum(cost_matrix[a][b] for a, b in zip(route, route[1:]))
+    return float(legs + cost_matrix[route[-1]][0])
+
+
+def _rank(cost_matrix: np.ndarray, route: List[int]) -> Tuple[int, float]:
+    cost = _route_cost(cost_matrix, route)
+    if len(route) == 1 or cost >= UNREACHABLE:
+        return (0, float('inf'))
+    return (-(len(route) - 1), cost)
+
+
+def _nearest_neighbour(cost_matrix: np.ndarray) -> List[int]:
+    route     = [0]
+    unvisited = set(range(1, cost_matrix.shape[0]))
+    while unvisited:
+        here = route[-1]
+        nxt  = min(unvisited, key=lambda j: cost_matrix[here][j])
+        if cost_matrix[here][nxt] >= UNREACHABLE:
+            break
+        route.append(nxt)
+        unvisited.discard(nxt)
+    return route
+
+
+def _neighbours(route: List[int], n: int) -> Iterator[List[int]]:
+    # Targets the route skips, at every position
+    for m in range(1, n + 1):
+        if m not in route:
+            for p in range(1, len(route) + 1):
+                yield route[:p] + [m] + route[p:]
+    # 2-opt: reverse route[i..j] (legs are direction-dependent, so callers
+    # re-price the whole route)
+    for i in range(1, len(route) - 1):
+        for j in range(i + 1, len(route)):
+            yield route[:i] + route[i:j + 1][::-1] + route[j + 1:]
+    # or-opt: move one target elsewhere
+    for i in range(1, len(route)):
+        rest = route[:i] + route[i + 1:]
+        for p in range(1, len(rest) + 1):
+            if p != i:
+                yield rest[:p] + [route[i]] + rest[p:]
+
+
+def _improve(cost_matrix: np.ndarray, route: List[int], deadline: float) -> List[int]:
+    """First-improvement local search until no move helps or time runs out."""
+    n    = cost_matrix.shape[0] - 1
+    best = route
+    rank = _rank(cost_matrix, best)
+
+    improved = True
+    while improved:
+        improved = False
+        for candidate in _neighbours(best, n):
+            if time.monotonic() >= deadline:
+                return best
+            candidate_rank = _rank(cost_matrix, candidate)
+            if candidate_rank < rank:
+                best, rank = candidate, candidate_rank
+                improved   = True
+                break
+
+    return best
+
+
+def anytime_route(cost_matrix: np.ndarray, deadline: float) -> Optional[Tuple[List[int], float]]:
+    """
+    Best route found by time.monotonic() deadline, in best_subset_route()'s
+    format, or None when not a single target is reachable.  The nearest
+    neighbour route is always built, even if the deadline has already passed.
+    """
+    n = cost_matrix.shape[0] - 1
+    if n <= 0:
+        return None
+
+    best = _improve(cost_matrix, _nearest_neighbour(cost_matrix), deadline)
+    rank = _rank(cost_matrix, best)
+
+    if n <= ANYTIME_EXACT_TARGETS and time.monotonic() < deadline:
+        return best_subset_route(cost_matrix)
+
+    rng = random.Random(0)
+    while time.monotonic() < deadline and len(best) > 3:
+        i, j      = sorted(rng.sample(range(1, len(best)), 2))
+        kicked    = best[:i] + best[i:j + 1][::-1] + best[j + 1:]
+        candidate = _improve(cost_matrix, kicked, deadline)
+        candidate_rank = _rank(cost_matrix, candidate)
+        if candidate_rank < rank:
+            best, rank = candidate, candidate_rank
+
+    if rank[1] == float('inf'):
+        return None
+    return best, rank[1]
@@ -1,10 +1,58 @@
 import heapq
-from typing import Dict, List, Optional, Tuple
+import os
+import threading
+from collections import OrderedDict
+from typing import Dict, Iterable, List, Optional, Tuple
 from algorithms.entities.grid import Grid
-from algorithms.utils.consts import TURN_RADIUS, TURN_COST
-from algorithms.utils.enums import Direction
+from algorithms.pathfinding import cost_model
+from algorithms.pathfinding.cost_model import CostModel
+from algorithms.pathfinding.lattice import PRIMITIVES
+from algorithms.pathfinding.reachability import blocked_mask
 from algorithms.utils.types import CellState
 
+# Finished searches shared by every solver in the process, so a retry or a
+# repeat run of the same arena skips the searches it already did.  Keyed by
+# (blocked-cell mask, move costs, start, goal): the mask is the whole layout as
+# A* sees it, and a path is only valid for the costs it was found under.  Each
+# entry is the cost and the path as indices into PRIMITIVES, one per move,
+# rebuilt from the start state on a hit; a goal with no path is kept too, as
+# an infinite cost, since proving that takes the longest search of all.  Least
+# recently used entries go first once there are MEMO_CAPACITY.
+MEMO_CAPACITY = int(os.environ.get('MDP_ASTAR_MEMO', 50000))
+_memo: "OrderedDict[tuple, Tuple[float, bytes]]" = OrderedDict()
+_memo_lock = threading.Lock()
+_memo_stats = {'hits': 0, 'misses': 0}
+
+
+def _state_key(state: CellState) -> Tuple[int, int, int]:
+    return (state.x, state.y, int(state.direction))
+
+
+def _encode_path(path: List[CellState]) -> bytes:
+    """Index of each move in its state's PRIMITIVES list (at most 6, so a byte each)."""
+    moves = bytearray()
+    for prev, nxt in zip(path, path[1:]):
+        key = _state_key(nxt)
+        moves.append(next(i for i, (s, _, _) in enumerate(PRIMITIVES[_state_key(prev)]) if _state_key(s) == key))
+    return bytes(moves)
+
+
+def _decode_path(start: CellState, moves: bytes) -> List[CellState]:
+    path = [start]
+    key = _state_key(start)
+    for i in moves:
+        nxt = PRIMITIVES[key][i][0]
+        path.append(nxt)
+        key = _state_key(nxt)
+    return path
+
+
+def memo_stats() -> Dict[str, int]:
+    """Hits, misses and entries of the process-wide memo since start-up."""
+    with _memo_lock:
+        return dict(_memo_stats, entries=len(_memo))
+
+
 class AStarNode:
     def __init__(self, state: CellState, g_cost: float, h_cost: float, parent: Optional['AStarNode'] = None):
         self.state = state
@@ -17,89 +65,142 @@ class AStarNode:
         return self.f_cost < other.f_cost
 
 class AStar:
-    def __init__(self, grid: Grid):
+    def __init__(self, grid: Grid, model: Optional[CostModel] = None):
         self.grid = grid
+        # Move prices for every search this instance runs (and caches)
+        self.model = model if model is not None else cost_model.current()
+        self.move_cost = self.model.move_cost
         self.cost_cache: Dict[Tuple[CellState, CellState], float] = {}
+        # Finished searches, so the route legs re-use what the cost matrix found
+        self.path_cache: Dict[Tuple[CellState, CellState], List[CellState]] = {}
+        self._cache_lock = threading.Lock()
+        # Cells the robot body may not touch; the grid's obstacles are fixed
+        # for the life of the solver, so this is built once
+        self.blocked = blocked_mask(grid)
+        self._layout = (self.blocked, tuple(sorted(self.move_cost.items())))
 
     def heuristic(self, current: CellState, goal: CellState) -> float:
-        return ((current.x - goal.x) ** 2 + (current.y - goal.y) ** 2) ** 0.5
+        # Obstacle-free cost-to-go over the lattice (a lower bound; ignores walls too)
+        return self.model.cost_to_go(current, goal)
 
     def get_neighbors(self, state: CellState) -> List[Tuple[CellState, float]]:
-        neighbors = []
-        x, y, d = state.x, state.y, state.direction
-        r = TURN_RADIUS # 3
-
-        # --- 1. STRAIGHT MOVEMENT ---
-        dx, dy = 0, 0
-        if d == Direction.NORTH: dy = 1
-        elif d == Direction.SOUTH: dy = -1
-        elif d == Direction.EAST: dx = 1
-        elif d == Direction.WEST: dx = -1
-        
-        for sign in [1, -1]:
-            nx, ny = x + (dx * sign), y + (dy * sign)
-            if self.grid.is_reachable(nx, ny):
-                neighbors.append((CellState(nx, ny, d), 1))
-
-        # --- 2. 90-DEGREE TURNS (CORRECTED PHYSICS) ---
-        # r = 3 (30cm)
-        # FL (Forward-Left):  Steer Left, Drive Fwd.
-        # FR (Forward-Right): Steer Right, Drive Fwd.
-        # BL (Back-Left):     Steer Left, Drive Rev. (Nose swings Right/East)
-        # BR (Back-Right):    Steer Right, Drive Rev. (Nose swings Left/West)
-        
-        def apply_turn(turn_type):
-            if turn_type == 'FL':
-                # N->W (-3,3) | E->N (3,3) | S->E (3,-3) | W->S (-3,-3)
-                return {0:(-r,r,6), 2:(r,r,0), 4:(r,-r,2), 6:(-r,-r,4)}[d]
-            
-            elif turn_type == 'FR':
-                # N->E (3,3) | E->S (3,-3) | S->W (-3,-3) | W->N (-3,3)
-                return {0:(r,r,2), 2:(r,-r,4), 4:(-r,-r,6), 6:(-r,r,0)}[d]
-            
-            elif turn_type == 'BL':
-                # Reverse Left (Backing up to the Left relative to driver)
-                # N->E (-3,-3) | E->S (-3,3) | S->W (3,3) | W->N (3,-3)
-                return {0:(-r,-r,2), 2:(-r,r,4), 4:(r,r,6), 6:(r,-r,0)}[d]
-            
-            elif turn_type == 'BR':
-                # Reverse Right (Backing up to the Right relative to driver)
-                # N->W (3,-3) | E->N (-3,-3) | S->E (-3,3) | W->S (3,3)
-                return {0:(r,-r,6), 2:(-r,-r,0), 4:(-r,r,2), 6:(r,r,4)}[d]
-
-        for turn in ['FL', 'FR', 'BL', 'BR']:
-            tdx, tdy, new_d = apply_turn(turn)
-            nx, ny = x + tdx, y + tdy
-            
-            if not self.grid.is_reachable(nx, ny, turn=True):
-                continue
-
-            # --- SWEEP CLEARANCE CHECK ---
-            # Verifies the entire swept area of the 3x3 turn arc to prevent corner clipping
-            safe = True
-            step_x = 1 if tdx > 0 else -1
-            step_y = 1 if tdy > 0 else -1
-            
-            # These points map the physical grid cells the robot body passes through
-            check_points = [
-                (step_x, 0), (0, step_y),                                                       # Entry points
-                (step_x, step_y), (2*step_x, step_y), (step_x, 2*step_y), (2*step_x, 2*step_y), # Core arc / Diagonal
-                (2*step_x, 3*step_y), (3*step_x, 2*step_y)                                      # Exit points
-            ]
-            
-            for cx, cy in check_points:
-                if not self.grid.is_reachable(x + cx, y + cy, turn=True):
-                    safe = False
-                    break
-                    
-            if not safe:
-                continue
-            
-            neighbors.append((CellState(nx, ny, Direction(new_d)), TURN_COST + r))
+        # Straight steps and the four 3x3 turn arcs, pre-built per state in
+        # lattice.PRIMITIVES and priced by the cost model; a move is legal if
+        # it sweeps no blocked cell
+        move_cost = self.move_cost
+        return [
+            (next_s, move_cost[kind])
+            for next_s, kind, swept in PRIMITIVES.get((state.x, state.y, int(state.direction)), ())
+            if not swept & self.blocked
+        ]
+
+    def store(self, start: CellState, goal: CellState, cost: float, path: List[CellState]) -> None:
+        """Record a finished search here and in the process-wide memo (thread-safe)."""
+        with self._cache_lock:
+            self.cost_cache[(start, goal)] = cost
+            self.path_cache[(start, goal)] = path
+        self._memo_put(start, goal, (cost, _encode_path(path)))
+
+    def store_unreachable(self, start: CellState, goal: CellState) -> None:
+        """Record that an exhaustive search found no path (memo only)."""
+        self._memo_put(start, goal, (float('inf'), b''))
 
-        return neighbors
+    def _memo_put(self, start: CellState, goal: CellState, entry: Tuple[float, bytes]) -> None:
+        if MEMO_CAPACITY <= 0:
+            return
+        key = (self._layout, _state_key(start), _state_key(goal))
+        with _memo_lock:
+            _memo[key] = entry
+            _memo.move_to_end(key)
+            while len(_memo) > MEMO_CAPACITY:
+                _memo.popitem(last=False)
+
+    def _recall(self, start: CellState, goal: CellState) -> Optional[List[CellState]]:
+        """
+        This instance's path, else the memo's (copied into this instance):
+        [] if the memo knows there is none, None if nothing is known.
+        """
+        with self._cache_lock:
+            path = self.path_cache.get((start, goal))
+        if path is not None or MEMO_CAPACITY <= 0:
+            return path
+        key = (self._layout, _state_key(start), _state_key(goal))
+        with _memo_lock:
+            entry = _memo.get(key)
+            if entry is None:
+                _memo_stats['misses'] += 1
+                return None
+            _memo.move_to_end(key)
+            _memo_stats['hits'] += 1
+        cost, moves = entry
+        if cost == float('inf'):
+            return []
+        path = _decode_path(start, moves)
+        with self._cache_lock:
+            self.cost_cache[(start, goal)] = cost
+            self.path_cache[(start, goal)] = path
+        return path
+
+    def cached(self, start: CellState, goal: CellState) -> Optional[List[CellState]]:
+        """
+        Copy of a previously found path, [] if there is known to be none, or
+        None.  Callers tag screenshot_id on path states, so the cached states
+        are never handed out.
+        """
+        path = self._recall(start, goal)
+        if path is None:
+            return None
+        return [CellState(s.x, s.y, s.direction) for s in path]
+
+    def search_many(self, start: CellState, goals: Iterable[CellState]) -> Dict[CellState, List[CellState]]:
+        """
+        One uniform-cost sweep from `start` that stops once every goal is
+        settled, instead of one A* per goal.  With several goals there is no
+        single heuristic to aim at, so this is Dijkstra; the costs it finds
+        are the same optimal costs search() finds.  Returns paths for the
+        reachable goals and caches them.  Goals already cached are not
+        searched for, and with all of them cached there is no sweep.
+        """
+        found: Dict[CellState, List[CellState]] = {}
+        remaining = set()
+        for goal in goals:
+            path = self._recall(start, goal)
+            if path is None:
+                remaining.add(goal)
+            elif path:
+                found[goal] = path
+        open_set = [AStarNode(start, 0, 0)]
+        closed_set = set()
+        g_scores = {start: 0}
+
+        while open_set and remaining:
+            current_node = heapq.heappop(open_set)
+            curr = current_node.state
+            if curr in closed_set: continue
+            closed_set.add(curr)
+
+            if curr in remaining:
+                remaining.discard(curr)
+                path = self._reconstruct_path(current_node)
+                self.store(start, curr, current_node.g_cost, path)
+                found[curr] = path
+
+            for next_s, cost in self.get_neighbors(curr):
+                if next_s in closed_set: continue
+                tentative_g = g_scores[curr] + cost
+                if next_s not in g_scores or tentative_g < g_scores[next_s]:
+                    g_scores[next_s] = tentative_g
+                    heapq.heappush(open_set, AStarNode(next_s, tentative_g, 0, current_node))
+
+        for goal in remaining:
+            self.store_unreachable(start, goal)
+        return found
 
     def search(self, start: CellState, goal: CellState) -> List[CellState]:
+        path = self.cached(start, goal)
+        if path is not None:
+            return path
+
         open_set = []
         heapq.heappush(open_set, AStarNode(start, 0, self.heuristic(start, goal)))
         closed_set = set()
@@ -110,8 +211,9 @@ class AStar:
             curr = current_node.state
             
             if curr.x == goal.x and curr.y == goal.y and curr.direction == goal.direction:
-                self.cost_cache[(start, goal)] = current_node.g_cost
-                return self._reconstruct_path(current_node)
+                path = self._reconstruct_path(current_node)
+                self.store(start, goal, current_node.g_cost, path)
+                return self.cached(start, goal)
             
             if curr in closed_set: continue
             closed_set.add(curr)
@@ -120,9 +222,12 @@ class AStar:
                 if next_s in closed_set: continue
                 tentative_g = g_scores[curr] + cost
                 if next_s not in g_scores or tentative_g < g_scores[next_s]:
+                    h_cost = self.heuristic(next_s, goal)
+                    if h_cost == float('inf'): continue # Cannot reach the goal even on an empty arena
                     g_scores[next_s] = tentative_g
-                    heapq.heappush(open_set, AStarNode(next_s, tentative_g, self.heuristic(next_s, goal), current_node))
-                    
+                    heapq.heappush(open_set, AStarNode(next_s, tentative_g, h_cost, current_node))
+
+        self.store_unreachable(start, goal)
         return []
 
     def _reconstruct_path(self, node):
@@ -17,11 +17,18 @@ from algorithms.entities.grid import Grid
 from algorithms.entities.obstacle import Obstacle
 from algorithms.entities.robot import Robot
 from algorithms.pathfinding.astar import AStar
+from algorithms.pathfinding.incremental import IncrementalPlanner
 from algorithms.commands.generator import CommandGenerator
 from algorithms.utils.enums import Direction
 from algorithms.utils.types import CellState
 
 
+# Goal trees survive between bullseye requests: later reroutes in the same
+# run mostly re-visit the same viewing positions from a new pose, often with
+# fewer obstacles left, which LPA* repairs instead of re-planning.
+_reroute_planner = IncrementalPlanner()
+
+
 class BullseyeHandler:
     """
     Two-phase bullseye recovery orchestrator.
@@ -110,7 +117,7 @@ class BullseyeHandler:
 
         # HamiltonianSolver gets self.grid (full collision grid).
         # target_obstacles tells it which obstacles to plan SNAP visits for.
-        solver = HamiltonianSolver(self.grid, new_robot)
+        solver = HamiltonianSolver(self.grid, new_robot, planner=_reroute_planner)
         permutation, total_cost = solver.find_optimal_order(
             target_obstacles=visit_obstacles
         )
@@ -122,10 +129,7 @@ class BullseyeHandler:
 
         return {
             "commands": raw_commands,
-            "path": [
-                {"x": s.x, "y": s.y, "d": int(s.direction), "s": s.screenshot_id}
-                for s in full_path
-            ],
+            "path": [p for s in full_path for p in s.path_dicts()],
             "distance": total_cost,
         }
 
@@ -226,10 +230,7 @@ class BullseyeHandler:
         )
 
         # ---- Stitch phase1 + phase2 into one unified path ----
-        p1_dicts = [
-            {"x": s.x, "y": s.y, "d": int(s.direction), "s": s.screenshot_id}
-            for s in p1_path_seg
-        ]
+        p1_dicts = [p for s in p1_path_seg for p in s.path_dicts()]
         p2_path = p2_result["path"]
 
         # Avoid duplicating the join-point waypoint
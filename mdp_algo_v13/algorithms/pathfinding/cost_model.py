@@ -0,0 +1,154 @@
+# algorithms/pathfinding/cost_model.py
+#
+# What each lattice move costs.  Without a model file this is the original
+# cell metric (1 per straight cell, TURN_COST + TURN_RADIUS per turn).  With
+# one, moves cost estimated seconds, fitted on the RPi from how long each
+# STM command actually took (latency_write_cost_model() in RPI/latency_stats.c):
+#
+#   {"version": 1, "commands": {"FW": {"n": .., "per_cmd_s": a, "per_unit_s": b}, ..}}
+#
+# one line per STM command type (FW/BW in cm, TL/TR in degrees), so a command
+# takes a + b * value seconds including ACK round trips, brake pulses, servo
+# alignment and the firmware's command cooldown.
+#
+# The generator merges straight cells into one FW/BW command and splits runs
+# at every turn, so a route has about one more straight command than turns.
+# Straight cells therefore cost b * CELL_SIZE and each turn also carries one
+# straight command's overhead a.
+#
+# Without a model file but with a measured motion-primitive table
+# (lattice.TABLE) that times its moves, moves cost the table's seconds instead.
+# Those are the firmware's own times, without the link and the RPi, so a
+# model file is preferred when there is one.
+#
+# current() re-reads COST_MODEL_PATH when its mtime changes, so a new fit takes
+# effect on the next request without restarting the server.  Each solver
+# takes one model at construction and uses it for the whole request.
+
+import json
+import os
+import threading
+from typing import Dict, Optional, Tuple
+
+from algorithms.pathfinding import lattice
+from algorithms.pathfinding.lattice import build_cost_to_go
+from algorithms.utils.consts import CELL_SIZE, TURN_COST, TURN_RADIUS
+from algorithms.utils.types import CellState
+
+COST_MODEL_PATH = os.environ.get(
+    'MDP_COST_MODEL',
+    os.path.join(os.path.dirname(__file__), '..', '..', 'cost_model.json'),
+)
+
+# Heuristic tables, one per distinct set of move costs (built on first use)
+_tables: Dict[Tuple[float, ...], Dict[int, Dict[Tuple[int, int, int], float]]] = {}
+_tables_lock = threading.Lock()
+
+
+class CostModel:
+    """
+    move_cost: cost of one lattice move by the command that drives it
+               ('FW', 'BW', 'FL', 'FR'; see lattice.MOVE_KINDS).
+    scale:     cost of one forward cell, for converting the cell-unit viewing
+               penalties (Obstacle.get_viewing_positions) into this model's units.
+    """
+
+    def __init__(self, move_cost: Dict[str, float], scale: float = 1.0, source: str = 'default'):
+        self.move_cost = move_cost
+        self.scale     = scale
+        self.source    = source
+
+    def _cost_to_go(self) -> Dict[int, Dict[Tuple[int, int, int], float]]:
+        key = tuple(self.move_cost[kind] for kind in sorted(self.move_cost))
+        with _tables_lock:
+            table = _tables.get(key)
+            if table is None:
+                table = _tables[key] = build_cost_to_go(self.move_cost)
+        return table
+
+    def cost_to_go(self, state: CellState, goal: CellState) -> float:
+        """Obstacle-free cost from state to goal (inf if no sequence of moves exists)."""
+        return self._cost_to_go()[int(goal.direction)].get(
+            (state.x - goal.x, state.y - goal.y, int(state.direction)), float('inf')
+        )
+
+
+DEFAULT_MODEL = CostModel({'FW': 1, 'BW': 1, 'FL': TURN_COST + TURN_RADIUS, 'FR': TURN_COST + TURN_RADIUS})
+
+
+def _command_seconds(commands: dict, name: str, fallback: str, value: float) -> Tuple[float, float]:
+    """(per-command seconds, seconds for `value` units) for one STM command type."""
+    fit = commands.get(name) or commands[fallback]
+    return float(fit['per_cmd_s']), float(fit['per_cmd_s']) + float(fit['per_unit_s']) * value
+
+
+def load(path: str) -> CostModel:
+    """Model from a latency_write_cost_model() file; raises on a malformed one."""
+    with open(path) as f:
+        commands = json.load(f)['commands']
+
+    fw_cmd, _ = _command_seconds(commands, 'FW', 'BW', 0)
+    bw_cmd, _ = _command_seconds(commands, 'BW', 'FW', 0)
+    fw_cell   = float((commands.get('FW') or commands['BW'])['per_unit_s']) * CELL_SIZE
+    bw_cell   = float((commands.get('BW') or commands['FW'])['per_unit_s']) * CELL_SIZE
+    _, left   = _command_seconds(commands, 'TL', 'TR', 90)
+    _, right  = _command_seconds(commands, 'TR', 'TL', 90)
+    straight  = (fw_cmd + bw_cmd) / 2
+
+    if min(fw_cell, bw_cell) <= 0 or min(left, right) <= 0:
+        raise ValueError('non-positive move time')
+    return CostModel(
+        {'FW': fw_cell, 'BW': bw_cell, 'FL': left + straight, 'FR': right + straight},
+        scale=fw_cell,
+        source=path,
+    )
+
+
+def from_primitives(primitives: Dict[str, dict], source: str) -> Optional[CostModel]:
+    """Model from a motion-primitive table's durations; None unless it times every move."""
+    if not all(name in primitives for name in ('FW', 'BW', 'FL90', 'FR90')):
+        return None
+    fw, bw  = primitives['FW'], primitives['BW']
+    fw_cell = float(fw['per_cm_s']) * CELL_SIZE
+    bw_cell = float(bw['per_cm_s']) * CELL_SIZE
+    straight = (float(fw['per_cmd_s']) + float(bw['per_cmd_s'])) / 2
+    left     = float(primitives['FL90']['duration_s'])
+    right    = float(primitives['FR90']['duration_s'])
+    if min(fw_cell, bw_cell, left, right) <= 0:
+        return None
+    return CostModel(
+        {'FW': fw_cell, 'BW': bw_cell, 'FL': left + straight, 'FR': right + straight},
+        scale=fw_cell,
+        source=source,
+    )
+
+
+# The model without a model file
+FALLBACK_MODEL = (lattice.TABLE is not None
+                  and from_primitives(lattice.TABLE, lattice.MOTION_PRIMITIVES_PATH)) or DEFAULT_MODEL
+
+_current       = FALLBACK_MODEL
+_current_mtime: Optional[float] = None
+_current_lock  = threading.Lock()
+
+
+def current() -> CostModel:
+    """The model in COST_MODEL_PATH, re-read if the file changed; FALLBACK_MODEL without one."""
+    global _current, _current_mtime
+    try:
+        mtime = os.stat(COST_MODEL_PATH).st_mtime
+    except OSError:
+        mtime = None
+
+    with _current_lock:
+        if mtime != _current_mtime:
+            _current_mtime = mtime
+            if mtime is None:
+                _current = FALLBACK_MODEL
+            else:
+                try:
+                    _current = load(COST_MODEL_PATH)
+                    print(f"Cost model reloaded from {COST_MODEL_PATH}: {_current.move_cost}")
+                except (OSError, ValueError, KeyError, TypeError) as e:
+                    print(f"Ignoring cost model {COST_MODEL_PATH} ({e}); keeping {_current.source}")
+        return _current
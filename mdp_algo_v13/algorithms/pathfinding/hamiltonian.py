@@ -1,15 +1,55 @@
-import itertools
+import os
+import time
+from concurrent.futures import ProcessPoolExecutor
 import numpy as np
-from python_tsp.exact import solve_tsp_dynamic_programming
-from typing import List, Optional, Tuple
+from typing import Dict, Iterator, List, Optional, Tuple
 from algorithms.entities.grid import Grid
 from algorithms.entities.robot import Robot
 from algorithms.entities.obstacle import Obstacle
 from algorithms.pathfinding.astar import AStar
+from algorithms.pathfinding.anytime import anytime_route
+from algorithms.pathfinding import cost_model
+from algorithms.pathfinding.cost_model import CostModel
+from algorithms.pathfinding.held_karp import best_cover_route, best_subset_route
+from algorithms.pathfinding.incremental import IncrementalPlanner
+from algorithms.pathfinding.reachability import Reachability
+from algorithms.pathfinding.shared_views import shared_viewing_positions
+from algorithms.utils.consts import COVER_MAX_TARGETS
 from algorithms.utils.types import CellState
 from algorithms.utils.enums import Direction
 
 
+# Cost-matrix rows are independent A* sweeps, so they run one per core.  The
+# pool is created on first use and kept for the life of the server.  Callers
+# that already run one solver per core (algorithms/tests/benchmark.py) set
+# ROW_WORKERS = 1 to search rows in-process.
+ROW_WORKERS = os.cpu_count() or 1
+_row_pool: Optional[ProcessPoolExecutor] = None
+
+
+# Plan stops that photograph several targets at once (shared_views.py)
+SHARED_VIEWS = True
+
+
+def _get_row_pool() -> ProcessPoolExecutor:
+    global _row_pool
+    if _row_pool is None:
+        _row_pool = ProcessPoolExecutor(max_workers=ROW_WORKERS)
+    return _row_pool
+
+
+def _search_row(
+    grid: Grid,
+    model: CostModel,
+    start: CellState,
+    goals: List[CellState],
+) -> Dict[CellState, Tuple[float, List[CellState]]]:
+    """Worker: every reachable goal's (cost, path) from one source."""
+    astar = AStar(grid, model)
+    paths = astar.search_many(start, goals)
+    return {goal: (astar.cost_cache[(start, goal)], path) for goal, path in paths.items()}
+
+
 class HamiltonianSolver:
     """
     Solves the TSP ordering problem and generates the full A* path.
@@ -25,12 +65,76 @@ class HamiltonianSolver:
 
     If `target_obstacles` is None the solver behaves exactly as before,
     using self.grid.obstacles for both collision and TSP targets.
+
+    With a `planner`, the cost matrix is read from its goal-rooted LPA*
+    trees (kept across calls) instead of fresh A* sweeps; see incremental.py.
+
+    Leg costs are in the units of the cost model current when the solver is
+    built (estimated seconds once the RPi has written one; see cost_model.py).
+
+    Up to COVER_MAX_TARGETS targets, the matrix also holds shared viewing
+    positions that photograph several targets in one frame, and the order is
+    a set cover (best_cover_route()): a permutation index past the targets is
+    one of those, and iter_path_segments() yields every target it photographs.
     """
 
-    def __init__(self, grid: Grid, robot: Robot):
-        self.grid  = grid          # COLLISION grid — never modified, always full
-        self.robot = robot
-        self.astar = AStar(grid)   # A* is bound to the collision grid permanently
+    def __init__(self, grid: Grid, robot: Robot, planner: Optional[IncrementalPlanner] = None):
+        self.grid    = grid          # COLLISION grid — never modified, always full
+        self.robot   = robot
+        self.model   = cost_model.current()
+        self.astar   = AStar(grid, self.model)   # A* is bound to the collision grid permanently
+        self.planner = planner
+        self._reach: Optional[Reachability] = None   # Built on first use
+        self._nodes: Optional[Tuple[Tuple[Tuple[int, ...], bool], List[CellState], List[int]]] = None
+
+    # ------------------------------------------------------------------
+    # Internal helper: viewing position for one obstacle
+    # ------------------------------------------------------------------
+    def _select_viewing_position(self, obstacle: Obstacle, retrying: bool = False) -> Optional[CellState]:
+        """
+        First candidate the robot can drive to from the start, else the first
+        it can stand on, else None.  One flood fill from the start (shared by
+        every obstacle) answers both as bit tests against the FULL collision
+        grid, instead of an A* search per candidate.
+        """
+        if self._reach is None:
+            self._reach = Reachability(self.robot.get_start_state(), self.astar.blocked)
+        _, selected_pos = self._reach.select(obstacle.get_viewing_positions(retrying=retrying))
+        return selected_pos
+
+    # ------------------------------------------------------------------
+    # Internal helper: every node of the cost matrix
+    # ------------------------------------------------------------------
+    def _viewing_nodes(self, targets: List[Obstacle], retrying: bool = False) -> Tuple[List[CellState], List[int]]:
+        """
+        (positions, covers): the start, one viewing position per target
+        (x = -99 when it has none), then the shared ones; covers[k - 1] is the
+        bitmask of the targets positions[k] photographs.  Kept for the
+        targets last planned, so the route's legs end where the order did.
+        """
+        key = (tuple(o.obstacle_id for o in targets), retrying)
+        if self._nodes is not None and self._nodes[0] == key:
+            return self._nodes[1], self._nodes[2]
+
+        positions = [self.robot.get_start_state()]
+        covers    = []
+        for i, obstacle in enumerate(targets):
+            selected_pos = self._select_viewing_position(obstacle, retrying)
+            if not selected_pos:
+                print(f"⚠️ Warning: Obstacle {obstacle.obstacle_id} has NO safe viewing spots!")
+                positions.append(CellState(-99, -99, Direction.NORTH))
+            else:
+                positions.append(selected_pos)
+            covers.append(1 << i)
+
+        if SHARED_VIEWS and 1 < len(targets) <= COVER_MAX_TARGETS:
+            for pose, seen in shared_viewing_positions(targets, self.grid.obstacles, self._reach):
+                positions.append(pose)
+                covers.append(sum(1 << k for k in seen))
+                print(f"📷 Shared view at ({pose.x}, {pose.y}) for {[targets[k].obstacle_id for k in seen]}")
+
+        self._nodes = (key, positions, covers)
+        return positions, covers
 
     # ------------------------------------------------------------------
     # Internal helper: resolve which obstacle list to iterate for SNAP targets
@@ -45,30 +149,72 @@ class HamiltonianSolver:
         self,
         positions: List[CellState],
     ) -> np.ndarray:
+        """
+        Leg costs between every pair of positions.  Each row is a single
+        multi-goal sweep (AStar.search_many) and the rows run in parallel
+        worker processes.  The resulting paths seed self.astar's cache, so
+        the route legs afterwards are cache hits.  Legs already in the
+        process-wide memo (astar.py) are taken from it, and only the rest are
+        sent to the workers.
+        """
         n = len(positions)
-        cost_matrix = np.zeros((n, n))
+        cost_matrix = np.full((n, n), 1e9)
+        cost_matrix[:, 0] = 0
+        np.fill_diagonal(cost_matrix, 0)
 
-        for i in range(n):
-            for j in range(n):
-                if i == j:
-                    cost_matrix[i][j] = 0
-                    continue
+        valid = [i for i in range(n) if positions[i].x != -99]
+
+        if self.planner is not None:
+            # Column j from the tree rooted at positions[j]: a new start pose
+            # is a lookup, a changed grid is repaired rather than re-searched
+            for j in valid:
                 if j == 0:
-                    cost_matrix[i][j] = 0
                     continue
-
-                if positions[i].x == -99 or positions[j].x == -99:
-                    cost_matrix[i][j] = 1e9
+                tree = self.planner.tree(positions[j], self.astar.blocked, self.model)
+                for i in valid:
+                    if i == j or tree.cost(positions[i]) == float('inf'):
+                        continue
+                    self.astar.store(positions[i], positions[j], tree.cost(positions[i]), tree.path(positions[i]))
+                    cost_matrix[i][j] = tree.cost(positions[i]) + getattr(positions[j], 'penalty', 0) * self.model.scale
+            return cost_matrix
+        known: Dict[int, Dict[CellState, Tuple[float, List[CellState]]]] = {i: {} for i in valid}
+        rows = []
+        for i in valid:
+            goals = []
+            for j in valid:
+                if j == i or j == 0:
                     continue
-
-                path = self.astar.search(positions[i], positions[j])
-                if path:
-                    cost = self.astar.cost_cache[(positions[i], positions[j])]
-                    if hasattr(positions[j], 'penalty'):
-                        cost += positions[j].penalty
-                    cost_matrix[i][j] = cost
-                else:
-                    cost_matrix[i][j] = 1e9
+                path = self.astar.cached(positions[i], positions[j])
+                if path is None:
+                    goals.append(positions[j])
+                elif path:
+                    known[i][positions[j]] = (self.astar.cost_cache[(positions[i], positions[j])], path)
+            if goals:
+                rows.append((i, goals))
+
+        if len(rows) > 1 and ROW_WORKERS > 1:
+            pool    = _get_row_pool()
+            futures = [pool.submit(_search_row, self.grid, self.model, positions[i], goals) for i, goals in rows]
+            results = [future.result() for future in futures]
+        else:
+            results = [_search_row(self.grid, self.model, positions[i], goals) for i, goals in rows]
+
+        for (i, goals), found in zip(rows, results):
+            for goal, (cost, path) in found.items():
+                self.astar.store(positions[i], goal, cost, path)
+            for goal in goals:
+                if goal not in found:
+                    self.astar.store_unreachable(positions[i], goal)
+            known[i].update(found)
+
+        for i, found in known.items():
+            for j in valid:
+                if j == i or j == 0 or positions[j] not in found:
+                    continue
+                cost = found[positions[j]][0]
+                if hasattr(positions[j], 'penalty'):
+                    cost += positions[j].penalty * self.model.scale
+                cost_matrix[i][j] = cost
 
         return cost_matrix
 
@@ -76,118 +222,75 @@ class HamiltonianSolver:
         self,
         retrying: bool = False,
         target_obstacles: Optional[List[Obstacle]] = None,
+        time_budget_ms: Optional[int] = None,
     ) -> Tuple[List[int], float]:
         """
         target_obstacles: if supplied, only these obstacles are used as SNAP
                           targets (viewing positions generated for them only).
                           All is_reachable() calls still use the full collision
                           grid (self.grid), so the robot avoids every obstacle.
+        time_budget_ms:   if supplied, return the best order found within this
+                          many ms of the call (anytime.py) instead of the exact
+                          Held-Karp one.
         """
+        deadline = None if time_budget_ms is None else time.monotonic() + time_budget_ms / 1000
         targets = self._target_list(target_obstacles)
 
-        start_state = self.robot.get_start_state()
-        viewing_positions = [start_state]
-
-        for obstacle in targets:
-            candidates = obstacle.get_viewing_positions(retrying=retrying)
-            # is_reachable uses self.grid — the FULL collision grid
-            valid_positions = [
-                pos for pos in candidates if self.grid.is_reachable(pos.x, pos.y)
-            ]
-
-            selected_pos = None
-            if valid_positions:
-                for pos in valid_positions:
-                    if self.astar.search(start_state, pos):
-                        selected_pos = pos
-                        break
-                if not selected_pos:
-                    selected_pos = valid_positions[0]
-
-            if not selected_pos:
-                print(f"⚠️ Warning: Obstacle {obstacle.obstacle_id} has NO safe viewing spots!")
-                viewing_positions.append(CellState(-99, -99, Direction.NORTH))
-            else:
-                viewing_positions.append(selected_pos)
+        viewing_positions, covers = self._viewing_nodes(targets, retrying)
 
         print("🧩 Solving for Fastest Path (Smart-Subset TSP)...")
         cost_matrix  = self.generate_cost_matrix(viewing_positions)
         n_targets    = len(targets)
 
-        best_permutation = None
-        best_distance    = float('inf')
-
-        for subset_size in range(n_targets, 0, -1):
-            found_valid_subset = False
-            min_subset_dist    = float('inf')
-            best_subset_perm   = None
-
-            for comb in itertools.combinations(range(1, n_targets + 1), subset_size):
-                subset_indices = [0] + list(comb)
-                sub_matrix     = cost_matrix[np.ix_(subset_indices, subset_indices)]
-                perm, dist     = solve_tsp_dynamic_programming(sub_matrix)
-
-                if dist < 1e9:
-                    found_valid_subset = True
-                    if dist < min_subset_dist:
-                        min_subset_dist  = dist
-                        best_subset_perm = [subset_indices[i] for i in perm]
-
-            if found_valid_subset:
-                best_permutation = best_subset_perm
-                best_distance    = min_subset_dist
-                print(f"🚀 OPTIMAL PATH FOUND for {subset_size}/{n_targets} obstacles! Cost: {best_distance:.2f}")
-
-                skipped = set(range(1, n_targets + 1)) - set(best_permutation)
-                if skipped:
-                    skipped_ids = [targets[i - 1].obstacle_id for i in skipped]
-                    print(f"🛑 SKIPPED TRAPPED OBSTACLES: {skipped_ids}")
-                break
-
-        if best_permutation is None:
+        if len(covers) > n_targets:
+            # Exact and fast at this size, so also what a time budget gets
+            best = best_cover_route(cost_matrix, covers)
+        elif deadline is None:
+            # One Held-Karp pass prices every subset; take the largest feasible one
+            best = best_subset_route(cost_matrix)
+        else:
+            print(f"⏱️ Anytime mode: best order within {time_budget_ms} ms")
+            best = anytime_route(cost_matrix, deadline)
+
+        if best is None:
             print("💀 ALL PATHS FAILED. Robot is completely boxed in.")
             return [0], 0
 
-        if best_permutation[0] != 0:
-            start_idx        = best_permutation.index(0)
-            best_permutation = best_permutation[start_idx:] + best_permutation[:start_idx]
+        best_permutation, best_distance = best
+        covered = 0
+        for k in best_permutation[1:]:
+            covered |= covers[k - 1]
+        subset_size = bin(covered).count("1")
+        stops = len(best_permutation) - 1
+        label = "OPTIMAL" if deadline is None or len(covers) > n_targets else "BEST"
+        print(f"🚀 {label} PATH FOUND for {subset_size}/{n_targets} obstacles in {stops} stops! Cost: {best_distance:.2f}")
+
+        skipped = [i for i in range(n_targets) if not covered >> i & 1]
+        if skipped:
+            skipped_ids = [targets[i].obstacle_id for i in skipped]
+            print(f"🛑 SKIPPED TRAPPED OBSTACLES: {skipped_ids}")
 
         return best_permutation, best_distance
 
-    def generate_full_path(
+    def iter_path_segments(
         self,
         permutation: List[int],
         target_obstacles: Optional[List[Obstacle]] = None,
-    ) -> List[CellState]:
+    ) -> Iterator[Tuple[int, List[CellState], List[int]]]:
         """
-        target_obstacles: same semantics as in find_optimal_order().
-                          Must be the identical list used there so indices match.
+        Yields (leg index, segment, obstacle_ids) for each leg of the visiting
+        order as soon as its A* search finishes. Each segment starts at the
+        previous viewing position and ends where obstacle_ids are
+        photographed: one target, or the ones a shared viewing position
+        covers that no earlier stop has. Legs with no path are skipped, as in
+        generate_full_path().
         """
         targets = self._target_list(target_obstacles)
+        ids = tuple(o.obstacle_id for o in targets)
+        retrying = self._nodes[0][1] if self._nodes is not None and self._nodes[0][0] == ids else False
+        viewing_positions, covers = self._viewing_nodes(targets, retrying)
 
-        start_state      = self.robot.get_start_state()
-        viewing_positions = [start_state]
-
-        for obstacle in targets:
-            candidates     = obstacle.get_viewing_positions()
-            valid_positions = [
-                pos for pos in candidates if self.grid.is_reachable(pos.x, pos.y)
-            ]
-
-            selected_pos = None
-            if valid_positions:
-                for pos in valid_positions:
-                    if self.astar.search(start_state, pos):
-                        selected_pos = pos
-                        break
-                if not selected_pos:
-                    selected_pos = valid_positions[0]
-
-            viewing_positions.append(
-                selected_pos if selected_pos else CellState(-99, -99, Direction.NORTH)
-            )
-
-        full_path = []
+        covered = 0
         for i in range(len(permutation) - 1):
             from_idx = permutation[i]
             to_idx   = permutation[i + 1]
@@ -200,12 +303,27 @@ class HamiltonianSolver:
             if not segment:
                 continue
 
+            fresh    = covers[to_idx - 1] & ~covered
+            covered |= fresh
+            yield i, segment, [targets[k].obstacle_id for k in range(len(targets)) if fresh >> k & 1]
+
+    def generate_full_path(
+        self,
+        permutation: List[int],
+        target_obstacles: Optional[List[Obstacle]] = None,
+    ) -> List[CellState]:
+        """
+        target_obstacles: same semantics as in find_optimal_order().
+                          Must be the identical list used there so indices match.
+        """
+        full_path = []
+        for i, segment, obstacle_ids in self.iter_path_segments(permutation, target_obstacles):
             if i == 0:
                 full_path.extend(segment)
             else:
                 full_path.extend(segment[1:])
 
-            if to_idx > 0 and full_path:
-                full_path[-1].screenshot_id = targets[to_idx - 1].obstacle_id
+            if full_path:
+                full_path[-1].set_screenshots(obstacle_ids)
 
         return full_path
@@ -0,0 +1,159 @@
+# algorithms/pathfinding/held_karp.py
+#
+# Bitmask Held-Karp over every subset of SNAP targets in one pass.
+#
+# dp[mask, j] is the cheapest route that leaves the start (node 0), visits
+# exactly the targets in `mask` and ends on target j.  Filling the table
+# layer by layer (by popcount) prices every subset at once, so the
+# skip-trapped-obstacles search reads the best route for each subset size
+# straight out of the table instead of re-solving a TSP per combination.
+#
+# Work is O(2^n * n^2), vectorised per (layer, end target) with numpy; for
+# MAX_OBSTACLES = 20 the table is 2^20 x 20 float64 (~170 MB).
+#
+# best_cover_route() fills the same kind of table over nodes that each
+# photograph a set of targets (shared_views.py), up to COVER_MAX_TARGETS.
+
+from typing import List, Optional, Tuple
+
+import numpy as np
+
+UNREACHABLE = 1e9   # generate_cost_matrix() marks blocked legs with this
+
+
+def best_subset_route(cost_matrix: np.ndarray) -> Optional[Tuple[List[int], float]]:
+    """
+    cost_matrix: (n+1) x (n+1) leg costs, node 0 being the start.  Column 0
+                 is what it costs to close the tour (0 for an open route).
+
+    Returns (route, cost) for the largest set of targets that can all be
+    visited without an UNREACHABLE leg; among sets of that size, the
+    cheapest.  route starts with 0 and lists cost_matrix indices in visiting
+    order.  Returns None when not a single target is reachable.
+    """
+    n = cost_matrix.shape[0] - 1
+    if n <= 0:
+        return None
+
+    full    = 1 << n
+    masks   = np.arange(full)
+    targets = np.arange(n)
+    legs    = cost_matrix[1:, 1:]          # legs[i, j]: target i -> target j
+
+    dp     = np.full((full, n), np.inf)
+    parent = np.full((full, n), -1, dtype=np.int8)
+    dp[1 << targets, targets] = cost_matrix[0, 1:]
+
+    popcount = np.zeros(full, dtype=np.int8)
+    for j in range(n):
+        popcount += (masks >> j) & 1
+
+    for size in range(2, n + 1):
+        layer = masks[popcount == size]
+        for j in range(n):
+            ends  = layer[((layer >> j) & 1) == 1]
+            # dp[prev, i] + legs[i, j] over every possible previous target i;
+            # i == j is inf because j is not in prev
+            steps = dp[ends ^ (1 << j)] + legs[:, j]
+            best  = steps.argmin(axis=1)
+            dp[ends, j]     = steps[np.arange(len(ends)), best]
+            parent[ends, j] = best
+
+    closed = (dp + cost_matrix[1:, 0]).min(axis=1)
+
+    for size in range(n, 0, -1):
+        layer = masks[popcount == size]
+        mask  = int(layer[closed[layer].argmin()])
+        if closed[mask] < UNREACHABLE:
+            break
+    else:
+        return None
+
+    cost  = float(closed[mask])
+    j     = int((dp[mask] + cost_matrix[1:, 0]).argmin())
+    route = []
+    while j >= 0:
+        route.append(j + 1)
+        prev  = int(parent[mask, j])
+        mask ^= 1 << j
+        j     = prev
+    route.append(0)
+    route.reverse()
+    return route, cost
+
+
+def best_cover_route(cost_matrix: np.ndarray, covers: List[int]) -> Optional[Tuple[List[int], float]]:
+    """
+    best_subset_route() for nodes that may photograph several targets:
+    covers[k - 1] is the bitmask of the targets node k covers (shared_views.py),
+    one bit per target.  dp[k, mask] is the cheapest route that leaves the
+    start, has covered exactly mask and ends on node k.  A node's targets can
+    jump several layers at once, so each layer pushes into the ones above it
+    rather than pulling from the one below.  Routes rank as there: most
+    targets covered, then cost.  route lists cost_matrix indices.
+    """
+    m = len(covers)
+    if m == 0:
+        return None
+    n = max(c.bit_length() for c in covers)
+
+    full  = 1 << n
+    masks = np.arange(full)
+    cover = np.array(covers)
+    legs  = cost_matrix[1:, 1:]            # legs[j, k]: node j -> node k
+
+    dp = np.full((m, full), np.inf)
+    dp[np.arange(m), cover] = cost_matrix[0, 1:]
+
+    popcount = np.zeros(full, dtype=np.int8)
+    for j in range(n):
+        popcount += (masks >> j) & 1
+
+    for size in range(1, n):
+        layer = masks[popcount == size]
+        block = dp[:, layer]               # (m, len(layer))
+        for k in range(m):
+            grown  = layer | cover[k]
+            useful = grown != layer
+            if not useful.any():
+                continue
+            steps = (block[:, useful] + legs[:, k:k + 1]).min(axis=0)
+            np.minimum.at(dp[k], grown[useful], steps)
+
+    closed = (dp + cost_matrix[1:, 0:1]).min(axis=0)
+
+    for size in range(n, 0, -1):
+        layer = masks[popcount == size]
+        mask  = int(layer[closed[layer].argmin()])
+        if closed[mask] < UNREACHABLE:
+            break
+    else:
+        return None
+
+    total = float(closed[mask])
+    k     = int((dp[:, mask] + cost_matrix[1:, 0]).argmin())
+    route = []
+    while True:
+        route.append(k + 1)
+        here = dp[k, mask]
+        if mask == covers[k] and here == cost_matrix[0, k + 1]:
+            break
+        # The layer below that k grew into mask: mask less k's targets, plus
+        # any of them covered before
+        rest, prev = mask & ~covers[k], None
+        sub = covers[k]
+        while prev is None:
+            sub = (sub - 1) & covers[k]
+            pmask = rest | sub
+            if pmask:
+                j = int((dp[:, pmask] + legs[:, k]).argmin())
+                if dp[j, pmask] + legs[j, k] <= here * (1 + 1e-12):
+                    prev = (j, pmask)
+            if sub == 0:
+                break
+        if prev is None:
+            break              # Unreachable with exact arithmetic
+        k, mask = prev
+    route.append(0)
+    route.reverse()
+    return route, total
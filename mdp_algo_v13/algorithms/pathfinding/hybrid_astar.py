@@ -0,0 +1,275 @@
+# algorithms/pathfinding/hybrid_astar.py
+#
+# Hybrid A* over continuous robot poses, for the optional "hybrid" planner
+# mode (main.py).  The lattice plans on 10 cm cells, 4 headings and whole
+# 90-degree turns, which makes routes longer than the geometry needs and cuts
+# them into many short commands.  Here a pose is (x cm, y cm, heading rad):
+#
+#   - expansions are short primitives at the robot's steering radius: a
+#     forward left or right arc of ARC_STEP, or FW / BW by STRAIGHT_STEP;
+#   - nodes are merged per (BIN_CM x BIN_CM, HEADING_BINS) bin;
+#   - every ANALYTIC_EVERY pops, and first thing, the search tries to finish
+#     with an analytic curve-straight-curve path (Dubins CSC words, exact for
+#     different left and right radii) and stops at the first collision-free
+#     one.  Reeds-Shepp words would also use reverse arcs, but the firmware's
+#     reverse turns cannot be sent from the RPi, so arcs are forward only and
+#     reversing is on straights;
+#   - a path costs its length in cm plus BOUNDARY_CM for every command it
+#     takes (A command boundary costs a brake, an ACK round trip and the
+#     firmware's cooldown).  The heuristic is the obstacle-free CSC length.
+#
+# The robot's centre is kept EXPANDED_CELL + 0.5 cells (Chebyshev) from every
+# obstacle and inside the arena padding; at cell centres that is exactly the
+# lattice's rule (Grid.is_reachable()).  Poses are in cm with cell (x, y) at
+# (x * CELL_SIZE, y * CELL_SIZE) and heading 0 facing east.
+#
+# Legs start and end on lattice poses (viewing positions), so the hybrid mode
+# keeps the lattice's visiting order and replaces each leg whose hybrid path
+# is cheaper.  A path comes back as (kind, amount) segments, FW/BW in cm and
+# FL/FR in degrees, for CommandGenerator.segment_commands().
+
+import heapq
+import math
+from typing import List, Optional, Tuple
+
+from algorithms.entities.grid import Grid
+from algorithms.pathfinding import lattice
+from algorithms.utils.consts import CELL_SIZE, EXPANDED_CELL, GRID_SIZE, MAX_PADDING, MIN_PADDING, TURN_RADIUS
+from algorithms.utils.enums import Direction
+from algorithms.utils.types import CellState
+
+STRAIGHT_STEP  = 10.0                 # cm per FW / BW expansion
+ARC_STEP       = math.radians(15)     # Heading change per arc expansion
+BIN_CM         = 5.0
+HEADING_BINS   = 24
+BOUNDARY_CM    = 20.0
+CHECK_CM       = 2.0                  # Collision test spacing along a path
+ANALYTIC_EVERY = 5
+MAX_EXPANSIONS = 2000                 # Past this the leg keeps its lattice path
+CLEARANCE_CM   = (EXPANDED_CELL + 0.5) * CELL_SIZE
+ARENA_CM       = GRID_SIZE * CELL_SIZE
+
+Segment = Tuple[str, float]           # ('FW' | 'BW', cm) or ('FL' | 'FR', degrees)
+Pose    = Tuple[float, float, float]
+
+
+def pose_of(state: CellState) -> Pose:
+    """Continuous pose of a lattice state."""
+    return (state.x * CELL_SIZE, state.y * CELL_SIZE, math.pi / 2 - int(state.direction) * math.pi / 4)
+
+
+def cell_of(pose: Pose) -> CellState:
+    """Nearest lattice state (heading to the nearest of the four)."""
+    d = round((math.pi / 2 - pose[2]) / (math.pi / 2)) % 4 * 2
+    return CellState(int(round(pose[0] / CELL_SIZE)), int(round(pose[1] / CELL_SIZE)), Direction(d))
+
+
+def turn_radii() -> Tuple[float, float]:
+    """(left, right) steering radius in cm: the measured turns if there is a table."""
+    if lattice.TABLE is None:
+        return TURN_RADIUS * CELL_SIZE, TURN_RADIUS * CELL_SIZE
+    fl, fr = lattice.TABLE['FL90'], lattice.TABLE['FR90']
+    return ((float(fl['forward_cm']) + abs(float(fl['left_cm']))) / 2,
+            (float(fr['forward_cm']) + abs(float(fr['left_cm']))) / 2)
+
+
+def _wrap(a: float) -> float:
+    return (a + math.pi) % (2 * math.pi) - math.pi
+
+
+def advance(pose: Pose, kind: str, amount: float, radii: Tuple[float, float]) -> Pose:
+    """Pose after one segment (cm for FW/BW, radians for FL/FR)."""
+    x, y, th = pose
+    if kind == 'FW' or kind == 'BW':
+        s = amount if kind == 'FW' else -amount
+        return (x + s * math.cos(th), y + s * math.sin(th), th)
+    side = 1.0 if kind == 'FL' else -1.0
+    r = radii[0] if kind == 'FL' else radii[1]
+    cx, cy = x - side * r * math.sin(th), y + side * r * math.cos(th)
+    nth = th + side * amount
+    return (cx + side * r * math.sin(nth), cy - side * r * math.cos(nth), _wrap(nth))
+
+
+def segment_length(kind: str, amount: float, radii: Tuple[float, float]) -> float:
+    if kind == 'FW' or kind == 'BW':
+        return amount
+    return amount * (radii[0] if kind == 'FL' else radii[1])
+
+
+def csc_paths(start: Pose, goal: Pose, radii: Tuple[float, float]) -> List[Tuple[float, List[Tuple[str, float]]]]:
+    """
+    Every curve-straight-curve path from start to goal, as (length, segments)
+    with arcs in radians.  For a circle turning with side s (+1 left) and
+    radius r, a robot at p heading u has its centre at p + s r left(u), so a
+    tangent of direction u from circle 1 to circle 2 satisfies
+    c2 - c1 = t u + (s2 r2 - s1 r1) left(u), t >= 0.
+    """
+    paths = []
+    x0, y0, th0 = start
+    x1, y1, th1 = goal
+    for k1, s1, r1 in (('FL', 1.0, radii[0]), ('FR', -1.0, radii[1])):
+        c1 = (x0 - s1 * r1 * math.sin(th0), y0 + s1 * r1 * math.cos(th0))
+        for k2, s2, r2 in (('FL', 1.0, radii[0]), ('FR', -1.0, radii[1])):
+            c2 = (x1 - s2 * r2 * math.sin(th1), y1 + s2 * r2 * math.cos(th1))
+            dx, dy = c2[0] - c1[0], c2[1] - c1[1]
+            k = s2 * r2 - s1 * r1
+            dd = dx * dx + dy * dy - k * k
+            if dd < 0:
+                continue
+            t = math.sqrt(dd)
+            phi = math.atan2(dy, dx) - math.atan2(k, t)
+            a1 = (s1 * (phi - th0)) % (2 * math.pi)
+            a2 = (s2 * (th1 - phi)) % (2 * math.pi)
+            paths.append((r1 * a1 + t + r2 * a2, [(k1, a1), ('FW', t), (k2, a2)]))
+    return sorted(paths, key=lambda p: p[0])
+
+
+class HybridAStar:
+    """Continuous-pose planner on one collision grid (the lattice's, in cm)."""
+
+    def __init__(self, grid: Grid):
+        self.radii = turn_radii()
+        # Whether the centre may be at each whole cm, so a test is one lookup.
+        # A point is tested at its nearest whole cm, so obstacles keep half a
+        # cm more clearance than CLEARANCE_CM to cover the rounding.
+        lo, hi = MIN_PADDING * CELL_SIZE, MAX_PADDING * CELL_SIZE
+        clear = CLEARANCE_CM + 0.5
+        self.free_cm = bytearray((ARENA_CM + 1) * (ARENA_CM + 1))
+        for y in range(lo, hi + 1):
+            self.free_cm[y * (ARENA_CM + 1) + lo:y * (ARENA_CM + 1) + hi + 1] = b'\x01' * (hi - lo + 1)
+        for o in grid.obstacles:
+            ox, oy = o.x * CELL_SIZE, o.y * CELL_SIZE
+            x0, x1 = max(lo, math.floor(ox - clear) + 1), min(hi, math.ceil(ox + clear) - 1)
+            for y in range(max(lo, math.floor(oy - clear) + 1), min(hi, math.ceil(oy + clear) - 1) + 1):
+                if x0 <= x1:
+                    self.free_cm[y * (ARENA_CM + 1) + x0:y * (ARENA_CM + 1) + x1 + 1] = bytes(x1 - x0 + 1)
+
+    def free(self, x: float, y: float) -> bool:
+        ix, iy = int(round(x)), int(round(y))
+        return 0 <= ix <= ARENA_CM and 0 <= iy <= ARENA_CM and bool(self.free_cm[iy * (ARENA_CM + 1) + ix])
+
+    def _clear(self, pose: Pose, kind: str, amount: float) -> Optional[Pose]:
+        """End pose of the segment, or None if any point on it collides."""
+        steps = max(1, int(math.ceil(segment_length(kind, amount, self.radii) / CHECK_CM)))
+        free, row = self.free_cm, ARENA_CM + 1
+        x, y, th = pose
+        if kind == 'FW' or kind == 'BW':
+            s = (amount if kind == 'FW' else -amount) / steps
+            dx, dy = s * math.cos(th), s * math.sin(th)
+            points = ((x + dx * i, y + dy * i) for i in range(1, steps + 1))
+        else:
+            side = 1.0 if kind == 'FL' else -1.0
+            r = self.radii[0] if kind == 'FL' else self.radii[1]
+            cx, cy = x - side * r * math.sin(th), y + side * r * math.cos(th)
+            da = side * amount / steps
+            points = ((cx + side * r * math.sin(th + da * i), cy - side * r * math.cos(th + da * i))
+                      for i in range(1, steps + 1))
+        for px, py in points:
+            ix, iy = int(px + 0.5), int(py + 0.5)
+            if not (0 <= ix < row and 0 <= iy < row and free[iy * row + ix]):
+                return None
+        return advance(pose, kind, amount, self.radii)
+
+    def _analytic(self, pose: Pose, goal: Pose) -> Optional[List[Tuple[str, float]]]:
+        for _, segments in csc_paths(pose, goal, self.radii):
+            p = pose
+            for kind, amount in segments:
+                if amount > 1e-9:
+                    p = self._clear(p, kind, amount)
+                    if p is None:
+                        break
+            else:
+                return [(kind, amount) for kind, amount in segments if amount > 1e-9]
+        return None
+
+    def _heuristic(self, pose: Pose, goal: Pose) -> float:
+        paths = csc_paths(pose, goal, self.radii)
+        if not paths:
+            return math.hypot(goal[0] - pose[0], goal[1] - pose[1])
+        return min(length + BOUNDARY_CM * sum(1 for _, a in segments if a > 1e-6) for length, segments in paths)
+
+    @staticmethod
+    def _bin(pose: Pose) -> Tuple[int, int, int]:
+        return (int(round(pose[0] / BIN_CM)), int(round(pose[1] / BIN_CM)),
+                int(round(pose[2] / (2 * math.pi / HEADING_BINS))) % HEADING_BINS)
+
+    def search(self, start: CellState, goal: CellState) -> Optional[List[Segment]]:
+        """Segments from start to goal (FW/BW cm, FL/FR degrees), or None."""
+        s, g = pose_of(start), pose_of(goal)
+        if not self.free(s[0], s[1]) or not self.free(g[0], g[1]):
+            return None
+        primitives = [('FW', STRAIGHT_STEP), ('BW', STRAIGHT_STEP), ('FL', ARC_STEP), ('FR', ARC_STEP)]
+        # node: (pose, g, parent node index, primitive)
+        nodes = [(s, 0.0, -1, None)]
+        open_set = [(self._heuristic(s, g), 0)]
+        closed = set()
+        pops = 0
+        while open_set and pops < MAX_EXPANSIONS:
+            _, idx = heapq.heappop(open_set)
+            pose, cost, _, prev = nodes[idx]
+            key = self._bin(pose)
+            if key in closed:
+                continue
+            closed.add(key)
+            if pops % ANALYTIC_EVERY == 0:
+                tail = self._analytic(pose, g)
+                if tail is not None:
+                    return self._segments(nodes, idx, tail)
+            pops += 1
+            for kind, amount in primitives:
+                nxt = self._clear(pose, kind, amount)
+                if nxt is None or self._bin(nxt) in closed:
+                    continue
+                step = segment_length(kind, amount, self.radii) + (BOUNDARY_CM if kind != prev else 0.0)
+                nodes.append((nxt, cost + step, idx, kind))
+                heapq.heappush(open_set, (cost + step + self._heuristic(nxt, g), len(nodes) - 1))
+        return None
+
+    def _segments(self, nodes, idx: int, tail) -> List[Segment]:
+        chain = []
+        while nodes[idx][2] >= 0:
+            _, _, parent, kind = nodes[idx]
+            chain.append((kind, STRAIGHT_STEP if kind in ('FW', 'BW') else ARC_STEP))
+            idx = parent
+        merged: List[List] = []
+        for kind, amount in chain[::-1] + tail:
+            if merged and merged[-1][0] == kind:
+                merged[-1][1] += amount
+            else:
+                merged.append([kind, amount])
+        return [(kind, math.degrees(a) if kind in ('FL', 'FR') else a) for kind, a in merged]
+
+    def cost(self, segments: List[Segment]) -> float:
+        """Length plus command boundaries, the measure search() minimises."""
+        total = 0.0
+        for kind, amount in segments:
+            amount = math.radians(amount) if kind in ('FL', 'FR') else amount
+            total += segment_length(kind, amount, self.radii) + BOUNDARY_CM
+        return total
+
+    def poses(self, start: CellState, segments: List[Segment]) -> List[Pose]:
+        """Pose at the end of every STRAIGHT_STEP of the path, for display."""
+        out = [pose_of(start)]
+        for kind, amount in segments:
+            amount = math.radians(amount) if kind in ('FL', 'FR') else amount
+            base = out[-1]
+            steps = max(1, int(math.ceil(segment_length(kind, amount, self.radii) / STRAIGHT_STEP)))
+            out.extend(advance(base, kind, amount * i / steps, self.radii) for i in range(1, steps + 1))
+        return out
+
+    def segment_cells(self, start: CellState, segments: List[Segment]) -> List[List[Tuple[int, int]]]:
+        """Cells each segment's poses round to, every CHECK_CM, for speed.segment_classes()."""
+        out = []
+        pose = pose_of(start)
+        for kind, amount in segments:
+            amount = math.radians(amount) if kind in ('FL', 'FR') else amount
+            steps = max(1, int(math.ceil(segment_length(kind, amount, self.radii) / CHECK_CM)))
+            cells = []
+            for i in range(steps + 1):
+                p = advance(pose, kind, amount * i / steps, self.radii)
+                cell = (int(round(p[0] / CELL_SIZE)), int(round(p[1] / CELL_SIZE)))
+                if not cells or cells[-1] != cell:
+                    cells.append(cell)
+            out.append(cells)
+            pose = advance(pose, kind, amount, self.radii)
+        return out
@@ -0,0 +1,135 @@
+# algorithms/pathfinding/incremental.py
+#
+# Incremental (LPA*) planning for bullseye reroutes.
+#
+# A GoalTree is an LPA* search rooted at one viewing position, run backwards
+# over the lattice moves, so g[state] is the cost from any state to that goal.
+# Because it is rooted at the goal:
+#   - a new start pose costs nothing: cost()/path() just read the tree;
+#   - a changed obstacle set (visited obstacles dropping out of the grid)
+#     only re-opens the states whose moves sweep a changed cell, and LPA*
+#     repairs outward from there instead of searching again.
+#
+# IncrementalPlanner keeps the trees between requests, so the second and
+# later bullseye reroutes of a run re-use the remaining goals' trees.  A tree
+# is only valid for the cost model it was built with; a reloaded model means
+# rebuilding it.
+
+import heapq
+import threading
+from collections import OrderedDict
+from typing import Dict, List, Tuple
+
+from algorithms.pathfinding.cost_model import CostModel
+from algorithms.pathfinding.lattice import PREDECESSORS, SUCCESSORS, SWEEPERS
+from algorithms.utils.enums import Direction
+from algorithms.utils.types import CellState
+
+INF = float('inf')
+
+State = Tuple[int, int, int]
+
+
+def _key(state: CellState) -> State:
+    return (state.x, state.y, int(state.direction))
+
+
+class GoalTree:
+    """
+    LPA* with a zero heuristic, rooted at `goal` and run to completion, so it
+    holds the cost-to-goal of every state.  blocked is AStar.blocked for the
+    collision grid the tree is valid for; moves are priced by model.
+    """
+
+    def __init__(self, goal: CellState, blocked: int, model: CostModel):
+        self.goal    = _key(goal)
+        self.blocked = blocked
+        self.model   = model
+        self.move_cost = model.move_cost
+        self.g: Dict[State, float]   = {}
+        self.rhs: Dict[State, float] = {self.goal: 0.0}
+        self.open_set = [(0.0, self.goal)]
+        self._compute()
+
+    def _update(self, u: State) -> None:
+        if u != self.goal:
+            self.rhs[u] = min(
+                (self.move_cost[kind] + self.g.get(v, INF)
+                 for v, kind, swept in SUCCESSORS.get(u, ())
+                 if not swept & self.blocked),
+                default=INF,
+            )
+        g, rhs = self.g.get(u, INF), self.rhs.get(u, INF)
+        if g != rhs:
+            heapq.heappush(self.open_set, (min(g, rhs), u))
+
+    def _compute(self) -> None:
+        while self.open_set:
+            k, u = heapq.heappop(self.open_set)
+            g, rhs = self.g.get(u, INF), self.rhs.get(u, INF)
+            if g == rhs or k != min(g, rhs):
+                continue    # Stale entry
+            if g > rhs:
+                self.g[u] = rhs
+            else:
+                self.g[u] = INF
+                self._update(u)
+            for p, _, _ in PREDECESSORS.get(u, ()):
+                self._update(p)
+
+    def update_blocked(self, blocked: int) -> None:
+        """Repair the tree for a new collision grid."""
+        changed = self.blocked ^ blocked
+        self.blocked = blocked
+        touched = set()
+        while changed:
+            low = changed & -changed
+            touched |= SWEEPERS.get(low.bit_length() - 1, set())
+            changed ^= low
+        for u in touched:
+            self._update(u)
+        self._compute()
+
+    def cost(self, start: CellState) -> float:
+        return self.g.get(_key(start), INF)
+
+    def path(self, start: CellState) -> List[CellState]:
+        """Cheapest path from start to the goal, [] if there is none."""
+        u = _key(start)
+        if self.g.get(u, INF) == INF:
+            return []
+        path = [CellState(start.x, start.y, start.direction)]
+        while u != self.goal:
+            # Follow the move that the goal's cost-to-go came through
+            u = min(
+                ((v, self.move_cost[kind] + self.g.get(v, INF))
+                 for v, kind, swept in SUCCESSORS[u]
+                 if not swept & self.blocked),
+                key=lambda step: step[1],
+            )[0]
+            path.append(CellState(u[0], u[1], Direction(u[2])))
+        return path
+
+
+class IncrementalPlanner:
+    """Process-wide store of GoalTrees; the least recently used are dropped first."""
+
+    def __init__(self, max_trees: int = 64):
+        self.max_trees = max_trees
+        self._trees: "OrderedDict[State, GoalTree]" = OrderedDict()
+        self._lock  = threading.Lock()
+
+    def tree(self, goal: CellState, blocked: int, model: CostModel) -> GoalTree:
+        """Tree for goal on the grid described by blocked, repairing or building it."""
+        with self._lock:
+            tree = self._trees.get(_key(goal))
+            if tree is None or tree.model is not model:
+                tree = GoalTree(goal, blocked, model)
+                self._trees[_key(goal)] = tree
+                if len(self._trees) > self.max_trees:
+                    self._trees.popitem(last=False)
+            else:
+                self._trees.move_to_end(_key(goal))
+                if tree.blocked != blocked:
+                    tree.update_blocked(blocked)
+            return tree
@@ -0,0 +1,238 @@
+# algorithms/pathfinding/lattice.py
+#
+# Motion-primitive lattice for the fixed GRID_SIZE x GRID_SIZE arena, built
+# once at import.
+#
+#   PRIMITIVES[state]  — every move that stays inside the arena padding from
+#                        state (x, y, direction): (next state, kind, swept),
+#                        where kind is the STM command that drives the move
+#                        (MOVE_KINDS) and swept is a bitmask of every cell the
+#                        robot body touches (destination + turn-arc sweep cells).
+#   build_cost_to_go() — obstacle-free cost between two states for a given
+#                        price per kind, used as the A* heuristic.  It knows
+#                        about headings and the fixed turn arcs, so it is much
+#                        tighter than straight-line distance.
+#
+# Moves are priced by cost_model.CostModel, so the lattice itself does not
+# change when the cost model does.  An A* expansion is one PRIMITIVES lookup
+# and one AND of swept against the grid's blocked-cell mask (AStar.blocked).
+#
+# The turns are the idealized TURN_RADIUS arcs unless MOTION_PRIMITIVES_PATH
+# holds a table measured on the robot (RPI/primitive_fit.py):
+#
+#   {"version": 1, "primitives": {"FL90": {"forward_cells": f, "left_cells": l,
+#                                          "swept": [[f, l], ..], ..}, "FR90": {..}, ..}}
+#
+# Then the turns are FL90 and FR90 where the firmware actually lands, with the
+# cells its centre actually crossed, and the reverse arcs are left out: they
+# are sent as forward turns, so their idealized geometry never matched what
+# the robot did.  The table is read once at import; restart the server for a
+# new one.
+
+import heapq
+import json
+import os
+from typing import Dict, List, Optional, Set, Tuple
+
+from algorithms.utils.consts import GRID_SIZE, MIN_PADDING, MAX_PADDING, TURN_RADIUS
+from algorithms.utils.enums import Direction
+from algorithms.utils.types import CellState
+
+DIRECTIONS = [Direction.NORTH, Direction.EAST, Direction.SOUTH, Direction.WEST]
+
+# Straight forward / backward cells, and turns by the command
+# CommandGenerator emits for them (it goes by the heading change)
+MOVE_KINDS = ('FW', 'BW', 'FL', 'FR')
+
+MOTION_PRIMITIVES_PATH = os.environ.get(
+    'MDP_MOTION_PRIMITIVES',
+    os.path.join(os.path.dirname(__file__), '..', '..', 'motion_primitives.json'),
+)
+# Unit (dx, dy) of the robot's forward and left, per heading
+_FORWARD = {Direction.NORTH: (0, 1), Direction.EAST: (1, 0), Direction.SOUTH: (0, -1), Direction.WEST: (-1, 0)}
+_LEFT    = {Direction.NORTH: (-1, 0), Direction.EAST: (0, 1), Direction.SOUTH: (1, 0), Direction.WEST: (0, -1)}
+
+
+def load_primitives(path: str) -> Dict[str, dict]:
+    """Primitives of a primitive_fit.py table; raises on a malformed one."""
+    with open(path) as f:
+        table = json.load(f)
+    if table.get('version') != 1:
+        raise ValueError(f"unknown version {table.get('version')}")
+    primitives = table['primitives']
+    for name in ('FL90', 'FR90'):
+        turn = primitives[name]
+        fwd, left = int(turn['forward_cells']), int(turn['left_cells'])
+        if fwd <= 0 or (left > 0) != (name == 'FL90'):
+            raise ValueError(f"{name} lands at ({fwd}, {left}) cells, not ahead and to its side")
+        if max(abs(fwd), abs(left), *(abs(c) for cell in turn['swept'] for c in cell)) > GRID_SIZE:
+            raise ValueError(f"{name} sweeps beyond the arena")
+    return primitives
+
+
+def _load_table() -> Optional[Dict[str, dict]]:
+    if not os.path.exists(MOTION_PRIMITIVES_PATH):
+        return None
+    try:
+        primitives = load_primitives(MOTION_PRIMITIVES_PATH)
+    except (OSError, ValueError, KeyError, TypeError) as e:
+        print(f"Ignoring motion primitives {MOTION_PRIMITIVES_PATH} ({e}); planning idealized turns")
+        return None
+    print(f"Motion primitives from {MOTION_PRIMITIVES_PATH}: "
+          + ", ".join(f"{n} ({primitives[n]['forward_cells']}, {primitives[n]['left_cells']})"
+                      for n in ('FL90', 'FR90')))
+    return primitives
+
+
+# The measured table, or None for the idealized turns
+TABLE = _load_table()
+
+
+def cell_bit(x: int, y: int) -> int:
+    """Bit for cell (x, y) in a swept / blocked mask."""
+    return 1 << (y * GRID_SIZE + x)
+
+
+def _moves(d: Direction) -> List[Tuple[int, int, Direction, str, List[Tuple[int, int]]]]:
+    """
+    Moves from heading d, relative to the robot's cell:
+    (dx, dy, new heading, kind, cells swept relative to the start).
+    """
+    r = TURN_RADIUS # 3
+    moves = []
+    fx, fy = _FORWARD[d]
+    lx, ly = _LEFT[d]
+
+    # --- 1. STRAIGHT MOVEMENT ---
+    dx, dy = {Direction.NORTH: (0, 1), Direction.SOUTH: (0, -1),
+              Direction.EAST: (1, 0), Direction.WEST: (-1, 0)}[d]
+    for sign in [1, -1]:
+        moves.append((dx * sign, dy * sign, d, 'FW' if sign == 1 else 'BW', [(dx * sign, dy * sign)]))
+
+    if TABLE is not None:
+        # Measured turns, (forward, left) cells turned into this heading's (dx, dy)
+        for name, heading_step in (('FL90', -2), ('FR90', 2)):
+            turn = TABLE[name]
+            cells = [(turn['forward_cells'], turn['left_cells'])] + [tuple(c) for c in turn['swept']]
+            swept = [(f * fx + l * lx, f * fy + l * ly) for f, l in dict.fromkeys(cells)]
+            tdx, tdy = swept[0]
+            moves.append((tdx, tdy, Direction((int(d) + heading_step) % 8), name[:2], swept))
+        return moves
+
+    # --- 2. 90-DEGREE TURNS (CORRECTED PHYSICS) ---
+    # r = 3 (30cm)
+    # FL (Forward-Left):  Steer Left, Drive Fwd.
+    # FR (Forward-Right): Steer Right, Drive Fwd.
+    # BL (Back-Left):     Steer Left, Drive Rev. (Nose swings Right/East)
+    # BR (Back-Right):    Steer Right, Drive Rev. (Nose swings Left/West)
+    turns = {
+        # N->W (-3,3) | E->N (3,3) | S->E (3,-3) | W->S (-3,-3)
+        'FL': {0:(-r,r,6), 2:(r,r,0), 4:(r,-r,2), 6:(-r,-r,4)},
+        # N->E (3,3) | E->S (3,-3) | S->W (-3,-3) | W->N (-3,3)
+        'FR': {0:(r,r,2), 2:(r,-r,4), 4:(-r,-r,6), 6:(-r,r,0)},
+        # Reverse Left (Backing up to the Left relative to driver)
+        # N->E (-3,-3) | E->S (-3,3) | S->W (3,3) | W->N (3,-3)
+        'BL': {0:(-r,-r,2), 2:(-r,r,4), 4:(r,r,6), 6:(r,-r,0)},
+        # Reverse Right (Backing up to the Right relative to driver)
+        # N->W (3,-3) | E->N (-3,-3) | S->E (-3,3) | W->S (3,3)
+        'BR': {0:(r,-r,6), 2:(-r,-r,0), 4:(-r,r,2), 6:(r,r,4)},
+    }
+    for turn in ['FL', 'FR', 'BL', 'BR']:
+        tdx, tdy, new_d = turns[turn][int(d)]
+        step_x = 1 if tdx > 0 else -1
+        step_y = 1 if tdy > 0 else -1
+        # --- SWEEP CLEARANCE ---
+        # The physical grid cells the robot body passes through on the 3x3 arc
+        swept = [
+            (tdx, tdy),                                                                     # Destination
+            (step_x, 0), (0, step_y),                                                       # Entry points
+            (step_x, step_y), (2*step_x, step_y), (step_x, 2*step_y), (2*step_x, 2*step_y), # Core arc / Diagonal
+            (2*step_x, 3*step_y), (3*step_x, 2*step_y)                                      # Exit points
+        ]
+        kind = 'FR' if (new_d - int(d)) % 8 == 2 else 'FL'
+        moves.append((tdx, tdy, Direction(new_d), kind, swept))
+
+    return moves
+
+
+def _in_bounds(x: int, y: int) -> bool:
+    return MIN_PADDING <= x <= MAX_PADDING and MIN_PADDING <= y <= MAX_PADDING
+
+
+def _build_primitives() -> Dict[Tuple[int, int, int], List[Tuple[CellState, str, int]]]:
+    # Shared CellStates: A* never mutates them and cached paths are copied
+    # before they are handed out (AStar.cached()), so one object per state
+    states = {
+        (x, y, int(d)): CellState(x, y, d)
+        for x in range(GRID_SIZE) for y in range(GRID_SIZE) for d in DIRECTIONS
+    }
+    primitives = {}
+    for (x, y, d), _ in states.items():
+        legal = []
+        for dx, dy, new_d, kind, swept in _moves(Direction(d)):
+            cells = [(x + cx, y + cy) for cx, cy in swept]
+            if not all(_in_bounds(cx, cy) for cx, cy in cells):
+                continue
+            mask = 0
+            for cx, cy in cells:
+                mask |= cell_bit(cx, cy)
+            legal.append((states[(x + dx, y + dy, int(new_d))], kind, mask))
+        primitives[(x, y, d)] = legal
+    return primitives
+
+
+def build_cost_to_go(move_cost: Dict[str, float]) -> Dict[int, Dict[Tuple[int, int, int], float]]:
+    """
+    For each goal heading, the obstacle-free cost (moves priced by
+    move_cost[kind]) from every relative start
+    (x - goal.x, y - goal.y, heading) within an arena-sized window.  Any
+    arena path maps into this window and walls only remove moves, so the
+    table never overestimates (admissible), and as an exact cost-to-go on
+    a supergraph it is consistent.
+    """
+    span = MAX_PADDING - MIN_PADDING
+    # Moves grouped by the heading they end on, for expanding backwards
+    arriving = {int(d): [] for d in DIRECTIONS}
+    for prev_d in DIRECTIONS:
+        for dx, dy, new_d, kind, _ in _moves(prev_d):
+            arriving[int(new_d)].append((dx, dy, int(prev_d), move_cost[kind]))
+    tables = {}
+    for goal_d in DIRECTIONS:
+        # Uniform-cost search backwards from the goal over reversed moves
+        dist = {(0, 0, int(goal_d)): 0.0}
+        open_set = [(0.0, 0, 0, int(goal_d))]
+        while open_set:
+            g, x, y, d = heapq.heappop(open_set)
+            if g > dist[(x, y, d)]:
+                continue
+            for dx, dy, prev_d, cost in arriving[d]:
+                px, py = x - dx, y - dy
+                if abs(px) > span or abs(py) > span:
+                    continue
+                key = (px, py, prev_d)
+                if g + cost < dist.get(key, float('inf')):
+                    dist[key] = g + cost
+                    heapq.heappush(open_set, (g + cost, px, py, prev_d))
+        tables[int(goal_d)] = dist
+    return tables
+
+
+PRIMITIVES = _build_primitives()
+
+# The same moves as (x, y, heading) tuples both ways round, for the
+# goal-rooted searches in incremental.py, plus which states' moves sweep
+# each cell so a changed blocked mask touches only the moves it affects.
+SUCCESSORS: Dict[Tuple[int, int, int], List[Tuple[Tuple[int, int, int], str, int]]] = {}
+PREDECESSORS: Dict[Tuple[int, int, int], List[Tuple[Tuple[int, int, int], str, int]]] = {}
+SWEEPERS: Dict[int, Set[Tuple[int, int, int]]] = {}
+for _state, _moves_from in PRIMITIVES.items():
+    SUCCESSORS[_state] = []
+    for _next, _kind, _swept in _moves_from:
+        _key = (_next.x, _next.y, int(_next.direction))
+        SUCCESSORS[_state].append((_key, _kind, _swept))
+        PREDECESSORS.setdefault(_key, []).append((_state, _kind, _swept))
+        while _swept:
+            _low = _swept & -_swept
+            SWEEPERS.setdefault(_low.bit_length() - 1, set()).add(_state)
+            _swept ^= _low
+
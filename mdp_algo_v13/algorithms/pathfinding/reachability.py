@@ -0,0 +1,94 @@
+# algorithms/pathfinding/reachability.py
+#
+# Bitset views of the arena, for picking viewing positions without searching.
+#
+#   blocked_mask(grid)  — every cell the robot's centre may not occupy
+#                         (Grid.is_reachable() == False), rasterised from
+#                         one clearance square per obstacle plus the fixed
+#                         arena padding instead of testing cell by cell.
+#   Reachability        — one flood fill over the lattice moves from a start
+#                         state; a state is reachable iff A* from the start
+#                         would find a path to it, so "can the robot get
+#                         there" is a bit test.
+
+from collections import deque
+from typing import Dict, List, Tuple
+
+from algorithms.entities.grid import Grid
+from algorithms.pathfinding.lattice import DIRECTIONS, PRIMITIVES, cell_bit
+from algorithms.utils.consts import EXPANDED_CELL, GRID_SIZE, MAX_PADDING, MIN_PADDING
+from algorithms.utils.types import CellState
+
+# Cells outside the padding (the virtual walls)
+_BORDER = 0
+for _x in range(GRID_SIZE):
+    for _y in range(GRID_SIZE):
+        if not (MIN_PADDING <= _x <= MAX_PADDING and MIN_PADDING <= _y <= MAX_PADDING):
+            _BORDER |= cell_bit(_x, _y)
+
+_clearance: Dict[Tuple[int, int], int] = {}
+
+
+def _clearance_square(x: int, y: int) -> int:
+    """Cells within EXPANDED_CELL of obstacle (x, y) on both axes."""
+    mask = _clearance.get((x, y))
+    if mask is None:
+        mask = 0
+        for cx in range(max(0, x - EXPANDED_CELL), min(GRID_SIZE - 1, x + EXPANDED_CELL) + 1):
+            for cy in range(max(0, y - EXPANDED_CELL), min(GRID_SIZE - 1, y + EXPANDED_CELL) + 1):
+                mask |= cell_bit(cx, cy)
+        _clearance[(x, y)] = mask
+    return mask
+
+
+def blocked_mask(grid: Grid) -> int:
+    """Bitmask (lattice.cell_bit) of the cells grid.is_reachable() rejects."""
+    mask = _BORDER
+    for obs in grid.obstacles:
+        mask |= _clearance_square(obs.x, obs.y)
+    return mask
+
+
+class Reachability:
+    """States reachable from `start` on the grid described by `blocked`."""
+
+    def __init__(self, start: CellState, blocked: int):
+        self.blocked = blocked
+        # One cell bitset per heading
+        self.masks: Dict[int, int] = {int(d): 0 for d in DIRECTIONS}
+        start_key = (start.x, start.y, int(start.direction))
+        if start_key not in PRIMITIVES:
+            return
+        self.masks[start_key[2]] = cell_bit(start.x, start.y)
+        frontier = deque([start_key])
+        while frontier:
+            for next_s, _, swept in PRIMITIVES[frontier.popleft()]:
+                if swept & blocked:
+                    continue
+                d   = int(next_s.direction)
+                bit = cell_bit(next_s.x, next_s.y)
+                if not self.masks[d] & bit:
+                    self.masks[d] |= bit
+                    frontier.append((next_s.x, next_s.y, d))
+
+    def free(self, state: CellState) -> bool:
+        """The robot may stand on state's cell (Grid.is_reachable)."""
+        if not (0 <= state.x < GRID_SIZE and 0 <= state.y < GRID_SIZE):
+            return False
+        return not self.blocked & cell_bit(state.x, state.y)
+
+    def reachable(self, state: CellState) -> bool:
+        if not (0 <= state.x < GRID_SIZE and 0 <= state.y < GRID_SIZE):
+            return False
+        return bool(self.masks.get(int(state.direction), 0) & cell_bit(state.x, state.y))
+
+    def select(self, candidates: List[CellState]) -> Tuple[List[CellState], CellState]:
+        """
+        (candidates the robot can stand on, the first of them it can also
+        drive to — or, failing that, the first it can stand on; None if none).
+        """
+        valid = [pos for pos in candidates if self.free(pos)]
+        for pos in valid:
+            if self.reachable(pos):
+                return valid, pos
+        return valid, (valid[0] if valid else None)
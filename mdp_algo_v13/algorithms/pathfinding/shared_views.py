@@ -0,0 +1,107 @@
+# algorithms/pathfinding/shared_views.py
+#
+# Viewing positions that photograph several targets in one frame.
+#
+# A pose sees a target when it faces the image face square on from between
+# 3 and SHARED_VIEW_MAX_CELLS cells away, the whole face fits in the camera's
+# horizontal field of view, and no obstacle stands in the column between
+# them.  For every pair of targets whose faces point the same way, the
+# reachable pose that sees both at the least penalty (and whatever other
+# target it catches, up to SHARED_VIEW_MAX_TARGETS) becomes an extra node of
+# the cost matrix covering all of them; best_cover_route() then decides which
+# nodes the route visits.  The route photographs a shared node's targets with
+# back-to-back SP commands, which the RPi takes as one stop and one frame.
+
+import math
+from typing import Dict, FrozenSet, List, Optional, Tuple
+
+from algorithms.entities.obstacle import Obstacle
+from algorithms.pathfinding.reachability import Reachability
+from algorithms.utils.consts import (
+    CAMERA_FORWARD_OFFSET,
+    CAMERA_HFOV_DEG,
+    CELL_SIZE,
+    OBSTACLE_SIZE,
+    SHARED_VIEW_COST,
+    SHARED_VIEW_MAX_CELLS,
+    SHARED_VIEW_MAX_TARGETS,
+)
+from algorithms.utils.enums import Direction
+from algorithms.utils.types import CellState
+
+MIN_VIEW_CELLS = 3   # Nearest the clearance box lets the robot stand
+
+_FORWARD = {Direction.NORTH: (0, 1), Direction.EAST: (1, 0), Direction.SOUTH: (0, -1), Direction.WEST: (-1, 0)}
+_RIGHT   = {Direction.NORTH: (1, 0), Direction.EAST: (0, -1), Direction.SOUTH: (-1, 0), Direction.WEST: (0, 1)}
+# Heading that faces an image face square on
+_FACING  = {Direction.NORTH: Direction.SOUTH, Direction.SOUTH: Direction.NORTH,
+            Direction.EAST: Direction.WEST, Direction.WEST: Direction.EAST}
+
+_HALF_FOV = math.tan(math.radians(CAMERA_HFOV_DEG / 2))
+
+
+def view_penalty(pose: CellState, target: Obstacle, obstacles: List[Obstacle]) -> Optional[float]:
+    """Penalty for photographing target from pose, or None if pose cannot see it."""
+    if target.direction not in _FACING or pose.direction != _FACING[target.direction]:
+        return None
+    fx, fy = _FORWARD[pose.direction]
+    rx, ry = _RIGHT[pose.direction]
+    dx, dy = target.x - pose.x, target.y - pose.y
+    ahead   = dx * fx + dy * fy
+    lateral = dx * rx + dy * ry
+    if not MIN_VIEW_CELLS <= ahead <= SHARED_VIEW_MAX_CELLS:
+        return None
+    face_cm = ahead * CELL_SIZE - CELL_SIZE / 2 - CAMERA_FORWARD_OFFSET
+    if abs(lateral) * CELL_SIZE + OBSTACLE_SIZE / 2 > face_cm * _HALF_FOV:
+        return None
+    for other in obstacles:
+        if other is target:
+            continue
+        ox, oy = other.x - pose.x, other.y - pose.y
+        if ox * rx + oy * ry == lateral and 0 < ox * fx + oy * fy < ahead:
+            return None
+    return 5 * (ahead - MIN_VIEW_CELLS) + SHARED_VIEW_COST * abs(lateral)
+
+
+def shared_viewing_positions(
+    targets: List[Obstacle],
+    obstacles: List[Obstacle],
+    reach: Reachability,
+) -> List[Tuple[CellState, List[int]]]:
+    """
+    (pose, indices into targets it photographs) for each set of two or more
+    targets one reachable pose can photograph together, the cheapest pose per
+    set.  The pose's penalty is the sum of its targets' view penalties.
+    """
+    best: Dict[FrozenSet[int], Tuple[float, CellState]] = {}
+    for a, first in enumerate(targets):
+        if first.direction not in _FACING:
+            continue
+        heading = _FACING[first.direction]
+        fx, fy  = _FORWARD[heading]
+        rx, ry  = _RIGHT[heading]
+        for b in range(a + 1, len(targets)):
+            second = targets[b]
+            if second.direction != first.direction:
+                continue
+            if max(abs(second.x - first.x), abs(second.y - first.y)) > SHARED_VIEW_MAX_CELLS:
+                continue
+            for ahead in range(MIN_VIEW_CELLS, SHARED_VIEW_MAX_CELLS + 1):
+                for lateral in (-1, 0, 1):
+                    pose = CellState(first.x - ahead * fx - lateral * rx, first.y - ahead * fy - lateral * ry, heading)
+                    if view_penalty(pose, second, obstacles) is None or not reach.reachable(pose):
+                        continue
+                    seen = []
+                    for k, target in enumerate(targets):
+                        penalty = view_penalty(pose, target, obstacles)
+                        if penalty is not None:
+                            seen.append((penalty, k))
+                    seen.sort()
+                    seen = seen[:SHARED_VIEW_MAX_TARGETS]
+                    if a not in [k for _, k in seen] or b not in [k for _, k in seen]:
+                        continue
+                    key   = frozenset(k for _, k in seen)
+                    total = sum(p for p, _ in seen)
+                    if key not in best or total < best[key][0]:
+                        best[key] = (total, CellState(pose.x, pose.y, heading, penalty=total))
+    return [(pose, sorted(key)) for key, (_, pose) in sorted(best.items(), key=lambda item: sorted(item[0]))]
@@ -0,0 +1,337 @@
+# algorithms/tests/benchmark.py
+#
+# Planner benchmark over a fixed, seeded corpus of arenas.
+#
+#   python3 -m algorithms.tests.benchmark                       # generate + run
+#   python3 -m algorithms.tests.benchmark --write-corpus corpus.ndjson
+#   python3 -m algorithms.tests.benchmark --corpus corpus.ndjson --results py.ndjson
+#   python3 -m algorithms.tests.benchmark --corpus corpus.ndjson --compare before.ndjson
+#
+# Run from mdp_algo_v13/.  The corpus is one /path request per line (plus
+# "name" and "kind"), so RPI/planner_bench.c plans exactly the same arenas;
+# its results file has the same format and works with --compare and
+# --summarize.  Corpus kinds:
+#
+#   fixed    FIXED_ARENAS: the RPI/json_corpus sendArena payload and test_api.py
+#   random   5-8 obstacles anywhere outside the start zone
+#   cluster  5-8 obstacles packed into one quarter of the arena
+#   boxed    one target's image face walled in by another obstacle
+#   wall     one target's image facing the arena wall
+#   pose     random obstacles, robot starting elsewhere / facing elsewhere
+#
+# Arenas are planned across all cores (one arena per worker, cost-matrix rows
+# run serially inside it), so plan times are single-core times.  --workers 1
+# plans one arena at a time with the server's row pool instead.  Every arena
+# is priced with the default cost model unless --cost-model is given, so runs
+# on machines with different fitted models stay comparable.
+#
+# route_cost is measured on the emitted commands, the same way for both
+# planners: one per 10 cm of FW/BW and TURN_COST + TURN_RADIUS per 90-degree
+# turn.
+
+import argparse
+import json
+import math
+import os
+import random
+import sys
+import time
+from concurrent.futures import ProcessPoolExecutor
+from typing import Dict, List, Optional
+
+from algorithms.utils.consts import CELL_SIZE, GRID_SIZE, TURN_COST, TURN_RADIUS
+
+DEFAULT_COUNT   = 2000
+DEFAULT_SEED    = 0
+KINDS           = ('random', 'cluster', 'boxed', 'wall', 'pose')
+FACES           = (0, 2, 4, 6)
+START_ZONE      = 4     # The 4x4 start box in the south-west corner stays clear
+NO_COST_MODEL   = ''    # A path that never exists: cost_model.current() uses FALLBACK_MODEL
+
+# Layouts the rest of the repo already uses, in /path coordinates (0-indexed
+# cells; the robot at the server's default start)
+FIXED_ARENAS = [
+    {
+        'name': 'fixed/sendarena_8',
+        'obstacles': [
+            {'id': 1, 'x': 4,  'y': 9,  'd': 4}, {'id': 2, 'x': 14, 'y': 14, 'd': 6},
+            {'id': 3, 'x': 9,  'y': 2,  'd': 0}, {'id': 4, 'x': 1,  'y': 16, 'd': 2},
+            {'id': 5, 'x': 17, 'y': 1,  'd': 6}, {'id': 6, 'x': 6,  'y': 6,  'd': 4},
+            {'id': 7, 'x': 12, 'y': 8,  'd': 2}, {'id': 8, 'x': 15, 'y': 17, 'd': 0},
+        ],
+        'robot_x': 1, 'robot_y': 1, 'robot_dir': 0,
+    },
+    {
+        # algorithms/tests/test_api.py
+        'name': 'fixed/test_api',
+        'obstacles': [
+            {'id': 1, 'x': 5, 'y': 10, 'd': 0}, {'id': 2, 'x': 15, 'y': 5, 'd': 2},
+            {'id': 3, 'x': 10, 'y': 15, 'd': 4},
+        ],
+        'robot_x': 1, 'robot_y': 1, 'robot_dir': 0,
+    },
+]
+
+
+# =============================================================================
+# CORPUS
+# =============================================================================
+
+def _free_cell(rng: random.Random, taken: set, x_range=(0, GRID_SIZE - 1), y_range=(0, GRID_SIZE - 1)):
+    while True:
+        x, y = rng.randint(*x_range), rng.randint(*y_range)
+        if (x, y) not in taken and not (x < START_ZONE and y < START_ZONE):
+            return x, y
+
+
+def _arena(rng: random.Random, kind: str, name: str) -> dict:
+    n         = rng.randint(5, 8)
+    taken     = set()
+    obstacles = []
+
+    def add(x, y, d):
+        taken.add((x, y))
+        obstacles.append({'id': len(obstacles) + 1, 'x': x, 'y': y, 'd': d})
+
+    robot = {'robot_x': 1, 'robot_y': 1, 'robot_dir': 0}
+
+    if kind == 'boxed':
+        # Another obstacle two cells in front of the image face
+        x, y = _free_cell(rng, taken, (3, GRID_SIZE - 4), (3, GRID_SIZE - 4))
+        d    = rng.choice(FACES)
+        dx, dy = {0: (0, 2), 2: (2, 0), 4: (0, -2), 6: (-2, 0)}[d]
+        add(x, y, d)
+        if (x + dx, y + dy) not in taken:
+            add(x + dx, y + dy, rng.choice(FACES))
+    elif kind == 'wall':
+        # On the border, image facing the wall
+        d = rng.choice(FACES)
+        edge = rng.randint(START_ZONE, GRID_SIZE - 1)
+        x, y = {0: (edge, GRID_SIZE - 1), 2: (GRID_SIZE - 1, edge), 4: (edge, 0), 6: (0, edge)}[d]
+        add(x, y, d)
+    elif kind == 'pose':
+        robot = {'robot_x': rng.randint(1, 2), 'robot_y': rng.randint(1, 2), 'robot_dir': rng.choice(FACES)}
+
+    if kind == 'cluster':
+        qx, qy  = rng.choice([(0, 1), (1, 0), (1, 1)])
+        half    = GRID_SIZE // 2
+        x_range = (qx * half, qx * half + half - 1)
+        y_range = (qy * half, qy * half + half - 1)
+    else:
+        x_range = y_range = (0, GRID_SIZE - 1)
+
+    while len(obstacles) < n:
+        x, y = _free_cell(rng, taken, x_range, y_range)
+        add(x, y, rng.choice(FACES))
+
+    return {'name': name, 'kind': kind, 'obstacles': obstacles, **robot}
+
+
+def generate_corpus(count: int = DEFAULT_COUNT, seed: int = DEFAULT_SEED) -> List[dict]:
+    """The fixed layouts, then `count` seeded arenas cycling through KINDS."""
+    corpus = [dict(arena, kind='fixed') for arena in FIXED_ARENAS]
+    for i in range(count):
+        kind = KINDS[i % len(KINDS)]
+        # One RNG per arena, so arena i is the same whatever count is
+        rng  = random.Random(f"{seed}:{i}")
+        corpus.append(_arena(rng, kind, f"{kind}/{seed}-{i}"))
+    return corpus
+
+
+def load_ndjson(path: str) -> List[dict]:
+    with open(path) as f:
+        return [json.loads(line) for line in f if line.strip()]
+
+
+def write_ndjson(path: str, rows: List[dict]) -> None:
+    with open(path, 'w') as f:
+        for row in rows:
+            f.write(json.dumps(row, separators=(',', ':')) + "\n")
+
+
+# =============================================================================
+# EVALUATION
+# =============================================================================
+
+def route_cost(commands: List[str]) -> float:
+    """Cell-metric cost of a command list (see the header)."""
+    cost = 0.0
+    for cmd in commands:
+        if cmd[:2] in ('FW', 'BW'):
+            cost += int(cmd[2:]) / CELL_SIZE
+        elif cmd[:2] in ('FL', 'FR', 'BL', 'BR'):
+            cost += (TURN_COST + TURN_RADIUS) * int(cmd[2:]) / 90
+    return cost
+
+
+def _init_worker(cost_model_path: str, serial_rows: bool) -> None:
+    from algorithms.pathfinding import cost_model, hamiltonian
+    # Silence the solver's progress prints while planning thousands of arenas
+    sys.stdout = open(os.devnull, 'w')
+    cost_model.COST_MODEL_PATH = cost_model_path
+    if serial_rows:
+        hamiltonian.ROW_WORKERS = 1
+
+
+def plan(arena: dict) -> dict:
+    """Plan one arena the way /path does and measure it."""
+    from algorithms.commands.generator import CommandGenerator
+    from algorithms.entities.grid import Grid
+    from algorithms.entities.obstacle import Obstacle
+    from algorithms.entities.robot import Robot
+    from algorithms.pathfinding.hamiltonian import HamiltonianSolver
+    from algorithms.utils.enums import Direction
+
+    result = {'name': arena['name'], 'kind': arena.get('kind', ''), 'obstacles': len(arena['obstacles'])}
+    start  = time.perf_counter()
+    try:
+        grid = Grid()
+        for obs in arena['obstacles']:
+            grid.add_obstacle(Obstacle(obs['x'], obs['y'], Direction(obs['d']), obs['id']))
+        robot_dir = arena.get('robot_dir', 0)
+        robot     = Robot(arena.get('robot_x', 1), arena.get('robot_y', 1),
+                          Direction(robot_dir) if robot_dir in FACES else Direction.NORTH)
+
+        solver = HamiltonianSolver(grid, robot)
+        permutation, distance = solver.find_optimal_order()
+        full_path = solver.generate_full_path(permutation)
+        commands  = CommandGenerator().generate_commands(full_path, append_fin=False)
+    except Exception as e:
+        result.update(time_us=int((time.perf_counter() - start) * 1e6), error=repr(e))
+        return result
+
+    visited = sum(1 for cmd in commands if cmd.startswith('SP'))
+    result.update(
+        time_us=int((time.perf_counter() - start) * 1e6),
+        visited=visited,
+        skipped=len(arena['obstacles']) - visited,
+        commands=len(commands),
+        route_cost=round(route_cost(commands), 3),
+        distance=round(float(distance), 3),
+    )
+    return result
+
+
+def run(corpus: List[dict], workers: int, cost_model_path: str) -> List[dict]:
+    if workers <= 1:
+        stdout = sys.stdout
+        try:
+            _init_worker(cost_model_path, serial_rows=False)
+            return [plan(arena) for arena in corpus]
+        finally:
+            sys.stdout.close()
+            sys.stdout = stdout
+    with ProcessPoolExecutor(max_workers=workers, initializer=_init_worker,
+                             initargs=(cost_model_path, True)) as pool:
+        return list(pool.map(plan, corpus, chunksize=8))
+
+
+# =============================================================================
+# REPORTING
+# =============================================================================
+
+def percentile(values: List[float], p: float) -> float:
+    """Nearest-rank percentile; 0 for no values."""
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(p / 100 * len(ordered)) - 1)]
+
+
+def summarize(results: List[dict]) -> Dict[str, dict]:
+    groups: Dict[str, List[dict]] = {'all': results}
+    for r in results:
+        groups.setdefault(r.get('kind') or '-', []).append(r)
+
+    summary = {}
+    for kind, rows in groups.items():
+        ok    = [r for r in rows if 'error' not in r]
+        times = [r['time_us'] / 1000 for r in rows]
+        summary[kind] = {
+            'arenas':      len(rows),
+            'errors':      len(rows) - len(ok),
+            'p50_ms':      percentile(times, 50),
+            'p90_ms':      percentile(times, 90),
+            'p99_ms':      percentile(times, 99),
+            'max_ms':      max(times, default=0.0),
+            'route_cost':  sum(r['route_cost'] for r in ok) / max(1, len(ok)),
+            'skipped':     sum(r['skipped'] for r in ok),
+            'with_skips':  sum(1 for r in ok if r['skipped']),
+            'commands':    sum(r['commands'] for r in ok) / max(1, len(ok)),
+        }
+    return summary
+
+
+def print_summary(summary: Dict[str, dict], title: str) -> None:
+    print(title)
+    print(f"  {'kind':<8} {'arenas':>6} {'err':>4} {'p50 ms':>8} {'p90 ms':>8} {'p99 ms':>8} {'max ms':>8}"
+          f" {'cost':>7} {'skipped':>7} {'w/skip':>6} {'cmds':>6}")
+    for kind, s in summary.items():
+        print(f"  {kind:<8} {s['arenas']:>6} {s['errors']:>4} {s['p50_ms']:>8.2f} {s['p90_ms']:>8.2f}"
+              f" {s['p99_ms']:>8.2f} {s['max_ms']:>8.2f} {s['route_cost']:>7.1f} {s['skipped']:>7}"
+              f" {s['with_skips']:>6} {s['commands']:>6.1f}")
+
+
+def compare(results: List[dict], baseline: List[dict]) -> None:
+    """Per-arena differences against an earlier run over the same corpus."""
+    before  = {r['name']: r for r in baseline}
+    shared  = [r for r in results if r['name'] in before and 'error' not in r and 'error' not in before[r['name']]]
+    if not shared:
+        print("No arenas in common with the baseline.")
+        return
+
+    old_times = [before[r['name']]['time_us'] / 1000 for r in shared]
+    new_times = [r['time_us'] / 1000 for r in shared]
+    cheaper   = sum(1 for r in shared if r['route_cost'] < before[r['name']]['route_cost'] - 1e-6)
+    dearer    = sum(1 for r in shared if r['route_cost'] > before[r['name']]['route_cost'] + 1e-6)
+    skips     = sum(r['skipped'] - before[r['name']]['skipped'] for r in shared)
+    commands  = sum(r['commands'] - before[r['name']]['commands'] for r in shared)
+
+    print(f"Against baseline ({len(shared)} arenas in common):")
+    for p in (50, 90, 99):
+        old, new = percentile(old_times, p), percentile(new_times, p)
+        print(f"  p{p} plan time  {old:8.2f} -> {new:8.2f} ms ({(new - old) / old * 100 if old else 0:+.1f}%)")
+    print(f"  route cost     {cheaper} arenas cheaper, {dearer} dearer, "
+          f"{len(shared) - cheaper - dearer} unchanged")
+    print(f"  skipped        {skips:+d} obstacles")
+    print(f"  commands       {commands:+d} in total")
+
+
+def main(argv: Optional[List[str]] = None) -> int:
+    parser = argparse.ArgumentParser(description="Planner benchmark over a seeded arena corpus")
+    parser.add_argument('--count', type=int, default=DEFAULT_COUNT, help="generated arenas (default %(default)s)")
+    parser.add_argument('--seed', type=int, default=DEFAULT_SEED)
+    parser.add_argument('--corpus', help="plan this NDJSON corpus instead of generating one")
+    parser.add_argument('--write-corpus', metavar='PATH', help="write the corpus and exit")
+    parser.add_argument('--workers', type=int, default=os.cpu_count() or 1)
+    parser.add_argument('--cost-model', default=NO_COST_MODEL, metavar='PATH',
+                        help="cost model file to plan with (default: the built-in cell metric)")
+    parser.add_argument('--results', metavar='PATH', help="write per-arena results as NDJSON")
+    parser.add_argument('--compare', metavar='PATH', help="results file of an earlier run to compare against")
+    parser.add_argument('--summarize', metavar='PATH', help="only print the summary of a results file")
+    args = parser.parse_args(argv)
+
+    if args.summarize:
+        print_summary(summarize(load_ndjson(args.summarize)), args.summarize)
+        return 0
+
+    corpus = load_ndjson(args.corpus) if args.corpus else generate_corpus(args.count, args.seed)
+    if args.write_corpus:
+        write_ndjson(args.write_corpus, corpus)
+        print(f"Wrote {len(corpus)} arenas to {args.write_corpus}")
+        return 0
+
+    start   = time.perf_counter()
+    results = run(corpus, args.workers, args.cost_model)
+    print(f"Planned {len(results)} arenas on {args.workers} worker(s) in {time.perf_counter() - start:.1f} s")
+    print_summary(summarize(results), "Python planner")
+
+    if args.results:
+        write_ndjson(args.results, results)
+    if args.compare:
+        compare(results, load_ndjson(args.compare))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
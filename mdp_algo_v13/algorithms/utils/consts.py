@@ -58,4 +58,28 @@ MAX_BOUNDARY = 185      # 185cm from wall
 # Grid Index limits (Center-point logic)
 # Valid indices are 1 to 18. Indices 0 and 19 are virtual walls.
 MIN_PADDING = 1         
-MAX_PADDING = 18
\ No newline at end of file
+MAX_PADDING = 18
+
+# -----------------------------------------------------------------------------
+# 6. SPEED CLASSES
+# -----------------------------------------------------------------------------
+# With speed classes on (AlgorithmInput.speed_classes), a move or turn may end
+# in a class letter: "FW90F" runs fast, "FR90S" slow, no letter at the normal
+# speed. Slack is how many free cells lie between the robot's cell and the
+# nearest obstacle's EXPANDED_CELL box (Chebyshev).
+SLOW_SLACK = 0          # Slack this small anywhere on a command: slow
+FAST_SLACK = 2          # A straight with at least this much slack all along...
+FAST_MIN_CM = 50        # ...and at least this long runs fast
+
+# -----------------------------------------------------------------------------
+# 7. SHARED VIEWING POSITIONS
+# -----------------------------------------------------------------------------
+# One stop can photograph several image faces when they all fit in one frame
+# (pathfinding/shared_views.py).  Camera figures match the RPi's
+# image_preprocess.c; SHARED_VIEW_MAX_TARGETS its SNAPSHOT_GROUP_MAX.
+CAMERA_HFOV_DEG = 62.2          # Pi Camera v2
+CAMERA_FORWARD_OFFSET = 5       # Lens ahead of the robot's centre (cm)
+SHARED_VIEW_MAX_CELLS = 5       # Farthest a shared face may be, robot cell to obstacle cell
+SHARED_VIEW_MAX_TARGETS = 3
+SHARED_VIEW_COST = 10           # Penalty per cell a shared face is off the camera's axis
+COVER_MAX_TARGETS = 12          # More targets than this: one stop per target (held_karp.py)
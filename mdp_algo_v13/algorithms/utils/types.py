@@ -1,6 +1,6 @@
 # IN THIS FILE: POSITION, CELLSTATE
 
-from typing import Optional
+from typing import List, Optional
 
 from algorithms.utils.enums import Direction
 
@@ -50,10 +50,16 @@ class CellState(Position):
         super().__init__(x, y, direction)
         self.screenshot_id = screenshot_id  # Which obstacle to photograph (-1 = none)
         self.penalty = penalty              # Additional cost for using this position
+        self.shared_ids: List[int] = []     # More obstacles in the same frame (shared_views.py)
     
     def set_screenshot(self, screenshot_id: int) -> None:
         """Mark this position as a photography point"""
         self.screenshot_id = screenshot_id
+
+    def set_screenshots(self, screenshot_ids: List[int]) -> None:
+        """Mark this position as the photography point of every obstacle in screenshot_ids"""
+        self.screenshot_id = screenshot_ids[0] if screenshot_ids else -1
+        self.shared_ids = list(screenshot_ids[1:])
     
     def get_dict(self) -> dict:
         """Convert to dictionary for JSON serialization"""
@@ -63,6 +69,11 @@ class CellState(Position):
             "d": int(self.direction),
             "s": self.screenshot_id
         }
+
+    def path_dicts(self) -> List[dict]:
+        """get_dict(), once more for each shared obstacle, so every SP has its snap position"""
+        first = self.get_dict()
+        return [first] + [dict(first, s=sid) for sid in self.shared_ids]
     
     def __repr__(self) -> str:
         """String representation for debugging"""
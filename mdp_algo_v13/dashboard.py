@@ -1,4 +1,9 @@
+import argparse
+import json
 import random
+import socket
+import threading
+import time
 import matplotlib.pyplot as plt
 import matplotlib.patches as patches
 import matplotlib.widgets as widgets
@@ -10,6 +15,8 @@ import numpy as np
 API_URL      = "http://localhost:5000/path"
 BULLSEYE_URL = "http://localhost:5000/bullseye"
 GRID_SIZE    = 20
+LIVE_PORT    = 5602   # RPi controller's live feed (RPI/live_feed.h)
+LIVE_MAX_HZ  = 10     # Pose/telemetry/queue lines per second the controller sends us
 
 # Direction int → human name
 DIR_NAMES = {0: "NORTH", 2: "EAST", 4: "SOUTH", 6: "WEST"}
@@ -17,13 +24,67 @@ DIR_NAMES = {0: "NORTH", 2: "EAST", 4: "SOUTH", 6: "WEST"}
 FACE_ARROW = {0: (0.5, 1, 0, 0.3), 2: (1, 0.5, 0.3, 0), 4: (0.5, 0, 0, -0.3), 6: (0, 0.5, -0.3, 0)}
 
 
+class LiveFeed:
+    """
+    Subscriber to the controller's live feed: one JSON object per line, keyed by
+    "topic". Keeps the latest message of each topic and every detection of the
+    current mission. The reader never holds the socket back; a slow dashboard
+    only makes the controller drop older lines for it.
+    """
+
+    def __init__(self, host, port, max_hz=LIVE_MAX_HZ):
+        self.host, self.port, self.max_hz = host, port, max_hz
+        self.lock = threading.Lock()
+        self.latest = {}       # topic -> newest message
+        self.detections = {}   # obstacle id -> detection message
+        self.connected = False
+        self.changed = False
+        threading.Thread(target=self._run, daemon=True).start()
+
+    def _run(self):
+        while True:
+            try:
+                with socket.create_connection((self.host, self.port), timeout=5) as sock:
+                    sock.settimeout(None)
+                    sock.sendall((json.dumps({"max_hz": self.max_hz}) + "\n").encode("ascii"))
+                    self._set_connected(True)
+                    for line in sock.makefile("rb"):
+                        self._apply(json.loads(line))
+            except (OSError, ValueError):
+                pass
+            self._set_connected(False)
+            time.sleep(2)
+
+    def _set_connected(self, connected):
+        with self.lock:
+            self.changed = self.changed or connected != self.connected
+            self.connected = connected
+
+    def _apply(self, msg):
+        with self.lock:
+            topic = msg.get("topic")
+            if topic == "state" and msg.get("phase") == "pathfinding":
+                self.detections = {}
+            if topic == "detection":
+                self.detections[msg["obstacle"]] = msg
+            self.latest[topic] = msg
+            self.changed = True
+
+    def take(self):
+        """Returns (changed since the last call, connected, latest, detections)."""
+        with self.lock:
+            changed, self.changed = self.changed, False
+            return changed, self.connected, dict(self.latest), dict(self.detections)
+
+
 class InteractiveDashboard:
 
     # =========================================================================
     # INIT
     # =========================================================================
 
-    def __init__(self):
+    def __init__(self, live=None):
+        self.live = live               # LiveFeed, or None
         # --- Obstacle & path state ---
         self.obstacles   = []          # List of {id, x, y, d}  — ground truth obstacle list
         self.raw_path    = []          # Active path being played back
@@ -50,6 +111,10 @@ class InteractiveDashboard:
 
         self.timer = self.fig.canvas.new_timer(interval=50)
         self.timer.add_callback(self.play_step)
+        if self.live:
+            self.live_timer = self.fig.canvas.new_timer(interval=200)
+            self.live_timer.add_callback(self.live_step)
+            self.live_timer.start()
 
         # --- Row 1: Playback controls ---
         self.btn_prev = widgets.Button(plt.axes([0.05, 0.14, 0.12, 0.06]), '<< Prev')
@@ -440,6 +505,10 @@ class InteractiveDashboard:
         self.status_text.set_text(f"{msg}")
         self.status_text.set_color(color)
 
+    def live_step(self):
+        if self.live.changed:
+            self.redraw()
+
     # =========================================================================
     # CLEAR
     # =========================================================================
@@ -669,8 +738,74 @@ class InteractiveDashboard:
                     (fx, fy), 1.8, fill=False, ec='gold', lw=3, zorder=12, alpha=0.9
                 ))
 
+        if self.live:
+            self._draw_live()
+
         self.fig.canvas.draw()
 
+    def _draw_live(self):
+        """Overlays what the controller's live feed last reported."""
+        _, connected, latest, detections = self.live.take()
+
+        # Robot where it last stopped for a snapshot (grid cell of its centre)
+        robot = latest.get("robot")
+        if robot:
+            rx, ry = robot["x"] + 0.5, robot["y"] + 0.5
+            self.ax.add_patch(patches.Rectangle(
+                (rx - 1.5, ry - 1.5), 3, 3, fill=False, ec='royalblue', lw=2, ls='--', zorder=13
+            ))
+            angle = np.radians(90 - 45 * robot["d"])
+            self.ax.arrow(rx, ry, 0.8 * np.cos(angle), 0.8 * np.sin(angle),
+                          color='royalblue', width=0.08, head_width=0.25, zorder=13)
+
+        for obs in self.obstacles:
+            det = detections.get(obs['id'])
+            if det:
+                label = f"img {det['img_id']}" if det['img_id'] >= 0 else "no match"
+                self.ax.text(obs['x'] + 0.5, obs['y'] - 0.4, label, ha='center', va='center',
+                             fontsize=7, color='navy', zorder=13,
+                             bbox=dict(boxstyle='round,pad=0.1', facecolor='white', alpha=0.8))
+
+        lines = [f"LIVE {self.live.host}:{self.live.port} "
+                 + (latest.get("state", {}).get("phase", "connected") if connected else "disconnected")]
+        cmd = latest.get("command")
+        if cmd:
+            lines.append(f"cmd #{cmd['id']} {cmd.get('cmd', '')}{cmd.get('value', '')} {cmd['status']}")
+        queue = latest.get("queue")
+        if queue:
+            lines.append(f"images {queue['image_queue']} queued / {queue['images_busy']} busy, "
+                         f"STM32 {queue['stm32_in_flight']} in flight")
+        pose = latest.get("pose")
+        if pose:
+            lines.append(f"odom ({pose['x_mm'] / 10:.1f}, {pose['y_mm'] / 10:.1f}) cm "
+                         f"{pose['theta_ddeg'] / 10:.1f}°")
+        telem = latest.get("telemetry")
+        if telem:
+            lines.append(f"rps {telem['rps_a_milli'] / 1000:.2f}/{telem['rps_d_milli'] / 1000:.2f} "
+                         f"pwm {telem['pwm_a']}/{telem['pwm_d']} yaw {telem['yaw_ddeg'] / 10:.1f}° "
+                         f"IR {telem['ir_mm']} mm")
+        report = latest.get("report")
+        if report:
+            answered = [ms for _, ms in report["targets"] if ms >= 0]
+            lines.append(f"last run #{report['mission']} {report['outcome']} {report['total_ms'] / 1000:.1f} s: "
+                         f"plan {report['plan_ms']} / motion {report['motion_ms']} / "
+                         f"settle {report['settle_ms']} / snap {report['snapshot_ms']} ms")
+            lines.append(f"  {len(answered)}/{len(report['targets'])} targets"
+                         + (f", worst {max(answered)} ms" if answered else "")
+                         + f", {report['retries'] + report['recaptures']} retries, "
+                         f"{report['ack_timeouts'] + report['capture_timeouts'] + report['settle_timeouts']} timeouts")
+        self.ax.text(0.01, 0.99, "\n".join(lines), transform=self.ax.transAxes, va='top', ha='left',
+                     fontsize=7.5, family='monospace', zorder=14,
+                     bbox=dict(boxstyle='round,pad=0.3', facecolor='white', alpha=0.85))
+
 
 if __name__ == "__main__":
-    dashboard = InteractiveDashboard()
+    parser = argparse.ArgumentParser(description="Path planning dashboard")
+    parser.add_argument("--live", metavar="HOST[:PORT]",
+                        help=f"also show the controller's live feed (default port {LIVE_PORT})")
+    args = parser.parse_args()
+    live = None
+    if args.live:
+        host, _, port = args.live.partition(":")
+        live = LiveFeed(host, int(port) if port else LIVE_PORT)
+    dashboard = InteractiveDashboard(live)
@@ -1,17 +1,22 @@
 # main.py
+import json
 import uvicorn
-from typing import List, Optional
+from typing import Iterator, List, Optional, Tuple
 from fastapi import FastAPI, HTTPException
 from fastapi.middleware.cors import CORSMiddleware
+from fastapi.responses import StreamingResponse
 from pydantic import BaseModel
 
+from algorithms.commands import speed
 from algorithms.commands.generator import CommandGenerator
 from algorithms.entities.grid import Grid
 from algorithms.entities.obstacle import Obstacle
 from algorithms.entities.robot import Robot
 from algorithms.pathfinding.hamiltonian import HamiltonianSolver
+from algorithms.pathfinding.hybrid_astar import HybridAStar, cell_of
 from algorithms.pathfinding.bullseye_handler import BullseyeHandler
 from algorithms.utils.enums import Direction
+from algorithms.utils.types import CellState
 
 app = FastAPI(title="MDP Algorithm Server")
 
@@ -39,6 +44,14 @@ class AlgorithmInput(BaseModel):
     robot_y: Optional[int] = 1
     robot_dir: Optional[int] = 0
     retrying: Optional[bool] = False
+    # Plan within this many ms (anytime mode) instead of waiting for the exact order
+    time_budget_ms: Optional[int] = None
+    # "hybrid": drive each leg on a continuous-pose path where that is cheaper
+    # (hybrid_astar.py): turns of any angle, fewer commands
+    planner: Optional[str] = None
+    # Append a speed class to each move and turn, from the clearance along it
+    # (commands/speed.py): "FW90F" fast, "FR90S" slow
+    speed_classes: Optional[bool] = False
 
 class PathPoint(BaseModel):
     x: int
@@ -98,13 +111,12 @@ class BullseyeOutput(BaseModel):
 # CORE ALGORITHM (unchanged)
 # =============================================================================
 
-def run_algorithm(
+def build_solver(
     obstacles_data: List[dict],
     robot_x: int,
     robot_y: int,
     robot_dir: int,
-    retrying: bool,
-) -> dict:
+) -> HamiltonianSolver:
     grid = Grid()
     for obs in obstacles_data:
         grid.add_obstacle(Obstacle(
@@ -114,17 +126,65 @@ def run_algorithm(
     start_dir = Direction(robot_dir) if robot_dir in [0, 2, 4, 6] else Direction.NORTH
     robot = Robot(robot_x, robot_y, start_dir)
 
-    solver = HamiltonianSolver(grid, robot)
-    permutation, total_cost = solver.find_optimal_order()
-    full_path = solver.generate_full_path(permutation)
+    return HamiltonianSolver(grid, robot)
 
+
+def hybrid_legs(
+    solver: HamiltonianSolver,
+    permutation: List[int],
+    speed_classes: bool = False,
+) -> Iterator[Tuple[List[str], List[CellState], List[int]]]:
+    """
+    (commands without the SPs, path, obstacle_ids) per leg of the lattice's
+    visiting order, each leg driven on its hybrid A* path when that costs
+    less than the lattice's (hybrid_astar.py).  The path of a hybrid leg is
+    its poses rounded to cells and the four headings, for display only.
+    """
+    hybrid  = HybridAStar(solver.grid)
     cmd_gen = CommandGenerator()
-    raw_commands = cmd_gen.generate_commands(full_path)
+    grid    = solver.grid if speed_classes else None
+    for _, segment, obstacle_ids in solver.iter_path_segments(permutation):
+        commands = cmd_gen.generate_commands(segment, append_fin=False, grid=grid)
+        found = hybrid.search(segment[0], segment[-1])
+        if found is not None and hybrid.cost(found) < hybrid.cost(cmd_gen.command_segments(commands)):
+            classes = None
+            if speed_classes:
+                classes = speed.segment_classes(solver.grid, found, hybrid.segment_cells(segment[0], found))
+            commands = cmd_gen.segment_commands(found, classes)
+            points = [segment[0]]
+            for pose in hybrid.poses(segment[0], found)[1:-1]:
+                if cell_of(pose) != points[-1]:
+                    points.append(cell_of(pose))
+            segment = points + [segment[-1]]
+        yield commands, segment, obstacle_ids
 
-    path_points = [
-        {"x": s.x, "y": s.y, "d": int(s.direction), "s": s.screenshot_id}
-        for s in full_path
-    ]
+
+def run_algorithm(
+    obstacles_data: List[dict],
+    robot_x: int,
+    robot_y: int,
+    robot_dir: int,
+    retrying: bool,
+    time_budget_ms: Optional[int] = None,
+    planner: Optional[str] = None,
+    speed_classes: bool = False,
+) -> dict:
+    solver = build_solver(obstacles_data, robot_x, robot_y, robot_dir)
+    permutation, total_cost = solver.find_optimal_order(time_budget_ms=time_budget_ms)
+
+    if planner == "hybrid":
+        full_path, raw_commands = [], []
+        for commands, segment, obstacle_ids in hybrid_legs(solver, permutation, speed_classes):
+            full_path.extend(segment if not full_path else segment[1:])
+            full_path[-1].set_screenshots(obstacle_ids)
+            raw_commands.extend(commands + [f"SP{i}" for i in obstacle_ids])
+        raw_commands.append("FIN")
+    else:
+        full_path = solver.generate_full_path(permutation)
+        raw_commands = CommandGenerator().generate_commands(full_path, grid=solver.grid if speed_classes else None)
+
+    # A shared viewing position appears once per obstacle it photographs
+    path_points = [p for s in full_path for p in s.path_dicts()]
 
     return {
         "data": {
@@ -136,6 +196,57 @@ def run_algorithm(
     }
 
 
+def ndjson_line(obj: dict) -> str:
+    # Compact separators: the RPi's parser matches keys as "key":value
+    return json.dumps(obj, separators=(",", ":")) + "\n"
+
+
+def stream_algorithm(
+    obstacles_data: List[dict],
+    robot_x: int,
+    robot_y: int,
+    robot_dir: int,
+    retrying: bool,
+    time_budget_ms: Optional[int] = None,
+    planner: Optional[str] = None,
+    speed_classes: bool = False,
+) -> Iterator[str]:
+    """
+    Same route as run_algorithm(), emitted as NDJSON while it is generated so
+    the robot can start on the first leg. One {"cmd": ...} line per command,
+    snapshot lines also carry the snap position x/y/d, and a final
+    {"done": true, "distance": ...}. No FIN is sent. Failures after the
+    response has started are reported as an {"error": ...} line.
+    """
+    try:
+        solver = build_solver(obstacles_data, robot_x, robot_y, robot_dir)
+        permutation, total_cost = solver.find_optimal_order(time_budget_ms=time_budget_ms)
+
+        if planner == "hybrid":
+            for commands, segment, obstacle_ids in hybrid_legs(solver, permutation, speed_classes):
+                for cmd in commands:
+                    yield ndjson_line({"cmd": cmd})
+                end = segment[-1]
+                for obstacle_id in obstacle_ids:
+                    yield ndjson_line({"cmd": f"SP{obstacle_id}", "x": end.x, "y": end.y, "d": int(end.direction)})
+        else:
+            cmd_gen = CommandGenerator()
+            grid = solver.grid if speed_classes else None
+            for _, segment, obstacle_ids in solver.iter_path_segments(permutation):
+                segment[-1].set_screenshots(obstacle_ids)
+                for cmd in cmd_gen.generate_commands(segment, append_fin=False, grid=grid):
+                    line = {"cmd": cmd}
+                    if cmd.startswith("SP"):
+                        end = segment[-1]
+                        line.update(x=end.x, y=end.y, d=int(end.direction))
+                    yield ndjson_line(line)
+
+        yield ndjson_line({"done": True, "distance": float(total_cost)})
+    except Exception as e:
+        import traceback; traceback.print_exc()
+        yield ndjson_line({"error": str(e)})
+
+
 # =============================================================================
 # ENDPOINTS
 # =============================================================================
@@ -157,7 +268,10 @@ def compute_path(input_data: AlgorithmInput):
             input_data.robot_x,
             input_data.robot_y,
             input_data.robot_dir,
-            input_data.retrying
+            input_data.retrying,
+            input_data.time_budget_ms,
+            input_data.planner,
+            bool(input_data.speed_classes),
         )
         return result
     except Exception as e:
@@ -165,6 +279,27 @@ def compute_path(input_data: AlgorithmInput):
         raise HTTPException(status_code=500, detail=str(e))
 
 
+@app.post("/path/stream")
+def compute_path_stream(input_data: AlgorithmInput):
+    obstacles_data = [
+        {"id": o.id, "x": o.x, "y": o.y, "d": o.d}
+        for o in input_data.obstacles
+    ]
+    return StreamingResponse(
+        stream_algorithm(
+            obstacles_data,
+            input_data.robot_x,
+            input_data.robot_y,
+            input_data.robot_dir,
+            input_data.retrying,
+            input_data.time_budget_ms,
+            input_data.planner,
+            bool(input_data.speed_classes),
+        ),
+        media_type="application/x-ndjson",
+    )
+
+
 @app.post("/bullseye", response_model=BullseyeOutput)
 def handle_bullseye(input_data: BullseyeInput):
     """